@@ -353,6 +353,13 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pg_autoctl_get_formation_maximum_backup_rate",
+        "pg_autoctl get formation maximum-backup-rate",
+        "pg_autoctl get formation maximum-backup-rate",
+        [author],
+        1,
+    ),
     (
         "ref/pg_autoctl_get_node_replication_quorum",
         "pg_autoctl get node replication-quorum",
@@ -374,6 +381,13 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pg_autoctl_set_formation_maximum_backup_rate",
+        "pg_autoctl set formation maximum-backup-rate",
+        "pg_autoctl set formation maximum-backup-rate",
+        [author],
+        1,
+    ),
     (
         "ref/pg_autoctl_set_node_replication_quorum",
         "pg_autoctl set node replication-quorum",
@@ -20,17 +20,31 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "snprintf.h"
 
 #include "log.h"
 
+/*
+ * Log lines are formatted in memory first, and then written with a single
+ * writev(2) call, so that the lock shared by all the pg_autoctl processes is
+ * only held for the duration of that system call, rather than for formatting
+ * the message and writing it piece by piece to the unbuffered stderr.
+ */
+#define LOG_BUFSIZE 2048
+
+#define LOG_CONTEXT_MAXCOUNT 16
+#define LOG_CONTEXT_KEY_MAXLEN 32
+#define LOG_CONTEXT_VALUE_MAXLEN 256
+
 static struct {
   void *udata;
   log_LockFn lock;
@@ -38,6 +52,13 @@ static struct {
   int level;
   int quiet;
   int useColors;
+  int json;
+  int contextCount;
+  struct {
+    char key[LOG_CONTEXT_KEY_MAXLEN];
+    char value[LOG_CONTEXT_VALUE_MAXLEN];
+    int isNumber;
+  } context[LOG_CONTEXT_MAXCOUNT];
 } L;
 
 
@@ -97,30 +118,413 @@ void log_use_colors(int enable) {
   L.useColors = enable ? 1 : 0;
 }
 
-void log_log(int level, const char *file, int line, const char *fmt, ...)
+
+void log_set_json(int enable) {
+  L.json = enable ? 1 : 0;
+}
+
+
+int log_get_json(void) {
+  return L.json;
+}
+
+
+/*
+ * The context is a set of key/value pairs that are added to every log line
+ * when using the JSON output format. Setting a key to a NULL value removes it
+ * from the context.
+ */
+static void log_set_context_value(const char *key, const char *value,
+								  int isNumber)
+{
+	int i = 0;
+
+	for (i = 0; i < L.contextCount; i++)
+	{
+		if (strcmp(L.context[i].key, key) == 0)
+		{
+			break;
+		}
+	}
+
+	if (value == NULL)
+	{
+		if (i < L.contextCount)
+		{
+			--L.contextCount;
+			memmove(&(L.context[i]), &(L.context[i + 1]),
+					(L.contextCount - i) * sizeof(L.context[0]));
+		}
+		return;
+	}
+
+	if (i == L.contextCount)
+	{
+		if (L.contextCount == LOG_CONTEXT_MAXCOUNT)
+		{
+			return;
+		}
+		++L.contextCount;
+		pg_snprintf(L.context[i].key, sizeof(L.context[i].key), "%s", key);
+	}
+
+	pg_snprintf(L.context[i].value, sizeof(L.context[i].value), "%s", value);
+	L.context[i].isNumber = isNumber;
+}
+
+
+void log_set_context(const char *key, const char *value) {
+  log_set_context_value(key, value, 0);
+}
+
+
+void log_set_context_int(const char *key, long long value) {
+  char buf[32];
+
+  pg_snprintf(buf, sizeof(buf), "%lld", value);
+  log_set_context_value(key, buf, 1);
+}
+
+
+/*
+ * A growable buffer for JSON log lines, where we can't truncate the contents
+ * without breaking the format.
+ */
+typedef struct log_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+	int broken;
+	char stack[LOG_BUFSIZE];
+} log_buffer;
+
+
+static void log_buffer_init(log_buffer *buf)
+{
+	buf->data = buf->stack;
+	buf->len = 0;
+	buf->size = sizeof(buf->stack);
+	buf->broken = 0;
+}
+
+
+static int log_buffer_reserve(log_buffer *buf, size_t needed)
+{
+	if (buf->broken)
+	{
+		return 0;
+	}
+
+	if (buf->len + needed < buf->size)
+	{
+		return 1;
+	}
+
+	size_t size = buf->size;
+
+	while (buf->len + needed >= size)
+	{
+		size *= 2;
+	}
+
+	char *data = buf->data == buf->stack
+				 ? malloc(size)
+				 : realloc(buf->data, size);
+
+	if (data == NULL)
+	{
+		buf->broken = 1;
+		return 0;
+	}
+
+	if (buf->data == buf->stack)
+	{
+		memcpy(data, buf->stack, buf->len);
+	}
+
+	buf->data = data;
+	buf->size = size;
+
+	return 1;
+}
+
+
+static void log_buffer_append(log_buffer *buf, const char *data, size_t len)
+{
+	if (log_buffer_reserve(buf, len))
+	{
+		memcpy(buf->data + buf->len, data, len);
+		buf->len += len;
+	}
+}
+
+
+static void log_buffer_append_json_string(log_buffer *buf,
+										  const char *str, size_t len)
+{
+	log_buffer_append(buf, "\"", 1);
+
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) str[i];
+
+		switch (c)
+		{
+			case '"':
+			{
+				log_buffer_append(buf, "\\\"", 2);
+				break;
+			}
+
+			case '\\':
+			{
+				log_buffer_append(buf, "\\\\", 2);
+				break;
+			}
+
+			case '\n':
+			{
+				log_buffer_append(buf, "\\n", 2);
+				break;
+			}
+
+			case '\r':
+			{
+				log_buffer_append(buf, "\\r", 2);
+				break;
+			}
+
+			case '\t':
+			{
+				log_buffer_append(buf, "\\t", 2);
+				break;
+			}
+
+			default:
+			{
+				if (c < 0x20)
+				{
+					char escaped[8];
+
+					pg_snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+					log_buffer_append(buf, escaped, 6);
+				}
+				else
+				{
+					log_buffer_append(buf, (const char *) &c, 1);
+				}
+				break;
+			}
+		}
+	}
+
+	log_buffer_append(buf, "\"", 1);
+}
+
+
+static void log_buffer_append_json_key(log_buffer *buf, const char *key)
+{
+	log_buffer_append(buf, ",", 1);
+	log_buffer_append_json_string(buf, key, strlen(key));
+	log_buffer_append(buf, ":", 1);
+}
+
+
+static void log_buffer_free(log_buffer *buf)
+{
+	if (buf->data != buf->stack)
+	{
+		free(buf->data);
+	}
+}
+
+
+/*
+ * Format a log line as a JSON object, with the context as separate keys.
+ */
+static void log_format_json(log_buffer *buf, int level, struct tm *lt,
+							const char *file, int line,
+							const char *message, int messageLen)
+{
+	char timestamp[32];
+	char header[BUFSIZ];
+
+	timestamp[strftime(timestamp, sizeof(timestamp),
+					   "%Y-%m-%dT%H:%M:%S%z", lt)] = '\0';
+
+	int len = pg_snprintf(header, sizeof(header),
+						  "{\"time\":\"%s\",\"pid\":%d,\"level\":\"%s\"",
+						  timestamp, getpid(), level_names[level]);
+
+	log_buffer_append(buf, header, len);
+
+	log_buffer_append_json_key(buf, "file");
+	log_buffer_append_json_string(buf, file, strlen(file));
+
+	len = pg_snprintf(header, sizeof(header), ",\"line\":%d", line);
+	log_buffer_append(buf, header, len);
+
+	for (int i = 0; i < L.contextCount; i++)
+	{
+		const char *value = L.context[i].value;
+
+		log_buffer_append_json_key(buf, L.context[i].key);
+
+		if (L.context[i].isNumber)
+		{
+			log_buffer_append(buf, value, strlen(value));
+		}
+		else
+		{
+			log_buffer_append_json_string(buf, value, strlen(value));
+		}
+	}
+
+	log_buffer_append_json_key(buf, "message");
+	log_buffer_append_json_string(buf, message, messageLen);
+	log_buffer_append(buf, "}", 1);
+}
+
+/*
+ * Write a log line made of a prefix and a message, and a final newline.
+ */
+static void log_writev(int fd, const char *prefix, int prefixLen,
+					   const char *message, int messageLen)
+{
+	struct iovec iov[3];
+	struct iovec *iovp = iov;
+	int iovcnt = 3;
+
+	iov[0].iov_base = (void *) prefix;
+	iov[0].iov_len = prefixLen;
+	iov[1].iov_base = (void *) message;
+	iov[1].iov_len = messageLen;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+
+	while (iovcnt > 0)
+	{
+		ssize_t written = writev(fd, iovp, iovcnt);
+
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (written <= 0)
+		{
+			return;
+		}
+
+		/* short writes are unlikely, skip what has been written already */
+		while (iovcnt > 0 && written >= (ssize_t) iovp->iov_len)
+		{
+			written -= iovp->iov_len;
+			++iovp;
+			--iovcnt;
+		}
+
+		if (iovcnt > 0)
+		{
+			iovp->iov_base = (char *) iovp->iov_base + written;
+			iovp->iov_len -= written;
+		}
+	}
+}
+
+
+/*
+ * Format a message in the given buffer, or in a malloc'ed buffer when it does
+ * not fit. The caller frees *message when it's not the given buffer.
+ */
+static int log_vformat(char *buffer, int size, char **message,
+					   int save_errno, const char *fmt, va_list args)
+{
+	va_list copy;
+
+	/* restore errno for %m */
+	errno = save_errno;
+	va_copy(copy, args);
+	int messageLen = pg_vsnprintf(buffer, size, fmt, copy);
+	va_end(copy);
+
+	*message = buffer;
+
+	if (messageLen >= size)
+	{
+		char *longMessage = malloc(messageLen + 1);
+
+		if (longMessage != NULL)
+		{
+			errno = save_errno;
+			va_copy(copy, args);
+			(void) pg_vsnprintf(longMessage, messageLen + 1, fmt, copy);
+			va_end(copy);
+
+			*message = longMessage;
+		}
+		else
+		{
+			/* out of memory, log the truncated message */
+			messageLen = size - 1;
+		}
+	}
+	else if (messageLen < 0)
+	{
+		messageLen = 0;
+	}
+
+	return messageLen;
+}
+
+
+/*
+ * Write a formatted message to stderr and to the log file.
+ */
+static void log_write(int level, const char *file, int line,
+					  const char *message, int messageLen)
 {
 	time_t t;
 	struct tm *lt;
 
-  if (level < L.level) {
-    return;
-  }
+	char prefix[BUFSIZ];
+	int prefixLen = 0;
 
-  if (fmt == NULL)
-  {
-	  return;
-  }
-
-  /* Acquire lock */
-  lock();
+	char filePrefix[BUFSIZ];
+	int filePrefixLen = 0;
 
   /* Get current time */
   t = time(NULL);
   lt = localtime(&t);
 
-  /* Log to stderr */
+  /* In JSON mode, the same line goes to stderr and to the file */
+  if (L.json) {
+	log_buffer json;
+
+	log_buffer_init(&json);
+	log_format_json(&json, level, lt, file, line, message, messageLen);
+
+	if (!json.broken)
+	{
+	  lock();
+
+	  if (!L.quiet) {
+		log_writev(fileno(stderr), "", 0, json.data, json.len);
+	  }
+
+	  if (L.fp) {
+		fflush(L.fp);
+		log_writev(fileno(L.fp), "", 0, json.data, json.len);
+	  }
+
+	  unlock();
+	}
+
+	log_buffer_free(&json);
+	return;
+  }
+
+  /* Prepare the stderr prefix */
   if (!L.quiet) {
-    va_list args;
     char buf[16];
 	int showLineNumber = L.level <= 1;
 
@@ -128,46 +532,261 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
 
 	if (L.useColors)
 	{
-		pg_fprintf(stderr, "%s %d %s%-5s\x1b[0m ",
-				   buf,
-				   getpid(),
-				   level_colors[level],
-				   level_names[level]);
+		prefixLen = pg_snprintf(prefix, sizeof(prefix), "%s %d %s%-5s\x1b[0m ",
+								buf,
+								getpid(),
+								level_colors[level],
+								level_names[level]);
 
-		if (showLineNumber)
+		if (showLineNumber && prefixLen < (int) sizeof(prefix))
 		{
-			pg_fprintf(stderr, "\x1b[90m%s:%d:\x1b[0m ", file, line);
+			prefixLen += pg_snprintf(prefix + prefixLen,
+									 sizeof(prefix) - prefixLen,
+									 "\x1b[90m%s:%d:\x1b[0m ", file, line);
 		}
 	}
 	else
 	{
-		pg_fprintf(stderr, "%s %d %-5s ", buf, getpid(), level_names[level]);
+		prefixLen = pg_snprintf(prefix, sizeof(prefix), "%s %d %-5s ",
+								buf, getpid(), level_names[level]);
 
-		if (showLineNumber)
+		if (showLineNumber && prefixLen < (int) sizeof(prefix))
 		{
-			pg_fprintf(stderr, "%s:%d ", file, line);
+			prefixLen += pg_snprintf(prefix + prefixLen,
+									 sizeof(prefix) - prefixLen,
+									 "%s:%d ", file, line);
 		}
 	}
 
-    va_start(args, fmt);
-    pg_vfprintf(stderr, fmt, args);
-    va_end(args);
-    pg_fprintf(stderr, "\n");
+	if (prefixLen >= (int) sizeof(prefix))
+	{
+		prefixLen = sizeof(prefix) - 1;
+	}
   }
 
-  /* Log to file */
+  /* Prepare the file prefix */
   if (L.fp) {
-    va_list args;
     char buf[32];
     buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    pg_fprintf(L.fp, "%s %d %-5s %s:%d: ",
-			   buf, getpid(), level_names[level], file, line);
-    va_start(args, fmt);
-    pg_vfprintf(L.fp, fmt, args);
-    va_end(args);
-    pg_fprintf(L.fp, "\n");
+    filePrefixLen = pg_snprintf(filePrefix, sizeof(filePrefix),
+								"%s %d %-5s %s:%d: ",
+								buf, getpid(), level_names[level], file, line);
+
+	if (filePrefixLen >= (int) sizeof(filePrefix))
+	{
+		filePrefixLen = sizeof(filePrefix) - 1;
+	}
+  }
+
+  /* Acquire lock */
+  lock();
+
+  /* Log to stderr */
+  if (!L.quiet) {
+	log_writev(fileno(stderr), prefix, prefixLen, message, messageLen);
+  }
+
+  /* Log to file */
+  if (L.fp) {
+	fflush(L.fp);
+	log_writev(fileno(L.fp), filePrefix, filePrefixLen, message, messageLen);
   }
 
   /* Release lock */
   unlock();
 }
+
+
+void log_log(int level, const char *file, int line, const char *fmt, ...)
+{
+	int save_errno = errno;
+	va_list args;
+	char messageBuffer[LOG_BUFSIZE];
+	char *message = NULL;
+
+  if (level < L.level) {
+    return;
+  }
+
+  if (fmt == NULL)
+  {
+	  return;
+  }
+
+	va_start(args, fmt);
+	int messageLen = log_vformat(messageBuffer, sizeof(messageBuffer),
+								 &message, save_errno, fmt, args);
+	va_end(args);
+
+	log_write(level, file, line, message, messageLen);
+
+	if (message != messageBuffer)
+	{
+		free(message);
+	}
+
+	errno = save_errno;
+}
+
+
+/*
+ * The identity of a rate-limited message is a hash of its contents, skipping
+ * the digits: FNV-1a.
+ */
+static unsigned int log_ratelimit_hash(int level,
+									   const char *message, int messageLen)
+{
+	unsigned int hash = 2166136261u ^ (unsigned int) level;
+
+	for (int i = 0; i < messageLen; i++)
+	{
+		unsigned char c = (unsigned char) message[i];
+
+		if (c >= '0' && c <= '9')
+		{
+			continue;
+		}
+
+		hash ^= c;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+/*
+ * Log how many times the previous message of a limiter has been repeated
+ * without being logged.
+ */
+static void log_ratelimit_summary(log_ratelimit *rl, const char *file, int line)
+{
+	char summary[LOG_BUFSIZE];
+
+	int len = pg_snprintf(summary, sizeof(summary),
+						  "Last message repeated %lu times: %s",
+						  rl->repeated, rl->message);
+
+	if (len >= (int) sizeof(summary))
+	{
+		len = sizeof(summary) - 1;
+	}
+
+	log_write(rl->level, file, line, summary, len);
+
+	rl->repeated = 0;
+}
+
+
+/*
+ * log_log_ratelimit logs a message, unless a similar message has been logged
+ * by the same limiter in the last interval seconds, in which case the message
+ * is only counted. Returns 1 when the message has been logged, 0 otherwise.
+ */
+int log_log_ratelimit(log_ratelimit *rl, int level,
+					  const char *file, int line, const char *fmt, ...)
+{
+	int save_errno = errno;
+	va_list args;
+	char messageBuffer[LOG_BUFSIZE];
+	char *message = NULL;
+	time_t now = time(NULL);
+	int interval =
+		rl->interval > 0 ? rl->interval : LOG_RATELIMIT_DEFAULT_INTERVAL;
+
+  if (level < L.level || fmt == NULL) {
+    return 0;
+  }
+
+	va_start(args, fmt);
+	int messageLen = log_vformat(messageBuffer, sizeof(messageBuffer),
+								 &message, save_errno, fmt, args);
+	va_end(args);
+
+	unsigned int hash = log_ratelimit_hash(level, message, messageLen);
+	int similar = rl->lastTime != 0 && rl->hash == hash;
+
+	if (similar && now - rl->lastTime < interval)
+	{
+		++rl->repeated;
+
+		if (message != messageBuffer)
+		{
+			free(message);
+		}
+
+		errno = save_errno;
+		return 0;
+	}
+
+	if (similar && rl->repeated > 0)
+	{
+		/* the message tells how many similar ones we skipped */
+		log_buffer buf;
+		char suffix[64];
+
+		int len = pg_snprintf(suffix, sizeof(suffix),
+							  " (repeated %lu times in the last %ld seconds)",
+							  rl->repeated, (long) (now - rl->lastTime));
+
+		log_buffer_init(&buf);
+		log_buffer_append(&buf, message, messageLen);
+		log_buffer_append(&buf, suffix, len);
+
+		if (!buf.broken)
+		{
+			log_write(level, file, line, buf.data, buf.len);
+		}
+		else
+		{
+			log_write(level, file, line, message, messageLen);
+		}
+
+		log_buffer_free(&buf);
+		rl->repeated = 0;
+	}
+	else
+	{
+		if (rl->repeated > 0)
+		{
+			log_ratelimit_summary(rl, file, line);
+		}
+
+		log_write(level, file, line, message, messageLen);
+	}
+
+	rl->lastTime = now;
+	rl->hash = hash;
+	rl->level = level;
+	pg_snprintf(rl->message, sizeof(rl->message), "%.*s", messageLen, message);
+
+	if (message != messageBuffer)
+	{
+		free(message);
+	}
+
+	errno = save_errno;
+	return 1;
+}
+
+
+/*
+ * log_log_ratelimit_reset logs how many times the last message of the limiter
+ * has been repeated, if any, and then forgets about it, so that the next
+ * message is logged in any case.
+ */
+void log_log_ratelimit_reset(log_ratelimit *rl, const char *file, int line)
+{
+	int save_errno = errno;
+
+	if (rl->repeated > 0 && rl->level >= L.level)
+	{
+		log_ratelimit_summary(rl, file, line);
+	}
+
+	rl->lastTime = 0;
+	rl->hash = 0;
+	rl->repeated = 0;
+
+	errno = save_errno;
+}
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 #define LOG_VERSION "0.1.0"
 
@@ -26,6 +27,37 @@ enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
 #define log_level(level, ...) log_log(level, __FILE__, __LINE__, __VA_ARGS__)
 
+/*
+ * Rate-limited logging, for messages that a loop would otherwise repeat at
+ * every round. Each call site uses its own log_ratelimit, zero-initialized.
+ * Two messages are similar when they only differ by their digits, such as a
+ * count of attempts or a duration. A similar message is logged at most once
+ * every interval seconds, with a count of the skipped ones, and the skipped
+ * messages are also counted when a different message is logged, or when
+ * log_ratelimit_reset() is called, typically when the condition is over.
+ */
+#define LOG_RATELIMIT_DEFAULT_INTERVAL 30 /* seconds */
+#define LOG_RATELIMIT_MESSAGE_MAXLEN 256
+
+typedef struct log_ratelimit {
+  int interval;                 /* seconds, 0 is the default interval */
+  time_t lastTime;
+  unsigned int hash;
+  unsigned long repeated;
+  int level;
+  char message[LOG_RATELIMIT_MESSAGE_MAXLEN];
+} log_ratelimit;
+
+#define log_warn_ratelimit(rl, ...) \
+  log_log_ratelimit(rl, LOG_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#define log_error_ratelimit(rl, ...) \
+  log_log_ratelimit(rl, LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#define log_level_ratelimit(rl, level, ...) \
+  log_log_ratelimit(rl, level, __FILE__, __LINE__, __VA_ARGS__)
+
+#define log_ratelimit_reset(rl) \
+  log_log_ratelimit_reset(rl, __FILE__, __LINE__)
+
 void log_set_udata(void *udata);
 void log_set_lock(log_LockFn fn);
 void log_set_fp(FILE *fp);
@@ -33,8 +65,17 @@ void log_set_level(int level);
 int log_get_level(void);
 void log_set_quiet(int enable);
 void log_use_colors(int enable);
+void log_set_json(int enable);
+int log_get_json(void);
+void log_set_context(const char *key, const char *value);
+void log_set_context_int(const char *key, long long value);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...)
  	__attribute__((format(printf, 4, 5)));
 
+int log_log_ratelimit(log_ratelimit *rl, int level,
+					  const char *file, int line, const char *fmt, ...)
+	__attribute__((format(printf, 5, 6)));
+void log_log_ratelimit_reset(log_ratelimit *rl, const char *file, int line);
+
 #endif
@@ -36,6 +36,7 @@
 #include <ctype.h>
 #include <math.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Apparently sscanf is not implemented in some "standard" libraries, so don't use it, if you
  * don't have to. */
@@ -46,6 +47,14 @@
 
 #define FLOAT_FORMAT "%1.17g" /* do not increase precision without incresing NUM_BUF_SIZE */
 #define NUM_BUF_SIZE 64 /* double printed with "%1.17g" shouldn't be longer than 25 bytes so let's be paranoid and use 64 */
+#define OUTPUT_STACK_SIZE 4096 /* serialize on the stack first, then double in size as needed */
+
+/* largest integer that both a double and an unsigned long hold exactly */
+#if ULONG_MAX > 4294967295UL
+#define MAX_FAST_INTEGER 9007199254740992.0
+#else
+#define MAX_FAST_INTEGER 4294967295.0
+#endif
 
 #define SIZEOF_TOKEN(a)       (sizeof(a) - 1)
 #define SKIP_CHAR(str)        ((*str)++)
@@ -150,10 +159,15 @@ static JSON_Value * parse_null_value(const char **string);
 static JSON_Value * parse_value(const char **string, size_t nesting);
 
 /* Serialization */
-static int    json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty, char *num_buf);
-static int    json_serialize_string(const char *string, size_t len, char *buf);
-static int    append_indent(char *buf, int level);
-static int    append_string(char *buf, const char *string);
+typedef struct json_output_t JSON_Output;
+
+static JSON_Status json_output_reserve(JSON_Output *output, size_t len);
+static JSON_Status json_output_append(JSON_Output *output, const char *string, size_t len);
+static JSON_Status json_serialize_to_output_r(const JSON_Value *value, JSON_Output *output, int level, int is_pretty);
+static JSON_Status json_serialize_string(const char *string, size_t len, JSON_Output *output);
+static JSON_Status json_serialize_number(double num, JSON_Output *output);
+static JSON_Status append_indent(JSON_Output *output, int level);
+static char *      json_serialize_to_new_buffer(const JSON_Value *value, int is_pretty);
 
 /* Various */
 static char * parson_strndup(const char *string, size_t n) {
@@ -881,26 +895,71 @@ static JSON_Value * parse_null_value(const char **string) {
 }
 
 /* Serialization */
-#define APPEND_STRING(str) do { written = append_string(buf, (str));\
-                                if (written < 0) { return -1; }\
-                                if (buf != NULL) { buf += written; }\
-                                written_total += written; } while(0)
 
-#define APPEND_INDENT(level) do { written = append_indent(buf, (level));\
-                                  if (written < 0) { return -1; }\
-                                  if (buf != NULL) { buf += written; }\
-                                  written_total += written; } while(0)
+/*
+ * Serialization happens in a single pass, appending to an output buffer that is
+ * either the caller's buffer, a buffer that grows as needed, or no buffer at
+ * all when we only compute the serialization size.
+ */
+struct json_output_t {
+    char  *buf;      /* NULL when only counting bytes */
+    size_t length;   /* bytes written so far, without the terminating NUL byte */
+    size_t capacity; /* size of buf in bytes */
+    int    growable; /* buf may be replaced by a bigger one */
+    int    owned;    /* buf is allocated with parson_malloc */
+};
+
+#define APPEND_STRING(str) do { if (json_output_append(output, (str), SIZEOF_TOKEN(str)) == JSONFailure) {\
+                                    return JSONFailure; } } while(0)
+
+static JSON_Status json_output_reserve(JSON_Output *output, size_t len) {
+    size_t new_capacity = 0;
+    char *new_buf = NULL;
+    if (output->buf == NULL && !output->growable) {
+        return JSONSuccess; /* only counting */
+    }
+    if (output->length + len + 1 <= output->capacity) {
+        return JSONSuccess;
+    }
+    if (!output->growable) {
+        return JSONFailure;
+    }
+    new_capacity = output->capacity > 0 ? output->capacity : OUTPUT_STACK_SIZE;
+    while (new_capacity < output->length + len + 1) {
+        new_capacity *= 2;
+    }
+    new_buf = (char*)parson_malloc(new_capacity);
+    if (new_buf == NULL) {
+        return JSONFailure;
+    }
+    memcpy(new_buf, output->buf, output->length);
+    if (output->owned) {
+        parson_free(output->buf);
+    }
+    output->buf = new_buf;
+    output->capacity = new_capacity;
+    output->owned = 1;
+    return JSONSuccess;
+}
+
+static JSON_Status json_output_append(JSON_Output *output, const char *string, size_t len) {
+    if (json_output_reserve(output, len) == JSONFailure) {
+        return JSONFailure;
+    }
+    if (output->buf != NULL) {
+        memcpy(output->buf + output->length, string, len);
+    }
+    output->length += len;
+    return JSONSuccess;
+}
 
-static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, int is_pretty, char *num_buf)
+static JSON_Status json_serialize_to_output_r(const JSON_Value *value, JSON_Output *output, int level, int is_pretty)
 {
     const char *key = NULL, *string = NULL;
     JSON_Value *temp_value = NULL;
     JSON_Array *array = NULL;
     JSON_Object *object = NULL;
     size_t i = 0, count = 0;
-    double num = 0.0;
-    int written = -1, written_total = 0;
-    size_t len = 0;
 
     switch (json_value_get_type(value)) {
         case JSONArray:
@@ -911,18 +970,13 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
                 APPEND_STRING("\n");
             }
             for (i = 0; i < count; i++) {
-                if (is_pretty) {
-                    APPEND_INDENT(level+1);
+                if (is_pretty && append_indent(output, level+1) == JSONFailure) {
+                    return JSONFailure;
                 }
                 temp_value = json_array_get_value(array, i);
-                written = json_serialize_to_buffer_r(temp_value, buf, level+1, is_pretty, num_buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
+                if (json_serialize_to_output_r(temp_value, output, level+1, is_pretty) == JSONFailure) {
+                    return JSONFailure;
                 }
-                written_total += written;
                 if (i < (count - 1)) {
                     APPEND_STRING(",");
                 }
@@ -930,11 +984,11 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
                     APPEND_STRING("\n");
                 }
             }
-            if (count > 0 && is_pretty) {
-                APPEND_INDENT(level);
+            if (count > 0 && is_pretty && append_indent(output, level) == JSONFailure) {
+                return JSONFailure;
             }
             APPEND_STRING("]");
-            return written_total;
+            return JSONSuccess;
         case JSONObject:
             object = json_value_get_object(value);
             count  = json_object_get_count(object);
@@ -945,33 +999,23 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
             for (i = 0; i < count; i++) {
                 key = json_object_get_name(object, i);
                 if (key == NULL) {
-                    return -1;
+                    return JSONFailure;
                 }
-                if (is_pretty) {
-                    APPEND_INDENT(level+1);
+                if (is_pretty && append_indent(output, level+1) == JSONFailure) {
+                    return JSONFailure;
                 }
                 /* We do not support key names with embedded \0 chars */
-                written = json_serialize_string(key, strlen(key), buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
+                if (json_serialize_string(key, strlen(key), output) == JSONFailure) {
+                    return JSONFailure;
                 }
-                written_total += written;
                 APPEND_STRING(":");
                 if (is_pretty) {
                     APPEND_STRING(" ");
                 }
                 temp_value = json_object_get_value_at(object, i);
-                written = json_serialize_to_buffer_r(temp_value, buf, level+1, is_pretty, num_buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
+                if (json_serialize_to_output_r(temp_value, output, level+1, is_pretty) == JSONFailure) {
+                    return JSONFailure;
                 }
-                written_total += written;
                 if (i < (count - 1)) {
                     APPEND_STRING(",");
                 }
@@ -979,142 +1023,156 @@ static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int le
                     APPEND_STRING("\n");
                 }
             }
-            if (count > 0 && is_pretty) {
-                APPEND_INDENT(level);
+            if (count > 0 && is_pretty && append_indent(output, level) == JSONFailure) {
+                return JSONFailure;
             }
             APPEND_STRING("}");
-            return written_total;
+            return JSONSuccess;
         case JSONString:
             string = json_value_get_string(value);
             if (string == NULL) {
-                return -1;
-            }
-            len = json_value_get_string_len(value);
-            written = json_serialize_string(string, len, buf);
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
+                return JSONFailure;
             }
-            written_total += written;
-            return written_total;
+            return json_serialize_string(string, json_value_get_string_len(value), output);
         case JSONBoolean:
             if (json_value_get_boolean(value)) {
                 APPEND_STRING("true");
             } else {
                 APPEND_STRING("false");
             }
-            return written_total;
+            return JSONSuccess;
         case JSONNumber:
-            num = json_value_get_number(value);
-            if (buf != NULL) {
-                num_buf = buf;
-            }
-            written = sprintf(num_buf, FLOAT_FORMAT, num);
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
-            }
-            written_total += written;
-            return written_total;
+            return json_serialize_number(json_value_get_number(value), output);
         case JSONNull:
             APPEND_STRING("null");
-            return written_total;
+            return JSONSuccess;
         case JSONError:
-            return -1;
+            return JSONFailure;
         default:
-            return -1;
+            return JSONFailure;
     }
 }
 
-static int json_serialize_string(const char *string, size_t len, char *buf) {
-    size_t i = 0;
-    char c = '\0';
-    int written = -1, written_total = 0;
+static JSON_Status json_serialize_string(const char *string, size_t len, JSON_Output *output) {
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t i = 0, run_start = 0;
+    char unicode_escape[6] = { '\\', 'u', '0', '0', '0', '0' };
+    const char *escape = NULL;
+    size_t escape_len = 0;
+    unsigned char c = '\0';
     APPEND_STRING("\"");
     for (i = 0; i < len; i++) {
-        c = string[i];
+        c = (unsigned char)string[i];
+        escape = NULL;
+        escape_len = 2;
         switch (c) {
-            case '\"': APPEND_STRING("\\\""); break;
-            case '\\': APPEND_STRING("\\\\"); break;
-            case '\b': APPEND_STRING("\\b"); break;
-            case '\f': APPEND_STRING("\\f"); break;
-            case '\n': APPEND_STRING("\\n"); break;
-            case '\r': APPEND_STRING("\\r"); break;
-            case '\t': APPEND_STRING("\\t"); break;
-            case '\x00': APPEND_STRING("\\u0000"); break;
-            case '\x01': APPEND_STRING("\\u0001"); break;
-            case '\x02': APPEND_STRING("\\u0002"); break;
-            case '\x03': APPEND_STRING("\\u0003"); break;
-            case '\x04': APPEND_STRING("\\u0004"); break;
-            case '\x05': APPEND_STRING("\\u0005"); break;
-            case '\x06': APPEND_STRING("\\u0006"); break;
-            case '\x07': APPEND_STRING("\\u0007"); break;
-            /* '\x08' duplicate: '\b' */
-            /* '\x09' duplicate: '\t' */
-            /* '\x0a' duplicate: '\n' */
-            case '\x0b': APPEND_STRING("\\u000b"); break;
-            /* '\x0c' duplicate: '\f' */
-            /* '\x0d' duplicate: '\r' */
-            case '\x0e': APPEND_STRING("\\u000e"); break;
-            case '\x0f': APPEND_STRING("\\u000f"); break;
-            case '\x10': APPEND_STRING("\\u0010"); break;
-            case '\x11': APPEND_STRING("\\u0011"); break;
-            case '\x12': APPEND_STRING("\\u0012"); break;
-            case '\x13': APPEND_STRING("\\u0013"); break;
-            case '\x14': APPEND_STRING("\\u0014"); break;
-            case '\x15': APPEND_STRING("\\u0015"); break;
-            case '\x16': APPEND_STRING("\\u0016"); break;
-            case '\x17': APPEND_STRING("\\u0017"); break;
-            case '\x18': APPEND_STRING("\\u0018"); break;
-            case '\x19': APPEND_STRING("\\u0019"); break;
-            case '\x1a': APPEND_STRING("\\u001a"); break;
-            case '\x1b': APPEND_STRING("\\u001b"); break;
-            case '\x1c': APPEND_STRING("\\u001c"); break;
-            case '\x1d': APPEND_STRING("\\u001d"); break;
-            case '\x1e': APPEND_STRING("\\u001e"); break;
-            case '\x1f': APPEND_STRING("\\u001f"); break;
+            case '\"': escape = "\\\""; break;
+            case '\\': escape = "\\\\"; break;
+            case '\b': escape = "\\b"; break;
+            case '\f': escape = "\\f"; break;
+            case '\n': escape = "\\n"; break;
+            case '\r': escape = "\\r"; break;
+            case '\t': escape = "\\t"; break;
             case '/':
                 if (parson_escape_slashes) {
-                    APPEND_STRING("\\/");  /* to make json embeddable in xml\/html */
-                } else {
-                    APPEND_STRING("/");
+                    escape = "\\/";  /* to make json embeddable in xml\/html */
                 }
                 break;
             default:
-                if (buf != NULL) {
-                    buf[0] = c;
-                    buf += 1;
+                if (c < 0x20) {
+                    unicode_escape[4] = hex_digits[c >> 4];
+                    unicode_escape[5] = hex_digits[c & 0x0f];
+                    escape = unicode_escape;
+                    escape_len = sizeof(unicode_escape);
                 }
-                written_total += 1;
                 break;
         }
+        if (escape != NULL) {
+            /* copy the characters that need no escaping in one go */
+            if (json_output_append(output, string + run_start, i - run_start) == JSONFailure ||
+                json_output_append(output, escape, escape_len) == JSONFailure) {
+                return JSONFailure;
+            }
+            run_start = i + 1;
+        }
+    }
+    if (json_output_append(output, string + run_start, len - run_start) == JSONFailure) {
+        return JSONFailure;
     }
     APPEND_STRING("\"");
-    return written_total;
+    return JSONSuccess;
+}
+
+static JSON_Status json_serialize_number(double num, JSON_Output *output) {
+    char num_buf[NUM_BUF_SIZE];
+    char *digits = num_buf + NUM_BUF_SIZE;
+    double magnitude = num < 0 ? -num : num;
+    unsigned long integer = 0;
+    int written = -1;
+    /*
+     * Integers that a double holds exactly print the same with FLOAT_FORMAT as
+     * their decimal digits, which we compute without going through sprintf.
+     * Zero is left to sprintf, which knows about negative zero.
+     */
+    if (magnitude > 0.0 && magnitude <= MAX_FAST_INTEGER &&
+        (double)(integer = (unsigned long)magnitude) == magnitude) {
+        do {
+            *--digits = (char)('0' + integer % 10);
+            integer /= 10;
+        } while (integer > 0);
+        if (num < 0) {
+            *--digits = '-';
+        }
+        return json_output_append(output, digits, (size_t)(num_buf + NUM_BUF_SIZE - digits));
+    }
+    written = sprintf(num_buf, FLOAT_FORMAT, num);
+    if (written < 0) {
+        return JSONFailure;
+    }
+    return json_output_append(output, num_buf, (size_t)written);
 }
 
-static int append_indent(char *buf, int level) {
+static JSON_Status append_indent(JSON_Output *output, int level) {
     int i;
-    int written = -1, written_total = 0;
     for (i = 0; i < level; i++) {
         APPEND_STRING("    ");
     }
-    return written_total;
+    return JSONSuccess;
 }
 
-static int append_string(char *buf, const char *string) {
-    if (buf == NULL) {
-        return (int)strlen(string);
+/*
+ * Most documents fit in a buffer on the stack, from which we copy the result
+ * into an allocation of the exact size. Bigger documents move to an allocated
+ * buffer that doubles in size as needed.
+ */
+static char * json_serialize_to_new_buffer(const JSON_Value *value, int is_pretty) {
+    char stack_buf[OUTPUT_STACK_SIZE];
+    char *result = NULL;
+    JSON_Output output;
+    output.buf = stack_buf;
+    output.length = 0;
+    output.capacity = sizeof(stack_buf);
+    output.growable = 1;
+    output.owned = 0;
+    if (json_serialize_to_output_r(value, &output, 0, is_pretty) == JSONFailure) {
+        if (output.owned) {
+            parson_free(output.buf);
+        }
+        return NULL;
+    }
+    output.buf[output.length] = '\0';
+    if (output.owned) {
+        return output.buf;
     }
-    return sprintf(buf, "%s", string);
+    result = (char*)parson_malloc(output.length + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+    memcpy(result, output.buf, output.length + 1);
+    return result;
 }
 
 #undef APPEND_STRING
-#undef APPEND_INDENT
 
 /* Parser API */
 JSON_Value * json_parse_file(const char *filename) {
@@ -1540,21 +1598,24 @@ JSON_Value * json_value_deep_copy(const JSON_Value *value) {
 }
 
 size_t json_serialization_size(const JSON_Value *value) {
-    char num_buf[NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, 0, num_buf);
-    return res < 0 ? 0 : (size_t)(res) + 1;
+    JSON_Output output = { NULL, 0, 0, 0, 0 };
+    if (json_serialize_to_output_r(value, &output, 0, 0) == JSONFailure) {
+        return 0;
+    }
+    return output.length + 1;
 }
 
 JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes) {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+    JSON_Output output = { NULL, 0, 0, 0, 0 };
+    if (buf == NULL || buf_size_in_bytes == 0) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, 0, NULL);
-    if (written < 0) {
+    output.buf = buf;
+    output.capacity = buf_size_in_bytes;
+    if (json_serialize_to_output_r(value, &output, 0, 0) == JSONFailure) {
         return JSONFailure;
     }
+    buf[output.length] = '\0';
     return JSONSuccess;
 }
 
@@ -1581,40 +1642,28 @@ JSON_Status json_serialize_to_file(const JSON_Value *value, const char *filename
 }
 
 char * json_serialize_to_string(const JSON_Value *value) {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
-    }
-    buf = (char*)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
-        return NULL;
-    }
-    serialization_result = json_serialize_to_buffer(value, buf, buf_size_bytes);
-    if (serialization_result == JSONFailure) {
-        json_free_serialized_string(buf);
-        return NULL;
-    }
-    return buf;
+    return json_serialize_to_new_buffer(value, 0);
 }
 
 size_t json_serialization_size_pretty(const JSON_Value *value) {
-    char num_buf[NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, 1, num_buf);
-    return res < 0 ? 0 : (size_t)(res) + 1;
+    JSON_Output output = { NULL, 0, 0, 0, 0 };
+    if (json_serialize_to_output_r(value, &output, 0, 1) == JSONFailure) {
+        return 0;
+    }
+    return output.length + 1;
 }
 
 JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf, size_t buf_size_in_bytes) {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size_pretty(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+    JSON_Output output = { NULL, 0, 0, 0, 0 };
+    if (buf == NULL || buf_size_in_bytes == 0) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, 1, NULL);
-    if (written < 0) {
+    output.buf = buf;
+    output.capacity = buf_size_in_bytes;
+    if (json_serialize_to_output_r(value, &output, 0, 1) == JSONFailure) {
         return JSONFailure;
     }
+    buf[output.length] = '\0';
     return JSONSuccess;
 }
 
@@ -1641,22 +1690,7 @@ JSON_Status json_serialize_to_file_pretty(const JSON_Value *value, const char *f
 }
 
 char * json_serialize_to_string_pretty(const JSON_Value *value) {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size_pretty(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
-    }
-    buf = (char*)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
-        return NULL;
-    }
-    serialization_result = json_serialize_to_buffer_pretty(value, buf, buf_size_bytes);
-    if (serialization_result == JSONFailure) {
-        json_free_serialized_string(buf);
-        return NULL;
-    }
-    return buf;
+    return json_serialize_to_new_buffer(value, 1);
 }
 
 void json_free_serialized_string(char *string) {
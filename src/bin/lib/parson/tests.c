@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 
 #define TEST(A) printf("%d %-72s-", __LINE__, #A);\
                 if(A){puts(" OK");tests_passed++;}\
@@ -53,8 +54,12 @@ void test_suite_8(void); /* Test serialization */
 void test_suite_9(void); /* Test serialization (pretty) */
 void test_suite_10(void); /* Testing for memory leaks */
 void test_suite_11(void); /* Additional things that require testing */
+void test_suite_12(void); /* Test serialization of numbers, strings, and into buffers */
 void test_memory_leaks(void);
 
+void benchmark_serialization(void);
+void benchmark_serialize(const char *name, const JSON_Value *value, int iterations);
+
 void print_commits_info(const char *username, const char *repo);
 void persistence_example(void);
 void serialization_example(void);
@@ -62,6 +67,7 @@ void serialization_example(void);
 static const char *tests_path = "tests";
 
 static int malloc_count = 0;
+static long malloc_total = 0; /* allocations done, frees are not subtracted */
 static void *counted_malloc(size_t size);
 static void counted_free(void *ptr);
 
@@ -77,6 +83,12 @@ int main(int argc, char *argv[]) {
     /* serialization_example(); */
     /* persistence_example(); */
 
+    if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
+        json_set_allocation_functions(counted_malloc, counted_free);
+        benchmark_serialization();
+        return 0;
+    }
+
     if (argc == 2) {
         tests_path = argv[1];
     } else {
@@ -96,6 +108,7 @@ int main(int argc, char *argv[]) {
     test_suite_9();
     test_suite_10();
     test_suite_11();
+    test_suite_12();
     test_memory_leaks();
 
     printf("Tests failed: %d\n", tests_failed);
@@ -580,6 +593,122 @@ void test_suite_11() {
     TEST(STREQ(array_with_escaped_slashes, serialized));
 }
 
+void test_suite_12(void) {
+    /* numbers must serialize exactly as with "%1.17g" */
+    double numbers[] = { 0.0, -0.0, 1.0, -1.0, 5432.0, 4294967295.0, 4294967296.0,
+                         -9007199254740992.0, 9007199254740992.0, 9007199254740994.0,
+                         1e17, 0.5, -2.25, 0.1, 1e-300, 1e300 };
+    char expected[128];
+    char buf[16];
+    char *serialized = NULL;
+    JSON_Value *value = NULL;
+    int all_equal = 1;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        value = json_value_init_array();
+        json_array_append_number(json_value_get_array(value), numbers[i]);
+        sprintf(expected, "[%1.17g]", numbers[i]);
+        serialized = json_serialize_to_string(value);
+        if (serialized == NULL || strcmp(expected, serialized) != 0) {
+            printf("serialized %s, expected %s\n", serialized, expected);
+            all_equal = 0;
+        }
+        json_free_serialized_string(serialized);
+        json_value_free(value);
+    }
+    TEST(all_equal);
+
+    value = json_value_init_string("a\x01\"b\n\x1f");
+    serialized = json_serialize_to_string(value);
+    TEST(STREQ("\"a\\u0001\\\"b\\n\\u001f\"", serialized));
+    json_free_serialized_string(serialized);
+    json_value_free(value);
+
+    /* serializing into a buffer fails cleanly when it's too small */
+    value = json_parse_string("{\"node_id\": 1, \"node_name\": \"node_1\"}");
+    TEST(json_serialization_size(value) == 35);
+    TEST(json_serialize_to_buffer(value, buf, sizeof(buf)) == JSONFailure);
+    TEST(json_serialize_to_buffer(value, expected, 35) == JSONSuccess);
+    TEST(strcmp(expected, "{\"node_id\":1,\"node_name\":\"node_1\"}") == 0);
+    TEST(json_serialize_to_buffer(value, expected, 34) == JSONFailure);
+    json_value_free(value);
+
+    /* documents bigger than the stack buffer grow into allocated buffers */
+    value = json_value_init_array();
+    for (i = 0; i < 5000; i++) {
+        json_array_append_string(json_value_get_array(value), "lorem ipsum");
+    }
+    serialized = json_serialize_to_string_pretty(value);
+    TEST(serialized != NULL && strlen(serialized) + 1 == json_serialization_size_pretty(value));
+    TEST(json_value_equals(json_parse_string(serialized), value));
+    json_free_serialized_string(serialized);
+    json_value_free(value);
+}
+
+/*
+ * Benchmarks are run with "./test --bench", they print how long a
+ * serialization takes and how many allocations it needs.
+ */
+void benchmark_serialization(void) {
+    JSON_Value *nodes = json_value_init_array();
+    JSON_Value *node = NULL;
+    JSON_Object *object = NULL;
+    JSON_Value *file_value = NULL;
+    char name[32];
+    int i = 0;
+
+    /* a nodes array as in the nodes.json file that the keeper writes */
+    for (i = 0; i < 12; i++) {
+        node = json_value_init_object();
+        object = json_value_get_object(node);
+        sprintf(name, "node_%d", i + 1);
+        json_object_set_number(object, "node_id", i + 1);
+        json_object_set_string(object, "node_name", name);
+        sprintf(name, "10.0.0.%d", i + 1);
+        json_object_set_string(object, "node_host", name);
+        json_object_set_number(object, "node_port", 5432);
+        json_object_set_string(object, "node_lsn", "0/3000148");
+        json_object_set_boolean(object, "node_is_primary", i == 0);
+        json_array_append_value(json_value_get_array(nodes), node);
+    }
+
+    printf("%-16s | %10s | %12s | %15s\n",
+           "document", "iterations", "ns per call", "allocs per call");
+    benchmark_serialize("nodes", nodes, 100000);
+
+    file_value = json_parse_file(get_file_path("test_1_1.txt"));
+    if (file_value != NULL) {
+        benchmark_serialize("test_1_1", file_value, 20000);
+        json_value_free(file_value);
+    }
+
+    json_value_free(nodes);
+}
+
+void benchmark_serialize(const char *name, const JSON_Value *value, int iterations) {
+    char label[64];
+    char *serialized = NULL;
+    clock_t start;
+    double elapsed = 0.0;
+    int pretty = 0;
+    int i = 0;
+
+    for (pretty = 0; pretty < 2; pretty++) {
+        malloc_total = 0;
+        start = clock();
+        for (i = 0; i < iterations; i++) {
+            serialized = pretty ? json_serialize_to_string_pretty(value) : json_serialize_to_string(value);
+            json_free_serialized_string(serialized);
+        }
+        elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        sprintf(label, "%s%s", name, pretty ? " pretty" : "");
+        printf("%-16s | %10d | %12.1f | %15.1f\n",
+               label, iterations, elapsed * 1e9 / iterations,
+               (double)malloc_total / iterations);
+    }
+}
+
 void test_memory_leaks() {
     malloc_count = 0;
 
@@ -716,6 +845,7 @@ static void *counted_malloc(size_t size) {
     void *res = malloc(size);
     if (res != NULL) {
         malloc_count++;
+        malloc_total++;
     }
     return res;
 }
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <spawn.h>
 #include <string.h>
 #include <sys/wait.h>
 
@@ -44,6 +45,10 @@ typedef struct
 	/* register a function to process output as it appears */
 	void (*processBuffer)(const char *buffer, bool error);
 
+	/* register a function to call in the child process before exec() */
+	void (*childSetup)(void *arg);
+	void *childSetupArg;
+
 	int stdOutFd;               /* redirect stdout to file descriptor */
 	int stdErrFd;               /* redirect stderr to file descriptor */
 
@@ -71,9 +76,12 @@ static size_t read_into_buf(Program *prog,
 							PQExpBuffer buffer,
 							bool error);
 static void waitprogram(Program *prog, pid_t childPid);
+static bool spawn_subprogram(Program *prog, int *outpipe, int *errpipe);
+
+extern char **environ;
 
 /*
- * Run a program using fork() and exec(), get the stdOut and stdErr output from
+ * Run a program using posix_spawn() or fork() and exec(), get the stdOut and stdErr output from
  * the run and then return a Program struct instance with the result of running
  * the program.
  */
@@ -92,6 +100,8 @@ run_program(const char *program, ...)
 	prog.capture = true;
 	prog.tty = false;
 	prog.processBuffer = NULL;
+	prog.childSetup = NULL;
+	prog.childSetupArg = NULL;
 	prog.stdOutFd = -1;
 	prog.stdErrFd = -1;
 	prog.stdOut = NULL;
@@ -148,6 +158,8 @@ initialize_program(Program *prog, char **args, bool setsid)
 	prog->capture = true;
 	prog->tty = false;
 	prog->processBuffer = NULL;
+	prog->childSetup = NULL;
+	prog->childSetupArg = NULL;
 	prog->stdOutFd = -1;
 	prog->stdErrFd = -1;
 
@@ -172,9 +184,16 @@ initialize_program(Program *prog, char **args, bool setsid)
 
 
 /*
- * Run given program with its args, by doing the fork()/exec() dance, and also
- * capture the subprocess output by installing pipes. We accumulate the output
- * into a PQExpBuffer when prog->capture is true.
+ * Run given program with its args, by using posix_spawn() or by doing the
+ * fork()/exec() dance, and also capture the subprocess output by installing
+ * pipes. We accumulate the output into a PQExpBuffer when prog->capture is
+ * true.
+ *
+ * posix_spawn() is preferred because it doesn't need to copy our page tables
+ * to then throw them away at exec() time, which costs latency on busy hosts
+ * and may fail with strict memory overcommit settings. We still fork() when
+ * the platform can't spawn the program the way we want, and when the caller
+ * registered a childSetup function.
  */
 void
 execute_subprogram(Program *prog)
@@ -205,6 +224,11 @@ execute_subprogram(Program *prog)
 		}
 	}
 
+	if (prog->childSetup == NULL && spawn_subprogram(prog, outpipe, errpipe))
+	{
+		return;
+	}
+
 	pid = fork();
 
 	switch (pid)
@@ -259,6 +283,11 @@ execute_subprogram(Program *prog)
 				}
 			}
 
+			if (prog->childSetup != NULL)
+			{
+				(*prog->childSetup)(prog->childSetupArg);
+			}
+
 			/*
 			 * When asked to do so, before creating the child process, we call
 			 * setsid() to create our own session group and detach from the
@@ -304,6 +333,120 @@ execute_subprogram(Program *prog)
 }
 
 
+/*
+ * spawn_subprogram runs the given program with posix_spawn(), installing the
+ * same redirections as execute_subprogram does after fork(). It returns false
+ * when the caller should use fork() instead, and true when the program has
+ * been run, or when posix_spawn() failed, in which case prog->returnCode is
+ * -1 and prog->error is set.
+ */
+static bool
+spawn_subprogram(Program *prog, int *outpipe, int *errpipe)
+{
+	pid_t pid;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	short flags = 0;
+
+	if (prog->setsid)
+	{
+#ifdef POSIX_SPAWN_SETSID
+		flags |= POSIX_SPAWN_SETSID;
+#else
+		return false;
+#endif
+	}
+
+	if (posix_spawnattr_init(&attr) != 0)
+	{
+		return false;
+	}
+
+	if (posix_spawn_file_actions_init(&actions) != 0)
+	{
+		(void) posix_spawnattr_destroy(&attr);
+		return false;
+	}
+
+	bool prepared = posix_spawnattr_setflags(&attr, flags) == 0;
+
+	if (prepared && prog->tty == false)
+	{
+		/* see execute_subprogram about redirecting /dev/null into stdin */
+		prepared = posix_spawn_file_actions_addopen(&actions,
+													STDIN_FILENO,
+													DEV_NULL,
+													O_RDONLY,
+													0) == 0;
+
+		if (prepared && prog->capture)
+		{
+			prepared =
+				posix_spawn_file_actions_adddup2(&actions,
+												 outpipe[1],
+												 STDOUT_FILENO) == 0 &&
+				posix_spawn_file_actions_adddup2(&actions,
+												 errpipe[1],
+												 STDERR_FILENO) == 0 &&
+				posix_spawn_file_actions_addclose(&actions, outpipe[0]) == 0 &&
+				posix_spawn_file_actions_addclose(&actions, outpipe[1]) == 0 &&
+				posix_spawn_file_actions_addclose(&actions, errpipe[0]) == 0 &&
+				posix_spawn_file_actions_addclose(&actions, errpipe[1]) == 0;
+		}
+		else if (prepared)
+		{
+			prepared =
+				posix_spawn_file_actions_adddup2(&actions,
+												 prog->stdOutFd,
+												 STDOUT_FILENO) == 0 &&
+				posix_spawn_file_actions_adddup2(&actions,
+												 prog->stdErrFd,
+												 STDERR_FILENO) == 0;
+		}
+	}
+
+	if (!prepared)
+	{
+		(void) posix_spawn_file_actions_destroy(&actions);
+		(void) posix_spawnattr_destroy(&attr);
+		return false;
+	}
+
+	int error = posix_spawn(&pid, prog->program, &actions, &attr,
+							prog->args, environ);
+
+	(void) posix_spawn_file_actions_destroy(&actions);
+	(void) posix_spawnattr_destroy(&attr);
+
+	if (error != 0)
+	{
+		prog->returnCode = -1;
+		prog->error = error;
+
+		if (prog->capture)
+		{
+			close(outpipe[0]);
+			close(outpipe[1]);
+			close(errpipe[0]);
+			close(errpipe[1]);
+		}
+
+		return true;
+	}
+
+	if (prog->capture)
+	{
+		read_from_pipes(prog, pid, outpipe, errpipe);
+	}
+	else
+	{
+		(void) waitprogram(prog, pid);
+	}
+
+	return true;
+}
+
+
 /*
  * Run given program with its args, by using exec().
  *
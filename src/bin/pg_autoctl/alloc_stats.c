@@ -0,0 +1,183 @@
+/*
+ * src/bin/pg_autoctl/alloc_stats.c
+ *   Counting of the memory allocations done by pg_autoctl.
+ *
+ * When PG_AUTOCTL_ALLOC_STATS is defined we replace malloc() and friends with
+ * versions that count the allocations and then call the glibc allocator.
+ * Because the functions are defined in the main program, the calls made from
+ * within libpq also use them, which is what we need to account for the
+ * PQExpBuffer and PGresult allocations of the keeper main loop.
+ *
+ * The byte counts use malloc_usable_size(), so that free() can discount the
+ * size of the chunk too.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#ifdef PG_AUTOCTL_ALLOC_STATS
+#include <malloc.h>
+#endif
+
+#include "alloc_stats.h"
+
+
+static AllocStats allocStats = { 0 };
+
+
+#ifdef PG_AUTOCTL_ALLOC_STATS
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+
+static inline void
+alloc_stats_count_allocation(void *ptr)
+{
+	if (ptr != NULL)
+	{
+		size_t size = malloc_usable_size(ptr);
+
+		++allocStats.allocations;
+		allocStats.allocatedBytes += size;
+		allocStats.liveBytes += size;
+	}
+}
+
+
+static inline void
+alloc_stats_count_free(void *ptr)
+{
+	if (ptr != NULL)
+	{
+		++allocStats.frees;
+		allocStats.liveBytes -= malloc_usable_size(ptr);
+	}
+}
+
+
+void *
+malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	alloc_stats_count_allocation(ptr);
+
+	return ptr;
+}
+
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	alloc_stats_count_allocation(ptr);
+
+	return ptr;
+}
+
+
+/*
+ * A realloc() is counted as a free of the previous chunk and a new
+ * allocation, even when glibc manages to extend the chunk in place.
+ */
+void *
+realloc(void *ptr, size_t size)
+{
+	size_t previousSize = ptr == NULL ? 0 : malloc_usable_size(ptr);
+	void *newPtr = __libc_realloc(ptr, size);
+
+	if (newPtr != NULL || size == 0)
+	{
+		if (ptr != NULL)
+		{
+			++allocStats.frees;
+			allocStats.liveBytes -= previousSize;
+		}
+
+		alloc_stats_count_allocation(newPtr);
+	}
+
+	return newPtr;
+}
+
+
+void
+free(void *ptr)
+{
+	alloc_stats_count_free(ptr);
+
+	__libc_free(ptr);
+}
+
+
+#endif  /* PG_AUTOCTL_ALLOC_STATS */
+
+
+/*
+ * alloc_stats_enabled returns true when this binary counts its allocations.
+ */
+bool
+alloc_stats_enabled(void)
+{
+#ifdef PG_AUTOCTL_ALLOC_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/*
+ * alloc_stats_get copies the current allocation counters to the given stats.
+ */
+void
+alloc_stats_get(AllocStats *stats)
+{
+	*stats = allocStats;
+}
+
+
+/*
+ * alloc_stats_diff computes the allocations done between two snapshots of the
+ * counters.
+ */
+void
+alloc_stats_diff(AllocStats *start, AllocStats *end, AllocStats *diff)
+{
+	diff->allocations = end->allocations - start->allocations;
+	diff->frees = end->frees - start->frees;
+	diff->allocatedBytes = end->allocatedBytes - start->allocatedBytes;
+	diff->liveBytes = end->liveBytes - start->liveBytes;
+}
+
+
+/*
+ * alloc_stats_peak_rss_kb returns the peak resident set size of the process,
+ * in kilobytes, or -1 when getrusage() fails.
+ */
+long
+alloc_stats_peak_rss_kb(void)
+{
+	struct rusage usage = { 0 };
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return -1;
+	}
+
+	/* ru_maxrss is in kilobytes on Linux, and in bytes on macOS */
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
@@ -0,0 +1,33 @@
+/*
+ * src/bin/pg_autoctl/alloc_stats.h
+ *   Counting of the memory allocations done by pg_autoctl.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The counters are only maintained in the pg_autoctl-alloc-stats binary,
+ * built with PG_AUTOCTL_ALLOC_STATS defined. See the Makefile.
+ */
+typedef struct AllocStats
+{
+	uint64_t allocations;       /* malloc, calloc and realloc calls */
+	uint64_t frees;             /* free calls with a non-NULL pointer */
+	uint64_t allocatedBytes;    /* total of the allocated bytes */
+	int64_t liveBytes;          /* allocated bytes not freed yet */
+} AllocStats;
+
+bool alloc_stats_enabled(void);
+void alloc_stats_get(AllocStats *stats);
+void alloc_stats_diff(AllocStats *start, AllocStats *end, AllocStats *diff);
+long alloc_stats_peak_rss_kb(void);
+
+#endif /* ALLOC_STATS_H */
@@ -50,15 +50,15 @@ static bool run_ssh_command(const char *username,
 							bool tty,
 							const char *command);
 
-static bool start_ssh_command(const char *username,
-							  const char *ip,
-							  const char *command);
+static pid_t start_ssh_command(const char *username,
+							   const char *ip,
+							   const char *command);
 
 static bool azure_git_toplevel(char *srcDir, size_t size);
 
-static bool start_rsync_command(const char *username,
-								const char *ip,
-								const char *srcDir);
+static pid_t start_rsync_command(const char *username,
+								 const char *ip,
+								 const char *srcDir);
 
 static bool azure_rsync_vms(AzureRegionResources *azRegion);
 
@@ -713,7 +713,7 @@ azure_node_index_from_name(const char *group, const char *name)
 /*
  * azure_create_vm creates a Virtual Machine in our azure resource group.
  */
-bool
+pid_t
 azure_create_vm(AzureRegionResources *azRegion,
 				const char *name,
 				const char *image,
@@ -806,11 +806,11 @@ azure_create_vms(AzureRegionResources *azRegion,
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] = azure_create_vm(azRegion,
-										  azRegion->vmArray[index].name,
-										  image,
-										  username);
-		++pending;
+		pidArray[pending++] =
+			azure_create_vm(azRegion,
+							azRegion->vmArray[index].name,
+							image,
+							username);
 	}
 
 	/* also create the application node VM when asked to */
@@ -832,11 +832,11 @@ azure_create_vms(AzureRegionResources *azRegion,
 		{
 			(void) azure_prepare_node(azRegion, index);
 
-			pidArray[index] = azure_create_vm(azRegion,
-											  azRegion->vmArray[index].name,
-											  image,
-											  username);
-			++pending;
+			pidArray[pending++] =
+				azure_create_vm(azRegion,
+								azRegion->vmArray[index].name,
+								image,
+								username);
 		}
 	}
 
@@ -903,7 +903,7 @@ azure_git_toplevel(char *srcDir, size_t size)
  * start_rsync_command is used to sync our local source directory with a remote
  * place on a target VM.
  */
-static bool
+static pid_t
 start_rsync_command(const char *username,
 					const char *ip,
 					const char *srcDir)
@@ -922,13 +922,13 @@ start_rsync_command(const char *username,
 	if (!search_path_first("rsync", rsync, LOG_ERROR))
 	{
 		log_fatal("Failed to find program rsync in PATH");
-		return false;
+		return -1;
 	}
 
 	if (!search_path_first("ssh", ssh, LOG_ERROR))
 	{
 		log_fatal("Failed to find program ssh in PATH");
-		return false;
+		return -1;
 	}
 
 	/* use our usual ssh options even when using it through rsync */
@@ -1006,12 +1006,10 @@ azure_rsync_vms(AzureRegionResources *azRegion)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] =
+		pidArray[pending++] =
 			start_rsync_command("ha-admin",
 								azRegion->vmArray[index].public,
 								srcDir);
-
-		++pending;
 	}
 
 	/* also provision the application node VM when asked to */
@@ -1021,12 +1019,10 @@ azure_rsync_vms(AzureRegionResources *azRegion)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] =
+		pidArray[pending++] =
 			start_rsync_command("ha-admin",
 								azRegion->vmArray[index].public,
 								srcDir);
-
-		++pending;
 	}
 
 	/* now wait for the child processes to be done */
@@ -1084,11 +1080,10 @@ azure_build_pg_autoctl(AzureRegionResources *azRegion)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] =
+		pidArray[pending++] =
 			start_ssh_command("ha-admin",
 							  azRegion->vmArray[index].public,
 							  buildCommand);
-		++pending;
 	}
 
 	/* also provision the application node VM when asked to */
@@ -1098,11 +1093,10 @@ azure_build_pg_autoctl(AzureRegionResources *azRegion)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] =
+		pidArray[pending++] =
 			start_ssh_command("ha-admin",
 							  azRegion->vmArray[index].public,
 							  buildCommand);
-		++pending;
 	}
 
 	/* now wait for the child processes to be done */
@@ -1276,7 +1270,7 @@ azure_prepare_debian_build_dep_postgres_command(char *command, size_t size)
  * azure_provision_vm runs the command `az vm run-command invoke` with our
  * provisioning script.
  */
-bool
+pid_t
 azure_provision_vm(const char *group, const char *name, bool fromSource)
 {
 	char *args[26];
@@ -1319,21 +1313,21 @@ azure_provision_vm(const char *group, const char *name, bool fromSource)
 	if (!azure_prepare_debian_install_command(aptGetInstall, BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	if (!azure_prepare_debian_install_postgres_command(aptGetInstallPostgres,
 													   BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	if (!azure_prepare_debian_build_dep_postgres_command(aptGetBuildDepPostgres,
 														 BUFSIZE))
 	{
 		/* errors have already been logged */
-		return false;
+		return -1;
 	}
 
 	args[argsIndex++] = azureCLI;
@@ -1417,11 +1411,10 @@ azure_provision_vms(AzureRegionResources *azRegion, bool fromSource)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] = azure_provision_vm(azRegion->group,
-											 azRegion->vmArray[index].name,
-											 fromSource);
-
-		++pending;
+		pidArray[pending++] =
+			azure_provision_vm(azRegion->group,
+							   azRegion->vmArray[index].name,
+							   fromSource);
 	}
 
 	/* also provision the application node VM when asked to */
@@ -1431,10 +1424,10 @@ azure_provision_vms(AzureRegionResources *azRegion, bool fromSource)
 
 		(void) azure_prepare_node(azRegion, index);
 
-		pidArray[index] = azure_provision_vm(azRegion->group,
-											 azRegion->vmArray[index].name,
-											 fromSource);
-		++pending;
+		pidArray[pending++] =
+			azure_provision_vm(azRegion->group,
+							   azRegion->vmArray[index].name,
+							   fromSource);
 	}
 
 	/* now wait for the child processes to be done */
@@ -1893,7 +1886,7 @@ run_ssh_command(const char *username,
  * start_ssh_command starts the given command on the remote machine given by ip
  * address, as the given username.
  */
-static bool
+static pid_t
 start_ssh_command(const char *username,
 				  const char *ip,
 				  const char *command)
@@ -1909,7 +1902,7 @@ start_ssh_command(const char *username,
 	if (!search_path_first("ssh", ssh, LOG_ERROR))
 	{
 		log_fatal("Failed to find program ssh in PATH");
-		return false;
+		return -1;
 	}
 
 	args[argsIndex++] = ssh;
@@ -1932,9 +1925,9 @@ start_ssh_command(const char *username,
 
 	if (dryRun)
 	{
-		appendPQExpBuffer(azureScript, "\n%s", ssh_command);
+		appendPQExpBuffer(azureScript, "\n%s &", ssh_command);
 
-		return true;
+		return 0;
 	}
 
 	return azure_start_command(&program);
@@ -2317,15 +2310,17 @@ azure_deploy_monitor(AzureRegionResources *azRegion)
 
 
 /*
- * azure_deploy_postgres deploys pg_autoctl on a Postgres node, running both
- * the pg_autoctl create postgres command and then the systemd integration
- * commands.
+ * azure_prepare_deploy_postgres_command prepares the command that deploys
+ * pg_autoctl on a Postgres node: the pg_autoctl create postgres command and
+ * then the systemd integration commands.
  */
-bool
-azure_deploy_postgres(AzureRegionResources *azRegion, int vmIndex)
+static bool
+azure_prepare_deploy_postgres_command(AzureRegionResources *azRegion,
+									  int vmIndex,
+									  char *command,
+									  size_t size)
 {
 	KeyVal env = { 0 };
-	char create_postgres[BUFSIZE] = { 0 };
 
 	char *systemd =
 		"pg_autoctl -q show systemd --pgdata /home/ha-admin/pgdata "
@@ -2335,17 +2330,14 @@ azure_deploy_postgres(AzureRegionResources *azRegion, int vmIndex)
 		"sudo systemctl enable pgautofailover; "
 		"sudo systemctl start pgautofailover";
 
-	bool tty = false;
-	char *host = azRegion->vmArray[vmIndex].public;
-
 	if (!azure_prepare_target_versions(&env))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	/* build pg_autoctl create monitor command with target Postgres version  */
-	sformat(create_postgres, sizeof(create_postgres),
+	/* build pg_autoctl create postgres command with target Postgres version */
+	sformat(command, size,
 			"pg_autoctl create postgres "
 			"--pgctl /usr/lib/postgresql/%s/bin/pg_ctl "
 			"--pgdata /home/ha-admin/pgdata "
@@ -2356,26 +2348,95 @@ azure_deploy_postgres(AzureRegionResources *azRegion, int vmIndex)
 			"--hostname %s "
 			"--name %s-%c "
 			"--monitor "
-			"'postgres://autoctl_node@%s/pg_auto_failover?sslmode=require'",
+			"'postgres://autoctl_node@%s/pg_auto_failover?sslmode=require'"
+			" && %s",
 
 	        /* AZ_PG_VERSION */
 			env.values[0],
 			azRegion->vmArray[vmIndex].private,
 			azRegion->region,
 			'a' + vmIndex - 1,
-			azRegion->vmArray[0].private);
+			azRegion->vmArray[0].private,
+			systemd);
 
-	/* the monitor is always at index 0 in the vmArray */
-	if (!run_ssh_command("ha-admin", host, tty, create_postgres))
+	return true;
+}
+
+
+/*
+ * azure_deploy_postgres deploys pg_autoctl on a Postgres node, running both
+ * the pg_autoctl create postgres command and then the systemd integration
+ * commands.
+ */
+bool
+azure_deploy_postgres(AzureRegionResources *azRegion, int vmIndex)
+{
+	char command[BUFSIZE] = { 0 };
+
+	bool tty = false;
+	char *host = azRegion->vmArray[vmIndex].public;
+
+	if (!azure_prepare_deploy_postgres_command(azRegion, vmIndex,
+											   command, sizeof(command)))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	if (!run_ssh_command("ha-admin", host, tty, systemd))
+	return run_ssh_command("ha-admin", host, tty, command);
+}
+
+
+/*
+ * azure_deploy_standby_nodes deploys pg_autoctl on the Postgres nodes from
+ * the given index to the last one, in parallel. The primary must have been
+ * deployed already, so that the standby nodes can join it at the same time.
+ */
+static bool
+azure_deploy_standby_nodes(AzureRegionResources *azRegion, int firstIndex)
+{
+	int pending = 0;
+	pid_t pidArray[MAX_VMS_PER_REGION] = { 0 };
+
+	if (azRegion->nodes < firstIndex)
 	{
-		/* errors have already been logged */
-		return false;
+		return true;
+	}
+
+	log_info("Deploying %d standby nodes in parallel",
+			 azRegion->nodes - firstIndex + 1);
+
+	for (int vmIndex = firstIndex; vmIndex <= azRegion->nodes; vmIndex++)
+	{
+		char command[BUFSIZE] = { 0 };
+
+		if (!azure_prepare_deploy_postgres_command(azRegion, vmIndex,
+												   command, sizeof(command)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		pidArray[pending++] =
+			start_ssh_command("ha-admin",
+							  azRegion->vmArray[vmIndex].public,
+							  command);
+	}
+
+	/* now wait for the child processes to be done */
+	if (dryRun)
+	{
+		appendPQExpBuffer(azureScript, "\nwait");
+	}
+	else
+	{
+		if (!azure_wait_for_commands(pending, pidArray))
+		{
+			log_fatal("Failed to deploy all %d standby nodes, "
+					  "see above for details",
+					  pending);
+			return false;
+		}
 	}
 
 	return true;
@@ -2403,15 +2464,17 @@ azure_create_nodes(AzureRegionResources *azRegion)
 	}
 
 	/*
-	 * Now prepare all the other nodes, one at a time, so that we have a the
-	 * primary, etc. It could also be all at once, but one at a time is good
-	 * for a tutorial.
+	 * Now prepare the first node, which is going to be the primary, and then
+	 * all the other nodes at once: they join the primary as standby nodes,
+	 * and the monitor lets them make progress concurrently.
 	 */
-	for (int vmIndex = 1; vmIndex <= azRegion->nodes; vmIndex++)
+	if (azRegion->nodes > 0)
 	{
-		success = success && azure_deploy_postgres(azRegion, vmIndex);
+		success = success && azure_deploy_postgres(azRegion, 1);
 	}
 
+	success = success && azure_deploy_standby_nodes(azRegion, 2);
+
 	return success;
 }
 
@@ -96,17 +96,17 @@ bool azure_create_subnet(const char *group,
 
 bool az_group_delete(const char *group);
 
-bool azure_create_vm(AzureRegionResources *azRegion,
-					 const char *name,
-					 const char *image,
-					 const char *username);
+pid_t azure_create_vm(AzureRegionResources *azRegion,
+					  const char *name,
+					  const char *image,
+					  const char *username);
 
 bool azure_create_vms(AzureRegionResources *azRegion,
 					  const char *image,
 					  const char *username);
 
 bool azure_prepare_target_versions(KeyVal *env);
-bool azure_provision_vm(const char *group, const char *name, bool fromSource);
+pid_t azure_provision_vm(const char *group, const char *name, bool fromSource);
 bool azure_provision_vms(AzureRegionResources *azRegion, bool fromSource);
 
 bool azure_fetch_ip_addresses(const char *group,
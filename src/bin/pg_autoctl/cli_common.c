@@ -24,6 +24,7 @@
 #include "log.h"
 #include "monitor.h"
 #include "monitor_config.h"
+#include "monitor_proxy.h"
 #include "parsing.h"
 #include "pgsetup.h"
 #include "pgsql.h"
@@ -1167,6 +1168,14 @@ monitor_init_from_pgsetup(Monitor *monitor, PostgresSetup *pgSetup)
 				return false;
 			}
 
+			if (!IS_EMPTY_STRING_BUFFER(config.monitor_replica_pguri) &&
+				!monitor_init_replica(&(keeper.monitor),
+									  config.monitor_replica_pguri))
+			{
+				log_warn("Failed to setup the monitor replica connection, "
+						 "reading from the monitor instead");
+			}
+
 			*monitor = keeper.monitor;
 			*pgSetup = config.pgSetup;
 			break;
@@ -1987,11 +1996,47 @@ cli_monitor_init_from_option_or_config(Monitor *monitor, KeeperConfig *kconfig)
 	}
 	else
 	{
+		char shardPgURI[MAXCONNINFO] = { 0 };
+
 		if (!monitor_init(monitor, kconfig->monitor_pguri))
 		{
 			/* errors have already been logged */
 			exit(EXIT_CODE_BAD_ARGS);
 		}
+
+		/* --monitor might be a directory of monitor shards */
+		if (!IS_EMPTY_STRING_BUFFER(kconfig->formation) &&
+			strcmp(kconfig->formation, "monitor") != 0 &&
+			!monitor_use_formation_shard(monitor, kconfig->formation,
+										 shardPgURI, MAXCONNINFO))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+}
+
+
+/*
+ * cli_monitor_use_local_proxy setups the monitor connection to first send its
+ * queries to the monitor-proxy service of the local node, when the monitor
+ * connection string comes from the configuration file of that node. Only
+ * commands that don't write to the monitor should use this, and when the
+ * monitor-proxy is not available the command connects to the monitor.
+ */
+void
+cli_monitor_use_local_proxy(Monitor *monitor, KeeperConfig *kconfig)
+{
+	if (!IS_EMPTY_STRING_BUFFER(kconfig->monitor_pguri) ||
+		IS_EMPTY_STRING_BUFFER(kconfig->pathnames.pid))
+	{
+		return;
+	}
+
+	if (!monitor_proxy_socket_path(kconfig->pathnames.pid,
+								   monitor->pgsql.proxySocketPath))
+	{
+		monitor->pgsql.proxySocketPath[0] = '\0';
 	}
 }
 
@@ -190,6 +190,7 @@ int cli_get_name_getopts(int argc, char **argv);
 bool cli_use_monitor_option(KeeperConfig *options);
 void cli_monitor_init_from_option_or_config(Monitor *monitor,
 											KeeperConfig *kconfig);
+void cli_monitor_use_local_proxy(Monitor *monitor, KeeperConfig *kconfig);
 void cli_ensure_node_name(Keeper *keeper);
 
 bool discover_hostname(char *hostname, int size,
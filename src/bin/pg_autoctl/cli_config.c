@@ -33,6 +33,7 @@ static void cli_config_check_connections(PostgresSetup *pgSetup,
 static void cli_config_get(int argc, char **argv);
 static void cli_keeper_config_get(int argc, char **argv);
 static void cli_monitor_config_get(int argc, char **argv);
+static void cli_config_print_settings(int count, char **paths, char **values);
 
 static void cli_config_set(int argc, char **argv);
 static void cli_keeper_config_set(int argc, char **argv);
@@ -49,7 +50,7 @@ static CommandLine config_check =
 static CommandLine config_get =
 	make_command("get",
 				 "Get the value of a given pg_autoctl configuration variable",
-				 CLI_PGDATA_USAGE "[ section.option ]",
+				 CLI_PGDATA_USAGE "[ section.option ... ]",
 				 CLI_PGDATA_OPTION,
 				 cli_getopt_pgdata,
 				 cli_config_get);
@@ -473,33 +474,50 @@ cli_keeper_config_get(int argc, char **argv)
 			break;
 		}
 
-		case 1:
+		default:
 		{
-			/* single argument, find the option and display its value */
-			char *path = argv[0];
-			char value[BUFSIZE];
-
-			if (keeper_config_get_setting(&config,
-										  path,
-										  value,
-										  BUFSIZE))
+			/*
+			 * Find the options and display their values. Tools call this in
+			 * loops, so we parse the file only once for all the options, and
+			 * skip parsing when we have a snapshot of the current file.
+			 */
+			if (!keeper_config_read_file_cached(&config))
 			{
-				fformat(stdout, "%s\n", value);
+				/* errors have already been logged */
+				exit(EXIT_CODE_BAD_CONFIG);
 			}
-			else
+
+			char **values = (char **) calloc(argc, sizeof(char *));
+
+			if (values == NULL)
 			{
-				log_error("Failed to lookup option %s", path);
-				exit(EXIT_CODE_BAD_ARGS);
+				log_fatal(ALLOCATION_FAILED_ERROR);
+				exit(EXIT_CODE_INTERNAL_ERROR);
 			}
 
-			break;
-		}
+			for (int i = 0; i < argc; i++)
+			{
+				values[i] = (char *) calloc(BUFSIZE, sizeof(char));
 
-		default:
-		{
-			/* we only support 0 or 1 argument */
-			commandline_help(stderr);
-			exit(EXIT_CODE_BAD_ARGS);
+				if (values[i] == NULL)
+				{
+					log_fatal(ALLOCATION_FAILED_ERROR);
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				if (!keeper_config_lookup_setting(&config,
+												  argv[i],
+												  values[i],
+												  BUFSIZE))
+				{
+					log_error("Failed to lookup option %s", argv[i]);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+			}
+
+			(void) cli_config_print_settings(argc, argv, values);
+
+			break;
 		}
 	}
 }
@@ -550,34 +568,72 @@ cli_monitor_config_get(int argc, char **argv)
 			break;
 		}
 
-		case 1:
+		default:
 		{
-			/* single argument, find the option and display its value */
-			char *path = argv[0];
-			char value[BUFSIZE];
-
-			if (monitor_config_get_setting(&mconfig,
-										   path,
-										   value,
-										   BUFSIZE))
+			/* find the options and display their values */
+			char **values = (char **) calloc(argc, sizeof(char *));
+
+			if (values == NULL)
 			{
-				fformat(stdout, "%s\n", value);
+				log_fatal(ALLOCATION_FAILED_ERROR);
+				exit(EXIT_CODE_INTERNAL_ERROR);
 			}
-			else
+
+			for (int i = 0; i < argc; i++)
 			{
-				log_error("Failed to lookup option %s", path);
-				exit(EXIT_CODE_BAD_ARGS);
+				values[i] = (char *) calloc(BUFSIZE, sizeof(char));
+
+				if (values[i] == NULL)
+				{
+					log_fatal(ALLOCATION_FAILED_ERROR);
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				if (!monitor_config_get_setting(&mconfig,
+												argv[i],
+												values[i],
+												BUFSIZE))
+				{
+					log_error("Failed to lookup option %s", argv[i]);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
 			}
 
+			(void) cli_config_print_settings(argc, argv, values);
+
 			break;
 		}
+	}
+}
 
-		default:
+
+/*
+ * cli_config_print_settings prints the values of the options given on the
+ * command line. A single value is printed as-is, as it always has been. With
+ * several options, the values are printed one per line in the order of the
+ * command line, or as a JSON object keyed by section.option with --json.
+ */
+static void
+cli_config_print_settings(int count, char **paths, char **values)
+{
+	if (count > 1 && outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		for (int i = 0; i < count; i++)
 		{
-			/* we only support 0 or 1 argument */
-			commandline_help(stderr);
-			exit(EXIT_CODE_BAD_ARGS);
+			/* section.option names must not be taken as dotted paths */
+			json_object_set_string(jsObj, paths[i], values[i]);
 		}
+
+		(void) cli_pprint_json(js);
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		fformat(stdout, "%s\n", values[i]);
 	}
 }
 
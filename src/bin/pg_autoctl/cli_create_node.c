@@ -66,6 +66,7 @@ CommandLine create_monitor_command =
 		"  --auth            authentication method for connections from data nodes\n"
 		"  --skip-pg-hba     skip editing pg_hba.conf rules\n"
 		"  --run             create node then run pg_autoctl service\n"
+		"  --standby-of      create a hot standby of the monitor at this URI\n"
 		KEEPER_CLI_SSL_OPTIONS,
 		cli_create_monitor_getopts,
 		cli_create_monitor);
@@ -362,6 +363,7 @@ cli_create_monitor_getopts(int argc, char **argv)
 		{ "quiet", no_argument, NULL, 'q' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "run", no_argument, NULL, 'x' },
+		{ "standby-of", required_argument, NULL, 'O' },
 		{ "no-ssl", no_argument, NULL, 'N' },
 		{ "ssl-self-signed", no_argument, NULL, 's' },
 		{ "ssl-mode", required_argument, &ssl_flag, SSL_MODE_FLAG },
@@ -375,10 +377,11 @@ cli_create_monitor_getopts(int argc, char **argv)
 
 	/* hard-coded defaults */
 	options.pgSetup.pgport = pgsetup_get_pgport();
+	options.takeoverTimeout = MONITOR_TAKEOVER_TIMEOUT;
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "C:D:p:n:l:A:SVvqhxNs",
+	while ((c = getopt_long(argc, argv, "C:D:p:n:l:A:SVvqhxO:Ns",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -509,6 +512,20 @@ cli_create_monitor_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'O':
+			{
+				/* { "standby-of", required_argument, NULL, 'O' }, */
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --standby-of connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.standbyOf, optarg, MAXCONNINFO);
+				log_trace("--standby-of %s", options.standbyOf);
+				break;
+			}
+
 			case 's':
 			{
 				/* { "ssl-self-signed", no_argument, NULL, 's' }, */
@@ -33,7 +33,9 @@ DemoAppOptions demoAppOptions = { 0 };
 
 static int cli_do_demoapp_getopts(int argc, char **argv);
 
+static void cli_demo_prepare(char *pguri, size_t size);
 static void cli_demo_run(int argc, char **argv);
+static void cli_demo_bench(int argc, char **argv);
 static void cli_demo_uri(int argc, char **argv);
 static void cli_demo_ping(int argc, char **argv);
 static void cli_demo_summary(int argc, char **argv);
@@ -52,6 +54,25 @@ static CommandLine do_demo_run_command =
 				 "  --failover-freq  Seconds between subsequent failovers (45)\n",
 				 cli_do_demoapp_getopts, cli_demo_run);
 
+static CommandLine do_demo_bench_command =
+	make_command("bench",
+				 "Benchmark the application during failovers",
+				 "[option ...]",
+				 "  --monitor        Postgres URI of the pg_auto_failover monitor\n"
+				 "  --formation      Formation to use (default)\n"
+				 "  --group          Group Id to failover (0)\n"
+				 "  --username       PostgreSQL's username\n"
+				 "  --clients        How many client processes to use (1)\n"
+				 "  --duration       Duration of the benchmark, in seconds (30)\n"
+				 "  --rate           Transactions per second per client, 0 for max (100)\n"
+				 "  --read-ratio     Percentage of reads in the transactions (50)\n"
+				 "  --no-failover    Run the benchmark without failovers\n"
+				 "  --first-failover Timing of the first failover (10)\n"
+				 "  --failover-freq  Seconds between subsequent failovers (45)\n"
+				 "  --output         JSON file where to write the results (stdout)\n"
+				 "  --report-outages Report client outages to the failover drills\n",
+				 cli_do_demoapp_getopts, cli_demo_bench);
+
 static CommandLine do_demo_uri_command =
 	make_command("uri",
 				 "Grab the application connection string from the monitor",
@@ -90,6 +111,7 @@ static CommandLine do_demo_summary_command =
 
 CommandLine *do_demo_subcommands[] = {
 	&do_demo_run_command,
+	&do_demo_bench_command,
 	&do_demo_uri_command,
 	&do_demo_ping_command,
 	&do_demo_summary_command,
@@ -125,6 +147,10 @@ cli_do_demoapp_getopts(int argc, char **argv)
 		{ "no-failover", no_argument, NULL, 'N' },
 		{ "first-failover", required_argument, NULL, 'F' },
 		{ "failover-freq", required_argument, NULL, 'Q' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "read-ratio", required_argument, NULL, 'R' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "report-outages", no_argument, NULL, 'O' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -141,6 +167,8 @@ cli_do_demoapp_getopts(int argc, char **argv)
 	options.firstFailover = 10;
 	options.failoverFreq = 45;
 	options.doFailover = true;
+	options.rate = DEMO_BENCH_DEFAULT_RATE;
+	options.readRatio = DEMO_BENCH_DEFAULT_READ_RATIO;
 	strlcpy(options.formation, "default", sizeof(options.formation));
 
 	/*
@@ -271,6 +299,50 @@ cli_do_demoapp_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'r':
+			{
+				/* { "rate", required_argument, NULL, 'r' }, */
+				if (!stringToInt(optarg, &options.rate) || options.rate < 0)
+				{
+					log_error("Failed to parse --rate number \"%s\"", optarg);
+					errors++;
+				}
+				log_trace("--rate %d", options.rate);
+				break;
+			}
+
+			case 'R':
+			{
+				/* { "read-ratio", required_argument, NULL, 'R' }, */
+				if (!stringToInt(optarg, &options.readRatio) ||
+					options.readRatio < 0 ||
+					options.readRatio > 100)
+				{
+					log_error("Failed to parse --read-ratio \"%s\": "
+							  "expected a percentage between 0 and 100",
+							  optarg);
+					errors++;
+				}
+				log_trace("--read-ratio %d", options.readRatio);
+				break;
+			}
+
+			case 'o':
+			{
+				/* { "output", required_argument, NULL, 'o' }, */
+				strlcpy(options.outputFilename, optarg, MAXPGPATH);
+				log_trace("--output %s", options.outputFilename);
+				break;
+			}
+
+			case 'O':
+			{
+				/* { "report-outages", no_argument, NULL, 'O' }, */
+				options.reportOutages = true;
+				log_trace("--report-outages");
+				break;
+			}
+
 
 			case 'h':
 			{
@@ -363,13 +435,12 @@ cli_do_demoapp_getopts(int argc, char **argv)
 
 
 /*
- * cli_demo_run runs a demo application.
+ * cli_demo_prepare grabs the formation URI from the monitor, retrying while
+ * the formation is not ready yet, and then prepares the demo schema.
  */
 static void
-cli_demo_run(int argc, char **argv)
+cli_demo_prepare(char *pguri, size_t size)
 {
-	char pguri[MAXCONNINFO] = { 0 };
-
 	ConnectionRetryPolicy retryPolicy = { 0 };
 
 	/* retry connecting to the monitor when it's not available */
@@ -379,7 +450,7 @@ cli_demo_run(int argc, char **argv)
 	{
 		bool mayRetry = false;
 
-		if (demoapp_grab_formation_uri(&demoAppOptions, pguri, sizeof(pguri),
+		if (demoapp_grab_formation_uri(&demoAppOptions, pguri, size,
 									   &mayRetry))
 		{
 			/* success: break out of the retry loop */
@@ -411,6 +482,18 @@ cli_demo_run(int argc, char **argv)
 		log_fatal("Failed to install the demo application schema");
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
+}
+
+
+/*
+ * cli_demo_run runs a demo application.
+ */
+static void
+cli_demo_run(int argc, char **argv)
+{
+	char pguri[MAXCONNINFO] = { 0 };
+
+	(void) cli_demo_prepare(pguri, sizeof(pguri));
 
 	if (!demoapp_run(pguri, &demoAppOptions))
 	{
@@ -423,6 +506,25 @@ cli_demo_run(int argc, char **argv)
 }
 
 
+/*
+ * cli_demo_bench runs the demo application benchmark, and exports the
+ * results as JSON.
+ */
+static void
+cli_demo_bench(int argc, char **argv)
+{
+	char pguri[MAXCONNINFO] = { 0 };
+
+	(void) cli_demo_prepare(pguri, sizeof(pguri));
+
+	if (!demoapp_bench(pguri, &demoAppOptions))
+	{
+		log_fatal("Failed to run the demo application benchmark");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
 /*
  * cli_demo_uri returns the Postgres connection string (URI) to use in the demo
  * application, grabbed from a running monitor node by using the SQL API.
@@ -40,6 +40,12 @@ typedef struct DemoAppOptions
 	int firstFailover;
 	int failoverFreq;
 	bool doFailover;
+
+	/* pg_autoctl do demo bench */
+	int rate;
+	int readRatio;
+	char outputFilename[MAXPGPATH];
+	bool reportOutages;
 } DemoAppOptions;
 
 extern DemoAppOptions demoAppOptions;
@@ -18,7 +18,9 @@
 #include "cli_common.h"
 #include "commandline.h"
 #include "defaults.h"
+#include "file_utils.h"
 #include "fsm.h"
+#include "fsm_timings.h"
 #include "keeper_config.h"
 #include "keeper.h"
 #include "parsing.h"
@@ -33,6 +35,7 @@ static void cli_do_fsm_list(int argc, char **argv);
 static void cli_do_fsm_gv(int argc, char **argv);
 static void cli_do_fsm_assign(int argc, char **argv);
 static void cli_do_fsm_step(int argc, char **argv);
+static void cli_do_fsm_replay(int argc, char **argv);
 
 static void cli_do_fsm_get_nodes(int argc, char **argv);
 static void cli_do_fsm_set_nodes(int argc, char **argv);
@@ -82,6 +85,14 @@ static CommandLine fsm_step =
 				 cli_getopt_pgdata,
 				 cli_do_fsm_step);
 
+static CommandLine fsm_replay =
+	make_command("replay",
+				 "Replay recorded assigned states without running them",
+				 CLI_PGDATA_USAGE "</path/to/input/steps.json>",
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_fsm_replay);
+
 static CommandLine fsm_nodes_get =
 	make_command("get",
 				 "Get the list of nodes from file (see --disable-monitor)",
@@ -117,6 +128,7 @@ static CommandLine *fsm[] = {
 	&fsm_gv,
 	&fsm_assign,
 	&fsm_step,
+	&fsm_replay,
 	&fsm_nodes,
 	NULL
 };
@@ -552,3 +564,396 @@ cli_do_fsm_set_nodes(int argc, char **argv)
 
 	(void) printNodeArray(&(keeper.otherNodes));
 }
+
+
+/*
+ * A replay step is a goal state assigned by the monitor, together with what
+ * the keeper observed of the local Postgres instance at the time.
+ */
+typedef struct FSMReplayStep
+{
+	NodeState current;
+	NodeState assigned;
+	bool pgIsRunning;
+	const char *action;
+	const char *function;
+	double costMs;
+	bool recordedCost;
+} FSMReplayStep;
+
+
+/*
+ * fsm_replay_state_expects_postgres returns 1 when Postgres is expected to
+ * be running in the given state, 0 when it is expected to be stopped, and -1
+ * when it does not matter. See keeper_ensure_current_state().
+ */
+static int
+fsm_replay_state_expects_postgres(NodeState state)
+{
+	switch (state)
+	{
+		case SINGLE_STATE:
+		case PRIMARY_STATE:
+		case WAIT_PRIMARY_STATE:
+		case JOIN_PRIMARY_STATE:
+		case APPLY_SETTINGS_STATE:
+		case PREP_PROMOTION_STATE:
+		case STOP_REPLICATION_STATE:
+		case SECONDARY_STATE:
+		case REPORT_LSN_STATE:
+		case CATCHINGUP_STATE:
+		{
+			return 1;
+		}
+
+		case DEMOTED_STATE:
+		case DEMOTE_TIMEOUT_STATE:
+		case DRAINING_STATE:
+		{
+			return 0;
+		}
+
+		default:
+		{
+			return -1;
+		}
+	}
+}
+
+
+/*
+ * fsm_replay_transition_cost returns the average duration of the successful
+ * transitions from current to assigned found in the timings file, or -1.
+ */
+static double
+fsm_replay_transition_cost(JSON_Array *timings,
+						   NodeState current, NodeState assigned)
+{
+	double totalMs = 0.0;
+	int count = 0;
+
+	for (size_t i = 0; timings != NULL && i < json_array_get_count(timings); i++)
+	{
+		JSON_Object *jsObj = json_array_get_object(timings, i);
+
+		const char *from = json_object_get_string(jsObj, "from");
+		const char *to = json_object_get_string(jsObj, "to");
+
+		if (from == NULL || to == NULL ||
+			json_object_get_boolean(jsObj, "success") != 1)
+		{
+			continue;
+		}
+
+		if (strcmp(from, NodeStateToString(current)) == 0 &&
+			strcmp(to, NodeStateToString(assigned)) == 0)
+		{
+			totalMs += json_object_get_number(jsObj, "duration_ms");
+			++count;
+		}
+	}
+
+	return count > 0 ? totalMs / count : -1.0;
+}
+
+
+/*
+ * fsm_replay_step drives the keeper FSM for a single replay step: either the
+ * transition to the assigned state, or ensuring the current state when the
+ * monitor assigned the current state again. The transition functions are
+ * not called, we only report what the keeper would do.
+ */
+static bool
+fsm_replay_step(Keeper *keeper, FSMReplayStep *step)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	step->current = keeperState->current_role;
+	step->assigned = keeperState->assigned_role;
+	step->pgIsRunning = postgres->pgIsRunning;
+	step->function = "none";
+
+	if (keeperState->current_role == keeperState->assigned_role)
+	{
+		int expected = fsm_replay_state_expects_postgres(step->current);
+
+		if (expected == 1 && !postgres->pgIsRunning)
+		{
+			step->action = "start postgres";
+			step->function = "ensure_postgres_service_is_running";
+			postgres->pgIsRunning = true;
+		}
+		else if (expected == 0 && postgres->pgIsRunning)
+		{
+			step->action = "stop postgres";
+			step->function = "ensure_postgres_service_is_stopped";
+			postgres->pgIsRunning = false;
+		}
+		else
+		{
+			step->action = "ensure";
+		}
+
+		return true;
+	}
+
+	KeeperFSMTransition *transition =
+		keeper_fsm_find_transition(keeperState->current_role,
+								   keeperState->assigned_role);
+
+	if (transition == NULL)
+	{
+		step->action = "unsupported";
+
+		log_error("pg_autoctl does not know how to reach state \"%s\" from \"%s\"",
+				  NodeStateToString(keeperState->assigned_role),
+				  NodeStateToString(keeperState->current_role));
+
+		return false;
+	}
+
+	step->action = "transition";
+	step->function = keeper_fsm_function_name(transition->transitionFunction);
+
+	keeperState->current_role = keeperState->assigned_role;
+
+	/* the transition leaves Postgres as the new state expects it */
+	int expected = fsm_replay_state_expects_postgres(keeperState->current_role);
+
+	if (expected >= 0)
+	{
+		postgres->pgIsRunning = expected == 1;
+	}
+
+	return true;
+}
+
+
+/*
+ * cli_do_fsm_replay replays a recorded sequence of assigned states against an
+ * in-memory keeper and Postgres instance, and reports the FSM transitions the
+ * keeper would run for them, and their cost.
+ *
+ * The input is a JSON array of objects with the assigned state in "to", and
+ * optionally the current state in "from" (only used on the first entry), the
+ * local Postgres observation in "pg_is_running", and the measured cost in
+ * "duration_ms". This is the format of the FSM timings file, so the last
+ * transitions of a node can be replayed as-is. Steps without a recorded cost
+ * use the average duration of the same transition in the timings file of the
+ * node given with --pgdata, when it exists.
+ */
+static void
+cli_do_fsm_replay(int argc, char **argv)
+{
+	Keeper keeper = { 0 };
+	KeeperStateData *keeperState = &(keeper.state);
+	LocalPostgresServer *postgres = &(keeper.postgres);
+
+	JSON_Value *timings = NULL;
+	char *contents = NULL;
+	long size = 0L;
+
+	int transitionCount = 0;
+	double totalCostMs = 0.0;
+	bool success = true;
+
+	keeper.config = keeperOptions;
+
+	if (argc != 1)
+	{
+		commandline_print_usage(&fsm_replay, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!read_file_if_exists(argv[0], &contents, &size))
+	{
+		log_error("Failed to read FSM replay steps from file \"%s\"", argv[0]);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	JSON_Value *js = json_parse_string(contents);
+	JSON_Array *jsSteps = json_value_get_array(js);
+
+	free(contents);
+
+	if (jsSteps == NULL)
+	{
+		log_error("Failed to parse FSM replay steps from file \"%s\": "
+				  "a JSON array is expected",
+				  argv[0]);
+		json_value_free(js);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* the cost model is optional, ignore errors */
+	(void) fsm_timings_read_file(keeper.config.pathnames.timings, &timings);
+
+	int stepCount = json_array_get_count(jsSteps);
+	FSMReplayStep *steps =
+		(FSMReplayStep *) calloc(Max(stepCount, 1), sizeof(FSMReplayStep));
+
+	if (steps == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	keeperState->current_role = INIT_STATE;
+	postgres->pgIsRunning = false;
+
+	for (int i = 0; i < stepCount; i++)
+	{
+		JSON_Object *jsStep = json_array_get_object(jsSteps, i);
+		FSMReplayStep *step = &(steps[i]);
+
+		const char *from = json_object_get_string(jsStep, "from");
+		const char *to = json_object_get_string(jsStep, "to");
+
+		if (to == NULL)
+		{
+			to = json_object_get_string(jsStep, "assigned");
+		}
+
+		if (i == 0 && from != NULL)
+		{
+			keeperState->current_role = NodeStateFromString(from);
+		}
+
+		keeperState->assigned_role = to ? NodeStateFromString(to) : NO_STATE;
+
+		if (keeperState->current_role == NO_STATE ||
+			keeperState->assigned_role == NO_STATE)
+		{
+			log_error("Failed to parse FSM replay step %d", i + 1);
+			success = false;
+			stepCount = i;
+			break;
+		}
+
+		/* the keeper observes Postgres before calling node_active() */
+		if (json_object_has_value_of_type(jsStep, "pg_is_running", JSONBoolean))
+		{
+			postgres->pgIsRunning =
+				json_object_get_boolean(jsStep, "pg_is_running") == 1;
+		}
+
+		if (!fsm_replay_step(&keeper, step))
+		{
+			success = false;
+			stepCount = i + 1;
+			break;
+		}
+
+		if (json_object_has_value_of_type(jsStep, "duration_ms", JSONNumber))
+		{
+			step->costMs = json_object_get_number(jsStep, "duration_ms");
+			step->recordedCost = true;
+		}
+		else if (strcmp(step->action, "transition") == 0)
+		{
+			double costMs =
+				fsm_replay_transition_cost(json_value_get_array(timings),
+										   step->current, step->assigned);
+
+			step->costMs = costMs >= 0 ? costMs : 0.0;
+			step->recordedCost = costMs >= 0;
+		}
+
+		if (strcmp(step->action, "transition") == 0)
+		{
+			++transitionCount;
+		}
+		totalCostMs += step->costMs;
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *jsResult = json_value_init_object();
+		JSON_Object *jsResultObj = json_value_get_object(jsResult);
+
+		JSON_Value *jsOutSteps = json_value_init_array();
+		JSON_Array *jsOutStepsArray = json_value_get_array(jsOutSteps);
+
+		for (int i = 0; i < stepCount; i++)
+		{
+			FSMReplayStep *step = &(steps[i]);
+
+			JSON_Value *jsOut = json_value_init_object();
+			JSON_Object *jsOutObj = json_value_get_object(jsOut);
+
+			json_object_set_string(jsOutObj, "from",
+								   NodeStateToString(step->current));
+			json_object_set_string(jsOutObj, "to",
+								   NodeStateToString(step->assigned));
+			json_object_set_boolean(jsOutObj, "pg_is_running",
+									step->pgIsRunning);
+			json_object_set_string(jsOutObj, "action", step->action);
+			json_object_set_string(jsOutObj, "function", step->function);
+
+			if (step->recordedCost)
+			{
+				json_object_set_number(jsOutObj, "cost_ms", step->costMs);
+			}
+			else
+			{
+				json_object_set_null(jsOutObj, "cost_ms");
+			}
+
+			json_array_append_value(jsOutStepsArray, jsOut);
+		}
+
+		json_object_set_value(jsResultObj, "steps", jsOutSteps);
+		json_object_set_number(jsResultObj, "transitions", transitionCount);
+		json_object_set_number(jsResultObj, "cost_ms", totalCostMs);
+		json_object_set_string(jsResultObj, "state",
+							   NodeStateToString(keeperState->current_role));
+		json_object_set_boolean(jsResultObj, "success", success);
+
+		(void) cli_pprint_json(jsResult);
+	}
+	else
+	{
+		fformat(stdout, "%3s | %20s | %20s | %5s | %14s | %38s | %10s\n",
+				"#", "Current", "Assigned", "PG", "Action", "Function",
+				"Cost (ms)");
+		fformat(stdout, "%3s-+-%20s-+-%20s-+-%5s-+-%14s-+-%38s-+-%10s\n",
+				"---", "--------------------", "--------------------",
+				"-----", "--------------", "--------------------------------------",
+				"----------");
+
+		for (int i = 0; i < stepCount; i++)
+		{
+			FSMReplayStep *step = &(steps[i]);
+			char cost[BUFSIZE] = "-";
+
+			if (step->recordedCost)
+			{
+				sformat(cost, sizeof(cost), "%.3f", step->costMs);
+			}
+
+			fformat(stdout, "%3d | %20s | %20s | %5s | %14s | %38s | %10s\n",
+					i + 1,
+					NodeStateToString(step->current),
+					NodeStateToString(step->assigned),
+					step->pgIsRunning ? "up" : "down",
+					step->action,
+					step->function,
+					cost);
+		}
+
+		fformat(stdout, "\n%d steps, %d transitions, %.3f ms, "
+						"current state is now \"%s\"\n",
+				stepCount, transitionCount, totalCostMs,
+				NodeStateToString(keeperState->current_role));
+	}
+
+	free(steps);
+	json_value_free(js);
+	json_value_free(timings);
+
+	if (!success)
+	{
+		exit(EXIT_CODE_BAD_STATE);
+	}
+}
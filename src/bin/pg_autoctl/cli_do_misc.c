@@ -14,8 +14,11 @@
 #include <signal.h>
 
 #include "postgres_fe.h"
+#include "libpq-fe.h"
 #include "pqexpbuffer.h"
+#include "portability/instr_time.h"
 
+#include "alloc_stats.h"
 #include "cli_common.h"
 #include "cli_do_root.h"
 #include "cli_root.h"
@@ -29,6 +32,8 @@
 #include "keeper.h"
 #include "monitor.h"
 #include "monitor_config.h"
+#include "parsing.h"
+#include "parson.h"
 #include "pgctl.h"
 #include "pgtuning.h"
 #include "primary_standby.h"
@@ -384,7 +389,9 @@ keeper_cli_pgsetup_tune(int argc, char **argv)
 {
 	char config[BUFSIZE] = { 0 };
 
-	if (!pgtuning_prepare_guc_settings(postgres_tuning, config, BUFSIZE))
+	if (!pgtuning_prepare_guc_settings(postgres_tuning,
+									   keeperOptions.pgSetup.pgdata,
+									   config, BUFSIZE))
 	{
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
@@ -645,3 +652,644 @@ keeper_cli_identify_system(int argc, char **argv)
 				(uint32_t) entry->end);
 	}
 }
+
+
+/*
+ * fill_bench_nodes_array fills in the given nodes array with count nodes, as
+ * the monitor would return them: sorted by nodeId.
+ */
+static void
+fill_bench_nodes_array(NodeAddressArray *nodesArray, int count, int firstNodeId)
+{
+	nodesArray->count = count;
+
+	for (int index = 0; index < count; index++)
+	{
+		NodeAddress *node = &(nodesArray->nodes[index]);
+
+		node->nodeId = firstNodeId + index;
+		sformat(node->name, sizeof(node->name), "node_%" PRId64, node->nodeId);
+		sformat(node->host, sizeof(node->host), "10.0.0.%" PRId64, node->nodeId);
+		node->port = 5432;
+	}
+}
+
+
+/*
+ * cli_do_bench_nodes_diff measures the time it takes to compute the nodes
+ * that need an HBA update at each round of the keeper main loop, for groups
+ * of different sizes: the nodes arrays differ by a node that left, a node
+ * that joined, and a node that has a new hostname.
+ */
+void
+cli_do_bench_nodes_diff(int argc, char **argv)
+{
+	int iterations = 100000;
+	int sizes[] = { 1, NODE_ARRAY_MAX_COUNT / 2, NODE_ARRAY_MAX_COUNT };
+
+	if (argc > 1)
+	{
+		commandline_print_usage(&do_bench_nodes_diff, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (argc == 1 && (!stringToInt(argv[0], &iterations) || iterations <= 0))
+	{
+		log_fatal("Argument is not a valid number of iterations: \"%s\"",
+				  argv[0]);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	fformat(stdout, "%5s | %10s | %7s | %12s\n",
+			"nodes", "iterations", "changes", "ns per diff");
+	fformat(stdout, "%5s-+-%10s-+-%7s-+-%12s\n",
+			"-----", "----------", "-------", "------------");
+
+	for (int sizeIndex = 0; sizeIndex < lengthof(sizes); sizeIndex++)
+	{
+		int count = sizes[sizeIndex];
+		NodeAddressArray previousNodesArray = { 0 };
+		NodeAddressArray currentNodesArray = { 0 };
+		NodeAddressArray diffNodesArray = { 0 };
+		instr_time startTime;
+		instr_time duration;
+
+		/* the first node left, and a new node joined the group */
+		fill_bench_nodes_array(&previousNodesArray, count, 1);
+		fill_bench_nodes_array(&currentNodesArray, count, 2);
+
+		/* and the node in the middle has a new hostname */
+		NodeAddress *node = &(currentNodesArray.nodes[count / 2]);
+		sformat(node->host, sizeof(node->host), "10.0.1.%" PRId64, node->nodeId);
+
+		INSTR_TIME_SET_CURRENT(startTime);
+
+		for (int iteration = 0; iteration < iterations; iteration++)
+		{
+			(void) diff_nodesArray(&previousNodesArray,
+								   &currentNodesArray,
+								   &diffNodesArray);
+		}
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		fformat(stdout, "%5d | %10d | %7d | %12.1f\n",
+				count,
+				iterations,
+				diffNodesArray.count,
+				INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations);
+	}
+}
+
+
+/* count the allocations that parson does while parsing the nodes array */
+static uint64_t benchAllocations = 0;
+
+static void *
+bench_counting_malloc(size_t size)
+{
+	++benchAllocations;
+	return malloc(size);
+}
+
+
+/*
+ * cli_do_bench_nodes_parse measures the time it takes to parse a nodes array
+ * in JSON, as found in the nodes file or in the node_active_v2 result, and
+ * how many allocations that takes, for groups of different sizes. We compare
+ * parseNodesArray with the parson based implementation that it replaced.
+ */
+void
+cli_do_bench_nodes_parse(int argc, char **argv)
+{
+	int iterations = 10000;
+	int sizes[] = { 1, NODE_ARRAY_MAX_COUNT / 2, NODE_ARRAY_MAX_COUNT };
+
+	struct
+	{
+		const char *name;
+		bool (*parse)(const char *, NodeAddressArray *, int64_t);
+	}
+	parsers[] = {
+		{ "parson", parseNodesArrayWithParson },
+		{ "scanner", parseNodesArray }
+	};
+
+	if (argc > 1)
+	{
+		commandline_print_usage(&do_bench_nodes_parse, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (argc == 1 && (!stringToInt(argv[0], &iterations) || iterations <= 0))
+	{
+		log_fatal("Argument is not a valid number of iterations: \"%s\"",
+				  argv[0]);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	json_set_allocation_functions(bench_counting_malloc, free);
+
+	fformat(stdout, "%5s | %7s | %10s | %12s | %16s\n",
+			"nodes", "parser", "iterations", "ns per parse", "allocs per parse");
+	fformat(stdout, "%5s-+-%7s-+-%10s-+-%12s-+-%16s\n",
+			"-----", "-------", "----------", "------------", "----------------");
+
+	for (int sizeIndex = 0; sizeIndex < lengthof(sizes); sizeIndex++)
+	{
+		int count = sizes[sizeIndex];
+		PQExpBuffer json = createPQExpBuffer();
+
+		appendPQExpBufferStr(json, "[");
+
+		for (int index = 0; index < count; index++)
+		{
+			int nodeId = index + 1;
+
+			appendPQExpBuffer(json,
+							  "%s{\"node_id\": %d, "
+							  "\"node_name\": \"node_%d\", "
+							  "\"node_host\": \"10.0.0.%d\", "
+							  "\"node_port\": 5432, "
+							  "\"node_lsn\": \"0/3000148\", "
+							  "\"node_is_primary\": %s}",
+							  index == 0 ? "" : ", ",
+							  nodeId, nodeId, nodeId,
+							  index == 0 ? "true" : "false");
+		}
+
+		appendPQExpBufferStr(json, "]");
+
+		if (PQExpBufferBroken(json))
+		{
+			log_fatal("Failed to allocate memory");
+			destroyPQExpBuffer(json);
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		for (int p = 0; p < lengthof(parsers); p++)
+		{
+			NodeAddressArray nodesArray = { 0 };
+			instr_time startTime;
+			instr_time duration;
+
+			benchAllocations = 0;
+			INSTR_TIME_SET_CURRENT(startTime);
+
+			for (int iteration = 0; iteration < iterations; iteration++)
+			{
+				/* use a nodeId that is not in the array, keep all nodes */
+				if (!(parsers[p].parse)(json->data, &nodesArray, 0))
+				{
+					log_fatal("Failed to parse nodes array:\n%s", json->data);
+					destroyPQExpBuffer(json);
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+			}
+
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, startTime);
+
+			fformat(stdout, "%5d | %7s | %10d | %12.1f | %16.1f\n",
+					nodesArray.count,
+					parsers[p].name,
+					iterations,
+					INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations,
+					(double) benchAllocations / iterations);
+		}
+
+		destroyPQExpBuffer(json);
+	}
+
+	json_set_allocation_functions(malloc, free);
+}
+
+
+/*
+ * The keeper-loop benchmark uses a group of 3 nodes, where we are node 1, and
+ * the other nodes are sent again by the monitor every few rounds, as when the
+ * group membership changes.
+ */
+#define BENCH_KEEPER_LOOP_NODES 3
+#define BENCH_KEEPER_LOOP_NODES_EVERY 10
+
+static const char *benchMetadataColumns[] = {
+	"pg_is_in_recovery", "sync_state", "current_lsn",
+	"pg_control_version", "catalog_version_no", "system_identifier",
+	"timeline_id", "wal_receiver_status", "wal_receiver_staleness_ms",
+	"wal_receiver_end_lsn"
+};
+
+static const char *benchNodeActiveColumns[] = {
+	"assigned_node_id", "assigned_group_id", "assigned_group_state",
+	"assigned_candidate_priority", "assigned_replication_quorum",
+	"nodes_version", "other_nodes", "group_version", "report_interval"
+};
+
+
+/*
+ * bench_make_result returns a single row PGresult with the given columns and
+ * values, as libpq would build it from a server answer. A NULL value is a SQL
+ * NULL.
+ */
+static PGresult *
+bench_make_result(const char **columns, const char **values, int count)
+{
+	PGresAttDesc attributes[lengthof(benchMetadataColumns)] = { 0 };
+	PGresult *result = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+
+	if (result == NULL || count > lengthof(attributes))
+	{
+		log_fatal("Failed to allocate memory");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		attributes[i].name = (char *) columns[i];
+		attributes[i].typid = TEXTOID;
+		attributes[i].typlen = -1;
+		attributes[i].atttypmod = -1;
+	}
+
+	if (!PQsetResultAttrs(result, count, attributes))
+	{
+		log_fatal("Failed to allocate memory");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		int length = values[i] == NULL ? -1 : strlen(values[i]);
+
+		if (!PQsetvalue(result, 0, i, (char *) values[i], length))
+		{
+			log_fatal("Failed to allocate memory");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+	}
+
+	return result;
+}
+
+
+/*
+ * bench_keeper_loop_iteration does the work of a round of the keeper main
+ * loop in the SECONDARY state, where the monitor and the local Postgres are
+ * replaced by canned query results: we update our view of Postgres, call
+ * node_active, maintain the other nodes array, and write the state file when
+ * it changed.
+ */
+static bool
+bench_keeper_loop_iteration(Keeper *keeper, int iteration,
+							const char *otherNodesJSON,
+							const char *stateFilename)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresControlData *control = &(postgres->postgresSetup.control);
+	MonitorAssignedState assignedState = { 0 };
+	bool pg_is_in_recovery = false;
+
+	/* the LSN keeps moving, as on a standby replaying WAL */
+	char currentLSN[PG_LSN_MAXLENGTH] = { 0 };
+
+	sformat(currentLSN, sizeof(currentLSN), "0/%X", 0x3000000 + iteration * 64);
+
+	const char *metadataValues[] = {
+		"t", "", currentLSN, "1300", "202107181", "7010881429821629758", "1",
+		"streaming", "0", currentLSN
+	};
+
+	PGresult *result =
+		bench_make_result(benchMetadataColumns, metadataValues,
+						  lengthof(benchMetadataColumns));
+
+	bool parsed =
+		pgsql_parse_postgres_metadata(result,
+									  &pg_is_in_recovery,
+									  postgres->pgsrSyncState,
+									  postgres->currentLSN,
+									  control,
+									  &(postgres->walReceiver));
+	PQclear(result);
+
+	if (!parsed)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	postgres->pgIsRunning = true;
+
+	log_debug("Calling node_active for node %d/%d with current state: "
+			  "%s, PostgreSQL is running, current lsn is \"%s\".",
+			  keeperState->current_node_id,
+			  keeperState->current_group,
+			  NodeStateToString(keeperState->current_role),
+			  postgres->currentLSN);
+
+	/* the monitor sends the other nodes when the group membership changed */
+	bool sendNodes = iteration % BENCH_KEEPER_LOOP_NODES_EVERY == 0;
+	IntString nodesVersion =
+		intToString(1 + iteration / BENCH_KEEPER_LOOP_NODES_EVERY);
+
+	const char *nodeActiveValues[] = {
+		"1", "0", "secondary", "50", "t",
+		nodesVersion.strValue,
+		sendNodes ? otherNodesJSON : NULL,
+		nodesVersion.strValue,
+		"1000"
+	};
+
+	result = bench_make_result(benchNodeActiveColumns, nodeActiveValues,
+							   lengthof(benchNodeActiveColumns));
+
+	parsed = monitor_parse_node_active_result(result, &assignedState);
+	PQclear(result);
+
+	if (!parsed)
+	{
+		log_error("Failed to parse the node_active result");
+		return false;
+	}
+
+	keeperState->assigned_role = assignedState.state;
+	keeperState->current_nodes_version = assignedState.nodesVersion;
+	keeperState->last_monitor_contact = time(NULL);
+
+	if (assignedState.hasOtherNodes)
+	{
+		NodeAddressArray diffNodesArray = { 0 };
+
+		(void) diff_nodesArray(&(keeper->otherNodes),
+							   &(assignedState.otherNodes),
+							   &diffNodesArray);
+
+		keeper->otherNodes = assignedState.otherNodes;
+	}
+
+	return keeper_state_write_if_changed(keeperState, stateFilename);
+}
+
+
+/*
+ * bench_keeper_loop_read_budget reads the allocation budget of a keeper loop
+ * iteration from the given JSON file.
+ */
+static bool
+bench_keeper_loop_read_budget(const char *filename, AllocStats *budget)
+{
+	JSON_Value *json = json_parse_file(filename);
+	JSON_Object *jsObj = json_value_get_object(json);
+
+	if (jsObj == NULL ||
+		!json_object_has_value_of_type(jsObj, "allocations", JSONNumber) ||
+		!json_object_has_value_of_type(jsObj, "bytes", JSONNumber) ||
+		!json_object_has_value_of_type(jsObj, "retained_bytes", JSONNumber))
+	{
+		log_error("Failed to parse allocation budget file \"%s\", "
+				  "expected a JSON object with the numbers "
+				  "\"allocations\", \"bytes\", and \"retained_bytes\"",
+				  filename);
+		json_value_free(json);
+		return false;
+	}
+
+	budget->allocations = (uint64_t) json_object_get_number(jsObj, "allocations");
+	budget->allocatedBytes = (uint64_t) json_object_get_number(jsObj, "bytes");
+	budget->liveBytes = (int64_t) json_object_get_number(jsObj, "retained_bytes");
+
+	json_value_free(json);
+
+	return true;
+}
+
+
+/*
+ * cli_do_bench_keeper_loop runs iterations of the keeper main loop against a
+ * mock monitor and a mock local Postgres, and reports the allocations done in
+ * each iteration, the bytes still allocated at the end of the run, and the
+ * peak RSS of the process.
+ *
+ * Counting the allocations requires the pg_autoctl-alloc-stats binary, see
+ * the Makefile. When given a budget file, we exit with EXIT_CODE_INTERNAL_ERROR
+ * when an iteration allocates more than the budget, or when the run retains
+ * more memory than the budget, which is how leaks look like.
+ */
+void
+cli_do_bench_keeper_loop(int argc, char **argv)
+{
+	int iterations = 10000;
+	char *budgetFilename = NULL;
+	AllocStats budget = { 0 };
+	Keeper keeper = { 0 };
+	KeeperStateData *keeperState = &(keeper.state);
+
+	if (argc > 2)
+	{
+		commandline_print_usage(&do_bench_keeper_loop, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (argc >= 1 && (!stringToInt(argv[0], &iterations) || iterations <= 0))
+	{
+		log_fatal("Argument is not a valid number of iterations: \"%s\"",
+				  argv[0]);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (argc == 2)
+	{
+		budgetFilename = argv[1];
+
+		if (!alloc_stats_enabled())
+		{
+			log_fatal("Checking an allocation budget requires the "
+					  "pg_autoctl-alloc-stats binary, "
+					  "see make bench-keeper-loop");
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+
+		if (!bench_keeper_loop_read_budget(budgetFilename, &budget))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+
+	if (!alloc_stats_enabled())
+	{
+		log_warn("This pg_autoctl binary does not count its allocations, "
+				 "only the peak RSS is reported, "
+				 "see make bench-keeper-loop");
+	}
+
+	char stateDirectory[MAXPGPATH] = { 0 };
+	char stateFilename[MAXPGPATH] = { 0 };
+
+	sformat(stateDirectory, sizeof(stateDirectory),
+			"%s/pg_autoctl.bench.XXXXXX",
+			env_exists("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+	if (mkdtemp(stateDirectory) == NULL)
+	{
+		log_fatal("Failed to create a temporary directory \"%s\": %m",
+				  stateDirectory);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	join_path_components(stateFilename, stateDirectory, "pg_autoctl.state");
+
+	/* the other nodes of the group, as node_active_v2 sends them */
+	PQExpBuffer otherNodesJSON = createPQExpBuffer();
+
+	appendPQExpBufferStr(otherNodesJSON, "[");
+
+	for (int nodeId = 2; nodeId <= BENCH_KEEPER_LOOP_NODES; nodeId++)
+	{
+		appendPQExpBuffer(otherNodesJSON,
+						  "%s{\"node_id\": %d, "
+						  "\"node_name\": \"node_%d\", "
+						  "\"node_host\": \"10.0.0.%d\", "
+						  "\"node_port\": 5432, "
+						  "\"node_lsn\": \"0/3000148\", "
+						  "\"node_is_primary\": %s}",
+						  nodeId == 2 ? "" : ", ",
+						  nodeId, nodeId, nodeId,
+						  nodeId == 2 ? "true" : "false");
+	}
+
+	appendPQExpBufferStr(otherNodesJSON, "]");
+
+	if (PQExpBufferBroken(otherNodesJSON))
+	{
+		log_fatal("Failed to allocate memory");
+		destroyPQExpBuffer(otherNodesJSON);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	keeper_state_init(keeperState);
+	keeperState->current_node_id = 1;
+	keeperState->current_group = 0;
+	keeperState->current_role = SECONDARY_STATE;
+
+	/*
+	 * The first iteration allocates things that are kept for the life time of
+	 * the process, such as the stdio buffers, so it's not measured.
+	 */
+	bool success = bench_keeper_loop_iteration(&keeper, 0,
+											   otherNodesJSON->data,
+											   stateFilename);
+
+	AllocStats startStats = { 0 };
+	AllocStats maxStats = { 0 };
+	instr_time startTime;
+	instr_time duration;
+
+	alloc_stats_get(&startStats);
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int iteration = 1; success && iteration <= iterations; iteration++)
+	{
+		AllocStats before = { 0 };
+		AllocStats after = { 0 };
+		AllocStats diff = { 0 };
+
+		alloc_stats_get(&before);
+
+		success = bench_keeper_loop_iteration(&keeper, iteration,
+											  otherNodesJSON->data,
+											  stateFilename);
+
+		alloc_stats_get(&after);
+		alloc_stats_diff(&before, &after, &diff);
+
+		maxStats.allocations = Max(maxStats.allocations, diff.allocations);
+		maxStats.allocatedBytes =
+			Max(maxStats.allocatedBytes, diff.allocatedBytes);
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	AllocStats endStats = { 0 };
+	AllocStats runStats = { 0 };
+
+	alloc_stats_get(&endStats);
+	alloc_stats_diff(&startStats, &endStats, &runStats);
+
+	destroyPQExpBuffer(otherNodesJSON);
+	(void) unlink_file(stateFilename);
+	(void) rmdir(stateDirectory);
+
+	if (!success)
+	{
+		log_fatal("Failed to run the keeper loop benchmark, "
+				  "see above for details");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	fformat(stdout, "%-20s %12d\n", "iterations", iterations);
+	fformat(stdout, "%-20s %12.1f\n", "us per loop",
+			INSTR_TIME_GET_DOUBLE(duration) * 1e6 / iterations);
+
+	if (alloc_stats_enabled())
+	{
+		fformat(stdout, "%-20s %12.1f\n", "allocs per loop",
+				(double) runStats.allocations / iterations);
+		fformat(stdout, "%-20s %12" PRIu64 "\n", "max allocs per loop",
+				maxStats.allocations);
+		fformat(stdout, "%-20s %12.1f\n", "bytes per loop",
+				(double) runStats.allocatedBytes / iterations);
+		fformat(stdout, "%-20s %12" PRIu64 "\n", "max bytes per loop",
+				maxStats.allocatedBytes);
+		fformat(stdout, "%-20s %12" PRId64 "\n", "retained bytes",
+				runStats.liveBytes);
+	}
+
+	fformat(stdout, "%-20s %12ld\n", "peak RSS kB", alloc_stats_peak_rss_kb());
+
+	if (budgetFilename == NULL)
+	{
+		return;
+	}
+
+	bool withinBudget = true;
+
+	if (maxStats.allocations > budget.allocations)
+	{
+		log_error("A keeper loop iteration did %" PRIu64 " allocations, "
+				  "more than the budget of %" PRIu64 " found in \"%s\"",
+				  maxStats.allocations, budget.allocations, budgetFilename);
+		withinBudget = false;
+	}
+
+	if (maxStats.allocatedBytes > budget.allocatedBytes)
+	{
+		log_error("A keeper loop iteration allocated %" PRIu64 " bytes, "
+				  "more than the budget of %" PRIu64 " found in \"%s\"",
+				  maxStats.allocatedBytes, budget.allocatedBytes,
+				  budgetFilename);
+		withinBudget = false;
+	}
+
+	if (runStats.liveBytes > budget.liveBytes)
+	{
+		log_error("The keeper loop retained %" PRId64 " bytes "
+				  "after %d iterations, "
+				  "more than the budget of %" PRId64 " found in \"%s\"",
+				  runStats.liveBytes, iterations, budget.liveBytes,
+				  budgetFilename);
+		withinBudget = false;
+	}
+
+	if (!withinBudget)
+	{
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	log_info("The keeper loop is within the allocation budget of \"%s\"",
+			 budgetFilename);
+}
@@ -14,6 +14,9 @@
  * those commands you need both a running monitor instance and a valid
  * configuration for a local keeper.
  *
+ * The exception is `pg_autoctl do monitor bench`, which only needs a monitor
+ * and simulates as many keepers as asked.
+ *
  * Copyright (c) Microsoft Corporation. All rights reserved.
  * Licensed under the PostgreSQL License.
  *
@@ -24,36 +27,69 @@
 
 #include "parson.h"
 #include "postgres_fe.h"
+#include "portability/instr_time.h"
 
 #include "cli_common.h"
 #include "commandline.h"
 #include "defaults.h"
+#include "env_utils.h"
 #include "keeper_config.h"
 #include "keeper.h"
 #include "monitor.h"
+#include "monitor_bench.h"
 #include "nodestate_utils.h"
 #include "parsing.h"
 #include "pgctl.h"
 #include "pgsetup.h"
 #include "pgsql.h"
+#include "signals.h"
 #include "state.h"
+#include "string_utils.h"
 
+static int cli_do_monitor_get_primary_getopts(int argc, char **argv);
 static void cli_do_monitor_get_primary_node(int argc, char **argv);
+static void cli_do_monitor_watch_primary_node(Monitor *monitor,
+											  KeeperConfig *config);
+static void cli_do_monitor_print_primary_node(KeeperConfig *config,
+											  NodeAddress *primaryNode,
+											  bool oneLine);
 static void cli_do_monitor_get_other_nodes(int argc, char **argv);
 static void cli_do_monitor_get_candidate_count(int argc, char **argv);
 static void cli_do_monitor_get_coordinator(int argc, char **argv);
 static void cli_do_monitor_register_node(int argc, char **argv);
 static void cli_do_monitor_node_active(int argc, char **argv);
 static void cli_do_monitor_version(int argc, char **argv);
+static int cli_do_monitor_upgrade_getopts(int argc, char **argv);
+static void cli_do_monitor_upgrade(int argc, char **argv);
+static int cli_do_monitor_parse_notification_getopts(int argc, char **argv);
 static void cli_do_monitor_parse_notification(int argc, char **argv);
+static void cli_do_monitor_parse_notification_loop(const char *message,
+												   int iterations);
+static void cli_do_monitor_parse_notification_compare(const char *message);
+static int cli_do_monitor_parse_nodes_getopts(int argc, char **argv);
+static void cli_do_monitor_parse_nodes(int argc, char **argv);
+static bool cli_do_monitor_bench_parse_int(const char *option,
+										   const char *value,
+										   int minValue, int *number);
+static int cli_do_monitor_bench_getopts(int argc, char **argv);
+static void cli_do_monitor_bench(int argc, char **argv);
+
+MonitorBenchOptions monitorBenchOptions = { 0 };
+
+static bool monitorGetPrimaryWatch = false;
+static bool monitorUpgradeDryRun = false;
+static int monitorParseNotificationLoop = 0;
+static bool monitorParseNotificationCompare = false;
+static int monitorParseNodesNodeId = 0;
 
 
 static CommandLine monitor_get_primary_command =
 	make_command("primary",
 				 "Get the primary node from pg_auto_failover in given formation/group",
-				 CLI_PGDATA_USAGE,
-				 CLI_PGDATA_OPTION,
-				 cli_getopt_pgdata,
+				 CLI_PGDATA_USAGE "[ --watch ]",
+				 CLI_PGDATA_OPTION
+				 "  --watch       print the primary node again each time it changes\n",
+				 cli_do_monitor_get_primary_getopts,
 				 cli_do_monitor_get_primary_node);
 
 static CommandLine monitor_get_other_nodes_command =
@@ -119,20 +155,64 @@ static CommandLine monitor_version_command =
 				 cli_getopt_pgdata,
 				 cli_do_monitor_version);
 
+static CommandLine monitor_upgrade_command =
+	make_command("upgrade",
+				 "Update the monitor extension to version "
+				 PG_AUTOCTL_EXTENSION_VERSION
+				 ", reporting the expected lock time",
+				 CLI_PGDATA_USAGE "[ --dry-run ]",
+				 CLI_PGDATA_OPTION
+				 "  --dry-run     only report the expected lock time\n",
+				 cli_do_monitor_upgrade_getopts,
+				 cli_do_monitor_upgrade);
+
 static CommandLine monitor_parse_notification_command =
 	make_command("parse-notification",
 				 "parse a raw notification message",
-				 " <notification> ",
-				 "",
-				 NULL,
+				 " [ --loop <count> | --compare ] <notification> ",
+				 "  --loop        time <count> parses with each parser\n"
+				 "  --compare     print the result of each parser\n",
+				 cli_do_monitor_parse_notification_getopts,
 				 cli_do_monitor_parse_notification);
 
+static CommandLine monitor_parse_nodes_command =
+	make_command("parse-nodes",
+				 "parse a nodes array with each parser",
+				 " [ --node-id <id> ] <nodes array> ",
+				 "  --node-id     skip this node, as the keeper skips itself\n",
+				 cli_do_monitor_parse_nodes_getopts,
+				 cli_do_monitor_parse_nodes);
+
+static CommandLine monitor_bench_command =
+	make_command("bench",
+				 "Simulate keepers to measure the monitor throughput",
+				 "[option ...]",
+				 "  --monitor    Postgres URI of the pg_auto_failover monitor\n"
+				 "  --formation  Prefix of the benchmark formations (bench)\n"
+				 "  --hostname   Hostname of the synthetic nodes (127.0.0.1)\n"
+				 "  --pgport     First port of the synthetic nodes (40000)\n"
+				 "  --nodes      How many synthetic nodes to register (100)\n"
+				 "  --groups     How many groups to spread the nodes into (50)\n"
+				 "  --clients    How many client processes to use (10)\n"
+				 "  --listeners  How many LISTEN sessions (one per group)\n"
+				 "  --duration   Duration of the benchmark, in seconds (60)\n"
+				 "  --interval   Milliseconds between node_active calls (1000)\n"
+				 "  --flap-rate  Health flaps per node per hour (6)\n"
+				 "  --lsn-rate   WAL bytes per second per group (1048576)\n"
+				 "  --persistent Keep monitor connections open between calls\n"
+				 "  --output     JSON file where to write the results (stdout)\n",
+				 cli_do_monitor_bench_getopts,
+				 cli_do_monitor_bench);
+
 static CommandLine *monitor_subcommands[] = {
 	&monitor_get_command,
 	&monitor_register_command,
 	&monitor_node_active_command,
 	&monitor_version_command,
+	&monitor_upgrade_command,
 	&monitor_parse_notification_command,
+	&monitor_parse_nodes_command,
+	&monitor_bench_command,
 	NULL
 };
 
@@ -142,6 +222,136 @@ CommandLine do_monitor_commands =
 					 NULL, monitor_subcommands);
 
 
+/*
+ * cli_do_monitor_get_primary_getopts parses the command line options for
+ * the pg_autoctl do monitor get primary command.
+ */
+static int
+cli_do_monitor_get_primary_getopts(int argc, char **argv)
+{
+	KeeperConfig options = { 0 };
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+	bool printVersion = false;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "watch", no_argument, NULL, 'w' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* see cli_getopt_pgdata about POSIXLY_CORRECT */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "D:wJVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgSetup.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgSetup.pgdata);
+				break;
+			}
+
+			case 'w':
+			{
+				monitorGetPrimaryWatch = true;
+				log_trace("--watch");
+				break;
+			}
+
+			case 'J':
+			{
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				printVersion = true;
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (printVersion)
+	{
+		keeper_cli_print_version(argc, argv);
+	}
+
+	/* now that we have the command line parameters, prepare the options */
+	(void) prepare_keeper_options(&options);
+
+	/* publish our option parsing in the global variable */
+	keeperOptions = options;
+
+	return optind;
+}
+
+
 /*
  * cli_do_monitor_get_primary_node contacts the pg_auto_failover monitor and
  * retrieves the primary node information for given formation and group.
@@ -173,6 +383,12 @@ cli_do_monitor_get_primary_node(int argc, char **argv)
 		exit(EXIT_CODE_BAD_CONFIG);
 	}
 
+	if (monitorGetPrimaryWatch)
+	{
+		(void) cli_do_monitor_watch_primary_node(&monitor, &config);
+		return;
+	}
+
 	if (!monitor_get_primary(&monitor,
 							 config.formation,
 							 config.groupId,
@@ -183,28 +399,102 @@ cli_do_monitor_get_primary_node(int argc, char **argv)
 		exit(EXIT_CODE_MONITOR);
 	}
 
-	/* output something easy to parse by another program */
+	(void) cli_do_monitor_print_primary_node(&config, &primaryNode, false);
+}
+
+
+/*
+ * cli_do_monitor_watch_primary_node prints the primary node of our group,
+ * and then again each time it changes, until asked to stop. Between changes
+ * we only LISTEN to the monitor notifications, so that service discovery
+ * layers can use this command without polling the monitor.
+ */
+static void
+cli_do_monitor_watch_primary_node(Monitor *monitor, KeeperConfig *config)
+{
+	MonitorPrimaryCache cache = { 0 };
+	bool exitOnQuit = true;
+
+	/* Establish a handler for signals, to stop on Control-C */
+	(void) set_signal_handlers(exitOnQuit);
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		NodeAddress primaryNode = { 0 };
+		bool primaryHasChanged = false;
+
+		if (!monitor_get_primary_cached(monitor,
+										config->formation,
+										config->groupId,
+										&cache,
+										PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT
+										* 1000,
+										&primaryNode,
+										&primaryHasChanged))
+		{
+			/* the group has no writable node during a failover */
+			log_warn("Failed to get the primary node from the monitor, "
+					 "retrying in %ds", PG_AUTOCTL_MONITOR_RETRY_TIME);
+			sleep(PG_AUTOCTL_MONITOR_RETRY_TIME);
+			continue;
+		}
+
+		if (primaryHasChanged)
+		{
+			(void) cli_do_monitor_print_primary_node(config, &primaryNode, true);
+		}
+	}
+
+	pgsql_finish(&(monitor->notificationClient));
+}
+
+
+/*
+ * cli_do_monitor_print_primary_node prints the given primary node in a way
+ * that is easy to parse by another program. When oneLine is true the JSON
+ * output is not pretty printed, so that each change is a single line.
+ */
+static void
+cli_do_monitor_print_primary_node(KeeperConfig *config,
+								  NodeAddress *primaryNode,
+								  bool oneLine)
+{
 	if (outputJSON)
 	{
 		JSON_Value *js = json_value_init_object();
 		JSON_Object *root = json_value_get_object(js);
 
-		json_object_set_string(root, "formation", config.formation);
-		json_object_set_number(root, "groupId", (double) config.groupId);
-		json_object_set_number(root, "nodeId", (double) primaryNode.nodeId);
-		json_object_set_string(root, "name", primaryNode.name);
-		json_object_set_string(root, "host", primaryNode.host);
-		json_object_set_number(root, "port", (double) primaryNode.port);
+		json_object_set_string(root, "formation", config->formation);
+		json_object_set_number(root, "groupId", (double) config->groupId);
+		json_object_set_number(root, "nodeId", (double) primaryNode->nodeId);
+		json_object_set_string(root, "name", primaryNode->name);
+		json_object_set_string(root, "host", primaryNode->host);
+		json_object_set_number(root, "port", (double) primaryNode->port);
 
-		(void) cli_pprint_json(js);
+		if (oneLine)
+		{
+			char *serialized_string = json_serialize_to_string(js);
+
+			fformat(stdout, "%s\n", serialized_string);
+
+			json_free_serialized_string(serialized_string);
+			json_value_free(js);
+		}
+		else
+		{
+			(void) cli_pprint_json(js);
+		}
 	}
 	else
 	{
 		fformat(stdout,
 				"%s/%d %s:%d\n",
-				config.formation, config.groupId,
-				primaryNode.host, primaryNode.port);
+				config->formation, config->groupId,
+				primaryNode->host, primaryNode->port);
 	}
+
+	/* when watching, the reader wants each change as soon as it happens */
+	fflush(stdout);
 }
 
 
@@ -658,6 +948,330 @@ cli_do_monitor_version(int argc, char **argv)
 }
 
 
+/*
+ * cli_do_monitor_upgrade_getopts parses the command line options for the
+ * pg_autoctl do monitor upgrade command.
+ */
+static int
+cli_do_monitor_upgrade_getopts(int argc, char **argv)
+{
+	KeeperConfig options = { 0 };
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+	bool printVersion = false;
+
+	static struct option long_options[] = {
+		{ "pgdata", required_argument, NULL, 'D' },
+		{ "dry-run", no_argument, NULL, 'n' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* see cli_getopt_pgdata about POSIXLY_CORRECT */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "D:nJVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+			{
+				strlcpy(options.pgSetup.pgdata, optarg, MAXPGPATH);
+				log_trace("--pgdata %s", options.pgSetup.pgdata);
+				break;
+			}
+
+			case 'n':
+			{
+				monitorUpgradeDryRun = true;
+				log_trace("--dry-run");
+				break;
+			}
+
+			case 'J':
+			{
+				outputJSON = true;
+				log_trace("--json");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				printVersion = true;
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (printVersion)
+	{
+		keeper_cli_print_version(argc, argv);
+	}
+
+	/* now that we have the command line parameters, prepare the options */
+	(void) prepare_keeper_options(&options);
+
+	/* publish our option parsing in the global variable */
+	keeperOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_do_monitor_upgrade updates the monitor extension to the version that
+ * this pg_autoctl expects, as pg_autoctl do monitor version does, and first
+ * reports how long the update is expected to keep the monitor tables
+ * locked. With --dry-run, the command only reports the estimate.
+ */
+static void
+cli_do_monitor_upgrade(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+	MonitorExtensionVersion version = { 0 };
+	MonitorExtensionUpdateEstimate estimate = { 0 };
+	LocalPostgresServer postgres = { 0 };
+
+	if (!monitor_init_from_pgsetup(&monitor, &config.pgSetup))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (!monitor_get_extension_version(&monitor, &version))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (!monitor_estimate_extension_update(&monitor,
+										   version.installedVersion,
+										   PG_AUTOCTL_EXTENSION_VERSION,
+										   &estimate))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *root = json_value_get_object(js);
+
+		json_object_set_string(root, "installedVersion",
+							   estimate.installedVersion);
+		json_object_set_string(root, "targetVersion", estimate.targetVersion);
+		json_object_set_string(root, "updatePath", estimate.updatePath);
+		json_object_set_string(root, "copiedTables", estimate.copiedTables);
+		json_object_set_number(root, "copiedBytes",
+							   (double) estimate.copiedBytes);
+		json_object_set_number(root, "expectedLockTimeMs",
+							   (double) estimate.expectedLockTimeMs);
+		json_object_set_boolean(root, "dryRun", monitorUpgradeDryRun);
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stdout, "%18s: %s\n", "Installed version",
+				estimate.installedVersion);
+		fformat(stdout, "%18s: %s\n", "Target version",
+				estimate.targetVersion);
+		fformat(stdout, "%18s: %s\n", "Update path",
+				IS_EMPTY_STRING_BUFFER(estimate.updatePath)
+				? "none" : estimate.updatePath);
+		fformat(stdout, "%18s: %s\n", "Copied tables",
+				IS_EMPTY_STRING_BUFFER(estimate.copiedTables)
+				? "none" : estimate.copiedTables);
+		fformat(stdout, "%18s: %" PRId64 "ms\n", "Expected lock time",
+				estimate.expectedLockTimeMs);
+	}
+
+	if (monitorUpgradeDryRun ||
+		strcmp(estimate.installedVersion, estimate.targetVersion) == 0)
+	{
+		return;
+	}
+
+	(void) local_postgres_init(&postgres, &(monitor.config.pgSetup));
+
+	if (!monitor_ensure_extension_version(&monitor, &postgres, &version))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+}
+
+/*
+ * cli_do_monitor_parse_notification_getopts parses the command line options
+ * for the pg_autoctl do monitor parse-notification command.
+ */
+static int
+cli_do_monitor_parse_notification_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "loop", required_argument, NULL, 'l' },
+		{ "compare", no_argument, NULL, 'c' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* see cli_getopt_pgdata about POSIXLY_CORRECT */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "l:cvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'l':
+			{
+				if (!cli_do_monitor_bench_parse_int("loop", optarg, 1,
+													&monitorParseNotificationLoop))
+				{
+					++errors;
+				}
+				break;
+			}
+
+			case 'c':
+			{
+				monitorParseNotificationCompare = true;
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (monitorParseNotificationLoop > 0 && monitorParseNotificationCompare)
+	{
+		log_error("Please use either --loop or --compare");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	return optind;
+}
+
+
 /*
  * cli_do_monitor_parse_notification parses a raw notification message as given
  * by the monitor LISTEN/NOTIFY protocol on the state channel, such as:
@@ -682,6 +1296,21 @@ cli_do_monitor_parse_notification(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
+	if (monitorParseNotificationLoop > 0)
+	{
+		(void) cli_do_monitor_parse_notification_loop(argv[0],
+													  monitorParseNotificationLoop);
+		json_value_free(js);
+		return;
+	}
+
+	if (monitorParseNotificationCompare)
+	{
+		(void) cli_do_monitor_parse_notification_compare(argv[0]);
+		json_value_free(js);
+		return;
+	}
+
 	/* errors are logged by parse_state_notification_message */
 	if (!parse_state_notification_message(&nodeState, argv[0]))
 	{
@@ -703,3 +1332,729 @@ cli_do_monitor_parse_notification(int argc, char **argv)
 
 	(void) cli_pprint_json(js);
 }
+
+
+/* count the allocations that parson does while parsing a notification */
+static uint64_t parseNotificationAllocations = 0;
+
+static void *
+parse_notification_counting_malloc(size_t size)
+{
+	++parseNotificationAllocations;
+	return malloc(size);
+}
+
+
+/*
+ * cli_do_monitor_parse_notification_loop measures the time it takes to parse
+ * the given notification message, and how many allocations that takes, with
+ * the fixed schema parser and with the parson one that it falls back to.
+ */
+static void
+cli_do_monitor_parse_notification_loop(const char *message, int iterations)
+{
+	struct
+	{
+		const char *name;
+		bool (*parse)(CurrentNodeState *, const char *);
+	}
+	parsers[] = {
+		{ "parson", parse_state_notification_json },
+		{ "fixed", parse_state_notification_fixed }
+	};
+
+	json_set_allocation_functions(parse_notification_counting_malloc, free);
+
+	fformat(stdout, "%7s | %10s | %12s | %16s\n",
+			"parser", "iterations", "ns per parse", "allocs per parse");
+	fformat(stdout, "%7s-+-%10s-+-%12s-+-%16s\n",
+			"-------", "----------", "------------", "----------------");
+
+	for (int p = 0; p < lengthof(parsers); p++)
+	{
+		CurrentNodeState nodeState = { 0 };
+		instr_time startTime;
+		instr_time duration;
+
+		/* the fixed schema parser doesn't log why it failed */
+		if (!(parsers[p].parse)(&nodeState, message))
+		{
+			log_error("Failed to parse notification message with the %s "
+					  "parser: \"%s\"",
+					  parsers[p].name, message);
+			continue;
+		}
+
+		parseNotificationAllocations = 0;
+		INSTR_TIME_SET_CURRENT(startTime);
+
+		for (int iteration = 0; iteration < iterations; iteration++)
+		{
+			(void) (parsers[p].parse)(&nodeState, message);
+		}
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, startTime);
+
+		fformat(stdout, "%7s | %10d | %12.1f | %16.1f\n",
+				parsers[p].name,
+				iterations,
+				INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations,
+				(double) parseNotificationAllocations / iterations);
+	}
+
+	json_set_allocation_functions(malloc, free);
+}
+
+
+/*
+ * cli_do_monitor_parse_notification_compare parses the given notification
+ * message with the fixed schema parser and with the parson one, and prints
+ * both results, and which parser parse_state_notification_message uses, so
+ * that tests can compare them:
+ *
+ *   {
+ *     "fixed": { "valid": true, "state": { ... } },
+ *     "parson": { "valid": true, "state": { ... } },
+ *     "parser": "fixed"
+ *   }
+ */
+static void
+cli_do_monitor_parse_notification_compare(const char *message)
+{
+	struct
+	{
+		const char *name;
+		bool (*parse)(CurrentNodeState *, const char *);
+	}
+	parsers[] = {
+		{ "fixed", parse_state_notification_fixed },
+		{ "parson", parse_state_notification_json }
+	};
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	const char *parser = NULL;
+
+	for (int p = 0; p < lengthof(parsers); p++)
+	{
+		CurrentNodeState nodeState = { 0 };
+
+		JSON_Value *jsParser = json_value_init_object();
+		JSON_Object *jsParserObj = json_value_get_object(jsParser);
+
+		/* the parson parser logs why it failed, the fixed one doesn't */
+		bool valid = (parsers[p].parse)(&nodeState, message);
+
+		json_object_set_boolean(jsParserObj, "valid", valid);
+
+		if (valid)
+		{
+			JSON_Value *jsState = json_value_init_object();
+			JSON_Object *jsStateObj = json_value_get_object(jsState);
+
+			json_object_set_string(jsStateObj, "formation",
+								   nodeState.formation);
+			json_object_set_number(jsStateObj, "groupId",
+								   (double) nodeState.groupId);
+			json_object_set_number(jsStateObj, "nodeId",
+								   (double) nodeState.node.nodeId);
+			json_object_set_string(jsStateObj, "name", nodeState.node.name);
+			json_object_set_string(jsStateObj, "host", nodeState.node.host);
+			json_object_set_number(jsStateObj, "port",
+								   (double) nodeState.node.port);
+			json_object_set_string(jsStateObj, "reportedState",
+								   NodeStateToString(nodeState.reportedState));
+			json_object_set_string(jsStateObj, "goalState",
+								   NodeStateToString(nodeState.goalState));
+			json_object_set_number(jsStateObj, "health",
+								   (double) nodeState.health);
+
+			if (nodeState.hasSynchronousStandbyNames)
+			{
+				json_object_set_string(jsStateObj, "synchronousStandbyNames",
+									   nodeState.synchronousStandbyNames);
+			}
+
+			json_object_set_value(jsParserObj, "state", jsState);
+
+			/* parse_state_notification_message uses the first that works */
+			if (parser == NULL)
+			{
+				parser = parsers[p].name;
+			}
+		}
+
+		json_object_set_value(root, parsers[p].name, jsParser);
+	}
+
+	if (parser == NULL)
+	{
+		json_object_set_null(root, "parser");
+	}
+	else
+	{
+		json_object_set_string(root, "parser", parser);
+	}
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * cli_do_monitor_parse_nodes_getopts parses the command line options for the
+ * pg_autoctl do monitor parse-nodes command.
+ */
+static int
+cli_do_monitor_parse_nodes_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "node-id", required_argument, NULL, 'n' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* see cli_getopt_pgdata about POSIXLY_CORRECT */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "n:vqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+			{
+				if (!cli_do_monitor_bench_parse_int("node-id", optarg, 0,
+													&monitorParseNodesNodeId))
+				{
+					++errors;
+				}
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	return optind;
+}
+
+
+/*
+ * cli_do_monitor_parse_nodes parses a nodes array, as found in the nodes file
+ * or in the node_active_v2 result, with parseNodesArray and with the parson
+ * based implementation that it replaced, and prints both results, so that
+ * tests can compare them:
+ *
+ *   {
+ *     "scanner": { "valid": true, "nodes": [ ... ] },
+ *     "parson": { "valid": true, "nodes": [ ... ] }
+ *   }
+ */
+static void
+cli_do_monitor_parse_nodes(int argc, char **argv)
+{
+	struct
+	{
+		const char *name;
+		bool (*parse)(const char *, NodeAddressArray *, int64_t);
+	}
+	parsers[] = {
+		{ "scanner", parseNodesArray },
+		{ "parson", parseNodesArrayWithParson }
+	};
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	if (argc != 1)
+	{
+		commandline_print_usage(&monitor_parse_nodes_command, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	for (int p = 0; p < lengthof(parsers); p++)
+	{
+		NodeAddressArray nodesArray = { 0 };
+
+		JSON_Value *jsParser = json_value_init_object();
+		JSON_Object *jsParserObj = json_value_get_object(jsParser);
+
+		/* errors are logged by the parsers */
+		bool valid = (parsers[p].parse)(argv[0], &nodesArray,
+										(int64_t) monitorParseNodesNodeId);
+
+		json_object_set_boolean(jsParserObj, "valid", valid);
+
+		if (valid)
+		{
+			JSON_Value *jsNodes = json_value_init_array();
+			JSON_Array *jsNodesArray = json_value_get_array(jsNodes);
+
+			for (int i = 0; i < nodesArray.count; i++)
+			{
+				NodeAddress *node = &(nodesArray.nodes[i]);
+
+				JSON_Value *jsNode = json_value_init_object();
+				JSON_Object *jsNodeObj = json_value_get_object(jsNode);
+
+				json_object_set_number(jsNodeObj, "node_id",
+									   (double) node->nodeId);
+				json_object_set_string(jsNodeObj, "node_name", node->name);
+				json_object_set_string(jsNodeObj, "node_host", node->host);
+				json_object_set_number(jsNodeObj, "node_port",
+									   (double) node->port);
+				json_object_set_string(jsNodeObj, "node_lsn", node->lsn);
+				json_object_set_boolean(jsNodeObj, "node_is_primary",
+										node->isPrimary);
+
+				json_array_append_value(jsNodesArray, jsNode);
+			}
+
+			json_object_set_value(jsParserObj, "nodes", jsNodes);
+		}
+
+		json_object_set_value(root, parsers[p].name, jsParser);
+	}
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * cli_do_monitor_bench_parse_int parses an integer option value that must be
+ * at least minValue, and logs an error otherwise.
+ */
+static bool
+cli_do_monitor_bench_parse_int(const char *option, const char *value,
+							   int minValue, int *number)
+{
+	if (!stringToInt(value, number) || *number < minValue)
+	{
+		log_error("Failed to parse --%s \"%s\": expected a number "
+				  "greater than or equal to %d",
+				  option, value, minValue);
+		return false;
+	}
+
+	log_trace("--%s %d", option, *number);
+
+	return true;
+}
+
+
+/*
+ * cli_do_monitor_bench_getopts parses the command line options for the
+ * pg_autoctl do monitor bench command.
+ */
+static int
+cli_do_monitor_bench_getopts(int argc, char **argv)
+{
+	int c, option_index = 0, errors = 0;
+	int verboseCount = 0;
+	bool printVersion = false;
+
+	MonitorBenchOptions options = { 0 };
+
+	static struct option long_options[] = {
+		{ "monitor", required_argument, NULL, 'm' },
+		{ "formation", required_argument, NULL, 'f' },
+		{ "hostname", required_argument, NULL, 'n' },
+		{ "pgport", required_argument, NULL, 'p' },
+		{ "nodes", required_argument, NULL, 'N' },
+		{ "groups", required_argument, NULL, 'g' },
+		{ "clients", required_argument, NULL, 'c' },
+		{ "listeners", required_argument, NULL, 'l' },
+		{ "duration", required_argument, NULL, 't' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "flap-rate", required_argument, NULL, 'F' },
+		{ "lsn-rate", required_argument, NULL, 'L' },
+		{ "persistent", no_argument, NULL, 'P' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* set our defaults */
+	strlcpy(options.formationPrefix, "bench", sizeof(options.formationPrefix));
+	strlcpy(options.hostname, "127.0.0.1", sizeof(options.hostname));
+	options.basePort = MONITOR_BENCH_DEFAULT_BASE_PORT;
+	options.nodesCount = MONITOR_BENCH_DEFAULT_NODES;
+	options.groupsCount = MONITOR_BENCH_DEFAULT_GROUPS;
+	options.clientsCount = MONITOR_BENCH_DEFAULT_CLIENTS;
+	options.listenersCount = -1;
+	options.duration = MONITOR_BENCH_DEFAULT_DURATION;
+	options.intervalMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+	options.flapRate = MONITOR_BENCH_DEFAULT_FLAP_RATE;
+	options.lsnRate = MONITOR_BENCH_DEFAULT_LSN_RATE;
+
+	/* see cli_do_demoapp_getopts about POSIXLY_CORRECT */
+	unsetenv("POSIXLY_CORRECT");
+
+	while ((c = getopt_long(argc, argv, "Vvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'm':
+			{
+				/* { "monitor", required_argument, NULL, 'm' } */
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --monitor connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.monitor_pguri, optarg, MAXCONNINFO);
+				log_trace("--monitor %s", options.monitor_pguri);
+				break;
+			}
+
+			case 'f':
+			{
+				/* { "formation", required_argument, NULL, 'f' } */
+				strlcpy(options.formationPrefix, optarg, NAMEDATALEN);
+				log_trace("--formation %s", options.formationPrefix);
+				break;
+			}
+
+			case 'n':
+			{
+				/* { "hostname", required_argument, NULL, 'n' } */
+				strlcpy(options.hostname, optarg, _POSIX_HOST_NAME_MAX);
+				log_trace("--hostname %s", options.hostname);
+				break;
+			}
+
+			case 'p':
+			{
+				/* { "pgport", required_argument, NULL, 'p' } */
+				if (!cli_do_monitor_bench_parse_int("pgport", optarg, 1,
+													&options.basePort))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'N':
+			{
+				/* { "nodes", required_argument, NULL, 'N' } */
+				if (!cli_do_monitor_bench_parse_int("nodes", optarg, 1,
+													&options.nodesCount))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'g':
+			{
+				/* { "groups", required_argument, NULL, 'g' } */
+				if (!cli_do_monitor_bench_parse_int("groups", optarg, 1,
+													&options.groupsCount))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'c':
+			{
+				/* { "clients", required_argument, NULL, 'c' } */
+				if (!cli_do_monitor_bench_parse_int("clients", optarg, 1,
+													&options.clientsCount))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'l':
+			{
+				/* { "listeners", required_argument, NULL, 'l' } */
+				if (!cli_do_monitor_bench_parse_int("listeners", optarg, 0,
+													&options.listenersCount))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 't':
+			{
+				/* { "duration", required_argument, NULL, 't' } */
+				if (!cli_do_monitor_bench_parse_int("duration", optarg, 1,
+													&options.duration))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'i':
+			{
+				/* { "interval", required_argument, NULL, 'i' } */
+				if (!cli_do_monitor_bench_parse_int("interval", optarg, 1,
+													&options.intervalMs))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'F':
+			{
+				/* { "flap-rate", required_argument, NULL, 'F' } */
+				if (!cli_do_monitor_bench_parse_int("flap-rate", optarg, 0,
+													&options.flapRate))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'L':
+			{
+				/* { "lsn-rate", required_argument, NULL, 'L' } */
+				if (!cli_do_monitor_bench_parse_int("lsn-rate", optarg, 0,
+													&options.lsnRate))
+				{
+					errors++;
+				}
+				break;
+			}
+
+			case 'P':
+			{
+				/* { "persistent", no_argument, NULL, 'P' } */
+				options.persistent = true;
+				log_trace("--persistent");
+				break;
+			}
+
+			case 'o':
+			{
+				/* { "output", required_argument, NULL, 'o' } */
+				strlcpy(options.outputFilename, optarg, MAXPGPATH);
+				log_trace("--output %s", options.outputFilename);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				printVersion = true;
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			default:
+			{
+				/* getopt_long already wrote an error message */
+				errors++;
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.monitor_pguri) &&
+		!(env_exists(PG_AUTOCTL_MONITOR) &&
+		  get_env_copy(PG_AUTOCTL_MONITOR,
+					   options.monitor_pguri,
+					   sizeof(options.monitor_pguri))))
+	{
+		log_fatal("Please provide --monitor");
+		errors++;
+	}
+
+	/* all the nodes of a group are simulated by the same client */
+	if (options.clientsCount > options.groupsCount)
+	{
+		options.clientsCount = options.groupsCount;
+	}
+
+	if (options.listenersCount == -1)
+	{
+		options.listenersCount = options.groupsCount;
+	}
+
+	if (options.nodesCount < options.groupsCount)
+	{
+		log_error("Failed to simulate %d groups with only %d nodes",
+				  options.groupsCount, options.nodesCount);
+		errors++;
+	}
+
+	/* node_active_v2 returns the other nodes of a group in a fixed array */
+	if (options.nodesCount >
+		(int64_t) options.groupsCount * NODE_ARRAY_MAX_COUNT)
+	{
+		log_error("Failed to simulate %d nodes in %d groups: a group has "
+				  "at most %d nodes",
+				  options.nodesCount, options.groupsCount,
+				  NODE_ARRAY_MAX_COUNT);
+		errors++;
+	}
+
+	if (options.clientsCount > MONITOR_BENCH_MAX_CLIENTS)
+	{
+		log_error("Unsupported value for --clients: %d is more than %d",
+				  options.clientsCount, MONITOR_BENCH_MAX_CLIENTS);
+		errors++;
+	}
+
+	if (options.listenersCount > MONITOR_BENCH_MAX_LISTENERS)
+	{
+		log_error("Unsupported value for --listeners: %d is more than %d",
+				  options.listenersCount, MONITOR_BENCH_MAX_LISTENERS);
+		errors++;
+	}
+
+	if ((int64_t) options.basePort + options.nodesCount - 1 > 65535)
+	{
+		log_error("Failed to assign a port to %d nodes starting at --pgport %d",
+				  options.nodesCount, options.basePort);
+		errors++;
+	}
+
+	/* node names add "_<group>_<node>" to the prefix, both up to 65535 */
+	if (strlen(options.formationPrefix) + 12 >= NAMEDATALEN)
+	{
+		log_error("Formation prefix \"%s\" is too long",
+				  options.formationPrefix);
+		errors++;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (printVersion)
+	{
+		keeper_cli_print_version(argc, argv);
+	}
+
+	/* publish parsed options */
+	monitorBenchOptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_do_monitor_bench runs the monitor load generator, and exports the
+ * results as JSON.
+ */
+static void
+cli_do_monitor_bench(int argc, char **argv)
+{
+	if (!monitor_bench(&monitorBenchOptions))
+	{
+		log_fatal("Failed to run the monitor benchmark");
+		exit(EXIT_CODE_MONITOR);
+	}
+}
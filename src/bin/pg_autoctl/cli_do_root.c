@@ -232,6 +232,7 @@ CommandLine do_tmux_script =
 				 "  --node-priorities list of nodes priorities (50)\n"
 				 "  --sync-standbys   number-sync-standbys to set (0 or 1)\n"
 				 "  --skip-pg-hba     use --skip-pg-hba when creating nodes\n"
+				 "  --serialize       create standby nodes one at a time\n"
 				 "  --layout          tmux layout to use (even-vertical)\n"
 				 "  --binpath         path to the pg_autoctl binary (current binary path)",
 				 cli_do_tmux_script_getopts,
@@ -248,6 +249,7 @@ CommandLine do_tmux_session =
 				 "  --node-priorities list of nodes priorities (50)\n"
 				 "  --sync-standbys   number-sync-standbys to set (0 or 1)\n"
 				 "  --skip-pg-hba     use --skip-pg-hba when creating nodes\n"
+				 "  --serialize       create standby nodes one at a time\n"
 				 "  --layout          tmux layout to use (even-vertical)\n"
 				 "  --binpath         path to the pg_autoctl binary (current binary path)",
 				 cli_do_tmux_script_getopts,
@@ -494,6 +496,40 @@ CommandLine do_azure_commands =
 					 NULL, NULL, NULL, do_azure);
 
 
+CommandLine do_bench_nodes_diff =
+	make_command("nodes-diff",
+				 "Measure the diff of the group nodes done in the keeper loop",
+				 "[ iterations ]",
+				 NULL, NULL,
+				 cli_do_bench_nodes_diff);
+
+CommandLine do_bench_nodes_parse =
+	make_command("nodes-parse",
+				 "Measure the parsing of the group nodes done in the keeper loop",
+				 "[ iterations ]",
+				 NULL, NULL,
+				 cli_do_bench_nodes_parse);
+
+CommandLine do_bench_keeper_loop =
+	make_command("keeper-loop",
+				 "Measure the allocations done in the keeper loop",
+				 "[ iterations [ budget file ] ]",
+				 NULL, NULL,
+				 cli_do_bench_keeper_loop);
+
+CommandLine *do_bench[] = {
+	&do_bench_nodes_diff,
+	&do_bench_nodes_parse,
+	&do_bench_keeper_loop,
+	NULL
+};
+
+CommandLine do_bench_commands =
+	make_command_set("bench",
+					 "Run micro-benchmarks of pg_autoctl internals", NULL, NULL,
+					 NULL, do_bench);
+
+
 CommandLine *do_subcommands[] = {
 	&do_monitor_commands,
 	&do_fsm_commands,
@@ -506,6 +542,7 @@ CommandLine *do_subcommands[] = {
 	&do_tmux_commands,
 	&do_azure_commands,
 	&do_demo_commands,
+	&do_bench_commands,
 	NULL
 };
 
@@ -68,6 +68,11 @@ extern CommandLine do_discover;
 
 extern CommandLine do_tmux_commands;
 
+extern CommandLine do_bench_commands;
+extern CommandLine do_bench_nodes_diff;
+extern CommandLine do_bench_nodes_parse;
+extern CommandLine do_bench_keeper_loop;
+
 /* src/bin/pg_autoctl/cli_do_azure.c */
 extern CommandLine do_azure_ssh;
 
@@ -101,6 +106,10 @@ void keeper_cli_promote_standby(int argc, char **argv);
 void keeper_cli_receiwal(int argc, char **argv);
 void keeper_cli_identify_system(int argc, char **argv);
 
+void cli_do_bench_nodes_diff(int argc, char **argv);
+void cli_do_bench_nodes_parse(int argc, char **argv);
+void cli_do_bench_keeper_loop(int argc, char **argv);
+
 /* src/bin/pg_autoctl/cli_do_tmux.c */
 int cli_do_tmux_script_getopts(int argc, char **argv);
 void cli_do_tmux_script(int argc, char **argv);
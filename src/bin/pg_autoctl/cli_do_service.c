@@ -25,8 +25,12 @@
 #include "monitor_config.h"
 #include "pidfile.h"
 #include "service_keeper.h"
+#include "service_metrics.h"
+#include "service_monitor_proxy.h"
 #include "service_monitor.h"
+#include "service_node_probe.h"
 #include "service_postgres_ctl.h"
+#include "service_router.h"
 #include "signals.h"
 #include "supervisor.h"
 
@@ -39,14 +43,26 @@ static void cli_do_service_getpid(const char *serviceName);
 static void cli_do_service_getpid_postgres(int argc, char **argv);
 static void cli_do_service_getpid_listener(int argc, char **argv);
 static void cli_do_service_getpid_node_active(int argc, char **argv);
+static void cli_do_service_getpid_metrics(int argc, char **argv);
+static void cli_do_service_getpid_monitor_proxy(int argc, char **argv);
+static void cli_do_service_getpid_router(int argc, char **argv);
+static void cli_do_service_getpid_node_probe(int argc, char **argv);
 
 static void cli_do_service_restart(const char *serviceName);
 static void cli_do_service_restart_postgres(int argc, char **argv);
 static void cli_do_service_restart_listener(int argc, char **argv);
 static void cli_do_service_restart_node_active(int argc, char **argv);
+static void cli_do_service_restart_metrics(int argc, char **argv);
+static void cli_do_service_restart_monitor_proxy(int argc, char **argv);
+static void cli_do_service_restart_router(int argc, char **argv);
+static void cli_do_service_restart_node_probe(int argc, char **argv);
 
 static void cli_do_service_monitor_listener(int argc, char **argv);
 static void cli_do_service_node_active(int argc, char **argv);
+static void cli_do_service_metrics(int argc, char **argv);
+static void cli_do_service_monitor_proxy(int argc, char **argv);
+static void cli_do_service_router(int argc, char **argv);
+static void cli_do_service_node_probe(int argc, char **argv);
 
 CommandLine service_pgcontroller =
 	make_command("pgcontroller",
@@ -80,6 +96,38 @@ CommandLine service_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_node_active);
 
+CommandLine service_metrics =
+	make_command("metrics",
+				 "pg_autoctl service that serves Prometheus metrics",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_metrics);
+
+CommandLine service_monitor_proxy =
+	make_command("monitor-proxy",
+				 "pg_autoctl service that shares a monitor session with the CLI",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_monitor_proxy);
+
+CommandLine service_router =
+	make_command("router",
+				 "pg_autoctl service that forwards connections to the primary",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_router);
+
+CommandLine service_node_probe =
+	make_command("node-probe",
+				 "pg_autoctl service that samples the local node health",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_node_probe);
+
 CommandLine service_getpid_postgres =
 	make_command("postgres",
 				 "Get the pid of the pg_autoctl postgres controller service",
@@ -104,10 +152,46 @@ CommandLine service_getpid_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_getpid_node_active);
 
+CommandLine service_getpid_metrics =
+	make_command("metrics",
+				 "Get the pid of the pg_autoctl keeper metrics service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_metrics);
+
+CommandLine service_getpid_monitor_proxy =
+	make_command("monitor-proxy",
+				 "Get the pid of the pg_autoctl keeper monitor-proxy service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_monitor_proxy);
+
+CommandLine service_getpid_router =
+	make_command("router",
+				 "Get the pid of the pg_autoctl keeper router service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_router);
+
+CommandLine service_getpid_node_probe =
+	make_command("node-probe",
+				 "Get the pid of the pg_autoctl keeper node-probe service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_getpid_node_probe);
+
 static CommandLine *service_getpid[] = {
 	&service_getpid_postgres,
 	&service_getpid_listener,
 	&service_getpid_node_active,
+	&service_getpid_metrics,
+	&service_getpid_monitor_proxy,
+	&service_getpid_router,
+	&service_getpid_node_probe,
 	NULL
 };
 
@@ -141,10 +225,46 @@ CommandLine service_restart_node_active =
 				 cli_getopt_pgdata,
 				 cli_do_service_restart_node_active);
 
+CommandLine service_restart_metrics =
+	make_command("metrics",
+				 "Restart the pg_autoctl keeper metrics service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_metrics);
+
+CommandLine service_restart_monitor_proxy =
+	make_command("monitor-proxy",
+				 "Restart the pg_autoctl keeper monitor-proxy service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_monitor_proxy);
+
+CommandLine service_restart_router =
+	make_command("router",
+				 "Restart the pg_autoctl keeper router service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_router);
+
+CommandLine service_restart_node_probe =
+	make_command("node-probe",
+				 "Restart the pg_autoctl keeper node-probe service",
+				 CLI_PGDATA_USAGE,
+				 CLI_PGDATA_OPTION,
+				 cli_getopt_pgdata,
+				 cli_do_service_restart_node_probe);
+
 static CommandLine *service_restart[] = {
 	&service_restart_postgres,
 	&service_restart_listener,
 	&service_restart_node_active,
+	&service_restart_metrics,
+	&service_restart_monitor_proxy,
+	&service_restart_router,
+	&service_restart_node_probe,
 	NULL
 };
 
@@ -160,6 +280,10 @@ static CommandLine *service[] = {
 	&service_postgres,
 	&service_monitor_listener,
 	&service_node_active,
+	&service_metrics,
+	&service_monitor_proxy,
+	&service_router,
+	&service_node_probe,
 	NULL
 };
 
@@ -255,6 +379,46 @@ cli_do_service_getpid_node_active(int argc, char **argv)
 }
 
 
+/*
+ * cli_do_service_getpid_metrics gets the metrics service pid.
+ */
+static void
+cli_do_service_getpid_metrics(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_METRICS);
+}
+
+
+/*
+ * cli_do_service_getpid_monitor_proxy gets the monitor-proxy service pid.
+ */
+static void
+cli_do_service_getpid_monitor_proxy(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_MONITOR_PROXY);
+}
+
+
+/*
+ * cli_do_service_getpid_router gets the router service pid.
+ */
+static void
+cli_do_service_getpid_router(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_ROUTER);
+}
+
+
+/*
+ * cli_do_service_getpid_node_probe gets the node-probe service pid.
+ */
+static void
+cli_do_service_getpid_node_probe(int argc, char **argv)
+{
+	(void) cli_do_service_getpid(SERVICE_NAME_NODE_PROBE);
+}
+
+
 /*
  * cli_do_service_restart sends the TERM signal to the given serviceName, which
  * is known to have the restart policy RP_PERMANENT (that's hard-coded). As a
@@ -290,7 +454,12 @@ cli_do_service_restart(const char *serviceName)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
-	/* loop until we have a new pid */
+	/*
+	 * The supervisor restarts the service as soon as it has exited, so
+	 * first wait for that to happen, and then loop until we have a new pid.
+	 */
+	(void) wait_for_process_exit(pid, 30 * 1000);
+
 	do {
 		if (!supervisor_find_service_pid(pathnames.pid, serviceName, &newPid))
 		{
@@ -352,6 +521,56 @@ cli_do_service_restart_node_active(int argc, char **argv)
 }
 
 
+/*
+ * cli_do_service_restart_metrics sends the TERM signal to the keeper metrics
+ * service, which is known to have the restart policy RP_PERMANENT (that's
+ * hard-coded). As a consequence the supervisor will restart the service.
+ */
+static void
+cli_do_service_restart_metrics(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_METRICS);
+}
+
+
+/*
+ * cli_do_service_restart_monitor_proxy sends the TERM signal to the keeper
+ * monitor-proxy service, which is known to have the restart policy
+ * RP_PERMANENT (that's hard-coded). As a consequence the supervisor will
+ * restart the service.
+ */
+static void
+cli_do_service_restart_monitor_proxy(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_MONITOR_PROXY);
+}
+
+
+/*
+ * cli_do_service_restart_router sends the TERM signal to the keeper router
+ * service, which is known to have the restart policy RP_PERMANENT (that's
+ * hard-coded). As a consequence the supervisor will restart the service.
+ */
+static void
+cli_do_service_restart_router(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_ROUTER);
+}
+
+
+/*
+ * cli_do_service_restart_node_probe sends the TERM signal to the keeper
+ * node-probe service, which is known to have the restart policy RP_PERMANENT
+ * (that's hard-coded). As a consequence the supervisor will restart the
+ * service.
+ */
+static void
+cli_do_service_restart_node_probe(int argc, char **argv)
+{
+	(void) cli_do_service_restart(SERVICE_NAME_NODE_PROBE);
+}
+
+
 /*
  * cli_do_pgcontroller starts the process controller service within a supervision
  * tree. It is used for debug purposes only. When using this entry point we
@@ -424,6 +643,7 @@ cli_do_service_postgres(int argc, char **argv)
 
 	/* display a user-friendly process name */
 	(void) set_ps_title("pg_autoctl: start/stop postgres");
+	(void) log_set_context("service", SERVICE_NAME_POSTGRES);
 
 	/* create the service pidfile */
 	if (!create_service_pidfile(pathnames.pid, SERVICE_NAME_POSTGRES))
@@ -535,6 +755,7 @@ cli_do_service_monitor_listener(int argc, char **argv)
 
 	/* display a user-friendly process name */
 	(void) set_ps_title("pg_autoctl: monitor listener");
+	(void) log_set_context("service", SERVICE_NAME_MONITOR);
 
 	/* create the service pidfile */
 	if (!create_service_pidfile(monitor.config.pathnames.pid,
@@ -576,6 +797,7 @@ cli_do_service_node_active(int argc, char **argv)
 
 	/* display a user-friendly process name */
 	(void) set_ps_title("pg_autoctl: node active");
+	(void) log_set_context("service", SERVICE_NAME_KEEPER);
 
 	/* create the service pidfile */
 	if (!create_service_pidfile(keeper.config.pathnames.pid,
@@ -588,3 +810,192 @@ cli_do_service_node_active(int argc, char **argv)
 	/* Start the node_active() protocol client */
 	(void) keeper_node_active_loop(&keeper, ppid);
 }
+
+
+/*
+ * cli_do_service_metrics starts the metrics service.
+ */
+static void
+cli_do_service_metrics(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = true;
+
+	pid_t ppid = getppid();
+
+	bool exitOnQuit = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: metrics");
+	(void) log_set_context("service", SERVICE_NAME_METRICS);
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid, SERVICE_NAME_METRICS))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_metrics_loop(&config, ppid))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
+/*
+ * cli_do_service_monitor_proxy starts the monitor-proxy service.
+ */
+static void
+cli_do_service_monitor_proxy(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = false;
+
+	pid_t ppid = getppid();
+
+	bool exitOnQuit = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: monitor proxy");
+	(void) log_set_context("service", SERVICE_NAME_MONITOR_PROXY);
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid,
+								SERVICE_NAME_MONITOR_PROXY))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_monitor_proxy_loop(&config, ppid))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
+/*
+ * cli_do_service_router starts the router service.
+ */
+static void
+cli_do_service_router(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = false;
+
+	pid_t ppid = getppid();
+
+	bool exitOnQuit = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: router");
+	(void) log_set_context("service", SERVICE_NAME_ROUTER);
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid, SERVICE_NAME_ROUTER))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_router_loop(&config, ppid))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
+/*
+ * cli_do_service_node_probe starts the node-probe service.
+ */
+static void
+cli_do_service_node_probe(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = false;
+
+	pid_t ppid = getppid();
+
+	bool exitOnQuit = true;
+
+	/* Establish a handler for signals. */
+	(void) set_signal_handlers(exitOnQuit);
+
+	if (!keeper_config_read_file(&config,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_CONFIG);
+	}
+
+	/* display a user-friendly process name */
+	(void) set_ps_title("pg_autoctl: node probe");
+	(void) log_set_context("service", SERVICE_NAME_NODE_PROBE);
+
+	/* create the service pidfile */
+	if (!create_service_pidfile(config.pathnames.pid, SERVICE_NAME_NODE_PROBE))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!service_node_probe_loop(&config, ppid))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
@@ -20,6 +20,7 @@
 #include "commandline.h"
 #include "config.h"
 #include "defaults.h"
+#include "env_utils.h"
 #include "file_utils.h"
 #include "fsm.h"
 #include "ipaddr.h"
@@ -28,15 +29,19 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "pgctl.h"
+#include "pghba.h"
 #include "pgsetup.h"
 #include "primary_standby.h"
+#include "system_utils.h"
 
 
 static void cli_show_ipaddr(int argc, char **argv);
 static void cli_show_cidr(int argc, char **argv);
 static void cli_show_lookup(int argc, char **argv);
+static void cli_show_hba_hosts(int argc, char **argv);
 static void cli_show_hostname(int argc, char **argv);
 static void cli_show_reverse(int argc, char **argv);
+static void cli_show_system(int argc, char **argv);
 
 static CommandLine do_show_ipaddr_command =
 	make_command("ipaddr",
@@ -54,6 +59,12 @@ static CommandLine do_show_lookup_command =
 				 "<hostname>", "",
 				 NULL, cli_show_lookup);
 
+static CommandLine do_show_hba_hosts_command =
+	make_command("hba-hosts",
+				 "Print the HBA rules hosts for the given nodes with hba_compact",
+				 "<host> [ ... ]", "",
+				 NULL, cli_show_hba_hosts);
+
 static CommandLine do_show_hostname_command =
 	make_command("hostname",
 				 "Print this node's default hostname",
@@ -65,12 +76,20 @@ static CommandLine do_show_reverse_command =
 				 "Lookup given hostname and check reverse DNS setup", "", "",
 				 NULL, cli_show_reverse);
 
+static CommandLine do_show_system_command =
+	make_command("system",
+				 "Print the CPU, memory and storage used for Postgres tuning",
+				 "", "",
+				 NULL, cli_show_system);
+
 CommandLine *do_show_subcommands[] = {
 	&do_show_ipaddr_command,
 	&do_show_cidr_command,
 	&do_show_lookup_command,
+	&do_show_hba_hosts_command,
 	&do_show_hostname_command,
 	&do_show_reverse_command,
+	&do_show_system_command,
 	NULL
 };
 
@@ -197,6 +216,56 @@ cli_show_lookup(int argc, char **argv)
 }
 
 
+/*
+ * cli_show_hba_hosts displays the hosts of the HBA rules that pg_autoctl
+ * edits when postgresql.hba_compact is set and the other nodes of the group
+ * are found at the given hosts: the smallest set of CIDR blocks that contains
+ * exactly their IP addresses, and then the hostnames that we fail to resolve.
+ */
+static void
+cli_show_hba_hosts(int argc, char **argv)
+{
+	NodeAddressArray nodesArray = { 0 };
+	NodeAddressArray hostnameNodesArray = { 0 };
+
+	CIDRBlock blocks[NODE_ARRAY_MAX_COUNT] = { 0 };
+	int blockCount = 0;
+
+	if (argc < 1 || argc > NODE_ARRAY_MAX_COUNT)
+	{
+		commandline_print_usage(&do_show_hba_hosts_command, stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	for (int index = 0; index < argc; index++)
+	{
+		NodeAddress *node = &(nodesArray.nodes[nodesArray.count++]);
+
+		node->nodeId = index + 1;
+		sformat(node->name, sizeof(node->name), "node_%d", index + 1);
+		strlcpy(node->host, argv[index], sizeof(node->host));
+		node->port = 5432;
+	}
+
+	if (!pghba_compact_hosts(&nodesArray, blocks, &blockCount,
+							 &hostnameNodesArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	for (int index = 0; index < blockCount; index++)
+	{
+		fformat(stdout, "%s\n", blocks[index].cidr);
+	}
+
+	for (int index = 0; index < hostnameNodesArray.count; index++)
+	{
+		fformat(stdout, "%s\n", hostnameNodesArray.nodes[index].host);
+	}
+}
+
+
 /*
  * cli_show_hostname shows the default --hostname we would use. It's the
  * reverse DNS entry for the local IP address we probe.
@@ -339,3 +408,75 @@ cli_show_reverse(int argc, char **argv)
 			 hostname,
 			 ipaddr);
 }
+
+
+/*
+ * cli_show_system displays the system resources that pg_autoctl uses to
+ * compute the Postgres tuning: CPUs and memory, within the cgroup limits, the
+ * huge pages pool, and the storage of PGDATA when it is set in the
+ * environment.
+ */
+static void
+cli_show_system(int argc, char **argv)
+{
+	SystemInfo sysInfo = { 0 };
+	char pgdata[MAXPGPATH] = { 0 };
+	char source[BUFSIZE] = { 0 };
+	char ram[BUFSIZE] = { 0 };
+	char hostram[BUFSIZE] = { 0 };
+	char hugepages[BUFSIZE] = { 0 };
+	char hugepagesize[BUFSIZE] = { 0 };
+
+	if (!get_system_info(&sysInfo))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	(void) pretty_print_bytes(ram, sizeof(ram), sysInfo.totalram);
+	(void) pretty_print_bytes(hostram, sizeof(hostram), sysInfo.hostTotalram);
+	(void) pretty_print_bytes(hugepages, sizeof(hugepages),
+							  sysInfo.hugePagesTotal);
+	(void) pretty_print_bytes(hugepagesize, sizeof(hugepagesize),
+							  sysInfo.hugePageSize);
+
+	fformat(stdout, "%12s | %12s | %s\n", "Resource", "Detected", "Details");
+	fformat(stdout, "%12s-+-%12s-+-%s\n",
+			"------------", "------------",
+			"------------------------------");
+
+	if (sysInfo.cgroupCpuLimit > 0)
+	{
+		sformat(source, sizeof(source), "cgroup v%d limit, host has %d",
+				sysInfo.cgroupVersion, sysInfo.hostNcpu);
+	}
+	else
+	{
+		sformat(source, sizeof(source), "host");
+	}
+
+	fformat(stdout, "%12s | %12d | %s\n", "CPUs", sysInfo.ncpu, source);
+
+	if (sysInfo.cgroupMemoryLimit > 0)
+	{
+		sformat(source, sizeof(source), "cgroup v%d limit, host has %s",
+				sysInfo.cgroupVersion, hostram);
+	}
+	else
+	{
+		sformat(source, sizeof(source), "host");
+	}
+
+	fformat(stdout, "%12s | %12s | %s\n", "RAM", ram, source);
+
+	sformat(source, sizeof(source), "pages of %s", hugepagesize);
+
+	fformat(stdout, "%12s | %12s | %s\n", "Huge pages", hugepages,
+			sysInfo.hugePageSize > 0 ? source : "");
+
+	if (get_env_pgdata(pgdata))
+	{
+		fformat(stdout, "%12s | %12s | %s\n", "Storage",
+				storage_type_to_string(get_storage_type(pgdata)), pgdata);
+	}
+}
@@ -211,6 +211,7 @@ cli_do_tmux_script_getopts(int argc, char **argv)
 		{ "node-priorities", required_argument, NULL, 'P' },
 		{ "sync-standbys", required_argument, NULL, 's' },
 		{ "skip-pg-hba", required_argument, NULL, 'S' },
+		{ "serialize", no_argument, NULL, 'z' },
 		{ "layout", required_argument, NULL, 'l' },
 		{ "binpath", required_argument, NULL, 'b' },
 		{ "version", no_argument, NULL, 'V' },
@@ -228,6 +229,7 @@ cli_do_tmux_script_getopts(int argc, char **argv)
 	options.asyncNodes = 0;
 	options.numSync = -1;       /* use pg_autoctl defaults */
 	options.skipHBA = false;
+	options.serialize = false;
 	strlcpy(options.root, "/tmp/pgaf/tmux", sizeof(options.root));
 	strlcpy(options.layout, "even-vertical", sizeof(options.layout));
 	strlcpy(options.binpath, pg_autoctl_argv0, sizeof(options.binpath));
@@ -340,6 +342,13 @@ cli_do_tmux_script_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'z':
+			{
+				options.serialize = true;
+				log_trace("--serialize");
+				break;
+			}
+
 			case 'l':
 			{
 				strlcpy(options.layout, optarg, MAXPGPATH);
@@ -761,8 +770,11 @@ prepare_tmux_script(TmuxOptions *options, PQExpBuffer script)
 		(void) tmux_add_xdg_environment(script);
 
 		/*
-		 * Force node ordering to easy debugging of interactive sessions: each
-		 * node waits until the previous one has been started or registered.
+		 * The first node waits for the monitor, and then the standby nodes
+		 * wait until the first node has been registered, so that it's the
+		 * primary, and are created in parallel. With --serialize each node
+		 * waits for the previous one instead, which makes it easier to debug
+		 * interactive sessions.
 		 */
 		tmux_add_send_keys_command(script,
 								   "PG_AUTOCTL_DEBUG=1 "
@@ -780,7 +792,10 @@ prepare_tmux_script(TmuxOptions *options, PQExpBuffer script)
 										node->candidatePriority,
 										options->skipHBA);
 
-		strlcpy(previousName, node->name, sizeof(previousName));
+		if (i == 0 || options->serialize)
+		{
+			strlcpy(previousName, node->name, sizeof(previousName));
+		}
 	}
 
 	/* add a window for pg_autoctl show state */
@@ -1001,6 +1016,15 @@ tmux_stop_pg_autoctl(TmuxOptions *options)
 	int signals[] = { SIGTERM, SIGINT, SIGQUIT };
 	int signalsCount = sizeof(signals) / sizeof(signals[0]);
 
+	/* the pids we have signaled, one per node and the monitor */
+	pid_t *signaledPids = (pid_t *) calloc(options->nodes + 1, sizeof(pid_t));
+
+	if (signaledPids == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
 	/* signal processes using increasing levels of urge to quit now */
 	for (int s = 0; s < signalsCount; s++)
 	{
@@ -1012,6 +1036,8 @@ tmux_stop_pg_autoctl(TmuxOptions *options)
 			char name[MAXPGPATH] = { 0 };
 			char pgdata[MAXPGPATH] = { 0 };
 
+			signaledPids[i] = 0;
+
 			if (i == options->nodes)
 			{
 				sformat(name, sizeof(name), "monitor");
@@ -1047,6 +1073,10 @@ tmux_stop_pg_autoctl(TmuxOptions *options)
 					log_info("Failed to send %s to pid %d",
 							 signal_to_string(signals[s]), pid);
 				}
+				else
+				{
+					signaledPids[i] = pid;
+				}
 			}
 		}
 
@@ -1055,10 +1085,12 @@ tmux_stop_pg_autoctl(TmuxOptions *options)
 			break;
 		}
 
-		/* sleep enough time that the processes might already be dead */
-		sleep(1);
+		/* wait for at most a second until the processes are dead */
+		(void) wait_for_processes_exit(signaledPids, options->nodes + 1, 1000);
 	}
 
+	free(signaledPids);
+
 	return success;
 }
 
@@ -37,6 +37,7 @@ typedef struct TmuxOptions
 	int priorities[MAX_NODES];  /* node priorities */
 	int numSync;                /* number-sync-standbys */
 	bool skipHBA;               /* do we want to use --skip-pg-hba? */
+	bool serialize;             /* create standby nodes one at a time? */
 	char layout[BUFSIZE];
 	char binpath[MAXPGPATH];
 } TmuxOptions;
@@ -19,6 +19,7 @@
 
 #include "cli_common.h"
 #include "commandline.h"
+#include "config_snapshot.h"
 #include "env_utils.h"
 #include "defaults.h"
 #include "fsm.h"
@@ -47,6 +48,7 @@
  */
 static bool dropAndDestroy = false;
 static bool dropForce = false;
+static char dropNodeNames[BUFSIZE] = { 0 };
 
 static int cli_drop_node_getopts(int argc, char **argv);
 static void cli_drop_node(int argc, char **argv);
@@ -77,11 +79,13 @@ CommandLine drop_node_command =
 		"node",
 		"Drop a node from the pg_auto_failover monitor",
 		"[ [ [ --pgdata ] [ --destroy ] ] | "
-		"[ --monitor [ [ --hostname --pgport ] | [ --formation --name ] ] ] ] ",
+		"[ --monitor [ [ --hostname --pgport ] | [ --formation --name ] | "
+		"[ --formation --names ] ] ] ] ",
 		"  --pgdata      path to data directory\n"
 		"  --monitor     pg_auto_failover Monitor Postgres URL\n"
 		"  --formation   pg_auto_failover formation\n"
 		"  --name        drop the node with the given node name\n"
+		"  --names       drop the nodes with the given comma separated names\n"
 		"  --hostname    drop the node with given hostname and pgport\n"
 		"  --pgport      drop the node with given hostname and pgport\n"
 		"  --destroy     also destroy Postgres database\n"
@@ -109,6 +113,7 @@ cli_drop_node_getopts(int argc, char **argv)
 		{ "pgport", required_argument, NULL, 'p' },
 		{ "formation", required_argument, NULL, 'f' },
 		{ "name", required_argument, NULL, 'a' },
+		{ "names", required_argument, NULL, 'N' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -118,7 +123,7 @@ cli_drop_node_getopts(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "D:dn:p:Vvqh",
+	while ((c = getopt_long(argc, argv, "D:dn:p:N:Vvqh",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -191,6 +196,14 @@ cli_drop_node_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'N':
+			{
+				/* { "names", required_argument, NULL, 'N' }, */
+				strlcpy(dropNodeNames, optarg, sizeof(dropNodeNames));
+				log_trace("--names %s", dropNodeNames);
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -249,6 +262,7 @@ cli_drop_node_getopts(int argc, char **argv)
 
 	if (dropAndDestroy &&
 		(!IS_EMPTY_STRING_BUFFER(options.hostname) ||
+		 !IS_EMPTY_STRING_BUFFER(dropNodeNames) ||
 		 options.pgSetup.pgport != 0))
 	{
 		log_error("Please use either [ --hostname --pgport ] "
@@ -282,6 +296,7 @@ cli_drop_node_getopts(int argc, char **argv)
 	 *   --pgdata ...                 # to drop the local node
 	 *   --pgdata <monitor>           # to drop any node from the monitor
 	 *   --formation ... --name ...   # address a node on the monitor
+	 *   --formation ... --names ...  # address several nodes on the monitor
 	 *   --hostname ... --pgport ...  # address a node on the monitor
 	 *
 	 * We check about the PGDATA being related to a monitor or a keeper later,
@@ -298,6 +313,15 @@ cli_drop_node_getopts(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
+	if (!IS_EMPTY_STRING_BUFFER(dropNodeNames) &&
+		(!IS_EMPTY_STRING_BUFFER(options.name) ||
+		 !IS_EMPTY_STRING_BUFFER(options.hostname)))
+	{
+		log_fatal("pg_autoctl drop node --names can not be used together "
+				  "with --name or [ --hostname and --pgport ]");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
 	/* use the "default" formation when not given */
 	if (IS_EMPTY_STRING_BUFFER(options.formation))
 	{
@@ -358,7 +382,8 @@ cli_drop_node(int argc, char **argv)
 			exit(EXIT_CODE_BAD_ARGS);
 		}
 
-		if (!IS_EMPTY_STRING_BUFFER(config.name))
+		if (!IS_EMPTY_STRING_BUFFER(config.name) ||
+			!IS_EMPTY_STRING_BUFFER(dropNodeNames))
 		{
 			log_fatal("Only dropping the local node is supported, "
 					  "[ --formation --name ] are not supported "
@@ -386,7 +411,8 @@ cli_drop_node(int argc, char **argv)
 	{
 		/* pg_autoctl drop node on the monitor drops another node */
 		if (IS_EMPTY_STRING_BUFFER(config.name) &&
-			IS_EMPTY_STRING_BUFFER(config.hostname))
+			IS_EMPTY_STRING_BUFFER(config.hostname) &&
+			IS_EMPTY_STRING_BUFFER(dropNodeNames))
 		{
 			log_fatal("pg_autoctl drop node target can either be specified "
 					  "using [ --formation --name ], or "
@@ -480,7 +506,8 @@ cli_drop_monitor(int argc, char **argv)
 /*
  * cli_drop_node_from_monitor calls pgautofailover.remove_node() on the monitor
  * for the given --hostname and --pgport, or from the given --formation and
- * --name.
+ * --name, or pgautofailover.remove_nodes() for the given --formation and
+ * --names.
  */
 static void
 cli_drop_node_from_monitor(KeeperConfig *config)
@@ -489,7 +516,22 @@ cli_drop_node_from_monitor(KeeperConfig *config)
 
 	(void) cli_monitor_init_from_option_or_config(&monitor, config);
 
-	if (!IS_EMPTY_STRING_BUFFER(config->name))
+	if (!IS_EMPTY_STRING_BUFFER(dropNodeNames))
+	{
+		log_info("Removing nodes with names \"%s\" in formation \"%s\" "
+				 "from the monitor",
+				 dropNodeNames, config->formation);
+
+		if (!monitor_remove_by_nodenames(&monitor,
+										 (char *) config->formation,
+										 dropNodeNames,
+										 dropForce))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+	else if (!IS_EMPTY_STRING_BUFFER(config->name))
 	{
 		log_info("Removing node with name \"%s\" in formation \"%s\" "
 				 "from the monitor",
@@ -726,6 +768,12 @@ cli_drop_node_files_and_directories(KeeperConfig *config)
 				  config->pathnames.state);
 	}
 
+	if (!unlink_file(config->pathnames.timings))
+	{
+		log_error("Failed to remove timings file \"%s\"",
+				  config->pathnames.timings);
+	}
+
 	(void) stop_postgres_and_remove_pgdata_and_config(
 		&config->pathnames,
 		&config->pgSetup);
@@ -850,4 +898,7 @@ stop_postgres_and_remove_pgdata_and_config(ConfigFilePaths *pathnames,
 		/* errors have already been logged. */
 		exit(EXIT_CODE_BAD_CONFIG);
 	}
+
+	/* errors are logged, and the snapshot would never be used anyway */
+	(void) config_snapshot_remove(pathnames->config);
 }
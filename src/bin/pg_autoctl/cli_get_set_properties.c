@@ -7,6 +7,8 @@
  * Licensed under the PostgreSQL License.
  *
  */
+#include <ctype.h>
+
 #include "parson.h"
 
 #include "cli_common.h"
@@ -17,11 +19,14 @@ static bool get_node_replication_settings(NodeReplicationSettings *settings);
 static void cli_get_node_replication_quorum(int argc, char **argv);
 static void cli_get_node_candidate_priority(int argc, char **argv);
 static void cli_get_formation_number_sync_standbys(int argc, char **argv);
+static void cli_get_formation_maximum_backup_rate(int argc, char **argv);
 
 static void cli_set_node_replication_quorum(int argc, char **argv);
 static void cli_set_node_candidate_priority(int argc, char **argv);
 static void cli_set_node_metadata(int argc, char **argv);
 static void cli_set_formation_number_sync_standbys(int arc, char **argv);
+static void cli_set_formation_maximum_backup_rate(int argc, char **argv);
+static void cli_set_formation_node_properties(int argc, char **argv);
 
 static bool set_node_candidate_priority(Keeper *keeper, int candidatePriority);
 static bool set_node_replication_quorum(Keeper *keeper, bool replicationQuorum);
@@ -29,6 +34,8 @@ static bool set_formation_number_sync_standbys(Monitor *monitor,
 											   char *formation,
 											   int groupId,
 											   int numberSyncStandbys);
+static bool parse_node_property(const char *arg,
+								NodePropertiesArray *propertiesArray);
 
 CommandLine get_node_replication_quorum =
 	make_command("replication-quorum",
@@ -85,9 +92,20 @@ static CommandLine get_formation_number_sync_standbys =
 				 cli_get_name_getopts,
 				 cli_get_formation_number_sync_standbys);
 
+static CommandLine get_formation_maximum_backup_rate =
+	make_command("maximum-backup-rate",
+				 "get maximum-backup-rate for a formation from the monitor",
+				 " [ --pgdata ] [ --json ] [ --formation ] ",
+				 "  --pgdata      path to data directory\n"
+				 "  --json        output data in the JSON format\n"
+				 "  --formation   pg_auto_failover formation\n",
+				 cli_get_name_getopts,
+				 cli_get_formation_maximum_backup_rate);
+
 static CommandLine *get_formation_subcommands[] = {
 	&get_formation_settings,
 	&get_formation_number_sync_standbys,
+	&get_formation_maximum_backup_rate,
 	NULL
 };
 
@@ -169,8 +187,32 @@ static CommandLine set_formation_number_sync_standby_command =
 				 cli_get_name_getopts,
 				 cli_set_formation_number_sync_standbys);
 
+static CommandLine set_formation_maximum_backup_rate_command =
+	make_command("maximum-backup-rate",
+				 "set maximum-backup-rate for a formation on the monitor",
+				 " [ --pgdata ] [ --json ] [ --formation ] "
+				 "<rate|default>",
+				 "  --pgdata      path to data directory\n"
+				 "  --formation   pg_auto_failover formation\n"
+				 "  --json        output data in the JSON format\n",
+				 cli_get_name_getopts,
+				 cli_set_formation_maximum_backup_rate);
+
+static CommandLine set_formation_node_properties_command =
+	make_command("node-properties",
+				 "set properties of several nodes of a formation on the monitor",
+				 " [ --pgdata ] [ --json ] [ --formation ] "
+				 "<name:property=value> ...",
+				 "  --pgdata      path to data directory\n"
+				 "  --formation   pg_auto_failover formation\n"
+				 "  --json        output data in the JSON format\n",
+				 cli_get_name_getopts,
+				 cli_set_formation_node_properties);
+
 static CommandLine *set_formation_subcommands[] = {
 	&set_formation_number_sync_standby_command,
+	&set_formation_maximum_backup_rate_command,
+	&set_formation_node_properties_command,
 	NULL
 };
 
@@ -356,6 +398,58 @@ cli_get_formation_number_sync_standbys(int argc, char **argv)
 }
 
 
+/*
+ * cli_get_formation_maximum_backup_rate prints the maximum backup rate of the
+ * formation to standard output, or "default" when the nodes of the formation
+ * use their own replication.maximum_backup_rate setting.
+ */
+static void
+cli_get_formation_maximum_backup_rate(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+	char maximumBackupRate[MAXIMUM_BACKUP_RATE_LEN] = { 0 };
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+
+	if (!monitor_get_formation_maximum_backup_rate(&monitor,
+												   config.formation,
+												   maximumBackupRate,
+												   sizeof(maximumBackupRate)))
+	{
+		log_error("Failed to get maximum-backup-rate for formation \"%s\"",
+				  config.formation);
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		if (IS_EMPTY_STRING_BUFFER(maximumBackupRate))
+		{
+			json_object_set_null(jsObj, "maximum-backup-rate");
+		}
+		else
+		{
+			json_object_set_string(jsObj,
+								   "maximum-backup-rate",
+								   maximumBackupRate);
+		}
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stdout, "%s\n",
+				IS_EMPTY_STRING_BUFFER(maximumBackupRate)
+				? "default"
+				: maximumBackupRate);
+	}
+}
+
+
 /*
  * cli_set_node_replication_quorum sets the replication quorum property on the
  * monitor for current pg_autoctl node.
@@ -659,6 +753,303 @@ cli_set_formation_number_sync_standbys(int argc, char **argv)
 }
 
 
+/*
+ * cli_set_formation_maximum_backup_rate sets the pg_basebackup --max-rate
+ * that the nodes of the formation use, overriding their own
+ * replication.maximum_backup_rate setting. The value "default" resets it.
+ */
+static void
+cli_set_formation_maximum_backup_rate(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+	char *maximumBackupRate = NULL;
+
+	if (argc != 1)
+	{
+		log_error("Failed to parse command line arguments: "
+				  "got %d when 1 is expected",
+				  argc);
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (strcmp(argv[0], "default") == 0)
+	{
+		maximumBackupRate = "";
+	}
+	else if (strlen(argv[0]) >= MAXIMUM_BACKUP_RATE_LEN ||
+			 !isdigit((unsigned char) argv[0][0]))
+	{
+		log_error("maximum-backup-rate value \"%s\" is not valid. Expected "
+				  "a pg_basebackup --max-rate value such as 100M, "
+				  "or \"default\".", argv[0]);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+	else
+	{
+		maximumBackupRate = argv[0];
+	}
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+
+	if (!monitor_set_formation_maximum_backup_rate(&monitor,
+												   config.formation,
+												   maximumBackupRate))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_object();
+		JSON_Object *jsObj = json_value_get_object(js);
+
+		if (IS_EMPTY_STRING_BUFFER(maximumBackupRate))
+		{
+			json_object_set_null(jsObj, "maximum-backup-rate");
+		}
+		else
+		{
+			json_object_set_string(jsObj,
+								   "maximum-backup-rate",
+								   maximumBackupRate);
+		}
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		fformat(stdout, "%s\n",
+				IS_EMPTY_STRING_BUFFER(maximumBackupRate)
+				? "default"
+				: maximumBackupRate);
+	}
+}
+
+
+/*
+ * cli_set_formation_node_properties sets the candidate priority and the
+ * replication quorum of several nodes of a formation at once, given as
+ * name:property=value arguments. The monitor changes them all in a single
+ * transaction, and each primary node applies the resulting
+ * synchronous_standby_names only once.
+ */
+static void
+cli_set_formation_node_properties(int argc, char **argv)
+{
+	KeeperConfig config = keeperOptions;
+	Monitor monitor = { 0 };
+	NodePropertiesArray propertiesArray = { 0 };
+	int applySettingsCount = 0;
+
+	if (argc < 1)
+	{
+		log_error("Failed to parse command line arguments: "
+				  "got %d when at least 1 is expected",
+				  argc);
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (!parse_node_property(argv[i], &propertiesArray))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_BAD_ARGS);
+		}
+	}
+
+	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+
+	/* listen for state changes BEFORE we apply new settings */
+	char *channels[] = { "state", NULL };
+
+	if (!pgsql_listen(&(monitor.notificationClient), channels))
+	{
+		log_error("Failed to listen to state changes from the monitor");
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	if (!monitor_set_node_properties(&monitor,
+									 config.formation,
+									 &propertiesArray,
+									 &applySettingsCount))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_MONITOR);
+	}
+
+	/* now wait until the primary actually applied the new settings */
+	if (applySettingsCount > 0)
+	{
+		if (!monitor_wait_until_primary_applied_settings(&monitor,
+														 config.formation))
+		{
+			log_error("Failed to wait until the new settings have been applied");
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+
+	if (outputJSON)
+	{
+		JSON_Value *js = json_value_init_array();
+		JSON_Array *jsArray = json_value_get_array(js);
+
+		for (int i = 0; i < propertiesArray.count; i++)
+		{
+			NodeProperties *properties = &(propertiesArray.nodes[i]);
+			JSON_Value *jsNode = json_value_init_object();
+			JSON_Object *jsObj = json_value_get_object(jsNode);
+
+			json_object_set_string(jsObj, "name", properties->name);
+
+			if (properties->hasCandidatePriority)
+			{
+				json_object_set_number(jsObj,
+									   "candidate-priority",
+									   (double) properties->candidatePriority);
+			}
+
+			if (properties->hasReplicationQuorum)
+			{
+				json_object_set_boolean(jsObj,
+										"replication-quorum",
+										properties->replicationQuorum);
+			}
+
+			json_array_append_value(jsArray, jsNode);
+		}
+
+		(void) cli_pprint_json(js);
+	}
+	else
+	{
+		for (int i = 0; i < propertiesArray.count; i++)
+		{
+			NodeProperties *properties = &(propertiesArray.nodes[i]);
+
+			if (properties->hasCandidatePriority)
+			{
+				fformat(stdout, "%s:candidate-priority=%d\n",
+						properties->name, properties->candidatePriority);
+			}
+
+			if (properties->hasReplicationQuorum)
+			{
+				fformat(stdout, "%s:replication-quorum=%s\n",
+						properties->name,
+						boolToString(properties->replicationQuorum));
+			}
+		}
+	}
+}
+
+
+/*
+ * parse_node_property parses a name:property=value argument of pg_autoctl
+ * set formation node-properties, and adds the change to the given array. The
+ * changes of the same node are merged in a single entry.
+ */
+static bool
+parse_node_property(const char *arg, NodePropertiesArray *propertiesArray)
+{
+	char name[_POSIX_HOST_NAME_MAX] = { 0 };
+	char property[NAMEDATALEN] = { 0 };
+
+	const char *equal = strrchr(arg, '=');
+	const char *colon = NULL;
+
+	/* node names may contain colons, properties don't */
+	for (const char *ptr = arg; equal != NULL && ptr < equal; ptr++)
+	{
+		if (*ptr == ':')
+		{
+			colon = ptr;
+		}
+	}
+
+	if (equal == NULL || colon == NULL || colon == arg ||
+		(colon - arg) >= sizeof(name) ||
+		(equal - colon - 1) >= sizeof(property))
+	{
+		log_error("Failed to parse node property \"%s\": "
+				  "expected name:property=value", arg);
+		return false;
+	}
+
+	strlcpy(name, arg, colon - arg + 1);
+	strlcpy(property, colon + 1, equal - colon);
+
+	const char *value = equal + 1;
+
+	NodeProperties *properties = NULL;
+
+	for (int i = 0; i < propertiesArray->count; i++)
+	{
+		if (streq(propertiesArray->nodes[i].name, name))
+		{
+			properties = &(propertiesArray->nodes[i]);
+			break;
+		}
+	}
+
+	if (properties == NULL)
+	{
+		if (propertiesArray->count >= NODE_PROPERTIES_MAX_COUNT)
+		{
+			log_error("Failed to parse node property \"%s\": "
+					  "at most %d nodes can be changed at once",
+					  arg, NODE_PROPERTIES_MAX_COUNT);
+			return false;
+		}
+
+		properties = &(propertiesArray->nodes[propertiesArray->count++]);
+		strlcpy(properties->name, name, sizeof(properties->name));
+	}
+
+	if (streq(property, "candidate-priority"))
+	{
+		int candidatePriority = 0;
+
+		if (!stringToInt(value, &candidatePriority) ||
+			candidatePriority < 0 || candidatePriority > 100)
+		{
+			log_error("candidate-priority value %s is not valid."
+					  " Valid values are integers from 0 to 100. ", value);
+			return false;
+		}
+
+		properties->hasCandidatePriority = true;
+		properties->candidatePriority = candidatePriority;
+	}
+	else if (streq(property, "replication-quorum"))
+	{
+		bool replicationQuorum = false;
+
+		if (!parse_bool(value, &replicationQuorum))
+		{
+			log_error("replication-quorum value %s is not valid."
+					  " Valid values are \"true\" or \"false.", value);
+			return false;
+		}
+
+		properties->hasReplicationQuorum = true;
+		properties->replicationQuorum = replicationQuorum;
+	}
+	else
+	{
+		log_error("Failed to parse node property \"%s\": unknown property "
+				  "\"%s\", expected candidate-priority or replication-quorum",
+				  arg, property);
+		return false;
+	}
+
+	return true;
+}
+
 /*
  * set_node_candidate_priority sets the candidate priority on the monitor, and
  * if we have more than one node registered, waits until the primary has
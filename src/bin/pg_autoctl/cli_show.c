@@ -17,6 +17,7 @@
 #include "commandline.h"
 #include "defaults.h"
 #include "env_utils.h"
+#include "fsm_timings.h"
 #include "ipaddr.h"
 #include "keeper_config.h"
 #include "keeper.h"
@@ -30,11 +31,14 @@
 #include "pgsetup.h"
 #include "pgsql.h"
 #include "pidfile.h"
+#include "signals.h"
 #include "state.h"
 #include "string_utils.h"
 
 static int eventCount = 10;
 static bool localState = false;
+static bool followState = false;
+static CurrentStateFilter stateFilter = { -1, NO_STATE, false, -1, false, 0 };
 
 static int cli_show_state_getopts(int argc, char **argv);
 static void cli_show_state(int argc, char **argv);
@@ -65,10 +69,12 @@ static void print_all_uri(SSLOptions *ssl,
 CommandLine show_uri_command =
 	make_command("uri",
 				 "Show the postgres uri to use to connect to pg_auto_failover nodes",
-				 " [ --pgdata --monitor --formation --json ] ",
+				 " [ --pgdata --monitor --formation --read-only --max-lag --json ] ",
 				 "  --pgdata      path to data directory\n"
 				 "  --monitor     show the monitor uri\n"
 				 "  --formation   show the coordinator uri of given formation\n"
+				 "  --read-only   show the uri of the secondary nodes, least lagging first\n"
+				 "  --max-lag     skip secondary nodes lagging more bytes than this\n"
 				 "  --json        output data in the JSON format\n",
 				 cli_show_uri_getopts,
 				 cli_show_uri);
@@ -89,12 +95,18 @@ CommandLine show_events_command =
 CommandLine show_state_command =
 	make_command("state",
 				 "Prints monitor's state of nodes in a given formation and group",
-				 " [ --pgdata --formation --group ] ",
+				 " [ --pgdata --formation --group --state --health --lagging "
+				 "--page-size --follow ] ",
 				 "  --pgdata      path to data directory	 \n"
 				 "  --monitor     show the monitor uri\n"
 				 "  --formation   formation to query, defaults to 'default' \n"
 				 "  --group       group to query formation, defaults to all \n"
+				 "  --state       only show nodes in the given reported state\n"
+				 "  --health      only show nodes with given health (yes, no, unknown)\n"
+				 "  --lagging     only show nodes lagging behind their group\n"
+				 "  --page-size   how many nodes to fetch from the monitor at a time\n"
 				 "  --local       show local data, do not connect to the monitor\n"
+				 "  --follow      keep running and show state changes as they happen\n"
 				 "  --json        output data in the JSON format\n",
 				 cli_show_state_getopts,
 				 cli_show_state);
@@ -157,6 +169,8 @@ static ShowFileOptions showFileOptions;
 typedef struct ShowUriOptions
 {
 	bool monitorOnly;
+	bool readOnly;
+	int64_t maxLagBytes;
 	char formation[NAMEDATALEN];
 	char citusClusterName[NAMEDATALEN];
 } ShowUriOptions;
@@ -181,7 +195,12 @@ cli_show_state_getopts(int argc, char **argv)
 		{ "formation", required_argument, NULL, 'f' },
 		{ "group", required_argument, NULL, 'g' },
 		{ "count", required_argument, NULL, 'n' },
+		{ "state", required_argument, NULL, 'S' },
+		{ "health", required_argument, NULL, 'H' },
+		{ "lagging", no_argument, NULL, 'l' },
+		{ "page-size", required_argument, NULL, 'P' },
 		{ "local", no_argument, NULL, 'L' },
+		{ "follow", no_argument, NULL, 'F' },
 		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -256,6 +275,67 @@ cli_show_state_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'S':
+			{
+				stateFilter.state = NodeStateFromString(optarg);
+
+				if (stateFilter.state == NO_STATE)
+				{
+					log_fatal("--state argument is not a valid state: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--state %s", optarg);
+				break;
+			}
+
+			case 'H':
+			{
+				if (strcmp(optarg, "yes") == 0)
+				{
+					stateFilter.health = 1;
+				}
+				else if (strcmp(optarg, "no") == 0)
+				{
+					stateFilter.health = 0;
+				}
+				else if (strcmp(optarg, "unknown") == 0)
+				{
+					stateFilter.health = -1;
+				}
+				else
+				{
+					log_fatal("--health argument must be one of yes, no, "
+							  "or unknown: \"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				stateFilter.filterHealth = true;
+				log_trace("--health %s", optarg);
+				break;
+			}
+
+			case 'l':
+			{
+				stateFilter.laggingOnly = true;
+				log_trace("--lagging");
+				break;
+			}
+
+			case 'P':
+			{
+				if (!stringToInt(optarg, &stateFilter.pageSize) ||
+					stateFilter.pageSize <= 0)
+				{
+					log_fatal("--page-size argument is not a valid page size: "
+							  "\"%s\"",
+							  optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				log_trace("--page-size %d", stateFilter.pageSize);
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -309,6 +389,13 @@ cli_show_state_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'F':
+			{
+				followState = true;
+				log_trace("--follow");
+				break;
+			}
+
 			case 'J':
 			{
 				outputJSON = true;
@@ -324,6 +411,23 @@ cli_show_state_getopts(int argc, char **argv)
 		}
 	}
 
+	if (followState && (localState || outputJSON))
+	{
+		log_error("Option --follow is not compatible with --local or --json");
+		errors++;
+	}
+
+	if ((followState || localState) &&
+		(stateFilter.state != NO_STATE ||
+		 stateFilter.filterHealth ||
+		 stateFilter.laggingOnly ||
+		 stateFilter.pageSize > 0))
+	{
+		log_error("Options --state, --health, --lagging, and --page-size "
+				  "are not compatible with --follow or --local");
+		errors++;
+	}
+
 	if (errors > 0)
 	{
 		commandline_help(stderr);
@@ -386,6 +490,7 @@ cli_show_events(int argc, char **argv)
 	Monitor monitor = { 0 };
 
 	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+	(void) cli_monitor_use_local_proxy(&monitor, &config);
 
 	if (outputJSON)
 	{
@@ -459,10 +564,31 @@ cli_show_state(int argc, char **argv)
 
 	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
 
-	if (outputJSON)
+	/* --follow keeps a session of its own to LISTEN to notifications */
+	if (!followState)
 	{
+		(void) cli_monitor_use_local_proxy(&monitor, &config);
+	}
+
+	if (followState)
+	{
+		bool exitOnQuit = true;
+
+		/* Establish a handler for signals, to stop on Control-C */
+		(void) set_signal_handlers(exitOnQuit);
+
+		if (!monitor_follow_state(&monitor, config.formation, config.groupId))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+	else if (outputJSON)
+	{
+		stateFilter.groupId = config.groupId;
+
 		if (!monitor_print_state_as_json(&monitor,
-										 config.formation, config.groupId))
+										 config.formation, &stateFilter))
 		{
 			/* errors have already been logged */
 			exit(EXIT_CODE_MONITOR);
@@ -470,11 +596,17 @@ cli_show_state(int argc, char **argv)
 	}
 	else
 	{
-		if (!monitor_print_state(&monitor, config.formation, config.groupId))
+		stateFilter.groupId = config.groupId;
+
+		if (!monitor_print_state(&monitor, config.formation, &stateFilter))
 		{
 			/* errors have already been logged */
 			exit(EXIT_CODE_MONITOR);
 		}
+
+		/* the state table is what matters, errors have been logged */
+		(void) monitor_print_catchup_progress(&monitor, config.formation,
+											  config.groupId);
 	}
 }
 
@@ -550,7 +682,8 @@ cli_show_local_state()
 						&(keeper.postgres.postgresSetup.is_in_recovery),
 						keeper.postgres.pgsrSyncState,
 						keeper.postgres.currentLSN,
-						&(keeper.postgres.postgresSetup.control)))
+						&(keeper.postgres.postgresSetup.control),
+						NULL))
 				{
 					log_warn("Failed to update the local Postgres metadata");
 
@@ -584,12 +717,23 @@ cli_show_local_state()
 			if (outputJSON)
 			{
 				JSON_Value *js = json_value_init_object();
+				JSON_Value *transitions = NULL;
 
 				if (!nodestateAsJSON(&nodeState, js))
 				{
 					/* can't happen */
 					exit(EXIT_CODE_INTERNAL_ERROR);
 				}
+
+				/* add the timings of the last FSM transitions */
+				if (fsm_timings_read_file(config.pathnames.timings,
+										  &transitions))
+				{
+					json_object_set_value(json_value_get_object(js),
+										  "transitions",
+										  transitions);
+				}
+
 				(void) cli_pprint_json(js);
 			}
 			else
@@ -821,6 +965,7 @@ cli_show_standby_names(int argc, char **argv)
 	char synchronous_standby_names[BUFSIZE] = { 0 };
 
 	(void) cli_monitor_init_from_option_or_config(&monitor, &config);
+	(void) cli_monitor_use_local_proxy(&monitor, &config);
 
 	(void) cli_set_groupId(&monitor, &config);
 
@@ -873,6 +1018,8 @@ cli_show_uri_getopts(int argc, char **argv)
 		{ "monitor", required_argument, NULL, 'm' },
 		{ "formation", required_argument, NULL, 'f' },
 		{ "citus-cluster", required_argument, NULL, 'Z' },
+		{ "read-only", no_argument, NULL, 'r' },
+		{ "max-lag", required_argument, NULL, 'L' },
 		{ "json", no_argument, NULL, 'J' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
@@ -936,6 +1083,28 @@ cli_show_uri_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'r':
+			{
+				showUriOptions.readOnly = true;
+				log_trace("--read-only");
+				break;
+			}
+
+			case 'L':
+			{
+				/* --max-lag implies --read-only */
+				if (!stringToInt64(optarg, &(showUriOptions.maxLagBytes)) ||
+					showUriOptions.maxLagBytes <= 0)
+				{
+					log_fatal("--max-lag argument is not a valid positive "
+							  "number of bytes: \"%s\"", optarg);
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				showUriOptions.readOnly = true;
+				log_trace("--max-lag %" PRId64, showUriOptions.maxLagBytes);
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -1041,6 +1210,21 @@ cli_show_uri_getopts(int argc, char **argv)
 				DEFAULT_CITUS_CLUSTER_NAME, NAMEDATALEN);
 	}
 
+	/* the monitor has no secondary nodes to route reads to */
+	if (showUriOptions.readOnly && showUriOptions.monitorOnly)
+	{
+		log_fatal("Options --read-only and --max-lag can not be used "
+				  "with --formation monitor");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* --read-only without --formation uses the default formation */
+	if (showUriOptions.readOnly &&
+		IS_EMPTY_STRING_BUFFER(showUriOptions.formation))
+	{
+		strlcpy(showUriOptions.formation, FORMATION_DEFAULT, NAMEDATALEN);
+	}
+
 	keeperOptions = options;
 
 	return optind;
@@ -1112,6 +1296,13 @@ cli_show_uri_monitor_init_from_config(KeeperConfig *kconfig,
 				exit(EXIT_CODE_BAD_CONFIG);
 			}
 
+			if (!IS_EMPTY_STRING_BUFFER(kconfig->monitor_replica_pguri) &&
+				!monitor_init_replica(monitor, kconfig->monitor_replica_pguri))
+			{
+				log_warn("Failed to setup the monitor replica connection, "
+						 "reading from the monitor instead");
+			}
+
 			*ssl = kconfig->pgSetup.ssl;
 			break;
 		}
@@ -1220,12 +1411,26 @@ print_formation_uri(SSLOptions *ssl,
 {
 	char postgresUri[MAXCONNINFO];
 
-	if (!monitor_formation_uri(monitor,
-							   formation,
-							   citusClusterName,
-							   ssl,
-							   postgresUri,
-							   MAXCONNINFO))
+	if (showUriOptions.readOnly)
+	{
+		if (!monitor_formation_read_only_uri(monitor,
+											 formation,
+											 citusClusterName,
+											 ssl,
+											 showUriOptions.maxLagBytes,
+											 postgresUri,
+											 MAXCONNINFO))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_MONITOR);
+		}
+	}
+	else if (!monitor_formation_uri(monitor,
+									formation,
+									citusClusterName,
+									ssl,
+									postgresUri,
+									MAXCONNINFO))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_MONITOR);
@@ -1511,6 +1716,8 @@ cli_show_file(int argc, char **argv)
 				{
 					json_object_set_string(root, "state", config.pathnames.state);
 					json_object_set_string(root, "init", config.pathnames.init);
+					json_object_set_string(root, "timings",
+										   config.pathnames.timings);
 				}
 
 				json_object_set_string(root, "pid", config.pathnames.pid);
@@ -1533,6 +1740,8 @@ cli_show_file(int argc, char **argv)
 				{
 					fformat(stdout, "%7s | %s\n", "State", config.pathnames.state);
 					fformat(stdout, "%7s | %s\n", "Init", config.pathnames.init);
+					fformat(stdout, "%7s | %s\n",
+							"Timings", config.pathnames.timings);
 				}
 				fformat(stdout, "%7s | %s\n", "Pid", config.pathnames.pid);
 				fformat(stdout, "\n");
@@ -208,6 +208,21 @@ SetStateFilePath(ConfigFilePaths *pathnames, const char *pgdata)
 	}
 	log_trace("SetKeeperStateFilePath: \"%s\"", pathnames->init);
 
+	/* and the FSM transitions timings file */
+	if (IS_EMPTY_STRING_BUFFER(pathnames->timings))
+	{
+		if (!build_xdg_path(pathnames->timings,
+							XDG_DATA,
+							pgdata,
+							KEEPER_TIMINGS_FILENAME))
+		{
+			log_error("Failed to build pg_autoctl timings file pathname, "
+					  "see above.");
+			return false;
+		}
+	}
+	log_trace("SetTimingsFilePath: \"%s\"", pathnames->timings);
+
 	return true;
 }
 
@@ -38,6 +38,7 @@ typedef struct ConfigFilePaths
 	char pid[MAXPGPATH];    /* /tmp/${PGDATA}/pg_autoctl.pid */
 	char init[MAXPGPATH];   /* /tmp/${PGDATA}/pg_autoctl.init */
 	char nodes[MAXPGPATH];  /* ~/.local/share/pg_autoctl/${PGDATA}/nodes.json */
+	char timings[MAXPGPATH];    /* ~/.local/share/pg_autoctl/${PGDATA}/pg_autoctl.timings */
 	char systemd[MAXPGPATH];    /* ~/.config/systemd/user/pgautofailover.service */
 } ConfigFilePaths;
 
@@ -0,0 +1,240 @@
+/*
+ * src/bin/pg_autoctl/config_snapshot.c
+ *   Binary snapshots of a parsed configuration file, for the CLI.
+ *
+ * Tools that call pg_autoctl config get in a loop have every process parse
+ * the INI file again. We keep the parsed configuration structure next to the
+ * configuration file, with a header that identifies the file it's been
+ * parsed from, and the CLI maps the snapshot instead of parsing when the
+ * configuration file has not changed.
+ *
+ * The snapshot is a cache: failing to read or write it is never an error,
+ * we just parse the configuration file as usual.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "config_snapshot.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+
+#define CONFIG_SNAPSHOT_SUFFIX ".snapshot"
+
+
+static void config_snapshot_path(const char *configPath, char *snapshotPath);
+
+
+/*
+ * config_snapshot_header prepares the header of a snapshot for the current
+ * version of the given configuration file, for a parsed structure of the
+ * given size.
+ */
+bool
+config_snapshot_header(const char *configPath,
+					   ConfigSnapshotHeader *header,
+					   size_t size)
+{
+	struct stat st;
+
+	if (stat(configPath, &st) != 0)
+	{
+		log_debug("Failed to stat \"%s\": %m", configPath);
+		return false;
+	}
+
+#if defined(__APPLE__)
+	struct timespec mtime = st.st_mtimespec;
+#else
+	struct timespec mtime = st.st_mtim;
+#endif
+
+	memset(header, 0, sizeof(ConfigSnapshotHeader));
+
+	header->magic = CONFIG_SNAPSHOT_MAGIC;
+	header->dataSize = (uint32_t) size;
+	strlcpy(header->version, PG_AUTOCTL_VERSION, sizeof(header->version));
+
+	header->inode = (uint64_t) st.st_ino;
+	header->size = (int64_t) st.st_size;
+	header->mtimeSec = (int64_t) mtime.tv_sec;
+	header->mtimeNsec = (int64_t) mtime.tv_nsec;
+
+	return true;
+}
+
+
+/*
+ * config_snapshot_read copies the parsed structure from the snapshot of the
+ * given configuration file into data, and returns true, when the snapshot
+ * exists and matches the current configuration file.
+ */
+bool
+config_snapshot_read(const char *configPath, void *data, size_t size)
+{
+	char snapshotPath[MAXPGPATH] = { 0 };
+	ConfigSnapshotHeader header = { 0 };
+	struct stat st;
+
+	if (!config_snapshot_header(configPath, &header, size))
+	{
+		return false;
+	}
+
+	(void) config_snapshot_path(configPath, snapshotPath);
+
+	int fd = open(snapshotPath, O_RDONLY, 0);
+
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+		{
+			log_debug("Failed to open \"%s\": %m", snapshotPath);
+		}
+		return false;
+	}
+
+	size_t snapshotSize = sizeof(ConfigSnapshotHeader) + size;
+
+	if (fstat(fd, &st) != 0 || st.st_size != (off_t) snapshotSize)
+	{
+		log_debug("Skipping configuration snapshot \"%s\": unexpected size",
+				  snapshotPath);
+		close(fd);
+		return false;
+	}
+
+	void *snapshot = mmap(NULL, snapshotSize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (snapshot == MAP_FAILED)
+	{
+		log_debug("Failed to map \"%s\": %m", snapshotPath);
+		return false;
+	}
+
+	bool matches =
+		memcmp(snapshot, &header, sizeof(ConfigSnapshotHeader)) == 0;
+
+	if (matches)
+	{
+		memcpy(data, (char *) snapshot + sizeof(ConfigSnapshotHeader), size);
+
+		log_debug("Read configuration snapshot \"%s\"", snapshotPath);
+	}
+	else
+	{
+		log_debug("Configuration snapshot \"%s\" is out of date", snapshotPath);
+	}
+
+	(void) munmap(snapshot, snapshotSize);
+
+	return matches;
+}
+
+
+/*
+ * config_snapshot_write writes a snapshot of the parsed structure, with the
+ * header that has been prepared before parsing the configuration file. When
+ * the configuration file changes while we parse it, the header doesn't match
+ * the file anymore, and the snapshot is never used.
+ *
+ * A file that has been modified within the last second could be modified
+ * again without its modification time changing on some file systems, so we
+ * don't take snapshots of those.
+ */
+bool
+config_snapshot_write(const char *configPath,
+					  const ConfigSnapshotHeader *header,
+					  const void *data, size_t size)
+{
+	char snapshotPath[MAXPGPATH] = { 0 };
+	char tempPath[MAXPGPATH] = { 0 };
+
+	if ((int64_t) time(NULL) - header->mtimeSec < 2)
+	{
+		log_debug("Skipping configuration snapshot for \"%s\": "
+				  "the file has just been modified",
+				  configPath);
+		return false;
+	}
+
+	(void) config_snapshot_path(configPath, snapshotPath);
+	sformat(tempPath, sizeof(tempPath), "%s.%d", snapshotPath, getpid());
+
+	int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+	{
+		/* the configuration directory might not be writable, that's ok */
+		log_debug("Failed to create \"%s\": %m", tempPath);
+		return false;
+	}
+
+	bool written =
+		write(fd, header, sizeof(ConfigSnapshotHeader)) ==
+		sizeof(ConfigSnapshotHeader) &&
+		write(fd, data, size) == (ssize_t) size;
+
+	if (close(fd) != 0)
+	{
+		written = false;
+	}
+
+	if (!written || rename(tempPath, snapshotPath) != 0)
+	{
+		log_debug("Failed to write configuration snapshot \"%s\": %m",
+				  snapshotPath);
+		(void) unlink(tempPath);
+		return false;
+	}
+
+	log_debug("Wrote configuration snapshot \"%s\"", snapshotPath);
+
+	return true;
+}
+
+
+/*
+ * config_snapshot_remove removes the snapshot of the given configuration
+ * file, if any.
+ */
+bool
+config_snapshot_remove(const char *configPath)
+{
+	char snapshotPath[MAXPGPATH] = { 0 };
+
+	(void) config_snapshot_path(configPath, snapshotPath);
+
+	if (unlink(snapshotPath) != 0 && errno != ENOENT)
+	{
+		log_warn("Failed to remove \"%s\": %m", snapshotPath);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * config_snapshot_path computes the path of the snapshot for the given
+ * configuration file, in the same directory.
+ */
+static void
+config_snapshot_path(const char *configPath, char *snapshotPath)
+{
+	sformat(snapshotPath, MAXPGPATH, "%s%s", configPath, CONFIG_SNAPSHOT_SUFFIX);
+}
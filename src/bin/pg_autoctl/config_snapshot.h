@@ -0,0 +1,49 @@
+/*
+ * src/bin/pg_autoctl/config_snapshot.h
+ *   Binary snapshots of a parsed configuration file, for the CLI.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+
+/* "pgaf" */
+#define CONFIG_SNAPSHOT_MAGIC 0x66616770
+
+/*
+ * A snapshot is only used when the configuration file it has been taken
+ * from is still the same file, with the same size and modification time,
+ * and when it's been written by the same version of pg_autoctl.
+ */
+typedef struct ConfigSnapshotHeader
+{
+	uint32_t magic;
+	uint32_t dataSize;
+	char version[32];
+
+	uint64_t inode;
+	int64_t size;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+} ConfigSnapshotHeader;
+
+
+bool config_snapshot_read(const char *configPath, void *data, size_t size);
+bool config_snapshot_write(const char *configPath,
+						   const ConfigSnapshotHeader *header,
+						   const void *data, size_t size);
+bool config_snapshot_header(const char *configPath,
+							ConfigSnapshotHeader *header,
+							size_t size);
+bool config_snapshot_remove(const char *configPath);
+
+#endif /* CONFIG_SNAPSHOT_H */
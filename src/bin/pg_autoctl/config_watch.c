@@ -0,0 +1,292 @@
+/*
+ * src/bin/pg_autoctl/config_watch.c
+ *   Notice changes to the pg_autoctl configuration files without a SIGHUP.
+ *
+ * On Linux we use inotify on the directories of the watched files, so that
+ * the keeper main loop can wake-up as soon as one of them is edited, even
+ * when a tool replaces the file with a rename(2). Elsewhere the keeper
+ * checks the files signatures at every round instead, which is cheap: a
+ * stat(2) call per file, and reading the file only when the stat changed.
+ *
+ * The same facility is used to wait for Postgres to update its postmaster.pid
+ * file, see config_watch_wait().
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#include "postgres_fe.h"
+
+#include "config_watch.h"
+#include "file_utils.h"
+#include "log.h"
+
+
+static bool config_watch_stat(WatchedFile *file);
+static uint64_t config_watch_hash(const char *data, long size);
+static void config_watch_drain(ConfigWatch *watch);
+
+
+/*
+ * config_watch_init initializes an empty set of watched files.
+ */
+void
+config_watch_init(ConfigWatch *watch)
+{
+	*watch = (ConfigWatch) { 0 };
+
+	watch->fd = -1;
+
+#if defined(__linux__)
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (watch->fd < 0)
+	{
+		log_debug("Failed to initialize inotify: %m");
+	}
+#endif
+}
+
+
+/*
+ * config_watch_add adds the given file to the set of watched files, and
+ * registers its current signature, so that config_watch_check() only reports
+ * changes that happen from now on.
+ */
+bool
+config_watch_add(ConfigWatch *watch, const char *path)
+{
+	if (watch->count >= CONFIG_WATCH_MAX_FILES)
+	{
+		log_error("BUG: config_watch_add: too many files");
+		return false;
+	}
+
+	WatchedFile *file = &(watch->files[watch->count]);
+
+	*file = (WatchedFile) { 0 };
+	strlcpy(file->path, path, sizeof(file->path));
+	file->wd = -1;
+
+#if defined(__linux__)
+	if (watch->fd >= 0)
+	{
+		char directory[MAXPGPATH] = { 0 };
+
+		strlcpy(directory, path, sizeof(directory));
+		get_parent_directory(directory);
+
+		/* editors and config management tools often rename a new file */
+		file->wd = inotify_add_watch(watch->fd, directory,
+									 IN_CLOSE_WRITE | IN_MOVED_TO |
+									 IN_CREATE | IN_DELETE | IN_ATTRIB);
+
+		if (file->wd < 0)
+		{
+			log_debug("Failed to watch directory \"%s\": %m", directory);
+		}
+	}
+#endif
+
+	(void) config_watch_stat(file);
+	file->changed = false;
+
+	++watch->count;
+
+	return true;
+}
+
+
+/*
+ * config_watch_check consumes the pending inotify events, if any, and then
+ * compares the signature of each watched file with the one we registered
+ * previously. It returns true when at least one of the files has changed,
+ * and sets the changed flag of those files.
+ */
+bool
+config_watch_check(ConfigWatch *watch)
+{
+	bool changed = false;
+
+	(void) config_watch_drain(watch);
+
+	for (int i = 0; i < watch->count; i++)
+	{
+		WatchedFile *file = &(watch->files[i]);
+
+		file->changed = config_watch_stat(file);
+
+		if (file->changed)
+		{
+			log_debug("Watched file \"%s\" has changed", file->path);
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+
+/*
+ * config_watch_wait waits until something happens in the directories of the
+ * watched files, or for timeoutMs milliseconds at most, and returns true when
+ * we've been woken up early. Without inotify, we just sleep. The caller then
+ * checks the files, either with config_watch_check() or on its own.
+ */
+bool
+config_watch_wait(ConfigWatch *watch, int timeoutMs)
+{
+	if (watch->fd < 0)
+	{
+		pg_usleep(timeoutMs * 1000L);
+		return false;
+	}
+
+	struct pollfd pollFd = { watch->fd, POLLIN, 0 };
+
+	if (poll(&pollFd, 1, timeoutMs) > 0)
+	{
+		(void) config_watch_drain(watch);
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * config_watch_finish releases the inotify instance.
+ */
+void
+config_watch_finish(ConfigWatch *watch)
+{
+	if (watch->fd >= 0)
+	{
+		close(watch->fd);
+	}
+
+	watch->fd = -1;
+	watch->count = 0;
+}
+
+
+/*
+ * config_watch_stat updates the signature of the given file, and returns
+ * true when the file contents changed since the previous call, including
+ * when the file has been created or removed.
+ */
+static bool
+config_watch_stat(WatchedFile *file)
+{
+	struct stat st;
+
+	if (stat(file->path, &st) != 0)
+	{
+		bool existed = file->exists;
+
+		if (errno != ENOENT)
+		{
+			log_debug("Failed to stat \"%s\": %m", file->path);
+			return false;
+		}
+
+		file->exists = false;
+		file->inode = 0;
+		file->size = 0;
+		file->hash = 0;
+
+		return existed;
+	}
+
+#if defined(__APPLE__)
+	struct timespec mtime = st.st_mtimespec;
+#else
+	struct timespec mtime = st.st_mtim;
+#endif
+
+	if (file->exists &&
+		file->inode == st.st_ino &&
+		file->size == st.st_size &&
+		file->mtime.tv_sec == mtime.tv_sec &&
+		file->mtime.tv_nsec == mtime.tv_nsec)
+	{
+		return false;
+	}
+
+	char *contents = NULL;
+	long size = 0;
+
+	if (!read_file_if_exists(file->path, &contents, &size))
+	{
+		/* removed in between, we see that at the next call */
+		return false;
+	}
+
+	uint64_t hash = config_watch_hash(contents, size);
+	bool changed = !file->exists || hash != file->hash;
+
+	free(contents);
+
+	file->exists = true;
+	file->inode = st.st_ino;
+	file->size = st.st_size;
+	file->mtime = mtime;
+	file->hash = hash;
+
+	return changed;
+}
+
+
+/*
+ * config_watch_hash computes the FNV-1a hash of the given data.
+ */
+static uint64_t
+config_watch_hash(const char *data, long size)
+{
+	uint64_t hash = UINT64_C(14695981039346656037);
+
+	for (long i = 0; i < size; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= UINT64_C(1099511628211);
+	}
+
+	return hash;
+}
+
+
+/*
+ * config_watch_drain reads all the pending inotify events. We don't need
+ * to look at them: any event makes config_watch_check() compare the file
+ * signatures, and other files in the same directories, such as the keeper
+ * state file, don't count as a change.
+ */
+static void
+config_watch_drain(ConfigWatch *watch)
+{
+#if defined(__linux__)
+	char buffer[4096]
+	__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	if (watch->fd < 0)
+	{
+		return;
+	}
+
+	while (read(watch->fd, buffer, sizeof(buffer)) > 0)
+	{
+		/* keep reading until EAGAIN */
+	}
+#endif
+}
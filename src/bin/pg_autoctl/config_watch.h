@@ -0,0 +1,55 @@
+/*
+ * src/bin/pg_autoctl/config_watch.h
+ *   Notice changes to the pg_autoctl configuration files without a SIGHUP.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef CONFIG_WATCH_H
+#define CONFIG_WATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+
+#define CONFIG_WATCH_MAX_FILES 2
+
+/*
+ * We compare a cheap signature of the files, and only hash their contents
+ * when the inode, size, or modification time changed, so that touching a
+ * file or rewriting it with the same contents does not count as a change.
+ */
+typedef struct WatchedFile
+{
+	char path[MAXPGPATH];
+	int wd;                     /* inotify watch descriptor, or -1 */
+
+	bool exists;
+	ino_t inode;
+	off_t size;
+	struct timespec mtime;
+	uint64_t hash;
+
+	bool changed;               /* set by config_watch_check() */
+} WatchedFile;
+
+typedef struct ConfigWatch
+{
+	int fd;                     /* inotify instance, or -1 */
+	int count;
+	WatchedFile files[CONFIG_WATCH_MAX_FILES];
+} ConfigWatch;
+
+
+void config_watch_init(ConfigWatch *watch);
+bool config_watch_add(ConfigWatch *watch, const char *path);
+bool config_watch_check(ConfigWatch *watch);
+bool config_watch_wait(ConfigWatch *watch, int timeoutMs);
+void config_watch_finish(ConfigWatch *watch);
+
+#endif /* CONFIG_WATCH_H */
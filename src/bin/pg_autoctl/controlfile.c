@@ -0,0 +1,435 @@
+/*
+ * src/bin/pg_autoctl/controlfile.c
+ *   Read the Postgres control file directly, without running pg_controldata.
+ *
+ * The keeper needs a couple fields from $PGDATA/global/pg_control at every
+ * loop where Postgres is not running, and forking pg_controldata for that
+ * costs way more than reading the file. We can't include the server header
+ * catalog/pg_control.h here, because pgsetup.h has its own copy of DBState,
+ * and anyway the layout depends on the Postgres major version of PGDATA,
+ * which might not be the one pg_autoctl has been compiled against.
+ *
+ * The fields we use are all found at the beginning of ControlFileData, where
+ * the layout has been stable since Postgres 10, apart from prevCheckPoint
+ * that has been removed in Postgres 11. When we don't know the version of
+ * the control file, or when it fails its CRC check, the caller falls back to
+ * running pg_controldata, which knows better.
+ *
+ * After a crash, Postgres replays the WAL from the redo location of the last
+ * checkpoint to the end of WAL. We also find out where the WAL ends from the
+ * first page header of the segment files in pg_wal, so that the keeper can
+ * estimate how long crash recovery is going to take.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "controlfile.h"
+#include "file_utils.h"
+#include "log.h"
+
+/*
+ * From postgres:src/include/catalog/pg_control.h, Postgres reads and checks
+ * at most that many bytes of the control file.
+ */
+#define PG_CONTROL_MAX_SAFE_SIZE 512
+
+/*
+ * Offsets of the fields we read in ControlFileData:
+ *
+ *   uint64 system_identifier;
+ *   uint32 pg_control_version;
+ *   uint32 catalog_version_no;
+ *   DBState state;
+ *   pg_time_t time;
+ *   XLogRecPtr checkPoint;
+ *   XLogRecPtr prevCheckPoint;     (Postgres 10 only)
+ *   CheckPoint checkPointCopy;     (redo, then ThisTimeLineID)
+ */
+#define CONTROL_OFFSET_SYSTEM_IDENTIFIER 0
+#define CONTROL_OFFSET_CONTROL_VERSION 8
+#define CONTROL_OFFSET_CATALOG_VERSION 12
+#define CONTROL_OFFSET_STATE 16
+#define CONTROL_OFFSET_CHECKPOINT 32
+#define CONTROL_OFFSET_REDO_PG10 48
+#define CONTROL_OFFSET_REDO 40
+#define CONTROL_OFFSET_TIMELINE_PG10 56
+#define CONTROL_OFFSET_TIMELINE 48
+
+/*
+ * The crc field is the last one of ControlFileData, and we don't know where
+ * that is without the whole struct definition for each version. It's always
+ * aligned on 4 bytes and found after the fields we read, so we look for it.
+ */
+#define CONTROL_CRC_MIN_OFFSET 64
+
+/*
+ * From postgres:src/include/access/xlog_internal.h, a WAL segment file name
+ * is made of 24 hexadecimal digits, and the first page of each segment has a
+ * long header XLogLongPageHeaderData:
+ *
+ *   uint16 xlp_magic;
+ *   uint16 xlp_info;
+ *   TimeLineID xlp_tli;
+ *   XLogRecPtr xlp_pageaddr;
+ *   uint64 xlp_sysid;
+ *   uint32 xlp_seg_size;
+ *   uint32 xlp_xlog_blcksz;
+ *
+ * Postgres recycles old segments by renaming them to future names, and those
+ * still contain their previous page address until they're written again.
+ */
+#define WAL_FILE_NAME_LENGTH 24
+#define WAL_PAGE_HEADER_SIZE 32
+#define WAL_OFFSET_PAGEADDR 8
+#define WAL_OFFSET_SEG_SIZE 24
+
+static bool controlfile_version_is_supported(uint32_t pg_control_version);
+static bool controlfile_wal_segment_is_valid(const char *path,
+											 uint32_t log, uint32_t seg,
+											 uint64_t *segmentSize);
+static bool controlfile_check_crc(const unsigned char *buffer);
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *data, size_t len);
+
+
+/*
+ * controlfile_read reads the given control file and fills in the control
+ * data. It returns false when the file could not be read, has an unknown
+ * version, or fails its CRC check, and the caller should then run
+ * pg_controldata instead.
+ */
+bool
+controlfile_read(const char *globalControlPath, PostgresControlData *control)
+{
+	unsigned char buffer[PG_CONTROL_MAX_SAFE_SIZE] = { 0 };
+
+	int fd = open(globalControlPath, O_RDONLY, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to open file \"%s\": %m", globalControlPath);
+		return false;
+	}
+
+	ssize_t bytes = read(fd, buffer, sizeof(buffer));
+	int savedErrno = errno;
+
+	close(fd);
+
+	if (bytes != sizeof(buffer))
+	{
+		errno = savedErrno;
+
+		if (bytes < 0)
+		{
+			log_debug("Failed to read file \"%s\": %m", globalControlPath);
+		}
+		else
+		{
+			log_debug("Failed to read file \"%s\": read %zd of %d bytes",
+					  globalControlPath, bytes, PG_CONTROL_MAX_SAFE_SIZE);
+		}
+		return false;
+	}
+
+	uint32_t pg_control_version = 0;
+
+	memcpy(&pg_control_version,
+		   buffer + CONTROL_OFFSET_CONTROL_VERSION,
+		   sizeof(uint32_t));
+
+	if (!controlfile_version_is_supported(pg_control_version))
+	{
+		log_debug("Control file \"%s\" has version %u, "
+				  "which pg_autoctl can't read directly",
+				  globalControlPath, pg_control_version);
+		return false;
+	}
+
+	if (!controlfile_check_crc(buffer))
+	{
+		log_debug("Control file \"%s\" failed its CRC check",
+				  globalControlPath);
+		return false;
+	}
+
+	PostgresControlData data = { 0 };
+	uint32_t state = 0;
+	uint64_t checkPoint = 0;
+	uint64_t redo = 0;
+	int redoOffset =
+		pg_control_version < 1100
+		? CONTROL_OFFSET_REDO_PG10
+		: CONTROL_OFFSET_REDO;
+	int timelineOffset =
+		pg_control_version < 1100
+		? CONTROL_OFFSET_TIMELINE_PG10
+		: CONTROL_OFFSET_TIMELINE;
+
+	memcpy(&(data.system_identifier),
+		   buffer + CONTROL_OFFSET_SYSTEM_IDENTIFIER,
+		   sizeof(uint64_t));
+
+	data.pg_control_version = pg_control_version;
+
+	memcpy(&(data.catalog_version_no),
+		   buffer + CONTROL_OFFSET_CATALOG_VERSION,
+		   sizeof(uint32_t));
+
+	memcpy(&state, buffer + CONTROL_OFFSET_STATE, sizeof(uint32_t));
+	memcpy(&checkPoint, buffer + CONTROL_OFFSET_CHECKPOINT, sizeof(uint64_t));
+	memcpy(&redo, buffer + redoOffset, sizeof(uint64_t));
+	memcpy(&(data.timeline_id), buffer + timelineOffset, sizeof(uint32_t));
+
+	if (state > DB_IN_PRODUCTION)
+	{
+		log_debug("Control file \"%s\" has unknown state %u",
+				  globalControlPath, state);
+		return false;
+	}
+
+	data.state = (DBState) state;
+
+	/* same format as pg_controldata, see LSN_FORMAT_ARGS */
+	sformat(data.latestCheckpointLSN, sizeof(data.latestCheckpointLSN),
+			"%X/%X",
+			(uint32_t) (checkPoint >> 32),
+			(uint32_t) checkPoint);
+
+	sformat(data.latestCheckpointRedoLSN, sizeof(data.latestCheckpointRedoLSN),
+			"%X/%X",
+			(uint32_t) (redo >> 32),
+			(uint32_t) redo);
+
+	*control = data;
+
+	return true;
+}
+
+
+/*
+ * controlfile_wal_end_lsn finds the end of the last WAL segment of PGDATA
+ * that has been written to since it was created or recycled. That's where
+ * crash recovery stops at the latest, so the result is an upper bound of the
+ * end of WAL, off by at most a segment size.
+ */
+bool
+controlfile_wal_end_lsn(const char *pgdata, uint64_t *walEndLSN)
+{
+	char walDirectory[MAXPGPATH] = { 0 };
+	struct dirent *entry = NULL;
+	uint64_t endLSN = 0;
+
+	join_path_components(walDirectory, pgdata, "pg_wal");
+
+	DIR *dir = opendir(walDirectory);
+
+	if (dir == NULL)
+	{
+		log_error("Failed to open directory \"%s\": %m", walDirectory);
+		return false;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		char path[MAXPGPATH] = { 0 };
+		uint32_t tli = 0;
+		uint32_t log = 0;
+		uint32_t seg = 0;
+		uint64_t segmentSize = 0;
+
+		if (strlen(entry->d_name) != WAL_FILE_NAME_LENGTH ||
+			strspn(entry->d_name, "0123456789ABCDEF") != WAL_FILE_NAME_LENGTH ||
+			sscanf(entry->d_name, "%08X%08X%08X", &tli, &log, &seg) != 3)
+		{
+			continue;
+		}
+
+		join_path_components(path, walDirectory, entry->d_name);
+
+		if (!controlfile_wal_segment_is_valid(path, log, seg, &segmentSize))
+		{
+			continue;
+		}
+
+		uint64_t segmentsPerLog = UINT64_C(0x100000000) / segmentSize;
+		uint64_t segmentEnd = (log * segmentsPerLog + seg + 1) * segmentSize;
+
+		if (segmentEnd > endLSN)
+		{
+			endLSN = segmentEnd;
+		}
+	}
+
+	closedir(dir);
+
+	if (endLSN == 0)
+	{
+		log_warn("Failed to find a WAL segment in \"%s\"", walDirectory);
+		return false;
+	}
+
+	*walEndLSN = endLSN;
+
+	return true;
+}
+
+
+/*
+ * controlfile_wal_segment_is_valid returns true when the first page of the
+ * given WAL segment file has been written for the segment that its name
+ * designates, rather than being left over from before it was recycled.
+ */
+static bool
+controlfile_wal_segment_is_valid(const char *path,
+								 uint32_t log, uint32_t seg,
+								 uint64_t *segmentSize)
+{
+	unsigned char header[WAL_PAGE_HEADER_SIZE] = { 0 };
+	uint64_t pageAddr = 0;
+	uint32_t segSize = 0;
+
+	int fd = open(path, O_RDONLY, 0);
+
+	if (fd < 0)
+	{
+		log_debug("Failed to open file \"%s\": %m", path);
+		return false;
+	}
+
+	ssize_t bytes = read(fd, header, sizeof(header));
+
+	close(fd);
+
+	if (bytes != sizeof(header))
+	{
+		return false;
+	}
+
+	memcpy(&pageAddr, header + WAL_OFFSET_PAGEADDR, sizeof(uint64_t));
+	memcpy(&segSize, header + WAL_OFFSET_SEG_SIZE, sizeof(uint32_t));
+
+	/* segment sizes are powers of two from 1MB to 1GB */
+	if (segSize < 1024 * 1024 || segSize > 1024 * 1024 * 1024 ||
+		(segSize & (segSize - 1)) != 0)
+	{
+		return false;
+	}
+
+	uint64_t segmentsPerLog = UINT64_C(0x100000000) / segSize;
+	uint64_t segmentStart = ((uint64_t) log * segmentsPerLog + seg) * segSize;
+
+	if (pageAddr != segmentStart)
+	{
+		return false;
+	}
+
+	*segmentSize = segSize;
+
+	return true;
+}
+
+
+/*
+ * controlfile_version_is_supported returns true when we know where to find
+ * our fields in a control file of the given version.
+ */
+static bool
+controlfile_version_is_supported(uint32_t pg_control_version)
+{
+	switch (pg_control_version)
+	{
+		case 1002:              /* Postgres 10 */
+		case 1100:              /* Postgres 11 */
+		case 1201:              /* Postgres 12 */
+		case 1300:              /* Postgres 13 to 16 */
+		{
+			return true;
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
+
+
+/*
+ * controlfile_check_crc looks for the CRC-32C of the bytes that precede it
+ * in the control file, as computed by Postgres. A random match when the file
+ * is corrupted is about as likely as a CRC collision at a known offset.
+ */
+static bool
+controlfile_check_crc(const unsigned char *buffer)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	crc = crc32c_update(crc, buffer, CONTROL_CRC_MIN_OFFSET);
+
+	for (int offset = CONTROL_CRC_MIN_OFFSET;
+		 offset + sizeof(uint32_t) <= PG_CONTROL_MAX_SAFE_SIZE;
+		 offset += sizeof(uint32_t))
+	{
+		uint32_t stored = 0;
+		uint32_t computed = crc ^ 0xFFFFFFFF;
+
+		memcpy(&stored, buffer + offset, sizeof(uint32_t));
+
+		if (stored == computed)
+		{
+			return true;
+		}
+
+		crc = crc32c_update(crc, buffer + offset, sizeof(uint32_t));
+	}
+
+	return false;
+}
+
+
+/*
+ * crc32c_update adds the given bytes to a CRC-32C computation, using the
+ * same Castagnoli polynomial as Postgres, one byte at a time. We only ever
+ * hash a few hundred bytes, so that's fast enough.
+ */
+static uint32_t
+crc32c_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+	static uint32_t table[256] = { 0 };
+	static bool tableIsReady = false;
+
+	if (!tableIsReady)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+			}
+
+			table[i] = value;
+		}
+
+		tableIsReady = true;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
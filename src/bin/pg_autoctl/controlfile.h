@@ -0,0 +1,22 @@
+/*
+ * src/bin/pg_autoctl/controlfile.h
+ *   Read the Postgres control file directly, without running pg_controldata.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef CONTROLFILE_H
+#define CONTROLFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsetup.h"
+
+bool controlfile_read(const char *globalControlPath,
+					  PostgresControlData *control);
+bool controlfile_wal_end_lsn(const char *pgdata, uint64_t *walEndLSN);
+
+#endif /* CONTROLFILE_H */
@@ -26,6 +26,18 @@
 /* environment variable for containing the id of the logging semaphore */
 #define PG_AUTOCTL_LOG_SEMAPHORE "PG_AUTOCTL_LOG_SEMAPHORE"
 
+/* environment variable to select the log format, either "text" or "json" */
+#define PG_AUTOCTL_LOG_FORMAT "PG_AUTOCTL_LOG_FORMAT"
+
+/* environment variable for containing the id of the metrics shared memory */
+#define PG_AUTOCTL_METRICS_SHMID "PG_AUTOCTL_METRICS_SHMID"
+
+/* environment variable for containing the id of the node-probe shared memory */
+#define PG_AUTOCTL_NODE_PROBE_SHMID "PG_AUTOCTL_NODE_PROBE_SHMID"
+
+/* environment variable for containing the id of the shared state memory */
+#define PG_AUTOCTL_SHARED_STATE_SHMID "PG_AUTOCTL_SHARED_STATE_SHMID"
+
 /* environment variable for --monitor, when used instead of --pgdata */
 #define PG_AUTOCTL_MONITOR "PG_AUTOCTL_MONITOR"
 
@@ -39,11 +51,45 @@
 #define REPLICATION_SLOT_NAME_PATTERN "^pgautofailover_standby_"
 #define REPLICATION_PASSWORD_DEFAULT NULL
 #define REPLICATION_APPLICATION_NAME_PREFIX "pgautofailover_standby_"
+
+/* no standby uses that name, commits wait forever when it's required */
+#define PG_AUTOCTL_FENCE_STANDBY_NAME "pgautofailover_fence"
+#define PG_AUTOCTL_FENCE_RELOAD_TIMEOUT 5 /* seconds */
 #define FORMATION_DEFAULT "default"
 #define GROUP_ID_DEFAULT 0
 #define POSTGRES_CONNECT_TIMEOUT "2"
+#define POSTGRES_KEEPALIVES 1            /* 0 uses the OS defaults */
+#define POSTGRES_KEEPALIVES_IDLE 10      /* seconds */
+#define POSTGRES_KEEPALIVES_INTERVAL 2   /* seconds */
+#define POSTGRES_KEEPALIVES_COUNT 3
+#define POSTGRES_TCP_USER_TIMEOUT 10     /* seconds, 0 uses the OS default */
 #define MAXIMUM_BACKUP_RATE "100M"
 #define MAXIMUM_BACKUP_RATE_LEN 32
+#define BACKUP_COMPRESSION_LEN 64
+#define REWIND_THRESHOLD 100 /* percent of the data size, 0 always rewinds */
+#define SLOT_ADVANCE_THRESHOLD (16 * 1024 * 1024) /* bytes, 0 always advances */
+#define MAINTENANCE_DRAIN_LAG (16 * 1024 * 1024) /* bytes */
+#define REBUILD_NICE 0       /* 0 runs pg_basebackup and pg_rewind as-is */
+#define REBUILD_IO_CLASS_LEN 32
+#define WAL_FETCH_WORKERS 0  /* 0 fetches missing WAL by streaming only */
+#define PG_AUTOCTL_MAX_WAL_FETCH_WORKERS 16
+#define PG_AUTOCTL_BASEBACKUP_PROGRESS_INTERVAL 10 /* seconds */
+#define METRICS_PORT 0 /* 0 disables the metrics service */
+#define SERVICE_NICE 0 /* 0 keeps the nice value of the supervisor */
+#define MONITOR_PROXY 0 /* 0 disables the monitor-proxy service */
+#define NODE_PROBE 1 /* 0 runs the probes in the node-active service */
+#define WATCH_CONFIG 0 /* 0 only reloads the configuration on SIGHUP */
+#define MONITOR_WAIT 0 /* 0 waits for monitor state changes with LISTEN */
+#define ROUTER_PORT 0 /* 0 disables the router service */
+#define READ_ONLY_FENCING 0 /* 0 stops Postgres when demoting a primary */
+#define HBA_COMPACT 0 /* 0 adds two HBA rules per node of the group */
+#define MONITOR_TAKEOVER_TIMEOUT 0 /* seconds, 0 never promotes a standby */
+
+/* keepers that can't reach the monitor say so to a standby monitor */
+#define MONITOR_LOST_CONTACT_APPLICATION_NAME_PREFIX "pgautofailover_lost_monitor_"
+#define MONITOR_LOST_CONTACT_RETRY_TIME 10 /* seconds */
+#define MONITOR_LOST_CONTACT_CONNECT_TIMEOUT "2" /* seconds, per host */
+#define PG_AUTOCTL_MONITOR_WAIT_MARGIN 1000 /* milliseconds */
 
 
 /*
@@ -67,14 +113,55 @@
 #define POSTGRES_PING_RETRY_CAP_SLEEP_TIME (2 * 1000) /* milliseconds */
 #define POSTGRES_PING_RETRY_BASE_SLEEP_TIME 5         /* milliseconds */
 
+/* stop connecting to an unreachable monitor at every keeper loop */
+#define MONITOR_CIRCUIT_BREAKER_THRESHOLD 3                  /* failures */
+#define MONITOR_CIRCUIT_BREAKER_BASE_SLEEP_TIME (1 * 1000)   /* milliseconds */
+#define MONITOR_CIRCUIT_BREAKER_CAP_SLEEP_TIME (5 * 1000)    /* milliseconds */
+
 #define PG_AUTOCTL_MONITOR_DISABLED "PG_AUTOCTL_DISABLED"
 
 #define NETWORK_PARTITION_TIMEOUT 20
+#define NETWORK_PARTITION_PROBE_TIMEOUT 0       /* ms, 0 disables probing */
+#define NETWORK_PARTITION_PROBE_MIN_TIMEOUT 2000 /* ms */
 #define PREPARE_PROMOTION_CATCHUP_TIMEOUT 30
 #define PREPARE_PROMOTION_WALRECEIVER_TIMEOUT 5
+#define PREWARM_BUDGET 0 /* seconds, 0 disables prewarming */
+#define SYNC_REP_STALL_TIMEOUT 0 /* milliseconds, 0 disables the watchdog */
+#define PRIMARY_CHANGE_HOOKS_TIMEOUT 2000 /* milliseconds */
+#define MAINTENANCE_DRAIN_TIMEOUT 0 /* milliseconds, 0 disables the staged drain */
+#define CRASH_RECOVERY_TIMEOUT 0 /* seconds, 0 waits for crash recovery */
+#define LOCAL_QUERY_TIMEOUT 10000 /* milliseconds, 0 disables the deadline */
+#define STORAGE_PROBE_INTERVAL 5000 /* milliseconds, 0 disables the probes */
+
+#define PG_AUTOCTL_PREWARM_REFRESH_TIME 300 /* seconds */
+#define PG_AUTOCTL_REPLICATION_STATS_REPORT_INTERVAL 1 /* seconds */
+#define PG_AUTOCTL_REPLAY_PROGRESS_REPORT_INTERVAL 10 /* seconds */
+#define PG_AUTOCTL_WAL_RECEIVER_STALL_TIME 2000 /* milliseconds */
+#define PG_AUTOCTL_LOCAL_QUERY_TIMEOUT_COUNT 3 /* timeouts in a row */
+#define PG_AUTOCTL_LATENCY_PROBE_INTERVAL 60 /* seconds */
+#define PG_AUTOCTL_LATENCY_PROBE_TIMEOUT 1000 /* milliseconds */
+#define PG_AUTOCTL_PREWARM_MAX_RELATIONS 64
+#define PG_AUTOCTL_MAX_HOOKS 16
+#define PG_AUTOCTL_CRASH_RECOVERY_REPLAY_RATE (64 * 1024 * 1024) /* bytes/s */
+
+/* ALTER EXTENSION UPDATE on the monitor, see monitor_extension_update */
+#define PG_AUTOCTL_EXTENSION_UPDATE_LOCK_TIMEOUT 2000 /* milliseconds */
+#define PG_AUTOCTL_EXTENSION_UPDATE_ATTEMPTS 10
+#define PG_AUTOCTL_EXTENSION_UPDATE_COPY_RATE (32 * 1024 * 1024) /* bytes/s */
+#define PG_AUTOCTL_EXTENSION_UPDATE_STEP_TIME 100 /* milliseconds */
 
 #define PG_AUTOCTL_KEEPER_SLEEP_TIME 1      /* seconds */
+#define PG_AUTOCTL_KEEPER_MIN_REPORT_INTERVAL 100         /* milliseconds */
+#define PG_AUTOCTL_KEEPER_MAX_REPORT_INTERVAL (10 * 1000) /* milliseconds */
 #define PG_AUTOCTL_KEEPER_RETRY_TIME_MS 350 /* milliseconds */
+#define PG_AUTOCTL_KEEPER_STATE_CONTACT_REFRESH_TIME 5 /* seconds */
+#define PG_AUTOCTL_KEEPER_ROUND_TIMEOUT 20 /* seconds */
+#define PG_AUTOCTL_KEEPER_LOOP_OVERRUN_TOLERANCE 1000 /* milliseconds */
+#define PG_AUTOCTL_SLOW_FSYNC_WARNING_MS 100         /* milliseconds */
+#define PG_AUTOCTL_IO_WATCHDOG_WINDOW 64 /* probes */
+#define PG_AUTOCTL_IO_WATCHDOG_STALL_WARNING_MS 1000 /* milliseconds */
+#define PG_AUTOCTL_WAL_SPACE_SAMPLE_TIME 10 /* seconds */
+#define PG_AUTOCTL_NODE_PROBE_INTERVAL 1000 /* milliseconds */
 #define PG_AUTOCTL_MONITOR_SLEEP_TIME 10 /* seconds */
 #define PG_AUTOCTL_MONITOR_RETRY_TIME 1  /* seconds */
 
@@ -82,6 +169,12 @@
 
 #define COORDINATOR_IS_READY_TIMEOUT 300
 
+/* hostname resolution cache, see ipaddr.c */
+#define DNS_CACHE_SIZE 64
+#define DNS_CACHE_TTL 60            /* seconds */
+#define DNS_CACHE_NEGATIVE_TTL 10   /* seconds */
+#define DNS_CACHE_STALE_TTL 600     /* seconds */
+
 #define POSTGRESQL_FAILS_TO_START_TIMEOUT 20
 #define POSTGRESQL_FAILS_TO_START_RETRIES 3
 
@@ -112,13 +205,18 @@
 #define KEEPER_CONFIGURATION_FILENAME "pg_autoctl.cfg"
 #define KEEPER_STATE_FILENAME "pg_autoctl.state"
 #define KEEPER_PID_FILENAME "pg_autoctl.pid"
+#define KEEPER_MONITOR_PROXY_SOCKET_FILENAME "pg_autoctl.monitor.sock"
 #define KEEPER_INIT_STATE_FILENAME "pg_autoctl.init"
 #define KEEPER_POSTGRES_STATE_FILENAME "pg_autoctl.pg"
 #define KEEPER_NODES_FILENAME "nodes.json"
+#define KEEPER_TIMINGS_FILENAME "pg_autoctl.timings"
 
 #define KEEPER_SYSTEMD_SERVICE "pgautofailover"
 #define KEEPER_SYSTEMD_FILENAME "pgautofailover.service"
 
+/* systemd restarts pg_autoctl when we miss the watchdog for that long */
+#define SYSTEMD_WATCHDOG_SEC 30 /* seconds */
+
 /* pg_auto_failover monitor related constants */
 #define PG_AUTOCTL_HEALTH_USERNAME "pgautofailover_monitor"
 #define PG_AUTOCTL_HEALTH_PASSWORD "pgautofailover_monitor"
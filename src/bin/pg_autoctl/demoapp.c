@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <termios.h>
 #include <time.h>
@@ -20,16 +21,78 @@
 #include "defaults.h"
 #include "demoapp.h"
 #include "env_utils.h"
+#include "file_utils.h"
+#include "histogram.h"
 #include "log.h"
 #include "monitor.h"
+#include "parson.h"
 #include "pgsql.h"
 #include "signals.h"
 #include "string_utils.h"
 
 #include "runprogram.h"
 
+/* macOS only has MAP_ANON */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define DEMO_BENCH_MAX_OUTAGES 32
+#define DEMO_BENCH_MAX_FAILOVERS 32
+
+/*
+ * A client outage is the time between the last successful write before a
+ * failure, and the first successful write after it.
+ */
+typedef struct DemoBenchOutage
+{
+	uint64_t startUs;
+	uint64_t endUs;
+} DemoBenchOutage;
+
+typedef struct DemoBenchClient
+{
+	LatencyHistogram connect;
+	LatencyHistogram read;
+	LatencyHistogram write;
+
+	uint64_t readErrors;
+	uint64_t writeErrors;
+	uint64_t reconnections;
+
+	int outageCount;
+	DemoBenchOutage outages[DEMO_BENCH_MAX_OUTAGES];
+} DemoBenchClient;
+
+typedef struct DemoBenchFailover
+{
+	uint64_t requestedUs;
+	uint64_t primaryUs;         /* 0 when no new primary has been reported */
+} DemoBenchFailover;
+
+/*
+ * DemoBenchResults is shared between the benchmark sub-processes, in an
+ * anonymous shared memory mapping that they inherit at fork() time. Each
+ * client only writes to its own slot, and the failover process only writes
+ * to the failovers array, so we don't need any locking.
+ */
+typedef struct DemoBenchResults
+{
+	uint64_t startUs;
+	uint64_t startTime;
+
+	int failoverCount;
+	DemoBenchFailover failovers[DEMO_BENCH_MAX_FAILOVERS];
+
+	DemoBenchClient clients[MAX_CLIENTS_COUNT + 1];
+} DemoBenchResults;
+
 static void demoapp_set_retry_policy(PGSQL *pgsql, int cap, int sleepTime);
 
+static bool demoapp_run_clients(const char *pguri,
+								DemoAppOptions *demoAppOptions,
+								DemoBenchResults *results);
+
 static bool demoapp_register_client(const char *pguri,
 									int clientId, int retrySleep, int retryCap);
 
@@ -46,7 +109,23 @@ static bool demoapp_wait_for_clients(pid_t clientsPidArray[],
 static void demoapp_terminate_clients(pid_t clientsPidArray[],
 									  int startedClientsCount);
 
-static void demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions);
+static void demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions,
+											   DemoBenchResults *results);
+
+static uint64_t demoapp_now_us(void);
+static void demoapp_bench_client(const char *pguri,
+								 int clientId,
+								 DemoAppOptions *demoAppOptions,
+								 DemoBenchClient *stats);
+static void demoapp_bench_report_outages(DemoAppOptions *demoAppOptions,
+										 DemoBenchResults *results);
+static void demoapp_bench_record_outage(DemoBenchClient *stats,
+										uint64_t startUs, uint64_t endUs);
+static JSON_Value * demoapp_bench_to_json(DemoAppOptions *demoAppOptions,
+										  DemoBenchResults *results);
+static JSON_Value * demoapp_bench_failover_to_json(DemoAppOptions *demoAppOptions,
+												   DemoBenchResults *results,
+												   int index);
 
 static int demoapp_get_terminal_columns(void);
 
@@ -148,6 +227,8 @@ demoapp_prepare_schema(const char *pguri)
 		"client integer, loop integer, retries integer, us bigint, recovery bool)",
 		"create table demo.client(client integer, pid integer, "
 		"retry_sleep_ms integer, retry_cap_ms integer, failover_count integer)",
+		"create table demo.bench(client integer, loop bigint, "
+		"ts timestamptz default now(), primary key(client, loop))",
 		NULL
 	};
 
@@ -180,6 +261,19 @@ demoapp_prepare_schema(const char *pguri)
  */
 bool
 demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions)
+{
+	return demoapp_run_clients(pguri, demoAppOptions, NULL);
+}
+
+
+/*
+ * demoapp_run_clients runs the failover process and the clients
+ * sub-processes, either the demo clients, or the benchmark clients when
+ * results is not NULL.
+ */
+static bool
+demoapp_run_clients(const char *pguri, DemoAppOptions *demoAppOptions,
+					DemoBenchResults *results)
 {
 	int clientsCount = demoAppOptions->clientsCount;
 	int startedClientsCount = 0;
@@ -227,7 +321,13 @@ demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions)
 
 				if (index == 0)
 				{
-					(void) demoapp_process_perform_switchover(demoAppOptions);
+					(void) demoapp_process_perform_switchover(demoAppOptions,
+															  results);
+				}
+				else if (results != NULL)
+				{
+					(void) demoapp_bench_client(pguri, index, demoAppOptions,
+												&(results->clients[index]));
 				}
 				else
 				{
@@ -350,10 +450,13 @@ demoapp_terminate_clients(pid_t clientsPidArray[], int startedClientsCount)
 
 /*
  * demoapp_perform_switchover performs a switchover while the demo application
- * is running, once in a while
+ * is running, once in a while. When results is not NULL, the time when each
+ * failover is requested and when a new primary is reported are recorded
+ * there.
  */
 static void
-demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
+demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions,
+								   DemoBenchResults *results)
 {
 	Monitor monitor = { 0 };
 	char *channels[] = { "state", NULL };
@@ -363,6 +466,7 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 
 	bool durationElapsed = false;
 	uint64_t startTime = time(NULL);
+	int previousFailoverSecond = -1;
 
 	if (!demoAppOptions->doFailover)
 	{
@@ -409,16 +513,24 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 		 * - we went past firstFailover already and current second is a
 		 *   multiple of the failover frequency (failover every failoverFreq
 		 *   seconds after the first failover).
+		 *
+		 * - we didn't failover already in the current second.
 		 */
-		if (currentSecond != demoAppOptions->firstFailover ||
+		bool isFailoverTime =
+			currentSecond == demoAppOptions->firstFailover ||
 			(currentSecond > demoAppOptions->firstFailover &&
+			 demoAppOptions->failoverFreq > 0 &&
 			 ((currentSecond - demoAppOptions->firstFailover) %
-			  demoAppOptions->failoverFreq) != 0))
+			  demoAppOptions->failoverFreq) == 0);
+
+		if (!isFailoverTime || currentSecond == previousFailoverSecond)
 		{
-			pg_usleep(500);
+			pg_usleep(100 * 1000); /* 100 ms */
 			continue;
 		}
 
+		previousFailoverSecond = currentSecond;
+
 		log_info("pg_autoctl perform failover");
 
 		/* start listening to the state changes before we perform_failover */
@@ -429,6 +541,15 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 			continue;
 		}
 
+		DemoBenchFailover *failover = NULL;
+
+		if (results != NULL && results->failoverCount < DEMO_BENCH_MAX_FAILOVERS)
+		{
+			failover = &(results->failovers[results->failoverCount]);
+			failover->requestedUs = demoapp_now_us();
+			failover->primaryUs = 0;
+		}
+
 		if (!monitor_perform_failover(&monitor, formation, groupId))
 		{
 			log_fatal("Failed to perform failover/switchover, "
@@ -439,6 +560,12 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 			continue;
 		}
 
+		/* the failover has been requested, account for it */
+		if (failover != NULL)
+		{
+			++results->failoverCount;
+		}
+
 		/* process state changes notification until we have a new primary */
 		if (!monitor_wait_until_some_node_reported_state(
 				&monitor,
@@ -451,6 +578,11 @@ demoapp_process_perform_switchover(DemoAppOptions *demoAppOptions)
 			log_error("Failed to wait until a new primary has been notified");
 			continue;
 		}
+
+		if (failover != NULL)
+		{
+			failover->primaryUs = demoapp_now_us();
+		}
 	}
 }
 
@@ -715,6 +847,604 @@ demoapp_start_client(const char *pguri, int clientId,
 }
 
 
+/*
+ * demoapp_bench runs the benchmark clients and the failover process for the
+ * given duration, and then exports the results as JSON, either to stdout or
+ * to the --output file.
+ */
+bool
+demoapp_bench(const char *pguri, DemoAppOptions *demoAppOptions)
+{
+	size_t size = sizeof(DemoBenchResults);
+
+	DemoBenchResults *results =
+		(DemoBenchResults *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+								  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (results == MAP_FAILED)
+	{
+		log_error("Failed to allocate shared memory for the benchmark: %m");
+		return false;
+	}
+
+	memset(results, 0, size);
+
+	results->startUs = demoapp_now_us();
+	results->startTime = time(NULL);
+
+	log_info("Starting the benchmark with %d clients for %ds, "
+			 "at %d transactions per second per client with %d%% reads",
+			 demoAppOptions->clientsCount,
+			 demoAppOptions->duration,
+			 demoAppOptions->rate,
+			 demoAppOptions->readRatio);
+
+	bool success = demoapp_run_clients(pguri, demoAppOptions, results);
+
+	JSON_Value *js = demoapp_bench_to_json(demoAppOptions, results);
+	char *serialized = json_serialize_to_string_pretty(js);
+
+	if (IS_EMPTY_STRING_BUFFER(demoAppOptions->outputFilename))
+	{
+		fformat(stdout, "%s\n", serialized);
+	}
+	else if (!write_file(serialized, strlen(serialized),
+						 demoAppOptions->outputFilename))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+	else
+	{
+		log_info("Wrote benchmark results to \"%s\"",
+				 demoAppOptions->outputFilename);
+	}
+
+	json_free_serialized_string(serialized);
+	json_value_free(js);
+
+	if (demoAppOptions->reportOutages)
+	{
+		(void) demoapp_bench_report_outages(demoAppOptions, results);
+	}
+
+	(void) munmap(results, size);
+
+	return success;
+}
+
+
+/*
+ * demoapp_now_us returns the current time from a monotonic clock, in
+ * microseconds. The clock is shared by all the processes on the system, so
+ * that the benchmark clients and the failover process timings compare.
+ */
+static uint64_t
+demoapp_now_us()
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	return (uint64_t) INSTR_TIME_GET_MICROSEC(now);
+}
+
+
+/*
+ * demoapp_bench_client runs a benchmark client: it uses a single connection
+ * for as long as it works, and runs a mix of reads and writes at the target
+ * rate. When a query fails, the client reconnects, using a retry policy that
+ * retries quickly so that we measure when writes are possible again.
+ */
+static void
+demoapp_bench_client(const char *pguri, int clientId,
+					 DemoAppOptions *demoAppOptions,
+					 DemoBenchClient *stats)
+{
+	PGSQL pgsql = { 0 };
+
+	uint64_t startUs = demoapp_now_us();
+	uint64_t endUs = startUs + (uint64_t) demoAppOptions->duration * 1000000;
+	uint64_t intervalUs =
+		demoAppOptions->rate > 0 ? 1000000 / demoAppOptions->rate : 0;
+	uint64_t nextUs = startUs;
+
+	uint64_t lastWriteUs = 0;
+	bool needReconnect = false;
+	int64_t lastKey = -1;
+
+	/* initialize a seed for our random number generator */
+	pg_srand48(((unsigned int) (getpid() ^ time(NULL))));
+
+	(void) histogram_init(&(stats->connect));
+	(void) histogram_init(&(stats->read));
+	(void) histogram_init(&(stats->write));
+
+	pgsql_init(&pgsql, (char *) pguri, PGSQL_CONN_APP);
+
+	for (int64_t loop = 0;; loop++)
+	{
+		uint64_t now = demoapp_now_us();
+
+		if (now >= endUs)
+		{
+			break;
+		}
+
+		/* pace ourselves, and don't try to catch-up when we're late */
+		if (intervalUs > 0)
+		{
+			if (now < nextUs)
+			{
+				pg_usleep(nextUs - now);
+			}
+
+			nextUs += intervalUs;
+
+			if (nextUs < now)
+			{
+				nextUs = now;
+			}
+		}
+
+		bool isRead = lastKey >= 0 &&
+					  random_between(1, 100) <= demoAppOptions->readRatio;
+		bool connecting = pgsql.connection == NULL;
+
+		const Oid paramTypes[2] = { INT4OID, INT8OID };
+		const char *paramValues[2] = { 0 };
+
+		IntString clientString = intToString(clientId);
+		IntString keyString = intToString(isRead ? lastKey : loop);
+
+		paramValues[0] = clientString.strValue;
+		paramValues[1] = keyString.strValue;
+
+		if (connecting)
+		{
+			/* keep the connection open between queries */
+			demoapp_set_retry_policy(&pgsql,
+									 DEMO_BENCH_RETRY_CAP_TIME,
+									 DEMO_BENCH_RETRY_SLEEP_TIME);
+			pgsql.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+		}
+
+		uint64_t queryStartUs = demoapp_now_us();
+		bool success = false;
+
+		if (isRead)
+		{
+			success = pgsql_execute_prepared(
+				&pgsql,
+				"demo_bench_read",
+				"select ts from demo.bench where client = $1 and loop = $2",
+				2, paramTypes, paramValues,
+				NULL, NULL);
+		}
+		else
+		{
+			success = pgsql_execute_prepared(
+				&pgsql,
+				"demo_bench_write",
+				"insert into demo.bench(client, loop) values($1, $2)",
+				2, paramTypes, paramValues,
+				NULL, NULL);
+		}
+
+		uint64_t queryEndUs = demoapp_now_us();
+		uint64_t connectUs = 0;
+
+		if (connecting && !INSTR_TIME_IS_ZERO(pgsql.retryPolicy.connectTime))
+		{
+			instr_time duration = pgsql.retryPolicy.connectTime;
+			INSTR_TIME_SUBTRACT(duration, pgsql.retryPolicy.startTime);
+
+			connectUs = (uint64_t) INSTR_TIME_GET_MICROSEC(duration);
+
+			(void) histogram_record(&(stats->connect), connectUs);
+
+			if (loop > 0)
+			{
+				++stats->reconnections;
+			}
+		}
+
+		uint64_t queryUs = queryEndUs - queryStartUs;
+		queryUs = queryUs > connectUs ? queryUs - connectUs : 0;
+
+		if (!success)
+		{
+			if (isRead)
+			{
+				++stats->readErrors;
+			}
+			else
+			{
+				++stats->writeErrors;
+			}
+
+			/* reconnect, the next query might be sent to a new primary */
+			pgsql_finish(&pgsql);
+			needReconnect = true;
+			continue;
+		}
+
+		if (isRead)
+		{
+			(void) histogram_record(&(stats->read), queryUs);
+			continue;
+		}
+
+		(void) histogram_record(&(stats->write), queryUs);
+
+		/* writes are possible again: that's the end of an outage */
+		if (needReconnect && lastWriteUs > 0)
+		{
+			(void) demoapp_bench_record_outage(stats, lastWriteUs, queryEndUs);
+		}
+
+		needReconnect = false;
+		lastWriteUs = queryEndUs;
+		lastKey = loop;
+	}
+
+	/* an outage that lasts until the end of the benchmark is still known */
+	if (needReconnect && lastWriteUs > 0)
+	{
+		(void) demoapp_bench_record_outage(stats, lastWriteUs, 0);
+	}
+
+	pgsql_finish(&pgsql);
+
+	log_info("Client %d ran %" PRIu64 " reads and %" PRIu64 " writes, "
+			 "with %" PRIu64 " read errors, %" PRIu64 " write errors "
+			 "and %" PRIu64 " reconnections",
+			 clientId,
+			 stats->read.count,
+			 stats->write.count,
+			 stats->readErrors,
+			 stats->writeErrors,
+			 stats->reconnections);
+}
+
+
+/*
+ * demoapp_bench_record_outage records a write outage of a client. An endUs
+ * of zero means that writes were still failing at the end of the benchmark.
+ */
+static void
+demoapp_bench_record_outage(DemoBenchClient *stats,
+							uint64_t startUs, uint64_t endUs)
+{
+	if (stats->outageCount >= DEMO_BENCH_MAX_OUTAGES)
+	{
+		return;
+	}
+
+	DemoBenchOutage *outage = &(stats->outages[stats->outageCount++]);
+
+	outage->startUs = startUs;
+	outage->endUs = endUs;
+}
+
+
+/*
+ * demoapp_bench_report_outages reports the outages of all the clients to the
+ * monitor, which accounts for them as the application-visible unavailability
+ * of the failover drills that they overlap. This is meant for a benchmark
+ * that runs with --no-failover during the window of scheduled drills.
+ */
+static void
+demoapp_bench_report_outages(DemoAppOptions *demoAppOptions,
+							 DemoBenchResults *results)
+{
+	Monitor monitor = { 0 };
+
+	if (!monitor_init(&monitor, demoAppOptions->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	for (int index = 1; index <= demoAppOptions->clientsCount; index++)
+	{
+		DemoBenchClient *client = &(results->clients[index]);
+
+		for (int i = 0; i < client->outageCount; i++)
+		{
+			DemoBenchOutage *outage = &(client->outages[i]);
+
+			/* the outages are timed with a monotonic clock */
+			uint64_t startEpochMs =
+				results->startTime * 1000 +
+				(outage->startUs - results->startUs) / 1000;
+			uint64_t durationMs = (outage->endUs - outage->startUs) / 1000;
+
+			if (!monitor_report_drill_outage(&monitor,
+											 demoAppOptions->formation,
+											 demoAppOptions->groupId,
+											 startEpochMs,
+											 durationMs))
+			{
+				/* errors have already been logged */
+				break;
+			}
+		}
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+}
+
+
+/*
+ * demoapp_bench_to_json returns the benchmark results as a JSON object: the
+ * options used, the latency histograms of all the clients merged, the write
+ * unavailability window of each failover, and a summary per client.
+ */
+static JSON_Value *
+demoapp_bench_to_json(DemoAppOptions *demoAppOptions,
+					  DemoBenchResults *results)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	JSON_Value *jsFailovers = json_value_init_array();
+	JSON_Array *jsFailoversArray = json_value_get_array(jsFailovers);
+
+	JSON_Value *jsClients = json_value_init_array();
+	JSON_Array *jsClientsArray = json_value_get_array(jsClients);
+
+	/* the histograms are too large for the stack */
+	DemoBenchClient *total = (DemoBenchClient *) calloc(1, sizeof(DemoBenchClient));
+
+	char timestring[MAXCTIMESIZE] = { 0 };
+
+	if (total == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return js;
+	}
+
+	json_object_set_string(jsObj, "version", PG_AUTOCTL_VERSION);
+	json_object_set_string(jsObj, "started_at",
+						   epoch_to_string(results->startTime, timestring));
+	json_object_set_number(jsObj, "clients", demoAppOptions->clientsCount);
+	json_object_set_number(jsObj, "duration", demoAppOptions->duration);
+	json_object_set_number(jsObj, "rate", demoAppOptions->rate);
+	json_object_set_number(jsObj, "read_ratio", demoAppOptions->readRatio);
+
+	for (int index = 1; index <= demoAppOptions->clientsCount; index++)
+	{
+		DemoBenchClient *client = &(results->clients[index]);
+
+		JSON_Value *jsClient = json_value_init_object();
+		JSON_Object *jsClientObj = json_value_get_object(jsClient);
+
+		(void) histogram_merge(&(total->connect), &(client->connect));
+		(void) histogram_merge(&(total->read), &(client->read));
+		(void) histogram_merge(&(total->write), &(client->write));
+
+		total->readErrors += client->readErrors;
+		total->writeErrors += client->writeErrors;
+		total->reconnections += client->reconnections;
+
+		json_object_set_number(jsClientObj, "client", index);
+		json_object_set_number(jsClientObj, "read_errors",
+							   (double) client->readErrors);
+		json_object_set_number(jsClientObj, "write_errors",
+							   (double) client->writeErrors);
+		json_object_set_number(jsClientObj, "reconnections",
+							   (double) client->reconnections);
+		json_object_set_value(jsClientObj, "read",
+							  histogram_to_json(&(client->read), false));
+		json_object_set_value(jsClientObj, "write",
+							  histogram_to_json(&(client->write), false));
+
+		json_array_append_value(jsClientsArray, jsClient);
+	}
+
+	json_object_set_number(jsObj, "reads_per_second",
+						   (double) total->read.count /
+						   demoAppOptions->duration);
+	json_object_set_number(jsObj, "writes_per_second",
+						   (double) total->write.count /
+						   demoAppOptions->duration);
+	json_object_set_number(jsObj, "read_errors", (double) total->readErrors);
+	json_object_set_number(jsObj, "write_errors", (double) total->writeErrors);
+	json_object_set_number(jsObj, "reconnections",
+						   (double) total->reconnections);
+
+	json_object_set_value(jsObj, "connect",
+						  histogram_to_json(&(total->connect), true));
+	json_object_set_value(jsObj, "read",
+						  histogram_to_json(&(total->read), true));
+	json_object_set_value(jsObj, "write",
+						  histogram_to_json(&(total->write), true));
+
+	log_info("Reads: %" PRIu64 " queries, p50 %.3f ms, p99 %.3f ms, "
+			 "max %.3f ms, %" PRIu64 " errors",
+			 total->read.count,
+			 histogram_percentile(&(total->read), 50.0) / 1000.0,
+			 histogram_percentile(&(total->read), 99.0) / 1000.0,
+			 total->read.max / 1000.0,
+			 total->readErrors);
+
+	log_info("Writes: %" PRIu64 " queries, p50 %.3f ms, p99 %.3f ms, "
+			 "max %.3f ms, %" PRIu64 " errors",
+			 total->write.count,
+			 histogram_percentile(&(total->write), 50.0) / 1000.0,
+			 histogram_percentile(&(total->write), 99.0) / 1000.0,
+			 total->write.max / 1000.0,
+			 total->writeErrors);
+
+	for (int index = 0; index < results->failoverCount; index++)
+	{
+		json_array_append_value(jsFailoversArray,
+								demoapp_bench_failover_to_json(demoAppOptions,
+															   results,
+															   index));
+	}
+
+	json_object_set_value(jsObj, "failovers", jsFailovers);
+	json_object_set_value(jsObj, "per_client", jsClients);
+
+	free(total);
+
+	return js;
+}
+
+
+/*
+ * demoapp_bench_failover_to_json returns a JSON object for the failover with
+ * the given index. The write unavailability window of a failover is computed
+ * from the clients outages that ended after the failover has been requested,
+ * and started before the next failover: it spans from the last successful
+ * write of any client before the outage, to the first successful write of
+ * any client after the outage.
+ */
+static JSON_Value *
+demoapp_bench_failover_to_json(DemoAppOptions *demoAppOptions,
+							   DemoBenchResults *results,
+							   int index)
+{
+	DemoBenchFailover *failover = &(results->failovers[index]);
+
+	uint64_t nextRequestedUs =
+		index + 1 < results->failoverCount
+		? results->failovers[index + 1].requestedUs
+		: UINT64_MAX;
+
+	uint64_t windowStartUs = 0;
+	uint64_t windowEndUs = 0;
+	uint64_t maxClientOutageUs = 0;
+	int affectedClients = 0;
+	bool recovered = true;
+
+	for (int c = 1; c <= demoAppOptions->clientsCount; c++)
+	{
+		DemoBenchClient *client = &(results->clients[c]);
+
+		uint64_t clientStartUs = 0;
+		uint64_t clientEndUs = 0;
+		bool clientAffected = false;
+		bool clientRecovered = true;
+
+		/* a client might have had several outages during the same failover */
+		for (int o = 0; o < client->outageCount; o++)
+		{
+			DemoBenchOutage *outage = &(client->outages[o]);
+
+			if ((outage->endUs != 0 && outage->endUs < failover->requestedUs) ||
+				outage->startUs >= nextRequestedUs)
+			{
+				continue;
+			}
+
+			if (!clientAffected || outage->startUs < clientStartUs)
+			{
+				clientStartUs = outage->startUs;
+			}
+
+			if (outage->endUs == 0)
+			{
+				clientRecovered = false;
+			}
+			else if (outage->endUs > clientEndUs)
+			{
+				clientEndUs = outage->endUs;
+			}
+
+			clientAffected = true;
+		}
+
+		if (!clientAffected)
+		{
+			continue;
+		}
+
+		++affectedClients;
+
+		if (clientStartUs > windowStartUs)
+		{
+			windowStartUs = clientStartUs;
+		}
+
+		if (!clientRecovered)
+		{
+			recovered = false;
+			continue;
+		}
+
+		if (windowEndUs == 0 || clientEndUs < windowEndUs)
+		{
+			windowEndUs = clientEndUs;
+		}
+
+		if (clientEndUs - clientStartUs > maxClientOutageUs)
+		{
+			maxClientOutageUs = clientEndUs - clientStartUs;
+		}
+	}
+
+	/* when no client could write again, the window is still open */
+	if (windowEndUs == 0 && !recovered)
+	{
+		windowEndUs = results->startUs +
+					  (uint64_t) demoAppOptions->duration * 1000000;
+	}
+
+	uint64_t windowUs =
+		windowEndUs > windowStartUs ? windowEndUs - windowStartUs : 0;
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	json_object_set_number(jsObj, "requested_at_ms",
+						   (failover->requestedUs - results->startUs) / 1000.0);
+
+	if (failover->primaryUs > 0)
+	{
+		json_object_set_number(jsObj, "new_primary_ms",
+							   (failover->primaryUs - failover->requestedUs) /
+							   1000.0);
+	}
+	else
+	{
+		json_object_set_null(jsObj, "new_primary_ms");
+	}
+
+	json_object_set_number(jsObj, "clients_affected", affectedClients);
+	json_object_set_boolean(jsObj, "writes_recovered", recovered);
+
+	if (affectedClients > 0)
+	{
+		json_object_set_number(jsObj, "write_unavailable_from_ms",
+							   (windowStartUs - results->startUs) / 1000.0);
+		json_object_set_number(jsObj, "write_unavailable_ms",
+							   windowUs / 1000.0);
+		json_object_set_number(jsObj, "max_client_outage_ms",
+							   maxClientOutageUs / 1000.0);
+	}
+	else
+	{
+		json_object_set_null(jsObj, "write_unavailable_from_ms");
+		json_object_set_number(jsObj, "write_unavailable_ms", 0);
+		json_object_set_number(jsObj, "max_client_outage_ms", 0);
+	}
+
+	log_info("Failover %d: new primary after %.3f ms, "
+			 "writes unavailable for %.3f ms (%d clients affected)",
+			 index + 1,
+			 failover->primaryUs > 0
+			 ? (failover->primaryUs - failover->requestedUs) / 1000.0
+			 : -1.0,
+			 windowUs / 1000.0,
+			 affectedClients);
+
+	return js;
+}
+
+
 /*
  * demoapp_print_histogram prints an histogram of the distribution of the
  * connection timings measured throughout the testing.
@@ -17,11 +17,19 @@
 #define DEMO_DEFAULT_RETRY_CAP_TIME 200
 #define DEMO_DEFAULT_RETRY_SLEEP_TIME 500
 
+/* the benchmark retries quickly, to measure unavailability precisely */
+#define DEMO_BENCH_RETRY_CAP_TIME 50
+#define DEMO_BENCH_RETRY_SLEEP_TIME 10
+
+#define DEMO_BENCH_DEFAULT_RATE 100
+#define DEMO_BENCH_DEFAULT_READ_RATIO 50
+
 bool demoapp_grab_formation_uri(DemoAppOptions *options,
 								char *pguri, size_t size,
 								bool *mayRetry);
 bool demoapp_prepare_schema(const char *pguri);
 bool demoapp_run(const char *pguri, DemoAppOptions *demoAppOptions);
+bool demoapp_bench(const char *pguri, DemoAppOptions *demoAppOptions);
 
 void demoapp_print_histogram(const char *pguri, DemoAppOptions *demoAppOptions);
 void demoapp_print_summary(const char *pguri, DemoAppOptions *demoAppOptions);
@@ -20,6 +20,7 @@
 #include "keeper.h"
 #include "pgctl.h"
 #include "fsm.h"
+#include "fsm_timings.h"
 #include "log.h"
 #include "monitor.h"
 #include "primary_standby.h"
@@ -154,6 +155,10 @@
 	"Stop traffic to primary, " \
 	"wait for it to finish draining."
 
+#define COMMENT_PREP_PROMOTION_TO_REPORT_LSN \
+	"Another standby node has more WAL, " \
+	"reporting the last write-ahead log location received"
+
 #define COMMENT_REPORT_LSN_TO_FAST_FORWARD \
 	"Fetching missing WAL bits from another standby before promotion"
 
@@ -220,16 +225,16 @@ KeeperFSMTransition KeeperFSM[] = {
 	/*
 	 * failover occurred, primary -> draining/demoted
 	 */
-	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
+	{ PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_fence_postgres },
 	{ DRAINING_STATE, DEMOTED_STATE, COMMENT_DRAINING_TO_DEMOTED, &fsm_stop_postgres },
 	{ PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 	{ PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 
-	{ JOIN_PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
+	{ JOIN_PRIMARY_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_fence_postgres },
 	{ JOIN_PRIMARY_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 	{ JOIN_PRIMARY_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 
-	{ APPLY_SETTINGS_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_stop_postgres },
+	{ APPLY_SETTINGS_STATE, DRAINING_STATE, COMMENT_PRIMARY_TO_DRAINING, &fsm_fence_postgres },
 	{ APPLY_SETTINGS_STATE, DEMOTED_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 	{ APPLY_SETTINGS_STATE, DEMOTE_TIMEOUT_STATE, COMMENT_PRIMARY_TO_DEMOTED, &fsm_stop_postgres },
 
@@ -360,6 +365,7 @@ KeeperFSMTransition KeeperFSM[] = {
 	{ SECONDARY_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
 	{ CATCHINGUP_STATE, REPORT_LSN_STATE, COMMENT_SECONDARY_TO_REPORT_LSN, &fsm_report_lsn },
 	{ REPORT_LSN_STATE, PREP_PROMOTION_STATE, COMMENT_REPORT_LSN_TO_PREP_PROMOTION, &fsm_prepare_standby_for_promotion },
+	{ PREP_PROMOTION_STATE, REPORT_LSN_STATE, COMMENT_PREP_PROMOTION_TO_REPORT_LSN, &fsm_cancel_promotion },
 
 	{ REPORT_LSN_STATE, FAST_FORWARD_STATE, COMMENT_REPORT_LSN_TO_FAST_FORWARD, &fsm_fast_forward },
 	{ FAST_FORWARD_STATE, PREP_PROMOTION_STATE, COMMENT_FAST_FORWARD_TO_PREP_PROMOTION, &fsm_cleanup_and_resume_as_primary },
@@ -396,6 +402,52 @@ KeeperFSMTransition KeeperFSM[] = {
 /* *INDENT-ON* */
 
 
+/*
+ * The names of the transition functions, used when replaying transitions
+ * without running them, see `pg_autoctl do fsm replay`.
+ */
+typedef struct KeeperFSMFunctionName
+{
+	ReachAssignedStateFunction function;
+	const char *name;
+} KeeperFSMFunctionName;
+
+#define FSM_FUNCTION(f) { &f, #f }
+
+static KeeperFSMFunctionName KeeperFSMFunctionNames[] = {
+	FSM_FUNCTION(fsm_apply_settings),
+	FSM_FUNCTION(fsm_cancel_promotion),
+	FSM_FUNCTION(fsm_checkpoint_and_stop_postgres),
+	FSM_FUNCTION(fsm_cleanup_and_resume_as_primary),
+	FSM_FUNCTION(fsm_disable_replication),
+	FSM_FUNCTION(fsm_disable_sync_rep),
+	FSM_FUNCTION(fsm_drop_node),
+	FSM_FUNCTION(fsm_enable_sync_rep),
+	FSM_FUNCTION(fsm_fast_forward),
+	FSM_FUNCTION(fsm_fence_postgres),
+	FSM_FUNCTION(fsm_follow_new_primary),
+	FSM_FUNCTION(fsm_init_from_standby),
+	FSM_FUNCTION(fsm_init_primary),
+	FSM_FUNCTION(fsm_init_standby),
+	FSM_FUNCTION(fsm_prepare_for_secondary),
+	FSM_FUNCTION(fsm_prepare_replication),
+	FSM_FUNCTION(fsm_prepare_standby_for_promotion),
+	FSM_FUNCTION(fsm_promote_standby),
+	FSM_FUNCTION(fsm_promote_standby_to_primary),
+	FSM_FUNCTION(fsm_report_lsn),
+	FSM_FUNCTION(fsm_restart_standby),
+	FSM_FUNCTION(fsm_resume_as_primary),
+	FSM_FUNCTION(fsm_rewind_or_init),
+	FSM_FUNCTION(fsm_start_maintenance_on_standby),
+	FSM_FUNCTION(fsm_start_postgres),
+	FSM_FUNCTION(fsm_stop_postgres),
+	FSM_FUNCTION(fsm_stop_postgres_and_setup_standby),
+	FSM_FUNCTION(fsm_stop_postgres_for_primary_maintenance),
+	FSM_FUNCTION(fsm_stop_replication),
+	{ NULL, NULL }
+};
+
+
 /*
  * keeper_fsm_step implements the logic to perform a single step
  * of the state machine according to the goal state returned by
@@ -486,6 +538,36 @@ keeper_fsm_step(Keeper *keeper)
 }
 
 
+/*
+ * keeper_fsm_record_transition_timing records the timing of the transition
+ * that just ran in the timings file, and when it was successful, sends them
+ * to the monitor where they are found in the events. Errors are only logged,
+ * the transition itself is done already.
+ */
+static void
+keeper_fsm_record_transition_timing(Keeper *keeper, bool success)
+{
+	KeeperConfig *config = &(keeper->config);
+	char description[BUFSIZE] = { 0 };
+
+	(void) fsm_timing_finish(success, config->pathnames.timings,
+							 description, sizeof(description));
+
+	log_info("%s", description);
+
+	/* the timing fields only belong to the transition summary line */
+	(void) log_set_context("duration_ms", NULL);
+	(void) log_set_context("attempts", NULL);
+
+	if (success && !config->monitorDisabled)
+	{
+		(void) monitor_report_transition_timing(&(keeper->monitor),
+												keeper->state.current_node_id,
+												description);
+	}
+}
+
+
 /*
  * keeper_fsm_reach_assigned_state uses the KeeperFSM to drive a transition
  * from keeper->state->current_role to keeper->state->assigned_role, when
@@ -494,9 +576,7 @@ keeper_fsm_step(Keeper *keeper)
 bool
 keeper_fsm_reach_assigned_state(Keeper *keeper)
 {
-	int transitionIndex = 0;
 	KeeperStateData *keeperState = &(keeper->state);
-	KeeperFSMTransition transition = KeeperFSM[0];
 
 	if (keeperState->current_role == keeperState->assigned_role)
 	{
@@ -506,70 +586,123 @@ keeper_fsm_reach_assigned_state(Keeper *keeper)
 		return true;
 	}
 
-	while (transition.current != NO_STATE)
+	KeeperFSMTransition *found =
+		keeper_fsm_find_transition(keeperState->current_role,
+								   keeperState->assigned_role);
+
+	if (found == NULL)
 	{
-		if (state_matches(transition.current, keeperState->current_role) &&
-			state_matches(transition.assigned, keeperState->assigned_role))
-		{
-			bool ret = false;
+		log_fatal("pg_autoctl does not know how to reach state \"%s\" from \"%s\"",
+				  NodeStateToString(keeperState->assigned_role),
+				  NodeStateToString(keeperState->current_role));
 
-			if (transition.current != ANY_STATE)
-			{
-				log_info("FSM transition from \"%s\" to \"%s\"%s%s",
-						 NodeStateToString(transition.current),
-						 NodeStateToString(transition.assigned),
-						 transition.comment ? ": " : "",
-						 transition.comment ? transition.comment : "");
-			}
-			else
-			{
-				log_info("FSM transition to \"%s\"%s%s",
-						 NodeStateToString(transition.assigned),
-						 transition.comment ? ": " : "",
-						 transition.comment ? transition.comment : "");
-			}
+		return false;
+	}
 
-			if (transition.transitionFunction)
-			{
-				ret = (*transition.transitionFunction)(keeper);
+	KeeperFSMTransition transition = *found;
+	bool ret = false;
 
-				log_debug("Transition function returned: %s",
-						  ret ? "true" : "false");
-			}
-			else
-			{
-				ret = true;
-				log_debug("No transition function, assigning new state");
-			}
+	(void) keeper_set_log_context(keeper);
 
-			if (ret)
-			{
-				keeperState->current_role = keeperState->assigned_role;
+	if (transition.current != ANY_STATE)
+	{
+		log_info("FSM transition from \"%s\" to \"%s\"%s%s",
+				 NodeStateToString(transition.current),
+				 NodeStateToString(transition.assigned),
+				 transition.comment ? ": " : "",
+				 transition.comment ? transition.comment : "");
+	}
+	else
+	{
+		log_info("FSM transition to \"%s\"%s%s",
+				 NodeStateToString(transition.assigned),
+				 transition.comment ? ": " : "",
+				 transition.comment ? transition.comment : "");
+	}
 
-				log_info("Transition complete: current state is now \"%s\"",
-						 NodeStateToString(keeperState->current_role));
-			}
-			else
-			{
-				log_error("Failed to transition from state \"%s\" "
-						  "to state \"%s\", see above.",
-						  NodeStateToString(transition.current),
-						  NodeStateToString(transition.assigned));
-			}
+	(void) fsm_timing_start(keeperState->current_role,
+							keeperState->assigned_role);
+
+	if (transition.transitionFunction)
+	{
+		ret = (*transition.transitionFunction)(keeper);
+
+		log_debug("Transition function returned: %s",
+				  ret ? "true" : "false");
+	}
+	else
+	{
+		ret = true;
+		log_debug("No transition function, assigning new state");
+	}
+
+	(void) keeper_fsm_record_transition_timing(keeper, ret);
+
+	if (ret)
+	{
+		keeperState->current_role = keeperState->assigned_role;
 
-			return ret;
+		(void) keeper_set_log_context(keeper);
+
+		log_info("Transition complete: current state is now \"%s\"",
+				 NodeStateToString(keeperState->current_role));
+	}
+	else
+	{
+		log_error("Failed to transition from state \"%s\" "
+				  "to state \"%s\", see above.",
+				  NodeStateToString(transition.current),
+				  NodeStateToString(transition.assigned));
+	}
+
+	return ret;
+}
+
+
+/*
+ * keeper_fsm_find_transition returns the KeeperFSM entry used to reach the
+ * assigned state from the current state, or NULL when there is none.
+ */
+KeeperFSMTransition *
+keeper_fsm_find_transition(NodeState current, NodeState assigned)
+{
+	for (int transitionIndex = 0;
+		 KeeperFSM[transitionIndex].current != NO_STATE;
+		 transitionIndex++)
+	{
+		KeeperFSMTransition *transition = &(KeeperFSM[transitionIndex]);
+
+		if (state_matches(transition->current, current) &&
+			state_matches(transition->assigned, assigned))
+		{
+			return transition;
 		}
-		transition = KeeperFSM[++transitionIndex];
 	}
 
-	/*
-	 * we didn't find a transition
-	 */
-	log_fatal("pg_autoctl does not know how to reach state \"%s\" from \"%s\"",
-			  NodeStateToString(keeperState->assigned_role),
-			  NodeStateToString(keeperState->current_role));
+	return NULL;
+}
+
+
+/*
+ * keeper_fsm_function_name returns the name of the given transition function.
+ */
+const char *
+keeper_fsm_function_name(ReachAssignedStateFunction function)
+{
+	if (function == NULL)
+	{
+		return "none";
+	}
+
+	for (int index = 0; KeeperFSMFunctionNames[index].function != NULL; index++)
+	{
+		if (KeeperFSMFunctionNames[index].function == function)
+		{
+			return KeeperFSMFunctionNames[index].name;
+		}
+	}
 
-	return false;
+	return "unknown";
 }
 
 
@@ -56,6 +56,7 @@ bool fsm_apply_settings(Keeper *keeper);
 
 bool fsm_start_postgres(Keeper *keeper);
 bool fsm_stop_postgres(Keeper *keeper);
+bool fsm_fence_postgres(Keeper *keeper);
 bool fsm_stop_postgres_for_primary_maintenance(Keeper *keeper);
 bool fsm_stop_postgres_and_setup_standby(Keeper *keeper);
 bool fsm_checkpoint_and_stop_postgres(Keeper *keeper);
@@ -64,6 +65,7 @@ bool fsm_start_maintenance_on_standby(Keeper *keeper);
 bool fsm_restart_standby(Keeper *keeper);
 
 bool fsm_report_lsn(Keeper *keeper);
+bool fsm_cancel_promotion(Keeper *keeper);
 bool fsm_fast_forward(Keeper *keeper);
 bool fsm_prepare_cascade(Keeper *keeper);
 bool fsm_follow_new_primary(Keeper *keeper);
@@ -85,6 +87,9 @@ void print_reachable_states(KeeperStateData *keeperState);
 void print_fsm_for_graphviz(void);
 bool keeper_fsm_step(Keeper *keeper);
 bool keeper_fsm_reach_assigned_state(Keeper *keeper);
+KeeperFSMTransition * keeper_fsm_find_transition(NodeState current,
+												 NodeState assigned);
+const char * keeper_fsm_function_name(ReachAssignedStateFunction function);
 
 
 #endif /* KEEPER_FSM_H */
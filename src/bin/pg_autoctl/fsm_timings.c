@@ -0,0 +1,393 @@
+/*
+ * src/bin/pg_autoctl/fsm_timings.c
+ *     Timing of the FSM transitions and of their steps.
+ *
+ * When a failover takes longer than expected, the keeper logs alone do not
+ * tell whether the time went to waiting for a standby to catch-up, to the
+ * promotion, to a checkpoint, or to restarting Postgres. So we time each FSM
+ * transition, and within it the time spent in the steps that are known to
+ * take time: SQL queries, pg_ctl commands, and waiting for Postgres.
+ *
+ * The timings of the last transitions are kept in a JSON file next to the
+ * keeper state file. A transition that is retried, such as when waiting for
+ * a standby to catch-up, is accounted for as a single transition with several
+ * attempts.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "fsm_timings.h"
+#include "log.h"
+#include "metrics.h"
+#include "parson.h"
+#include "state.h"
+#include "string_utils.h"
+
+
+/* the transition in progress, when the keeper is running one */
+static FSMTransitionTiming currentTransition = { 0 };
+static bool transitionInProgress = false;
+
+
+static void fsm_timing_add_step(FSMTransitionTiming *transition,
+								const char *name,
+								int calls,
+								double durationMs);
+static JSON_Value * fsm_timing_to_json(FSMTransitionTiming *transition,
+									   int attempts);
+static void fsm_timing_merge_previous_attempts(FSMTransitionTiming *transition,
+											   JSON_Object *previous,
+											   int *attempts);
+
+
+/*
+ * fsm_timing_start starts timing a transition.
+ */
+void
+fsm_timing_start(NodeState current, NodeState assigned)
+{
+	currentTransition = (FSMTransitionTiming) { 0 };
+
+	currentTransition.current = current;
+	currentTransition.assigned = assigned;
+	currentTransition.startTime = time(NULL);
+	INSTR_TIME_SET_CURRENT(currentTransition.start);
+
+	transitionInProgress = true;
+}
+
+
+/*
+ * fsm_timing_step_start registers the start time of a step.
+ */
+void
+fsm_timing_step_start(instr_time *start)
+{
+	INSTR_TIME_SET_CURRENT(*start);
+}
+
+
+/*
+ * fsm_timing_step_done accounts for the time spent in a step since its start
+ * time, when a transition is in progress.
+ */
+void
+fsm_timing_step_done(const char *name, instr_time *start)
+{
+	instr_time duration;
+
+	if (!transitionInProgress)
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *start);
+
+	(void) fsm_timing_add_step(&currentTransition, name, 1,
+							   INSTR_TIME_GET_MILLISEC(duration));
+}
+
+
+/*
+ * fsm_timing_note attaches a short free-form note to the transition in
+ * progress, such as the replication lag reached while draining a primary. It
+ * is appended to the transition summary that is sent to the monitor.
+ */
+void
+fsm_timing_note(const char *note)
+{
+	if (!transitionInProgress)
+	{
+		return;
+	}
+
+	strlcpy(currentTransition.note, note, sizeof(currentTransition.note));
+}
+
+
+/*
+ * fsm_timing_add_step adds the given calls and duration to the step with the
+ * given name, creating it if needed. Steps beyond FSM_TIMINGS_MAX_STEPS are
+ * not accounted for.
+ */
+static void
+fsm_timing_add_step(FSMTransitionTiming *transition,
+					const char *name, int calls, double durationMs)
+{
+	for (int i = 0; i < transition->stepCount; i++)
+	{
+		FSMStepTiming *step = &(transition->steps[i]);
+
+		if (strcmp(step->name, name) == 0)
+		{
+			step->calls += calls;
+			step->durationMs += durationMs;
+			return;
+		}
+	}
+
+	if (transition->stepCount < FSM_TIMINGS_MAX_STEPS)
+	{
+		FSMStepTiming *step = &(transition->steps[transition->stepCount++]);
+
+		strlcpy(step->name, name, sizeof(step->name));
+		step->calls = calls;
+		step->durationMs = durationMs;
+	}
+}
+
+
+/*
+ * fsm_timing_finish stops timing the current transition, and records it in
+ * the given timings file, keeping only the last FSM_TIMINGS_MAX_TRANSITIONS
+ * there. When a description buffer is given, it is filled with a one-line
+ * summary of the transition, to be sent to the monitor, and the duration and
+ * attempts are added to the log context for the caller to log the summary.
+ */
+bool
+fsm_timing_finish(bool success, const char *filename,
+				  char *description, size_t size)
+{
+	FSMTransitionTiming *transition = &currentTransition;
+	instr_time duration;
+
+	JSON_Value *transitions = NULL;
+	int attempts = 1;
+
+	if (!transitionInProgress)
+	{
+		return true;
+	}
+
+	transitionInProgress = false;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, transition->start);
+
+	transition->durationMs = INSTR_TIME_GET_MILLISEC(duration);
+	transition->success = success;
+
+	(void) metrics_record_transition(success,
+									 INSTR_TIME_GET_DOUBLE(duration));
+
+	if (!fsm_timings_read_file(filename, &transitions))
+	{
+		/* start over with a new file */
+		transitions = json_value_init_array();
+	}
+
+	JSON_Array *jsArray = json_value_get_array(transitions);
+	size_t count = json_array_get_count(jsArray);
+
+	/* a failed transition is retried, account for all the attempts at once */
+	if (count > 0)
+	{
+		JSON_Object *previous = json_array_get_object(jsArray, count - 1);
+
+		const char *from = json_object_get_string(previous, "from");
+		const char *to = json_object_get_string(previous, "to");
+
+		if (previous != NULL && from != NULL && to != NULL &&
+			json_object_get_boolean(previous, "success") == 0 &&
+			strcmp(from, NodeStateToString(transition->current)) == 0 &&
+			strcmp(to, NodeStateToString(transition->assigned)) == 0)
+		{
+			(void) fsm_timing_merge_previous_attempts(transition, previous,
+													  &attempts);
+			json_array_remove(jsArray, count - 1);
+			--count;
+		}
+	}
+
+	while (count >= FSM_TIMINGS_MAX_TRANSITIONS)
+	{
+		json_array_remove(jsArray, 0);
+		--count;
+	}
+
+	json_array_append_value(jsArray, fsm_timing_to_json(transition, attempts));
+
+	char *serialized = json_serialize_to_string_pretty(transitions);
+	bool written = write_file(serialized, strlen(serialized), filename);
+
+	json_free_serialized_string(serialized);
+	json_value_free(transitions);
+
+	if (description != NULL)
+	{
+		int len = sformat(description, size,
+						  "Transition from \"%s\" to \"%s\" took %.0f ms "
+						  "in %d attempt%s",
+						  NodeStateToString(transition->current),
+						  NodeStateToString(transition->assigned),
+						  transition->durationMs,
+						  attempts,
+						  attempts > 1 ? "s" : "");
+
+		for (int i = 0; i < transition->stepCount && len < (int) size; i++)
+		{
+			FSMStepTiming *step = &(transition->steps[i]);
+
+			len += sformat(description + len, size - len,
+						   "%s %s %.0f ms (%d call%s)",
+						   i == 0 ? ":" : ",",
+						   step->name,
+						   step->durationMs,
+						   step->calls,
+						   step->calls > 1 ? "s" : "");
+		}
+
+		if (!IS_EMPTY_STRING_BUFFER(transition->note) && len < (int) size)
+		{
+			(void) sformat(description + len, size - len, "; %s",
+						   transition->note);
+		}
+
+		(void) log_set_context_int("duration_ms",
+								   (long long) transition->durationMs);
+		(void) log_set_context_int("attempts", attempts);
+	}
+
+	if (!written)
+	{
+		log_warn("Failed to write the FSM transitions timings file \"%s\"",
+				 filename);
+	}
+
+	return written;
+}
+
+
+/*
+ * fsm_timing_merge_previous_attempts adds the duration and steps of the
+ * previous failed attempts of the same transition to the current one.
+ */
+static void
+fsm_timing_merge_previous_attempts(FSMTransitionTiming *transition,
+								   JSON_Object *previous,
+								   int *attempts)
+{
+	JSON_Array *steps = json_object_get_array(previous, "steps");
+
+	*attempts += (int) json_object_get_number(previous, "attempts");
+
+	transition->startTime =
+		(uint64_t) json_object_get_number(previous, "start_time");
+	transition->durationMs += json_object_get_number(previous, "duration_ms");
+
+	for (size_t i = 0; i < json_array_get_count(steps); i++)
+	{
+		JSON_Object *step = json_array_get_object(steps, i);
+		const char *name = json_object_get_string(step, "name");
+
+		if (name != NULL)
+		{
+			(void) fsm_timing_add_step(transition,
+									   name,
+									   (int) json_object_get_number(step, "calls"),
+									   json_object_get_number(step, "duration_ms"));
+		}
+	}
+}
+
+
+/*
+ * fsm_timing_to_json returns a JSON object for the given transition.
+ */
+static JSON_Value *
+fsm_timing_to_json(FSMTransitionTiming *transition, int attempts)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	JSON_Value *jsSteps = json_value_init_array();
+	JSON_Array *jsStepsArray = json_value_get_array(jsSteps);
+
+	char timestring[MAXCTIMESIZE] = { 0 };
+
+	json_object_set_string(jsObj, "from",
+						   NodeStateToString(transition->current));
+	json_object_set_string(jsObj, "to",
+						   NodeStateToString(transition->assigned));
+	json_object_set_number(jsObj, "start_time",
+						   (double) transition->startTime);
+	json_object_set_string(jsObj, "started_at",
+						   epoch_to_string(transition->startTime, timestring));
+	json_object_set_number(jsObj, "duration_ms", transition->durationMs);
+	json_object_set_number(jsObj, "attempts", (double) attempts);
+	json_object_set_boolean(jsObj, "success", transition->success);
+
+	for (int i = 0; i < transition->stepCount; i++)
+	{
+		FSMStepTiming *step = &(transition->steps[i]);
+
+		JSON_Value *jsStep = json_value_init_object();
+		JSON_Object *jsStepObj = json_value_get_object(jsStep);
+
+		json_object_set_string(jsStepObj, "name", step->name);
+		json_object_set_number(jsStepObj, "calls", (double) step->calls);
+		json_object_set_number(jsStepObj, "duration_ms", step->durationMs);
+
+		json_array_append_value(jsStepsArray, jsStep);
+	}
+
+	json_object_set_value(jsObj, "steps", jsSteps);
+
+	if (!IS_EMPTY_STRING_BUFFER(transition->note))
+	{
+		json_object_set_string(jsObj, "note", transition->note);
+	}
+
+	return js;
+}
+
+
+/*
+ * fsm_timings_read_file reads the JSON array of the last transitions timings
+ * from the given file. When the file does not exist, an empty array is
+ * returned.
+ */
+bool
+fsm_timings_read_file(const char *filename, JSON_Value **transitions)
+{
+	char *contents = NULL;
+	long size = 0L;
+
+	if (!file_exists(filename))
+	{
+		*transitions = json_value_init_array();
+		return true;
+	}
+
+	if (!read_file_if_exists(filename, &contents, &size))
+	{
+		log_warn("Failed to read FSM transitions timings file \"%s\"",
+				 filename);
+		return false;
+	}
+
+	JSON_Value *js = json_parse_string(contents);
+	free(contents);
+
+	if (js == NULL || json_value_get_type(js) != JSONArray)
+	{
+		log_warn("Failed to parse FSM transitions timings file \"%s\"",
+				 filename);
+		json_value_free(js);
+		return false;
+	}
+
+	*transitions = js;
+
+	return true;
+}
@@ -0,0 +1,67 @@
+/*
+ * src/bin/pg_autoctl/fsm_timings.h
+ *     Timing of the FSM transitions and of their steps.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef FSM_TIMINGS_H
+#define FSM_TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "parson.h"
+#include "state.h"
+
+
+/* how many transitions we keep in the timings file */
+#define FSM_TIMINGS_MAX_TRANSITIONS 20
+
+/* how many different steps we time in a single transition */
+#define FSM_TIMINGS_MAX_STEPS 16
+
+#define FSM_STEP_NAME_MAXLEN 32
+#define FSM_NOTE_MAXLEN 128
+
+/*
+ * A step accumulates the time spent in all the calls of the same kind during
+ * a transition, such as SQL queries to the monitor, or waiting for Postgres
+ * to be started.
+ */
+typedef struct FSMStepTiming
+{
+	char name[FSM_STEP_NAME_MAXLEN];
+	int calls;
+	double durationMs;
+} FSMStepTiming;
+
+typedef struct FSMTransitionTiming
+{
+	NodeState current;
+	NodeState assigned;
+	uint64_t startTime;         /* epoch, in seconds */
+	instr_time start;
+	double durationMs;
+	bool success;
+	int stepCount;
+	FSMStepTiming steps[FSM_TIMINGS_MAX_STEPS];
+	char note[FSM_NOTE_MAXLEN];
+} FSMTransitionTiming;
+
+
+void fsm_timing_start(NodeState current, NodeState assigned);
+void fsm_timing_step_start(instr_time *start);
+void fsm_timing_step_done(const char *name, instr_time *start);
+void fsm_timing_note(const char *note);
+bool fsm_timing_finish(bool success, const char *filename,
+					   char *description, size_t size);
+
+bool fsm_timings_read_file(const char *filename, JSON_Value **transitions);
+
+#endif /* FSM_TIMINGS_H */
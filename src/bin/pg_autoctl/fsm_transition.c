@@ -32,16 +32,22 @@
 #include "env_utils.h"
 #include "pgctl.h"
 #include "fsm.h"
+#include "fsm_timings.h"
 #include "keeper.h"
 #include "keeper_pg_init.h"
 #include "log.h"
 #include "monitor.h"
 #include "pghba.h"
 #include "primary_standby.h"
+#include "signals.h"
 #include "state.h"
+#include "string_utils.h"
 
 
 static bool fsm_init_standby_from_upstream(Keeper *keeper);
+static void fsm_drain_primary_for_maintenance(Keeper *keeper);
+static void fsm_init_step_done(Keeper *keeper, KeeperInitStep step,
+							   instr_time *start);
 
 
 /*
@@ -54,8 +60,10 @@ static bool fsm_init_standby_from_upstream(Keeper *keeper);
  * && start_postgres
  * && promote_standby (if applicable)
  * && add_default_settings
- * && create_monitor_user
- * && create_replication_user
+ * && create_monitor_user + create_replication_user (one session)
+ *
+ * The duration of the initdb, create database and primary setup steps are
+ * recorded in the init state file.
  */
 bool
 fsm_init_primary(Keeper *keeper)
@@ -69,6 +77,8 @@ fsm_init_primary(Keeper *keeper)
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	bool postgresInstanceExists = pg_setup_pgdata_exists(pgSetup);
 
+	instr_time stepStart;
+
 	log_info("Initialising postgres as a primary");
 
 	/*
@@ -118,6 +128,8 @@ fsm_init_primary(Keeper *keeper)
 		bool missingPgdataIsOk = false;
 		bool postgresNotRunningIsOk = true;
 
+		(void) fsm_timing_step_start(&stepStart);
+
 		if (!pg_ctl_initdb(pgSetup->pg_ctl, pgSetup->pgdata))
 		{
 			log_fatal("Failed to initialize a PostgreSQL instance at \"%s\""
@@ -126,6 +138,8 @@ fsm_init_primary(Keeper *keeper)
 			return false;
 		}
 
+		(void) fsm_init_step_done(keeper, INIT_STEP_INITDB, &stepStart);
+
 		if (!pg_setup_init(&newPgSetup,
 						   pgSetup,
 						   missingPgdataIsOk,
@@ -180,14 +194,20 @@ fsm_init_primary(Keeper *keeper)
 	 */
 	if (pgInstanceIsOurs)
 	{
+		(void) fsm_timing_step_start(&stepStart);
+
 		/* create the target database and install our extension there */
 		if (!create_database_and_extension(keeper))
 		{
 			/* errors have already been logged */
 			return false;
 		}
+
+		(void) fsm_init_step_done(keeper, INIT_STEP_DATABASE, &stepStart);
 	}
 
+	(void) fsm_timing_step_start(&stepStart);
+
 	/*
 	 * Now is the time to make sure Postgres is running, as our next steps to
 	 * prepare a SINGLE from INIT are depending on being able to connect to the
@@ -241,13 +261,21 @@ fsm_init_primary(Keeper *keeper)
 
 	/*
 	 * Now add the role and HBA entries necessary for the monitor to run health
-	 * checks on the local Postgres node.
+	 * checks on the local Postgres node, and the replication user: this node
+	 * is intended to be used as a primary later in the setup, when we have a
+	 * standby node to register.
+	 *
+	 * Note that we forcibly use the authentication method "trust" for the
+	 * pgautofailover_monitor user, which from the monitor also uses the
+	 * hard-coded password PG_AUTOCTL_HEALTH_PASSWORD. The idea is to avoid
+	 * leaking information from the passfile, environment variable, or other
+	 * places.
 	 */
+	char monitorHostname[_POSIX_HOST_NAME_MAX] = { 0 };
+
 	if (!config->monitorDisabled)
 	{
-		char monitorHostname[_POSIX_HOST_NAME_MAX];
 		int monitorPort = 0;
-		int connlimit = 1;
 
 		if (!hostname_from_uri(config->monitor_pguri,
 							   monitorHostname, _POSIX_HOST_NAME_MAX,
@@ -258,42 +286,16 @@ fsm_init_primary(Keeper *keeper)
 					  "fsm_init_primary");
 			return false;
 		}
-
-		/*
-		 * We need to add the monitor host:port in the HBA settings for the
-		 * node to enable the health checks.
-		 *
-		 * Node that we forcibly use the authentication method "trust" for the
-		 * pgautofailover_monitor user, which from the monitor also uses the
-		 * hard-coded password PG_AUTOCTL_HEALTH_PASSWORD. The idea is to avoid
-		 * leaking information from the passfile, environment variable, or
-		 * other places.
-		 */
-		if (!primary_create_user_with_hba(postgres,
-										  PG_AUTOCTL_HEALTH_USERNAME,
-										  PG_AUTOCTL_HEALTH_PASSWORD,
-										  monitorHostname,
-										  "trust",
-										  pgSetup->hbaLevel,
-										  connlimit))
-		{
-			log_error(
-				"Failed to initialise postgres as primary because "
-				"creating the database user that the pg_auto_failover monitor "
-				"uses for health checks failed, see above for details");
-			return false;
-		}
 	}
 
-	/*
-	 * This node is intended to be used as a primary later in the setup, when
-	 * we have a standby node to register, so prepare the replication user now.
-	 */
-	if (!primary_create_replication_user(postgres, PG_AUTOCTL_REPLICA_USERNAME,
-										 config->replication_password))
+	if (!primary_create_node_users(postgres,
+								   config->monitorDisabled ? NULL : monitorHostname,
+								   config->replication_password,
+								   pgSetup->hbaLevel))
 	{
-		log_error("Failed to initialize postgres as primary because creating the "
-				  "replication user for the standby failed, see above for details");
+		log_error("Failed to initialize postgres as primary because creating "
+				  "the database users for the monitor health checks and the "
+				  "standby replication failed, see above for details");
 		return false;
 	}
 
@@ -357,10 +359,40 @@ fsm_init_primary(Keeper *keeper)
 	/* and we're done with this connection. */
 	pgsql_finish(pgsql);
 
+	(void) fsm_init_step_done(keeper, INIT_STEP_PRIMARY, &stepStart);
+
 	return true;
 }
 
 
+/*
+ * fsm_init_step_done accounts for the time spent in the given step of
+ * fsm_init_primary, both in the FSM timings and in the init state file.
+ */
+static void
+fsm_init_step_done(Keeper *keeper, KeeperInitStep step, instr_time *start)
+{
+	static const char *stepNames[INIT_STEP_COUNT] = {
+		"initdb", "create database", "primary setup"
+	};
+
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *start);
+
+	(void) fsm_timing_step_done(stepNames[step], start);
+
+	uint64_t durationMs = (uint64_t) INSTR_TIME_GET_MILLISEC(duration);
+
+	log_debug("Init step \"%s\" took %" PRIu64 " ms",
+			  stepNames[step], durationMs);
+
+	(void) keeper_init_state_update_step_duration(keeper->config.pathnames.init,
+												  step, durationMs);
+}
+
+
 /*
  * fsm_disable_replication is used when other node was forcibly removed, now
  * single.
@@ -421,6 +453,14 @@ fsm_resume_as_primary(Keeper *keeper)
 		return false;
 	}
 
+	/* we might have been fenced read-only when demoted */
+	if (!keeper_unfence_postgres(keeper))
+	{
+		log_error("Failed to accept writes again in order to "
+				  "resume as a primary, see above for details");
+		return false;
+	}
+
 	return true;
 }
 
@@ -575,7 +615,8 @@ fsm_enable_sync_rep(Keeper *keeper)
 										 &pgSetup->is_in_recovery,
 										 postgres->pgsrSyncState,
 										 postgres->currentLSN,
-										 &(postgres->postgresSetup.control)))
+										 &(postgres->postgresSetup.control),
+										 NULL))
 		{
 			log_error("Failed to update the local Postgres metadata");
 			return false;
@@ -672,6 +713,13 @@ fsm_start_postgres(Keeper *keeper)
 		return false;
 	}
 
+	/* we might have been fenced read-only while draining */
+	if (!keeper_unfence_postgres(keeper))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	/* fetch synchronous_standby_names setting from the monitor */
 	if (!fsm_apply_settings(keeper))
 	{
@@ -695,18 +743,162 @@ fsm_stop_postgres(Keeper *keeper)
 }
 
 
+/*
+ * fsm_fence_postgres is used when the monitor drains the local primary node.
+ * When pg_autoctl.read_only_fencing is set and Postgres is running, we block
+ * commits rather than stopping Postgres, see keeper_fence_postgres, and
+ * read-only traffic is still served while draining. Otherwise, and when
+ * fencing fails, we stop Postgres as in fsm_checkpoint_and_stop_postgres.
+ *
+ * Postgres is always stopped before we report demote_timeout or demoted,
+ * where the monitor lets the new primary take writes, and when the keeper
+ * demotes itself because of a network partition.
+ */
+bool
+fsm_fence_postgres(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (keeper->config.read_only_fencing &&
+		pg_is_running(postgres->postgresSetup.pg_ctl,
+					  postgres->postgresSetup.pgdata))
+	{
+		if (keeper_fence_postgres(keeper))
+		{
+			return true;
+		}
+
+		log_warn("Failed to fence Postgres read-only, stopping it instead");
+	}
+
+	/* a clean and short shutdown lets us follow the new primary without rewind */
+	return fsm_checkpoint_and_stop_postgres(keeper);
+}
+
+
 /*
  * fsm_stop_postgres_for_primary_maintenance is used when pg_autoctl enable
  * maintenance has been used on the primary server, we do a couple CHECKPOINT
  * before stopping Postgres to ensure a smooth transition.
+ *
+ * When timeout.maintenance_drain_timeout is set, we first drain the writes,
+ * so that the standby node about to be promoted doesn't have a large replay
+ * backlog when under heavy write load.
  */
 bool
 fsm_stop_postgres_for_primary_maintenance(Keeper *keeper)
 {
+	if (keeper->config.maintenance_drain_timeout > 0 &&
+		pg_setup_is_running(&(keeper->postgres.postgresSetup)))
+	{
+		(void) fsm_drain_primary_for_maintenance(keeper);
+	}
+
 	return fsm_checkpoint_and_stop_postgres(keeper);
 }
 
 
+/*
+ * fsm_drain_primary_for_maintenance makes new transactions read-only by
+ * default, and then waits until the standby replay lag is down to
+ * replication.maintenance_drain_lag bytes, for at most
+ * timeout.maintenance_drain_timeout milliseconds. The sessions that already
+ * write get to finish their work meanwhile.
+ *
+ * The drain is best effort: when it fails or times out we stop Postgres
+ * anyway, as the user asked for maintenance. The replication lag reached is
+ * found in the monitor event for this transition.
+ */
+static void
+fsm_drain_primary_for_maintenance(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+
+	uint64_t targetLag = (uint64_t) config->maintenance_drain_lag;
+	uint64_t lag = 0;
+	bool hasStandby = false;
+	bool drained = false;
+
+	char note[FSM_NOTE_MAXLEN] = { 0 };
+	instr_time start;
+	instr_time elapsed;
+
+	log_info("Draining writes before maintenance: waiting for up to %dms "
+			 "for the standby replay lag to be down to %d bytes",
+			 config->maintenance_drain_timeout,
+			 config->maintenance_drain_lag);
+
+	if (!pgsql_set_default_transaction_mode_read_only(pgsql))
+	{
+		log_warn("Failed to drain writes before maintenance, "
+				 "stopping Postgres now");
+		return;
+	}
+
+	(void) fsm_timing_step_start(&start);
+
+	for (int round = 0; !(asked_to_stop || asked_to_stop_fast); round++)
+	{
+		if (!pgsql_get_standby_replay_lag(pgsql, &hasStandby, &lag) ||
+			!hasStandby)
+		{
+			break;
+		}
+
+		if (lag <= targetLag)
+		{
+			drained = true;
+			break;
+		}
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) >= config->maintenance_drain_timeout)
+		{
+			break;
+		}
+
+		/* log progress every second */
+		if (round % 10 == 0)
+		{
+			log_info("Standby replay lag is %" PRIu64 " bytes", lag);
+		}
+
+		pg_usleep(100 * 1000);
+	}
+
+	(void) fsm_timing_step_done("drain", &start);
+
+	if (!hasStandby)
+	{
+		log_warn("Failed to get the replay lag of a connected standby node, "
+				 "stopping Postgres now");
+		sformat(note, sizeof(note), "standby replay lag unknown after drain");
+	}
+	else
+	{
+		if (drained)
+		{
+			log_info("Drained writes: standby replay lag is %" PRIu64 " bytes",
+					 lag);
+		}
+		else
+		{
+			log_warn("Failed to drain writes: standby replay lag is still "
+					 "%" PRIu64 " bytes, stopping Postgres now",
+					 lag);
+		}
+
+		sformat(note, sizeof(note),
+				"standby replay lag %" PRIu64 " bytes after drain", lag);
+	}
+
+	(void) fsm_timing_note(note);
+}
+
+
 /*
  * fsm_stop_postgres_and_setup_standby is used when the primary is put to
  * maintenance. Not only do we stop Postgres, we also prepare a setup as a
@@ -737,10 +929,10 @@ fsm_stop_postgres_and_setup_standby(Keeper *keeper)
 		return false;
 	}
 
-	/* get the primary node to follow */
-	if (!keeper_get_primary(keeper, &(postgres->replicationSource.primaryNode)))
+	/* get the primary node to follow, or our cascading upstream node */
+	if (!keeper_get_upstream(keeper, &(postgres->replicationSource.primaryNode)))
 	{
-		log_error("Failed to initialize standby for lack of a primary node, "
+		log_error("Failed to initialize standby for lack of an upstream node, "
 				  "see above for details");
 		return false;
 	}
@@ -814,9 +1006,17 @@ fsm_checkpoint_and_stop_postgres(Keeper *keeper)
 		 *
 		 * The first checkpoint writes all the in-memory buffers, the second
 		 * checkpoint writes everything that was added during the first one.
+		 *
+		 * Both the time spent in the pre-checkpoint and in the final shutdown
+		 * are found in the transition timings, and then in the monitor event
+		 * for this transition.
 		 */
+		instr_time start;
+
 		log_info("Preparing Postgres shutdown: CHECKPOINT;");
 
+		(void) fsm_timing_step_start(&start);
+
 		for (int i = 0; i < 2; i++)
 		{
 			if (!pgsql_checkpoint(pgsql))
@@ -824,6 +1024,8 @@ fsm_checkpoint_and_stop_postgres(Keeper *keeper)
 				log_warn("Failed to checkpoint before stopping Postgres");
 			}
 		}
+
+		(void) fsm_timing_step_done("pre-checkpoint", &start);
 	}
 
 	log_info("Stopping Postgres at \"%s\"", pgSetup->pgdata);
@@ -857,6 +1059,8 @@ fsm_init_standby_from_upstream(Keeper *keeper)
 	bool skipBaseBackup = file_exists(keeper->config.pathnames.init) &&
 						  keeper->initState.pgInitState == PRE_INIT_STATE_EXISTS;
 
+	(void) keeper_prepare_base_backup(keeper);
+
 	if (!standby_init_database(postgres, config->hostname, skipBaseBackup))
 	{
 		log_error("Failed to initialize standby server, see above for details");
@@ -938,6 +1142,15 @@ fsm_init_standby(Keeper *keeper)
 		return false;
 	}
 
+	/* spare the primary the base backup when a secondary node can do it */
+	if (!keeper_get_basebackup_source(keeper,
+									  &(postgres->replicationSource.backupNode)))
+	{
+		log_warn("Failed to get a base backup source node from the monitor, "
+				 "taking the base backup from the primary");
+		postgres->replicationSource.backupNode = (NodeAddress) { 0 };
+	}
+
 	return fsm_init_standby_from_upstream(keeper);
 }
 
@@ -991,13 +1204,52 @@ fsm_rewind_or_init(Keeper *keeper)
 		return false;
 	}
 
-	if (!primary_rewind_to_standby(postgres))
+	/*
+	 * After a switchover we have been shut down cleanly, and the new primary
+	 * has replayed our shutdown checkpoint: we can just restart as a standby.
+	 */
+	if (primary_can_follow_without_rewind(postgres))
+	{
+		if (primary_restart_as_standby(postgres))
+		{
+			return true;
+		}
+
+		log_warn("Failed to restart demoted primary as a standby, "
+				 "trying pg_rewind instead");
+	}
+
+	bool tryRewind = keeper_rewind_is_expected_faster(keeper);
+
+	(void) keeper_prepare_rebuild_scheduling(keeper);
+
+	if (!tryRewind || !primary_rewind_to_standby(postgres))
 	{
 		bool skipBaseBackup = false;
 		bool forceCacheInvalidation = true;
 
-		log_warn("Failed to rewind demoted primary to standby, "
-				 "trying pg_basebackup instead");
+		if (tryRewind)
+		{
+			log_warn("Failed to rewind demoted primary to standby, "
+					 "trying pg_basebackup instead");
+		}
+
+		(void) keeper_prepare_base_backup(keeper);
+
+		/*
+		 * Most of our data files might still be the same as on the primary,
+		 * and then copying only the files that differ is faster.
+		 */
+		if (!IS_EMPTY_STRING_BUFFER(upstream->resyncCommand))
+		{
+			skipBaseBackup = standby_delta_resync(postgres);
+
+			if (!skipBaseBackup)
+			{
+				log_warn("Failed to resync the data files of the demoted "
+						 "primary, using pg_basebackup instead");
+			}
+		}
 
 		if (!standby_init_database(postgres, config->hostname, skipBaseBackup))
 		{
@@ -1067,10 +1319,26 @@ fsm_prepare_for_secondary(Keeper *keeper)
 bool
 fsm_prepare_standby_for_promotion(Keeper *keeper)
 {
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
 	log_debug("No support for async replication means we don't wait until "
 			  "prepare_promotion_walreceiver_timeout (%ds)",
 			  keeper->config.prepare_promotion_walreceiver);
 
+	/*
+	 * Start warming up the cache with the hot relations of the primary. This
+	 * runs in the background of the keeper main loop, and failing to prewarm
+	 * must not prevent the promotion.
+	 */
+	if (!keeper_prewarm_start(&(keeper->prewarm),
+							  &(postgres->postgresSetup),
+							  config->prewarm_budget))
+	{
+		log_warn("Failed to prewarm the standby before promotion, "
+				 "see above for details");
+	}
+
 	return true;
 }
 
@@ -1231,7 +1499,7 @@ fsm_report_lsn(Keeper *keeper)
 		return false;
 	}
 
-	log_info("Restarting standby node to disconnect replication "
+	log_info("Reconfiguring standby node to disconnect replication "
 			 "from failed primary node, to prepare failover");
 
 	if (!standby_restart_with_current_replication_source(postgres))
@@ -1250,7 +1518,8 @@ fsm_report_lsn(Keeper *keeper)
 									 &pgSetup->is_in_recovery,
 									 postgres->pgsrSyncState,
 									 postgres->currentLSN,
-									 &(postgres->postgresSetup.control)))
+									 &(postgres->postgresSetup.control),
+									 NULL))
 	{
 		log_error("Failed to update the local Postgres metadata");
 		return false;
@@ -1260,6 +1529,22 @@ fsm_report_lsn(Keeper *keeper)
 }
 
 
+/*
+ * When the monitor elected us as the failover candidate before the other
+ * standby nodes reported their LSN, and one of them turns out to have more
+ * WAL, we join the regular election instead.
+ *
+ * prepare_promotion ➜ report_lsn
+ */
+bool
+fsm_cancel_promotion(Keeper *keeper)
+{
+	(void) keeper_prewarm_stop(&(keeper->prewarm));
+
+	return fsm_report_lsn(keeper);
+}
+
+
 /*
  * When the selected failover candidate does not have the latest received WAL,
  * it fetches them from another standby, the first one with the most LSN
@@ -1309,6 +1594,8 @@ fsm_fast_forward(Keeper *keeper)
 		return false;
 	}
 
+	upstream->walFetchWorkers = config->wal_fetch_workers;
+
 	if (!standby_fetch_missing_wal(postgres))
 	{
 		log_error("Failed to fetch WAL bytes from standby node " NODE_FORMAT
@@ -1327,12 +1614,25 @@ fsm_fast_forward(Keeper *keeper)
 /*
  * fsm_cleanup_and_resume_as_primary cleans-up the replication setting and
  * start the local node as primary. It's called after a fast-forward operation.
+ *
+ * When the fast-forward streamed the missing WAL without a recovery target,
+ * Postgres is still a running standby, just like when reaching
+ * prepare_promotion from report_lsn: we keep it running and it is promoted
+ * in the next transition.
  */
 bool
 fsm_cleanup_and_resume_as_primary(Keeper *keeper)
 {
 	LocalPostgresServer *postgres = &(keeper->postgres);
 
+	if (standby_can_reload_replication_source(postgres))
+	{
+		log_info("Fast-forward streamed the missing WAL, "
+				 "skipping the restart of Postgres before promotion");
+
+		return fsm_prepare_standby_for_promotion(keeper);
+	}
+
 	if (!standby_cleanup_as_primary(postgres))
 	{
 		log_error("Failed to cleanup replication settings and restart Postgres "
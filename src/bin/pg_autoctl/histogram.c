@@ -0,0 +1,247 @@
+/*
+ * src/bin/pg_autoctl/histogram.c
+ *     Latency histograms with a bounded relative error.
+ *
+ * This follows the HdrHistogram layout: values below the sub-bucket count
+ * are recorded exactly, and then each power of two has its own set of
+ * HISTOGRAM_SUB_BUCKET_HALF buckets. The histogram has a fixed size, so that
+ * it can live in shared memory, and merging histograms is adding counts.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+#include "parson.h"
+
+
+static int histogram_bucket_index(uint64_t value);
+static uint64_t histogram_bucket_highest_value(int index);
+
+
+/*
+ * histogram_init initializes an empty histogram.
+ */
+void
+histogram_init(LatencyHistogram *histogram)
+{
+	memset(histogram, 0, sizeof(LatencyHistogram));
+}
+
+
+/*
+ * histogram_record records a value in the histogram. Values that are larger
+ * than HISTOGRAM_MAX_VALUE are recorded as HISTOGRAM_MAX_VALUE.
+ */
+void
+histogram_record(LatencyHistogram *histogram, uint64_t value)
+{
+	if (value > HISTOGRAM_MAX_VALUE)
+	{
+		value = HISTOGRAM_MAX_VALUE;
+	}
+
+	if (histogram->count == 0 || value < histogram->min)
+	{
+		histogram->min = value;
+	}
+
+	if (value > histogram->max)
+	{
+		histogram->max = value;
+	}
+
+	++histogram->count;
+	histogram->sum += (double) value;
+	++histogram->counts[histogram_bucket_index(value)];
+}
+
+
+/*
+ * histogram_merge adds the values of the source histogram to the target one.
+ */
+void
+histogram_merge(LatencyHistogram *target, LatencyHistogram *source)
+{
+	if (source->count == 0)
+	{
+		return;
+	}
+
+	if (target->count == 0 || source->min < target->min)
+	{
+		target->min = source->min;
+	}
+
+	if (source->max > target->max)
+	{
+		target->max = source->max;
+	}
+
+	target->count += source->count;
+	target->sum += source->sum;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		target->counts[i] += source->counts[i];
+	}
+}
+
+
+/*
+ * histogram_percentile returns the value at the given percentile, between 0
+ * and 100. As in HdrHistogram, that's the highest value that is equivalent
+ * to the values recorded in the bucket where the percentile is reached,
+ * capped to the maximum value recorded.
+ */
+uint64_t
+histogram_percentile(LatencyHistogram *histogram, double percentile)
+{
+	if (histogram->count == 0)
+	{
+		return 0;
+	}
+
+	if (percentile > 100.0)
+	{
+		percentile = 100.0;
+	}
+
+	uint64_t target = (uint64_t) ((percentile / 100.0) * histogram->count + 0.5);
+	uint64_t total = 0;
+
+	if (target == 0)
+	{
+		target = 1;
+	}
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total += histogram->counts[i];
+
+		if (total >= target)
+		{
+			uint64_t value = histogram_bucket_highest_value(i);
+
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
+
+
+/*
+ * histogram_mean returns the mean of the recorded values.
+ */
+double
+histogram_mean(LatencyHistogram *histogram)
+{
+	if (histogram->count == 0)
+	{
+		return 0.0;
+	}
+
+	return histogram->sum / (double) histogram->count;
+}
+
+
+/*
+ * histogram_to_json returns a JSON object with the count, the min, max and
+ * mean values, and the usual percentiles, all in microseconds. With
+ * withBuckets, the non-empty buckets are added as an array of the highest
+ * value of each bucket and its count, which is enough to merge or plot
+ * histograms later.
+ */
+JSON_Value *
+histogram_to_json(LatencyHistogram *histogram, bool withBuckets)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	json_object_set_number(jsObj, "count", (double) histogram->count);
+	json_object_set_number(jsObj, "min_us", (double) histogram->min);
+	json_object_set_number(jsObj, "mean_us", histogram_mean(histogram));
+	json_object_set_number(jsObj, "p50_us",
+						   (double) histogram_percentile(histogram, 50.0));
+	json_object_set_number(jsObj, "p90_us",
+						   (double) histogram_percentile(histogram, 90.0));
+	json_object_set_number(jsObj, "p99_us",
+						   (double) histogram_percentile(histogram, 99.0));
+	json_object_set_number(jsObj, "p99.9_us",
+						   (double) histogram_percentile(histogram, 99.9));
+	json_object_set_number(jsObj, "p99.99_us",
+						   (double) histogram_percentile(histogram, 99.99));
+	json_object_set_number(jsObj, "max_us", (double) histogram->max);
+
+	if (withBuckets)
+	{
+		JSON_Value *jsBuckets = json_value_init_array();
+		JSON_Array *jsBucketsArray = json_value_get_array(jsBuckets);
+
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			if (histogram->counts[i] == 0)
+			{
+				continue;
+			}
+
+			JSON_Value *jsBucket = json_value_init_array();
+			JSON_Array *jsBucketArray = json_value_get_array(jsBucket);
+
+			json_array_append_number(jsBucketArray,
+									 (double) histogram_bucket_highest_value(i));
+			json_array_append_number(jsBucketArray,
+									 (double) histogram->counts[i]);
+
+			json_array_append_value(jsBucketsArray, jsBucket);
+		}
+
+		json_object_set_value(jsObj, "buckets", jsBuckets);
+	}
+
+	return js;
+}
+
+
+/*
+ * histogram_bucket_index returns the index of the bucket where to record the
+ * given value.
+ */
+static int
+histogram_bucket_index(uint64_t value)
+{
+	int magnitude = 0;
+
+	while ((value >> magnitude) >= HISTOGRAM_SUB_BUCKET_COUNT)
+	{
+		++magnitude;
+	}
+
+	int subBucket = (int) (value >> magnitude);
+
+	return magnitude * HISTOGRAM_SUB_BUCKET_HALF + subBucket;
+}
+
+
+/*
+ * histogram_bucket_highest_value returns the highest value that is recorded
+ * in the bucket with the given index.
+ */
+static uint64_t
+histogram_bucket_highest_value(int index)
+{
+	int magnitude = 0;
+	int subBucket = index;
+
+	if (index >= HISTOGRAM_SUB_BUCKET_COUNT)
+	{
+		magnitude = index / HISTOGRAM_SUB_BUCKET_HALF - 1;
+		subBucket = index - magnitude * HISTOGRAM_SUB_BUCKET_HALF;
+	}
+
+	return (((uint64_t) subBucket + 1) << magnitude) - 1;
+}
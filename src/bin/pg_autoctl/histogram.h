@@ -0,0 +1,49 @@
+/*
+ * src/bin/pg_autoctl/histogram.h
+ *     Latency histograms with a bounded relative error.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parson.h"
+
+/*
+ * Values are recorded in microseconds, in buckets that are as precise as 1/64
+ * of their magnitude, that is with 2 significant decimal digits, from 1us up
+ * to 38 hours.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKET_COUNT (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_SUB_BUCKET_HALF (HISTOGRAM_SUB_BUCKET_COUNT / 2)
+#define HISTOGRAM_MAX_MAGNITUDE 30
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_MAGNITUDE + 2) * HISTOGRAM_SUB_BUCKET_HALF)
+#define HISTOGRAM_MAX_VALUE \
+	((((uint64_t) HISTOGRAM_SUB_BUCKET_COUNT) << HISTOGRAM_MAX_MAGNITUDE) - 1)
+
+typedef struct LatencyHistogram
+{
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+	uint64_t counts[HISTOGRAM_BUCKETS];
+} LatencyHistogram;
+
+
+void histogram_init(LatencyHistogram *histogram);
+void histogram_record(LatencyHistogram *histogram, uint64_t value);
+void histogram_merge(LatencyHistogram *target, LatencyHistogram *source);
+uint64_t histogram_percentile(LatencyHistogram *histogram, double percentile);
+double histogram_mean(LatencyHistogram *histogram);
+JSON_Value * histogram_to_json(LatencyHistogram *histogram, bool withBuckets);
+
+#endif /* HISTOGRAM_H */
@@ -10,18 +10,21 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
 #include <limits.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "postgres_fe.h"
@@ -42,6 +45,57 @@ static bool fetchIPAddressFromInterfaceList(char *localIpAddress, int size);
 static bool ipaddr_sockaddr_to_string(struct addrinfo *ai,
 									  char *ipaddr, size_t size);
 static bool ipaddr_getsockname(int sock, char *ipaddr, size_t size);
+static int ipaddr_connect_nonblocking(ConnectProbe *probe, int64_t *startUs);
+static int ipaddr_cidr_block_cmp(const void *a, const void *b);
+static bool ipaddr_cidr_block_bit(const CIDRBlock *block, int bit);
+static int64_t monotonic_time_us(void);
+
+/*
+ * The keeper checks the hostnames of the other nodes each time it edits HBA
+ * rules, and DNS might be slow to answer, or even time out. We keep the
+ * results of our lookups in a small cache for DNS_CACHE_TTL seconds, and
+ * failures for DNS_CACHE_NEGATIVE_TTL seconds.
+ *
+ * When a lookup fails after its cache entry expired, we keep using the last
+ * successful answer for up to DNS_CACHE_STALE_TTL seconds, so that a DNS
+ * outage doesn't stall the keeper loops.
+ */
+typedef enum
+{
+	DNS_LOOKUP_LOCAL_ADDRESS = 0,
+	DNS_LOOKUP_FORWARD_AND_REVERSE
+} DNSLookupKind;
+
+typedef struct DNSCacheEntry
+{
+	DNSLookupKind kind;
+	char hostname[_POSIX_HOST_NAME_MAX];
+	bool success;
+	bool foundHostnameFromAddress;
+	char ipaddr[BUFSIZE];
+	uint64_t lookupTime;
+	uint64_t successTime;
+} DNSCacheEntry;
+
+static DNSCacheEntry dnsCache[DNS_CACHE_SIZE] = { 0 };
+static int dnsCacheCount = 0;
+
+static DNSCacheEntry * ipaddr_cache_lookup(DNSLookupKind kind,
+										   const char *hostname);
+static bool ipaddr_cache_is_fresh(DNSCacheEntry *entry, uint64_t now);
+static DNSCacheEntry * ipaddr_cache_store(DNSCacheEntry *entry,
+										  DNSLookupKind kind,
+										  const char *hostname,
+										  bool success,
+										  const char *ipaddr,
+										  bool foundHostnameFromAddress,
+										  uint64_t now);
+
+static bool ipaddr_find_local_address(const char *hostname,
+									  char *localIpAddress, int size);
+static bool ipaddr_resolve_forward_and_reverse(const char *hostname,
+											   char *ipaddr, int size,
+											   bool *foundHostnameFromAddress);
 
 
 /*
@@ -320,6 +374,159 @@ fetchLocalCIDR(const char *localIpAddress, char *localCIDR, int size)
 }
 
 
+/*
+ * aggregateCIDRBlocks computes the smallest set of CIDR blocks that contains
+ * exactly the given IP addresses, no more: two blocks of the same prefix
+ * length that only differ on their last bit are merged into a block of a
+ * prefix one bit shorter, until no such pair is left. The blocks array must
+ * have room for count entries.
+ *
+ * The function returns the number of blocks, sorted by address, or -1 when
+ * one of the given strings is not an IP address.
+ */
+int
+aggregateCIDRBlocks(const char **ipAddresses, int count, CIDRBlock *blocks)
+{
+	int blockCount = 0;
+	bool merged = true;
+
+	for (int i = 0; i < count; i++)
+	{
+		CIDRBlock *block = &(blocks[i]);
+
+		memset(block, 0, sizeof(CIDRBlock));
+
+		if (inet_pton(AF_INET, ipAddresses[i], block->address) == 1)
+		{
+			block->family = AF_INET;
+			block->prefixLength = 32;
+		}
+		else if (inet_pton(AF_INET6, ipAddresses[i], block->address) == 1)
+		{
+			block->family = AF_INET6;
+			block->prefixLength = 128;
+		}
+		else
+		{
+			log_warn("Failed to parse IP address \"%s\"", ipAddresses[i]);
+			return -1;
+		}
+	}
+
+	/* skip duplicate addresses */
+	qsort(blocks, count, sizeof(CIDRBlock), ipaddr_cidr_block_cmp);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (blockCount == 0 ||
+			ipaddr_cidr_block_cmp(&(blocks[blockCount - 1]), &(blocks[i])) != 0)
+		{
+			blocks[blockCount++] = blocks[i];
+		}
+	}
+
+	while (merged)
+	{
+		int mergedCount = 0;
+
+		merged = false;
+		qsort(blocks, blockCount, sizeof(CIDRBlock), ipaddr_cidr_block_cmp);
+
+		for (int i = 0; i < blockCount; i++)
+		{
+			CIDRBlock block = blocks[i];
+			CIDRBlock *previous =
+				mergedCount > 0 ? &(blocks[mergedCount - 1]) : NULL;
+			int lastBit = block.prefixLength - 1;
+
+			/*
+			 * The previous block is our sibling when it has the same prefix,
+			 * with its last bit set to zero where ours is set to one. It then
+			 * becomes the parent block of both.
+			 */
+			if (previous != NULL &&
+				previous->family == block.family &&
+				previous->prefixLength == block.prefixLength &&
+				lastBit >= 0 &&
+				!ipaddr_cidr_block_bit(previous, lastBit) &&
+				ipaddr_cidr_block_bit(&block, lastBit))
+			{
+				block.address[lastBit / 8] &= ~(0x80 >> (lastBit % 8));
+
+				if (memcmp(previous->address, block.address,
+						   sizeof(block.address)) == 0)
+				{
+					--(previous->prefixLength);
+					merged = true;
+					continue;
+				}
+
+				block.address[lastBit / 8] |= 0x80 >> (lastBit % 8);
+			}
+
+			blocks[mergedCount++] = block;
+		}
+
+		blockCount = mergedCount;
+	}
+
+	for (int i = 0; i < blockCount; i++)
+	{
+		CIDRBlock *block = &(blocks[i]);
+		char address[INET6_ADDRSTRLEN] = { 0 };
+
+		if (inet_ntop(block->family, block->address,
+					  address, sizeof(address)) == NULL)
+		{
+			log_warn("Failed to format IP address: %m");
+			return -1;
+		}
+
+		sformat(block->cidr, sizeof(block->cidr), "%s/%d",
+				address, block->prefixLength);
+	}
+
+	return blockCount;
+}
+
+
+/*
+ * ipaddr_cidr_block_cmp is a qsort comparator for CIDRBlock arrays: IPv4
+ * first, then by address, then by prefix length.
+ */
+static int
+ipaddr_cidr_block_cmp(const void *a, const void *b)
+{
+	const CIDRBlock *blockA = (const CIDRBlock *) a;
+	const CIDRBlock *blockB = (const CIDRBlock *) b;
+
+	if (blockA->family != blockB->family)
+	{
+		return blockA->family == AF_INET ? -1 : 1;
+	}
+
+	int cmp = memcmp(blockA->address, blockB->address, sizeof(blockA->address));
+
+	if (cmp != 0)
+	{
+		return cmp;
+	}
+
+	return blockA->prefixLength - blockB->prefixLength;
+}
+
+
+/*
+ * ipaddr_cidr_block_bit returns true when the given bit of the block address
+ * is set, counting from the most significant bit.
+ */
+static bool
+ipaddr_cidr_block_bit(const CIDRBlock *block, int bit)
+{
+	return (block->address[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+
 /*
  * countSetBits return how many bits are set (to 1) in an integer. When given a
  * netmask, that's the CIDR prefix.
@@ -468,6 +675,50 @@ ipv6eq(struct sockaddr_in6 *a, struct sockaddr_in6 *b)
  */
 bool
 findHostnameLocalAddress(const char *hostname, char *localIpAddress, int size)
+{
+	uint64_t now = time(NULL);
+	DNSCacheEntry *entry =
+		ipaddr_cache_lookup(DNS_LOOKUP_LOCAL_ADDRESS, hostname);
+
+	if (ipaddr_cache_is_fresh(entry, now))
+	{
+		if (!entry->success)
+		{
+			log_warn("Failed to find a local IP address for \"%s\" "
+					 "%d seconds ago, see above for details",
+					 hostname, (int) (now - entry->lookupTime));
+			return false;
+		}
+
+		log_trace("findHostnameLocalAddress: \"%s\" is %s (cached)",
+				  hostname, entry->ipaddr);
+
+		strlcpy(localIpAddress, entry->ipaddr, size);
+		return true;
+	}
+
+	bool success = ipaddr_find_local_address(hostname, localIpAddress, size);
+
+	entry = ipaddr_cache_store(entry, DNS_LOOKUP_LOCAL_ADDRESS, hostname,
+							   success, localIpAddress, false, now);
+
+	/* use the last known answer when the lookup failed */
+	if (!success && entry->success)
+	{
+		strlcpy(localIpAddress, entry->ipaddr, size);
+		return true;
+	}
+
+	return success;
+}
+
+
+/*
+ * ipaddr_find_local_address implements findHostnameLocalAddress without
+ * using our cache.
+ */
+static bool
+ipaddr_find_local_address(const char *hostname, char *localIpAddress, int size)
 {
 	struct addrinfo *dns_lookup_addr;
 	struct addrinfo *dns_addr;
@@ -681,6 +932,57 @@ findHostnameFromLocalIpAddress(char *localIpAddress, char *hostname, int size)
 bool
 resolveHostnameForwardAndReverse(const char *hostname, char *ipaddr, int size,
 								 bool *foundHostnameFromAddress)
+{
+	uint64_t now = time(NULL);
+	DNSCacheEntry *entry =
+		ipaddr_cache_lookup(DNS_LOOKUP_FORWARD_AND_REVERSE, hostname);
+
+	if (ipaddr_cache_is_fresh(entry, now))
+	{
+		if (!entry->success)
+		{
+			log_warn("Failed to resolve DNS name \"%s\" %d seconds ago, "
+					 "see above for details",
+					 hostname, (int) (now - entry->lookupTime));
+			return false;
+		}
+
+		log_trace("resolveHostnameForwardAndReverse: \"%s\" is %s (cached)",
+				  hostname, entry->ipaddr);
+
+		strlcpy(ipaddr, entry->ipaddr, size);
+		*foundHostnameFromAddress = entry->foundHostnameFromAddress;
+		return true;
+	}
+
+	bool success =
+		ipaddr_resolve_forward_and_reverse(hostname, ipaddr, size,
+										   foundHostnameFromAddress);
+
+	entry = ipaddr_cache_store(entry, DNS_LOOKUP_FORWARD_AND_REVERSE,
+							   hostname, success, ipaddr,
+							   *foundHostnameFromAddress, now);
+
+	/* use the last known answer when the lookup failed */
+	if (!success && entry->success)
+	{
+		strlcpy(ipaddr, entry->ipaddr, size);
+		*foundHostnameFromAddress = entry->foundHostnameFromAddress;
+		return true;
+	}
+
+	return success;
+}
+
+
+/*
+ * ipaddr_resolve_forward_and_reverse implements
+ * resolveHostnameForwardAndReverse without using our cache.
+ */
+static bool
+ipaddr_resolve_forward_and_reverse(const char *hostname,
+								   char *ipaddr, int size,
+								   bool *foundHostnameFromAddress)
 {
 	struct addrinfo *lookup, *ai;
 
@@ -745,6 +1047,113 @@ resolveHostnameForwardAndReverse(const char *hostname, char *ipaddr, int size,
 }
 
 
+/*
+ * ipaddr_cache_lookup returns the cache entry for the given lookup, or NULL.
+ */
+static DNSCacheEntry *
+ipaddr_cache_lookup(DNSLookupKind kind, const char *hostname)
+{
+	for (int i = 0; i < dnsCacheCount; i++)
+	{
+		DNSCacheEntry *entry = &(dnsCache[i]);
+
+		if (entry->kind == kind && strcmp(entry->hostname, hostname) == 0)
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * ipaddr_cache_is_fresh returns true when the cache entry can be used without
+ * doing the lookup again. Failed lookups, including the ones where we are
+ * using the last known answer, are retried after DNS_CACHE_NEGATIVE_TTL.
+ */
+static bool
+ipaddr_cache_is_fresh(DNSCacheEntry *entry, uint64_t now)
+{
+	if (entry == NULL)
+	{
+		return false;
+	}
+
+	uint64_t ttl =
+		entry->success && entry->lookupTime == entry->successTime
+		? DNS_CACHE_TTL
+		: DNS_CACHE_NEGATIVE_TTL;
+
+	return (now - entry->lookupTime) < ttl;
+}
+
+
+/*
+ * ipaddr_cache_store registers the result of a lookup in the cache, and
+ * returns the cache entry. When the lookup failed and we had a successful
+ * answer less than DNS_CACHE_STALE_TTL seconds ago, the entry keeps that
+ * answer, which the caller then uses.
+ */
+static DNSCacheEntry *
+ipaddr_cache_store(DNSCacheEntry *entry,
+				   DNSLookupKind kind, const char *hostname,
+				   bool success, const char *ipaddr,
+				   bool foundHostnameFromAddress,
+				   uint64_t now)
+{
+	if (entry == NULL)
+	{
+		if (dnsCacheCount < DNS_CACHE_SIZE)
+		{
+			entry = &(dnsCache[dnsCacheCount++]);
+		}
+		else
+		{
+			/* evict the entry that was looked-up the longest time ago */
+			entry = &(dnsCache[0]);
+
+			for (int i = 1; i < dnsCacheCount; i++)
+			{
+				if (dnsCache[i].lookupTime < entry->lookupTime)
+				{
+					entry = &(dnsCache[i]);
+				}
+			}
+		}
+
+		bzero((void *) entry, sizeof(DNSCacheEntry));
+
+		entry->kind = kind;
+		strlcpy(entry->hostname, hostname, sizeof(entry->hostname));
+	}
+
+	entry->lookupTime = now;
+
+	if (success)
+	{
+		entry->success = true;
+		entry->successTime = now;
+		entry->foundHostnameFromAddress = foundHostnameFromAddress;
+		strlcpy(entry->ipaddr, ipaddr, sizeof(entry->ipaddr));
+	}
+	else if (entry->success && (now - entry->successTime) < DNS_CACHE_STALE_TTL)
+	{
+		log_warn("Using the last known address %s for \"%s\", "
+				 "resolved %d seconds ago",
+				 entry->ipaddr, hostname, (int) (now - entry->successTime));
+	}
+	else
+	{
+		entry->success = false;
+		entry->foundHostnameFromAddress = false;
+		bzero((void *) entry->ipaddr, sizeof(entry->ipaddr));
+	}
+
+	return entry;
+}
+
+
 /*
  * ipaddr_sockaddr_to_string converts a binary socket address to its string
  * representation using inet_ntop(3).
@@ -867,3 +1276,190 @@ ipaddrGetLocalHostname(char *hostname, size_t size)
 
 	return true;
 }
+
+
+/*
+ * probeConnectTime opens a TCP connection to each of the given probes, and
+ * closes it as soon as it is established: the TCP handshake takes a single
+ * network round-trip, so the time it took is our estimate of the round-trip
+ * time to the probe.
+ *
+ * The connections are made in parallel, and the probes that could not
+ * connect within timeoutMs get an rttUs of -1. Only the first address of
+ * each host name is probed.
+ */
+bool
+probeConnectTime(ConnectProbe *probes, int count, int timeoutMs)
+{
+	struct pollfd fds[CONNECT_PROBE_MAX_COUNT] = { 0 };
+	int64_t startUs[CONNECT_PROBE_MAX_COUNT] = { 0 };
+	int pending = 0;
+
+	if (count > CONNECT_PROBE_MAX_COUNT)
+	{
+		log_error("BUG: probeConnectTime called with %d probes, "
+				  "the maximum is %d",
+				  count, CONNECT_PROBE_MAX_COUNT);
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		probes[i].rttUs = -1;
+
+		fds[i].events = POLLOUT;
+		fds[i].fd = ipaddr_connect_nonblocking(&(probes[i]), &(startUs[i]));
+
+		if (fds[i].fd >= 0)
+		{
+			++pending;
+		}
+	}
+
+	int64_t deadlineUs = monotonic_time_us() + (int64_t) timeoutMs * 1000;
+
+	while (pending > 0)
+	{
+		int64_t nowUs = monotonic_time_us();
+
+		if (nowUs >= deadlineUs)
+		{
+			break;
+		}
+
+		int ready = poll(fds, count, (int) ((deadlineUs - nowUs + 999) / 1000));
+
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_warn("Failed to poll connections to probe: %m");
+			break;
+		}
+
+		nowUs = monotonic_time_us();
+
+		for (int i = 0; i < count; i++)
+		{
+			int error = 0;
+			socklen_t errorSize = sizeof(error);
+
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+			{
+				continue;
+			}
+
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR,
+						   &error, &errorSize) == 0 &&
+				error == 0)
+			{
+				probes[i].rttUs = nowUs - startUs[i];
+			}
+			else
+			{
+				log_debug("Failed to connect to \"%s\" port %d: %s",
+						  probes[i].host, probes[i].port, strerror(error));
+			}
+
+			close(fds[i].fd);
+			fds[i].fd = -1;
+			--pending;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (fds[i].fd >= 0)
+		{
+			log_debug("Failed to connect to \"%s\" port %d in %d ms",
+					  probes[i].host, probes[i].port, timeoutMs);
+			close(fds[i].fd);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * ipaddr_connect_nonblocking starts a TCP connection to the first address of
+ * the probe host, and returns the socket, or -1 when the connection has
+ * failed already. The time when the connection started is set in startUs,
+ * after the host name has been resolved.
+ */
+static int
+ipaddr_connect_nonblocking(ConnectProbe *probe, int64_t *startUs)
+{
+	struct addrinfo *lookup = NULL;
+	struct addrinfo hints = { 0 };
+
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	int error = getaddrinfo(probe->host,
+							intToString(probe->port).strValue,
+							&hints,
+							&lookup);
+	if (error != 0)
+	{
+		log_warn("Failed to parse host name or IP address \"%s\": %s",
+				 probe->host, gai_strerror(error));
+		return -1;
+	}
+
+	int sock = socket(lookup->ai_family, lookup->ai_socktype,
+					  lookup->ai_protocol);
+
+	if (sock < 0)
+	{
+		log_warn("Failed to create a socket: %m");
+		freeaddrinfo(lookup);
+		return -1;
+	}
+
+	int flags = fcntl(sock, F_GETFL, 0);
+
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		log_warn("Failed to set the socket in non-blocking mode: %m");
+		close(sock);
+		freeaddrinfo(lookup);
+		return -1;
+	}
+
+	*startUs = monotonic_time_us();
+
+	/* connecting on the loopback interface may succeed right away */
+	if (connect(sock, lookup->ai_addr, lookup->ai_addrlen) < 0 &&
+		errno != EINPROGRESS)
+	{
+		log_debug("Failed to connect to \"%s\" port %d: %m",
+				  probe->host, probe->port);
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(lookup);
+
+	return sock;
+}
+
+
+/*
+ * monotonic_time_us returns the current time of the monotonic clock, in
+ * microseconds.
+ */
+static int64_t
+monotonic_time_us(void)
+{
+	struct timespec now = { 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -11,7 +11,9 @@
 #ifndef __IPADDRH__
 #define __IPADDRH__
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 
 typedef enum
@@ -20,11 +22,41 @@ typedef enum
 } IPType;
 
 
+/*
+ * ConnectProbe is a TCP endpoint that probeConnectTime() opens a connection
+ * to, to estimate the network round-trip time to that endpoint.
+ */
+#define CONNECT_PROBE_MAX_COUNT 32
+
+typedef struct ConnectProbe
+{
+	char host[_POSIX_HOST_NAME_MAX];
+	int port;
+	int64_t rttUs;              /* -1 when we couldn't connect in time */
+} ConnectProbe;
+
+
+/*
+ * CIDRBlock is a network, as computed by aggregateCIDRBlocks(): the address
+ * has all the bits after the prefix length set to zero.
+ */
+#define CIDR_MAXLENGTH 64           /* IPv6 address, slash, prefix */
+
+typedef struct CIDRBlock
+{
+	int family;                     /* AF_INET or AF_INET6 */
+	unsigned char address[16];
+	int prefixLength;
+	char cidr[CIDR_MAXLENGTH];
+} CIDRBlock;
+
+
 IPType ip_address_type(const char *hostname);
 bool fetchLocalIPAddress(char *localIpAddress, int size,
 						 const char *serviceName, int servicePort,
 						 int logLevel, bool *mayRetry);
 bool fetchLocalCIDR(const char *localIpAddress, char *localCIDR, int size);
+int aggregateCIDRBlocks(const char **ipAddresses, int count, CIDRBlock *blocks);
 bool findHostnameLocalAddress(const char *hostname,
 							  char *localIpAddress, int size);
 bool findHostnameFromLocalIpAddress(char *localIpAddress,
@@ -36,5 +68,7 @@ bool resolveHostnameForwardAndReverse(const char *hostname,
 
 bool ipaddrGetLocalHostname(char *hostname, size_t size);
 
+bool probeConnectTime(ConnectProbe *probes, int count, int timeoutMs);
+
 
 #endif /* __IPADDRH__ */
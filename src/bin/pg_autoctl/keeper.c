@@ -19,23 +19,39 @@
 #include "env_utils.h"
 #include "file_utils.h"
 #include "fsm.h"
+#include "ipaddr.h"
 #include "keeper.h"
 #include "keeper_config.h"
 #include "keeper_pg_init.h"
+#include "node_probe.h"
 #include "parsing.h"
 #include "pghba.h"
 #include "pgsetup.h"
+#include "pqexpbuffer.h"
 #include "primary_standby.h"
 #include "signals.h"
 #include "state.h"
+#include "string_utils.h"
+#include "system_utils.h"
+
+
+/* weight of the last sample in the moving average of the apply rate */
+#define REPLAY_PROGRESS_RATE_WEIGHT 0.3
 
 
 static bool keeper_state_check_postgres(Keeper *keeper,
 										PostgresControlData *control);
+static void stale_nodesArray(NodeAddressArray *previousNodesArray,
+							 NodeAddressArray *currentNodesArray,
+							 NodeAddressArray *staleNodesArray);
+static bool keeper_report_replication_slots(Keeper *keeper);
+static bool keeper_report_drain_stats(Keeper *keeper);
+static void keeper_report_wal_space(Keeper *keeper, NodeProbeSnapshot *snapshot);
+static bool keeper_crash_recovery_exceeds_timeout(Keeper *keeper);
+static bool keeper_warn_restart_settings(Keeper *keeper,
+										 const char *configFilePath,
+										 const char *previousContents);
 
-static void diff_nodesArray(NodeAddressArray *previousNodesArray,
-							NodeAddressArray *currentNodesArray,
-							NodeAddressArray *diffNodesArray);
 
 
 /*
@@ -52,12 +68,31 @@ keeper_init(Keeper *keeper, KeeperConfig *config)
 
 	local_postgres_init(&keeper->postgres, pgSetup);
 
+	(void) pgsql_set_keepalives(config->keepalives,
+								config->keepalives_idle,
+								config->tcp_user_timeout);
+
 	if (!config->monitorDisabled)
 	{
 		if (!monitor_init(&keeper->monitor, config->monitor_pguri))
 		{
 			return false;
 		}
+
+		if (!IS_EMPTY_STRING_BUFFER(config->monitor_replica_pguri) &&
+			!monitor_init_replica(&keeper->monitor,
+								  config->monitor_replica_pguri))
+		{
+			log_warn("Failed to setup the monitor replica connection, "
+					 "reading from the monitor instead");
+		}
+
+		if (!IS_EMPTY_STRING_BUFFER(config->monitor_pooler_pguri) &&
+			!monitor_init_pooler(&keeper->monitor,
+								 config->monitor_pooler_pguri))
+		{
+			return false;
+		}
 	}
 
 	if (!keeper_load_state(keeper))
@@ -86,7 +121,7 @@ keeper_load_state(Keeper *keeper)
 
 /*
  * keeper_store_state stores the current state of the keeper in the configured
- * state file.
+ * state file, unless the file is up to date already.
  */
 bool
 keeper_store_state(Keeper *keeper)
@@ -94,7 +129,34 @@ keeper_store_state(Keeper *keeper)
 	KeeperStateData *keeperState = &(keeper->state);
 	KeeperConfig *config = &(keeper->config);
 
-	return keeper_state_write(keeperState, config->pathnames.state);
+	return keeper_state_write_if_changed(keeperState, config->pathnames.state);
+}
+
+
+/*
+ * keeper_set_log_context adds the node identity and FSM states to the context
+ * of our log lines, which is only visible when using the JSON log format.
+ */
+void
+keeper_set_log_context(Keeper *keeper)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+
+	if (!log_get_json())
+	{
+		return;
+	}
+
+	(void) log_set_context_int("node_id", keeperState->current_node_id);
+	(void) log_set_context_int("group_id", keeperState->current_group);
+	(void) log_set_context("current_state",
+						   NodeStateToString(keeperState->current_role));
+	(void) log_set_context("assigned_state",
+						   NodeStateToString(keeperState->assigned_role));
+
+	/* a NULL value removes the trace id from the context */
+	(void) log_set_context("trace_id",
+						   keeper->traceId[0] != '\0' ? keeper->traceId : NULL);
 }
 
 
@@ -292,9 +354,40 @@ keeper_ensure_current_state(Keeper *keeper)
 			return keeper_ensure_postgres_is_running(keeper, updateRetries);
 		}
 
+		case DRAINING_STATE:
+		{
+			if (postgres->pgIsRunning && keeper->config.read_only_fencing)
+			{
+				/* keep serving reads, and make sure commits are still fenced */
+				if (keeper_fence_postgres(keeper))
+				{
+					return true;
+				}
+
+				log_warn("Failed to fence PostgreSQL while in state \"%s\", "
+						 "stopping PostgreSQL.",
+						 NodeStateToString(keeperState->current_role));
+
+				return ensure_postgres_service_is_stopped(postgres);
+			}
+
+			if (postgres->pgIsRunning)
+			{
+				log_warn("PostgreSQL is running while in state \"%s\", "
+						 "stopping PostgreSQL.",
+						 NodeStateToString(keeperState->current_role));
+
+				return ensure_postgres_service_is_stopped(postgres);
+			}
+			return true;
+		}
+
+		/*
+		 * Once we report demote_timeout or demoted, the monitor lets the new
+		 * primary take writes: Postgres must be stopped, fenced or not.
+		 */
 		case DEMOTED_STATE:
 		case DEMOTE_TIMEOUT_STATE:
-		case DRAINING_STATE:
 		{
 			if (postgres->pgIsRunning)
 			{
@@ -319,6 +412,139 @@ keeper_ensure_current_state(Keeper *keeper)
 }
 
 
+/*
+ * keeper_fence_postgres blocks commits on the local Postgres instance without
+ * stopping it, so that a draining primary keeps serving reads. It sets
+ * synchronous_standby_names to a standby name that no node uses, so that
+ * every commit waits for a standby that never comes and stays invisible to
+ * the other sessions, even when the session asked for a read-write
+ * transaction explicitly. It also sets default_transaction_read_only to on,
+ * so that clients using target_session_attrs=read-write go elsewhere.
+ *
+ * Once our own session sees the new settings, the configuration reload has
+ * been signaled to every session, and each session reloads it before its
+ * next statement. The statements that were already running might still
+ * commit with the previous settings, so we terminate them.
+ *
+ * When the instance is already fenced, this only checks that it still is.
+ */
+bool
+keeper_fence_postgres(Keeper *keeper)
+{
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+	bool readOnly = false;
+	bool fenced = false;
+	int count = 0;
+
+	if (!pgsql_get_default_transaction_read_only(pgsql, &readOnly) ||
+		!pgsql_get_commits_fenced(pgsql, &fenced))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (readOnly && fenced)
+	{
+		return true;
+	}
+
+	log_info("Fencing the local Postgres instance: commits are now "
+			 "blocked, reads are still served");
+
+	if (!readOnly && !pgsql_set_default_transaction_mode_read_only(pgsql))
+	{
+		log_error("Failed to set default_transaction_read_only to on, "
+				  "see above for details");
+		return false;
+	}
+
+	if (!fenced && !pgsql_fence_commits(pgsql))
+	{
+		log_error("Failed to set synchronous_standby_names to \"%s\", "
+				  "see above for details",
+				  PG_AUTOCTL_FENCE_STANDBY_NAME);
+		return false;
+	}
+
+	/* wait until the configuration reload has been processed */
+	uint64_t start = time(NULL);
+
+	for (;;)
+	{
+		if (!pgsql_get_commits_fenced(pgsql, &fenced))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (fenced)
+		{
+			break;
+		}
+
+		if ((time(NULL) - start) > PG_AUTOCTL_FENCE_RELOAD_TIMEOUT)
+		{
+			log_error("Failed to fence the local Postgres instance: the "
+					  "configuration reload has not been processed in %ds",
+					  PG_AUTOCTL_FENCE_RELOAD_TIMEOUT);
+			return false;
+		}
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+
+	if (!pgsql_terminate_running_sessions(pgsql, &count))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (count > 0)
+	{
+		log_info("Terminated %d session%s that were running a statement "
+				 "while fencing",
+				 count, count == 1 ? "" : "s");
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_unfence_postgres accepts writes again on the local Postgres instance
+ * when it has been fenced with keeper_fence_postgres, when the node resumes
+ * as a primary. The commits that were waiting behind the fence are then
+ * released, the node being the primary again.
+ */
+bool
+keeper_unfence_postgres(Keeper *keeper)
+{
+	PGSQL *pgsql = &(keeper->postgres.sqlClient);
+	bool readOnly = false;
+	bool fenced = false;
+
+	if (!pgsql_get_default_transaction_read_only(pgsql, &readOnly) ||
+		!pgsql_get_commits_fenced(pgsql, &fenced))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (fenced && !pgsql_disable_synchronous_replication(pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!readOnly)
+	{
+		return true;
+	}
+
+	return pgsql_set_default_transaction_mode_read_write(pgsql);
+}
+
+
 /*
  * reportPgIsRunning returns the boolean that we should use to report
  * pgIsRunning to the monitor. When the local PostgreSQL isn't running, we
@@ -327,6 +553,10 @@ keeper_ensure_current_state(Keeper *keeper)
  *
  *   timeout.postgresql_restart_failure_timeout (default 20s)
  *   timeout.postgresql_restart_failure_max_retries (default 3 times)
+ *
+ * When timeout.crash_recovery_timeout is set and the crash recovery of the
+ * local Postgres is expected to take longer than that, we report that it's
+ * not running right away, so that the monitor doesn't wait for it.
  */
 bool
 ReportPgIsRunning(Keeper *keeper)
@@ -373,6 +603,10 @@ ReportPgIsRunning(Keeper *keeper)
 
 		return postgres->pgIsRunning;
 	}
+	else if (keeper_crash_recovery_exceeds_timeout(keeper))
+	{
+		return false;
+	}
 	else if ((now - postgres->pgFirstStartFailureTs) > timeout ||
 			 postgres->pgStartRetries >= retries)
 	{
@@ -408,6 +642,79 @@ ReportPgIsRunning(Keeper *keeper)
 }
 
 
+/*
+ * keeper_crash_recovery_exceeds_timeout estimates how long the crash recovery
+ * of the local Postgres is going to take, once per failure, and returns true
+ * when that's longer than timeout.crash_recovery_timeout. The WAL to replay
+ * is the distance from the last checkpoint redo location to the end of WAL,
+ * replayed at PG_AUTOCTL_CRASH_RECOVERY_REPLAY_RATE.
+ */
+static bool
+keeper_crash_recovery_exceeds_timeout(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	uint64_t now = time(NULL);
+	uint64_t elapsed = now - postgres->pgFirstStartFailureTs;
+
+	if (config->crash_recovery_timeout <= 0)
+	{
+		return false;
+	}
+
+	if (postgres->crashRecoveryWalBytes < 0)
+	{
+		uint64_t walBytes = 0;
+
+		if (!local_postgres_estimate_crash_recovery(postgres, &walBytes))
+		{
+			log_warn("Failed to estimate the crash recovery time of Postgres, "
+					 "see above for details");
+
+			/* don't try again until Postgres runs again */
+			postgres->crashRecoveryWalBytes = 0;
+			return false;
+		}
+
+		postgres->crashRecoveryWalBytes = (int64_t) walBytes;
+
+		if (walBytes > 0)
+		{
+			log_info("Postgres crash recovery has %" PRIu64 "MB of WAL "
+					 "to replay, estimated to take %" PRIu64 "s",
+					 walBytes / (1024 * 1024),
+					 walBytes / PG_AUTOCTL_CRASH_RECOVERY_REPLAY_RATE);
+		}
+	}
+
+	if (postgres->crashRecoveryWalBytes == 0)
+	{
+		return false;
+	}
+
+	uint64_t estimate =
+		postgres->crashRecoveryWalBytes / PG_AUTOCTL_CRASH_RECOVERY_REPLAY_RATE;
+
+	if (estimate > (uint64_t) config->crash_recovery_timeout)
+	{
+		log_warn("Postgres crash recovery is estimated to take %" PRIu64 "s "
+				 "(%" PRIu64 "s elapsed), more than "
+				 "timeout.crash_recovery_timeout %ds, "
+				 "reporting PostgreSQL not running to the monitor",
+				 estimate, elapsed, config->crash_recovery_timeout);
+
+		return true;
+	}
+
+	log_info("Postgres crash recovery in progress for %" PRIu64 "s, "
+			 "estimated to take %" PRIu64 "s",
+			 elapsed, estimate);
+
+	return false;
+}
+
+
 /*
  * keeper_update_pg_state updates our internal reflection of the PostgreSQL
  * state.
@@ -467,10 +774,25 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 
 		/*
 		 * Reinitialize connection string in case host changed or was first
-		 * discovered.
+		 * discovered. When the connection string is still the same, we keep
+		 * using the connection that our previous round opened, and the
+		 * statements that have been prepared there.
 		 */
 		pg_setup_get_local_connection_string(pgSetup, connInfo);
-		pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+
+		bool reuseConnection =
+			pgsql->connection != NULL &&
+			PQstatus(pgsql->connection) == CONNECTION_OK &&
+			strcmp(pgsql->connectionString, connInfo) == 0;
+
+		if (!reuseConnection)
+		{
+			pgsql_finish(pgsql);
+			pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+		}
+
+		pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+		pgsql->statementTimeoutMs = config->local_query_timeout;
 
 		/*
 		 * Update our Postgres metadata now.
@@ -487,13 +809,82 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 		 * values (pg_control_version, catalog_version_no, and
 		 * system_identifier).
 		 */
-		if (!pgsql_get_postgres_metadata(pgsql,
-										 &pgSetup->is_in_recovery,
-										 postgres->pgsrSyncState,
-										 postgres->currentLSN,
-										 &(pgSetup->control)))
+		bool metadataOk =
+			pgsql_get_postgres_metadata(pgsql,
+										&pgSetup->is_in_recovery,
+										postgres->pgsrSyncState,
+										postgres->currentLSN,
+										&(pgSetup->control),
+										&(postgres->walReceiver));
+
+		/*
+		 * Postgres might have been restarted since our previous round, and
+		 * libpq only notices that the connection is broken when using it:
+		 * retry once with a new connection.
+		 */
+		if (!metadataOk && reuseConnection && !pgsql->statementTimedOut)
+		{
+			log_debug("Retrying to update the local Postgres metadata "
+					  "with a new connection");
+
+			pgsql_finish(pgsql);
+			pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+			pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+			pgsql->statementTimeoutMs = config->local_query_timeout;
+
+			metadataOk =
+				pgsql_get_postgres_metadata(pgsql,
+											&pgSetup->is_in_recovery,
+											postgres->pgsrSyncState,
+											postgres->currentLSN,
+											&(pgSetup->control),
+											&(postgres->walReceiver));
+		}
+
+		/*
+		 * A hung Postgres (I/O stall, stuck checkpoint) still has a pid file
+		 * and accepts connections. Rather than blocking here and going silent,
+		 * we report it to the monitor as not running. A single slow query
+		 * (autovacuum, a large sort) should not trigger a failover though, so
+		 * we only do that after several timeouts in a row.
+		 */
+		if (!metadataOk && pgsql->statementTimedOut)
+		{
+			++keeper->localQueryTimeoutCount;
+
+			if (keeper->localQueryTimeoutCount >=
+				PG_AUTOCTL_LOCAL_QUERY_TIMEOUT_COUNT)
+			{
+				log_warn("Postgres did not answer within "
+						 "timeout.local_query_timeout (%dms) %d times in a row, "
+						 "reporting it as unresponsive to the monitor",
+						 config->local_query_timeout,
+						 keeper->localQueryTimeoutCount);
+
+				postgres->pgIsRunning = false;
+			}
+			else
+			{
+				log_warn("Postgres did not answer within "
+						 "timeout.local_query_timeout (%dms), "
+						 "%d time(s) in a row out of %d",
+						 config->local_query_timeout,
+						 keeper->localQueryTimeoutCount,
+						 PG_AUTOCTL_LOCAL_QUERY_TIMEOUT_COUNT);
+			}
+		}
+		else if (metadataOk)
+		{
+			keeper->localQueryTimeoutCount = 0;
+		}
+
+		if (!metadataOk)
 		{
 			log_level(logLevel, "Failed to update the local Postgres metadata");
+
+			/* the next round opens a new connection */
+			pgsql_finish(pgsql);
+
 			return false;
 		}
 
@@ -514,6 +905,10 @@ keeper_update_pg_state(Keeper *keeper, int logLevel)
 	{
 		/* Postgres is not running. */
 		postgres->pgIsRunning = false;
+		keeper->localQueryTimeoutCount = 0;
+
+		/* a connection from a previous round is not usable anymore */
+		pgsql_finish(pgsql);
 
 		/*
 		 * Cache invalidation: keep the current values we have for the Postgres
@@ -705,6 +1100,7 @@ keeper_ensure_postgres_is_running(Keeper *keeper, bool updateRetries)
 			/* reset PostgreSQL restart failures tracking */
 			postgres->pgFirstStartFailureTs = 0;
 			postgres->pgStartRetries = 0;
+			postgres->crashRecoveryWalBytes = -1;
 		}
 		return true;
 	}
@@ -808,13 +1204,26 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 	/*
 	 * We might have to deploy a new Postgres configuration, from new SSL
 	 * options being found in our pg_autoctl configuration file or for other
-	 * reasons.
+	 * reasons. Keep the previous contents around to see what changed.
 	 */
+	char defaultsConfPath[MAXPGPATH] = { 0 };
+	char *previousDefaultsContents = NULL;
+	long previousDefaultsSize = 0L;
+
+	join_path_components(defaultsConfPath,
+						 pgSetup->pgdata,
+						 AUTOCTL_DEFAULTS_CONF_FILENAME);
+
+	(void) read_file_if_exists(defaultsConfPath,
+							   &previousDefaultsContents,
+							   &previousDefaultsSize);
+
 	if (!postgres_add_default_settings(postgres, config->hostname))
 	{
 		log_warn("Failed to edit Postgres configuration after "
 				 "reloading pg_autoctl configuration, "
 				 "see above for details");
+		free(previousDefaultsContents);
 		return false;
 	}
 
@@ -845,15 +1254,26 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 			(void) pgsql_reset_primary_conninfo(&(postgres->sqlClient));
 		}
 
-		if (!pgsql_reload_conf(&(postgres->sqlClient)))
+		if (!pg_reload_conf(pgSetup, &(postgres->sqlClient)))
 		{
 			log_warn("Failed to reload Postgres configuration after "
 					 "reloading pg_autoctl configuration, "
 					 "see above for details");
+			free(previousDefaultsContents);
 			return false;
 		}
+
+		/*
+		 * We don't restart a running Postgres for our default settings, that
+		 * is left to the operators. Let them know when it's needed.
+		 */
+		(void) keeper_warn_restart_settings(keeper,
+											defaultsConfPath,
+											previousDefaultsContents);
 	}
 
+	free(previousDefaultsContents);
+
 	if (!config->monitorDisabled)
 	{
 		if (!monitor_init(&(keeper->monitor), config->monitor_pguri))
@@ -863,6 +1283,23 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 					 "URL is invalid, see above for details");
 			return false;
 		}
+
+		if (!IS_EMPTY_STRING_BUFFER(config->monitor_replica_pguri) &&
+			!monitor_init_replica(&(keeper->monitor),
+								  config->monitor_replica_pguri))
+		{
+			log_warn("Failed to setup the monitor replica connection, "
+					 "reading from the monitor instead");
+		}
+
+		if (!IS_EMPTY_STRING_BUFFER(config->monitor_pooler_pguri) &&
+			!monitor_init_pooler(&(keeper->monitor),
+								 config->monitor_pooler_pguri))
+		{
+			log_warn("Failed to contact the monitor through its pooler "
+					 "because its URL is invalid, see above for details");
+			return false;
+		}
 	}
 
 	/*
@@ -963,6 +1400,52 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 			currentConfContents == NULL ||
 			strcmp(newConfContents, currentConfContents) != 0;
 
+		/*
+		 * Starting with Postgres 13 primary_conninfo and primary_slot_name
+		 * can be changed with a reload, so only restart Postgres when one of
+		 * the settings that changed requires it.
+		 */
+		if (replicationSettingsHaveChanged &&
+			state->pg_control_version >= 1200 &&
+			pg_setup_is_running(pgSetup))
+		{
+			char changedSettings[BUFSIZE] = { 0 };
+			char restartSettings[BUFSIZE] = { 0 };
+
+			if (pg_config_changed_settings(currentConfContents,
+										   newConfContents,
+										   changedSettings,
+										   sizeof(changedSettings)) &&
+				pgsql_get_restart_settings(&(postgres->sqlClient),
+										   changedSettings,
+										   restartSettings,
+										   sizeof(restartSettings)))
+			{
+				if (IS_EMPTY_STRING_BUFFER(changedSettings))
+				{
+					log_debug("Replication settings at \"%s\" have the "
+							  "same values", upstreamConfPath);
+					replicationSettingsHaveChanged = false;
+				}
+				else if (IS_EMPTY_STRING_BUFFER(restartSettings))
+				{
+					log_info("Replication settings at \"%s\" have changed "
+							 "(%s), reloading Postgres",
+							 upstreamConfPath, changedSettings);
+
+					if (pg_reload_conf(pgSetup, &(postgres->sqlClient)))
+					{
+						replicationSettingsHaveChanged = false;
+					}
+				}
+				else
+				{
+					log_info("Replication settings %s require a restart",
+							 restartSettings);
+				}
+			}
+		}
+
 		free(currentConfContents);
 		free(newConfContents);
 
@@ -991,40 +1474,100 @@ keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk)
 
 
 /*
- * keeper_create_and_drop_replication_slots drops replication slots that we
- * have on the local Postgres instance when the node is not registered on the
- * monitor anymore (after a pgautofailover.remove_node() has been issued, maybe
- * with the command `pg_autoctl drop node [ --destroy ]`); and creates
- * replication slots for nodes that have been recently registered on the
- * monitor.
+ * keeper_warn_restart_settings compares the given previous contents of a
+ * Postgres configuration file with its current contents, and warns about the
+ * changed settings that won't be applied until Postgres is restarted.
  */
-bool
-keeper_create_and_drop_replication_slots(Keeper *keeper)
+static bool
+keeper_warn_restart_settings(Keeper *keeper,
+							 const char *configFilePath,
+							 const char *previousContents)
 {
 	LocalPostgresServer *postgres = &(keeper->postgres);
-	NodeAddressArray *otherNodesArray = &(keeper->otherNodes);
 
-	log_trace("keeper_create_and_drop_replication_slots");
+	char *contents = NULL;
+	long size = 0L;
 
-	if (!postgres_replication_slot_create_and_drop(postgres, otherNodesArray))
+	char changedSettings[BUFSIZE] = { 0 };
+	char restartSettings[BUFSIZE] = { 0 };
+
+	if (!read_file_if_exists(configFilePath, &contents, &size))
 	{
-		log_error("Failed to maintain replication slots on the local Postgres "
-				  "instance, see above for details");
 		return false;
 	}
 
-	return true;
-}
+	if (!pg_config_changed_settings(previousContents, contents,
+									changedSettings, sizeof(changedSettings)))
+	{
+		free(contents);
+		return false;
+	}
 
+	free(contents);
 
-/*
- * keeper_advance_replication_slots loops over the other standby nodes and
- * advance their replication slots up to the current LSN value known by the
- * monitor.
- */
-bool
-keeper_maintain_replication_slots(Keeper *keeper)
-{
+	if (IS_EMPTY_STRING_BUFFER(changedSettings))
+	{
+		return true;
+	}
+
+	log_info("Settings changed in \"%s\": %s", configFilePath, changedSettings);
+
+	if (!pgsql_get_restart_settings(&(postgres->sqlClient),
+									changedSettings,
+									restartSettings,
+									sizeof(restartSettings)))
+	{
+		return false;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(restartSettings))
+	{
+		log_warn("Postgres must be restarted for the new value of "
+				 "settings %s to be used", restartSettings);
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_create_and_drop_replication_slots drops replication slots that we
+ * have on the local Postgres instance when the node is not registered on the
+ * monitor anymore (after a pgautofailover.remove_node() has been issued, maybe
+ * with the command `pg_autoctl drop node [ --destroy ]`); and creates
+ * replication slots for nodes that have been recently registered on the
+ * monitor.
+ */
+bool
+keeper_create_and_drop_replication_slots(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	NodeAddressArray *otherNodesArray = &(keeper->otherNodes);
+	int advanceThreshold = keeper->config.slot_advance_threshold;
+
+	log_trace("keeper_create_and_drop_replication_slots");
+
+	if (!postgres_replication_slot_create_and_drop(postgres,
+												   otherNodesArray,
+												   advanceThreshold))
+	{
+		log_error("Failed to maintain replication slots on the local Postgres "
+				  "instance, see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_advance_replication_slots loops over the other standby nodes and
+ * advance their replication slots up to the current LSN value known by the
+ * monitor.
+ */
+bool
+keeper_maintain_replication_slots(Keeper *keeper)
+{
 	PostgresSetup *pgSetup = &(keeper->postgres.postgresSetup);
 	LocalPostgresServer *postgres = &(keeper->postgres);
 
@@ -1109,7 +1652,11 @@ keeper_maintain_replication_slots(Keeper *keeper)
 		return false;
 	}
 
-	if (!postgres_replication_slot_maintain(postgres, &(keeper->otherNodes)))
+	int advanceThreshold = keeper->config.slot_advance_threshold;
+
+	if (!postgres_replication_slot_maintain(postgres,
+											&(keeper->otherNodes),
+											advanceThreshold))
 	{
 		log_error("Failed to maintain replication slots on the local Postgres "
 				  "instance, see above for details");
@@ -1159,8 +1706,21 @@ keeper_node_active(Keeper *keeper, bool doInit,
 	 * All in all, the worst case is going to be one extra call before we
 	 * restart node active process, and an extra error message in the logs
 	 * during the live upgrade of pg_auto_failover.
+	 *
+	 * So we only check the version once, and then again when the monitor
+	 * answered our node_active call with an error, or when we have been out
+	 * of contact for longer than the lease of our assigned state. When the
+	 * monitor restarts, all the keepers then resume with a single node_active
+	 * call that sends the versions of the group nodes they know about, rather
+	 * than running the whole check sequence at the same time.
 	 */
-	if (!keeper_check_monitor_extension_version(keeper))
+	if (doInit || !keeper_assignment_lease_is_valid(keeper))
+	{
+		keeper->monitorVersionChecked = false;
+	}
+
+	if (!keeper->monitorVersionChecked &&
+		!keeper_check_monitor_extension_version(keeper))
 	{
 		/*
 		 * We could fail here for two different reasons:
@@ -1197,6 +1757,8 @@ keeper_node_active(Keeper *keeper, bool doInit,
 		exit(EXIT_CODE_MONITOR);
 	}
 
+	keeper->monitorVersionChecked = true;
+
 	if (doInit)
 	{
 		PostgresSetup *pgSetup = &(postgres->postgresSetup);
@@ -1231,16 +1793,53 @@ keeper_node_active(Keeper *keeper, bool doInit,
 	/*
 	 * Report the current state to the monitor and get the assigned state.
 	 */
-	return monitor_node_active(monitor,
-							   config->formation,
-							   keeperState->current_node_id,
-							   keeperState->current_group,
-							   keeperState->current_role,
-							   reportPgIsRunning,
-							   postgres->postgresSetup.control.timeline_id,
-							   postgres->currentLSN,
-							   postgres->pgsrSyncState,
-							   assignedState);
+	bool success =
+		monitor_node_active(monitor,
+							config->formation,
+							keeperState->current_node_id,
+							keeperState->current_group,
+							keeperState->current_role,
+							reportPgIsRunning,
+							postgres->postgresSetup.control.timeline_id,
+							postgres->currentLSN,
+							postgres->pgsrSyncState,
+							assignedState);
+
+	/* the monitor might have been upgraded, check again next time */
+	if (!success && monitor->pgsql.status == PG_CONNECTION_OK)
+	{
+		keeper->monitorVersionChecked = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * keeper_assignment_lease_is_valid returns true when our last contact with
+ * the monitor is recent enough for the state it assigned to us to still be
+ * authoritative, such as while the monitor restarts. The lease starts with
+ * our last successful node_active call and lasts for
+ * network_partition_timeout: past that delay the monitor may fail over
+ * without us, and a primary that lost its standby nodes too demotes itself.
+ */
+bool
+keeper_assignment_lease_is_valid(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	instr_time contactAge;
+
+	/* the state file could be older than this process, don't trust it */
+	if (INSTR_TIME_IS_ZERO(keeper->lastMonitorContactTime))
+	{
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(contactAge);
+	INSTR_TIME_SUBTRACT(contactAge, keeper->lastMonitorContactTime);
+
+	return INSTR_TIME_GET_MILLISEC(contactAge) <=
+		   1000.0 * config->network_partition_timeout;
 }
 
 
@@ -1419,6 +2018,14 @@ keeper_check_monitor_extension_version(Keeper *keeper)
 				  PG_AUTOCTL_MONITOR_EXTENSION_NAME, version.installedVersion);
 	}
 
+	/* remember the version number to pick the protocol functions to use */
+	if (!parse_pgaf_extension_version_string(version.installedVersion,
+											 &(monitor->extensionVersionNum)))
+	{
+		/* errors have already been logged */
+		monitor->extensionVersionNum = 0;
+	}
+
 	return true;
 }
 
@@ -1547,6 +2154,34 @@ keeper_register_and_init(Keeper *keeper, NodeState initialState)
 		return false;
 	}
 
+	/*
+	 * When the monitor is a directory of monitor shards, register to the
+	 * monitor that manages our formation instead, and keep its URI in our
+	 * configuration file so that we only ever connect to that monitor.
+	 */
+	char shardPgURI[MAXCONNINFO] = { 0 };
+
+	if (!monitor_use_formation_shard(monitor, config->formation,
+									 shardPgURI, MAXCONNINFO))
+	{
+		/* errors have already been logged */
+		unlink_file(config->pathnames.state);
+		return false;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(shardPgURI))
+	{
+		strlcpy(config->monitor_pguri, shardPgURI, MAXCONNINFO);
+
+		if (!keeper_config_write_file(config))
+		{
+			log_fatal("Failed to write the pg_autoctl configuration file, "
+					  "see above");
+			unlink_file(config->pathnames.state);
+			return false;
+		}
+	}
+
 	/*
 	 * We implement a specific retry policy for cases where we have a transient
 	 * error on the monitor, such as OBJECT_IN_USE which indicates that another
@@ -1750,7 +2385,8 @@ keeper_register_again(Keeper *keeper)
 									 &pgSetup->is_in_recovery,
 									 keeper->postgres.pgsrSyncState,
 									 keeper->postgres.currentLSN,
-									 &(pgSetup->control)))
+									 &(pgSetup->control),
+									 NULL))
 	{
 		log_error("Failed to get the local Postgres metadata");
 		return false;
@@ -1868,7 +2504,8 @@ keeper_register_again(Keeper *keeper)
 										 &pgSetup->is_in_recovery,
 										 keeper->postgres.pgsrSyncState,
 										 keeper->postgres.currentLSN,
-										 &(pgSetup->control)))
+										 &(pgSetup->control),
+										 NULL))
 		{
 			log_error("Failed to get the local Postgres metadata");
 			return false;
@@ -1962,10 +2599,19 @@ keeper_state_as_json(Keeper *keeper, char *json, int size)
 /*
  * keeper_update_group_hba updates updates the HBA file to ensure we have two
  * entries per other node in the group, allowing for both replication
- * connections and connections to the --dbname.
+ * connections and connections to the --dbname. The rules that we generated
+ * for the nodes in staleNodesArray are removed in the same edit, and Postgres
+ * is only reloaded when the file did change.
+ *
+ * When postgresql.hba_compact is set, the rules are computed again for the
+ * whole groupNodesArray instead, with two entries per CIDR block, see
+ * pghba_update_compact_host_rules.
  */
 bool
-keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray)
+keeper_update_group_hba(Keeper *keeper,
+						NodeAddressArray *groupNodesArray,
+						NodeAddressArray *diffNodesArray,
+						NodeAddressArray *staleNodesArray)
 {
 	LocalPostgresServer *postgres = &(keeper->postgres);
 	PostgresSetup *postgresSetup = &(postgres->postgresSetup);
@@ -1973,9 +2619,10 @@ keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray)
 
 	char hbaFilePath[MAXPGPATH] = { 0 };
 	char *authMethod = pg_setup_get_auth_method(postgresSetup);
+	bool hbaChanged = false;
 
 	/* early exit when we're alone in the group */
-	if (diffNodesArray->count == 0)
+	if (diffNodesArray->count == 0 && staleNodesArray->count == 0)
 	{
 		return true;
 	}
@@ -1988,13 +2635,27 @@ keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray)
 
 	sformat(hbaFilePath, MAXPGPATH, "%s/pg_hba.conf", postgresSetup->pgdata);
 
-	if (!pghba_ensure_host_rules_exist(hbaFilePath,
-									   diffNodesArray,
-									   postgresSetup->ssl.active,
-									   postgresSetup->dbname,
-									   PG_AUTOCTL_REPLICA_USERNAME,
-									   authMethod,
-									   keeper->config.pgSetup.hbaLevel))
+	bool success =
+		keeper->config.hba_compact
+		? pghba_update_compact_host_rules(hbaFilePath,
+										  groupNodesArray,
+										  postgresSetup->ssl.active,
+										  postgresSetup->dbname,
+										  PG_AUTOCTL_REPLICA_USERNAME,
+										  authMethod,
+										  keeper->config.pgSetup.hbaLevel,
+										  &hbaChanged)
+		: pghba_update_host_rules(hbaFilePath,
+								  diffNodesArray,
+								  staleNodesArray,
+								  postgresSetup->ssl.active,
+								  postgresSetup->dbname,
+								  PG_AUTOCTL_REPLICA_USERNAME,
+								  authMethod,
+								  keeper->config.pgSetup.hbaLevel,
+								  &hbaChanged);
+
+	if (!success)
 	{
 		log_error("Failed to edit HBA file \"%s\" to update rules to current "
 				  "list of nodes registered on the monitor",
@@ -2007,10 +2668,9 @@ keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray)
 	 * edited the HBA and it's going to take effect at next restart of
 	 * Postgres, so we're good here.
 	 */
-	if (keeper->config.pgSetup.hbaLevel >= HBA_EDIT_MINIMAL &&
-		pg_setup_is_running(postgresSetup))
+	if (hbaChanged && pg_setup_is_running(postgresSetup))
 	{
-		if (!pgsql_reload_conf(pgsql))
+		if (!pg_reload_conf(postgresSetup, pgsql))
 		{
 			log_error("Failed to reload the postgres configuration after adding "
 					  "the standby user to pg_hba");
@@ -2077,6 +2737,66 @@ keeper_refresh_other_nodes(Keeper *keeper, bool forceCacheInvalidation)
 }
 
 
+/*
+ * keeper_update_other_nodes updates the keeper otherNodes array from the
+ * result of node_active_v2, which includes the other nodes unless they did
+ * not change since the last version we installed. When the monitor did not
+ * send the other nodes, we fetch them with keeper_refresh_other_nodes.
+ *
+ * The refresh hooks only run when the group membership version changed since
+ * the last time they succeeded.
+ */
+bool
+keeper_update_other_nodes(Keeper *keeper, MonitorAssignedState *assignedState)
+{
+	Monitor *monitor = &(keeper->monitor);
+	bool forceCacheInvalidation = false;
+
+	if (assignedState->otherNodesKnown)
+	{
+		log_trace("keeper_update_other_nodes: version %" PRId64
+				  " is current",
+				  assignedState->nodesVersion);
+		return true;
+	}
+
+	if (!assignedState->hasOtherNodes)
+	{
+		return keeper_refresh_other_nodes(keeper, forceCacheInvalidation);
+	}
+
+	/*
+	 * When the group membership did not change, only the LSN of the other
+	 * nodes moved: we keep them for replication slots maintenance, and skip
+	 * the refresh hooks (HBA rules) entirely.
+	 */
+	if (monitor->knownGroupVersion != 0 &&
+		monitor->knownGroupVersion == assignedState->groupVersion)
+	{
+		keeper->otherNodes = assignedState->otherNodes;
+		monitor->knownNodesVersion = assignedState->nodesVersion;
+
+		return true;
+	}
+
+	if (!keeper_call_refresh_hooks(keeper,
+								   &(assignedState->otherNodes),
+								   forceCacheInvalidation))
+	{
+		/* have the monitor send the whole list again next time */
+		monitor->knownNodesVersion = 0;
+		monitor->knownGroupVersion = 0;
+		return false;
+	}
+
+	keeper->otherNodes = assignedState->otherNodes;
+	monitor->knownNodesVersion = assignedState->nodesVersion;
+	monitor->knownGroupVersion = assignedState->groupVersion;
+
+	return true;
+}
+
+
 /*
  * keeper_call_refresh_hooks loops over the KeeperNodesArrayRefreshArray and
  * calls each hook in turn. It returns true when all the hooks have returned
@@ -2114,8 +2834,14 @@ keeper_refresh_hba(Keeper *keeper,
 {
 	NodeAddressArray *otherNodesArray = &(keeper->otherNodes);
 	NodeAddressArray diffNodesArray = { 0 };
+	NodeAddressArray staleNodesArray = { 0 };
 
-	/* compute nodes that need an HBA change (new ones, new hostnames) */
+	/*
+	 * Compute nodes that need an HBA change (new ones, new hostnames), and
+	 * the nodes that left the group or got a new hostname, as their rules are
+	 * not needed anymore. After a pg_basebackup we don't know which rules the
+	 * file contains, so we only add the rules of the current nodes.
+	 */
 	if (forceCacheInvalidation)
 	{
 		diffNodesArray = *newNodesArray;
@@ -2123,13 +2849,13 @@ keeper_refresh_hba(Keeper *keeper,
 	else
 	{
 		(void) diff_nodesArray(otherNodesArray, newNodesArray, &diffNodesArray);
+		(void) stale_nodesArray(otherNodesArray, newNodesArray, &staleNodesArray);
 	}
 
 	/*
-	 * When we're alone in the group, and also when there's no change, then we
-	 * are done here already.
+	 * When there's no change, then we are done here already.
 	 */
-	if (newNodesArray->count == 0 || diffNodesArray.count == 0)
+	if (diffNodesArray.count == 0 && staleNodesArray.count == 0)
 	{
 		/* refresh the keeper's cache with the current other nodes array */
 		keeper->otherNodes = *newNodesArray;
@@ -2137,14 +2863,15 @@ keeper_refresh_hba(Keeper *keeper,
 	}
 
 	log_info("Fetched current list of %d other nodes from the monitor "
-			 "to update HBA rules, including %d changes.",
-			 newNodesArray->count, diffNodesArray.count);
+			 "to update HBA rules, including %d changes and %d removals.",
+			 newNodesArray->count, diffNodesArray.count, staleNodesArray.count);
 
 	/*
 	 * We have a new list of other nodes, update the HBA file. We only update
 	 * the nodes that we didn't know before, or that have a new host property.
 	 */
-	if (!keeper_update_group_hba(keeper, &diffNodesArray))
+	if (!keeper_update_group_hba(keeper, newNodesArray,
+								 &diffNodesArray, &staleNodesArray))
 	{
 		log_error("Failed to update the HBA entries for the new "
 				  "elements in the our formation \"%s\" and group %d",
@@ -2163,78 +2890,109 @@ keeper_refresh_hba(Keeper *keeper,
  * the HBA file in the given pre-allocated diffNodesArray parameter. The diff
  * is computed from the keeper's otherNodesArray on the previous round, and the
  * one we just got from the monitor.
+ *
+ * Both input arrays are sorted by nodeId, as the monitor returns them, so we
+ * walk them side by side in a single pass.
  */
-static void
+void
 diff_nodesArray(NodeAddressArray *previousNodesArray,
 				NodeAddressArray *currentNodesArray,
 				NodeAddressArray *diffNodesArray)
 {
 	int prevIndex = 0;
-	int currIndex = 0;
-	int diffIndex = 0;
 
-	if (previousNodesArray->count == 0)
-	{
-		/* all the entries are new and we want them in diffNodesArray */
-		*diffNodesArray = *currentNodesArray;
-		return;
-	}
+	diffNodesArray->count = 0;
 
 	/* we only care about the nodes in the current nodes array */
-	for (currIndex = 0; currIndex < currentNodesArray->count; currIndex++)
+	for (int currIndex = 0; currIndex < currentNodesArray->count; currIndex++)
 	{
 		NodeAddress *currNode = &(currentNodesArray->nodes[currIndex]);
-		NodeAddress *prevNode = &(previousNodesArray->nodes[prevIndex]);
 
-		/* remember, the input arrays are sorted on nodeId */
-		if (currNode->nodeId < prevNode->nodeId)
+		/*
+		 * Skip the previous entries that are not found in currentNodesArray
+		 * anymore: stale_nodesArray takes care of those.
+		 */
+		while (prevIndex < previousNodesArray->count &&
+			   previousNodesArray->nodes[prevIndex].nodeId < currNode->nodeId)
 		{
-			diffNodesArray->count++;
-			diffNodesArray->nodes[diffIndex++] = *currNode;
+			++prevIndex;
 		}
-		else if (currNode->nodeId == prevNode->nodeId)
+
+		if (prevIndex < previousNodesArray->count &&
+			previousNodesArray->nodes[prevIndex].nodeId == currNode->nodeId)
 		{
+			NodeAddress *prevNode = &(previousNodesArray->nodes[prevIndex++]);
+
 			/*
 			 * We still have to update our HBA file when the host of a node
 			 * that we already have has changed on the monitor.
 			 */
-			if (!streq(currNode->host, prevNode->host))
+			if (streq(currNode->host, prevNode->host))
 			{
-				log_debug("Node %" PRId64 " has a new hostname \"%s\"",
-						  currNode->nodeId, currNode->host);
-
-				diffNodesArray->count++;
-				diffNodesArray->nodes[diffIndex++] = *currNode;
+				continue;
 			}
 
-			/*
-			 * In any case, if we have more elements in previousNodesArray,
-			 * advance our position there.
-			 */
-			if (prevIndex < previousNodesArray->count)
-			{
-				prevIndex++;
-			}
+			log_debug("Node %" PRId64 " has a new hostname \"%s\"",
+					  currNode->nodeId, currNode->host);
+		}
+
+		/* that's a new node, or a node with a new hostname */
+		diffNodesArray->nodes[diffNodesArray->count++] = *currNode;
+	}
+}
+
+
+/*
+ * stale_nodesArray computes the array of nodes entries that should be removed
+ * from the HBA file: the nodes of the previous round that are not in the
+ * current nodes array anymore, and the previous host of the nodes that have
+ * a new one. A host that is still used by one of the current nodes is kept.
+ */
+static void
+stale_nodesArray(NodeAddressArray *previousNodesArray,
+				 NodeAddressArray *currentNodesArray,
+				 NodeAddressArray *staleNodesArray)
+{
+	int currIndex = 0;
+
+	staleNodesArray->count = 0;
+
+	for (int prevIndex = 0; prevIndex < previousNodesArray->count; prevIndex++)
+	{
+		NodeAddress *prevNode = &(previousNodesArray->nodes[prevIndex]);
+		bool hostInUse = false;
+
+		while (currIndex < currentNodesArray->count &&
+			   currentNodesArray->nodes[currIndex].nodeId < prevNode->nodeId)
+		{
+			++currIndex;
 		}
-		else if (currNode->nodeId > prevNode->nodeId)
+
+		if (currIndex < currentNodesArray->count &&
+			currentNodesArray->nodes[currIndex].nodeId == prevNode->nodeId &&
+			streq(currentNodesArray->nodes[currIndex].host, prevNode->host))
 		{
-			/*
-			 * All the remaining entries of currentNodesArray are new.
-			 *
-			 * We might have entries in previousNodesArray that are not found
-			 * in currentNodesArray anymore, but we don't know how to clean-up
-			 * the HBA file entries at the moment anyway, so we just skip them.
-			 */
-			diffNodesArray->count++;
-			diffNodesArray->nodes[diffIndex++] = *currNode;
+			continue;
+		}
 
-			break;
+		for (int index = 0; index < currentNodesArray->count; index++)
+		{
+			if (streq(currentNodesArray->nodes[index].host, prevNode->host))
+			{
+				hostInUse = true;
+				break;
+			}
 		}
-		else
+
+		if (hostInUse)
 		{
-			log_error("BUG in diff_nodesArray!");
-			return;
+			continue;
 		}
+
+		log_debug("Node %" PRId64 " host \"%s\" is not in use anymore",
+				  prevNode->nodeId, prevNode->host);
+
+		staleNodesArray->nodes[staleNodesArray->count++] = *prevNode;
 	}
 }
 
@@ -2440,6 +3198,40 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 		}
 	}
 
+	if (strneq(newConfig->monitor_replica_pguri, config->monitor_replica_pguri))
+	{
+		log_info("Reloading configuration: monitor replica uri is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->monitor_replica_pguri,
+				 config->monitor_replica_pguri);
+
+		strlcpy(config->monitor_replica_pguri,
+				newConfig->monitor_replica_pguri,
+				sizeof(config->monitor_replica_pguri));
+	}
+
+	if (strneq(newConfig->monitor_pooler_pguri, config->monitor_pooler_pguri))
+	{
+		Monitor monitor = { 0 };
+
+		if (!IS_EMPTY_STRING_BUFFER(newConfig->monitor_pooler_pguri) &&
+			!monitor_init_pooler(&monitor, newConfig->monitor_pooler_pguri))
+		{
+			log_fatal("Failed to contact the monitor through its pooler "
+					  "because its URL is invalid, see above for details");
+			return false;
+		}
+
+		log_info("Reloading configuration: monitor pooler uri is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->monitor_pooler_pguri,
+				 config->monitor_pooler_pguri);
+
+		strlcpy(config->monitor_pooler_pguri,
+				newConfig->monitor_pooler_pguri,
+				sizeof(config->monitor_pooler_pguri));
+	}
+
 	/*
 	 * We don't support changing formation, group, or hostname mid-flight: we
 	 * might have to register again to the monitor to make that work, and in
@@ -2453,6 +3245,71 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 				 config->formation);
 	}
 
+	/* the metrics service is only started with pg_autoctl run */
+	if (newConfig->metrics_port != config->metrics_port)
+	{
+		log_warn("pg_autoctl doesn't know how to change metrics_port at "
+				 "run-time, restart pg_autoctl to use port %d.",
+				 newConfig->metrics_port);
+	}
+
+	/* the supervisor applies the service scheduling when starting them */
+	if (newConfig->service_nice != config->service_nice ||
+		strneq(newConfig->service_cpu_affinity, config->service_cpu_affinity))
+	{
+		log_warn("pg_autoctl doesn't know how to change service_nice and "
+				 "service_cpu_affinity at run-time, restart pg_autoctl to "
+				 "use nice %d and CPUs \"%s\".",
+				 newConfig->service_nice,
+				 newConfig->service_cpu_affinity);
+	}
+
+	/* the monitor-proxy service is only started with pg_autoctl run */
+	if (newConfig->monitor_proxy != config->monitor_proxy)
+	{
+		log_warn("pg_autoctl doesn't know how to change monitor_proxy at "
+				 "run-time, restart pg_autoctl to use monitor_proxy %d.",
+				 newConfig->monitor_proxy);
+	}
+
+	/* the node-probe service is only started with pg_autoctl run */
+	if (newConfig->node_probe != config->node_probe)
+	{
+		log_warn("pg_autoctl doesn't know how to change node_probe at "
+				 "run-time, restart pg_autoctl to use node_probe %d.",
+				 newConfig->node_probe);
+	}
+
+	/* the router service is only started with pg_autoctl run */
+	if (newConfig->router_port != config->router_port)
+	{
+		log_warn("pg_autoctl doesn't know how to change router_port at "
+				 "run-time, restart pg_autoctl to use port %d.",
+				 newConfig->router_port);
+	}
+
+	/* the keeper main loop starts or stops watching the files */
+	if (newConfig->watch_config != config->watch_config)
+	{
+		log_info("Reloading configuration: pg_autoctl.watch_config "
+				 "is now %d; used to be %d",
+				 newConfig->watch_config,
+				 config->watch_config);
+
+		config->watch_config = newConfig->watch_config;
+	}
+
+	/* the keeper main loop picks the new way to wait at its next sleep */
+	if (newConfig->monitor_wait != config->monitor_wait)
+	{
+		log_info("Reloading configuration: pg_autoctl.monitor_wait "
+				 "is now %d; used to be %d",
+				 newConfig->monitor_wait,
+				 config->monitor_wait);
+
+		config->monitor_wait = newConfig->monitor_wait;
+	}
+
 	/*
 	 * Changing the node name is okay, we need to sync the update to the
 	 * monitor though.
@@ -2528,56 +3385,203 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 	}
 
 	/*
-	 * The backupDirectory can be changed online too.
+	 * Changing replication.backup_compression.
 	 */
-	if (strneq(newConfig->backupDirectory, config->backupDirectory))
+	if (strneq(newConfig->backup_compression, config->backup_compression))
 	{
 		log_info("Reloading configuration: "
-				 "replication.backup_directory is now \"%s\"; "
+				 "replication.backup_compression is now \"%s\"; "
 				 "used to be \"%s\"",
-				 newConfig->backupDirectory, config->backupDirectory);
+				 newConfig->backup_compression, config->backup_compression);
 
-		strlcpy(config->backupDirectory, newConfig->backupDirectory, MAXPGPATH);
+		strlcpy(config->backup_compression,
+				newConfig->backup_compression,
+				BACKUP_COMPRESSION_LEN);
 	}
 
 	/*
-	 * And now the timeouts. Of course we support changing them at run-time.
+	 * Changing replication.backup_restore_command.
 	 */
-	if (newConfig->network_partition_timeout != config->network_partition_timeout)
+	if (strneq(newConfig->backup_restore_command,
+			   config->backup_restore_command))
 	{
-		log_info("Reloading configuration: timeout.network_partition_timeout "
-				 "is now %d; used to be %d",
-				 newConfig->network_partition_timeout,
-				 config->network_partition_timeout);
+		log_info("Reloading configuration: "
+				 "replication.backup_restore_command is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->backup_restore_command,
+				 config->backup_restore_command);
 
-		config->network_partition_timeout =
-			newConfig->network_partition_timeout;
+		strlcpy(config->backup_restore_command,
+				newConfig->backup_restore_command,
+				sizeof(config->backup_restore_command));
 	}
 
-	if (newConfig->prepare_promotion_catchup != config->prepare_promotion_catchup)
+	/*
+	 * Changing replication.delta_resync_command.
+	 */
+	if (strneq(newConfig->delta_resync_command, config->delta_resync_command))
 	{
-		log_info("Reloading configuration: timeout.prepare_promotion_catchup "
-				 "is now %d; used to be %d",
-				 newConfig->prepare_promotion_catchup,
-				 config->prepare_promotion_catchup);
+		log_info("Reloading configuration: "
+				 "replication.delta_resync_command is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->delta_resync_command,
+				 config->delta_resync_command);
 
-		config->prepare_promotion_catchup =
-			newConfig->prepare_promotion_catchup;
+		strlcpy(config->delta_resync_command,
+				newConfig->delta_resync_command,
+				sizeof(config->delta_resync_command));
 	}
 
-	if (newConfig->prepare_promotion_walreceiver != config->prepare_promotion_walreceiver)
+	if (newConfig->rewind_threshold != config->rewind_threshold)
 	{
-		log_info(
-			"Reloading configuration: timeout.prepare_promotion_walreceiver "
-			"is now %d; used to be %d",
-			newConfig->prepare_promotion_walreceiver,
-			config->prepare_promotion_walreceiver);
+		log_info("Reloading configuration: replication.rewind_threshold "
+				 "is now %d; used to be %d",
+				 newConfig->rewind_threshold,
+				 config->rewind_threshold);
 
-		config->prepare_promotion_walreceiver =
-			newConfig->prepare_promotion_walreceiver;
+		config->rewind_threshold = newConfig->rewind_threshold;
 	}
 
-	if (newConfig->postgresql_restart_failure_timeout !=
+	if (newConfig->slot_advance_threshold != config->slot_advance_threshold)
+	{
+		log_info("Reloading configuration: replication.slot_advance_threshold "
+				 "is now %d; used to be %d",
+				 newConfig->slot_advance_threshold,
+				 config->slot_advance_threshold);
+
+		config->slot_advance_threshold = newConfig->slot_advance_threshold;
+	}
+
+	if (newConfig->wal_fetch_workers != config->wal_fetch_workers)
+	{
+		log_info("Reloading configuration: replication.wal_fetch_workers "
+				 "is now %d; used to be %d",
+				 newConfig->wal_fetch_workers,
+				 config->wal_fetch_workers);
+
+		config->wal_fetch_workers = newConfig->wal_fetch_workers;
+	}
+
+	if (newConfig->maintenance_drain_lag != config->maintenance_drain_lag)
+	{
+		log_info("Reloading configuration: replication.maintenance_drain_lag "
+				 "is now %d; used to be %d",
+				 newConfig->maintenance_drain_lag,
+				 config->maintenance_drain_lag);
+
+		config->maintenance_drain_lag = newConfig->maintenance_drain_lag;
+	}
+
+	if (newConfig->rebuild_nice != config->rebuild_nice)
+	{
+		log_info("Reloading configuration: replication.rebuild_nice "
+				 "is now %d; used to be %d",
+				 newConfig->rebuild_nice,
+				 config->rebuild_nice);
+
+		config->rebuild_nice = newConfig->rebuild_nice;
+	}
+
+	if (strneq(newConfig->rebuild_io_class, config->rebuild_io_class))
+	{
+		log_info("Reloading configuration: "
+				 "replication.rebuild_io_class is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->rebuild_io_class,
+				 config->rebuild_io_class);
+
+		strlcpy(config->rebuild_io_class,
+				newConfig->rebuild_io_class,
+				sizeof(config->rebuild_io_class));
+	}
+
+	if (strneq(newConfig->rebuild_cgroup, config->rebuild_cgroup))
+	{
+		log_info("Reloading configuration: "
+				 "replication.rebuild_cgroup is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->rebuild_cgroup,
+				 config->rebuild_cgroup);
+
+		strlcpy(config->rebuild_cgroup,
+				newConfig->rebuild_cgroup,
+				sizeof(config->rebuild_cgroup));
+	}
+
+	/*
+	 * The backupDirectory can be changed online too.
+	 */
+	if (strneq(newConfig->backupDirectory, config->backupDirectory))
+	{
+		log_info("Reloading configuration: "
+				 "replication.backup_directory is now \"%s\"; "
+				 "used to be \"%s\"",
+				 newConfig->backupDirectory, config->backupDirectory);
+
+		strlcpy(config->backupDirectory, newConfig->backupDirectory, MAXPGPATH);
+	}
+
+	/*
+	 * And now the timeouts. Of course we support changing them at run-time.
+	 */
+	if (newConfig->network_partition_timeout != config->network_partition_timeout)
+	{
+		log_info("Reloading configuration: timeout.network_partition_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->network_partition_timeout,
+				 config->network_partition_timeout);
+
+		config->network_partition_timeout =
+			newConfig->network_partition_timeout;
+	}
+
+	if (newConfig->network_partition_probe_timeout !=
+		config->network_partition_probe_timeout)
+	{
+		log_info(
+			"Reloading configuration: timeout.network_partition_probe_timeout "
+			"is now %d; used to be %d",
+			newConfig->network_partition_probe_timeout,
+			config->network_partition_probe_timeout);
+
+		config->network_partition_probe_timeout =
+			newConfig->network_partition_probe_timeout;
+	}
+
+	if (newConfig->prepare_promotion_catchup != config->prepare_promotion_catchup)
+	{
+		log_info("Reloading configuration: timeout.prepare_promotion_catchup "
+				 "is now %d; used to be %d",
+				 newConfig->prepare_promotion_catchup,
+				 config->prepare_promotion_catchup);
+
+		config->prepare_promotion_catchup =
+			newConfig->prepare_promotion_catchup;
+	}
+
+	if (newConfig->prepare_promotion_walreceiver != config->prepare_promotion_walreceiver)
+	{
+		log_info(
+			"Reloading configuration: timeout.prepare_promotion_walreceiver "
+			"is now %d; used to be %d",
+			newConfig->prepare_promotion_walreceiver,
+			config->prepare_promotion_walreceiver);
+
+		config->prepare_promotion_walreceiver =
+			newConfig->prepare_promotion_walreceiver;
+	}
+
+	if (newConfig->prewarm_budget != config->prewarm_budget)
+	{
+		log_info("Reloading configuration: timeout.prewarm_budget "
+				 "is now %d; used to be %d",
+				 newConfig->prewarm_budget,
+				 config->prewarm_budget);
+
+		config->prewarm_budget = newConfig->prewarm_budget;
+	}
+
+	if (newConfig->postgresql_restart_failure_timeout !=
 		config->postgresql_restart_failure_timeout)
 	{
 		log_info(
@@ -2603,6 +3607,179 @@ keeper_config_accept_new(Keeper *keeper, KeeperConfig *newConfig)
 			newConfig->postgresql_restart_failure_max_retries;
 	}
 
+	if (newConfig->crash_recovery_timeout != config->crash_recovery_timeout)
+	{
+		log_info("Reloading configuration: timeout.crash_recovery_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->crash_recovery_timeout,
+				 config->crash_recovery_timeout);
+
+		config->crash_recovery_timeout = newConfig->crash_recovery_timeout;
+	}
+
+	if (newConfig->min_report_interval != config->min_report_interval)
+	{
+		log_info("Reloading configuration: timeout.min_report_interval "
+				 "is now %d; used to be %d",
+				 newConfig->min_report_interval,
+				 config->min_report_interval);
+
+		config->min_report_interval = newConfig->min_report_interval;
+	}
+
+	if (newConfig->max_report_interval != config->max_report_interval)
+	{
+		log_info("Reloading configuration: timeout.max_report_interval "
+				 "is now %d; used to be %d",
+				 newConfig->max_report_interval,
+				 config->max_report_interval);
+
+		config->max_report_interval = newConfig->max_report_interval;
+	}
+
+	if (strneq(newConfig->primary_change_hooks, config->primary_change_hooks))
+	{
+		log_info("Reloading configuration: pg_autoctl.primary_change_hooks "
+				 "is now \"%s\"; used to be \"%s\"",
+				 newConfig->primary_change_hooks,
+				 config->primary_change_hooks);
+
+		strlcpy(config->primary_change_hooks,
+				newConfig->primary_change_hooks,
+				sizeof(config->primary_change_hooks));
+	}
+
+	if (newConfig->hba_compact != config->hba_compact)
+	{
+		log_info("Reloading configuration: postgresql.hba_compact "
+				 "is now %d; used to be %d",
+				 newConfig->hba_compact,
+				 config->hba_compact);
+
+		config->hba_compact = newConfig->hba_compact;
+
+		/* have the monitor send the whole list again, to edit HBA rules */
+		keeper->otherNodes.count = 0;
+		keeper->monitor.knownNodesVersion = 0;
+		keeper->monitor.knownGroupVersion = 0;
+	}
+
+	if (strneq(newConfig->latency_anchors, config->latency_anchors))
+	{
+		log_info("Reloading configuration: pg_autoctl.latency_anchors "
+				 "is now \"%s\"; used to be \"%s\"",
+				 newConfig->latency_anchors,
+				 config->latency_anchors);
+
+		strlcpy(config->latency_anchors,
+				newConfig->latency_anchors,
+				sizeof(config->latency_anchors));
+
+		/* probe the new anchors at the next round */
+		keeper->latencyProbeTime = 0;
+	}
+
+	if (newConfig->read_only_fencing != config->read_only_fencing)
+	{
+		log_info("Reloading configuration: pg_autoctl.read_only_fencing "
+				 "is now %d; used to be %d",
+				 newConfig->read_only_fencing,
+				 config->read_only_fencing);
+
+		config->read_only_fencing = newConfig->read_only_fencing;
+	}
+
+	if (newConfig->primary_change_hooks_timeout !=
+		config->primary_change_hooks_timeout)
+	{
+		log_info("Reloading configuration: "
+				 "timeout.primary_change_hooks_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->primary_change_hooks_timeout,
+				 config->primary_change_hooks_timeout);
+
+		config->primary_change_hooks_timeout =
+			newConfig->primary_change_hooks_timeout;
+	}
+
+	if (newConfig->maintenance_drain_timeout !=
+		config->maintenance_drain_timeout)
+	{
+		log_info("Reloading configuration: "
+				 "timeout.maintenance_drain_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->maintenance_drain_timeout,
+				 config->maintenance_drain_timeout);
+
+		config->maintenance_drain_timeout =
+			newConfig->maintenance_drain_timeout;
+	}
+
+	if (newConfig->sync_rep_stall_timeout != config->sync_rep_stall_timeout)
+	{
+		log_info("Reloading configuration: timeout.sync_rep_stall_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->sync_rep_stall_timeout,
+				 config->sync_rep_stall_timeout);
+
+		config->sync_rep_stall_timeout = newConfig->sync_rep_stall_timeout;
+	}
+
+	if (newConfig->keepalives != config->keepalives)
+	{
+		log_info("Reloading configuration: timeout.keepalives "
+				 "is now %d; used to be %d",
+				 newConfig->keepalives,
+				 config->keepalives);
+
+		config->keepalives = newConfig->keepalives;
+	}
+
+	if (newConfig->keepalives_idle != config->keepalives_idle)
+	{
+		log_info("Reloading configuration: timeout.keepalives_idle "
+				 "is now %d; used to be %d",
+				 newConfig->keepalives_idle,
+				 config->keepalives_idle);
+
+		config->keepalives_idle = newConfig->keepalives_idle;
+	}
+
+	if (newConfig->storage_probe_interval != config->storage_probe_interval)
+	{
+		log_info("Reloading configuration: timeout.storage_probe_interval "
+				 "is now %d; used to be %d",
+				 newConfig->storage_probe_interval,
+				 config->storage_probe_interval);
+
+		config->storage_probe_interval = newConfig->storage_probe_interval;
+	}
+
+	if (newConfig->local_query_timeout != config->local_query_timeout)
+	{
+		log_info("Reloading configuration: timeout.local_query_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->local_query_timeout,
+				 config->local_query_timeout);
+
+		config->local_query_timeout = newConfig->local_query_timeout;
+	}
+
+	if (newConfig->tcp_user_timeout != config->tcp_user_timeout)
+	{
+		log_info("Reloading configuration: timeout.tcp_user_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->tcp_user_timeout,
+				 config->tcp_user_timeout);
+
+		config->tcp_user_timeout = newConfig->tcp_user_timeout;
+	}
+
+	/* new connections use the new settings, existing ones are kept as-is */
+	(void) pgsql_set_keepalives(config->keepalives,
+								config->keepalives_idle,
+								config->tcp_user_timeout);
+
 	/* we can change any SSL related setup options at runtime */
 	return config_accept_new_ssloptions(&(config->pgSetup),
 										&(newConfig->pgSetup));
@@ -2812,6 +3989,1161 @@ keeper_get_primary(Keeper *keeper, NodeAddress *primaryNode)
 }
 
 
+/*
+ * keeper_get_upstream fetches the node to stream from. That's the primary
+ * node, unless this standby node has been set to stream from another standby
+ * node on the monitor, with pgautofailover.set_node_upstream(). Without a
+ * monitor, we always stream from the primary.
+ */
+bool
+keeper_get_upstream(Keeper *keeper, NodeAddress *upstreamNode)
+{
+	KeeperConfig *config = &(keeper->config);
+
+	if (config->monitorDisabled)
+	{
+		return keeper_get_primary(keeper, upstreamNode);
+	}
+
+	if (!monitor_get_upstream(&(keeper->monitor),
+							  keeper->state.current_node_id,
+							  upstreamNode))
+	{
+		log_error("Failed to get the upstream node from the monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_get_basebackup_source fetches the node to take a base backup from.
+ * The monitor picks a healthy secondary node when it has one, so that
+ * standby nodes joining at the same time don't all copy PGDATA from the
+ * primary node. Without a monitor, we always use the primary.
+ */
+bool
+keeper_get_basebackup_source(Keeper *keeper, NodeAddress *sourceNode)
+{
+	KeeperConfig *config = &(keeper->config);
+
+	if (config->monitorDisabled)
+	{
+		return keeper_get_primary(keeper, sourceNode);
+	}
+
+	if (!monitor_get_basebackup_source(&(keeper->monitor),
+									   keeper->state.current_node_id,
+									   sourceNode))
+	{
+		log_error("Failed to get the base backup source node from the "
+				  "monitor, see above for details");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_prepare_base_backup sets the pg_basebackup options that
+ * standby_init_replication_source does not know about: the maximum backup
+ * rate of the formation when it is set on the monitor, the server-side
+ * compression, the commands that restore a base backup from the backup
+ * repository or resync an existing PGDATA, and the init state file where to
+ * report the progress.
+ */
+void
+keeper_prepare_base_backup(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+	char *compression = config->backup_compression;
+
+	(void) keeper_prepare_rebuild_scheduling(keeper);
+
+	if (!config->monitorDisabled)
+	{
+		char formationRate[MAXIMUM_BACKUP_RATE_LEN] = { 0 };
+
+		if (!monitor_get_formation_maximum_backup_rate(&(keeper->monitor),
+													   config->formation,
+													   formationRate,
+													   sizeof(formationRate)))
+		{
+			log_warn("Failed to get the maximum backup rate of formation "
+					 "\"%s\", using replication.maximum_backup_rate \"%s\"",
+					 config->formation,
+					 upstream->maximumBackupRate);
+		}
+		else if (!IS_EMPTY_STRING_BUFFER(formationRate))
+		{
+			log_info("Using maximum backup rate \"%s\" of formation \"%s\"",
+					 formationRate,
+					 config->formation);
+
+			strlcpy(upstream->maximumBackupRate,
+					formationRate,
+					MAXIMUM_BACKUP_RATE_LEN);
+		}
+	}
+
+	upstream->backupCompression[0] = '\0';
+
+	if (!IS_EMPTY_STRING_BUFFER(compression) && !streq(compression, "none"))
+	{
+		int pgVersion = 0;
+
+		(void) parse_pg_version_string(postgres->postgresSetup.pg_version,
+									   &pgVersion);
+
+		/*
+		 * pg_autoctl uses the plain format, where pg_basebackup can only
+		 * decompress what the server compressed.
+		 */
+		if (strncmp(compression, "server-", strlen("server-")) != 0)
+		{
+			log_warn("Ignoring replication.backup_compression \"%s\": only "
+					 "server-side compression methods are supported, "
+					 "such as \"server-zstd:workers=4\"",
+					 compression);
+		}
+		else if (pgVersion < 1500)
+		{
+			log_warn("Ignoring replication.backup_compression \"%s\": "
+					 "server-side compression requires Postgres 15 or later",
+					 compression);
+		}
+		else
+		{
+			strlcpy(upstream->backupCompression,
+					compression,
+					BACKUP_COMPRESSION_LEN);
+		}
+	}
+
+	strlcpy(upstream->restoreCommand,
+			config->backup_restore_command,
+			sizeof(upstream->restoreCommand));
+
+	strlcpy(upstream->resyncCommand,
+			config->delta_resync_command,
+			sizeof(upstream->resyncCommand));
+
+	strlcpy(upstream->initStateFilename, config->pathnames.init, MAXPGPATH);
+}
+
+
+/*
+ * keeper_prepare_rebuild_scheduling sets how the replication source
+ * pg_basebackup and pg_rewind processes are scheduled, from the
+ * replication.rebuild_nice, replication.rebuild_io_class, and
+ * replication.rebuild_cgroup settings. Invalid settings are ignored with a
+ * warning: a node rebuild should not fail because of them.
+ */
+void
+keeper_prepare_rebuild_scheduling(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	RebuildScheduling *scheduling =
+		&(postgres->replicationSource.scheduling);
+
+	char *ioClass = config->rebuild_io_class;
+
+	scheduling->nice = config->rebuild_nice;
+	scheduling->ioClass = REBUILD_IO_CLASS_NONE;
+	scheduling->cgroup[0] = '\0';
+
+	if (IS_EMPTY_STRING_BUFFER(ioClass) || streq(ioClass, "none"))
+	{
+		/* keep the I/O class of pg_autoctl */
+	}
+	else if (streq(ioClass, "best-effort"))
+	{
+		scheduling->ioClass = REBUILD_IO_CLASS_BEST_EFFORT;
+	}
+	else if (streq(ioClass, "idle"))
+	{
+		scheduling->ioClass = REBUILD_IO_CLASS_IDLE;
+	}
+	else
+	{
+		log_warn("Ignoring replication.rebuild_io_class \"%s\": expected "
+				 "one of \"none\", \"best-effort\", or \"idle\"",
+				 ioClass);
+	}
+
+#if !defined(__linux__)
+	if (scheduling->ioClass != REBUILD_IO_CLASS_NONE)
+	{
+		log_warn("Ignoring replication.rebuild_io_class \"%s\": I/O "
+				 "scheduling classes are only supported on Linux",
+				 ioClass);
+
+		scheduling->ioClass = REBUILD_IO_CLASS_NONE;
+	}
+#endif
+
+	if (!IS_EMPTY_STRING_BUFFER(config->rebuild_cgroup))
+	{
+		if (directory_exists(config->rebuild_cgroup))
+		{
+			strlcpy(scheduling->cgroup,
+					config->rebuild_cgroup,
+					sizeof(scheduling->cgroup));
+		}
+		else
+		{
+			log_warn("Ignoring replication.rebuild_cgroup \"%s\": "
+					 "directory does not exist",
+					 config->rebuild_cgroup);
+		}
+	}
+}
+
+
+/*
+ * keeper_rewind_is_expected_faster returns true when pg_rewind should be
+ * tried before pg_basebackup, which is the case unless the estimated amount
+ * of WAL that pg_rewind has to go through is more than
+ * replication.rewind_threshold percent of the data size.
+ *
+ * When the estimate can't be computed, we try pg_rewind as before.
+ */
+bool
+keeper_rewind_is_expected_faster(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	uint64_t divergence = 0;
+	uint64_t dataSize = 0;
+
+	char divergenceStr[BUFSIZE] = { 0 };
+	char dataSizeStr[BUFSIZE] = { 0 };
+
+	if (config->rewind_threshold <= 0)
+	{
+		return true;
+	}
+
+	if (!standby_estimate_rewind(postgres, &divergence, &dataSize))
+	{
+		log_warn("Failed to estimate the cost of pg_rewind, trying it anyway");
+		return true;
+	}
+
+	pretty_print_bytes(divergenceStr, sizeof(divergenceStr), divergence);
+	pretty_print_bytes(dataSizeStr, sizeof(dataSizeStr), dataSize);
+
+	if (dataSize > 0 &&
+		divergence > dataSize / 100 * (uint64_t) config->rewind_threshold)
+	{
+		log_info("Skipping pg_rewind: the timelines have diverged by %s "
+				 "of WAL, more than %d%% of the %s of data to copy "
+				 "with pg_basebackup",
+				 divergenceStr,
+				 config->rewind_threshold,
+				 dataSizeStr);
+		return false;
+	}
+
+	log_info("The timelines have diverged by %s of WAL, for %s of data, "
+			 "trying pg_rewind",
+			 divergenceStr,
+			 dataSizeStr);
+
+	return true;
+}
+
+
+/*
+ * keeper_maintain_prewarm is called at each round of the keeper main loop. It
+ * makes progress on a running prewarm, and when the node is a secondary it
+ * refreshes the list of the hot relations of the primary from time to time,
+ * so that the list is ready when the node gets promoted.
+ */
+void
+keeper_maintain_prewarm(Keeper *keeper)
+{
+	KeeperPrewarm *prewarm = &(keeper->prewarm);
+	uint64_t now = time(NULL);
+
+	(void) keeper_prewarm_poll(prewarm);
+
+	if (keeper->config.prewarm_budget <= 0 ||
+		keeper->state.current_role != SECONDARY_STATE ||
+		!keeper->postgres.pgIsRunning ||
+		(now - prewarm->refreshTime) < PG_AUTOCTL_PREWARM_REFRESH_TIME)
+	{
+		return;
+	}
+
+	for (int i = 0; i < keeper->otherNodes.count; i++)
+	{
+		NodeAddress *node = &(keeper->otherNodes.nodes[i]);
+
+		if (node->isPrimary)
+		{
+			(void) keeper_prewarm_refresh_relations(prewarm,
+													&(keeper->postgres.postgresSetup),
+													node);
+			return;
+		}
+	}
+}
+
+
+/*
+ * keeper_run_primary_change_hooks is called at each round of the keeper main
+ * loop. When the primary node of the group is not the one we last ran the
+ * primary change hooks for, we run them now. That's either this node, once
+ * it's a primary, or the other node that the monitor reports as the primary.
+ *
+ * During a failover the group might have no primary for a while, we then
+ * wait until the new primary is known.
+ */
+void
+keeper_run_primary_change_hooks(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	KeeperHooks *hooks = &(keeper->hooks);
+
+	NodeAddress primary = { 0 };
+	bool primaryKnown = false;
+
+	if (IS_EMPTY_STRING_BUFFER(config->primary_change_hooks))
+	{
+		return;
+	}
+
+	switch (keeperState->current_role)
+	{
+		case SINGLE_STATE:
+		case WAIT_PRIMARY_STATE:
+		case PRIMARY_STATE:
+		case JOIN_PRIMARY_STATE:
+		case APPLY_SETTINGS_STATE:
+		{
+			primary.nodeId = keeperState->current_node_id;
+			primary.port = config->pgSetup.pgport;
+			primary.isPrimary = true;
+
+			strlcpy(primary.name, config->name, sizeof(primary.name));
+			strlcpy(primary.host, config->hostname, sizeof(primary.host));
+
+			primaryKnown = true;
+			break;
+		}
+
+		default:
+		{
+			for (int i = 0; i < keeper->otherNodes.count; i++)
+			{
+				NodeAddress *node = &(keeper->otherNodes.nodes[i]);
+
+				if (node->isPrimary)
+				{
+					primary = *node;
+					primaryKnown = true;
+					break;
+				}
+			}
+			break;
+		}
+	}
+
+	if (!primaryKnown ||
+		(hooks->primaryKnown &&
+		 hooks->primary.nodeId == primary.nodeId &&
+		 hooks->primary.port == primary.port &&
+		 streq(hooks->primary.host, primary.host)))
+	{
+		return;
+	}
+
+	(void) keeper_hooks_run(hooks,
+							config->primary_change_hooks,
+							config->primary_change_hooks_timeout,
+							config->formation,
+							keeperState->current_group,
+							&primary);
+}
+
+
+/*
+ * keeper_report_replication_stats sends the replication progress of our
+ * standbys to the monitor, every PG_AUTOCTL_REPLICATION_STATS_REPORT_INTERVAL
+ * seconds, while we are the primary node. The monitor uses the flush LSN to
+ * rank failover candidates with fresher data than their own node_active
+ * reports, and the flush lag to list the closest standbys first in
+ * synchronous_standby_names.
+ *
+ * We also report the WAL retained by the replication slots of our standbys,
+ * see keeper_report_replication_slots, and the transactions that a
+ * switchover would have to wait for, see keeper_report_drain_stats.
+ */
+void
+keeper_report_replication_stats(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	ReplicationStatsReport report = { 0 };
+	uint64_t now = time(NULL);
+
+	if (keeper->config.monitorDisabled ||
+		keeper->state.current_role != PRIMARY_STATE ||
+		!postgres->pgIsRunning ||
+		(now - keeper->statsReportTime) <
+		PG_AUTOCTL_REPLICATION_STATS_REPORT_INTERVAL)
+	{
+		return;
+	}
+
+	/* we retry at the next interval, even when we fail now */
+	keeper->statsReportTime = now;
+
+	/* disconnected standby nodes only show up in pg_replication_slots */
+	(void) keeper_report_replication_slots(keeper);
+
+	(void) keeper_report_drain_stats(keeper);
+
+	if (!pgsql_get_replication_stats(&(postgres->sqlClient), &report))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (report.count == 0)
+	{
+		return;
+	}
+
+	(void) monitor_report_replication_stats(&(keeper->monitor),
+											keeper->state.current_node_id,
+											&report);
+}
+
+
+/*
+ * keeper_report_replay_progress samples the replayed LSN of our standby at
+ * every round, and reports it to the monitor with the received LSN and our
+ * apply rate every PG_AUTOCTL_REPLAY_PROGRESS_REPORT_INTERVAL seconds, or at
+ * every round in the report_lsn state, when the monitor is about to select a
+ * failover candidate.
+ *
+ * We also report the staleness of our WAL receiver, the time since it last
+ * heard from the upstream node. While the WAL receiver looks stalled, that is
+ * when it's stale and the primary has WAL that we did not receive, we report
+ * at every round so that the monitor can stop counting on this standby
+ * without waiting for the replication lag to grow.
+ *
+ * The replay is only as fast as the WAL that we receive when there's no
+ * backlog, so we only update the apply rate from the samples where replay was
+ * behind the received LSN.
+ *
+ * The catch-up rate is how fast the distance between the end of WAL on the
+ * upstream node, as our WAL receiver last heard of it, and our received LSN
+ * shrinks. It is negative when we are falling behind. The monitor compares
+ * the same distance to pgautofailover.enable_sync_wal_log_threshold before
+ * assigning the secondary state, so we report at every round while catching
+ * up, and the monitor turns the rate into a catch-up ETA, as shown in
+ * pg_autoctl show state.
+ */
+void
+keeper_report_replay_progress(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	KeeperStateData *keeperState = &(keeper->state);
+	KeeperReplayProgress *progress = &(keeper->replayProgress);
+
+	uint64_t receivedLSN = 0;
+	uint64_t replayLSN = 0;
+	uint64_t now = time(NULL);
+	instr_time sampleTime;
+
+	if (keeper->config.monitorDisabled ||
+		keeperState->current_node_id < 0 ||
+		!postgres->pgIsRunning ||
+		!postgres->postgresSetup.is_in_recovery)
+	{
+		progress->started = false;
+		progress->sampleHasDistance = false;
+		progress->catchupRate = 0;
+		progress->receiverSeenStreaming = false;
+		progress->receiverStalled = false;
+		return;
+	}
+
+	if (!pgsql_get_replay_lsn(&(postgres->sqlClient), progress->replayLSN) ||
+		!parseLSN(progress->replayLSN, &replayLSN) ||
+		!parseLSN(postgres->currentLSN, &receivedLSN))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(sampleTime);
+
+	double seconds = 0;
+
+	if (progress->started)
+	{
+		instr_time elapsed = sampleTime;
+
+		INSTR_TIME_SUBTRACT(elapsed, progress->sampleTime);
+		seconds = INSTR_TIME_GET_DOUBLE(elapsed);
+	}
+
+	/* a new timeline may start at a lower LSN, start over */
+	if (seconds > 0 &&
+		progress->sampleHadBacklog &&
+		replayLSN >= progress->sampleReplayLSN)
+	{
+		double applyRate = (replayLSN - progress->sampleReplayLSN) / seconds;
+
+		progress->applyRate =
+			progress->applyRate > 0
+			? REPLAY_PROGRESS_RATE_WEIGHT * applyRate +
+			  (1 - REPLAY_PROGRESS_RATE_WEIGHT) * progress->applyRate
+			: applyRate;
+	}
+
+	uint64_t upstreamLSN = 0;
+	bool hasDistance =
+		parseLSN(postgres->walReceiver.latestEndLSN, &upstreamLSN) &&
+		upstreamLSN > 0;
+	uint64_t distance =
+		upstreamLSN > receivedLSN ? upstreamLSN - receivedLSN : 0;
+
+	if (seconds > 0 && hasDistance && progress->sampleHasDistance)
+	{
+		double catchupRate =
+			((double) progress->sampleDistance - (double) distance) / seconds;
+
+		progress->catchupRate =
+			progress->catchupRate != 0
+			? REPLAY_PROGRESS_RATE_WEIGHT * catchupRate +
+			  (1 - REPLAY_PROGRESS_RATE_WEIGHT) * progress->catchupRate
+			: catchupRate;
+	}
+	else if (!hasDistance)
+	{
+		progress->catchupRate = 0;
+	}
+
+	progress->started = true;
+	progress->sampleTime = sampleTime;
+	progress->sampleReplayLSN = replayLSN;
+	progress->sampleHadBacklog = replayLSN < receivedLSN;
+	progress->sampleDistance = distance;
+	progress->sampleHasDistance = hasDistance;
+
+	/*
+	 * A WAL receiver that is not streaming, because it died or keeps
+	 * restarting, is as stale as the last time we saw it streaming.
+	 */
+	WalReceiverState *walReceiver = &(postgres->walReceiver);
+	bool streaming = streq(walReceiver->status, "streaming");
+	int64_t receiverStalenessMs = -1;
+
+	if (streaming)
+	{
+		progress->receiverSeenStreaming = true;
+		progress->receiverStreamingTime = sampleTime;
+		receiverStalenessMs = walReceiver->stalenessMs;
+	}
+	else if (progress->receiverSeenStreaming)
+	{
+		instr_time elapsed = sampleTime;
+
+		INSTR_TIME_SUBTRACT(elapsed, progress->receiverStreamingTime);
+		receiverStalenessMs = (int64_t) INSTR_TIME_GET_MILLISEC(elapsed);
+	}
+
+	/* an idle primary only sends keepalives, that's not a stall */
+	bool primaryIsAhead = false;
+
+	for (int i = 0; i < keeper->otherNodes.count; i++)
+	{
+		NodeAddress *node = &(keeper->otherNodes.nodes[i]);
+		uint64_t primaryLSN = 0;
+
+		if (node->isPrimary && parseLSN(node->lsn, &primaryLSN))
+		{
+			primaryIsAhead = primaryLSN > receivedLSN;
+			break;
+		}
+	}
+
+	bool receiverStalled =
+		receiverStalenessMs >= PG_AUTOCTL_WAL_RECEIVER_STALL_TIME &&
+		(!streaming || primaryIsAhead);
+
+	if (receiverStalled != progress->receiverStalled)
+	{
+		if (receiverStalled)
+		{
+			log_warn("WAL receiver has not heard from the upstream node "
+					 "in %lld ms, with status \"%s\"",
+					 (long long) receiverStalenessMs,
+					 streaming ? walReceiver->status : "stopped");
+		}
+		else
+		{
+			log_info("WAL receiver is streaming again");
+		}
+	}
+
+	bool reportingLSN =
+		keeperState->current_role == REPORT_LSN_STATE ||
+		keeperState->assigned_role == REPORT_LSN_STATE;
+
+	bool reportingStall = receiverStalled || progress->receiverStalled;
+
+	bool catchingUp =
+		keeperState->current_role == CATCHINGUP_STATE ||
+		keeperState->assigned_role == CATCHINGUP_STATE ||
+		keeperState->current_role == JOIN_SECONDARY_STATE ||
+		keeperState->assigned_role == JOIN_SECONDARY_STATE;
+
+	progress->receiverStalled = receiverStalled;
+
+	if (!reportingLSN && !reportingStall && !catchingUp &&
+		(now - progress->reportTime) < PG_AUTOCTL_REPLAY_PROGRESS_REPORT_INTERVAL)
+	{
+		return;
+	}
+
+	/* we retry at the next interval, even when we fail now */
+	progress->reportTime = now;
+
+	(void) monitor_report_replay_progress(&(keeper->monitor),
+										  keeperState->current_node_id,
+										  postgres->currentLSN,
+										  progress->replayLSN,
+										  (int64_t) progress->applyRate,
+										  receiverStalenessMs,
+										  (int64_t) progress->catchupRate);
+}
+
+
+/*
+ * keeper_report_node_latency probes the network round-trip time to the other
+ * nodes of the group and to the application anchors listed in the
+ * pg_autoctl.latency_anchors setting, as "host:port" entries separated by
+ * commas, and reports it to the monitor. The monitor then prefers to promote
+ * the standby nodes that are close to the applications, see
+ * pgautofailover.anchor_latency_priority_step.
+ *
+ * The probes only happen when anchors are configured, once every
+ * PG_AUTOCTL_LATENCY_PROBE_INTERVAL seconds.
+ */
+void
+keeper_report_node_latency(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	NodeAddressArray *otherNodes = &(keeper->otherNodes);
+
+	ConnectProbe probes[CONNECT_PROBE_MAX_COUNT] = { 0 };
+	int64_t targetNodeIds[CONNECT_PROBE_MAX_COUNT] = { 0 };
+	char anchors[MAXCONNINFO] = { 0 };
+	char *savePtr = NULL;
+	int count = 0;
+	uint64_t now = time(NULL);
+
+	if (config->monitorDisabled ||
+		keeperState->current_node_id < 0 ||
+		IS_EMPTY_STRING_BUFFER(config->latency_anchors) ||
+		(now - keeper->latencyProbeTime) < PG_AUTOCTL_LATENCY_PROBE_INTERVAL)
+	{
+		return;
+	}
+
+	/* we retry at the next interval, even when we fail now */
+	keeper->latencyProbeTime = now;
+
+	for (int i = 0; i < otherNodes->count && count < CONNECT_PROBE_MAX_COUNT; i++)
+	{
+		NodeAddress *node = &(otherNodes->nodes[i]);
+
+		strlcpy(probes[count].host, node->host, sizeof(probes[count].host));
+		probes[count].port = node->port;
+		targetNodeIds[count] = node->nodeId;
+		++count;
+	}
+
+	strlcpy(anchors, config->latency_anchors, sizeof(anchors));
+
+	for (char *anchor = strtok_r(anchors, ", ", &savePtr);
+		 anchor != NULL && count < CONNECT_PROBE_MAX_COUNT;
+		 anchor = strtok_r(NULL, ", ", &savePtr))
+	{
+		char *portString = strrchr(anchor, ':');
+
+		if (portString == NULL ||
+			portString == anchor ||
+			!stringToInt(portString + 1, &(probes[count].port)))
+		{
+			log_warn("Failed to parse pg_autoctl.latency_anchors entry \"%s\", "
+					 "expected \"host:port\"",
+					 anchor);
+			continue;
+		}
+
+		*portString = '\0';
+
+		/* IPv6 addresses are written in brackets, as in [::1]:443 */
+		if (anchor[0] == '[' && portString[-1] == ']')
+		{
+			portString[-1] = '\0';
+			++anchor;
+		}
+
+		strlcpy(probes[count].host, anchor, sizeof(probes[count].host));
+		targetNodeIds[count] = -1;
+		++count;
+	}
+
+	if (!probeConnectTime(probes, count, PG_AUTOCTL_LATENCY_PROBE_TIMEOUT))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	PQExpBuffer nodeIds = createPQExpBuffer();
+	PQExpBuffer targets = createPQExpBuffer();
+	PQExpBuffer rtts = createPQExpBuffer();
+
+	for (int i = 0; i < count; i++)
+	{
+		const char *separator = i == 0 ? "{" : ",";
+
+		if (targetNodeIds[i] < 0)
+		{
+			appendPQExpBuffer(nodeIds, "%sNULL", separator);
+		}
+		else
+		{
+			appendPQExpBuffer(nodeIds, "%s%" PRId64, separator, targetNodeIds[i]);
+		}
+
+		appendPQExpBuffer(targets, "%s\"%s:%d\"",
+						  separator, probes[i].host, probes[i].port);
+		appendPQExpBuffer(rtts, "%s%" PRId64, separator, probes[i].rttUs);
+
+		log_debug("Network round-trip time to %s:%d is %" PRId64 " us",
+				  probes[i].host, probes[i].port, probes[i].rttUs);
+	}
+
+	appendPQExpBufferStr(nodeIds, count == 0 ? "{}" : "}");
+	appendPQExpBufferStr(targets, count == 0 ? "{}" : "}");
+	appendPQExpBufferStr(rtts, count == 0 ? "{}" : "}");
+
+	if (PQExpBufferBroken(nodeIds) ||
+		PQExpBufferBroken(targets) ||
+		PQExpBufferBroken(rtts))
+	{
+		log_error("Failed to allocate memory");
+	}
+	else
+	{
+		(void) monitor_report_node_latency(&(keeper->monitor),
+										   keeperState->current_node_id,
+										   nodeIds->data,
+										   targets->data,
+										   rtts->data);
+	}
+
+	destroyPQExpBuffer(nodeIds);
+	destroyPQExpBuffer(targets);
+	destroyPQExpBuffer(rtts);
+}
+
+
+/*
+ * keeper_apply_pushed_settings applies the synchronous_standby_names value
+ * that the monitor pushed to our node when number_sync_standbys changed, with
+ * pgautofailover.enable_direct_settings on. The value comes with the state
+ * notification of our node, and again with our next node_active call, which
+ * confirms it: we call this function after both, and only reload Postgres
+ * when the value is not the one we already applied.
+ *
+ * We only apply pushed settings while we are a primary node that is assigned
+ * the primary state, other transitions fetch the value from the monitor.
+ */
+void
+keeper_apply_pushed_settings(Keeper *keeper)
+{
+	Monitor *monitor = &(keeper->monitor);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+
+	if (!monitor->hasPushedSettings)
+	{
+		return;
+	}
+
+	monitor->hasPushedSettings = false;
+
+	if (keeperState->current_role != PRIMARY_STATE ||
+		keeperState->assigned_role != PRIMARY_STATE ||
+		!postgres->pgIsRunning)
+	{
+		log_debug("Skipping synchronous_standby_names '%s' pushed by the "
+				  "monitor in state \"%s\"",
+				  monitor->pushedSynchronousStandbyNames,
+				  NodeStateToString(keeperState->current_role));
+		return;
+	}
+
+	if (streq(postgres->synchronousStandbyNames,
+			  monitor->pushedSynchronousStandbyNames))
+	{
+		return;
+	}
+
+	strlcpy(postgres->synchronousStandbyNames,
+			monitor->pushedSynchronousStandbyNames,
+			sizeof(postgres->synchronousStandbyNames));
+
+	if (!primary_set_synchronous_standby_names(postgres))
+	{
+		/* have the next push, or node_active confirmation, try again */
+		postgres->synchronousStandbyNames[0] = '\0';
+
+		log_warn("Failed to apply synchronous_standby_names pushed by "
+				 "the monitor, see above for details");
+	}
+}
+
+
+/*
+ * keeper_check_sync_rep_stall is a watchdog for the commits that wait for
+ * synchronous replication on a primary node. When the oldest statement that
+ * waits on SyncRep has been running for more than the
+ * timeout.sync_rep_stall_timeout milliseconds, we ask the monitor to stop
+ * waiting for the standby nodes that are not streaming from us right away,
+ * rather than wait until it finds them to be unhealthy. The monitor then assigns us wait_primary when needed, and
+ * fsm_disable_sync_rep releases the waiting commits.
+ *
+ * We ask the monitor at most once per second.
+ */
+void
+keeper_check_sync_rep_stall(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	char streamingStandbyIds[BUFSIZE] = { 0 };
+	int stallMs = 0;
+	bool degraded = false;
+	uint64_t now = time(NULL);
+
+	if (config->monitorDisabled ||
+		config->sync_rep_stall_timeout <= 0 ||
+		keeper->state.current_role != PRIMARY_STATE ||
+		!postgres->pgIsRunning ||
+		now == keeper->syncRepStallReportTime)
+	{
+		return;
+	}
+
+	if (!pgsql_get_sync_rep_stall(&(postgres->sqlClient),
+								  pgSetup->control.pg_control_version,
+								  config->sync_rep_stall_timeout,
+								  &stallMs,
+								  streamingStandbyIds,
+								  sizeof(streamingStandbyIds)))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (stallMs < config->sync_rep_stall_timeout)
+	{
+		return;
+	}
+
+	keeper->syncRepStallReportTime = now;
+
+	log_warn("Commits have been waiting for synchronous replication "
+			 "for %d ms, more than timeout.sync_rep_stall_timeout (%d ms), "
+			 "streaming standby nodes are %s",
+			 stallMs,
+			 config->sync_rep_stall_timeout,
+			 streamingStandbyIds);
+
+	if (!monitor_report_sync_rep_stall(&(keeper->monitor),
+									   keeper->state.current_node_id,
+									   streamingStandbyIds,
+									   stallMs,
+									   &degraded))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (degraded)
+	{
+		log_info("The monitor is degrading synchronous replication "
+				 "for the standby nodes that are not streaming");
+	}
+}
+
+
+/*
+ * keeper_check_storage reports the latency of the storage probes of PGDATA
+ * and pg_wal to the monitor when a new probe is done, and at most once per
+ * second while a probe is waiting. It also reports the free space of pg_wal
+ * and when it is expected to be full.
+ *
+ * The probes run in the node-probe service when it is enabled, see
+ * node_probe.c, and we only report its last sample here. Otherwise we run
+ * the probes ourselves, see keeper_io_watchdog.c.
+ */
+void
+keeper_check_storage(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperIOWatchdog *watchdog = &(keeper->ioWatchdog);
+	NodeProbeSnapshot snapshot = { 0 };
+	NodeProbeSnapshot *probeSnapshot = NULL;
+	IOWatchdogStats stats = { 0 };
+	bool newSample = false;
+	bool stalled = false;
+	uint64_t now = time(NULL);
+
+	if (node_probe_enabled())
+	{
+		if (!node_probe_read(&snapshot))
+		{
+			/* no sample yet */
+			return;
+		}
+
+		probeSnapshot = &snapshot;
+		stats = snapshot.ioStats;
+		newSample = snapshot.ioSampleCount != keeper->probeIoSampleCount;
+		keeper->probeIoSampleCount = snapshot.ioSampleCount;
+	}
+	else
+	{
+		(void) keeper_io_watchdog_poll(watchdog,
+									   config->pgSetup.pgdata,
+									   config->storage_probe_interval);
+		(void) keeper_io_watchdog_stats(watchdog, &stats);
+
+		newSample = watchdog->newSample;
+		watchdog->newSample = false;
+	}
+
+	if (config->monitorDisabled ||
+		keeper->state.current_node_id < 0)
+	{
+		return;
+	}
+
+	(void) keeper_report_wal_space(keeper, probeSnapshot);
+
+	bool stalling =
+		stats.stallMs >= PG_AUTOCTL_IO_WATCHDOG_STALL_WARNING_MS &&
+		now != keeper->storageStallReportTime;
+
+	if (!newSample && !stalling)
+	{
+		return;
+	}
+
+	if (stalling)
+	{
+		keeper->storageStallReportTime = now;
+	}
+
+	if (!monitor_report_storage_health(&(keeper->monitor),
+									   keeper->state.current_node_id,
+									   &stats,
+									   &stalled))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (stalled)
+	{
+		log_warn("The monitor considers the storage of this node stalled, "
+				 "after %d ms", stats.stallMs);
+	}
+}
+
+
+/*
+ * keeper_report_wal_space reports the free space and WAL rate of pg_wal to
+ * the monitor with each new sample. The samples come from the node-probe
+ * service when it is enabled, otherwise we update them from the current LSN
+ * of our Postgres metadata.
+ */
+static void
+keeper_report_wal_space(Keeper *keeper, NodeProbeSnapshot *snapshot)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	KeeperWalSpace *walSpace = &(keeper->walSpace);
+	bool exhausting = false;
+
+	if (snapshot != NULL)
+	{
+		if (snapshot->walSampleCount == keeper->probeWalSampleCount)
+		{
+			return;
+		}
+
+		keeper->probeWalSampleCount = snapshot->walSampleCount;
+		*walSpace = snapshot->walSpace;
+	}
+	else
+	{
+		if (!postgres->pgIsRunning)
+		{
+			return;
+		}
+
+		(void) keeper_wal_space_update(walSpace,
+									   keeper->config.pgSetup.pgdata,
+									   postgres->currentLSN);
+
+		if (!walSpace->newSample)
+		{
+			return;
+		}
+
+		walSpace->newSample = false;
+	}
+
+	if (!monitor_report_wal_space(&(keeper->monitor),
+								  keeper->state.current_node_id,
+								  walSpace,
+								  &exhausting))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	if (exhausting)
+	{
+		log_warn("The monitor expects pg_wal to be full in %d seconds, "
+				 "with %" PRId64 " bytes free",
+				 walSpace->timeToFull,
+				 walSpace->freeBytes);
+	}
+}
+
+
+/*
+ * keeper_report_drain_stats sends the write transactions in progress and the
+ * prepared transactions of the local Postgres instance to the monitor. A
+ * switchover has to wait for the write transactions to finish or be rolled
+ * back, and prepared transactions keep their locks on the new primary, so
+ * the monitor uses that to refuse a switchover that would stall.
+ */
+static bool
+keeper_report_drain_stats(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	DrainStats stats = { 0 };
+
+	if (!pgsql_get_drain_stats(&(postgres->sqlClient), &stats))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return monitor_report_drain_stats(&(keeper->monitor),
+									  keeper->state.current_node_id,
+									  &stats);
+}
+
+
+/*
+ * keeper_report_replication_slots sends how much WAL the replication slots
+ * of our standbys retain to the monitor, and drops the slots that the monitor
+ * asks us to invalidate: the inactive slots that retain more WAL than its
+ * pgautofailover.replication_slot_wal_budget, and the slots that Postgres
+ * already invalidated because of max_slot_wal_keep_size.
+ *
+ * We then create the slots again at the next round of the main loop, at the
+ * current WAL position, so that the WAL that the standby node has not
+ * fetched yet can be recycled.
+ */
+static bool
+keeper_report_replication_slots(Keeper *keeper)
+{
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSlotStatsReport report = { 0 };
+	NodeAddressArray invalidateNodesArray = { 0 };
+
+	if (!pgsql_get_replication_slot_stats(&(postgres->sqlClient),
+										  pgSetup->control.pg_control_version,
+										  &report))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (report.count == 0)
+	{
+		return true;
+	}
+
+	if (!monitor_report_replication_slots(&(keeper->monitor),
+										  keeper->state.current_node_id,
+										  &report,
+										  &invalidateNodesArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int index = 0; index < invalidateNodesArray.count; index++)
+	{
+		NodeAddress *node = &(invalidateNodesArray.nodes[index]);
+		char slotName[BUFSIZE] = { 0 };
+
+		if (!postgres_sprintf_replicationSlotName(node->nodeId,
+												  slotName,
+												  sizeof(slotName)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		log_warn("Invalidating replication slot \"%s\" of node %" PRId64
+				 " \"%s\" (%s:%d) as requested by the monitor, the node "
+				 "will need to be rebuilt if the WAL it needs is recycled",
+				 slotName,
+				 node->nodeId,
+				 node->name,
+				 node->host,
+				 node->port);
+
+		if (!pgsql_drop_replication_slot(&(postgres->sqlClient), slotName))
+		{
+			log_error("Failed to invalidate replication slot \"%s\", "
+					  "see above for details",
+					  slotName);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * keeper_get_most_advanced_standby fetches the current most advanded standby
  * node in the group, either by connecting to the monitor and using the
@@ -12,11 +12,39 @@
 
 #include "commandline.h"
 #include "keeper_config.h"
+#include "keeper_hooks.h"
+#include "keeper_io_watchdog.h"
+#include "keeper_prewarm.h"
 #include "log.h"
 #include "monitor.h"
 #include "primary_standby.h"
 #include "state.h"
 
+/*
+ * KeeperReplayProgress estimates how fast a standby node replays WAL, so
+ * that the monitor can tell how long it would take to promote it, and how
+ * fast it catches up with its upstream node.
+ */
+typedef struct KeeperReplayProgress
+{
+	bool started;
+	instr_time sampleTime;
+	uint64_t sampleReplayLSN;
+	bool sampleHadBacklog;
+	uint64_t sampleDistance;
+	bool sampleHasDistance;
+
+	char replayLSN[PG_LSN_MAXLENGTH];
+	double applyRate;           /* bytes per second, 0 when unknown */
+	double catchupRate;         /* bytes per second, 0 when unknown */
+	uint64_t reportTime;
+
+	bool receiverSeenStreaming;
+	instr_time receiverStreamingTime;
+	bool receiverStalled;
+} KeeperReplayProgress;
+
+
 /* the keeper manages a postgres server according to the given configuration */
 typedef struct Keeper
 {
@@ -31,6 +59,50 @@ typedef struct Keeper
 	 */
 	NodeAddressArray otherNodes;
 
+	/* hot relations of the primary, to prewarm when we get promoted */
+	KeeperPrewarm prewarm;
+
+	/* primary node for which we last ran the primary change hooks */
+	KeeperHooks hooks;
+
+	/* last successful node_active call, for network partition probing */
+	instr_time lastMonitorContactTime;
+
+	/* last time we reported the replication stats of our standbys */
+	uint64_t statsReportTime;
+
+	/* last time we reported commits stuck on synchronous replication */
+	uint64_t syncRepStallReportTime;
+
+	/* how many local_query_timeout we had in a row on the local Postgres */
+	int localQueryTimeoutCount;
+
+	/* storage probes of PGDATA and pg_wal, and when we last reported a stall */
+	KeeperIOWatchdog ioWatchdog;
+	uint64_t storageStallReportTime;
+
+	/* free space and WAL rate of pg_wal, to predict when it gets full */
+	KeeperWalSpace walSpace;
+
+	/* replay of a standby node, to rank the failover candidates */
+	KeeperReplayProgress replayProgress;
+
+	/* last time we probed the network latency to the other nodes */
+	uint64_t latencyProbeTime;
+
+	/* the node-probe samples that we have already reported */
+	uint64_t probeIoSampleCount;
+	uint64_t probeWalSampleCount;
+
+	/* how long to wait before the next node_active call, as the monitor says */
+	int reportIntervalMs;
+
+	/* the failover trace id that came with our goal state, if any */
+	char traceId[NAMEDATALEN];
+
+	/* whether we checked the monitor extension version, see node_active */
+	bool monitorVersionChecked;
+
 	/* Only useful during the initialization of the Keeper */
 	KeeperStateInit initState;
 } Keeper;
@@ -42,6 +114,7 @@ bool keeper_register_and_init(Keeper *keeper, NodeState initialState);
 bool keeper_register_again(Keeper *keeper);
 bool keeper_load_state(Keeper *keeper);
 bool keeper_store_state(Keeper *keeper);
+void keeper_set_log_context(Keeper *keeper);
 bool keeper_update_state(Keeper *keeper, int64_t node_id, int group_id, NodeState state,
 						 bool update_last_monitor_contact);
 bool keeper_start_postgres(Keeper *keeper);
@@ -51,18 +124,40 @@ bool keeper_ensure_postgres_is_running(Keeper *keeper, bool updateRetries);
 bool keeper_create_and_drop_replication_slots(Keeper *keeper);
 bool keeper_maintain_replication_slots(Keeper *keeper);
 bool keeper_ensure_current_state(Keeper *keeper);
+bool keeper_fence_postgres(Keeper *keeper);
+bool keeper_unfence_postgres(Keeper *keeper);
 bool keeper_create_self_signed_cert(Keeper *keeper);
 bool keeper_ensure_configuration(Keeper *keeper, bool postgresNotRunningIsOk);
 bool keeper_update_pg_state(Keeper *keeper, int logLevel);
 bool keeper_node_active(Keeper *keeper, bool doInit,
 						MonitorAssignedState *assignedState);
+bool keeper_assignment_lease_is_valid(Keeper *keeper);
 bool keeper_ensure_node_has_been_dropped(Keeper *keeper, bool *dropped);
 bool ReportPgIsRunning(Keeper *keeper);
 bool keeper_remove(Keeper *keeper, KeeperConfig *config);
 bool keeper_check_monitor_extension_version(Keeper *keeper);
 bool keeper_state_as_json(Keeper *keeper, char *json, int size);
-bool keeper_update_group_hba(Keeper *keeper, NodeAddressArray *diffNodesArray);
+bool keeper_update_group_hba(Keeper *keeper,
+							 NodeAddressArray *groupNodesArray,
+							 NodeAddressArray *diffNodesArray,
+							 NodeAddressArray *staleNodesArray);
+void diff_nodesArray(NodeAddressArray *previousNodesArray,
+					 NodeAddressArray *currentNodesArray,
+					 NodeAddressArray *diffNodesArray);
 bool keeper_refresh_other_nodes(Keeper *keeper, bool forceCacheInvalidation);
+void keeper_maintain_prewarm(Keeper *keeper);
+void keeper_run_primary_change_hooks(Keeper *keeper);
+void keeper_report_replication_stats(Keeper *keeper);
+void keeper_report_replay_progress(Keeper *keeper);
+void keeper_report_node_latency(Keeper *keeper);
+void keeper_check_sync_rep_stall(Keeper *keeper);
+void keeper_apply_pushed_settings(Keeper *keeper);
+void keeper_check_storage(Keeper *keeper);
+void keeper_prepare_base_backup(Keeper *keeper);
+void keeper_prepare_rebuild_scheduling(Keeper *keeper);
+bool keeper_rewind_is_expected_faster(Keeper *keeper);
+bool keeper_update_other_nodes(Keeper *keeper,
+							   MonitorAssignedState *assignedState);
 
 bool keeper_set_node_metadata(Keeper *keeper, KeeperConfig *oldConfig);
 bool keeper_update_nodename_from_monitor(Keeper *keeper);
@@ -106,6 +201,8 @@ bool keeper_refresh_hba(Keeper *keeper,
 
 bool keeper_read_nodes_from_file(Keeper *keeper, NodeAddressArray *nodesArray);
 bool keeper_get_primary(Keeper *keeper, NodeAddress *primaryNode);
+bool keeper_get_upstream(Keeper *keeper, NodeAddress *upstreamNode);
+bool keeper_get_basebackup_source(Keeper *keeper, NodeAddress *sourceNode);
 bool keeper_get_most_advanced_standby(Keeper *keeper, NodeAddress *primaryNode);
 
 
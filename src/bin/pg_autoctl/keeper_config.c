@@ -13,6 +13,7 @@
 
 #include "postgres_fe.h"
 
+#include "config_snapshot.h"
 #include "defaults.h"
 #include "ini_file.h"
 #include "keeper.h"
@@ -29,6 +30,14 @@
 	make_strbuf_option("pg_autoctl", "monitor", "monitor", false, MAXCONNINFO, \
 					   config->monitor_pguri)
 
+#define OPTION_AUTOCTL_MONITOR_REPLICA(config) \
+	make_strbuf_option("pg_autoctl", "monitor_replica", NULL, false, \
+					   MAXCONNINFO, config->monitor_replica_pguri)
+
+#define OPTION_AUTOCTL_MONITOR_POOLER(config) \
+	make_strbuf_option("pg_autoctl", "monitor_pooler", NULL, false, \
+					   MAXCONNINFO, config->monitor_pooler_pguri)
+
 #define OPTION_AUTOCTL_FORMATION(config) \
 	make_strbuf_option_default("pg_autoctl", "formation", "formation", \
 							   true, NAMEDATALEN, \
@@ -61,6 +70,51 @@
 	make_strbuf_option("pg_autoctl", "nodekind", NULL, false, NAMEDATALEN, \
 					   config->nodeKind)
 
+#define OPTION_AUTOCTL_METRICS_PORT(config) \
+	make_int_option_default("pg_autoctl", "metrics_port", NULL, \
+							false, &(config->metrics_port), METRICS_PORT)
+
+#define OPTION_AUTOCTL_MONITOR_PROXY(config) \
+	make_int_option_default("pg_autoctl", "monitor_proxy", NULL, \
+							false, &(config->monitor_proxy), MONITOR_PROXY)
+
+#define OPTION_AUTOCTL_NODE_PROBE(config) \
+	make_int_option_default("pg_autoctl", "node_probe", NULL, \
+							false, &(config->node_probe), NODE_PROBE)
+
+#define OPTION_AUTOCTL_WATCH_CONFIG(config) \
+	make_int_option_default("pg_autoctl", "watch_config", NULL, \
+							false, &(config->watch_config), WATCH_CONFIG)
+
+#define OPTION_AUTOCTL_MONITOR_WAIT(config) \
+	make_int_option_default("pg_autoctl", "monitor_wait", NULL, \
+							false, &(config->monitor_wait), MONITOR_WAIT)
+
+#define OPTION_AUTOCTL_ROUTER_PORT(config) \
+	make_int_option_default("pg_autoctl", "router_port", NULL, \
+							false, &(config->router_port), ROUTER_PORT)
+
+#define OPTION_AUTOCTL_PRIMARY_CHANGE_HOOKS(config) \
+	make_strbuf_option("pg_autoctl", "primary_change_hooks", NULL, false, \
+					   MAXPGPATH, config->primary_change_hooks)
+
+#define OPTION_AUTOCTL_READ_ONLY_FENCING(config) \
+	make_int_option_default("pg_autoctl", "read_only_fencing", NULL, \
+							false, &(config->read_only_fencing), \
+							READ_ONLY_FENCING)
+
+#define OPTION_AUTOCTL_LATENCY_ANCHORS(config) \
+	make_strbuf_option("pg_autoctl", "latency_anchors", NULL, false, \
+					   MAXCONNINFO, config->latency_anchors)
+
+#define OPTION_AUTOCTL_SERVICE_NICE(config) \
+	make_int_option_default("pg_autoctl", "service_nice", NULL, \
+							false, &(config->service_nice), SERVICE_NICE)
+
+#define OPTION_AUTOCTL_SERVICE_CPU_AFFINITY(config) \
+	make_strbuf_option("pg_autoctl", "service_cpu_affinity", NULL, false, \
+					   BUFSIZE, config->service_cpu_affinity)
+
 #define OPTION_POSTGRESQL_PGDATA(config) \
 	make_strbuf_option("postgresql", "pgdata", "pgdata", true, MAXPGPATH, \
 					   config->pgSetup.pgdata)
@@ -103,6 +157,10 @@
 	make_strbuf_option("postgresql", "hba_level", NULL, \
 					   false, MAXPGPATH, config->pgSetup.hbaLevelStr)
 
+#define OPTION_POSTGRESQL_HBA_COMPACT(config) \
+	make_int_option_default("postgresql", "hba_compact", NULL, \
+							false, &(config->hba_compact), HBA_COMPACT)
+
 #define OPTION_SSL_ACTIVE(config) \
 	make_int_option_default("ssl", "active", NULL, \
 							false, &(config->pgSetup.ssl.active), 0)
@@ -139,6 +197,66 @@
 							   config->maximum_backup_rate, \
 							   MAXIMUM_BACKUP_RATE)
 
+#define OPTION_REPLICATION_BACKUP_COMPRESSION(config) \
+	make_strbuf_option("replication", "backup_compression", NULL, \
+					   false, BACKUP_COMPRESSION_LEN, \
+					   config->backup_compression)
+
+#define OPTION_REPLICATION_BACKUP_RESTORE_COMMAND(config) \
+	make_strbuf_option("replication", "backup_restore_command", NULL, \
+					   false, MAXPGPATH, \
+					   config->backup_restore_command)
+
+#define OPTION_REPLICATION_DELTA_RESYNC_COMMAND(config) \
+	make_strbuf_option("replication", "delta_resync_command", NULL, \
+					   false, MAXPGPATH, \
+					   config->delta_resync_command)
+
+#define OPTION_REPLICATION_REWIND_THRESHOLD(config) \
+	make_int_option_default("replication", "rewind_threshold", \
+							NULL, \
+							false, \
+							&(config->rewind_threshold), \
+							REWIND_THRESHOLD)
+
+#define OPTION_REPLICATION_SLOT_ADVANCE_THRESHOLD(config) \
+	make_int_option_default("replication", "slot_advance_threshold", \
+							NULL, \
+							false, \
+							&(config->slot_advance_threshold), \
+							SLOT_ADVANCE_THRESHOLD)
+
+#define OPTION_REPLICATION_WAL_FETCH_WORKERS(config) \
+	make_int_option_default("replication", "wal_fetch_workers", \
+							NULL, \
+							false, \
+							&(config->wal_fetch_workers), \
+							WAL_FETCH_WORKERS)
+
+#define OPTION_REPLICATION_MAINTENANCE_DRAIN_LAG(config) \
+	make_int_option_default("replication", "maintenance_drain_lag", \
+							NULL, \
+							false, \
+							&(config->maintenance_drain_lag), \
+							MAINTENANCE_DRAIN_LAG)
+
+#define OPTION_REPLICATION_REBUILD_NICE(config) \
+	make_int_option_default("replication", "rebuild_nice", \
+							NULL, \
+							false, \
+							&(config->rebuild_nice), \
+							REBUILD_NICE)
+
+#define OPTION_REPLICATION_REBUILD_IO_CLASS(config) \
+	make_strbuf_option("replication", "rebuild_io_class", NULL, \
+					   false, REBUILD_IO_CLASS_LEN, \
+					   config->rebuild_io_class)
+
+#define OPTION_REPLICATION_REBUILD_CGROUP(config) \
+	make_strbuf_option("replication", "rebuild_cgroup", NULL, \
+					   false, MAXPGPATH, \
+					   config->rebuild_cgroup)
+
 #define OPTION_REPLICATION_BACKUP_DIR(config) \
 	make_strbuf_option("replication", "backup_directory", NULL, \
 					   false, MAXPGPATH, config->backupDirectory)
@@ -149,6 +267,12 @@
 							&(config->network_partition_timeout), \
 							NETWORK_PARTITION_TIMEOUT)
 
+#define OPTION_TIMEOUT_NETWORK_PARTITION_PROBE(config) \
+	make_int_option_default("timeout", "network_partition_probe_timeout", \
+							NULL, false, \
+							&(config->network_partition_probe_timeout), \
+							NETWORK_PARTITION_PROBE_TIMEOUT)
+
 #define OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config) \
 	make_int_option_default("timeout", "prepare_promotion_catchup", \
 							NULL, \
@@ -163,6 +287,13 @@
 							&(config->prepare_promotion_walreceiver), \
 							PREPARE_PROMOTION_WALRECEIVER_TIMEOUT)
 
+#define OPTION_TIMEOUT_PREWARM_BUDGET(config) \
+	make_int_option_default("timeout", "prewarm_budget", \
+							NULL, \
+							false, \
+							&(config->prewarm_budget), \
+							PREWARM_BUDGET)
+
 #define OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_TIMEOUT(config) \
 	make_int_option_default("timeout", "postgresql_restart_failure_timeout", \
 							NULL, \
@@ -177,12 +308,79 @@
 							&(config->postgresql_restart_failure_max_retries), \
 							POSTGRESQL_FAILS_TO_START_RETRIES)
 
+#define OPTION_TIMEOUT_CRASH_RECOVERY(config) \
+	make_int_option_default("timeout", "crash_recovery_timeout", \
+							NULL, \
+							false, \
+							&(config->crash_recovery_timeout), \
+							CRASH_RECOVERY_TIMEOUT)
+
 #define OPTION_TIMEOUT_LISTEN_NOTIFICATIONS(config) \
 	make_int_option_default("timeout", "listen_notifications_timeout", \
 							NULL, false, \
 							&(config->listen_notifications_timeout), \
 							PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT)
 
+#define OPTION_TIMEOUT_MIN_REPORT_INTERVAL(config) \
+	make_int_option_default("timeout", "min_report_interval", \
+							NULL, false, \
+							&(config->min_report_interval), \
+							PG_AUTOCTL_KEEPER_MIN_REPORT_INTERVAL)
+
+#define OPTION_TIMEOUT_MAX_REPORT_INTERVAL(config) \
+	make_int_option_default("timeout", "max_report_interval", \
+							NULL, false, \
+							&(config->max_report_interval), \
+							PG_AUTOCTL_KEEPER_MAX_REPORT_INTERVAL)
+
+#define OPTION_TIMEOUT_SYNC_REP_STALL(config) \
+	make_int_option_default("timeout", "sync_rep_stall_timeout", \
+							NULL, false, \
+							&(config->sync_rep_stall_timeout), \
+							SYNC_REP_STALL_TIMEOUT)
+
+#define OPTION_TIMEOUT_PRIMARY_CHANGE_HOOKS(config) \
+	make_int_option_default("timeout", "primary_change_hooks_timeout", \
+							NULL, false, \
+							&(config->primary_change_hooks_timeout), \
+							PRIMARY_CHANGE_HOOKS_TIMEOUT)
+
+#define OPTION_TIMEOUT_MAINTENANCE_DRAIN(config) \
+	make_int_option_default("timeout", "maintenance_drain_timeout", \
+							NULL, false, \
+							&(config->maintenance_drain_timeout), \
+							MAINTENANCE_DRAIN_TIMEOUT)
+
+#define OPTION_TIMEOUT_LOCAL_QUERY(config) \
+	make_int_option_default("timeout", "local_query_timeout", \
+							NULL, false, \
+							&(config->local_query_timeout), \
+							LOCAL_QUERY_TIMEOUT)
+
+#define OPTION_TIMEOUT_STORAGE_PROBE_INTERVAL(config) \
+	make_int_option_default("timeout", "storage_probe_interval", \
+							NULL, false, \
+							&(config->storage_probe_interval), \
+							STORAGE_PROBE_INTERVAL)
+
+#define OPTION_TIMEOUT_KEEPALIVES(config) \
+	make_int_option_default("timeout", "keepalives", \
+							NULL, false, \
+							&(config->keepalives), \
+							POSTGRES_KEEPALIVES)
+
+#define OPTION_TIMEOUT_KEEPALIVES_IDLE(config) \
+	make_int_option_default("timeout", "keepalives_idle", \
+							NULL, false, \
+							&(config->keepalives_idle), \
+							POSTGRES_KEEPALIVES_IDLE)
+
+#define OPTION_TIMEOUT_TCP_USER_TIMEOUT(config) \
+	make_int_option_default("timeout", "tcp_user_timeout", \
+							NULL, false, \
+							&(config->tcp_user_timeout), \
+							POSTGRES_TCP_USER_TIMEOUT)
+
 #define OPTION_CITUS_ROLE(config) \
 	make_strbuf_option_default("citus", "role", NULL, false, NAMEDATALEN, \
 							   config->citusRoleStr, DEFAULT_CITUS_ROLE)
@@ -196,12 +394,25 @@
 	{ \
 		OPTION_AUTOCTL_ROLE(config), \
 		OPTION_AUTOCTL_MONITOR(config), \
+		OPTION_AUTOCTL_MONITOR_REPLICA(config), \
+		OPTION_AUTOCTL_MONITOR_POOLER(config), \
 		OPTION_AUTOCTL_FORMATION(config), \
 		OPTION_AUTOCTL_GROUPID(config), \
 		OPTION_AUTOCTL_NAME(config), \
 		OPTION_AUTOCTL_HOSTNAME(config), \
 		OPTION_AUTOCTL_NODENAME(config), \
 		OPTION_AUTOCTL_NODEKIND(config), \
+		OPTION_AUTOCTL_METRICS_PORT(config), \
+		OPTION_AUTOCTL_MONITOR_PROXY(config), \
+		OPTION_AUTOCTL_NODE_PROBE(config), \
+		OPTION_AUTOCTL_WATCH_CONFIG(config), \
+		OPTION_AUTOCTL_MONITOR_WAIT(config), \
+		OPTION_AUTOCTL_ROUTER_PORT(config), \
+		OPTION_AUTOCTL_PRIMARY_CHANGE_HOOKS(config), \
+		OPTION_AUTOCTL_READ_ONLY_FENCING(config), \
+		OPTION_AUTOCTL_LATENCY_ANCHORS(config), \
+		OPTION_AUTOCTL_SERVICE_NICE(config), \
+		OPTION_AUTOCTL_SERVICE_CPU_AFFINITY(config), \
 		OPTION_POSTGRESQL_PGDATA(config), \
 		OPTION_POSTGRESQL_PG_CTL(config), \
 		OPTION_POSTGRESQL_USERNAME(config), \
@@ -212,6 +423,7 @@
 		OPTION_POSTGRESQL_LISTEN_ADDRESSES(config), \
 		OPTION_POSTGRESQL_AUTH_METHOD(config), \
 		OPTION_POSTGRESQL_HBA_LEVEL(config), \
+		OPTION_POSTGRESQL_HBA_COMPACT(config), \
 		OPTION_SSL_ACTIVE(config), \
 		OPTION_SSL_MODE(config), \
 		OPTION_SSL_CA_FILE(config), \
@@ -219,14 +431,37 @@
 		OPTION_SSL_SERVER_CERT(config), \
 		OPTION_SSL_SERVER_KEY(config), \
 		OPTION_REPLICATION_MAXIMUM_BACKUP_RATE(config), \
+		OPTION_REPLICATION_BACKUP_COMPRESSION(config), \
 		OPTION_REPLICATION_BACKUP_DIR(config), \
+		OPTION_REPLICATION_BACKUP_RESTORE_COMMAND(config), \
+		OPTION_REPLICATION_DELTA_RESYNC_COMMAND(config), \
+		OPTION_REPLICATION_REWIND_THRESHOLD(config), \
+		OPTION_REPLICATION_SLOT_ADVANCE_THRESHOLD(config), \
+		OPTION_REPLICATION_WAL_FETCH_WORKERS(config), \
+		OPTION_REPLICATION_MAINTENANCE_DRAIN_LAG(config), \
+		OPTION_REPLICATION_REBUILD_NICE(config), \
+		OPTION_REPLICATION_REBUILD_IO_CLASS(config), \
+		OPTION_REPLICATION_REBUILD_CGROUP(config), \
 		OPTION_REPLICATION_PASSWORD(config), \
 		OPTION_TIMEOUT_NETWORK_PARTITION(config), \
+		OPTION_TIMEOUT_NETWORK_PARTITION_PROBE(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_CATCHUP(config), \
 		OPTION_TIMEOUT_PREPARE_PROMOTION_WALRECEIVER(config), \
+		OPTION_TIMEOUT_PREWARM_BUDGET(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_TIMEOUT(config), \
 		OPTION_TIMEOUT_POSTGRESQL_RESTART_FAILURE_MAX_RETRIES(config), \
+		OPTION_TIMEOUT_CRASH_RECOVERY(config), \
 		OPTION_TIMEOUT_LISTEN_NOTIFICATIONS(config), \
+		OPTION_TIMEOUT_MIN_REPORT_INTERVAL(config), \
+		OPTION_TIMEOUT_MAX_REPORT_INTERVAL(config), \
+		OPTION_TIMEOUT_SYNC_REP_STALL(config), \
+		OPTION_TIMEOUT_PRIMARY_CHANGE_HOOKS(config), \
+		OPTION_TIMEOUT_MAINTENANCE_DRAIN(config), \
+		OPTION_TIMEOUT_LOCAL_QUERY(config), \
+		OPTION_TIMEOUT_STORAGE_PROBE_INTERVAL(config), \
+		OPTION_TIMEOUT_KEEPALIVES(config), \
+		OPTION_TIMEOUT_KEEPALIVES_IDLE(config), \
+		OPTION_TIMEOUT_TCP_USER_TIMEOUT(config), \
  \
 		OPTION_CITUS_ROLE(config), \
 		OPTION_CITUS_CLUSTER_NAME(config), \
@@ -623,6 +858,67 @@ keeper_config_get_setting(KeeperConfig *config,
 }
 
 
+/*
+ * keeper_config_read_file_cached reads the configuration file as
+ * keeper_config_get_setting does, without validating the settings or probing
+ * the Postgres setup, and uses a snapshot of a previous parsing when the
+ * configuration file has not changed since then. The snapshot is only valid
+ * for callers that don't set anything else than the pathnames in config, such
+ * as pg_autoctl config get.
+ */
+bool
+keeper_config_read_file_cached(KeeperConfig *config)
+{
+	const char *filename = config->pathnames.config;
+	ConfigSnapshotHeader header = { 0 };
+
+	bool hasHeader =
+		config_snapshot_header(filename, &header, sizeof(KeeperConfig));
+
+	if (hasHeader &&
+		config_snapshot_read(filename, config, sizeof(KeeperConfig)))
+	{
+		return true;
+	}
+
+	IniOption keeperOptions[] = SET_INI_OPTIONS_ARRAY(config);
+
+	log_debug("Reading configuration from \"%s\"", filename);
+
+	if (!read_ini_file(filename, keeperOptions))
+	{
+		log_error("Failed to parse configuration file \"%s\"", filename);
+		return false;
+	}
+
+	if (hasHeader)
+	{
+		/* failing to write the snapshot is not an error */
+		(void) config_snapshot_write(filename, &header,
+									 config, sizeof(KeeperConfig));
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_config_lookup_setting prints the current value of the setting
+ * identified by "path" (section.option) in the given config into value,
+ * without reading the configuration file.
+ */
+bool
+keeper_config_lookup_setting(KeeperConfig *config,
+							 const char *path,
+							 char *value, size_t size)
+{
+	IniOption keeperOptions[] = SET_INI_OPTIONS_ARRAY(config);
+	IniOption *option = lookup_ini_path_value(keeperOptions, path);
+
+	return option != NULL && ini_option_to_string(option, value, size);
+}
+
+
 /*
  * keeper_config_set_setting sets the setting identified by "path"
  * (section.option) to the given value. The value is passed in as a string,
@@ -41,20 +41,44 @@ typedef struct KeeperConfig
 	/* pg_autoctl setup */
 	char role[NAMEDATALEN];
 	char monitor_pguri[MAXCONNINFO];
+	char monitor_replica_pguri[MAXCONNINFO];
+	char monitor_pooler_pguri[MAXCONNINFO];
 	char formation[NAMEDATALEN];
 	int groupId;
 	char name[_POSIX_HOST_NAME_MAX];
 	char hostname[_POSIX_HOST_NAME_MAX];
 	char nodeKind[NAMEDATALEN];
+	int metrics_port;
+	int monitor_proxy;
+	int node_probe;
+	int watch_config;
+	int monitor_wait;
+	int router_port;
+	char primary_change_hooks[MAXPGPATH];
+	int read_only_fencing;
+	char latency_anchors[MAXCONNINFO];
+	int service_nice;
+	char service_cpu_affinity[BUFSIZE];
 
 	/* PostgreSQL setup */
 	PostgresSetup pgSetup;
+	int hba_compact;
 
 	/* PostgreSQL replication / tooling setup */
 	char replication_slot_name[MAXCONNINFO];
 	char replication_password[MAXCONNINFO];
 	char maximum_backup_rate[MAXIMUM_BACKUP_RATE_LEN];
+	char backup_compression[BACKUP_COMPRESSION_LEN];
 	char backupDirectory[MAXPGPATH];
+	char backup_restore_command[MAXPGPATH];
+	char delta_resync_command[MAXPGPATH];
+	int rewind_threshold;
+	int slot_advance_threshold;
+	int wal_fetch_workers;
+	int maintenance_drain_lag;
+	int rebuild_nice;
+	char rebuild_io_class[REBUILD_IO_CLASS_LEN];
+	char rebuild_cgroup[MAXPGPATH];
 
 	/* Citus specific options and settings */
 	char citusRoleStr[NAMEDATALEN];
@@ -62,11 +86,24 @@ typedef struct KeeperConfig
 
 	/* pg_autoctl timeouts */
 	int network_partition_timeout;
+	int network_partition_probe_timeout;
 	int prepare_promotion_catchup;
 	int prepare_promotion_walreceiver;
+	int prewarm_budget;
 	int postgresql_restart_failure_timeout;
 	int postgresql_restart_failure_max_retries;
+	int crash_recovery_timeout;
 	int listen_notifications_timeout;
+	int min_report_interval;
+	int max_report_interval;
+	int sync_rep_stall_timeout;
+	int primary_change_hooks_timeout;
+	int maintenance_drain_timeout;
+	int local_query_timeout;
+	int storage_probe_interval;
+	int keepalives;
+	int keepalives_idle;
+	int tcp_user_timeout;
 } KeeperConfig;
 
 #define PG_AUTOCTL_MONITOR_IS_DISABLED(config) \
@@ -96,6 +133,11 @@ bool keeper_config_get_setting(KeeperConfig *config,
 							   const char *path,
 							   char *value, size_t size);
 
+bool keeper_config_read_file_cached(KeeperConfig *config);
+bool keeper_config_lookup_setting(KeeperConfig *config,
+								  const char *path,
+								  char *value, size_t size);
+
 bool keeper_config_set_setting(KeeperConfig *config,
 							   const char *path,
 							   char *value);
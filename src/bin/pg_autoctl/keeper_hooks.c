@@ -0,0 +1,392 @@
+/*
+ * src/bin/pg_autoctl/keeper_hooks.c
+ *     Run user provided hooks when the primary node of the group changes.
+ *
+ * The pg_autoctl.primary_change_hooks setting names a directory of
+ * executable files, such as scripts that issue RECONNECT to PgBouncer, or
+ * that update a backend with the HAProxy runtime API. When the keeper sees a
+ * new primary node in its group, it runs every hook in that directory, all at
+ * once, with the primary node in the environment:
+ *
+ *   PG_AUTOCTL_FORMATION, PG_AUTOCTL_GROUP_ID,
+ *   PG_AUTOCTL_PRIMARY_NODE_ID, PG_AUTOCTL_PRIMARY_NAME,
+ *   PG_AUTOCTL_PRIMARY_HOST, PG_AUTOCTL_PRIMARY_PORT
+ *
+ * The hooks run in a detached process, so that the keeper main loop goes on
+ * with its own work right away. That process waits for the hooks for up to
+ * timeout.primary_change_hooks_timeout milliseconds, kills the hooks that are
+ * still running then, and logs how long each hook took.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper_hooks.h"
+#include "log.h"
+#include "metrics.h"
+#include "monitor.h"
+#include "string_utils.h"
+
+
+/* how often the hooks runner checks on the hooks, in microseconds */
+#define HOOKS_POLL_INTERVAL 1000
+
+typedef struct KeeperHook
+{
+	char name[NAMEDATALEN];
+	char path[MAXPGPATH];
+	pid_t pid;
+	instr_time startTime;
+	bool done;
+} KeeperHook;
+
+
+static int keeper_hooks_list(const char *directory, KeeperHook *hooks);
+static int keeper_hooks_compare(const void *a, const void *b);
+static void keeper_hooks_runner(KeeperHook *hooks, int hookCount, int timeoutMs);
+static void keeper_hooks_reap(KeeperHook *hook, int status);
+
+
+/*
+ * keeper_hooks_run runs the hooks found in the given directory for the given
+ * primary node, and returns without waiting for them to finish.
+ */
+bool
+keeper_hooks_run(KeeperHooks *hooks,
+				 const char *directory,
+				 int timeoutMs,
+				 const char *formation,
+				 int groupId,
+				 NodeAddress *primary)
+{
+	KeeperHook hookArray[PG_AUTOCTL_MAX_HOOKS] = { 0 };
+
+	/* we don't retry when the hooks fail, they run once per primary */
+	hooks->primaryKnown = true;
+	hooks->primary = *primary;
+
+	if (IS_EMPTY_STRING_BUFFER(directory))
+	{
+		return true;
+	}
+
+	int hookCount = keeper_hooks_list(directory, hookArray);
+
+	if (hookCount <= 0)
+	{
+		/* errors have already been logged */
+		return hookCount == 0;
+	}
+
+	log_info("Running %d primary change hook%s from \"%s\" for node "
+			 NODE_FORMAT,
+			 hookCount, hookCount == 1 ? "" : "s",
+			 directory,
+			 primary->nodeId, primary->name, primary->host, primary->port);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the primary change hooks process: %m");
+			return false;
+		}
+
+		case 0:
+		{
+			/*
+			 * Fork again and exit, so that the hooks runner is not a child
+			 * of the keeper, which then doesn't have to wait for it.
+			 */
+			pid_t runner = fork();
+
+			if (runner == 0)
+			{
+				setenv("PG_AUTOCTL_FORMATION", formation, 1);
+				setenv("PG_AUTOCTL_GROUP_ID", intToString(groupId).strValue, 1);
+				setenv("PG_AUTOCTL_PRIMARY_NODE_ID",
+					   intToString(primary->nodeId).strValue, 1);
+				setenv("PG_AUTOCTL_PRIMARY_NAME", primary->name, 1);
+				setenv("PG_AUTOCTL_PRIMARY_HOST", primary->host, 1);
+				setenv("PG_AUTOCTL_PRIMARY_PORT",
+					   intToString(primary->port).strValue, 1);
+
+				(void) keeper_hooks_runner(hookArray, hookCount, timeoutMs);
+			}
+			else if (runner < 0)
+			{
+				log_error("Failed to fork the primary change hooks runner: %m");
+			}
+
+			/* skip the atexit() handlers of the keeper process */
+			_exit(runner < 0 ? EXIT_CODE_INTERNAL_ERROR : EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			int status = 0;
+			pid_t pid = 0;
+
+			do {
+				pid = waitpid(fpid, &status, 0);
+			} while (pid == -1 && errno == EINTR);
+
+			return pid == fpid &&
+				   WIFEXITED(status) &&
+				   WEXITSTATUS(status) == EXIT_CODE_QUIT;
+		}
+	}
+}
+
+
+/*
+ * keeper_hooks_list fills in the given array with the executable files found
+ * in the given directory, sorted by name, and returns how many it found, or
+ * -1 on error.
+ */
+static int
+keeper_hooks_list(const char *directory, KeeperHook *hooks)
+{
+	int hookCount = 0;
+	struct dirent *entry = NULL;
+
+	DIR *dir = opendir(directory);
+
+	if (dir == NULL)
+	{
+		log_error("Failed to open the primary change hooks directory \"%s\": %m",
+				  directory);
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		struct stat st;
+		char path[MAXPGPATH] = { 0 };
+
+		/* skip hidden files, and editors backup files */
+		if (entry->d_name[0] == '.' ||
+			entry->d_name[strlen(entry->d_name) - 1] == '~')
+		{
+			continue;
+		}
+
+		sformat(path, sizeof(path), "%s/%s", directory, entry->d_name);
+
+		if (stat(path, &st) != 0 ||
+			!S_ISREG(st.st_mode) ||
+			access(path, X_OK) != 0)
+		{
+			log_debug("Skipping \"%s\", which is not an executable file", path);
+			continue;
+		}
+
+		if (hookCount == PG_AUTOCTL_MAX_HOOKS)
+		{
+			log_warn("Skipping primary change hook \"%s\": only %d hooks "
+					 "are supported",
+					 path, PG_AUTOCTL_MAX_HOOKS);
+			continue;
+		}
+
+		strlcpy(hooks[hookCount].name, entry->d_name, NAMEDATALEN);
+		strlcpy(hooks[hookCount].path, path, MAXPGPATH);
+
+		++hookCount;
+	}
+
+	closedir(dir);
+
+	qsort(hooks, hookCount, sizeof(KeeperHook), keeper_hooks_compare);
+
+	return hookCount;
+}
+
+
+/*
+ * keeper_hooks_compare sorts hooks by name.
+ */
+static int
+keeper_hooks_compare(const void *a, const void *b)
+{
+	return strcmp(((KeeperHook *) a)->name, ((KeeperHook *) b)->name);
+}
+
+
+/*
+ * keeper_hooks_runner starts all the hooks, then waits for them until the
+ * time budget is exhausted, and kills the hooks that are still running then.
+ */
+static void
+keeper_hooks_runner(KeeperHook *hooks, int hookCount, int timeoutMs)
+{
+	int running = 0;
+	instr_time startTime;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int i = 0; i < hookCount; i++)
+	{
+		KeeperHook *hook = &(hooks[i]);
+
+		INSTR_TIME_SET_CURRENT(hook->startTime);
+
+		pid_t fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork primary change hook \"%s\": %m",
+						  hook->name);
+				hook->done = true;
+				(void) metrics_record_hook(hook->name, false, 0);
+				break;
+			}
+
+			case 0:
+			{
+				/* hooks don't get to read from our stdin */
+				int devnull = open("/dev/null", O_RDONLY);
+
+				if (devnull >= 0)
+				{
+					(void) dup2(devnull, STDIN_FILENO);
+					close(devnull);
+				}
+
+				execl(hook->path, hook->path, (char *) NULL);
+
+				log_error("Failed to run primary change hook \"%s\": %m",
+						  hook->path);
+				_exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			default:
+			{
+				hook->pid = fpid;
+				++running;
+				break;
+			}
+		}
+	}
+
+	while (running > 0)
+	{
+		int status = 0;
+		instr_time elapsed;
+
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+
+		if (pid > 0)
+		{
+			for (int i = 0; i < hookCount; i++)
+			{
+				if (hooks[i].pid == pid && !hooks[i].done)
+				{
+					(void) keeper_hooks_reap(&(hooks[i]), status);
+					--running;
+					break;
+				}
+			}
+			continue;
+		}
+
+		if (pid < 0 && errno != EINTR)
+		{
+			log_error("Failed to wait for the primary change hooks: %m");
+			break;
+		}
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) < timeoutMs)
+		{
+			pg_usleep(HOOKS_POLL_INTERVAL);
+			continue;
+		}
+
+		for (int i = 0; i < hookCount; i++)
+		{
+			KeeperHook *hook = &(hooks[i]);
+
+			if (hook->done)
+			{
+				continue;
+			}
+
+			log_warn("Primary change hook \"%s\" is still running after %dms, "
+					 "killing it",
+					 hook->name, timeoutMs);
+
+			(void) kill(hook->pid, SIGKILL);
+		}
+
+		/* the killed hooks are reaped just like the others */
+		timeoutMs = INT_MAX;
+	}
+}
+
+
+/*
+ * keeper_hooks_reap logs how the given hook exited, and how long it took.
+ */
+static void
+keeper_hooks_reap(KeeperHook *hook, int status)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, hook->startTime);
+
+	double ms = INSTR_TIME_GET_MILLISEC(duration);
+	bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	hook->done = true;
+
+	if (success)
+	{
+		log_info("Primary change hook \"%s\" succeeded in %.0fms",
+				 hook->name, ms);
+	}
+	else if (WIFEXITED(status))
+	{
+		log_warn("Primary change hook \"%s\" failed with exit code %d in %.0fms",
+				 hook->name, WEXITSTATUS(status), ms);
+	}
+	else
+	{
+		log_warn("Primary change hook \"%s\" was terminated by signal %d "
+				 "after %.0fms",
+				 hook->name, WTERMSIG(status), ms);
+	}
+
+	(void) metrics_record_hook(hook->name, success, ms / 1000.0);
+}
@@ -0,0 +1,36 @@
+/*
+ * src/bin/pg_autoctl/keeper_hooks.h
+ *     Run user provided hooks when the primary node of the group changes.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef KEEPER_HOOKS_H
+#define KEEPER_HOOKS_H
+
+#include <stdbool.h>
+
+#include "pgsql.h"
+
+
+/*
+ * KeeperHooks keeps the primary node for which we last ran the hooks, so
+ * that we only run them again when the primary changes.
+ */
+typedef struct KeeperHooks
+{
+	bool primaryKnown;
+	NodeAddress primary;
+} KeeperHooks;
+
+
+bool keeper_hooks_run(KeeperHooks *hooks,
+					  const char *directory,
+					  int timeoutMs,
+					  const char *formation,
+					  int groupId,
+					  NodeAddress *primary);
+
+#endif /* KEEPER_HOOKS_H */
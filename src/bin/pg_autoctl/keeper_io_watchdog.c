@@ -0,0 +1,449 @@
+/*
+ * src/bin/pg_autoctl/keeper_io_watchdog.c
+ *     Watch the storage of PGDATA and pg_wal.
+ *
+ * A primary node whose storage is stalled still accepts connections and
+ * answers read-only queries from its cache, while its commits hang. Every
+ * timeout.storage_probe_interval milliseconds, the keeper writes and fsyncs
+ * a small file in PGDATA and then in pg_wal, and keeps the latency of the
+ * last probes, which it reports to the monitor.
+ *
+ * A probe that hits stalled storage would block in fsync() for as long as
+ * the stall lasts, so it runs in a child process, that sends its result in a
+ * pipe. The keeper main loop only checks whether the result is in, and while
+ * it is not, how long the probe has been waiting is the current stall.
+ *
+ * Running out of space in pg_wal makes Postgres PANIC. The keeper also
+ * tracks the free space of the pg_wal file system and how fast it goes down,
+ * to predict when it is going to be full. WAL segments are recycled at each
+ * checkpoint, so the WAL generation rate alone would predict a full disk on
+ * any busy primary: the prediction uses the free space consumption rate
+ * instead, which only goes up when WAL is retained, such as when archiving
+ * fails or a replication slot is behind.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper_io_watchdog.h"
+#include "log.h"
+#include "parsing.h"
+
+
+/* the probe file, in PGDATA and in pg_wal, removed after each probe */
+#define IO_PROBE_FILENAME "pg_autoctl.io_probe"
+#define IO_PROBE_SIZE 4096
+
+/* weight of the last sample in the WAL space rates moving averages */
+#define WAL_SPACE_RATE_WEIGHT 0.3
+
+typedef struct IOProbeResult
+{
+	int64_t pgdataUs;
+	int64_t walUs;
+} IOProbeResult;
+
+
+static bool keeper_io_watchdog_start(KeeperIOWatchdog *watchdog,
+									 const char *pgdata);
+static void keeper_io_watchdog_collect(KeeperIOWatchdog *watchdog);
+static void keeper_io_probe_run(const char *pgdata, int fd);
+static int64_t keeper_io_probe_file(const char *directory);
+static int compare_int64(const void *a, const void *b);
+
+
+/*
+ * keeper_io_watchdog_poll is called at each round of the keeper main loop.
+ * It collects the result of the probe in progress when it is in, and starts
+ * a new probe every intervalMs milliseconds. It never waits for a probe.
+ */
+void
+keeper_io_watchdog_poll(KeeperIOWatchdog *watchdog,
+						const char *pgdata,
+						int intervalMs)
+{
+	if (watchdog->inProgress)
+	{
+		(void) keeper_io_watchdog_collect(watchdog);
+		return;
+	}
+
+	if (intervalMs <= 0)
+	{
+		return;
+	}
+
+	if (watchdog->started)
+	{
+		instr_time elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, watchdog->startTime);
+
+		if (INSTR_TIME_GET_MILLISEC(elapsed) < intervalMs)
+		{
+			return;
+		}
+	}
+
+	(void) keeper_io_watchdog_start(watchdog, pgdata);
+}
+
+
+/*
+ * keeper_io_watchdog_start forks the child process that runs a probe.
+ */
+static bool
+keeper_io_watchdog_start(KeeperIOWatchdog *watchdog, const char *pgdata)
+{
+	int pipeFds[2] = { 0 };
+
+	if (pipe(pipeFds) != 0)
+	{
+		log_error("Failed to create the storage probe pipe: %m");
+		return false;
+	}
+
+	/* don't leak the pipe to the other processes that we start */
+	(void) fcntl(pipeFds[0], F_SETFD, FD_CLOEXEC);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the storage probe process: %m");
+			close(pipeFds[0]);
+			close(pipeFds[1]);
+			return false;
+		}
+
+		case 0:
+		{
+			close(pipeFds[0]);
+
+			(void) keeper_io_probe_run(pgdata, pipeFds[1]);
+
+			/* skip the atexit() handlers of the keeper process */
+			_exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			close(pipeFds[1]);
+
+			watchdog->inProgress = true;
+			watchdog->started = true;
+			watchdog->pid = fpid;
+			watchdog->fd = pipeFds[0];
+			INSTR_TIME_SET_CURRENT(watchdog->startTime);
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * keeper_io_watchdog_collect checks whether the result of the probe in
+ * progress is in, without waiting, and then records its latency.
+ */
+static void
+keeper_io_watchdog_collect(KeeperIOWatchdog *watchdog)
+{
+	IOProbeResult result = { -1, -1 };
+	struct pollfd pollFd = { watchdog->fd, POLLIN, 0 };
+
+	if (poll(&pollFd, 1, 0) <= 0)
+	{
+		IOWatchdogStats stats = { 0 };
+
+		(void) keeper_io_watchdog_stats(watchdog, &stats);
+
+		if (!watchdog->warned &&
+			stats.stallMs >= PG_AUTOCTL_IO_WATCHDOG_STALL_WARNING_MS)
+		{
+			log_warn("Slow storage: the storage probe of PGDATA and pg_wal "
+					 "has been waiting for %d ms", stats.stallMs);
+			watchdog->warned = true;
+		}
+		return;
+	}
+
+	ssize_t bytes = read(watchdog->fd, &result, sizeof(result));
+	int status = 0;
+	pid_t pid = 0;
+
+	close(watchdog->fd);
+
+	/* the child process exits right after sending its result */
+	do {
+		pid = waitpid(watchdog->pid, &status, 0);
+	} while (pid == -1 && errno == EINTR);
+
+	watchdog->inProgress = false;
+
+	if (bytes != sizeof(result) || result.pgdataUs < 0 || result.walUs < 0)
+	{
+		log_warn("Storage probe of PGDATA and pg_wal failed, "
+				 "see above for details");
+		return;
+	}
+
+	int64_t latencyUs = Max(result.pgdataUs, result.walUs);
+
+	watchdog->samplesUs[watchdog->nextSample] = latencyUs;
+	watchdog->nextSample =
+		(watchdog->nextSample + 1) % PG_AUTOCTL_IO_WATCHDOG_WINDOW;
+
+	if (watchdog->sampleCount < PG_AUTOCTL_IO_WATCHDOG_WINDOW)
+	{
+		watchdog->sampleCount++;
+	}
+
+	watchdog->lastPgdataUs = result.pgdataUs;
+	watchdog->lastWalUs = result.walUs;
+	watchdog->newSample = true;
+
+	if (watchdog->warned)
+	{
+		log_info("Storage probe of PGDATA and pg_wal is done, "
+				 "it took %" PRId64 " ms",
+				 latencyUs / 1000);
+		watchdog->warned = false;
+	}
+	else
+	{
+		log_trace("Storage probe took %" PRId64 " us in PGDATA "
+				  "and %" PRId64 " us in pg_wal",
+				  result.pgdataUs, result.walUs);
+	}
+}
+
+
+/*
+ * keeper_io_watchdog_stats computes the latency percentiles of the last
+ * probes, and how long the probe in progress has been waiting, if any.
+ */
+void
+keeper_io_watchdog_stats(KeeperIOWatchdog *watchdog, IOWatchdogStats *stats)
+{
+	int64_t sortedUs[PG_AUTOCTL_IO_WATCHDOG_WINDOW] = { 0 };
+	int count = watchdog->sampleCount;
+
+	memset(stats, 0, sizeof(IOWatchdogStats));
+
+	stats->sampleCount = count;
+
+	if (count > 0)
+	{
+		memcpy(sortedUs, watchdog->samplesUs, count * sizeof(int64_t));
+		qsort(sortedUs, count, sizeof(int64_t), compare_int64);
+
+		stats->p50Us = sortedUs[(count - 1) * 50 / 100];
+		stats->p99Us = sortedUs[(count - 1) * 99 / 100];
+		stats->maxUs = sortedUs[count - 1];
+	}
+
+	if (watchdog->inProgress)
+	{
+		instr_time elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, watchdog->startTime);
+
+		stats->stallMs = (int) INSTR_TIME_GET_MILLISEC(elapsed);
+	}
+}
+
+
+/*
+ * keeper_io_probe_run runs in the child process: it probes PGDATA and then
+ * pg_wal, and writes the result to the given file descriptor.
+ */
+static void
+keeper_io_probe_run(const char *pgdata, int fd)
+{
+	IOProbeResult result = { 0 };
+	char walDirectory[MAXPGPATH] = { 0 };
+
+	sformat(walDirectory, sizeof(walDirectory), "%s/pg_wal", pgdata);
+
+	result.pgdataUs = keeper_io_probe_file(pgdata);
+	result.walUs = keeper_io_probe_file(walDirectory);
+
+	if (write(fd, &result, sizeof(result)) != sizeof(result))
+	{
+		log_error("Failed to send the storage probe result: %m");
+	}
+
+	close(fd);
+}
+
+
+/*
+ * keeper_io_probe_file writes and fsyncs a small file in the given directory,
+ * then removes it, and returns how long the write and fsync took in
+ * microseconds, or -1 on error.
+ */
+static int64_t
+keeper_io_probe_file(const char *directory)
+{
+	char filename[MAXPGPATH] = { 0 };
+	char buffer[IO_PROBE_SIZE] = { 0 };
+	instr_time startTime;
+	instr_time duration;
+
+	sformat(filename, sizeof(filename), "%s/%s", directory, IO_PROBE_FILENAME);
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+	if (fd < 0)
+	{
+		log_error("Failed to create storage probe file \"%s\": %m", filename);
+		return -1;
+	}
+
+	if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer) || fsync(fd) != 0)
+	{
+		log_error("Failed to write storage probe file \"%s\": %m", filename);
+		close(fd);
+		unlink(filename);
+		return -1;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	close(fd);
+	unlink(filename);
+
+	return (int64_t) INSTR_TIME_GET_MICROSEC(duration);
+}
+
+
+/*
+ * keeper_wal_space_update samples the free space of the pg_wal file system
+ * and the current LSN every PG_AUTOCTL_WAL_SPACE_SAMPLE_TIME seconds, and
+ * updates the moving averages of the WAL generation rate and of the free
+ * space consumption rate, and the time until pg_wal is full.
+ */
+void
+keeper_wal_space_update(KeeperWalSpace *walSpace,
+						const char *pgdata,
+						const char *currentLSN)
+{
+	char walDirectory[MAXPGPATH] = { 0 };
+	struct statvfs fs = { 0 };
+	uint64_t lsn = 0;
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	if (walSpace->started)
+	{
+		instr_time elapsed = now;
+
+		INSTR_TIME_SUBTRACT(elapsed, walSpace->sampleTime);
+
+		if (INSTR_TIME_GET_DOUBLE(elapsed) < PG_AUTOCTL_WAL_SPACE_SAMPLE_TIME)
+		{
+			return;
+		}
+	}
+
+	if (!parseLSN(currentLSN, &lsn) || lsn == 0)
+	{
+		return;
+	}
+
+	sformat(walDirectory, sizeof(walDirectory), "%s/pg_wal", pgdata);
+
+	if (statvfs(walDirectory, &fs) != 0)
+	{
+		log_warn("Failed to get the free space of \"%s\": %m", walDirectory);
+		return;
+	}
+
+	int64_t freeBytes = (int64_t) fs.f_bavail * (int64_t) fs.f_frsize;
+
+	/* a new timeline may start at a lower LSN, start over */
+	if (walSpace->started && lsn >= walSpace->sampleLSN)
+	{
+		instr_time elapsed = now;
+
+		INSTR_TIME_SUBTRACT(elapsed, walSpace->sampleTime);
+
+		double seconds = INSTR_TIME_GET_DOUBLE(elapsed);
+		double walRate = (lsn - walSpace->sampleLSN) / seconds;
+		double consumptionRate =
+			Max(0, walSpace->sampleFreeBytes - freeBytes) / seconds;
+
+		walSpace->walRate =
+			WAL_SPACE_RATE_WEIGHT * walRate +
+			(1 - WAL_SPACE_RATE_WEIGHT) * walSpace->walRate;
+
+		walSpace->consumptionRate =
+			WAL_SPACE_RATE_WEIGHT * consumptionRate +
+			(1 - WAL_SPACE_RATE_WEIGHT) * walSpace->consumptionRate;
+
+		walSpace->freeBytes = freeBytes;
+		walSpace->timeToFull =
+			walSpace->consumptionRate >= 1
+			? (int) Min(freeBytes / walSpace->consumptionRate, INT_MAX)
+			: -1;
+		walSpace->newSample = true;
+
+		log_trace("pg_wal has %" PRId64 " bytes free, WAL rate is %.0f B/s, "
+				  "free space consumption is %.0f B/s",
+				  freeBytes, walSpace->walRate, walSpace->consumptionRate);
+	}
+	else
+	{
+		walSpace->walRate = 0;
+		walSpace->consumptionRate = 0;
+		walSpace->timeToFull = -1;
+	}
+
+	walSpace->started = true;
+	walSpace->sampleTime = now;
+	walSpace->sampleLSN = lsn;
+	walSpace->sampleFreeBytes = freeBytes;
+}
+
+
+/*
+ * compare_int64 is a qsort comparison function for int64_t values.
+ */
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *((const int64_t *) a);
+	int64_t y = *((const int64_t *) b);
+
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,84 @@
+/*
+ * src/bin/pg_autoctl/keeper_io_watchdog.h
+ *     Watch the storage of PGDATA and pg_wal.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef KEEPER_IO_WATCHDOG_H
+#define KEEPER_IO_WATCHDOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "portability/instr_time.h"
+
+#include "defaults.h"
+
+
+/*
+ * KeeperIOWatchdog keeps the probe in progress, if any, and the latency of
+ * the last probes, where a probe writes and fsyncs a small file in PGDATA
+ * and then in pg_wal.
+ */
+typedef struct KeeperIOWatchdog
+{
+	/* the probe runs in a child process, that writes its result to fd */
+	bool inProgress;
+	pid_t pid;
+	int fd;
+	instr_time startTime;
+	bool started;
+	bool warned;
+
+	/* latency of the last probes, in microseconds */
+	int sampleCount;
+	int nextSample;
+	int64_t samplesUs[PG_AUTOCTL_IO_WATCHDOG_WINDOW];
+	int64_t lastPgdataUs;
+	int64_t lastWalUs;
+	bool newSample;
+} KeeperIOWatchdog;
+
+/* what we report to the monitor */
+typedef struct IOWatchdogStats
+{
+	int sampleCount;
+	int64_t p50Us;
+	int64_t p99Us;
+	int64_t maxUs;
+	int stallMs;
+} IOWatchdogStats;
+
+/*
+ * KeeperWalSpace tracks the free space of the pg_wal file system, and how
+ * fast it is being used.
+ */
+typedef struct KeeperWalSpace
+{
+	bool started;
+	instr_time sampleTime;
+	uint64_t sampleLSN;
+	int64_t sampleFreeBytes;
+
+	int64_t freeBytes;
+	double walRate;             /* bytes per second of WAL generated */
+	double consumptionRate;     /* bytes per second of free space used */
+	int timeToFull;             /* seconds, -1 when not running out */
+	bool newSample;
+} KeeperWalSpace;
+
+
+void keeper_io_watchdog_poll(KeeperIOWatchdog *watchdog,
+							 const char *pgdata,
+							 int intervalMs);
+void keeper_io_watchdog_stats(KeeperIOWatchdog *watchdog,
+							  IOWatchdogStats *stats);
+void keeper_wal_space_update(KeeperWalSpace *walSpace,
+							 const char *pgdata,
+							 const char *currentLSN);
+
+#endif /* KEEPER_IO_WATCHDOG_H */
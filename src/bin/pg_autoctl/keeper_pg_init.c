@@ -578,7 +578,26 @@ reach_initial_state(Keeper *keeper)
 		return false;
 	}
 
-	/* everything went fine, get rid of the init state file */
+	/*
+	 * Everything went fine, get rid of the init state file, once we have
+	 * logged the durations of the init steps that it contains.
+	 */
+	KeeperStateInit initState = { 0 };
+
+	if (keeper_init_state_read(&initState, config->pathnames.init) &&
+		initState.stepDurationMs[INIT_STEP_INITDB] > 0)
+	{
+		log_info("Initialized the primary node in %" PRIu64 " ms: "
+				 "initdb %" PRIu64 " ms, database and extensions %" PRIu64 " ms, "
+				 "primary setup %" PRIu64 " ms",
+				 initState.stepDurationMs[INIT_STEP_INITDB] +
+				 initState.stepDurationMs[INIT_STEP_DATABASE] +
+				 initState.stepDurationMs[INIT_STEP_PRIMARY],
+				 initState.stepDurationMs[INIT_STEP_INITDB],
+				 initState.stepDurationMs[INIT_STEP_DATABASE],
+				 initState.stepDurationMs[INIT_STEP_PRIMARY]);
+	}
+
 	return unlink_file(config->pathnames.init);
 }
 
@@ -653,6 +672,7 @@ wait_until_primary_is_ready(Keeper *keeper,
 												 keeperState->current_group,
 												 keeperState->current_node_id,
 												 timeoutMs,
+												 -1,
 												 &groupStateHasChanged);
 
 			/* when no state change has been notified, close the connection */
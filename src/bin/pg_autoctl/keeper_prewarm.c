@@ -0,0 +1,378 @@
+/*
+ * src/bin/pg_autoctl/keeper_prewarm.c
+ *     Warm up the buffer cache of a standby that is being promoted.
+ *
+ * After a failover the new primary serves its queries from a cold cache. To
+ * reduce that window, the keeper of a standby node regularly fetches the list
+ * of the relations that are the most used on the primary, and when the
+ * standby is being promoted the keeper replays that list with pg_prewarm on
+ * the local Postgres instance.
+ *
+ * The replay runs on its own connection, one relation at a time and without
+ * waiting for the queries to complete, so that it never delays the
+ * promotion. It stops when the timeout.prewarm_budget is exhausted.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper_prewarm.h"
+#include "log.h"
+#include "pgsetup.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+
+/*
+ * We rank the relations by how many blocks have been accessed on the
+ * primary, since its statistics were last reset.
+ */
+#define HOT_RELATIONS_SQL \
+	"SELECT format('%I.%I', schemaname, relname) " \
+	"  FROM (SELECT schemaname, relname, " \
+	"               heap_blks_hit + heap_blks_read AS blocks " \
+	"          FROM pg_statio_user_tables " \
+	"         UNION ALL " \
+	"        SELECT schemaname, indexrelname, " \
+	"               idx_blks_hit + idx_blks_read " \
+	"          FROM pg_statio_user_indexes) AS rels " \
+	" WHERE blocks > 0 " \
+	" ORDER BY blocks DESC " \
+	" LIMIT $1"
+
+#define PREWARM_RELATION_SQL \
+	"SELECT coalesce((SELECT pg_prewarm(c.oid) " \
+	"                   FROM pg_class c " \
+	"                  WHERE c.oid = to_regclass($1)), 0)"
+
+typedef struct HotRelationsParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	KeeperPrewarm *prewarm;
+	bool parsedOK;
+} HotRelationsParseContext;
+
+
+static void parseHotRelations(void *ctx, PGresult *result);
+static bool keeper_prewarm_send_next(KeeperPrewarm *prewarm);
+static void keeper_prewarm_done(KeeperPrewarm *prewarm);
+
+
+/*
+ * keeper_prewarm_refresh_relations connects to the primary node and fetches
+ * the list of its hot relations, that we keep in memory for when we get
+ * promoted.
+ */
+bool
+keeper_prewarm_refresh_relations(KeeperPrewarm *prewarm,
+								 PostgresSetup *pgSetup,
+								 NodeAddress *primaryNode)
+{
+	PostgresSetup upstreamSetup = { 0 };
+	PGSQL upstreamClient = { 0 };
+	char connectionString[MAXCONNINFO] = { 0 };
+
+	HotRelationsParseContext context = { { 0 }, prewarm, false };
+	IntString limitString = intToString(PG_AUTOCTL_PREWARM_MAX_RELATIONS);
+
+	const Oid paramTypes[1] = { INT4OID };
+	const char *paramValues[1] = { limitString.strValue };
+
+	/* we retry at the next refresh time, even when we fail now */
+	prewarm->refreshTime = time(NULL);
+
+	/* we don't change the list of relations while replaying it */
+	if (prewarm->inProgress)
+	{
+		return true;
+	}
+
+	/* prepare a PostgresSetup that allows preparing a connection string */
+	strlcpy(upstreamSetup.username, PG_AUTOCTL_REPLICA_USERNAME, NAMEDATALEN);
+	strlcpy(upstreamSetup.dbname, pgSetup->dbname, NAMEDATALEN);
+	strlcpy(upstreamSetup.pghost, primaryNode->host, _POSIX_HOST_NAME_MAX);
+	upstreamSetup.pgport = primaryNode->port;
+	upstreamSetup.ssl = pgSetup->ssl;
+
+	pg_setup_get_local_connection_string(&upstreamSetup, connectionString);
+
+	if (!pgsql_init(&upstreamClient, connectionString, PGSQL_CONN_UPSTREAM))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* this is a background task, don't retry connecting */
+	(void) pgsql_set_main_loop_retry_policy(&(upstreamClient.retryPolicy));
+
+	if (!pgsql_execute_with_params(&upstreamClient, HOT_RELATIONS_SQL,
+								   1, paramTypes, paramValues,
+								   &context, &parseHotRelations))
+	{
+		log_warn("Failed to fetch the list of hot relations from "
+				 "the primary node %" PRId64 " \"%s\" (%s:%d)",
+				 primaryNode->nodeId,
+				 primaryNode->name,
+				 primaryNode->host,
+				 primaryNode->port);
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_debug("Fetched a list of %d hot relations to prewarm at promotion "
+			  "from the primary node %" PRId64 " \"%s\" (%s:%d)",
+			  prewarm->relationCount,
+			  primaryNode->nodeId,
+			  primaryNode->name,
+			  primaryNode->host,
+			  primaryNode->port);
+
+	return true;
+}
+
+
+/*
+ * parseHotRelations parses the list of the hot relations of the primary.
+ */
+static void
+parseHotRelations(void *ctx, PGresult *result)
+{
+	HotRelationsParseContext *context = (HotRelationsParseContext *) ctx;
+	KeeperPrewarm *prewarm = context->prewarm;
+
+	if (PQnfields(result) != 1)
+	{
+		log_error("Query returned %d columns, expected 1", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	int count = PQntuples(result);
+
+	if (count > PG_AUTOCTL_PREWARM_MAX_RELATIONS)
+	{
+		count = PG_AUTOCTL_PREWARM_MAX_RELATIONS;
+	}
+
+	for (int rowNumber = 0; rowNumber < count; rowNumber++)
+	{
+		strlcpy(prewarm->relations[rowNumber],
+				PQgetvalue(result, rowNumber, 0),
+				PREWARM_RELNAME_MAXLEN);
+	}
+
+	prewarm->relationCount = count;
+	context->parsedOK = true;
+}
+
+
+/*
+ * keeper_prewarm_start starts replaying the list of hot relations with
+ * pg_prewarm on the local Postgres instance. Only the first query is sent
+ * here, keeper_prewarm_poll takes it from there.
+ */
+bool
+keeper_prewarm_start(KeeperPrewarm *prewarm, PostgresSetup *pgSetup, int budget)
+{
+	PGSQL *pgsql = &(prewarm->pgsql);
+	char connectionString[MAXCONNINFO] = { 0 };
+	char setTimeout[BUFSIZE] = { 0 };
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql =
+		"SELECT exists(SELECT 1 FROM pg_extension WHERE extname = 'pg_prewarm')";
+
+	if (budget <= 0 || prewarm->inProgress)
+	{
+		return true;
+	}
+
+	if (prewarm->relationCount == 0)
+	{
+		log_info("Skipping prewarm: the list of hot relations of the primary "
+				 "is empty");
+		return true;
+	}
+
+	pg_setup_get_local_connection_string(pgSetup, connectionString);
+
+	if (!pgsql_init(pgsql, connectionString, PGSQL_CONN_LOCAL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) pgsql_set_main_loop_retry_policy(&(pgsql->retryPolicy));
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_warn("Failed to check for the pg_prewarm extension, "
+				 "skipping prewarm");
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	if (!context.boolVal)
+	{
+		log_info("Skipping prewarm: the pg_prewarm extension is not installed "
+				 "in database \"%s\"",
+				 pgSetup->dbname);
+		pgsql_finish(pgsql);
+		return true;
+	}
+
+	/* a single relation might take longer than our budget */
+	sformat(setTimeout, sizeof(setTimeout),
+			"SET statement_timeout TO %d", budget * 1000);
+
+	if (!pgsql_execute(pgsql, setTimeout))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	log_info("Prewarming up to %d hot relations of the primary, "
+			 "within a budget of %ds",
+			 prewarm->relationCount,
+			 budget);
+
+	prewarm->inProgress = true;
+	prewarm->nextRelation = 0;
+	prewarm->prewarmedCount = 0;
+	prewarm->prewarmedBlocks = 0;
+	prewarm->startTime = time(NULL);
+	prewarm->budget = budget;
+
+	return keeper_prewarm_send_next(prewarm);
+}
+
+
+/*
+ * keeper_prewarm_poll is called from the keeper main loop. It collects the
+ * results of the pg_prewarm queries that have completed and sends the next
+ * ones, without ever waiting for a query to complete.
+ */
+void
+keeper_prewarm_poll(KeeperPrewarm *prewarm)
+{
+	while (prewarm->inProgress)
+	{
+		SingleValueResultContext context =
+		{ { 0 }, PGSQL_RESULT_BIGINT, false };
+		bool done = false;
+
+		if (!pgsql_fetch_async_result(&(prewarm->pgsql), &done,
+									  &context, &parseSingleValueResult))
+		{
+			log_warn("Failed to prewarm relation %s, stopping prewarm",
+					 prewarm->relations[prewarm->nextRelation - 1]);
+			(void) keeper_prewarm_done(prewarm);
+			return;
+		}
+
+		if (!done)
+		{
+			if ((time(NULL) - prewarm->startTime) >= prewarm->budget)
+			{
+				log_info("Prewarm budget of %ds is exhausted",
+						 prewarm->budget);
+				(void) keeper_prewarm_done(prewarm);
+			}
+			return;
+		}
+
+		if (context.parsedOk)
+		{
+			++prewarm->prewarmedCount;
+			prewarm->prewarmedBlocks += context.bigint;
+		}
+
+		if (!keeper_prewarm_send_next(prewarm))
+		{
+			return;
+		}
+	}
+}
+
+
+/*
+ * keeper_prewarm_send_next sends the pg_prewarm query for the next relation
+ * of the list. When we're done with the list, or with our budget, it stops
+ * the prewarm and returns false.
+ */
+static bool
+keeper_prewarm_send_next(KeeperPrewarm *prewarm)
+{
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { 0 };
+
+	if (prewarm->nextRelation >= prewarm->relationCount ||
+		(time(NULL) - prewarm->startTime) >= prewarm->budget)
+	{
+		(void) keeper_prewarm_done(prewarm);
+		return false;
+	}
+
+	paramValues[0] = prewarm->relations[prewarm->nextRelation++];
+
+	if (!pgsql_send_with_params(&(prewarm->pgsql), PREWARM_RELATION_SQL,
+								1, paramTypes, paramValues))
+	{
+		/* errors have already been logged */
+		(void) keeper_prewarm_done(prewarm);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_prewarm_done logs a summary of the prewarm and stops it.
+ */
+static void
+keeper_prewarm_done(KeeperPrewarm *prewarm)
+{
+	log_info("Prewarmed %d relations (%" PRId64 " blocks) in %ds",
+			 prewarm->prewarmedCount,
+			 prewarm->prewarmedBlocks,
+			 (int) (time(NULL) - prewarm->startTime));
+
+	(void) keeper_prewarm_stop(prewarm);
+}
+
+
+/*
+ * keeper_prewarm_stop cancels the current pg_prewarm query, if any, and
+ * closes the prewarm connection.
+ */
+void
+keeper_prewarm_stop(KeeperPrewarm *prewarm)
+{
+	if (!prewarm->inProgress)
+	{
+		return;
+	}
+
+	(void) pgsql_cancel_query(&(prewarm->pgsql));
+	(void) pgsql_finish(&(prewarm->pgsql));
+
+	prewarm->inProgress = false;
+}
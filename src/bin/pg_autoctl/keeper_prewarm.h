@@ -0,0 +1,56 @@
+/*
+ * src/bin/pg_autoctl/keeper_prewarm.h
+ *     Warm up the buffer cache of a standby that is being promoted.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef KEEPER_PREWARM_H
+#define KEEPER_PREWARM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "defaults.h"
+#include "pgsetup.h"
+#include "pgsql.h"
+
+
+/* schema qualified and quoted relation names, as in format('%I.%I') */
+#define PREWARM_RELNAME_MAXLEN (2 * NAMEDATALEN + 6)
+
+/*
+ * KeeperPrewarm keeps the list of the relations that are the most used on the
+ * primary, as refreshed by the standby, and the progress of replaying that
+ * list with pg_prewarm when the standby is being promoted.
+ */
+typedef struct KeeperPrewarm
+{
+	/* hot relations list, the hottest first */
+	int relationCount;
+	char relations[PG_AUTOCTL_PREWARM_MAX_RELATIONS][PREWARM_RELNAME_MAXLEN];
+	uint64_t refreshTime;
+
+	/* pg_prewarm replay on the local standby */
+	PGSQL pgsql;
+	bool inProgress;
+	int nextRelation;
+	int prewarmedCount;
+	int64_t prewarmedBlocks;
+	uint64_t startTime;
+	int budget;
+} KeeperPrewarm;
+
+
+bool keeper_prewarm_refresh_relations(KeeperPrewarm *prewarm,
+									  PostgresSetup *pgSetup,
+									  NodeAddress *primaryNode);
+bool keeper_prewarm_start(KeeperPrewarm *prewarm,
+						  PostgresSetup *pgSetup,
+						  int budget);
+void keeper_prewarm_poll(KeeperPrewarm *prewarm);
+void keeper_prewarm_stop(KeeperPrewarm *prewarm);
+
+#endif /* KEEPER_PREWARM_H */
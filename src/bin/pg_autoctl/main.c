@@ -169,6 +169,29 @@ set_logger()
 	 */
 	log_use_colors(isatty(fileno(stderr)));
 
+	/*
+	 * Log lines may be formatted as JSON objects instead, for log pipelines
+	 * to ingest them without parsing. The environment is inherited by our
+	 * services, so they all use the same format.
+	 */
+	if (env_exists(PG_AUTOCTL_LOG_FORMAT))
+	{
+		char logFormat[NAMEDATALEN] = { 0 };
+
+		if (get_env_copy(PG_AUTOCTL_LOG_FORMAT, logFormat, NAMEDATALEN) &&
+			strcmp(logFormat, "json") == 0)
+		{
+			log_use_colors(false);
+			log_set_json(true);
+		}
+		else if (strcmp(logFormat, "text") != 0)
+		{
+			log_warn("Unknown log format \"%s\" in environment variable "
+					 "%s, using \"text\"",
+					 logFormat, PG_AUTOCTL_LOG_FORMAT);
+		}
+	}
+
 	/* initialize the semaphore used for locking log output */
 	if (!semaphore_init(&log_semaphore))
 	{
@@ -0,0 +1,648 @@
+/*
+ * src/bin/pg_autoctl/metrics.c
+ *   Keeper metrics, shared between the pg_autoctl services.
+ *
+ * The node-active service, the supervisor, and our connection code update
+ * counters in a SysV shared memory segment that the supervisor creates when
+ * the metrics service is enabled. The metrics service then reads the same
+ * segment to serve the Prometheus text format, so that scraping pg_autoctl
+ * never needs to fork or to connect to the monitor.
+ *
+ * We share the shared memory identifier with our sub-processes in the
+ * environment, the same way as we do for our logging semaphore. When the
+ * segment does not exist, all the metrics_* functions do nothing.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "parsing.h"
+#include "string_utils.h"
+
+
+static KeeperMetrics *metrics = NULL;
+
+/* the supervisor removes the shared memory segment it created at exit */
+static int metricsShmId = -1;
+static pid_t metricsCreatorPid = 0;
+
+/* connection labels, indexed by ConnectionType */
+static const char *ConnectionTypeLabels[PGSQL_CONN_APP + 1] = {
+	"local", "monitor", "coordinator", "upstream", "application"
+};
+
+static void metrics_unlink_atexit(void);
+static void appendSummary(PQExpBuffer out, const char *name, const char *help,
+						  uint64_t count, double sum);
+
+
+/*
+ * metrics_create creates the shared memory segment for our metrics, and
+ * exports its identifier in the environment for the sub-processes that the
+ * supervisor is about to start.
+ */
+bool
+metrics_create(void)
+{
+	int shmId = shmget(IPC_PRIVATE, sizeof(KeeperMetrics), IPC_CREAT | 0600);
+
+	if (shmId < 0)
+	{
+		log_error("Failed to create the metrics shared memory segment: %m");
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_error("Failed to attach the metrics shared memory segment %d: %m",
+				  shmId);
+		(void) shmctl(shmId, IPC_RMID, NULL);
+		return false;
+	}
+
+	metrics = (KeeperMetrics *) segment;
+	memset(metrics, 0, sizeof(KeeperMetrics));
+
+	metrics->startTime = time(NULL);
+	metrics->currentRole = NO_STATE;
+	metrics->assignedRole = NO_STATE;
+	metrics->lagBytes = -1;
+
+	metricsShmId = shmId;
+	metricsCreatorPid = getpid();
+	atexit(metrics_unlink_atexit);
+
+	IntString shmIdString = intToString(shmId);
+
+	setenv(PG_AUTOCTL_METRICS_SHMID, shmIdString.strValue, 1);
+
+	log_debug("Created metrics shared memory segment %d", shmId);
+
+	return true;
+}
+
+
+/*
+ * metrics_attach attaches to the shared memory segment that our supervisor
+ * created, when the metrics service is enabled.
+ */
+bool
+metrics_attach(void)
+{
+	char shmIdString[BUFSIZE] = { 0 };
+	int shmId = -1;
+
+	if (metrics != NULL || !env_exists(PG_AUTOCTL_METRICS_SHMID))
+	{
+		return true;
+	}
+
+	if (!get_env_copy(PG_AUTOCTL_METRICS_SHMID, shmIdString, BUFSIZE) ||
+		!stringToInt(shmIdString, &shmId))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_warn("Failed to attach the metrics shared memory segment %d: %m",
+				 shmId);
+		return false;
+	}
+
+	metrics = (KeeperMetrics *) segment;
+
+	return true;
+}
+
+
+/*
+ * metrics_enabled returns true when we are attached to the metrics segment.
+ */
+bool
+metrics_enabled(void)
+{
+	return metrics != NULL;
+}
+
+
+/*
+ * metrics_unlink_atexit removes the shared memory segment, only from the
+ * process that created it.
+ */
+static void
+metrics_unlink_atexit(void)
+{
+	if (metricsShmId < 0 || getpid() != metricsCreatorPid)
+	{
+		return;
+	}
+
+	(void) shmdt(metrics);
+	metrics = NULL;
+
+	if (shmctl(metricsShmId, IPC_RMID, NULL) != 0)
+	{
+		log_warn("Failed to remove the metrics shared memory segment %d: %m",
+				 metricsShmId);
+	}
+
+	metricsShmId = -1;
+}
+
+
+/*
+ * metrics_record_loop accounts for a round of the keeper main loop.
+ */
+void
+metrics_record_loop(double seconds)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	++metrics->loopCount;
+	metrics->loopSecondsSum += seconds;
+	metrics->loopSecondsLast = seconds;
+}
+
+
+/*
+ * metrics_record_loop_overrun accounts for a round of the keeper main loop
+ * that started the given amount of seconds later than expected.
+ */
+void
+metrics_record_loop_overrun(double seconds)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	++metrics->loopOverrunCount;
+	metrics->loopOverrunSecondsSum += seconds;
+}
+
+
+/*
+ * metrics_record_node_active accounts for a node_active() call to the
+ * monitor.
+ */
+void
+metrics_record_node_active(bool success, double seconds)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	++metrics->monitorCallCount;
+	metrics->monitorSecondsSum += seconds;
+	metrics->monitorSecondsLast = seconds;
+
+	if (!success)
+	{
+		++metrics->monitorCallFailures;
+	}
+}
+
+
+/*
+ * metrics_record_node_state registers the state of the local node, as
+ * reported to the monitor.
+ */
+void
+metrics_record_node_state(int64_t nodeId,
+						  NodeState currentRole,
+						  NodeState assignedRole,
+						  int timeline,
+						  const char *reportedLSN,
+						  int64_t lagBytes)
+{
+	uint64_t lsn = 0;
+
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	metrics->nodeId = nodeId;
+	metrics->currentRole = currentRole;
+	metrics->assignedRole = assignedRole;
+	metrics->timeline = timeline;
+	metrics->lagBytes = lagBytes;
+
+	if (reportedLSN != NULL && parseLSN(reportedLSN, &lsn))
+	{
+		metrics->reportedLSN = lsn;
+	}
+}
+
+
+/*
+ * metrics_record_transition accounts for an FSM transition.
+ */
+void
+metrics_record_transition(bool success, double seconds)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	++metrics->transitionCount;
+	metrics->transitionSecondsSum += seconds;
+
+	if (!success)
+	{
+		++metrics->transitionFailures;
+	}
+}
+
+
+/*
+ * metrics_record_slot_maintenance accounts for a round of replication slots
+ * maintenance, and for how many slots were advanced or skipped.
+ */
+void
+metrics_record_slot_maintenance(bool success, double seconds,
+								int advanced, int skipped)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	++metrics->slotMaintainCount;
+	metrics->slotMaintainSecondsSum += seconds;
+	metrics->slotsAdvanced += advanced;
+	metrics->slotsSkipped += skipped;
+
+	if (!success)
+	{
+		++metrics->slotMaintainFailures;
+	}
+}
+
+
+/*
+ * metrics_count_connection accounts for a new connection to Postgres.
+ */
+void
+metrics_count_connection(ConnectionType connectionType)
+{
+	if (metrics == NULL || connectionType > PGSQL_CONN_APP)
+	{
+		return;
+	}
+
+	++metrics->connections[connectionType];
+}
+
+
+/*
+ * metrics_count_connection_retry accounts for a connection attempt made by
+ * our ConnectionRetryPolicy after the first one failed.
+ */
+void
+metrics_count_connection_retry(ConnectionType connectionType)
+{
+	if (metrics == NULL || connectionType > PGSQL_CONN_APP)
+	{
+		return;
+	}
+
+	++metrics->connectionRetries[connectionType];
+}
+
+
+/*
+ * metrics_count_service_restart accounts for a service restart by the
+ * supervisor.
+ */
+void
+metrics_count_service_restart(const char *serviceName)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	for (int i = 0; i < metrics->serviceCount; i++)
+	{
+		if (strcmp(metrics->services[i].name, serviceName) == 0)
+		{
+			++metrics->services[i].restarts;
+			return;
+		}
+	}
+
+	if (metrics->serviceCount < METRICS_MAX_SERVICES)
+	{
+		ServiceMetrics *service = &(metrics->services[metrics->serviceCount]);
+
+		strlcpy(service->name, serviceName, sizeof(service->name));
+		service->restarts = 1;
+
+		++metrics->serviceCount;
+	}
+}
+
+
+/*
+ * metrics_record_hook accounts for a run of a primary change hook. Hooks are
+ * known by their file name, and only the first METRICS_MAX_HOOKS of them
+ * have metrics.
+ */
+void
+metrics_record_hook(const char *hookName, bool success, double seconds)
+{
+	HookMetrics *hook = NULL;
+
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	for (int i = 0; i < metrics->hookCount; i++)
+	{
+		if (strcmp(metrics->hooks[i].name, hookName) == 0)
+		{
+			hook = &(metrics->hooks[i]);
+			break;
+		}
+	}
+
+	if (hook == NULL)
+	{
+		if (metrics->hookCount >= METRICS_MAX_HOOKS)
+		{
+			return;
+		}
+
+		hook = &(metrics->hooks[metrics->hookCount++]);
+		strlcpy(hook->name, hookName, sizeof(hook->name));
+	}
+
+	++hook->runs;
+	hook->secondsSum += seconds;
+	hook->secondsLast = seconds;
+
+	if (!success)
+	{
+		++hook->failures;
+	}
+}
+
+
+/*
+ * metrics_format_prometheus appends our metrics to the given buffer, using
+ * the Prometheus text exposition format.
+ */
+void
+metrics_format_prometheus(PQExpBuffer out)
+{
+	if (metrics == NULL)
+	{
+		return;
+	}
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_start_time_seconds "
+					  "Start time of pg_autoctl since unix epoch.\n"
+					  "# TYPE pg_autoctl_start_time_seconds gauge\n"
+					  "pg_autoctl_start_time_seconds %" PRIu64 "\n",
+					  metrics->startTime);
+
+	appendSummary(out, "pg_autoctl_keeper_loop_duration_seconds",
+				  "Duration of the rounds of the keeper main loop.",
+				  metrics->loopCount, metrics->loopSecondsSum);
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_keeper_last_loop_duration_seconds "
+					  "Duration of the last round of the keeper main loop.\n"
+					  "# TYPE pg_autoctl_keeper_last_loop_duration_seconds gauge\n"
+					  "pg_autoctl_keeper_last_loop_duration_seconds %g\n",
+					  metrics->loopSecondsLast);
+
+	appendSummary(out, "pg_autoctl_keeper_loop_overrun_seconds",
+				  "Delay of the rounds of the keeper main loop that started "
+				  "later than the report interval allows.",
+				  metrics->loopOverrunCount, metrics->loopOverrunSecondsSum);
+
+	appendSummary(out, "pg_autoctl_monitor_node_active_duration_seconds",
+				  "Round-trip time of the node_active calls to the monitor.",
+				  metrics->monitorCallCount, metrics->monitorSecondsSum);
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_monitor_node_active_last_duration_seconds "
+					  "Round-trip time of the last node_active call.\n"
+					  "# TYPE pg_autoctl_monitor_node_active_last_duration_seconds gauge\n"
+					  "pg_autoctl_monitor_node_active_last_duration_seconds %g\n"
+					  "# HELP pg_autoctl_monitor_node_active_failures_total "
+					  "Number of node_active calls that failed.\n"
+					  "# TYPE pg_autoctl_monitor_node_active_failures_total counter\n"
+					  "pg_autoctl_monitor_node_active_failures_total %" PRIu64 "\n",
+					  metrics->monitorSecondsLast,
+					  metrics->monitorCallFailures);
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_node_info "
+					  "Current and assigned state of the local node.\n"
+					  "# TYPE pg_autoctl_node_info gauge\n"
+					  "pg_autoctl_node_info{node_id=\"%" PRId64 "\","
+					  "current_state=\"%s\",assigned_state=\"%s\"} 1\n",
+					  metrics->nodeId,
+					  NodeStateToString(metrics->currentRole),
+					  NodeStateToString(metrics->assignedRole));
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_timeline "
+					  "Timeline of the local Postgres instance.\n"
+					  "# TYPE pg_autoctl_timeline gauge\n"
+					  "pg_autoctl_timeline %d\n"
+					  "# HELP pg_autoctl_reported_lsn_bytes "
+					  "LSN reported to the monitor, in bytes.\n"
+					  "# TYPE pg_autoctl_reported_lsn_bytes gauge\n"
+					  "pg_autoctl_reported_lsn_bytes %" PRIu64 "\n",
+					  metrics->timeline,
+					  metrics->reportedLSN);
+
+	if (metrics->lagBytes >= 0)
+	{
+		appendPQExpBuffer(out,
+						  "# HELP pg_autoctl_replication_lag_bytes "
+						  "Bytes of WAL between the primary and the local "
+						  "standby, as known from the monitor.\n"
+						  "# TYPE pg_autoctl_replication_lag_bytes gauge\n"
+						  "pg_autoctl_replication_lag_bytes %" PRId64 "\n",
+						  metrics->lagBytes);
+	}
+
+	appendSummary(out, "pg_autoctl_fsm_transition_duration_seconds",
+				  "Duration of the FSM transitions.",
+				  metrics->transitionCount, metrics->transitionSecondsSum);
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_fsm_transition_failures_total "
+					  "Number of FSM transitions that failed.\n"
+					  "# TYPE pg_autoctl_fsm_transition_failures_total counter\n"
+					  "pg_autoctl_fsm_transition_failures_total %" PRIu64 "\n",
+					  metrics->transitionFailures);
+
+	appendSummary(out, "pg_autoctl_replication_slots_maintenance_duration_seconds",
+				  "Duration of the replication slots maintenance queries.",
+				  metrics->slotMaintainCount, metrics->slotMaintainSecondsSum);
+
+	appendPQExpBuffer(out,
+					  "# HELP pg_autoctl_replication_slots_maintenance_failures_total "
+					  "Number of replication slots maintenance queries that failed.\n"
+					  "# TYPE pg_autoctl_replication_slots_maintenance_failures_total counter\n"
+					  "pg_autoctl_replication_slots_maintenance_failures_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_replication_slots_advanced_total "
+					  "Number of replication slots advanced.\n"
+					  "# TYPE pg_autoctl_replication_slots_advanced_total counter\n"
+					  "pg_autoctl_replication_slots_advanced_total %" PRIu64 "\n"
+					  "# HELP pg_autoctl_replication_slots_skipped_total "
+					  "Number of replication slots not advanced because they "
+					  "were behind by less than replication.slot_advance_threshold.\n"
+					  "# TYPE pg_autoctl_replication_slots_skipped_total counter\n"
+					  "pg_autoctl_replication_slots_skipped_total %" PRIu64 "\n",
+					  metrics->slotMaintainFailures,
+					  metrics->slotsAdvanced,
+					  metrics->slotsSkipped);
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_connections_total "
+						 "Number of connections opened to Postgres.\n"
+						 "# TYPE pg_autoctl_connections_total counter\n");
+
+	for (int i = 0; i <= PGSQL_CONN_APP; i++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_connections_total{type=\"%s\"} %" PRIu64 "\n",
+						  ConnectionTypeLabels[i],
+						  metrics->connections[i]);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_connection_retries_total "
+						 "Number of connection attempts retried.\n"
+						 "# TYPE pg_autoctl_connection_retries_total counter\n");
+
+	for (int i = 0; i <= PGSQL_CONN_APP; i++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_connection_retries_total{type=\"%s\"} %"
+						  PRIu64 "\n",
+						  ConnectionTypeLabels[i],
+						  metrics->connectionRetries[i]);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_service_restarts_total "
+						 "Number of restarts of the pg_autoctl services.\n"
+						 "# TYPE pg_autoctl_service_restarts_total counter\n");
+
+	for (int i = 0; i < metrics->serviceCount && i < METRICS_MAX_SERVICES; i++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_service_restarts_total{service=\"%s\"} %"
+						  PRIu64 "\n",
+						  metrics->services[i].name,
+						  metrics->services[i].restarts);
+	}
+
+	if (metrics->hookCount == 0)
+	{
+		return;
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_hook_duration_seconds "
+						 "Duration of the primary change hooks.\n"
+						 "# TYPE pg_autoctl_hook_duration_seconds summary\n");
+
+	for (int i = 0; i < metrics->hookCount && i < METRICS_MAX_HOOKS; i++)
+	{
+		HookMetrics *hook = &(metrics->hooks[i]);
+
+		appendPQExpBuffer(out,
+						  "pg_autoctl_hook_duration_seconds_sum{hook=\"%s\"} %g\n"
+						  "pg_autoctl_hook_duration_seconds_count{hook=\"%s\"} %"
+						  PRIu64 "\n",
+						  hook->name, hook->secondsSum,
+						  hook->name, hook->runs);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_hook_last_duration_seconds "
+						 "Duration of the last run of the primary change hooks.\n"
+						 "# TYPE pg_autoctl_hook_last_duration_seconds gauge\n");
+
+	for (int i = 0; i < metrics->hookCount && i < METRICS_MAX_HOOKS; i++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_hook_last_duration_seconds{hook=\"%s\"} %g\n",
+						  metrics->hooks[i].name,
+						  metrics->hooks[i].secondsLast);
+	}
+
+	appendPQExpBufferStr(out,
+						 "# HELP pg_autoctl_hook_failures_total "
+						 "Number of primary change hook runs that failed "
+						 "or timed out.\n"
+						 "# TYPE pg_autoctl_hook_failures_total counter\n");
+
+	for (int i = 0; i < metrics->hookCount && i < METRICS_MAX_HOOKS; i++)
+	{
+		appendPQExpBuffer(out,
+						  "pg_autoctl_hook_failures_total{hook=\"%s\"} %"
+						  PRIu64 "\n",
+						  metrics->hooks[i].name,
+						  metrics->hooks[i].failures);
+	}
+}
+
+
+/*
+ * appendSummary appends a Prometheus summary that has no quantiles, only a
+ * count and a sum.
+ */
+static void
+appendSummary(PQExpBuffer out, const char *name, const char *help,
+			  uint64_t count, double sum)
+{
+	appendPQExpBuffer(out,
+					  "# HELP %s %s\n"
+					  "# TYPE %s summary\n"
+					  "%s_sum %g\n"
+					  "%s_count %" PRIu64 "\n",
+					  name, help,
+					  name,
+					  name, sum,
+					  name, count);
+}
@@ -0,0 +1,123 @@
+/*
+ * src/bin/pg_autoctl/metrics.h
+ *   Keeper metrics, shared between the pg_autoctl services.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "pgsql.h"
+#include "state.h"
+
+
+/* the supervisor runs at most a handful of services */
+#define METRICS_MAX_SERVICES 8
+#define METRICS_MAX_HOOKS 8
+
+typedef struct ServiceMetrics
+{
+	char name[NAMEDATALEN];
+	uint64_t restarts;
+} ServiceMetrics;
+
+typedef struct HookMetrics
+{
+	char name[NAMEDATALEN];
+	uint64_t runs;
+	uint64_t failures;
+	double secondsSum;
+	double secondsLast;
+} HookMetrics;
+
+/*
+ * KeeperMetrics is kept in a SysV shared memory segment that the supervisor
+ * creates, and that its services attach to. Each counter is only ever written
+ * to by a single process, so we don't need any locking: the metrics service
+ * might read a value that is being updated, and will get it right at the next
+ * scrape.
+ */
+typedef struct KeeperMetrics
+{
+	uint64_t startTime;
+
+	/* keeper main loop */
+	uint64_t loopCount;
+	double loopSecondsSum;
+	double loopSecondsLast;
+	uint64_t loopOverrunCount;
+	double loopOverrunSecondsSum;
+
+	/* node_active() round-trips to the monitor */
+	uint64_t monitorCallCount;
+	uint64_t monitorCallFailures;
+	double monitorSecondsSum;
+	double monitorSecondsLast;
+
+	/* local node state and replication */
+	int64_t nodeId;
+	NodeState currentRole;
+	NodeState assignedRole;
+	int timeline;
+	uint64_t reportedLSN;
+	int64_t lagBytes;           /* -1 when unknown */
+
+	/* FSM transitions */
+	uint64_t transitionCount;
+	uint64_t transitionFailures;
+	double transitionSecondsSum;
+
+	/* replication slots maintenance */
+	uint64_t slotMaintainCount;
+	uint64_t slotMaintainFailures;
+	double slotMaintainSecondsSum;
+	uint64_t slotsAdvanced;
+	uint64_t slotsSkipped;
+
+	/* connections, per connection type */
+	uint64_t connections[PGSQL_CONN_APP + 1];
+	uint64_t connectionRetries[PGSQL_CONN_APP + 1];
+
+	/* supervisor */
+	int serviceCount;
+	ServiceMetrics services[METRICS_MAX_SERVICES];
+
+	/* primary change hooks, see keeper_hooks.c */
+	int hookCount;
+	HookMetrics hooks[METRICS_MAX_HOOKS];
+} KeeperMetrics;
+
+
+bool metrics_create(void);
+bool metrics_attach(void);
+bool metrics_enabled(void);
+
+void metrics_record_loop(double seconds);
+void metrics_record_loop_overrun(double seconds);
+void metrics_record_node_active(bool success, double seconds);
+void metrics_record_node_state(int64_t nodeId,
+							   NodeState currentRole,
+							   NodeState assignedRole,
+							   int timeline,
+							   const char *reportedLSN,
+							   int64_t lagBytes);
+void metrics_record_transition(bool success, double seconds);
+void metrics_record_slot_maintenance(bool success, double seconds,
+									 int advanced, int skipped);
+void metrics_count_connection(ConnectionType connectionType);
+void metrics_count_connection_retry(ConnectionType connectionType);
+void metrics_count_service_restart(const char *serviceName);
+void metrics_record_hook(const char *hookName, bool success, double seconds);
+
+void metrics_format_prometheus(PQExpBuffer out);
+
+#endif /* METRICS_H */
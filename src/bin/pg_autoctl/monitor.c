@@ -20,6 +20,7 @@
 #include "nodestate_utils.h"
 #include "parsing.h"
 #include "pgsql.h"
+#include "pqexpbuffer.h"
 #include "primary_standby.h"
 #include "signals.h"
 #include "string_utils.h"
@@ -83,6 +84,27 @@ typedef struct FormationURIParseContext
 	bool parsedOK;
 } FormationURIParseContext;
 
+typedef struct FollowStateNotificationContext
+{
+	char *formation;
+	int groupId;
+	CurrentNodeStateArray *nodesArray;
+	bool needsFullRedraw;
+} FollowStateNotificationContext;
+
+typedef struct CatchupProgressParseContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOK;
+} CatchupProgressParseContext;
+
+typedef struct JSONStreamContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	FILE *stream;
+	uint64_t rowCount;
+} JSONStreamContext;
+
 typedef struct MonitorExtensionVersionParseContext
 {
 	char sqlstate[SQLSTATE_LENGTH];
@@ -90,6 +112,13 @@ typedef struct MonitorExtensionVersionParseContext
 	bool parsedOK;
 } MonitorExtensionVersionParseContext;
 
+typedef struct MonitorExtensionUpdateEstimateContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	MonitorExtensionUpdateEstimate *estimate;
+	bool parsedOK;
+} MonitorExtensionUpdateEstimateContext;
+
 
 static bool parseNode(PGresult *result, int rowNumber, NodeAddress *node);
 static void parseNodeResult(void *ctx, PGresult *result);
@@ -100,12 +129,20 @@ static bool parseCurrentNodeState(PGresult *result, int rowNumber,
 								  CurrentNodeState *nodeState);
 static bool parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray,
 									   PGresult *result);
-static void printCurrentState(void *ctx, PGresult *result);
+static void parseCurrentState(void *ctx, PGresult *result);
+static void printCurrentStateArray(CurrentNodeStateArray *nodesArray);
 static void printLastEvents(void *ctx, PGresult *result);
+static void printJSONArrayElement(void *ctx, PGresult *result);
+static bool monitor_print_json_array(Monitor *monitor, const char *sql,
+									 int paramCount, const Oid *paramTypes,
+									 const char **paramValues, FILE *stream);
 static void printFormationSettings(void *ctx, PGresult *result);
 static void printFormationURI(void *ctx, PGresult *result);
+static void printCatchupProgress(void *ctx, PGresult *result);
+static void appendArrayElement(PQExpBuffer buffer, const char *value);
 static void parseCoordinatorNode(void *ctx, PGresult *result);
 static void parseExtensionVersion(void *ctx, PGresult *result);
+static void parseExtensionUpdateEstimate(void *ctx, PGresult *result);
 
 static bool prepare_connection_to_current_system_user(Monitor *source,
 													  Monitor *target);
@@ -171,13 +208,50 @@ typedef struct WaitForStateChangeNotificationContext
 	int groupId;
 	int64_t nodeId;
 	bool stateHasChanged;
+	bool hasPushedSettings;
+	char synchronousStandbyNames[BUFSIZE];
 } WaitForStateChangeNotificationContext;
 
+
+/*
+ * PendingNodeStates holds the state changes that we drained from the
+ * notification connection, before processing them.
+ */
+typedef struct PendingNodeStates
+{
+	CurrentNodeState *nodeStates;
+	int count;
+	int capacity;
+	int received;
+} PendingNodeStates;
+
+static bool monitor_is_state_channel(const char *channel);
+static bool monitor_pending_node_states_add(PendingNodeStates *pending,
+											CurrentNodeState *nodeState,
+											bool coalesce);
+static void monitor_follow_state_notification(void *context,
+											  CurrentNodeState *nodeState);
 static bool monitor_process_notifications(Monitor *monitor,
 										  int timeoutMs,
+										  int wakeupFd,
+										  bool coalesce,
 										  char *channels[],
 										  void *NotificationContext,
 										  NotificationProcessingFunction processor);
+static bool monitor_wait_for_state_change_count(Monitor *monitor,
+												const char *formation,
+												int groupId,
+												int timeoutMs,
+												int wakeupFd,
+												bool *stateHasChanged);
+static bool monitor_has_wait_for_node_state(Monitor *monitor);
+static bool monitor_wait_for_node_state(Monitor *monitor,
+										const char *formation,
+										int groupId,
+										int64_t nodeId,
+										NodeState targetState,
+										int timeout,
+										bool *done);
 
 
 /*
@@ -201,10 +275,90 @@ monitor_init(Monitor *monitor, char *url)
 		return false;
 	}
 
+	monitor->hasReplica = false;
+
+	return true;
+}
+
+
+/*
+ * monitor_init_replica sets up a connection to a streaming replica of the
+ * monitor, to which the read-only queries that tolerate some replication lag
+ * are sent: the current state, the events, the formation URI, and the list
+ * of nodes. That leaves more headroom for node_active calls on the monitor
+ * itself. When a query fails on the replica, it's sent to the monitor.
+ */
+bool
+monitor_init_replica(Monitor *monitor, char *url)
+{
+	log_trace("monitor_init_replica: %s", url);
+
+	if (!pgsql_init(&monitor->replica, url, PGSQL_CONN_MONITOR))
+	{
+		/* URL must be invalid, pgsql_init logged an error */
+		return false;
+	}
+
+	monitor->hasReplica = true;
+
+	return true;
+}
+
+
+/*
+ * monitor_init_pooler sends the calls of the keeper protocol, such as
+ * node_active and get_other_nodes, through a connection pooler in
+ * transaction mode, such as PgBouncer. Those calls don't keep any session
+ * state: each of them opens its own connection, and the node registration
+ * uses a single transaction. Only the notification client keeps a session on
+ * the monitor, because LISTEN and the state change wait need one. The monitor
+ * then needs as many backends as the pooler has server connections, plus one
+ * per waiting keeper, rather than two per keeper.
+ */
+bool
+monitor_init_pooler(Monitor *monitor, char *url)
+{
+	log_trace("monitor_init_pooler: %s", url);
+
+	if (!pgsql_init(&monitor->pgsql, url, PGSQL_CONN_MONITOR))
+	{
+		/* URL must be invalid, pgsql_init logged an error */
+		return false;
+	}
+
 	return true;
 }
 
 
+/*
+ * monitor_execute_read runs a read-only query on the monitor replica when we
+ * have one, and otherwise or when that fails, on the monitor.
+ */
+static bool
+monitor_execute_read(Monitor *monitor, const char *sql,
+					 int paramCount, const Oid *paramTypes,
+					 const char **paramValues,
+					 void *context, ParsePostgresResultCB *parseFun)
+{
+	if (monitor->hasReplica)
+	{
+		if (pgsql_execute_with_params(&(monitor->replica), sql,
+									  paramCount, paramTypes, paramValues,
+									  context, parseFun))
+		{
+			return true;
+		}
+
+		log_warn("Failed to query the monitor replica, "
+				 "querying the monitor instead");
+	}
+
+	return pgsql_execute_with_params(&(monitor->pgsql), sql,
+									 paramCount, paramTypes, paramValues,
+									 context, parseFun);
+}
+
+
 /*
  * monitor_setup_notifications sets the monitor Postgres client structure to
  * enable notification processing for a given groupId.
@@ -215,6 +369,7 @@ monitor_setup_notifications(Monitor *monitor, int groupId, int64_t nodeId)
 	monitor->notificationClient.notificationGroupId = groupId;
 	monitor->notificationClient.notificationNodeId = nodeId;
 	monitor->notificationClient.notificationReceived = false;
+	monitor->knownStateChangeCount = -1;
 
 	/* install our notification handler */
 	monitor->notificationClient.notificationProcessFunction =
@@ -240,7 +395,7 @@ monitor_has_received_notifications(Monitor *monitor)
 
 /*
  * monitor_process_state_notification processes a notification received on the
- * "state" channel from the monitor.
+ * "state" channel, or a per-group state channel, from the monitor.
  */
 bool
 monitor_process_state_notification(int notificationGroupId,
@@ -248,24 +403,35 @@ monitor_process_state_notification(int notificationGroupId,
 								   char *channel,
 								   char *payload)
 {
-	CurrentNodeState nodeState = { 0 };
+	CurrentNodeState *nodeStates = NULL;
+	int count = 0;
+	bool groupStateHasChanged = false;
+
+	if (!monitor_is_state_channel(channel))
+	{
+		return false;
+	}
 
-	if (strcmp(channel, "state") != 0)
+	/* errors are logged by parse_state_notification_messages */
+	if (!parse_state_notification_messages(&nodeStates, &count, payload))
 	{
 		return false;
 	}
 
-	/* errors are logged by parse_state_notification_message */
-	if (parse_state_notification_message(&nodeState, payload))
+	for (int index = 0; index < count; index++)
 	{
-		if (nodeState.groupId == notificationGroupId)
+		if (nodeStates[index].groupId == notificationGroupId)
 		{
-			(void) nodestate_log(&nodeState, LOG_INFO, notificationNodeId);
-			return true;
+			(void) nodestate_log(&(nodeStates[index]),
+								 LOG_INFO,
+								 notificationNodeId);
+			groupStateHasChanged = true;
 		}
 	}
 
-	return false;
+	free(nodeStates);
+
+	return groupStateHasChanged;
 }
 
 
@@ -395,7 +561,6 @@ monitor_get_nodes(Monitor *monitor, char *formation, int groupId,
 bool
 monitor_print_nodes_as_json(Monitor *monitor, char *formation, int groupId)
 {
-	PGSQL *pgsql = &monitor->pgsql;
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
 
 	const char *sql =
@@ -421,9 +586,9 @@ monitor_print_nodes_as_json(Monitor *monitor, char *formation, int groupId)
 		paramValues[1] = myGroupIdString.strValue;
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &parseSingleValueResult))
 	{
 		log_error("Failed to get the nodes from the monitor while running "
 				  "\"%s\" with formation %s and group %d",
@@ -466,7 +631,6 @@ monitor_get_other_nodes(Monitor *monitor,
 						NodeState currentState,
 						NodeAddressArray *nodeArray)
 {
-	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
 		currentState == ANY_STATE
 		?
@@ -492,9 +656,9 @@ monitor_get_other_nodes(Monitor *monitor,
 		paramValues[1] = NodeStateToString(currentState);
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeArray))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &parseContext, parseNodeArray))
 	{
 		log_error("Failed to get other nodes from the monitor while running "
 				  "\"%s\" with node id %" PRId64,
@@ -657,6 +821,335 @@ monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 }
 
 
+/*
+ * monitor_report_contact lets a hot standby monitor know whether this keeper
+ * can reach the monitor. While the keeper can't, it keeps a session open on
+ * whichever host of the monitor URI accepts connections, with an
+ * application_name that a hot standby monitor counts before taking over, see
+ * monitor_count_lost_contact. That's only useful with a multi-host monitor
+ * URI, and we try at most every MONITOR_LOST_CONTACT_RETRY_TIME seconds.
+ */
+void
+monitor_report_contact(Monitor *monitor, int64_t nodeId,
+					   bool couldContactMonitor)
+{
+	uint64_t now = time(NULL);
+
+	if (couldContactMonitor)
+	{
+		if (monitor->lostContactConnection != NULL)
+		{
+			PQfinish(monitor->lostContactConnection);
+			monitor->lostContactConnection = NULL;
+		}
+		return;
+	}
+
+	if ((now - monitor->lostContactAttemptTime) < MONITOR_LOST_CONTACT_RETRY_TIME)
+	{
+		return;
+	}
+
+	monitor->lostContactAttemptTime = now;
+
+	/* when we already have a session, make sure it's still there */
+	if (monitor->lostContactConnection != NULL)
+	{
+		/* PQconsumeInput doesn't block, and notices a closed session */
+		if (PQconsumeInput(monitor->lostContactConnection) != 0 &&
+			PQstatus(monitor->lostContactConnection) == CONNECTION_OK)
+		{
+			return;
+		}
+
+		PQfinish(monitor->lostContactConnection);
+		monitor->lostContactConnection = NULL;
+	}
+
+	char *errmsg = NULL;
+	PQconninfoOption *conninfo =
+		PQconninfoParse(monitor->pgsql.connectionString, &errmsg);
+	bool hasManyHosts = false;
+
+	if (conninfo == NULL)
+	{
+		/* the monitor URI has been validated already */
+		PQfreemem(errmsg);
+		return;
+	}
+
+	for (PQconninfoOption *option = conninfo; option->keyword != NULL; option++)
+	{
+		if ((strcmp(option->keyword, "host") == 0 ||
+			 strcmp(option->keyword, "hostaddr") == 0) &&
+			option->val != NULL &&
+			strchr(option->val, ',') != NULL)
+		{
+			hasManyHosts = true;
+		}
+	}
+
+	PQconninfoFree(conninfo);
+
+	if (!hasManyHosts)
+	{
+		return;
+	}
+
+	char applicationName[NAMEDATALEN] = { 0 };
+
+	sformat(applicationName, sizeof(applicationName), "%s%" PRId64,
+			MONITOR_LOST_CONTACT_APPLICATION_NAME_PREFIX, nodeId);
+
+	/*
+	 * The keywords after dbname override the ones in the monitor URI. We are
+	 * called from the keeper main loop while the monitor is unreachable, so
+	 * we don't wait for more than connect_timeout on each host.
+	 */
+	const char *keywords[] = {
+		"dbname", "target_session_attrs", "application_name",
+		"connect_timeout", NULL
+	};
+	const char *values[] = {
+		monitor->pgsql.connectionString, "any", applicationName,
+		MONITOR_LOST_CONTACT_CONNECT_TIMEOUT, NULL
+	};
+
+	PGconn *connection = PQconnectdbParams(keywords, values, 1);
+
+	if (PQstatus(connection) != CONNECTION_OK)
+	{
+		log_debug("Failed to connect to any monitor host to report losing "
+				  "contact with the monitor: %s",
+				  PQerrorMessage(connection));
+		PQfinish(connection);
+		return;
+	}
+
+	log_info("Reported losing contact with the monitor to monitor host "
+			 "\"%s:%s\"",
+			 PQhost(connection), PQport(connection));
+
+	monitor->lostContactConnection = connection;
+}
+
+
+/*
+ * monitor_count_lost_contact counts how many keepers reported losing contact
+ * with the monitor to this hot standby monitor, see monitor_report_contact,
+ * and how many nodes are registered, as far as this standby knows.
+ */
+bool
+monitor_count_lost_contact(Monitor *monitor,
+						   int *lostContactCount, int *nodeCount)
+{
+	PGSQL *pgsql = &(monitor->pgsql);
+	SingleValueResultContext lostContext = { { 0 }, PGSQL_RESULT_INT, false };
+	SingleValueResultContext nodeContext = { { 0 }, PGSQL_RESULT_INT, false };
+
+	const char *lostSql =
+		"SELECT count(DISTINCT application_name)::int "
+		"  FROM pg_stat_activity "
+		" WHERE left(application_name, length($1)) = $1";
+	Oid lostTypes[1] = { TEXTOID };
+	const char *lostValues[1] = { MONITOR_LOST_CONTACT_APPLICATION_NAME_PREFIX };
+
+	const char *nodeSql = "SELECT count(*)::int FROM pgautofailover.node";
+
+	if (!pgsql_execute_with_params(pgsql, lostSql, 1, lostTypes, lostValues,
+								   &lostContext, &parseSingleValueResult) ||
+		!lostContext.parsedOk)
+	{
+		log_error("Failed to count the keepers that lost contact with "
+				  "the upstream monitor");
+		return false;
+	}
+
+	if (!pgsql_execute_with_params(pgsql, nodeSql, 0, NULL, NULL,
+								   &nodeContext, &parseSingleValueResult) ||
+		!nodeContext.parsedOk)
+	{
+		log_error("Failed to count the registered nodes");
+		return false;
+	}
+
+	*lostContactCount = lostContext.intVal;
+	*nodeCount = nodeContext.intVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_get_primary_cached returns the primary node of the given group
+ * from the cache, after waiting for up to timeoutMs for a state change to be
+ * notified in the group. Only when a state change has been notified, or when
+ * we lost the notification connection, do we ask the monitor again. Service
+ * discovery loops then sit on LISTEN rather than calling get_primary over
+ * and over again.
+ *
+ * The primaryHasChanged boolean is set to true when the primary node is not
+ * the same as the one previously in the cache.
+ */
+bool
+monitor_get_primary_cached(Monitor *monitor, char *formation, int groupId,
+						   MonitorPrimaryCache *cache, int timeoutMs,
+						   NodeAddress *node, bool *primaryHasChanged)
+{
+	*primaryHasChanged = false;
+
+	if (cache->valid)
+	{
+		bool stateHasChanged = false;
+
+		if (!monitor_wait_for_state_change(monitor, formation, groupId, -1,
+										   timeoutMs, -1, &stateHasChanged))
+		{
+			/* we might have missed notifications, start again */
+			pgsql_finish(&(monitor->notificationClient));
+			cache->valid = false;
+		}
+		else if (stateHasChanged)
+		{
+			cache->valid = false;
+		}
+	}
+
+	if (!cache->valid)
+	{
+		NodeAddress primary = { 0 };
+		char groupChannel[NAMEDATALEN] = { 0 };
+		char *channels[] = { groupChannel, NULL };
+
+		(void) monitor_state_channel(formation, groupId,
+									 groupChannel, sizeof(groupChannel));
+
+		/* LISTEN first, so that we don't miss a change after our query */
+		if (!pgsql_listen(&(monitor->notificationClient), channels))
+		{
+			log_warn("Failed to listen to the monitor notifications");
+			pgsql_finish(&(monitor->notificationClient));
+			return false;
+		}
+
+		bool success =
+			monitor_get_primary(monitor, formation, groupId, &primary);
+
+		/* don't keep the connection open between our queries */
+		pgsql_finish(&(monitor->pgsql));
+
+		if (!success)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* node ids start at 1, an empty cache never matches */
+		*primaryHasChanged =
+			primary.nodeId != cache->primary.nodeId ||
+			strcmp(primary.host, cache->primary.host) != 0 ||
+			primary.port != cache->primary.port;
+
+		cache->primary = primary;
+		cache->valid = true;
+	}
+
+	*node = cache->primary;
+
+	return true;
+}
+
+
+/*
+ * monitor_get_upstream gets the node that the given standby node streams
+ * from, which is the primary node unless the standby has been set to cascade
+ * from another standby node.
+ */
+bool
+monitor_get_upstream(Monitor *monitor, int64_t nodeId, NodeAddress *node)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT * FROM pgautofailover.get_upstream($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+	NodeAddressParseContext parseContext = { { 0 }, node, false };
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeResult))
+	{
+		log_error("Failed to get the upstream node of node %lld from the "
+				  "monitor while running \"%s\"",
+				  (long long) nodeId, sql);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to get the upstream node of node %lld from the "
+				  "monitor while running \"%s\" because it returned an "
+				  "unexpected result. See previous line for details.",
+				  (long long) nodeId, sql);
+		return false;
+	}
+
+	log_debug("The upstream node returned by the monitor is node " NODE_FORMAT,
+			  node->nodeId, node->name, node->host, node->port);
+
+	return true;
+}
+
+
+/*
+ * monitor_get_basebackup_source gets the node that the given standby node
+ * should take its base backup from, which is a healthy secondary node when
+ * the monitor finds one, and the primary node otherwise.
+ */
+bool
+monitor_get_basebackup_source(Monitor *monitor, int64_t nodeId,
+							  NodeAddress *node)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql = "SELECT * FROM pgautofailover.get_basebackup_source($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1];
+	NodeAddressParseContext parseContext = { { 0 }, node, false };
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeResult))
+	{
+		log_error("Failed to get the base backup source of node %lld from "
+				  "the monitor while running \"%s\"",
+				  (long long) nodeId, sql);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to get the base backup source of node %lld from "
+				  "the monitor while running \"%s\" because it returned an "
+				  "unexpected result. See previous line for details.",
+				  (long long) nodeId, sql);
+		return false;
+	}
+
+	log_debug("The base backup source returned by the monitor is node "
+			  NODE_FORMAT,
+			  node->nodeId, node->name, node->host, node->port);
+
+	return true;
+}
+
+
 /*
  * monitor_get_coordinator gets the coordinator node in a given formation.
  */
@@ -908,11 +1401,11 @@ monitor_node_active(Monitor *monitor,
 		"SELECT * FROM pgautofailover.node_active($1, $2, $3, "
 		"$4::pgautofailover.replication_state, $5, $6, $7, $8)";
 	int paramCount = 8;
-	Oid paramTypes[8] = {
+	Oid paramTypes[9] = {
 		TEXTOID, INT8OID, INT4OID, TEXTOID,
-		BOOLOID, INT4OID, LSNOID, TEXTOID
+		BOOLOID, INT4OID, LSNOID, TEXTOID, INT8OID
 	};
-	const char *paramValues[8];
+	const char *paramValues[9];
 	MonitorAssignedStateParseContext parseContext =
 	{ { 0 }, assignedState, false };
 	const char *nodeStateString = NodeStateToString(currentState);
@@ -926,10 +1419,28 @@ monitor_node_active(Monitor *monitor,
 	paramValues[6] = currentLSN;
 	paramValues[7] = pgsrSyncState;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeState))
-	{
+	/*
+	 * node_active_v2 also returns the other nodes in the group, saving the
+	 * extra round trip to get_other_nodes in the keeper main loop.
+	 */
+	if (monitor->extensionVersionNum >= MONITOR_NODE_ACTIVE_V2_VERSION_NUM)
+	{
+		sql =
+			"SELECT * FROM pgautofailover.node_active_v2($1, $2, $3, "
+			"$4::pgautofailover.replication_state, $5, $6, $7, $8, $9)";
+		paramCount = 9;
+		paramValues[8] = intToString(monitor->knownNodesVersion).strValue;
+	}
+
+	assignedState->hasOtherNodes = false;
+	assignedState->otherNodesKnown = false;
+	assignedState->reportIntervalMs = 0;
+	assignedState->traceId[0] = '\0';
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeState))
+	{
 		log_error("Failed to get node state for node %" PRId64
 				  " in group %d of formation \"%s\" with initial state "
 				  "\"%s\", replication state \"%s\", "
@@ -957,6 +1468,29 @@ monitor_node_active(Monitor *monitor,
 }
 
 
+/*
+ * monitor_parse_node_active_result parses a result of the node_active or
+ * node_active_v2 functions that has been obtained without a connection to the
+ * monitor, as in pg_autoctl do bench keeper-loop.
+ */
+bool
+monitor_parse_node_active_result(PGresult *result,
+								 MonitorAssignedState *assignedState)
+{
+	MonitorAssignedStateParseContext parseContext =
+	{ { 0 }, assignedState, false };
+
+	assignedState->hasOtherNodes = false;
+	assignedState->otherNodesKnown = false;
+	assignedState->reportIntervalMs = 0;
+	assignedState->traceId[0] = '\0';
+
+	(void) parseNodeState(&parseContext, result);
+
+	return parseContext.parsedOK;
+}
+
+
 /*
  * monitor_set_node_candidate_priority updates the monitor on the changes
  * in the node candidate priority.
@@ -1130,6 +1664,150 @@ parseNodeReplicationSettings(void *ctx, PGresult *result)
 }
 
 
+/*
+ * appendArrayElement appends the given value to a Postgres array literal
+ * that is being built, quoting it. A NULL value is a SQL NULL element.
+ */
+static void
+appendArrayElement(PQExpBuffer buffer, const char *value)
+{
+	if (buffer->len > 1)
+	{
+		appendPQExpBufferChar(buffer, ',');
+	}
+
+	if (value == NULL)
+	{
+		appendPQExpBufferStr(buffer, "NULL");
+		return;
+	}
+
+	appendPQExpBufferChar(buffer, '"');
+
+	for (const char *ptr = value; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '"' || *ptr == '\\')
+		{
+			appendPQExpBufferChar(buffer, '\\');
+		}
+		appendPQExpBufferChar(buffer, *ptr);
+	}
+
+	appendPQExpBufferChar(buffer, '"');
+}
+
+
+/*
+ * monitor_set_node_properties calls pgautofailover.set_node_properties() on
+ * the monitor, so that the candidate priority and replication quorum changes
+ * of all the given nodes are done in a single transaction, and the primary
+ * node of each group applies them in a single apply_settings transition. We
+ * set applySettingsCount to how many primary nodes have to do that.
+ */
+bool
+monitor_set_node_properties(Monitor *monitor, char *formation,
+							NodePropertiesArray *propertiesArray,
+							int *applySettingsCount)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_node_properties"
+		"($1, $2::text[], $3::int[], $4::bool[])";
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[4];
+
+	PQExpBuffer names = createPQExpBuffer();
+	PQExpBuffer priorities = createPQExpBuffer();
+	PQExpBuffer quorums = createPQExpBuffer();
+
+	if (names == NULL || priorities == NULL || quorums == NULL)
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(names);
+		destroyPQExpBuffer(priorities);
+		destroyPQExpBuffer(quorums);
+		return false;
+	}
+
+	appendPQExpBufferChar(names, '{');
+	appendPQExpBufferChar(priorities, '{');
+	appendPQExpBufferChar(quorums, '{');
+
+	for (int i = 0; i < propertiesArray->count; i++)
+	{
+		NodeProperties *properties = &(propertiesArray->nodes[i]);
+		IntString priorityString = intToString(properties->candidatePriority);
+		char *quorumString = properties->replicationQuorum ? "true" : "false";
+
+		appendArrayElement(names, properties->name);
+
+		appendArrayElement(priorities,
+						   properties->hasCandidatePriority
+						   ? priorityString.strValue
+						   : NULL);
+
+		appendArrayElement(quorums,
+						   properties->hasReplicationQuorum
+						   ? quorumString
+						   : NULL);
+	}
+
+	appendPQExpBufferChar(names, '}');
+	appendPQExpBufferChar(priorities, '}');
+	appendPQExpBufferChar(quorums, '}');
+
+	if (PQExpBufferBroken(names) ||
+		PQExpBufferBroken(priorities) ||
+		PQExpBufferBroken(quorums))
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(names);
+		destroyPQExpBuffer(priorities);
+		destroyPQExpBuffer(quorums);
+		return false;
+	}
+
+	paramValues[0] = formation;
+	paramValues[1] = names->data;
+	paramValues[2] = priorities->data;
+	paramValues[3] = quorums->data;
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql,
+								  paramCount, paramTypes, paramValues,
+								  &context, &parseSingleValueResult);
+
+	destroyPQExpBuffer(names);
+	destroyPQExpBuffer(priorities);
+	destroyPQExpBuffer(quorums);
+
+	if (!success)
+	{
+		log_error("Failed to set the properties of %d nodes in formation "
+				  "\"%s\" on the monitor",
+				  propertiesArray->count, formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to set the properties of %d nodes in formation "
+				  "\"%s\" on the monitor: could not parse monitor's result.",
+				  propertiesArray->count, formation);
+		return false;
+	}
+
+	log_info("Updated the properties of %d nodes in formation \"%s\"",
+			 propertiesArray->count, formation);
+
+	*applySettingsCount = context.intVal;
+
+	return true;
+}
+
+
 /*
  * monitor_get_formation_number_sync_standbys retrieves number-sync-standbys
  * property for formation from the monitor. The function returns true upon
@@ -1210,6 +1888,135 @@ monitor_set_formation_number_sync_standbys(Monitor *monitor, char *formation,
 }
 
 
+/*
+ * monitor_get_formation_maximum_backup_rate retrieves the maximum backup rate
+ * of the nodes of the formation from the monitor. When the formation does not
+ * set a maximum backup rate, an empty string is returned, and each node uses
+ * its own replication.maximum_backup_rate setting.
+ */
+bool
+monitor_get_formation_maximum_backup_rate(Monitor *monitor, char *formation,
+										  char *maximumBackupRate, size_t size)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT coalesce(maximum_backup_rate, '') "
+		"  FROM pgautofailover.formation "
+		" WHERE formationid = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1];
+	SingleValueResultContext parseContext =
+	{ { 0 }, PGSQL_RESULT_STRING, false };
+	paramValues[0] = formation;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to retrieve settings for formation \"%s\".",
+				  formation);
+
+		if (parseContext.strVal)
+		{
+			free(parseContext.strVal);
+		}
+		return false;
+	}
+
+	if (!parseContext.parsedOk)
+	{
+		if (parseContext.strVal)
+		{
+			free(parseContext.strVal);
+		}
+		return false;
+	}
+
+	strlcpy(maximumBackupRate, parseContext.strVal, size);
+	free(parseContext.strVal);
+
+	return true;
+}
+
+
+/*
+ * monitor_set_formation_maximum_backup_rate sets the maximum backup rate of
+ * the nodes of the formation on the monitor. An empty string resets the
+ * formation setting. The function returns true upon success.
+ */
+bool
+monitor_set_formation_maximum_backup_rate(Monitor *monitor, char *formation,
+										  char *maximumBackupRate)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.set_formation_maximum_backup_rate($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2];
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BOOL, false };
+	paramValues[0] = formation;
+	paramValues[1] = maximumBackupRate;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseSingleValueResult))
+	{
+		log_error("Failed to update maximum-backup-rate for formation \"%s\".",
+				  formation);
+		return false;
+	}
+
+	if (!parseContext.parsedOk)
+	{
+		return false;
+	}
+
+	if (!parseContext.boolVal)
+	{
+		log_error("Formation \"%s\" does not exist on the monitor", formation);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_report_transition_timing calls the
+ * pgautofailover.report_transition_timing function on the monitor, so that
+ * the timings of an FSM transition are found in the events table.
+ */
+bool
+monitor_report_transition_timing(Monitor *monitor, int64_t nodeId,
+								 const char *description)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_transition_timing($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { INT8OID, TEXTOID };
+	const char *paramValues[2];
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = description;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to report FSM transition timings of node %" PRId64
+				  " to the monitor",
+				  nodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_remove_by_hostname calls the pgautofailover.monitor_remove function
  * on the monitor.
@@ -1317,6 +2124,58 @@ monitor_remove_by_nodename(Monitor *monitor,
 }
 
 
+/*
+ * monitor_remove_by_nodenames calls the pgautofailover.remove_nodes function
+ * on the monitor for the given comma separated list of node names, so that
+ * all the nodes are removed in a single transaction.
+ */
+bool
+monitor_remove_by_nodenames(Monitor *monitor,
+							char *formation, char *names, bool force)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT coalesce(pgautofailover.remove_nodes(array_agg(nodeid), $3), 0)"
+		"  FROM pgautofailover.node"
+		" WHERE formationid = $1"
+		"   AND nodename = ANY(string_to_array($2, ','))";
+
+	int paramCount = 3;
+	Oid paramTypes[3] = { TEXTOID, TEXTOID, BOOLOID };
+	const char *paramValues[3] = { formation, names, force ? "true" : "false" };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to remove nodes \"%s\" in formation \"%s\" "
+				  "from the monitor", names, formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to remove nodes \"%s\" in formation \"%s\" "
+				  "from the monitor: could not parse monitor's result.",
+				  names, formation);
+		return false;
+	}
+
+	if (context.intVal == 0)
+	{
+		log_error("Failed to find nodes \"%s\" in formation \"%s\" "
+				  "on the monitor", names, formation);
+		return false;
+	}
+
+	log_info("Removed %d nodes from formation \"%s\"",
+			 context.intVal, formation);
+
+	return true;
+}
+
+
 /*
  * monitor_count_groups counts how many groups we have in this formation, and
  * sets the obtained value in the groupsCount parameter.
@@ -1413,6 +2272,63 @@ monitor_perform_failover(Monitor *monitor, char *formation, int group)
 }
 
 
+/*
+ * monitor_report_drill_outage calls the pgautofailover.report_drill_outage
+ * function on the monitor, with an outage that an application saw, so that
+ * the monitor may account for it in the failover drills that it overlaps.
+ */
+bool
+monitor_report_drill_outage(Monitor *monitor, char *formation, int group,
+							uint64_t startEpochMs, uint64_t durationMs)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_drill_outage($1, $2, "
+		"to_timestamp($3 / 1000.0), $4 * interval '1 ms')";
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, INT4OID, INT8OID, INT8OID };
+	const char *paramValues[4];
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+
+	IntString groupString = intToString(group);
+	IntString startString = intToString(startEpochMs);
+	IntString durationString = intToString(durationMs);
+
+	paramValues[0] = formation;
+	paramValues[1] = groupString.strValue;
+	paramValues[2] = startString.strValue;
+	paramValues[3] = durationString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to report an outage to the failover drills "
+				  "of formation %s and group %d", formation, group);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to report an outage to the failover drills "
+				  "of formation %s and group %d because the monitor returned "
+				  "an unexpected result. See previous line for details.",
+				  formation, group);
+		return false;
+	}
+
+	if (context.intVal > 0)
+	{
+		log_info("Reported an outage of %" PRIu64 " ms "
+				 "to %d failover drill(s) of formation %s and group %d",
+				 durationMs, context.intVal, formation, group);
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_perform_promotion calls the pgautofailover.perform_promotion
  * function on the monitor.
@@ -1615,9 +2531,11 @@ parseNodeState(void *ctx, PGresult *result)
 	 * We re-use the same data structure for register_node and node_active,
 	 * where the former adds the nodename to its result.
 	 */
-	if (PQnfields(result) != 5 && PQnfields(result) != 6)
+	if (PQnfields(result) != 5 && PQnfields(result) != 6 &&
+		(PQnfields(result) < 9 || PQnfields(result) > 11))
 	{
-		log_error("Query returned %d columns, expected 5 or 6", PQnfields(result));
+		log_error("Query returned %d columns, expected 5, 6, or 9 to 11",
+				  PQnfields(result));
 		context->parsedOK = false;
 		return;
 	}
@@ -1680,28 +2598,377 @@ parseNodeState(void *ctx, PGresult *result)
 				sizeof(context->assignedState->name));
 	}
 
-	/* if we reach this line, then we're good. */
-	context->parsedOK = true;
-}
+	/*
+	 * node_active_v2 adds the other nodes, the group version, the report
+	 * interval, and since the 1.6 version of the extension the failover trace
+	 * id and the synchronous_standby_names value pushed to a primary node.
+	 */
+	if (PQnfields(result) >= 9)
+	{
+		MonitorAssignedState *assignedState = context->assignedState;
+
+		value = PQgetvalue(result, 0, 7);
+
+		if (!stringToInt64(value, &assignedState->groupVersion))
+		{
+			log_error("Invalid group version \"%s\" returned by monitor",
+					  value);
+			context->parsedOK = false;
+			return;
+		}
+
+		value = PQgetvalue(result, 0, 8);
+
+		if (!stringToInt(value, &assignedState->reportIntervalMs))
+		{
+			log_error("Invalid report interval \"%s\" returned by monitor",
+					  value);
+			context->parsedOK = false;
+			return;
+		}
+
+		value = PQgetvalue(result, 0, 5);
+
+		if (!stringToInt64(value, &assignedState->nodesVersion))
+		{
+			log_error("Invalid nodes version \"%s\" returned by monitor",
+					  value);
+			context->parsedOK = false;
+			return;
+		}
+
+		if (PQgetisnull(result, 0, 6))
+		{
+			assignedState->otherNodesKnown = true;
+		}
+		else
+		{
+			value = PQgetvalue(result, 0, 6);
+
+			if (!parseNodesArray(value,
+								 &(assignedState->otherNodes),
+								 assignedState->nodeId))
+			{
+				log_error("Failed to parse the other nodes returned by monitor");
+				context->parsedOK = false;
+				return;
+			}
+
+			assignedState->hasOtherNodes = true;
+		}
+
+		if (PQnfields(result) >= 10 && !PQgetisnull(result, 0, 9))
+		{
+			strlcpy(assignedState->traceId,
+					PQgetvalue(result, 0, 9),
+					sizeof(assignedState->traceId));
+		}
+
+		if (PQnfields(result) == 11 && !PQgetisnull(result, 0, 10))
+		{
+			assignedState->hasSynchronousStandbyNames = true;
+			strlcpy(assignedState->synchronousStandbyNames,
+					PQgetvalue(result, 0, 10),
+					sizeof(assignedState->synchronousStandbyNames));
+		}
+	}
+
+	/* if we reach this line, then we're good. */
+	context->parsedOK = true;
+}
+
+
+/*
+ * CurrentStatePageParams holds the parameters of a call to
+ * pgautofailover.current_state_page(), NULL meaning no filter.
+ */
+typedef struct CurrentStatePageParams
+{
+	Oid types[8];
+	const char *values[8];
+	IntString groupId;
+	IntString health;
+	IntString afterGroupId;
+	IntString afterNodeId;
+	IntString pageSize;
+} CurrentStatePageParams;
+
+
+/*
+ * prepareCurrentStatePageParams prepares the parameters of a call to
+ * pgautofailover.current_state_page() for the given filter, the page that
+ * starts after the given node when hasKey is true, and the given page size.
+ */
+static void
+prepareCurrentStatePageParams(CurrentStatePageParams *params,
+							  const char *formation,
+							  CurrentStateFilter *filter,
+							  bool hasKey,
+							  int afterGroupId,
+							  int64_t afterNodeId,
+							  int pageSize)
+{
+	/* node_state is an enum, let the monitor infer its type */
+	Oid types[8] = {
+		TEXTOID, INT4OID, 0, INT4OID, BOOLOID, INT4OID, INT8OID, INT4OID
+	};
+
+	memcpy(params->types, types, sizeof(types));
+
+	params->groupId = intToString(filter->groupId);
+	params->health = intToString(filter->health);
+	params->afterGroupId = intToString(afterGroupId);
+	params->afterNodeId = intToString(afterNodeId);
+	params->pageSize = intToString(pageSize);
+
+	params->values[0] = formation;
+	params->values[1] = filter->groupId >= 0 ? params->groupId.strValue : NULL;
+	params->values[2] =
+		filter->state != NO_STATE ? NodeStateToString(filter->state) : NULL;
+	params->values[3] = filter->filterHealth ? params->health.strValue : NULL;
+	params->values[4] = filter->laggingOnly ? "true" : "false";
+	params->values[5] = hasKey ? params->afterGroupId.strValue : NULL;
+	params->values[6] = hasKey ? params->afterNodeId.strValue : NULL;
+	params->values[7] = pageSize > 0 ? params->pageSize.strValue : NULL;
+}
 
 
 /*
- * monitor_print_state calls the function pgautofailover.current_state on the
- * monitor, and prints a line of output per state record obtained.
+ * monitor_print_state calls the function pgautofailover.current_state_page
+ * on the monitor, and prints a line of output per state record obtained.
+ *
+ * The nodes are fetched a page at a time, using the group and node id of the
+ * last node of a page as the key of the next one, and each page is printed
+ * as soon as it's received. The widths of the columns are computed from the
+ * first page.
  */
 bool
-monitor_print_state(Monitor *monitor, char *formation, int group)
+monitor_print_state(Monitor *monitor, char *formation,
+					CurrentStateFilter *filter)
 {
 	CurrentNodeStateArray nodesArray = { 0 };
+	NodeAddressHeaders headers = { 0 };
 	CurrentNodeStateContext context = { { 0 }, &nodesArray, false };
-	PGSQL *pgsql = &monitor->pgsql;
+
+	const char *sql =
+		"SELECT * FROM pgautofailover.current_state_page"
+		"($1, $2, $3::pgautofailover.replication_state, $4, $5, $6, $7, $8)";
+
+	int pageSize =
+		filter->pageSize > 0 && filter->pageSize < NODE_ARRAY_MAX_COUNT
+		? filter->pageSize
+		: NODE_ARRAY_MAX_COUNT;
+
+	bool hasKey = false;
+	int afterGroupId = 0;
+	int64_t afterNodeId = 0;
+	int pageCount = 0;
+
+	log_trace("monitor_print_state(%s, %d)", formation, filter->groupId);
+
+	do {
+		CurrentStatePageParams params = { 0 };
+
+		(void) prepareCurrentStatePageParams(&params, formation, filter,
+											 hasKey, afterGroupId, afterNodeId,
+											 pageSize);
+
+		context.parsedOK = false;
+
+		if (!monitor_execute_read(monitor, sql,
+								  8, params.types, params.values,
+								  &context, &parseCurrentState))
+		{
+			log_error("Failed to retrieve current state from the monitor");
+			return false;
+		}
+
+		if (!context.parsedOK)
+		{
+			log_error("Failed to parse current state from the monitor");
+			return false;
+		}
+
+		if (pageCount++ == 0)
+		{
+			PgInstanceKind firstNodeKind =
+				nodesArray.count > 0
+				? nodesArray.nodes[0].pgKind
+				: NODE_KIND_UNKNOWN;
+
+			(void) nodestatePrepareHeaders(&nodesArray, firstNodeKind);
+
+			headers = nodesArray.headers;
+
+			(void) nodestatePrintHeader(&headers);
+		}
+
+		for (int position = 0; position < nodesArray.count; position++)
+		{
+			(void) nodestatePrintNodeState(&headers,
+										   &(nodesArray.nodes[position]));
+		}
+		fflush(stdout);
+
+		if (nodesArray.count > 0)
+		{
+			CurrentNodeState *lastNode = &(nodesArray.nodes[nodesArray.count - 1]);
+
+			hasKey = true;
+			afterGroupId = lastNode->groupId;
+			afterNodeId = lastNode->node.nodeId;
+		}
+	} while (nodesArray.count == pageSize);
+
+	fformat(stdout, "\n");
+
+	return true;
+}
+
+
+/*
+ * monitor_print_catchup_progress prints the apply rate, catch-up rate, lag,
+ * and catch-up ETA of the nodes that are in, or assigned to, the catchingup or
+ * join_secondary state, as their keepers reported them. The ETA is the time
+ * the node is expected to need to get within
+ * pgautofailover.enable_sync_wal_log_threshold of its primary, when the
+ * monitor assigns it the secondary state. Nothing is printed when no node is
+ * catching up.
+ */
+bool
+monitor_print_catchup_progress(Monitor *monitor, char *formation, int group)
+{
+	CatchupProgressParseContext context = { { 0 }, false };
+
+	/*
+	 * The other nodes of the group that are catching up are behind the
+	 * primary, so the most advanced LSN of the group is the primary's.
+	 */
+	const char *sql =
+		"SELECT node.nodename, "
+		"       coalesce(pg_size_pretty(rp.apply_rate) || '/s', 'unknown'), "
+		"       coalesce(pg_size_pretty(rp.catchup_rate) || '/s', 'unknown'), "
+		"       coalesce(pg_size_pretty("
+		"                  greatest(upstream.lsn - node.reportedlsn, 0)), "
+		"                'unknown'), "
+		"       coalesce(date_trunc('second', rp.catchup_eta)::text, "
+		"                'unknown') "
+		"  FROM pgautofailover.replay_progress() AS rp "
+		"       JOIN pgautofailover.node ON node.nodeid = rp.nodeid, "
+		"       LATERAL (SELECT max(other.reportedlsn) AS lsn "
+		"                  FROM pgautofailover.node AS other "
+		"                 WHERE other.formationid = node.formationid "
+		"                   AND other.groupid = node.groupid "
+		"                   AND other.nodeid <> node.nodeid) AS upstream "
+		" WHERE node.formationid = $1 "
+		"   AND ($2::int IS NULL OR node.groupid = $2::int) "
+		"   AND (node.reportedstate IN ('catchingup', 'join_secondary') "
+		"        OR node.goalstate IN ('catchingup', 'join_secondary')) "
+		"ORDER BY node.groupid, node.nodeid";
+
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2];
+	IntString groupString = intToString(group);
+
+	paramValues[0] = formation;
+	paramValues[1] = group >= 0 ? groupString.strValue : NULL;
+
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &printCatchupProgress))
+	{
+		log_error("Failed to retrieve the catch-up progress from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOK)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * printCatchupProgress loops over the results of the SQL query in
+ * monitor_print_catchup_progress and outputs the result in table like
+ * format.
+ */
+static void
+printCatchupProgress(void *ctx, PGresult *result)
+{
+	CatchupProgressParseContext *context = (CatchupProgressParseContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	int maxNodeNameSize = 4;    /* "Name" */
+	char nodeNameSeparator[BUFSIZE] = { 0 };
+
+	if (PQnfields(result) != 5)
+	{
+		log_error("Query returned %d columns, expected 5", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (nTuples == 0)
+	{
+		context->parsedOK = true;
+		return;
+	}
+
+	for (int index = 0; index < nTuples; index++)
+	{
+		int size = strlen(PQgetvalue(result, index, 0));
+
+		if (size > maxNodeNameSize)
+		{
+			maxNodeNameSize = size;
+		}
+	}
+
+	(void) prepareHostNameSeparator(nodeNameSeparator, maxNodeNameSize);
+
+	fformat(stdout, "%*s | %12s | %13s | %10s | %10s\n",
+			maxNodeNameSize, "Name",
+			"Apply Rate", "Catch-up Rate", "Lag", "ETA");
+	fformat(stdout, "%*s-+-%12s-+-%13s-+-%10s-+-%10s\n",
+			maxNodeNameSize, nodeNameSeparator,
+			"------------", "-------------", "----------", "----------");
+
+	for (int index = 0; index < nTuples; index++)
+	{
+		fformat(stdout, "%*s | %12s | %13s | %10s | %10s\n",
+				maxNodeNameSize, PQgetvalue(result, index, 0),
+				PQgetvalue(result, index, 1),
+				PQgetvalue(result, index, 2),
+				PQgetvalue(result, index, 3),
+				PQgetvalue(result, index, 4));
+	}
+	fformat(stdout, "\n");
+
+	context->parsedOK = true;
+}
+
+
+/*
+ * monitor_get_current_state calls the function pgautofailover.current_state
+ * on the monitor, and fills in the given nodesArray with the result.
+ */
+bool
+monitor_get_current_state(Monitor *monitor, char *formation, int group,
+						  CurrentNodeStateArray *nodesArray)
+{
+	CurrentNodeStateContext context = { { 0 }, nodesArray, false };
 	char *sql = NULL;
 	int paramCount = 0;
 	Oid paramTypes[2];
 	const char *paramValues[2];
 	IntString groupStr;
 
-	log_trace("monitor_print_state(%s, %d)", formation, group);
+	log_trace("monitor_get_current_state(%s, %d)", formation, group);
 
 	switch (group)
 	{
@@ -1736,9 +3003,9 @@ monitor_print_state(Monitor *monitor, char *formation, int group)
 		}
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &printCurrentState))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &parseCurrentState))
 	{
 		log_error("Failed to retrieve current state from the monitor");
 		return false;
@@ -1961,24 +3228,29 @@ parseCurrentNodeStateArray(CurrentNodeStateArray *nodesArray, PGresult *result)
 
 
 /*
- * printCurrentState loops over pgautofailover.current_state() results and
- * prints them, one per line.
+ * parseCurrentState parses pgautofailover.current_state() results into the
+ * context's nodesArray.
  */
 static void
-printCurrentState(void *ctx, PGresult *result)
+parseCurrentState(void *ctx, PGresult *result)
 {
 	CurrentNodeStateContext *context = (CurrentNodeStateContext *) ctx;
-	CurrentNodeStateArray *nodesArray = context->nodesArray;
+
+	/* errors have already been logged */
+	context->parsedOK = parseCurrentNodeStateArray(context->nodesArray, result);
+}
+
+
+/*
+ * printCurrentStateArray prints the given nodes states, one per line, with
+ * a table header.
+ */
+static void
+printCurrentStateArray(CurrentNodeStateArray *nodesArray)
+{
 	NodeAddressHeaders *headers = &(nodesArray->headers);
 	PgInstanceKind firstNodeKind = NODE_KIND_UNKNOWN;
 
-	if (!parseCurrentNodeStateArray(nodesArray, result))
-	{
-		/* errors have already been logged */
-		context->parsedOK = false;
-		return;
-	}
-
 	if (nodesArray->count > 0)
 	{
 		firstNodeKind = nodesArray->nodes[0].pgKind;
@@ -1987,7 +3259,7 @@ printCurrentState(void *ctx, PGresult *result)
 	(void) nodestatePrepareHeaders(nodesArray, firstNodeKind);
 	(void) nodestatePrintHeader(headers);
 
-	for (int position = 0; position < context->nodesArray->count; position++)
+	for (int position = 0; position < nodesArray->count; position++)
 	{
 		CurrentNodeState *nodeState = &(nodesArray->nodes[position]);
 
@@ -1995,86 +3267,39 @@ printCurrentState(void *ctx, PGresult *result)
 	}
 
 	fformat(stdout, "\n");
-
-	context->parsedOK = true;
 }
 
 
 /*
  * monitor_print_state_as_json prints to given stream a single string that
- * contains the JSON representation of the current state on the monitor.
+ * contains the JSON representation of the current state on the monitor. The
+ * rows are already printed as soon as they are received, so we don't need
+ * to use pages here.
  */
 bool
-monitor_print_state_as_json(Monitor *monitor, char *formation, int group)
+monitor_print_state_as_json(Monitor *monitor, char *formation,
+							CurrentStateFilter *filter)
 {
-	SingleValueResultContext context = { 0 };
-	PGSQL *pgsql = &monitor->pgsql;
-	char *sql = NULL;
-	int paramCount = 0;
-	Oid paramTypes[2];
-	const char *paramValues[2];
-	IntString groupStr;
-
-	log_trace("monitor_get_state_as_json(%s, %d)", formation, group);
-
-	context.resultType = PGSQL_RESULT_STRING;
-	context.parsedOk = false;
-
-	switch (group)
-	{
-		case -1:
-		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(state)), '[]'))"
-				  " FROM pgautofailover.current_state($1) as state";
-
-			paramCount = 1;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-
-			break;
-		}
-
-		default:
-		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(state)), '[]'))"
-				  "FROM pgautofailover.current_state($1,$2) as state";
-
-			groupStr = intToString(group);
+	CurrentStatePageParams params = { 0 };
+	const char *sql =
+		"SELECT jsonb_pretty(to_jsonb(state))"
+		" FROM pgautofailover.current_state_page"
+		"($1, $2, $3::pgautofailover.replication_state, $4, $5, $6, $7, $8)"
+		" as state";
 
-			paramCount = 2;
-			paramTypes[0] = TEXTOID;
-			paramValues[0] = formation;
-			paramTypes[1] = INT4OID;
-			paramValues[1] = groupStr.strValue;
+	log_trace("monitor_get_state_as_json(%s, %d)", formation, filter->groupId);
 
-			break;
-		}
-	}
+	(void) prepareCurrentStatePageParams(&params, formation, filter,
+										 false, 0, 0, 0);
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_print_json_array(monitor, sql,
+								  8, params.types, params.values,
+								  stdout))
 	{
 		log_error("Failed to retrieve current state from the monitor");
 		return false;
 	}
 
-	if (!context.parsedOk)
-	{
-		log_error("Failed to parse current state from the monitor");
-		log_error("%s", context.strVal);
-		if (context.strVal)
-		{
-			free(context.strVal);
-		}
-		return false;
-	}
-
-	fformat(stdout, "%s\n", context.strVal);
-	free(context.strVal);
-
 	return true;
 }
 
@@ -2087,7 +3312,6 @@ bool
 monitor_print_last_events(Monitor *monitor, char *formation, int group, int count)
 {
 	MonitorAssignedStateParseContext context = { 0 };
-	PGSQL *pgsql = &monitor->pgsql;
 	char *sql = NULL;
 	int paramCount = 0;
 	Oid paramTypes[3];
@@ -2139,9 +3363,9 @@ monitor_print_last_events(Monitor *monitor, char *formation, int group, int coun
 		}
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &printLastEvents))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &printLastEvents))
 	{
 		log_error("Failed to retrieve current state from the monitor");
 		return false;
@@ -2167,8 +3391,6 @@ monitor_print_last_events_as_json(Monitor *monitor,
 								  int count,
 								  FILE *stream)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
-	PGSQL *pgsql = &monitor->pgsql;
 	char *sql = NULL;
 	int paramCount = 0;
 	Oid paramTypes[3];
@@ -2180,8 +3402,7 @@ monitor_print_last_events_as_json(Monitor *monitor,
 	{
 		case -1:
 		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(event)), '[]'))"
+			sql = "SELECT jsonb_pretty(to_jsonb(event))"
 				  " FROM pgautofailover.last_events($1, count => $2) as event";
 
 			countStr = intToString(count);
@@ -2197,9 +3418,8 @@ monitor_print_last_events_as_json(Monitor *monitor,
 
 		default:
 		{
-			sql = "SELECT jsonb_pretty("
-				  "coalesce(jsonb_agg(row_to_json(event)), '[]'))"
-				  " FROM * FROM pgautofailover.last_events($1,$2,$3) as event";
+			sql = "SELECT jsonb_pretty(to_jsonb(event))"
+				  " FROM pgautofailover.last_events($1,$2,$3) as event";
 
 			countStr = intToString(count);
 			groupStr = intToString(group);
@@ -2216,30 +3436,100 @@ monitor_print_last_events_as_json(Monitor *monitor,
 		}
 	}
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_print_json_array(monitor, sql,
+								  paramCount, paramTypes, paramValues,
+								  stream))
 	{
 		log_error("Failed to retrieve the last %d events from the monitor",
 				  count);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	return true;
+}
+
+
+/*
+ * monitor_print_json_array runs the given query, that returns one JSON value
+ * per row, and prints the rows as a JSON array as soon as they are received
+ * from the monitor. This uses a constant amount of memory however many nodes
+ * or events we are printing.
+ */
+static bool
+monitor_print_json_array(Monitor *monitor, const char *sql,
+						 int paramCount, const Oid *paramTypes,
+						 const char **paramValues, FILE *stream)
+{
+	JSONStreamContext context = { { 0 }, stream, 0 };
+	bool success = false;
+
+	if (monitor->hasReplica)
 	{
-		log_error("Failed to parse %d last events from the monitor", count);
-		log_error("%s", context.strVal);
-		if (context.strVal)
+		success = pgsql_execute_single_row(&(monitor->replica), sql,
+										   paramCount, paramTypes, paramValues,
+										   &context, &printJSONArrayElement);
+
+		/* once rows have been printed, we can't start over on the monitor */
+		if (!success && context.rowCount == 0)
 		{
-			free(context.strVal);
+			log_warn("Failed to query the monitor replica, "
+					 "querying the monitor instead");
 		}
+	}
+
+	if (!success && context.rowCount == 0)
+	{
+		success = pgsql_execute_single_row(&(monitor->pgsql), sql,
+										   paramCount, paramTypes, paramValues,
+										   &context, &printJSONArrayElement);
+	}
+
+	/* when we printed some rows already, terminate the array anyway */
+	if (!success && context.rowCount == 0)
+	{
 		return false;
 	}
 
-	fformat(stream, "%s\n", context.strVal);
-	free(context.strVal);
+	fformat(stream, context.rowCount == 0 ? "[\n]\n" : "\n]\n");
 
-	return true;
+	return success;
+}
+
+
+/*
+ * printJSONArrayElement prints a JSON value received from the monitor as an
+ * element of a JSON array, with the same indentation as jsonb_pretty() would
+ * use for the whole array.
+ */
+static void
+printJSONArrayElement(void *ctx, PGresult *result)
+{
+	JSONStreamContext *context = (JSONStreamContext *) ctx;
+
+	for (int row = 0; row < PQntuples(result); row++)
+	{
+		char *value = PQgetvalue(result, row, 0);
+		char *line = value;
+
+		fformat(context->stream, context->rowCount++ == 0 ? "[\n" : ",\n");
+
+		while (line != NULL && *line != '\0')
+		{
+			char *newline = strchr(line, '\n');
+
+			if (newline != NULL)
+			{
+				fformat(context->stream, "    %.*s\n",
+						(int) (newline - line), line);
+				line = newline + 1;
+			}
+			else
+			{
+				fformat(context->stream, "    %s", line);
+				line = NULL;
+			}
+		}
+	}
 }
 
 
@@ -2437,7 +3727,6 @@ monitor_formation_uri(Monitor *monitor,
 					  size_t size)
 {
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
-	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
 		"SELECT formation_uri "
 		"FROM pgautofailover.formation_uri($1, $2, $3, $4, $5)";
@@ -2451,9 +3740,9 @@ monitor_formation_uri(Monitor *monitor,
 	paramValues[3] = ssl->caFile;
 	paramValues[4] = ssl->crlFile;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &parseSingleValueResult))
 	{
 		log_error("Failed to list the formation uri for \"%s\", "
 				  "see previous lines for details.",
@@ -2489,6 +3778,188 @@ monitor_formation_uri(Monitor *monitor,
 }
 
 
+/*
+ * monitor_get_formation_shard calls the pgautofailover.formation_shard SQL
+ * API on the monitor, used as a directory of monitor shards. It copies the
+ * URI of the monitor that manages the given formation to shardPgURI, or an
+ * empty string when the formation is managed by this monitor.
+ */
+bool
+monitor_get_formation_shard(Monitor *monitor,
+							const char *formation,
+							char *shardPgURI,
+							size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	const char *sql = "SELECT pgautofailover.formation_shard($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { formation };
+
+	shardPgURI[0] = '\0';
+
+	if (!pgsql_execute_with_params(&(monitor->pgsql), sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get the monitor shard of formation \"%s\", "
+				  "see previous lines for details.",
+				  formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
+	}
+
+	if (context.strVal != NULL)
+	{
+		strlcpy(shardPgURI, context.strVal, size);
+		free(context.strVal);
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_use_formation_shard re-initializes the given monitor to connect to
+ * the monitor shard that manages the given formation, when the monitor we
+ * are connected to is a directory where the formation has been assigned to
+ * another monitor. The URI of that monitor is copied to shardPgURI, which is
+ * left empty when the formation is managed by the given monitor.
+ *
+ * We only follow the directory once: a monitor shard manages all the
+ * formations that are assigned to it.
+ */
+bool
+monitor_use_formation_shard(Monitor *monitor,
+							const char *formation,
+							char *shardPgURI,
+							size_t size)
+{
+	char scrubbedConnectionString[MAXCONNINFO] = { 0 };
+
+	if (!monitor_get_formation_shard(monitor, formation, shardPgURI, size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(shardPgURI))
+	{
+		return true;
+	}
+
+	(void) parse_and_scrub_connection_string(shardPgURI,
+											 scrubbedConnectionString);
+
+	log_info("Formation \"%s\" is managed by the monitor shard at \"%s\"",
+			 formation, scrubbedConnectionString);
+
+	pgsql_finish(&(monitor->pgsql));
+	pgsql_finish(&(monitor->notificationClient));
+
+	if (monitor->hasReplica)
+	{
+		pgsql_finish(&(monitor->replica));
+	}
+
+	return monitor_init(monitor, shardPgURI);
+}
+
+
+/*
+ * monitor_formation_read_only_uri calls the
+ * pgautofailover.formation_read_only_uri SQL API on the monitor to get a
+ * multi-host URI of the secondary nodes of the given formation, least
+ * lagging first. When maxLagBytes is positive, the
+ * secondary nodes that lag more than that are not part of the URI.
+ */
+bool
+monitor_formation_read_only_uri(Monitor *monitor,
+								const char *formation,
+								const char *citusClusterName,
+								const SSLOptions *ssl,
+								int64_t maxLagBytes,
+								char *connectionString,
+								size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	const char *sql =
+		"SELECT formation_read_only_uri "
+		"FROM pgautofailover.formation_read_only_uri($1, $2, $3, $4, $5, $6)";
+	int paramCount = 6;
+	Oid paramTypes[6] = {
+		TEXTOID, TEXTOID, TEXTOID, TEXTOID, TEXTOID, INT8OID
+	};
+	const char *paramValues[6] = { 0 };
+	IntString maxLagString = intToString(maxLagBytes);
+
+	paramValues[0] = formation;
+	paramValues[1] = citusClusterName;
+	paramValues[2] = ssl->sslModeStr;
+	paramValues[3] = ssl->caFile;
+	paramValues[4] = ssl->crlFile;
+
+	/* a NULL max_lag_bytes accepts any lag */
+	paramValues[5] = maxLagBytes > 0 ? maxLagString.strValue : NULL;
+
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get the read-only uri for \"%s\", "
+				  "see previous lines for details.",
+				  formation);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
+	}
+
+	if (context.strVal == NULL || strcmp(context.strVal, "") == 0)
+	{
+		if (maxLagBytes > 0)
+		{
+			log_error("Formation \"%s\" currently has no healthy secondary "
+					  "node in group 0 that lags less than %" PRId64 " bytes",
+					  formation, maxLagBytes);
+		}
+		else
+		{
+			log_error("Formation \"%s\" currently has no healthy secondary "
+					  "node in group 0",
+					  formation);
+		}
+
+		if (context.strVal)
+		{
+			free(context.strVal);
+		}
+		return false;
+	}
+
+	strlcpy(connectionString, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
 /*
  * monitor_print_every_formation_uri prints a table of all our connection
  * strings: first the monitor URI itself, and then one line per formation.
@@ -2497,7 +3968,6 @@ bool
 monitor_print_every_formation_uri(Monitor *monitor, const SSLOptions *ssl)
 {
 	FormationURIParseContext context = { 0 };
-	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
 		"SELECT 'monitor', 'monitor', $1 "
 		" UNION ALL "
@@ -2524,9 +3994,9 @@ monitor_print_every_formation_uri(Monitor *monitor, const SSLOptions *ssl)
 
 	context.parsedOK = false;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &printFormationURI))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &printFormationURI))
 	{
 		log_error("Failed to list the formation uri, "
 				  "see previous lines for details.");
@@ -2554,7 +4024,6 @@ monitor_print_every_formation_uri_as_json(Monitor *monitor,
 										  FILE *stream)
 {
 	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
-	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
 		"WITH formation(type, name, uri) AS ( "
 		"SELECT 'monitor', 'monitor', $1 "
@@ -2582,9 +4051,9 @@ monitor_print_every_formation_uri_as_json(Monitor *monitor,
 	paramValues[2] = ssl->caFile;
 	paramValues[3] = ssl->crlFile;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &parseSingleValueResult))
+	if (!monitor_execute_read(monitor, sql,
+							  paramCount, paramTypes, paramValues,
+							  &context, &parseSingleValueResult))
 	{
 		log_error("Failed to list the formation uri, "
 				  "see previous lines for details.");
@@ -3032,147 +4501,556 @@ monitor_update_node_metadata(Monitor *monitor,
 
 
 /*
- * monitor_set_node_system_identifier sets the node's sysidentifier column on
- * the monitor.
+ * monitor_report_replication_stats sends the replication progress of the
+ * standby nodes of the given primary node to the monitor, in a single call.
  */
 bool
-monitor_set_node_system_identifier(Monitor *monitor,
-								   int64_t nodeId,
-								   uint64_t system_identifier)
+monitor_report_replication_stats(Monitor *monitor,
+								 int64_t nodeId,
+								 ReplicationStatsReport *report)
 {
 	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
-		"SELECT * FROM pgautofailover.set_node_system_identifier($1, $2)";
-	int paramCount = 2;
-	Oid paramTypes[2] = { INT8OID, INT8OID };
-	const char *paramValues[2];
+		"SELECT pgautofailover.report_replication_stats"
+		"($1, $2::bigint[], "
+		"$3::pg_lsn[], $4::pg_lsn[], $5::pg_lsn[], $6::pg_lsn[], "
+		"$7::interval[], $8::interval[], $9::interval[])";
+	int paramCount = 9;
+	Oid paramTypes[9] = {
+		INT8OID, TEXTOID, TEXTOID, TEXTOID, TEXTOID,
+		TEXTOID, TEXTOID, TEXTOID, TEXTOID
+	};
+	const char *paramValues[9];
 
-	NodeAddress node = { 0 };
-	NodeAddressParseContext parseContext = { { 0 }, &node, false };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
 
 	paramValues[0] = intToString(nodeId).strValue;
-	paramValues[1] = intToString(system_identifier).strValue;
+	paramValues[1] = report->standbyIds;
+	paramValues[2] = report->sentLSNs;
+	paramValues[3] = report->writeLSNs;
+	paramValues[4] = report->flushLSNs;
+	paramValues[5] = report->replayLSNs;
+	paramValues[6] = report->writeLags;
+	paramValues[7] = report->flushLags;
+	paramValues[8] = report->replayLags;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
-								   &parseContext, parseNodeResult))
+								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to set_node_system_identifier of node %" PRId64
-				  " from the monitor", nodeId);
+		log_error("Failed to report replication stats of node %" PRId64
+				  " to the monitor", nodeId);
 		return false;
 	}
 
-	if (!parseContext.parsedOK)
+	if (!context.parsedOk)
 	{
-		/* *INDENT-OFF* */
-		log_error(
-			"Failed to set node %" PRId64" sysidentifier to \"%" PRId64 "\""
-			" on the monitor because it returned an unexpected result. "
-			"See previous line for details.",
-			nodeId, system_identifier);
-		/* *INDENT-ON* */
-
+		log_error("Failed to report replication stats of node %" PRId64
+				  " to the monitor because it returned an unexpected result. "
+				  "See previous line for details.",
+				  nodeId);
 		return false;
 	}
 
+	log_trace("Reported replication stats of %d standby nodes",
+			  context.intVal);
+
 	return true;
 }
 
 
 /*
- * monitor_set_group_system_identifier sets the node's sysidentifier column on
- * the monitor for all nodes in the same group, when the current sysidentifier
- * they have is zero. That's needed after an upgrade from 1.3 to 1.4.
+ * monitor_report_sync_rep_stall tells the monitor that commits have been
+ * waiting for synchronous replication for stallMs on the given primary
+ * node, and which of its standby nodes are streaming. The monitor sets
+ * degraded to true when it assigned new goal states to stop waiting for the
+ * other standby nodes.
  */
 bool
-monitor_set_group_system_identifier(Monitor *monitor,
-									int groupId,
-									uint64_t system_identifier)
+monitor_report_sync_rep_stall(Monitor *monitor,
+							  int64_t nodeId,
+							  char *streamingStandbyIds,
+							  int stallMs,
+							  bool *degraded)
 {
 	PGSQL *pgsql = &monitor->pgsql;
 	const char *sql =
-		"SELECT * FROM pgautofailover.set_group_system_identifier($1, $2)";
-	int paramCount = 2;
-	Oid paramTypes[2] = { INT8OID, INT8OID };
-	const char *paramValues[2];
+		"SELECT pgautofailover.report_sync_rep_stall($1, $2::bigint[], $3)";
+	int paramCount = 3;
+	Oid paramTypes[3] = { INT8OID, TEXTOID, INT4OID };
+	const char *paramValues[3];
 
-	SingleValueResultContext context = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
 
-	paramValues[0] = intToString(groupId).strValue;
-	paramValues[1] = intToString(system_identifier).strValue;
+	paramValues[0] = intToString(nodeId).strValue;
+	paramValues[1] = streamingStandbyIds;
+	paramValues[2] = intToString(stallMs).strValue;
 
 	if (!pgsql_execute_with_params(pgsql, sql,
 								   paramCount, paramTypes, paramValues,
-								   &context, &fetchedRows))
+								   &context, &parseSingleValueResult))
 	{
-		log_error("Failed to set_group_system_identifier for group %d "
-				  "from the monitor", groupId);
+		log_error("Failed to report synchronous replication stall of node %"
+				  PRId64 " to the monitor", nodeId);
 		return false;
 	}
 
 	if (!context.parsedOk)
 	{
-		/* *INDENT-OFF* */
-		log_error(
-			"Failed to set sysidentifier to \"%" PRIu64 "\" "
-			"for nodes in group %d "
-			"on the monitor because it returned an unexpected result. "
-			"See previous line for details.",
-			system_identifier, groupId);
-
-		/* *INDENT-ON* */
+		log_error("Failed to report synchronous replication stall of node %"
+				  PRId64 " to the monitor because it returned an unexpected "
+				  "result. See previous line for details.",
+				  nodeId);
 		return false;
 	}
 
-	if (context.intVal > 0)
-	{
-		log_info("Updated system identifier of %d nodes in group %d "
-				 "to the local node value \"%" PRIu64 "\"",
-				 context.intVal, groupId, system_identifier);
-	}
+	*degraded = context.boolVal;
 
 	return true;
 }
 
 
 /*
- * parseCoordinatorNode parses a hostname and a port from the libpq result and
- * writes it to the NodeAddressParseContext pointed to by ctx. This is about
- * the same as parseNode: the only difference is that an empty result set is
- * not an error condition in parseCoordinatorNode.
+ * monitor_report_storage_health sends the latency percentiles of the storage
+ * probes of the given node to the monitor, and how long the probe in progress
+ * has been waiting. The monitor sets stalled to true when it just found the
+ * storage of the node to be stalled for longer than it accepts.
  */
-static void
-parseCoordinatorNode(void *ctx, PGresult *result)
+bool
+monitor_report_storage_health(Monitor *monitor,
+							  int64_t nodeId,
+							  IOWatchdogStats *stats,
+							  bool *stalled)
 {
-	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_storage_health($1, $2, $3, $4, $5)";
+	int paramCount = 5;
+	Oid paramTypes[5] = { INT8OID, INT8OID, INT8OID, INT8OID, INT4OID };
+	const char *paramValues[5];
 
-	/* no rows, set the node to NULL, return */
-	if (PQntuples(result) == 0)
-	{
-		context->node = NULL;
-		context->parsedOK = true;
-		return;
-	}
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
 
-	/* we have rows: we accept only one */
-	if (PQntuples(result) != 1)
+	paramValues[0] = intToString(nodeId).strValue;
+	paramValues[1] = intToString(stats->p50Us).strValue;
+	paramValues[2] = intToString(stats->p99Us).strValue;
+	paramValues[3] = intToString(stats->maxUs).strValue;
+	paramValues[4] = intToString(stats->stallMs).strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
-		log_error("Query returned %d rows, expected 1", PQntuples(result));
-		context->parsedOK = false;
-		return;
+		log_error("Failed to report storage health of node %"
+				  PRId64 " to the monitor", nodeId);
+		return false;
 	}
 
-	if (PQnfields(result) != 2)
+	if (!context.parsedOk)
 	{
-		log_error("Query returned %d columns, expected 2", PQnfields(result));
-		context->parsedOK = false;
-		return;
+		log_error("Failed to report storage health of node %"
+				  PRId64 " to the monitor because it returned an unexpected "
+				  "result. See previous line for details.",
+				  nodeId);
+		return false;
 	}
 
-	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
-	{
-		log_error("Hostname or port returned by monitor is NULL");
-		context->parsedOK = false;
+	*stalled = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_report_wal_space sends the free space of the pg_wal file system of
+ * the given node to the monitor, with the WAL generation rate, and how long
+ * until pg_wal is full, -1 when the free space is not going down. The monitor
+ * sets exhausting to true when it just found that pg_wal is going to be full
+ * sooner than it accepts.
+ */
+bool
+monitor_report_wal_space(Monitor *monitor,
+						 int64_t nodeId,
+						 KeeperWalSpace *walSpace,
+						 bool *exhausting)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_wal_space($1, $2, $3, $4)";
+	int paramCount = 4;
+	Oid paramTypes[4] = { INT8OID, INT8OID, INT8OID, INT4OID };
+	const char *paramValues[4];
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	paramValues[0] = intToString(nodeId).strValue;
+	paramValues[1] = intToString(walSpace->freeBytes).strValue;
+	paramValues[2] = intToString((int64_t) walSpace->walRate).strValue;
+	paramValues[3] = intToString(walSpace->timeToFull).strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to report pg_wal free space of node %"
+				  PRId64 " to the monitor", nodeId);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to report pg_wal free space of node %"
+				  PRId64 " to the monitor because it returned an unexpected "
+				  "result. See previous line for details.",
+				  nodeId);
+		return false;
+	}
+
+	*exhausting = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * monitor_report_replay_progress sends the last received and replayed LSN of
+ * the given standby node to the monitor, with its apply rate in bytes per
+ * second, zero when unknown. The monitor uses that to rank the failover
+ * candidates by how long they need to be ready for promotion.
+ *
+ * We also send the staleness of the WAL receiver of the standby node, in
+ * milliseconds, or -1 when it's unknown, so that the monitor can treat
+ * a standby node with a stalled WAL receiver as lagging, and how fast the
+ * standby node catches up with its upstream node, in bytes per second, zero
+ * when unknown.
+ */
+bool
+monitor_report_replay_progress(Monitor *monitor,
+							   int64_t nodeId,
+							   const char *receivedLSN,
+							   const char *replayLSN,
+							   int64_t applyRate,
+							   int64_t receiverStalenessMs,
+							   int64_t catchupRate)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_replay_progress($1, $2, $3, $4, $5, $6)";
+	int paramCount = 6;
+	Oid paramTypes[6] = { INT8OID, LSNOID, LSNOID, INT8OID, INT8OID, INT8OID };
+	const char *paramValues[6];
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString applyRateString = intToString(applyRate);
+	IntString stalenessString = intToString(receiverStalenessMs);
+	IntString catchupRateString = intToString(catchupRate);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = receivedLSN;
+	paramValues[2] = replayLSN;
+	paramValues[3] = applyRateString.strValue;
+	paramValues[4] = stalenessString.strValue;
+	paramValues[5] = catchupRateString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to report replay progress of node %"
+				  PRId64 " to the monitor", nodeId);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to report replay progress of node %"
+				  PRId64 " to the monitor because it returned an unexpected "
+				  "result. See previous line for details.",
+				  nodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_report_replication_slots sends how much WAL the replication slots
+ * of the standby nodes of the given primary node retain to the monitor, in a
+ * single call. The monitor then returns the standby nodes whose slot is to be
+ * invalidated, in invalidateNodesArray.
+ */
+bool
+monitor_report_replication_slots(Monitor *monitor,
+								 int64_t nodeId,
+								 ReplicationSlotStatsReport *report,
+								 NodeAddressArray *invalidateNodesArray)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.report_replication_slots"
+		"($1, $2::bigint[], $3::bool[], $4::bigint[], $5::text[])";
+	int paramCount = 5;
+	Oid paramTypes[5] = { INT8OID, TEXTOID, TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[5];
+
+	NodeAddressArrayParseContext parseContext =
+	{ { 0 }, invalidateNodesArray, false };
+
+	paramValues[0] = intToString(nodeId).strValue;
+	paramValues[1] = report->standbyIds;
+	paramValues[2] = report->active;
+	paramValues[3] = report->retainedBytes;
+	paramValues[4] = report->walStatus;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeArray))
+	{
+		log_error("Failed to report replication slots of node %" PRId64
+				  " to the monitor", nodeId);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		log_error("Failed to report replication slots of node %" PRId64
+				  " to the monitor because it returned an unexpected result. "
+				  "See previous line for details.",
+				  nodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_report_node_latency sends the network round-trip times that the
+ * given node measured, in microseconds, to the monitor. The arguments are
+ * Postgres array literals: the node ids of the targets, NULL for the
+ * application anchors, their "host:port" and their round-trip time, -1 for
+ * the targets that couldn't be reached in time.
+ */
+bool
+monitor_report_node_latency(Monitor *monitor,
+							int64_t nodeId,
+							const char *targetNodeIds,
+							const char *targets,
+							const char *rttUs)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_node_latency"
+		"($1, $2::bigint[], $3::text[], $4::bigint[])";
+	int paramCount = 4;
+	Oid paramTypes[4] = { INT8OID, TEXTOID, TEXTOID, TEXTOID };
+	const char *paramValues[4];
+
+	IntString nodeIdString = intToString(nodeId);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = targetNodeIds;
+	paramValues[2] = targets;
+	paramValues[3] = rttUs;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to report network latency of node %" PRId64
+				  " to the monitor", nodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_report_drain_stats sends the write and prepared transactions in
+ * progress on the given primary node to the monitor, which uses them to
+ * refuse a switchover that would have to wait for too long.
+ */
+bool
+monitor_report_drain_stats(Monitor *monitor, int64_t nodeId, DrainStats *stats)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT pgautofailover.report_drain_stats($1, $2, $3, $4, $5)";
+	int paramCount = 5;
+	Oid paramTypes[5] = { INT8OID, INT4OID, INT8OID, INT4OID, INT8OID };
+	const char *paramValues[5];
+
+	IntString nodeIdString = intToString(nodeId);
+	IntString writeXactsString = intToString(stats->writeXacts);
+	IntString oldestWriteString = intToString(stats->oldestWriteXactMs);
+	IntString preparedXactsString = intToString(stats->preparedXacts);
+	IntString oldestPreparedString = intToString(stats->oldestPreparedXactMs);
+
+	paramValues[0] = nodeIdString.strValue;
+	paramValues[1] = writeXactsString.strValue;
+	paramValues[2] = oldestWriteString.strValue;
+	paramValues[3] = preparedXactsString.strValue;
+	paramValues[4] = oldestPreparedString.strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to report drain stats of node %" PRId64
+				  " to the monitor", nodeId);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_set_node_system_identifier sets the node's sysidentifier column on
+ * the monitor.
+ */
+bool
+monitor_set_node_system_identifier(Monitor *monitor,
+								   int64_t nodeId,
+								   uint64_t system_identifier)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.set_node_system_identifier($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { INT8OID, INT8OID };
+	const char *paramValues[2];
+
+	NodeAddress node = { 0 };
+	NodeAddressParseContext parseContext = { { 0 }, &node, false };
+
+	paramValues[0] = intToString(nodeId).strValue;
+	paramValues[1] = intToString(system_identifier).strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &parseContext, parseNodeResult))
+	{
+		log_error("Failed to set_node_system_identifier of node %" PRId64
+				  " from the monitor", nodeId);
+		return false;
+	}
+
+	if (!parseContext.parsedOK)
+	{
+		/* *INDENT-OFF* */
+		log_error(
+			"Failed to set node %" PRId64" sysidentifier to \"%" PRId64 "\""
+			" on the monitor because it returned an unexpected result. "
+			"See previous line for details.",
+			nodeId, system_identifier);
+		/* *INDENT-ON* */
+
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_set_group_system_identifier sets the node's sysidentifier column on
+ * the monitor for all nodes in the same group, when the current sysidentifier
+ * they have is zero. That's needed after an upgrade from 1.3 to 1.4.
+ */
+bool
+monitor_set_group_system_identifier(Monitor *monitor,
+									int groupId,
+									uint64_t system_identifier)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+	const char *sql =
+		"SELECT * FROM pgautofailover.set_group_system_identifier($1, $2)";
+	int paramCount = 2;
+	Oid paramTypes[2] = { INT8OID, INT8OID };
+	const char *paramValues[2];
+
+	SingleValueResultContext context = { 0 };
+
+	paramValues[0] = intToString(groupId).strValue;
+	paramValues[1] = intToString(system_identifier).strValue;
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &fetchedRows))
+	{
+		log_error("Failed to set_group_system_identifier for group %d "
+				  "from the monitor", groupId);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* *INDENT-OFF* */
+		log_error(
+			"Failed to set sysidentifier to \"%" PRIu64 "\" "
+			"for nodes in group %d "
+			"on the monitor because it returned an unexpected result. "
+			"See previous line for details.",
+			system_identifier, groupId);
+
+		/* *INDENT-ON* */
+		return false;
+	}
+
+	if (context.intVal > 0)
+	{
+		log_info("Updated system identifier of %d nodes in group %d "
+				 "to the local node value \"%" PRIu64 "\"",
+				 context.intVal, groupId, system_identifier);
+	}
+
+	return true;
+}
+
+
+/*
+ * parseCoordinatorNode parses a hostname and a port from the libpq result and
+ * writes it to the NodeAddressParseContext pointed to by ctx. This is about
+ * the same as parseNode: the only difference is that an empty result set is
+ * not an error condition in parseCoordinatorNode.
+ */
+static void
+parseCoordinatorNode(void *ctx, PGresult *result)
+{
+	NodeAddressParseContext *context = (NodeAddressParseContext *) ctx;
+
+	/* no rows, set the node to NULL, return */
+	if (PQntuples(result) == 0)
+	{
+		context->node = NULL;
+		context->parsedOK = true;
+		return;
+	}
+
+	/* we have rows: we accept only one */
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	if (PQgetisnull(result, 0, 0) || PQgetisnull(result, 0, 1))
+	{
+		log_error("Hostname or port returned by monitor is NULL");
+		context->parsedOK = false;
 		return;
 	}
 
@@ -3300,8 +5178,18 @@ monitor_stop_maintenance(Monitor *monitor, int64_t nodeId, bool *mayRetry)
  *
  * We use the pselect(2) facility to check if something is ready to be read on
  * the PQconn socket for us. When it's the case, return the next notification
- * message from the "state" channel. Other channel messages are sent to the log
- * directly.
+ * message from the "state" channels. Other channel messages are sent to the
+ * log directly.
+ *
+ * When wakeupFd is not -1, we also stop waiting as soon as it's readable, and
+ * then leave it to the caller to find out why.
+ *
+ * We drain all the notifications that are pending before calling the
+ * processing function. When coalesce is true, we only keep the latest state
+ * change of each node: when a group goes through several states quickly, the
+ * keeper then makes a single decision from the current state of the group,
+ * rather than waking up for every stale intermediate state. Callers that
+ * follow every step of a transition use false.
  *
  * When the function returns true, it's safe for the caller to sleep, otherwise
  * it's expected that the caller keeps polling the results to drain the queue
@@ -3310,12 +5198,15 @@ monitor_stop_maintenance(Monitor *monitor, int64_t nodeId, bool *mayRetry)
 static bool
 monitor_process_notifications(Monitor *monitor,
 							  int timeoutMs,
+							  int wakeupFd,
+							  bool coalesce,
 							  char *channels[],
 							  void *notificationContext,
 							  NotificationProcessingFunction processor)
 {
 	PGconn *connection = monitor->notificationClient.connection;
 	PGnotify *notify;
+	PendingNodeStates pending = { 0 };
 
 
 	sigset_t sig_mask;
@@ -3382,7 +5273,13 @@ monitor_process_notifications(Monitor *monitor,
 	FD_ZERO(&input_mask);
 	FD_SET(sock, &input_mask);
 
-	int ret = pselect(sock + 1, &input_mask, NULL, NULL, &timeout, &sig_mask_orig);
+	if (wakeupFd >= 0)
+	{
+		FD_SET(wakeupFd, &input_mask);
+	}
+
+	int maxFd = sock > wakeupFd ? sock : wakeupFd;
+	int ret = pselect(maxFd + 1, &input_mask, NULL, NULL, &timeout, &sig_mask_orig);
 
 	/* restore signal masks (un block them) now that pselect() is done */
 	(void) unblock_signals(&sig_mask_orig);
@@ -3403,44 +5300,152 @@ monitor_process_notifications(Monitor *monitor,
 
 	if (ret == 0)
 	{
-		/* we reached the timeout */
-		return true;
+		/* we reached the timeout */
+		return true;
+	}
+
+	if (!FD_ISSET(sock, &input_mask))
+	{
+		/* only the wakeupFd is readable */
+		return true;
+	}
+
+	/* Now check for input */
+	PQconsumeInput(connection);
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		if (strcmp(notify->relname, "log") == 0)
+		{
+			log_info("%s", notify->extra);
+		}
+		else if (monitor_is_state_channel(notify->relname))
+		{
+			CurrentNodeState *nodeStates = NULL;
+			int count = 0;
+
+			log_trace("received \"%s\"", notify->extra);
+
+			/* errors are logged by parse_state_notification_messages */
+			if (parse_state_notification_messages(&nodeStates,
+												  &count,
+												  notify->extra))
+			{
+				for (int index = 0; index < count; index++)
+				{
+					(void) monitor_pending_node_states_add(&pending,
+														   &(nodeStates[index]),
+														   coalesce);
+				}
+
+				free(nodeStates);
+			}
+		}
+		else
+		{
+			log_warn("BUG: received unknown notification on channel \"%s\": %s",
+					 notify->relname, notify->extra);
+		}
+
+		PQfreemem(notify);
+		PQconsumeInput(connection);
+	}
+
+	if (pending.received > pending.count)
+	{
+		log_debug("Coalesced %d state notifications into %d node states",
+				  pending.received, pending.count);
+	}
+
+	for (int index = 0; index < pending.count; index++)
+	{
+		(void) (*processor)(notificationContext, &(pending.nodeStates[index]));
 	}
 
-	/* Now check for input */
-	PQconsumeInput(connection);
-	while ((notify = PQnotifies(connection)) != NULL)
+	free(pending.nodeStates);
+
+	return true;
+}
+
+
+/*
+ * monitor_pending_node_states_add adds a state change to the pending ones.
+ * When coalesce is true and we already have a state change for the same node,
+ * we replace it, so that the node keeps its place in the processing order.
+ */
+static bool
+monitor_pending_node_states_add(PendingNodeStates *pending,
+								CurrentNodeState *nodeState,
+								bool coalesce)
+{
+	++pending->received;
+
+	if (coalesce)
 	{
-		if (strcmp(notify->relname, "log") == 0)
+		for (int index = 0; index < pending->count; index++)
 		{
-			log_info("%s", notify->extra);
-		}
-		else if (strcmp(notify->relname, "state") == 0)
-		{
-			CurrentNodeState nodeState = { 0 };
-
-			log_trace("received \"%s\"", notify->extra);
+			CurrentNodeState *pendingState = &(pending->nodeStates[index]);
 
-			/* errors are logged by parse_state_notification_message */
-			if (parse_state_notification_message(&nodeState, notify->extra))
+			if (pendingState->node.nodeId == nodeState->node.nodeId &&
+				strcmp(pendingState->formation, nodeState->formation) == 0)
 			{
-				(void) (*processor)(notificationContext, &nodeState);
+				*pendingState = *nodeState;
+				return true;
 			}
 		}
-		else
+	}
+
+	if (pending->count == pending->capacity)
+	{
+		int capacity = pending->capacity == 0 ? 8 : 2 * pending->capacity;
+		CurrentNodeState *nodeStates =
+			realloc(pending->nodeStates, capacity * sizeof(CurrentNodeState));
+
+		if (nodeStates == NULL)
 		{
-			log_warn("BUG: received unknown notification on channel \"%s\": %s",
-					 notify->relname, notify->extra);
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
 		}
 
-		PQfreemem(notify);
-		PQconsumeInput(connection);
+		pending->nodeStates = nodeStates;
+		pending->capacity = capacity;
 	}
 
+	pending->nodeStates[pending->count++] = *nodeState;
+
 	return true;
 }
 
 
+/*
+ * monitor_state_channel builds the name of the channel where the monitor
+ * notifies the state changes of the given formation and group, such as
+ * "state.default.0". The monitor only uses the "state" channel when that name
+ * does not fit in a Postgres identifier, and so do we.
+ */
+void
+monitor_state_channel(const char *formation, int groupId,
+					  char *channel, size_t size)
+{
+	sformat(channel, size, "state.%s.%d", formation, groupId);
+
+	if (strlen(channel) >= NAMEDATALEN)
+	{
+		strlcpy(channel, "state", size);
+	}
+}
+
+
+/*
+ * monitor_is_state_channel returns true when the given channel is either the
+ * "state" channel or a per-group "state.<formation>.<group>" channel.
+ */
+static bool
+monitor_is_state_channel(const char *channel)
+{
+	return strcmp(channel, "state") == 0 || strncmp(channel, "state.", 6) == 0;
+}
+
+
 /*
  * monitor_log_notifications is a Notification Processing Function that gets
  * all the notifications from the monitor and append them to our logs.
@@ -3466,6 +5471,8 @@ monitor_get_notifications(Monitor *monitor, int timeoutMs)
 
 	return monitor_process_notifications(monitor,
 										 timeoutMs,
+										 -1,
+										 false,
 										 channels,
 										 (void *) &context,
 										 &monitor_log_notifications);
@@ -3491,8 +5498,27 @@ monitor_notification_process_apply_settings(void *context,
 		return;
 	}
 
-	if (nodeState->reportedState == PRIMARY_STATE &&
-		nodeState->goalState == APPLY_SETTINGS_STATE)
+	/*
+	 * With pgautofailover.enable_direct_settings, the monitor pushes the new
+	 * synchronous_standby_names to the primary without apply_settings, and
+	 * the primary applies it with a reload as soon as it is notified.
+	 */
+	if (nodeState->hasSynchronousStandbyNames &&
+		nodeState->reportedState == PRIMARY_STATE &&
+		nodeState->goalState == PRIMARY_STATE)
+	{
+		ctx->applySettingsTransitionDone = true;
+
+		log_info("Primary node " NODE_FORMAT
+				 " is applying synchronous_standby_names '%s' directly",
+				 nodeState->node.nodeId,
+				 nodeState->node.name,
+				 nodeState->node.host,
+				 nodeState->node.port,
+				 nodeState->synchronousStandbyNames);
+	}
+	else if (nodeState->reportedState == PRIMARY_STATE &&
+			 nodeState->goalState == APPLY_SETTINGS_STATE)
 	{
 		ctx->applySettingsTransitionInProgress = true;
 
@@ -3609,6 +5635,8 @@ monitor_wait_until_primary_applied_settings(Monitor *monitor,
 		if (!monitor_process_notifications(
 				monitor,
 				PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT * 1000,
+				-1,
+				false,
 				channels,
 				(void *) &context,
 				&monitor_notification_process_apply_settings))
@@ -3631,71 +5659,415 @@ monitor_wait_until_primary_applied_settings(Monitor *monitor,
  * monitor and logs them.
  */
 static void
-monitor_notification_process_wait_for_state_change(void *context,
-												   CurrentNodeState *nodeState)
+monitor_notification_process_wait_for_state_change(void *context,
+												   CurrentNodeState *nodeState)
+{
+	WaitForStateChangeNotificationContext *ctx =
+		(WaitForStateChangeNotificationContext *) context;
+
+	/* filter notifications for our own formation */
+	if (strcmp(nodeState->formation, ctx->formation) != 0 ||
+		nodeState->groupId != ctx->groupId)
+	{
+		return;
+	}
+
+	/* here, we received a state change that belongs to our formation/group */
+	ctx->stateHasChanged = true;
+	nodestate_log(nodeState, LOG_INFO, ctx->nodeId);
+
+	/* coalesced notifications keep the last value pushed to our node */
+	if (nodeState->node.nodeId == ctx->nodeId &&
+		nodeState->hasSynchronousStandbyNames)
+	{
+		ctx->hasPushedSettings = true;
+		strlcpy(ctx->synchronousStandbyNames,
+				nodeState->synchronousStandbyNames,
+				sizeof(ctx->synchronousStandbyNames));
+	}
+}
+
+
+/*
+ * monitor_wait_for_state_change waits for timeout milliseconds or until we
+ * receive a notification for a state change concerning the given nodeId,
+ * whichever comes first. When wakeupFd is not -1, we also stop waiting as
+ * soon as it is readable.
+ *
+ * When we have received at least one notification for the given groupId then
+ * the stateHasChanged boolean is set to true, otherwise it's set to false.
+ */
+bool
+monitor_wait_for_state_change(Monitor *monitor,
+							  const char *formation,
+							  int groupId,
+							  int64_t nodeId,
+							  int timeoutMs,
+							  int wakeupFd,
+							  bool *stateHasChanged)
+{
+	PGconn *connection = monitor->notificationClient.connection;
+
+	WaitForStateChangeNotificationContext context = {
+		(char *) formation,
+		groupId,
+		nodeId,
+		false                   /* stateHasChanged */
+	};
+
+	char groupChannel[BUFSIZE] = { 0 };
+	char *channels[] = { groupChannel, NULL };
+
+	if (connection == NULL)
+	{
+		log_warn("Lost connection.");
+		return false;
+	}
+
+	if (monitor->useStateChangeWait)
+	{
+		return monitor_wait_for_state_change_count(monitor,
+												   formation,
+												   groupId,
+												   timeoutMs,
+												   wakeupFd,
+												   stateHasChanged);
+	}
+
+	/* only wake-up for notifications about our own group */
+	(void) monitor_state_channel(formation, groupId,
+								 groupChannel, sizeof(groupChannel));
+
+	/* the keeper only needs the latest state of each node to decide */
+	if (!monitor_process_notifications(
+			monitor,
+			timeoutMs,
+			wakeupFd,
+			true,
+			channels,
+			(void *) &context,
+			&monitor_notification_process_wait_for_state_change))
+	{
+		return false;
+	}
+
+	*stateHasChanged = context.stateHasChanged;
+
+	if (context.hasPushedSettings)
+	{
+		monitor->hasPushedSettings = true;
+		strlcpy(monitor->pushedSynchronousStandbyNames,
+				context.synchronousStandbyNames,
+				sizeof(monitor->pushedSynchronousStandbyNames));
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_wait_for_state_change_count waits for a state change in our group
+ * with pgautofailover.wait_for_state_change(), which only wakes up the
+ * monitor backends that wait on that group, where LISTEN wakes up every
+ * listening backend for every notification sent in the monitor database.
+ *
+ * The query is sent asynchronously so that we still stop waiting as soon as
+ * wakeupFd is readable or we receive a signal, in which case the query is
+ * canceled and the connection closed.
+ */
+static bool
+monitor_wait_for_state_change_count(Monitor *monitor,
+									const char *formation,
+									int groupId,
+									int timeoutMs,
+									int wakeupFd,
+									bool *stateHasChanged)
+{
+	PGSQL *pgsql = &(monitor->notificationClient);
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	char *sql =
+		"SELECT pgautofailover.wait_for_state_change($1, $2, $3, $4)";
+
+	IntString groupIdString = intToString(groupId);
+	IntString knownCountString = intToString(monitor->knownStateChangeCount);
+	IntString timeoutString = intToString(timeoutMs);
+
+	int paramCount = 4;
+	Oid paramTypes[4] = { TEXTOID, INT4OID, INT8OID, INT4OID };
+	const char *paramValues[4] = {
+		formation,
+		groupIdString.strValue,
+		knownCountString.strValue,
+		timeoutString.strValue
+	};
+
+	/* the monitor answers by itself at timeoutMs, leave it some margin */
+	int waitMs = timeoutMs + PG_AUTOCTL_MONITOR_WAIT_MARGIN;
+	struct timespec timeout = {
+		.tv_sec = waitMs / 1000,
+		.tv_nsec = 1000 * 1000 * (waitMs % 1000)
+	};
+
+	bool done = false;
+
+	*stateHasChanged = false;
+
+	if (!pgsql_send_with_params(pgsql, sql,
+								paramCount, paramTypes, paramValues))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	while (!done)
+	{
+		sigset_t sig_mask;
+		sigset_t sig_mask_orig;
+		fd_set input_mask;
+
+		int sock = PQsocket(pgsql->connection);
+
+		if (sock < 0)
+		{
+			pgsql_finish(pgsql);
+			return false;   /* shouldn't happen */
+		}
+
+		if (!block_signals(&sig_mask, &sig_mask_orig))
+		{
+			pgsql_cancel_query(pgsql);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		if (asked_to_stop || asked_to_stop_fast ||
+			asked_to_reload || asked_to_quit)
+		{
+			(void) unblock_signals(&sig_mask_orig);
+
+			pgsql_cancel_query(pgsql);
+			pgsql_finish(pgsql);
+			return true;
+		}
+
+		FD_ZERO(&input_mask);
+		FD_SET(sock, &input_mask);
+
+		if (wakeupFd >= 0)
+		{
+			FD_SET(wakeupFd, &input_mask);
+		}
+
+		int maxFd = sock > wakeupFd ? sock : wakeupFd;
+		int ret = pselect(maxFd + 1, &input_mask, NULL, NULL,
+						  &timeout, &sig_mask_orig);
+		bool interrupted = ret < 0 && errno == EINTR;
+
+		if (ret < 0 && !interrupted)
+		{
+			log_warn("Failed to wait for monitor state changes: "
+					 "select(): %m");
+		}
+
+		(void) unblock_signals(&sig_mask_orig);
+
+		/* interrupted, timed-out, or woken up by wakeupFd */
+		if (ret <= 0 || !FD_ISSET(sock, &input_mask))
+		{
+			pgsql_cancel_query(pgsql);
+			pgsql_finish(pgsql);
+
+			return ret >= 0 || interrupted;
+		}
+
+		if (!pgsql_fetch_async_result(pgsql, &done,
+									  &context, &parseSingleValueResult))
+		{
+			/* errors have already been logged */
+			pgsql_finish(pgsql);
+			return false;
+		}
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the result of "
+				  "pgautofailover.wait_for_state_change()");
+		return false;
+	}
+
+	int64_t changeCount = (int64_t) context.bigint;
+
+	if (monitor->knownStateChangeCount >= 0 &&
+		changeCount != monitor->knownStateChangeCount)
+	{
+		log_debug("State change counter of group %d is now %" PRId64
+				  ", used to be %" PRId64,
+				  groupId, changeCount, monitor->knownStateChangeCount);
+
+		*stateHasChanged = true;
+		pgsql->notificationReceived = true;
+	}
+
+	monitor->knownStateChangeCount = changeCount;
+
+	return true;
+}
+
+/*
+ * monitor_follow_state prints the current state of the given formation and
+ * group, and then prints again the rows of the nodes that change state as we
+ * receive notifications from the monitor, until we're asked to stop.
+ *
+ * This only costs one long-lived LISTEN connection on the monitor, where
+ * watching the output of pg_autoctl show state would connect and call
+ * current_state() every time.
+ */
+bool
+monitor_follow_state(Monitor *monitor, char *formation, int group)
+{
+	CurrentNodeStateArray nodesArray = { 0 };
+
+	FollowStateNotificationContext context = {
+		formation,
+		group,
+		&nodesArray,
+		true                    /* needsFullRedraw */
+	};
+
+	char groupChannel[BUFSIZE] = { 0 };
+	char *channels[] = { groupChannel, NULL };
+
+	if (group == -1)
+	{
+		strlcpy(groupChannel, "state", sizeof(groupChannel));
+	}
+	else
+	{
+		(void) monitor_state_channel(formation, group,
+									 groupChannel, sizeof(groupChannel));
+	}
+
+	/* start listening before fetching the state, not to miss any change */
+	if (!pgsql_listen(&(monitor->notificationClient), channels))
+	{
+		log_error("Failed to listen to state changes from the monitor");
+		return false;
+	}
+
+	while (!(asked_to_stop || asked_to_stop_fast || asked_to_quit))
+	{
+		if (asked_to_reload)
+		{
+			/* no configuration to reload here, just redraw */
+			asked_to_reload = 0;
+			context.needsFullRedraw = true;
+		}
+
+		if (context.needsFullRedraw)
+		{
+			if (!monitor_get_current_state(monitor, formation, group,
+										   &nodesArray))
+			{
+				log_warn("Failed to retrieve current state from the monitor, "
+						 "retrying in %ds", PG_AUTOCTL_MONITOR_RETRY_TIME);
+				sleep(PG_AUTOCTL_MONITOR_RETRY_TIME);
+				continue;
+			}
+
+			(void) printCurrentStateArray(&nodesArray);
+			context.needsFullRedraw = false;
+		}
+
+		if (!monitor_process_notifications(
+				monitor,
+				PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT * 1000,
+				-1,
+				false,
+				channels,
+				(void *) &context,
+				&monitor_follow_state_notification))
+		{
+			if (asked_to_stop || asked_to_stop_fast || asked_to_quit ||
+				asked_to_reload)
+			{
+				continue;
+			}
+
+			/* we lost the connection, changes might have been missed */
+			log_warn("Lost connection to the monitor, retrying in %ds",
+					 PG_AUTOCTL_MONITOR_RETRY_TIME);
+			sleep(PG_AUTOCTL_MONITOR_RETRY_TIME);
+
+			context.needsFullRedraw = true;
+		}
+	}
+
+	/* disconnect from monitor */
+	pgsql_finish(&monitor->notificationClient);
+
+	return true;
+}
+
+
+/*
+ * monitor_follow_state_notification is a Notification Processing Function
+ * that prints the row of a node when its state changed. When we receive a
+ * notification for a node that we don't know about yet, or when a node
+ * changed its name or address, we redraw the whole table instead, as the
+ * column sizes might have to change.
+ */
+static void
+monitor_follow_state_notification(void *context, CurrentNodeState *nodeState)
 {
-	WaitForStateChangeNotificationContext *ctx =
-		(WaitForStateChangeNotificationContext *) context;
+	FollowStateNotificationContext *ctx =
+		(FollowStateNotificationContext *) context;
+	CurrentNodeStateArray *nodesArray = ctx->nodesArray;
 
-	/* filter notifications for our own formation */
+	/* filter notifications for our own formation and group */
 	if (strcmp(nodeState->formation, ctx->formation) != 0 ||
-		nodeState->groupId != ctx->groupId)
+		(ctx->groupId != -1 && nodeState->groupId != ctx->groupId))
 	{
 		return;
 	}
 
-	/* here, we received a state change that belongs to our formation/group */
-	ctx->stateHasChanged = true;
-	nodestate_log(nodeState, LOG_INFO, ctx->nodeId);
-}
+	for (int i = 0; i < nodesArray->count; i++)
+	{
+		CurrentNodeState *known = &(nodesArray->nodes[i]);
 
+		if (known->node.nodeId != nodeState->node.nodeId)
+		{
+			continue;
+		}
 
-/*
- * monitor_wait_for_state_change waits for timeout milliseconds or until we
- * receive a notification for a state change concerning the given nodeId,
- * whichever comes first.
- *
- * When we have received at least one notification for the given groupId then
- * the stateHasChanged boolean is set to true, otherwise it's set to false.
- */
-bool
-monitor_wait_for_state_change(Monitor *monitor,
-							  const char *formation,
-							  int groupId,
-							  int64_t nodeId,
-							  int timeoutMs,
-							  bool *stateHasChanged)
-{
-	PGconn *connection = monitor->notificationClient.connection;
+		if (strcmp(known->node.name, nodeState->node.name) != 0 ||
+			strcmp(known->node.host, nodeState->node.host) != 0 ||
+			known->node.port != nodeState->node.port)
+		{
+			ctx->needsFullRedraw = true;
+			return;
+		}
 
-	WaitForStateChangeNotificationContext context = {
-		(char *) formation,
-		groupId,
-		nodeId,
-		false                   /* stateHasChanged */
-	};
+		if (known->reportedState == nodeState->reportedState &&
+			known->goalState == nodeState->goalState &&
+			known->health == nodeState->health)
+		{
+			return;
+		}
 
-	char *channels[] = { "state", NULL };
+		/* notifications don't have the LSN, keep the one we have */
+		known->reportedState = nodeState->reportedState;
+		known->goalState = nodeState->goalState;
+		known->health = nodeState->health;
 
-	if (connection == NULL)
-	{
-		log_warn("Lost connection.");
-		return false;
-	}
+		(void) nodestatePrintNodeState(&(nodesArray->headers), known);
 
-	if (!monitor_process_notifications(
-			monitor,
-			timeoutMs,
-			channels,
-			(void *) &context,
-			&monitor_notification_process_wait_for_state_change))
-	{
-		return false;
+		return;
 	}
 
-	*stateHasChanged = context.stateHasChanged;
-
-	return true;
+	/* that's a new node */
+	ctx->needsFullRedraw = true;
 }
 
 
@@ -3862,6 +6234,22 @@ monitor_wait_until_some_node_reported_state(Monitor *monitor,
 				 timeout, NodeStateToString(targetState), formation, groupId);
 	}
 
+	if (monitor_has_wait_for_node_state(monitor))
+	{
+		bool done = false;
+
+		if (!monitor_wait_for_node_state(monitor, formation, groupId, -1,
+										 targetState, timeout, &done))
+		{
+			/* errors have already been logged */
+			done = false;
+		}
+
+		pgsql_finish(&monitor->notificationClient);
+
+		return done;
+	}
+
 	(void) monitor_report_state_print_headers(monitor, formation, groupId,
 											  nodeKind, &nodesArray, &headers);
 
@@ -3885,6 +6273,8 @@ monitor_wait_until_some_node_reported_state(Monitor *monitor,
 		if (!monitor_process_notifications(
 				monitor,
 				thisLoopTimeout * 1000,
+				-1,
+				false,
 				channels,
 				(void *) &context,
 				&monitor_check_report_state))
@@ -4005,6 +6395,24 @@ monitor_wait_until_node_reported_state(Monitor *monitor,
 		return false;
 	}
 
+	if (monitor_has_wait_for_node_state(monitor))
+	{
+		bool done = false;
+
+		if (!monitor_wait_for_node_state(monitor, formation, groupId, nodeId,
+										 targetState,
+										 PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT,
+										 &done))
+		{
+			/* errors have already been logged */
+			done = false;
+		}
+
+		pgsql_finish(&monitor->notificationClient);
+
+		return done;
+	}
+
 	(void) monitor_report_state_print_headers(monitor, formation, groupId,
 											  nodeKind, &nodesArray, &headers);
 
@@ -4021,6 +6429,8 @@ monitor_wait_until_node_reported_state(Monitor *monitor,
 		if (!monitor_process_notifications(
 				monitor,
 				PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT * 1000,
+				-1,
+				false,
 				channels,
 				(void *) &context,
 				&monitor_check_node_report_state))
@@ -4037,6 +6447,123 @@ monitor_wait_until_node_reported_state(Monitor *monitor,
 }
 
 
+/*
+ * monitor_has_wait_for_node_state returns true when the monitor extension
+ * provides pgautofailover.wait_for_node_state(). The CLI commands don't check
+ * the extension version otherwise, so we fetch it here when needed.
+ */
+static bool
+monitor_has_wait_for_node_state(Monitor *monitor)
+{
+	if (monitor->extensionVersionNum == 0)
+	{
+		MonitorExtensionVersion version = { 0 };
+
+		if (!monitor_get_extension_version(monitor, &version) ||
+			!parse_pgaf_extension_version_string(version.installedVersion,
+												 &(monitor->extensionVersionNum)))
+		{
+			/* errors have already been logged, use notifications then */
+			monitor->extensionVersionNum = -1;
+		}
+	}
+
+	return monitor->extensionVersionNum >= MONITOR_WAIT_FOR_NODE_STATE_VERSION_NUM;
+}
+
+
+/*
+ * monitor_wait_for_node_state blocks on the monitor side until the given
+ * node, or any node of the group when nodeId is -1, reaches the targetState,
+ * with a single query that only returns the result. When timeout is zero or
+ * less we wait forever, in chunks of PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT.
+ */
+static bool
+monitor_wait_for_node_state(Monitor *monitor,
+							const char *formation,
+							int groupId,
+							int64_t nodeId,
+							NodeState targetState,
+							int timeout,
+							bool *done)
+{
+	PGSQL *pgsql = &monitor->pgsql;
+
+	char *sql =
+		"SELECT coalesce(pgautofailover.wait_for_node_state($1, $2, $3, "
+		"$4::pgautofailover.replication_state, $5), 0)";
+
+	int thisLoopTimeout =
+		timeout > 0 ? timeout : PG_AUTOCTL_LISTEN_NOTIFICATIONS_TIMEOUT;
+
+	IntString groupIdString = intToString(groupId);
+	IntString nodeIdString = intToString(nodeId);
+	IntString timeoutString = intToString(thisLoopTimeout * 1000);
+
+	int paramCount = 5;
+	Oid paramTypes[5] = { TEXTOID, INT4OID, INT8OID, TEXTOID, INT4OID };
+	const char *paramValues[5] = {
+		formation,
+		groupIdString.strValue,
+		nodeId == -1 ? NULL : nodeIdString.strValue,
+		NodeStateToString(targetState),
+		timeoutString.strValue
+	};
+
+	if (nodeId == -1)
+	{
+		log_info("Waiting %d secs for a node to reach state \"%s\" "
+				 "in formation \"%s\" and group %d",
+				 thisLoopTimeout, NodeStateToString(targetState),
+				 formation, groupId);
+	}
+	else
+	{
+		log_info("Waiting %d secs for node %" PRId64 " to reach state \"%s\"",
+				 thisLoopTimeout, nodeId, NodeStateToString(targetState));
+	}
+
+	*done = false;
+
+	while (!*done)
+	{
+		SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+		if (!pgsql_execute_with_params(pgsql, sql,
+									   paramCount, paramTypes, paramValues,
+									   &context, &parseSingleValueResult))
+		{
+			log_error("Failed to wait for state \"%s\" on the monitor",
+					  NodeStateToString(targetState));
+			return false;
+		}
+
+		if (!context.parsedOk)
+		{
+			log_error("Failed to parse the result of "
+					  "pgautofailover.wait_for_node_state");
+			return false;
+		}
+
+		if (context.bigint > 0)
+		{
+			log_info("Node %" PRId64 " reached state \"%s\"",
+					 (int64_t) context.bigint, NodeStateToString(targetState));
+
+			*done = true;
+		}
+		else if (timeout > 0)
+		{
+			log_error("Timed out after %d secs waiting for state \"%s\"",
+					  timeout, NodeStateToString(targetState));
+			break;
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * monitor_get_extension_version gets the current extension version from the
  * Monitor's Postgres catalog pg_available_extensions.
@@ -4185,9 +6712,270 @@ monitor_extension_update(Monitor *monitor, const char *targetVersion)
 		}
 	}
 
-	return pgsql_alter_extension_update_to(pgsql,
-										   PG_AUTOCTL_MONITOR_EXTENSION_NAME,
-										   targetVersion);
+	/*
+	 * The update keeps the tables that it changes locked until it commits,
+	 * and every node_active() call queues up behind it, and behind any lock
+	 * that it waits for. We'd rather fail fast and retry when a transaction
+	 * holds a conflicting lock, and only wait for as long as it takes on the
+	 * last attempt.
+	 */
+	for (int attempt = 1; attempt <= PG_AUTOCTL_EXTENSION_UPDATE_ATTEMPTS; attempt++)
+	{
+		bool lastAttempt = attempt == PG_AUTOCTL_EXTENSION_UPDATE_ATTEMPTS;
+		int lockTimeoutMs =
+			lastAttempt ? 0 : PG_AUTOCTL_EXTENSION_UPDATE_LOCK_TIMEOUT;
+		bool lockNotAvailable = false;
+
+		instr_time startTime;
+		instr_time duration;
+
+		INSTR_TIME_SET_CURRENT(startTime);
+
+		if (pgsql_alter_extension_update_to(pgsql,
+											PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+											targetVersion,
+											lockTimeoutMs,
+											&lockNotAvailable))
+		{
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, startTime);
+
+			log_info("ALTER EXTENSION \"%s\" UPDATE TO \"%s\" took %.0fms",
+					 PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+					 targetVersion,
+					 INSTR_TIME_GET_MILLISEC(duration));
+
+			return true;
+		}
+
+		if (!lockNotAvailable)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		int sleepTimeMs = attempt * PG_AUTOCTL_EXTENSION_UPDATE_LOCK_TIMEOUT;
+
+		log_info("Retrying to update extension \"%s\" in %dms "
+				 "(attempt %d of %d)",
+				 PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				 sleepTimeMs,
+				 attempt + 1,
+				 PG_AUTOCTL_EXTENSION_UPDATE_ATTEMPTS);
+
+		pg_usleep(sleepTimeMs * 1000L);
+	}
+
+	return false;
+}
+
+
+/*
+ * The update scripts of the monitor extension that copy or rewrite tables,
+ * and which ones, more than once when a script does it twice. Those tables
+ * are locked until the end of the ALTER EXTENSION transaction, and copying
+ * them is most of the time spent in the update.
+ */
+typedef struct MonitorExtensionUpdateStep
+{
+	const char *source;
+	const char *target;
+	const char *tables;
+} MonitorExtensionUpdateStep;
+
+static MonitorExtensionUpdateStep monitorExtensionUpdateSteps[] = {
+	{ "1.0", "1.1", "node,event" },
+	{ "1.2", "1.3", "node,event,node,event" },
+	{ "1.3", "1.4", "node,event,node,event" },
+	{ "1.4", "1.5", "node" },
+	{ "1.5", "1.6", "node,event" },
+	{ NULL, NULL, NULL }
+};
+
+
+/*
+ * monitor_estimate_extension_update computes how long the ALTER EXTENSION
+ * UPDATE from the installed version to the target version is expected to
+ * keep the monitor tables locked, from the size of the tables that the
+ * update scripts copy, without updating anything.
+ */
+bool
+monitor_estimate_extension_update(Monitor *monitor,
+								  const char *installedVersion,
+								  const char *targetVersion,
+								  MonitorExtensionUpdateEstimate *estimate)
+{
+	SingleValueResultContext pathContext = { { 0 }, PGSQL_RESULT_STRING, false };
+	MonitorExtensionUpdateEstimateContext context = { { 0 }, estimate, false };
+	PGSQL *pgsql = &monitor->pgsql;
+
+	char tables[BUFSIZE] = { 0 };
+	char *steps[BUFSIZE] = { 0 };
+
+	const char *pathSql =
+		"SELECT coalesce(path, '')"
+		"  FROM pg_extension_update_paths($1)"
+		" WHERE source = $2 AND target = $3";
+	Oid pathTypes[3] = { TEXTOID, TEXTOID, TEXTOID };
+	const char *pathValues[3] = {
+		PG_AUTOCTL_MONITOR_EXTENSION_NAME, installedVersion, targetVersion
+	};
+
+	const char *sizeSql =
+		"SELECT coalesce(sum(pg_total_relation_size(c.oid)), 0),"
+		"       coalesce(string_agg(format('%s (%s)', c.relname,"
+		"                  pg_size_pretty(pg_total_relation_size(c.oid))),"
+		"                  ', ' ORDER BY t.n), '')"
+		"  FROM unnest($1::text[]) WITH ORDINALITY AS t(relname, n)"
+		"  JOIN pg_class c ON c.relname = t.relname"
+		"  JOIN pg_namespace n ON n.oid = c.relnamespace"
+		" WHERE n.nspname = 'pgautofailover'";
+	Oid sizeTypes[1] = { TEXTOID };
+	const char *sizeValues[1] = { 0 };
+
+	memset(estimate, 0, sizeof(MonitorExtensionUpdateEstimate));
+
+	strlcpy(estimate->installedVersion, installedVersion, BUFSIZE);
+	strlcpy(estimate->targetVersion, targetVersion, BUFSIZE);
+
+	if (strcmp(installedVersion, targetVersion) == 0)
+	{
+		return true;
+	}
+
+	if (!pgsql_execute_with_params(pgsql, pathSql, 3, pathTypes, pathValues,
+								   &pathContext, &parseSingleValueResult))
+	{
+		log_error("Failed to get the update path of extension \"%s\" "
+				  "from version \"%s\" to version \"%s\"",
+				  PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				  installedVersion, targetVersion);
+		return false;
+	}
+
+	if (!pathContext.parsedOk || IS_EMPTY_STRING_BUFFER(pathContext.strVal))
+	{
+		log_error("Failed to find an update path for extension \"%s\" "
+				  "from version \"%s\" to version \"%s\"",
+				  PG_AUTOCTL_MONITOR_EXTENSION_NAME,
+				  installedVersion, targetVersion);
+
+		if (pathContext.strVal)
+		{
+			free(pathContext.strVal);
+		}
+		return false;
+	}
+
+	strlcpy(estimate->updatePath, pathContext.strVal, BUFSIZE);
+	free(pathContext.strVal);
+
+	/* the path is a list of versions separated with "--" */
+	char path[BUFSIZE] = { 0 };
+	int stepCount = 0;
+
+	strlcpy(path, estimate->updatePath, BUFSIZE);
+
+	for (char *ptr = path; ptr != NULL && stepCount < BUFSIZE;)
+	{
+		char *separator = strstr(ptr, "--");
+
+		steps[stepCount++] = ptr;
+
+		if (separator != NULL)
+		{
+			*separator = '\0';
+			ptr = separator + 2;
+		}
+		else
+		{
+			ptr = NULL;
+		}
+	}
+
+	estimate->stepCount = stepCount - 1;
+
+	for (int i = 0; i < stepCount - 1; i++)
+	{
+		for (int s = 0; monitorExtensionUpdateSteps[s].source != NULL; s++)
+		{
+			MonitorExtensionUpdateStep *step = &(monitorExtensionUpdateSteps[s]);
+
+			if (strcmp(step->source, steps[i]) == 0 &&
+				strcmp(step->target, steps[i + 1]) == 0)
+			{
+				if (!IS_EMPTY_STRING_BUFFER(tables))
+				{
+					strlcat(tables, ",", BUFSIZE);
+				}
+				strlcat(tables, step->tables, BUFSIZE);
+			}
+		}
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(tables))
+	{
+		char tablesArray[BUFSIZE] = { 0 };
+
+		sformat(tablesArray, BUFSIZE, "{%s}", tables);
+		sizeValues[0] = tablesArray;
+
+		if (!pgsql_execute_with_params(pgsql, sizeSql, 1, sizeTypes, sizeValues,
+									   &context,
+									   &parseExtensionUpdateEstimate))
+		{
+			log_error("Failed to get the size of the tables that the update "
+					  "of extension \"%s\" copies",
+					  PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+			return false;
+		}
+
+		if (!context.parsedOK)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	estimate->expectedLockTimeMs =
+		estimate->stepCount * PG_AUTOCTL_EXTENSION_UPDATE_STEP_TIME +
+		estimate->copiedBytes * 1000 / PG_AUTOCTL_EXTENSION_UPDATE_COPY_RATE;
+
+	return true;
+}
+
+
+/*
+ * parseExtensionUpdateEstimate parses the size of the tables that an
+ * extension update copies, and their names with their pretty sizes.
+ */
+static void
+parseExtensionUpdateEstimate(void *ctx, PGresult *result)
+{
+	MonitorExtensionUpdateEstimateContext *context =
+		(MonitorExtensionUpdateEstimateContext *) ctx;
+
+	if (PQntuples(result) != 1 || PQnfields(result) != 2)
+	{
+		log_error("Query returned %d rows of %d columns, expected 1 row "
+				  "of 2 columns",
+				  PQntuples(result), PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt64(value, &(context->estimate->copiedBytes)))
+	{
+		log_error("Failed to parse table size \"%s\"", value);
+		context->parsedOK = false;
+		return;
+	}
+
+	strlcpy(context->estimate->copiedTables, PQgetvalue(result, 0, 1), BUFSIZE);
+
+	context->parsedOK = true;
 }
 
 
@@ -13,7 +13,9 @@
 #include <stdbool.h>
 
 #include "pgsql.h"
+#include "keeper_io_watchdog.h"
 #include "monitor_config.h"
+#include "nodestate_utils.h"
 #include "primary_standby.h"
 #include "state.h"
 
@@ -23,8 +25,49 @@ typedef struct Monitor
 	PGSQL pgsql;
 	PGSQL notificationClient;
 	MonitorConfig config;
+
+	int extensionVersionNum;    /* installed extension version, e.g. 106 */
+	int64_t knownNodesVersion;  /* version of the other nodes we installed */
+	int64_t knownGroupVersion;  /* group membership version we installed */
+
+	/*
+	 * When useStateChangeWait is true, monitor_wait_for_state_change calls
+	 * pgautofailover.wait_for_state_change() rather than using LISTEN, and
+	 * knownStateChangeCount is the last counter it returned, or -1.
+	 */
+	bool useStateChangeWait;
+	int64_t knownStateChangeCount;
+
+	/*
+	 * The synchronous_standby_names value that the monitor pushed to our
+	 * node, in a state notification or with node_active, and that the keeper
+	 * has yet to apply, see keeper_apply_pushed_settings.
+	 */
+	bool hasPushedSettings;
+	char pushedSynchronousStandbyNames[BUFSIZE];
+
+	/*
+	 * An optional streaming replica of the monitor, where the reads that
+	 * tolerate some staleness are sent, see monitor_init_replica.
+	 */
+	PGSQL replica;
+	bool hasReplica;
+
+	/*
+	 * While a keeper can't reach the monitor, it keeps a session open on any
+	 * other host of the monitor URI, where a hot standby monitor counts such
+	 * sessions before taking over, see monitor_report_contact.
+	 */
+	PGconn *lostContactConnection;
+	uint64_t lostContactAttemptTime;
 } Monitor;
 
+/* pgautofailover.node_active_v2 appeared in extension version 1.6 */
+#define MONITOR_NODE_ACTIVE_V2_VERSION_NUM 106
+
+/* pgautofailover.wait_for_node_state appeared in extension version 1.6 */
+#define MONITOR_WAIT_FOR_NODE_STATE_VERSION_NUM 106
+
 typedef struct MonitorAssignedState
 {
 	char name[_POSIX_HOST_NAME_MAX];
@@ -33,6 +76,25 @@ typedef struct MonitorAssignedState
 	NodeState state;
 	int candidatePriority;
 	bool replicationQuorum;
+
+	/*
+	 * When using node_active_v2 the monitor also returns the other nodes in
+	 * the group, unless they did not change since knownNodesVersion, the
+	 * group membership version, and when to call node_active again.
+	 */
+	int64_t nodesVersion;
+	int64_t groupVersion;
+	int reportIntervalMs;
+	bool hasOtherNodes;
+	bool otherNodesKnown;
+	NodeAddressArray otherNodes;
+
+	/* the id of the failover trace of the group, empty when not failing over */
+	char traceId[NAMEDATALEN];
+
+	/* the synchronous_standby_names value pushed to a primary node, if any */
+	bool hasSynchronousStandbyNames;
+	char synchronousStandbyNames[BUFSIZE];
 } MonitorAssignedState;
 
 typedef struct StateNotification
@@ -53,11 +115,77 @@ typedef struct MonitorExtensionVersion
 	char installedVersion[BUFSIZE];
 } MonitorExtensionVersion;
 
+/*
+ * MonitorExtensionUpdateEstimate is what pg_autoctl do monitor upgrade
+ * --dry-run reports: the tables that the update copies, and how long they
+ * are expected to be locked.
+ */
+typedef struct MonitorExtensionUpdateEstimate
+{
+	char installedVersion[BUFSIZE];
+	char targetVersion[BUFSIZE];
+	char updatePath[BUFSIZE];
+	int stepCount;
+	char copiedTables[BUFSIZE];
+	int64_t copiedBytes;
+	int64_t expectedLockTimeMs;
+} MonitorExtensionUpdateEstimate;
+
+/*
+ * CurrentStateFilter holds the filters of pg_autoctl show state, that the
+ * monitor applies in pgautofailover.current_state_page().
+ */
+typedef struct CurrentStateFilter
+{
+	int groupId;                /* -1 for all groups */
+	NodeState state;            /* NO_STATE for all states */
+	bool filterHealth;
+	int health;                 /* -1 (unknown), 0 (no), or 1 (yes) */
+	bool laggingOnly;
+	int pageSize;               /* 0 for the default page size */
+} CurrentStateFilter;
+
+/*
+ * NodePropertiesArray holds a batch of node property changes, that the
+ * monitor applies in pgautofailover.set_node_properties(), in a single
+ * transaction.
+ */
+#define NODE_PROPERTIES_MAX_COUNT 128
+
+typedef struct NodeProperties
+{
+	char name[_POSIX_HOST_NAME_MAX];
+	bool hasCandidatePriority;
+	int candidatePriority;
+	bool hasReplicationQuorum;
+	bool replicationQuorum;
+} NodeProperties;
+
+typedef struct NodePropertiesArray
+{
+	int count;
+	NodeProperties nodes[NODE_PROPERTIES_MAX_COUNT];
+} NodePropertiesArray;
+
 #define NODE_FORMAT "%" PRId64 " \"%s\" (%s:%d)"
 
+/*
+ * The primary node of a group as last returned by the monitor, valid until
+ * a state change is notified in the group, see monitor_get_primary_cached.
+ */
+typedef struct MonitorPrimaryCache
+{
+	bool valid;
+	NodeAddress primary;
+} MonitorPrimaryCache;
+
 bool monitor_init(Monitor *monitor, char *url);
+bool monitor_init_replica(Monitor *monitor, char *url);
+bool monitor_init_pooler(Monitor *monitor, char *url);
 void monitor_setup_notifications(Monitor *monitor, int groupId, int64_t nodeId);
 bool monitor_has_received_notifications(Monitor *monitor);
+void monitor_state_channel(const char *formation, int groupId,
+						   char *channel, size_t size);
 bool monitor_process_state_notification(int notificationGroupId,
 										int64_t notificationNodeId,
 										char *channel,
@@ -83,6 +211,16 @@ bool monitor_print_other_nodes_as_json(Monitor *monitor,
 
 bool monitor_get_primary(Monitor *monitor, char *formation, int groupId,
 						 NodeAddress *node);
+void monitor_report_contact(Monitor *monitor, int64_t nodeId,
+							bool couldContactMonitor);
+bool monitor_count_lost_contact(Monitor *monitor,
+								int *lostContactCount, int *nodeCount);
+bool monitor_get_primary_cached(Monitor *monitor, char *formation, int groupId,
+								MonitorPrimaryCache *cache, int timeoutMs,
+								NodeAddress *node, bool *primaryHasChanged);
+bool monitor_get_upstream(Monitor *monitor, int64_t nodeId, NodeAddress *node);
+bool monitor_get_basebackup_source(Monitor *monitor, int64_t nodeId,
+								   NodeAddress *node);
 bool monitor_get_coordinator(Monitor *monitor, char *formation,
 							 NodeAddress *node);
 bool monitor_get_most_advanced_standby(Monitor *monitor,
@@ -110,6 +248,8 @@ bool monitor_node_active(Monitor *monitor,
 						 bool pgIsRunning, int currentTLI,
 						 char *currentLSN, char *pgsrSyncState,
 						 MonitorAssignedState *assignedState);
+bool monitor_parse_node_active_result(PGresult *result,
+									  MonitorAssignedState *assignedState);
 bool monitor_get_node_replication_settings(Monitor *monitor,
 										   NodeReplicationSettings *settings);
 bool monitor_set_node_candidate_priority(Monitor *monitor,
@@ -118,12 +258,24 @@ bool monitor_set_node_candidate_priority(Monitor *monitor,
 bool monitor_set_node_replication_quorum(Monitor *monitor,
 										 char *formation, char *name,
 										 bool replicationQuorum);
+bool monitor_set_node_properties(Monitor *monitor, char *formation,
+								 NodePropertiesArray *propertiesArray,
+								 int *applySettingsCount);
 bool monitor_get_formation_number_sync_standbys(Monitor *monitor, char *formation,
 												int *numberSyncStandbys);
 bool monitor_set_formation_number_sync_standbys(Monitor *monitor, char *formation,
 												int numberSyncStandbys);
+bool monitor_get_formation_maximum_backup_rate(Monitor *monitor, char *formation,
+											   char *maximumBackupRate,
+											   size_t size);
+bool monitor_report_transition_timing(Monitor *monitor, int64_t nodeId,
+									  const char *description);
+bool monitor_set_formation_maximum_backup_rate(Monitor *monitor, char *formation,
+											   char *maximumBackupRate);
 
 bool monitor_remove_by_hostname(Monitor *monitor, char *host, int port, bool force);
+bool monitor_remove_by_nodenames(Monitor *monitor,
+								 char *formation, char *names, bool force);
 bool monitor_remove_by_nodename(Monitor *monitor,
 								char *formation, char *name, bool force);
 
@@ -133,12 +285,21 @@ bool monitor_get_groupId_from_name(Monitor *monitor,
 								   int *groupId);
 
 bool monitor_perform_failover(Monitor *monitor, char *formation, int group);
+bool monitor_report_drill_outage(Monitor *monitor, char *formation, int group,
+								 uint64_t startEpochMs, uint64_t durationMs);
 bool monitor_perform_promotion(Monitor *monitor, char *formation, char *name);
 
-bool monitor_print_state(Monitor *monitor, char *formation, int group);
+bool monitor_print_state(Monitor *monitor, char *formation,
+						 CurrentStateFilter *filter);
+bool monitor_print_catchup_progress(Monitor *monitor, char *formation,
+									int group);
+bool monitor_get_current_state(Monitor *monitor, char *formation, int group,
+							   CurrentNodeStateArray *nodesArray);
+bool monitor_follow_state(Monitor *monitor, char *formation, int group);
 bool monitor_print_last_events(Monitor *monitor,
 							   char *formation, int group, int count);
-bool monitor_print_state_as_json(Monitor *monitor, char *formation, int group);
+bool monitor_print_state_as_json(Monitor *monitor, char *formation,
+								 CurrentStateFilter *filter);
 bool monitor_print_last_events_as_json(Monitor *monitor,
 									   char *formation, int group,
 									   int count,
@@ -171,6 +332,21 @@ bool monitor_formation_uri(Monitor *monitor,
 						   const SSLOptions *ssl,
 						   char *connectionString,
 						   size_t size);
+bool monitor_get_formation_shard(Monitor *monitor,
+								 const char *formation,
+								 char *shardPgURI,
+								 size_t size);
+bool monitor_use_formation_shard(Monitor *monitor,
+								 const char *formation,
+								 char *shardPgURI,
+								 size_t size);
+bool monitor_formation_read_only_uri(Monitor *monitor,
+									 const char *formation,
+									 const char *citusClusterName,
+									 const SSLOptions *ssl,
+									 int64_t maxLagBytes,
+									 char *connectionString,
+									 size_t size);
 
 bool monitor_synchronous_standby_names(Monitor *monitor,
 									   char *formation, int groupId,
@@ -182,6 +358,41 @@ bool monitor_update_node_metadata(Monitor *monitor,
 								  const char *name,
 								  const char *hostname,
 								  int port);
+bool monitor_report_replication_stats(Monitor *monitor,
+									  int64_t nodeId,
+									  ReplicationStatsReport *report);
+bool monitor_report_sync_rep_stall(Monitor *monitor,
+								   int64_t nodeId,
+								   char *streamingStandbyIds,
+								   int stallMs,
+								   bool *degraded);
+bool monitor_report_storage_health(Monitor *monitor,
+								   int64_t nodeId,
+								   IOWatchdogStats *stats,
+								   bool *stalled);
+bool monitor_report_wal_space(Monitor *monitor,
+							  int64_t nodeId,
+							  KeeperWalSpace *walSpace,
+							  bool *exhausting);
+bool monitor_report_replay_progress(Monitor *monitor,
+									int64_t nodeId,
+									const char *receivedLSN,
+									const char *replayLSN,
+									int64_t applyRate,
+									int64_t receiverStalenessMs,
+									int64_t catchupRate);
+bool monitor_report_node_latency(Monitor *monitor,
+								 int64_t nodeId,
+								 const char *targetNodeIds,
+								 const char *targets,
+								 const char *rttUs);
+bool monitor_report_replication_slots(Monitor *monitor,
+									  int64_t nodeId,
+									  ReplicationSlotStatsReport *report,
+									  NodeAddressArray *invalidateNodesArray);
+bool monitor_report_drain_stats(Monitor *monitor,
+								int64_t nodeId,
+								DrainStats *stats);
 bool monitor_set_node_system_identifier(Monitor *monitor,
 										int64_t nodeId,
 										uint64_t system_identifier);
@@ -212,10 +423,15 @@ bool monitor_wait_for_state_change(Monitor *monitor,
 								   int groupId,
 								   int64_t nodeId,
 								   int timeoutMs,
+								   int wakeupFd,
 								   bool *stateHasChanged);
 bool monitor_get_extension_version(Monitor *monitor,
 								   MonitorExtensionVersion *version);
 bool monitor_extension_update(Monitor *monitor, const char *targetVersion);
+bool monitor_estimate_extension_update(Monitor *monitor,
+									   const char *installedVersion,
+									   const char *targetVersion,
+									   MonitorExtensionUpdateEstimate *estimate);
 bool monitor_ensure_extension_version(Monitor *monitor,
 									  LocalPostgresServer *postgres,
 									  MonitorExtensionVersion *version);
@@ -0,0 +1,1097 @@
+/*
+ * src/bin/pg_autoctl/monitor_bench.c
+ *	 Load generator for the pg_auto_failover monitor.
+ *
+ * The benchmark registers synthetic nodes to the monitor, in formations of
+ * their own, and then calls the node active protocol for each of them at the
+ * keeper cadence, as the keeper main loop would: check the monitor extension
+ * version, call node_active, and fetch the other nodes when the monitor did
+ * not send them.
+ *
+ * Synthetic nodes reach their assigned state instantly, report an LSN that
+ * progresses at a given WAL rate, and now and then report that Postgres is
+ * not running, which triggers the usual failovers. A listener process keeps
+ * LISTEN sessions open on the groups notification channels.
+ *
+ * Each client process owns a subset of the groups, so that all the nodes of
+ * a group are simulated in the same process and share the same LSN.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli_root.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "histogram.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "monitor.h"
+#include "monitor_bench.h"
+#include "parsing.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "state.h"
+#include "string_utils.h"
+
+/* macOS only has MAP_ANON */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define random_between(M, N) \
+	((M) + pg_lrand48() / (RAND_MAX / ((N) -(M) +1) + 1))
+
+/* the protocol functions that we measure */
+typedef enum
+{
+	MONITOR_BENCH_REGISTER_NODE = 0,
+	MONITOR_BENCH_EXTENSION_VERSION,
+	MONITOR_BENCH_NODE_ACTIVE,
+	MONITOR_BENCH_GET_OTHER_NODES,
+	MONITOR_BENCH_REMOVE_NODE,
+	MONITOR_BENCH_FUNCTIONS_COUNT
+} MonitorBenchFunction;
+
+static const char *MonitorBenchFunctionNames[] = {
+	"register_node",
+	"extension_version",
+	"node_active",
+	"get_other_nodes",
+	"remove_node"
+};
+
+typedef struct MonitorBenchCall
+{
+	LatencyHistogram latency;
+	uint64_t errors;
+} MonitorBenchCall;
+
+typedef struct MonitorBenchClient
+{
+	MonitorBenchCall calls[MONITOR_BENCH_FUNCTIONS_COUNT];
+
+	uint64_t registered;
+	uint64_t transitions;
+	uint64_t flaps;
+} MonitorBenchClient;
+
+typedef struct MonitorBenchListener
+{
+	LatencyHistogram listen;
+	uint64_t sessions;
+	uint64_t errors;
+	uint64_t notifications;
+} MonitorBenchListener;
+
+/*
+ * MonitorBenchResults is shared between the benchmark sub-processes, in an
+ * anonymous shared memory mapping that they inherit at fork() time. Each
+ * process only writes to its own slot, so we don't need any locking.
+ */
+typedef struct MonitorBenchResults
+{
+	uint64_t startUs;
+	uint64_t startTime;
+	int extensionVersionNum;
+
+	MonitorBenchListener listener;
+	MonitorBenchClient clients[MONITOR_BENCH_MAX_CLIENTS];
+} MonitorBenchResults;
+
+/* a synthetic node, private to the client process that simulates it */
+typedef struct MonitorBenchNode
+{
+	int group;                  /* index of the synthetic group */
+	char formation[NAMEDATALEN];
+	char name[NAMEDATALEN];
+	int port;
+
+	int64_t nodeId;             /* 0 until registered, -1 when failed */
+	NodeState state;
+	int flapCalls;              /* calls left reporting Postgres is down */
+	int64_t knownNodesVersion;
+	uint64_t nextCallUs;
+} MonitorBenchNode;
+
+typedef struct MonitorBenchGroup
+{
+	int timeline;
+	int registeredCount;
+} MonitorBenchGroup;
+
+
+static bool monitor_bench_create_formations(Monitor *monitor,
+											MonitorBenchOptions *options);
+static void monitor_bench_drop_formations(Monitor *monitor,
+										  MonitorBenchOptions *options);
+static void monitor_bench_formation_name(MonitorBenchOptions *options,
+										 int group, char *name, size_t size);
+static bool monitor_bench_run_processes(MonitorBenchOptions *options,
+										MonitorBenchResults *results);
+static bool monitor_bench_wait_for_processes(pid_t pidArray[], int count);
+static void monitor_bench_client(MonitorBenchOptions *options, int clientId,
+								 MonitorBenchResults *results);
+static void monitor_bench_node_call(Monitor *monitor,
+									MonitorBenchOptions *options,
+									MonitorBenchNode *node,
+									MonitorBenchGroup *group,
+									uint64_t elapsedUs,
+									MonitorBenchClient *stats);
+static void monitor_bench_listener(MonitorBenchOptions *options,
+								   MonitorBenchResults *results);
+static void monitor_bench_record(MonitorBenchClient *stats,
+								 MonitorBenchFunction function,
+								 uint64_t startUs, bool success);
+static JSON_Value * monitor_bench_to_json(MonitorBenchOptions *options,
+										  MonitorBenchResults *results);
+static uint64_t monitor_bench_now_us(void);
+static bool monitor_bench_asked_to_stop(void);
+
+
+/*
+ * monitor_bench creates the benchmark formations on the monitor, runs the
+ * clients and the listener sub-processes for the given duration, removes
+ * the formations, and then exports the results as JSON, either to stdout or
+ * to the --output file.
+ */
+bool
+monitor_bench(MonitorBenchOptions *options)
+{
+	Monitor monitor = { 0 };
+	MonitorExtensionVersion version = { 0 };
+
+	size_t size = sizeof(MonitorBenchResults);
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!monitor_get_extension_version(&monitor, &version))
+	{
+		log_error("Failed to check the version of the monitor extension \"%s\"",
+				  PG_AUTOCTL_MONITOR_EXTENSION_NAME);
+		return false;
+	}
+
+	MonitorBenchResults *results =
+		(MonitorBenchResults *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+									 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (results == MAP_FAILED)
+	{
+		log_error("Failed to allocate shared memory for the benchmark: %m");
+		return false;
+	}
+
+	memset(results, 0, size);
+
+	/* pick the same protocol functions as a keeper would */
+	if (!parse_pgaf_extension_version_string(version.installedVersion,
+											 &(results->extensionVersionNum)))
+	{
+		/* errors have already been logged */
+		results->extensionVersionNum = 0;
+	}
+
+	if (!monitor_bench_create_formations(&monitor, options))
+	{
+		/* errors have already been logged */
+		(void) munmap(results, size);
+		return false;
+	}
+
+	log_info("Simulating %d nodes in %d groups with %d clients "
+			 "and %d listeners for %ds, calling node_active every %dms",
+			 options->nodesCount,
+			 options->groupsCount,
+			 options->clientsCount,
+			 options->listenersCount,
+			 options->duration,
+			 options->intervalMs);
+
+	results->startUs = monitor_bench_now_us();
+	results->startTime = time(NULL);
+
+	bool success = monitor_bench_run_processes(options, results);
+
+	(void) monitor_bench_drop_formations(&monitor, options);
+
+	JSON_Value *js = monitor_bench_to_json(options, results);
+	char *serialized = json_serialize_to_string_pretty(js);
+
+	if (IS_EMPTY_STRING_BUFFER(options->outputFilename))
+	{
+		fformat(stdout, "%s\n", serialized);
+	}
+	else if (!write_file(serialized, strlen(serialized),
+						 options->outputFilename))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+	else
+	{
+		log_info("Wrote benchmark results to \"%s\"", options->outputFilename);
+	}
+
+	json_free_serialized_string(serialized);
+	json_value_free(js);
+
+	(void) munmap(results, size);
+
+	return success;
+}
+
+
+/*
+ * monitor_bench_formation_name builds the name of the formation of the given
+ * synthetic group: pgsql formations only have a group zero.
+ */
+static void
+monitor_bench_formation_name(MonitorBenchOptions *options, int group,
+							 char *name, size_t size)
+{
+	sformat(name, size, "%s_%d", options->formationPrefix, group);
+}
+
+
+/*
+ * monitor_bench_create_formations creates a formation on the monitor for
+ * each synthetic group.
+ */
+static bool
+monitor_bench_create_formations(Monitor *monitor, MonitorBenchOptions *options)
+{
+	for (int group = 0; group < options->groupsCount; group++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		(void) monitor_bench_formation_name(options, group,
+											formation, sizeof(formation));
+
+		if (!monitor_create_formation(monitor, formation, "pgsql", "postgres",
+									  true, 0))
+		{
+			log_error("Failed to create the benchmark formations, "
+					  "a previous benchmark might have left formation \"%s\" "
+					  "behind, see pg_autoctl drop formation",
+					  formation);
+
+			/* don't leave our own formations behind */
+			options->groupsCount = group;
+			(void) monitor_bench_drop_formations(monitor, options);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_bench_drop_formations drops the benchmark formations, after the
+ * clients have removed their nodes.
+ */
+static void
+monitor_bench_drop_formations(Monitor *monitor, MonitorBenchOptions *options)
+{
+	for (int group = 0; group < options->groupsCount; group++)
+	{
+		char formation[NAMEDATALEN] = { 0 };
+
+		(void) monitor_bench_formation_name(options, group,
+											formation, sizeof(formation));
+
+		if (!monitor_drop_formation(monitor, formation))
+		{
+			log_warn("Failed to drop benchmark formation \"%s\"", formation);
+		}
+	}
+}
+
+
+/*
+ * monitor_bench_run_processes starts the clients sub-processes, and the
+ * listener sub-process when asked to, and waits until they are done.
+ */
+static bool
+monitor_bench_run_processes(MonitorBenchOptions *options,
+							MonitorBenchResults *results)
+{
+	int processCount = options->clientsCount + 1;
+	int startedCount = 0;
+	pid_t pidArray[MONITOR_BENCH_MAX_CLIENTS + 1] = { 0 };
+
+	IntString semIdString = intToString(log_semaphore.semId);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/* we want to use the same logs semaphore in the sub-processes */
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+
+	for (int index = 0; index < processCount; index++)
+	{
+		/* the last process is the listener */
+		bool isListener = index == options->clientsCount;
+
+		if (isListener && options->listenersCount == 0)
+		{
+			break;
+		}
+
+		pid_t fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork benchmark process %d", index);
+
+				for (int i = 0; i < startedCount; i++)
+				{
+					(void) kill(pidArray[i], SIGQUIT);
+				}
+
+				(void) monitor_bench_wait_for_processes(pidArray, startedCount);
+
+				return false;
+			}
+
+			case 0:
+			{
+				/* initialize the semaphore used for locking log output */
+				if (!semaphore_init(&log_semaphore))
+				{
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				/* set our logging facility to use our semaphore as a lock */
+				(void) log_set_udata(&log_semaphore);
+				(void) log_set_lock(&semaphore_log_lock_function);
+
+				if (isListener)
+				{
+					(void) monitor_bench_listener(options, results);
+				}
+				else
+				{
+					(void) monitor_bench_client(options, index, results);
+				}
+
+				(void) semaphore_finish(&log_semaphore);
+				exit(EXIT_CODE_QUIT);
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				pidArray[startedCount++] = fpid;
+			}
+		}
+	}
+
+	return monitor_bench_wait_for_processes(pidArray, startedCount);
+}
+
+
+/*
+ * monitor_bench_wait_for_processes waits until all the sub-processes are
+ * finished, and returns true when all of them exited successfully.
+ */
+static bool
+monitor_bench_wait_for_processes(pid_t pidArray[], int count)
+{
+	int remaining = count;
+	bool allReturnCodeAreZero = true;
+
+	while (remaining > 0)
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			/* ECHILD: no more children */
+			break;
+		}
+
+		if (WEXITSTATUS(status) != 0)
+		{
+			log_error("Benchmark process %d exited with code %d",
+					  pid, WEXITSTATUS(status));
+			allReturnCodeAreZero = false;
+		}
+
+		--remaining;
+	}
+
+	return allReturnCodeAreZero;
+}
+
+
+/*
+ * monitor_bench_client simulates the keepers of the synthetic groups that
+ * belong to the given client: group g belongs to client g % clientsCount.
+ * Nodes register when they are first called, spread over the first interval,
+ * and are removed from the monitor at the end of the benchmark.
+ */
+static void
+monitor_bench_client(MonitorBenchOptions *options, int clientId,
+					 MonitorBenchResults *results)
+{
+	Monitor monitor = { 0 };
+	MonitorBenchClient *stats = &(results->clients[clientId]);
+
+	int nodesPerGroup = options->nodesCount / options->groupsCount;
+	int extraNodes = options->nodesCount % options->groupsCount;
+
+	uint64_t startUs = monitor_bench_now_us();
+	uint64_t endUs = results->startUs + (uint64_t) options->duration * 1000000;
+	uint64_t intervalUs = (uint64_t) options->intervalMs * 1000;
+
+	int nodesCount = 0;
+
+	MonitorBenchGroup *groups =
+		(MonitorBenchGroup *) calloc(options->groupsCount,
+									 sizeof(MonitorBenchGroup));
+	MonitorBenchNode *nodes =
+		(MonitorBenchNode *) calloc(options->nodesCount,
+									sizeof(MonitorBenchNode));
+
+	if (groups == NULL || nodes == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* initialize a seed for our random number generator */
+	pg_srand48(((unsigned int) (getpid() ^ time(NULL))));
+
+	for (int index = 0; index < MONITOR_BENCH_FUNCTIONS_COUNT; index++)
+	{
+		(void) histogram_init(&(stats->calls[index].latency));
+	}
+
+	for (int g = clientId; g < options->groupsCount; g += options->clientsCount)
+	{
+		int count = nodesPerGroup + (g < extraNodes ? 1 : 0);
+
+		groups[g].timeline = 1;
+
+		for (int k = 0; k < count; k++)
+		{
+			MonitorBenchNode *node = &(nodes[nodesCount++]);
+
+			node->group = g;
+			node->port = options->basePort + g + k * options->groupsCount;
+			node->state = INIT_STATE;
+			node->nextCallUs = startUs + random_between(0, intervalUs);
+
+			(void) monitor_bench_formation_name(options, g,
+												node->formation,
+												sizeof(node->formation));
+
+			sformat(node->name, sizeof(node->name), "%s_%d_%d",
+					options->formationPrefix, g, k);
+		}
+	}
+
+	if (!monitor_init(&monitor, options->monitor_pguri))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* keepers connect to the monitor again for each query, by default */
+	if (options->persistent)
+	{
+		monitor.pgsql.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+	}
+
+	monitor.extensionVersionNum = results->extensionVersionNum;
+	(void) pgsql_set_main_loop_retry_policy(&(monitor.pgsql.retryPolicy));
+
+	while (nodesCount > 0 && !monitor_bench_asked_to_stop())
+	{
+		/* call the node that's been waiting for the longest time */
+		MonitorBenchNode *node = &(nodes[0]);
+
+		for (int index = 1; index < nodesCount; index++)
+		{
+			if (nodes[index].nextCallUs < node->nextCallUs)
+			{
+				node = &(nodes[index]);
+			}
+		}
+
+		uint64_t now = monitor_bench_now_us();
+
+		if (node->nextCallUs >= endUs || now >= endUs)
+		{
+			break;
+		}
+
+		if (now < node->nextCallUs)
+		{
+			pg_usleep(node->nextCallUs - now);
+		}
+
+		(void) monitor_bench_node_call(&monitor, options, node,
+									   &(groups[node->group]),
+									   monitor_bench_now_us() - results->startUs,
+									   stats);
+
+		/* keepers sleep between calls, they don't try to catch-up */
+		node->nextCallUs += intervalUs;
+		now = monitor_bench_now_us();
+
+		if (node->nextCallUs < now)
+		{
+			node->nextCallUs = now + intervalUs;
+		}
+	}
+
+	/* clean-up after ourselves, with the default interactive retry policy */
+	(void) pgsql_set_monitor_interactive_retry_policy(
+		&(monitor.pgsql.retryPolicy));
+
+	for (int index = 0; index < nodesCount; index++)
+	{
+		MonitorBenchNode *node = &(nodes[index]);
+
+		if (node->nodeId <= 0)
+		{
+			continue;
+		}
+
+		uint64_t callStartUs = monitor_bench_now_us();
+		bool force = true;
+
+		bool success = monitor_remove_by_nodename(&monitor,
+												  node->formation,
+												  node->name,
+												  force);
+
+		(void) monitor_bench_record(stats, MONITOR_BENCH_REMOVE_NODE,
+									callStartUs, success);
+	}
+
+	pgsql_finish(&(monitor.pgsql));
+
+	log_info("Client %d registered %" PRIu64 " nodes and ran %" PRIu64
+			 " node_active calls, with %" PRIu64 " transitions, "
+			 "%" PRIu64 " health flaps, and %" PRIu64 " errors",
+			 clientId,
+			 stats->registered,
+			 stats->calls[MONITOR_BENCH_NODE_ACTIVE].latency.count,
+			 stats->transitions,
+			 stats->flaps,
+			 stats->calls[MONITOR_BENCH_NODE_ACTIVE].errors);
+
+	free(groups);
+	free(nodes);
+}
+
+
+/*
+ * monitor_bench_node_call runs one round of the keeper main loop for the
+ * given synthetic node: register the node when it's not been registered yet,
+ * or check the extension version and call node_active, and then fetch the
+ * other nodes when node_active did not return them.
+ */
+static void
+monitor_bench_node_call(Monitor *monitor,
+						MonitorBenchOptions *options,
+						MonitorBenchNode *node,
+						MonitorBenchGroup *group,
+						uint64_t elapsedUs,
+						MonitorBenchClient *stats)
+{
+	MonitorAssignedState assignedState = { 0 };
+	MonitorExtensionVersion version = { 0 };
+
+	if (node->nodeId < 0)
+	{
+		/* registration failed and can't be retried */
+		return;
+	}
+
+	if (node->nodeId == 0)
+	{
+		bool mayRetry = false;
+		uint64_t callStartUs = monitor_bench_now_us();
+
+		bool success =
+			monitor_register_node(monitor,
+								  node->formation,
+								  node->name,
+								  options->hostname,
+								  node->port,
+								  0,
+								  "postgres",
+								  -1,
+								  -1,
+								  INIT_STATE,
+								  NODE_KIND_STANDALONE,
+								  FAILOVER_NODE_CANDIDATE_PRIORITY,
+								  FAILOVER_NODE_REPLICATION_QUORUM,
+								  DEFAULT_CITUS_CLUSTER_NAME,
+								  &mayRetry,
+								  &assignedState);
+
+		(void) monitor_bench_record(stats, MONITOR_BENCH_REGISTER_NODE,
+									callStartUs, success);
+
+		if (!success)
+		{
+			if (!mayRetry)
+			{
+				log_error("Failed to register node \"%s\" in formation \"%s\"",
+						  node->name, node->formation);
+				node->nodeId = -1;
+			}
+			return;
+		}
+
+		node->nodeId = assignedState.nodeId;
+		node->state = assignedState.state;
+
+		++group->registeredCount;
+		++stats->registered;
+
+		return;
+	}
+
+	/* a flapping node reports that Postgres is not running for a while */
+	bool pgIsRunning = true;
+
+	if (node->flapCalls > 0)
+	{
+		--node->flapCalls;
+		pgIsRunning = false;
+	}
+	else if (options->flapRate > 0)
+	{
+		/* probability of a flap at each call, in parts per million */
+		int64_t flapPpm =
+			(int64_t) options->flapRate * options->intervalMs * 10 / 36;
+
+		if (random_between(1, 1000000) <= flapPpm)
+		{
+			node->flapCalls = MONITOR_BENCH_FLAP_CALLS - 1;
+			pgIsRunning = false;
+			++stats->flaps;
+		}
+	}
+
+	/* primaries report the group LSN, standbys lag for up to 100ms */
+	bool isPrimary =
+		node->state == SINGLE_STATE ||
+		node->state == PRIMARY_STATE ||
+		node->state == WAIT_PRIMARY_STATE ||
+		node->state == JOIN_PRIMARY_STATE ||
+		node->state == APPLY_SETTINGS_STATE;
+
+	uint64_t lsn = 0x1000000 + (uint64_t) options->lsnRate * elapsedUs / 1000000;
+
+	if (!isPrimary && options->lsnRate >= 10)
+	{
+		uint64_t lag = random_between(0, options->lsnRate / 10);
+
+		lsn = lag < lsn ? lsn - lag : 0;
+	}
+
+	char currentLSN[PG_LSN_MAXLENGTH] = { 0 };
+
+	sformat(currentLSN, sizeof(currentLSN), "%X/%X",
+			(uint32_t) (lsn >> 32), (uint32_t) lsn);
+
+	char *pgsrSyncState = isPrimary && group->registeredCount > 1 ? "quorum" : "";
+
+	uint64_t callStartUs = monitor_bench_now_us();
+
+	bool success = monitor_get_extension_version(monitor, &version);
+
+	(void) monitor_bench_record(stats, MONITOR_BENCH_EXTENSION_VERSION,
+								callStartUs, success);
+
+	if (!success)
+	{
+		return;
+	}
+
+	monitor->knownNodesVersion = node->knownNodesVersion;
+	callStartUs = monitor_bench_now_us();
+
+	success = monitor_node_active(monitor,
+								  node->formation,
+								  node->nodeId,
+								  0,
+								  node->state,
+								  pgIsRunning,
+								  group->timeline,
+								  currentLSN,
+								  pgsrSyncState,
+								  &assignedState);
+
+	(void) monitor_bench_record(stats, MONITOR_BENCH_NODE_ACTIVE,
+								callStartUs, success);
+
+	if (!success)
+	{
+		return;
+	}
+
+	if (assignedState.state != node->state)
+	{
+		++stats->transitions;
+
+		/* promoting a standby starts a new timeline */
+		if (assignedState.state == STOP_REPLICATION_STATE)
+		{
+			++group->timeline;
+		}
+
+		/* reach the assigned state instantly */
+		node->state = assignedState.state;
+	}
+
+	if (!assignedState.otherNodesKnown && !assignedState.hasOtherNodes)
+	{
+		NodeAddressArray otherNodes = { 0 };
+
+		callStartUs = monitor_bench_now_us();
+
+		success = monitor_get_other_nodes(monitor, node->nodeId, ANY_STATE,
+										  &otherNodes);
+
+		(void) monitor_bench_record(stats, MONITOR_BENCH_GET_OTHER_NODES,
+									callStartUs, success);
+
+		if (!success)
+		{
+			return;
+		}
+	}
+
+	node->knownNodesVersion = assignedState.nodesVersion;
+}
+
+
+/*
+ * monitor_bench_listener opens the LISTEN sessions, on the notification
+ * channel of each group in turn as the keepers do, and counts the
+ * notifications received until the end of the benchmark.
+ */
+static void
+monitor_bench_listener(MonitorBenchOptions *options,
+					   MonitorBenchResults *results)
+{
+	MonitorBenchListener *stats = &(results->listener);
+	int count = options->listenersCount;
+
+	uint64_t endUs = results->startUs + (uint64_t) options->duration * 1000000;
+
+	PGSQL *sessions = (PGSQL *) calloc(count, sizeof(PGSQL));
+	struct pollfd *pollFds = (struct pollfd *) calloc(count,
+													  sizeof(struct pollfd));
+
+	if (sessions == NULL || pollFds == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	(void) histogram_init(&(stats->listen));
+
+	for (int index = 0; index < count; index++)
+	{
+		PGSQL *pgsql = &(sessions[index]);
+
+		char formation[NAMEDATALEN] = { 0 };
+		char channel[BUFSIZE] = { 0 };
+		char *channels[] = { channel, NULL };
+
+		pollFds[index].fd = -1;
+
+		if (monitor_bench_asked_to_stop())
+		{
+			break;
+		}
+
+		(void) monitor_bench_formation_name(options,
+											index % options->groupsCount,
+											formation, sizeof(formation));
+
+		(void) monitor_state_channel(formation, 0, channel, sizeof(channel));
+
+		uint64_t startUs = monitor_bench_now_us();
+
+		if (!pgsql_init(pgsql, options->monitor_pguri, PGSQL_CONN_MONITOR) ||
+			!pgsql_listen(pgsql, channels))
+		{
+			++stats->errors;
+			continue;
+		}
+
+		(void) histogram_record(&(stats->listen),
+								monitor_bench_now_us() - startUs);
+
+		pollFds[index].fd = PQsocket(pgsql->connection);
+		pollFds[index].events = POLLIN;
+
+		++stats->sessions;
+	}
+
+	while (!monitor_bench_asked_to_stop() && monitor_bench_now_us() < endUs)
+	{
+		/* EINTR is fine, we process signals next */
+		int ready = poll(pollFds, count, 100);
+
+		if (ready <= 0)
+		{
+			continue;
+		}
+
+		for (int index = 0; index < count; index++)
+		{
+			PGconn *connection = sessions[index].connection;
+			PGnotify *notify = NULL;
+
+			if (!(pollFds[index].revents & POLLIN))
+			{
+				continue;
+			}
+
+			if (PQconsumeInput(connection) == 0)
+			{
+				log_warn("Failed to read notifications from the monitor: %s",
+						 PQerrorMessage(connection));
+
+				++stats->errors;
+				pollFds[index].fd = -1;
+				continue;
+			}
+
+			while ((notify = PQnotifies(connection)) != NULL)
+			{
+				++stats->notifications;
+				PQfreemem(notify);
+			}
+		}
+	}
+
+	for (int index = 0; index < count; index++)
+	{
+		pgsql_finish(&(sessions[index]));
+	}
+
+	log_info("Listener received %" PRIu64 " notifications on %" PRIu64
+			 " sessions",
+			 stats->notifications,
+			 stats->sessions);
+
+	free(sessions);
+	free(pollFds);
+}
+
+
+/*
+ * monitor_bench_record records the latency of a successful call to a
+ * protocol function, or counts the error.
+ */
+static void
+monitor_bench_record(MonitorBenchClient *stats,
+					 MonitorBenchFunction function,
+					 uint64_t startUs, bool success)
+{
+	MonitorBenchCall *call = &(stats->calls[function]);
+
+	if (success)
+	{
+		(void) histogram_record(&(call->latency),
+								monitor_bench_now_us() - startUs);
+	}
+	else
+	{
+		++call->errors;
+	}
+}
+
+
+/*
+ * monitor_bench_to_json returns the benchmark results as a JSON object: the
+ * options used, the throughput of the monitor, and the latency histogram and
+ * error count of each protocol function with all the clients merged.
+ */
+static JSON_Value *
+monitor_bench_to_json(MonitorBenchOptions *options,
+					  MonitorBenchResults *results)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	JSON_Value *jsFunctions = json_value_init_object();
+	JSON_Object *jsFunctionsObj = json_value_get_object(jsFunctions);
+
+	JSON_Value *jsListener = json_value_init_object();
+	JSON_Object *jsListenerObj = json_value_get_object(jsListener);
+
+	/* the histograms are too large for the stack */
+	MonitorBenchClient *total =
+		(MonitorBenchClient *) calloc(1, sizeof(MonitorBenchClient));
+
+	MonitorBenchListener *listener = &(results->listener);
+
+	char timestring[MAXCTIMESIZE] = { 0 };
+	uint64_t totalCalls = 0;
+
+	if (total == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return js;
+	}
+
+	for (int index = 0; index < options->clientsCount; index++)
+	{
+		MonitorBenchClient *client = &(results->clients[index]);
+
+		for (int f = 0; f < MONITOR_BENCH_FUNCTIONS_COUNT; f++)
+		{
+			(void) histogram_merge(&(total->calls[f].latency),
+								   &(client->calls[f].latency));
+
+			total->calls[f].errors += client->calls[f].errors;
+		}
+
+		total->registered += client->registered;
+		total->transitions += client->transitions;
+		total->flaps += client->flaps;
+	}
+
+	json_object_set_string(jsObj, "version", PG_AUTOCTL_VERSION);
+	json_object_set_string(jsObj, "started_at",
+						   epoch_to_string(results->startTime, timestring));
+	json_object_set_number(jsObj, "nodes", options->nodesCount);
+	json_object_set_number(jsObj, "groups", options->groupsCount);
+	json_object_set_number(jsObj, "clients", options->clientsCount);
+	json_object_set_number(jsObj, "listeners", options->listenersCount);
+	json_object_set_number(jsObj, "duration", options->duration);
+	json_object_set_number(jsObj, "interval_ms", options->intervalMs);
+	json_object_set_number(jsObj, "flap_rate", options->flapRate);
+	json_object_set_number(jsObj, "lsn_rate", options->lsnRate);
+	json_object_set_boolean(jsObj, "persistent", options->persistent);
+
+	json_object_set_number(jsObj, "registered", (double) total->registered);
+	json_object_set_number(jsObj, "transitions", (double) total->transitions);
+	json_object_set_number(jsObj, "flaps", (double) total->flaps);
+
+	for (int f = 0; f < MONITOR_BENCH_FUNCTIONS_COUNT; f++)
+	{
+		MonitorBenchCall *call = &(total->calls[f]);
+
+		JSON_Value *jsCall = histogram_to_json(&(call->latency), true);
+		JSON_Object *jsCallObj = json_value_get_object(jsCall);
+
+		json_object_set_number(jsCallObj, "errors", (double) call->errors);
+
+		/* nodes are removed after the benchmark duration */
+		if (f != MONITOR_BENCH_REMOVE_NODE)
+		{
+			totalCalls += call->latency.count;
+
+			json_object_set_number(jsCallObj, "calls_per_second",
+								   (double) call->latency.count /
+								   options->duration);
+		}
+
+		json_object_set_value(jsFunctionsObj,
+							  MonitorBenchFunctionNames[f],
+							  jsCall);
+
+		if (call->latency.count > 0 || call->errors > 0)
+		{
+			log_info("%s: %" PRIu64 " calls, p50 %.3f ms, p99 %.3f ms, "
+					 "max %.3f ms, %" PRIu64 " errors",
+					 MonitorBenchFunctionNames[f],
+					 call->latency.count,
+					 histogram_percentile(&(call->latency), 50.0) / 1000.0,
+					 histogram_percentile(&(call->latency), 99.0) / 1000.0,
+					 call->latency.max / 1000.0,
+					 call->errors);
+		}
+	}
+
+	json_object_set_number(jsObj, "calls_per_second",
+						   (double) totalCalls / options->duration);
+
+	log_info("Monitor throughput: %.1f calls per second",
+			 (double) totalCalls / options->duration);
+
+	json_object_set_value(jsObj, "functions", jsFunctions);
+
+	json_object_set_number(jsListenerObj, "sessions",
+						   (double) listener->sessions);
+	json_object_set_number(jsListenerObj, "errors", (double) listener->errors);
+	json_object_set_number(jsListenerObj, "notifications",
+						   (double) listener->notifications);
+	json_object_set_number(jsListenerObj, "notifications_per_second",
+						   (double) listener->notifications / options->duration);
+	json_object_set_value(jsListenerObj, "listen",
+						  histogram_to_json(&(listener->listen), false));
+
+	json_object_set_value(jsObj, "notifications", jsListener);
+
+	free(total);
+
+	return js;
+}
+
+
+/*
+ * monitor_bench_now_us returns the current time from a monotonic clock, in
+ * microseconds, shared by all the benchmark processes.
+ */
+static uint64_t
+monitor_bench_now_us()
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+
+	return (uint64_t) INSTR_TIME_GET_MICROSEC(now);
+}
+
+
+/*
+ * monitor_bench_asked_to_stop returns true when we received a signal that
+ * asks us to stop.
+ */
+static bool
+monitor_bench_asked_to_stop()
+{
+	return asked_to_stop || asked_to_stop_fast || asked_to_quit;
+}
@@ -0,0 +1,61 @@
+/*
+ * src/bin/pg_autoctl/monitor_bench.h
+ *	 Load generator for the pg_auto_failover monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef MONITOR_BENCH_H
+#define MONITOR_BENCH_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+#include "postgres_fe.h"
+
+#include "pgsql.h"
+
+#define MONITOR_BENCH_MAX_CLIENTS 128
+#define MONITOR_BENCH_MAX_LISTENERS 1000
+
+#define MONITOR_BENCH_DEFAULT_NODES 100
+#define MONITOR_BENCH_DEFAULT_GROUPS 50
+#define MONITOR_BENCH_DEFAULT_CLIENTS 10
+#define MONITOR_BENCH_DEFAULT_DURATION 60
+#define MONITOR_BENCH_DEFAULT_BASE_PORT 40000
+
+/* health flaps per node per hour, and WAL bytes per second per group */
+#define MONITOR_BENCH_DEFAULT_FLAP_RATE 6
+#define MONITOR_BENCH_DEFAULT_LSN_RATE (1024 * 1024)
+
+/* a flapping node reports Postgres is not running for that many calls */
+#define MONITOR_BENCH_FLAP_CALLS 3
+
+typedef struct MonitorBenchOptions
+{
+	char monitor_pguri[MAXCONNINFO];
+	char formationPrefix[NAMEDATALEN];
+	char hostname[_POSIX_HOST_NAME_MAX];
+	int basePort;
+
+	int nodesCount;
+	int groupsCount;
+	int clientsCount;
+	int listenersCount;
+
+	int duration;
+	int intervalMs;
+	int flapRate;
+	int lsnRate;
+	bool persistent;
+
+	char outputFilename[MAXPGPATH];
+} MonitorBenchOptions;
+
+extern MonitorBenchOptions monitorBenchOptions;
+
+bool monitor_bench(MonitorBenchOptions *options);
+
+#endif /* MONITOR_BENCH_H */
@@ -98,6 +98,15 @@
 	make_strbuf_option("ssl", "key_file", "server-key", \
 					   false, MAXPGPATH, config->pgSetup.ssl.serverKey)
 
+#define OPTION_REPLICATION_STANDBY_OF(config) \
+	make_strbuf_option("replication", "standby_of", "standby-of", \
+					   false, MAXCONNINFO, config->standbyOf)
+
+#define OPTION_REPLICATION_TAKEOVER_TIMEOUT(config) \
+	make_int_option_default("replication", "takeover_timeout", NULL, \
+							false, &(config->takeoverTimeout), \
+							MONITOR_TAKEOVER_TIMEOUT)
+
 
 #define SET_INI_OPTIONS_ARRAY(config) \
 	{ \
@@ -118,6 +127,8 @@
 		OPTION_SSL_CRL_FILE(config), \
 		OPTION_SSL_SERVER_CERT(config), \
 		OPTION_SSL_SERVER_KEY(config), \
+		OPTION_REPLICATION_STANDBY_OF(config), \
+		OPTION_REPLICATION_TAKEOVER_TIMEOUT(config), \
 		INI_OPTION_LAST \
 	}
 
@@ -395,6 +406,9 @@ monitor_config_log_settings(MonitorConfig config)
 	log_debug("ssl.crlFile: %s", config.pgSetup.ssl.crlFile);
 	log_debug("ssl.serverKey: %s", config.pgSetup.ssl.serverCert);
 	log_debug("ssl.serverCert: %s", config.pgSetup.ssl.serverKey);
+
+	log_debug("replication.standby_of: %s", config.standbyOf);
+	log_debug("replication.takeover_timeout: %d", config.takeoverTimeout);
 }
 
 
@@ -633,6 +647,23 @@ monitor_config_accept_new(MonitorConfig *config, MonitorConfig *newConfig)
 		strlcpy(config->hostname, newConfig->hostname, _POSIX_HOST_NAME_MAX);
 	}
 
+	/* the upstream of a hot standby monitor can be changed online */
+	if (strneq(newConfig->standbyOf, config->standbyOf))
+	{
+		log_info("Reloading configuration: replication.standby_of is now "
+				 "\"%s\"; used to be \"%s\"",
+				 newConfig->standbyOf, config->standbyOf);
+		strlcpy(config->standbyOf, newConfig->standbyOf, MAXCONNINFO);
+	}
+
+	if (newConfig->takeoverTimeout != config->takeoverTimeout)
+	{
+		log_info("Reloading configuration: replication.takeover_timeout "
+				 "is now %d; used to be %d",
+				 newConfig->takeoverTimeout, config->takeoverTimeout);
+		config->takeoverTimeout = newConfig->takeoverTimeout;
+	}
+
 	/* we can change any SSL related setup options at runtime */
 	return config_accept_new_ssloptions(&(config->pgSetup),
 										&(newConfig->pgSetup));
@@ -31,6 +31,10 @@ typedef struct MonitorConfig
 
 	/* PostgreSQL setup */
 	PostgresSetup pgSetup;
+
+	/* hot standby monitor setup */
+	char standbyOf[MAXCONNINFO];
+	int takeoverTimeout;
 } MonitorConfig;
 
 
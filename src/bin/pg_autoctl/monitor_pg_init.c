@@ -20,6 +20,7 @@
 #include "monitor.h"
 #include "monitor_config.h"
 #include "monitor_pg_init.h"
+#include "parsing.h"
 #include "pgctl.h"
 #include "pghba.h"
 #include "pgsetup.h"
@@ -63,11 +64,13 @@ GUC monitor_default_settings[] = {
 
 
 static bool check_monitor_settings(PostgresSetup pgSetup);
+static bool monitor_pg_init_standby(Monitor *monitor);
 
 
 /*
  * monitor_pg_init initializes a pg_auto_failover monitor PostgreSQL cluster
- * from scratch using `pg_ctl initdb`.
+ * from scratch using `pg_ctl initdb`, or as a hot standby of another monitor
+ * using pg_basebackup when replication.standby_of is set.
  */
 bool
 monitor_pg_init(Monitor *monitor)
@@ -108,6 +111,15 @@ monitor_pg_init(Monitor *monitor)
 			return false;
 		}
 	}
+	else if (!IS_EMPTY_STRING_BUFFER(config->standbyOf))
+	{
+		if (!monitor_pg_init_standby(monitor))
+		{
+			log_fatal("Failed to initialize a hot standby monitor at \"%s\", "
+					  "see above for details", pgSetup->pgdata);
+			return false;
+		}
+	}
 	else
 	{
 		if (!pg_ctl_initdb(pgSetup->pg_ctl, pgSetup->pgdata))
@@ -129,6 +141,107 @@ monitor_pg_init(Monitor *monitor)
 }
 
 
+/*
+ * monitor_pg_init_standby initializes PGDATA with a pg_basebackup of the
+ * monitor at replication.standby_of, and sets it up to stream from there. The
+ * pg_auto_failover database, its roles and extension, and the HBA rules, are
+ * all part of the base backup.
+ *
+ * The URI must name a user with the REPLICATION privilege, and the upstream
+ * monitor must allow replication connections from this host for that user:
+ * the monitor's own HBA rules only cover the pg_auto_failover database.
+ */
+static bool
+monitor_pg_init_standby(Monitor *monitor)
+{
+	MonitorConfig *config = &(monitor->config);
+	PostgresSetup *pgSetup = &(config->pgSetup);
+
+	LocalPostgresServer postgres = { 0 };
+	ReplicationSource *upstream = &(postgres.replicationSource);
+
+	NodeAddress upstreamNode = { 0 };
+	URIParams params = { 0 };
+	KeyVal overrides = { 0 };
+	SSLOptions sslOptions = { 0 };
+
+	char backupDirectory[MAXPGPATH] = { 0 };
+	bool checkForCompleteURI = false;
+
+	if (!parse_pguri_info_key_vals(config->standbyOf,
+								   &overrides,
+								   &params,
+								   checkForCompleteURI) ||
+		!hostname_from_uri(config->standbyOf,
+						   upstreamNode.host, _POSIX_HOST_NAME_MAX,
+						   &(upstreamNode.port)) ||
+		!parse_pguri_ssl_settings(config->standbyOf, &sslOptions))
+	{
+		log_error("Failed to parse replication.standby_of \"%s\"",
+				  config->standbyOf);
+		return false;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(params.username))
+	{
+		log_error("Failed to initialize a hot standby monitor: "
+				  "replication.standby_of \"%s\" must name a user "
+				  "with the REPLICATION privilege",
+				  config->standbyOf);
+		return false;
+	}
+
+	path_in_same_directory(pgSetup->pgdata, "backup/monitor", backupDirectory);
+
+	(void) local_postgres_init(&postgres, pgSetup);
+
+	if (!standby_init_replication_source(&postgres,
+										 &upstreamNode,
+										 params.username,
+										 NULL, /* password from PGPASSFILE */
+										 "",   /* no replication slot */
+										 MAXIMUM_BACKUP_RATE,
+										 backupDirectory,
+										 NULL, /* no targetLSN */
+										 sslOptions,
+										 0))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	strlcpy(upstream->applicationName,
+			REPLICATION_APPLICATION_NAME_PREFIX "monitor",
+			MAXCONNINFO);
+
+	log_info("Initializing a hot standby of the monitor at %s:%d",
+			 upstreamNode.host, upstreamNode.port);
+
+	if (!pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, upstream))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pg_controldata(pgSetup, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   upstream))
+	{
+		log_error("Failed to setup Postgres as a standby after pg_basebackup");
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * Install pg_auto_failover monitor in some existing PostgreSQL instance:
  *
@@ -189,6 +302,27 @@ monitor_install(const char *hostname,
 		return false;
 	}
 
+	/*
+	 * A hot standby monitor gets the roles, the database, and the extension
+	 * from its upstream monitor, and could not create them anyway.
+	 */
+	bool inRecovery = false;
+
+	if (!pgsql_is_in_recovery(&postgres.sqlClient, &inRecovery))
+	{
+		log_error("Failed to install pg_auto_failover in the monitor's "
+				  "Postgres database, see above for details");
+		return false;
+	}
+
+	if (inRecovery)
+	{
+		log_info("Your pg_auto_failover hot standby monitor instance "
+				 "is now ready on port %d.",
+				 pgSetup.pgport);
+		return true;
+	}
+
 	if (!pgsql_create_user(&postgres.sqlClient, PG_AUTOCTL_MONITOR_DBOWNER,
 
 	                       /* password, login, superuser, replication, connlimit */
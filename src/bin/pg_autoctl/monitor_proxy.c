@@ -0,0 +1,650 @@
+/*
+ * src/bin/pg_autoctl/monitor_proxy.c
+ *   Client and protocol of the pg_autoctl monitor-proxy service.
+ *
+ * Every pg_autoctl CLI command that queries the monitor opens a connection of
+ * its own, including the TLS handshake and the authentication. When the
+ * monitor-proxy service is enabled, pg_autoctl run keeps a monitor session
+ * open and listens on a unix socket next to its pidfile: read-only CLI
+ * commands then send their SQL query there and get the result back.
+ *
+ * The protocol is a single request per connection, and a single response.
+ * Both are a sequence of netstrings: the length of the field, a colon, the
+ * field itself, and a comma. A SQL NULL is sent with the length -1.
+ *
+ *   request:  "1" connstring sql paramCount (paramType paramValue)*
+ *   response: "ok" nfields (fname ftype)* ntuples value*
+ *             "error" sqlstate
+ *
+ * When anything goes wrong, the client connects to the monitor itself, so the
+ * monitor-proxy is never required for a command to work.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+#include "pqexpbuffer.h"
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "monitor_proxy.h"
+#include "string_utils.h"
+
+#define MONITOR_PROXY_PROTOCOL_VERSION "1"
+
+/* macOS doesn't have MSG_NOSIGNAL, there we ignore SIGPIPE instead */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* a cursor in a buffer of netstrings that we are parsing */
+typedef struct ProxyReader
+{
+	char *data;
+	size_t len;
+	size_t pos;
+} ProxyReader;
+
+
+static int monitor_proxy_connect(const char *socketPath);
+static void proxy_append_field(PQExpBuffer out, const char *value, int len);
+static void proxy_append_string(PQExpBuffer out, const char *value);
+static void proxy_append_int(PQExpBuffer out, int value);
+static bool proxy_read_field(ProxyReader *reader, char **value, int *len);
+static bool proxy_read_int(ProxyReader *reader, int *value);
+
+
+/*
+ * monitor_proxy_socket_path computes the path to the monitor-proxy unix
+ * socket, which is next to the given pidfile. It returns false when the path
+ * is too long to be used as a unix socket path.
+ */
+bool
+monitor_proxy_socket_path(const char *pidfile, char *path)
+{
+	struct sockaddr_un addr;
+
+	(void) path_in_same_directory(pidfile,
+								  KEEPER_MONITOR_PROXY_SOCKET_FILENAME,
+								  path);
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		log_debug("Path to the monitor-proxy socket \"%s\" is too long", path);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * monitor_proxy_execute sends the given SQL query to the monitor-proxy
+ * service, and calls the parse function with the result. It returns false
+ * without having called the parse function when the query could not be run
+ * through the monitor-proxy, in which case the caller connects to the monitor.
+ */
+bool
+monitor_proxy_execute(PGSQL *pgsql, const char *sql, int paramCount,
+					  const Oid *paramTypes, const char **paramValues,
+					  void *context, ParsePostgresResultCB *parseFun)
+{
+	PGresult *result = NULL;
+
+	if (paramCount > MONITOR_PROXY_MAX_PARAMS)
+	{
+		return false;
+	}
+
+	int sock = monitor_proxy_connect(pgsql->proxySocketPath);
+
+	if (sock < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	PQExpBuffer request = createPQExpBuffer();
+	PQExpBuffer response = createPQExpBuffer();
+
+	(void) monitor_proxy_format_request(request,
+										pgsql->connectionString,
+										sql,
+										paramCount,
+										paramTypes,
+										paramValues);
+
+	if (!PQExpBufferBroken(request) &&
+		monitor_proxy_write(sock, request->data, request->len) &&
+		shutdown(sock, SHUT_WR) == 0 &&
+		monitor_proxy_read(sock, response, MONITOR_PROXY_CLIENT_TIMEOUT_MS, 0))
+	{
+		result = monitor_proxy_parse_response(response->data, response->len);
+	}
+
+	close(sock);
+	destroyPQExpBuffer(request);
+	destroyPQExpBuffer(response);
+
+	if (result == NULL)
+	{
+		log_debug("Failed to run the query through the monitor-proxy at \"%s\", "
+				  "connecting to the monitor",
+				  pgsql->proxySocketPath);
+		return false;
+	}
+
+	log_debug("%s; -- sent to the monitor-proxy", sql);
+
+	if (parseFun != NULL)
+	{
+		(*parseFun)(context, result);
+	}
+
+	PQclear(result);
+
+	return true;
+}
+
+
+/*
+ * monitor_proxy_connect connects to the monitor-proxy unix socket, and
+ * returns the socket, or -1 when the monitor-proxy is not available.
+ */
+static int
+monitor_proxy_connect(const char *socketPath)
+{
+	struct sockaddr_un addr = { 0 };
+
+	if (!file_exists(socketPath))
+	{
+		log_debug("The monitor-proxy socket \"%s\" does not exist", socketPath);
+		return -1;
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock < 0)
+	{
+		log_debug("Failed to create a unix socket: %m");
+		return -1;
+	}
+
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	(void) setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		log_debug("Failed to connect to the monitor-proxy at \"%s\": %m",
+				  socketPath);
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+/*
+ * monitor_proxy_format_request serializes a request in the given buffer.
+ */
+void
+monitor_proxy_format_request(PQExpBuffer out,
+							 const char *connectionString,
+							 const char *sql,
+							 int paramCount,
+							 const Oid *paramTypes,
+							 const char **paramValues)
+{
+	(void) proxy_append_string(out, MONITOR_PROXY_PROTOCOL_VERSION);
+	(void) proxy_append_string(out, connectionString);
+	(void) proxy_append_string(out, sql);
+	(void) proxy_append_int(out, paramCount);
+
+	for (int i = 0; i < paramCount; i++)
+	{
+		Oid paramType = paramTypes != NULL ? paramTypes[i] : InvalidOid;
+
+		(void) proxy_append_int(out, (int) paramType);
+		(void) proxy_append_string(out, paramValues[i]);
+	}
+}
+
+
+/*
+ * monitor_proxy_parse_request parses a request from the given buffer. The
+ * buffer is modified in place, and the request fields point into it.
+ */
+bool
+monitor_proxy_parse_request(char *data, size_t len,
+							MonitorProxyRequest *request)
+{
+	ProxyReader reader = { data, len, 0 };
+
+	char *version = NULL;
+	int fieldLen = 0;
+
+	if (!proxy_read_field(&reader, &version, &fieldLen) ||
+		version == NULL ||
+		strcmp(version, MONITOR_PROXY_PROTOCOL_VERSION) != 0)
+	{
+		log_warn("Failed to parse monitor-proxy request: "
+				 "unknown protocol version");
+		return false;
+	}
+
+	if (!proxy_read_field(&reader, &(request->connectionString), &fieldLen) ||
+		request->connectionString == NULL ||
+		!proxy_read_field(&reader, &(request->sql), &fieldLen) ||
+		request->sql == NULL ||
+		!proxy_read_int(&reader, &(request->paramCount)) ||
+		request->paramCount < 0 ||
+		request->paramCount > MONITOR_PROXY_MAX_PARAMS)
+	{
+		log_warn("Failed to parse monitor-proxy request");
+		return false;
+	}
+
+	for (int i = 0; i < request->paramCount; i++)
+	{
+		int paramType = 0;
+		char *value = NULL;
+
+		if (!proxy_read_int(&reader, &paramType) ||
+			!proxy_read_field(&reader, &value, &fieldLen))
+		{
+			log_warn("Failed to parse monitor-proxy request parameter %d", i);
+			return false;
+		}
+
+		request->paramTypes[i] = (Oid) paramType;
+		request->paramValues[i] = value;
+	}
+
+	return reader.pos == reader.len;
+}
+
+
+/*
+ * monitor_proxy_format_result serializes a successful query result.
+ */
+void
+monitor_proxy_format_result(PQExpBuffer out, PGresult *result)
+{
+	int nfields = PQnfields(result);
+	int ntuples = PQntuples(result);
+
+	(void) proxy_append_string(out, "ok");
+	(void) proxy_append_int(out, nfields);
+
+	for (int field = 0; field < nfields; field++)
+	{
+		(void) proxy_append_string(out, PQfname(result, field));
+		(void) proxy_append_int(out, (int) PQftype(result, field));
+	}
+
+	(void) proxy_append_int(out, ntuples);
+
+	for (int tuple = 0; tuple < ntuples; tuple++)
+	{
+		for (int field = 0; field < nfields; field++)
+		{
+			if (PQgetisnull(result, tuple, field))
+			{
+				(void) proxy_append_field(out, NULL, -1);
+			}
+			else
+			{
+				(void) proxy_append_field(out,
+										  PQgetvalue(result, tuple, field),
+										  PQgetlength(result, tuple, field));
+			}
+		}
+	}
+}
+
+
+/*
+ * monitor_proxy_format_error serializes a failed query, with its SQLSTATE.
+ */
+void
+monitor_proxy_format_error(PQExpBuffer out, const char *sqlstate)
+{
+	(void) proxy_append_string(out, "error");
+	(void) proxy_append_string(out, sqlstate);
+}
+
+
+/*
+ * monitor_proxy_parse_response parses a response from the given buffer, and
+ * returns a PGresult built from it, or NULL when the query failed or the
+ * response could not be parsed.
+ */
+PGresult *
+monitor_proxy_parse_response(char *data, size_t len)
+{
+	ProxyReader reader = { data, len, 0 };
+
+	char *status = NULL;
+	int fieldLen = 0;
+	int nfields = 0;
+	int ntuples = 0;
+
+	if (!proxy_read_field(&reader, &status, &fieldLen) || status == NULL)
+	{
+		log_debug("Failed to parse monitor-proxy response");
+		return NULL;
+	}
+
+	if (strcmp(status, "error") == 0)
+	{
+		char *sqlstate = NULL;
+
+		(void) proxy_read_field(&reader, &sqlstate, &fieldLen);
+
+		log_debug("The monitor-proxy failed to run the query: SQLSTATE %s",
+				  sqlstate == NULL ? "unknown" : sqlstate);
+		return NULL;
+	}
+
+	if (strcmp(status, "ok") != 0 ||
+		!proxy_read_int(&reader, &nfields) ||
+		nfields < 0 ||
+		(size_t) nfields > len)
+	{
+		log_debug("Failed to parse monitor-proxy response");
+		return NULL;
+	}
+
+	PGresult *result =
+		PQmakeEmptyPGresult(NULL,
+							nfields > 0 ? PGRES_TUPLES_OK : PGRES_COMMAND_OK);
+	PGresAttDesc *attributes = NULL;
+
+	if (result == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return NULL;
+	}
+
+	if (nfields > 0)
+	{
+		attributes = (PGresAttDesc *) calloc(nfields, sizeof(PGresAttDesc));
+
+		if (attributes == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			PQclear(result);
+			return NULL;
+		}
+	}
+
+	for (int field = 0; field < nfields; field++)
+	{
+		int typid = 0;
+
+		if (!proxy_read_field(&reader, &(attributes[field].name), &fieldLen) ||
+			attributes[field].name == NULL ||
+			!proxy_read_int(&reader, &typid))
+		{
+			log_debug("Failed to parse monitor-proxy response");
+			free(attributes);
+			PQclear(result);
+			return NULL;
+		}
+
+		attributes[field].typid = (Oid) typid;
+		attributes[field].typlen = -1;
+		attributes[field].atttypmod = -1;
+	}
+
+	if ((nfields > 0 && !PQsetResultAttrs(result, nfields, attributes)) ||
+		!proxy_read_int(&reader, &ntuples) ||
+		ntuples < 0)
+	{
+		log_debug("Failed to parse monitor-proxy response");
+		free(attributes);
+		PQclear(result);
+		return NULL;
+	}
+
+	free(attributes);
+
+	for (int tuple = 0; tuple < ntuples; tuple++)
+	{
+		for (int field = 0; field < nfields; field++)
+		{
+			char *value = NULL;
+
+			if (!proxy_read_field(&reader, &value, &fieldLen) ||
+				!PQsetvalue(result, tuple, field, value, fieldLen))
+			{
+				log_debug("Failed to parse monitor-proxy response");
+				PQclear(result);
+				return NULL;
+			}
+		}
+	}
+
+	if (reader.pos != reader.len)
+	{
+		log_debug("Failed to parse monitor-proxy response: trailing data");
+		PQclear(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+
+/*
+ * monitor_proxy_read reads from the given file descriptor until the other
+ * side closes it, waiting at most timeoutMs for each chunk of data. When
+ * maxlen is not zero, reading more than maxlen bytes is an error.
+ */
+bool
+monitor_proxy_read(int fd, PQExpBuffer buffer, int timeoutMs, size_t maxlen)
+{
+	char chunk[BUFSIZE];
+
+	for (;;)
+	{
+		struct pollfd pollFd = { fd, POLLIN, 0 };
+
+		int ready = poll(&pollFd, 1, timeoutMs);
+
+		if (ready < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (ready <= 0)
+		{
+			log_debug("Failed to read from the monitor-proxy socket: %s",
+					  ready == 0 ? "timeout" : strerror(errno));
+			return false;
+		}
+
+		ssize_t bytes = read(fd, chunk, sizeof(chunk));
+
+		if (bytes < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN)
+			{
+				continue;
+			}
+
+			log_debug("Failed to read from the monitor-proxy socket: %m");
+			return false;
+		}
+
+		if (bytes == 0)
+		{
+			break;
+		}
+
+		if (maxlen > 0 && buffer->len + bytes > maxlen)
+		{
+			log_warn("Failed to read from the monitor-proxy socket: "
+					 "message is larger than %zu bytes",
+					 maxlen);
+			return false;
+		}
+
+		appendBinaryPQExpBuffer(buffer, chunk, bytes);
+	}
+
+	return !PQExpBufferBroken(buffer);
+}
+
+
+/*
+ * monitor_proxy_write writes all the given data to the file descriptor.
+ */
+bool
+monitor_proxy_write(int fd, const char *data, size_t len)
+{
+	size_t written = 0;
+
+	while (written < len)
+	{
+		ssize_t bytes = send(fd, data + written, len - written, MSG_NOSIGNAL);
+
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_debug("Failed to write to the monitor-proxy socket: %m");
+			return false;
+		}
+
+		written += bytes;
+	}
+
+	return true;
+}
+
+
+/*
+ * proxy_append_field appends a netstring to the buffer, or a SQL NULL when
+ * the value is NULL.
+ */
+static void
+proxy_append_field(PQExpBuffer out, const char *value, int len)
+{
+	if (value == NULL)
+	{
+		appendPQExpBufferStr(out, "-1:,");
+		return;
+	}
+
+	appendPQExpBuffer(out, "%d:", len);
+	appendBinaryPQExpBuffer(out, value, len);
+	appendPQExpBufferChar(out, ',');
+}
+
+
+/*
+ * proxy_append_string appends a C string to the buffer as a netstring.
+ */
+static void
+proxy_append_string(PQExpBuffer out, const char *value)
+{
+	(void) proxy_append_field(out, value, value == NULL ? -1 : strlen(value));
+}
+
+
+/*
+ * proxy_append_int appends an integer to the buffer as a netstring.
+ */
+static void
+proxy_append_int(PQExpBuffer out, int value)
+{
+	(void) proxy_append_string(out, intToString(value).strValue);
+}
+
+
+/*
+ * proxy_read_field reads the next netstring from the buffer. The comma that
+ * ends the netstring is replaced with a NUL byte so that the value can be
+ * used as a C string in place. A SQL NULL sets the value to NULL and the
+ * length to -1.
+ */
+static bool
+proxy_read_field(ProxyReader *reader, char **value, int *len)
+{
+	char *start = reader->data + reader->pos;
+	char *colon = memchr(start, ':', reader->len - reader->pos);
+
+	if (colon == NULL || colon == start || colon - start > 10)
+	{
+		return false;
+	}
+
+	*colon = '\0';
+
+	if (!stringToInt(start, len) || *len < -1)
+	{
+		return false;
+	}
+
+	reader->pos += (colon - start) + 1;
+
+	if (*len == -1)
+	{
+		*value = NULL;
+	}
+	else if ((size_t) *len >= reader->len - reader->pos)
+	{
+		/* we need room for the value and the comma */
+		return false;
+	}
+	else
+	{
+		*value = reader->data + reader->pos;
+		reader->pos += *len;
+	}
+
+	if (reader->pos >= reader->len || reader->data[reader->pos] != ',')
+	{
+		return false;
+	}
+
+	reader->data[reader->pos++] = '\0';
+
+	return true;
+}
+
+
+/*
+ * proxy_read_int reads the next netstring from the buffer as an integer.
+ */
+static bool
+proxy_read_int(ProxyReader *reader, int *value)
+{
+	char *str = NULL;
+	int len = 0;
+
+	return proxy_read_field(reader, &str, &len) &&
+		   str != NULL &&
+		   stringToInt(str, value);
+}
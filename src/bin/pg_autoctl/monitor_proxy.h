@@ -0,0 +1,68 @@
+/*
+ * src/bin/pg_autoctl/monitor_proxy.h
+ *   Client and protocol of the pg_autoctl monitor-proxy service.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef MONITOR_PROXY_H
+#define MONITOR_PROXY_H
+
+#include <stdbool.h>
+
+#include "postgres_fe.h"
+#include "libpq-fe.h"
+#include "pqexpbuffer.h"
+
+#include "pgsql.h"
+
+
+/* CLI commands only send small queries with a few parameters */
+#define MONITOR_PROXY_MAX_PARAMS 32
+#define MONITOR_PROXY_REQUEST_MAXLEN (64 * 1024)
+
+/* time allowed for the monitor-proxy to answer a CLI command */
+#define MONITOR_PROXY_CLIENT_TIMEOUT_MS 10000
+
+/*
+ * A request is the monitor connection string that the client would use
+ * itself, so that the monitor-proxy only answers when it's connected to the
+ * same monitor, and the SQL command to run with its parameters. Values point
+ * into the request buffer that has been parsed.
+ */
+typedef struct MonitorProxyRequest
+{
+	char *connectionString;
+	char *sql;
+	int paramCount;
+	Oid paramTypes[MONITOR_PROXY_MAX_PARAMS];
+	const char *paramValues[MONITOR_PROXY_MAX_PARAMS];
+} MonitorProxyRequest;
+
+
+bool monitor_proxy_socket_path(const char *pidfile, char *path);
+
+bool monitor_proxy_execute(PGSQL *pgsql, const char *sql, int paramCount,
+						   const Oid *paramTypes, const char **paramValues,
+						   void *context, ParsePostgresResultCB *parseFun);
+
+void monitor_proxy_format_request(PQExpBuffer out,
+								  const char *connectionString,
+								  const char *sql,
+								  int paramCount,
+								  const Oid *paramTypes,
+								  const char **paramValues);
+bool monitor_proxy_parse_request(char *data, size_t len,
+								 MonitorProxyRequest *request);
+
+void monitor_proxy_format_result(PQExpBuffer out, PGresult *result);
+void monitor_proxy_format_error(PQExpBuffer out, const char *sqlstate);
+PGresult * monitor_proxy_parse_response(char *data, size_t len);
+
+bool monitor_proxy_read(int fd, PQExpBuffer buffer,
+						int timeoutMs, size_t maxlen);
+bool monitor_proxy_write(int fd, const char *data, size_t len);
+
+#endif /* MONITOR_PROXY_H */
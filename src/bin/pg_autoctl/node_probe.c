@@ -0,0 +1,237 @@
+/*
+ * src/bin/pg_autoctl/node_probe.c
+ *   Local health samples of the node-probe service, shared with the
+ *   node-active service.
+ *
+ * The node-active service talks to the monitor, and a slow or unreachable
+ * monitor used to also delay the local health checks of the keeper main
+ * loop. The node-probe service now samples the local Postgres instance, the
+ * storage latency of PGDATA and pg_wal, and the free space of pg_wal at a
+ * fixed cadence, and publishes the last sample in a SysV shared memory
+ * segment. The node-active service then reports the last sample to the
+ * monitor whenever it gets to it.
+ *
+ * We share the shared memory identifier with our sub-processes in the
+ * environment, the same way as we do for the metrics. When the segment does
+ * not exist, the node-active service runs the probes itself.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "log.h"
+#include "node_probe.h"
+#include "parsing.h"
+#include "string_utils.h"
+
+
+/* how many times we try to read a snapshot that is being written */
+#define NODE_PROBE_READ_ATTEMPTS 100
+
+static NodeProbeSnapshot *nodeProbe = NULL;
+
+/* the supervisor removes the shared memory segment it created at exit */
+static int nodeProbeShmId = -1;
+static pid_t nodeProbeCreatorPid = 0;
+
+static void node_probe_unlink_atexit(void);
+
+
+/*
+ * node_probe_create creates the shared memory segment for the node-probe
+ * samples, and exports its identifier in the environment for the
+ * sub-processes that the supervisor is about to start.
+ */
+bool
+node_probe_create(void)
+{
+	int shmId = shmget(IPC_PRIVATE, sizeof(NodeProbeSnapshot), IPC_CREAT | 0600);
+
+	if (shmId < 0)
+	{
+		log_error("Failed to create the node-probe shared memory segment: %m");
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_error("Failed to attach the node-probe shared memory segment %d: %m",
+				  shmId);
+		(void) shmctl(shmId, IPC_RMID, NULL);
+		return false;
+	}
+
+	nodeProbe = (NodeProbeSnapshot *) segment;
+	memset(nodeProbe, 0, sizeof(NodeProbeSnapshot));
+
+	nodeProbeShmId = shmId;
+	nodeProbeCreatorPid = getpid();
+	atexit(node_probe_unlink_atexit);
+
+	IntString shmIdString = intToString(shmId);
+
+	setenv(PG_AUTOCTL_NODE_PROBE_SHMID, shmIdString.strValue, 1);
+
+	log_debug("Created node-probe shared memory segment %d", shmId);
+
+	return true;
+}
+
+
+/*
+ * node_probe_attach attaches to the shared memory segment that our
+ * supervisor created, when the node-probe service is enabled.
+ */
+bool
+node_probe_attach(void)
+{
+	char shmIdString[BUFSIZE] = { 0 };
+	int shmId = -1;
+
+	if (nodeProbe != NULL || !env_exists(PG_AUTOCTL_NODE_PROBE_SHMID))
+	{
+		return true;
+	}
+
+	if (!get_env_copy(PG_AUTOCTL_NODE_PROBE_SHMID, shmIdString, BUFSIZE) ||
+		!stringToInt(shmIdString, &shmId))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_warn("Failed to attach the node-probe shared memory segment %d: %m",
+				 shmId);
+		return false;
+	}
+
+	nodeProbe = (NodeProbeSnapshot *) segment;
+
+	return true;
+}
+
+
+/*
+ * node_probe_enabled returns true when we are attached to the node-probe
+ * segment.
+ */
+bool
+node_probe_enabled(void)
+{
+	return nodeProbe != NULL;
+}
+
+
+/*
+ * node_probe_unlink_atexit removes the shared memory segment, only from the
+ * process that created it.
+ */
+static void
+node_probe_unlink_atexit(void)
+{
+	if (nodeProbeShmId < 0 || getpid() != nodeProbeCreatorPid)
+	{
+		return;
+	}
+
+	(void) shmdt(nodeProbe);
+	nodeProbe = NULL;
+
+	if (shmctl(nodeProbeShmId, IPC_RMID, NULL) != 0)
+	{
+		log_warn("Failed to remove the node-probe shared memory segment %d: %m",
+				 nodeProbeShmId);
+	}
+
+	nodeProbeShmId = -1;
+}
+
+
+/*
+ * node_probe_publish copies the given sample into the shared memory segment.
+ * The node-probe service is the only writer.
+ */
+void
+node_probe_publish(NodeProbeSnapshot *snapshot)
+{
+	if (nodeProbe == NULL)
+	{
+		return;
+	}
+
+	uint64_t generation = nodeProbe->generation;
+
+	nodeProbe->generation = generation + 1;
+	__sync_synchronize();
+
+	memcpy((char *) nodeProbe + sizeof(nodeProbe->generation),
+		   (char *) snapshot + sizeof(snapshot->generation),
+		   sizeof(NodeProbeSnapshot) - sizeof(snapshot->generation));
+
+	__sync_synchronize();
+	nodeProbe->generation = generation + 2;
+}
+
+
+/*
+ * node_probe_read copies the last published sample from the shared memory
+ * segment. It returns false when the node-probe service has not published
+ * any sample yet, or when we could not get a consistent copy.
+ */
+bool
+node_probe_read(NodeProbeSnapshot *snapshot)
+{
+	if (nodeProbe == NULL)
+	{
+		return false;
+	}
+
+	for (int attempt = 0; attempt < NODE_PROBE_READ_ATTEMPTS; attempt++)
+	{
+		uint64_t before = nodeProbe->generation;
+
+		if (before == 0)
+		{
+			return false;
+		}
+
+		if (before % 2 == 1)
+		{
+			/* the node-probe service is writing, give it some time */
+			pg_usleep(1000);
+			continue;
+		}
+
+		__sync_synchronize();
+		memcpy(snapshot, (char *) nodeProbe, sizeof(NodeProbeSnapshot));
+		__sync_synchronize();
+
+		if (nodeProbe->generation == before)
+		{
+			snapshot->generation = before;
+			return true;
+		}
+	}
+
+	log_warn("Failed to read the last sample of the node-probe service");
+
+	return false;
+}
@@ -0,0 +1,61 @@
+/*
+ * src/bin/pg_autoctl/node_probe.h
+ *   Local health samples of the node-probe service, shared with the
+ *   node-active service.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef NODE_PROBE_H
+#define NODE_PROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+
+#include "keeper_io_watchdog.h"
+#include "pgsql.h"
+
+
+/*
+ * NodeProbeSnapshot is kept in a SysV shared memory segment that the
+ * supervisor creates, and that the node-probe service updates at a fixed
+ * cadence. The node-active service is the only reader. The generation is odd
+ * while the node-probe service is writing the snapshot, so that the reader
+ * can retry rather than use a half-written snapshot.
+ */
+typedef struct NodeProbeSnapshot
+{
+	volatile uint64_t generation;
+
+	uint64_t sampleTime;
+	uint64_t probeCount;
+
+	/* local Postgres liveness */
+	bool pgIsRunning;
+	bool pgIsResponsive;
+	bool pgIsInRecovery;
+	char currentLSN[PG_LSN_MAXLENGTH];
+	int64_t queryUs;
+
+	/* storage latency, counting the probes that completed */
+	uint64_t ioSampleCount;
+	IOWatchdogStats ioStats;
+
+	/* pg_wal free space, counting the samples that were taken */
+	uint64_t walSampleCount;
+	KeeperWalSpace walSpace;
+} NodeProbeSnapshot;
+
+
+bool node_probe_create(void);
+bool node_probe_attach(void);
+bool node_probe_enabled(void);
+
+void node_probe_publish(NodeProbeSnapshot *snapshot);
+bool node_probe_read(NodeProbeSnapshot *snapshot);
+
+#endif /* NODE_PROBE_H */
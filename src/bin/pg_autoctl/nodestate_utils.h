@@ -33,6 +33,10 @@ typedef struct CurrentNodeState
 	bool replicationQuorum;
 
 	int health;
+
+	/* pushed by the monitor, see pgautofailover.enable_direct_settings */
+	bool hasSynchronousStandbyNames;
+	char synchronousStandbyNames[BUFSIZE];
 } CurrentNodeState;
 
 
@@ -39,6 +39,8 @@ static bool parse_controldata_field_lsn(const char *controlDataString,
 static bool parse_bool_with_len(const char *value, size_t len, bool *result);
 
 static int nodeAddressCmpByNodeId(const void *a, const void *b);
+static int parse_state_notification_array_fixed(const char *message,
+												CurrentNodeState *nodeStates);
 
 #define RE_MATCH_COUNT 10
 
@@ -274,6 +276,10 @@ parse_controldata(PostgresControlData *pgControlData,
 									 "Latest checkpoint location",
 									 pgControlData->latestCheckpointLSN) ||
 
+		!parse_controldata_field_lsn(control_data_string,
+									 "Latest checkpoint's REDO location",
+									 pgControlData->latestCheckpointRedoLSN) ||
+
 		!parse_controldata_field_uint32(control_data_string,
 										"Latest checkpoint's TimeLineID",
 										&(pgControlData->timeline_id)))
@@ -437,32 +443,20 @@ parse_controldata_field_lsn(const char *controlDataString,
 
 
 /*
- * parse_notification_message parses pgautofailover state change notifications,
- * which are sent in the JSON format.
+ * parse_state_notification_object parses a single node state change from a
+ * pgautofailover notification message.
  */
-bool
-parse_state_notification_message(CurrentNodeState *nodeState,
-								 const char *message)
+static bool
+parse_state_notification_object(CurrentNodeState *nodeState,
+								JSON_Object *jsobj,
+								const char *message)
 {
-	JSON_Value *json = json_parse_string(message);
-	JSON_Object *jsobj = json_value_get_object(json);
-
-	log_trace("parse_state_notification_message: %s", message);
-
-	if (json_type(json) != JSONObject)
-	{
-		log_error("Failed to parse JSON notification message: \"%s\"", message);
-		json_value_free(json);
-		return false;
-	}
-
 	char *str = (char *) json_object_get_string(jsobj, "type");
 
-	if (strcmp(str, "state") != 0)
+	if (str == NULL || strcmp(str, "state") != 0)
 	{
 		log_error("Failed to parse JSOBJ notification state message: "
 				  "jsobj object type is not \"state\" as expected");
-		json_value_free(json);
 		return false;
 	}
 
@@ -472,7 +466,6 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse formation in JSON "
 				  "notification message \"%s\"", message);
-		json_value_free(json);
 		return false;
 	}
 	strlcpy(nodeState->formation, str, sizeof(nodeState->formation));
@@ -481,7 +474,7 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	nodeState->groupId = (int) number;
 
 	number = json_object_get_number(jsobj, "nodeId");
-	nodeState->node.nodeId = (int) number;
+	nodeState->node.nodeId = (int64_t) number;
 
 	str = (char *) json_object_get_string(jsobj, "name");
 
@@ -489,7 +482,6 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse node name in JSON "
 				  "notification message \"%s\"", message);
-		json_value_free(json);
 		return false;
 	}
 	strlcpy(nodeState->node.name, str, sizeof(nodeState->node.name));
@@ -500,7 +492,6 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse node host in JSON "
 				  "notification message \"%s\"", message);
-		json_value_free(json);
 		return false;
 	}
 	strlcpy(nodeState->node.host, str, sizeof(nodeState->node.host));
@@ -514,7 +505,6 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse reportedState in JSON "
 				  "notification message \"%s\"", message);
-		json_value_free(json);
 		return false;
 	}
 	nodeState->reportedState = NodeStateFromString(str);
@@ -525,7 +515,6 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse goalState in JSON "
 				  "notification message \"%s\"", message);
-		json_value_free(json);
 		return false;
 	}
 	nodeState->goalState = NodeStateFromString(str);
@@ -548,10 +537,209 @@ parse_state_notification_message(CurrentNodeState *nodeState,
 	{
 		log_error("Failed to parse health in JSON "
 				  "notification message \"%s\"", message);
+		return false;
+	}
+
+	str = (char *) json_object_get_string(jsobj, "synchronousStandbyNames");
+
+	if (str != NULL)
+	{
+		nodeState->hasSynchronousStandbyNames = true;
+		strlcpy(nodeState->synchronousStandbyNames, str,
+				sizeof(nodeState->synchronousStandbyNames));
+	}
+
+	return true;
+}
+
+
+/*
+ * parse_state_notification_message parses pgautofailover state change
+ * notifications, which are sent in the JSON format. We first try the fixed
+ * schema parser, and fall back to parson for messages that have another
+ * schema, such as when the monitor runs another version.
+ */
+bool
+parse_state_notification_message(CurrentNodeState *nodeState,
+								 const char *message)
+{
+	log_trace("parse_state_notification_message: %s", message);
+
+	if (parse_state_notification_fixed(nodeState, message))
+	{
+		return true;
+	}
+
+	return parse_state_notification_json(nodeState, message);
+}
+
+
+/*
+ * parse_state_notification_json parses a pgautofailover state change
+ * notification with the parson library.
+ */
+bool
+parse_state_notification_json(CurrentNodeState *nodeState,
+							  const char *message)
+{
+	JSON_Value *json = json_parse_string(message);
+	JSON_Object *jsobj = json_value_get_object(json);
+
+	if (json_type(json) != JSONObject)
+	{
+		log_error("Failed to parse JSON notification message: \"%s\"", message);
+		json_value_free(json);
+		return false;
+	}
+
+	bool success = parse_state_notification_object(nodeState, jsobj, message);
+
+	json_value_free(json);
+	return success;
+}
+
+
+/*
+ * parse_state_notification_messages parses a pgautofailover state change
+ * notification that is either a single JSON object, or a JSON array of such
+ * objects when the monitor coalesced the state changes of several nodes of a
+ * group in the same transaction.
+ *
+ * The nodeStates array is allocated with malloc and must be free'd by the
+ * caller, its size is set in count.
+ */
+bool
+parse_state_notification_messages(CurrentNodeState **nodeStates,
+								  int *count,
+								  const char *message)
+{
+	log_trace("parse_state_notification_messages: %s", message);
+
+	*nodeStates = NULL;
+	*count = 0;
+
+	/* first count the objects with the fixed schema parser */
+	int arrayCount = parse_state_notification_array_fixed(message, NULL);
+
+	if (arrayCount == 0)
+	{
+		return true;
+	}
+	else if (arrayCount > 0)
+	{
+		*nodeStates =
+			(CurrentNodeState *) calloc(arrayCount, sizeof(CurrentNodeState));
+
+		if (*nodeStates == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		(void) parse_state_notification_array_fixed(message, *nodeStates);
+
+		*count = arrayCount;
+		return true;
+	}
+	else if (*message == '{')
+	{
+		CurrentNodeState nodeState = { 0 };
+
+		if (parse_state_notification_fixed(&nodeState, message))
+		{
+			*nodeStates =
+				(CurrentNodeState *) calloc(1, sizeof(CurrentNodeState));
+
+			if (*nodeStates == NULL)
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				return false;
+			}
+
+			**nodeStates = nodeState;
+			*count = 1;
+			return true;
+		}
+	}
+
+	/* fall back to parson for messages of other schemas */
+	JSON_Value *json = json_parse_string(message);
+
+	if (json_type(json) == JSONObject)
+	{
+		*nodeStates = (CurrentNodeState *) calloc(1, sizeof(CurrentNodeState));
+
+		if (*nodeStates == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			json_value_free(json);
+			return false;
+		}
+
+		if (!parse_state_notification_object(*nodeStates,
+											 json_value_get_object(json),
+											 message))
+		{
+			free(*nodeStates);
+			*nodeStates = NULL;
+			json_value_free(json);
+			return false;
+		}
+
+		*count = 1;
+		json_value_free(json);
+		return true;
+	}
+
+	if (json_type(json) != JSONArray)
+	{
+		log_error("Failed to parse JSON notification message: \"%s\"", message);
+		json_value_free(json);
+		return false;
+	}
+
+	JSON_Array *jsArray = json_value_get_array(json);
+	arrayCount = (int) json_array_get_count(jsArray);
+
+	if (arrayCount == 0)
+	{
+		json_value_free(json);
+		return true;
+	}
+
+	*nodeStates =
+		(CurrentNodeState *) calloc(arrayCount, sizeof(CurrentNodeState));
+
+	if (*nodeStates == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
 		json_value_free(json);
 		return false;
 	}
 
+	for (int index = 0; index < arrayCount; index++)
+	{
+		JSON_Object *jsobj = json_array_get_object(jsArray, index);
+
+		if (jsobj == NULL ||
+			!parse_state_notification_object(&((*nodeStates)[index]),
+											 jsobj,
+											 message))
+		{
+			if (jsobj == NULL)
+			{
+				log_error("Failed to parse JSON notification message: \"%s\"",
+						  message);
+			}
+
+			free(*nodeStates);
+			*nodeStates = NULL;
+			json_value_free(json);
+			return false;
+		}
+	}
+
+	*count = arrayCount;
 	json_value_free(json);
 	return true;
 }
@@ -1007,119 +1195,904 @@ parseLSN(const char *str, uint64_t *lsn)
 
 
 /*
- * parseNodesArrayFromFile parses a Nodes Array from a JSON file, that contains
- * an array of JSON object with the following properties: node_id, node_lsn,
- * node_host, node_name, node_port, and potentially node_is_primary.
+ * NodesArrayScanner is the state of the parser of a nodes array: the JSON
+ * input, and the position we have reached in there. A quiet scanner doesn't
+ * log its errors, for callers that have another parser to fall back to.
  */
-bool
-parseNodesArray(const char *nodesJSON,
-				NodeAddressArray *nodesArray,
-				int64_t nodeId)
+typedef struct NodesArrayScanner
 {
-	JSON_Value *template =
-		json_parse_string("[{"
-						  "\"node_id\": 0,"
-						  "\"node_lsn\": \"\","
-						  "\"node_name\": \"\","
-						  "\"node_host\": \"\","
-						  "\"node_port\": 0,"
-						  "\"node_is_primary\": false"
-						  "}]");
-	int nodesArrayIndex = 0;
-	int primaryCount = 0;
+	const char *input;
+	const char *ptr;
+	bool quiet;
+} NodesArrayScanner;
 
-	JSON_Value *json = json_parse_string(nodesJSON);
+#define NODES_ARRAY_FIELD_ID (1 << 0)
+#define NODES_ARRAY_FIELD_NAME (1 << 1)
+#define NODES_ARRAY_FIELD_HOST (1 << 2)
+#define NODES_ARRAY_FIELD_PORT (1 << 3)
+#define NODES_ARRAY_FIELD_LSN (1 << 4)
+#define NODES_ARRAY_FIELD_IS_PRIMARY (1 << 5)
+#define NODES_ARRAY_ALL_FIELDS ((1 << 6) - 1)
 
-	/* validate the JSON input as an array of object with required fields */
-	if (json_validate(template, json) == JSONFailure)
+/* unknown properties may hold nested values, up to this depth */
+#define NODES_ARRAY_MAX_DEPTH 32
+
+#define NODES_ARRAY_FORMAT \
+	"[{node_id:number, node_name:string, " \
+	"node_host:string, node_port:number, node_lsn:string, " \
+	"node_is_primary:boolean}, ...]"
+
+
+/*
+ * nodes_scanner_error logs that we failed to find what we expected at the
+ * current position of the scanner.
+ */
+static void
+nodes_scanner_error(NodesArrayScanner *scanner, const char *expected)
+{
+	if (scanner->quiet)
 	{
-		log_error("Failed to parse nodes array which is expected "
-				  "to contain a JSON Array of Objects with properties "
-				  "[{node_id:number, node_name:string, "
-				  "node_host:string, node_port:number, node_lsn:string, "
-				  "node_is_primary:boolean}, ...]");
-		json_value_free(template);
-		json_value_free(json);
-		return false;
+		return;
 	}
 
-	JSON_Array *jsArray = json_value_get_array(json);
-	int len = json_array_get_count(jsArray);
+	log_error("Failed to parse nodes array: expected %s at offset %ld",
+			  expected,
+			  (long) (scanner->ptr - scanner->input));
+}
 
-	if (NODE_ARRAY_MAX_COUNT < len)
+
+/*
+ * nodes_scanner_skip_whitespace skips JSON insignificant whitespace.
+ */
+static void
+nodes_scanner_skip_whitespace(NodesArrayScanner *scanner)
+{
+	while (*scanner->ptr == ' ' || *scanner->ptr == '\t' ||
+		   *scanner->ptr == '\n' || *scanner->ptr == '\r')
 	{
-		log_error("Failed to parse nodes array which contains "
-				  "%d nodes: pg_autoctl supports up to %d nodes",
-				  len,
-				  NODE_ARRAY_MAX_COUNT);
-		json_value_free(template);
-		json_value_free(json);
-		return false;
+		++scanner->ptr;
 	}
+}
 
-	nodesArray->count = len;
 
-	for (int i = 0; i < len; i++)
+/*
+ * nodes_scanner_expect skips whitespace and then the given character, which
+ * must be found at this position.
+ */
+static bool
+nodes_scanner_expect(NodesArrayScanner *scanner, char c, const char *expected)
+{
+	nodes_scanner_skip_whitespace(scanner);
+
+	if (*scanner->ptr != c)
 	{
-		NodeAddress *node = &(nodesArray->nodes[nodesArrayIndex]);
-		JSON_Object *jsObj = json_array_get_object(jsArray, i);
+		nodes_scanner_error(scanner, expected);
+		return false;
+	}
 
-		int jsNodeId = (int) json_object_get_number(jsObj, "node_id");
-		uint64_t lsn = 0;
+	++scanner->ptr;
 
-		/* we install the keeper.otherNodes array, so skip ourselves */
-		if (jsNodeId == nodeId)
+	return true;
+}
+
+
+/*
+ * nodes_scanner_append appends a byte to a string buffer of the given size,
+ * keeping room for the terminating NUL byte. A NULL buffer skips the string.
+ */
+static bool
+nodes_scanner_append(NodesArrayScanner *scanner,
+					 char *buffer, size_t size, size_t *length, char c)
+{
+	if (buffer == NULL)
+	{
+		return true;
+	}
+
+	if (*length + 1 >= size)
+	{
+		if (scanner->quiet)
 		{
-			--(nodesArray->count);
-			continue;
+			return false;
 		}
 
-		node->nodeId = jsNodeId;
+		log_error("Failed to parse nodes array: string value \"%.*s...\" "
+				  "is longer than the maximum of %zu bytes",
+				  (int) *length, buffer, size - 1);
+		return false;
+	}
 
-		strlcpy(node->name,
-				json_object_get_string(jsObj, "node_name"),
-				sizeof(node->name));
+	buffer[(*length)++] = c;
 
-		strlcpy(node->host,
-				json_object_get_string(jsObj, "node_host"),
-				sizeof(node->host));
+	return true;
+}
 
-		node->port = (int) json_object_get_number(jsObj, "node_port");
 
-		strlcpy(node->lsn,
-				json_object_get_string(jsObj, "node_lsn"),
-				sizeof(node->lsn));
+/*
+ * nodes_scanner_string parses a JSON string into the given buffer, decoding
+ * the escape sequences, or skips it when buffer is NULL.
+ */
+static bool
+nodes_scanner_string(NodesArrayScanner *scanner, char *buffer, size_t size)
+{
+	size_t length = 0;
 
-		if (!parseLSN(node->lsn, &lsn))
+	if (!nodes_scanner_expect(scanner, '"', "a string"))
+	{
+		return false;
+	}
+
+	for (;;)
+	{
+		char c = *scanner->ptr;
+
+		if (c == '\0' || (unsigned char) c < 0x20)
 		{
-			log_error("Failed to parse nodes array LSN value \"%s\"", node->lsn);
-			json_value_free(template);
-			json_value_free(json);
+			nodes_scanner_error(scanner, "the end of the string");
 			return false;
 		}
 
-		node->isPrimary = json_object_get_boolean(jsObj, "node_is_primary");
+		++scanner->ptr;
 
-		if (node->isPrimary)
+		if (c == '"')
+		{
+			break;
+		}
+
+		if (c != '\\')
+		{
+			if (!nodes_scanner_append(scanner, buffer, size, &length, c))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		c = *scanner->ptr++;
+
+		switch (c)
+		{
+			case '"':
+			case '\\':
+			case '/':
+			{
+				break;
+			}
+
+			case 'b':
+			{
+				c = '\b';
+				break;
+			}
+
+			case 'f':
+			{
+				c = '\f';
+				break;
+			}
+
+			case 'n':
+			{
+				c = '\n';
+				break;
+			}
+
+			case 'r':
+			{
+				c = '\r';
+				break;
+			}
+
+			case 't':
+			{
+				c = '\t';
+				break;
+			}
+
+			case 'u':
+			{
+				unsigned int codepoint = 0;
+
+				for (int i = 0; i < 4; i++)
+				{
+					char h = *scanner->ptr;
+
+					codepoint <<= 4;
+
+					if (h >= '0' && h <= '9')
+					{
+						codepoint |= h - '0';
+					}
+					else if (h >= 'a' && h <= 'f')
+					{
+						codepoint |= h - 'a' + 10;
+					}
+					else if (h >= 'A' && h <= 'F')
+					{
+						codepoint |= h - 'A' + 10;
+					}
+					else
+					{
+						nodes_scanner_error(scanner, "an hexadecimal digit");
+						return false;
+					}
+
+					++scanner->ptr;
+				}
+
+				/* an embedded NUL would silently truncate the value */
+				if (codepoint == 0)
+				{
+					nodes_scanner_error(scanner, "a non-zero code point");
+					return false;
+				}
+
+				/* hostnames and node names have no use for surrogate pairs */
+				if (codepoint >= 0xD800 && codepoint <= 0xDFFF)
+				{
+					nodes_scanner_error(scanner, "a non-surrogate code point");
+					return false;
+				}
+
+				char utf8[3];
+				int utf8len = 0;
+
+				if (codepoint < 0x80)
+				{
+					utf8[utf8len++] = (char) codepoint;
+				}
+				else if (codepoint < 0x800)
+				{
+					utf8[utf8len++] = (char) (0xC0 | (codepoint >> 6));
+					utf8[utf8len++] = (char) (0x80 | (codepoint & 0x3F));
+				}
+				else
+				{
+					utf8[utf8len++] = (char) (0xE0 | (codepoint >> 12));
+					utf8[utf8len++] = (char) (0x80 | ((codepoint >> 6) & 0x3F));
+					utf8[utf8len++] = (char) (0x80 | (codepoint & 0x3F));
+				}
+
+				for (int i = 0; i < utf8len; i++)
+				{
+					if (!nodes_scanner_append(scanner, buffer, size, &length,
+											  utf8[i]))
+					{
+						return false;
+					}
+				}
+				continue;
+			}
+
+			default:
+			{
+				--scanner->ptr;
+				nodes_scanner_error(scanner, "a valid escape sequence");
+				return false;
+			}
+		}
+
+		if (!nodes_scanner_append(scanner, buffer, size, &length, c))
+		{
+			return false;
+		}
+	}
+
+	if (buffer != NULL)
+	{
+		buffer[length] = '\0';
+	}
+
+	return true;
+}
+
+
+/*
+ * nodes_scanner_integer parses a JSON number that must be an integer.
+ */
+static bool
+nodes_scanner_integer(NodesArrayScanner *scanner, int64_t *value)
+{
+	char *end = NULL;
+
+	nodes_scanner_skip_whitespace(scanner);
+
+	errno = 0;
+	long long number = strtoll(scanner->ptr, &end, 10);
+
+	if (end == scanner->ptr || errno == ERANGE ||
+		*end == '.' || *end == 'e' || *end == 'E')
+	{
+		nodes_scanner_error(scanner, "an integer");
+		return false;
+	}
+
+	scanner->ptr = end;
+	*value = (int64_t) number;
+
+	return true;
+}
+
+
+/*
+ * nodes_scanner_literal parses the given JSON literal (true, false, null).
+ */
+static bool
+nodes_scanner_literal(NodesArrayScanner *scanner, const char *literal)
+{
+	size_t length = strlen(literal);
+
+	nodes_scanner_skip_whitespace(scanner);
+
+	if (strncmp(scanner->ptr, literal, length) != 0)
+	{
+		nodes_scanner_error(scanner, literal);
+		return false;
+	}
+
+	scanner->ptr += length;
+
+	return true;
+}
+
+
+/*
+ * nodes_scanner_boolean parses a JSON boolean.
+ */
+static bool
+nodes_scanner_boolean(NodesArrayScanner *scanner, bool *value)
+{
+	nodes_scanner_skip_whitespace(scanner);
+
+	*value = *scanner->ptr == 't';
+
+	return nodes_scanner_literal(scanner, *value ? "true" : "false");
+}
+
+
+/*
+ * nodes_scanner_skip_value skips any JSON value, which we use for properties
+ * of the nodes that we don't know about.
+ */
+static bool
+nodes_scanner_skip_value(NodesArrayScanner *scanner, int depth)
+{
+	if (depth > NODES_ARRAY_MAX_DEPTH)
+	{
+		nodes_scanner_error(scanner, "less nested values");
+		return false;
+	}
+
+	nodes_scanner_skip_whitespace(scanner);
+
+	switch (*scanner->ptr)
+	{
+		case '"':
+		{
+			return nodes_scanner_string(scanner, NULL, 0);
+		}
+
+		case '{':
+		case '[':
+		{
+			char close = *scanner->ptr == '{' ? '}' : ']';
+			bool isObject = close == '}';
+
+			++scanner->ptr;
+			nodes_scanner_skip_whitespace(scanner);
+
+			if (*scanner->ptr == close)
+			{
+				++scanner->ptr;
+				return true;
+			}
+
+			for (;;)
+			{
+				if (isObject &&
+					(!nodes_scanner_string(scanner, NULL, 0) ||
+					 !nodes_scanner_expect(scanner, ':', "':'")))
+				{
+					return false;
+				}
+
+				if (!nodes_scanner_skip_value(scanner, depth + 1))
+				{
+					return false;
+				}
+
+				nodes_scanner_skip_whitespace(scanner);
+
+				if (*scanner->ptr == ',')
+				{
+					++scanner->ptr;
+					continue;
+				}
+
+				return nodes_scanner_expect(scanner, close,
+											isObject ? "',' or '}'" : "',' or ']'");
+			}
+		}
+
+		case 't':
+		{
+			return nodes_scanner_literal(scanner, "true");
+		}
+
+		case 'f':
+		{
+			return nodes_scanner_literal(scanner, "false");
+		}
+
+		case 'n':
+		{
+			return nodes_scanner_literal(scanner, "null");
+		}
+
+		default:
+		{
+			char *end = NULL;
+
+			(void) strtod(scanner->ptr, &end);
+
+			if (end == scanner->ptr)
+			{
+				nodes_scanner_error(scanner, "a value");
+				return false;
+			}
+
+			scanner->ptr = end;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * nodes_scanner_key_is returns true when the key found in the JSON input is
+ * the given property name.
+ */
+static bool
+nodes_scanner_key_is(const char *key, size_t length, const char *name)
+{
+	return strlen(name) == length && strncmp(key, name, length) == 0;
+}
+
+
+/*
+ * nodes_scanner_node parses a JSON object describing a node directly into
+ * the given NodeAddress.
+ */
+static bool
+nodes_scanner_node(NodesArrayScanner *scanner, NodeAddress *node)
+{
+	int fields = 0;
+
+	if (!nodes_scanner_expect(scanner, '{', "'{'"))
+	{
+		return false;
+	}
+
+	nodes_scanner_skip_whitespace(scanner);
+
+	if (*scanner->ptr == '}')
+	{
+		++scanner->ptr;
+	}
+	else
+	{
+		for (;;)
+		{
+			bool success = true;
+
+			/* our property names don't need escaping, skip over the key */
+			nodes_scanner_skip_whitespace(scanner);
+
+			const char *key = scanner->ptr + 1;
+
+			if (!nodes_scanner_string(scanner, NULL, 0))
+			{
+				return false;
+			}
+
+			size_t keyLength = scanner->ptr - 1 - key;
+
+			if (!nodes_scanner_expect(scanner, ':', "':'"))
+			{
+				return false;
+			}
+
+			if (nodes_scanner_key_is(key, keyLength, "node_id"))
+			{
+				success = nodes_scanner_integer(scanner, &(node->nodeId));
+				fields |= NODES_ARRAY_FIELD_ID;
+			}
+			else if (nodes_scanner_key_is(key, keyLength, "node_name"))
+			{
+				success = nodes_scanner_string(scanner,
+											   node->name,
+											   sizeof(node->name));
+				fields |= NODES_ARRAY_FIELD_NAME;
+			}
+			else if (nodes_scanner_key_is(key, keyLength, "node_host"))
+			{
+				success = nodes_scanner_string(scanner,
+											   node->host,
+											   sizeof(node->host));
+				fields |= NODES_ARRAY_FIELD_HOST;
+			}
+			else if (nodes_scanner_key_is(key, keyLength, "node_port"))
+			{
+				int64_t port = 0;
+
+				success = nodes_scanner_integer(scanner, &port);
+
+				if (success && (port < 0 || port > 65535))
+				{
+					log_error("Failed to parse nodes array: invalid port "
+							  "number %" PRId64,
+							  port);
+					return false;
+				}
+
+				node->port = (int) port;
+				fields |= NODES_ARRAY_FIELD_PORT;
+			}
+			else if (nodes_scanner_key_is(key, keyLength, "node_lsn"))
+			{
+				success = nodes_scanner_string(scanner,
+											   node->lsn,
+											   sizeof(node->lsn));
+				fields |= NODES_ARRAY_FIELD_LSN;
+			}
+			else if (nodes_scanner_key_is(key, keyLength, "node_is_primary"))
+			{
+				success = nodes_scanner_boolean(scanner, &(node->isPrimary));
+				fields |= NODES_ARRAY_FIELD_IS_PRIMARY;
+			}
+			else
+			{
+				success = nodes_scanner_skip_value(scanner, 1);
+			}
+
+			if (!success)
+			{
+				return false;
+			}
+
+			nodes_scanner_skip_whitespace(scanner);
+
+			if (*scanner->ptr == ',')
+			{
+				++scanner->ptr;
+				continue;
+			}
+
+			if (!nodes_scanner_expect(scanner, '}', "',' or '}'"))
+			{
+				return false;
+			}
+
+			break;
+		}
+	}
+
+	if (fields != NODES_ARRAY_ALL_FIELDS)
+	{
+		log_error("Failed to parse nodes array which is expected "
+				  "to contain a JSON Array of Objects with properties "
+				  NODES_ARRAY_FORMAT);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * The monitor builds its state notifications in NotifyStateChange() as flat
+ * JSON objects, or as arrays of such objects. We scan them with the nodes
+ * array scanner, without building a JSON_Value tree for each message, and
+ * quietly give up on messages that don't have the expected properties: the
+ * parson parser then takes over for those, so that we still accept the
+ * messages of other versions of the monitor.
+ */
+#define NOTIFICATION_FIELD_TYPE (1 << 0)
+#define NOTIFICATION_FIELD_FORMATION (1 << 1)
+#define NOTIFICATION_FIELD_GROUP_ID (1 << 2)
+#define NOTIFICATION_FIELD_NODE_ID (1 << 3)
+#define NOTIFICATION_FIELD_NAME (1 << 4)
+#define NOTIFICATION_FIELD_HOST (1 << 5)
+#define NOTIFICATION_FIELD_PORT (1 << 6)
+#define NOTIFICATION_FIELD_REPORTED_STATE (1 << 7)
+#define NOTIFICATION_FIELD_GOAL_STATE (1 << 8)
+#define NOTIFICATION_FIELD_HEALTH (1 << 9)
+#define NOTIFICATION_ALL_FIELDS ((1 << 10) - 1)
+
+
+/*
+ * notification_scanner_state parses a JSON string that is a node state name.
+ */
+static bool
+notification_scanner_state(NodesArrayScanner *scanner, NodeState *state)
+{
+	char value[NAMEDATALEN] = { 0 };
+
+	if (!nodes_scanner_string(scanner, value, sizeof(value)))
+	{
+		return false;
+	}
+
+	*state = NodeStateFromString(value);
+
+	return true;
+}
+
+
+/*
+ * notification_scanner_health parses a JSON string that is a node health.
+ */
+static bool
+notification_scanner_health(NodesArrayScanner *scanner, int *health)
+{
+	char value[NAMEDATALEN] = { 0 };
+
+	if (!nodes_scanner_string(scanner, value, sizeof(value)))
+	{
+		return false;
+	}
+
+	if (streq(value, "unknown"))
+	{
+		*health = -1;
+	}
+	else if (streq(value, "bad"))
+	{
+		*health = 0;
+	}
+	else if (streq(value, "good"))
+	{
+		*health = 1;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * notification_scanner_object parses a JSON object describing a node state
+ * change directly into the given CurrentNodeState.
+ */
+static bool
+notification_scanner_object(NodesArrayScanner *scanner,
+							CurrentNodeState *nodeState)
+{
+	int fields = 0;
+
+	if (!nodes_scanner_expect(scanner, '{', "'{'"))
+	{
+		return false;
+	}
+
+	for (;;)
+	{
+		bool success = true;
+		int64_t number = 0;
+
+		/* our property names don't need escaping, skip over the key */
+		nodes_scanner_skip_whitespace(scanner);
+
+		const char *key = scanner->ptr + 1;
+
+		if (!nodes_scanner_string(scanner, NULL, 0))
+		{
+			return false;
+		}
+
+		size_t keyLength = scanner->ptr - 1 - key;
+
+		if (!nodes_scanner_expect(scanner, ':', "':'"))
+		{
+			return false;
+		}
+
+		if (nodes_scanner_key_is(key, keyLength, "type"))
+		{
+			char type[NAMEDATALEN] = { 0 };
+
+			success = nodes_scanner_string(scanner, type, sizeof(type)) &&
+					  streq(type, "state");
+			fields |= NOTIFICATION_FIELD_TYPE;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "formation"))
+		{
+			success = nodes_scanner_string(scanner,
+										   nodeState->formation,
+										   sizeof(nodeState->formation));
+			fields |= NOTIFICATION_FIELD_FORMATION;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "groupId"))
+		{
+			success = nodes_scanner_integer(scanner, &number);
+			nodeState->groupId = (int) number;
+			fields |= NOTIFICATION_FIELD_GROUP_ID;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "nodeId"))
+		{
+			success = nodes_scanner_integer(scanner, &(nodeState->node.nodeId));
+			fields |= NOTIFICATION_FIELD_NODE_ID;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "name"))
+		{
+			success = nodes_scanner_string(scanner,
+										   nodeState->node.name,
+										   sizeof(nodeState->node.name));
+			fields |= NOTIFICATION_FIELD_NAME;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "host"))
+		{
+			success = nodes_scanner_string(scanner,
+										   nodeState->node.host,
+										   sizeof(nodeState->node.host));
+			fields |= NOTIFICATION_FIELD_HOST;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "port"))
+		{
+			success = nodes_scanner_integer(scanner, &number);
+			nodeState->node.port = (int) number;
+			fields |= NOTIFICATION_FIELD_PORT;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "reportedState"))
+		{
+			success = notification_scanner_state(scanner,
+												 &(nodeState->reportedState));
+			fields |= NOTIFICATION_FIELD_REPORTED_STATE;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "goalState"))
+		{
+			success = notification_scanner_state(scanner,
+												 &(nodeState->goalState));
+			fields |= NOTIFICATION_FIELD_GOAL_STATE;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "health"))
 		{
-			++primaryCount;
+			success = notification_scanner_health(scanner, &(nodeState->health));
+			fields |= NOTIFICATION_FIELD_HEALTH;
+		}
+		else if (nodes_scanner_key_is(key, keyLength, "synchronousStandbyNames"))
+		{
+			/* optional, only when the monitor pushes new settings */
+			success = nodes_scanner_string(
+				scanner,
+				nodeState->synchronousStandbyNames,
+				sizeof(nodeState->synchronousStandbyNames));
+			nodeState->hasSynchronousStandbyNames = true;
+		}
+		else
+		{
+			success = nodes_scanner_skip_value(scanner, 1);
+		}
 
-			if (primaryCount > 1)
+		if (!success)
+		{
+			return false;
+		}
+
+		nodes_scanner_skip_whitespace(scanner);
+
+		if (*scanner->ptr == ',')
+		{
+			++scanner->ptr;
+			continue;
+		}
+
+		if (!nodes_scanner_expect(scanner, '}', "',' or '}'"))
+		{
+			return false;
+		}
+
+		break;
+	}
+
+	return fields == NOTIFICATION_ALL_FIELDS;
+}
+
+
+/*
+ * parse_state_notification_fixed parses a state notification message that is
+ * a single JSON object with the nodes array scanner, and returns false
+ * without logging anything when the message is not as expected.
+ */
+bool
+parse_state_notification_fixed(CurrentNodeState *nodeState,
+							   const char *message)
+{
+	NodesArrayScanner scanner = { message, message, true };
+
+	if (!notification_scanner_object(&scanner, nodeState))
+	{
+		return false;
+	}
+
+	nodes_scanner_skip_whitespace(&scanner);
+
+	return *scanner.ptr == '\0';
+}
+
+
+/*
+ * parse_state_notification_array_fixed parses a state notification message
+ * that is a JSON array of objects with the nodes array scanner, and returns
+ * how many objects it contains, or -1 when the message is not as expected.
+ * When nodeStates is NULL the objects are only counted.
+ */
+static int
+parse_state_notification_array_fixed(const char *message,
+									 CurrentNodeState *nodeStates)
+{
+	NodesArrayScanner scanner = { message, message, true };
+	CurrentNodeState nodeState = { 0 };
+	int count = 0;
+
+	if (!nodes_scanner_expect(&scanner, '[', "'['"))
+	{
+		return -1;
+	}
+
+	nodes_scanner_skip_whitespace(&scanner);
+
+	if (*scanner.ptr == ']')
+	{
+		++scanner.ptr;
+	}
+	else
+	{
+		for (;;)
+		{
+			CurrentNodeState *target =
+				nodeStates == NULL ? &nodeState : &(nodeStates[count]);
+
+			if (!notification_scanner_object(&scanner, target))
 			{
-				log_error("Failed to parse nodes array: more than one node "
-						  "is listed with \"node_is_primary\" true.");
-				json_value_free(template);
-				json_value_free(json);
-				return false;
+				return -1;
 			}
-		}
 
-		++nodesArrayIndex;
+			++count;
+
+			nodes_scanner_skip_whitespace(&scanner);
+
+			if (*scanner.ptr == ',')
+			{
+				++scanner.ptr;
+				continue;
+			}
+
+			if (!nodes_scanner_expect(&scanner, ']', "',' or ']'"))
+			{
+				return -1;
+			}
+
+			break;
+		}
 	}
 
-	json_value_free(template);
-	json_value_free(json);
+	nodes_scanner_skip_whitespace(&scanner);
+
+	return *scanner.ptr == '\0' ? count : -1;
+}
 
+
+/*
+ * sortAndCheckNodesArray sorts the nodes array by nodeId, and checks that
+ * every nodeId is unique.
+ */
+static bool
+sortAndCheckNodesArray(NodeAddressArray *nodesArray)
+{
 	/* now ensure the array is sorted by nodeId */
 	(void) pg_qsort(nodesArray->nodes,
 					nodesArray->count,
@@ -1129,13 +2102,13 @@ parseNodesArray(const char *nodesJSON,
 	/* check that every node id is unique in our array */
 	for (int i = 0; i < (nodesArray->count - 1); i++)
 	{
-		int currentNodeId = nodesArray->nodes[i].nodeId;
-		int nextNodeId = nodesArray->nodes[i + 1].nodeId;
+		int64_t currentNodeId = nodesArray->nodes[i].nodeId;
+		int64_t nextNodeId = nodesArray->nodes[i + 1].nodeId;
 
 		if (currentNodeId == nextNodeId)
 		{
 			log_error("Failed to parse nodes array: more than one node "
-					  "is listed with the same nodeId %d",
+					  "is listed with the same nodeId %" PRId64,
 					  currentNodeId);
 			return false;
 		}
@@ -1145,6 +2118,235 @@ parseNodesArray(const char *nodesJSON,
 }
 
 
+/*
+ * parseNodesArray parses a Nodes Array from a JSON string, as found in the
+ * nodes file or in the other nodes sent by the monitor in node_active_v2.
+ * Both are parsed at every round of the keeper main loop where the group
+ * changed, so rather than building a JSON_Value tree with parson and then
+ * copying from it, we scan the JSON text once and write the values directly
+ * in the target NodeAddressArray, without allocating memory.
+ *
+ * Properties that we don't know about are skipped, and all of the properties
+ * we know about are required.
+ */
+bool
+parseNodesArray(const char *nodesJSON,
+				NodeAddressArray *nodesArray,
+				int64_t nodeId)
+{
+	NodesArrayScanner scanner = { nodesJSON, nodesJSON };
+	int len = 0;
+	int primaryCount = 0;
+
+	nodesArray->count = 0;
+
+	if (!nodes_scanner_expect(&scanner, '[', "'['"))
+	{
+		log_error("Failed to parse nodes array which is expected "
+				  "to contain a JSON Array of Objects with properties "
+				  NODES_ARRAY_FORMAT);
+		return false;
+	}
+
+	nodes_scanner_skip_whitespace(&scanner);
+
+	if (*scanner.ptr == ']')
+	{
+		++scanner.ptr;
+	}
+	else
+	{
+		for (;;)
+		{
+			if (NODE_ARRAY_MAX_COUNT <= len)
+			{
+				log_error("Failed to parse nodes array which contains "
+						  "more than %d nodes: pg_autoctl supports up to %d nodes",
+						  NODE_ARRAY_MAX_COUNT,
+						  NODE_ARRAY_MAX_COUNT);
+				return false;
+			}
+
+			NodeAddress *node = &(nodesArray->nodes[nodesArray->count]);
+			uint64_t lsn = 0;
+
+			*node = (NodeAddress) { 0 };
+
+			if (!nodes_scanner_node(&scanner, node))
+			{
+				return false;
+			}
+
+			++len;
+
+			/* we install the keeper.otherNodes array, so skip ourselves */
+			if (node->nodeId != nodeId)
+			{
+				if (!parseLSN(node->lsn, &lsn))
+				{
+					log_error("Failed to parse nodes array LSN value \"%s\"",
+							  node->lsn);
+					return false;
+				}
+
+				if (node->isPrimary && ++primaryCount > 1)
+				{
+					log_error("Failed to parse nodes array: more than one node "
+							  "is listed with \"node_is_primary\" true.");
+					return false;
+				}
+
+				++(nodesArray->count);
+			}
+
+			nodes_scanner_skip_whitespace(&scanner);
+
+			if (*scanner.ptr == ',')
+			{
+				++scanner.ptr;
+				continue;
+			}
+
+			if (!nodes_scanner_expect(&scanner, ']', "',' or ']'"))
+			{
+				return false;
+			}
+
+			break;
+		}
+	}
+
+	nodes_scanner_skip_whitespace(&scanner);
+
+	if (*scanner.ptr != '\0')
+	{
+		nodes_scanner_error(&scanner, "the end of the nodes array");
+		return false;
+	}
+
+	return sortAndCheckNodesArray(nodesArray);
+}
+
+
+/*
+ * parseNodesArrayWithParson parses a Nodes Array from a JSON string using
+ * parson, validating it against a template first. It's the implementation
+ * that parseNodesArray replaced, kept as a reference for pg_autoctl do bench
+ * nodes-parse.
+ */
+bool
+parseNodesArrayWithParson(const char *nodesJSON,
+						  NodeAddressArray *nodesArray,
+						  int64_t nodeId)
+{
+	JSON_Value *template =
+		json_parse_string("[{"
+						  "\"node_id\": 0,"
+						  "\"node_lsn\": \"\","
+						  "\"node_name\": \"\","
+						  "\"node_host\": \"\","
+						  "\"node_port\": 0,"
+						  "\"node_is_primary\": false"
+						  "}]");
+	int nodesArrayIndex = 0;
+	int primaryCount = 0;
+
+	JSON_Value *json = json_parse_string(nodesJSON);
+
+	/* validate the JSON input as an array of object with required fields */
+	if (json_validate(template, json) == JSONFailure)
+	{
+		log_error("Failed to parse nodes array which is expected "
+				  "to contain a JSON Array of Objects with properties "
+				  "[{node_id:number, node_name:string, "
+				  "node_host:string, node_port:number, node_lsn:string, "
+				  "node_is_primary:boolean}, ...]");
+		json_value_free(template);
+		json_value_free(json);
+		return false;
+	}
+
+	JSON_Array *jsArray = json_value_get_array(json);
+	int len = json_array_get_count(jsArray);
+
+	if (NODE_ARRAY_MAX_COUNT < len)
+	{
+		log_error("Failed to parse nodes array which contains "
+				  "%d nodes: pg_autoctl supports up to %d nodes",
+				  len,
+				  NODE_ARRAY_MAX_COUNT);
+		json_value_free(template);
+		json_value_free(json);
+		return false;
+	}
+
+	nodesArray->count = len;
+
+	for (int i = 0; i < len; i++)
+	{
+		NodeAddress *node = &(nodesArray->nodes[nodesArrayIndex]);
+		JSON_Object *jsObj = json_array_get_object(jsArray, i);
+
+		int jsNodeId = (int) json_object_get_number(jsObj, "node_id");
+		uint64_t lsn = 0;
+
+		/* we install the keeper.otherNodes array, so skip ourselves */
+		if (jsNodeId == nodeId)
+		{
+			--(nodesArray->count);
+			continue;
+		}
+
+		node->nodeId = jsNodeId;
+
+		strlcpy(node->name,
+				json_object_get_string(jsObj, "node_name"),
+				sizeof(node->name));
+
+		strlcpy(node->host,
+				json_object_get_string(jsObj, "node_host"),
+				sizeof(node->host));
+
+		node->port = (int) json_object_get_number(jsObj, "node_port");
+
+		strlcpy(node->lsn,
+				json_object_get_string(jsObj, "node_lsn"),
+				sizeof(node->lsn));
+
+		if (!parseLSN(node->lsn, &lsn))
+		{
+			log_error("Failed to parse nodes array LSN value \"%s\"", node->lsn);
+			json_value_free(template);
+			json_value_free(json);
+			return false;
+		}
+
+		node->isPrimary = json_object_get_boolean(jsObj, "node_is_primary");
+
+		if (node->isPrimary)
+		{
+			++primaryCount;
+
+			if (primaryCount > 1)
+			{
+				log_error("Failed to parse nodes array: more than one node "
+						  "is listed with \"node_is_primary\" true.");
+				json_value_free(template);
+				json_value_free(json);
+				return false;
+			}
+		}
+
+		++nodesArrayIndex;
+	}
+
+	json_value_free(template);
+	json_value_free(json);
+
+	return sortAndCheckNodesArray(nodesArray);
+}
+
+
 /*
  * uri_contains_password takes a Postgres connection string and checks to see
  * if it contains a parameter called password. Returns true if a password
@@ -35,6 +35,13 @@ bool parse_controldata(PostgresControlData *pgControlData,
 
 bool parse_state_notification_message(CurrentNodeState *nodeState,
 									  const char *message);
+bool parse_state_notification_fixed(CurrentNodeState *nodeState,
+									const char *message);
+bool parse_state_notification_json(CurrentNodeState *nodeState,
+								   const char *message);
+bool parse_state_notification_messages(CurrentNodeState **nodeStates,
+									   int *count,
+									   const char *message);
 
 bool parse_bool(const char *value, bool *result);
 
@@ -96,5 +103,8 @@ bool parseLSN(const char *str, uint64_t *lsn);
 bool parseNodesArray(const char *nodesJSON,
 					 NodeAddressArray *nodesArray,
 					 int64_t nodeId);
+bool parseNodesArrayWithParson(const char *nodesJSON,
+							   NodeAddressArray *nodesArray,
+							   int64_t nodeId);
 
 #endif /* PARSING_H */
@@ -9,16 +9,25 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
 
+#include "controlfile.h"
 #include "defaults.h"
 #include "env_utils.h"
 #include "file_utils.h"
@@ -28,8 +37,11 @@
 #include "pgsql.h"
 #include "pgsetup.h"
 #include "pgtuning.h"
+#include "program_cache.h"
 #include "signals.h"
+#include "state.h"
 #include "string_utils.h"
+#include "system_utils.h"
 
 #define RUN_PROGRAM_IMPLEMENTATION
 #include "runprogram.h"
@@ -40,6 +52,14 @@
 #define AUTOCTL_CONF_INCLUDE_LINE "include '" AUTOCTL_DEFAULTS_CONF_FILENAME "'"
 #define AUTOCTL_SB_CONF_INCLUDE_LINE "include '" AUTOCTL_STANDBY_CONF_FILENAME "'"
 
+static int pg_config_parse_settings(char *contents,
+									char **names, char **values, int size);
+static int pg_config_find_setting(const char *name,
+								  char **names, int count);
+static bool pg_sync_pgdata(const char *pg_ctl, const char *pgdata);
+#if defined(__linux__)
+static bool pg_syncfs(const char *path);
+#endif
 static bool pg_include_config(const char *configFilePath,
 							  const char *configIncludeLine,
 							  const char *configIncludeComment);
@@ -78,42 +98,45 @@ static bool prepare_primary_conninfo(char *primaryConnInfo,
 									 SSLOptions sslOptions,
 									 bool escape);
 static bool prepare_conninfo_sslmode(PQExpBuffer buffer, SSLOptions sslOptions);
+static bool prepare_replication_conninfo(ReplicationSource *replicationSource,
+										 char *primaryConnInfoReplication,
+										 int size);
 
 static bool pg_write_recovery_conf(const char *pgdata,
 								   ReplicationSource *replicationSource);
 static bool pg_write_standby_signal(const char *pgdata,
 									ReplicationSource *replicationSource);
+static bool pg_read_postmaster_pid(const char *pgdata, pid_t *pid);
+static bool pg_postmaster_status(const char *pgdata, int *status);
 
 
 /*
- * Get pg_ctl --version output in pgSetup->pg_version.
+ * Get pg_ctl --version output in pgSetup->pg_version. The output is cached,
+ * see program_cache.c.
  */
 bool
 pg_ctl_version(PostgresSetup *pgSetup)
 {
-	Program prog = run_program(pgSetup->pg_ctl, "--version", NULL);
+	char output[MAXPGPATH] = { 0 };
 	char pg_version_string[PG_VERSION_STRING_MAX] = { 0 };
 	int pg_version = 0;
 
-	if (prog.returnCode != 0)
+	if (!program_cache_run(pgSetup->pg_ctl, "--version",
+						   output, sizeof(output)))
 	{
-		errno = prog.error;
-		log_error("Failed to run \"pg_ctl --version\" using program \"%s\": %m",
+		log_error("Failed to run \"pg_ctl --version\" using program \"%s\"",
 				  pgSetup->pg_ctl);
-		free_program(&prog);
 		return false;
 	}
 
-	if (!parse_version_number(prog.stdOut,
+	if (!parse_version_number(output,
 							  pg_version_string,
 							  PG_VERSION_STRING_MAX,
 							  &pg_version))
 	{
 		/* errors have already been logged */
-		free_program(&prog);
 		return false;
 	}
-	free_program(&prog);
 
 	strlcpy(pgSetup->pg_version, pg_version_string, PG_VERSION_STRING_MAX);
 
@@ -139,32 +162,17 @@ set_pg_ctl_from_config_bindir(PostgresSetup *pgSetup, const char *pg_config)
 		return false;
 	}
 
-	Program prog = run_program(pg_config, "--bindir", NULL);
-
-	char *lines[1];
+	char bindir[MAXPGPATH] = { 0 };
 
-	if (prog.returnCode != 0)
+	if (!program_cache_run(pg_config, "--bindir", bindir, sizeof(bindir)))
 	{
-		errno = prog.error;
-		log_error("Failed to run \"pg_config --bindir\" using program \"%s\": %m",
+		log_error("Failed to run \"pg_config --bindir\" using program \"%s\"",
 				  pg_config);
-		free_program(&prog);
-		return false;
-	}
-
-	if (splitLines(prog.stdOut, lines, 1) != 1)
-	{
-		log_error("Unable to parse output from pg_config --bindir");
-		free_program(&prog);
 		return false;
 	}
 
-	char *bindir = lines[0];
 	join_path_components(pg_ctl, bindir, "pg_ctl");
 
-	/* we're now done with the Program and its output */
-	free_program(&prog);
-
 	if (!file_exists(pg_ctl))
 	{
 		log_error("Failed to find pg_ctl at \"%s\" from PG_CONFIG at \"%s\"",
@@ -207,6 +215,16 @@ pg_controldata(PostgresSetup *pgSetup, bool missing_ok)
 		return false;
 	}
 
+	/*
+	 * Reading the control file ourselves is much cheaper than running
+	 * pg_controldata, which remains our fallback for control file versions
+	 * that we don't know about, or when the CRC check fails.
+	 */
+	if (controlfile_read(globalControlPath, &(pgSetup->control)))
+	{
+		return true;
+	}
+
 	/* now find the pg_controldata binary */
 	path_in_same_directory(pgSetup->pg_ctl, "pg_controldata", pg_controldata_path);
 	log_debug("%s %s", pg_controldata_path, pgSetup->pgdata);
@@ -672,9 +690,8 @@ find_extension_control_file(const char *pg_ctl, const char *extName)
 {
 	char pg_config_path[MAXPGPATH] = { 0 };
 	char extension_path[MAXPGPATH] = { 0 };
-	char *share_dir;
+	char share_dir[MAXPGPATH] = { 0 };
 	char extension_control_file_name[MAXPGPATH] = { 0 };
-	char *lines[1];
 
 	log_debug("Checking if the %s extension is installed", extName);
 
@@ -684,44 +701,24 @@ find_extension_control_file(const char *pg_ctl, const char *extName)
 		return false;
 	}
 
-	Program prog = run_program(pg_config_path, "--sharedir", NULL);
-
-	if (prog.returnCode == 0)
-	{
-		if (!prog.stdOut)
-		{
-			log_error("Got empty output from pg_config --sharedir");
-			free_program(&prog);
-			return false;
-		}
-		if (splitLines(prog.stdOut, lines, 1) != 1)
-		{
-			log_error("Unable to parse output from pg_config --sharedir");
-			free_program(&prog);
-			return false;
-		}
-		share_dir = lines[0];
-
-		join_path_components(extension_path, share_dir, "extension");
-		sformat(extension_control_file_name, MAXPGPATH, "%s.control", extName);
-		join_path_components(extension_path, extension_path, extension_control_file_name);
-		if (!file_exists(extension_path))
-		{
-			log_error("Failed to find extension control file \"%s\"",
-					  extension_path);
-			free_program(&prog);
-			return false;
-		}
-	}
-	else
+	if (!program_cache_run(pg_config_path, "--sharedir",
+						   share_dir, sizeof(share_dir)))
 	{
-		(void) log_program_output(prog, LOG_INFO, LOG_ERROR);
 		log_error("Failed to run \"%s\", see above for details",
 				  pg_config_path);
-		free_program(&prog);
 		return false;
 	}
-	free_program(&prog);
+
+	join_path_components(extension_path, share_dir, "extension");
+	sformat(extension_control_file_name, MAXPGPATH, "%s.control", extName);
+	join_path_components(extension_path, extension_path, extension_control_file_name);
+	if (!file_exists(extension_path))
+	{
+		log_error("Failed to find extension control file \"%s\"",
+				  extension_path);
+		return false;
+	}
+
 	return true;
 }
 
@@ -796,6 +793,178 @@ pg_auto_failover_default_settings_file_exists(PostgresSetup *pgSetup)
 }
 
 
+/*
+ * pg_config_changed_settings compares two versions of a Postgres
+ * configuration file and copies to settingNames the comma separated list of
+ * the settings that have been added, removed, or changed to another value.
+ * Comments, include lines, and the order of the settings are not considered.
+ *
+ * We use that to decide if a configuration change can be applied with a
+ * reload, or needs a restart of Postgres, see pgsql_get_restart_settings.
+ */
+#define PG_CONFIG_MAX_SETTINGS 1024
+
+bool
+pg_config_changed_settings(const char *oldContents, const char *newContents,
+						   char *settingNames, size_t size)
+{
+	char *oldNames[PG_CONFIG_MAX_SETTINGS] = { 0 };
+	char *oldValues[PG_CONFIG_MAX_SETTINGS] = { 0 };
+	char *newNames[PG_CONFIG_MAX_SETTINGS] = { 0 };
+	char *newValues[PG_CONFIG_MAX_SETTINGS] = { 0 };
+
+	PQExpBuffer changed = createPQExpBuffer();
+
+	char *oldCopy = strdup(oldContents == NULL ? "" : oldContents);
+	char *newCopy = strdup(newContents == NULL ? "" : newContents);
+
+	if (changed == NULL || oldCopy == NULL || newCopy == NULL)
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(changed);
+		free(oldCopy);
+		free(newCopy);
+		return false;
+	}
+
+	int oldCount = pg_config_parse_settings(oldCopy, oldNames, oldValues,
+											PG_CONFIG_MAX_SETTINGS);
+	int newCount = pg_config_parse_settings(newCopy, newNames, newValues,
+											PG_CONFIG_MAX_SETTINGS);
+
+	/* settings that are new, or have a new value */
+	for (int i = 0; i < newCount; i++)
+	{
+		/* when a setting is repeated, only the last entry is used */
+		if (pg_config_find_setting(newNames[i], newNames, newCount) != i)
+		{
+			continue;
+		}
+
+		int oldIndex = pg_config_find_setting(newNames[i], oldNames, oldCount);
+
+		if (oldIndex == -1 || strcmp(oldValues[oldIndex], newValues[i]) != 0)
+		{
+			appendPQExpBuffer(changed, "%s%s",
+							  changed->len > 0 ? "," : "",
+							  newNames[i]);
+		}
+	}
+
+	/* settings that have been removed */
+	for (int i = 0; i < oldCount; i++)
+	{
+		if (pg_config_find_setting(oldNames[i], oldNames, oldCount) == i &&
+			pg_config_find_setting(oldNames[i], newNames, newCount) == -1)
+		{
+			appendPQExpBuffer(changed, "%s%s",
+							  changed->len > 0 ? "," : "",
+							  oldNames[i]);
+		}
+	}
+
+	free(oldCopy);
+	free(newCopy);
+
+	if (PQExpBufferBroken(changed) || (size_t) changed->len >= size)
+	{
+		log_error("Failed to compute the list of changed settings: "
+				  "too many changes");
+		destroyPQExpBuffer(changed);
+		return false;
+	}
+
+	strlcpy(settingNames, changed->data, size);
+	destroyPQExpBuffer(changed);
+
+	return true;
+}
+
+
+/*
+ * pg_config_parse_settings splits the given configuration file contents in
+ * place, and fills in the names and values arrays with the settings found.
+ * It returns how many settings have been found.
+ */
+static int
+pg_config_parse_settings(char *contents, char **names, char **values, int size)
+{
+	int count = 0;
+	char *line = contents;
+
+	while (line != NULL && *line != '\0' && count < size)
+	{
+		char *next = strchr(line, '\n');
+
+		if (next != NULL)
+		{
+			*next++ = '\0';
+		}
+
+		/* skip leading spaces, empty lines, comments, and include lines */
+		while (*line == ' ' || *line == '\t')
+		{
+			++line;
+		}
+
+		if (*line == '\0' || *line == '#' || *line == '\r' ||
+			strncmp(line, "include", strlen("include")) == 0)
+		{
+			line = next;
+			continue;
+		}
+
+		char *name = line;
+		char *value = line + strcspn(line, " \t=");
+
+		if (*value != '\0')
+		{
+			*value++ = '\0';
+		}
+
+		/* the value starts after the optional equal sign and spaces */
+		value += strspn(value, " \t=");
+
+		/* and we trim trailing spaces */
+		char *end = value + strlen(value);
+
+		while (end > value &&
+			   (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+		{
+			*--end = '\0';
+		}
+
+		names[count] = name;
+		values[count] = value;
+		++count;
+
+		line = next;
+	}
+
+	return count;
+}
+
+
+/*
+ * pg_config_find_setting returns the index of the last entry of the given
+ * setting name in the names array, or -1 when the setting is not found.
+ * Postgres setting names are case insensitive.
+ */
+static int
+pg_config_find_setting(const char *name, char **names, int count)
+{
+	for (int i = count - 1; i >= 0; i--)
+	{
+		if (pg_strcasecmp(name, names[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
 /*
  * pg_include_config adds an include line to postgresql.conf to include the
  * given configuration file, with a comment refering pg_auto_failover.
@@ -1150,6 +1319,7 @@ prepare_guc_settings_from_pgsetup(const char *configFilePath,
 	if (includeTuning)
 	{
 		if (!pgtuning_prepare_guc_settings(postgres_tuning,
+										   pgSetup->pgdata,
 										   tuning,
 										   sizeof(tuning)))
 		{
@@ -1172,6 +1342,35 @@ prepare_guc_settings_from_pgsetup(const char *configFilePath,
 }
 
 
+/*
+ * BaseBackupProgress tracks the progress that pg_basebackup --progress
+ * reports, so that we log the throughput at regular intervals rather than
+ * every progress line, and record it in the init state file.
+ */
+typedef struct BaseBackupProgress
+{
+	const char *initStateFilename;
+	uint64_t startTime;
+	uint64_t lastReportTime;
+	int64_t doneKB;
+	int64_t totalKB;
+} BaseBackupProgress;
+
+static BaseBackupProgress baseBackupProgress = { 0 };
+
+/* the latest "copied" kB count that pg_rewind --progress reported */
+static int64_t rewindCopiedKB = 0;
+
+static bool pg_install_backup_dir(const char *backupDir, const char *pgdata);
+static void pg_set_rebuild_scheduling(Program *program,
+									  RebuildScheduling *scheduling);
+static void pg_apply_rebuild_scheduling(void *arg);
+static void pg_basebackup_process_buffer(const char *buffer, bool error);
+static void pg_rewind_process_buffer(const char *buffer, bool error);
+static void pg_basebackup_report_progress(BaseBackupProgress *progress,
+										  bool finished);
+
+
 /*
  * Call pg_basebackup, using a temporary directory for the duration of the data
  * transfer.
@@ -1187,10 +1386,11 @@ pg_basebackup(const char *pgdata,
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
 	char primaryConnInfo[MAXCONNINFO] = { 0 };
 
-	char *args[16];
+	char *args[20];
 	int argsIndex = 0;
 
 	char command[BUFSIZE];
+	char compressOption[BUFSIZE] = { 0 };
 
 	log_debug("mkdir -p \"%s\"", replicationSource->backupDir);
 	if (!ensure_empty_dir(replicationSource->backupDir, 0700))
@@ -1239,6 +1439,19 @@ pg_basebackup(const char *pgdata,
 	args[argsIndex++] = replicationSource->maximumBackupRate;
 	args[argsIndex++] = "--wal-method=stream";
 
+	/*
+	 * Server-side compression (Postgres 15 and later) lowers the network
+	 * bandwidth needed, and zstd can use several workers on the server. With
+	 * the plain format, pg_basebackup decompresses on our side.
+	 */
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->backupCompression))
+	{
+		sformat(compressOption, sizeof(compressOption),
+				"--compress=%s", replicationSource->backupCompression);
+
+		args[argsIndex++] = compressOption;
+	}
+
 	/* we don't use a replication slot e.g. when upstream is a standby */
 	if (!IS_EMPTY_STRING_BUFFER(replicationSource->slotName))
 	{
@@ -1256,7 +1469,8 @@ pg_basebackup(const char *pgdata,
 	Program program = { 0 };
 
 	(void) initialize_program(&program, args, false);
-	program.processBuffer = &processBufferCallback;
+	program.processBuffer = &pg_basebackup_process_buffer;
+	(void) pg_set_rebuild_scheduling(&program, &(replicationSource->scheduling));
 
 	/* log the exact command line we're using */
 	int commandSize = snprintf_program_command_line(&program, command, BUFSIZE);
@@ -1271,6 +1485,11 @@ pg_basebackup(const char *pgdata,
 		log_info("%s", command);
 	}
 
+	baseBackupProgress = (BaseBackupProgress) { 0 };
+	baseBackupProgress.initStateFilename = replicationSource->initStateFilename;
+	baseBackupProgress.startTime = time(NULL);
+	baseBackupProgress.lastReportTime = baseBackupProgress.startTime;
+
 	(void) execute_subprogram(&program);
 
 	returnCode = program.returnCode;
@@ -1282,115 +1501,144 @@ pg_basebackup(const char *pgdata,
 		return false;
 	}
 
-	/* replace $pgdata with the backup directory */
-	if (directory_exists(pgdata))
+	(void) pg_basebackup_report_progress(&baseBackupProgress, true);
+
+	return pg_install_backup_dir(replicationSource->backupDir, pgdata);
+}
+
+
+/*
+ * pg_restore_backup runs the replication.backup_restore_command to restore a
+ * base backup from a backup repository, such as pgBackRest or WAL-G, rather
+ * than copying it from the upstream node with pg_basebackup. The command is
+ * run in the same temporary directory as pg_basebackup, which is then
+ * installed as PGDATA.
+ */
+bool
+pg_restore_backup(const char *pgdata, ReplicationSource *replicationSource)
+{
+	const char *backupDir = replicationSource->backupDir;
+
+	log_debug("mkdir -p \"%s\"", backupDir);
+	if (!ensure_empty_dir(backupDir, 0700))
 	{
-		if (!rmtree(pgdata, true))
-		{
-			log_error("Failed to remove directory \"%s\": %m", pgdata);
-			return false;
-		}
+		/* errors have already been logged. */
+		return false;
 	}
 
-	log_debug("mv \"%s\" \"%s\"", replicationSource->backupDir, pgdata);
+	log_info("Restoring a base backup from the backup repository");
 
-	if (rename(replicationSource->backupDir, pgdata) != 0)
+	if (!pg_run_backup_command(replicationSource->restoreCommand,
+							   "replication.backup_restore_command",
+							   backupDir,
+							   replicationSource))
 	{
-		log_error(
-			"Failed to install pg_basebackup dir " " \"%s\" in \"%s\": %m",
-			replicationSource->backupDir, pgdata);
+		/* errors have already been logged */
 		return false;
 	}
 
-	return true;
+	char versionFile[MAXPGPATH] = { 0 };
+
+	join_path_components(versionFile, backupDir, "PG_VERSION");
+
+	if (!file_exists(versionFile))
+	{
+		log_error("Failed to restore a base backup using "
+				  "replication.backup_restore_command: \"%s\" does not exist",
+				  versionFile);
+		return false;
+	}
+
+	return pg_install_backup_dir(backupDir, pgdata);
 }
 
 
 /*
- * pg_rewind runs the pg_rewind program to rewind the given database directory
- * to a state where it can follow the given primary. We need the ability to
- * connect to the node.
+ * pg_run_backup_command runs one of the user provided commands that copy
+ * data files to the given target directory, such as
+ * replication.backup_restore_command. The command is run with the shell,
+ * where %p is replaced with the target directory, which is also exported as
+ * the PGDATA environment variable. The upstream node is exported as
+ * PG_AUTOCTL_PRIMARY_HOST and PG_AUTOCTL_PRIMARY_PORT.
  */
 bool
-pg_rewind(const char *pgdata,
-		  const char *pg_ctl,
-		  ReplicationSource *replicationSource)
+pg_run_backup_command(const char *commandTemplate,
+					  const char *settingName,
+					  const char *targetDir,
+					  ReplicationSource *replicationSource)
 {
-	int returnCode;
-	char pg_rewind[MAXPGPATH] = { 0 };
-
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
-	char primaryConnInfo[MAXCONNINFO] = { 0 };
 
-	char *args[7];
-	int argsIndex = 0;
-
-	char command[BUFSIZE];
-
-	/* call pg_rewind*/
-	path_in_same_directory(pg_ctl, "pg_rewind", pg_rewind);
+	PQExpBuffer command = createPQExpBuffer();
 
-	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
+	if (command == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
 
-	if (!IS_EMPTY_STRING_BUFFER(replicationSource->password))
+	for (const char *ptr = commandTemplate; *ptr; ptr++)
 	{
-		setenv("PGPASSWORD", replicationSource->password, 1);
+		if (ptr[0] == '%' && ptr[1] == 'p')
+		{
+			appendPQExpBufferStr(command, targetDir);
+			++ptr;
+		}
+		else if (ptr[0] == '%' && ptr[1] == '%')
+		{
+			appendPQExpBufferChar(command, '%');
+			++ptr;
+		}
+		else
+		{
+			appendPQExpBufferChar(command, *ptr);
+		}
 	}
 
-	if (!prepare_primary_conninfo(primaryConnInfo,
-								  MAXCONNINFO,
-								  primaryNode->host,
-								  primaryNode->port,
-								  replicationSource->userName,
-								  "postgres", /* pg_rewind needs a database */
-								  NULL,       /* no password here */
-								  replicationSource->applicationName,
-								  replicationSource->sslOptions,
-								  false)) /* do not escape this one */
+	if (PQExpBufferBroken(command))
 	{
-		/* errors have already been logged. */
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(command);
 		return false;
 	}
 
-	args[argsIndex++] = (char *) pg_rewind;
-	args[argsIndex++] = "--target-pgdata";
-	args[argsIndex++] = (char *) pgdata;
-	args[argsIndex++] = "--source-server";
-	args[argsIndex++] = primaryConnInfo;
-	args[argsIndex++] = "--progress";
-	args[argsIndex] = NULL;
+	char previousPGDATA[MAXPGPATH] = { 0 };
+	bool hasPGDATA = env_exists("PGDATA") &&
+					 get_env_copy("PGDATA", previousPGDATA, MAXPGPATH);
 
-	/*
-	 * We do not want to call setsid() when running this program, as the
-	 * pg_rewind subprogram is not intended to be its own session leader, but
-	 * remain a sub-process in the same group as pg_autoctl.
-	 */
+	setenv("PGDATA", targetDir, 1);
+	setenv("PG_AUTOCTL_PRIMARY_HOST", primaryNode->host, 1);
+	setenv("PG_AUTOCTL_PRIMARY_PORT", intToString(primaryNode->port).strValue, 1);
+
+	char *args[] = { "/bin/sh", "-c", command->data, NULL };
+
+	/* as for pg_basebackup, the command remains in our process group */
 	Program program = { 0 };
 
 	(void) initialize_program(&program, args, false);
-	program.processBuffer = &processBufferCallback;
 
-	/* log the exact command line we're using */
-	int commandSize = snprintf_program_command_line(&program, command, BUFSIZE);
+	log_info("%s", command->data);
 
-	if (commandSize >= BUFSIZE)
+	(void) execute_subprogram(&program);
+
+	int returnCode = program.returnCode;
+
+	free_program(&program);
+	destroyPQExpBuffer(command);
+
+	/* restore our environment for the next steps */
+	if (hasPGDATA)
 	{
-		/* we only display the first BUFSIZE bytes of the real command */
-		log_info("%s...", command);
+		setenv("PGDATA", previousPGDATA, 1);
 	}
 	else
 	{
-		log_info("%s", command);
+		unsetenv("PGDATA");
 	}
 
-	(void) execute_subprogram(&program);
-
-	returnCode = program.returnCode;
-	free_program(&program);
-
 	if (returnCode != 0)
 	{
-		log_error("Failed to run pg_rewind: exit code %d", returnCode);
+		log_error("Failed to run %s: exit code %d", settingName, returnCode);
 		return false;
 	}
 
@@ -1398,78 +1646,624 @@ pg_rewind(const char *pgdata,
 }
 
 
-/* log_program_output logs the output of the given program. */
-static void
-log_program_output(Program prog, int outLogLevel, int errorLogLevel)
+/*
+ * pg_install_backup_dir replaces PGDATA with the given backup directory.
+ */
+static bool
+pg_install_backup_dir(const char *backupDir, const char *pgdata)
 {
-	if (prog.stdOut != NULL)
+	if (directory_exists(pgdata))
 	{
-		char *outLines[BUFSIZE];
-		int lineCount = splitLines(prog.stdOut, outLines, BUFSIZE);
-		int lineNumber = 0;
-
-		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
+		if (!rmtree(pgdata, true))
 		{
-			log_level(outLogLevel, "%s", outLines[lineNumber]);
-		}
+			log_error("Failed to remove directory \"%s\": %m", pgdata);
+			return false;
+		}
+	}
+
+	log_debug("mv \"%s\" \"%s\"", backupDir, pgdata);
+
+	if (rename(backupDir, pgdata) != 0)
+	{
+		log_error("Failed to install backup dir \"%s\" in \"%s\": %m",
+				  backupDir, pgdata);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_set_rebuild_scheduling registers pg_apply_rebuild_scheduling to run in
+ * the child process of the given program, unless the scheduling is left to
+ * the defaults.
+ */
+static void
+pg_set_rebuild_scheduling(Program *program, RebuildScheduling *scheduling)
+{
+	if (scheduling->nice == 0 &&
+		scheduling->ioClass == REBUILD_IO_CLASS_NONE &&
+		IS_EMPTY_STRING_BUFFER(scheduling->cgroup))
+	{
+		return;
+	}
+
+	log_info("Running with nice %d, I/O class %s%s%s",
+			 scheduling->nice,
+			 scheduling->ioClass == REBUILD_IO_CLASS_IDLE ? "idle" :
+			 scheduling->ioClass == REBUILD_IO_CLASS_BEST_EFFORT ?
+			 "best-effort" : "unchanged",
+			 IS_EMPTY_STRING_BUFFER(scheduling->cgroup) ? "" : ", in cgroup ",
+			 scheduling->cgroup);
+
+	program->childSetup = &pg_apply_rebuild_scheduling;
+	program->childSetupArg = (void *) scheduling;
+}
+
+
+/*
+ * pg_apply_rebuild_scheduling runs in the child process, right before exec(),
+ * and applies the given RebuildScheduling to the process. Failures are only
+ * reported on stderr, which pg_autoctl logs, and the program still runs.
+ *
+ * With the best-effort I/O class we use the lowest priority level, 7. The
+ * idle class only gets disk time when no other process needs it, which can
+ * make a rebuild very slow on a busy host.
+ */
+static void
+pg_apply_rebuild_scheduling(void *arg)
+{
+	RebuildScheduling *scheduling = (RebuildScheduling *) arg;
+
+	if (scheduling->nice != 0)
+	{
+		errno = 0;
+
+		if (nice(scheduling->nice) == -1 && errno != 0)
+		{
+			fprintf(stderr, "pg_autoctl: failed to set nice %d: %s\n",
+					scheduling->nice, strerror(errno));
+		}
+	}
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (scheduling->ioClass != REBUILD_IO_CLASS_NONE)
+	{
+		/* see IOPRIO_PRIO_VALUE and IOPRIO_WHO_PROCESS in linux/ioprio.h */
+		int ioprio =
+			(scheduling->ioClass << 13) |
+			(scheduling->ioClass == REBUILD_IO_CLASS_BEST_EFFORT ? 7 : 0);
+
+		if (syscall(SYS_ioprio_set, 1, 0, ioprio) == -1)
+		{
+			fprintf(stderr, "pg_autoctl: failed to set the I/O class: %s\n",
+					strerror(errno));
+		}
+	}
+#endif
+
+	if (!IS_EMPTY_STRING_BUFFER(scheduling->cgroup))
+	{
+		char procs[MAXPGPATH] = { 0 };
+		char pid[32] = { 0 };
+
+		int pidLength = snprintf(pid, sizeof(pid), "%d\n", (int) getpid());
+		int fd = -1;
+
+		(void) snprintf(procs, sizeof(procs), "%s/cgroup.procs",
+						scheduling->cgroup);
+
+		if ((fd = open(procs, O_WRONLY)) == -1 ||
+			write(fd, pid, pidLength) != pidLength)
+		{
+			fprintf(stderr, "pg_autoctl: failed to move to cgroup \"%s\": %s\n",
+					scheduling->cgroup, strerror(errno));
+		}
+
+		if (fd != -1)
+		{
+			(void) close(fd);
+		}
+	}
+}
+
+
+/*
+ * pg_basebackup_process_buffer is a processBuffer callback for pg_basebackup.
+ * The progress lines are only logged at the DEBUG level and tracked, the
+ * other lines are handled as in processBufferCallback.
+ */
+static void
+pg_basebackup_process_buffer(const char *buffer, bool error)
+{
+	char *outLines[BUFSIZE] = { 0 };
+	int lineCount = splitLines((char *) buffer, outLines, BUFSIZE);
+
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		char *line = outLines[lineNumber];
+		int64_t doneKB = 0;
+		int64_t totalKB = 0;
+
+		if (IS_EMPTY_STRING_BUFFER(line))
+		{
+			continue;
+		}
+
+		/* "12345/67890 kB (18%), 0/1 tablespace (...)" */
+		if (sscanf(line, " %" SCNd64 "/%" SCNd64 " kB", &doneKB, &totalKB) == 2)
+		{
+			log_debug("%s", line);
+
+			baseBackupProgress.doneKB = doneKB;
+			baseBackupProgress.totalKB = totalKB;
+
+			if ((time(NULL) - baseBackupProgress.lastReportTime) >=
+				PG_AUTOCTL_BASEBACKUP_PROGRESS_INTERVAL)
+			{
+				(void) pg_basebackup_report_progress(&baseBackupProgress,
+													 false);
+			}
+			continue;
+		}
+
+		log_info("%s", line);
+	}
+}
+
+
+/*
+ * pg_basebackup_report_progress logs the progress and throughput of the
+ * current pg_basebackup, with an estimate of the remaining time, and records
+ * the progress in the init state file.
+ */
+static void
+pg_basebackup_report_progress(BaseBackupProgress *progress, bool finished)
+{
+	uint64_t now = time(NULL);
+	uint64_t elapsed = now - progress->startTime;
+
+	char done[BUFSIZE] = { 0 };
+	char total[BUFSIZE] = { 0 };
+	char rate[BUFSIZE] = { 0 };
+
+	progress->lastReportTime = now;
+
+	if (progress->totalKB <= 0)
+	{
+		return;
+	}
+
+	uint64_t bytesPerSecond =
+		elapsed > 0 ? (uint64_t) progress->doneKB * 1024 / elapsed : 0;
+
+	pretty_print_bytes(done, sizeof(done), (uint64_t) progress->doneKB * 1024);
+	pretty_print_bytes(total, sizeof(total), (uint64_t) progress->totalKB * 1024);
+	pretty_print_bytes(rate, sizeof(rate), bytesPerSecond);
+
+	if (finished)
+	{
+		log_info("pg_basebackup copied %s in %" PRIu64 "s (%s/s)",
+				 done, elapsed, rate);
+	}
+	else
+	{
+		int64_t remainingKB = progress->totalKB - progress->doneKB;
+		uint64_t remaining =
+			bytesPerSecond > 0
+			? (uint64_t) (remainingKB > 0 ? remainingKB : 0) * 1024 /
+			bytesPerSecond
+			: 0;
+
+		log_info("pg_basebackup copied %s of %s (%d%%) at %s/s, "
+				 "about %" PRIu64 "s remaining",
+				 done, total,
+				 (int) (100 * progress->doneKB / progress->totalKB),
+				 rate,
+				 remaining);
+	}
+
+	if (!keeper_init_state_update_backup_progress(progress->initStateFilename,
+												  progress->doneKB,
+												  progress->totalKB,
+												  progress->startTime))
+	{
+		log_warn("Failed to record pg_basebackup progress in \"%s\"",
+				 progress->initStateFilename);
+	}
+}
+
+
+/*
+ * pg_rewind runs the pg_rewind program to rewind the given database directory
+ * to a state where it can follow the given primary. We need the ability to
+ * connect to the node.
+ */
+bool
+pg_rewind(const char *pgdata,
+		  const char *pg_ctl,
+		  ReplicationSource *replicationSource)
+{
+	int returnCode;
+	char pg_rewind[MAXPGPATH] = { 0 };
+
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	char primaryConnInfo[MAXCONNINFO] = { 0 };
+
+	char *args[9];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* call pg_rewind*/
+	path_in_same_directory(pg_ctl, "pg_rewind", pg_rewind);
+
+	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
+
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->password))
+	{
+		setenv("PGPASSWORD", replicationSource->password, 1);
+	}
+
+	if (!prepare_primary_conninfo(primaryConnInfo,
+								  MAXCONNINFO,
+								  primaryNode->host,
+								  primaryNode->port,
+								  replicationSource->userName,
+								  "postgres", /* pg_rewind needs a database */
+								  NULL,       /* no password here */
+								  replicationSource->applicationName,
+								  replicationSource->sslOptions,
+								  false)) /* do not escape this one */
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	args[argsIndex++] = (char *) pg_rewind;
+	args[argsIndex++] = "--target-pgdata";
+	args[argsIndex++] = (char *) pgdata;
+	args[argsIndex++] = "--source-server";
+	args[argsIndex++] = primaryConnInfo;
+	args[argsIndex++] = "--progress";
+
+	/*
+	 * Fetch the WAL files that are missing from pg_wal with the target
+	 * restore_command, rather than failing and doing a base backup.
+	 */
+	if (replicationSource->rewindRestoreTargetWal)
+	{
+		args[argsIndex++] = "--restore-target-wal";
+	}
+
+	/* we sync the whole data directory once pg_rewind is done, see below */
+	if (replicationSource->rewindNoSync)
+	{
+		args[argsIndex++] = "--no-sync";
+	}
+
+	args[argsIndex] = NULL;
+
+	rewindCopiedKB = 0;
+
+	/*
+	 * We do not want to call setsid() when running this program, as the
+	 * pg_rewind subprogram is not intended to be its own session leader, but
+	 * remain a sub-process in the same group as pg_autoctl.
+	 */
+	Program program = { 0 };
+
+	(void) initialize_program(&program, args, false);
+	program.processBuffer = &pg_rewind_process_buffer;
+	(void) pg_set_rebuild_scheduling(&program, &(replicationSource->scheduling));
+
+	/* log the exact command line we're using */
+	int commandSize = snprintf_program_command_line(&program, command, BUFSIZE);
+
+	if (commandSize >= BUFSIZE)
+	{
+		/* we only display the first BUFSIZE bytes of the real command */
+		log_info("%s...", command);
+	}
+	else
+	{
+		log_info("%s", command);
+	}
+
+	(void) execute_subprogram(&program);
+
+	returnCode = program.returnCode;
+	free_program(&program);
+
+	replicationSource->rewindCopiedKB = rewindCopiedKB;
+
+	if (returnCode != 0)
+	{
+		log_error("Failed to run pg_rewind: exit code %d", returnCode);
+		return false;
+	}
+
+	log_info("pg_rewind copied %" PRId64 " kB", rewindCopiedKB);
+
+	/*
+	 * With --no-sync pg_rewind leaves the files it wrote in the OS cache,
+	 * and we must have them on disk before Postgres starts again.
+	 */
+	if (replicationSource->rewindNoSync && !pg_sync_pgdata(pg_ctl, pgdata))
+	{
+		log_error("Failed to sync the rewound data directory \"%s\" to "
+				  "disk, see above for details",
+				  pgdata);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_rewind_process_buffer is a processBuffer callback for pg_rewind. The
+ * progress lines are only logged at the DEBUG level, and we keep the last
+ * count of copied kB for reporting.
+ */
+static void
+pg_rewind_process_buffer(const char *buffer, bool error)
+{
+	char *outLines[BUFSIZE] = { 0 };
+	int lineCount = splitLines((char *) buffer, outLines, BUFSIZE);
+
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		char *line = outLines[lineNumber];
+		int64_t doneKB = 0;
+		int64_t totalKB = 0;
+
+		if (IS_EMPTY_STRING_BUFFER(line))
+		{
+			continue;
+		}
+
+		/* "12345/67890 kB (18%) copied" */
+		if (sscanf(line, " %" SCNd64 "/%" SCNd64 " kB", &doneKB, &totalKB) == 2)
+		{
+			log_debug("%s", line);
+			rewindCopiedKB = doneKB;
+			continue;
+		}
+
+		log_info("%s", line);
+	}
+}
+
+
+/*
+ * pg_has_restore_command returns true when the restore_command setting of
+ * the Postgres instance at pgdata is not empty, which is what pg_rewind
+ * --restore-target-wal uses. We ask "postgres -C" as pg_rewind does, so that
+ * the setting is found in any of the configuration files.
+ */
+bool
+pg_has_restore_command(const char *pg_ctl, const char *pgdata)
+{
+	char postgres[MAXPGPATH] = { 0 };
+
+	path_in_same_directory(pg_ctl, "postgres", postgres);
+
+	Program program = run_program(postgres,
+								  "-D", pgdata, "-C", "restore_command", NULL);
+
+	bool hasRestoreCommand =
+		program.returnCode == 0 &&
+		program.stdOut != NULL &&
+		program.stdOut[0] != '\0' &&
+		program.stdOut[0] != '\n';
+
+	if (program.returnCode != 0)
+	{
+		(void) log_program_output(program, LOG_DEBUG, LOG_DEBUG);
+	}
+
+	free_program(&program);
+
+	return hasRestoreCommand;
+}
+
+
+/* log_program_output logs the output of the given program. */
+static void
+log_program_output(Program prog, int outLogLevel, int errorLogLevel)
+{
+	if (prog.stdOut != NULL)
+	{
+		char *outLines[BUFSIZE];
+		int lineCount = splitLines(prog.stdOut, outLines, BUFSIZE);
+		int lineNumber = 0;
+
+		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
+		{
+			log_level(outLogLevel, "%s", outLines[lineNumber]);
+		}
+	}
+
+	if (prog.stdErr != NULL)
+	{
+		char *errorLines[BUFSIZE];
+		int lineCount = splitLines(prog.stdErr, errorLines, BUFSIZE);
+		int lineNumber = 0;
+
+		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
+		{
+			log_level(errorLogLevel, "%s", errorLines[lineNumber]);
+		}
+	}
+}
+
+
+/*
+ * pg_ctl_initdb initializes a PostgreSQL directory from scratch by calling
+ * "pg_ctl initdb", and returns true when this was successful. Beware that it
+ * will inherit from the environment, such as LC_COLLATE and LC_ALL etc.
+ *
+ * No provision is made to control (sanitize?) that environment.
+ *
+ * initdb spends most of its time calling fsync() on each of the files it
+ * created, so we run it with --no-sync and then sync PGDATA in one go.
+ */
+bool
+pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
+{
+	/* initdb takes time, so log about the operation BEFORE doing it */
+	log_info("Initialising a PostgreSQL cluster at \"%s\"", pgdata);
+	log_info("%s initdb -s -D %s --option '--auth=trust --no-sync'",
+			 pg_ctl, pgdata);
+
+	Program program = run_program(pg_ctl, "initdb",
+								  "--silent",
+								  "--pgdata", pgdata,
+
+	                              /* avoid warning message */
+								  "--option", "'--auth=trust' --no-sync",
+								  NULL);
+
+	bool success = program.returnCode == 0;
+
+	if (program.returnCode != 0)
+	{
+		(void) log_program_output(program, LOG_INFO, LOG_ERROR);
+		log_fatal("Failed to initialize Postgres cluster at \"%s\", "
+				  "see above for details",
+				  pgdata);
+	}
+	else
+	{
+		/* we might still have important information to read there */
+		(void) log_program_output(program, LOG_INFO, LOG_WARN);
+	}
+	free_program(&program);
+
+	if (success && !pg_sync_pgdata(pg_ctl, pgdata))
+	{
+		log_fatal("Failed to sync Postgres cluster at \"%s\" to disk, "
+				  "see above for details",
+				  pgdata);
+		return false;
+	}
+
+	return success;
+}
+
+
+/*
+ * pg_sync_pgdata makes sure that the files written by initdb --no-sync or
+ * pg_rewind --no-sync are on disk. On Linux a single syncfs(2) call on the
+ * file system of PGDATA is much faster than the fsync() calls of initdb on
+ * each file. As pg_wal and the tablespaces may be symbolic links to other
+ * file systems, we also syncfs each of them. Elsewhere, or when syncfs fails,
+ * we use initdb --sync-only.
+ */
+static bool
+pg_sync_pgdata(const char *pg_ctl, const char *pgdata)
+{
+	char initdb[MAXPGPATH] = { 0 };
+
+#if defined(__linux__)
+	char path[MAXPGPATH] = { 0 };
+	bool synced = pg_syncfs(pgdata);
+
+	sformat(path, sizeof(path), "%s/pg_wal", pgdata);
+
+	if (synced && directory_exists(path))
+	{
+		synced = pg_syncfs(path);
+	}
+
+	sformat(path, sizeof(path), "%s/pg_tblspc", pgdata);
+
+	DIR *tblspc = synced ? opendir(path) : NULL;
+
+	if (tblspc != NULL)
+	{
+		struct dirent *entry = NULL;
+
+		while (synced && (entry = readdir(tblspc)) != NULL)
+		{
+			char tblspcPath[MAXPGPATH] = { 0 };
+
+			if (entry->d_name[0] == '.')
+			{
+				continue;
+			}
+
+			sformat(tblspcPath, sizeof(tblspcPath), "%s/%s",
+					path, entry->d_name);
+
+			synced = pg_syncfs(tblspcPath);
+		}
+
+		closedir(tblspc);
 	}
 
-	if (prog.stdErr != NULL)
+	if (synced)
 	{
-		char *errorLines[BUFSIZE];
-		int lineCount = splitLines(prog.stdErr, errorLines, BUFSIZE);
-		int lineNumber = 0;
+		return true;
+	}
 
-		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
-		{
-			log_level(errorLogLevel, "%s", errorLines[lineNumber]);
-		}
+	log_debug("Failed to syncfs \"%s\", using initdb --sync-only", pgdata);
+#endif
+
+	path_in_same_directory(pg_ctl, "initdb", initdb);
+
+	Program program = run_program(initdb, "--sync-only", "--pgdata", pgdata, NULL);
+
+	bool success = program.returnCode == 0;
+
+	if (!success)
+	{
+		(void) log_program_output(program, LOG_INFO, LOG_ERROR);
+		log_error("Failed to run \"%s --sync-only --pgdata %s\"",
+				  initdb, pgdata);
 	}
+	free_program(&program);
+
+	return success;
 }
 
 
+#if defined(__linux__)
+
 /*
- * pg_ctl_initdb initializes a PostgreSQL directory from scratch by calling
- * "pg_ctl initdb", and returns true when this was successful. Beware that it
- * will inherit from the environment, such as LC_COLLATE and LC_ALL etc.
- *
- * No provision is made to control (sanitize?) that environment.
+ * pg_syncfs calls syncfs(2) on the file system where the given path is.
  */
-bool
-pg_ctl_initdb(const char *pg_ctl, const char *pgdata)
+static bool
+pg_syncfs(const char *path)
 {
-	/* initdb takes time, so log about the operation BEFORE doing it */
-	log_info("Initialising a PostgreSQL cluster at \"%s\"", pgdata);
-	log_info("%s initdb -s -D %s --option '--auth=trust'", pg_ctl, pgdata);
+	int fd = open(path, O_RDONLY);
 
-	Program program = run_program(pg_ctl, "initdb",
-								  "--silent",
-								  "--pgdata", pgdata,
+	if (fd < 0)
+	{
+		log_debug("Failed to open \"%s\": %m", path);
+		return false;
+	}
 
-	                              /* avoid warning message */
-								  "--option", "'--auth=trust'",
-								  NULL);
+	int ret = syncfs(fd);
 
-	bool success = program.returnCode == 0;
+	close(fd);
 
-	if (program.returnCode != 0)
+	if (ret != 0)
 	{
-		(void) log_program_output(program, LOG_INFO, LOG_ERROR);
-		log_fatal("Failed to initialize Postgres cluster at \"%s\", "
-				  "see above for details",
-				  pgdata);
-	}
-	else
-	{
-		/* we might still have important information to read there */
-		(void) log_program_output(program, LOG_INFO, LOG_WARN);
+		log_debug("Failed to syncfs \"%s\": %m", path);
+		return false;
 	}
-	free_program(&program);
 
-	return success;
+	log_debug("Synced the file system of \"%s\"", path);
+	return true;
 }
 
 
+#endif
+
+
 /*
  * pg_ctl_postgres runs the "postgres" command-line in the current process,
  * with the same options as we would use in pg_ctl_start. pg_ctl_postgres does
@@ -1868,6 +2662,18 @@ pg_ctl_stop(const char *pg_ctl, const char *pgdata)
 int
 pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 {
+	int status = -1;
+
+	/*
+	 * When we don't have to show the pg_ctl output, check the postmaster.pid
+	 * file ourselves, which is what pg_ctl status does anyway.
+	 */
+	if (!log_output && pg_postmaster_status(pgdata, &status))
+	{
+		log_debug("postmaster status for \"%s\" is %d", pgdata, status);
+		return status;
+	}
+
 	Program program = run_program(pg_ctl, "status", "-D", pgdata, NULL);
 	int returnCode = program.returnCode;
 
@@ -1884,6 +2690,123 @@ pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output)
 }
 
 
+/*
+ * pg_reload_conf sends SIGHUP to the postmaster, as pg_reload_conf() and
+ * pg_ctl reload do. When the postmaster PID can't be found without a doubt
+ * in the postmaster.pid file, we ask Postgres to reload using the given SQL
+ * connection instead.
+ */
+bool
+pg_reload_conf(PostgresSetup *pgSetup, PGSQL *pgsql)
+{
+	pid_t pid = 0;
+
+	if (pg_read_postmaster_pid(pgSetup->pgdata, &pid) && pid > 0)
+	{
+		if (kill(pid, SIGHUP) == 0)
+		{
+			log_info("Reloading Postgres configuration and HBA rules");
+			return true;
+		}
+
+		log_debug("Failed to signal postmaster pid %d: %m", pid);
+	}
+
+	return pgsql_reload_conf(pgsql);
+}
+
+
+/*
+ * pg_read_postmaster_pid reads the postmaster PID from the postmaster.pid
+ * file in PGDATA. When the file does not exist, pid is set to zero. The
+ * function returns false when the file exists but we can't make sense of its
+ * contents, such as when it's being written, or for a single-user backend.
+ */
+static bool
+pg_read_postmaster_pid(const char *pgdata, pid_t *pid)
+{
+	char pidfile[MAXPGPATH] = { 0 };
+	char *contents = NULL;
+	long fileSize = 0;
+	char *lines[1];
+	int value = 0;
+
+	join_path_components(pidfile, pgdata, "postmaster.pid");
+
+	if (!read_file_if_exists(pidfile, &contents, &fileSize))
+	{
+		if (errno == ENOENT)
+		{
+			*pid = 0;
+			return true;
+		}
+		return false;
+	}
+
+	bool parsed = fileSize > 0 &&
+				  splitLines(contents, lines, 1) == 1 &&
+				  stringToInt(lines[0], &value) &&
+				  value > 0;
+
+	free(contents);
+
+	if (!parsed)
+	{
+		log_debug("Failed to parse a postmaster pid in \"%s\"", pidfile);
+		return false;
+	}
+
+	*pid = (pid_t) value;
+
+	return true;
+}
+
+
+/*
+ * pg_postmaster_status sets status to what pg_ctl status would return, 0
+ * when Postgres is running and PG_CTL_STATUS_NOT_RUNNING when it's not, by
+ * checking the postmaster.pid file and the process it points to. It returns
+ * false when the situation is not clear enough, and then we run pg_ctl.
+ */
+static bool
+pg_postmaster_status(const char *pgdata, int *status)
+{
+	pid_t pid = 0;
+
+	if (!pg_read_postmaster_pid(pgdata, &pid))
+	{
+		return false;
+	}
+
+	if (pid == 0)
+	{
+		/* pg_ctl status has its own exit code when PGDATA is missing */
+		if (!directory_exists(pgdata))
+		{
+			return false;
+		}
+
+		*status = PG_CTL_STATUS_NOT_RUNNING;
+		return true;
+	}
+
+	if (kill(pid, 0) == 0)
+	{
+		*status = 0;
+		return true;
+	}
+
+	if (errno == ESRCH)
+	{
+		/* stale pidfile, Postgres is not running */
+		*status = PG_CTL_STATUS_NOT_RUNNING;
+		return true;
+	}
+
+	return false;
+}
+
+
 /*
  * pg_ctl_promote promotes a standby by running "pg_ctl promote"
  */
@@ -1937,7 +2860,7 @@ pg_setup_standby_mode(uint32_t pg_control_version,
 	 * replication mode and issuing a IDENTIFY_SYSTEM command.
 	 */
 	if (!IS_EMPTY_STRING_BUFFER(replicationSource->primaryNode.host) &&
-		!pgctl_identify_system(replicationSource))
+		!pgctl_identify_system_once(replicationSource))
 	{
 		log_error("Failed to setup standby mode: can't connect to the primary. "
 				  "See above for details");
@@ -2418,6 +3341,24 @@ prepare_primary_conninfo(char *primaryConnInfo,
 		appendPQExpBuffer(buffer, " password=%s", replicationPassword);
 	}
 
+	/* notice a broken replication connection before wal_receiver_timeout */
+	if (pgsql_keepalives.keepalives)
+	{
+		appendPQExpBuffer(buffer,
+						  " keepalives=1"
+						  " keepalives_idle=%d"
+						  " keepalives_interval=%d"
+						  " keepalives_count=%d",
+						  pgsql_keepalives.idle,
+						  pgsql_keepalives.interval,
+						  pgsql_keepalives.count);
+
+#if PG_VERSION_NUM >= 120000
+		appendPQExpBuffer(buffer, " tcp_user_timeout=%d",
+						  pgsql_keepalives.userTimeout * 1000);
+#endif
+	}
+
 	appendPQExpBufferStr(buffer, " ");
 	if (!prepare_conninfo_sslmode(buffer, sslOptions))
 	{
@@ -2514,11 +3455,174 @@ prepare_conninfo_sslmode(PQExpBuffer buffer, SSLOptions sslOptions)
 bool
 pgctl_identify_system(ReplicationSource *replicationSource)
 {
-	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+	char primaryConnInfoReplication[MAXCONNINFO] = { 0 };
+	PGSQL replicationClient = { 0 };
 
-	char primaryConnInfo[MAXCONNINFO] = { 0 };
+	if (!prepare_replication_conninfo(replicationSource,
+									  primaryConnInfoReplication,
+									  MAXCONNINFO))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	if (!pgsql_init(&replicationClient,
+					primaryConnInfoReplication,
+					PGSQL_CONN_UPSTREAM))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_identify_system(&replicationClient,
+							   &(replicationSource->system)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	replicationSource->systemIdentified = true;
+
+	return true;
+}
+
+
+/*
+ * pgctl_identify_system_once is pgctl_identify_system, skipped when it has
+ * already been done since the replication source was setup. A transition
+ * such as rejoining a demoted primary checks the replication connection
+ * before pg_rewind and again when setting up the standby, and the first
+ * connection is enough for both.
+ */
+bool
+pgctl_identify_system_once(ReplicationSource *replicationSource)
+{
+	if (replicationSource->systemIdentified)
+	{
+		log_debug("Skipping IDENTIFY_SYSTEM, done already at timeline %d",
+				  replicationSource->system.timeline);
+		return true;
+	}
+
+	return pgctl_identify_system(replicationSource);
+}
+
+
+/*
+ * pgctl_fetch_wal_segments connects with replication=1 to our target node and
+ * fetches the WAL segments from firstSegNo to lastSegNo (excluded), taking
+ * one every step segments, into the pg_wal directory of pgdata.
+ *
+ * Each segment is written to a temporary file first, and renamed once
+ * complete, so that the local standby, which polls pg_wal when it is not
+ * streaming, replays only complete segments.
+ */
+bool
+pgctl_fetch_wal_segments(ReplicationSource *replicationSource,
+						 const char *pgdata,
+						 uint32_t timeline,
+						 uint64_t segmentSize,
+						 uint64_t firstSegNo,
+						 uint64_t lastSegNo,
+						 int step)
+{
 	char primaryConnInfoReplication[MAXCONNINFO] = { 0 };
 	PGSQL replicationClient = { 0 };
+	uint64_t segmentsPerXLogId = UINT64_C(0x100000000) / segmentSize;
+
+	if (!prepare_replication_conninfo(replicationSource,
+									  primaryConnInfoReplication,
+									  MAXCONNINFO))
+	{
+		/* errors have already been logged. */
+		return false;
+	}
+
+	if (!pgsql_init(&replicationClient,
+					primaryConnInfoReplication,
+					PGSQL_CONN_UPSTREAM))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* we send one START_REPLICATION command per segment */
+	replicationClient.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	for (uint64_t segNo = firstSegNo; segNo < lastSegNo; segNo += step)
+	{
+		char walFileName[MAXPGPATH] = { 0 };
+		char walFilePath[MAXPGPATH] = { 0 };
+		char tempFilePath[MAXPGPATH] = { 0 };
+
+		if (asked_to_stop || asked_to_stop_fast)
+		{
+			pgsql_finish(&replicationClient);
+			return false;
+		}
+
+		sformat(walFileName, sizeof(walFileName), "%08X%08X%08X",
+				timeline,
+				(uint32_t) (segNo / segmentsPerXLogId),
+				(uint32_t) (segNo % segmentsPerXLogId));
+
+		sformat(walFilePath, sizeof(walFilePath),
+				"%s/pg_wal/%s", pgdata, walFileName);
+
+		sformat(tempFilePath, sizeof(tempFilePath),
+				"%s.pg_autoctl", walFilePath);
+
+		int fd = open(tempFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+		if (fd < 0)
+		{
+			log_error("Failed to open file \"%s\": %m", tempFilePath);
+			pgsql_finish(&replicationClient);
+			return false;
+		}
+
+		if (!pgsql_stream_wal_segment(&replicationClient, timeline,
+									  segNo * segmentSize, segmentSize, fd) ||
+			fsync(fd) != 0)
+		{
+			log_error("Failed to fetch WAL segment \"%s\"", walFileName);
+			close(fd);
+			(void) unlink(tempFilePath);
+			pgsql_finish(&replicationClient);
+			return false;
+		}
+
+		close(fd);
+
+		if (rename(tempFilePath, walFilePath) != 0)
+		{
+			log_error("Failed to rename \"%s\" to \"%s\": %m",
+					  tempFilePath, walFilePath);
+			pgsql_finish(&replicationClient);
+			return false;
+		}
+
+		log_debug("Fetched WAL segment \"%s\"", walFileName);
+	}
+
+	pgsql_finish(&replicationClient);
+
+	return true;
+}
+
+
+/*
+ * prepare_replication_conninfo prepares a connection string with
+ * replication=1 to the primary node of the given replication source.
+ */
+static bool
+prepare_replication_conninfo(ReplicationSource *replicationSource,
+							 char *primaryConnInfoReplication,
+							 int size)
+{
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+
+	char primaryConnInfo[MAXCONNINFO] = { 0 };
 
 	if (!prepare_primary_conninfo(primaryConnInfo,
 								  MAXCONNINFO,
@@ -2544,28 +3648,14 @@ pgctl_identify_system(ReplicationSource *replicationSource)
 	 * wherein a small set of replication commands, shown below, can be issued
 	 * instead of SQL statements.
 	 */
-	int len = sformat(primaryConnInfoReplication, MAXCONNINFO,
+	int len = sformat(primaryConnInfoReplication, size,
 					  "%s replication=1",
 					  primaryConnInfo);
 
-	if (len >= MAXCONNINFO)
-	{
-		log_warn("Failed to call IDENTIFY_SYSTEM: primary_conninfo too large");
-		return false;
-	}
-
-	if (!pgsql_init(&replicationClient,
-					primaryConnInfoReplication,
-					PGSQL_CONN_UPSTREAM))
-	{
-		/* errors have already been logged */
-		return false;
-	}
-
-	if (!pgsql_identify_system(&replicationClient,
-							   &(replicationSource->system)))
+	if (len >= size)
 	{
-		/* errors have already been logged */
+		log_warn("Failed to prepare a replication connection string: "
+				 "primary_conninfo too large");
 		return false;
 	}
 
@@ -43,13 +43,23 @@ bool pg_add_auto_failover_default_settings(PostgresSetup *pgSetup,
 										   GUC *settings);
 
 bool pg_auto_failover_default_settings_file_exists(PostgresSetup *pgSetup);
+bool pg_config_changed_settings(const char *oldContents,
+								const char *newContents,
+								char *settingNames, size_t size);
 
 bool pg_basebackup(const char *pgdata,
 				   const char *pg_ctl,
 				   ReplicationSource *replicationSource);
+bool pg_restore_backup(const char *pgdata,
+					   ReplicationSource *replicationSource);
+bool pg_run_backup_command(const char *commandTemplate,
+						   const char *settingName,
+						   const char *targetDir,
+						   ReplicationSource *replicationSource);
 bool pg_rewind(const char *pgdata,
 			   const char *pg_ctl,
 			   ReplicationSource *replicationSource);
+bool pg_has_restore_command(const char *pg_ctl, const char *pgdata);
 
 bool pg_ctl_initdb(const char *pg_ctl, const char *pgdata);
 bool pg_ctl_postgres(const char *pg_ctl, const char *pgdata, int pgport,
@@ -59,6 +69,7 @@ bool pg_log_recovery_setup(const char *pgdata, int logLevel);
 bool pg_ctl_stop(const char *pg_ctl, const char *pgdata);
 int pg_ctl_status(const char *pg_ctl, const char *pgdata, bool log_output);
 bool pg_ctl_promote(const char *pg_ctl, const char *pgdata);
+bool pg_reload_conf(PostgresSetup *pgSetup, PGSQL *pgsql);
 
 bool pg_setup_standby_mode(uint32_t pg_control_version,
 						   const char *pg_ctl,
@@ -71,6 +82,14 @@ bool pg_cleanup_standby_mode(uint32_t pg_control_version,
 							 PGSQL *pgsql);
 
 bool pgctl_identify_system(ReplicationSource *replicationSource);
+bool pgctl_identify_system_once(ReplicationSource *replicationSource);
+bool pgctl_fetch_wal_segments(ReplicationSource *replicationSource,
+							  const char *pgdata,
+							  uint32_t timeline,
+							  uint64_t segmentSize,
+							  uint64_t firstSegNo,
+							  uint64_t lastSegNo,
+							  int step);
 
 bool pg_is_running(const char *pg_ctl, const char *pgdata);
 bool pg_create_self_signed_cert(PostgresSetup *pgSetup, const char *hostname);
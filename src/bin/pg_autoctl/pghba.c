@@ -40,6 +40,26 @@ static void append_database_field(PQExpBuffer destination,
 static void append_hostname_or_cidr(PQExpBuffer destination,
 									const char *host);
 static int escape_hba_string(char *destination, const char *hbaString);
+static bool pghba_node_rules(NodeAddress *node,
+							 bool ssl,
+							 const char *database,
+							 const char *username,
+							 const char *authenticationScheme,
+							 HBAEditLevel hbaLevel,
+							 PQExpBuffer *hbaLines);
+static bool pghba_append_line(HBAFile *hba, char *text, bool owned);
+static char * pghba_normalize_rule(const char *line);
+static uint32_t pghba_hash_rule(const char *rule);
+static bool pghba_hash_insert(HBAFile *hba, int lineIndex);
+static bool pghba_hash_lookup(HBAFile *hba, const char *rule);
+static bool pghba_is_replication_rule(const char *rule,
+									  bool ssl,
+									  const char *database,
+									  const char *username);
+static bool pghba_reorder_replication_rules(HBAFile *hba,
+											bool ssl,
+											const char *database,
+											const char *username);
 
 
 /*
@@ -110,8 +130,7 @@ pghba_ensure_host_rule_exists(const char *hbaFilePath,
 							  const char *authenticationScheme,
 							  HBAEditLevel hbaLevel)
 {
-	char *currentHbaContents = NULL;
-	long currentHbaSize = 0L;
+	HBAFile hba = { 0 };
 	PQExpBuffer hbaLineBuffer = createPQExpBuffer();
 
 	char ipaddr[BUFSIZE] = { 0 };
@@ -152,19 +171,15 @@ pghba_ensure_host_rule_exists(const char *hbaFilePath,
 									 authenticationScheme))
 	{
 		/* errors have already been logged */
-
-		/* done with the new HBA line buffer */
-		destroyPQExpBuffer(hbaLineBuffer);
-
 		return false;
 	}
 
 	log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
 			  hbaFilePath, hbaLineBuffer->data);
 
-	if (!read_file(hbaFilePath, &currentHbaContents, &currentHbaSize))
+	if (!pghba_read_file(&hba, hbaFilePath))
 	{
-		/* read_file logs an error */
+		/* errors have already been logged */
 
 		/* done with the new HBA line buffer */
 		destroyPQExpBuffer(hbaLineBuffer);
@@ -172,321 +187,1066 @@ pghba_ensure_host_rule_exists(const char *hbaFilePath,
 		return false;
 	}
 
-	char *includeLine = strstr(currentHbaContents, hbaLineBuffer->data);
-
-	/*
-	 * If the rule was found and it starts on a new line. We can
-	 * skip adding it.
-	 */
-	if (includeLine != NULL && (includeLine == currentHbaContents ||
-								includeLine[-1] == '\n'))
-	{
-		log_debug("Line already exists in %s, skipping %s",
-				  hbaFilePath, hbaLineBuffer->data);
-
-		destroyPQExpBuffer(hbaLineBuffer);
-		free(currentHbaContents);
-		return true;
-	}
-
 	/*
 	 * When the option --skip-pg-hba has been used, we still WARN about the HBA
 	 * rule that we need, so that users can review their HBA settings and
 	 * provisioning.
 	 */
-	if (hbaLevel <= HBA_EDIT_SKIP)
+	if (hbaLevel <= HBA_EDIT_SKIP &&
+		!pghba_contains_rule(&hba, hbaLineBuffer->data))
 	{
 		log_warn("Skipping HBA edits (per --skip-pg-hba) for rule: %s",
 				 hbaLineBuffer->data);
-		destroyPQExpBuffer(hbaLineBuffer);
-		free(currentHbaContents);
-		return true;
 	}
-
-	/* build the new postgresql.conf contents */
-	PQExpBuffer newHbaContents = createPQExpBuffer();
-	if (newHbaContents == NULL)
+	else if (hbaLevel > HBA_EDIT_SKIP)
 	{
-		log_error("Failed to allocate memory");
-		destroyPQExpBuffer(hbaLineBuffer);
-		free(currentHbaContents);
-		return false;
+		if (!pghba_add_rule(&hba, hbaLineBuffer->data) ||
+			!pghba_write_file(&hba))
+		{
+			/* errors have already been logged */
+			destroyPQExpBuffer(hbaLineBuffer);
+			pghba_free_file(&hba);
+			return false;
+		}
 	}
 
-	appendPQExpBufferStr(newHbaContents, currentHbaContents);
-	appendPQExpBufferStr(newHbaContents, hbaLineBuffer->data);
-	appendPQExpBufferStr(newHbaContents, HBA_LINE_COMMENT "\n");
-
-	/* done with the old pg_hba.conf contents */
-	free(currentHbaContents);
-
-	/* done with the new HBA line buffer */
 	destroyPQExpBuffer(hbaLineBuffer);
-
-	/* memory allocation could have failed while building string */
-	if (PQExpBufferBroken(newHbaContents))
-	{
-		log_error("Failed to allocate memory");
-		destroyPQExpBuffer(newHbaContents);
-		return false;
-	}
-
-	/* write the new pg_hba.conf */
-	if (!write_file(newHbaContents->data, newHbaContents->len, hbaFilePath))
-	{
-		/* write_file logs an error */
-		destroyPQExpBuffer(newHbaContents);
-		return false;
-	}
-
-	destroyPQExpBuffer(newHbaContents);
-
-	log_debug("Wrote new %s", hbaFilePath);
+	pghba_free_file(&hba);
 
 	return true;
 }
 
 
 /*
- * pghba_ensure_host_rules_exist ensures that we have all the rules needed for
- * the given array of nodes, as retrived from the monitor for our formation and
- * group, presumably.
+ * pghba_update_host_rules ensures that we have all the rules needed for the
+ * given array of nodes to add, as retrived from the monitor for our formation
+ * and group, presumably, and removes the rules that we added for the given
+ * array of nodes to remove, which may be NULL.
  *
- * Each node in the array needs two rules:
+ * Each node in the arrays needs two rules:
  *
  *  host(ssl) replication "pgautofailover_replicator" hostname/ip trust
  *  host(ssl) "dbname"    "pgautofailover_replicator" hostname/ip trust
+ *
+ * The whole set of changes is applied to the in-memory HBA file, which is
+ * then written only once, and hbaChanged tells the caller whether Postgres
+ * should reload its configuration.
  */
 bool
-pghba_ensure_host_rules_exist(const char *hbaFilePath,
-							  NodeAddressArray *nodesArray,
-							  bool ssl,
-							  const char *database,
-							  const char *username,
-							  const char *authenticationScheme,
-							  HBAEditLevel hbaLevel)
+pghba_update_host_rules(const char *hbaFilePath,
+						NodeAddressArray *addNodesArray,
+						NodeAddressArray *removeNodesArray,
+						bool ssl,
+						const char *database,
+						const char *username,
+						const char *authenticationScheme,
+						HBAEditLevel hbaLevel,
+						bool *hbaChanged)
 {
-	PQExpBuffer newHbaContents = createPQExpBuffer();
-	char *currentHbaContents = NULL;
-	long currentHbaSize = 0L;
-	char *includeLine = NULL;
-
-	int nodeIndex = 0;
-	int hbaLinesAdded = 0;
-
-	PQExpBuffer hbaLineReplicationBuffer = NULL;
-	PQExpBuffer hbaLineDatabaseBuffer = NULL;
+	HBAFile hba = { 0 };
 
-	if (newHbaContents == NULL)
-	{
-		log_error("Failed to allocate memory");
-		return false;
-	}
+	*hbaChanged = false;
 
-	if (!read_file(hbaFilePath, &currentHbaContents, &currentHbaSize))
+	if (!pghba_read_file(&hba, hbaFilePath))
 	{
-		/* read_file logs an error */
-		destroyPQExpBuffer(newHbaContents);
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* always begin with the existing HBA file */
-	appendPQExpBufferStr(newHbaContents, currentHbaContents);
-
-	for (nodeIndex = 0; nodeIndex < nodesArray->count; nodeIndex++)
+	/*
+	 * Remove the rules first: a node that has a new hostname is found in both
+	 * arrays, and its new rules might be the same as the old ones, when using
+	 * IP addresses.
+	 */
+	for (int nodeIndex = 0;
+		 removeNodesArray != NULL && nodeIndex < removeNodesArray->count;
+		 nodeIndex++)
 	{
-		NodeAddress *node = &(nodesArray->nodes[nodeIndex]);
+		NodeAddress *node = &(removeNodesArray->nodes[nodeIndex]);
+		PQExpBuffer hbaLines[2] = { 0 };
 
-		int hbaLinesIndex = 0;
-		PQExpBuffer hbaLines[3] = { 0 };
-
-		bool useHostname = true;
-		char ipaddr[BUFSIZE] = { 0 };
+		if (hbaLevel < HBA_EDIT_MINIMAL)
+		{
+			break;
+		}
 
-		/* done with the new HBA line buffers (and safe to call on NULL) */
-		destroyPQExpBuffer(hbaLineReplicationBuffer);
-		destroyPQExpBuffer(hbaLineDatabaseBuffer);
+		if (!pghba_node_rules(node, ssl, database, username,
+							  authenticationScheme, hbaLevel, hbaLines))
+		{
+			/* errors have already been logged */
+			pghba_free_file(&hba);
+			return false;
+		}
 
-		/* we need new buffers now */
-		hbaLineReplicationBuffer = createPQExpBuffer();
-		hbaLineDatabaseBuffer = createPQExpBuffer();
+		log_info("Removing HBA rules for node %" PRId64 " \"%s\" (%s:%d)",
+				 node->nodeId, node->name, node->host, node->port);
 
-		if (hbaLineReplicationBuffer == NULL ||
-			hbaLineDatabaseBuffer == NULL)
+		for (int hbaLinesIndex = 0; hbaLinesIndex < 2; hbaLinesIndex++)
 		{
-			log_error("Failed to allocate memory");
-
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
-			destroyPQExpBuffer(newHbaContents);
+			(void) pghba_remove_rule(&hba, hbaLines[hbaLinesIndex]->data);
+			destroyPQExpBuffer(hbaLines[hbaLinesIndex]);
+		}
+	}
 
-			/* done with the new HBA line buffers */
-			destroyPQExpBuffer(hbaLineReplicationBuffer);
-			destroyPQExpBuffer(hbaLineDatabaseBuffer);
+	for (int nodeIndex = 0; nodeIndex < addNodesArray->count; nodeIndex++)
+	{
+		NodeAddress *node = &(addNodesArray->nodes[nodeIndex]);
+		PQExpBuffer hbaLines[2] = { 0 };
+		bool success = true;
 
+		if (!pghba_node_rules(node, ssl, database, username,
+							  authenticationScheme, hbaLevel, hbaLines))
+		{
+			/* errors have already been logged */
+			pghba_free_file(&hba);
 			return false;
 		}
 
-		if (hbaLevel >= HBA_EDIT_MINIMAL)
+		for (int hbaLinesIndex = 0; hbaLinesIndex < 2; hbaLinesIndex++)
 		{
+			PQExpBuffer hbaLineBuffer = hbaLines[hbaLinesIndex];
+
+			log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
+					  hbaFilePath, hbaLineBuffer->data);
+
+			if (pghba_contains_rule(&hba, hbaLineBuffer->data))
+			{
+				log_debug("Line already exists in %s, skipping %s",
+						  hbaFilePath, hbaLineBuffer->data);
+			}
+
 			/*
-			 * When using a hostname in the HBA host field, Postgres is very
-			 * picky about the matching rules. We have an opportunity here to
-			 * check the same DNS and reverse DNS rules as Postgres, and warn
-			 * our users when we see something that we know Postgres won't be
-			 * happy with.
-			 *
-			 * HBA & DNS is hard.
+			 * When the option --skip-pg-hba has been used, we still WARN about
+			 * the HBA rule that we need, so that users can review their HBA
+			 * settings and provisioning.
 			 */
-			if (!pghba_check_hostname(node->host, ipaddr, sizeof(ipaddr),
-									  &useHostname))
+			else if (hbaLevel < HBA_EDIT_MINIMAL)
 			{
-				/* errors have already been logged (DNS failure) */
+				log_warn("Skipping HBA edits (per --skip-pg-hba) for rule: %s",
+						 hbaLineBuffer->data);
 			}
-
-			if (!useHostname)
+			else
 			{
-				log_warn("Using IP address \"%s\" in HBA file "
-						 "instead of hostname \"%s\"", ipaddr, node->host);
+				/* now append the line to the new HBA file contents */
+				log_info("Adding HBA rule: %s", hbaLineBuffer->data);
+
+				success = success && pghba_add_rule(&hba, hbaLineBuffer->data);
 			}
+
+			destroyPQExpBuffer(hbaLineBuffer);
 		}
 
-		log_debug("pghba_ensure_host_rules_exist: %" PRId64 " \"%s\" (%s:%d)",
-				  node->nodeId,
-				  node->name,
-				  useHostname ? node->host : ipaddr,
-				  node->port);
+		if (!success)
+		{
+			/* errors have already been logged */
+			pghba_free_file(&hba);
+			return false;
+		}
+	}
 
-		if (!pghba_append_rule_to_buffer(hbaLineReplicationBuffer,
-										 ssl,
-										 HBA_DATABASE_REPLICATION,
-										 NULL,
-										 username,
-										 useHostname ? node->host : ipaddr,
-										 authenticationScheme))
+	/* write the new pg_hba.conf, unless --skip-pg-hba has been used */
+	if (hbaLevel >= HBA_EDIT_MINIMAL)
+	{
+		if (!pghba_write_file(&hba))
 		{
 			/* errors have already been logged */
+			pghba_free_file(&hba);
+			return false;
+		}
 
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
-			destroyPQExpBuffer(newHbaContents);
+		*hbaChanged = hba.changes > 0;
+	}
 
-			/* done with the new HBA line buffers (and safe to call on NULL) */
-			destroyPQExpBuffer(hbaLineReplicationBuffer);
-			destroyPQExpBuffer(hbaLineDatabaseBuffer);
+	pghba_free_file(&hba);
 
-			return false;
+	return true;
+}
+
+
+/*
+ * pghba_compact_hosts computes the hosts of the HBA rules that we need for
+ * the given nodes when postgresql.hba_compact is set: the smallest set of CIDR
+ * blocks that contains exactly the IP addresses of the nodes, and the nodes
+ * whose hostname we fail to resolve, which get rules of their own with their
+ * hostname. The blocks array must have room for nodesArray->count entries.
+ */
+bool
+pghba_compact_hosts(NodeAddressArray *nodesArray,
+					CIDRBlock *blocks,
+					int *blockCount,
+					NodeAddressArray *hostnameNodesArray)
+{
+	char ipAddresses[NODE_ARRAY_MAX_COUNT][BUFSIZE] = { 0 };
+	const char *ipAddressesPtr[NODE_ARRAY_MAX_COUNT] = { 0 };
+	int ipCount = 0;
+
+	hostnameNodesArray->count = 0;
+
+	for (int nodeIndex = 0; nodeIndex < nodesArray->count; nodeIndex++)
+	{
+		NodeAddress *node = &(nodesArray->nodes[nodeIndex]);
+		char *ipaddr = ipAddresses[ipCount];
+		bool foundHostnameFromAddress = false;
+
+		/* we use IP addresses, so reverse DNS doesn't matter here */
+		if (ip_address_type(node->host) != IPTYPE_NONE)
+		{
+			strlcpy(ipaddr, node->host, BUFSIZE);
+		}
+		else if (!resolveHostnameForwardAndReverse(node->host, ipaddr, BUFSIZE,
+												   &foundHostnameFromAddress))
+		{
+			/* errors have already been logged (DNS failure) */
+			ipaddr[0] = '\0';
 		}
 
-		if (!pghba_append_rule_to_buffer(hbaLineDatabaseBuffer,
-										 ssl,
-										 HBA_DATABASE_DBNAME,
-										 database,
-										 username,
-										 useHostname ? node->host : ipaddr,
-										 authenticationScheme))
+		if (ip_address_type(ipaddr) == IPTYPE_NONE)
 		{
-			/* errors have already been logged */
+			log_warn("Failed to find the IP address of node %" PRId64
+					 " \"%s\" (%s:%d), using its hostname in HBA rules",
+					 node->nodeId, node->name, node->host, node->port);
 
-			/* done with the old pg_hba.conf contents */
-			free(currentHbaContents);
-			destroyPQExpBuffer(newHbaContents);
+			hostnameNodesArray->nodes[hostnameNodesArray->count++] = *node;
+			continue;
+		}
 
-			/* done with the new HBA line buffers (and safe to call on NULL) */
-			destroyPQExpBuffer(hbaLineReplicationBuffer);
-			destroyPQExpBuffer(hbaLineDatabaseBuffer);
+		ipAddressesPtr[ipCount++] = ipaddr;
+	}
 
-			return false;
-		}
+	*blockCount = aggregateCIDRBlocks(ipAddressesPtr, ipCount, blocks);
 
-		log_info("%s HBA rules for node %" PRId64 " \"%s\" (%s:%d)",
-				 hbaLevel < HBA_EDIT_MINIMAL ? "Checking for" : "Ensuring",
-				 node->nodeId,
-				 node->name,
-				 useHostname ? node->host : ipaddr,
-				 node->port);
+	/* errors have already been logged */
+	return *blockCount >= 0;
+}
 
-		hbaLines[0] = hbaLineReplicationBuffer;
-		hbaLines[1] = hbaLineDatabaseBuffer;
 
-		for (hbaLinesIndex = 0; hbaLines[hbaLinesIndex] != NULL; hbaLinesIndex++)
-		{
-			PQExpBuffer hbaLineBuffer = hbaLines[hbaLinesIndex];
+/*
+ * pghba_update_compact_host_rules is a variant of pghba_update_host_rules
+ * that is used when postgresql.hba_compact is set. Rather than two rules per
+ * node, it adds two rules per CIDR block or hostname, as computed by
+ * pghba_compact_hosts for the given nodes, which are all the other nodes of
+ * our group.
+ *
+ * The rules that we generated for our replication username and that are not
+ * needed anymore, including per-node rules from before the setting was
+ * used, are removed. Postgres scans the HBA rules in order for each new
+ * connection, so we also move the replication rules after the other rules
+ * that we generated, which are used by the application connections.
+ */
+bool
+pghba_update_compact_host_rules(const char *hbaFilePath,
+								NodeAddressArray *nodesArray,
+								bool ssl,
+								const char *database,
+								const char *username,
+								const char *authenticationScheme,
+								HBAEditLevel hbaLevel,
+								bool *hbaChanged)
+{
+	HBAFile hba = { 0 };
+	NodeAddressArray hostnameNodesArray = { 0 };
 
-			log_debug("Ensuring the HBA file \"%s\" contains the line: %s",
-					  hbaFilePath, hbaLineBuffer->data);
+	CIDRBlock blocks[NODE_ARRAY_MAX_COUNT] = { 0 };
+	int blockCount = 0;
 
-			includeLine = strstr(currentHbaContents, hbaLineBuffer->data);
+	/* two rules per block or hostname */
+	PQExpBuffer rules[2 * NODE_ARRAY_MAX_COUNT] = { 0 };
+	int ruleCount = 0;
+	bool success = true;
 
-			/*
-			 * If the rule was found and it starts on a new line. We can
-			 * skip adding it.
-			 */
-			if (includeLine != NULL && (includeLine == currentHbaContents ||
-										includeLine[-1] == '\n'))
+	*hbaChanged = false;
+
+	/* with --skip-pg-hba, just warn about the rules that are missing */
+	if (hbaLevel < HBA_EDIT_MINIMAL)
+	{
+		return pghba_update_host_rules(hbaFilePath, nodesArray, NULL,
+									   ssl, database, username,
+									   authenticationScheme, hbaLevel,
+									   hbaChanged);
+	}
+
+	if (!pghba_compact_hosts(nodesArray, blocks, &blockCount,
+							 &hostnameNodesArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Ensuring %d HBA rules for the %d other nodes of the group",
+			 2 * (blockCount + hostnameNodesArray.count), nodesArray->count);
+
+	for (int index = 0;
+		 success && index < blockCount + hostnameNodesArray.count;
+		 index++)
+	{
+		const char *host =
+			index < blockCount
+			? blocks[index].cidr
+			: hostnameNodesArray.nodes[index - blockCount].host;
+
+		for (int hbaLinesIndex = 0; success && hbaLinesIndex < 2; hbaLinesIndex++)
+		{
+			PQExpBuffer buffer = createPQExpBuffer();
+
+			if (buffer == NULL)
 			{
-				log_debug("Line already exists in %s, skipping %s",
-						  hbaFilePath, hbaLineBuffer->data);
+				log_error("Failed to allocate memory");
+				success = false;
+				break;
+			}
+
+			/* pghba_append_rule_to_buffer destroys the buffer on failure */
+			success =
+				pghba_append_rule_to_buffer(buffer,
+											ssl,
+											hbaLinesIndex == 0
+											? HBA_DATABASE_REPLICATION
+											: HBA_DATABASE_DBNAME,
+											database,
+											username,
+											host,
+											authenticationScheme);
+
+			if (success)
+			{
+				rules[ruleCount++] = buffer;
+			}
+		}
+	}
+
+	if (success)
+	{
+		success = pghba_read_file(&hba, hbaFilePath);
+	}
 
+	if (success)
+	{
+		/* remove the rules that are not needed anymore */
+		for (int index = 0; index < hba.lineCount; index++)
+		{
+			HBALine *line = &(hba.lines[index]);
+			bool needed = false;
+
+			if (!line->generated || line->removed ||
+				!pghba_is_replication_rule(line->rule, ssl, database, username))
+			{
 				continue;
 			}
 
-			/*
-			 * When the option --skip-pg-hba has been used, we still WARN about
-			 * the HBA rule that we need, so that users can review their HBA
-			 * settings and provisioning.
-			 */
-			if (hbaLevel < HBA_EDIT_MINIMAL)
+			for (int ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++)
 			{
-				log_warn("Skipping HBA edits (per --skip-pg-hba) for rule: %s",
-						 hbaLineBuffer->data);
+				if (strcmp(line->rule, rules[ruleIndex]->data) == 0)
+				{
+					needed = true;
+					break;
+				}
 			}
-			else
+
+			if (!needed)
 			{
-				/* now append the line to the new HBA file contents */
-				log_info("Adding HBA rule: %s", hbaLineBuffer->data);
+				log_info("Removing HBA rule: %s", line->rule);
 
-				appendPQExpBufferStr(newHbaContents, hbaLineBuffer->data);
-				appendPQExpBufferStr(newHbaContents, HBA_LINE_COMMENT "\n");
+				line->removed = true;
+				++hba.changes;
+			}
+		}
 
-				++hbaLinesAdded;
+		for (int ruleIndex = 0; success && ruleIndex < ruleCount; ruleIndex++)
+		{
+			if (!pghba_contains_rule(&hba, rules[ruleIndex]->data))
+			{
+				log_info("Adding HBA rule: %s", rules[ruleIndex]->data);
 			}
+
+			success = pghba_add_rule(&hba, rules[ruleIndex]->data);
 		}
 	}
 
-	/* done with the new HBA line buffers (and safe to call on NULL) */
-	destroyPQExpBuffer(hbaLineReplicationBuffer);
-	destroyPQExpBuffer(hbaLineDatabaseBuffer);
+	if (success)
+	{
+		success =
+			pghba_reorder_replication_rules(&hba, ssl, database, username) &&
+			pghba_write_file(&hba);
 
-	/* done with the old pg_hba.conf contents */
-	free(currentHbaContents);
+		*hbaChanged = success && hba.changes > 0;
+	}
 
-	/* memory allocation could have failed while building string */
-	if (PQExpBufferBroken(newHbaContents))
+	for (int ruleIndex = 0; ruleIndex < ruleCount; ruleIndex++)
 	{
-		log_error("Failed to allocate memory");
-		destroyPQExpBuffer(newHbaContents);
-		return false;
+		destroyPQExpBuffer(rules[ruleIndex]);
 	}
 
-	/* write the new pg_hba.conf, unless --skip-pg-hba has been used */
-	if (hbaLevel >= HBA_EDIT_MINIMAL && hbaLinesAdded > 0)
+	pghba_free_file(&hba);
+
+	return success;
+}
+
+
+/*
+ * pghba_is_replication_rule returns true when the given normalized rule is
+ * one of the two rules that pghba_node_rules or
+ * pghba_update_compact_host_rules build for the other nodes of the group,
+ * whatever the host.
+ */
+static bool
+pghba_is_replication_rule(const char *rule,
+						  bool ssl,
+						  const char *database,
+						  const char *username)
+{
+	bool found = false;
+
+	for (int index = 0; !found && index < 2; index++)
 	{
-		log_info("Writing new HBA rules in \"%s\"", hbaFilePath);
+		PQExpBuffer prefix = createPQExpBuffer();
+		char escapedUsername[BUFSIZE] = { 0 };
 
-		if (!write_file(newHbaContents->data, newHbaContents->len, hbaFilePath))
+		if (prefix == NULL)
 		{
-			/* write_file logs an error */
-			destroyPQExpBuffer(newHbaContents);
+			log_error("Failed to allocate memory");
 			return false;
 		}
+
+		(void) escape_hba_string(escapedUsername, username);
+
+		appendPQExpBufferStr(prefix, ssl ? "hostssl " : "host ");
+		append_database_field(prefix,
+							  index == 0
+							  ? HBA_DATABASE_REPLICATION
+							  : HBA_DATABASE_DBNAME,
+							  database);
+		appendPQExpBuffer(prefix, " %s ", escapedUsername);
+
+		found = !PQExpBufferBroken(prefix) &&
+				strncmp(rule, prefix->data, prefix->len) == 0;
+
+		destroyPQExpBuffer(prefix);
 	}
 
-	destroyPQExpBuffer(newHbaContents);
+	return found;
+}
 
-	log_debug("Wrote new %s", hbaFilePath);
 
-	return true;
+/*
+ * pghba_reorder_replication_rules moves the replication rules that we
+ * generated after the other rules that we generated, which are used for the
+ * application connections. Postgres uses the first rule that matches, so we
+ * only move rules within a run of lines that we generated, and never across
+ * a line that has been edited by hand. The replication rules are for our
+ * replication username only, so the other rules that we generated don't
+ * match the same connections.
+ *
+ * The hash table of the rules is built again for the new line order.
+ */
+static bool
+pghba_reorder_replication_rules(HBAFile *hba,
+								bool ssl,
+								const char *database,
+								const char *username)
+{
+	int runStart = 0;
+	bool reordered = false;
+
+	while (runStart < hba->lineCount)
+	{
+		int runEnd = runStart;
+
+		/* comments and removed lines don't break a run */
+		while (runEnd < hba->lineCount &&
+			   (hba->lines[runEnd].generated ||
+				hba->lines[runEnd].removed ||
+				hba->lines[runEnd].rule[0] == '\0'))
+		{
+			++runEnd;
+		}
+
+		/* stable partition of the run, using insertion */
+		for (int index = runStart + 1; index < runEnd; index++)
+		{
+			HBALine line = hba->lines[index];
+			int position = index;
+
+			if (!line.generated ||
+				pghba_is_replication_rule(line.rule, ssl, database, username))
+			{
+				continue;
+			}
+
+			while (position > runStart &&
+				   hba->lines[position - 1].generated &&
+				   pghba_is_replication_rule(hba->lines[position - 1].rule,
+											 ssl, database, username))
+			{
+				hba->lines[position] = hba->lines[position - 1];
+				--position;
+			}
+
+			if (position != index)
+			{
+				hba->lines[position] = line;
+				reordered = true;
+			}
+		}
+
+		runStart = runEnd == runStart ? runEnd + 1 : runEnd;
+	}
+
+	if (!reordered)
+	{
+		return true;
+	}
+
+	++hba->changes;
+
+	free(hba->hashTable);
+	hba->hashTable = NULL;
+	hba->hashSize = 0;
+	hba->hashCount = 0;
+
+	for (int index = 0; index < hba->lineCount; index++)
+	{
+		if (hba->lines[index].rule[0] != '\0' && !pghba_hash_insert(hba, index))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * pghba_node_rules builds the two HBA rules that a node of our group needs,
+ * see pghba_update_host_rules, in the given array of two new buffers.
+ */
+static bool
+pghba_node_rules(NodeAddress *node,
+				 bool ssl,
+				 const char *database,
+				 const char *username,
+				 const char *authenticationScheme,
+				 HBAEditLevel hbaLevel,
+				 PQExpBuffer *hbaLines)
+{
+	bool useHostname = true;
+	char ipaddr[BUFSIZE] = { 0 };
+
+	PQExpBuffer hbaLineReplicationBuffer = createPQExpBuffer();
+	PQExpBuffer hbaLineDatabaseBuffer = createPQExpBuffer();
+
+	if (hbaLineReplicationBuffer == NULL ||
+		hbaLineDatabaseBuffer == NULL)
+	{
+		log_error("Failed to allocate memory");
+
+		/* done with the new HBA line buffers (and safe to call on NULL) */
+		destroyPQExpBuffer(hbaLineReplicationBuffer);
+		destroyPQExpBuffer(hbaLineDatabaseBuffer);
+
+		return false;
+	}
+
+	if (hbaLevel >= HBA_EDIT_MINIMAL)
+	{
+		/*
+		 * When using a hostname in the HBA host field, Postgres is very
+		 * picky about the matching rules. We have an opportunity here to
+		 * check the same DNS and reverse DNS rules as Postgres, and warn
+		 * our users when we see something that we know Postgres won't be
+		 * happy with.
+		 *
+		 * HBA & DNS is hard.
+		 */
+		if (!pghba_check_hostname(node->host, ipaddr, sizeof(ipaddr),
+								  &useHostname))
+		{
+			/* errors have already been logged (DNS failure) */
+		}
+
+		if (!useHostname)
+		{
+			log_warn("Using IP address \"%s\" in HBA file "
+					 "instead of hostname \"%s\"", ipaddr, node->host);
+		}
+	}
+
+	log_debug("pghba_node_rules: %" PRId64 " \"%s\" (%s:%d)",
+			  node->nodeId,
+			  node->name,
+			  useHostname ? node->host : ipaddr,
+			  node->port);
+
+	/* pghba_append_rule_to_buffer destroys the buffer on failure */
+	if (!pghba_append_rule_to_buffer(hbaLineReplicationBuffer,
+									 ssl,
+									 HBA_DATABASE_REPLICATION,
+									 NULL,
+									 username,
+									 useHostname ? node->host : ipaddr,
+									 authenticationScheme))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(hbaLineDatabaseBuffer);
+		return false;
+	}
+
+	if (!pghba_append_rule_to_buffer(hbaLineDatabaseBuffer,
+									 ssl,
+									 HBA_DATABASE_DBNAME,
+									 database,
+									 username,
+									 useHostname ? node->host : ipaddr,
+									 authenticationScheme))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(hbaLineReplicationBuffer);
+		return false;
+	}
+
+	log_info("%s HBA rules for node %" PRId64 " \"%s\" (%s:%d)",
+			 hbaLevel < HBA_EDIT_MINIMAL ? "Checking for" : "Ensuring",
+			 node->nodeId,
+			 node->name,
+			 useHostname ? node->host : ipaddr,
+			 node->port);
+
+	hbaLines[0] = hbaLineReplicationBuffer;
+	hbaLines[1] = hbaLineDatabaseBuffer;
+
+	return true;
+}
+
+
+/*
+ * pghba_read_file reads the given HBA file into our in-memory model: an array
+ * of lines, and a hash table indexed by the rule of each line, so that we
+ * know in a single lookup if a rule is already present.
+ */
+bool
+pghba_read_file(HBAFile *hba, const char *hbaFilePath)
+{
+	long fileSize = 0L;
+
+	memset(hba, 0, sizeof(HBAFile));
+	strlcpy(hba->hbaFilePath, hbaFilePath, MAXPGPATH);
+
+	if (!read_file(hbaFilePath, &(hba->contents), &fileSize))
+	{
+		/* read_file logs an error */
+		return false;
+	}
+
+	char *line = hba->contents;
+
+	while (line != NULL && *line != '\0')
+	{
+		char *newline = strchr(line, '\n');
+
+		if (newline != NULL)
+		{
+			*newline = '\0';
+		}
+
+		if (!pghba_append_line(hba, line, false))
+		{
+			/* errors have already been logged */
+			pghba_free_file(hba);
+			return false;
+		}
+
+		line = newline == NULL ? NULL : newline + 1;
+	}
+
+	return true;
+}
+
+
+/*
+ * pghba_append_line appends a line to the in-memory HBA file, and registers
+ * its rule in the hash table. When owned is true, the line has been
+ * allocated by us and is going to be free'd with the model.
+ */
+static bool
+pghba_append_line(HBAFile *hba, char *text, bool owned)
+{
+	if (hba->lineCount == hba->lineCapacity)
+	{
+		int capacity = hba->lineCapacity == 0 ? 64 : 2 * hba->lineCapacity;
+		HBALine *lines = realloc(hba->lines, capacity * sizeof(HBALine));
+
+		if (lines == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		hba->lines = lines;
+		hba->lineCapacity = capacity;
+	}
+
+	HBALine *line = &(hba->lines[hba->lineCount]);
+
+	line->text = text;
+	line->owned = owned;
+	line->removed = false;
+	line->generated = strstr(text, HBA_LINE_COMMENT) != NULL;
+	line->rule = pghba_normalize_rule(text);
+
+	if (line->rule == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	/* comments and empty lines are not registered in the hash table */
+	if (line->rule[0] != '\0' && !pghba_hash_insert(hba, hba->lineCount))
+	{
+		free(line->rule);
+		return false;
+	}
+
+	++hba->lineCount;
+
+	return true;
+}
+
+
+/*
+ * pghba_normalize_rule returns a malloc'ed copy of the rule found in the
+ * given HBA line: without comments, and where runs of spaces and tabs have
+ * been replaced by a single space, so that we recognize rules that have
+ * been edited by hand.
+ */
+static char *
+pghba_normalize_rule(const char *line)
+{
+	char *rule = malloc(strlen(line) + 1);
+	int ruleIndex = 0;
+	bool inQuotes = false;
+
+	if (rule == NULL)
+	{
+		return NULL;
+	}
+
+	for (const char *ptr = line; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '#' && !inQuotes)
+		{
+			break;
+		}
+
+		if (*ptr == '"')
+		{
+			inQuotes = !inQuotes;
+		}
+
+		if ((*ptr == ' ' || *ptr == '\t' || *ptr == '\r') && !inQuotes)
+		{
+			/* skip leading spaces, and only keep one space in a row */
+			if (ruleIndex > 0 && rule[ruleIndex - 1] != ' ')
+			{
+				rule[ruleIndex++] = ' ';
+			}
+			continue;
+		}
+
+		rule[ruleIndex++] = *ptr;
+	}
+
+	/* remove the trailing space, if any */
+	if (ruleIndex > 0 && rule[ruleIndex - 1] == ' ')
+	{
+		--ruleIndex;
+	}
+
+	rule[ruleIndex] = '\0';
+
+	return rule;
+}
+
+
+/*
+ * pghba_hash_rule computes the FNV-1a hash of the given rule.
+ */
+static uint32_t
+pghba_hash_rule(const char *rule)
+{
+	uint32_t hash = 2166136261U;
+
+	for (const char *ptr = rule; *ptr != '\0'; ptr++)
+	{
+		hash ^= (unsigned char) *ptr;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+
+/*
+ * pghba_hash_insert adds the given line to the hash table, an open addressing
+ * table of line indexes that is kept at most half full.
+ */
+static bool
+pghba_hash_insert(HBAFile *hba, int lineIndex)
+{
+	if (2 * (hba->hashCount + 1) > hba->hashSize)
+	{
+		int size = hba->hashSize == 0 ? 128 : 2 * hba->hashSize;
+		int *table = malloc(size * sizeof(int));
+
+		if (table == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		for (int index = 0; index < size; index++)
+		{
+			table[index] = -1;
+		}
+
+		/* re-hash the lines that are already registered */
+		int *previousTable = hba->hashTable;
+		int previousSize = hba->hashSize;
+
+		hba->hashTable = table;
+		hba->hashSize = size;
+		hba->hashCount = 0;
+
+		for (int index = 0; index < previousSize; index++)
+		{
+			if (previousTable[index] >= 0)
+			{
+				(void) pghba_hash_insert(hba, previousTable[index]);
+			}
+		}
+
+		free(previousTable);
+	}
+
+	uint32_t mask = hba->hashSize - 1;
+	uint32_t slot = pghba_hash_rule(hba->lines[lineIndex].rule) & mask;
+
+	while (hba->hashTable[slot] >= 0)
+	{
+		slot = (slot + 1) & mask;
+	}
+
+	hba->hashTable[slot] = lineIndex;
+	++hba->hashCount;
+
+	return true;
+}
+
+
+/*
+ * pghba_contains_rule returns true when the given rule is found in the
+ * in-memory HBA file, on a line that has not been removed.
+ */
+bool
+pghba_contains_rule(HBAFile *hba, const char *rule)
+{
+	char *normalizedRule = pghba_normalize_rule(rule);
+
+	if (normalizedRule == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	bool found = pghba_hash_lookup(hba, normalizedRule);
+
+	free(normalizedRule);
+
+	return found;
+}
+
+
+/*
+ * pghba_hash_lookup returns true when the given normalized rule is found in
+ * the hash table, on a line that has not been removed.
+ */
+static bool
+pghba_hash_lookup(HBAFile *hba, const char *rule)
+{
+	if (hba->hashSize == 0)
+	{
+		return false;
+	}
+
+	uint32_t mask = hba->hashSize - 1;
+	uint32_t slot = pghba_hash_rule(rule) & mask;
+
+	for (; hba->hashTable[slot] >= 0; slot = (slot + 1) & mask)
+	{
+		HBALine *line = &(hba->lines[hba->hashTable[slot]]);
+
+		if (!line->removed && strcmp(line->rule, rule) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * pghba_add_rule adds the given rule at the end of the in-memory HBA file,
+ * unless it's already there. The HBA file is only modified in-memory, see
+ * pghba_write_file.
+ */
+bool
+pghba_add_rule(HBAFile *hba, const char *rule)
+{
+	if (pghba_contains_rule(hba, rule))
+	{
+		log_debug("Line already exists in %s, skipping %s",
+				  hba->hbaFilePath, rule);
+		return true;
+	}
+
+	int size = strlen(rule) + strlen(HBA_LINE_COMMENT) + 1;
+	char *text = malloc(size);
+
+	if (text == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	sformat(text, size, "%s%s", rule, HBA_LINE_COMMENT);
+
+	if (!pghba_append_line(hba, text, true))
+	{
+		free(text);
+		return false;
+	}
+
+	++hba->changes;
+
+	return true;
+}
+
+
+/*
+ * pghba_remove_rule removes the lines that implement the given rule from the
+ * in-memory HBA file. Only the lines that pg_auto_failover added are removed,
+ * the rules that have been edited by hand are left alone.
+ */
+bool
+pghba_remove_rule(HBAFile *hba, const char *rule)
+{
+	char *normalizedRule = pghba_normalize_rule(rule);
+
+	if (normalizedRule == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int index = 0; index < hba->lineCount; index++)
+	{
+		HBALine *line = &(hba->lines[index]);
+
+		if (line->generated && !line->removed &&
+			strcmp(line->rule, normalizedRule) == 0)
+		{
+			log_info("Removing HBA rule: %s", line->rule);
+
+			line->removed = true;
+			++hba->changes;
+		}
+	}
+
+	free(normalizedRule);
+
+	return true;
+}
+
+
+/*
+ * pghba_write_file writes the in-memory HBA file to disk, when it has been
+ * modified.
+ */
+bool
+pghba_write_file(HBAFile *hba)
+{
+	if (hba->changes == 0)
+	{
+		return true;
+	}
+
+	PQExpBuffer newHbaContents = createPQExpBuffer();
+
+	if (newHbaContents == NULL)
+	{
+		log_error("Failed to allocate memory");
+		return false;
+	}
+
+	for (int index = 0; index < hba->lineCount; index++)
+	{
+		HBALine *line = &(hba->lines[index]);
+
+		if (!line->removed)
+		{
+			appendPQExpBufferStr(newHbaContents, line->text);
+			appendPQExpBufferChar(newHbaContents, '\n');
+		}
+	}
+
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(newHbaContents))
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(newHbaContents);
+		return false;
+	}
+
+	log_info("Writing new HBA rules in \"%s\"", hba->hbaFilePath);
+
+	if (!write_file(newHbaContents->data, newHbaContents->len,
+					hba->hbaFilePath))
+	{
+		/* write_file logs an error */
+		destroyPQExpBuffer(newHbaContents);
+		return false;
+	}
+
+	destroyPQExpBuffer(newHbaContents);
+
+	log_debug("Wrote new %s", hba->hbaFilePath);
+
+	return true;
+}
+
+
+/*
+ * pghba_free_file frees the memory used by the in-memory HBA file.
+ */
+void
+pghba_free_file(HBAFile *hba)
+{
+	for (int index = 0; index < hba->lineCount; index++)
+	{
+		HBALine *line = &(hba->lines[index]);
+
+		free(line->rule);
+
+		if (line->owned)
+		{
+			free(line->text);
+		}
+	}
+
+	free(hba->lines);
+	free(hba->hashTable);
+	free(hba->contents);
+
+	memset(hba, 0, sizeof(HBAFile));
 }
 
 
@@ -10,6 +10,7 @@
 #ifndef PGHBA_H
 #define PGHBA_H
 
+#include "ipaddr.h"
 #include "pgsetup.h"
 #include "pgsql.h"
 
@@ -21,6 +22,33 @@ typedef enum HBADatabaseType
 	HBA_DATABASE_DBNAME
 } HBADatabaseType;
 
+/*
+ * An HBA file is loaded in memory as an array of lines, and a hash table of
+ * the rules found on those lines, so that we can apply a set of changes and
+ * then write the file only once.
+ */
+typedef struct HBALine
+{
+	char *text;                 /* the line, as found in the file */
+	char *rule;                 /* normalized rule, without comments */
+	bool generated;             /* the line has been added by pg_autoctl */
+	bool removed;
+	bool owned;                 /* text has been allocated for this line */
+} HBALine;
+
+typedef struct HBAFile
+{
+	char hbaFilePath[MAXPGPATH];
+	char *contents;
+	HBALine *lines;
+	int lineCount;
+	int lineCapacity;
+	int *hashTable;             /* line indexes, -1 for empty slots */
+	int hashSize;
+	int hashCount;
+	int changes;
+} HBAFile;
+
 
 bool pghba_ensure_host_rule_exists(const char *hbaFilePath,
 								   bool ssl,
@@ -31,13 +59,36 @@ bool pghba_ensure_host_rule_exists(const char *hbaFilePath,
 								   const char *authenticationScheme,
 								   HBAEditLevel hbaLevel);
 
-bool pghba_ensure_host_rules_exist(const char *hbaFilePath,
-								   NodeAddressArray *nodesArray,
-								   bool ssl,
-								   const char *database,
-								   const char *username,
-								   const char *authenticationScheme,
-								   HBAEditLevel hbaLevel);
+bool pghba_update_host_rules(const char *hbaFilePath,
+							 NodeAddressArray *addNodesArray,
+							 NodeAddressArray *removeNodesArray,
+							 bool ssl,
+							 const char *database,
+							 const char *username,
+							 const char *authenticationScheme,
+							 HBAEditLevel hbaLevel,
+							 bool *hbaChanged);
+
+bool pghba_compact_hosts(NodeAddressArray *nodesArray,
+						 CIDRBlock *blocks,
+						 int *blockCount,
+						 NodeAddressArray *hostnameNodesArray);
+
+bool pghba_update_compact_host_rules(const char *hbaFilePath,
+									 NodeAddressArray *nodesArray,
+									 bool ssl,
+									 const char *database,
+									 const char *username,
+									 const char *authenticationScheme,
+									 HBAEditLevel hbaLevel,
+									 bool *hbaChanged);
+
+bool pghba_read_file(HBAFile *hba, const char *hbaFilePath);
+bool pghba_contains_rule(HBAFile *hba, const char *rule);
+bool pghba_add_rule(HBAFile *hba, const char *rule);
+bool pghba_remove_rule(HBAFile *hba, const char *rule);
+bool pghba_write_file(HBAFile *hba);
+void pghba_free_file(HBAFile *hba);
 
 bool pghba_enable_lan_cidr(PGSQL *pgsql,
 						   bool ssl,
@@ -22,6 +22,7 @@
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
 
+#include "config_watch.h"
 #include "defaults.h"
 #include "env_utils.h"
 #include "log.h"
@@ -922,6 +923,19 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 		return false;
 	}
 
+	/*
+	 * Postgres updates the status line of its postmaster.pid file when it's
+	 * ready, so rather than sleeping in between our attempts we wait for the
+	 * file to be written to, with the same delays as a timeout.
+	 */
+	char pidfilePath[MAXPGPATH] = { 0 };
+	ConfigWatch pidfileWatch = { 0 };
+
+	join_path_components(pidfilePath, pgSetup->pgdata, "postmaster.pid");
+
+	(void) config_watch_init(&pidfileWatch);
+	(void) config_watch_add(&pidfileWatch, pidfilePath);
+
 	/*
 	 * Invalidate in-memory Postmaster status cache.
 	 *
@@ -968,6 +982,7 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 			 * file, so we consider that Postgres is not running, thus not
 			 * ready.
 			 */
+			(void) config_watch_finish(&pidfileWatch);
 			return false;
 		}
 
@@ -978,7 +993,7 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 		 */
 		if (pgSetup->pidFile.pid < 0)
 		{
-			pg_usleep(250 * 1000);
+			(void) config_watch_wait(&pidfileWatch, 250);
 			continue;
 		}
 
@@ -991,6 +1006,7 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 		if (!read_pg_pidfile(pgSetup, pgIsNotRunningIsOk, maxRetries))
 		{
 			log_warn("Failed to read Postgres \"postmaster.pid\" file");
+			(void) config_watch_finish(&pidfileWatch);
 			return false;
 		}
 
@@ -1000,13 +1016,15 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 			break;
 		}
 
-		log_debug("postmaster status is \"%s\", retrying in %ds.",
+		log_debug("postmaster status is \"%s\", retrying in %dms.",
 				  pmStatusToString(pgSetup->pm_status),
 				  PG_AUTOCTL_KEEPER_RETRY_TIME_MS);
 
-		pg_usleep(PG_AUTOCTL_KEEPER_RETRY_TIME_MS * 1000);
+		(void) config_watch_wait(&pidfileWatch, PG_AUTOCTL_KEEPER_RETRY_TIME_MS);
 	}
 
+	(void) config_watch_finish(&pidfileWatch);
+
 	if (pgSetup->pm_status != POSTMASTER_STATUS_UNKNOWN)
 	{
 		log_trace("pg_setup_is_ready: %s", pmStatusToString(pgSetup->pm_status));
@@ -1019,7 +1037,7 @@ pg_setup_is_ready(PostgresSetup *pgSetup, bool pgIsNotRunningIsOk)
 /*
  * pg_setup_wait_until_is_ready loops over pg_setup_is_running() and returns
  * when Postgres is ready. The loop tries every 100ms up to the given timeout,
- * given in seconds.
+ * given in seconds, or as soon as the postmaster.pid file changes.
  */
 bool
 pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
@@ -1036,12 +1054,20 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 
 	log_trace("pg_setup_wait_until_is_ready");
 
+	char pidfilePath[MAXPGPATH] = { 0 };
+	ConfigWatch pidfileWatch = { 0 };
+
+	join_path_components(pidfilePath, pgSetup->pgdata, "postmaster.pid");
+
+	(void) config_watch_init(&pidfileWatch);
+	(void) config_watch_add(&pidfileWatch, pidfilePath);
+
 	for (attempts = 1; !pgIsRunning; attempts++)
 	{
 		uint64_t now = time(NULL);
 
-		/* sleep 100 ms in between postmaster.pid probes */
-		pg_usleep(100 * 1000);
+		/* wait 100 ms in between postmaster.pid probes */
+		(void) config_watch_wait(&pidfileWatch, 100);
 
 		pgIsRunning = get_pgpid(pgSetup, postgresNotRunningIsOk) &&
 					  pgSetup->pidFile.pid > 0;
@@ -1084,6 +1110,7 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 		{
 			/* errors have already been logged */
 			log_error("pg_setup_wait_until_is_ready: pg_setup_init is false");
+			(void) config_watch_finish(&pidfileWatch);
 			return false;
 		}
 
@@ -1123,10 +1150,12 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 			break;
 		}
 
-		/* sleep 100 ms in between postmaster.pid probes */
-		pg_usleep(100 * 1000);
+		/* wait 100 ms in between postmaster.pid probes */
+		(void) config_watch_wait(&pidfileWatch, 100);
 	}
 
+	(void) config_watch_finish(&pidfileWatch);
+
 	if (!pgIsReady)
 	{
 		/* offer more diagnostic information to the user */
@@ -1151,7 +1180,7 @@ pg_setup_wait_until_is_ready(PostgresSetup *pgSetup, int timeout, int logLevel)
 /*
  * pg_setup_wait_until_is_stopped loops over pg_ctl_status() and returns when
  * Postgres is stopped. The loop tries every 100ms up to the given timeout,
- * given in seconds.
+ * given in seconds, or as soon as the postmaster.pid file is removed.
  */
 bool
 pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup, int timeout, int logLevel)
@@ -1165,6 +1194,14 @@ pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup, int timeout, int logLevel
 	bool missingPgdataIsOk = false;
 	bool postgresNotRunningIsOk = true;
 
+	char pidfilePath[MAXPGPATH] = { 0 };
+	ConfigWatch pidfileWatch = { 0 };
+
+	join_path_components(pidfilePath, pgSetup->pgdata, "postmaster.pid");
+
+	(void) config_watch_init(&pidfileWatch);
+	(void) config_watch_add(&pidfileWatch, pidfilePath);
+
 	for (attempts = 1; status != PG_CTL_STATUS_NOT_RUNNING; attempts++)
 	{
 		uint64_t now = time(NULL);
@@ -1175,6 +1212,7 @@ pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup, int timeout, int logLevel
 		 */
 		if (!get_pgpid(pgSetup, postgresNotRunningIsOk))
 		{
+			(void) config_watch_finish(&pidfileWatch);
 			return true;
 		}
 
@@ -1191,6 +1229,7 @@ pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup, int timeout, int logLevel
 
 		if (status == PG_CTL_STATUS_NOT_RUNNING)
 		{
+			(void) config_watch_finish(&pidfileWatch);
 			return true;
 		}
 
@@ -1201,9 +1240,11 @@ pg_setup_wait_until_is_stopped(PostgresSetup *pgSetup, int timeout, int logLevel
 		}
 
 		/* wait for 100 ms and try again */
-		pg_usleep(100 * 1000);
+		(void) config_watch_wait(&pidfileWatch, 100);
 	}
 
+	(void) config_watch_finish(&pidfileWatch);
+
 	/* update settings from running database */
 	if (previousPostgresPid != pgSetup->pidFile.pid)
 	{
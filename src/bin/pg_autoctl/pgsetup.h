@@ -55,6 +55,7 @@ typedef struct pg_control_data
 	uint32_t catalog_version_no;        /* see catversion.h */
 	DBState state;                      /* see enum above */
 	char latestCheckpointLSN[PG_LSN_MAXLENGTH];
+	char latestCheckpointRedoLSN[PG_LSN_MAXLENGTH];
 	uint32_t timeline_id;
 } PostgresControlData;
 
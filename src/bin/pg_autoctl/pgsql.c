@@ -6,6 +6,8 @@
  * Licensed under the PostgreSQL License.
  *
  */
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
@@ -17,7 +19,10 @@
 
 #include "cli_root.h"
 #include "defaults.h"
+#include "fsm_timings.h"
 #include "log.h"
+#include "metrics.h"
+#include "monitor_proxy.h"
 #include "parsing.h"
 #include "pgsql.h"
 #include "signals.h"
@@ -30,16 +35,72 @@
 #define ERRCODE_INVALID_OBJECT_DEFINITION "42P17"
 #define ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE "55000"
 #define ERRCODE_OBJECT_IN_USE "55006"
+#define ERRCODE_LOCK_NOT_AVAILABLE "55P03"
 #define ERRCODE_UNDEFINED_OBJECT "42704"
 
+/*
+ * Count the connections we open, per connection type, so that we can log how
+ * many connections we opened in the last minute.
+ */
+static int ConnectionsOpenedCount[PGSQL_CONN_APP + 1] = { 0 };
+static instr_time ConnectionsCountStartTime;
+
+/*
+ * When the monitor is down, all the keepers of all the formations would try
+ * and connect again at each round of their main loop, and in lockstep once
+ * the monitor is back. After a few consecutive failures, we "open" a circuit
+ * breaker and only probe the monitor at intervals computed with the same
+ * decorrelated jitter backoff as our retry policies, failing fast in between.
+ */
+typedef struct MonitorCircuitBreaker
+{
+	int failures;               /* consecutive failures to connect */
+	ConnectionRetryPolicy backoff;
+	instr_time lastAttemptTime;
+} MonitorCircuitBreaker;
+
+static MonitorCircuitBreaker MonitorBreaker = { 0 };
+
 static char * ConnectionTypeToString(ConnectionType connectionType);
 static void log_connection_error(PGconn *connection, int logLevel);
 static void pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message);
 static void pgAutoCtlDebugNoticeProcessor(void *arg, const char *message);
 static PGconn * pgsql_open_connection(PGSQL *pgsql);
+static PGconn * pgsql_connectdb(PGSQL *pgsql);
 static bool pgsql_retry_open_connection(PGSQL *pgsql);
+static bool pgsql_circuit_breaker_is_open(PGSQL *pgsql);
+static void pgsql_circuit_breaker_record(PGSQL *pgsql, bool success);
+static bool pgsql_execute_statement(PGSQL *pgsql, const char *statementName,
+									const char *sql, int paramCount,
+									const Oid *paramTypes,
+									const char **paramValues,
+									void *context,
+									ParsePostgresResultCB *parseFun);
+static bool pgsql_run_statement(PGSQL *pgsql, const char *statementName,
+								const char *sql, int paramCount,
+								const Oid *paramTypes,
+								const char **paramValues,
+								void *context,
+								ParsePostgresResultCB *parseFun);
+static void pgsql_log_parameters(int paramCount, const char **paramValues,
+								 char *debugParameters);
+static void pgsql_log_query_error(PGSQL *pgsql, PGresult *result,
+								  const char *sql, const char *debugParameters,
+								  void *context);
+#ifdef LIBPQ_HAS_PIPELINING
+static bool pgsql_pipeline_send(PGSQLPipeline *pipeline);
+#else
+static bool pgsql_pipeline_sequential(PGSQLPipeline *pipeline);
+#endif
+static bool pgsql_statement_is_prepared(PGSQL *pgsql,
+										const char *statementName);
+static void pgsql_register_prepared_statement(PGSQL *pgsql,
+											  const char *statementName);
 static bool is_response_ok(PGresult *result);
+static bool pgsql_use_monitor_proxy(PGSQL *pgsql);
 static bool clear_results(PGSQL *pgsql);
+static PGresult * pgsql_get_result_with_deadline(PGSQL *pgsql,
+												 instr_time startTime);
 static void pgsql_handle_notifications(PGSQL *pgsql);
 static bool pgsql_alter_system_set(PGSQL *pgsql, GUC setting);
 static bool pgsql_get_current_setting(PGSQL *pgsql, char *settingName,
@@ -50,6 +111,20 @@ static void parseReplicationSlotMaintain(void *ctx, PGresult *result);
 static void parsePgReachedTargetLSN(void *ctx, PGresult *result);
 static void parseIdentifySystemResult(void *ctx, PGresult *result);
 static void parseTimelineHistoryResult(void *ctx, PGresult *result);
+static void parseDrainStatsResult(void *ctx, PGresult *result);
+static void parseReplicationStatsResult(void *ctx, PGresult *result);
+static void parseReplicationSlotStatsResult(void *ctx, PGresult *result);
+static void parseSyncRepStallResult(void *ctx, PGresult *result);
+static void parseBackupStopResult(void *ctx, PGresult *result);
+
+/* see pgsql_set_keepalives, the keeper uses its timeout settings */
+TCPKeepalives pgsql_keepalives = {
+	.keepalives = POSTGRES_KEEPALIVES,
+	.idle = POSTGRES_KEEPALIVES_IDLE,
+	.interval = POSTGRES_KEEPALIVES_INTERVAL,
+	.count = POSTGRES_KEEPALIVES_COUNT,
+	.userTimeout = POSTGRES_TCP_USER_TIMEOUT
+};
 
 
 /*
@@ -141,6 +216,10 @@ pgsql_init(PGSQL *pgsql, char *url, ConnectionType connectionType)
 {
 	pgsql->connectionType = connectionType;
 	pgsql->connection = NULL;
+	pgsql->preparedStatementCount = 0;
+	pgsql->proxySocketPath[0] = '\0';
+	pgsql->statementTimeoutMs = 0;
+	pgsql->statementTimedOut = false;
 
 	/* set our default retry policy for interactive commands */
 	(void) pgsql_set_interactive_retry_policy(&(pgsql->retryPolicy));
@@ -176,8 +255,12 @@ pgsql_set_retry_policy(ConnectionRetryPolicy *retryPolicy,
 	retryPolicy->maxSleepTime = maxSleepTime;
 	retryPolicy->baseSleepTime = baseSleepTime;
 
-	/* initialize a seed for our random number generator */
-	pg_srand48(time(0));
+	/*
+	 * Initialize a seed for our random number generator. Nodes are often
+	 * started all at once, mix-in our pid so that they don't all share the
+	 * same seed and compute the same "random" sleep times.
+	 */
+	pg_srand48(time(0) ^ getpid());
 }
 
 
@@ -220,6 +303,24 @@ pgsql_set_init_retry_policy(ConnectionRetryPolicy *retryPolicy)
 }
 
 
+/*
+ * pgsql_set_keepalives sets the TCP keepalives settings that we use for all
+ * the remote connections opened from now on, including the replication
+ * connections set up in primary_conninfo. The keepalives interval and count
+ * are not exposed: a dead connection is noticed a few seconds after having
+ * been idle for the given time.
+ */
+void
+pgsql_set_keepalives(int keepalives, int idle, int userTimeout)
+{
+	pgsql_keepalives.keepalives = keepalives;
+	pgsql_keepalives.idle = idle > 0 ? idle : POSTGRES_KEEPALIVES_IDLE;
+	pgsql_keepalives.interval = POSTGRES_KEEPALIVES_INTERVAL;
+	pgsql_keepalives.count = POSTGRES_KEEPALIVES_COUNT;
+	pgsql_keepalives.userTimeout = userTimeout > 0 ? userTimeout : 0;
+}
+
+
 /*
  * pgsql_set_interactive_retry_policy sets the retry policy to 2 seconds of
  * total retrying time (or PGCONNECT_TIMEOUT when that's set), unbounded number
@@ -313,8 +414,15 @@ pgsql_compute_connection_retry_sleep_time(ConnectionRetryPolicy *retryPolicy)
 	 * work on the monitor side.
 	 */
 	int previousSleepTime = retryPolicy->sleepTime;
-	int sleepTime =
-		random_between(retryPolicy->baseSleepTime, previousSleepTime * 3);
+	int upperBound = previousSleepTime * 3;
+
+	/* on the first attempt there is no previous sleep time to start from */
+	if (upperBound < retryPolicy->baseSleepTime)
+	{
+		upperBound = retryPolicy->baseSleepTime;
+	}
+
+	int sleepTime = random_between(retryPolicy->baseSleepTime, upperBound);
 
 	retryPolicy->sleepTime = min(retryPolicy->maxSleepTime, sleepTime);
 
@@ -396,6 +504,11 @@ ConnectionTypeToString(ConnectionType connectionType)
 			return "upstream";
 		}
 
+		case PGSQL_CONN_APP:
+		{
+			return "application";
+		}
+
 		default:
 		{
 			return "unknown connection type";
@@ -505,6 +618,13 @@ pgsql_open_connection(PGSQL *pgsql)
 			  ConnectionTypeToString(pgsql->connectionType),
 			  scrubbedConnectionString);
 
+	/* fail fast while the monitor is known to be unreachable */
+	if (pgsql_circuit_breaker_is_open(pgsql))
+	{
+		pgsql->status = PG_CONNECTION_BAD;
+		return NULL;
+	}
+
 	/* we implement our own retry strategy */
 	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
 
@@ -513,7 +633,10 @@ pgsql_open_connection(PGSQL *pgsql)
 	INSTR_TIME_SET_ZERO(pgsql->retryPolicy.connectTime);
 
 	/* Make a connection to the database */
-	pgsql->connection = PQconnectdb(pgsql->connectionString);
+	pgsql->connection = pgsql_connectdb(pgsql);
+
+	/* statements prepared on a previous connection are gone now */
+	pgsql->preparedStatementCount = 0;
 
 	/* Check to see that the backend connection was successfully made */
 	if (PQstatus(pgsql->connection) != CONNECTION_OK)
@@ -535,15 +658,19 @@ pgsql_open_connection(PGSQL *pgsql)
 		{
 			INSTR_TIME_SET_CURRENT(pgsql->retryPolicy.connectTime);
 
-			(void) log_connection_error(pgsql->connection, LOG_ERROR);
-
-			log_error("Failed to connect to %s database at \"%s\", "
-					  "see above for details",
-					  ConnectionTypeToString(pgsql->connectionType),
-					  pgsql->connectionString);
+			if (log_error_ratelimit(&(pgsql->retryFailedLogs),
+									"Failed to connect to %s database at "
+									"\"%s\", see below for details",
+									ConnectionTypeToString(pgsql->connectionType),
+									pgsql->connectionString))
+			{
+				(void) log_connection_error(pgsql->connection, LOG_ERROR);
+			}
 
 			pgsql->status = PG_CONNECTION_BAD;
 
+			(void) pgsql_circuit_breaker_record(pgsql, false);
+
 			pgsql_finish(pgsql);
 			return NULL;
 		}
@@ -562,6 +689,16 @@ pgsql_open_connection(PGSQL *pgsql)
 	INSTR_TIME_SET_CURRENT(pgsql->retryPolicy.connectTime);
 	pgsql->status = PG_CONNECTION_OK;
 
+	(void) pgsql_circuit_breaker_record(pgsql, true);
+
+	/* log how many times the connection failures have been repeated */
+	(void) log_ratelimit_reset(&(pgsql->retryLogs));
+	(void) log_ratelimit_reset(&(pgsql->retryPingLogs));
+	(void) log_ratelimit_reset(&(pgsql->retryFailedLogs));
+
+	++ConnectionsOpenedCount[pgsql->connectionType];
+	(void) metrics_count_connection(pgsql->connectionType);
+
 	/* set the libpq notice receiver to integrate notifications as warnings. */
 	PQsetNoticeProcessor(pgsql->connection,
 						 &pgAutoCtlDefaultNoticeProcessor,
@@ -571,6 +708,100 @@ pgsql_open_connection(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_circuit_breaker_is_open returns true when we should not even try to
+ * connect to the monitor at this time. The circuit breaker only applies to
+ * monitor connections that don't retry, which is what the keeper main loop
+ * uses: interactive commands have their own retry policy, and a user waiting
+ * for them.
+ */
+static bool
+pgsql_circuit_breaker_is_open(PGSQL *pgsql)
+{
+	MonitorCircuitBreaker *breaker = &MonitorBreaker;
+	instr_time elapsed;
+
+	if (pgsql->connectionType != PGSQL_CONN_MONITOR ||
+		pgsql->retryPolicy.maxR != 0 ||
+		breaker->failures < MONITOR_CIRCUIT_BREAKER_THRESHOLD)
+	{
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, breaker->lastAttemptTime);
+
+	if (INSTR_TIME_GET_MILLISEC(elapsed) >= breaker->backoff.sleepTime)
+	{
+		/* time to probe the monitor again */
+		return false;
+	}
+
+	log_debug("Skipping connection to the monitor, "
+			  "next attempt in %d ms after %d failures",
+			  breaker->backoff.sleepTime -
+			  (int) INSTR_TIME_GET_MILLISEC(elapsed),
+			  breaker->failures);
+
+	return true;
+}
+
+
+/*
+ * pgsql_circuit_breaker_record registers the outcome of an attempt to connect
+ * to the monitor, and computes when to probe the monitor next when the
+ * circuit is open.
+ */
+static void
+pgsql_circuit_breaker_record(PGSQL *pgsql, bool success)
+{
+	MonitorCircuitBreaker *breaker = &MonitorBreaker;
+
+	if (pgsql->connectionType != PGSQL_CONN_MONITOR ||
+		pgsql->retryPolicy.maxR != 0)
+	{
+		return;
+	}
+
+	if (success)
+	{
+		if (breaker->failures >= MONITOR_CIRCUIT_BREAKER_THRESHOLD)
+		{
+			log_info("Connected to the monitor again after %d failed attempts",
+					 breaker->failures);
+		}
+
+		breaker->failures = 0;
+		breaker->backoff.sleepTime = 0;
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(breaker->lastAttemptTime);
+
+	if (++breaker->failures < MONITOR_CIRCUIT_BREAKER_THRESHOLD)
+	{
+		return;
+	}
+
+	if (breaker->failures == MONITOR_CIRCUIT_BREAKER_THRESHOLD)
+	{
+		(void) pgsql_set_retry_policy(&(breaker->backoff),
+									  0, /* unused */
+									  -1,
+									  MONITOR_CIRCUIT_BREAKER_CAP_SLEEP_TIME,
+									  MONITOR_CIRCUIT_BREAKER_BASE_SLEEP_TIME);
+		breaker->backoff.sleepTime = 0;
+	}
+
+	int sleepTime =
+		pgsql_compute_connection_retry_sleep_time(&(breaker->backoff));
+
+	log_warn("Failed to connect to the monitor %d times in a row, "
+			 "next attempt in %d ms",
+			 breaker->failures, sleepTime);
+}
+
+
 /*
  * Refrain from warning too often. The user certainly wants to know that we are
  * still trying to connect, though warning several times a second is not going
@@ -579,6 +810,68 @@ pgsql_open_connection(PGSQL *pgsql)
 #define SHOULD_WARN_AGAIN(duration) \
 	(INSTR_TIME_GET_MILLISEC(duration) > 30000)
 
+/*
+ * pgsql_connectdb connects to the Postgres service of the given client. For
+ * remote connections we add our keepalives settings in front of the
+ * connection string itself, which is then expanded by libpq, so that keepalives
+ * options given explicitly in a connection string take precedence.
+ *
+ * libpq ignores the keepalives settings on Unix Domain Sockets, so it's fine
+ * to set them when using the monitor-proxy service.
+ */
+static PGconn *
+pgsql_connectdb(PGSQL *pgsql)
+{
+	if (pgsql->connectionType == PGSQL_CONN_LOCAL ||
+		!pgsql_keepalives.keepalives)
+	{
+		return PQconnectdb(pgsql->connectionString);
+	}
+
+	char idle[BUFSIZE] = { 0 };
+	char interval[BUFSIZE] = { 0 };
+	char count[BUFSIZE] = { 0 };
+
+	sformat(idle, sizeof(idle), "%d", pgsql_keepalives.idle);
+	sformat(interval, sizeof(interval), "%d", pgsql_keepalives.interval);
+	sformat(count, sizeof(count), "%d", pgsql_keepalives.count);
+
+#if PG_VERSION_NUM >= 120000
+	char userTimeout[BUFSIZE] = { 0 };
+
+	/* libpq option tcp_user_timeout is in milliseconds */
+	sformat(userTimeout, sizeof(userTimeout), "%d",
+			pgsql_keepalives.userTimeout * 1000);
+#endif
+
+	const char *keywords[] = {
+		"keepalives",
+		"keepalives_idle",
+		"keepalives_interval",
+		"keepalives_count",
+#if PG_VERSION_NUM >= 120000
+		"tcp_user_timeout",
+#endif
+		"dbname",
+		NULL
+	};
+
+	const char *values[] = {
+		"1",
+		idle,
+		interval,
+		count,
+#if PG_VERSION_NUM >= 120000
+		userTimeout,
+#endif
+		pgsql->connectionString,
+		NULL
+	};
+
+	return PQconnectdbParams(keywords, values, 1);
+}
+
+
 /*
  * pgsql_retry_open_connection loops over a PQping call until the remote server
  * is ready to accept connections, and then connects to it and returns true
@@ -599,8 +892,9 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 	(void) parse_and_scrub_connection_string(pgsql->connectionString,
 											 scrubbedConnectionString);
 
-	log_warn("Failed to connect to \"%s\", retrying until "
-			 "the server is ready", scrubbedConnectionString);
+	log_warn_ratelimit(&(pgsql->retryLogs),
+					   "Failed to connect to \"%s\", retrying until "
+					   "the server is ready", scrubbedConnectionString);
 
 	/* should not happen */
 	if (pgsql->retryPolicy.maxR == 0)
@@ -620,17 +914,21 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 			INSTR_TIME_SET_CURRENT(duration);
 			INSTR_TIME_SUBTRACT(duration, pgsql->retryPolicy.startTime);
 
-			(void) log_connection_error(pgsql->connection, LOG_ERROR);
+			/* the details are only logged with the rate-limited message */
+			if (log_error_ratelimit(&(pgsql->retryFailedLogs),
+									"Failed to connect to \"%s\" "
+									"after %d attempts in %d ms, "
+									"pg_autoctl stops retrying now",
+									scrubbedConnectionString,
+									pgsql->retryPolicy.attempts,
+									(int) INSTR_TIME_GET_MILLISEC(duration)))
+			{
+				(void) log_connection_error(pgsql->connection, LOG_ERROR);
+			}
+
 			pgsql->status = PG_CONNECTION_BAD;
 			pgsql_finish(pgsql);
 
-			log_error("Failed to connect to \"%s\" "
-					  "after %d attempts in %d ms, "
-					  "pg_autoctl stops retrying now",
-					  scrubbedConnectionString,
-					  pgsql->retryPolicy.attempts,
-					  (int) INSTR_TIME_GET_MILLISEC(duration));
-
 			return false;
 		}
 
@@ -641,6 +939,8 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 		int sleep =
 			pgsql_compute_connection_retry_sleep_time(&(pgsql->retryPolicy));
 
+		(void) metrics_count_connection_retry(pgsql->connectionType);
+
 		/* we have milliseconds, pg_usleep() wants microseconds */
 		(void) pg_usleep(sleep * 1000);
 
@@ -669,7 +969,7 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 				 * PQping does not check authentication, so we might still fail
 				 * to connect to the server.
 				 */
-				pgsql->connection = PQconnectdb(pgsql->connectionString);
+				pgsql->connection = pgsql_connectdb(pgsql);
 
 				if (PQstatus(pgsql->connection) == CONNECTION_OK)
 				{
@@ -709,7 +1009,9 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 						 */
 						(void) log_connection_error(pgsql->connection, LOG_DEBUG);
 
-						log_warn("Failed to connect after successful ping");
+						log_warn_ratelimit(&(pgsql->retryPingLogs),
+										   "Failed to connect after "
+										   "successful ping");
 					}
 					pgsql_finish(pgsql);
 				}
@@ -735,7 +1037,8 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 					lastWarningMessage = PQPING_REJECT;
 					INSTR_TIME_SET_CURRENT(lastWarningTime);
 
-					log_warn(
+					log_warn_ratelimit(
+						&(pgsql->retryPingLogs),
 						"The server at \"%s\" is running but is in a state "
 						"that disallows connections (startup, shutdown, or "
 						"crash recovery).",
@@ -773,7 +1076,8 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 					lastWarningMessage = PQPING_NO_RESPONSE;
 					INSTR_TIME_SET_CURRENT(lastWarningTime);
 
-					log_warn(
+					log_warn_ratelimit(
+						&(pgsql->retryPingLogs),
 						"The server at \"%s\" could not be contacted "
 						"after %d attempts in %d ms (milliseconds). "
 						"This might indicate that the server is not running, "
@@ -986,10 +1290,93 @@ bool
 pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 						  const Oid *paramTypes, const char **paramValues,
 						  void *context, ParsePostgresResultCB *parseFun)
+{
+	return pgsql_execute_statement(pgsql, NULL, sql,
+								   paramCount, paramTypes, paramValues,
+								   context, parseFun);
+}
+
+
+/*
+ * pgsql_execute_prepared runs a given SQL command as a server-side prepared
+ * statement, so that Postgres parses and plans it only once per connection.
+ *
+ * Prepared statements only live as long as the connection, so we only use
+ * them with a PGSQL_CONNECTION_MULTI_STATEMENT connection, that is kept open
+ * between queries. Otherwise we just run the SQL command.
+ */
+bool
+pgsql_execute_prepared(PGSQL *pgsql, const char *statementName,
+					   const char *sql, int paramCount,
+					   const Oid *paramTypes, const char **paramValues,
+					   void *context, ParsePostgresResultCB *parseFun)
+{
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT)
+	{
+		return pgsql_execute_with_params(pgsql, sql,
+										 paramCount, paramTypes, paramValues,
+										 context, parseFun);
+	}
+
+	return pgsql_execute_statement(pgsql, statementName, sql,
+								   paramCount, paramTypes, paramValues,
+								   context, parseFun);
+}
+
+
+/*
+ * pgsql_execute_statement implements both pgsql_execute_with_params and
+ * pgsql_execute_prepared, and accounts for the time spent in the SQL command
+ * in the FSM transition timings, per connection type.
+ */
+static bool
+pgsql_execute_statement(PGSQL *pgsql, const char *statementName,
+						const char *sql, int paramCount,
+						const Oid *paramTypes, const char **paramValues,
+						void *context, ParsePostgresResultCB *parseFun)
+{
+	char stepName[FSM_STEP_NAME_MAXLEN] = { 0 };
+	instr_time start;
+
+	(void) fsm_timing_step_start(&start);
+
+	bool success = pgsql_run_statement(pgsql, statementName, sql,
+									   paramCount, paramTypes, paramValues,
+									   context, parseFun);
+
+	sformat(stepName, sizeof(stepName), "sql %s",
+			ConnectionTypeToString(pgsql->connectionType));
+
+	(void) fsm_timing_step_done(stepName, &start);
+
+	return success;
+}
+
+
+/*
+ * pgsql_run_statement runs the given SQL command. When statementName is not
+ * NULL, the SQL command is prepared with that name first, unless that's been
+ * done already on the current connection.
+ */
+static bool
+pgsql_run_statement(PGSQL *pgsql, const char *statementName,
+					const char *sql, int paramCount,
+					const Oid *paramTypes, const char **paramValues,
+					void *context, ParsePostgresResultCB *parseFun)
 {
 	char debugParameters[BUFSIZE] = { 0 };
 	PGresult *result = NULL;
 
+	/* when the monitor-proxy fails us, we connect to the monitor ourselves */
+	if (statementName == NULL &&
+		pgsql_use_monitor_proxy(pgsql) &&
+		monitor_proxy_execute(pgsql, sql,
+							  paramCount, paramTypes, paramValues,
+							  context, parseFun))
+	{
+		return true;
+	}
+
 	PGconn *connection = pgsql_open_connection(pgsql);
 
 	if (connection == NULL)
@@ -999,40 +1386,105 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 	log_debug("%s;", sql);
 
-	if (paramCount > 0)
+	(void) pgsql_log_parameters(paramCount, paramValues, debugParameters);
+
+	/*
+	 * With a statement timeout, the query is sent asynchronously and we wait
+	 * for its result until the deadline, so that a hung Postgres can't block
+	 * the keeper main loop.
+	 */
+	if (pgsql->statementTimeoutMs > 0)
 	{
-		int paramIndex = 0;
-		int remainingBytes = BUFSIZE;
-		char *writePointer = (char *) debugParameters;
+		instr_time startTime;
+
+		INSTR_TIME_SET_CURRENT(startTime);
+		pgsql->statementTimedOut = false;
+
+		bool sent = true;
 
-		for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
+		if (statementName != NULL &&
+			!pgsql_statement_is_prepared(pgsql, statementName))
 		{
-			int bytesWritten = 0;
-			const char *value = paramValues[paramIndex];
+			sent = PQsendPrepare(connection, statementName, sql,
+								 paramCount, paramTypes) &&
+				   (result = pgsql_get_result_with_deadline(pgsql,
+															startTime)) != NULL;
 
-			if (paramIndex > 0)
+			if (is_response_ok(result))
 			{
-				bytesWritten = sformat(writePointer, remainingBytes, ", ");
-				remainingBytes -= bytesWritten;
-				writePointer += bytesWritten;
-			}
+				PQclear(result);
+				result = NULL;
 
-			if (value == NULL)
-			{
-				bytesWritten = sformat(writePointer, remainingBytes, "NULL");
+				(void) pgsql_register_prepared_statement(pgsql, statementName);
 			}
-			else
+		}
+
+		if (!sent || result != NULL)
+		{
+			/* PQsendPrepare failed, see above */
+		}
+		else if (statementName != NULL)
+		{
+			sent = PQsendQueryPrepared(connection, statementName,
+									   paramCount, paramValues,
+									   NULL, NULL, 0);
+		}
+		else if (paramCount == 0)
+		{
+			sent = PQsendQuery(connection, sql);
+		}
+		else
+		{
+			sent = PQsendQueryParams(connection, sql,
+									 paramCount, paramTypes, paramValues,
+									 NULL, NULL, 0);
+		}
+
+		if (sent && result == NULL)
+		{
+			result = pgsql_get_result_with_deadline(pgsql, startTime);
+			sent = result != NULL;
+		}
+
+		if (!sent)
+		{
+			/* on timeout the connection is closed already */
+			if (pgsql->connection != NULL)
 			{
-				bytesWritten =
-					sformat(writePointer, remainingBytes, "'%s'", value);
+				log_error("Failed to send query to the server: %s",
+						  PQerrorMessage(connection));
+				pgsql_finish(pgsql);
 			}
-			remainingBytes -= bytesWritten;
-			writePointer += bytesWritten;
+			return false;
 		}
-		log_debug("%s", debugParameters);
 	}
+	else if (statementName != NULL &&
+			 !pgsql_statement_is_prepared(pgsql, statementName))
+	{
+		result = PQprepare(connection, statementName, sql,
+						   paramCount, paramTypes);
 
-	if (paramCount == 0)
+		/* when PQprepare fails, its result is handled as a query error */
+		if (is_response_ok(result))
+		{
+			PQclear(result);
+			result = NULL;
+
+			(void) pgsql_register_prepared_statement(pgsql, statementName);
+		}
+	}
+
+	if (result != NULL)
+	{
+		/* PQprepare failed or the result is in already, see above */
+	}
+	else if (statementName != NULL)
+	{
+		result = PQexecPrepared(connection, statementName,
+								paramCount, paramValues,
+								NULL, NULL, 0);
+	}
+	else if (paramCount == 0)
 	{
 		result = PQexec(connection, sql);
 	}
@@ -1045,58 +1497,8 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 	if (!is_response_ok(result))
 	{
-		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
-		char *message = PQerrorMessage(connection);
-		char *errorLines[BUFSIZE];
-		int lineCount = splitLines(message, errorLines, BUFSIZE);
-		int lineNumber = 0;
-
-		char *prefix =
-			pgsql->connectionType == PGSQL_CONN_MONITOR ? "Monitor" : "Postgres";
-
-		/*
-		 * PostgreSQL Error message might contain several lines. Log each of
-		 * them as a separate ERROR line here.
-		 */
-		for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
-		{
-			log_error("%s %s", prefix, errorLines[lineNumber]);
-		}
-
-		/*
-		 * The monitor uses those error codes in situations we know how to
-		 * handle, so if we have one of those, it's not a client-side error
-		 * with a badly formed SQL query etc.
-		 */
-		if (pgsql->connectionType == PGSQL_CONN_MONITOR &&
-			!(strcmp(sqlstate, ERRCODE_INVALID_OBJECT_DEFINITION) == 0 ||
-			  strcmp(sqlstate, ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE) == 0 ||
-			  strcmp(sqlstate, ERRCODE_OBJECT_IN_USE) == 0 ||
-			  strcmp(sqlstate, ERRCODE_UNDEFINED_OBJECT) == 0))
-		{
-			log_error("SQL query: %s", sql);
-			log_error("SQL params: %s", debugParameters);
-		}
-		else
-		{
-			log_debug("SQL query: %s", sql);
-			log_debug("SQL params: %s", debugParameters);
-		}
-
-		/* now stash away the SQL STATE if any */
-		if (context && sqlstate)
-		{
-			AbstractResultContext *ctx = (AbstractResultContext *) context;
-
-			strlcpy(ctx->sqlstate, sqlstate, SQLSTATE_LENGTH);
-		}
-
-		/* if we get a connection exception, track that */
-		if (sqlstate &&
-			strncmp(sqlstate, STR_ERRCODE_CLASS_CONNECTION_EXCEPTION, 2) == 0)
-		{
-			pgsql->status = PG_CONNECTION_BAD;
-		}
+		(void) pgsql_log_query_error(pgsql, result, sql, debugParameters,
+									 context);
 
 		PQclear(result);
 		clear_results(pgsql);
@@ -1132,775 +1534,2614 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 
 /*
- * is_response_ok returns whether the query result is a correct response
- * (not an error or failure).
+ * pgsql_get_result_with_deadline waits for the result of the query that has
+ * been sent on the connection, until pgsql->statementTimeoutMs have passed
+ * since the given start time. As with PQexec, when
+ * the query returns several results we keep the last one, unless an error
+ * happens first.
+ *
+ * When the deadline is reached, the query is cancelled and the connection is
+ * closed, as we can't know in which state we would leave it otherwise, and
+ * NULL is returned with pgsql->statementTimedOut set. NULL is also returned
+ * when we fail to read from the connection.
  */
-static bool
-is_response_ok(PGresult *result)
+static PGresult *
+pgsql_get_result_with_deadline(PGSQL *pgsql, instr_time startTime)
 {
-	ExecStatusType resultStatus = PQresultStatus(result);
+	PGconn *connection = pgsql->connection;
+	PGresult *lastResult = NULL;
 
-	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
-		   resultStatus == PGRES_COMMAND_OK;
-}
+	for (;;)
+	{
+		while (!PQisBusy(connection))
+		{
+			PGresult *result = PQgetResult(connection);
 
+			if (result == NULL)
+			{
+				return lastResult;
+			}
 
-/*
- * clear_results consumes results on a connection until NULL is returned.
- * If an error is returned it returns false.
- */
-static bool
-clear_results(PGSQL *pgsql)
-{
-	PGconn *connection = pgsql->connection;
+			if (lastResult != NULL)
+			{
+				/* the first error wins, as with PQexec */
+				if (!is_response_ok(lastResult))
+				{
+					PQclear(result);
+					continue;
+				}
 
-	/*
-	 * Per Postgres documentation: You should, however, remember to check
-	 * PQnotifies after each PQgetResult or PQexec, to see if any
-	 * notifications came in during the processing of the command.
-	 *
-	 * Before calling clear_results(), we called PQexecParams().
-	 */
-	(void) pgsql_handle_notifications(pgsql);
+				PQclear(lastResult);
+			}
 
-	while (true)
-	{
-		PGresult *result = PQgetResult(connection);
+			lastResult = result;
+		}
 
-		/*
-		 * Per Postgres documentation: You should, however, remember to check
-		 * PQnotifies after each PQgetResult or PQexec, to see if any
-		 * notifications came in during the processing of the command.
-		 *
-		 * Here, we just called PQgetResult().
-		 */
-		(void) pgsql_handle_notifications(pgsql);
+		instr_time elapsed;
 
-		if (result == NULL)
-		{
-			break;
-		}
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, startTime);
 
-		if (!is_response_ok(result))
+		int timeoutMs =
+			pgsql->statementTimeoutMs - (int) INSTR_TIME_GET_MILLISEC(elapsed);
+
+		if (timeoutMs <= 0)
 		{
-			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
+			log_error("Postgres did not answer within %dms, "
+					  "cancelling the query",
+					  pgsql->statementTimeoutMs);
 
-			PQclear(result);
+			PQclear(lastResult);
+
+			(void) pgsql_cancel_query(pgsql);
+
+			pgsql->statementTimedOut = true;
+			pgsql->status = PG_CONNECTION_BAD;
 			pgsql_finish(pgsql);
-			return false;
-		}
 
-		PQclear(result);
-	}
+			return NULL;
+		}
 
-	return true;
-}
+		struct pollfd pollFd = { PQsocket(connection), POLLIN, 0 };
 
+		int ready = poll(&pollFd, 1, timeoutMs);
 
-/*
- * pgsql_handle_notifications check PQnotifies when a PGSQL notificationChannel
- * has been set. Then if the parsed notification is from the
- * notificationGroupId we set notificationReceived and also log the
- * notification.
- *
- * This allow another part of the code to later know that some notifications
- * have been received.
- */
-static void
-pgsql_handle_notifications(PGSQL *pgsql)
-{
-	PGconn *connection = pgsql->connection;
-	PGnotify *notify;
+		if (ready < 0 && errno != EINTR)
+		{
+			log_error("Failed to wait for the query result: %m");
 
-	if (pgsql->notificationProcessFunction == NULL)
-	{
-		return;
-	}
+			PQclear(lastResult);
+			pgsql_finish(pgsql);
 
-	PQconsumeInput(connection);
-	while ((notify = PQnotifies(connection)) != NULL)
-	{
-		log_trace("pgsql_handle_notifications: \"%s\"", notify->extra);
+			return NULL;
+		}
 
-		if ((*pgsql->notificationProcessFunction)(pgsql->notificationGroupId,
-												  pgsql->notificationNodeId,
-												  notify->relname,
-												  notify->extra))
+		if (ready > 0 && !PQconsumeInput(connection))
 		{
-			/* mark that we received some notifications */
-			pgsql->notificationReceived = true;
-		}
+			log_error("Failed to read the query result from the server: %s",
+					  PQerrorMessage(connection));
 
-		PQfreemem(notify);
-		PQconsumeInput(connection);
+			PQclear(lastResult);
+			pgsql->status = PG_CONNECTION_BAD;
+			pgsql_finish(pgsql);
+
+			return NULL;
+		}
 	}
 }
 
 
 /*
- * pgsql_is_in_recovery connects to PostgreSQL and sets the is_in_recovery
- * boolean to the result of the SELECT pg_is_in_recovery() query. It returns
- * false when something went wrong doing that.
+ * pgsql_execute_single_row runs the given SQL command in libpq single-row
+ * mode, and calls the parse function once per row as soon as the row has been
+ * received, so that the whole result set is never held in memory.
+ *
+ * When the query fails after some rows have been received already, the parse
+ * function has been called for those rows, and we return false.
  */
 bool
-pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery)
+pgsql_execute_single_row(PGSQL *pgsql, const char *sql, int paramCount,
+						 const Oid *paramTypes, const char **paramValues,
+						 void *context, ParsePostgresResultCB *parseFun)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	char *sql = "SELECT pg_is_in_recovery()";
+	char debugParameters[BUFSIZE] = { 0 };
+	PGresult *result = NULL;
+	bool success = true;
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
+	/* the monitor-proxy sends the whole result at once */
+	if (pgsql_use_monitor_proxy(pgsql) &&
+		monitor_proxy_execute(pgsql, sql,
+							  paramCount, paramTypes, paramValues,
+							  context, parseFun))
+	{
+		return true;
+	}
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
 	{
-		/* errors have been logged already */
 		return false;
 	}
 
-	if (!context.parsedOk)
+	log_debug("%s;", sql);
+
+	(void) pgsql_log_parameters(paramCount, paramValues, debugParameters);
+
+	if (!PQsendQueryParams(connection, sql,
+						   paramCount, paramTypes, paramValues,
+						   NULL, NULL, 0))
 	{
-		log_error("Failed to get result from pg_is_in_recovery()");
+		log_error("Failed to send query to the server: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
 		return false;
 	}
 
-	*is_in_recovery = context.boolVal;
+	if (!PQsetSingleRowMode(connection))
+	{
+		log_warn("Failed to use single-row mode, fetching all the rows");
+	}
 
-	return true;
+	while ((result = PQgetResult(connection)) != NULL)
+	{
+		if (!is_response_ok(result))
+		{
+			(void) pgsql_log_query_error(pgsql, result, sql, debugParameters,
+										 context);
+			success = false;
+		}
+		else if (success && parseFun != NULL && PQntuples(result) > 0)
+		{
+			(*parseFun)(context, result);
+		}
+
+		PQclear(result);
+	}
+
+	if (!success ||
+		pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		PQfinish(pgsql->connection);
+		pgsql->connection = NULL;
+	}
+
+	return success;
 }
 
 
 /*
- * check_postgresql_settings connects to our local PostgreSQL instance and
- * verifies that our minimal viable configuration is in place by running a SQL
- * query that looks at the current settings.
+ * pgsql_use_monitor_proxy returns true when the given SQL command should be
+ * sent to the local monitor-proxy service first. That's only the case for
+ * monitor connections that have been setup to use it, and that are not
+ * holding to a session of their own.
+ */
+static bool
+pgsql_use_monitor_proxy(PGSQL *pgsql)
+{
+	return pgsql->connectionType == PGSQL_CONN_MONITOR &&
+		   pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT &&
+		   pgsql->connection == NULL &&
+		   pgsql->proxySocketPath[0] != '\0';
+}
+
+
+/*
+ * pgsql_execute_read_only runs the given SQL command in a READ ONLY
+ * transaction, that is always rolled back. The SQL command is sent using the
+ * extended query protocol, so that it's a single SQL statement.
+ *
+ * This is used by the monitor-proxy service to run SQL commands that pg_autoctl
+ * CLI commands send on its long-lived monitor session: whatever the command
+ * does to the session, such as changing a setting, is rolled back too.
  */
 bool
-pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
-								bool *settings_are_ok)
+pgsql_execute_read_only(PGSQL *pgsql, const char *sql, int paramCount,
+						const Oid *paramTypes, const char **paramValues,
+						void *context, ParsePostgresResultCB *parseFun)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	const char *sql =
-		isCitusInstanceKind ?
-		CHECK_CITUS_NODE_SETTINGS_SQL : CHECK_POSTGRESQL_NODE_SETTINGS_SQL;
+	char debugParameters[BUFSIZE] = { 0 };
+	bool success = true;
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
 	{
-		/* errors have been logged already */
 		return false;
 	}
 
-	if (!context.parsedOk)
+	log_debug("%s;", sql);
+
+	(void) pgsql_log_parameters(paramCount, paramValues, debugParameters);
+
+	PGresult *result = PQexec(connection, "BEGIN READ ONLY");
+
+	if (!is_response_ok(result))
 	{
-		/* errors have already been logged */
+		(void) pgsql_log_query_error(pgsql, result, "BEGIN READ ONLY", "",
+									 context);
+		PQclear(result);
+		pgsql_finish(pgsql);
 		return false;
 	}
 
-	*settings_are_ok = context.boolVal;
+	PQclear(result);
 
-	return true;
-}
+	result = PQexecParams(connection, sql,
+						  paramCount, paramTypes, paramValues,
+						  NULL, NULL, 0);
 
+	if (!is_response_ok(result))
+	{
+		(void) pgsql_log_query_error(pgsql, result, sql, debugParameters,
+									 context);
+		success = false;
+	}
+	else if (parseFun != NULL)
+	{
+		(*parseFun)(context, result);
+	}
 
-/*
- * pgsql_check_monitor_settings connects to the given pgsql instance to check
- * that pgautofailover is part of shared_preload_libraries.
- */
-bool
-pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok)
-{
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	const char *sql =
-		"select exists(select 1 from "
-		"unnest("
-		"string_to_array(current_setting('shared_preload_libraries'), ','))"
-		" as t(name) "
-		"where trim(name) = 'pgautofailover');";
+	PQclear(result);
+	clear_results(pgsql);
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parseSingleValueResult))
+	result = PQexec(connection, "ROLLBACK");
+
+	if (!is_response_ok(result))
 	{
-		/* errors have been logged already */
+		log_error("Failed to rollback the read-only transaction: %s",
+				  PQerrorMessage(connection));
+		PQclear(result);
+		pgsql_finish(pgsql);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	PQclear(result);
+
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT ||
+		PQstatus(connection) != CONNECTION_OK)
 	{
-		/* errors have already been logged */
-		return false;
+		pgsql_finish(pgsql);
 	}
 
-	*settings_are_ok = context.boolVal;
-
-	return true;
+	return success;
 }
 
 
 /*
- * postgres_sprintf_replicationSlotName prints the replication Slot Name to use
- * for given nodeId in the given slotName buffer of given size.
+ * pgsql_pipeline_init initializes an empty pipeline of queries to run on the
+ * given connection.
  */
-bool
-postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int size)
+void
+pgsql_pipeline_init(PGSQLPipeline *pipeline, PGSQL *pgsql)
 {
-	int bytesWritten =
-		sformat(slotName, size, "%s_%" PRId64,
-				REPLICATION_SLOT_NAME_DEFAULT,
-				nodeId);
-
-	return bytesWritten <= size;
+	pipeline->pgsql = pgsql;
+	pipeline->count = 0;
 }
 
 
 /*
- * pgsql_set_synchronous_standby_names set synchronous_standby_names on the
- * local Postgres to the value computed on the pg_auto_failover monitor.
+ * pgsql_pipeline_queue adds a query to the pipeline. The query text, the
+ * parameters and the context must remain valid until pgsql_pipeline_execute
+ * has been called.
  */
 bool
-pgsql_set_synchronous_standby_names(PGSQL *pgsql,
-									char *synchronous_standby_names)
+pgsql_pipeline_queue(PGSQLPipeline *pipeline, const char *sql, int paramCount,
+					 const Oid *paramTypes, const char **paramValues,
+					 void *context, ParsePostgresResultCB *parseFun)
 {
-	char quoted[BUFSIZE] = { 0 };
-	GUC setting = { "synchronous_standby_names", quoted };
-
-	if (sformat(quoted, BUFSIZE, "'%s'", synchronous_standby_names) >= BUFSIZE)
+	if (pipeline->count >= PGSQL_PIPELINE_MAX_QUERIES)
 	{
-		log_error("Failed to apply the synchronous_standby_names value \"%s\": "
-				  "pg_autoctl supports values up to %d bytes and this one "
-				  "requires %lu bytes",
-				  synchronous_standby_names,
-				  BUFSIZE,
-				  (unsigned long) strlen(synchronous_standby_names));
+		log_error("BUG: pg_autoctl supports up to %d queries in a pipeline",
+				  PGSQL_PIPELINE_MAX_QUERIES);
 		return false;
 	}
 
-	return pgsql_alter_system_set(pgsql, setting);
+	PGSQLPipelineQuery *query = &(pipeline->queries[pipeline->count++]);
+
+	query->sql = sql;
+	query->paramCount = paramCount;
+	query->paramTypes = paramTypes;
+	query->paramValues = paramValues;
+	query->context = context;
+	query->parseFun = parseFun;
+	query->syncAfter = false;
+	query->succeeded = false;
+
+	return true;
 }
 
 
 /*
- * pgsql_replication_slot_maintain advances the current confirmed position of
- * the given replication slot up to the given LSN position, create the
- * replication slot if it does not exists yet, and remove the slots that exist
- * in Postgres but are ommited in the given array of slots.
+ * pgsql_pipeline_sync adds a sync point after the last query queued in the
+ * pipeline: the queries that follow run in their own implicit transaction,
+ * even when a query before the sync point has failed.
  */
-typedef struct ReplicationSlotMaintainContext
+void
+pgsql_pipeline_sync(PGSQLPipeline *pipeline)
 {
-	char sqlstate[SQLSTATE_LENGTH];
-	char operation[NAMEDATALEN];
-	char slotName[BUFSIZE];
-	char lsn[PG_LSN_MAXLENGTH];
-	bool parsedOK;
-} ReplicationSlotMaintainContext;
+	if (pipeline->count > 0)
+	{
+		pipeline->queries[pipeline->count - 1].syncAfter = true;
+	}
+}
 
 
 /*
- * pgsql_replication_slot_exists checks that a replication slot with the given
- * slotName exists on the Postgres server.
+ * pgsql_pipeline_execute runs the queries of the pipeline, calling the parse
+ * function of each query that succeeds with its result. It returns true when
+ * all the queries have succeeded, and the succeeded field of each query tells
+ * which ones did.
+ *
+ * As with pgsql_execute_with_params, the connection is closed afterwards
+ * unless it's a PGSQL_CONNECTION_MULTI_STATEMENT connection.
  */
 bool
-pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
-							  bool *slotExists)
+pgsql_pipeline_execute(PGSQLPipeline *pipeline)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
-	char *sql = "SELECT 1 FROM pg_replication_slots WHERE slot_name = $1";
-	int paramCount = 1;
-	Oid paramTypes[1] = { NAMEOID };
-	const char *paramValues[1] = { slotName };
+	PGSQL *pgsql = pipeline->pgsql;
+	ConnectionStatementType statementType = pgsql->connectionStatementType;
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &fetchedRows))
+	if (pipeline->count == 0)
 	{
-		/* errors have already been logged */
-		return false;
+		return true;
 	}
 
-	if (!context.parsedOk)
+	/* the last query always ends the pipeline */
+	pipeline->queries[pipeline->count - 1].syncAfter = true;
+
+	/* keep the connection open until we're done with all the queries */
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	bool success = pgsql_pipeline_send(pipeline);
+#else
+	bool success = pgsql_pipeline_sequential(pipeline);
+#endif
+
+	if (statementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
 	{
-		log_error("Failed to check if the replication slot \"%s\" exists",
-				  slotName);
-		return false;
+		pgsql_finish(pgsql);
+	}
+	else
+	{
+		pgsql->connectionStatementType = statementType;
 	}
 
-	/* we receive 0 rows in the result when the slot does not exist yet */
-	*slotExists = context.intVal == 1;
-
-	return true;
+	return success;
 }
 
 
+#ifndef LIBPQ_HAS_PIPELINING
+
 /*
- * pgsql_create_replication_slot tries to create a replication slot on the
- * database identified by a connection string. It's implemented as CREATE IF
- * NOT EXISTS so that it's idempotent and can be retried easily.
+ * pgsql_pipeline_sequential runs the queries of the pipeline one after the
+ * other, skipping the queries that follow a failed query up to the next sync
+ * point, as Postgres would do in pipeline mode.
  */
-bool
-pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName)
+static bool
+pgsql_pipeline_sequential(PGSQLPipeline *pipeline)
 {
-	ReplicationSlotMaintainContext context = { 0 };
-	char *sql =
-		"SELECT 'create', slot_name, lsn "
-		"  FROM pg_create_physical_replication_slot($1) "
-		" WHERE NOT EXISTS "
-		" (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1)";
-	const Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { slotName };
+	bool success = true;
+	bool skipping = false;
 
-	log_trace("pgsql_create_replication_slot");
+	for (int index = 0; index < pipeline->count; index++)
+	{
+		PGSQLPipelineQuery *query = &(pipeline->queries[index]);
 
-	/*
-	 * parseReplicationSlotMaintain will log_info() the replication slot
-	 * creation if it happens. When the slot already exists we return 0 row and
-	 * remain silent about it.
-	 */
-	return pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
-									 &context, parseReplicationSlotMaintain);
+		if (!skipping)
+		{
+			query->succeeded =
+				pgsql_execute_with_params(pipeline->pgsql,
+										  query->sql,
+										  query->paramCount,
+										  query->paramTypes,
+										  query->paramValues,
+										  query->context,
+										  query->parseFun);
+
+			skipping = !query->succeeded;
+			success = success && query->succeeded;
+		}
+
+		if (query->syncAfter)
+		{
+			skipping = false;
+		}
+	}
+
+	return success;
 }
 
 
+#else
+
 /*
- * pgsql_drop_replication_slot drops a given replication slot.
+ * pgsql_pipeline_send sends all the queries of the pipeline to Postgres using
+ * the libpq pipeline mode, and then reads their results in order.
  */
-bool
-pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
+static bool
+pgsql_pipeline_send(PGSQLPipeline *pipeline)
 {
-	char *sql =
-		"SELECT pg_drop_replication_slot(slot_name) "
-		"  FROM pg_replication_slots "
-		" WHERE slot_name = $1";
-	Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { slotName };
+	PGSQL *pgsql = pipeline->pgsql;
+	bool success = true;
 
-	log_info("Drop replication slot \"%s\"", slotName);
-
-	return pgsql_execute_with_params(pgsql, sql,
-									 1, paramTypes, paramValues, NULL, NULL);
-}
+	PGconn *connection = pgsql_open_connection(pgsql);
 
+	if (connection == NULL)
+	{
+		return false;
+	}
 
-/*
- * BuildNodesArrayValues build the SQL expression to use in a FROM clause to
- * represent the list of other standby nodes from the given nodeArray.
- *
- * Such a list looks either like:
- *
- *   VALUES($1, $2::pg_lsn), ($3, $4)
- *
- * or for an empty set (e.g. when we're the only standby):
- *
- *   SELECT id, lsn
- *     FROM (values (null::int, null::pg_lsn)) as t(id, lsn)
- *    WHERE false
- *
- * We actually need to provide an empty set (0 rows) with columns of the
- * expected data types so that we can join against the existing replication
- * slots and drop them. If the set is empty, we drop all the slots.
- *
- * We return how many parameters we filled in paramTypes and paramValues from
- * the nodeArray.
- */
-#define NODEID_MAX_LENGTH 20    /* should allow for bigint digits */
+	if (!PQenterPipelineMode(connection))
+	{
+		log_error("Failed to enter pipeline mode: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
 
-typedef struct nodesArraysValuesParams
-{
-	int count;
-	Oid types[NODE_ARRAY_MAX_COUNT * 2];
-	char *values[NODE_ARRAY_MAX_COUNT * 2];
+	for (int index = 0; index < pipeline->count; index++)
+	{
+		PGSQLPipelineQuery *query = &(pipeline->queries[index]);
 
-	/*
-	 * Pre-allocate arrays for the data separately from the values array, which
-	 * needs to be a (const char **) thing rather than a (char [][]) thing,
-	 * because of the pgsql_execute_with_params and libpq APIs.
-	 */
-	char nodeIds[NODE_ARRAY_MAX_COUNT][NODEID_MAX_LENGTH];
-	char lsns[NODE_ARRAY_MAX_COUNT][PG_LSN_MAXLENGTH];
-} nodesArraysValuesParams;
+		log_debug("%s;", query->sql);
 
+		if (!PQsendQueryParams(connection, query->sql,
+							   query->paramCount,
+							   query->paramTypes,
+							   query->paramValues,
+							   NULL, NULL, 0))
+		{
+			log_error("Failed to send query to Postgres: %s",
+					  PQerrorMessage(connection));
+			pgsql_finish(pgsql);
+			return false;
+		}
 
-static bool
-BuildNodesArrayValues(NodeAddressArray *nodeArray,
-					  nodesArraysValuesParams *sqlParams,
-					  char *values, int size)
-{
-	char buffer[BUFSIZE] = { 0 };
-	int nodeIndex = 0;
-	int paramIndex = 0;
-	int valuesIndex = 0;
+		if (query->syncAfter && !PQpipelineSync(connection))
+		{
+			log_error("Failed to send query to Postgres: %s",
+					  PQerrorMessage(connection));
+			pgsql_finish(pgsql);
+			return false;
+		}
+	}
 
 	/*
-	 * Build a SQL VALUES statement for every other node registered in the
-	 * system, so that we can maintain their LSN position locally on a standby
-	 * server.
+	 * Now read the results: each query returns its result followed by a NULL
+	 * result, and each sync point returns a PGRES_PIPELINE_SYNC result.
 	 */
-	for (nodeIndex = 0; nodeIndex < nodeArray->count; nodeIndex++)
+	for (int index = 0; index < pipeline->count; index++)
 	{
-		NodeAddress *node = &(nodeArray->nodes[nodeIndex]);
-		char *nodeIdString = intToString(node->nodeId).strValue;
+		PGSQLPipelineQuery *query = &(pipeline->queries[index]);
+		PGresult *result = PQgetResult(connection);
 
-		int idParamIndex = paramIndex;
-		int lsnParamIndex = paramIndex + 1;
+		(void) pgsql_handle_notifications(pgsql);
 
-		sqlParams->types[idParamIndex] = INT8OID;
-		strlcpy(sqlParams->nodeIds[nodeIndex], nodeIdString, NODEID_MAX_LENGTH);
+		if (PQresultStatus(result) == PGRES_PIPELINE_ABORTED)
+		{
+			log_debug("Skipped query because of a previous error: %s",
+					  query->sql);
+			success = false;
+		}
+		else if (!is_response_ok(result))
+		{
+			char debugParameters[BUFSIZE] = { 0 };
 
-		/* store the (char *) pointer to the data in values */
-		sqlParams->values[idParamIndex] = sqlParams->nodeIds[nodeIndex];
+			(void) pgsql_log_parameters(query->paramCount,
+										query->paramValues,
+										debugParameters);
 
-		sqlParams->types[lsnParamIndex] = LSNOID;
-		strlcpy(sqlParams->lsns[nodeIndex], node->lsn, PG_LSN_MAXLENGTH);
+			(void) pgsql_log_query_error(pgsql, result, query->sql,
+										 debugParameters, query->context);
+			success = false;
+		}
+		else
+		{
+			if (query->parseFun != NULL)
+			{
+				(*query->parseFun)(query->context, result);
+			}
+			query->succeeded = true;
+		}
 
-		/* store the (char *) pointer to the data in values */
-		sqlParams->values[lsnParamIndex] = sqlParams->lsns[nodeIndex];
+		PQclear(result);
 
-		valuesIndex += sformat(buffer + valuesIndex, BUFSIZE - valuesIndex,
-							   "%s($%d, $%d%s)",
-							   valuesIndex == 0 ? "" : ",",
+		/* consume the NULL result that ends this query's results */
+		while ((result = PQgetResult(connection)) != NULL)
+		{
+			PQclear(result);
+		}
 
-		                       /* we begin at $1 here: intentional off-by-one */
-							   idParamIndex + 1, lsnParamIndex + 1,
+		if (query->syncAfter)
+		{
+			result = PQgetResult(connection);
 
-		                       /* cast only the first row */
-							   valuesIndex == 0 ? "::pg_lsn" : "");
+			if (PQresultStatus(result) != PGRES_PIPELINE_SYNC)
+			{
+				log_error("Failed to read pipeline results from Postgres: %s",
+						  PQerrorMessage(connection));
+				PQclear(result);
+				pgsql_finish(pgsql);
+				return false;
+			}
 
-		if (valuesIndex > BUFSIZE)
-		{
-			/* shouldn't happen because we only support up to 12 nodes */
-			log_error("Failed to prepare the SQL query for "
-					  "pgsql_replication_slot_maintain");
-			return false;
+			PQclear(result);
 		}
+	}
 
-		/* prepare next round */
-		paramIndex += 2;
+	if (!PQexitPipelineMode(connection))
+	{
+		log_error("Failed to exit pipeline mode: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
 	}
 
-	/* count how many parameters where appended to the VALUES() parts */
-	sqlParams->count = paramIndex;
+	return success;
+}
 
-	/* when we didn't find any node to process, return our empty set */
-	if (paramIndex == 0)
+
+#endif
+
+
+/*
+ * pgsql_log_parameters formats the given query parameters in the buffer, of
+ * size BUFSIZE, and logs them at the DEBUG level.
+ */
+static void
+pgsql_log_parameters(int paramCount, const char **paramValues,
+					 char *debugParameters)
+{
+	int paramIndex = 0;
+	int remainingBytes = BUFSIZE;
+	char *writePointer = debugParameters;
+
+	if (paramCount == 0)
 	{
-		/* we know it fits, size is BUFSIZE or more */
-		sformat(values, size,
-				"SELECT id, lsn "
-				"FROM (values (null::int, null::pg_lsn)) as t(id, lsn) "
-				"where false");
+		return;
 	}
-	else
+
+	for (paramIndex = 0; paramIndex < paramCount; paramIndex++)
 	{
-		int bytes = sformat(values, size, "values %s", buffer);
+		int bytesWritten = 0;
+		const char *value = paramValues[paramIndex];
 
-		if (bytes > size)
+		if (paramIndex > 0)
 		{
-			/* shouldn't happen because we only support up to 12 nodes */
-			log_error("Failed to prepare the SQL query for "
-					  "pgsql_replication_slot_maintain");
-			return false;
+			bytesWritten = sformat(writePointer, remainingBytes, ", ");
+			remainingBytes -= bytesWritten;
+			writePointer += bytesWritten;
 		}
-	}
 
-	return true;
+		if (value == NULL)
+		{
+			bytesWritten = sformat(writePointer, remainingBytes, "NULL");
+		}
+		else
+		{
+			bytesWritten =
+				sformat(writePointer, remainingBytes, "'%s'", value);
+		}
+		remainingBytes -= bytesWritten;
+		writePointer += bytesWritten;
+	}
+	log_debug("%s", debugParameters);
 }
 
 
 /*
- * pgsql_replication_slot_create_and_drop drops replication slots that belong
- * to nodes that have been removed, and creates replication slots for nodes
- * that have been newly registered. We call that function on the primary, where
- * the slots are maintained by the replication protocol.
- *
- * On the standby nodes, we advance the slots ourselves and use the other
- * function pgsql_replication_slot_maintain which is complete (create, drop,
- * advance).
+ * pgsql_log_query_error logs the error message of a failed query, stashes
+ * away its SQL STATE in the given context, and tracks connection errors.
  */
-bool
-pgsql_replication_slot_create_and_drop(PGSQL *pgsql, NodeAddressArray *nodeArray)
+static void
+pgsql_log_query_error(PGSQL *pgsql, PGresult *result,
+					  const char *sql, const char *debugParameters,
+					  void *context)
 {
-	char sql[2 * BUFSIZE] = { 0 };
-	char values[BUFSIZE] = { 0 };
-
-	/* *INDENT-OFF* */
-	char *sqlTemplate =
-		/*
-		 * We could simplify the writing of this query, but we prefer that it
-		 * looks as much as possible like the query used in
-		 * pgsql_replication_slot_maintain() so that we can maintain both
-		 * easily.
-		 */
-		"WITH nodes(slot_name, lsn) as ("
-		" SELECT '" REPLICATION_SLOT_NAME_DEFAULT "_' || id, lsn"
-		"   FROM (%s) as sb(id, lsn) "
-		"), \n"
-		"dropped as ("
-		" SELECT slot_name, pg_drop_replication_slot(slot_name) "
-		"   FROM pg_replication_slots pgrs LEFT JOIN nodes USING(slot_name) "
-		"  WHERE nodes.slot_name IS NULL "
-		"    AND (   slot_name ~ '" REPLICATION_SLOT_NAME_PATTERN "' "
-		"         OR slot_name ~ '" REPLICATION_SLOT_NAME_DEFAULT "' )"
-		"    AND not active"
-		"    AND slot_type = 'physical'"
-		"), \n"
-		"created as ("
-		"SELECT c.slot_name, c.lsn "
-		"  FROM nodes LEFT JOIN pg_replication_slots pgrs USING(slot_name), "
-		"       LATERAL pg_create_physical_replication_slot(slot_name, true) c"
-		" WHERE pgrs.slot_name IS NULL "
-		") \n"
-		"SELECT 'create', slot_name, lsn FROM created "
-		" union all "
-		"SELECT 'drop', slot_name, NULL::pg_lsn FROM dropped";
-	/* *INDENT-ON* */
+	char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+	char *message = PQerrorMessage(pgsql->connection);
+	char *errorLines[BUFSIZE];
+	int lineCount = splitLines(message, errorLines, BUFSIZE);
+	int lineNumber = 0;
 
-	nodesArraysValuesParams sqlParams = { 0 };
-	ReplicationSlotMaintainContext context = { 0 };
+	char *prefix =
+		pgsql->connectionType == PGSQL_CONN_MONITOR ? "Monitor" : "Postgres";
 
-	if (!BuildNodesArrayValues(nodeArray, &sqlParams, values, BUFSIZE))
+	/*
+	 * PostgreSQL Error message might contain several lines. Log each of
+	 * them as a separate ERROR line here.
+	 */
+	for (lineNumber = 0; lineNumber < lineCount; lineNumber++)
 	{
-		/* errors have already been logged */
-		return false;
+		log_error("%s %s", prefix, errorLines[lineNumber]);
 	}
 
-	/* add the computed ($1,$2), ... string to the query "template" */
-	int bytes = sformat(sql, 2 * BUFSIZE, sqlTemplate, values);
-
-	if (bytes > 2 * BUFSIZE)
+	/*
+	 * The monitor uses those error codes in situations we know how to
+	 * handle, so if we have one of those, it's not a client-side error
+	 * with a badly formed SQL query etc.
+	 */
+	if (pgsql->connectionType == PGSQL_CONN_MONITOR &&
+		!(strcmp(sqlstate, ERRCODE_INVALID_OBJECT_DEFINITION) == 0 ||
+		  strcmp(sqlstate, ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE) == 0 ||
+		  strcmp(sqlstate, ERRCODE_OBJECT_IN_USE) == 0 ||
+		  strcmp(sqlstate, ERRCODE_UNDEFINED_OBJECT) == 0))
+	{
+		log_error("SQL query: %s", sql);
+		log_error("SQL params: %s", debugParameters);
+	}
+	else
+	{
+		log_debug("SQL query: %s", sql);
+		log_debug("SQL params: %s", debugParameters);
+	}
+
+	/* now stash away the SQL STATE if any */
+	if (context && sqlstate)
+	{
+		AbstractResultContext *ctx = (AbstractResultContext *) context;
+
+		strlcpy(ctx->sqlstate, sqlstate, SQLSTATE_LENGTH);
+	}
+
+	/* if we get a connection exception, track that */
+	if (sqlstate &&
+		strncmp(sqlstate, STR_ERRCODE_CLASS_CONNECTION_EXCEPTION, 2) == 0)
+	{
+		pgsql->status = PG_CONNECTION_BAD;
+	}
+}
+
+
+/*
+ * pgsql_statement_is_prepared returns true when the given statement has been
+ * prepared already on the current connection.
+ */
+static bool
+pgsql_statement_is_prepared(PGSQL *pgsql, const char *statementName)
+{
+	for (int index = 0; index < pgsql->preparedStatementCount; index++)
+	{
+		if (strcmp(pgsql->preparedStatements[index], statementName) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * pgsql_register_prepared_statement registers that the given statement has
+ * been prepared on the current connection.
+ */
+static void
+pgsql_register_prepared_statement(PGSQL *pgsql, const char *statementName)
+{
+	if (pgsql->preparedStatementCount >= PGSQL_MAX_PREPARED_STATEMENTS)
+	{
+		log_error("BUG: pg_autoctl supports up to %d prepared statements "
+				  "per connection", PGSQL_MAX_PREPARED_STATEMENTS);
+		return;
+	}
+
+	strlcpy(pgsql->preparedStatements[pgsql->preparedStatementCount++],
+			statementName,
+			NAMEDATALEN);
+}
+
+
+/*
+ * pgsql_log_connections_per_minute logs at the DEBUG level how many
+ * connections we opened in the last minute, and then resets the counters.
+ * It is meant to be called from a main loop, and only logs something once a
+ * minute.
+ */
+void
+pgsql_log_connections_per_minute()
+{
+	instr_time duration;
+
+	if (INSTR_TIME_IS_ZERO(ConnectionsCountStartTime))
+	{
+		INSTR_TIME_SET_CURRENT(ConnectionsCountStartTime);
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, ConnectionsCountStartTime);
+
+	if (INSTR_TIME_GET_MILLISEC(duration) < 60 * 1000)
+	{
+		return;
+	}
+
+	log_debug("Opened %d connections to the local Postgres and %d "
+			  "connections to the monitor in the last %ds",
+			  ConnectionsOpenedCount[PGSQL_CONN_LOCAL],
+			  ConnectionsOpenedCount[PGSQL_CONN_MONITOR],
+			  (int) INSTR_TIME_GET_DOUBLE(duration));
+
+	for (int index = 0; index <= PGSQL_CONN_APP; index++)
+	{
+		ConnectionsOpenedCount[index] = 0;
+	}
+
+	INSTR_TIME_SET_CURRENT(ConnectionsCountStartTime);
+}
+
+
+/*
+ * is_response_ok returns whether the query result is a correct response
+ * (not an error or failure).
+ */
+static bool
+is_response_ok(PGresult *result)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+
+	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
+		   resultStatus == PGRES_COMMAND_OK;
+}
+
+
+/*
+ * clear_results consumes results on a connection until NULL is returned.
+ * If an error is returned it returns false.
+ */
+static bool
+clear_results(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
+
+	/*
+	 * Per Postgres documentation: You should, however, remember to check
+	 * PQnotifies after each PQgetResult or PQexec, to see if any
+	 * notifications came in during the processing of the command.
+	 *
+	 * Before calling clear_results(), we called PQexecParams().
+	 */
+	(void) pgsql_handle_notifications(pgsql);
+
+	while (true)
+	{
+		PGresult *result = PQgetResult(connection);
+
+		/*
+		 * Per Postgres documentation: You should, however, remember to check
+		 * PQnotifies after each PQgetResult or PQexec, to see if any
+		 * notifications came in during the processing of the command.
+		 *
+		 * Here, we just called PQgetResult().
+		 */
+		(void) pgsql_handle_notifications(pgsql);
+
+		if (result == NULL)
+		{
+			break;
+		}
+
+		if (!is_response_ok(result))
+		{
+			log_error("Failure from Postgres: %s", PQerrorMessage(connection));
+
+			PQclear(result);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
+		PQclear(result);
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_handle_notifications check PQnotifies when a PGSQL notificationChannel
+ * has been set. Then if the parsed notification is from the
+ * notificationGroupId we set notificationReceived and also log the
+ * notification.
+ *
+ * This allow another part of the code to later know that some notifications
+ * have been received.
+ */
+static void
+pgsql_handle_notifications(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
+	PGnotify *notify;
+
+	if (pgsql->notificationProcessFunction == NULL)
+	{
+		return;
+	}
+
+	PQconsumeInput(connection);
+	while ((notify = PQnotifies(connection)) != NULL)
+	{
+		log_trace("pgsql_handle_notifications: \"%s\"", notify->extra);
+
+		if ((*pgsql->notificationProcessFunction)(pgsql->notificationGroupId,
+												  pgsql->notificationNodeId,
+												  notify->relname,
+												  notify->extra))
+		{
+			/* mark that we received some notifications */
+			pgsql->notificationReceived = true;
+		}
+
+		PQfreemem(notify);
+		PQconsumeInput(connection);
+	}
+}
+
+
+/*
+ * pgsql_send_with_params sends a SQL command to the server and returns
+ * without waiting for its result, that is then fetched with
+ * pgsql_fetch_async_result. The connection must be a
+ * PGSQL_CONNECTION_MULTI_STATEMENT connection, as it needs to be kept open
+ * until the result has been fetched.
+ */
+bool
+pgsql_send_with_params(PGSQL *pgsql, const char *sql, int paramCount,
+					   const Oid *paramTypes, const char **paramValues)
+{
+	char debugParameters[BUFSIZE] = { 0 };
+
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT)
+	{
+		log_error("BUG: pgsql_send_with_params requires a multi-statement "
+				  "connection");
+		return false;
+	}
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	log_debug("%s;", sql);
+
+	(void) pgsql_log_parameters(paramCount, paramValues, debugParameters);
+
+	if (!PQsendQueryParams(connection, sql,
+						   paramCount, paramTypes, paramValues,
+						   NULL, NULL, 0))
+	{
+		log_error("Failed to send query to the server: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_fetch_async_result checks whether the result of the SQL command sent
+ * with pgsql_send_with_params is available, without blocking. When it is,
+ * done is set to true and the parse function is called with the result.
+ */
+bool
+pgsql_fetch_async_result(PGSQL *pgsql, bool *done,
+						 void *context, ParsePostgresResultCB *parseFun)
+{
+	PGconn *connection = pgsql->connection;
+	PGresult *result = NULL;
+	bool success = true;
+
+	*done = false;
+
+	if (connection == NULL)
+	{
+		log_error("BUG: pgsql_fetch_async_result called without a connection");
+		*done = true;
+		return false;
+	}
+
+	if (!PQconsumeInput(connection))
+	{
+		log_error("Failed to read the query result from the server: %s",
+				  PQerrorMessage(connection));
+		pgsql->status = PG_CONNECTION_BAD;
+		*done = true;
+		return false;
+	}
+
+	if (PQisBusy(connection))
+	{
+		return true;
+	}
+
+	*done = true;
+
+	while ((result = PQgetResult(connection)) != NULL)
+	{
+		if (!is_response_ok(result))
+		{
+			(void) pgsql_log_query_error(pgsql, result,
+										 "(asynchronous query)", "",
+										 context);
+			success = false;
+		}
+		else if (parseFun != NULL)
+		{
+			(*parseFun)(context, result);
+		}
+
+		PQclear(result);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_cancel_query asks the server to cancel the SQL command that is
+ * currently running on the connection, if any.
+ */
+void
+pgsql_cancel_query(PGSQL *pgsql)
+{
+	char errbuf[BUFSIZE] = { 0 };
+
+	if (pgsql->connection == NULL)
+	{
+		return;
+	}
+
+	PGcancel *cancel = PQgetCancel(pgsql->connection);
+
+	if (cancel == NULL)
+	{
+		return;
+	}
+
+	if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+	{
+		log_warn("Failed to cancel query: %s", errbuf);
+	}
+
+	PQfreeCancel(cancel);
+}
+
+
+/*
+ * pgsql_is_in_recovery connects to PostgreSQL and sets the is_in_recovery
+ * boolean to the result of the SELECT pg_is_in_recovery() query. It returns
+ * false when something went wrong doing that.
+ */
+bool
+pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT pg_is_in_recovery()";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_is_in_recovery()");
+		return false;
+	}
+
+	*is_in_recovery = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_standby_settings_can_reload sets canReload to true when the local
+ * Postgres instance is a standby that follows the latest timeline without any
+ * recovery target. Those are the recovery settings that we install for
+ * streaming replication, and starting with Postgres 13 the only other ones,
+ * primary_conninfo and primary_slot_name, can be changed with a reload.
+ */
+bool
+pgsql_standby_settings_can_reload(PGSQL *pgsql, bool *canReload)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql =
+		"SELECT pg_is_in_recovery() "
+		"   AND current_setting('recovery_target_timeline') = 'latest' "
+		"   AND current_setting('recovery_target_lsn') = ''";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from current recovery settings");
+		return false;
+	}
+
+	*canReload = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_has_wal_receiver sets hasWalReceiver to true when the local Postgres
+ * instance has a WAL receiver process running.
+ */
+bool
+pgsql_has_wal_receiver(PGSQL *pgsql, bool *hasWalReceiver)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql =
+		"SELECT exists(SELECT 1 FROM pg_stat_wal_receiver WHERE pid IS NOT NULL)";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from pg_stat_wal_receiver");
+		return false;
+	}
+
+	*hasWalReceiver = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_get_replay_lsn copies the result of pg_last_wal_replay_lsn() on the
+ * local standby node to replayLSN, which must be PG_LSN_MAXLENGTH long.
+ */
+bool
+pgsql_get_replay_lsn(PGSQL *pgsql, char *replayLSN)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	char *sql = "SELECT pg_last_wal_replay_lsn()";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk || context.strVal == NULL)
+	{
+		log_error("Failed to get result from pg_last_wal_replay_lsn()");
+		return false;
+	}
+
+	strlcpy(replayLSN, context.strVal, PG_LSN_MAXLENGTH);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * check_postgresql_settings connects to our local PostgreSQL instance and
+ * verifies that our minimal viable configuration is in place by running a SQL
+ * query that looks at the current settings.
+ */
+bool
+pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
+								bool *settings_are_ok)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	const char *sql =
+		isCitusInstanceKind ?
+		CHECK_CITUS_NODE_SETTINGS_SQL : CHECK_POSTGRESQL_NODE_SETTINGS_SQL;
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*settings_are_ok = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_check_monitor_settings connects to the given pgsql instance to check
+ * that pgautofailover is part of shared_preload_libraries.
+ */
+bool
+pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	const char *sql =
+		"select exists(select 1 from "
+		"unnest("
+		"string_to_array(current_setting('shared_preload_libraries'), ','))"
+		" as t(name) "
+		"where trim(name) = 'pgautofailover');";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have been logged already */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*settings_are_ok = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * postgres_sprintf_replicationSlotName prints the replication Slot Name to use
+ * for given nodeId in the given slotName buffer of given size.
+ */
+bool
+postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int size)
+{
+	int bytesWritten =
+		sformat(slotName, size, "%s_%" PRId64,
+				REPLICATION_SLOT_NAME_DEFAULT,
+				nodeId);
+
+	return bytesWritten <= size;
+}
+
+
+/*
+ * pgsql_set_synchronous_standby_names set synchronous_standby_names on the
+ * local Postgres to the value computed on the pg_auto_failover monitor.
+ */
+bool
+pgsql_set_synchronous_standby_names(PGSQL *pgsql,
+									char *synchronous_standby_names)
+{
+	char quoted[BUFSIZE] = { 0 };
+	GUC setting = { "synchronous_standby_names", quoted };
+
+	if (sformat(quoted, BUFSIZE, "'%s'", synchronous_standby_names) >= BUFSIZE)
+	{
+		log_error("Failed to apply the synchronous_standby_names value \"%s\": "
+				  "pg_autoctl supports values up to %d bytes and this one "
+				  "requires %lu bytes",
+				  synchronous_standby_names,
+				  BUFSIZE,
+				  (unsigned long) strlen(synchronous_standby_names));
+		return false;
+	}
+
+	return pgsql_alter_system_set(pgsql, setting);
+}
+
+
+/*
+ * pgsql_replication_slot_maintain advances the current confirmed position of
+ * the given replication slot up to the given LSN position, create the
+ * replication slot if it does not exists yet, and remove the slots that exist
+ * in Postgres but are ommited in the given array of slots.
+ */
+typedef struct ReplicationSlotMaintainContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	char operation[NAMEDATALEN];
+	char slotName[BUFSIZE];
+	char lsn[PG_LSN_MAXLENGTH];
+	int createdCount;
+	int droppedCount;
+	int advancedCount;
+	int skippedCount;
+	bool parsedOK;
+} ReplicationSlotMaintainContext;
+
+
+/*
+ * pgsql_replication_slot_exists checks that a replication slot with the given
+ * slotName exists on the Postgres server.
+ */
+bool
+pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
+							  bool *slotExists)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT 1 FROM pg_replication_slots WHERE slot_name = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { NAMEOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &fetchedRows))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to check if the replication slot \"%s\" exists",
+				  slotName);
+		return false;
+	}
+
+	/* we receive 0 rows in the result when the slot does not exist yet */
+	*slotExists = context.intVal == 1;
+
+	return true;
+}
+
+
+/*
+ * pgsql_create_replication_slot tries to create a replication slot on the
+ * database identified by a connection string. It's implemented as CREATE IF
+ * NOT EXISTS so that it's idempotent and can be retried easily.
+ */
+bool
+pgsql_create_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	ReplicationSlotMaintainContext context = { 0 };
+	char *sql =
+		"SELECT 'create', slot_name, lsn "
+		"  FROM pg_create_physical_replication_slot($1) "
+		" WHERE NOT EXISTS "
+		" (SELECT 1 FROM pg_replication_slots WHERE slot_name = $1)";
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	log_trace("pgsql_create_replication_slot");
+
+	/*
+	 * parseReplicationSlotMaintain will log_info() the replication slot
+	 * creation if it happens. When the slot already exists we return 0 row and
+	 * remain silent about it.
+	 */
+	return pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+									 &context, parseReplicationSlotMaintain);
+}
+
+
+/*
+ * pgsql_drop_replication_slot drops a given replication slot.
+ */
+bool
+pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	char *sql =
+		"SELECT pg_drop_replication_slot(slot_name) "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name = $1";
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	log_info("Drop replication slot \"%s\"", slotName);
+
+	return pgsql_execute_with_params(pgsql, sql,
+									 1, paramTypes, paramValues, NULL, NULL);
+}
+
+
+/*
+ * BuildNodesArrayValues build the SQL expression to use in a FROM clause to
+ * represent the list of other standby nodes from the given nodeArray.
+ *
+ * Such a list looks either like:
+ *
+ *   VALUES($1, $2::pg_lsn), ($3, $4)
+ *
+ * or for an empty set (e.g. when we're the only standby):
+ *
+ *   SELECT id, lsn
+ *     FROM (values (null::int, null::pg_lsn)) as t(id, lsn)
+ *    WHERE false
+ *
+ * We actually need to provide an empty set (0 rows) with columns of the
+ * expected data types so that we can join against the existing replication
+ * slots and drop them. If the set is empty, we drop all the slots.
+ *
+ * We return how many parameters we filled in paramTypes and paramValues from
+ * the nodeArray.
+ */
+#define NODEID_MAX_LENGTH 20    /* should allow for bigint digits */
+
+typedef struct nodesArraysValuesParams
+{
+	int count;
+	Oid types[NODE_ARRAY_MAX_COUNT * 2];
+	char *values[NODE_ARRAY_MAX_COUNT * 2];
+
+	/*
+	 * Pre-allocate arrays for the data separately from the values array, which
+	 * needs to be a (const char **) thing rather than a (char [][]) thing,
+	 * because of the pgsql_execute_with_params and libpq APIs.
+	 */
+	char nodeIds[NODE_ARRAY_MAX_COUNT][NODEID_MAX_LENGTH];
+	char lsns[NODE_ARRAY_MAX_COUNT][PG_LSN_MAXLENGTH];
+} nodesArraysValuesParams;
+
+
+static bool
+BuildNodesArrayValues(NodeAddressArray *nodeArray,
+					  nodesArraysValuesParams *sqlParams,
+					  char *values, int size)
+{
+	char buffer[BUFSIZE] = { 0 };
+	int nodeIndex = 0;
+	int paramIndex = 0;
+	int valuesIndex = 0;
+
+	/*
+	 * Build a SQL VALUES statement for every other node registered in the
+	 * system, so that we can maintain their LSN position locally on a standby
+	 * server.
+	 */
+	for (nodeIndex = 0; nodeIndex < nodeArray->count; nodeIndex++)
+	{
+		NodeAddress *node = &(nodeArray->nodes[nodeIndex]);
+		char *nodeIdString = intToString(node->nodeId).strValue;
+
+		int idParamIndex = paramIndex;
+		int lsnParamIndex = paramIndex + 1;
+
+		sqlParams->types[idParamIndex] = INT8OID;
+		strlcpy(sqlParams->nodeIds[nodeIndex], nodeIdString, NODEID_MAX_LENGTH);
+
+		/* store the (char *) pointer to the data in values */
+		sqlParams->values[idParamIndex] = sqlParams->nodeIds[nodeIndex];
+
+		sqlParams->types[lsnParamIndex] = LSNOID;
+		strlcpy(sqlParams->lsns[nodeIndex], node->lsn, PG_LSN_MAXLENGTH);
+
+		/* store the (char *) pointer to the data in values */
+		sqlParams->values[lsnParamIndex] = sqlParams->lsns[nodeIndex];
+
+		valuesIndex += sformat(buffer + valuesIndex, BUFSIZE - valuesIndex,
+							   "%s($%d, $%d%s)",
+							   valuesIndex == 0 ? "" : ",",
+
+		                       /* we begin at $1 here: intentional off-by-one */
+							   idParamIndex + 1, lsnParamIndex + 1,
+
+		                       /* cast only the first row */
+							   valuesIndex == 0 ? "::pg_lsn" : "");
+
+		if (valuesIndex > BUFSIZE)
+		{
+			/* shouldn't happen because we only support up to 12 nodes */
+			log_error("Failed to prepare the SQL query for "
+					  "pgsql_replication_slot_maintain");
+			return false;
+		}
+
+		/* prepare next round */
+		paramIndex += 2;
+	}
+
+	/* count how many parameters where appended to the VALUES() parts */
+	sqlParams->count = paramIndex;
+
+	/* when we didn't find any node to process, return our empty set */
+	if (paramIndex == 0)
+	{
+		/* we know it fits, size is BUFSIZE or more */
+		sformat(values, size,
+				"SELECT id, lsn "
+				"FROM (values (null::int, null::pg_lsn)) as t(id, lsn) "
+				"where false");
+	}
+	else
+	{
+		int bytes = sformat(values, size, "values %s", buffer);
+
+		if (bytes > size)
+		{
+			/* shouldn't happen because we only support up to 12 nodes */
+			log_error("Failed to prepare the SQL query for "
+					  "pgsql_replication_slot_maintain");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * BuildSlotAdvanceQuery builds the "advanced" and "skipped" parts of the
+ * replication slots maintenance queries. Advancing a slot costs a write and
+ * takes locks in Postgres, so we skip the slots that are behind their target
+ * LSN by less than advanceThreshold bytes: they only keep that much more WAL
+ * around until the next round, and advance as soon as the node moves on.
+ */
+static bool
+BuildSlotAdvanceQuery(int advanceThreshold, char *query, int size)
+{
+	/* *INDENT-OFF* */
+	char *advanceTemplate =
+		"candidates as ("
+		"SELECT slot_name, nodes.lsn, "
+		"       nodes.lsn - s.restart_lsn >= %d as advance"
+		"  FROM pg_replication_slots s JOIN nodes USING(slot_name) "
+		" WHERE not s.active "
+		"   AND nodes.lsn <> '0/0' and nodes.lsn > s.restart_lsn "
+		"), \n"
+		"advanced as ("
+		"SELECT a.slot_name, a.end_lsn"
+		"  FROM candidates c, "
+		"       LATERAL pg_replication_slot_advance(c.slot_name, c.lsn) a"
+		" WHERE c.advance "
+		"), \n"
+		"skipped as ("
+		"SELECT slot_name, lsn FROM candidates WHERE not advance"
+		"), \n";
+	/* *INDENT-ON* */
+
+	int bytes = sformat(query, size, advanceTemplate,
+						advanceThreshold > 0 ? advanceThreshold : 0);
+
+	return bytes < size;
+}
+
+
+/*
+ * pgsql_replication_slot_execute runs one of our replication slots
+ * maintenance queries, and accounts for how long it took and what it did.
+ */
+static bool
+pgsql_replication_slot_execute(PGSQL *pgsql, const char *sql,
+							   nodesArraysValuesParams *sqlParams)
+{
+	ReplicationSlotMaintainContext context = { 0 };
+	instr_time startTime;
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql,
+								  sqlParams->count,
+								  sqlParams->types,
+								  (const char **) sqlParams->values,
+								  &context,
+								  parseReplicationSlotMaintain);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	(void) metrics_record_slot_maintenance(success && context.parsedOK,
+										   INSTR_TIME_GET_DOUBLE(duration),
+										   context.advancedCount,
+										   context.skippedCount);
+
+	if (success && context.parsedOK)
+	{
+		log_debug("Maintained replication slots in %.3f ms: "
+				  "%d created, %d dropped, %d advanced, %d skipped",
+				  INSTR_TIME_GET_MILLISEC(duration),
+				  context.createdCount,
+				  context.droppedCount,
+				  context.advancedCount,
+				  context.skippedCount);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_replication_slot_create_and_drop drops replication slots that belong
+ * to nodes that have been removed, and creates replication slots for nodes
+ * that have been newly registered. We call that function on the primary, where
+ * the slots are maintained by the replication protocol.
+ *
+ * On the standby nodes, we advance the slots ourselves and use the other
+ * function pgsql_replication_slot_maintain which is complete (create, drop,
+ * advance). When advanceInactiveSlots is true, we also advance the slots
+ * that no standby node is streaming from here, see BuildSlotAdvanceQuery for
+ * the advanceThreshold.
+ */
+bool
+pgsql_replication_slot_create_and_drop(PGSQL *pgsql, NodeAddressArray *nodeArray,
+									   bool advanceInactiveSlots,
+									   int advanceThreshold)
+{
+	char sql[2 * BUFSIZE] = { 0 };
+	char values[BUFSIZE] = { 0 };
+
+	/* *INDENT-OFF* */
+	char *sqlTemplate =
+		/*
+		 * We could simplify the writing of this query, but we prefer that it
+		 * looks as much as possible like the query used in
+		 * pgsql_replication_slot_maintain() so that we can maintain both
+		 * easily.
+		 */
+		"WITH nodes(slot_name, lsn) as ("
+		" SELECT '" REPLICATION_SLOT_NAME_DEFAULT "_' || id, lsn"
+		"   FROM (%s) as sb(id, lsn) "
+		"), \n"
+		"dropped as ("
+		" SELECT slot_name, pg_drop_replication_slot(slot_name) "
+		"   FROM pg_replication_slots pgrs LEFT JOIN nodes USING(slot_name) "
+		"  WHERE nodes.slot_name IS NULL "
+		"    AND (   slot_name ~ '" REPLICATION_SLOT_NAME_PATTERN "' "
+		"         OR slot_name ~ '" REPLICATION_SLOT_NAME_DEFAULT "' )"
+		"    AND not active"
+		"    AND slot_type = 'physical'"
+		"), \n"
+		"%s"
+		"created as ("
+		"SELECT c.slot_name, c.lsn "
+		"  FROM nodes LEFT JOIN pg_replication_slots pgrs USING(slot_name), "
+		"       LATERAL pg_create_physical_replication_slot(slot_name, true) c"
+		" WHERE pgrs.slot_name IS NULL "
+		") \n"
+		"SELECT 'create', slot_name, lsn FROM created "
+		" union all "
+		"SELECT 'drop', slot_name, NULL::pg_lsn FROM dropped"
+		"%s";
+
+	char *advanceUnion =
+		" union all "
+		"SELECT 'advance', slot_name, end_lsn FROM advanced "
+		" union all "
+		"SELECT 'skip', slot_name, lsn FROM skipped";
+	/* *INDENT-ON* */
+
+	nodesArraysValuesParams sqlParams = { 0 };
+	char advance[BUFSIZE] = { 0 };
+
+	if (!BuildNodesArrayValues(nodeArray, &sqlParams, values, BUFSIZE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (advanceInactiveSlots)
+	{
+		(void) BuildSlotAdvanceQuery(advanceThreshold, advance, BUFSIZE);
+	}
+
+	/* add the computed ($1,$2), ... string to the query "template" */
+	int bytes = sformat(sql, 2 * BUFSIZE, sqlTemplate, values,
+						advance,
+						advanceInactiveSlots ? advanceUnion : "");
+
+	if (bytes > 2 * BUFSIZE)
+	{
+		/* shouldn't happen because we only support up to 12 nodes */
+		log_error("Failed to prepare the SQL query for "
+				  "pgsql_replication_slot_maintain");
+		return false;
+	}
+
+	return pgsql_replication_slot_execute(pgsql, sql, &sqlParams);
+}
+
+
+/*
+ * pgsql_replication_slot_maintain creates, drops, and advance replication
+ * slots that belong to other standby nodes. We call that function on the
+ * standby nodes, where the slots are maintained manually just in case we need
+ * them at failover.
+ */
+bool
+pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray,
+								int advanceThreshold)
+{
+	char sql[2 * BUFSIZE] = { 0 };
+	char values[BUFSIZE] = { 0 };
+
+	/* *INDENT-OFF* */
+	char *sqlTemplate =
+		"WITH nodes(slot_name, lsn) as ("
+		" SELECT '" REPLICATION_SLOT_NAME_DEFAULT "_' || id, lsn"
+		"   FROM (%s) as sb(id, lsn) "
+		"), \n"
+		"dropped as ("
+		" SELECT slot_name, pg_drop_replication_slot(slot_name) "
+		"   FROM pg_replication_slots pgrs LEFT JOIN nodes USING(slot_name) "
+		"  WHERE nodes.slot_name IS NULL "
+		"    AND slot_name ~ '" REPLICATION_SLOT_NAME_PATTERN "' "
+		"    AND not active"
+		"    AND slot_type = 'physical'"
+		"), \n"
+		"%s"
+		"created as ("
+		"SELECT c.slot_name, c.lsn "
+		"  FROM nodes LEFT JOIN pg_replication_slots pgrs USING(slot_name), "
+		"       LATERAL pg_create_physical_replication_slot(slot_name, true) c"
+		" WHERE pgrs.slot_name IS NULL "
+		") \n"
+		"SELECT 'create', slot_name, lsn FROM created "
+		" union all "
+		"SELECT 'drop', slot_name, NULL::pg_lsn FROM dropped "
+		" union all "
+		"SELECT 'advance', slot_name, end_lsn FROM advanced "
+		" union all "
+		"SELECT 'skip', slot_name, lsn FROM skipped ";
+	/* *INDENT-ON* */
+
+	nodesArraysValuesParams sqlParams = { 0 };
+	char advance[BUFSIZE] = { 0 };
+
+	if (!BuildNodesArrayValues(nodeArray, &sqlParams, values, BUFSIZE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) BuildSlotAdvanceQuery(advanceThreshold, advance, BUFSIZE);
+
+	/* add the computed ($1,$2), ... string to the query "template" */
+	int bytes = sformat(sql, 2 * BUFSIZE, sqlTemplate, values, advance);
+
+	if (bytes > 2 * BUFSIZE)
+	{
+		/* shouldn't happen because we only support up to 12 nodes */
+		log_error("Failed to prepare the SQL query for "
+				  "pgsql_replication_slot_maintain");
+		return false;
+	}
+
+	return pgsql_replication_slot_execute(pgsql, sql, &sqlParams);
+}
+
+
+/*
+ * parseReplicationSlotMaintain parses the result from a PostgreSQL query
+ * fetching two columns from pg_stat_replication: sync_state and currentLSN.
+ */
+static void
+parseReplicationSlotMaintain(void *ctx, PGresult *result)
+{
+	int rowNumber = 0;
+	ReplicationSlotMaintainContext *context =
+		(ReplicationSlotMaintainContext *) ctx;
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOK = false;
+		return;
+	}
+
+	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	{
+		/* operation and slotName can't be NULL given how the SQL is built */
+		char *operation = PQgetvalue(result, rowNumber, 0);
+		char *slotName = PQgetvalue(result, rowNumber, 1);
+		char *lsn = PQgetisnull(result, rowNumber, 2) ? ""
+					: PQgetvalue(result, rowNumber, 2);
+
+		/* adding or removing another standby node is worthy of a log line */
+		if (strcmp(operation, "create") == 0)
+		{
+			++context->createdCount;
+			log_info("Creating replication slot \"%s\"", slotName);
+		}
+		else if (strcmp(operation, "drop") == 0)
+		{
+			++context->droppedCount;
+			log_info("Dropping replication slot \"%s\"", slotName);
+		}
+		else
+		{
+			if (strcmp(operation, "advance") == 0)
+			{
+				++context->advancedCount;
+			}
+			else if (strcmp(operation, "skip") == 0)
+			{
+				++context->skippedCount;
+			}
+
+			log_debug("parseReplicationSlotMaintain: %s %s %s",
+					  operation, slotName, lsn);
+		}
+	}
+
+	context->parsedOK = true;
+}
+
+
+/*
+ * pgsql_disable_synchronous_replication disables synchronous replication
+ * in Postgres such that writes do not block if there is no replica.
+ */
+bool
+pgsql_disable_synchronous_replication(PGSQL *pgsql)
+{
+	PGSQLPipeline pipeline = { 0 };
+	char *alterSystemCommand =
+		"ALTER SYSTEM SET synchronous_standby_names TO ''";
+	char *reloadCommand = "SELECT pg_reload_conf()";
+	char *cancelBlockedStatementsCommand =
+		"SELECT pg_cancel_backend(pid) "
+		"  FROM pg_stat_activity "
+		" WHERE wait_event = 'SyncRep'";
+
+	log_info("Disabling synchronous replication");
+
+	/*
+	 * Send the three commands at once. ALTER SYSTEM cannot run inside a
+	 * transaction block, so it needs a sync point of its own.
+	 */
+	(void) pgsql_pipeline_init(&pipeline, pgsql);
+
+	if (!pgsql_pipeline_queue(&pipeline, alterSystemCommand,
+							  0, NULL, NULL, NULL, NULL))
+	{
+		return false;
+	}
+
+	(void) pgsql_pipeline_sync(&pipeline);
+
+	if (!pgsql_pipeline_queue(&pipeline, reloadCommand,
+							  0, NULL, NULL, NULL, NULL) ||
+		!pgsql_pipeline_queue(&pipeline, cancelBlockedStatementsCommand,
+							  0, NULL, NULL, NULL, NULL))
+	{
+		return false;
+	}
+
+	if (!pgsql_pipeline_execute(&pipeline))
+	{
+		if (!pipeline.queries[0].succeeded)
+		{
+			log_error("Failed to set \"synchronous_standby_names\" to \"''\" "
+					  "with ALTER SYSTEM, see above for details");
+		}
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_set_default_transaction_mode_read_only makes it so that the server
+ * won't be a target of a connection string requiring target_session_attrs
+ * read-write by issuing ALTER SYSTEM SET transaction_mode_read_only TO on;
+ *
+ */
+bool
+pgsql_set_default_transaction_mode_read_only(PGSQL *pgsql)
+{
+	GUC setting = { "default_transaction_read_only", "'on'" };
+
+	log_info("Setting default_transaction_read_only to on");
+
+	return pgsql_alter_system_set(pgsql, setting);
+}
+
+
+/*
+ * pgsql_set_default_transaction_mode_read_write makes it so that the server
+ * can be a target of a connection string requiring target_session_attrs
+ * read-write by issuing ALTER SYSTEM SET transaction_mode_read_only TO off;
+ *
+ */
+bool
+pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql)
+{
+	GUC setting = { "default_transaction_read_only", "'off'" };
+
+	log_info("Setting default_transaction_read_only to off");
+
+	return pgsql_alter_system_set(pgsql, setting);
+}
+
+
+/*
+ * pgsql_get_default_transaction_read_only sets readOnly to the current value
+ * of the default_transaction_read_only setting.
+ */
+bool
+pgsql_get_default_transaction_read_only(PGSQL *pgsql, bool *readOnly)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql = "SELECT current_setting('default_transaction_read_only')::bool";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from "
+				  "current_setting('default_transaction_read_only')");
+		return false;
+	}
+
+	*readOnly = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_fence_commits sets synchronous_standby_names to a standby name that
+ * no node uses, so that every commit then waits for a standby that never
+ * comes. The transactions that commit meanwhile are written locally, but
+ * remain invisible to the other sessions for as long as they wait.
+ */
+bool
+pgsql_fence_commits(PGSQL *pgsql)
+{
+	return pgsql_set_synchronous_standby_names(pgsql,
+											   PG_AUTOCTL_FENCE_STANDBY_NAME);
+}
+
+
+/*
+ * pgsql_get_commits_fenced sets fenced to true when the current value of
+ * synchronous_standby_names is the one set by pgsql_fence_commits. As the
+ * session reloads its configuration before running each query, this is also
+ * how we know that a reload of the fence has been processed.
+ */
+bool
+pgsql_get_commits_fenced(PGSQL *pgsql, bool *fenced)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	char *sql =
+		"SELECT current_setting('synchronous_standby_names') = $1";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { PG_AUTOCTL_FENCE_STANDBY_NAME };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get result from "
+				  "current_setting('synchronous_standby_names')");
+		return false;
+	}
+
+	*fenced = context.boolVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_terminate_running_sessions terminates the client sessions that are
+ * running a statement, and sets count to how many sessions were terminated.
+ *
+ * A session reloads its configuration before running each statement, so a
+ * statement that was already running when we changed the configuration may
+ * still commit with the previous settings. The sessions that wait for a
+ * synchronous standby are left alone: terminating them would make their
+ * commit visible.
+ */
+bool
+pgsql_terminate_running_sessions(PGSQL *pgsql, int *count)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+
+	char *sql =
+		"SELECT count(pg_terminate_backend(pid))::int "
+		"  FROM pg_stat_activity "
+		" WHERE pid <> pg_backend_pid() "
+		"   AND backend_type = 'client backend' "
+		"   AND state IN ('active', 'fastpath function call') "
+		"   AND wait_event IS DISTINCT FROM 'SyncRep'";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to terminate the running sessions");
+		return false;
+	}
+
+	*count = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * pgsql_checkpoint runs a CHECKPOINT command on postgres to trigger a checkpoint.
+ */
+bool
+pgsql_checkpoint(PGSQL *pgsql)
+{
+	/* a CHECKPOINT is expected to take its time, don't cancel it */
+	int statementTimeoutMs = pgsql->statementTimeoutMs;
+
+	pgsql->statementTimeoutMs = 0;
+
+	bool success = pgsql_execute(pgsql, "CHECKPOINT");
+
+	pgsql->statementTimeoutMs = statementTimeoutMs;
+
+	return success;
+}
+
+
+/*
+ * pgsql_alter_system_set runs an ALTER SYSTEM SET ... command on Postgres
+ * to globally set a GUC and then runs pg_reload_conf() to make existing
+ * sessions reload it.
+ */
+static bool
+pgsql_alter_system_set(PGSQL *pgsql, GUC setting)
+{
+	PGSQLPipeline pipeline = { 0 };
+	char command[BUFSIZE];
+	char *reloadCommand = "SELECT pg_reload_conf()";
+
+	sformat(command, sizeof(command),
+			"ALTER SYSTEM SET %s TO %s", setting.name, setting.value);
+
+	/* ALTER SYSTEM cannot run inside a transaction block */
+	(void) pgsql_pipeline_init(&pipeline, pgsql);
+
+	if (!pgsql_pipeline_queue(&pipeline, command, 0, NULL, NULL, NULL, NULL))
 	{
-		/* shouldn't happen because we only support up to 12 nodes */
-		log_error("Failed to prepare the SQL query for "
-				  "pgsql_replication_slot_maintain");
 		return false;
 	}
 
-	return pgsql_execute_with_params(pgsql, sql,
-									 sqlParams.count,
-									 sqlParams.types,
-									 (const char **) sqlParams.values,
-									 &context,
-									 parseReplicationSlotMaintain);
+	(void) pgsql_pipeline_sync(&pipeline);
+
+	if (!pgsql_pipeline_queue(&pipeline, reloadCommand,
+							  0, NULL, NULL, NULL, NULL))
+	{
+		return false;
+	}
+
+	log_info("Reloading Postgres configuration and HBA rules");
+
+	(void) pgsql_pipeline_execute(&pipeline);
+
+	if (!pipeline.queries[0].succeeded)
+	{
+		log_error("Failed to set \"%s\" to \"%s\" with ALTER SYSTEM, "
+				  "see above for details",
+				  setting.name, setting.value);
+		return false;
+	}
+
+	if (!pipeline.queries[1].succeeded)
+	{
+		log_error("Failed to reload Postgres config after ALTER SYSTEM "
+				  "to set \"%s\" to \"%s\".",
+				  setting.name, setting.value);
+		return false;
+	}
+
+	return true;
 }
 
 
 /*
- * pgsql_replication_slot_maintain creates, drops, and advance replication
- * slots that belong to other standby nodes. We call that function on the
- * standby nodes, where the slots are maintained manually just in case we need
- * them at failover.
+ * pgsql_reset_primary_conninfo issues the following SQL commands:
+ *
+ *   ALTER SYSTEM RESET primary_conninfo;
+ *   ALTER SYSTEM RESET primary_slot_name;
+ *
+ * That's necessary to clean-up the replication settings that pg_basebackup
+ * puts in place in postgresql.auto.conf in Postgres 12. We don't reload the
+ * configuration after the RESET in that case, because Postgres 12 requires a
+ * restart to apply the new setting value anyway.
  */
 bool
-pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray)
+pgsql_reset_primary_conninfo(PGSQL *pgsql)
 {
-	char sql[2 * BUFSIZE] = { 0 };
-	char values[BUFSIZE] = { 0 };
+	PGSQLPipeline pipeline = { 0 };
+	char *reset_primary_conninfo = "ALTER SYSTEM RESET primary_conninfo";
+	char *reset_primary_slot_name = "ALTER SYSTEM RESET primary_slot_name";
+
+	/* ALTER SYSTEM cannot run inside a transaction block */
+	(void) pgsql_pipeline_init(&pipeline, pgsql);
+
+	if (!pgsql_pipeline_queue(&pipeline, reset_primary_conninfo,
+							  0, NULL, NULL, NULL, NULL))
+	{
+		return false;
+	}
+
+	(void) pgsql_pipeline_sync(&pipeline);
+
+	if (!pgsql_pipeline_queue(&pipeline, reset_primary_slot_name,
+							  0, NULL, NULL, NULL, NULL))
+	{
+		return false;
+	}
+
+	return pgsql_pipeline_execute(&pipeline);
+}
+
+
+/*
+ * pgsql_get_restart_settings copies to restartSettingNames the list of the
+ * given comma separated settings that can only be changed with a restart of
+ * Postgres: either their context is postmaster, or Postgres already knows
+ * that a new value is pending a restart. Settings that Postgres doesn't know
+ * about are skipped.
+ */
+bool
+pgsql_get_restart_settings(PGSQL *pgsql, const char *settingNames,
+						   char *restartSettingNames, size_t size)
+{
+	SingleValueResultContext context = { 0 };
+	char *sql =
+		"SELECT coalesce(string_agg(name, ', ' ORDER BY name), '') "
+		"  FROM pg_settings "
+		" WHERE name = ANY(string_to_array($1, ',')) "
+		"   AND (context = 'postmaster' OR pending_restart)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { settingNames };
+
+	context.resultType = PGSQL_RESULT_STRING;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk || context.strVal == NULL)
+	{
+		log_error("Failed to get the context of settings \"%s\"", settingNames);
+		return false;
+	}
+
+	strlcpy(restartSettingNames, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * pgsql_backup_start starts a non-exclusive base backup on the server, with
+ * an immediate checkpoint. The backup must be stopped using the same
+ * connection, so the caller must use PGSQL_CONNECTION_MULTI_STATEMENT.
+ */
+bool
+pgsql_backup_start(PGSQL *pgsql, const char *label)
+{
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { label };
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		/* error message was logged in pgsql_open_connection */
+		return false;
+	}
+
+	/* Postgres 15 renamed pg_start_backup() and removed exclusive backups */
+	char *sql =
+		PQserverVersion(connection) >= 150000
+		? "SELECT pg_backup_start($1, true)"
+		: "SELECT pg_start_backup($1, true, false)";
+
+	/* the immediate checkpoint takes its time, don't cancel it */
+	int statementTimeoutMs = pgsql->statementTimeoutMs;
+
+	pgsql->statementTimeoutMs = 0;
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								  NULL, NULL);
+
+	pgsql->statementTimeoutMs = statementTimeoutMs;
+
+	return success;
+}
+
+
+/*
+ * BackupStopContext is used to parse the result of pg_backup_stop().
+ */
+typedef struct BackupStopContext
+{
+	char sqlstate[6];
+	char *labelFile;
+	char *tablespaceMap;
+	bool parsedOk;
+} BackupStopContext;
+
+
+/*
+ * pgsql_backup_stop stops the base backup started with pgsql_backup_start,
+ * without waiting for the WAL to be archived, and gets the contents of the
+ * backup_label and tablespace_map files. Those are malloc'ed strings that
+ * the caller must free.
+ */
+bool
+pgsql_backup_stop(PGSQL *pgsql, char **labelFile, char **tablespaceMap)
+{
+	BackupStopContext context = { { 0 }, NULL, NULL, false };
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		/* error message was logged in pgsql_open_connection */
+		return false;
+	}
+
+	char *sql =
+		PQserverVersion(connection) >= 150000
+		? "SELECT labelfile, spcmapfile FROM pg_backup_stop(false)"
+		: "SELECT labelfile, spcmapfile FROM pg_stop_backup(false, false)";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseBackupStopResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the result of pg_backup_stop()");
+		free(context.labelFile);
+		free(context.tablespaceMap);
+		return false;
+	}
+
+	*labelFile = context.labelFile;
+	*tablespaceMap = context.tablespaceMap;
+
+	return true;
+}
+
+
+/*
+ * parseBackupStopResult parses the result of the query in pgsql_backup_stop.
+ */
+static void
+parseBackupStopResult(void *ctx, PGresult *result)
+{
+	BackupStopContext *context = (BackupStopContext *) ctx;
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	context->labelFile = strdup(PQgetvalue(result, 0, 0));
+	context->tablespaceMap =
+		PQgetisnull(result, 0, 1) ? strdup("") : strdup(PQgetvalue(result, 0, 1));
+
+	context->parsedOk = context->labelFile != NULL &&
+						context->tablespaceMap != NULL;
+}
+
+
+/*
+ * pgsql_reload_conf causes open sessions to reload the PostgreSQL configuration
+ * files.
+ */
+bool
+pgsql_reload_conf(PGSQL *pgsql)
+{
+	char *sql = "SELECT pg_reload_conf()";
+
+	log_info("Reloading Postgres configuration and HBA rules");
+
+	return pgsql_execute(pgsql, sql);
+}
+
+
+/*
+ * pgsql_get_hba_file_path gets the value of the hba_file setting in
+ * Postgres or returns false if a failure occurred. The value is copied to
+ * the hbaFilePath pointer.
+ */
+bool
+pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength)
+{
+	char *configValue = NULL;
+
+	if (!pgsql_get_current_setting(pgsql, "hba_file", &configValue))
+	{
+		/* pgsql_get_current_setting logs a relevant error */
+		return false;
+	}
+
+	int hbaFilePathLength = strlcpy(hbaFilePath, configValue, maxPathLength);
+
+	if (hbaFilePathLength >= maxPathLength)
+	{
+		log_error("The hba_file \"%s\" returned by postgres is %d characters, "
+				  "the maximum supported by pg_autoctl is %d characters",
+				  configValue, hbaFilePathLength, maxPathLength);
+		free(configValue);
+		return false;
+	}
+
+	free(configValue);
+
+	return true;
+}
 
-	/* *INDENT-OFF* */
-	char *sqlTemplate =
-		"WITH nodes(slot_name, lsn) as ("
-		" SELECT '" REPLICATION_SLOT_NAME_DEFAULT "_' || id, lsn"
-		"   FROM (%s) as sb(id, lsn) "
-		"), \n"
-		"dropped as ("
-		" SELECT slot_name, pg_drop_replication_slot(slot_name) "
-		"   FROM pg_replication_slots pgrs LEFT JOIN nodes USING(slot_name) "
-		"  WHERE nodes.slot_name IS NULL "
-		"    AND slot_name ~ '" REPLICATION_SLOT_NAME_PATTERN "' "
-		"    AND not active"
-		"    AND slot_type = 'physical'"
-		"), \n"
-		"advanced as ("
-		"SELECT a.slot_name, a.end_lsn"
-		"  FROM pg_replication_slots s JOIN nodes USING(slot_name), "
-		"       LATERAL pg_replication_slot_advance(slot_name, lsn) a"
-		" WHERE nodes.lsn <> '0/0' and nodes.lsn >= s.restart_lsn "
-		"), \n"
-		"created as ("
-		"SELECT c.slot_name, c.lsn "
-		"  FROM nodes LEFT JOIN pg_replication_slots pgrs USING(slot_name), "
-		"       LATERAL pg_create_physical_replication_slot(slot_name, true) c"
-		" WHERE pgrs.slot_name IS NULL "
-		") \n"
-		"SELECT 'create', slot_name, lsn FROM created "
-		" union all "
-		"SELECT 'drop', slot_name, NULL::pg_lsn FROM dropped "
-		" union all "
-		"SELECT 'advance', slot_name, end_lsn FROM advanced ";
-	/* *INDENT-ON* */
 
-	nodesArraysValuesParams sqlParams = { 0 };
-	ReplicationSlotMaintainContext context = { 0 };
+/*
+ * pgsql_get_current_setting gets the value of a GUC in Postgres by running
+ * SELECT current_setting($settingName), or returns false if a failure occurred.
+ *
+ * If getting the value was successful, currentValue will point to a copy of the
+ * value which should be freed by the caller.
+ */
+static bool
+pgsql_get_current_setting(PGSQL *pgsql, char *settingName, char **currentValue)
+{
+	SingleValueResultContext context = { 0 };
+	char *sql = "SELECT current_setting($1)";
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { settingName };
 
-	if (!BuildNodesArrayValues(nodeArray, &sqlParams, values, BUFSIZE))
+	context.resultType = PGSQL_RESULT_STRING;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	/* add the computed ($1,$2), ... string to the query "template" */
-	int bytes = sformat(sql, 2 * BUFSIZE, sqlTemplate, values);
-
-	if (bytes > 2 * BUFSIZE)
+	if (!context.parsedOk)
 	{
-		/* shouldn't happen because we only support up to 12 nodes */
-		log_error("Failed to prepare the SQL query for "
-				  "pgsql_replication_slot_maintain");
+		log_error("Failed to get result from current_setting('%s')", settingName);
 		return false;
 	}
 
-	return pgsql_execute_with_params(pgsql, sql,
-									 sqlParams.count,
-									 sqlParams.types,
-									 (const char **) sqlParams.values,
-									 &context,
-									 parseReplicationSlotMaintain);
+	*currentValue = context.strVal;
+
+	return true;
 }
 
 
 /*
- * parseReplicationSlotMaintain parses the result from a PostgreSQL query
- * fetching two columns from pg_stat_replication: sync_state and currentLSN.
+ * pgsql_create_database issues a CREATE DATABASE statement.
  */
-static void
-parseReplicationSlotMaintain(void *ctx, PGresult *result)
+bool
+pgsql_create_database(PGSQL *pgsql, const char *dbname, const char *owner)
 {
-	int rowNumber = 0;
-	ReplicationSlotMaintainContext *context =
-		(ReplicationSlotMaintainContext *) ctx;
+	char command[BUFSIZE];
+	char *escapedDBName, *escapedOwner;
 
-	if (PQnfields(result) != 3)
+	/* open a connection upfront since it is needed by PQescape functions */
+	PGconn *connection = pgsql_open_connection(pgsql);
+	if (connection == NULL)
 	{
-		log_error("Query returned %d columns, expected 3", PQnfields(result));
-		context->parsedOK = false;
-		return;
+		/* error message was logged in pgsql_open_connection */
+		return false;
 	}
 
-	for (rowNumber = 0; rowNumber < PQntuples(result); rowNumber++)
+	/* escape the dbname */
+	escapedDBName = PQescapeIdentifier(connection, dbname, strlen(dbname));
+	if (escapedDBName == NULL)
 	{
-		/* operation and slotName can't be NULL given how the SQL is built */
-		char *operation = PQgetvalue(result, rowNumber, 0);
-		char *slotName = PQgetvalue(result, rowNumber, 1);
-		char *lsn = PQgetisnull(result, rowNumber, 2) ? ""
-					: PQgetvalue(result, rowNumber, 2);
+		log_error("Failed to create database \"%s\": %s", dbname,
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
 
-		/* adding or removing another standby node is worthy of a log line */
-		if (strcmp(operation, "create") == 0)
-		{
-			log_info("Creating replication slot \"%s\"", slotName);
-		}
-		else if (strcmp(operation, "drop") == 0)
+	/* escape the username */
+	escapedOwner = PQescapeIdentifier(connection, owner, strlen(owner));
+	if (escapedOwner == NULL)
+	{
+		log_error("Failed to create database \"%s\": %s", dbname,
+				  PQerrorMessage(connection));
+		PQfreemem(escapedDBName);
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	/* now build the SQL command */
+	sformat(command, BUFSIZE,
+			"CREATE DATABASE %s WITH OWNER %s",
+			escapedDBName,
+			escapedOwner);
+
+	log_debug("Running command on Postgres: %s;", command);
+
+	PQfreemem(escapedDBName);
+	PQfreemem(escapedOwner);
+
+	PGresult *result = PQexec(connection, command);
+
+	if (!is_response_ok(result))
+	{
+		/*
+		 * Check if we have a duplicate_database (42P04) error, in which case
+		 * it means the user has already been created, accept that as a
+		 * non-error, only inform about the situation.
+		 */
+		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+
+		if (strcmp(sqlstate, ERRCODE_DUPLICATE_DATABASE) == 0)
 		{
-			log_info("Dropping replication slot \"%s\"", slotName);
+			log_info("The database \"%s\" already exists, skipping.", dbname);
 		}
 		else
 		{
-			log_debug("parseReplicationSlotMaintain: %s %s %s",
-					  operation, slotName, lsn);
+			log_error("Failed to create database \"%s\"[%s]: %s",
+					  dbname, sqlstate, PQerrorMessage(connection));
+			PQclear(result);
+			clear_results(pgsql);
+			pgsql_finish(pgsql);
+			return false;
 		}
 	}
 
-	context->parsedOK = true;
+	PQclear(result);
+	clear_results(pgsql);
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		pgsql_finish(pgsql);
+	}
+
+	return true;
 }
 
 
 /*
- * pgsql_disable_synchronous_replication disables synchronous replication
- * in Postgres such that writes do not block if there is no replica.
+ * pgsql_create_extension issues a CREATE EXTENSION statement.
  */
 bool
-pgsql_disable_synchronous_replication(PGSQL *pgsql)
+pgsql_create_extension(PGSQL *pgsql, const char *name)
 {
-	GUC setting = { "synchronous_standby_names", "''" };
-	char *cancelBlockedStatementsCommand =
-		"SELECT pg_cancel_backend(pid) "
-		"  FROM pg_stat_activity "
-		" WHERE wait_event = 'SyncRep'";
+	char command[BUFSIZE];
 
-	log_info("Disabling synchronous replication");
+	/* open a connection upfront since it is needed by PQescape functions */
+	PGconn *connection = pgsql_open_connection(pgsql);
+	if (connection == NULL)
+	{
+		/* error message was logged in pgsql_open_connection */
+		return false;
+	}
 
-	if (!pgsql_alter_system_set(pgsql, setting))
+	/* escape the dbname */
+	char *escapedIdentifier = PQescapeIdentifier(connection, name, strlen(name));
+	if (escapedIdentifier == NULL)
 	{
+		log_error("Failed to create extension \"%s\": %s", name,
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
 		return false;
 	}
 
-	log_debug("Unblocking commands waiting for synchronous replication");
+	/* now build the SQL command */
+	sformat(command, BUFSIZE, "CREATE EXTENSION IF NOT EXISTS %s CASCADE",
+			escapedIdentifier);
+	PQfreemem(escapedIdentifier);
+	log_debug("Running command on Postgres: %s;", command);
+
+	PGresult *result = PQexec(connection, command);
 
-	if (!pgsql_execute(pgsql, cancelBlockedStatementsCommand))
+	if (!is_response_ok(result))
 	{
+		/*
+		 * Check if we have a duplicate_object (42710) error, in which case
+		 * it means the user has already been created, accept that as a
+		 * non-error, only inform about the situation.
+		 */
+		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+
+		log_error("Failed to create extension \"%s\"[%s]: %s",
+				  name, sqlstate, PQerrorMessage(connection));
+		PQclear(result);
+		clear_results(pgsql);
+		pgsql_finish(pgsql);
 		return false;
 	}
 
+	PQclear(result);
+	clear_results(pgsql);
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		pgsql_finish(pgsql);
+	}
+
 	return true;
 }
 
 
 /*
- * pgsql_set_default_transaction_mode_read_only makes it so that the server
- * won't be a target of a connection string requiring target_session_attrs
- * read-write by issuing ALTER SYSTEM SET transaction_mode_read_only TO on;
+ * pgsql_create_user creates a user with the given settings.
  *
+ * Unlike most functions this function does opens a connection itself
+ * because it has some specific requirements around logging, error handling
+ * and escaping.
  */
 bool
-pgsql_set_default_transaction_mode_read_only(PGSQL *pgsql)
+pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
+				  bool login, bool superuser, bool replication, int connlimit)
 {
-	GUC setting = { "default_transaction_read_only", "'on'" };
+	/* open a connection upfront since it is needed by PQescape functions */
+	PGconn *connection = pgsql_open_connection(pgsql);
+	if (connection == NULL)
+	{
+		/* error message was logged in pgsql_open_connection */
+		return false;
+	}
 
-	log_info("Setting default_transaction_read_only to on");
+	/* escape the username */
+	PQExpBuffer query = createPQExpBuffer();
+	char *escapedIdentifier = PQescapeIdentifier(connection, userName, strlen(userName));
+	if (escapedIdentifier == NULL)
+	{
+		log_error("Failed to create user \"%s\": %s", userName,
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
 
-	return pgsql_alter_system_set(pgsql, setting);
-}
+	appendPQExpBuffer(query, "CREATE USER %s", escapedIdentifier);
+	PQfreemem(escapedIdentifier);
 
+	if (login || superuser || replication || password)
+	{
+		appendPQExpBufferStr(query, " WITH");
+	}
+	if (login)
+	{
+		appendPQExpBufferStr(query, " LOGIN");
+	}
+	if (superuser)
+	{
+		appendPQExpBufferStr(query, " SUPERUSER");
+	}
+	if (replication)
+	{
+		appendPQExpBufferStr(query, " REPLICATION");
+	}
+	if (connlimit > -1)
+	{
+		appendPQExpBuffer(query, " CONNECTION LIMIT %d", connlimit);
+	}
+	if (password)
+	{
+		/* show the statement before we append the password */
+		log_debug("Running command on Postgres: %s PASSWORD '*****';", query->data);
 
-/*
- * pgsql_set_default_transaction_mode_read_write makes it so that the server
- * can be a target of a connection string requiring target_session_attrs
- * read-write by issuing ALTER SYSTEM SET transaction_mode_read_only TO off;
- *
- */
-bool
-pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql)
-{
-	GUC setting = { "default_transaction_read_only", "'off'" };
+		escapedIdentifier = PQescapeLiteral(connection, password, strlen(password));
+		if (escapedIdentifier == NULL)
+		{
+			log_error("Failed to create user \"%s\": %s", userName,
+					  PQerrorMessage(connection));
+			PQfreemem(escapedIdentifier);
+			pgsql_finish(pgsql);
+			destroyPQExpBuffer(query);
+			return false;
+		}
 
-	log_info("Setting default_transaction_read_only to off");
+		appendPQExpBuffer(query, " PASSWORD %s", escapedIdentifier);
+		PQfreemem(escapedIdentifier);
+	}
+	else
+	{
+		log_debug("Running command on Postgres: %s;", query->data);
+	}
 
-	return pgsql_alter_system_set(pgsql, setting);
-}
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(query))
+	{
+		log_error("Failed to allocate memory");
+		destroyPQExpBuffer(query);
+		pgsql_finish(pgsql);
+		return false;
+	}
 
+	/*
+	 * Set the libpq notice receiver to integrate notifications as debug
+	 * message, because when dealing with the citus extension those messages
+	 * are not that interesting to our pg_autoctl users frankly:
+	 *
+	 * NOTICE:  not propagating CREATE ROLE/USER commands to worker nodes
+	 * HINT:  Connect to worker nodes directly...
+	 */
+	PQnoticeProcessor previousNoticeProcessor =
+		PQsetNoticeProcessor(connection, &pgAutoCtlDebugNoticeProcessor, NULL);
 
-/*
- * pgsql_checkpoint runs a CHECKPOINT command on postgres to trigger a checkpoint.
- */
-bool
-pgsql_checkpoint(PGSQL *pgsql)
-{
-	return pgsql_execute(pgsql, "CHECKPOINT");
-}
+	PGresult *result = PQexec(connection, query->data);
+	destroyPQExpBuffer(query);
 
+	if (!is_response_ok(result))
+	{
+		/*
+		 * Check if we have a duplicate_object (42710) error, in which case
+		 * it means the user has already been created, accept that as a
+		 * non-error, only inform about the situation.
+		 */
+		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
 
-/*
- * pgsql_alter_system_set runs an ALTER SYSTEM SET ... command on Postgres
- * to globally set a GUC and then runs pg_reload_conf() to make existing
- * sessions reload it.
- */
-static bool
-pgsql_alter_system_set(PGSQL *pgsql, GUC setting)
-{
-	char command[BUFSIZE];
+		if (strcmp(sqlstate, ERRCODE_DUPLICATE_OBJECT) == 0)
+		{
+			log_info("The user \"%s\" already exists, skipping.", userName);
+		}
+		else
+		{
+			log_error("Failed to create user \"%s\"[%s]: %s",
+					  userName, sqlstate, PQerrorMessage(connection));
+			PQclear(result);
+			clear_results(pgsql);
+			pgsql_finish(pgsql);
+			return false;
+		}
+	}
 
-	sformat(command, sizeof(command),
-			"ALTER SYSTEM SET %s TO %s", setting.name, setting.value);
+	PQclear(result);
+	clear_results(pgsql);
 
-	if (!pgsql_execute(pgsql, command))
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
 	{
-		log_error("Failed to set \"%s\" to \"%s\" with ALTER SYSTEM, "
-				  "see above for details",
-				  setting.name, setting.value);
-		return false;
+		pgsql_finish(pgsql);
 	}
-
-	if (!pgsql_reload_conf(pgsql))
+	else
 	{
-		log_error("Failed to reload Postgres config after ALTER SYSTEM "
-				  "to set \"%s\" to \"%s\".",
-				  setting.name, setting.value);
-		return false;
+		/* restore the normal notice message processing, if needed. */
+		PQsetNoticeProcessor(connection, previousNoticeProcessor, NULL);
 	}
 
 	return true;
@@ -1908,434 +4149,610 @@ pgsql_alter_system_set(PGSQL *pgsql, GUC setting)
 
 
 /*
- * pgsql_reset_primary_conninfo issues the following SQL commands:
- *
- *   ALTER SYSTEM RESET primary_conninfo;
- *   ALTER SYSTEM RESET primary_slot_name;
- *
- * That's necessary to clean-up the replication settings that pg_basebackup
- * puts in place in postgresql.auto.conf in Postgres 12. We don't reload the
- * configuration after the RESET in that case, because Postgres 12 requires a
- * restart to apply the new setting value anyway.
+ * pgsql_has_replica returns whether a replica with the given username is active.
  */
 bool
-pgsql_reset_primary_conninfo(PGSQL *pgsql)
+pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
 {
-	char *reset_primary_conninfo = "ALTER SYSTEM RESET primary_conninfo";
-	char *reset_primary_slot_name = "ALTER SYSTEM RESET primary_slot_name";
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
 
-	/* ALTER SYSTEM cannot run inside a transaction block */
-	if (!pgsql_execute(pgsql, reset_primary_conninfo))
+	/*
+	 * Check whether there is an entry in pg_stat_replication, which means
+	 * there is either a pg_basebackup or streaming replica active. In either
+	 * case, it means there is a replica that recently communicated with the
+	 * postgres server, which is all we care about for the purpose of this
+	 * function.
+	 */
+	char *sql =
+		"SELECT EXISTS (SELECT 1 FROM pg_stat_replication WHERE usename = $1)";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { userName };
+	int paramCount = 1;
+
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
+		/* errors have already been logged */
 		return false;
 	}
 
-	if (!pgsql_execute(pgsql, reset_primary_slot_name))
+	if (!context.parsedOk)
 	{
+		log_error("Failed to find pg_stat_replication");
 		return false;
 	}
 
+	*hasReplica = context.boolVal;
+
 	return true;
 }
 
 
 /*
- * pgsql_reload_conf causes open sessions to reload the PostgreSQL configuration
- * files.
+ * pgsql_get_replica_reply_age returns how many milliseconds have passed since
+ * the last reply received from any replica connected with the given username,
+ * or -1 when there is no such replica. Standbys send a reply at least every
+ * wal_receiver_status_interval, so this works as a heartbeat for them.
+ *
+ * pg_stat_replication.reply_time has been added in Postgres 12.
  */
 bool
-pgsql_reload_conf(PGSQL *pgsql)
+pgsql_get_replica_reply_age(PGSQL *pgsql, char *userName, int *replyAgeMs)
 {
-	char *sql = "SELECT pg_reload_conf()";
-
-	log_info("Reloading Postgres configuration and HBA rules");
-
-	return pgsql_execute(pgsql, sql);
-}
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
 
+	char *sql =
+		"SELECT coalesce(least(floor(extract(epoch "
+		"                        from now() - max(reply_time)) * 1000), "
+		"                      2147483647), "
+		"                -1)::int "
+		"  FROM pg_stat_replication WHERE usename = $1";
 
-/*
- * pgsql_get_hba_file_path gets the value of the hba_file setting in
- * Postgres or returns false if a failure occurred. The value is copied to
- * the hbaFilePath pointer.
- */
-bool
-pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength)
-{
-	char *configValue = NULL;
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { userName };
+	int paramCount = 1;
 
-	if (!pgsql_get_current_setting(pgsql, "hba_file", &configValue))
+	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
 	{
-		/* pgsql_get_current_setting logs a relevant error */
+		/* errors have already been logged */
 		return false;
 	}
 
-	int hbaFilePathLength = strlcpy(hbaFilePath, configValue, maxPathLength);
-
-	if (hbaFilePathLength >= maxPathLength)
+	if (!context.parsedOk)
 	{
-		log_error("The hba_file \"%s\" returned by postgres is %d characters, "
-				  "the maximum supported by pg_autoctl is %d characters",
-				  configValue, hbaFilePathLength, maxPathLength);
-		free(configValue);
+		log_error("Failed to get replies time from pg_stat_replication");
 		return false;
 	}
 
-	free(configValue);
+	*replyAgeMs = context.intVal;
 
 	return true;
 }
 
 
 /*
- * pgsql_get_current_setting gets the value of a GUC in Postgres by running
- * SELECT current_setting($settingName), or returns false if a failure occurred.
- *
- * If getting the value was successful, currentValue will point to a copy of the
- * value which should be freed by the caller.
+ * pgsql_get_standby_replay_lag sets lagBytes to how many bytes of WAL the
+ * most advanced synchronous standby node still has to replay, or the most
+ * advanced standby node when none is synchronous. hasStandby is set to false
+ * when no standby node is connected.
  */
-static bool
-pgsql_get_current_setting(PGSQL *pgsql, char *settingName, char **currentValue)
+bool
+pgsql_get_standby_replay_lag(PGSQL *pgsql, bool *hasStandby, uint64_t *lagBytes)
 {
-	SingleValueResultContext context = { 0 };
-	char *sql = "SELECT current_setting($1)";
-	int paramCount = 1;
-	Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { settingName };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
 
-	context.resultType = PGSQL_RESULT_STRING;
+	char *sql =
+		"SELECT coalesce(min(lag) FILTER (WHERE sync), min(lag))::bigint "
+		"  FROM (SELECT greatest(pg_wal_lsn_diff(pg_current_wal_lsn(), "
+		"                                        replay_lsn), "
+		"                        0) AS lag, "
+		"               sync_state IN ('sync', 'quorum') AS sync "
+		"          FROM pg_stat_replication "
+		"         WHERE application_name ~ '^" REPLICATION_APPLICATION_NAME_PREFIX "\\d+$' "
+		"           AND replay_lsn IS NOT NULL) AS standbys "
+		"HAVING count(*) > 0";
 
-	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
 								   &context, &parseSingleValueResult))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
+	if (context.ntuples == 0)
+	{
+		*hasStandby = false;
+		return true;
+	}
+
 	if (!context.parsedOk)
 	{
-		log_error("Failed to get result from current_setting('%s')", settingName);
+		log_error("Failed to get the standby replay lag "
+				  "from pg_stat_replication");
 		return false;
 	}
 
-	*currentValue = context.strVal;
+	*hasStandby = true;
+	*lagBytes = context.bigint;
 
 	return true;
 }
 
 
 /*
- * pgsql_create_database issues a CREATE DATABASE statement.
+ * DrainStatsContext is used to parse the result of the query in
+ * pgsql_get_drain_stats.
+ */
+typedef struct DrainStatsContext
+{
+	char sqlstate[6];
+	DrainStats *stats;
+	bool parsedOk;
+} DrainStatsContext;
+
+
+/*
+ * pgsql_get_drain_stats fetches how many client sessions have a write
+ * transaction in progress, and how many transactions are prepared, with the
+ * age of the oldest of each.
  */
 bool
-pgsql_create_database(PGSQL *pgsql, const char *dbname, const char *owner)
+pgsql_get_drain_stats(PGSQL *pgsql, DrainStats *stats)
 {
-	char command[BUFSIZE];
-	char *escapedDBName, *escapedOwner;
+	DrainStatsContext context = { { 0 }, stats, false };
 
-	/* open a connection upfront since it is needed by PQescape functions */
-	PGconn *connection = pgsql_open_connection(pgsql);
-	if (connection == NULL)
-	{
-		/* error message was logged in pgsql_open_connection */
-		return false;
-	}
+	char *sql =
+		"SELECT w.count, w.oldest, p.count, p.oldest "
+		"  FROM (SELECT count(*)::int, "
+		"               coalesce(floor(extract(epoch "
+		"                                from now() - min(xact_start)) "
+		"                              * 1000), -1)::bigint "
+		"          FROM pg_stat_activity "
+		"         WHERE pid <> pg_backend_pid() "
+		"           AND backend_type = 'client backend' "
+		"           AND backend_xid IS NOT NULL) AS w(count, oldest), "
+		"       (SELECT count(*)::int, "
+		"               coalesce(floor(extract(epoch "
+		"                                from now() - min(prepared)) "
+		"                              * 1000), -1)::bigint "
+		"          FROM pg_prepared_xacts) AS p(count, oldest)";
 
-	/* escape the dbname */
-	escapedDBName = PQescapeIdentifier(connection, dbname, strlen(dbname));
-	if (escapedDBName == NULL)
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseDrainStatsResult))
 	{
-		log_error("Failed to create database \"%s\": %s", dbname,
-				  PQerrorMessage(connection));
-		pgsql_finish(pgsql);
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* escape the username */
-	escapedOwner = PQescapeIdentifier(connection, owner, strlen(owner));
-	if (escapedOwner == NULL)
+	if (!context.parsedOk)
 	{
-		log_error("Failed to create database \"%s\": %s", dbname,
-				  PQerrorMessage(connection));
-		PQfreemem(escapedDBName);
-		pgsql_finish(pgsql);
+		log_error("Failed to get the write and prepared transactions "
+				  "from pg_stat_activity and pg_prepared_xacts");
 		return false;
 	}
 
-	/* now build the SQL command */
-	sformat(command, BUFSIZE,
-			"CREATE DATABASE %s WITH OWNER %s",
-			escapedDBName,
-			escapedOwner);
-
-	log_debug("Running command on Postgres: %s;", command);
-
-	PQfreemem(escapedDBName);
-	PQfreemem(escapedOwner);
+	return true;
+}
 
-	PGresult *result = PQexec(connection, command);
 
-	if (!is_response_ok(result))
-	{
-		/*
-		 * Check if we have a duplicate_database (42P04) error, in which case
-		 * it means the user has already been created, accept that as a
-		 * non-error, only inform about the situation.
-		 */
-		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+/*
+ * parseDrainStatsResult parses the result of the query in
+ * pgsql_get_drain_stats.
+ */
+static void
+parseDrainStatsResult(void *ctx, PGresult *result)
+{
+	DrainStatsContext *context = (DrainStatsContext *) ctx;
+	DrainStats *stats = context->stats;
 
-		if (strcmp(sqlstate, ERRCODE_DUPLICATE_DATABASE) == 0)
-		{
-			log_info("The database \"%s\" already exists, skipping.", dbname);
-		}
-		else
-		{
-			log_error("Failed to create database \"%s\"[%s]: %s",
-					  dbname, sqlstate, PQerrorMessage(connection));
-			PQclear(result);
-			clear_results(pgsql);
-			pgsql_finish(pgsql);
-			return false;
-		}
+	if (PQnfields(result) != 4)
+	{
+		log_error("Query returned %d columns, expected 4", PQnfields(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	PQclear(result);
-	clear_results(pgsql);
-	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	if (PQntuples(result) != 1)
 	{
-		pgsql_finish(pgsql);
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	return true;
+	context->parsedOk =
+		stringToInt(PQgetvalue(result, 0, 0), &(stats->writeXacts)) &&
+		stringToInt64(PQgetvalue(result, 0, 1), &(stats->oldestWriteXactMs)) &&
+		stringToInt(PQgetvalue(result, 0, 2), &(stats->preparedXacts)) &&
+		stringToInt64(PQgetvalue(result, 0, 3), &(stats->oldestPreparedXactMs));
 }
 
 
 /*
- * pgsql_create_extension issues a CREATE EXTENSION statement.
+ * ReplicationStatsContext is used to parse the result of the query in
+ * pgsql_get_replication_stats.
+ */
+typedef struct ReplicationStatsContext
+{
+	char sqlstate[6];
+	ReplicationStatsReport *report;
+	bool parsedOk;
+} ReplicationStatsContext;
+
+
+/*
+ * pgsql_get_replication_stats fetches the sent, write, flush, and replay
+ * positions and lags of the standby nodes connected to the local Postgres
+ * instance, which are found by their application_name.
  */
 bool
-pgsql_create_extension(PGSQL *pgsql, const char *name)
+pgsql_get_replication_stats(PGSQL *pgsql, ReplicationStatsReport *report)
 {
-	char command[BUFSIZE];
+	ReplicationStatsContext context = { { 0 }, report, false };
 
-	/* open a connection upfront since it is needed by PQescape functions */
-	PGconn *connection = pgsql_open_connection(pgsql);
-	if (connection == NULL)
+	char *sql =
+		"SELECT count(*)::int, "
+		"       coalesce(array_agg(substring(application_name "
+		"                                    from '^" REPLICATION_APPLICATION_NAME_PREFIX "(\\d+)$')::bigint "
+		"                          ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(sent_lsn ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(write_lsn ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(flush_lsn ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(replay_lsn ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(write_lag ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(flush_lag ORDER BY pid), '{}')::text, "
+		"       coalesce(array_agg(replay_lag ORDER BY pid), '{}')::text "
+		"  FROM pg_stat_replication "
+		" WHERE application_name ~ '^" REPLICATION_APPLICATION_NAME_PREFIX "\\d+$'";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseReplicationStatsResult))
 	{
-		/* error message was logged in pgsql_open_connection */
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* escape the dbname */
-	char *escapedIdentifier = PQescapeIdentifier(connection, name, strlen(name));
-	if (escapedIdentifier == NULL)
+	if (!context.parsedOk)
 	{
-		log_error("Failed to create extension \"%s\": %s", name,
-				  PQerrorMessage(connection));
-		pgsql_finish(pgsql);
+		log_error("Failed to get replication stats from pg_stat_replication");
 		return false;
 	}
 
-	/* now build the SQL command */
-	sformat(command, BUFSIZE, "CREATE EXTENSION IF NOT EXISTS %s CASCADE",
-			escapedIdentifier);
-	PQfreemem(escapedIdentifier);
-	log_debug("Running command on Postgres: %s;", command);
+	return true;
+}
 
-	PGresult *result = PQexec(connection, command);
 
-	if (!is_response_ok(result))
+/*
+ * parseReplicationStatsResult parses the result of the query in
+ * pgsql_get_replication_stats.
+ */
+static void
+parseReplicationStatsResult(void *ctx, PGresult *result)
+{
+	ReplicationStatsContext *context = (ReplicationStatsContext *) ctx;
+	ReplicationStatsReport *report = context->report;
+
+	/* in the order of the query columns, after the count */
+	char *arrays[] = {
+		report->standbyIds,
+		report->sentLSNs,
+		report->writeLSNs,
+		report->flushLSNs,
+		report->replayLSNs,
+		report->writeLags,
+		report->flushLags,
+		report->replayLags
+	};
+	int arrayCount = sizeof(arrays) / sizeof(arrays[0]);
+
+	if (PQnfields(result) != arrayCount + 1)
+	{
+		log_error("Query returned %d columns, expected %d",
+				  PQnfields(result), arrayCount + 1);
+		context->parsedOk = false;
+		return;
+	}
+
+	if (PQntuples(result) != 1)
 	{
-		/*
-		 * Check if we have a duplicate_object (42710) error, in which case
-		 * it means the user has already been created, accept that as a
-		 * non-error, only inform about the situation.
-		 */
-		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
 
-		log_error("Failed to create extension \"%s\"[%s]: %s",
-				  name, sqlstate, PQerrorMessage(connection));
-		PQclear(result);
-		clear_results(pgsql);
-		pgsql_finish(pgsql);
-		return false;
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt(value, &(report->count)))
+	{
+		log_error("Failed to parse standby count \"%s\"", value);
+		context->parsedOk = false;
+		return;
 	}
 
-	PQclear(result);
-	clear_results(pgsql);
-	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	for (int i = 0; i < arrayCount; i++)
 	{
-		pgsql_finish(pgsql);
+		/* we don't want to send a partial array to the monitor */
+		if (strlcpy(arrays[i], PQgetvalue(result, 0, i + 1), BUFSIZE) >= BUFSIZE)
+		{
+			log_error("Failed to parse replication stats: "
+					  "too many standby nodes");
+			context->parsedOk = false;
+			return;
+		}
 	}
 
-	return true;
+	context->parsedOk = true;
 }
 
 
 /*
- * pgsql_create_user creates a user with the given settings.
- *
- * Unlike most functions this function does opens a connection itself
- * because it has some specific requirements around logging, error handling
- * and escaping.
+ * ReplicationSlotStatsContext is used to parse the result of the query in
+ * pgsql_get_replication_slot_stats.
+ */
+typedef struct ReplicationSlotStatsContext
+{
+	char sqlstate[6];
+	ReplicationSlotStatsReport *report;
+	bool parsedOk;
+} ReplicationSlotStatsContext;
+
+
+/*
+ * pgsql_get_replication_slot_stats fetches how much WAL the replication slots
+ * of our standby nodes retain on the local Postgres instance, and whether
+ * they are in use. Starting with Postgres 13 we also fetch the wal_status of
+ * the slots, which is "lost" when max_slot_wal_keep_size had Postgres
+ * invalidate them.
  */
 bool
-pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
-				  bool login, bool superuser, bool replication, int connlimit)
+pgsql_get_replication_slot_stats(PGSQL *pgsql,
+								 int pgControlVersion,
+								 ReplicationSlotStatsReport *report)
 {
-	/* open a connection upfront since it is needed by PQescape functions */
-	PGconn *connection = pgsql_open_connection(pgsql);
-	if (connection == NULL)
+	ReplicationSlotStatsContext context = { { 0 }, report, false };
+	char sql[BUFSIZE] = { 0 };
+
+	/* *INDENT-OFF* */
+	char *sqlTemplate =
+		"SELECT count(*)::int, "
+		"       coalesce(array_agg(substring(slot_name "
+		"                                    from '" REPLICATION_SLOT_NAME_PATTERN "(\\d+)$')::bigint "
+		"                          ORDER BY slot_name), '{}')::text, "
+		"       coalesce(array_agg(active ORDER BY slot_name), '{}')::text, "
+		"       coalesce(array_agg("
+		"         pg_wal_lsn_diff(pg_current_wal_lsn(), restart_lsn)::bigint "
+		"                          ORDER BY slot_name), '{}')::text, "
+		"       coalesce(array_agg(%s ORDER BY slot_name), '{}')::text "
+		"  FROM pg_replication_slots "
+		" WHERE slot_name ~ '" REPLICATION_SLOT_NAME_PATTERN "\\d+$' "
+		"   AND slot_type = 'physical'";
+	/* *INDENT-ON* */
+
+	sformat(sql, sizeof(sql), sqlTemplate,
+			pgControlVersion >= 1300 ? "wal_status" : "NULL::text");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseReplicationSlotStatsResult))
 	{
-		/* error message was logged in pgsql_open_connection */
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* escape the username */
-	PQExpBuffer query = createPQExpBuffer();
-	char *escapedIdentifier = PQescapeIdentifier(connection, userName, strlen(userName));
-	if (escapedIdentifier == NULL)
+	if (!context.parsedOk)
 	{
-		log_error("Failed to create user \"%s\": %s", userName,
-				  PQerrorMessage(connection));
-		pgsql_finish(pgsql);
+		log_error("Failed to get replication slot stats "
+				  "from pg_replication_slots");
 		return false;
 	}
 
-	appendPQExpBuffer(query, "CREATE USER %s", escapedIdentifier);
-	PQfreemem(escapedIdentifier);
+	return true;
+}
 
-	if (login || superuser || replication || password)
-	{
-		appendPQExpBufferStr(query, " WITH");
-	}
-	if (login)
-	{
-		appendPQExpBufferStr(query, " LOGIN");
-	}
-	if (superuser)
-	{
-		appendPQExpBufferStr(query, " SUPERUSER");
+
+/*
+ * parseReplicationSlotStatsResult parses the result of the query in
+ * pgsql_get_replication_slot_stats.
+ */
+static void
+parseReplicationSlotStatsResult(void *ctx, PGresult *result)
+{
+	ReplicationSlotStatsContext *context = (ReplicationSlotStatsContext *) ctx;
+	ReplicationSlotStatsReport *report = context->report;
+
+	/* in the order of the query columns, after the count */
+	char *arrays[] = {
+		report->standbyIds,
+		report->active,
+		report->retainedBytes,
+		report->walStatus
+	};
+	int arrayCount = sizeof(arrays) / sizeof(arrays[0]);
+
+	if (PQnfields(result) != arrayCount + 1)
+	{
+		log_error("Query returned %d columns, expected %d",
+				  PQnfields(result), arrayCount + 1);
+		context->parsedOk = false;
+		return;
 	}
-	if (replication)
+
+	if (PQntuples(result) != 1)
 	{
-		appendPQExpBufferStr(query, " REPLICATION");
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
 	}
-	if (connlimit > -1)
+
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt(value, &(report->count)))
 	{
-		appendPQExpBuffer(query, " CONNECTION LIMIT %d", connlimit);
+		log_error("Failed to parse replication slot count \"%s\"", value);
+		context->parsedOk = false;
+		return;
 	}
-	if (password)
-	{
-		/* show the statement before we append the password */
-		log_debug("Running command on Postgres: %s PASSWORD '*****';", query->data);
 
-		escapedIdentifier = PQescapeLiteral(connection, password, strlen(password));
-		if (escapedIdentifier == NULL)
+	for (int i = 0; i < arrayCount; i++)
+	{
+		/* we don't want to send a partial array to the monitor */
+		if (strlcpy(arrays[i], PQgetvalue(result, 0, i + 1), BUFSIZE) >= BUFSIZE)
 		{
-			log_error("Failed to create user \"%s\": %s", userName,
-					  PQerrorMessage(connection));
-			PQfreemem(escapedIdentifier);
-			pgsql_finish(pgsql);
-			destroyPQExpBuffer(query);
-			return false;
+			log_error("Failed to parse replication slot stats: "
+					  "too many replication slots");
+			context->parsedOk = false;
+			return;
 		}
-
-		appendPQExpBuffer(query, " PASSWORD %s", escapedIdentifier);
-		PQfreemem(escapedIdentifier);
 	}
-	else
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * SyncRepStallContext is used to parse the result of the query in
+ * pgsql_get_sync_rep_stall.
+ */
+typedef struct SyncRepStallContext
+{
+	char sqlstate[6];
+	int stallMs;
+	char *standbyIds;
+	int size;
+	bool parsedOk;
+} SyncRepStallContext;
+
+
+/*
+ * pgsql_get_sync_rep_stall fetches for how long the oldest statement that is
+ * waiting for synchronous replication has been running, in milliseconds, and
+ * the Postgres array literal of the ids of our standby nodes that are
+ * streaming. Starting with Postgres 12, a standby node that has not replied
+ * within replyTimeoutMs is not counted as streaming.
+ */
+bool
+pgsql_get_sync_rep_stall(PGSQL *pgsql,
+						 int pgControlVersion,
+						 int replyTimeoutMs,
+						 int *stallMs,
+						 char *streamingStandbyIds,
+						 int size)
+{
+	SyncRepStallContext context = {
+		{ 0 }, 0, streamingStandbyIds, size, false
+	};
+	char sql[BUFSIZE] = { 0 };
+
+	/* *INDENT-OFF* */
+	char *sqlTemplate =
+		"SELECT coalesce(("
+		"         SELECT least(extract(epoch from max(now() - query_start)) "
+		"                      * 1000, 2147483647)::int "
+		"           FROM pg_stat_activity "
+		"          WHERE wait_event = 'SyncRep'), 0), "
+		"       ("
+		"         SELECT coalesce(array_agg(substring(application_name "
+		"                 from '^" REPLICATION_APPLICATION_NAME_PREFIX "(\\d+)$')::bigint), "
+		"                         '{}')::text "
+		"           FROM pg_stat_replication "
+		"          WHERE application_name ~ '^" REPLICATION_APPLICATION_NAME_PREFIX "\\d+$' "
+		"            AND state = 'streaming' %s)";
+	/* *INDENT-ON* */
+
+	char *replyTimeClause =
+		"AND (reply_time IS NULL "
+		"     OR reply_time > now() - make_interval(secs => $1 / 1000.0))";
+
+	const Oid paramTypes[1] = { INT4OID };
+	const char *paramValues[1] = { intToString(replyTimeoutMs).strValue };
+	int paramCount = pgControlVersion >= 1200 ? 1 : 0;
+
+	sformat(sql, sizeof(sql), sqlTemplate,
+			pgControlVersion >= 1200 ? replyTimeClause : "");
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSyncRepStallResult))
 	{
-		log_debug("Running command on Postgres: %s;", query->data);
+		/* errors have already been logged */
+		return false;
 	}
 
-	/* memory allocation could have failed while building string */
-	if (PQExpBufferBroken(query))
+	if (!context.parsedOk)
 	{
-		log_error("Failed to allocate memory");
-		destroyPQExpBuffer(query);
-		pgsql_finish(pgsql);
+		log_error("Failed to check for statements waiting for "
+				  "synchronous replication");
 		return false;
 	}
 
-	/*
-	 * Set the libpq notice receiver to integrate notifications as debug
-	 * message, because when dealing with the citus extension those messages
-	 * are not that interesting to our pg_autoctl users frankly:
-	 *
-	 * NOTICE:  not propagating CREATE ROLE/USER commands to worker nodes
-	 * HINT:  Connect to worker nodes directly...
-	 */
-	PQnoticeProcessor previousNoticeProcessor =
-		PQsetNoticeProcessor(connection, &pgAutoCtlDebugNoticeProcessor, NULL);
+	*stallMs = context.stallMs;
 
-	PGresult *result = PQexec(connection, query->data);
-	destroyPQExpBuffer(query);
+	return true;
+}
 
-	if (!is_response_ok(result))
-	{
-		/*
-		 * Check if we have a duplicate_object (42710) error, in which case
-		 * it means the user has already been created, accept that as a
-		 * non-error, only inform about the situation.
-		 */
-		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
 
-		if (strcmp(sqlstate, ERRCODE_DUPLICATE_OBJECT) == 0)
-		{
-			log_info("The user \"%s\" already exists, skipping.", userName);
-		}
-		else
-		{
-			log_error("Failed to create user \"%s\"[%s]: %s",
-					  userName, sqlstate, PQerrorMessage(connection));
-			PQclear(result);
-			clear_results(pgsql);
-			pgsql_finish(pgsql);
-			return false;
-		}
+/*
+ * parseSyncRepStallResult parses the result of the query in
+ * pgsql_get_sync_rep_stall.
+ */
+static void
+parseSyncRepStallResult(void *ctx, PGresult *result)
+{
+	SyncRepStallContext *context = (SyncRepStallContext *) ctx;
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	PQclear(result);
-	clear_results(pgsql);
+	if (PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows, expected 1", PQntuples(result));
+		context->parsedOk = false;
+		return;
+	}
 
-	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt(value, &(context->stallMs)))
 	{
-		pgsql_finish(pgsql);
+		log_error("Failed to parse synchronous replication wait \"%s\"",
+				  value);
+		context->parsedOk = false;
+		return;
 	}
-	else
+
+	value = PQgetvalue(result, 0, 1);
+
+	if (strlcpy(context->standbyIds, value, context->size) >= context->size)
 	{
-		/* restore the normal notice message processing, if needed. */
-		PQsetNoticeProcessor(connection, previousNoticeProcessor, NULL);
+		log_error("Failed to parse streaming standby nodes: "
+				  "too many standby nodes");
+		context->parsedOk = false;
+		return;
 	}
 
-	return true;
+	context->parsedOk = true;
 }
 
 
 /*
- * pgsql_has_replica returns whether a replica with the given username is active.
+ * pgsql_get_databases_size returns the sum of the size of the databases that
+ * we are allowed to connect to, an estimate of what pg_basebackup copies.
  */
 bool
-pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
+pgsql_get_databases_size(PGSQL *pgsql, uint64_t *size)
 {
-	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
 
-	/*
-	 * Check whether there is an entry in pg_stat_replication, which means
-	 * there is either a pg_basebackup or streaming replica active. In either
-	 * case, it means there is a replica that recently communicated with the
-	 * postgres server, which is all we care about for the purpose of this
-	 * function.
-	 */
 	char *sql =
-		"SELECT EXISTS (SELECT 1 FROM pg_stat_replication WHERE usename = $1)";
-
-	const Oid paramTypes[1] = { TEXTOID };
-	const char *paramValues[1] = { userName };
-	int paramCount = 1;
+		"SELECT coalesce(sum(pg_database_size(oid)), 0)::bigint "
+		"  FROM pg_database "
+		" WHERE has_database_privilege(oid, 'CONNECT')";
 
-	if (!pgsql_execute_with_params(pgsql, sql, paramCount, paramTypes, paramValues,
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
 								   &context, &parseSingleValueResult))
 	{
 		/* errors have already been logged */
@@ -2344,11 +4761,11 @@ pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
 
 	if (!context.parsedOk)
 	{
-		log_error("Failed to find pg_stat_replication");
+		log_error("Failed to compute the size of the databases");
 		return false;
 	}
 
-	*hasReplica = context.boolVal;
+	*size = context.bigint;
 
 	return true;
 }
@@ -2357,6 +4774,9 @@ pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica)
 /*
  * hostname_from_uri parses a PostgreSQL connection string URI and returns
  * whether the URL was successfully parsed.
+ *
+ * When the URI lists several hosts, as in a monitor URI that also targets a
+ * hot standby monitor, we return the first host and its port.
  */
 bool
 hostname_from_uri(const char *pguri,
@@ -2381,7 +4801,7 @@ hostname_from_uri(const char *pguri,
 		{
 			if (option->val)
 			{
-				int hostNameLength = strlcpy(hostname, option->val, maxHostLength);
+				int hostNameLength = strcspn(option->val, ",");
 
 				if (hostNameLength >= maxHostLength)
 				{
@@ -2393,6 +4813,8 @@ hostname_from_uri(const char *pguri,
 					return false;
 				}
 
+				strlcpy(hostname, option->val, hostNameLength + 1);
+
 				++found;
 			}
 		}
@@ -2401,8 +4823,13 @@ hostname_from_uri(const char *pguri,
 		{
 			if (option->val)
 			{
-				/* we expect a single port number in a monitor's URI */
-				if (!stringToInt(option->val, port))
+				char portString[NAMEDATALEN] = { 0 };
+
+				/* only keep the port of the first host */
+				strlcpy(portString, option->val,
+						Min(strcspn(option->val, ",") + 1, NAMEDATALEN));
+
+				if (!stringToInt(portString, port))
 				{
 					log_error("Failed to parse port number : %s", option->val);
 
@@ -2471,6 +4898,7 @@ validate_connection_string(const char *connectionString)
  *  - pg_control_version
  *  - catalog_version_no
  *  - system_identifier
+ *  - status and staleness of the WAL receiver when a standby
  *
  * With those metadata we can then check our expectations and take decisions in
  * some cases. We can obtain all the metadata that we need easily enough in a
@@ -2484,6 +4912,7 @@ typedef struct PgMetadata
 	char syncState[PGSR_SYNC_STATE_MAXLENGTH];
 	char currentLSN[PG_LSN_MAXLENGTH];
 	PostgresControlData control;
+	WalReceiverState walReceiver;
 } PgMetadata;
 
 
@@ -2492,7 +4921,8 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 							bool *pg_is_in_recovery,
 							char *pgsrSyncState,
 							char *currentLSN,
-							PostgresControlData *control)
+							PostgresControlData *control,
+							WalReceiverState *walReceiver)
 {
 	PgMetadata context = { 0 };
 
@@ -2517,13 +4947,19 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 		" case when pg_is_in_recovery()"
 		" then (select received_tli from pg_stat_wal_receiver)"
 		" else (select timeline_id from pg_control_checkpoint()) "
-		" end as timeline_id "
+		" end as timeline_id,"
+		" receiver.status as wal_receiver_status,"
+		" (extract(epoch from now() - "
+		"  greatest(receiver.last_msg_receipt_time, receiver.latest_end_time))"
+		"  * 1000)::bigint as wal_receiver_staleness_ms,"
+		" receiver.latest_end_lsn as wal_receiver_end_lsn"
 		" from (values(1)) as dummy"
 		" full outer join"
 		" (select pg_control_version, catalog_version_no, system_identifier "
 		"    from pg_control_system()"
 		" )"
 		" as control on true"
+		" left join pg_stat_wal_receiver receiver on pg_is_in_recovery()"
 		" full outer join"
 		" ("
 		"   select sync_state"
@@ -2543,8 +4979,9 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 		"as rep on true";
 	/* *INDENT-ON* */
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &parsePgMetadata))
+	if (!pgsql_execute_prepared(pgsql, "pgautofailover_metadata", sql,
+								0, NULL, NULL,
+								&context, &parsePgMetadata))
 	{
 		/* errors have been logged already */
 		return false;
@@ -2558,7 +4995,7 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 
 	*pg_is_in_recovery = context.pg_is_in_recovery;
 
-	/* the last two metadata items are opt-in */
+	/* the sync state, current LSN, and WAL receiver state are opt-in */
 	if (pgsrSyncState != NULL)
 	{
 		strlcpy(pgsrSyncState, context.syncState, PGSR_SYNC_STATE_MAXLENGTH);
@@ -2569,10 +5006,288 @@ pgsql_get_postgres_metadata(PGSQL *pgsql,
 		strlcpy(currentLSN, context.currentLSN, PG_LSN_MAXLENGTH);
 	}
 
+	if (walReceiver != NULL)
+	{
+		*walReceiver = context.walReceiver;
+	}
+
 	/* overwrite the Control Data fetched from the query */
 	*control = context.control;
 
-	pgsql_finish(pgsql);
+	return true;
+}
+
+
+/*
+ * pgsql_parse_postgres_metadata parses a result of the metadata query of
+ * pgsql_get_postgres_metadata that has been obtained without a connection to
+ * Postgres, as in pg_autoctl do bench keeper-loop.
+ */
+bool
+pgsql_parse_postgres_metadata(PGresult *result,
+							  bool *pg_is_in_recovery,
+							  char *pgsrSyncState,
+							  char *currentLSN,
+							  PostgresControlData *control,
+							  WalReceiverState *walReceiver)
+{
+	PgMetadata context = { 0 };
+
+	(void) parsePgMetadata(&context, result);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the Postgres metadata");
+		return false;
+	}
+
+	*pg_is_in_recovery = context.pg_is_in_recovery;
+	strlcpy(pgsrSyncState, context.syncState, PGSR_SYNC_STATE_MAXLENGTH);
+	strlcpy(currentLSN, context.currentLSN, PG_LSN_MAXLENGTH);
+	*control = context.control;
+
+	if (walReceiver != NULL)
+	{
+		*walReceiver = context.walReceiver;
+	}
+
+	return true;
+}
+
+
+/*
+ * recvint64 and sendint64 convert a 64 bits integer from and to the network
+ * byte order used in the streaming replication protocol messages.
+ */
+static uint64_t
+recvint64(const char *buf)
+{
+	uint64_t result = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		result = (result << 8) | (unsigned char) buf[i];
+	}
+
+	return result;
+}
+
+
+static void
+sendint64(uint64_t value, char *buf)
+{
+	for (int i = 7; i >= 0; i--)
+	{
+		buf[i] = (char) (value & 0xff);
+		value >>= 8;
+	}
+}
+
+
+/*
+ * pgsql_stream_wal_reply sends a standby status update message, as the
+ * upstream server asks for one in its keepalive messages.
+ */
+static bool
+pgsql_stream_wal_reply(PGconn *connection, uint64_t receivedLSN)
+{
+	char buf[1 + 4 * 8 + 1] = { 0 };
+	int len = 0;
+
+	buf[len++] = 'r';
+	sendint64(receivedLSN, &buf[len]);   /* write */
+	len += 8;
+	sendint64(InvalidXLogRecPtr, &buf[len]); /* flush */
+	len += 8;
+	sendint64(InvalidXLogRecPtr, &buf[len]); /* apply */
+	len += 8;
+	sendint64(0, &buf[len]);   /* sendTime, unused */
+	len += 8;
+	buf[len++] = 0;            /* replyRequested */
+
+	if (PQputCopyData(connection, buf, len) <= 0 || PQflush(connection) != 0)
+	{
+		log_error("Failed to send a standby status update: %s",
+				  PQerrorMessage(connection));
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_stream_wal_segment uses the START_REPLICATION command on a
+ * replication connection to fetch size bytes of WAL from startLSN on the
+ * given timeline, and writes them to the given file descriptor, starting at
+ * offset zero. The connection is kept open, so that several segments can be
+ * fetched in turn.
+ */
+bool
+pgsql_stream_wal_segment(PGSQL *pgsql, uint32_t timeline,
+						 uint64_t startLSN, uint64_t size, int fd)
+{
+	char sql[BUFSIZE] = { 0 };
+	uint64_t received = 0;
+	bool success = true;
+
+	PGconn *connection = pgsql_open_connection(pgsql);
+	if (connection == NULL)
+	{
+		/* error message was logged in pgsql_open_connection */
+		return false;
+	}
+
+	sformat(sql, sizeof(sql), "START_REPLICATION PHYSICAL %X/%X TIMELINE %u",
+			(uint32_t) (startLSN >> 32), (uint32_t) startLSN, timeline);
+
+	/* extended query protocol not supported in a replication connection */
+	PGresult *result = PQexec(connection, sql);
+
+	if (PQresultStatus(result) != PGRES_COPY_BOTH)
+	{
+		log_error("Failed to START_REPLICATION at %X/%X: %s",
+				  (uint32_t) (startLSN >> 32), (uint32_t) startLSN,
+				  PQerrorMessage(connection));
+		PQclear(result);
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	PQclear(result);
+
+	while (received < size)
+	{
+		char *copybuf = NULL;
+		int len = PQgetCopyData(connection, &copybuf, 0);
+
+		if (len < 0)
+		{
+			log_error("Failed to stream WAL from %X/%X: %s",
+					  (uint32_t) (startLSN >> 32), (uint32_t) startLSN,
+					  PQerrorMessage(connection));
+			success = false;
+			break;
+		}
+
+		/* 'k': walEnd, sendTime, replyRequested */
+		if (copybuf[0] == 'k' && len >= 18)
+		{
+			if (copybuf[17] &&
+				!pgsql_stream_wal_reply(connection, startLSN + received))
+			{
+				PQfreemem(copybuf);
+				success = false;
+				break;
+			}
+		}
+
+		/* 'w': dataStart, walEnd, sendTime, data */
+		else if (copybuf[0] == 'w' && len >= 25)
+		{
+			uint64_t dataStart = recvint64(&copybuf[1]);
+			uint64_t dataSize = len - 25;
+			uint64_t offset = dataStart - startLSN;
+
+			if (dataStart < startLSN || offset > size)
+			{
+				log_error("Failed to stream WAL: received unexpected data "
+						  "at %X/%X",
+						  (uint32_t) (dataStart >> 32), (uint32_t) dataStart);
+				PQfreemem(copybuf);
+				success = false;
+				break;
+			}
+
+			if (offset + dataSize > size)
+			{
+				dataSize = size - offset;
+			}
+
+			if (pwrite(fd, &copybuf[25], dataSize, offset) != (ssize_t) dataSize)
+			{
+				log_error("Failed to write WAL: %m");
+				PQfreemem(copybuf);
+				success = false;
+				break;
+			}
+
+			received = offset + dataSize;
+		}
+
+		PQfreemem(copybuf);
+	}
+
+	if (!success)
+	{
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	/* we have what we need, end the COPY and get back to the command mode */
+	if (PQputCopyEnd(connection, NULL) <= 0 || PQflush(connection) != 0)
+	{
+		log_error("Failed to end WAL streaming: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	for (;;)
+	{
+		char *copybuf = NULL;
+
+		if (PQgetCopyData(connection, &copybuf, 0) < 0)
+		{
+			break;
+		}
+		PQfreemem(copybuf);
+	}
+
+	while ((result = PQgetResult(connection)) != NULL)
+	{
+		if (!is_response_ok(result))
+		{
+			log_error("Failed to end WAL streaming: %s",
+					  PQerrorMessage(connection));
+			success = false;
+		}
+		PQclear(result);
+	}
+
+	if (!success)
+	{
+		pgsql_finish(pgsql);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_get_wal_segment_size returns the wal_segment_size, in bytes.
+ */
+bool
+pgsql_get_wal_segment_size(PGSQL *pgsql, uint64_t *size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	char *sql = "SELECT pg_size_bytes(current_setting('wal_segment_size'))";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get the wal_segment_size");
+		return false;
+	}
+
+	*size = context.bigint;
 
 	return true;
 }
@@ -2588,9 +5303,9 @@ parsePgMetadata(void *ctx, PGresult *result)
 	PgMetadata *context = (PgMetadata *) ctx;
 	char *value;
 
-	if (PQnfields(result) != 7)
+	if (PQnfields(result) != 10)
 	{
-		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		log_error("Query returned %d columns, expected 10", PQnfields(result));
 		context->parsedOk = false;
 		return;
 	}
@@ -2670,6 +5385,42 @@ parsePgMetadata(void *ctx, PGresult *result)
 		}
 	}
 
+	/*
+	 * The WAL receiver columns are NULL on a primary, and on a standby node
+	 * where the WAL receiver is not running.
+	 */
+	if (PQgetisnull(result, 0, 7))
+	{
+		context->walReceiver.status[0] = '\0';
+	}
+	else
+	{
+		value = PQgetvalue(result, 0, 7);
+		strlcpy(context->walReceiver.status, value, NAMEDATALEN);
+	}
+
+	context->walReceiver.stalenessMs = -1;
+
+	if (!PQgetisnull(result, 0, 8))
+	{
+		value = PQgetvalue(result, 0, 8);
+		if (!stringToInt64(value, &(context->walReceiver.stalenessMs)))
+		{
+			log_error("Failed to parse WAL receiver staleness \"%s\"", value);
+			context->walReceiver.stalenessMs = -1;
+		}
+	}
+
+	if (PQgetisnull(result, 0, 9))
+	{
+		context->walReceiver.latestEndLSN[0] = '\0';
+	}
+	else
+	{
+		value = PQgetvalue(result, 0, 9);
+		strlcpy(context->walReceiver.latestEndLSN, value, PG_LSN_MAXLENGTH);
+	}
+
 	context->parsedOk = true;
 }
 
@@ -2878,6 +5629,13 @@ pgsql_identify_system(PGSQL *pgsql, IdentifySystem *system)
 
 	IdentifySystemResult isContext = { { 0 }, false, system };
 
+	/* the timeline history we already have, if any */
+	uint64_t knownIdentifier = system->identifier;
+	uint32_t knownTimeline =
+		system->timelines.count > 0
+		? system->timelines.history[system->timelines.count - 1].tli
+		: 0;
+
 	(void) parseIdentifySystemResult((void *) &isContext, result);
 
 	PQclear(result);
@@ -2895,8 +5653,19 @@ pgsql_identify_system(PGSQL *pgsql, IdentifySystem *system)
 		return false;
 	}
 
-	/* while at it, we also run the TIMELINE_HISTORY command */
-	if (system->timeline > 1)
+	/*
+	 * While at it, we also run the TIMELINE_HISTORY command, unless we have
+	 * parsed the history of that timeline already: the history of a given
+	 * timeline never changes.
+	 */
+	if (system->timeline > 1 &&
+		system->identifier == knownIdentifier &&
+		system->timeline == knownTimeline)
+	{
+		log_debug("TIMELINE_HISTORY: using the known history of timeline %d",
+				  system->timeline);
+	}
+	else if (system->timeline > 1)
 	{
 		TimelineHistoryResult hContext = { 0 };
 
@@ -3278,11 +6047,20 @@ pgsql_prepare_to_wait(PGSQL *pgsql)
 
 /*
  * pgsql_alter_extension_update_to executes ALTER EXTENSION ... UPDATE TO ...
+ *
+ * When lockTimeoutMs is positive, the command gives up waiting for a lock
+ * after that many milliseconds rather than queue behind a long transaction,
+ * and then lockNotAvailable is set to true.
  */
 bool
 pgsql_alter_extension_update_to(PGSQL *pgsql,
-								const char *extname, const char *version)
+								const char *extname, const char *version,
+								int lockTimeoutMs, bool *lockNotAvailable)
 {
+	char lockTimeout[BUFSIZE] = { 0 };
+
+	*lockNotAvailable = false;
+
 	char command[BUFSIZE];
 	char *escapedIdentifier, *escapedVersion;
 
@@ -3315,9 +6093,15 @@ pgsql_alter_extension_update_to(PGSQL *pgsql,
 		return false;
 	}
 
+	/* SET and ALTER EXTENSION run in the same implicit transaction */
+	if (lockTimeoutMs > 0)
+	{
+		sformat(lockTimeout, BUFSIZE, "SET lock_timeout TO %d; ", lockTimeoutMs);
+	}
+
 	/* now build the SQL command */
-	int n = sformat(command, BUFSIZE, "ALTER EXTENSION %s UPDATE TO %s",
-					escapedIdentifier, escapedVersion);
+	int n = sformat(command, BUFSIZE, "%sALTER EXTENSION %s UPDATE TO %s",
+					lockTimeout, escapedIdentifier, escapedVersion);
 
 	if (n >= BUFSIZE)
 	{
@@ -3338,6 +6122,21 @@ pgsql_alter_extension_update_to(PGSQL *pgsql,
 	{
 		char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
 
+		if (sqlstate != NULL &&
+			strcmp(sqlstate, ERRCODE_LOCK_NOT_AVAILABLE) == 0)
+		{
+			log_warn("Failed to acquire the locks needed to update "
+					 "extension \"%s\" within %dms",
+					 extname, lockTimeoutMs);
+
+			*lockNotAvailable = true;
+
+			PQclear(result);
+			clear_results(pgsql);
+			pgsql_finish(pgsql);
+			return false;
+		}
+
 		log_error("Error %s while running Postgres query: %s:",
 				  sqlstate, command);
 
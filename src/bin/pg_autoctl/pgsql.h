@@ -18,6 +18,7 @@
 #include "portability/instr_time.h"
 
 #include "defaults.h"
+#include "log.h"
 #include "pgsetup.h"
 #include "state.h"
 
@@ -94,6 +95,25 @@ typedef struct ConnectionRetryPolicy
 	int attempts;               /* how many attempts have been made so far */
 } ConnectionRetryPolicy;
 
+/*
+ * A connection to a remote node that hangs, with the network gone and no RST
+ * ever received, would otherwise only fail after the kernel's TCP timeouts,
+ * which are counted in minutes, or hours for an idle connection. We set
+ * libpq keepalives options and tcp_user_timeout on all our remote
+ * connections, including the replication connections, so that a network
+ * failure is noticed well within network_partition_timeout.
+ */
+typedef struct TCPKeepalives
+{
+	int keepalives;             /* 0 disables our settings */
+	int idle;                   /* seconds */
+	int interval;               /* seconds */
+	int count;
+	int userTimeout;            /* seconds, 0 is the OS default */
+} TCPKeepalives;
+
+extern TCPKeepalives pgsql_keepalives;
+
 /*
  * Denote if the connetion is going to be used for one, or multiple statements.
  * This is used by psql_* functions to know if a connection is to be closed
@@ -129,6 +149,12 @@ typedef bool (*ProcessNotificationFunction)(int notificationGroupId,
 											int64_t notificationNodeId,
 											char *channel, char *payload);
 
+/*
+ * Prepared statements only live as long as the connection where they have
+ * been prepared, so we keep track of their names in the PGSQL struct.
+ */
+#define PGSQL_MAX_PREPARED_STATEMENTS 4
+
 typedef struct PGSQL
 {
 	ConnectionType connectionType;
@@ -142,6 +168,21 @@ typedef struct PGSQL
 	int notificationGroupId;
 	int64_t notificationNodeId;
 	bool notificationReceived;
+
+	int preparedStatementCount;
+	char preparedStatements[PGSQL_MAX_PREPARED_STATEMENTS][NAMEDATALEN];
+
+	/* when set, read-only queries are first sent to the local monitor-proxy */
+	char proxySocketPath[MAXPGPATH];
+
+	/* when set, queries that take longer are cancelled and fail */
+	int statementTimeoutMs;
+	bool statementTimedOut;
+
+	/* the main loop retries connections every round, limit the logs */
+	log_ratelimit retryLogs;
+	log_ratelimit retryPingLogs;
+	log_ratelimit retryFailedLogs;
 } PGSQL;
 
 
@@ -215,6 +256,24 @@ typedef struct IdentifySystem
 } IdentifySystem;
 
 
+/*
+ * RebuildScheduling is how pg_basebackup and pg_rewind run when rebuilding a
+ * standby node, so that they compete less for CPU and disk with the other
+ * Postgres instances of the same host: their nice value increment, their
+ * I/O scheduling class, and the cgroup v2 directory where to move them.
+ */
+typedef struct RebuildScheduling
+{
+	int nice;                   /* added to our nice value, 0 keeps it */
+	int ioClass;                /* one of the REBUILD_IO_CLASS_* values */
+	char cgroup[MAXPGPATH];     /* empty keeps our cgroup */
+} RebuildScheduling;
+
+#define REBUILD_IO_CLASS_NONE 0
+#define REBUILD_IO_CLASS_BEST_EFFORT 2
+#define REBUILD_IO_CLASS_IDLE 3
+
+
 /*
  * The replicationSource structure is used to pass the bits of a connection
  * string to the primary node around in several function calls. All the
@@ -224,20 +283,91 @@ typedef struct IdentifySystem
 typedef struct ReplicationSource
 {
 	NodeAddress primaryNode;
+	NodeAddress backupNode;     /* when the base backup is not from primaryNode */
 	char userName[NAMEDATALEN];
 	char slotName[MAXCONNINFO];
 	char password[MAXCONNINFO];
 	char maximumBackupRate[MAXIMUM_BACKUP_RATE_LEN];
+	char backupCompression[BACKUP_COMPRESSION_LEN];
 	char backupDir[MAXCONNINFO];
+	char restoreCommand[MAXPGPATH]; /* restores a base backup, or empty */
+	char resyncCommand[MAXPGPATH];  /* syncs an existing PGDATA, or empty */
+	char initStateFilename[MAXPGPATH];
 	char applicationName[MAXCONNINFO];
 	char targetLSN[PG_LSN_MAXLENGTH];
 	char targetAction[NAMEDATALEN];
 	char targetTimeline[NAMEDATALEN];
+	int walFetchWorkers;
+	RebuildScheduling scheduling;
+	bool rewindRestoreTargetWal; /* pg_rewind --restore-target-wal */
+	bool rewindNoSync;          /* pg_rewind --no-sync, then syncfs(2) */
+	int64_t rewindCopiedKB;     /* as reported by pg_rewind --progress */
 	SSLOptions sslOptions;
 	IdentifySystem system;
+	bool systemIdentified;      /* system is current for this transition */
 } ReplicationSource;
 
 
+/*
+ * The keeper of a primary node reports the replication progress of its
+ * standbys to the monitor, as Postgres array literals built from
+ * pg_stat_replication, with a standby node id per entry.
+ */
+typedef struct ReplicationStatsReport
+{
+	int count;
+	char standbyIds[BUFSIZE];
+	char sentLSNs[BUFSIZE];
+	char writeLSNs[BUFSIZE];
+	char flushLSNs[BUFSIZE];
+	char replayLSNs[BUFSIZE];
+	char writeLags[BUFSIZE];
+	char flushLags[BUFSIZE];
+	char replayLags[BUFSIZE];
+} ReplicationStatsReport;
+
+/*
+ * The keeper of a primary node also reports how much WAL the replication
+ * slots of its standbys retain, from pg_replication_slots, with a standby
+ * node id per entry.
+ */
+typedef struct ReplicationSlotStatsReport
+{
+	int count;
+	char standbyIds[BUFSIZE];
+	char active[BUFSIZE];
+	char retainedBytes[BUFSIZE];
+	char walStatus[BUFSIZE];
+} ReplicationSlotStatsReport;
+
+/*
+ * The keeper of a primary node also reports the work that a switchover would
+ * have to wait for: the write transactions in progress, and the prepared
+ * transactions. Ages are in milliseconds, and -1 when there's none.
+ */
+typedef struct DrainStats
+{
+	int writeXacts;
+	int64_t oldestWriteXactMs;
+	int preparedXacts;
+	int64_t oldestPreparedXactMs;
+} DrainStats;
+
+/*
+ * The keeper of a standby node samples the status of its WAL receiver from
+ * pg_stat_wal_receiver: the status is empty when no WAL receiver is running,
+ * and the staleness is the time in milliseconds since the last message from
+ * the upstream node, or -1 when unknown. The latest end LSN is the end of WAL
+ * on the upstream node as it last reported it, empty when unknown.
+ */
+typedef struct WalReceiverState
+{
+	char status[NAMEDATALEN];
+	int64_t stalenessMs;
+	char latestEndLSN[PG_LSN_MAXLENGTH];
+} WalReceiverState;
+
+
 /*
  * Arrange a generic way to parse PostgreSQL result from a query. Most of the
  * queries we need here return a single row of a single column, so that's what
@@ -283,6 +413,39 @@ typedef struct SingleValueResultContext
 } SingleValueResultContext;
 
 
+/*
+ * A pipeline is a list of queries that we send to Postgres all at once, and
+ * then read the results of, saving a network round trip per query. With a
+ * libpq that does not implement the pipeline mode (before Postgres 14) the
+ * queries are sent one after the other instead.
+ *
+ * The queries that are queued before a sync point are run in the same
+ * implicit transaction, and when one of them fails the next ones are
+ * skipped, up to the next sync point. Commands that cannot run in a
+ * transaction block, such as ALTER SYSTEM, need a sync point of their own.
+ */
+#define PGSQL_PIPELINE_MAX_QUERIES 8
+
+typedef struct PGSQLPipelineQuery
+{
+	const char *sql;
+	int paramCount;
+	const Oid *paramTypes;
+	const char **paramValues;
+	void *context;
+	ParsePostgresResultCB *parseFun;
+	bool syncAfter;
+	bool succeeded;
+} PGSQLPipelineQuery;
+
+typedef struct PGSQLPipeline
+{
+	PGSQL *pgsql;
+	int count;
+	PGSQLPipelineQuery queries[PGSQL_PIPELINE_MAX_QUERIES];
+} PGSQLPipeline;
+
+
 #define CHECK__SETTINGS_SQL \
 	"select bool_and(ok) " \
 	"from (" \
@@ -318,6 +481,7 @@ void pgsql_set_retry_policy(ConnectionRetryPolicy *retryPolicy,
 void pgsql_set_main_loop_retry_policy(ConnectionRetryPolicy *retryPolicy);
 void pgsql_set_init_retry_policy(ConnectionRetryPolicy *retryPolicy);
 void pgsql_set_interactive_retry_policy(ConnectionRetryPolicy *retryPolicy);
+void pgsql_set_keepalives(int keepalives, int idle, int userTimeout);
 void pgsql_set_monitor_interactive_retry_policy(ConnectionRetryPolicy *retryPolicy);
 int pgsql_compute_connection_retry_sleep_time(ConnectionRetryPolicy *retryPolicy);
 bool pgsql_retry_policy_expired(ConnectionRetryPolicy *retryPolicy);
@@ -332,10 +496,36 @@ bool pgsql_execute(PGSQL *pgsql, const char *sql);
 bool pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 							   const Oid *paramTypes, const char **paramValues,
 							   void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_prepared(PGSQL *pgsql, const char *statementName,
+							const char *sql, int paramCount,
+							const Oid *paramTypes, const char **paramValues,
+							void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_single_row(PGSQL *pgsql, const char *sql, int paramCount,
+							  const Oid *paramTypes, const char **paramValues,
+							  void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_read_only(PGSQL *pgsql, const char *sql, int paramCount,
+							 const Oid *paramTypes, const char **paramValues,
+							 void *parseContext, ParsePostgresResultCB *parseFun);
+void pgsql_log_connections_per_minute(void);
+void pgsql_pipeline_init(PGSQLPipeline *pipeline, PGSQL *pgsql);
+bool pgsql_pipeline_queue(PGSQLPipeline *pipeline, const char *sql,
+						  int paramCount,
+						  const Oid *paramTypes, const char **paramValues,
+						  void *parseContext, ParsePostgresResultCB *parseFun);
+void pgsql_pipeline_sync(PGSQLPipeline *pipeline);
+bool pgsql_pipeline_execute(PGSQLPipeline *pipeline);
+bool pgsql_send_with_params(PGSQL *pgsql, const char *sql, int paramCount,
+							const Oid *paramTypes, const char **paramValues);
+bool pgsql_fetch_async_result(PGSQL *pgsql, bool *done,
+							  void *context, ParsePostgresResultCB *parseFun);
+void pgsql_cancel_query(PGSQL *pgsql);
 bool pgsql_check_postgresql_settings(PGSQL *pgsql, bool isCitusInstanceKind,
 									 bool *settings_are_ok);
 bool pgsql_check_monitor_settings(PGSQL *pgsql, bool *settings_are_ok);
 bool pgsql_is_in_recovery(PGSQL *pgsql, bool *is_in_recovery);
+bool pgsql_standby_settings_can_reload(PGSQL *pgsql, bool *canReload);
+bool pgsql_has_wal_receiver(PGSQL *pgsql, bool *hasWalReceiver);
+bool pgsql_get_replay_lsn(PGSQL *pgsql, char *replayLSN);
 bool pgsql_reload_conf(PGSQL *pgsql);
 bool pgsql_replication_slot_exists(PGSQL *pgsql, const char *slotName,
 								   bool *slotExists);
@@ -345,11 +535,18 @@ bool postgres_sprintf_replicationSlotName(int64_t nodeId, char *slotName, int si
 bool pgsql_set_synchronous_standby_names(PGSQL *pgsql,
 										 char *synchronous_standby_names);
 bool pgsql_replication_slot_create_and_drop(PGSQL *pgsql,
-											NodeAddressArray *nodeArray);
-bool pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray);
+											NodeAddressArray *nodeArray,
+											bool advanceInactiveSlots,
+											int advanceThreshold);
+bool pgsql_replication_slot_maintain(PGSQL *pgsql, NodeAddressArray *nodeArray,
+									 int advanceThreshold);
 bool pgsql_disable_synchronous_replication(PGSQL *pgsql);
 bool pgsql_set_default_transaction_mode_read_only(PGSQL *pgsql);
 bool pgsql_set_default_transaction_mode_read_write(PGSQL *pgsql);
+bool pgsql_get_default_transaction_read_only(PGSQL *pgsql, bool *readOnly);
+bool pgsql_fence_commits(PGSQL *pgsql);
+bool pgsql_get_commits_fenced(PGSQL *pgsql, bool *fenced);
+bool pgsql_terminate_running_sessions(PGSQL *pgsql, int *count);
 bool pgsql_checkpoint(PGSQL *pgsql);
 bool pgsql_get_hba_file_path(PGSQL *pgsql, char *hbaFilePath, int maxPathLength);
 bool pgsql_create_database(PGSQL *pgsql, const char *dbname, const char *owner);
@@ -358,15 +555,41 @@ bool pgsql_create_user(PGSQL *pgsql, const char *userName, const char *password,
 					   bool login, bool superuser, bool replication,
 					   int connlimit);
 bool pgsql_has_replica(PGSQL *pgsql, char *userName, bool *hasReplica);
+bool pgsql_get_replica_reply_age(PGSQL *pgsql, char *userName, int *replyAgeMs);
+bool pgsql_get_standby_replay_lag(PGSQL *pgsql, bool *hasStandby,
+								  uint64_t *lagBytes);
+bool pgsql_get_drain_stats(PGSQL *pgsql, DrainStats *stats);
+bool pgsql_get_replication_stats(PGSQL *pgsql,
+								 ReplicationStatsReport *report);
+bool pgsql_get_replication_slot_stats(PGSQL *pgsql,
+									  int pgControlVersion,
+									  ReplicationSlotStatsReport *report);
+bool pgsql_get_sync_rep_stall(PGSQL *pgsql,
+							  int pgControlVersion,
+							  int replyTimeoutMs,
+							  int *stallMs,
+							  char *streamingStandbyIds,
+							  int size);
+bool pgsql_get_databases_size(PGSQL *pgsql, uint64_t *size);
 bool hostname_from_uri(const char *pguri,
 					   char *hostname, int maxHostLength, int *port);
 bool validate_connection_string(const char *connectionString);
 bool pgsql_reset_primary_conninfo(PGSQL *pgsql);
+bool pgsql_get_restart_settings(PGSQL *pgsql, const char *settingNames,
+								char *restartSettingNames, size_t size);
+bool pgsql_backup_start(PGSQL *pgsql, const char *label);
+bool pgsql_backup_stop(PGSQL *pgsql, char **labelFile, char **tablespaceMap);
 
 bool pgsql_get_postgres_metadata(PGSQL *pgsql,
 								 bool *pg_is_in_recovery,
 								 char *pgsrSyncState, char *currentLSN,
-								 PostgresControlData *control);
+								 PostgresControlData *control,
+								 WalReceiverState *walReceiver);
+bool pgsql_parse_postgres_metadata(PGresult *result,
+								   bool *pg_is_in_recovery,
+								   char *pgsrSyncState, char *currentLSN,
+								   PostgresControlData *control,
+								   WalReceiverState *walReceiver);
 
 bool pgsql_one_slot_has_reached_target_lsn(PGSQL *pgsql,
 										   char *targetLSN,
@@ -375,11 +598,15 @@ bool pgsql_one_slot_has_reached_target_lsn(PGSQL *pgsql,
 bool pgsql_has_reached_target_lsn(PGSQL *pgsql, char *targetLSN,
 								  char *currentLSN, bool *hasReachedLSN);
 bool pgsql_identify_system(PGSQL *pgsql, IdentifySystem *system);
+bool pgsql_stream_wal_segment(PGSQL *pgsql, uint32_t timeline,
+							  uint64_t startLSN, uint64_t size, int fd);
+bool pgsql_get_wal_segment_size(PGSQL *pgsql, uint64_t *size);
 bool pgsql_listen(PGSQL *pgsql, char *channels[]);
 bool pgsql_prepare_to_wait(PGSQL *pgsql);
 
 bool pgsql_alter_extension_update_to(PGSQL *pgsql,
-									 const char *extname, const char *version);
+									 const char *extname, const char *version,
+									 int lockTimeoutMs, bool *lockNotAvailable);
 
 bool parseTimeLineHistory(const char *filename, const char *content,
 						  IdentifySystem *system);
@@ -25,7 +25,11 @@
  *
  * Dynamic code is then used on the target systems to compute better values
  * dynamically for some parameters: work_mem, maintenance_work_mem,
- * effective_cache_size, autovacuum_max_workers.
+ * effective_cache_size, autovacuum_max_workers, and the storage settings
+ * random_page_cost and effective_io_concurrency.
+ *
+ * A NULL value means that we only set the parameter when we computed a value
+ * for it, and otherwise keep the Postgres default.
  */
 GUC postgres_tuning[] = {
 	{ "track_functions", "pl" },
@@ -36,6 +40,8 @@ GUC postgres_tuning[] = {
 	{ "autovacuum_max_workers", "3" },
 	{ "autovacuum_vacuum_scale_factor", "0.08" },
 	{ "autovacuum_analyze_scale_factor", "0.02" },
+	{ "random_page_cost", NULL },
+	{ "effective_io_concurrency", NULL },
 	{ NULL, NULL }
 };
 
@@ -47,6 +53,8 @@ typedef struct DynamicTuning
 	uint64_t work_mem;
 	uint64_t maintenance_work_mem;
 	uint64_t effective_cache_size;
+	double random_page_cost;
+	int effective_io_concurrency;
 } DynamicTuning;
 
 
@@ -57,16 +65,21 @@ void pgtuning_log_settings(DynamicTuning *tuning, int logLevel);
 
 static int pgtuning_compute_max_workers(SystemInfo *sysInfo);
 
+static void pgtuning_compute_storage_settings(StorageType storageType,
+											  DynamicTuning *tuning);
+
 static bool pgtuning_edit_guc_settings(GUC *settings, DynamicTuning *tuning,
 									   char *config, size_t size);
 
 
 /*
  * pgtuning_prepare_guc_settings probes the system information (nCPU and total
- * RAM) and computes some better defaults for Postgres.
+ * RAM, within our cgroup limits, and the storage of pgdata when given) and
+ * computes some better defaults for Postgres.
  */
 bool
-pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
+pgtuning_prepare_guc_settings(GUC *settings, const char *pgdata,
+							  char *config, size_t size)
 {
 	SystemInfo sysInfo = { 0 };
 	DynamicTuning tuning = { 0 };
@@ -84,6 +97,37 @@ pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
 			  sysInfo.ncpu,
 			  totalram);
 
+	if (sysInfo.cgroupMemoryLimit > 0 || sysInfo.cgroupCpuLimit > 0)
+	{
+		char hostram[BUFSIZE] = { 0 };
+
+		(void) pretty_print_bytes(hostram, sizeof(hostram),
+								  sysInfo.hostTotalram);
+
+		log_debug("Using cgroup v%d limits, the host has %d CPUs and %s RAM",
+				  sysInfo.cgroupVersion, sysInfo.hostNcpu, hostram);
+	}
+
+	if (sysInfo.hugePagesTotal > 0)
+	{
+		char hugepages[BUFSIZE] = { 0 };
+
+		(void) pretty_print_bytes(hugepages, sizeof(hugepages),
+								  sysInfo.hugePagesTotal);
+
+		log_debug("Detected a huge pages pool of %s", hugepages);
+	}
+
+	StorageType storageType =
+		IS_EMPTY_STRING_BUFFER(pgdata) ? STORAGE_UNKNOWN
+		: get_storage_type(pgdata);
+
+	if (storageType != STORAGE_UNKNOWN)
+	{
+		log_debug("Detected %s storage for \"%s\"",
+				  storage_type_to_string(storageType), pgdata);
+	}
+
 	/*
 	 * Disable Postgres tuning when running the unit test suite: we install our
 	 * default set of values rather than computing better values for the
@@ -99,6 +143,8 @@ pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size)
 			return false;
 		}
 
+		(void) pgtuning_compute_storage_settings(storageType, &tuning);
+
 		(void) pgtuning_log_settings(&tuning, LOG_DEBUG);
 	}
 
@@ -208,10 +254,71 @@ pgtuning_compute_mem_settings(SystemInfo *sysInfo, DynamicTuning *tuning)
 	 */
 	tuning->effective_cache_size = sysInfo->totalram - tuning->shared_buffers;
 
+	/*
+	 * Memory reserved for huge pages is not available for anything else, so
+	 * when an operator has reserved a pool that is smaller than what we
+	 * computed, we size shared_buffers so that Postgres can use it, leaving
+	 * some room for the other shared memory areas. That memory is not part of
+	 * the file system cache either.
+	 */
+	if (sysInfo->hugePagesTotal > 0)
+	{
+		uint64_t hugePagesBuffers = sysInfo->hugePagesTotal / 10 * 9;
+
+		if (hugePagesBuffers < tuning->shared_buffers)
+		{
+			tuning->shared_buffers = hugePagesBuffers;
+		}
+
+		if (sysInfo->hugePagesTotal < sysInfo->totalram)
+		{
+			tuning->effective_cache_size =
+				sysInfo->totalram - sysInfo->hugePagesTotal;
+		}
+	}
+
 	return true;
 }
 
 
+/*
+ * pgtuning_compute_storage_settings adjusts the planner cost of random reads
+ * and the prefetching depth of bitmap heap scans to the storage of pgdata.
+ * Solid state devices have about the same cost for random and sequential
+ * reads, and NVMe devices handle deep queues.
+ *
+ * When we don't know, we keep the Postgres defaults, which are meant for
+ * rotational disks.
+ */
+static void
+pgtuning_compute_storage_settings(StorageType storageType,
+								  DynamicTuning *tuning)
+{
+	switch (storageType)
+	{
+		case STORAGE_SSD:
+		{
+			tuning->random_page_cost = 1.1;
+			tuning->effective_io_concurrency = 200;
+			break;
+		}
+
+		case STORAGE_NVME:
+		{
+			tuning->random_page_cost = 1.1;
+			tuning->effective_io_concurrency = 256;
+			break;
+		}
+
+		default:
+		{
+			/* keep the Postgres defaults */
+			break;
+		}
+	}
+}
+
+
 /*
  * pgtuning_log_mem_settings logs the memory settings we computed.
  */
@@ -237,6 +344,18 @@ pgtuning_log_settings(DynamicTuning *tuning, int logLevel)
 	(void) pretty_print_bytes(buf, sizeof(buf),
 							  tuning->effective_cache_size);
 	log_level(logLevel, "Setting effective_cache_size to %s", buf);
+
+	if (tuning->random_page_cost > 0)
+	{
+		log_level(logLevel, "Setting random_page_cost to %g",
+				  tuning->random_page_cost);
+	}
+
+	if (tuning->effective_io_concurrency > 0)
+	{
+		log_level(logLevel, "Setting effective_io_concurrency to %d",
+				  tuning->effective_io_concurrency);
+	}
 }
 
 
@@ -356,6 +475,24 @@ pgtuning_edit_guc_settings(GUC *settings, DynamicTuning *tuning,
 								  setting->name, setting->value);
 			}
 		}
+		else if (streq(setting->name, "random_page_cost"))
+		{
+			if (tuning->random_page_cost > 0)
+			{
+				appendPQExpBuffer(contents, "%s = %g\n",
+								  setting->name,
+								  tuning->random_page_cost);
+			}
+		}
+		else if (streq(setting->name, "effective_io_concurrency"))
+		{
+			if (tuning->effective_io_concurrency > 0)
+			{
+				appendPQExpBuffer(contents, "%s = %d\n",
+								  setting->name,
+								  tuning->effective_io_concurrency);
+			}
+		}
 		else
 		{
 			appendPQExpBuffer(contents, "%s = %s\n",
@@ -14,6 +14,7 @@
 
 extern GUC postgres_tuning[];
 
-bool pgtuning_prepare_guc_settings(GUC *settings, char *config, size_t size);
+bool pgtuning_prepare_guc_settings(GUC *settings, const char *pgdata,
+								   char *config, size_t size);
 
 #endif /* PGTUNING_H */
@@ -7,6 +7,19 @@
  *
  */
 
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/syscall.h>
+#else
+#include <sys/types.h>
+#include <sys/param.h>
+#endif
+
+#if defined(__APPLE__) || defined(BSD)
+#include <sys/event.h>
+#endif
+
+#include <errno.h>
 #include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
@@ -33,11 +46,17 @@
 #include "state.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "system_utils.h"
 
 /* pidfile for this process */
 char service_pidfile[MAXPGPATH] = { 0 };
 
+/* how often we check if a process is still running, when we have to */
+#define PROCESS_EXIT_POLL_INTERVAL_MS 100
+
 static void remove_service_pidfile_atexit(void);
+static int64_t monotonic_time_ms(void);
+static int wait_for_process_exit_notification(pid_t pid, int64_t deadline);
 
 /*
  * create_pidfile writes our pid in a file.
@@ -342,7 +361,8 @@ read_service_pidfile_version_strings(const char *pidfile,
  *
  * When includeStatus is true, add a "status" entry for each PID (main service
  * and sub-processes) with either "running" or "stale" as a value, depending on
- * what a kill -0 reports.
+ * what a kill -0 reports, and an "rss" entry with the resident memory of the
+ * running processes, in bytes, where the platform allows.
  */
 void
 pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
@@ -380,7 +400,14 @@ pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
 			{
 				if (kill(pidnum, 0) == 0)
 				{
+					uint64_t rss = 0;
+
 					json_object_set_string(jsobj, "status", "running");
+
+					if (get_process_rss(pidnum, &rss))
+					{
+						json_object_set_number(jsobj, "rss", (double) rss);
+					}
 				}
 				else
 				{
@@ -457,7 +484,15 @@ pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus)
 				{
 					if (kill(pidnum, 0) == 0)
 					{
+						uint64_t rss = 0;
+
 						json_object_set_string(jsServiceObj, "status", "running");
+
+						if (get_process_rss(pidnum, &rss))
+						{
+							json_object_set_number(jsServiceObj, "rss",
+												   (double) rss);
+						}
 					}
 					else
 					{
@@ -513,23 +548,16 @@ wait_for_pid_to_exit(const char *pidfile, int timeout, pid_t *pid)
 			log_info("An instance of pg_autoctl is running with PID %d, "
 					 "waiting for it to stop.", *pid);
 
-			int timeout_counter = timeout;
-
-			while (timeout_counter > 0)
+			if (!wait_for_process_exit(*pid, timeout * 1000))
 			{
-				if (kill(*pid, 0) == -1 && errno == ESRCH)
-				{
-					log_info("The pg_autoctl instance with pid %d "
-							 "has now terminated.",
-							 *pid);
-					break;
-				}
-
-				sleep(1);
-				--timeout_counter;
+				return false;
 			}
 
-			return timeout_counter > 0;
+			log_info("The pg_autoctl instance with pid %d "
+					 "has now terminated.",
+					 *pid);
+
+			return true;
 		}
 		else
 		{
@@ -543,3 +571,164 @@ wait_for_pid_to_exit(const char *pidfile, int timeout, pid_t *pid)
 		return true;
 	}
 }
+
+
+/*
+ * wait_for_process_exit waits for at most timeoutMs milliseconds until the
+ * given process is not running anymore, and returns true when it has exited.
+ *
+ * We are notified of the exit right away with a pidfd on Linux (5.3 and
+ * later), and with kqueue on BSD and macOS. Elsewhere we check if the process
+ * is still running every PROCESS_EXIT_POLL_INTERVAL_MS.
+ */
+bool
+wait_for_process_exit(pid_t pid, int timeoutMs)
+{
+	int64_t deadline = monotonic_time_ms() + timeoutMs;
+
+	if (kill(pid, 0) == -1 && errno == ESRCH)
+	{
+		return true;
+	}
+
+	int notified = wait_for_process_exit_notification(pid, deadline);
+
+	if (notified >= 0)
+	{
+		return notified == 1;
+	}
+
+	for (;;)
+	{
+		if (kill(pid, 0) == -1 && errno == ESRCH)
+		{
+			return true;
+		}
+
+		int64_t remaining = deadline - monotonic_time_ms();
+
+		if (remaining <= 0)
+		{
+			return false;
+		}
+
+		pg_usleep(Min(remaining, PROCESS_EXIT_POLL_INTERVAL_MS) * 1000L);
+	}
+}
+
+
+/*
+ * wait_for_processes_exit waits for at most timeoutMs milliseconds until all
+ * the given processes are not running anymore, and returns true when they
+ * have all exited. A pid of zero is skipped.
+ */
+bool
+wait_for_processes_exit(pid_t *pids, int count, int timeoutMs)
+{
+	int64_t deadline = monotonic_time_ms() + timeoutMs;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (pids[i] <= 0)
+		{
+			continue;
+		}
+
+		int64_t remaining = deadline - monotonic_time_ms();
+
+		if (!wait_for_process_exit(pids[i], (int) Max(remaining, 0)))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * monotonic_time_ms returns the current time of the monotonic clock, in
+ * milliseconds.
+ */
+static int64_t
+monotonic_time_ms(void)
+{
+	struct timespec now = { 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * wait_for_process_exit_notification asks the kernel to notify us when the
+ * given process exits, and waits for that until the deadline. It returns 1
+ * when the process has exited, 0 at the deadline, and -1 when the platform
+ * can't notify us, in which case the caller has to poll.
+ */
+static int
+wait_for_process_exit_notification(pid_t pid, int64_t deadline)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+	if (pidfd < 0)
+	{
+		/* ESRCH: the process has already exited */
+		return errno == ESRCH ? 1 : -1;
+	}
+
+	struct pollfd pollFd = { pidfd, POLLIN, 0 };
+	int result = 0;
+
+	do {
+		int64_t remaining = Max(deadline - monotonic_time_ms(), 0);
+
+		result = poll(&pollFd, 1, (int) remaining);
+	} while (result < 0 && errno == EINTR);
+
+	close(pidfd);
+
+	return result < 0 ? -1 : (result > 0 ? 1 : 0);
+#elif defined(__APPLE__) || defined(BSD)
+	struct kevent change;
+	struct kevent event;
+	int result = 0;
+
+	int kq = kqueue();
+
+	if (kq < 0)
+	{
+		return -1;
+	}
+
+	EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+
+	if (kevent(kq, &change, 1, NULL, 0, NULL) < 0)
+	{
+		int registerErrno = errno;
+
+		close(kq);
+
+		/* ESRCH: the process has already exited */
+		return registerErrno == ESRCH ? 1 : -1;
+	}
+
+	do {
+		int64_t remaining = Max(deadline - monotonic_time_ms(), 0);
+		struct timespec timeout = {
+			.tv_sec = remaining / 1000,
+			.tv_nsec = (remaining % 1000) * 1000000
+		};
+
+		result = kevent(kq, NULL, 0, &event, 1, &timeout);
+	} while (result < 0 && errno == EINTR);
+
+	close(kq);
+
+	return result < 0 ? -1 : (result > 0 ? 1 : 0);
+#else
+	return -1;
+#endif
+}
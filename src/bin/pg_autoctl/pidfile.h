@@ -68,5 +68,7 @@ void check_pidfile(const char *pidfile, pid_t start_pid);
 void pidfile_as_json(JSON_Value *js, const char *pidfile, bool includeStatus);
 
 bool wait_for_pid_to_exit(const char *pidfile, int timeout, pid_t *pid);
+bool wait_for_process_exit(pid_t pid, int timeoutMs);
+bool wait_for_processes_exit(pid_t *pids, int count, int timeoutMs);
 
 #endif /* PIDFILE_H */
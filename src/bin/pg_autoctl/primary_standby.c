@@ -13,7 +13,9 @@
 #include "postgres_fe.h"
 
 #include "config.h"
+#include "controlfile.h"
 #include "file_utils.h"
+#include "fsm_timings.h"
 #include "keeper.h"
 #include "log.h"
 #include "parsing.h"
@@ -23,9 +25,15 @@
 #include "primary_standby.h"
 #include "signals.h"
 #include "state.h"
+#include "supervisor.h"
 
 
 static bool local_postgres_wait_until_ready(LocalPostgresServer *postgres);
+static void local_postgres_notify_controller(LocalPostgresServer *postgres);
+static bool standby_prefetch_missing_wal(LocalPostgresServer *postgres);
+static bool standby_reload_replication_source(LocalPostgresServer *postgres,
+											  bool *reloaded);
+static void primary_prepare_rewind(LocalPostgresServer *postgres);
 
 static void local_postgres_update_pg_failures_tracking(LocalPostgresServer *postgres,
 													   bool pgIsRunning);
@@ -47,6 +55,7 @@ static void local_postgres_update_pg_failures_tracking(LocalPostgresServer *post
 	{ "wal_level", "'replica'" }, \
 	{ "wal_log_hints", "on" }, \
 	{ "wal_sender_timeout", "'30s'" }, \
+	{ "wal_receiver_status_interval", "'1s'" }, \
 	{ "hot_standby_feedback", "on" }, \
 	{ "hot_standby", "on" }, \
 	{ "synchronous_commit", "on" }, \
@@ -121,6 +130,7 @@ local_postgres_init(LocalPostgresServer *postgres, PostgresSetup *pgSetup)
 	/* reset PostgreSQL restart failures tracking */
 	postgres->pgFirstStartFailureTs = 0;
 	postgres->pgStartRetries = 0;
+	postgres->crashRecoveryWalBytes = -1;
 
 	/* set the local instance kind from the configuration. */
 	postgres->pgKind = pgSetup->pgKind;
@@ -214,6 +224,7 @@ local_postgres_update_pg_failures_tracking(LocalPostgresServer *postgres,
 		/* reset PostgreSQL restart failures tracking */
 		postgres->pgFirstStartFailureTs = 0;
 		postgres->pgStartRetries = 0;
+		postgres->crashRecoveryWalBytes = -1;
 		postgres->pgIsRunning = true;
 	}
 	else
@@ -230,6 +241,53 @@ local_postgres_update_pg_failures_tracking(LocalPostgresServer *postgres,
 }
 
 
+/*
+ * local_postgres_estimate_crash_recovery sets walBytes to the amount of WAL
+ * that Postgres has to replay before it accepts connections again: from the
+ * redo location of the last checkpoint to the end of WAL. That's zero when
+ * Postgres has been shut down cleanly.
+ */
+bool
+local_postgres_estimate_crash_recovery(LocalPostgresServer *postgres,
+									   uint64_t *walBytes)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	bool missingPgdataIsOk = false;
+	uint64_t redoLSN = 0;
+	uint64_t walEndLSN = 0;
+
+	if (!pg_controldata(pgSetup, missingPgdataIsOk))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (pgSetup->control.state != DB_IN_PRODUCTION &&
+		pgSetup->control.state != DB_IN_CRASH_RECOVERY)
+	{
+		*walBytes = 0;
+		return true;
+	}
+
+	if (!parseLSN(pgSetup->control.latestCheckpointRedoLSN, &redoLSN))
+	{
+		log_error("Failed to parse the checkpoint redo location \"%s\"",
+				  pgSetup->control.latestCheckpointRedoLSN);
+		return false;
+	}
+
+	if (!controlfile_wal_end_lsn(pgSetup->pgdata, &walEndLSN))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*walBytes = walEndLSN > redoLSN ? walEndLSN - redoLSN : 0;
+
+	return true;
+}
+
+
 /*
  * local_postgres_finish closes our connection to the local PostgreSQL
  * server, if needs be.
@@ -287,9 +345,15 @@ local_postgres_wait_until_ready(LocalPostgresServer *postgres)
 
 	if (!pgIsRunning)
 	{
+		instr_time start;
+
+		(void) fsm_timing_step_start(&start);
+
 		/* main logging is done in the Postgres controller sub-process */
 		pgIsRunning = pg_setup_wait_until_is_ready(pgSetup, timeout, LOG_DEBUG);
 
+		(void) fsm_timing_step_done("postgres start", &start);
+
 		/* update connection string for connection to postgres */
 		(void)
 		local_postgres_update_pg_failures_tracking(postgres, pgIsRunning);
@@ -297,6 +361,7 @@ local_postgres_wait_until_ready(LocalPostgresServer *postgres)
 		if (pgIsRunning)
 		{
 			/* update pgSetup cache with new Postgres pid and all */
+			local_postgres_finish(postgres);
 			local_postgres_init(postgres, pgSetup);
 
 			log_debug("local_postgres_wait_until_ready: Postgres is running "
@@ -323,6 +388,7 @@ bool
 ensure_postgres_service_is_running(LocalPostgresServer *postgres)
 {
 	LocalExpectedPostgresStatus *pgStatus = &(postgres->expectedPgStatus);
+	ExpectedPostgresStatus previous = pgStatus->state.pgExpectedStatus;
 
 	/* update our data structure in-memory, then on-disk */
 	if (!keeper_set_postgres_state_running(&(pgStatus->state),
@@ -332,6 +398,11 @@ ensure_postgres_service_is_running(LocalPostgresServer *postgres)
 		return false;
 	}
 
+	if (previous != pgStatus->state.pgExpectedStatus)
+	{
+		(void) local_postgres_notify_controller(postgres);
+	}
+
 	return local_postgres_wait_until_ready(postgres);
 }
 
@@ -349,6 +420,8 @@ ensure_postgres_service_is_running_as_subprocess(LocalPostgresServer *postgres)
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	LocalExpectedPostgresStatus *pgStatus = &(postgres->expectedPgStatus);
 
+	ExpectedPostgresStatus previous = pgStatus->state.pgExpectedStatus;
+
 	bool pgIsRunning = pg_is_running(pgSetup->pg_ctl, pgSetup->pgdata);
 
 	/* update our data structure in-memory, then on-disk */
@@ -359,6 +432,11 @@ ensure_postgres_service_is_running_as_subprocess(LocalPostgresServer *postgres)
 		return false;
 	}
 
+	if (previous != pgStatus->state.pgExpectedStatus)
+	{
+		(void) local_postgres_notify_controller(postgres);
+	}
+
 	/*
 	 * If Postgres was already running before we wrote a new expected status
 	 * file, then the Postgres controller might be up to stop and then restart
@@ -389,8 +467,10 @@ ensure_postgres_service_is_stopped(LocalPostgresServer *postgres)
 {
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	LocalExpectedPostgresStatus *pgStatus = &(postgres->expectedPgStatus);
+	ExpectedPostgresStatus previous = pgStatus->state.pgExpectedStatus;
 
 	int timeout = 10;       /* wait for Postgres for 10s */
+	instr_time start;
 
 	log_trace("keeper_ensure_postgres_is_stopped");
 
@@ -402,7 +482,54 @@ ensure_postgres_service_is_stopped(LocalPostgresServer *postgres)
 		return false;
 	}
 
-	return pg_setup_wait_until_is_stopped(pgSetup, timeout, LOG_DEBUG);
+	if (previous != pgStatus->state.pgExpectedStatus)
+	{
+		(void) local_postgres_notify_controller(postgres);
+	}
+
+	(void) fsm_timing_step_start(&start);
+
+	bool stopped = pg_setup_wait_until_is_stopped(pgSetup, timeout, LOG_DEBUG);
+
+	(void) fsm_timing_step_done("postgres stop", &start);
+
+	return stopped;
+}
+
+
+/*
+ * local_postgres_notify_controller wakes up the Postgres controller service
+ * after we changed the expected Postgres status, so that it acts on the new
+ * status now rather than at its next polling interval.
+ *
+ * The controller still reads the expected status file regularly, so failing
+ * to signal it is not an error: we only lose the latency improvement.
+ */
+static void
+local_postgres_notify_controller(LocalPostgresServer *postgres)
+{
+	LocalExpectedPostgresStatus *pgStatus = &(postgres->expectedPgStatus);
+
+	char pidfile[MAXPGPATH] = { 0 };
+	pid_t pid = 0;
+
+	/* the pidfile lives in the same runtime directory as pg_autoctl.pg */
+	(void) path_in_same_directory(pgStatus->pgStatusPath,
+								  KEEPER_PID_FILENAME,
+								  pidfile);
+
+	if (!supervisor_find_service_pid(pidfile, SERVICE_NAME_POSTGRES, &pid) ||
+		pid <= 0)
+	{
+		log_debug("Failed to find the Postgres controller pid in \"%s\"",
+				  pidfile);
+		return;
+	}
+
+	if (kill(pid, SIGURG) != 0)
+	{
+		log_debug("Failed to signal the Postgres controller pid %d: %m", pid);
+	}
 }
 
 
@@ -424,6 +551,25 @@ primary_has_replica(LocalPostgresServer *postgres, char *userName, bool *hasStan
 }
 
 
+/*
+ * primary_get_replica_reply_age returns how long ago in milliseconds the local
+ * postgres server received a reply from any of its replicas, or -1.
+ */
+bool
+primary_get_replica_reply_age(LocalPostgresServer *postgres, char *userName,
+							  int *replyAgeMs)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+
+	log_trace("primary_get_replica_reply_age");
+
+	bool result = pgsql_get_replica_reply_age(pgsql, userName, replyAgeMs);
+
+	pgsql_finish(pgsql);
+	return result;
+}
+
+
 /*
  * upstream_has_replication_slot checks whether the upstream server already has
  * created our replication slot.
@@ -472,6 +618,48 @@ upstream_has_replication_slot(ReplicationSource *upstream,
 }
 
 
+/*
+ * upstream_get_databases_size connects to the upstream server and computes
+ * the size of its databases.
+ */
+bool
+upstream_get_databases_size(ReplicationSource *upstream,
+							PostgresSetup *pgSetup,
+							uint64_t *size)
+{
+	NodeAddress *primaryNode = &(upstream->primaryNode);
+
+	PostgresSetup upstreamSetup = { 0 };
+	PGSQL upstreamClient = { 0 };
+	char connectionString[MAXCONNINFO] = { 0 };
+
+	/* prepare a PostgresSetup that allows preparing a connection string */
+	strlcpy(upstreamSetup.username, PG_AUTOCTL_REPLICA_USERNAME, NAMEDATALEN);
+	strlcpy(upstreamSetup.dbname, pgSetup->dbname, NAMEDATALEN);
+	strlcpy(upstreamSetup.pghost, primaryNode->host, _POSIX_HOST_NAME_MAX);
+	upstreamSetup.pgport = primaryNode->port;
+	upstreamSetup.ssl = pgSetup->ssl;
+
+	pg_setup_get_local_connection_string(&upstreamSetup, connectionString);
+
+	if (!pgsql_init(&upstreamClient, connectionString, PGSQL_CONN_UPSTREAM))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_get_databases_size(&upstreamClient, size))
+	{
+		/* errors have already been logged */
+		PQfinish(upstreamClient.connection);
+		return false;
+	}
+
+	PQfinish(upstreamClient.connection);
+	return true;
+}
+
+
 /*
  * primary_create_replication_slot (re)creates a replication slot. The
  * replication slot will not have its LSN initialized until first use. The
@@ -515,16 +703,25 @@ primary_drop_replication_slot(LocalPostgresServer *postgres,
  * postgres_replication_slot_create_and_drop drops the replication slots that
  * belong to dropped nodes on a primary server, and creates replication slots
  * for newly created nodes on the monitor.
+ *
+ * Standby nodes that cascade from another standby node don't use their slot
+ * on the primary, so we advance the inactive slots to the LSN that their
+ * node reported, when Postgres allows it, rather than keep WAL for them.
  */
 bool
 postgres_replication_slot_create_and_drop(LocalPostgresServer *postgres,
-										  NodeAddressArray *nodeArray)
+										  NodeAddressArray *nodeArray,
+										  int advanceThreshold)
 {
 	PGSQL *pgsql = &(postgres->sqlClient);
+	bool advanceInactiveSlots =
+		postgres->postgresSetup.control.pg_control_version >= 1100;
 
 	log_trace("postgres_replication_slot_drop_removed");
 
-	bool result = pgsql_replication_slot_create_and_drop(pgsql, nodeArray);
+	bool result = pgsql_replication_slot_create_and_drop(pgsql, nodeArray,
+														 advanceInactiveSlots,
+														 advanceThreshold);
 
 	pgsql_finish(pgsql);
 	return result;
@@ -533,17 +730,20 @@ postgres_replication_slot_create_and_drop(LocalPostgresServer *postgres,
 
 /*
  * postgres_replication_slot_advance advances the current confirmed position of
- * the given replication slot up to the given LSN position.
+ * the given replication slot up to the given LSN position, unless the slot
+ * is behind by less than advanceThreshold bytes.
  */
 bool
 postgres_replication_slot_maintain(LocalPostgresServer *postgres,
-								   NodeAddressArray *nodeArray)
+								   NodeAddressArray *nodeArray,
+								   int advanceThreshold)
 {
 	PGSQL *pgsql = &(postgres->sqlClient);
 
 	log_trace("postgres_replication_slot_maintain");
 
-	bool result = pgsql_replication_slot_maintain(pgsql, nodeArray);
+	bool result = pgsql_replication_slot_maintain(pgsql, nodeArray,
+												  advanceThreshold);
 
 	pgsql_finish(pgsql);
 	return result;
@@ -716,7 +916,7 @@ primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 		return false;
 	}
 
-	if (!pgsql_reload_conf(pgsql))
+	if (!pg_reload_conf(&(postgres->postgresSetup), pgsql))
 	{
 		log_error("Failed to reload pg_hba settings after updating pg_hba.conf");
 		return false;
@@ -754,6 +954,91 @@ primary_create_replication_user(LocalPostgresServer *postgres,
 }
 
 
+/*
+ * primary_create_node_users creates the users that a new primary node needs:
+ * the user that the monitor uses for health checks, when a monitorHostname
+ * is given, and the replication user. That's the same as calling
+ * primary_create_user_with_hba and primary_create_replication_user, using a
+ * single connection and a single configuration reload.
+ *
+ * We forcibly use the authentication method "trust" for the health check
+ * user, see fsm_init_primary.
+ */
+bool
+primary_create_node_users(LocalPostgresServer *postgres,
+						  char *monitorHostname,
+						  char *replicationPassword,
+						  HBAEditLevel hbaLevel)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	char hbaFilePath[MAXPGPATH];
+
+	log_trace("primary_create_node_users");
+
+	if (monitorHostname != NULL)
+	{
+		bool login = true;
+		bool superuser = false;
+		bool replication = false;
+		int connlimit = 1;
+
+		if (!pgsql_create_user(pgsql,
+							   PG_AUTOCTL_HEALTH_USERNAME,
+							   PG_AUTOCTL_HEALTH_PASSWORD,
+							   login, superuser, replication, connlimit))
+		{
+			log_error("Failed to create user \"%s\" on local postgres server",
+					  PG_AUTOCTL_HEALTH_USERNAME);
+			return false;
+		}
+
+		if (!pgsql_get_hba_file_path(pgsql, hbaFilePath, MAXPGPATH))
+		{
+			log_error("Failed to set the pg_hba rule for user \"%s\": "
+					  "couldn't get hba_file from local postgres server",
+					  PG_AUTOCTL_HEALTH_USERNAME);
+			return false;
+		}
+
+		if (!pghba_ensure_host_rule_exists(hbaFilePath,
+										   postgres->postgresSetup.ssl.active,
+										   HBA_DATABASE_ALL,
+										   NULL,
+										   PG_AUTOCTL_HEALTH_USERNAME,
+										   monitorHostname,
+										   "trust",
+										   hbaLevel))
+		{
+			log_error("Failed to set the pg_hba rule for user \"%s\"",
+					  PG_AUTOCTL_HEALTH_USERNAME);
+			return false;
+		}
+	}
+
+	/* same privileges as in primary_create_replication_user */
+	if (!pgsql_create_user(pgsql, PG_AUTOCTL_REPLICA_USERNAME,
+
+	                       /* password, login, superuser, replication, connlimit */
+						   replicationPassword, true, true, true, -1))
+	{
+		log_error("Failed to create user \"%s\" on local postgres server",
+				  PG_AUTOCTL_REPLICA_USERNAME);
+		return false;
+	}
+
+	if (monitorHostname != NULL &&
+		!pg_reload_conf(&(postgres->postgresSetup), pgsql))
+	{
+		log_error("Failed to reload pg_hba settings after updating pg_hba.conf");
+		return false;
+	}
+
+	pgsql_finish(pgsql);
+
+	return true;
+}
+
+
 /*
  * standby_init_replication_source initializes a replication source structure
  * with given arguments. If the upstreamNode is NULL, then the
@@ -789,6 +1074,12 @@ standby_init_replication_source(LocalPostgresServer *postgres,
 		upstream->primaryNode.port = upstreamNode->port;
 	}
 
+	/* by default, the base backup is taken from the upstream node */
+	upstream->backupNode = (NodeAddress) { 0 };
+
+	/* the upstream node might have changed, IDENTIFY_SYSTEM again */
+	upstream->systemIdentified = false;
+
 	strlcpy(upstream->userName, username, NAMEDATALEN);
 
 	if (password != NULL)
@@ -820,117 +1111,373 @@ standby_init_replication_source(LocalPostgresServer *postgres,
 
 
 /*
- * standby_init_database tries to initialize PostgreSQL as a hot standby. It uses
- * pg_basebackup to do so. Returns false on failure.
+ * standby_delta_resync brings an existing PGDATA in line with the data files
+ * of the upstream node using the replication.delta_resync_command, such as
+ * rsync --checksum over SSH, which only copies the files that differ. That's
+ * much faster than pg_basebackup when rewinding is not possible but most of
+ * the data files are the same.
+ *
+ * The command runs while a non-exclusive base backup is in progress on the
+ * upstream node, so that we get the backup_label file that Postgres needs to
+ * replay the WAL written meanwhile, which it streams from our replication
+ * slot. Then the caller completes the setup with standby_init_database and
+ * skipBaseBackup.
  */
 bool
-standby_init_database(LocalPostgresServer *postgres,
-					  const char *hostname,
-					  bool skipBaseBackup)
+standby_delta_resync(LocalPostgresServer *postgres)
 {
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	ReplicationSource *upstream = &(postgres->replicationSource);
+	NodeAddress *primaryNode = &(upstream->primaryNode);
 
-	log_trace("standby_init_database");
-	log_info("Initialising PostgreSQL as a hot standby");
+	PostgresSetup upstreamSetup = { 0 };
+	PGSQL upstreamClient = { 0 };
+	char connectionString[MAXCONNINFO] = { 0 };
 
-	if (pg_setup_pgdata_exists(pgSetup) && pg_setup_is_running(pgSetup))
-	{
-		log_info("Target directory exists: \"%s\", stopping PostgreSQL",
-				 pgSetup->pgdata);
+	char *labelFile = NULL;
+	char *tablespaceMap = NULL;
 
-		/* try to stop PostgreSQL, stop here if that fails */
-		if (!ensure_postgres_service_is_stopped(postgres))
-		{
-			log_error("Failed to initialize a standby: "
-					  "the database directory exists "
-					  "and postgres could not be stopped");
-			return false;
-		}
+	if (IS_EMPTY_STRING_BUFFER(upstream->resyncCommand) ||
+		!pg_setup_pgdata_exists(pgSetup))
+	{
+		return false;
 	}
 
-	/*
-	 * Now, we know that pgdata either doesn't exists or belongs to a stopped
-	 * PostgreSQL instance. We can safely proceed with pg_basebackup.
-	 *
-	 * We might be asked to skip pg_basebackup when the PGDATA directory has
-	 * already been prepared externally: typically we are creating a standby
-	 * node and it was faster to install PGDATA from a file system snapshot or
-	 * a backup/recovery tooling.
-	 */
-	if (skipBaseBackup)
+	log_info("Resyncing \"%s\" with the data files of node " NODE_FORMAT,
+			 pgSetup->pgdata,
+			 primaryNode->nodeId,
+			 primaryNode->name,
+			 primaryNode->host,
+			 primaryNode->port);
+
+	if (pg_setup_is_running(pgSetup) &&
+		!ensure_postgres_service_is_stopped(postgres))
 	{
-		log_info("Skipping base backup to use pre-existing PGDATA at \"%s\"",
-				 pgSetup->pgdata);
+		log_error("Failed to stop Postgres before resyncing its data files");
+		return false;
 	}
-	else
+
+	/* Postgres streams the WAL written during the resync from our slot */
+	if (!IS_EMPTY_STRING_BUFFER(upstream->slotName))
 	{
-		/*
-		 * pg_basebackup has this bug where it will copy over the whole PGDATA
-		 * contents even if the WAL receiver subprocess fails early, typically
-		 * when the replication slot does not exists on the target connection.
-		 *
-		 * We want to protect against this case here, so we manually check that
-		 * the replication exists before calling pg_basebackup.
-		 */
 		bool hasReplicationSlot = false;
 
-		/*
-		 * When initialising from another standby (in REPORT_LSN, if there is
-		 * currently no primary node and no candidate node either), we don't
-		 * require a replication slot on the upstream node.
-		 */
-		bool needsReplicationSlot = !IS_EMPTY_STRING_BUFFER(upstream->slotName);
-
-		if (needsReplicationSlot &&
-			!upstream_has_replication_slot(upstream,
-										   pgSetup,
+		if (!upstream_has_replication_slot(upstream, pgSetup,
 										   &hasReplicationSlot))
 		{
 			/* errors have already been logged */
 			return false;
 		}
 
-		if (!needsReplicationSlot || hasReplicationSlot)
-		{
-			/* first, make sure we can connect with "replication" */
-			if (!pgctl_identify_system(upstream))
-			{
-				log_error("Failed to connect to the primary with a replication "
-						  "connection string. See above for details");
-				return false;
-			}
-
-			/* now pg_basebackup from our upstream node */
-			if (!pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, upstream))
-			{
-				return false;
-			}
-		}
-		else
+		if (!hasReplicationSlot)
 		{
 			log_error("The replication slot \"%s\" has not been created yet "
 					  "on the primary node " NODE_FORMAT,
 					  upstream->slotName,
-					  upstream->primaryNode.nodeId,
-					  upstream->primaryNode.name,
-					  upstream->primaryNode.host,
-					  upstream->primaryNode.port);
+					  primaryNode->nodeId,
+					  primaryNode->name,
+					  primaryNode->host,
+					  primaryNode->port);
 			return false;
 		}
 	}
 
-	/* we have a new PGDATA, update our pgSetup information */
-	if (!local_postgres_update(postgres, true))
+	/* connect to the upstream node as in upstream_has_replication_slot */
+	strlcpy(upstreamSetup.username, PG_AUTOCTL_REPLICA_USERNAME, NAMEDATALEN);
+	strlcpy(upstreamSetup.dbname, pgSetup->dbname, NAMEDATALEN);
+	strlcpy(upstreamSetup.pghost, primaryNode->host, _POSIX_HOST_NAME_MAX);
+	upstreamSetup.pgport = primaryNode->port;
+	upstreamSetup.ssl = pgSetup->ssl;
+
+	pg_setup_get_local_connection_string(&upstreamSetup, connectionString);
+
+	if (!pgsql_init(&upstreamClient, connectionString, PGSQL_CONN_UPSTREAM))
 	{
-		log_error("Failed to update our internal Postgres representation "
-				  "after pg_basebackup, see above for details");
+		/* errors have already been logged */
 		return false;
 	}
 
-	/* now setup the replication configuration (primary_conninfo etc) */
-	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
-							   pgSetup->pgdata,
+	/* the backup must be stopped in the session that started it */
+	upstreamClient.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	if (!pgsql_backup_start(&upstreamClient, "pg_auto_failover delta resync"))
+	{
+		log_error("Failed to start a base backup on the upstream node");
+		pgsql_finish(&upstreamClient);
+		return false;
+	}
+
+	instr_time start;
+
+	(void) fsm_timing_step_start(&start);
+
+	bool success = pg_run_backup_command(upstream->resyncCommand,
+										 "replication.delta_resync_command",
+										 pgSetup->pgdata,
+										 upstream);
+
+	(void) fsm_timing_step_done("delta resync", &start);
+
+	/* always stop the backup, even when the command failed */
+	if (!pgsql_backup_stop(&upstreamClient, &labelFile, &tablespaceMap))
+	{
+		log_error("Failed to stop the base backup on the upstream node");
+		success = false;
+	}
+
+	pgsql_finish(&upstreamClient);
+
+	if (!success)
+	{
+		free(labelFile);
+		free(tablespaceMap);
+		return false;
+	}
+
+	/*
+	 * Our own WAL files belong to the history we are leaving, Postgres gets
+	 * the WAL it needs from the upstream node.
+	 */
+	char walDir[MAXPGPATH] = { 0 };
+	char archiveStatusDir[MAXPGPATH] = { 0 };
+	char labelPath[MAXPGPATH] = { 0 };
+	char mapPath[MAXPGPATH] = { 0 };
+
+	join_path_components(walDir, pgSetup->pgdata, "pg_wal");
+	join_path_components(archiveStatusDir, walDir, "archive_status");
+	join_path_components(labelPath, pgSetup->pgdata, "backup_label");
+	join_path_components(mapPath, pgSetup->pgdata, "tablespace_map");
+
+	if (directory_exists(walDir) && !rmtree(walDir, false))
+	{
+		log_error("Failed to remove the contents of \"%s\": %m", walDir);
+		free(labelFile);
+		free(tablespaceMap);
+		return false;
+	}
+
+	if (pg_mkdir_p(archiveStatusDir, 0700) == -1)
+	{
+		log_error("Failed to create directory \"%s\": %m", archiveStatusDir);
+		free(labelFile);
+		free(tablespaceMap);
+		return false;
+	}
+
+	success = write_file(labelFile, strlen(labelFile), labelPath);
+
+	if (success && tablespaceMap[0] != '\0')
+	{
+		success = write_file(tablespaceMap, strlen(tablespaceMap), mapPath);
+	}
+
+	free(labelFile);
+	free(tablespaceMap);
+
+	if (!success)
+	{
+		log_error("Failed to write the backup_label file after the resync");
+		return false;
+	}
+
+	log_info("Resynced \"%s\" from the upstream node", pgSetup->pgdata);
+
+	return true;
+}
+
+
+/*
+ * standby_init_database tries to initialize PostgreSQL as a hot standby. It uses
+ * pg_basebackup to do so. Returns false on failure.
+ */
+bool
+standby_init_database(LocalPostgresServer *postgres,
+					  const char *hostname,
+					  bool skipBaseBackup)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *upstream = &(postgres->replicationSource);
+
+	log_trace("standby_init_database");
+	log_info("Initialising PostgreSQL as a hot standby");
+
+	if (pg_setup_pgdata_exists(pgSetup) && pg_setup_is_running(pgSetup))
+	{
+		log_info("Target directory exists: \"%s\", stopping PostgreSQL",
+				 pgSetup->pgdata);
+
+		/* try to stop PostgreSQL, stop here if that fails */
+		if (!ensure_postgres_service_is_stopped(postgres))
+		{
+			log_error("Failed to initialize a standby: "
+					  "the database directory exists "
+					  "and postgres could not be stopped");
+			return false;
+		}
+	}
+
+	/*
+	 * Now, we know that pgdata either doesn't exists or belongs to a stopped
+	 * PostgreSQL instance. We can safely proceed with pg_basebackup.
+	 *
+	 * We might be asked to skip pg_basebackup when the PGDATA directory has
+	 * already been prepared externally: typically we are creating a standby
+	 * node and it was faster to install PGDATA from a file system snapshot or
+	 * a backup/recovery tooling.
+	 */
+	if (skipBaseBackup)
+	{
+		log_info("Skipping base backup to use pre-existing PGDATA at \"%s\"",
+				 pgSetup->pgdata);
+	}
+	else
+	{
+		/*
+		 * pg_basebackup has this bug where it will copy over the whole PGDATA
+		 * contents even if the WAL receiver subprocess fails early, typically
+		 * when the replication slot does not exists on the target connection.
+		 *
+		 * We want to protect against this case here, so we manually check that
+		 * the replication exists before calling pg_basebackup.
+		 */
+		bool hasReplicationSlot = false;
+
+		/*
+		 * When initialising from another standby (in REPORT_LSN, if there is
+		 * currently no primary node and no candidate node either), we don't
+		 * require a replication slot on the upstream node.
+		 */
+		bool needsReplicationSlot = !IS_EMPTY_STRING_BUFFER(upstream->slotName);
+
+		if (needsReplicationSlot &&
+			!upstream_has_replication_slot(upstream,
+										   pgSetup,
+										   &hasReplicationSlot))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		bool restoredBackup = false;
+
+		/*
+		 * When a command to restore a base backup from the backup repository
+		 * has been setup, use it rather than reading the whole data set from
+		 * an upstream node. Postgres then only has to stream the WAL that
+		 * the backup and the WAL archive lack.
+		 */
+		if ((!needsReplicationSlot || hasReplicationSlot) &&
+			!IS_EMPTY_STRING_BUFFER(upstream->restoreCommand))
+		{
+			instr_time start;
+
+			(void) fsm_timing_step_start(&start);
+
+			restoredBackup = pg_restore_backup(pgSetup->pgdata, upstream);
+
+			(void) fsm_timing_step_done("restore backup", &start);
+
+			if (!restoredBackup)
+			{
+				log_warn("Failed to restore a base backup from the backup "
+						 "repository, using pg_basebackup instead");
+			}
+		}
+
+		if (restoredBackup)
+		{
+			log_info("Restored a base backup from the backup repository, "
+					 "remaining WAL is going to be streamed from the primary");
+		}
+		else if (!needsReplicationSlot || hasReplicationSlot)
+		{
+			/*
+			 * The monitor may have picked a secondary node for us to take the
+			 * base backup from, sparing the primary node the read I/O. We
+			 * still stream from our upstream node and its replication slot
+			 * afterwards, and fall back to it when the secondary node can't
+			 * be reached.
+			 */
+			ReplicationSource *backupSource = upstream;
+			ReplicationSource standbySource = *upstream;
+
+			if (upstream->backupNode.nodeId > 0 &&
+				upstream->backupNode.nodeId != upstream->primaryNode.nodeId)
+			{
+				standbySource.primaryNode = upstream->backupNode;
+				standbySource.slotName[0] = '\0';
+				standbySource.systemIdentified = false;
+
+				if (pgctl_identify_system(&standbySource))
+				{
+					log_info("Taking the base backup from secondary node "
+							 NODE_FORMAT,
+							 standbySource.primaryNode.nodeId,
+							 standbySource.primaryNode.name,
+							 standbySource.primaryNode.host,
+							 standbySource.primaryNode.port);
+
+					backupSource = &standbySource;
+				}
+				else
+				{
+					log_warn("Failed to connect to secondary node " NODE_FORMAT
+							 " with a replication connection string, "
+							 "taking the base backup from the primary",
+							 standbySource.primaryNode.nodeId,
+							 standbySource.primaryNode.name,
+							 standbySource.primaryNode.host,
+							 standbySource.primaryNode.port);
+				}
+			}
+
+			/* first, make sure we can connect with "replication" */
+			if (backupSource == upstream && !pgctl_identify_system_once(upstream))
+			{
+				log_error("Failed to connect to the primary with a replication "
+						  "connection string. See above for details");
+				return false;
+			}
+
+			/* now pg_basebackup from our upstream node */
+			instr_time start;
+
+			(void) fsm_timing_step_start(&start);
+
+			bool success =
+				pg_basebackup(pgSetup->pgdata, pgSetup->pg_ctl, backupSource);
+
+			(void) fsm_timing_step_done("pg_basebackup", &start);
+
+			if (!success)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			log_error("The replication slot \"%s\" has not been created yet "
+					  "on the primary node " NODE_FORMAT,
+					  upstream->slotName,
+					  upstream->primaryNode.nodeId,
+					  upstream->primaryNode.name,
+					  upstream->primaryNode.host,
+					  upstream->primaryNode.port);
+			return false;
+		}
+	}
+
+	/* we have a new PGDATA, update our pgSetup information */
+	if (!local_postgres_update(postgres, true))
+	{
+		log_error("Failed to update our internal Postgres representation "
+				  "after pg_basebackup, see above for details");
+		return false;
+	}
+
+	/* now setup the replication configuration (primary_conninfo etc) */
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
 							   pgSetup->pg_ctl,
 							   upstream))
 	{
@@ -975,73 +1522,319 @@ standby_init_database(LocalPostgresServer *postgres,
 		return false;
 	}
 
-	log_info("PostgreSQL started on port %d", pgSetup->pgport);
-
-	return true;
+	log_info("PostgreSQL started on port %d", pgSetup->pgport);
+
+	return true;
+}
+
+
+/*
+ * standby_estimate_rewind estimates how much data pg_rewind would have to
+ * process to bring the local data directory back as a standby of the
+ * upstream server, and how much data pg_basebackup would copy instead.
+ *
+ * The fork point is where our timeline ends in the timeline history of the
+ * upstream server. pg_rewind reads the WAL that we have written after that
+ * point and copies the blocks that the upstream server has changed since
+ * then, so that we count the WAL written after the fork point on both sides.
+ * Our own end of WAL is approximated with the latest checkpoint LSN, which is
+ * exact after a clean shutdown.
+ *
+ * The replication source must have been identified with
+ * pgctl_identify_system() first.
+ */
+bool
+standby_estimate_rewind(LocalPostgresServer *postgres,
+						uint64_t *divergence,
+						uint64_t *dataSize)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+	IdentifySystem *system = &(replicationSource->system);
+
+	uint64_t localLSN = InvalidXLogRecPtr;
+	uint64_t upstreamLSN = InvalidXLogRecPtr;
+	uint64_t forkPoint = InvalidXLogRecPtr;
+	bool foundTimeline = false;
+	const bool missingPgdataIsOk = false;
+
+	if (!pg_controldata(pgSetup, missingPgdataIsOk))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!parseLSN(pgSetup->control.latestCheckpointLSN, &localLSN) ||
+		!parseLSN(system->xlogpos, &upstreamLSN))
+	{
+		log_warn("Failed to parse LSN \"%s\" or \"%s\"",
+				 pgSetup->control.latestCheckpointLSN,
+				 system->xlogpos);
+		return false;
+	}
+
+	for (int i = 0; i < system->timelines.count; i++)
+	{
+		TimeLineHistoryEntry *entry = &(system->timelines.history[i]);
+
+		if (entry->tli == pgSetup->control.timeline_id)
+		{
+			forkPoint =
+				XLogRecPtrIsInvalid(entry->end) ? upstreamLSN : entry->end;
+			foundTimeline = true;
+			break;
+		}
+	}
+
+	if (!foundTimeline)
+	{
+		log_warn("Failed to find local timeline %d in the timeline history "
+				 "of the upstream server, currently on timeline %d",
+				 pgSetup->control.timeline_id,
+				 system->timeline);
+		return false;
+	}
+
+	*divergence = (localLSN > forkPoint ? localLSN - forkPoint : 0) +
+				  (upstreamLSN > forkPoint ? upstreamLSN - forkPoint : 0);
+
+	if (!upstream_get_databases_size(replicationSource, pgSetup, dataSize))
+	{
+		log_warn("Failed to compute the size of the upstream databases");
+		return false;
+	}
+
+	log_debug("standby_estimate_rewind: fork point %X/%X on timeline %d, "
+			  "local %X/%X, upstream %X/%X on timeline %d",
+			  (uint32_t) (forkPoint >> 32), (uint32_t) forkPoint,
+			  pgSetup->control.timeline_id,
+			  (uint32_t) (localLSN >> 32), (uint32_t) localLSN,
+			  (uint32_t) (upstreamLSN >> 32), (uint32_t) upstreamLSN,
+			  system->timeline);
+
+	return true;
+}
+
+
+/*
+ * primary_prepare_rewind sets the pg_rewind options that depend on the local
+ * Postgres version and setup:
+ *
+ *  - from Postgres 13 on, when restore_command is set, --restore-target-wal
+ *    fetches the WAL that has already been recycled from pg_wal, where
+ *    pg_rewind would otherwise fail and we would do a base backup,
+ *
+ *  - from Postgres 12 on, --no-sync skips the fsync() of every file, and we
+ *    then sync the file systems of the data directory only once.
+ */
+static void
+primary_prepare_rewind(LocalPostgresServer *postgres)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+	int pgVersion = 0;
+
+	(void) parse_pg_version_string(pgSetup->pg_version, &pgVersion);
+
+	replicationSource->rewindNoSync = pgVersion >= 1200;
+	replicationSource->rewindRestoreTargetWal =
+		pgVersion >= 1300 &&
+		pg_has_restore_command(pgSetup->pg_ctl, pgSetup->pgdata);
+
+	if (replicationSource->rewindRestoreTargetWal)
+	{
+		log_info("Using restore_command to fetch missing WAL during pg_rewind");
+	}
+}
+
+
+/*
+ * primary_rewind_to_standby brings a database directory of a failed primary back
+ * into a state where it can become the standby of the new primary.
+ */
+bool
+primary_rewind_to_standby(LocalPostgresServer *postgres)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+	NodeAddress *primaryNode = &(replicationSource->primaryNode);
+
+	log_trace("primary_rewind_to_standby");
+	log_info("Rewinding PostgreSQL to follow new primary node " NODE_FORMAT,
+			 primaryNode->nodeId,
+			 primaryNode->name,
+			 primaryNode->host,
+			 primaryNode->port);
+
+	if (!ensure_postgres_service_is_stopped(postgres))
+	{
+		log_error("Failed to stop postgres to do rewind");
+		return false;
+	}
+
+	if (!postgres_maybe_do_crash_recovery(postgres))
+	{
+		log_error("Failed to implement Postgres crash recovery "
+				  "before calling pg_rewind");
+		return false;
+	}
+
+	/* before pg_rewind, make sure we can connect with "replication" */
+	if (!pgctl_identify_system_once(replicationSource))
+	{
+		log_error("Failed to connect to the primary node " NODE_FORMAT
+				  "with a replication connection string. "
+				  "See above for details",
+				  primaryNode->nodeId,
+				  primaryNode->name,
+				  primaryNode->host,
+				  primaryNode->port);
+	}
+
+	(void) primary_prepare_rewind(postgres);
+
+	instr_time start;
+
+	(void) fsm_timing_step_start(&start);
+
+	bool rewound =
+		pg_rewind(pgSetup->pgdata, pgSetup->pg_ctl, replicationSource);
+
+	(void) fsm_timing_step_done("pg_rewind", &start);
+
+	if (rewound)
+	{
+		char note[BUFSIZE] = { 0 };
+
+		sformat(note, sizeof(note), "pg_rewind copied %" PRId64 " kB",
+				replicationSource->rewindCopiedKB);
+
+		(void) fsm_timing_note(note);
+	}
+
+	if (!rewound)
+	{
+		log_error("Failed to rewind old data directory");
+		return false;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres as a standby, after rewind");
+		return false;
+	}
+
+	if (!ensure_postgres_service_is_running(postgres))
+	{
+		log_error("Failed to start postgres after rewind");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * primary_can_follow_without_rewind returns true when the local Postgres
+ * instance, a demoted primary, has been shut down cleanly before the upstream
+ * server forked its timeline off ours. That's what happens in a switchover:
+ * the standby replays our shutdown checkpoint before being promoted, so we
+ * can follow the new timeline as it is, and pg_rewind has nothing to do.
+ *
+ * The replication source must have been setup, and pgctl_identify_system()
+ * called, first.
+ */
+bool
+primary_can_follow_without_rewind(LocalPostgresServer *postgres)
+{
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	IdentifySystem *system = &(postgres->replicationSource.system);
+
+	uint64_t localLSN = InvalidXLogRecPtr;
+	const bool missingPgdataIsOk = false;
+
+	if (!pg_controldata(pgSetup, missingPgdataIsOk))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (pgSetup->control.state != DB_SHUTDOWNED ||
+		pgSetup->control.system_identifier != system->identifier ||
+		pgSetup->control.timeline_id == system->timeline)
+	{
+		return false;
+	}
+
+	if (!parseLSN(pgSetup->control.latestCheckpointLSN, &localLSN))
+	{
+		log_warn("Failed to parse LSN \"%s\"",
+				 pgSetup->control.latestCheckpointLSN);
+		return false;
+	}
+
+	for (int i = 0; i < system->timelines.count; i++)
+	{
+		TimeLineHistoryEntry *entry = &(system->timelines.history[i]);
+
+		if (entry->tli == pgSetup->control.timeline_id)
+		{
+			/*
+			 * Records don't cross the fork point, so when our last
+			 * checkpoint starts before it, the upstream server has it.
+			 */
+			bool canFollow =
+				!XLogRecPtrIsInvalid(entry->end) && localLSN < entry->end;
+
+			log_debug("primary_can_follow_without_rewind: local checkpoint "
+					  "at %X/%X, timeline %d forked at %X/%X: %s",
+					  (uint32_t) (localLSN >> 32), (uint32_t) localLSN,
+					  entry->tli,
+					  (uint32_t) (entry->end >> 32), (uint32_t) entry->end,
+					  canFollow ? "no rewind needed" : "rewind needed");
+
+			return canFollow;
+		}
+	}
+
+	return false;
 }
 
 
 /*
- * primary_rewind_to_standby brings a database directory of a failed primary back
- * into a state where it can become the standby of the new primary.
+ * primary_restart_as_standby restarts a cleanly shut down primary as a
+ * standby of the new primary, when primary_can_follow_without_rewind says
+ * that's possible.
  */
 bool
-primary_rewind_to_standby(LocalPostgresServer *postgres)
+primary_restart_as_standby(LocalPostgresServer *postgres)
 {
 	PostgresSetup *pgSetup = &(postgres->postgresSetup);
 	ReplicationSource *replicationSource = &(postgres->replicationSource);
 	NodeAddress *primaryNode = &(replicationSource->primaryNode);
 
-	log_trace("primary_rewind_to_standby");
-	log_info("Rewinding PostgreSQL to follow new primary node " NODE_FORMAT,
+	log_info("Restarting PostgreSQL to follow new primary node " NODE_FORMAT
+			 ", no rewind needed",
 			 primaryNode->nodeId,
 			 primaryNode->name,
 			 primaryNode->host,
 			 primaryNode->port);
 
-	if (!ensure_postgres_service_is_stopped(postgres))
-	{
-		log_error("Failed to stop postgres to do rewind");
-		return false;
-	}
-
-	if (!postgres_maybe_do_crash_recovery(postgres))
-	{
-		log_error("Failed to implement Postgres crash recovery "
-				  "before calling pg_rewind");
-		return false;
-	}
-
-	/* before pg_rewind, make sure we can connect with "replication" */
-	if (!pgctl_identify_system(replicationSource))
-	{
-		log_error("Failed to connect to the primary node " NODE_FORMAT
-				  "with a replication connection string. "
-				  "See above for details",
-				  primaryNode->nodeId,
-				  primaryNode->name,
-				  primaryNode->host,
-				  primaryNode->port);
-	}
-
-	if (!pg_rewind(pgSetup->pgdata, pgSetup->pg_ctl, replicationSource))
-	{
-		log_error("Failed to rewind old data directory");
-		return false;
-	}
-
 	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
 							   pgSetup->pgdata,
 							   pgSetup->pg_ctl,
 							   replicationSource))
 	{
-		log_error("Failed to setup Postgres as a standby, after rewind");
+		log_error("Failed to setup Postgres as a standby");
 		return false;
 	}
 
 	if (!ensure_postgres_service_is_running(postgres))
 	{
-		log_error("Failed to start postgres after rewind");
+		log_error("Failed to start postgres as a standby");
 		return false;
 	}
 
@@ -1190,7 +1983,8 @@ postgres_maybe_do_crash_recovery(LocalPostgresServer *postgres)
 												&pgSetup->is_in_recovery,
 												postgres->pgsrSyncState,
 												postgres->currentLSN,
-												&(pgSetup->control)))
+												&(pgSetup->control),
+												NULL))
 				{
 					log_info("Postgres has finished crash recovery at LSN %s",
 							 postgres->currentLSN);
@@ -1293,7 +2087,15 @@ standby_promote(LocalPostgresServer *postgres)
 
 	log_info("Promoting postgres");
 
-	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	instr_time start;
+
+	(void) fsm_timing_step_start(&start);
+
+	bool promoted = pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata);
+
+	(void) fsm_timing_step_done("pg_ctl promote", &start);
+
+	if (!promoted)
 	{
 		log_error("Failed to promote standby: see pg_ctl promote errors above");
 		return false;
@@ -1411,9 +2213,145 @@ primary_standby_has_caught_up(LocalPostgresServer *postgres)
 }
 
 
+/*
+ * When disconnecting a standby from its primary with a reload, how long do we
+ * wait for the WAL receiver to exit before restarting Postgres instead.
+ */
+#define STANDBY_RELOAD_WAL_RECEIVER_TIMEOUT 5000 /* milliseconds */
+
+
+/*
+ * standby_can_reload_replication_source returns true when the local Postgres
+ * instance is a running standby that can change its primary_conninfo and
+ * primary_slot_name with a reload: starting with Postgres 13, and when the
+ * running standby has no recovery target, as those need a restart.
+ */
+bool
+standby_can_reload_replication_source(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+
+	bool canReload = false;
+
+	if (pgSetup->control.pg_control_version < 1300 ||
+		!pg_is_running(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		return false;
+	}
+
+	if (!pgsql_standby_settings_can_reload(pgsql, &canReload))
+	{
+		log_warn("Failed to check the current recovery settings, "
+				 "restarting Postgres instead");
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	if (!canReload)
+	{
+		log_debug("standby_can_reload_replication_source: "
+				  "recovery settings need a restart");
+	}
+
+	return canReload;
+}
+
+
+/*
+ * standby_reload_replication_source installs the current replication source
+ * of a running standby and reloads Postgres, rather than restarting it, so
+ * that read-only sessions and the cache survive a failover.
+ *
+ * The startup process then restarts the WAL receiver. When we need a recovery
+ * target, or when Postgres can't reload its replication source, reloaded is
+ * set to false and the caller restarts Postgres as before.
+ */
+static bool
+standby_reload_replication_source(LocalPostgresServer *postgres, bool *reloaded)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+
+	*reloaded = false;
+
+	if (!IS_EMPTY_STRING_BUFFER(replicationSource->targetLSN) ||
+		!IS_EMPTY_STRING_BUFFER(replicationSource->targetTimeline) ||
+		!standby_can_reload_replication_source(postgres))
+	{
+		return true;
+	}
+
+	if (!pg_setup_standby_mode(pgSetup->control.pg_control_version,
+							   pgSetup->pgdata,
+							   pgSetup->pg_ctl,
+							   replicationSource))
+	{
+		log_error("Failed to setup Postgres as a standby");
+		return false;
+	}
+
+	if (!pgsql_reload_conf(pgsql))
+	{
+		log_warn("Failed to reload Postgres configuration, "
+				 "restarting Postgres instead");
+		pgsql_finish(pgsql);
+		return true;
+	}
+
+	/*
+	 * When disconnecting from the primary, we want the LSN that we report to
+	 * be final by the time we return, as it is when restarting: wait until
+	 * the WAL receiver is gone.
+	 */
+	if (IS_EMPTY_STRING_BUFFER(replicationSource->primaryNode.host))
+	{
+		bool hasWalReceiver = true;
+		uint64_t startTime = time(NULL);
+
+		for (;;)
+		{
+			if (!pgsql_has_wal_receiver(pgsql, &hasWalReceiver))
+			{
+				/* errors have already been logged */
+				break;
+			}
+
+			if (!hasWalReceiver ||
+				(time(NULL) - startTime) * 1000 >=
+				STANDBY_RELOAD_WAL_RECEIVER_TIMEOUT)
+			{
+				break;
+			}
+
+			pg_usleep(100 * 1000);
+		}
+
+		if (hasWalReceiver)
+		{
+			log_warn("WAL receiver is still running after a reload, "
+					 "restarting Postgres instead");
+			pgsql_finish(pgsql);
+			return true;
+		}
+	}
+
+	pgsql_finish(pgsql);
+
+	log_info("Reloaded Postgres at \"%s\" with its new replication source",
+			 pgSetup->pgdata);
+
+	*reloaded = true;
+
+	return true;
+}
+
+
 /*
  * standby_follow_new_primary rewrites the replication setup to follow the new
- * primary after a failover.
+ * primary after a failover. With Postgres 13 and later, a running standby is
+ * reloaded rather than restarted, see standby_reload_replication_source().
  */
 bool
 standby_follow_new_primary(LocalPostgresServer *postgres)
@@ -1440,6 +2378,19 @@ standby_follow_new_primary(LocalPostgresServer *postgres)
 		}
 	}
 
+	bool reloaded = false;
+
+	if (!standby_reload_replication_source(postgres, &reloaded))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (reloaded)
+	{
+		return true;
+	}
+
 	/* cleanup our existing standby setup, including postgresql.auto.conf */
 	if (!pg_cleanup_standby_mode(pgSetup->control.pg_control_version,
 								 pgSetup->pg_ctl,
@@ -1488,8 +2439,12 @@ standby_follow_new_primary(LocalPostgresServer *postgres)
 /*
  * standby_fetch_missing_wal sets up replication to fetch up to given
  * recovery_target_lsn (inclusive) with a recovery_target_action set to
- * 'promote' so that as soon as we get our WAL bytes we are promoted to being a
- * primary.
+ * 'pause', and waits until we get our WAL bytes.
+ *
+ * When the running standby can reload its replication source, we stream from
+ * the upstream node without a recovery target instead, and wait until replay
+ * has reached the target LSN. Postgres is then neither restarted here nor
+ * when resuming as a primary, see fsm_cleanup_and_resume_as_primary().
  */
 bool
 standby_fetch_missing_wal(LocalPostgresServer *postgres)
@@ -1499,7 +2454,9 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 	NodeAddress *upstreamNode = &(replicationSource->primaryNode);
 
 	char currentLSN[PG_LSN_MAXLENGTH] = { 0 };
+	char targetLSN[PG_LSN_MAXLENGTH] = { 0 };
 	bool hasReachedLSN = false;
+	instr_time start;
 
 	log_info("Fetching WAL from upstream node " NODE_FORMAT
 			 "up to LSN %s",
@@ -1509,8 +2466,39 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 			 upstreamNode->port,
 			 replicationSource->targetLSN);
 
+	/* first fetch most of the missing WAL in parallel, when configured to */
+	if (replicationSource->walFetchWorkers > 0 &&
+		!standby_prefetch_missing_wal(postgres))
+	{
+		log_warn("Failed to fetch WAL segments in parallel, "
+				 "streaming the missing WAL instead");
+	}
+
+	strlcpy(targetLSN, replicationSource->targetLSN, PG_LSN_MAXLENGTH);
+
+	/*
+	 * The upstream standby node is disconnected from the failed primary, so
+	 * it won't send us WAL past the target LSN: we don't need a recovery
+	 * target when we can stream from it without a restart.
+	 */
+	bool streaming = standby_can_reload_replication_source(postgres);
+
+	if (streaming)
+	{
+		log_info("Streaming the missing WAL without restarting Postgres");
+		bzero((void *) replicationSource->targetLSN, PG_LSN_MAXLENGTH);
+	}
+
 	/* apply new replication source to fetch missing WAL bits */
-	if (!standby_restart_with_current_replication_source(postgres))
+	bool replicationIsSetup =
+		standby_restart_with_current_replication_source(postgres);
+
+	if (streaming)
+	{
+		strlcpy(replicationSource->targetLSN, targetLSN, PG_LSN_MAXLENGTH);
+	}
+
+	if (!replicationIsSetup)
 	{
 		log_error("Failed to setup replication "
 				  "from upstream node " NODE_FORMAT
@@ -1524,6 +2512,8 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 	/*
 	 * Now loop until replay has reached our targetLSN.
 	 */
+	(void) fsm_timing_step_start(&start);
+
 	while (!hasReachedLSN)
 	{
 		if (asked_to_stop || asked_to_stop_fast)
@@ -1538,6 +2528,7 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 										  &hasReachedLSN))
 		{
 			/* errors have already been logged */
+			(void) fsm_timing_step_done("wal replay", &start);
 			return false;
 		}
 
@@ -1549,6 +2540,8 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 		}
 	}
 
+	(void) fsm_timing_step_done("wal replay", &start);
+
 	/* done with fast-forwarding, keep the value for node_active() call */
 	strlcpy(postgres->currentLSN, currentLSN, PG_LSN_MAXLENGTH);
 
@@ -1586,9 +2579,186 @@ standby_fetch_missing_wal(LocalPostgresServer *postgres)
 
 
 /*
- * standby_restart_with_no_primary sets up recovery parameters without a
- * primary_conninfo, so as to force disconnect from the primary and still
- * remain a standby that can report its current LSN position, for instance.
+ * standby_prefetch_missing_wal fetches the complete WAL segments between our
+ * current replay LSN and the target LSN from the upstream node, using several
+ * replication connections in parallel: worker i fetches every Nth segment
+ * starting from the i-th one.
+ *
+ * The segments are placed in our pg_wal directory, where the local standby
+ * replays them without waiting for streaming replication to be set up again.
+ * The last, incomplete, segment and any segment that we failed to fetch are
+ * then streamed as usual.
+ */
+static bool
+standby_prefetch_missing_wal(LocalPostgresServer *postgres)
+{
+	PGSQL *pgsql = &(postgres->sqlClient);
+	PostgresSetup *pgSetup = &(postgres->postgresSetup);
+	ReplicationSource *replicationSource = &(postgres->replicationSource);
+	NodeAddress *upstreamNode = &(replicationSource->primaryNode);
+	IdentifySystem *system = &(replicationSource->system);
+
+	char currentLSN[PG_LSN_MAXLENGTH] = { 0 };
+	bool hasReachedLSN = false;
+	const bool missingPgdataIsOk = false;
+
+	uint64_t currentLSNValue = InvalidXLogRecPtr;
+	uint64_t targetLSNValue = InvalidXLogRecPtr;
+	uint64_t segmentSize = 0;
+
+	pid_t workers[PG_AUTOCTL_MAX_WAL_FETCH_WORKERS] = { 0 };
+	int workerCount = replicationSource->walFetchWorkers;
+	bool success = true;
+
+	if (!pgsql_has_reached_target_lsn(pgsql,
+									  replicationSource->targetLSN,
+									  currentLSN,
+									  &hasReachedLSN) ||
+		!pgsql_get_wal_segment_size(pgsql, &segmentSize))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (hasReachedLSN)
+	{
+		return true;
+	}
+
+	if (!parseLSN(currentLSN, &currentLSNValue) ||
+		!parseLSN(replicationSource->targetLSN, &targetLSNValue))
+	{
+		log_error("Failed to parse LSN \"%s\" or \"%s\"",
+				  currentLSN,
+				  replicationSource->targetLSN);
+		return false;
+	}
+
+	if (!pgctl_identify_system(replicationSource) ||
+		!pg_controldata(pgSetup, missingPgdataIsOk))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the segments must all be found on the timeline that we are on */
+	if (pgSetup->control.timeline_id != system->timeline)
+	{
+		log_info("Skipping parallel WAL fetch: local timeline is %d, "
+				 "upstream node timeline is %d",
+				 pgSetup->control.timeline_id,
+				 system->timeline);
+		return true;
+	}
+
+	/* the segment that contains the target LSN is left to streaming */
+	uint64_t firstSegNo = currentLSNValue / segmentSize;
+	uint64_t lastSegNo = targetLSNValue / segmentSize;
+
+	if (lastSegNo <= firstSegNo)
+	{
+		return true;
+	}
+
+	if (workerCount > PG_AUTOCTL_MAX_WAL_FETCH_WORKERS)
+	{
+		workerCount = PG_AUTOCTL_MAX_WAL_FETCH_WORKERS;
+	}
+
+	if ((uint64_t) workerCount > lastSegNo - firstSegNo)
+	{
+		workerCount = (int) (lastSegNo - firstSegNo);
+	}
+
+	log_info("Fetching %" PRIu64 " WAL segments from upstream node "
+			 NODE_FORMAT "using %d replication connections",
+			 lastSegNo - firstSegNo,
+			 upstreamNode->nodeId,
+			 upstreamNode->name,
+			 upstreamNode->host,
+			 upstreamNode->port,
+			 workerCount);
+
+	uint64_t startTime = time(NULL);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < workerCount; i++)
+	{
+		pid_t fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork a WAL fetch worker process: %m");
+				success = false;
+				break;
+			}
+
+			case 0:
+			{
+				bool fetched =
+					pgctl_fetch_wal_segments(replicationSource,
+											 pgSetup->pgdata,
+											 system->timeline,
+											 segmentSize,
+											 firstSegNo + i,
+											 lastSegNo,
+											 workerCount);
+
+				/* skip the atexit() handlers of the keeper process */
+				_exit(fetched ? EXIT_CODE_QUIT : EXIT_CODE_PGSQL);
+			}
+
+			default:
+			{
+				workers[i] = fpid;
+				break;
+			}
+		}
+	}
+
+	for (int i = 0; i < workerCount; i++)
+	{
+		int status = 0;
+		pid_t pid = 0;
+
+		if (workers[i] == 0)
+		{
+			continue;
+		}
+
+		do {
+			pid = waitpid(workers[i], &status, 0);
+		} while (pid == -1 && errno == EINTR);
+
+		if (pid != workers[i] ||
+			!WIFEXITED(status) ||
+			WEXITSTATUS(status) != EXIT_CODE_QUIT)
+		{
+			success = false;
+		}
+	}
+
+	if (success)
+	{
+		log_info("Fetched %" PRIu64 " WAL segments in %ds",
+				 lastSegNo - firstSegNo,
+				 (int) (time(NULL) - startTime));
+	}
+
+	return success;
+}
+
+
+/*
+ * standby_restart_with_current_replication_source installs the current
+ * replication source, for instance without a primary_conninfo so as to force
+ * disconnect from the primary and still remain a standby that can report its
+ * current LSN position. With Postgres 13 and later, a running standby is
+ * reloaded rather than restarted when that's enough.
  */
 bool
 standby_restart_with_current_replication_source(LocalPostgresServer *postgres)
@@ -1608,6 +2778,19 @@ standby_restart_with_current_replication_source(LocalPostgresServer *postgres)
 		}
 	}
 
+	bool reloaded = false;
+
+	if (!standby_reload_replication_source(postgres, &reloaded))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (reloaded)
+	{
+		return true;
+	}
+
 	/* cleanup our existing standby setup, including postgresql.auto.conf */
 	if (!pg_cleanup_standby_mode(pgSetup->control.pg_control_version,
 								 pgSetup->pg_ctl,
@@ -1700,7 +2883,8 @@ standby_check_timeline_with_upstream(LocalPostgresServer *postgres)
 									 &(postgres->postgresSetup.is_in_recovery),
 									 postgres->pgsrSyncState,
 									 postgres->currentLSN,
-									 &(postgres->postgresSetup.control)))
+									 &(postgres->postgresSetup.control),
+									 NULL))
 	{
 		log_error("Failed to update the local Postgres metadata");
 		return false;
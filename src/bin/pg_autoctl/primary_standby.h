@@ -41,8 +41,10 @@ typedef struct LocalPostgresServer
 	bool pgIsRunning;
 	char pgsrSyncState[PGSR_SYNC_STATE_MAXLENGTH];
 	char currentLSN[PG_LSN_MAXLENGTH];
+	WalReceiverState walReceiver;
 	uint64_t pgFirstStartFailureTs;
 	int pgStartRetries;
+	int64_t crashRecoveryWalBytes;
 	PgInstanceKind pgKind;
 	LocalExpectedPostgresStatus expectedPgStatus;
 	char standbyTargetLSN[PG_LSN_MAXLENGTH];
@@ -58,14 +60,21 @@ void local_postgres_finish(LocalPostgresServer *postgres);
 bool local_postgres_update(LocalPostgresServer *postgres,
 						   bool postgresNotRunningIsOk);
 bool ensure_postgres_service_is_running(LocalPostgresServer *postgres);
+bool local_postgres_estimate_crash_recovery(LocalPostgresServer *postgres,
+											uint64_t *walBytes);
 bool ensure_postgres_service_is_running_as_subprocess(LocalPostgresServer *postgres);
 bool ensure_postgres_service_is_stopped(LocalPostgresServer *postgres);
 
 bool primary_has_replica(LocalPostgresServer *postgres, char *userName,
 						 bool *hasStandby);
+bool primary_get_replica_reply_age(LocalPostgresServer *postgres, char *userName,
+								   int *replyAgeMs);
 bool upstream_has_replication_slot(ReplicationSource *upstream,
 								   PostgresSetup *pgSetup,
 								   bool *hasReplicationSlot);
+bool upstream_get_databases_size(ReplicationSource *upstream,
+								 PostgresSetup *pgSetup,
+								 uint64_t *size);
 bool primary_create_replication_slot(LocalPostgresServer *postgres,
 									 char *replicationSlotName);
 bool primary_drop_replication_slot(LocalPostgresServer *postgres,
@@ -73,9 +82,11 @@ bool primary_drop_replication_slot(LocalPostgresServer *postgres,
 bool primary_drop_replication_slots(LocalPostgresServer *postgres);
 bool primary_set_synchronous_standby_names(LocalPostgresServer *postgres);
 bool postgres_replication_slot_create_and_drop(LocalPostgresServer *postgres,
-											   NodeAddressArray *nodeArray);
+											   NodeAddressArray *nodeArray,
+											   int advanceThreshold);
 bool postgres_replication_slot_maintain(LocalPostgresServer *postgres,
-										NodeAddressArray *nodeArray);
+										NodeAddressArray *nodeArray,
+										int advanceThreshold);
 bool primary_disable_synchronous_replication(LocalPostgresServer *postgres);
 bool postgres_add_default_settings(LocalPostgresServer *postgres,
 								   const char *hostname);
@@ -86,6 +97,10 @@ bool primary_create_user_with_hba(LocalPostgresServer *postgres, char *userName,
 bool primary_create_replication_user(LocalPostgresServer *postgres,
 									 char *replicationUser,
 									 char *replicationPassword);
+bool primary_create_node_users(LocalPostgresServer *postgres,
+							   char *monitorHostname,
+							   char *replicationPassword,
+							   HBAEditLevel hbaLevel);
 bool standby_init_replication_source(LocalPostgresServer *postgres,
 									 NodeAddress *upstreamNode,
 									 const char *username,
@@ -99,7 +114,13 @@ bool standby_init_replication_source(LocalPostgresServer *postgres,
 bool standby_init_database(LocalPostgresServer *postgres,
 						   const char *hostname,
 						   bool skipBaseBackup);
+bool standby_delta_resync(LocalPostgresServer *postgres);
+bool standby_estimate_rewind(LocalPostgresServer *postgres,
+							 uint64_t *divergence,
+							 uint64_t *dataSize);
 bool primary_rewind_to_standby(LocalPostgresServer *postgres);
+bool primary_can_follow_without_rewind(LocalPostgresServer *postgres);
+bool primary_restart_as_standby(LocalPostgresServer *postgres);
 bool postgres_maybe_do_crash_recovery(LocalPostgresServer *postgres);
 bool standby_promote(LocalPostgresServer *postgres);
 bool check_postgresql_settings(LocalPostgresServer *postgres,
@@ -107,6 +128,7 @@ bool check_postgresql_settings(LocalPostgresServer *postgres,
 bool primary_standby_has_caught_up(LocalPostgresServer *postgres);
 bool standby_follow_new_primary(LocalPostgresServer *postgres);
 bool standby_fetch_missing_wal(LocalPostgresServer *postgres);
+bool standby_can_reload_replication_source(LocalPostgresServer *postgres);
 bool standby_restart_with_current_replication_source(LocalPostgresServer *postgres);
 bool standby_cleanup_as_primary(LocalPostgresServer *postgres);
 bool standby_check_timeline_with_upstream(LocalPostgresServer *postgres);
@@ -0,0 +1,447 @@
+/*
+ * src/bin/pg_autoctl/program_cache.c
+ *   Cache the output of the Postgres programs we run to discover the local
+ *   Postgres installation.
+ *
+ * Every pg_autoctl command that needs to know about the local Postgres
+ * installation runs pg_ctl --version, and sometimes pg_config --bindir or
+ * pg_config --sharedir for each candidate found in PATH. On hosts with many
+ * Postgres versions installed, those fork and exec calls add up.
+ *
+ * We keep the first line of output of those programs in a cache file in
+ * $XDG_CACHE_HOME/pg_autoctl, one line per program and argument, along with
+ * the inode, size and modification time of the program. An entry is only used
+ * when the program still has the same inode, size and modification time, and
+ * for PROGRAM_CACHE_TTL seconds at most: wrapper scripts such as the debian
+ * pg_config are not modified when another Postgres version is installed.
+ *
+ * The cache is never required: failing to read or write it is not an error,
+ * we just run the program. Set PG_AUTOCTL_PROGRAM_CACHE=0 in the environment
+ * to disable it.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "file_utils.h"
+#include "log.h"
+#include "program_cache.h"
+#include "runprogram.h"
+#include "string_utils.h"
+
+#define PROGRAM_CACHE_FILENAME "programs.cache"
+
+
+/*
+ * A cache entry is a line of tab separated fields:
+ *
+ *   program, arg, inode, size, mtime sec, mtime nsec, cached at, output
+ */
+typedef struct ProgramCacheEntry
+{
+	char program[MAXPGPATH];
+	char arg[NAMEDATALEN];
+	uint64_t inode;
+	int64_t size;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t cachedAt;
+	char output[MAXPGPATH];
+} ProgramCacheEntry;
+
+typedef struct ProgramCache
+{
+	int count;
+	ProgramCacheEntry entries[PROGRAM_CACHE_MAX_ENTRIES];
+} ProgramCache;
+
+
+static bool program_cache_enabled(void);
+static bool program_cache_path(char *cachePath, size_t size);
+static bool program_cache_stat(const char *program, ProgramCacheEntry *entry);
+static void program_cache_read(const char *cachePath, ProgramCache *cache);
+static bool program_cache_parse_entry(char *line, ProgramCacheEntry *entry);
+static void program_cache_write(const char *cachePath, ProgramCache *cache);
+static bool program_run_first_line(const char *program, const char *arg,
+								   char *output, size_t size);
+
+
+/*
+ * program_cache_run copies the first line of the output of "program arg" into
+ * output, using the cache when we have a valid entry, and running the
+ * program and updating the cache otherwise.
+ */
+bool
+program_cache_run(const char *program, const char *arg,
+				  char *output, size_t size)
+{
+	char cachePath[MAXPGPATH] = { 0 };
+	ProgramCacheEntry current = { 0 };
+
+	if (!program_cache_enabled() ||
+		!program_cache_path(cachePath, sizeof(cachePath)) ||
+		!program_cache_stat(program, &current) ||
+		strlen(program) >= sizeof(current.program) ||
+		strlen(arg) >= sizeof(current.arg))
+	{
+		return program_run_first_line(program, arg, output, size);
+	}
+
+	ProgramCache *cache = (ProgramCache *) calloc(1, sizeof(ProgramCache));
+
+	if (cache == NULL)
+	{
+		return program_run_first_line(program, arg, output, size);
+	}
+
+	(void) program_cache_read(cachePath, cache);
+
+	int64_t now = (int64_t) time(NULL);
+	int found = -1;
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		ProgramCacheEntry *entry = &(cache->entries[i]);
+
+		if (strcmp(entry->program, program) == 0 &&
+			strcmp(entry->arg, arg) == 0)
+		{
+			found = i;
+
+			if (entry->inode == current.inode &&
+				entry->size == current.size &&
+				entry->mtimeSec == current.mtimeSec &&
+				entry->mtimeNsec == current.mtimeNsec &&
+				now - entry->cachedAt >= 0 &&
+				now - entry->cachedAt < PROGRAM_CACHE_TTL)
+			{
+				log_debug("Using cached output of \"%s %s\"", program, arg);
+
+				strlcpy(output, entry->output, size);
+				free(cache);
+
+				return true;
+			}
+			break;
+		}
+	}
+
+	if (!program_run_first_line(program, arg, output, size))
+	{
+		free(cache);
+		return false;
+	}
+
+	/* replace the stale entry, or the oldest one when the cache is full */
+	if (found < 0)
+	{
+		if (cache->count < PROGRAM_CACHE_MAX_ENTRIES)
+		{
+			found = cache->count++;
+		}
+		else
+		{
+			found = 0;
+
+			for (int i = 1; i < cache->count; i++)
+			{
+				if (cache->entries[i].cachedAt < cache->entries[found].cachedAt)
+				{
+					found = i;
+				}
+			}
+		}
+	}
+
+	ProgramCacheEntry *entry = &(cache->entries[found]);
+
+	*entry = current;
+	strlcpy(entry->program, program, sizeof(entry->program));
+	strlcpy(entry->arg, arg, sizeof(entry->arg));
+	strlcpy(entry->output, output, sizeof(entry->output));
+	entry->cachedAt = now;
+
+	(void) program_cache_write(cachePath, cache);
+
+	free(cache);
+
+	return true;
+}
+
+
+/*
+ * program_cache_enabled returns false when PG_AUTOCTL_PROGRAM_CACHE is set to
+ * 0 in the environment.
+ */
+static bool
+program_cache_enabled(void)
+{
+	char value[BUFSIZE] = { 0 };
+
+	if (!env_exists(PG_AUTOCTL_PROGRAM_CACHE))
+	{
+		return true;
+	}
+
+	if (!get_env_copy(PG_AUTOCTL_PROGRAM_CACHE, value, sizeof(value)))
+	{
+		return false;
+	}
+
+	return strcmp(value, "0") != 0;
+}
+
+
+/*
+ * program_cache_path computes the path of our cache file, and makes sure its
+ * directory exists.
+ */
+static bool
+program_cache_path(char *cachePath, size_t size)
+{
+	char home[MAXPGPATH] = { 0 };
+	char fallback[MAXPGPATH] = { 0 };
+	char cacheDir[MAXPGPATH] = { 0 };
+
+	if (!env_exists("HOME") ||
+		!get_env_copy("HOME", home, sizeof(home)))
+	{
+		return false;
+	}
+
+	join_path_components(fallback, home, ".cache");
+
+	if (!get_env_copy_with_fallback("XDG_CACHE_HOME",
+									cacheDir, sizeof(cacheDir),
+									fallback))
+	{
+		return false;
+	}
+
+	join_path_components(cacheDir, cacheDir, "pg_autoctl");
+
+	if (pg_mkdir_p(cacheDir, 0700) == -1)
+	{
+		log_debug("Failed to create directory \"%s\": %m", cacheDir);
+		return false;
+	}
+
+	sformat(cachePath, size, "%s/%s", cacheDir, PROGRAM_CACHE_FILENAME);
+
+	return true;
+}
+
+
+/*
+ * program_cache_stat fills in the inode, size and modification time of the
+ * given program.
+ */
+static bool
+program_cache_stat(const char *program, ProgramCacheEntry *entry)
+{
+	struct stat st;
+
+	if (stat(program, &st) != 0)
+	{
+		log_debug("Failed to stat \"%s\": %m", program);
+		return false;
+	}
+
+#if defined(__APPLE__)
+	struct timespec mtime = st.st_mtimespec;
+#else
+	struct timespec mtime = st.st_mtim;
+#endif
+
+	entry->inode = (uint64_t) st.st_ino;
+	entry->size = (int64_t) st.st_size;
+	entry->mtimeSec = (int64_t) mtime.tv_sec;
+	entry->mtimeNsec = (int64_t) mtime.tv_nsec;
+
+	return true;
+}
+
+
+/*
+ * program_cache_read reads our cache file, skipping the lines that we fail
+ * to parse.
+ */
+static void
+program_cache_read(const char *cachePath, ProgramCache *cache)
+{
+	char line[BUFSIZE] = { 0 };
+
+	FILE *file = fopen(cachePath, "r");
+
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+		{
+			log_debug("Failed to open \"%s\": %m", cachePath);
+		}
+		return;
+	}
+
+	while (cache->count < PROGRAM_CACHE_MAX_ENTRIES &&
+		   fgets(line, sizeof(line), file) != NULL)
+	{
+		ProgramCacheEntry *entry = &(cache->entries[cache->count]);
+
+		line[strcspn(line, "\n")] = '\0';
+
+		if (program_cache_parse_entry(line, entry))
+		{
+			++cache->count;
+		}
+	}
+
+	fclose(file);
+}
+
+
+/*
+ * program_cache_parse_entry parses a line of our cache file.
+ */
+static bool
+program_cache_parse_entry(char *line, ProgramCacheEntry *entry)
+{
+	char *fields[8] = { 0 };
+	int fieldCount = 0;
+	char *ptr = line;
+
+	while (fieldCount < 8)
+	{
+		fields[fieldCount++] = ptr;
+
+		if (fieldCount == 8)
+		{
+			break;
+		}
+
+		char *tab = strchr(ptr, '\t');
+
+		if (tab == NULL)
+		{
+			return false;
+		}
+
+		*tab = '\0';
+		ptr = tab + 1;
+	}
+
+	if (strlcpy(entry->program, fields[0], sizeof(entry->program)) >=
+		sizeof(entry->program) ||
+		strlcpy(entry->arg, fields[1], sizeof(entry->arg)) >=
+		sizeof(entry->arg) ||
+		strlcpy(entry->output, fields[7], sizeof(entry->output)) >=
+		sizeof(entry->output))
+	{
+		return false;
+	}
+
+	return sscanf(fields[2], "%" SCNu64, &(entry->inode)) == 1 &&
+		   sscanf(fields[3], "%" SCNd64, &(entry->size)) == 1 &&
+		   sscanf(fields[4], "%" SCNd64, &(entry->mtimeSec)) == 1 &&
+		   sscanf(fields[5], "%" SCNd64, &(entry->mtimeNsec)) == 1 &&
+		   sscanf(fields[6], "%" SCNd64, &(entry->cachedAt)) == 1;
+}
+
+
+/*
+ * program_cache_write writes our cache file to a temporary file that is then
+ * renamed, so that concurrent pg_autoctl commands always read a complete
+ * file. The cache is not worth an fsync.
+ */
+static void
+program_cache_write(const char *cachePath, ProgramCache *cache)
+{
+	char tempPath[MAXPGPATH] = { 0 };
+
+	sformat(tempPath, sizeof(tempPath), "%s.%d", cachePath, getpid());
+
+	FILE *file = fopen(tempPath, "w");
+
+	if (file == NULL)
+	{
+		log_debug("Failed to create \"%s\": %m", tempPath);
+		return;
+	}
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		ProgramCacheEntry *entry = &(cache->entries[i]);
+
+		fformat(file,
+				"%s\t%s\t%" PRIu64 "\t%" PRId64 "\t%" PRId64
+				"\t%" PRId64 "\t%" PRId64 "\t%s\n",
+				entry->program,
+				entry->arg,
+				entry->inode,
+				entry->size,
+				entry->mtimeSec,
+				entry->mtimeNsec,
+				entry->cachedAt,
+				entry->output);
+	}
+
+	if (fclose(file) != 0 || rename(tempPath, cachePath) != 0)
+	{
+		log_debug("Failed to write \"%s\": %m", cachePath);
+		(void) unlink(tempPath);
+	}
+}
+
+
+/*
+ * program_run_first_line runs "program arg" and copies the first line of its
+ * output into output.
+ */
+static bool
+program_run_first_line(const char *program, const char *arg,
+					   char *output, size_t size)
+{
+	Program prog = run_program(program, arg, NULL);
+	char *lines[1];
+
+	if (prog.returnCode != 0)
+	{
+		errno = prog.error;
+		log_error("Failed to run \"%s %s\": %m", program, arg);
+		free_program(&prog);
+		return false;
+	}
+
+	if (prog.stdOut == NULL || splitLines(prog.stdOut, lines, 1) != 1)
+	{
+		log_error("Unable to parse output from \"%s %s\"", program, arg);
+		free_program(&prog);
+		return false;
+	}
+
+	/* a tab or a newline would break our cache file format */
+	if (strchr(lines[0], '\t') != NULL)
+	{
+		log_error("Unable to parse output from \"%s %s\"", program, arg);
+		free_program(&prog);
+		return false;
+	}
+
+	strlcpy(output, lines[0], size);
+	free_program(&prog);
+
+	return true;
+}
@@ -0,0 +1,29 @@
+/*
+ * src/bin/pg_autoctl/program_cache.h
+ *   Cache the output of the Postgres programs we run to discover the local
+ *   Postgres installation.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "postgres_fe.h"
+
+/* environment variable to disable the cache, e.g. when debugging */
+#define PG_AUTOCTL_PROGRAM_CACHE "PG_AUTOCTL_PROGRAM_CACHE"
+
+/* how many entries we keep, and how long we trust them */
+#define PROGRAM_CACHE_MAX_ENTRIES 64
+#define PROGRAM_CACHE_TTL 3600  /* seconds */
+
+bool program_cache_run(const char *program, const char *arg,
+					   char *output, size_t size);
+
+#endif /* PROGRAM_CACHE_H */
@@ -8,25 +8,40 @@
  */
 
 #include <inttypes.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
 #include "cli_common.h"
 #include "cli_root.h"
+#include "config_watch.h"
 #include "defaults.h"
 #include "fsm.h"
 #include "keeper.h"
 #include "keeper_config.h"
 #include "keeper_pg_init.h"
 #include "log.h"
+#include "metrics.h"
 #include "monitor.h"
+#include "node_probe.h"
+#include "parsing.h"
 #include "pgctl.h"
 #include "pidfile.h"
 #include "service_keeper.h"
+#include "service_metrics.h"
+#include "service_monitor_proxy.h"
+#include "service_node_probe.h"
 #include "service_postgres_ctl.h"
+#include "service_router.h"
+#include "shared_state.h"
 #include "signals.h"
 #include "state.h"
 #include "string_utils.h"
@@ -36,6 +51,21 @@
 
 static bool keepRunning = true;
 
+/*
+ * When the monitor or Postgres is not available the main loop would log the
+ * same messages at every round, so those are rate-limited, see log.h.
+ */
+static log_ratelimit readStateLogs = { 0 };
+static log_ratelimit updatePgStateLogs = { 0 };
+static log_ratelimit otherNodesLogs = { 0 };
+static log_ratelimit ensureStateLogs = { 0 };
+static log_ratelimit transitionLogs = { 0 };
+static log_ratelimit nodeActiveLogs = { 0 };
+static log_ratelimit networkPartitionLogs = { 0 };
+static log_ratelimit networkHealthyLogs = { 0 };
+static log_ratelimit standbyContactLogs = { 0 };
+static log_ratelimit assignmentLeaseLogs = { 0 };
+
 /* list of hooks to run at reload time */
 KeeperReloadFunction KeeperReloadHooksArray[] = {
 	&keeper_reload_configuration,
@@ -54,9 +84,54 @@ KeeperNodesArrayRefreshFunction *KeeperRefreshHooks =
 	KeeperNodesArrayRefreshArray;
 
 
+/*
+ * The keeper waits for the postmaster to exit with a pidfd when the platform
+ * supports it (Linux 5.3 and later), so that we notice a crash of the local
+ * Postgres right away rather than at the next round.
+ */
+typedef struct PostmasterWatch
+{
+	pid_t pid;
+	int pidfd;
+} PostmasterWatch;
+
+/*
+ * The keeper sleeps until either the postmaster exits or a watched
+ * configuration file changes, and only has a single file descriptor to wait
+ * on. When we have both, we register them in an epoll set, which is readable
+ * as soon as one of them is.
+ */
+typedef struct KeeperWakeup
+{
+	int epollFd;
+	int configFd;               /* registered in the epoll set */
+	pid_t pid;                  /* postmaster pid registered in the epoll set */
+} KeeperWakeup;
+
+/* index of the files in the ConfigWatch of the keeper */
+#define KEEPER_WATCH_CONFIG_FILE 0
+#define KEEPER_WATCH_NODES_FILE 1
+
+
 static bool service_keeper_node_active(Keeper *keeper, bool doInit);
+static int keeper_report_interval(Keeper *keeper);
+static void keeper_watch_postmaster(PostmasterWatch *watch, pid_t pid);
+static void keeper_check_postmaster_watch(PostmasterWatch *watch);
+static bool keeper_check_config_watch(Keeper *keeper,
+									  ConfigWatch *watch,
+									  bool *watching);
+static int keeper_wakeup_fd(KeeperWakeup *wakeup,
+							PostmasterWatch *postmasterWatch,
+							int configFd);
+static void keeper_wakeup_finish(KeeperWakeup *wakeup);
+static void keeper_unwatch_postmaster(PostmasterWatch *watch);
+static void keeper_record_metrics(Keeper *keeper, instr_time *loopStart);
+static void keeper_check_loop_overrun(Keeper *keeper,
+									  instr_time *previousLoopStart,
+									  instr_time *loopStart);
 static void check_for_network_partitions(Keeper *keeper);
 static bool is_network_healthy(Keeper *keeper);
+static bool is_network_healthy_probe(Keeper *keeper);
 static bool in_network_partition(KeeperStateData *keeperState, uint64_t now,
 								 int networkPartitionTimeout);
 
@@ -70,6 +145,25 @@ start_keeper(Keeper *keeper)
 {
 	const char *pidfile = keeper->config.pathnames.pid;
 
+	/*
+	 * The node-active and node-probe services report to the monitor on a
+	 * schedule, we don't apply the scheduling to Postgres.
+	 */
+	ServiceScheduling scheduling = { 0 };
+	ServiceScheduling *keeperScheduling = NULL;
+
+	if (keeper->config.service_nice != 0 ||
+		!IS_EMPTY_STRING_BUFFER(keeper->config.service_cpu_affinity))
+	{
+		scheduling.nice = keeper->config.service_nice;
+
+		strlcpy(scheduling.cpuAffinity,
+				keeper->config.service_cpu_affinity,
+				sizeof(scheduling.cpuAffinity));
+
+		keeperScheduling = &scheduling;
+	}
+
 	Service subprocesses[] = {
 		{
 			SERVICE_NAME_POSTGRES,
@@ -82,11 +176,94 @@ start_keeper(Keeper *keeper)
 			RP_PERMANENT,
 			-1,
 			&service_keeper_start,
-			(void *) keeper
-		}
+			(void *) keeper,
+			keeperScheduling
+		},
+
+		/* optional services, only started when they're enabled */
+		{ 0 },
+		{ 0 },
+		{ 0 },
+		{ 0 }
 	};
 
-	int subprocessesCount = sizeof(subprocesses) / sizeof(subprocesses[0]);
+	int subprocessesCount = 2;
+
+	if (keeper->config.metrics_port <= 0)
+	{
+		/* the metrics service is disabled */
+	}
+	else if (!metrics_create())
+	{
+		log_warn("Failed to setup the metrics service, "
+				 "continuing without metrics");
+	}
+	else
+	{
+		Service metrics = {
+			SERVICE_NAME_METRICS,
+			RP_PERMANENT,
+			-1,
+			&service_metrics_start,
+			(void *) keeper
+		};
+
+		subprocesses[subprocessesCount++] = metrics;
+	}
+
+	/*
+	 * The node-probe service samples the local node health at a fixed
+	 * cadence, so that a slow monitor doesn't delay it. Without it, the
+	 * node-active service runs the probes between its calls to the monitor.
+	 */
+	if (keeper->config.monitorDisabled || keeper->config.node_probe <= 0)
+	{
+		/* there is no monitor to report the samples to, or it's disabled */
+	}
+	else if (!node_probe_create())
+	{
+		log_warn("Failed to setup the node-probe service, "
+				 "continuing with the probes in the node-active service");
+	}
+	else
+	{
+		Service nodeProbe = {
+			SERVICE_NAME_NODE_PROBE,
+			RP_PERMANENT,
+			-1,
+			&service_node_probe_start,
+			(void *) keeper,
+			keeperScheduling
+		};
+
+		subprocesses[subprocessesCount++] = nodeProbe;
+	}
+
+	if (keeper->config.monitor_proxy > 0 && !keeper->config.monitorDisabled)
+	{
+		Service monitorProxy = {
+			SERVICE_NAME_MONITOR_PROXY,
+			RP_PERMANENT,
+			-1,
+			&service_monitor_proxy_start,
+			(void *) keeper
+		};
+
+		subprocesses[subprocessesCount++] = monitorProxy;
+	}
+
+	if (keeper->config.router_port > 0 && !keeper->config.monitorDisabled)
+	{
+		Service router = {
+			SERVICE_NAME_ROUTER,
+			RP_PERMANENT,
+			-1,
+			&service_router_start,
+			(void *) keeper
+		};
+
+		subprocesses[subprocessesCount++] = router;
+	}
 
 	return supervisor_start(subprocesses, subprocessesCount, pidfile);
 }
@@ -264,10 +441,30 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 	bool warnedOnCurrentIteration = false;
 	bool warnedOnPreviousIteration = false;
 
+	instr_time previousLoopStart;
+
 	bool nodeHasBeenDroppedFromTheMonitor = false;
 
+	PostmasterWatch postmasterWatch = { 0, -1 };
+	ConfigWatch configWatch = { 0 };
+	KeeperWakeup wakeup = { -1, -1, 0 };
+	bool watchingConfig = false;
+
 	log_debug("pg_autoctl service is starting");
 
+	/* when the metrics service is enabled, attach to its shared memory */
+	if (!metrics_attach())
+	{
+		log_warn("Failed to attach to the metrics, continuing without them");
+	}
+
+	/* when the node-probe service is enabled, attach to its shared memory */
+	if (!node_probe_attach())
+	{
+		log_warn("Failed to attach to the node-probe service, "
+				 "running the probes in the node-active service");
+	}
+
 	/* setup our monitor client connection with our notification handler */
 	(void) monitor_setup_notifications(monitor,
 									   keeperState->current_group,
@@ -306,6 +503,8 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		}
 	}
 
+	INSTR_TIME_SET_ZERO(previousLoopStart);
+
 	while (keepRunning)
 	{
 		bool couldContactMonitorThisRound = false;
@@ -313,18 +512,51 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		bool needStateChange = false;
 		bool transitionFailed = false;
 
+		instr_time loopStart;
+
 		/*
 		 * If we're in a stable state (current state and goal state are the
 		 * same, and this didn't change in the previous loop), then we can
 		 * sleep for a while. As the monitor notifies every state change, we
 		 * can also interrupt our sleep as soon as we get the hint.
 		 */
+		if (doSleep)
+		{
+			/* also wake-up as soon as the local Postgres exits */
+			(void) keeper_watch_postmaster(&postmasterWatch,
+										   postgres->pgIsRunning
+										   ? postgres->postgresSetup.pidFile.pid
+										   : 0);
+
+			/*
+			 * Consume the file events of the previous round, such as our own
+			 * state file updates, and skip sleeping if a watched file has
+			 * been edited in the meantime.
+			 */
+			if (keeper_check_config_watch(keeper, &configWatch, &watchingConfig))
+			{
+				doSleep = false;
+			}
+		}
+
+		int wakeupFd =
+			keeper_wakeup_fd(&wakeup,
+							 &postmasterWatch,
+							 watchingConfig ? configWatch.fd : -1);
+
 		if (doSleep && !config->monitorDisabled)
 		{
-			int timeoutMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+			int timeoutMs = keeper_report_interval(keeper);
 
 			bool groupStateHasChanged = false;
 
+			(void) shared_state_keeper_heartbeat(timeoutMs +
+												 PG_AUTOCTL_KEEPER_ROUND_TIMEOUT
+												 * 1000);
+
+			/* LISTEN, or wait on the monitor's group state change counter */
+			monitor->useStateChangeWait = config->monitor_wait != 0;
+
 			/* establish a connection for notifications if none present */
 			(void) pgsql_prepare_to_wait(&(monitor->notificationClient));
 			(void) monitor_wait_for_state_change(monitor,
@@ -332,10 +564,19 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 												 keeperState->current_group,
 												 keeperState->current_node_id,
 												 timeoutMs,
+												 wakeupFd,
 												 &groupStateHasChanged);
 
-			/* when no state change has been notified, close the connection */
+			/* apply pushed settings right away, node_active confirms them */
+			(void) keeper_apply_pushed_settings(keeper);
+
+			/*
+			 * When no state change has been notified, close the LISTEN
+			 * connection. Waiting on the state change counter keeps no
+			 * server-side state between calls, so that connection is kept.
+			 */
 			if (!groupStateHasChanged &&
+				!monitor->useStateChangeWait &&
 				monitor->notificationClient.connectionStatementType ==
 				PGSQL_CONNECTION_MULTI_STATEMENT)
 			{
@@ -344,13 +585,41 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		}
 		else if (doSleep && config->monitorDisabled)
 		{
-			int timeoutUs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000 * 1000;
+			int timeoutMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+
+			(void) shared_state_keeper_heartbeat(timeoutMs +
+												 PG_AUTOCTL_KEEPER_ROUND_TIMEOUT
+												 * 1000);
+
+			if (wakeupFd >= 0)
+			{
+				struct pollfd pollFd = { wakeupFd, POLLIN, 0 };
 
-			pg_usleep(timeoutUs);
+				/* EINTR is fine, we process signals next */
+				(void) poll(&pollFd, 1, timeoutMs);
+			}
+			else
+			{
+				pg_usleep(timeoutMs * 1000);
+			}
+		}
+
+		if (doSleep)
+		{
+			(void) keeper_check_postmaster_watch(&postmasterWatch);
+			(void) keeper_check_config_watch(keeper, &configWatch, &watchingConfig);
 		}
 
 		doSleep = true;
 
+		INSTR_TIME_SET_CURRENT(loopStart);
+
+		(void) keeper_check_loop_overrun(keeper, &previousLoopStart, &loopStart);
+		previousLoopStart = loopStart;
+
+		/* tell the supervisor that we are alive, for the systemd watchdog */
+		(void) shared_state_keeper_heartbeat(PG_AUTOCTL_KEEPER_ROUND_TIMEOUT * 1000);
+
 		/*
 		 * Handle signals.
 		 *
@@ -391,11 +660,14 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 */
 		if (!keeper_load_state(keeper))
 		{
-			log_error("Failed to read keeper state file, retrying...");
+			log_error_ratelimit(&readStateLogs,
+								"Failed to read keeper state file, retrying...");
 			CHECK_FOR_FAST_SHUTDOWN;
 			continue;
 		}
 
+		(void) log_ratelimit_reset(&readStateLogs);
+
 		if (firstLoop)
 		{
 			log_info("pg_autoctl service is running, "
@@ -410,14 +682,20 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		if (!keeper_update_pg_state(keeper, LOG_WARN))
 		{
 			warnedOnCurrentIteration = true;
-			log_warn("Failed to update the keeper's state from the local "
-					 "PostgreSQL instance.");
+			log_warn_ratelimit(&updatePgStateLogs,
+							   "Failed to update the keeper's state from "
+							   "the local PostgreSQL instance.");
 		}
-		else if (warnedOnPreviousIteration)
+		else
 		{
-			log_info("Updated the keeper's state from the local "
-					 "PostgreSQL instance, which is %s",
-					 postgres->pgIsRunning ? "running" : "not running");
+			(void) log_ratelimit_reset(&updatePgStateLogs);
+
+			if (warnedOnPreviousIteration)
+			{
+				log_info("Updated the keeper's state from the local "
+						 "PostgreSQL instance, which is %s",
+						 postgres->pgIsRunning ? "running" : "not running");
+			}
 		}
 
 		CHECK_FOR_FAST_SHUTDOWN;
@@ -439,9 +717,12 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
 			{
 				/* we will try again... */
-				log_warn("Failed to update our list of other nodes");
+				log_warn_ratelimit(&otherNodesLogs,
+								   "Failed to update our list of other nodes");
 				continue;
 			}
+
+			(void) log_ratelimit_reset(&otherNodesLogs);
 		}
 		/*
 		 * If the monitor is not disabled, call the node_active function on the
@@ -464,17 +745,34 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 				 *
 				 * Failed to get the goal state from the monitor
 				 */
+				(void) log_ratelimit_reset(&nodeActiveLogs);
+				(void) log_ratelimit_reset(&networkPartitionLogs);
+				(void) log_ratelimit_reset(&networkHealthyLogs);
+				(void) log_ratelimit_reset(&standbyContactLogs);
+				(void) log_ratelimit_reset(&assignmentLeaseLogs);
+
 				log_info("Successfully got the goal state from the monitor");
 			}
 
 			couldContactMonitor = couldContactMonitorThisRound;
+
+			/* a hot standby monitor only takes over when we lost it too */
+			(void) monitor_report_contact(&(keeper->monitor),
+										  keeperState->current_node_id,
+										  couldContactMonitor);
 		}
 
 		if (keeperState->assigned_role != keeperState->current_role)
 		{
 			needStateChange = true;
 
-			if (couldContactMonitor)
+			if (couldContactMonitor && keeper->traceId[0] != '\0')
+			{
+				log_info("Monitor assigned new state \"%s\" in failover trace %s",
+						 NodeStateToString(keeperState->assigned_role),
+						 keeper->traceId);
+			}
+			else if (couldContactMonitor)
 			{
 				log_info("Monitor assigned new state \"%s\"",
 						 NodeStateToString(keeperState->assigned_role));
@@ -503,7 +801,13 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 		 * time when meanwhile the Monitor did set our goal_state to DEMOTED
 		 * because the other node has been promoted, which could happen if this
 		 * node was rebooting for a long enough time.
+		 *
+		 * Transitions and Postgres restarts take as long as they need, such
+		 * as when running pg_basebackup or crash recovery, so we don't
+		 * publish a deadline for our next heartbeat in the meantime.
 		 */
+		(void) shared_state_keeper_heartbeat(0);
+
 		if (needStateChange)
 		{
 			/*
@@ -523,7 +827,8 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 					 * transition to the next state. That's what we keep track
 					 * of with "transitionFailed".
 					 */
-					log_warn(
+					log_warn_ratelimit(
+						&ensureStateLogs,
 						"pg_autoctl failed to ensure current state \"%s\": "
 						"PostgreSQL %s running",
 						NodeStateToString(keeperState->current_role),
@@ -533,24 +838,39 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 
 			if (!keeper_fsm_reach_assigned_state(keeper))
 			{
-				log_error("Failed to transition to state \"%s\", retrying... ",
-						  NodeStateToString(keeperState->assigned_role));
+				log_error_ratelimit(&transitionLogs,
+									"Failed to transition to state \"%s\", "
+									"retrying... ",
+									NodeStateToString(keeperState->assigned_role));
 
 				transitionFailed = true;
 			}
+			else
+			{
+				(void) log_ratelimit_reset(&transitionLogs);
+			}
 		}
-		else if (couldContactMonitor || config->monitorDisabled)
+		else if (couldContactMonitor ||
+				 config->monitorDisabled ||
+				 keeper_assignment_lease_is_valid(keeper))
 		{
+			/*
+			 * While the lease of our assigned state is valid, such as when
+			 * the monitor restarts, we keep serving that state.
+			 */
 			if (!keeper_ensure_current_state(keeper))
 			{
 				warnedOnCurrentIteration = true;
-				log_warn("pg_autoctl failed to ensure current state \"%s\": "
-						 "PostgreSQL %s running",
-						 NodeStateToString(keeperState->current_role),
-						 postgres->pgIsRunning ? "is" : "is not");
+				log_warn_ratelimit(&ensureStateLogs,
+								   "pg_autoctl failed to ensure current state "
+								   "\"%s\": PostgreSQL %s running",
+								   NodeStateToString(keeperState->current_role),
+								   postgres->pgIsRunning ? "is" : "is not");
 			}
 			else if (warnedOnPreviousIteration)
 			{
+				(void) log_ratelimit_reset(&ensureStateLogs);
+
 				log_info("pg_autoctl managed to ensure current state \"%s\": "
 						 "PostgreSQL %s running",
 						 NodeStateToString(keeperState->current_role),
@@ -558,8 +878,26 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			}
 		}
 
-		/* now is a good time to make sure we're closing our connections */
-		pgsql_finish(&(postgres->sqlClient));
+		/*
+		 * The local connection is kept open between rounds, and only closed
+		 * when Postgres is not running anymore. keeper_update_pg_state
+		 * opens a new connection when needed.
+		 */
+		if (!postgres->pgIsRunning)
+		{
+			pgsql_finish(&(postgres->sqlClient));
+		}
+
+		(void) shared_state_keeper_heartbeat(PG_AUTOCTL_KEEPER_ROUND_TIMEOUT * 1000);
+
+		(void) keeper_maintain_prewarm(keeper);
+		(void) keeper_run_primary_change_hooks(keeper);
+		(void) keeper_report_replication_stats(keeper);
+		(void) keeper_report_replay_progress(keeper);
+		(void) keeper_report_node_latency(keeper);
+		(void) keeper_check_sync_rep_stall(keeper);
+		(void) keeper_check_storage(keeper);
+		(void) pgsql_log_connections_per_minute();
 
 		CHECK_FOR_FAST_SHUTDOWN;
 
@@ -581,6 +919,9 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 			}
 		}
 
+		(void) keeper_record_metrics(keeper, &loopStart);
+		(void) keeper_set_log_context(keeper);
+
 		/*
 		 * If the node has been dropped, we exit the process... after having
 		 * done at least another round where we could contact the monitor to
@@ -660,7 +1001,17 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 	}
 
 	/* One last check that we do not have any connections open */
+	(void) keeper_prewarm_stop(&(keeper->prewarm));
 	pgsql_finish(&(keeper->monitor.pgsql));
+	pgsql_finish(&(postgres->sqlClient));
+
+	(void) keeper_unwatch_postmaster(&postmasterWatch);
+	(void) keeper_wakeup_finish(&wakeup);
+
+	if (watchingConfig)
+	{
+		(void) config_watch_finish(&configWatch);
+	}
 
 	if (nodeHasBeenDroppedFromTheMonitor)
 	{
@@ -672,6 +1023,369 @@ keeper_node_active_loop(Keeper *keeper, pid_t start_pid)
 }
 
 
+/*
+ * keeper_watch_postmaster opens a pidfd for the given postmaster pid, unless
+ * we are already watching that pid. A pid of zero means that Postgres is not
+ * running, and we stop watching.
+ *
+ * When pidfds are not supported, we silently keep the watch->pidfd at -1 and
+ * the keeper only notices that Postgres has exited at its next round.
+ */
+static void
+keeper_watch_postmaster(PostmasterWatch *watch, pid_t pid)
+{
+	if (pid == watch->pid)
+	{
+		return;
+	}
+
+	(void) keeper_unwatch_postmaster(watch);
+
+	watch->pid = pid;
+
+	if (pid <= 0)
+	{
+		return;
+	}
+
+#if defined(SYS_pidfd_open)
+	watch->pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+	if (watch->pidfd < 0)
+	{
+		log_debug("Failed to open a pidfd for Postgres pid %d: %m", pid);
+	}
+#endif
+}
+
+
+/*
+ * keeper_check_postmaster_watch checks if the postmaster we are watching has
+ * exited. When that's the case our pidfd is going to be readable from now
+ * on, so we close it, and keep the pid around so that we don't watch it
+ * again.
+ */
+static void
+keeper_check_postmaster_watch(PostmasterWatch *watch)
+{
+	struct pollfd pollFd = { watch->pidfd, POLLIN, 0 };
+
+	if (watch->pidfd < 0)
+	{
+		return;
+	}
+
+	if (poll(&pollFd, 1, 0) > 0)
+	{
+		log_debug("Postgres with pid %d has exited", watch->pid);
+
+		close(watch->pidfd);
+		watch->pidfd = -1;
+	}
+}
+
+
+/*
+ * keeper_unwatch_postmaster stops watching the postmaster.
+ */
+static void
+keeper_unwatch_postmaster(PostmasterWatch *watch)
+{
+	if (watch->pidfd >= 0)
+	{
+		close(watch->pidfd);
+	}
+
+	watch->pid = 0;
+	watch->pidfd = -1;
+}
+
+
+/*
+ * keeper_check_config_watch starts or stops watching the configuration files
+ * depending on the pg_autoctl.watch_config setting, and checks the watched
+ * files for changes. A change of the configuration file is processed as if
+ * we had received SIGHUP. The function returns true when any watched file
+ * changed, so that the keeper runs its next round without sleeping.
+ */
+static bool
+keeper_check_config_watch(Keeper *keeper, ConfigWatch *watch, bool *watching)
+{
+	KeeperConfig *config = &(keeper->config);
+
+	if (!config->watch_config)
+	{
+		if (*watching)
+		{
+			log_info("Stopped watching configuration file \"%s\"",
+					 config->pathnames.config);
+
+			(void) config_watch_finish(watch);
+			*watching = false;
+		}
+
+		return false;
+	}
+
+	if (!*watching)
+	{
+		(void) config_watch_init(watch);
+
+		if (!config_watch_add(watch, config->pathnames.config) ||
+			!config_watch_add(watch, config->pathnames.nodes))
+		{
+			/* errors have already been logged */
+			(void) config_watch_finish(watch);
+			return false;
+		}
+
+		log_info("Watching configuration file \"%s\" for changes%s",
+				 config->pathnames.config,
+				 watch->fd >= 0 ? "" : ", at every round");
+
+		*watching = true;
+		return false;
+	}
+
+	if (!config_watch_check(watch))
+	{
+		return false;
+	}
+
+	if (watch->files[KEEPER_WATCH_CONFIG_FILE].changed)
+	{
+		log_info("Configuration file \"%s\" has changed, reloading",
+				 config->pathnames.config);
+
+		asked_to_reload = 1;
+	}
+
+	return true;
+}
+
+
+/*
+ * keeper_wakeup_fd returns the file descriptor the keeper should wait on
+ * while sleeping, in addition to the monitor notifications, or -1.
+ */
+static int
+keeper_wakeup_fd(KeeperWakeup *wakeup,
+				 PostmasterWatch *postmasterWatch,
+				 int configFd)
+{
+	int pidfd = postmasterWatch->pidfd;
+
+	if (pidfd < 0)
+	{
+		return configFd;
+	}
+
+	if (configFd < 0)
+	{
+		return pidfd;
+	}
+
+#if defined(__linux__)
+	if (wakeup->epollFd >= 0 && wakeup->configFd != configFd)
+	{
+		(void) keeper_wakeup_finish(wakeup);
+	}
+
+	if (wakeup->epollFd < 0)
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = configFd };
+
+		wakeup->epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (wakeup->epollFd < 0)
+		{
+			log_debug("Failed to create an epoll set: %m");
+			return pidfd;
+		}
+
+		if (epoll_ctl(wakeup->epollFd, EPOLL_CTL_ADD, configFd, &event) != 0)
+		{
+			log_debug("Failed to add the inotify fd to the epoll set: %m");
+			(void) keeper_wakeup_finish(wakeup);
+			return pidfd;
+		}
+
+		wakeup->configFd = configFd;
+		wakeup->pid = 0;
+	}
+
+	/* closing a pidfd removes it from the epoll set, see epoll(7) */
+	if (wakeup->pid != postmasterWatch->pid)
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = pidfd };
+
+		if (epoll_ctl(wakeup->epollFd, EPOLL_CTL_ADD, pidfd, &event) != 0 &&
+			errno != EEXIST)
+		{
+			log_debug("Failed to add the pidfd to the epoll set: %m");
+			return pidfd;
+		}
+
+		wakeup->pid = postmasterWatch->pid;
+	}
+
+	return wakeup->epollFd;
+#else
+	return pidfd;
+#endif
+}
+
+
+/*
+ * keeper_wakeup_finish closes the epoll set, if any.
+ */
+static void
+keeper_wakeup_finish(KeeperWakeup *wakeup)
+{
+	if (wakeup->epollFd >= 0)
+	{
+		close(wakeup->epollFd);
+	}
+
+	wakeup->epollFd = -1;
+	wakeup->configFd = -1;
+	wakeup->pid = 0;
+}
+
+
+/*
+ * keeper_record_metrics updates the metrics with this round of the keeper
+ * main loop. The replication lag is computed from the LSN that the monitor
+ * has for the primary node, and is only known on a standby.
+ */
+static void
+keeper_record_metrics(Keeper *keeper, instr_time *loopStart)
+{
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	NodeAddressArray *otherNodes = &(keeper->otherNodes);
+
+	instr_time duration;
+	int64_t lagBytes = -1;
+	uint64_t localLSN = 0;
+
+	if (!metrics_enabled())
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, *loopStart);
+
+	(void) metrics_record_loop(INSTR_TIME_GET_DOUBLE(duration));
+
+	if (postgres->postgresSetup.is_in_recovery &&
+		parseLSN(postgres->currentLSN, &localLSN))
+	{
+		for (int i = 0; i < otherNodes->count; i++)
+		{
+			uint64_t primaryLSN = 0;
+
+			if (otherNodes->nodes[i].isPrimary &&
+				parseLSN(otherNodes->nodes[i].lsn, &primaryLSN))
+			{
+				lagBytes = primaryLSN > localLSN ? primaryLSN - localLSN : 0;
+				break;
+			}
+		}
+	}
+
+	(void) metrics_record_node_state(keeperState->current_node_id,
+									 keeperState->current_role,
+									 keeperState->assigned_role,
+									 postgres->postgresSetup.control.timeline_id,
+									 postgres->currentLSN,
+									 lagBytes);
+}
+
+
+/*
+ * keeper_check_loop_overrun accounts for the rounds of the keeper main loop
+ * that start later than the report interval allows, that is when the monitor
+ * does not hear from us in time. On a host where the Postgres backends use
+ * all the CPU time, this is how we see the keeper being starved. A slow
+ * previous round, such as with a FSM transition, is an overrun too.
+ */
+static void
+keeper_check_loop_overrun(Keeper *keeper,
+						  instr_time *previousLoopStart,
+						  instr_time *loopStart)
+{
+	instr_time elapsed;
+
+	if (INSTR_TIME_IS_ZERO(*previousLoopStart))
+	{
+		return;
+	}
+
+	elapsed = *loopStart;
+	INSTR_TIME_SUBTRACT(elapsed, *previousLoopStart);
+
+	double overrunMs =
+		INSTR_TIME_GET_MILLISEC(elapsed) -
+		keeper_report_interval(keeper) -
+		PG_AUTOCTL_KEEPER_LOOP_OVERRUN_TOLERANCE;
+
+	if (overrunMs > 0)
+	{
+		log_debug("keeper main loop round started %.0fms late", overrunMs);
+
+		(void) metrics_record_loop_overrun(overrunMs / 1000.0);
+	}
+}
+
+
+/*
+ * keeper_report_interval returns how long to wait for a state change
+ * notification before calling node_active again, in milliseconds. The
+ * monitor suggests a long interval for steady groups and a short one for
+ * groups in transition, and we follow it within the configured bounds. When
+ * the monitor did not suggest an interval, we use the default sleep time.
+ *
+ * On a primary node with timeout.sync_rep_stall_timeout set, we also wake up
+ * often enough to notice commits stuck on synchronous replication in time.
+ */
+static int
+keeper_report_interval(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	int stallTimeoutMs = config->sync_rep_stall_timeout;
+
+	int minIntervalMs = config->min_report_interval;
+	int maxIntervalMs = config->max_report_interval;
+	int intervalMs = keeper->reportIntervalMs;
+
+	if (intervalMs <= 0)
+	{
+		intervalMs = PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000;
+	}
+
+	if (minIntervalMs > 0 && intervalMs < minIntervalMs)
+	{
+		intervalMs = minIntervalMs;
+	}
+
+	if (maxIntervalMs > 0 && intervalMs > maxIntervalMs)
+	{
+		intervalMs = maxIntervalMs;
+	}
+
+	if (stallTimeoutMs > 0 &&
+		keeper->state.current_role == PRIMARY_STATE &&
+		intervalMs > stallTimeoutMs / 2)
+	{
+		intervalMs = Max(stallTimeoutMs / 2, PG_AUTOCTL_KEEPER_MIN_REPORT_INTERVAL);
+	}
+
+	return intervalMs;
+}
+
+
 /*
  * keeper_node_active calls the node_active function on the monitor, and when
  * it could contact the monitor it also updates our copy of the list of other
@@ -691,13 +1405,38 @@ service_keeper_node_active(Keeper *keeper, bool doInit)
 	MonitorAssignedState assignedState = { 0 };
 
 	uint64_t now = time(NULL);
+	instr_time start;
+	instr_time duration;
 
 	/*
 	 * Report the current state to the monitor and get the assigned state.
 	 */
-	if (!keeper_node_active(keeper, doInit, &assignedState))
+	INSTR_TIME_SET_CURRENT(start);
+
+	bool success = keeper_node_active(keeper, doInit, &assignedState);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	(void) metrics_record_node_active(success,
+									  INSTR_TIME_GET_DOUBLE(duration));
+
+	if (!success)
 	{
-		log_error("Failed to get the goal state from the monitor");
+		log_error_ratelimit(&nodeActiveLogs,
+							"Failed to get the goal state from the monitor");
+
+		if (keeper_assignment_lease_is_valid(keeper))
+		{
+			log_level_ratelimit(&assignmentLeaseLogs, LOG_INFO,
+								"Keeping assigned state \"%s\" for up to %ds "
+								"after the last contact with the monitor",
+								NodeStateToString(keeperState->assigned_role),
+								config->network_partition_timeout);
+		}
+
+		/* retry at the default pace rather than the steady interval */
+		keeper->reportIntervalMs = 0;
 
 		/*
 		 * Check whether we're likely to be in a network partition.
@@ -713,6 +1452,19 @@ service_keeper_node_active(Keeper *keeper, bool doInit)
 	 */
 	keeperState->last_monitor_contact = now;
 	keeperState->assigned_role = assignedState.state;
+	keeper->reportIntervalMs = assignedState.reportIntervalMs;
+	strlcpy(keeper->traceId, assignedState.traceId, sizeof(keeper->traceId));
+	INSTR_TIME_SET_CURRENT(keeper->lastMonitorContactTime);
+
+	if (assignedState.hasSynchronousStandbyNames)
+	{
+		keeper->monitor.hasPushedSettings = true;
+		strlcpy(keeper->monitor.pushedSynchronousStandbyNames,
+				assignedState.synchronousStandbyNames,
+				sizeof(keeper->monitor.pushedSynchronousStandbyNames));
+
+		(void) keeper_apply_pushed_settings(keeper);
+	}
 
 	if (keeperState->assigned_role != keeperState->current_role)
 	{
@@ -728,9 +1480,7 @@ service_keeper_node_active(Keeper *keeper, bool doInit)
 		return true;
 	}
 
-	bool forceCacheInvalidation = false;
-
-	if (!keeper_refresh_other_nodes(keeper, forceCacheInvalidation))
+	if (!keeper_update_other_nodes(keeper, &assignedState))
 	{
 		/*
 		 * We have a new MD5 but failed to update our list, try again next
@@ -789,7 +1539,8 @@ check_for_network_partitions(Keeper *keeper)
 
 	if (keeperState->current_role == PRIMARY_STATE)
 	{
-		log_warn("Checking for network partitions...");
+		log_warn_ratelimit(&networkPartitionLogs,
+						   "Checking for network partitions...");
 
 		if (!is_network_healthy(keeper))
 		{
@@ -800,7 +1551,8 @@ check_for_network_partitions(Keeper *keeper)
 		}
 		else
 		{
-			log_info("Network is healthy");
+			log_level_ratelimit(&networkHealthyLogs, LOG_INFO,
+								"Network is healthy");
 		}
 	}
 }
@@ -835,12 +1587,20 @@ is_network_healthy(Keeper *keeper)
 		return true;
 	}
 
+	/* reply_time is only available in pg_stat_replication in Postgres 12 */
+	if (config->network_partition_probe_timeout > 0 &&
+		config->pgSetup.control.pg_control_version >= 1200)
+	{
+		return is_network_healthy_probe(keeper);
+	}
+
 	if (primary_has_replica(postgres, PG_AUTOCTL_REPLICA_USERNAME, &hasReplica) &&
 		hasReplica)
 	{
 		keeperState->last_secondary_contact = now;
-		log_warn("We lost the monitor, but still have a standby: "
-				 "we're not in a network partition, continuing.");
+		log_warn_ratelimit(&standbyContactLogs,
+						   "We lost the monitor, but still have a standby: "
+						   "we're not in a network partition, continuing.");
 		return true;
 	}
 
@@ -859,6 +1619,85 @@ is_network_healthy(Keeper *keeper)
 }
 
 
+/*
+ * is_network_healthy_probe implements timeout.network_partition_probe_timeout.
+ *
+ * A standby is listed in pg_stat_replication until wal_sender_timeout has
+ * expired, well after the network is gone, so instead we compare the time
+ * since the last reply of any standby, which we have them send every second,
+ * and the time since our last successful call to the monitor, to a budget
+ * counted in milliseconds. When both are out of budget, we demote.
+ */
+static bool
+is_network_healthy_probe(Keeper *keeper)
+{
+	KeeperConfig *config = &(keeper->config);
+	KeeperStateData *keeperState = &(keeper->state);
+	LocalPostgresServer *postgres = &(keeper->postgres);
+	int replyAgeMs = -1;
+
+	/* standbys reply every second, don't demote between two replies */
+	int budgetMs =
+		config->network_partition_probe_timeout < NETWORK_PARTITION_PROBE_MIN_TIMEOUT
+		? NETWORK_PARTITION_PROBE_MIN_TIMEOUT
+		: config->network_partition_probe_timeout;
+
+	if (primary_get_replica_reply_age(postgres,
+									  PG_AUTOCTL_REPLICA_USERNAME,
+									  &replyAgeMs) &&
+		replyAgeMs >= 0 &&
+		replyAgeMs <= budgetMs)
+	{
+		keeperState->last_secondary_contact = time(NULL);
+		log_warn_ratelimit(&standbyContactLogs,
+						   "We lost the monitor, but a standby replied "
+						   "%d ms ago: we're not in a network partition, "
+						   "continuing.",
+						   replyAgeMs);
+		return true;
+	}
+
+	/* same as in_network_partition, we need to have had contact before */
+	if (INSTR_TIME_IS_ZERO(keeper->lastMonitorContactTime) ||
+		keeperState->last_secondary_contact == 0)
+	{
+		return true;
+	}
+
+	instr_time monitorAge;
+
+	INSTR_TIME_SET_CURRENT(monitorAge);
+	INSTR_TIME_SUBTRACT(monitorAge, keeper->lastMonitorContactTime);
+
+	int monitorAgeMs = (int) INSTR_TIME_GET_MILLISEC(monitorAge);
+
+	if (monitorAgeMs <= budgetMs)
+	{
+		return true;
+	}
+
+	if (replyAgeMs < 0)
+	{
+		log_info("Failed to contact the monitor in %d ms and no standby is "
+				 "connected, at %d ms we shut down PostgreSQL to prevent "
+				 "split brain issues",
+				 monitorAgeMs,
+				 budgetMs);
+	}
+	else
+	{
+		log_info("Failed to contact the monitor in %d ms and the standbys "
+				 "in %d ms, at %d ms we shut down PostgreSQL to prevent "
+				 "split brain issues",
+				 monitorAgeMs,
+				 replyAgeMs,
+				 budgetMs);
+	}
+
+	return false;
+}
+
+
 /*
  * in_network_partition determines if we're in a network partition by applying
  * the configured network_partition_timeout to current known values. Updating
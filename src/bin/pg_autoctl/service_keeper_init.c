@@ -115,6 +115,7 @@ service_keeper_init_start(void *context, pid_t *pid)
 									  "pg_autoctl: node installer";
 
 			(void) set_ps_title(serviceName);
+			(void) log_set_context("service", SERVICE_NAME_KEEPER_INIT);
 
 			setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
 
@@ -0,0 +1,394 @@
+/*
+ * src/bin/pg_autoctl/service_metrics.c
+ *   The pg_autoctl metrics service, serving Prometheus metrics over HTTP.
+ *
+ * The service answers GET /metrics requests with the content of the metrics
+ * shared memory segment, formatted in the Prometheus text exposition format.
+ * It only implements what's needed for a scraper: one request per connection,
+ * and a response that we write before closing the connection.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "metrics.h"
+#include "pidfile.h"
+#include "runprogram.h"
+#include "service_metrics.h"
+#include "signals.h"
+#include "string_utils.h"
+
+/* we only look at the request line, HTTP headers are ignored */
+#define METRICS_REQUEST_MAXLEN 1024
+
+/* don't let a slow client block the service */
+#define METRICS_CLIENT_TIMEOUT_MS 1000
+
+/* macOS doesn't have MSG_NOSIGNAL, there we ignore SIGPIPE instead */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int service_metrics_listen(int port);
+static void service_metrics_handle_client(int client);
+static bool service_metrics_write(int client, const char *data, size_t len);
+
+
+/*
+ * service_metrics_start starts the metrics sub-process.
+ */
+bool
+service_metrics_start(void *context, pid_t *pid)
+{
+	Keeper *keeper = (Keeper *) context;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/* time to create the metrics sub-process */
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the metrics process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_metrics_runprogram(keeper);
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_metrics_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_debug("pg_autoctl metrics process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_metrics_runprogram runs the metrics service:
+ *
+ *   $ pg_autoctl do service metrics --pgdata ...
+ *
+ * This function is intended to be called from the child process after a fork()
+ * has been successfully done at the parent process level: it's calling
+ * execve() and will never return.
+ */
+void
+service_metrics_runprogram(Keeper *keeper)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* see service_keeper_runprogram about using --pgdata here */
+	char *pgdata = keeperOptions.pgSetup.pgdata;
+	IntString semIdString = intToString(log_semaphore.semId);
+
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "metrics";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_metrics_loop listens on the configured metrics port and serves the
+ * metrics until asked to stop.
+ */
+bool
+service_metrics_loop(KeeperConfig *config, pid_t start_pid)
+{
+	if (!metrics_attach() || !metrics_enabled())
+	{
+		log_fatal("Failed to attach to the metrics shared memory segment");
+		return false;
+	}
+
+	/* a scraper that goes away must not kill the service */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	int sock = service_metrics_listen(config->metrics_port);
+
+	if (sock < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Serving Prometheus metrics on port %d", config->metrics_port);
+
+	for (;;)
+	{
+		struct pollfd pollFd = { sock, POLLIN, 0 };
+
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit)
+		{
+			break;
+		}
+
+		/* Check that we still own our PID file, or quit now */
+		(void) check_pidfile(config->pathnames.pid, start_pid);
+
+		/* EINTR is fine, we process signals next */
+		int ready = poll(&pollFd, 1, PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000);
+
+		if (ready <= 0 || !(pollFd.revents & POLLIN))
+		{
+			continue;
+		}
+
+		int client = accept(sock, NULL, NULL);
+
+		if (client < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN)
+			{
+				log_warn("Failed to accept a metrics connection: %m");
+			}
+			continue;
+		}
+
+		(void) service_metrics_handle_client(client);
+
+		close(client);
+	}
+
+	close(sock);
+
+	return true;
+}
+
+
+/*
+ * service_metrics_listen opens a socket listening on the given port on all
+ * the local addresses, and returns it, or -1 on error.
+ */
+static int
+service_metrics_listen(int port)
+{
+	struct addrinfo *lookup;
+	struct addrinfo hints;
+
+	int sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;     /* accept any family as supported by OS */
+	hints.ai_socktype = SOCK_STREAM; /* we only want TCP sockets */
+	hints.ai_flags = AI_PASSIVE;     /* listen on all the local addresses */
+
+	int error = getaddrinfo(NULL, intToString(port).strValue, &hints, &lookup);
+
+	if (error != 0)
+	{
+		log_error("Failed to prepare listening on port %d: %s",
+				  port, gai_strerror(error));
+		return -1;
+	}
+
+	/* prefer IPv6, which also accepts IPv4 connections on most systems */
+	for (int pass = 0; pass < 2 && sock < 0; pass++)
+	{
+		for (struct addrinfo *ai = lookup; ai != NULL; ai = ai->ai_next)
+		{
+			int on = 1;
+
+			if ((pass == 0) != (ai->ai_family == AF_INET6))
+			{
+				continue;
+			}
+
+			sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+			if (sock < 0)
+			{
+				continue;
+			}
+
+			(void) setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+			if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+				listen(sock, 16) == 0)
+			{
+				break;
+			}
+
+			log_debug("Failed to listen on port %d: %m", port);
+
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	freeaddrinfo(lookup);
+
+	if (sock < 0)
+	{
+		log_error("Failed to listen on port %d for the metrics service: %m",
+				  port);
+	}
+
+	return sock;
+}
+
+
+/*
+ * service_metrics_handle_client reads an HTTP request from the client and
+ * answers with our metrics when the request is a GET /metrics.
+ */
+static void
+service_metrics_handle_client(int client)
+{
+	char request[METRICS_REQUEST_MAXLEN] = { 0 };
+	size_t len = 0;
+
+	/* read at least the request line */
+	while (len < sizeof(request) - 1 && strchr(request, '\n') == NULL)
+	{
+		struct pollfd pollFd = { client, POLLIN, 0 };
+
+		if (poll(&pollFd, 1, METRICS_CLIENT_TIMEOUT_MS) <= 0)
+		{
+			return;
+		}
+
+		ssize_t bytes = read(client, request + len, sizeof(request) - 1 - len);
+
+		if (bytes <= 0)
+		{
+			return;
+		}
+
+		len += bytes;
+	}
+
+	if (strncmp(request, "GET /metrics ", 13) != 0 &&
+		strncmp(request, "GET /metrics?", 13) != 0)
+	{
+		const char *notFound =
+			"HTTP/1.0 404 Not Found\r\n"
+			"Content-Type: text/plain\r\n"
+			"Connection: close\r\n"
+			"\r\n"
+			"pg_autoctl only serves /metrics\n";
+
+		(void) service_metrics_write(client, notFound, strlen(notFound));
+		return;
+	}
+
+	PQExpBuffer body = createPQExpBuffer();
+	PQExpBuffer header = createPQExpBuffer();
+
+	(void) metrics_format_prometheus(body);
+
+	if (PQExpBufferBroken(body))
+	{
+		log_error("Failed to allocate memory for the metrics");
+		destroyPQExpBuffer(body);
+		destroyPQExpBuffer(header);
+		return;
+	}
+
+	appendPQExpBuffer(header,
+					  "HTTP/1.0 200 OK\r\n"
+					  "Content-Type: text/plain; version=0.0.4\r\n"
+					  "Content-Length: %zu\r\n"
+					  "Connection: close\r\n"
+					  "\r\n",
+					  body->len);
+
+	if (!service_metrics_write(client, header->data, header->len) ||
+		!service_metrics_write(client, body->data, body->len))
+	{
+		log_debug("Failed to send the metrics: %m");
+	}
+
+	destroyPQExpBuffer(body);
+	destroyPQExpBuffer(header);
+}
+
+
+/*
+ * service_metrics_write writes all the given data to the client.
+ */
+static bool
+service_metrics_write(int client, const char *data, size_t len)
+{
+	size_t written = 0;
+
+	while (written < len)
+	{
+		ssize_t bytes = send(client, data + written, len - written, MSG_NOSIGNAL);
+
+		if (bytes < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		written += bytes;
+	}
+
+	return true;
+}
@@ -30,8 +30,24 @@
 #include "runprogram.h"
 
 
+/*
+ * A hot standby monitor keeps track of the last time its upstream monitor
+ * was seen alive, and promotes itself when that was more than
+ * replication.takeover_timeout seconds ago.
+ */
+typedef struct MonitorStandbyWatch
+{
+	uint64_t lastUpstreamContact;
+	bool loggedUpstreamDown;
+	int lostContactCount;       /* keepers that lost the upstream too */
+	bool loggedLostContact;
+} MonitorStandbyWatch;
+
 static void reload_configuration(Monitor *monitor);
 static bool monitor_ensure_configuration(Monitor *monitor);
+static bool monitor_standby_watch(Monitor *monitor,
+								  MonitorStandbyWatch *watch,
+								  bool *promoted);
 
 
 /*
@@ -191,6 +207,9 @@ service_monitor_runprogram(Monitor *monitor)
  * monitor_service_run watches over monitor process, restarts if it is
  * necessary, also loops over a LISTEN command that is notified at every change
  * of state on the monitor, and prints the change on stdout.
+ *
+ * On a hot standby monitor we can't LISTEN, we watch the upstream monitor
+ * instead, and take over when it's been gone for too long.
  */
 bool
 monitor_service_run(Monitor *monitor)
@@ -200,6 +219,10 @@ monitor_service_run(Monitor *monitor)
 
 	bool loggedAboutListening = false;
 	bool firstLoop = true;
+	bool isStandby = false;
+	bool checkRecovery = false;
+	bool checkExtensionVersion = false;
+	MonitorStandbyWatch standbyWatch = { 0 };
 	LocalPostgresServer postgres = { 0 };
 
 	/* Initialize our local connection to the monitor */
@@ -249,8 +272,6 @@ monitor_service_run(Monitor *monitor)
 		 */
 		if (firstLoop || !pg_setup_is_ready(pgSetup, pgIsNotRunningIsOk))
 		{
-			MonitorExtensionVersion version = { 0 };
-
 			if (!ensure_postgres_service_is_running_as_subprocess(&postgres))
 			{
 				log_error("Failed to ensure Postgres is running "
@@ -259,6 +280,53 @@ monitor_service_run(Monitor *monitor)
 				return false;
 			}
 
+			checkRecovery = true;
+		}
+
+		if (checkRecovery)
+		{
+			if (!pgsql_is_in_recovery(&(monitor->pgsql), &isStandby))
+			{
+				/* leave some time to the monitor before we try again */
+				sleep(PG_AUTOCTL_MONITOR_RETRY_TIME);
+				continue;
+			}
+
+			if (isStandby)
+			{
+				log_info("This monitor is a hot standby of \"%s\"",
+						 mconfig->standbyOf);
+			}
+
+			checkRecovery = false;
+			checkExtensionVersion = !isStandby;
+		}
+
+		if (isStandby)
+		{
+			bool promoted = false;
+
+			if (!monitor_standby_watch(monitor, &standbyWatch, &promoted))
+			{
+				log_warn("Failed to watch the upstream monitor, "
+						 "see above for details");
+			}
+
+			if (!promoted)
+			{
+				sleep(PG_AUTOCTL_MONITOR_SLEEP_TIME);
+				continue;
+			}
+
+			/* we are the monitor now */
+			isStandby = false;
+			checkExtensionVersion = true;
+		}
+
+		if (checkExtensionVersion)
+		{
+			MonitorExtensionVersion version = { 0 };
+
 			/* Check version compatibility. */
 			if (!monitor_ensure_extension_version(monitor, &postgres, &version))
 			{
@@ -273,6 +341,8 @@ monitor_service_run(Monitor *monitor)
 				/* or maybe we failed to update the extension altogether */
 				return false;
 			}
+
+			checkExtensionVersion = false;
 		}
 
 		if (!loggedAboutListening)
@@ -300,6 +370,152 @@ monitor_service_run(Monitor *monitor)
 }
 
 
+/*
+ * monitor_standby_watch checks whether the upstream monitor of this hot
+ * standby monitor is still alive: either we're streaming from it, or it
+ * accepts connections. When the upstream has been gone for more than
+ * replication.takeover_timeout seconds, we promote our local Postgres, and the
+ * health check workers then start on this node.
+ *
+ * Our own view isn't enough: when only the link between the two monitors
+ * fails, promoting would give us two monitors taking failover decisions. So
+ * we also require that most of the registered keepers reported losing
+ * contact with the upstream monitor, see monitor_report_contact.
+ *
+ * Keepers that use a multi-host monitor URI with
+ * target_session_attrs=read-write then connect to us on their next attempt.
+ */
+static bool
+monitor_standby_watch(Monitor *monitor,
+					  MonitorStandbyWatch *watch,
+					  bool *promoted)
+{
+	MonitorConfig *config = &(monitor->config);
+	PostgresSetup *pgSetup = &(config->pgSetup);
+
+	uint64_t now = time(NULL);
+	bool inRecovery = true;
+	bool hasWalReceiver = false;
+
+	*promoted = false;
+
+	if (watch->lastUpstreamContact == 0)
+	{
+		watch->lastUpstreamContact = now;
+	}
+
+	/* the operator might have promoted this monitor already */
+	if (!pgsql_is_in_recovery(&(monitor->pgsql), &inRecovery))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!inRecovery)
+	{
+		log_info("This monitor has been promoted, taking over from \"%s\"",
+				 config->standbyOf);
+
+		pgsql_finish(&(monitor->notificationClient));
+		*promoted = true;
+
+		return true;
+	}
+
+	if (!pgsql_has_wal_receiver(&(monitor->pgsql), &hasWalReceiver))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * When we're not streaming, the upstream might still be alive and busy
+	 * restarting, so also try to connect to it. PQping does not need the
+	 * authentication to succeed, which our replication user might fail.
+	 */
+	if (hasWalReceiver ||
+		(!IS_EMPTY_STRING_BUFFER(config->standbyOf) &&
+		 PQping(config->standbyOf) == PQPING_OK))
+	{
+		if (watch->loggedUpstreamDown)
+		{
+			log_info("Upstream monitor \"%s\" is reachable again",
+					 config->standbyOf);
+			watch->loggedUpstreamDown = false;
+		}
+
+		watch->lastUpstreamContact = now;
+		watch->loggedLostContact = false;
+		return true;
+	}
+
+	uint64_t elapsed = now - watch->lastUpstreamContact;
+
+	if (!watch->loggedUpstreamDown)
+	{
+		log_warn("Upstream monitor \"%s\" is unreachable",
+				 config->standbyOf);
+		watch->loggedUpstreamDown = true;
+	}
+
+	/* a zero takeover_timeout disables the automatic takeover */
+	if (config->takeoverTimeout <= 0 ||
+		elapsed < (uint64_t) config->takeoverTimeout)
+	{
+		return true;
+	}
+
+	int lostContactCount = 0;
+	int nodeCount = 0;
+
+	if (!monitor_count_lost_contact(monitor, &lostContactCount, &nodeCount))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (lostContactCount * 2 <= nodeCount)
+	{
+		if (!watch->loggedLostContact ||
+			lostContactCount != watch->lostContactCount)
+		{
+			log_warn("Upstream monitor \"%s\" has been unreachable for "
+					 "%" PRIu64 "s, but only %d of the %d registered keepers "
+					 "lost contact with it: not taking over",
+					 config->standbyOf, elapsed, lostContactCount, nodeCount);
+
+			watch->lostContactCount = lostContactCount;
+			watch->loggedLostContact = true;
+		}
+
+		return true;
+	}
+
+	log_warn("Upstream monitor \"%s\" has been unreachable for %" PRIu64 "s, "
+			 "replication.takeover_timeout is %ds, and %d of the %d "
+			 "registered keepers lost contact with it: promoting this monitor",
+			 config->standbyOf, elapsed, config->takeoverTimeout,
+			 lostContactCount, nodeCount);
+
+	if (!pg_ctl_promote(pgSetup->pg_ctl, pgSetup->pgdata))
+	{
+		log_error("Failed to promote the hot standby monitor, "
+				  "see above for details");
+		return false;
+	}
+
+	/* the LISTEN connection is opened again on the promoted monitor */
+	pgsql_finish(&(monitor->pgsql));
+	pgsql_finish(&(monitor->notificationClient));
+
+	log_info("This monitor has taken over from \"%s\"", config->standbyOf);
+
+	*promoted = true;
+
+	return true;
+}
+
+
 /*
  * reload_configuration reads the supposedly new configuration file and
  * integrates accepted new values into the current setup.
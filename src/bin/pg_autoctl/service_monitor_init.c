@@ -133,6 +133,7 @@ service_monitor_init_start(void *context, pid_t *pid)
 									  "pg_autoctl: monitor installer";
 
 			(void) set_ps_title(serviceName);
+			(void) log_set_context("service", SERVICE_NAME_MONITOR_INIT);
 
 			setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
 
@@ -0,0 +1,379 @@
+/*
+ * src/bin/pg_autoctl/service_monitor_proxy.c
+ *   The pg_autoctl monitor-proxy service, sharing a monitor session with the
+ *   pg_autoctl CLI commands.
+ *
+ * The service keeps a monitor connection open, and listens on a unix socket
+ * next to the pidfile. The pg_autoctl CLI commands that only read from the
+ * monitor, such as pg_autoctl show state, send their SQL query to the socket
+ * rather than opening a connection to the monitor of their own. See
+ * monitor_proxy.c for the protocol.
+ *
+ * Each query runs in a READ ONLY transaction that is then rolled back, so a
+ * client can neither write to the monitor nor change the shared session. The
+ * socket is only accessible to the system user that runs pg_autoctl, who
+ * already has access to the monitor connection string.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "pqexpbuffer.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "monitor.h"
+#include "monitor_proxy.h"
+#include "pgsql.h"
+#include "pidfile.h"
+#include "runprogram.h"
+#include "service_monitor_proxy.h"
+#include "signals.h"
+#include "string_utils.h"
+
+/* don't let a slow client block the service */
+#define MONITOR_PROXY_REQUEST_TIMEOUT_MS 1000
+
+/* the serialized result of the query we run for a client */
+typedef struct MonitorProxyContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	PQExpBuffer response;
+	bool parsed;
+} MonitorProxyContext;
+
+
+static int service_monitor_proxy_listen(const char *socketPath);
+static void service_monitor_proxy_handle_client(Monitor *monitor, int client);
+static void parseMonitorProxyResult(void *ctx, PGresult *result);
+
+
+/*
+ * service_monitor_proxy_start starts the monitor-proxy sub-process.
+ */
+bool
+service_monitor_proxy_start(void *context, pid_t *pid)
+{
+	Keeper *keeper = (Keeper *) context;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/* time to create the monitor-proxy sub-process */
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the monitor-proxy process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_monitor_proxy_runprogram(keeper);
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_monitor_proxy_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_debug("pg_autoctl monitor-proxy process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_monitor_proxy_runprogram runs the monitor-proxy service:
+ *
+ *   $ pg_autoctl do service monitor-proxy --pgdata ...
+ *
+ * This function is intended to be called from the child process after a fork()
+ * has been successfully done at the parent process level: it's calling
+ * execve() and will never return.
+ */
+void
+service_monitor_proxy_runprogram(Keeper *keeper)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* see service_keeper_runprogram about using --pgdata here */
+	char *pgdata = keeperOptions.pgSetup.pgdata;
+	IntString semIdString = intToString(log_semaphore.semId);
+
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "monitor-proxy";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_monitor_proxy_loop listens on the monitor-proxy unix socket and
+ * runs the clients queries on its monitor session until asked to stop.
+ */
+bool
+service_monitor_proxy_loop(KeeperConfig *config, pid_t start_pid)
+{
+	Monitor monitor = { 0 };
+	char socketPath[MAXPGPATH] = { 0 };
+
+	if (config->monitorDisabled)
+	{
+		log_fatal("The monitor-proxy service requires a monitor");
+		return false;
+	}
+
+	if (!monitor_init(&monitor, config->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* keep our session, and don't make clients wait for the monitor */
+	monitor.pgsql.connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+	(void) pgsql_set_main_loop_retry_policy(&(monitor.pgsql.retryPolicy));
+
+	if (!monitor_proxy_socket_path(config->pathnames.pid, socketPath))
+	{
+		log_fatal("Failed to compute the monitor-proxy socket path");
+		return false;
+	}
+
+	/* a client that goes away must not kill the service */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	int sock = service_monitor_proxy_listen(socketPath);
+
+	if (sock < 0)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Serving monitor queries on unix socket \"%s\"", socketPath);
+
+	for (;;)
+	{
+		struct pollfd pollFd = { sock, POLLIN, 0 };
+
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit)
+		{
+			break;
+		}
+
+		/* Check that we still own our PID file, or quit now */
+		(void) check_pidfile(config->pathnames.pid, start_pid);
+
+		/* EINTR is fine, we process signals next */
+		int ready = poll(&pollFd, 1, PG_AUTOCTL_KEEPER_SLEEP_TIME * 1000);
+
+		if (ready <= 0 || !(pollFd.revents & POLLIN))
+		{
+			continue;
+		}
+
+		int client = accept(sock, NULL, NULL);
+
+		if (client < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN)
+			{
+				log_warn("Failed to accept a monitor-proxy connection: %m");
+			}
+			continue;
+		}
+
+		(void) service_monitor_proxy_handle_client(&monitor, client);
+
+		close(client);
+	}
+
+	close(sock);
+	(void) unlink_file(socketPath);
+
+	pgsql_finish(&(monitor.pgsql));
+
+	return true;
+}
+
+
+/*
+ * service_monitor_proxy_listen opens a unix socket listening at the given
+ * path, that only the current system user can connect to, and returns it, or
+ * -1 on error.
+ */
+static int
+service_monitor_proxy_listen(const char *socketPath)
+{
+	struct sockaddr_un addr = { 0 };
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (sock < 0)
+	{
+		log_error("Failed to create the monitor-proxy unix socket: %m");
+		return -1;
+	}
+
+	/* we own the pidfile, so a socket that's already there is stale */
+	if (file_exists(socketPath) && !unlink_file(socketPath))
+	{
+		/* errors have already been logged */
+		close(sock);
+		return -1;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, socketPath, sizeof(addr.sun_path));
+
+	mode_t previousUmask = umask(S_IRWXG | S_IRWXO);
+
+	bool listening =
+		bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+		listen(sock, 16) == 0;
+
+	(void) umask(previousUmask);
+
+	if (!listening)
+	{
+		log_error("Failed to listen on unix socket \"%s\" "
+				  "for the monitor-proxy service: %m",
+				  socketPath);
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+/*
+ * service_monitor_proxy_handle_client reads a request from the client, runs
+ * the query on the monitor session, and writes the result back.
+ */
+static void
+service_monitor_proxy_handle_client(Monitor *monitor, int client)
+{
+	PGSQL *pgsql = &(monitor->pgsql);
+
+	MonitorProxyRequest request = { 0 };
+	MonitorProxyContext context = { 0 };
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (!monitor_proxy_read(client, buffer,
+							MONITOR_PROXY_REQUEST_TIMEOUT_MS,
+							MONITOR_PROXY_REQUEST_MAXLEN) ||
+		!monitor_proxy_parse_request(buffer->data, buffer->len, &request))
+	{
+		/* errors have already been logged, the client connects directly */
+		destroyPQExpBuffer(buffer);
+		return;
+	}
+
+	context.response = createPQExpBuffer();
+
+	/* only serve clients that would connect to our monitor */
+	if (strcmp(request.connectionString, pgsql->connectionString) != 0)
+	{
+		log_debug("Received a monitor-proxy request for another monitor");
+		(void) monitor_proxy_format_error(context.response, "08000");
+	}
+	else if (!pgsql_execute_read_only(pgsql, request.sql,
+									  request.paramCount,
+									  request.paramTypes,
+									  request.paramValues,
+									  &context,
+									  &parseMonitorProxyResult) ||
+			 !context.parsed)
+	{
+		resetPQExpBuffer(context.response);
+		(void) monitor_proxy_format_error(context.response,
+										  IS_EMPTY_STRING_BUFFER(context.sqlstate) ?
+										  "XX000" : context.sqlstate);
+	}
+
+	if (PQExpBufferBroken(context.response))
+	{
+		log_error("Failed to allocate memory for the monitor-proxy response");
+	}
+	else if (!monitor_proxy_write(client,
+								  context.response->data,
+								  context.response->len))
+	{
+		/* the client connects directly */
+		log_debug("Failed to send the monitor-proxy response");
+	}
+
+	destroyPQExpBuffer(buffer);
+	destroyPQExpBuffer(context.response);
+}
+
+
+/*
+ * parseMonitorProxyResult serializes the query result in the context
+ * response buffer.
+ */
+static void
+parseMonitorProxyResult(void *ctx, PGresult *result)
+{
+	MonitorProxyContext *context = (MonitorProxyContext *) ctx;
+
+	(void) monitor_proxy_format_result(context->response, result);
+
+	context->parsed = true;
+}
@@ -0,0 +1,24 @@
+/*
+ * src/bin/pg_autoctl/service_monitor_proxy.h
+ *   The pg_autoctl monitor-proxy service, sharing a monitor session with the
+ *   pg_autoctl CLI commands.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SERVICE_MONITOR_PROXY_H
+#define SERVICE_MONITOR_PROXY_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "keeper.h"
+#include "keeper_config.h"
+
+bool service_monitor_proxy_start(void *context, pid_t *pid);
+void service_monitor_proxy_runprogram(Keeper *keeper);
+bool service_monitor_proxy_loop(KeeperConfig *config, pid_t start_pid);
+
+#endif /* SERVICE_MONITOR_PROXY_H */
@@ -0,0 +1,340 @@
+/*
+ * src/bin/pg_autoctl/service_node_probe.c
+ *   The pg_autoctl node-probe service, sampling the local node health at a
+ *   fixed cadence.
+ *
+ * The service checks every PG_AUTOCTL_NODE_PROBE_INTERVAL that the local
+ * Postgres instance is running and answers a query, runs the storage probes
+ * of PGDATA and pg_wal, and samples the free space of pg_wal. It never talks
+ * to the monitor: the node-active service reports the last sample, see
+ * node_probe.c.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+#include "portability/instr_time.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "keeper_io_watchdog.h"
+#include "log.h"
+#include "node_probe.h"
+#include "pgsetup.h"
+#include "pgsql.h"
+#include "pidfile.h"
+#include "runprogram.h"
+#include "service_node_probe.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+static void service_node_probe_reload(KeeperConfig *config);
+static void service_node_probe_postgres(KeeperConfig *config,
+										PGSQL *pgsql,
+										NodeProbeSnapshot *snapshot);
+
+
+/*
+ * service_node_probe_start starts the node-probe sub-process.
+ */
+bool
+service_node_probe_start(void *context, pid_t *pid)
+{
+	Keeper *keeper = (Keeper *) context;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/* time to create the node-probe sub-process */
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the node-probe process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_node_probe_runprogram(keeper);
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_node_probe_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_debug("pg_autoctl node-probe process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_node_probe_runprogram runs the node-probe service:
+ *
+ *   $ pg_autoctl do service node-probe --pgdata ...
+ *
+ * This function is intended to be called from the child process after a fork()
+ * has been successfully done at the parent process level: it's calling
+ * execve() and will never return.
+ */
+void
+service_node_probe_runprogram(Keeper *keeper)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* see service_keeper_runprogram about using --pgdata here */
+	char *pgdata = keeperOptions.pgSetup.pgdata;
+	IntString semIdString = intToString(log_semaphore.semId);
+
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "node-probe";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_node_probe_loop samples the local node health and publishes it
+ * every PG_AUTOCTL_NODE_PROBE_INTERVAL until asked to stop.
+ */
+bool
+service_node_probe_loop(KeeperConfig *config, pid_t start_pid)
+{
+	KeeperIOWatchdog watchdog = { 0 };
+	KeeperWalSpace walSpace = { 0 };
+	NodeProbeSnapshot snapshot = { 0 };
+	PGSQL pgsql = { 0 };
+
+	if (!node_probe_attach() || !node_probe_enabled())
+	{
+		log_fatal("Failed to attach to the node-probe shared memory segment");
+		return false;
+	}
+
+	log_info("Sampling the local node health every %dms",
+			 PG_AUTOCTL_NODE_PROBE_INTERVAL);
+
+	for (;;)
+	{
+		instr_time start;
+		instr_time duration;
+
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit)
+		{
+			break;
+		}
+
+		if (asked_to_reload)
+		{
+			(void) service_node_probe_reload(config);
+		}
+
+		/* Check that we still own our PID file, or quit now */
+		(void) check_pidfile(config->pathnames.pid, start_pid);
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		(void) service_node_probe_postgres(config, &pgsql, &snapshot);
+
+		(void) keeper_io_watchdog_poll(&watchdog,
+									   config->pgSetup.pgdata,
+									   config->storage_probe_interval);
+
+		if (watchdog.newSample)
+		{
+			watchdog.newSample = false;
+			++snapshot.ioSampleCount;
+		}
+
+		(void) keeper_io_watchdog_stats(&watchdog, &(snapshot.ioStats));
+
+		if (snapshot.pgIsResponsive)
+		{
+			(void) keeper_wal_space_update(&walSpace,
+										   config->pgSetup.pgdata,
+										   snapshot.currentLSN);
+
+			if (walSpace.newSample)
+			{
+				walSpace.newSample = false;
+				snapshot.walSpace = walSpace;
+				++snapshot.walSampleCount;
+			}
+		}
+
+		snapshot.sampleTime = time(NULL);
+		++snapshot.probeCount;
+
+		(void) node_probe_publish(&snapshot);
+
+		/* keep a fixed cadence, whatever the time the probes took */
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+
+		int64_t elapsedMs = INSTR_TIME_GET_MILLISEC(duration);
+
+		if (elapsedMs < PG_AUTOCTL_NODE_PROBE_INTERVAL)
+		{
+			pg_usleep((PG_AUTOCTL_NODE_PROBE_INTERVAL - elapsedMs) * 1000L);
+		}
+	}
+
+	pgsql_finish(&pgsql);
+
+	return true;
+}
+
+
+/*
+ * service_node_probe_reload reads the configuration file again, for the
+ * timeouts that the probes use.
+ */
+static void
+service_node_probe_reload(KeeperConfig *config)
+{
+	KeeperConfig newConfig = *config;
+
+	bool missingPgdataIsOk = true;
+	bool pgIsNotRunningIsOk = true;
+	bool monitorDisabledIsOk = true;
+
+	asked_to_reload = 0;
+
+	if (!keeper_config_read_file(&newConfig,
+								 missingPgdataIsOk,
+								 pgIsNotRunningIsOk,
+								 monitorDisabledIsOk))
+	{
+		log_warn("Failed to read the configuration file \"%s\", "
+				 "continuing with the same timeouts",
+				 config->pathnames.config);
+		return;
+	}
+
+	config->local_query_timeout = newConfig.local_query_timeout;
+	config->storage_probe_interval = newConfig.storage_probe_interval;
+}
+
+
+/*
+ * service_node_probe_postgres checks that the local Postgres instance is
+ * running, and that it answers a query within timeout.local_query_timeout.
+ * The connection is kept open from one sample to the next.
+ */
+static void
+service_node_probe_postgres(KeeperConfig *config,
+							PGSQL *pgsql,
+							NodeProbeSnapshot *snapshot)
+{
+	PostgresSetup pgSetup = config->pgSetup;
+	char pgsrSyncState[PGSR_SYNC_STATE_MAXLENGTH] = { 0 };
+	char connInfo[MAXCONNINFO];
+	bool pgIsNotRunningIsOk = true;
+
+	instr_time start;
+	instr_time duration;
+
+	snapshot->pgIsRunning = false;
+	snapshot->pgIsResponsive = false;
+	snapshot->queryUs = -1;
+	strlcpy(snapshot->currentLSN, "0/0", sizeof(snapshot->currentLSN));
+
+	if (!pg_setup_is_ready(&pgSetup, pgIsNotRunningIsOk))
+	{
+		pgsql_finish(pgsql);
+		return;
+	}
+
+	snapshot->pgIsRunning = true;
+
+	pg_setup_get_local_connection_string(&pgSetup, connInfo);
+
+	if (pgsql->connection == NULL ||
+		PQstatus(pgsql->connection) != CONNECTION_OK ||
+		strcmp(pgsql->connectionString, connInfo) != 0)
+	{
+		pgsql_finish(pgsql);
+		pgsql_init(pgsql, connInfo, PGSQL_CONN_LOCAL);
+	}
+
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+	pgsql->statementTimeoutMs = config->local_query_timeout;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	bool metadataOk =
+		pgsql_get_postgres_metadata(pgsql,
+									&(snapshot->pgIsInRecovery),
+									pgsrSyncState,
+									snapshot->currentLSN,
+									&(pgSetup.control),
+									NULL);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	if (!metadataOk)
+	{
+		if (pgsql->statementTimedOut)
+		{
+			log_warn("Postgres did not answer within "
+					 "timeout.local_query_timeout (%dms)",
+					 config->local_query_timeout);
+		}
+
+		/* open a new connection at the next sample */
+		pgsql_finish(pgsql);
+		return;
+	}
+
+	snapshot->pgIsResponsive = true;
+	snapshot->queryUs = INSTR_TIME_GET_MICROSEC(duration);
+}
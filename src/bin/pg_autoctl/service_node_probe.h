@@ -0,0 +1,24 @@
+/*
+ * src/bin/pg_autoctl/service_node_probe.h
+ *   The pg_autoctl node-probe service, sampling the local node health at a
+ *   fixed cadence.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SERVICE_NODE_PROBE_H
+#define SERVICE_NODE_PROBE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "keeper.h"
+#include "keeper_config.h"
+
+bool service_node_probe_start(void *context, pid_t *pid);
+void service_node_probe_runprogram(Keeper *keeper);
+bool service_node_probe_loop(KeeperConfig *config, pid_t start_pid);
+
+#endif /* SERVICE_NODE_PROBE_H */
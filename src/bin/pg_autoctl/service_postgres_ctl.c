@@ -7,8 +7,10 @@
  *
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <signal.h>
 #include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
@@ -24,6 +26,7 @@
 #include "primary_standby.h"
 #include "service_postgres.h"
 #include "service_postgres_ctl.h"
+#include "shared_state.h"
 #include "signals.h"
 #include "supervisor.h"
 #include "state.h"
@@ -33,6 +36,9 @@
 
 static bool shutdownSequenceInProgress = false;
 
+/* set when the keeper tells us that the expected status has changed */
+static volatile sig_atomic_t pg_status_changed = 0;
+
 static bool ensure_postgres_status(LocalPostgresServer *postgres,
 								   Service *service);
 
@@ -43,6 +49,9 @@ static bool ensure_postgres_status_running(LocalPostgresServer *postgres,
 										   Service *service,
 										   bool ensurePostgresSubprocess);
 
+static void service_postgres_ctl_wait(void);
+static void catch_pg_status_changed(int sig);
+
 
 /*
  * service_postgres_ctl_start starts a subprocess that implements the postgres
@@ -184,10 +193,14 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 	};
 
 	bool pgStatusPathIsReady = false;
+	uint64_t pgStatusGeneration = 0;
 
 	/* make sure to initialize the expected Postgres status to unknown */
 	pgStatus->pgExpectedStatus = PG_EXPECTED_STATUS_UNKNOWN;
 
+	/* the keeper sends SIGURG when it changes the expected status */
+	pqsignal(SIGURG, catch_pg_status_changed);
+
 	if (pg_setup_pgdata_exists(pgSetup))
 	{
 		if (!local_postgres_set_status_path(postgres, true))
@@ -350,11 +363,39 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 		 * Adding to that, during the `pg_autoctl create postgres` phase we
 		 * also need to start Postgres and sometimes even restart it.
 		 */
+		bool statusSignaled = pg_status_changed;
+		pg_status_changed = 0;
+
 		if (pgStatusPathIsReady && file_exists(localStatus->pgStatusPath))
 		{
 			const char *filename = localStatus->pgStatusPath;
 
-			if (!keeper_postgres_state_read(pgStatus, filename))
+			KeeperStatePostgres sharedStatus = { 0 };
+			uint64_t generation = 0;
+			bool readStatusFile = true;
+
+			/*
+			 * Under our supervisor, take the expected status from shared
+			 * memory when it has been updated. Only read the file when
+			 * nothing has been published yet, or when a process that is not
+			 * attached to the shared memory, such as pg_autoctl do pgctl on,
+			 * has signaled us after writing the file.
+			 */
+			if (shared_state_read_postgres(&sharedStatus, &generation))
+			{
+				if (generation != pgStatusGeneration)
+				{
+					*pgStatus = sharedStatus;
+					pgStatusGeneration = generation;
+					readStatusFile = false;
+				}
+				else if (!statusSignaled)
+				{
+					readStatusFile = false;
+				}
+			}
+
+			if (readStatusFile && !keeper_postgres_state_read(pgStatus, filename))
 			{
 				/* errors have already been logged, will try again */
 				pg_usleep(100 * 1000);  /* 100ms */
@@ -371,8 +412,78 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
 			}
 		}
 
+		(void) service_postgres_ctl_wait();
+	}
+}
+
+
+/*
+ * service_postgres_ctl_wait sleeps for 100ms at most, or until the keeper
+ * signals us that it has changed the expected Postgres status, so that we
+ * don't add our polling interval to the time it takes to start or stop
+ * Postgres during a failover.
+ *
+ * Same as in the supervisor, we block the signals and check our flags before
+ * calling pselect(2), so that a signal received in between is never missed.
+ */
+static void
+service_postgres_ctl_wait(void)
+{
+	sigset_t sig_mask;
+	sigset_t sig_mask_orig;
+	sigset_t sig_mask_urg;
+
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+
+	if (!block_signals(&sig_mask, &sig_mask_orig))
+	{
+		pg_usleep(100 * 1000);  /* 100ms */
+		return;
+	}
+
+	/* block_signals() only handles our control signals, add SIGURG */
+	sigemptyset(&sig_mask_urg);
+	sigaddset(&sig_mask_urg, SIGURG);
+
+	if (sigprocmask(SIG_BLOCK, &sig_mask_urg, NULL) == -1)
+	{
+		(void) unblock_signals(&sig_mask_orig);
+
 		pg_usleep(100 * 1000);  /* 100ms */
+		return;
+	}
+
+	/*
+	 * Check if we received signals just before blocking them. Our main loop
+	 * resets pg_status_changed when it reads the expected status.
+	 */
+	if (pg_status_changed ||
+		asked_to_stop || asked_to_stop_fast || asked_to_reload || asked_to_quit)
+	{
+		(void) unblock_signals(&sig_mask_orig);
+		return;
 	}
+
+	int ret = pselect(0, NULL, NULL, NULL, &timeout, &sig_mask_orig);
+
+	/* restore signal masks (un block them) now that pselect() is done */
+	(void) unblock_signals(&sig_mask_orig);
+
+	if (ret < 0 && errno != EINTR)
+	{
+		log_debug("Failed to wait for signals: pselect(): %m");
+	}
+}
+
+
+/*
+ * catch_pg_status_changed receives the SIGURG signal.
+ */
+static void
+catch_pg_status_changed(int sig)
+{
+	pg_status_changed = 1;
+	pqsignal(sig, catch_pg_status_changed);
 }
 
 
@@ -384,7 +495,8 @@ service_postgres_ctl_loop(LocalPostgresServer *postgres)
  * The Postgres controller process (the code in this file) takes orders from
  * another process, either the monitor "listener" or the keeper "node active"
  * process. The orders are sent through a shared file containing the expected
- * status of the Postgres service.
+ * status of the Postgres service, and through shared memory when running
+ * under our supervisor, see shared_state.c.
  *
  * This process only reads the file, and the "other" process is responsible for
  * writing it: deleting a stale version of it at startup, creating it, updating
@@ -0,0 +1,1416 @@
+/*
+ * src/bin/pg_autoctl/service_router.c
+ *   The pg_autoctl router service, forwarding client connections to the
+ *   current primary node of the group.
+ *
+ * The service listens on pg_autoctl.router_port and relays each client
+ * connection to the primary node, as known to the monitor. Applications then
+ * connect to a single address, and don't have to try every host of a
+ * multi-host connection string with target_session_attrs=read-write after a
+ * failover.
+ *
+ * A call to the monitor blocks until it answers or the connection times out,
+ * so the service never talks to the monitor itself: a watcher child process
+ * LISTENs to the monitor state notifications for the group, asks the monitor
+ * for the primary again when the group state changes, and sends each answer
+ * to the router in a pipe. When the primary changes, the connections to the
+ * previous primary are closed, and new clients are held until a new primary
+ * is known.
+ *
+ * On Linux bytes are moved with splice(2) through a pipe, so that they are
+ * never copied to user space. Elsewhere we copy them through a buffer.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "defaults.h"
+#include "keeper_config.h"
+#include "log.h"
+#include "monitor.h"
+#include "pgsql.h"
+#include "pidfile.h"
+#include "runprogram.h"
+#include "service_router.h"
+#include "signals.h"
+#include "string_utils.h"
+
+/* the router serves that many client connections at once */
+#define ROUTER_MAX_CONNECTIONS 256
+
+/* bytes moved in one call for each direction of a connection */
+#define ROUTER_CHUNK_SIZE (64 * 1024)
+
+/* how long a client is held while no primary is known, in seconds */
+#define ROUTER_WAIT_PRIMARY_TIMEOUT 30
+
+/* ask the monitor again even when we receive no notification, in seconds */
+#define ROUTER_REFRESH_INTERVAL 5
+
+#define ROUTER_POLL_TIMEOUT_MS 1000
+
+typedef enum
+{
+	ROUTER_CONNECTION_FREE = 0,
+	ROUTER_CONNECTION_WAITING,  /* for a primary to be known */
+	ROUTER_CONNECTION_CONNECTING,  /* to the primary */
+	ROUTER_CONNECTION_FORWARDING
+} RouterConnectionState;
+
+
+/* one direction of a connection, from the client or from the server */
+typedef struct RouterStream
+{
+	int from;
+	int to;
+
+#if defined(__linux__)
+	int pipe[2];
+#else
+	char *buffer;
+	size_t offset;
+#endif
+
+	size_t pending;             /* bytes read and not yet written */
+	bool eof;                   /* the reading side is done */
+	bool shutdown;              /* and we've told the writing side */
+} RouterStream;
+
+
+typedef struct RouterConnection
+{
+	RouterConnectionState state;
+	int client;
+	int server;
+	int64_t nodeId;
+	time_t acceptTime;
+
+	RouterStream up;            /* from the client to the server */
+	RouterStream down;          /* from the server to the client */
+} RouterConnection;
+
+
+typedef struct Router
+{
+	KeeperConfig *config;
+	int sock;                   /* listening for client connections */
+
+	pid_t watcherPid;           /* -1 when the watcher is not running */
+	int watcher;                /* read end of the watcher pipe */
+	int watcherRequest;         /* write end of the refresh requests pipe */
+	time_t watcherStartTime;
+
+	bool hasPrimary;
+	NodeAddress primary;
+	struct sockaddr_storage primaryAddr;
+	socklen_t primaryAddrLen;
+
+	RouterConnection connections[ROUTER_MAX_CONNECTIONS];
+} Router;
+
+
+/* the watcher process, the only one that talks to the monitor */
+typedef struct RouterWatcher
+{
+	KeeperConfig *config;
+	Monitor monitor;
+	int fd;                     /* write end of the pipe to the router */
+	int request;                /* read end of the refresh requests pipe */
+
+	bool listening;
+	time_t lastListen;
+
+	bool needRefresh;
+	time_t lastRefresh;
+} RouterWatcher;
+
+
+/*
+ * RouterPrimaryMessage is what the watcher sends at each answer from the
+ * monitor. It is smaller than PIPE_BUF, so that it's written and read at
+ * once.
+ */
+typedef struct RouterPrimaryMessage
+{
+	bool hasPrimary;
+	NodeAddress primary;
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+} RouterPrimaryMessage;
+
+
+static int service_router_listen(int port);
+static void service_router_start_watcher(Router *router);
+static void service_router_stop_watcher(Router *router);
+static void service_router_read_watcher(Router *router);
+static void service_router_set_primary(Router *router,
+									   RouterPrimaryMessage *message);
+static void service_router_request_refresh(Router *router);
+static void service_router_watch(KeeperConfig *config, int fd, int request);
+static void service_router_listen_notifications(RouterWatcher *watcher);
+static void service_router_consume_notifications(RouterWatcher *watcher);
+static bool service_router_refresh_primary(RouterWatcher *watcher);
+static bool service_router_resolve(NodeAddress *node,
+								   struct sockaddr_storage *addr,
+								   socklen_t *addrLen);
+static void service_router_accept(Router *router, int sock);
+static void service_router_connect(Router *router, RouterConnection *conn);
+static void service_router_connected(RouterConnection *conn);
+static void service_router_forward(RouterConnection *conn);
+static void service_router_close(RouterConnection *conn);
+static bool router_stream_init(RouterStream *stream, int from, int to);
+static void router_stream_free(RouterStream *stream);
+static bool router_stream_relay(RouterStream *stream);
+static short router_stream_events(RouterStream *stream, int fd);
+
+
+/*
+ * service_router_start starts the router sub-process.
+ */
+bool
+service_router_start(void *context, pid_t *pid)
+{
+	Keeper *keeper = (Keeper *) context;
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	/* time to create the router sub-process */
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the router process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* here we call execv() so we never get back */
+			(void) service_router_runprogram(keeper);
+
+			/* unexpected */
+			log_fatal("BUG: returned from service_router_runprogram()");
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			log_debug("pg_autoctl router process started in subprocess %d",
+					  fpid);
+			*pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * service_router_runprogram runs the router service:
+ *
+ *   $ pg_autoctl do service router --pgdata ...
+ *
+ * This function is intended to be called from the child process after a fork()
+ * has been successfully done at the parent process level: it's calling
+ * execve() and will never return.
+ */
+void
+service_router_runprogram(Keeper *keeper)
+{
+	char *args[12];
+	int argsIndex = 0;
+
+	char command[BUFSIZE];
+
+	/* see service_keeper_runprogram about using --pgdata here */
+	char *pgdata = keeperOptions.pgSetup.pgdata;
+	IntString semIdString = intToString(log_semaphore.semId);
+
+	setenv(PG_AUTOCTL_DEBUG, "1", 1);
+	setenv(PG_AUTOCTL_LOG_SEMAPHORE, semIdString.strValue, 1);
+
+	args[argsIndex++] = (char *) pg_autoctl_program;
+	args[argsIndex++] = "do";
+	args[argsIndex++] = "service";
+	args[argsIndex++] = "router";
+	args[argsIndex++] = "--pgdata";
+	args[argsIndex++] = pgdata;
+	args[argsIndex++] = logLevelToString(log_get_level());
+	args[argsIndex] = NULL;
+
+	/* we do not want to call setsid() when running this program. */
+	Program program = { 0 };
+	(void) initialize_program(&program, args, false);
+
+	program.capture = false;    /* redirect output, don't capture */
+	program.stdOutFd = STDOUT_FILENO;
+	program.stdErrFd = STDERR_FILENO;
+
+	/* log the exact command line we're using */
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_program(&program);
+}
+
+
+/*
+ * service_router_loop accepts client connections on the router port and
+ * forwards them to the current primary until asked to stop.
+ */
+bool
+service_router_loop(KeeperConfig *config, pid_t start_pid)
+{
+	/* the connections array is too big for the stack */
+	Router *router = (Router *) calloc(1, sizeof(Router));
+	struct pollfd pollFds[2 + 2 * ROUTER_MAX_CONNECTIONS];
+
+	if (router == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	if (config->monitorDisabled)
+	{
+		log_fatal("The router service requires a monitor");
+		free(router);
+		return false;
+	}
+
+	router->config = config;
+	router->watcherPid = -1;
+	router->watcher = -1;
+	router->watcherRequest = -1;
+
+	for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+	{
+		router->connections[i].client = -1;
+		router->connections[i].server = -1;
+	}
+
+	/* a client that goes away must not kill the service */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	int sock = service_router_listen(config->router_port);
+
+	if (sock < 0)
+	{
+		/* errors have already been logged */
+		free(router);
+		return false;
+	}
+
+	router->sock = sock;
+
+	log_info("Routing connections on port %d to the primary of "
+			 "formation \"%s\" group %d",
+			 config->router_port, config->formation, config->groupId);
+
+	for (;;)
+	{
+		int pollCount = 0;
+		int watcherIndex = -1;
+		time_t now = time(NULL);
+
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit)
+		{
+			break;
+		}
+
+		/* Check that we still own our PID file, or quit now */
+		(void) check_pidfile(config->pathnames.pid, start_pid);
+
+		/* restart the watcher when it failed, but not in a tight loop */
+		if (router->watcherPid < 0 &&
+			now - router->watcherStartTime >= ROUTER_REFRESH_INTERVAL)
+		{
+			(void) service_router_start_watcher(router);
+		}
+
+		/* connect the clients that wait, or give up on them */
+		for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+		{
+			RouterConnection *conn = &(router->connections[i]);
+
+			if (conn->state != ROUTER_CONNECTION_WAITING)
+			{
+				continue;
+			}
+
+			if (router->hasPrimary)
+			{
+				(void) service_router_connect(router, conn);
+			}
+			else if (now - conn->acceptTime >= ROUTER_WAIT_PRIMARY_TIMEOUT)
+			{
+				log_warn("Closing a client connection after %ds "
+						 "without a primary node",
+						 ROUTER_WAIT_PRIMARY_TIMEOUT);
+				(void) service_router_close(conn);
+			}
+		}
+
+		pollFds[pollCount++] = (struct pollfd) { sock, POLLIN, 0 };
+
+		if (router->watcher >= 0)
+		{
+			watcherIndex = pollCount;
+			pollFds[pollCount++] = (struct pollfd) { router->watcher, POLLIN, 0 };
+		}
+
+		/* each connection has its client and server entries */
+		int connectionsIndex = pollCount;
+
+		for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+		{
+			RouterConnection *conn = &(router->connections[i]);
+
+			short clientEvents = 0;
+			short serverEvents = 0;
+
+			if (conn->state == ROUTER_CONNECTION_CONNECTING)
+			{
+				serverEvents = POLLOUT;
+			}
+			else if (conn->state == ROUTER_CONNECTION_FORWARDING)
+			{
+				clientEvents = router_stream_events(&(conn->up), conn->client) |
+							   router_stream_events(&(conn->down), conn->client);
+
+				serverEvents = router_stream_events(&(conn->up), conn->server) |
+							   router_stream_events(&(conn->down), conn->server);
+			}
+
+			/* free entries have a negative fd, that poll() ignores */
+			pollFds[pollCount++] = (struct pollfd) {
+				conn->client, clientEvents, 0
+			};
+			pollFds[pollCount++] = (struct pollfd) {
+				conn->server, serverEvents, 0
+			};
+		}
+
+		/* EINTR is fine, we process signals next */
+		int ready = poll(pollFds, pollCount, ROUTER_POLL_TIMEOUT_MS);
+
+		if (ready <= 0)
+		{
+			continue;
+		}
+
+		if (watcherIndex > 0 && pollFds[watcherIndex].revents != 0)
+		{
+			(void) service_router_read_watcher(router);
+		}
+
+		for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+		{
+			RouterConnection *conn = &(router->connections[i]);
+
+			short clientRevents = pollFds[connectionsIndex + 2 * i].revents;
+			short serverRevents = pollFds[connectionsIndex + 2 * i + 1].revents;
+
+			if (clientRevents == 0 && serverRevents == 0)
+			{
+				continue;
+			}
+
+			switch (conn->state)
+			{
+				case ROUTER_CONNECTION_WAITING:
+				{
+					/* we don't read from waiting clients, so they hung up */
+					(void) service_router_close(conn);
+					break;
+				}
+
+				case ROUTER_CONNECTION_CONNECTING:
+				{
+					if (serverRevents != 0)
+					{
+						(void) service_router_connected(conn);
+					}
+					break;
+				}
+
+				case ROUTER_CONNECTION_FORWARDING:
+				{
+					(void) service_router_forward(conn);
+					break;
+				}
+
+				default:
+				{
+					break;
+				}
+			}
+		}
+
+		/* accept new clients last, their entries were not polled */
+		if (pollFds[0].revents & POLLIN)
+		{
+			(void) service_router_accept(router, sock);
+		}
+	}
+
+	for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+	{
+		if (router->connections[i].state != ROUTER_CONNECTION_FREE)
+		{
+			(void) service_router_close(&(router->connections[i]));
+		}
+	}
+
+	close(sock);
+
+	(void) service_router_stop_watcher(router);
+
+	free(router);
+
+	return true;
+}
+
+
+/*
+ * service_router_listen opens a socket listening on the given port on all
+ * the local addresses, and returns it, or -1 on error.
+ */
+static int
+service_router_listen(int port)
+{
+	struct addrinfo *lookup;
+	struct addrinfo hints;
+
+	int sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;     /* accept any family as supported by OS */
+	hints.ai_socktype = SOCK_STREAM; /* we only want TCP sockets */
+	hints.ai_flags = AI_PASSIVE;     /* listen on all the local addresses */
+
+	int error = getaddrinfo(NULL, intToString(port).strValue, &hints, &lookup);
+
+	if (error != 0)
+	{
+		log_error("Failed to prepare listening on port %d: %s",
+				  port, gai_strerror(error));
+		return -1;
+	}
+
+	/* prefer IPv6, which also accepts IPv4 connections on most systems */
+	for (int pass = 0; pass < 2 && sock < 0; pass++)
+	{
+		for (struct addrinfo *ai = lookup; ai != NULL; ai = ai->ai_next)
+		{
+			int on = 1;
+
+			if ((pass == 0) != (ai->ai_family == AF_INET6))
+			{
+				continue;
+			}
+
+			sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+			if (sock < 0)
+			{
+				continue;
+			}
+
+			(void) setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+			if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+				listen(sock, 128) == 0 &&
+				fcntl(sock, F_SETFL, O_NONBLOCK) == 0)
+			{
+				break;
+			}
+
+			log_debug("Failed to listen on port %d: %m", port);
+
+			close(sock);
+			sock = -1;
+		}
+	}
+
+	freeaddrinfo(lookup);
+
+	if (sock < 0)
+	{
+		log_error("Failed to listen on port %d for the router service: %m",
+				  port);
+	}
+
+	return sock;
+}
+
+
+/*
+ * service_router_start_watcher forks the watcher process, that talks to the
+ * monitor and sends us the primary in a pipe.
+ */
+static void
+service_router_start_watcher(Router *router)
+{
+	int pipeFds[2] = { 0 };
+	int requestFds[2] = { 0 };
+
+	router->watcherStartTime = time(NULL);
+
+	if (pipe(pipeFds) != 0)
+	{
+		log_error("Failed to create the router watcher pipe: %m");
+		return;
+	}
+
+	if (pipe(requestFds) != 0)
+	{
+		log_error("Failed to create the router watcher pipe: %m");
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		return;
+	}
+
+	/* don't leak the pipes to the other processes that we start */
+	(void) fcntl(pipeFds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(requestFds[1], F_SETFD, FD_CLOEXEC);
+
+	/* the router never waits on the watcher */
+	(void) fcntl(pipeFds[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(requestFds[1], F_SETFL, O_NONBLOCK);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the router watcher process: %m");
+			close(pipeFds[0]);
+			close(pipeFds[1]);
+			close(requestFds[0]);
+			close(requestFds[1]);
+			return;
+		}
+
+		case 0:
+		{
+			close(pipeFds[0]);
+			close(requestFds[1]);
+
+			/* the client connections belong to the router process */
+			close(router->sock);
+			for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+			{
+				RouterConnection *conn = &(router->connections[i]);
+
+				if (conn->client >= 0)
+				{
+					close(conn->client);
+				}
+
+				if (conn->server >= 0)
+				{
+					close(conn->server);
+				}
+			}
+
+			(void) service_router_watch(router->config,
+										pipeFds[1], requestFds[0]);
+
+			/* skip the atexit() handlers of the router process */
+			_exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			close(pipeFds[1]);
+			close(requestFds[0]);
+
+			log_debug("pg_autoctl router watcher started in subprocess %d",
+					  fpid);
+
+			router->watcherPid = fpid;
+			router->watcher = pipeFds[0];
+			router->watcherRequest = requestFds[1];
+			return;
+		}
+	}
+}
+
+
+/*
+ * service_router_stop_watcher stops the watcher process and waits until it
+ * has exited.
+ */
+static void
+service_router_stop_watcher(Router *router)
+{
+	int status = 0;
+	pid_t pid = 0;
+
+	if (router->watcher >= 0)
+	{
+		close(router->watcher);
+		router->watcher = -1;
+	}
+
+	if (router->watcherRequest >= 0)
+	{
+		close(router->watcherRequest);
+		router->watcherRequest = -1;
+	}
+
+	if (router->watcherPid < 0)
+	{
+		return;
+	}
+
+	(void) kill(router->watcherPid, SIGTERM);
+
+	do {
+		pid = waitpid(router->watcherPid, &status, 0);
+	} while (pid == -1 && errno == EINTR);
+
+	router->watcherPid = -1;
+}
+
+
+/*
+ * service_router_read_watcher reads the messages that the watcher has sent,
+ * and routes the new connections to the last primary that it sent.
+ */
+static void
+service_router_read_watcher(Router *router)
+{
+	RouterPrimaryMessage message = { 0 };
+	bool received = false;
+
+	for (;;)
+	{
+		ssize_t bytes = read(router->watcher, &message, sizeof(message));
+
+		if (bytes == sizeof(message))
+		{
+			received = true;
+			continue;
+		}
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+
+		/* the watcher exited, keep routing to the same node meanwhile */
+		log_warn("The router watcher process has exited, "
+				 "restarting it in %ds",
+				 ROUTER_REFRESH_INTERVAL);
+
+		(void) service_router_stop_watcher(router);
+		break;
+	}
+
+	if (received)
+	{
+		(void) service_router_set_primary(router, &message);
+	}
+}
+
+
+/*
+ * service_router_set_primary routes the new connections to the primary that
+ * the monitor told the watcher about. When it has changed, the connections to
+ * the previous primary are closed: that node is being demoted and may not
+ * accept writes anymore.
+ */
+static void
+service_router_set_primary(Router *router, RouterPrimaryMessage *message)
+{
+	NodeAddress *primary = &(message->primary);
+	bool hasPrimary = message->hasPrimary;
+
+	if (hasPrimary &&
+		router->hasPrimary &&
+		primary->nodeId == router->primary.nodeId &&
+		primary->port == router->primary.port &&
+		streq(primary->host, router->primary.host))
+	{
+		/* nothing changed */
+		return;
+	}
+
+	if (hasPrimary)
+	{
+		log_info("Routing connections to primary node " NODE_FORMAT,
+				 primary->nodeId, primary->name, primary->host, primary->port);
+	}
+	else if (router->hasPrimary)
+	{
+		log_warn("No primary node is known, new connections wait for one");
+	}
+
+	for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+	{
+		RouterConnection *conn = &(router->connections[i]);
+
+		if ((conn->state == ROUTER_CONNECTION_CONNECTING ||
+			 conn->state == ROUTER_CONNECTION_FORWARDING) &&
+			(!hasPrimary || conn->nodeId != primary->nodeId))
+		{
+			(void) service_router_close(conn);
+		}
+	}
+
+	router->hasPrimary = hasPrimary;
+	router->primary = *primary;
+	router->primaryAddr = message->addr;
+	router->primaryAddrLen = message->addrLen;
+}
+
+
+/*
+ * service_router_request_refresh asks the watcher to ask the monitor for the
+ * primary now. When the pipe is full, a request is pending already.
+ */
+static void
+service_router_request_refresh(Router *router)
+{
+	char request = 'r';
+
+	if (router->watcherRequest >= 0 &&
+		write(router->watcherRequest, &request, 1) != 1)
+	{
+		log_trace("Failed to request a refresh from the router watcher: %m");
+	}
+}
+
+
+/*
+ * service_router_watch is the main loop of the watcher process. It runs
+ * until the router stops it, or until the router is gone.
+ */
+static void
+service_router_watch(KeeperConfig *config, int fd, int request)
+{
+	RouterWatcher watcher = { 0 };
+	pid_t routerPid = getppid();
+
+	watcher.config = config;
+	watcher.fd = fd;
+	watcher.request = request;
+	watcher.needRefresh = true;
+
+	if (!monitor_init(&(watcher.monitor), config->monitor_pguri))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	/* don't retry connecting to the monitor, we ask again in a while */
+	(void) pgsql_set_main_loop_retry_policy(
+		&(watcher.monitor.pgsql.retryPolicy));
+
+	for (;;)
+	{
+		time_t now = time(NULL);
+
+		if (asked_to_stop || asked_to_stop_fast || asked_to_quit ||
+			getppid() != routerPid)
+		{
+			break;
+		}
+
+		if (!watcher.listening &&
+			now - watcher.lastListen >= ROUTER_REFRESH_INTERVAL)
+		{
+			(void) service_router_listen_notifications(&watcher);
+		}
+
+		if (watcher.needRefresh ||
+			now - watcher.lastRefresh >= ROUTER_REFRESH_INTERVAL)
+		{
+			if (!service_router_refresh_primary(&watcher))
+			{
+				/* the router is gone */
+				break;
+			}
+		}
+
+		struct pollfd pollFds[2] = {
+			{ request, POLLIN, 0 },
+			{ -1, POLLIN, 0 }
+		};
+
+		if (watcher.listening)
+		{
+			pollFds[1].fd = PQsocket(watcher.monitor.notificationClient.connection);
+		}
+
+		/* EINTR is fine, we process signals next */
+		if (poll(pollFds, 2, ROUTER_POLL_TIMEOUT_MS) <= 0)
+		{
+			continue;
+		}
+
+		if (pollFds[0].revents != 0)
+		{
+			char buffer[64];
+
+			if (read(request, buffer, sizeof(buffer)) <= 0)
+			{
+				/* the router is gone */
+				break;
+			}
+
+			watcher.needRefresh = true;
+		}
+
+		if (pollFds[1].revents != 0)
+		{
+			(void) service_router_consume_notifications(&watcher);
+		}
+	}
+
+	close(fd);
+	close(request);
+
+	pgsql_finish(&(watcher.monitor.notificationClient));
+	pgsql_finish(&(watcher.monitor.pgsql));
+}
+
+
+/*
+ * service_router_listen_notifications LISTENs to the state changes of our
+ * group. We might have missed some while not listening, so we also ask for
+ * the primary again.
+ */
+static void
+service_router_listen_notifications(RouterWatcher *watcher)
+{
+	KeeperConfig *config = watcher->config;
+	char groupChannel[NAMEDATALEN] = { 0 };
+	char *channels[] = { groupChannel, NULL };
+
+	watcher->lastListen = time(NULL);
+
+	(void) monitor_state_channel(config->formation, config->groupId,
+								 groupChannel, sizeof(groupChannel));
+
+	if (!pgsql_listen(&(watcher->monitor.notificationClient), channels))
+	{
+		log_warn("Failed to listen to the monitor notifications, "
+				 "asking the monitor for the primary every %ds",
+				 ROUTER_REFRESH_INTERVAL);
+
+		pgsql_finish(&(watcher->monitor.notificationClient));
+		return;
+	}
+
+	watcher->listening = true;
+	watcher->needRefresh = true;
+}
+
+
+/*
+ * service_router_consume_notifications reads the notifications that the
+ * monitor has sent. Any state change in our group might be a new primary.
+ */
+static void
+service_router_consume_notifications(RouterWatcher *watcher)
+{
+	PGSQL *client = &(watcher->monitor.notificationClient);
+	PGnotify *notify = NULL;
+
+	if (PQconsumeInput(client->connection) == 0)
+	{
+		log_warn("Failed to read the monitor notifications: %s",
+				 PQerrorMessage(client->connection));
+
+		pgsql_finish(client);
+		watcher->listening = false;
+		return;
+	}
+
+	while ((notify = PQnotifies(client->connection)) != NULL)
+	{
+		log_debug("Received a notification on channel \"%s\"",
+				  notify->relname);
+
+		watcher->needRefresh = true;
+		PQfreemem(notify);
+	}
+}
+
+
+/*
+ * service_router_refresh_primary asks the monitor for the current primary,
+ * and sends the answer to the router. It returns false when the router is
+ * gone.
+ */
+static bool
+service_router_refresh_primary(RouterWatcher *watcher)
+{
+	KeeperConfig *config = watcher->config;
+	RouterPrimaryMessage message = { 0 };
+
+	message.hasPrimary =
+		monitor_get_primary(&(watcher->monitor),
+							config->formation, config->groupId,
+							&(message.primary));
+
+	bool monitorIsDown = watcher->monitor.pgsql.status == PG_CONNECTION_BAD;
+
+	/* don't keep the connection open between our queries */
+	pgsql_finish(&(watcher->monitor.pgsql));
+
+	watcher->needRefresh = false;
+	watcher->lastRefresh = time(NULL);
+
+	/*
+	 * When the monitor can't be reached we don't know better than before, so
+	 * the router keeps routing to the same node. Only the monitor telling us
+	 * that the group has no primary stops the routing.
+	 */
+	if (!message.hasPrimary && monitorIsDown)
+	{
+		log_warn("Failed to get the primary node from the monitor, "
+				 "retrying in %ds",
+				 ROUTER_REFRESH_INTERVAL);
+		return true;
+	}
+
+	if (message.hasPrimary &&
+		!service_router_resolve(&(message.primary),
+								&(message.addr),
+								&(message.addrLen)))
+	{
+		/* errors have already been logged */
+		message.hasPrimary = false;
+	}
+
+	for (;;)
+	{
+		ssize_t bytes = write(watcher->fd, &message, sizeof(message));
+
+		if (bytes == sizeof(message))
+		{
+			return true;
+		}
+
+		if (bytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		return false;
+	}
+}
+
+
+/*
+ * service_router_resolve resolves the address of the given node once, rather
+ * than at each client connection.
+ */
+static bool
+service_router_resolve(NodeAddress *node,
+					   struct sockaddr_storage *addr,
+					   socklen_t *addrLen)
+{
+	struct addrinfo *lookup;
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int error = getaddrinfo(node->host, intToString(node->port).strValue,
+							&hints, &lookup);
+
+	if (error != 0)
+	{
+		log_error("Failed to resolve the address of node " NODE_FORMAT ": %s",
+				  node->nodeId, node->name, node->host, node->port,
+				  gai_strerror(error));
+		return false;
+	}
+
+	memcpy(addr, lookup->ai_addr, lookup->ai_addrlen);
+	*addrLen = lookup->ai_addrlen;
+
+	freeaddrinfo(lookup);
+
+	return true;
+}
+
+
+/*
+ * service_router_accept accepts the clients that are waiting on our socket.
+ */
+static void
+service_router_accept(Router *router, int sock)
+{
+	for (;;)
+	{
+		RouterConnection *conn = NULL;
+
+		for (int i = 0; i < ROUTER_MAX_CONNECTIONS; i++)
+		{
+			if (router->connections[i].state == ROUTER_CONNECTION_FREE)
+			{
+				conn = &(router->connections[i]);
+				break;
+			}
+		}
+
+		int client = accept(sock, NULL, NULL);
+
+		if (client < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				log_warn("Failed to accept a router connection: %m");
+			}
+			return;
+		}
+
+		if (conn == NULL)
+		{
+			log_warn("Closing a client connection: the router already "
+					 "serves %d connections",
+					 ROUTER_MAX_CONNECTIONS);
+			close(client);
+			continue;
+		}
+
+		int on = 1;
+
+		(void) fcntl(client, F_SETFL, O_NONBLOCK);
+		(void) setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		*conn = (RouterConnection) {
+			.state = ROUTER_CONNECTION_WAITING,
+			.client = client,
+			.server = -1,
+			.acceptTime = time(NULL)
+		};
+
+		if (router->hasPrimary)
+		{
+			(void) service_router_connect(router, conn);
+		}
+	}
+}
+
+
+/*
+ * service_router_connect starts connecting the client to the primary.
+ */
+static void
+service_router_connect(Router *router, RouterConnection *conn)
+{
+	struct sockaddr *addr = (struct sockaddr *) &(router->primaryAddr);
+
+	int server = socket(addr->sa_family, SOCK_STREAM, 0);
+
+	if (server < 0)
+	{
+		log_error("Failed to create a socket for the primary: %m");
+		(void) service_router_close(conn);
+		return;
+	}
+
+	conn->server = server;
+	conn->nodeId = router->primary.nodeId;
+
+	int on = 1;
+
+	(void) fcntl(server, F_SETFL, O_NONBLOCK);
+	(void) setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(server, addr, router->primaryAddrLen) == 0)
+	{
+		(void) service_router_connected(conn);
+	}
+	else if (errno == EINPROGRESS)
+	{
+		conn->state = ROUTER_CONNECTION_CONNECTING;
+	}
+	else
+	{
+		log_warn("Failed to connect to primary node " NODE_FORMAT ": %m",
+				 router->primary.nodeId,
+				 router->primary.name,
+				 router->primary.host,
+				 router->primary.port);
+
+		/* the monitor might know better now */
+		(void) service_router_request_refresh(router);
+		(void) service_router_close(conn);
+	}
+}
+
+
+/*
+ * service_router_connected checks the outcome of connecting to the primary,
+ * and when it's a success, starts forwarding.
+ */
+static void
+service_router_connected(RouterConnection *conn)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(conn->server, SOL_SOCKET, SO_ERROR, &error, &len) != 0 ||
+		error != 0)
+	{
+		log_warn("Failed to connect to the primary: %s",
+				 strerror(error != 0 ? error : errno));
+		(void) service_router_close(conn);
+		return;
+	}
+
+	if (!router_stream_init(&(conn->up), conn->client, conn->server) ||
+		!router_stream_init(&(conn->down), conn->server, conn->client))
+	{
+		/* errors have already been logged */
+		(void) service_router_close(conn);
+		return;
+	}
+
+	conn->state = ROUTER_CONNECTION_FORWARDING;
+
+	/* the client might have sent its startup packet already */
+	(void) service_router_forward(conn);
+}
+
+
+/*
+ * service_router_forward moves the bytes that can be moved without blocking,
+ * in both directions, and closes the connection when it's done.
+ */
+static void
+service_router_forward(RouterConnection *conn)
+{
+	if (!router_stream_relay(&(conn->up)) ||
+		!router_stream_relay(&(conn->down)))
+	{
+		(void) service_router_close(conn);
+		return;
+	}
+
+	/* once both sides are done, so are we */
+	if (conn->up.shutdown && conn->down.shutdown)
+	{
+		(void) service_router_close(conn);
+	}
+}
+
+
+/*
+ * service_router_close closes a connection and frees its entry.
+ */
+static void
+service_router_close(RouterConnection *conn)
+{
+	if (conn->state == ROUTER_CONNECTION_FORWARDING)
+	{
+		(void) router_stream_free(&(conn->up));
+		(void) router_stream_free(&(conn->down));
+	}
+
+	if (conn->client >= 0)
+	{
+		close(conn->client);
+	}
+
+	if (conn->server >= 0)
+	{
+		close(conn->server);
+	}
+
+	*conn = (RouterConnection) {
+		.state = ROUTER_CONNECTION_FREE,
+		.client = -1,
+		.server = -1
+	};
+}
+
+
+/*
+ * router_stream_init prepares a stream to move bytes from one socket to the
+ * other one.
+ */
+static bool
+router_stream_init(RouterStream *stream, int from, int to)
+{
+	*stream = (RouterStream) {
+		.from = from, .to = to
+	};
+
+#if defined(__linux__)
+	if (pipe2(stream->pipe, O_NONBLOCK) != 0)
+	{
+		log_error("Failed to create a pipe for a router connection: %m");
+		stream->pipe[0] = stream->pipe[1] = -1;
+		return false;
+	}
+#else
+	stream->buffer = (char *) malloc(ROUTER_CHUNK_SIZE);
+
+	if (stream->buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+
+/*
+ * router_stream_free releases the resources of a stream.
+ */
+static void
+router_stream_free(RouterStream *stream)
+{
+#if defined(__linux__)
+	if (stream->pipe[0] >= 0)
+	{
+		close(stream->pipe[0]);
+		close(stream->pipe[1]);
+	}
+#else
+	free(stream->buffer);
+#endif
+
+	*stream = (RouterStream) { 0 };
+}
+
+
+/*
+ * router_stream_relay writes the pending bytes of the stream, then reads and
+ * writes more until either socket would block. It returns false when the
+ * connection must be closed.
+ */
+static bool
+router_stream_relay(RouterStream *stream)
+{
+	for (;;)
+	{
+		ssize_t bytes = 0;
+
+		if (stream->pending > 0)
+		{
+#if defined(__linux__)
+			bytes = splice(stream->pipe[0], NULL, stream->to, NULL,
+						   stream->pending,
+						   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+			bytes = write(stream->to,
+						  stream->buffer + stream->offset,
+						  stream->pending);
+#endif
+
+			if (bytes < 0)
+			{
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+
+			stream->pending -= bytes;
+
+#if !defined(__linux__)
+			stream->offset = stream->pending > 0 ? stream->offset + bytes : 0;
+#endif
+
+			continue;
+		}
+
+		if (stream->eof)
+		{
+			if (!stream->shutdown)
+			{
+				(void) shutdown(stream->to, SHUT_WR);
+				stream->shutdown = true;
+			}
+			return true;
+		}
+
+#if defined(__linux__)
+		bytes = splice(stream->from, NULL, stream->pipe[1], NULL,
+					   ROUTER_CHUNK_SIZE,
+					   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+		bytes = read(stream->from, stream->buffer, ROUTER_CHUNK_SIZE);
+#endif
+
+		if (bytes < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		if (bytes == 0)
+		{
+			stream->eof = true;
+			continue;
+		}
+
+		stream->pending = bytes;
+	}
+}
+
+
+/*
+ * router_stream_events returns the poll() events that the stream waits for
+ * on the given socket.
+ */
+static short
+router_stream_events(RouterStream *stream, int fd)
+{
+	if (stream->pending > 0)
+	{
+		return fd == stream->to ? POLLOUT : 0;
+	}
+
+	if (!stream->eof)
+	{
+		return fd == stream->from ? POLLIN : 0;
+	}
+
+	return 0;
+}
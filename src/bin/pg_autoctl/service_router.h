@@ -0,0 +1,24 @@
+/*
+ * src/bin/pg_autoctl/service_router.h
+ *   The pg_autoctl router service, forwarding client connections to the
+ *   current primary node of the group.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SERVICE_ROUTER_H
+#define SERVICE_ROUTER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "keeper.h"
+#include "keeper_config.h"
+
+bool service_router_start(void *context, pid_t *pid);
+void service_router_runprogram(Keeper *keeper);
+bool service_router_loop(KeeperConfig *config, pid_t start_pid);
+
+#endif /* SERVICE_ROUTER_H */
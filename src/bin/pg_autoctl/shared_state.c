@@ -0,0 +1,337 @@
+/*
+ * src/bin/pg_autoctl/shared_state.c
+ *   State exchanged between the pg_autoctl services in shared memory.
+ *
+ * The node-active service (or the monitor listener service) tells the
+ * Postgres controller service whether Postgres should be running. That used
+ * to go through the pg_autoctl.pg file only: the keeper wrote and fsynced it
+ * each time it ensured the Postgres status, and the controller read it every
+ * 100ms. The supervisor now creates a shared memory segment where the
+ * expected status is published, and the controller only reads the file when
+ * a process outside of the supervision tree has signaled it, such as
+ * pg_autoctl do pgctl on.
+ *
+ * The file is still written each time the expected status changes, as a
+ * checkpoint for the processes that are not attached to the segment, and for
+ * when pg_autoctl is restarted.
+ *
+ * We share the shared memory identifier with our sub-processes in the
+ * environment, the same way as we do for the metrics. The services attach to
+ * the segment the first time they use it.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "defaults.h"
+#include "env_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "shared_state.h"
+#include "string_utils.h"
+
+
+/* how many times we try to read a state that is being written */
+#define SHARED_STATE_READ_ATTEMPTS 100
+
+static SharedState *sharedState = NULL;
+static bool sharedStateAttachFailed = false;
+
+/* the supervisor removes the shared memory segment it created at exit */
+static int sharedStateShmId = -1;
+static pid_t sharedStateCreatorPid = 0;
+
+static void shared_state_unlink_atexit(void);
+static uint64_t shared_state_monotonic_us(void);
+
+
+/*
+ * shared_state_create creates the shared memory segment for the state of our
+ * services, and exports its identifier in the environment for the
+ * sub-processes that the supervisor is about to start.
+ */
+bool
+shared_state_create(void)
+{
+	/* a process that runs several supervisors in turn keeps its segment */
+	if (sharedState != NULL && getpid() == sharedStateCreatorPid)
+	{
+		memset(sharedState, 0, sizeof(SharedState));
+		return true;
+	}
+
+	int shmId = shmget(IPC_PRIVATE, sizeof(SharedState), IPC_CREAT | 0600);
+
+	if (shmId < 0)
+	{
+		log_error("Failed to create the shared state memory segment: %m");
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_error("Failed to attach the shared state memory segment %d: %m",
+				  shmId);
+		(void) shmctl(shmId, IPC_RMID, NULL);
+		return false;
+	}
+
+	sharedState = (SharedState *) segment;
+	memset(sharedState, 0, sizeof(SharedState));
+
+	sharedStateShmId = shmId;
+	sharedStateCreatorPid = getpid();
+	atexit(shared_state_unlink_atexit);
+
+	IntString shmIdString = intToString(shmId);
+
+	setenv(PG_AUTOCTL_SHARED_STATE_SHMID, shmIdString.strValue, 1);
+
+	log_debug("Created shared state memory segment %d", shmId);
+
+	return true;
+}
+
+
+/*
+ * shared_state_attach attaches to the shared memory segment that our
+ * supervisor created. When we are not running under a supervisor, there is
+ * no segment to attach to, and the shared_state_* functions return false.
+ */
+bool
+shared_state_attach(void)
+{
+	char shmIdString[BUFSIZE] = { 0 };
+	int shmId = -1;
+
+	if (sharedState != NULL || sharedStateAttachFailed ||
+		!env_exists(PG_AUTOCTL_SHARED_STATE_SHMID))
+	{
+		return true;
+	}
+
+	/* only try once, and then use the files */
+	sharedStateAttachFailed = true;
+
+	if (!get_env_copy(PG_AUTOCTL_SHARED_STATE_SHMID, shmIdString, BUFSIZE) ||
+		!stringToInt(shmIdString, &shmId))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	void *segment = shmat(shmId, NULL, 0);
+
+	if (segment == (void *) -1)
+	{
+		log_warn("Failed to attach the shared state memory segment %d: %m",
+				 shmId);
+		return false;
+	}
+
+	sharedState = (SharedState *) segment;
+	sharedStateAttachFailed = false;
+
+	return true;
+}
+
+
+/*
+ * shared_state_enabled returns true when we are attached to the shared state
+ * segment.
+ */
+bool
+shared_state_enabled(void)
+{
+	(void) shared_state_attach();
+
+	return sharedState != NULL;
+}
+
+
+/*
+ * shared_state_unlink_atexit removes the shared memory segment, only from the
+ * process that created it.
+ */
+static void
+shared_state_unlink_atexit(void)
+{
+	if (sharedStateShmId < 0 || getpid() != sharedStateCreatorPid)
+	{
+		return;
+	}
+
+	(void) shmdt(sharedState);
+	sharedState = NULL;
+
+	if (shmctl(sharedStateShmId, IPC_RMID, NULL) != 0)
+	{
+		log_warn("Failed to remove the shared state memory segment %d: %m",
+				 sharedStateShmId);
+	}
+
+	sharedStateShmId = -1;
+}
+
+
+/*
+ * shared_state_publish_postgres publishes the given expected Postgres status,
+ * and sets changed to false when it's the same as the one that was published
+ * before. It returns false when we are not attached to the segment.
+ */
+bool
+shared_state_publish_postgres(KeeperStatePostgres *pgStatus, bool *changed)
+{
+	if (!shared_state_enabled())
+	{
+		return false;
+	}
+
+	uint64_t generation = sharedState->generation;
+
+	*changed =
+		generation == 0 ||
+		sharedState->pgStatus.pgExpectedStatus != pgStatus->pgExpectedStatus;
+
+	sharedState->generation = generation + 1;
+	__sync_synchronize();
+
+	sharedState->pgStatus = *pgStatus;
+
+	__sync_synchronize();
+	sharedState->generation = generation + 2;
+
+	return true;
+}
+
+
+/*
+ * shared_state_read_postgres copies the last published expected Postgres
+ * status, and the generation it was published with. It returns false when
+ * we are not attached to the segment, or when nothing has been published
+ * yet.
+ */
+bool
+shared_state_read_postgres(KeeperStatePostgres *pgStatus, uint64_t *generation)
+{
+	if (!shared_state_enabled())
+	{
+		return false;
+	}
+
+	for (int attempt = 0; attempt < SHARED_STATE_READ_ATTEMPTS; attempt++)
+	{
+		uint64_t before = sharedState->generation;
+
+		if (before == 0)
+		{
+			return false;
+		}
+
+		if (before % 2 == 1)
+		{
+			/* a service is writing, give it some time */
+			pg_usleep(1000);
+			continue;
+		}
+
+		__sync_synchronize();
+		KeeperStatePostgres copy = sharedState->pgStatus;
+		__sync_synchronize();
+
+		if (sharedState->generation == before)
+		{
+			*pgStatus = copy;
+			*generation = before;
+			return true;
+		}
+	}
+
+	log_warn("Failed to read the expected Postgres status in shared memory");
+
+	return false;
+}
+
+
+/*
+ * shared_state_keeper_heartbeat publishes that the node-active service is
+ * alive, and that it expects to publish its next heartbeat within timeoutMs
+ * milliseconds. A zero timeoutMs means that the service is about to run an
+ * operation that takes as long as it takes, such as pg_basebackup or
+ * pg_rewind, and that it should not be considered late in the meantime.
+ */
+bool
+shared_state_keeper_heartbeat(int timeoutMs)
+{
+	if (!shared_state_enabled())
+	{
+		return false;
+	}
+
+	uint64_t now = shared_state_monotonic_us();
+
+	sharedState->keeperDeadlineUs =
+		timeoutMs > 0 ? now + (uint64_t) timeoutMs * 1000 : 0;
+	sharedState->keeperHeartbeatUs = now;
+
+	return true;
+}
+
+
+/*
+ * shared_state_read_keeper_heartbeat returns how long ago the node-active
+ * service published its last heartbeat, and whether it's now late for the
+ * next one. It returns false when we are not attached to the segment, or
+ * when no heartbeat has been published yet.
+ */
+bool
+shared_state_read_keeper_heartbeat(uint64_t *sinceHeartbeatMs, bool *late)
+{
+	if (!shared_state_enabled())
+	{
+		return false;
+	}
+
+	uint64_t heartbeat = sharedState->keeperHeartbeatUs;
+	uint64_t deadline = sharedState->keeperDeadlineUs;
+	uint64_t now = shared_state_monotonic_us();
+
+	if (heartbeat == 0)
+	{
+		return false;
+	}
+
+	*sinceHeartbeatMs = now > heartbeat ? (now - heartbeat) / 1000 : 0;
+	*late = deadline > 0 && now > deadline;
+
+	return true;
+}
+
+
+/*
+ * shared_state_monotonic_us returns the current time of the monotonic clock,
+ * in microseconds. The clock is the same for all the processes of the
+ * system, so that our services can compare their readings.
+ */
+static uint64_t
+shared_state_monotonic_us(void)
+{
+	struct timespec now = { 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
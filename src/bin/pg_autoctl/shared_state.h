@@ -0,0 +1,60 @@
+/*
+ * src/bin/pg_autoctl/shared_state.h
+ *   State exchanged between the pg_autoctl services in shared memory.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "state.h"
+
+
+/*
+ * SharedState is kept in a SysV shared memory segment that the supervisor
+ * creates before starting its services. The generation is odd while a
+ * service is writing the state, so that readers can retry rather than use a
+ * half-written copy, and it is incremented twice for each update, so that
+ * readers also know when something new has been published.
+ *
+ * The expected Postgres status is written either by the node-active service
+ * or by the monitor listener service, never by both in the same supervision
+ * tree.
+ *
+ * The node-active service also publishes a heartbeat at each round of its
+ * main loop, with the monotonic time by which it expects to publish the next
+ * one, or zero while it runs a transition of unknown duration. The
+ * supervisor uses it to drive the systemd watchdog. Those are single 64-bit
+ * words with only one writer, outside of the generation protocol.
+ */
+typedef struct SharedState
+{
+	volatile uint64_t generation;
+
+	KeeperStatePostgres pgStatus;
+
+	volatile uint64_t keeperHeartbeatUs;
+	volatile uint64_t keeperDeadlineUs;
+} SharedState;
+
+
+bool shared_state_create(void);
+bool shared_state_attach(void);
+bool shared_state_enabled(void);
+
+bool shared_state_publish_postgres(KeeperStatePostgres *pgStatus,
+								   bool *changed);
+bool shared_state_read_postgres(KeeperStatePostgres *pgStatus,
+								uint64_t *generation);
+
+bool shared_state_keeper_heartbeat(int timeoutMs);
+bool shared_state_read_keeper_heartbeat(uint64_t *sinceHeartbeatMs,
+										bool *late);
+
+#endif /* SHARED_STATE_H */
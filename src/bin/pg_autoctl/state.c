@@ -17,6 +17,7 @@
 
 #include "postgres_fe.h"
 #include "libpq-fe.h"
+#include "portability/instr_time.h"
 
 #include "parson.h"
 
@@ -28,9 +29,16 @@
 #include "pgctl.h"
 #include "pgsetup.h"
 #include "pgsql.h"
+#include "shared_state.h"
 #include "state.h"
 
 static bool keeper_state_is_readable(int pg_autoctl_state_version);
+static bool keeper_state_has_changed(KeeperStateData *keeperState,
+									 KeeperStateData *storedState);
+static bool contact_time_has_changed(uint64_t contact, uint64_t storedContact);
+static bool state_file_fsync(int fd, const char *filename);
+static bool keeper_init_state_rewrite(KeeperStateInit *initState,
+									  const char *filename);
 static bool keeper_init_state_write(KeeperStateInit *initState,
 									const char *filename);
 static bool keeper_postgres_state_write(KeeperStatePostgres *pgStatus,
@@ -159,9 +167,9 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 		return false;
 	}
 
-	if (fsync(fd) != 0)
+	if (!state_file_fsync(fd, tempFileName))
 	{
-		log_fatal("fsync error: %m");
+		/* errors have already been logged */
 		return false;
 	}
 
@@ -185,6 +193,133 @@ keeper_state_write(KeeperStateData *keeperState, const char *filename)
 }
 
 
+/*
+ * keeper_state_write_if_changed writes the given state to disk, unless the
+ * state file already has the same contents. The keeper main loop stores its
+ * state at every round, most of the time without any change, and each write
+ * costs an fsync.
+ *
+ * The contact timestamps change at every round though, so when they are the
+ * only change we only write them every few seconds, see
+ * PG_AUTOCTL_KEEPER_STATE_CONTACT_REFRESH_TIME. The network partition checks
+ * use the in-memory values, the state file only needs them to be recent when
+ * pg_autoctl restarts.
+ */
+bool
+keeper_state_write_if_changed(KeeperStateData *keeperState,
+							  const char *filename)
+{
+	char *content = NULL;
+	long fileSize = 0;
+
+	if (read_file_if_exists(filename, &content, &fileSize))
+	{
+		bool hasChanged =
+			fileSize < sizeof(KeeperStateData) ||
+			keeper_state_has_changed(keeperState, (KeeperStateData *) content);
+
+		free(content);
+
+		if (!hasChanged)
+		{
+			log_trace("Keeper state has not changed, "
+					  "skipping writing \"%s\"", filename);
+			return true;
+		}
+	}
+
+	return keeper_state_write(keeperState, filename);
+}
+
+
+/*
+ * keeper_state_has_changed returns true when the given state differs from
+ * the stored state, ignoring small changes of the contact timestamps.
+ */
+static bool
+keeper_state_has_changed(KeeperStateData *keeperState,
+						 KeeperStateData *storedState)
+{
+	return keeperState->pg_autoctl_state_version !=
+		   storedState->pg_autoctl_state_version ||
+		   keeperState->pg_version != storedState->pg_version ||
+		   keeperState->pg_control_version != storedState->pg_control_version ||
+		   keeperState->catalog_version_no != storedState->catalog_version_no ||
+		   keeperState->system_identifier != storedState->system_identifier ||
+		   keeperState->current_node_id != storedState->current_node_id ||
+		   keeperState->current_group != storedState->current_group ||
+		   keeperState->assigned_role != storedState->assigned_role ||
+		   keeperState->current_nodes_version !=
+		   storedState->current_nodes_version ||
+		   keeperState->current_role != storedState->current_role ||
+		   keeperState->xlog_lag != storedState->xlog_lag ||
+		   keeperState->keeper_is_paused != storedState->keeper_is_paused ||
+		   contact_time_has_changed(keeperState->last_monitor_contact,
+									storedState->last_monitor_contact) ||
+		   contact_time_has_changed(keeperState->last_secondary_contact,
+									storedState->last_secondary_contact);
+}
+
+
+/*
+ * contact_time_has_changed returns true when a contact timestamp has been
+ * set or reset, or has moved by PG_AUTOCTL_KEEPER_STATE_CONTACT_REFRESH_TIME
+ * seconds or more.
+ */
+static bool
+contact_time_has_changed(uint64_t contact, uint64_t storedContact)
+{
+	if (contact == 0 || storedContact == 0)
+	{
+		return contact != storedContact;
+	}
+
+	uint64_t delta = contact > storedContact
+					 ? contact - storedContact
+					 : storedContact - contact;
+
+	return delta >= PG_AUTOCTL_KEEPER_STATE_CONTACT_REFRESH_TIME;
+}
+
+
+/*
+ * state_file_fsync calls fsync() on a state file that we just wrote, and
+ * warns when it took more than PG_AUTOCTL_SLOW_FSYNC_WARNING_MS, as the
+ * keeper main loop waits for it.
+ */
+static bool
+state_file_fsync(int fd, const char *filename)
+{
+	instr_time startTime;
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	if (fsync(fd) != 0)
+	{
+		log_fatal("fsync error: %m");
+		return false;
+	}
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	int durationMs = (int) INSTR_TIME_GET_MILLISEC(duration);
+
+	if (durationMs >= PG_AUTOCTL_SLOW_FSYNC_WARNING_MS)
+	{
+		log_warn("Slow storage: fsync of \"%s\" took %d ms",
+				 filename, durationMs);
+	}
+	else
+	{
+		log_trace("fsync of \"%s\" took %d ms", filename, durationMs);
+	}
+
+	return true;
+}
+
+
 /*
  * keeper_state_init initializes a new state structure with default values.
  */
@@ -359,6 +494,32 @@ print_keeper_init_state(KeeperStateInit *initState, FILE *stream)
 	fformat(stream,
 			"Postgres state at keeper init: %s\n",
 			PreInitPostgreInstanceStateToString(initState->pgInitState));
+
+	if (initState->backupTotalKB > 0)
+	{
+		uint64_t elapsed =
+			initState->backupUpdateTime - initState->backupStartTime;
+
+		fformat(stream,
+				"pg_basebackup progress: %" PRId64 "/%" PRId64 " kB "
+				"(%d%%) in %" PRIu64 "s\n",
+				initState->backupDoneKB,
+				initState->backupTotalKB,
+				(int) (100 * initState->backupDoneKB /
+					   initState->backupTotalKB),
+				elapsed);
+	}
+
+	if (initState->stepDurationMs[INIT_STEP_INITDB] > 0)
+	{
+		fformat(stream,
+				"Init step durations: initdb %" PRIu64 " ms, "
+				"database and extensions %" PRIu64 " ms, "
+				"primary setup %" PRIu64 " ms\n",
+				initState->stepDurationMs[INIT_STEP_INITDB],
+				initState->stepDurationMs[INIT_STEP_DATABASE],
+				initState->stepDurationMs[INIT_STEP_PRIMARY]);
+	}
 	fflush(stream);
 }
 
@@ -743,9 +904,9 @@ keeper_init_state_write(KeeperStateInit *initState, const char *filename)
 		return false;
 	}
 
-	if (fsync(fd) != 0)
+	if (!state_file_fsync(fd, filename))
 	{
-		log_fatal("fsync error: %m");
+		/* errors have already been logged */
 		return false;
 	}
 
@@ -838,6 +999,113 @@ keeper_init_state_read(KeeperStateInit *initState, const char *filename)
 }
 
 
+/*
+ * keeper_init_state_update_backup_progress records the pg_basebackup progress
+ * in the keeper init file, when it exists: that's only the case when the
+ * standby is being initialized by pg_autoctl create.
+ */
+bool
+keeper_init_state_update_backup_progress(const char *filename,
+										 int64_t doneKB,
+										 int64_t totalKB,
+										 uint64_t startTime)
+{
+	KeeperStateInit initState = { 0 };
+
+	if (IS_EMPTY_STRING_BUFFER(filename) || !file_exists(filename))
+	{
+		return true;
+	}
+
+	if (!keeper_init_state_read(&initState, filename))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	initState.backupDoneKB = doneKB;
+	initState.backupTotalKB = totalKB;
+	initState.backupStartTime = startTime;
+	initState.backupUpdateTime = time(NULL);
+
+	return keeper_init_state_rewrite(&initState, filename);
+}
+
+
+/*
+ * keeper_init_state_update_step_duration records how long the given step of
+ * initializing a primary node took in the keeper init file, when it exists.
+ */
+bool
+keeper_init_state_update_step_duration(const char *filename,
+									   KeeperInitStep step,
+									   uint64_t durationMs)
+{
+	KeeperStateInit initState = { 0 };
+
+	if (IS_EMPTY_STRING_BUFFER(filename) || !file_exists(filename))
+	{
+		return true;
+	}
+
+	if (!keeper_init_state_read(&initState, filename))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	initState.stepDurationMs[step] = durationMs;
+
+	return keeper_init_state_rewrite(&initState, filename);
+}
+
+
+/*
+ * keeper_init_state_rewrite replaces the contents of the existing keeper init
+ * file with the given initState.
+ */
+static bool
+keeper_init_state_rewrite(KeeperStateInit *initState, const char *filename)
+{
+	char buffer[PG_AUTOCTL_KEEPER_STATE_FILE_SIZE] = { 0 };
+	char tempFileName[MAXPGPATH] = { 0 };
+
+	/* see keeper_init_state_write about using memcpy here */
+	memcpy(buffer, initState, sizeof(KeeperStateInit)); /* IGNORE-BANNED */
+
+	/* as in keeper_state_write, write a new file and rename it */
+	sformat(tempFileName, MAXPGPATH, "%s.new", filename);
+
+	int fd = open(tempFileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+	{
+		log_error("Failed to create keeper init state file \"%s\": %m",
+				  tempFileName);
+		return false;
+	}
+
+	if (write(fd, buffer, PG_AUTOCTL_KEEPER_STATE_FILE_SIZE) !=
+		PG_AUTOCTL_KEEPER_STATE_FILE_SIZE)
+	{
+		log_error("Failed to write keeper init state file \"%s\": %m",
+				  tempFileName);
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	if (rename(tempFileName, filename) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tempFileName, filename);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * ExpectedPostgresStatusToString return the string that represents our
  * expected PostgreSQL state.
@@ -930,14 +1198,28 @@ keeper_set_postgres_state_stopped(KeeperStatePostgres *pgStatus,
 
 
 /*
- * keeper_postgres_state_create creates our pg_autoctl.pg file.
+ * keeper_postgres_state_update publishes the expected Postgres status to the
+ * Postgres controller, and writes our pg_autoctl.pg file.
+ *
+ * Under a supervisor, the controller reads the status from shared memory, see
+ * shared_state.c, and we only need to write the file when the status changes
+ * or when the file has been removed.
  */
 bool
 keeper_postgres_state_update(KeeperStatePostgres *pgStatus,
 							 const char *filename)
 {
+	bool changed = true;
+
 	pgStatus->pg_autoctl_state_version = PG_AUTOCTL_STATE_VERSION;
 
+	if (shared_state_publish_postgres(pgStatus, &changed) &&
+		!changed &&
+		file_exists(filename))
+	{
+		return true;
+	}
+
 	log_debug("Writing keeper postgres expected state file at \"%s\"", filename);
 	log_debug("keeper_postgres_state_create: version = %d",
 			  pgStatus->pg_autoctl_state_version);
@@ -998,9 +1280,9 @@ keeper_postgres_state_write(KeeperStatePostgres *pgStatus,
 		return false;
 	}
 
-	if (fsync(fd) != 0)
+	if (!state_file_fsync(fd, filename))
 	{
-		log_fatal("fsync error: %m");
+		/* errors have already been logged */
 		return false;
 	}
 
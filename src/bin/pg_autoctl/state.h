@@ -147,6 +147,18 @@ typedef enum
 	PRE_INIT_STATE_PRIMARY
 } PreInitPostgreInstanceState;
 
+/*
+ * The steps of initializing a new primary node that we time and record in
+ * the init state file.
+ */
+typedef enum
+{
+	INIT_STEP_INITDB = 0,
+	INIT_STEP_DATABASE,
+	INIT_STEP_PRIMARY,
+	INIT_STEP_COUNT
+} KeeperInitStep;
+
 /*
  *  Note: The struct is serialized/serialiazed to/from state file. Therefore
  *  keeping the memory layout the same is important. Please
@@ -158,6 +170,15 @@ typedef struct
 {
 	int pg_autoctl_state_version;
 	PreInitPostgreInstanceState pgInitState;
+
+	/* pg_basebackup progress, when initializing a standby */
+	int64_t backupDoneKB;
+	int64_t backupTotalKB;
+	uint64_t backupStartTime;
+	uint64_t backupUpdateTime;
+
+	/* duration of each KeeperInitStep, in milliseconds */
+	uint64_t stepDurationMs[INIT_STEP_COUNT];
 } KeeperStateInit;
 
 _Static_assert(sizeof(KeeperStateInit) < PG_AUTOCTL_KEEPER_STATE_FILE_SIZE,
@@ -208,6 +229,8 @@ void keeper_state_init(KeeperStateData *keeperState);
 bool keeper_state_create_file(const char *filename);
 bool keeper_state_read(KeeperStateData *keeperState, const char *filename);
 bool keeper_state_write(KeeperStateData *keeperState, const char *filename);
+bool keeper_state_write_if_changed(KeeperStateData *keeperState,
+								   const char *filename);
 
 void log_keeper_state(KeeperStateData *keeperState);
 void print_keeper_state(KeeperStateData *keeperState, FILE *fp);
@@ -220,6 +243,13 @@ bool keeper_init_state_create(KeeperStateInit *initState,
 							  PostgresSetup *pgSetup,
 							  const char *filename);
 bool keeper_init_state_read(KeeperStateInit *initState, const char *filename);
+bool keeper_init_state_update_backup_progress(const char *filename,
+											  int64_t doneKB,
+											  int64_t totalKB,
+											  uint64_t startTime);
+bool keeper_init_state_update_step_duration(const char *filename,
+											KeeperInitStep step,
+											uint64_t durationMs);
 bool keeper_init_state_discover(KeeperStateInit *initState,
 								PostgresSetup *pgSetup,
 								const char *filename);
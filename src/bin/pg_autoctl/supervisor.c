@@ -7,10 +7,14 @@
  *
  */
 
+#include <errno.h>
 #include <inttypes.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -26,16 +30,34 @@
 #include "keeper_config.h"
 #include "keeper_pg_init.h"
 #include "log.h"
+#include "metrics.h"
 #include "monitor.h"
 #include "pgctl.h"
 #include "pidfile.h"
+#include "shared_state.h"
 #include "state.h"
 #include "supervisor.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "systemd_notify.h"
+
+/*
+ * The supervisor waits for its services without polling: a SIGCHLD handler
+ * sets this flag, and the supervisor sleeps in pselect(2) until a signal is
+ * received. The timeout is only used to check our pidfile once in a while,
+ * to drive the shutdown sequence, and to send the systemd watchdog
+ * notifications in time.
+ */
+static volatile sig_atomic_t child_exited = 0;
+
+#define SUPERVISOR_IDLE_TIMEOUT_MS 5000
+#define SUPERVISOR_SHUTDOWN_TIMEOUT_MS 100
 
 static bool supervisor_init(Supervisor *supervisor);
 static SupervisorExitMode supervisor_loop(Supervisor *supervisor);
+static void supervisor_wait(Supervisor *supervisor);
+static void catch_child(int sig);
+static void supervisor_notify_systemd(Supervisor *supervisor);
 
 static bool supervisor_find_service(Supervisor *supervisor, pid_t pid,
 									Service **result);
@@ -58,6 +80,12 @@ static bool supervisor_restart_service(Supervisor *supervisor,
 
 static bool supervisor_may_restart(Service *service);
 
+static void supervisor_apply_scheduling(Service *service);
+
+#if defined(__linux__)
+static bool supervisor_parse_cpu_list(const char *cpuList, cpu_set_t *cpuSet);
+#endif
+
 static bool supervisor_update_pidfile(Supervisor *supervisor);
 
 
@@ -76,6 +104,9 @@ supervisor_start(Service services[], int serviceCount, const char *pidfile)
 	/* copy the pidfile over to our supervisor structure */
 	strlcpy(supervisor.pidfile, pidfile, MAXPGPATH);
 
+	/* our services log as themselves, we log as the main pg_autoctl process */
+	(void) log_set_context("service", "pg_autoctl");
+
 	/*
 	 * Create our PID file, or quit now if another pg_autoctl instance is
 	 * runnning.
@@ -86,6 +117,16 @@ supervisor_start(Service services[], int serviceCount, const char *pidfile)
 		return false;
 	}
 
+	/* only the supervisor talks to systemd, not our services nor Postgres */
+	(void) systemd_notify_init();
+
+	/* our services exchange their state in shared memory when possible */
+	if (!shared_state_create())
+	{
+		log_warn("Failed to setup the shared state of our services, "
+				 "continuing with the state files only");
+	}
+
 	/*
 	 * Start all the given services, in order.
 	 *
@@ -103,6 +144,8 @@ supervisor_start(Service services[], int serviceCount, const char *pidfile)
 
 		if (started)
 		{
+			(void) supervisor_apply_scheduling(service);
+
 			uint64_t now = time(NULL);
 			RestartCounters *counters = &(service->restartCounters);
 
@@ -192,7 +235,7 @@ static SupervisorExitMode
 supervisor_loop(Supervisor *supervisor)
 {
 	int subprocessCount = supervisor->serviceCount;
-	bool firstLoop = true;
+	bool doWait = false;
 
 	/* wait until all subprocesses are done */
 	while (subprocessCount > 0)
@@ -200,6 +243,15 @@ supervisor_loop(Supervisor *supervisor)
 		pid_t pid;
 		int status;
 
+		if (doWait)
+		{
+			(void) supervisor_wait(supervisor);
+		}
+
+		doWait = true;
+
+		(void) supervisor_notify_systemd(supervisor);
+
 		/* Check that we still own our PID file, or quit now */
 		(void) check_pidfile(supervisor->pidfile, supervisor->pid);
 
@@ -211,15 +263,8 @@ supervisor_loop(Supervisor *supervisor)
 			(void) supervisor_reload_services(supervisor);
 		}
 
-		if (firstLoop)
-		{
-			firstLoop = false;
-		}
-		else
-		{
-			/* avoid busy looping on waitpid(WNOHANG) */
-			pg_usleep(100 * 1000); /* 100 ms */
-		}
+		/* reset the flag before calling waitpid(), not to miss a child */
+		child_exited = 0;
 
 		/* ignore errors */
 		pid = waitpid(-1, &status, WNOHANG);
@@ -284,6 +329,9 @@ supervisor_loop(Supervisor *supervisor)
 				/* one child process is no more */
 				--subprocessCount;
 
+				/* other children might have exited too, don't wait */
+				doWait = false;
+
 				/* apply the service restart policy */
 				if (supervisor_restart_service(supervisor, dead, status))
 				{
@@ -300,6 +348,181 @@ supervisor_loop(Supervisor *supervisor)
 }
 
 
+/*
+ * supervisor_wait sleeps until a signal is received, such as SIGCHLD when one
+ * of our services exits, or until the timeout is reached.
+ *
+ * We block the signals and check our flags before calling pselect(2), which
+ * unblocks the signals only while waiting, so that a signal received in
+ * between is never missed.
+ */
+static void
+supervisor_wait(Supervisor *supervisor)
+{
+	sigset_t sig_mask;
+	sigset_t sig_mask_orig;
+	sigset_t sig_mask_child;
+
+	int timeoutMs = supervisor->shutdownSequenceInProgress
+					? SUPERVISOR_SHUTDOWN_TIMEOUT_MS
+					: SUPERVISOR_IDLE_TIMEOUT_MS;
+
+	/* wake-up often enough to send the systemd watchdog notifications */
+	int watchdogMs = systemd_watchdog_interval_ms();
+
+	if (watchdogMs > 0 && watchdogMs / 4 < timeoutMs)
+	{
+		timeoutMs = Max(watchdogMs / 4, SUPERVISOR_SHUTDOWN_TIMEOUT_MS);
+	}
+
+	/* we have milliseconds, we want seconds and nanoseconds separately */
+	int seconds = timeoutMs / 1000;
+	int nanosecs = 1000 * 1000 * (timeoutMs % 1000);
+	struct timespec timeout = { .tv_sec = seconds, .tv_nsec = nanosecs };
+
+	if (!block_signals(&sig_mask, &sig_mask_orig))
+	{
+		/* fallback to a short sleep, as if we had been interrupted */
+		pg_usleep(SUPERVISOR_SHUTDOWN_TIMEOUT_MS * 1000);
+		return;
+	}
+
+	/* block_signals() only handles our control signals, add SIGCHLD */
+	sigemptyset(&sig_mask_child);
+	sigaddset(&sig_mask_child, SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK, &sig_mask_child, NULL) == -1)
+	{
+		(void) unblock_signals(&sig_mask_orig);
+
+		pg_usleep(SUPERVISOR_SHUTDOWN_TIMEOUT_MS * 1000);
+		return;
+	}
+
+	/* check if we received signals just before blocking them */
+	if (child_exited ||
+		asked_to_stop || asked_to_stop_fast || asked_to_reload || asked_to_quit)
+	{
+		(void) unblock_signals(&sig_mask_orig);
+		return;
+	}
+
+	int ret = pselect(0, NULL, NULL, NULL, &timeout, &sig_mask_orig);
+
+	/* restore signal masks (un block them) now that pselect() is done */
+	(void) unblock_signals(&sig_mask_orig);
+
+	if (ret < 0 && errno != EINTR)
+	{
+		log_debug("Failed to wait for signals: pselect(): %m");
+	}
+}
+
+
+/*
+ * supervisor_notify_systemd implements our side of the systemd notification
+ * protocol, when pg_autoctl runs as a Type=notify service.
+ *
+ * We are ready when the node-active service has published its first
+ * heartbeat, or as soon as our services are started when there is no
+ * node-active service, such as on the monitor. Then we send the systemd
+ * watchdog notifications only as long as the node-active service is not late
+ * for its next heartbeat, so that systemd restarts a pg_autoctl that is
+ * wedged, and not only one that has exited.
+ */
+static void
+supervisor_notify_systemd(Supervisor *supervisor)
+{
+	bool hasKeeperService = false;
+	uint64_t sinceHeartbeatMs = 0;
+	bool late = false;
+
+	if (!systemd_notify_enabled())
+	{
+		return;
+	}
+
+	if (supervisor->shutdownSequenceInProgress)
+	{
+		if (!supervisor->notifiedStopping)
+		{
+			supervisor->notifiedStopping = systemd_notify("STOPPING=1");
+		}
+
+		(void) systemd_notify_watchdog();
+		return;
+	}
+
+	for (int i = 0; i < supervisor->serviceCount; i++)
+	{
+		if (strcmp(supervisor->services[i].name, SERVICE_NAME_KEEPER) == 0)
+		{
+			hasKeeperService = true;
+			break;
+		}
+	}
+
+	/* without the shared state, we only know that we are still running */
+	if (!hasKeeperService || !shared_state_enabled())
+	{
+		if (!supervisor->notifiedReady)
+		{
+			supervisor->notifiedReady = systemd_notify("READY=1");
+		}
+
+		(void) systemd_notify_watchdog();
+		return;
+	}
+
+	if (!shared_state_read_keeper_heartbeat(&sinceHeartbeatMs, &late))
+	{
+		/* the node-active service is starting, TimeoutStartSec applies */
+		(void) systemd_notify_watchdog();
+		return;
+	}
+
+	if (!supervisor->notifiedReady)
+	{
+		supervisor->notifiedReady = systemd_notify("READY=1");
+	}
+
+	if (late)
+	{
+		if (!supervisor->keeperIsLate)
+		{
+			log_error("The %s service has not published a heartbeat "
+					  "in %" PRIu64 "ms, stopping the systemd watchdog "
+					  "notifications",
+					  SERVICE_NAME_KEEPER, sinceHeartbeatMs);
+		}
+
+		supervisor->keeperIsLate = true;
+		return;
+	}
+
+	if (supervisor->keeperIsLate)
+	{
+		log_info("The %s service is back to publishing its heartbeat, "
+				 "resuming the systemd watchdog notifications",
+				 SERVICE_NAME_KEEPER);
+		supervisor->keeperIsLate = false;
+	}
+
+	(void) systemd_notify_watchdog();
+}
+
+
+/*
+ * catch_child receives the SIGCHLD signal.
+ */
+static void
+catch_child(int sig)
+{
+	child_exited = 1;
+	pqsignal(sig, catch_child);
+}
+
+
 /*
  * supervisor_find_service loops over the SubProcess array to find given pid and
  * return its entry in the array.
@@ -454,6 +677,9 @@ supervisor_init(Supervisor *supervisor)
 	/* Establish a handler for signals. */
 	(void) set_signal_handlers(exitOnQuit);
 
+	/* and wake-up as soon as one of our services exits */
+	pqsignal(SIGCHLD, catch_child);
+
 	/* Check that the keeper service is not already running */
 	if (read_pidfile(supervisor->pidfile, &(supervisor->pid)))
 	{
@@ -775,6 +1001,7 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 	 * too.
 	 */
 	log_info("Restarting service %s", service->name);
+	(void) metrics_count_service_restart(service->name);
 	bool restarted = (*service->startFunction)(service->context, &(service->pid));
 
 	if (!restarted)
@@ -790,6 +1017,8 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 		return false;
 	}
 
+	(void) supervisor_apply_scheduling(service);
+
 	/*
 	 * Now we have restarted the service, it has a new PID and we need to
 	 * update our PID file with the new information. Failing to update the PID
@@ -812,6 +1041,145 @@ supervisor_restart_service(Supervisor *supervisor, Service *service, int status)
 }
 
 
+/*
+ * supervisor_apply_scheduling sets the nice value and the CPU affinity of a
+ * service that has just been started, when the service registered a
+ * ServiceScheduling. The setting applies to the service pid, so it survives
+ * the exec() of the service, and is inherited by the processes that the
+ * service starts. Failures are logged and the service continues with the
+ * scheduling of the supervisor.
+ */
+static void
+supervisor_apply_scheduling(Service *service)
+{
+	ServiceScheduling *scheduling = service->scheduling;
+
+	if (scheduling == NULL || service->pid <= 0)
+	{
+		return;
+	}
+
+	/* only privileged users can set a negative nice value */
+	if (scheduling->nice != 0 &&
+		setpriority(PRIO_PROCESS, service->pid, scheduling->nice) != 0)
+	{
+		log_warn("Failed to set the nice value of pg_autoctl %s service "
+				 "with pid %d to %d: %s",
+				 service->name,
+				 service->pid,
+				 scheduling->nice,
+				 strerror(errno));
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(scheduling->cpuAffinity))
+	{
+		return;
+	}
+
+#if defined(__linux__)
+	cpu_set_t cpuSet;
+
+	if (!supervisor_parse_cpu_list(scheduling->cpuAffinity, &cpuSet))
+	{
+		log_warn("Failed to parse CPU list \"%s\", pg_autoctl %s service "
+				 "runs on all the CPUs",
+				 scheduling->cpuAffinity,
+				 service->name);
+	}
+	else if (sched_setaffinity(service->pid, sizeof(cpuSet), &cpuSet) != 0)
+	{
+		log_warn("Failed to set the CPU affinity of pg_autoctl %s service "
+				 "with pid %d to \"%s\": %s",
+				 service->name,
+				 service->pid,
+				 scheduling->cpuAffinity,
+				 strerror(errno));
+	}
+	else
+	{
+		log_info("Running pg_autoctl %s service on CPUs %s",
+				 service->name,
+				 scheduling->cpuAffinity);
+	}
+#else
+	log_warn("Ignoring CPU affinity \"%s\" of pg_autoctl %s service: CPU "
+			 "affinity is only supported on Linux",
+			 scheduling->cpuAffinity,
+			 service->name);
+#endif
+}
+
+
+#if defined(__linux__)
+
+/*
+ * supervisor_parse_cpu_list parses a list of CPU numbers and ranges, such as
+ * "0-1,4", into the given cpu_set_t.
+ */
+static bool
+supervisor_parse_cpu_list(const char *cpuList, cpu_set_t *cpuSet)
+{
+	const char *ptr = cpuList;
+
+	CPU_ZERO(cpuSet);
+
+	while (*ptr != '\0')
+	{
+		char *end = NULL;
+
+		errno = 0;
+		long first = strtol(ptr, &end, 10);
+		long last = first;
+
+		if (errno != 0 || end == ptr)
+		{
+			return false;
+		}
+
+		ptr = end;
+
+		if (*ptr == '-')
+		{
+			++ptr;
+
+			errno = 0;
+			last = strtol(ptr, &end, 10);
+
+			if (errno != 0 || end == ptr)
+			{
+				return false;
+			}
+
+			ptr = end;
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+		{
+			return false;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			CPU_SET(cpu, cpuSet);
+		}
+
+		if (*ptr == ',')
+		{
+			++ptr;
+		}
+		else if (*ptr != '\0')
+		{
+			return false;
+		}
+	}
+
+	return CPU_COUNT(cpuSet) > 0;
+}
+
+
+#endif
+
+
 /*
  * supervisor_count_restarts returns true when we have restarted more than
  * SUPERVISOR_SERVICE_MAX_RETRY in the last SUPERVISOR_SERVICE_MAX_TIME period
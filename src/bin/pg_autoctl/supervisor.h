@@ -23,6 +23,10 @@
 #define SERVICE_NAME_POSTGRES "postgres"
 #define SERVICE_NAME_KEEPER "node-active"
 #define SERVICE_NAME_MONITOR "listener"
+#define SERVICE_NAME_METRICS "metrics"
+#define SERVICE_NAME_MONITOR_PROXY "monitor-proxy"
+#define SERVICE_NAME_ROUTER "router"
+#define SERVICE_NAME_NODE_PROBE "node-probe"
 
 /*
  * At pg_autoctl create time we use a transient service to initialize our local
@@ -94,6 +98,18 @@ typedef struct RestartCounters
  *
  * In particular, services may be started more than once when they fail.
  */
+
+/*
+ * The supervisor applies a ServiceScheduling to the services that register
+ * one each time it starts them, so that they keep up with their work on a
+ * host where Postgres backends use all the CPU time.
+ */
+typedef struct ServiceScheduling
+{
+	int nice;                   /* nice value, 0 keeps the supervisor's */
+	char cpuAffinity[BUFSIZE];  /* list of CPUs such as "0-1,4", or empty */
+} ServiceScheduling;
+
 typedef struct Service
 {
 	char name[NAMEDATALEN];             /* Service name for the user */
@@ -101,6 +117,7 @@ typedef struct Service
 	pid_t pid;                          /* Service PID */
 	bool (*startFunction)(void *context, pid_t *pid);
 	void *context;             /* Service Context (Monitor or Keeper struct) */
+	ServiceScheduling *scheduling;      /* NULL keeps the supervisor's */
 	RestartCounters restartCounters;
 } Service;
 
@@ -122,6 +139,11 @@ typedef struct Supervisor
 	bool shutdownSequenceInProgress;
 	int shutdownSignal;
 	int stoppingLoopCounter;
+
+	/* systemd notifications, see supervisor_notify_systemd */
+	bool notifiedReady;
+	bool notifiedStopping;
+	bool keeperIsLate;
 } Supervisor;
 
 
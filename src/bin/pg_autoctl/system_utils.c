@@ -8,21 +8,37 @@
  */
 
 #if defined(__linux__)
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
 #else
 #include <sys/types.h>
 #include <sys/sysctl.h>
 #include <sys/param.h>
 #endif
 
+#include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "log.h"
+#include "defaults.h"
 #include "file_utils.h"
+#include "log.h"
 #include "system_utils.h"
 
 #if defined(__linux__)
 static bool get_system_info_linux(SystemInfo *sysInfo);
+static void get_cgroup_limits(SystemInfo *sysInfo);
+static bool read_cgroup_file(const char *mount, const char *cgroupPath,
+							 const char *name, char *value, int size);
+static void apply_cgroup_memory_limit(SystemInfo *sysInfo, uint64_t limit);
+static void apply_cgroup_cpu_limit(SystemInfo *sysInfo,
+								   uint64_t quota, uint64_t period);
+static void get_huge_pages_info(SystemInfo *sysInfo);
+static bool read_first_line(const char *filename, char *buffer, int size);
 #endif
 
 #if defined(__APPLE__) || defined(BSD)
@@ -64,7 +80,281 @@ get_system_info_linux(SystemInfo *sysInfo)
 	}
 
 	sysInfo->ncpu = get_nprocs();
-	sysInfo->totalram = linuxSysInfo.totalram;
+	sysInfo->totalram = linuxSysInfo.totalram * linuxSysInfo.mem_unit;
+
+	sysInfo->hostNcpu = sysInfo->ncpu;
+	sysInfo->hostTotalram = sysInfo->totalram;
+
+	(void) get_cgroup_limits(sysInfo);
+	(void) get_huge_pages_info(sysInfo);
+
+	return true;
+}
+
+
+/*
+ * get_cgroup_limits reads the memory and cpu limits of the cgroup that we
+ * belong to, and applies them to the SystemInfo, so that we don't tune
+ * Postgres for the whole host when running in a container.
+ *
+ * Our cgroups are listed in /proc/self/cgroup, one line per hierarchy, in the
+ * format "id:controllers:path". The cgroup v2 hierarchy has an empty list of
+ * controllers, and we only use it for the controllers that are not mounted in
+ * a cgroup v1 hierarchy, as on hybrid systems.
+ */
+static void
+get_cgroup_limits(SystemInfo *sysInfo)
+{
+	char line[MAXPGPATH] = { 0 };
+	char v2Path[MAXPGPATH] = { 0 };
+	char memoryPath[MAXPGPATH] = { 0 };
+	char cpuPath[MAXPGPATH] = { 0 };
+	char cpuMount[MAXPGPATH] = { 0 };
+	bool hasV2 = false;
+
+	FILE *cgroups = fopen("/proc/self/cgroup", "r");
+
+	if (cgroups == NULL)
+	{
+		log_trace("Failed to open \"/proc/self/cgroup\": %m");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), cgroups) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+
+		char *controllers = strchr(line, ':');
+		char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+
+		if (path == NULL)
+		{
+			continue;
+		}
+
+		*controllers++ = '\0';
+		*path++ = '\0';
+
+		if (*controllers == '\0')
+		{
+			hasV2 = true;
+			strlcpy(v2Path, path, sizeof(v2Path));
+			continue;
+		}
+
+		/* the v1 mount point is named after the list of controllers */
+		char mount[MAXPGPATH] = { 0 };
+		sformat(mount, sizeof(mount), "/sys/fs/cgroup/%s", controllers);
+
+		char *saveptr = NULL;
+
+		for (char *controller = strtok_r(controllers, ",", &saveptr);
+			 controller != NULL;
+			 controller = strtok_r(NULL, ",", &saveptr))
+		{
+			if (strcmp(controller, "memory") == 0)
+			{
+				strlcpy(memoryPath, path, sizeof(memoryPath));
+			}
+			else if (strcmp(controller, "cpu") == 0)
+			{
+				strlcpy(cpuPath, path, sizeof(cpuPath));
+				strlcpy(cpuMount, mount, sizeof(cpuMount));
+			}
+		}
+	}
+
+	fclose(cgroups);
+
+	/* v1 has memory.limit_in_bytes, v2 has memory.max, maybe set to "max" */
+	if (memoryPath[0] != '\0')
+	{
+		char value[BUFSIZE] = { 0 };
+
+		if (read_cgroup_file("/sys/fs/cgroup/memory", memoryPath,
+							 "memory.limit_in_bytes", value, sizeof(value)))
+		{
+			sysInfo->cgroupVersion = 1;
+			apply_cgroup_memory_limit(sysInfo, strtoull(value, NULL, 10));
+		}
+	}
+	else if (hasV2)
+	{
+		char value[BUFSIZE] = { 0 };
+
+		if (read_cgroup_file("/sys/fs/cgroup", v2Path, "memory.max",
+							 value, sizeof(value)))
+		{
+			sysInfo->cgroupVersion = 2;
+
+			if (strcmp(value, "max") != 0)
+			{
+				apply_cgroup_memory_limit(sysInfo, strtoull(value, NULL, 10));
+			}
+		}
+	}
+
+	/* v1 has a quota and a period, v2 has cpu.max as "$MAX $PERIOD" */
+	if (cpuPath[0] != '\0')
+	{
+		char quota[BUFSIZE] = { 0 };
+		char period[BUFSIZE] = { 0 };
+
+		if (read_cgroup_file(cpuMount, cpuPath, "cpu.cfs_quota_us",
+							 quota, sizeof(quota)) &&
+			read_cgroup_file(cpuMount, cpuPath, "cpu.cfs_period_us",
+							 period, sizeof(period)))
+		{
+			sysInfo->cgroupVersion = 1;
+
+			/* the quota is -1 when unlimited */
+			if (quota[0] != '-')
+			{
+				apply_cgroup_cpu_limit(sysInfo,
+									   strtoull(quota, NULL, 10),
+									   strtoull(period, NULL, 10));
+			}
+		}
+	}
+	else if (hasV2)
+	{
+		char value[BUFSIZE] = { 0 };
+		uint64_t quota = 0;
+		uint64_t period = 0;
+
+		if (read_cgroup_file("/sys/fs/cgroup", v2Path, "cpu.max",
+							 value, sizeof(value)) &&
+			strncmp(value, "max", 3) != 0 &&
+			sscanf(value, "%" SCNu64 " %" SCNu64, &quota, &period) == 2)
+		{
+			apply_cgroup_cpu_limit(sysInfo, quota, period);
+		}
+	}
+}
+
+
+/*
+ * read_cgroup_file reads the first line of the given file of our cgroup. In a
+ * container without a cgroup namespace, /proc/self/cgroup lists the path
+ * as seen from the host, and our cgroup is mounted at the root of the
+ * hierarchy: we then read the file found there.
+ */
+static bool
+read_cgroup_file(const char *mount, const char *cgroupPath,
+				 const char *name, char *value, int size)
+{
+	char filename[MAXPGPATH] = { 0 };
+
+	sformat(filename, sizeof(filename), "%s%s/%s",
+			mount,
+			strcmp(cgroupPath, "/") == 0 ? "" : cgroupPath,
+			name);
+
+	if (read_first_line(filename, value, size))
+	{
+		return true;
+	}
+
+	sformat(filename, sizeof(filename), "%s/%s", mount, name);
+
+	return read_first_line(filename, value, size);
+}
+
+
+/*
+ * apply_cgroup_memory_limit uses the given cgroup memory limit as our total
+ * RAM when it is lower than the host memory. Unlimited cgroup v1 limits are
+ * reported as a very large number, that we ignore the same way.
+ */
+static void
+apply_cgroup_memory_limit(SystemInfo *sysInfo, uint64_t limit)
+{
+	if (limit > 0 && limit < sysInfo->totalram)
+	{
+		sysInfo->cgroupMemoryLimit = limit;
+		sysInfo->totalram = limit;
+	}
+}
+
+
+/*
+ * apply_cgroup_cpu_limit uses the given cgroup cpu quota as our number of
+ * CPUs when it is lower than the host count.
+ */
+static void
+apply_cgroup_cpu_limit(SystemInfo *sysInfo, uint64_t quota, uint64_t period)
+{
+	if (period == 0)
+	{
+		return;
+	}
+
+	/* round up: a quota of 1.5 CPU allows for 2 concurrent workers */
+	unsigned short ncpu = (unsigned short) ((quota + period - 1) / period);
+
+	if (ncpu > 0 && ncpu < sysInfo->ncpu)
+	{
+		sysInfo->cgroupCpuLimit = ncpu;
+		sysInfo->ncpu = ncpu;
+	}
+}
+
+
+/*
+ * get_huge_pages_info reads the size of the huge pages pool from /proc/meminfo.
+ */
+static void
+get_huge_pages_info(SystemInfo *sysInfo)
+{
+	char line[BUFSIZE] = { 0 };
+	uint64_t hugePagesCount = 0;
+	uint64_t hugePageSizeKB = 0;
+
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+
+	if (meminfo == NULL)
+	{
+		log_debug("Failed to open \"/proc/meminfo\": %m");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), meminfo) != NULL)
+	{
+		(void) sscanf(line, "HugePages_Total: %" SCNu64, &hugePagesCount);
+		(void) sscanf(line, "Hugepagesize: %" SCNu64 " kB", &hugePageSizeKB);
+	}
+
+	fclose(meminfo);
+
+	sysInfo->hugePageSize = hugePageSizeKB * 1024;
+	sysInfo->hugePagesTotal = hugePagesCount * sysInfo->hugePageSize;
+}
+
+
+/*
+ * read_first_line reads the first line of a file, without the newline. Files
+ * in /proc and /sys report a size of zero, so we can't use read_file() here.
+ */
+static bool
+read_first_line(const char *filename, char *buffer, int size)
+{
+	FILE *file = fopen(filename, "r");
+
+	if (file == NULL)
+	{
+		log_trace("Failed to open \"%s\": %m", filename);
+		return false;
+	}
+
+	if (fgets(buffer, size, file) == NULL)
+	{
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+
+	buffer[strcspn(buffer, "\n")] = '\0';
 
 	return true;
 }
@@ -107,6 +397,9 @@ get_system_info_bsd(SystemInfo *sysInfo)
 		return false;
 	}
 
+	sysInfo->hostNcpu = sysInfo->ncpu;
+	sysInfo->hostTotalram = sysInfo->totalram;
+
 	return true;
 }
 
@@ -114,6 +407,143 @@ get_system_info_bsd(SystemInfo *sysInfo)
 #endif
 
 
+/*
+ * get_storage_type returns the kind of block device that stores the given
+ * path. On Linux the device is found in /sys/dev/block using the major and
+ * minor numbers of the file system, and a partition has its queue settings
+ * in its parent device directory.
+ */
+StorageType
+get_storage_type(const char *path)
+{
+#if defined(__linux__)
+	struct stat st;
+	char devicePath[MAXPGPATH] = { 0 };
+	char realDevicePath[PATH_MAX] = { 0 };
+	char filename[MAXPGPATH] = { 0 };
+	char rotational[BUFSIZE] = { 0 };
+
+	if (path == NULL || stat(path, &st) != 0)
+	{
+		log_debug("Failed to stat \"%s\": %m", path ? path : "(null)");
+		return STORAGE_UNKNOWN;
+	}
+
+	sformat(devicePath, sizeof(devicePath), "/sys/dev/block/%u:%u",
+			major(st.st_dev), minor(st.st_dev));
+
+	if (realpath(devicePath, realDevicePath) == NULL)
+	{
+		log_debug("Failed to get the realpath of \"%s\": %m", devicePath);
+		return STORAGE_UNKNOWN;
+	}
+
+	sformat(filename, sizeof(filename), "%s/queue/rotational", realDevicePath);
+
+	if (!read_first_line(filename, rotational, sizeof(rotational)))
+	{
+		sformat(filename, sizeof(filename), "%s/../queue/rotational",
+				realDevicePath);
+
+		if (!read_first_line(filename, rotational, sizeof(rotational)))
+		{
+			return STORAGE_UNKNOWN;
+		}
+	}
+
+	if (strcmp(rotational, "1") == 0)
+	{
+		return STORAGE_ROTATIONAL;
+	}
+
+	char *deviceName = strrchr(realDevicePath, '/');
+
+	if (deviceName != NULL && strncmp(deviceName + 1, "nvme", 4) == 0)
+	{
+		return STORAGE_NVME;
+	}
+
+	return STORAGE_SSD;
+#else
+	return STORAGE_UNKNOWN;
+#endif
+}
+
+
+/*
+ * get_process_rss returns the resident set size of the given process, in
+ * bytes. Only Linux is supported, where we read /proc/<pid>/status.
+ */
+bool
+get_process_rss(pid_t pid, uint64_t *rssBytes)
+{
+#if defined(__linux__)
+	char filename[MAXPGPATH] = { 0 };
+	char line[BUFSIZE] = { 0 };
+	uint64_t rssKB = 0;
+	bool found = false;
+
+	sformat(filename, sizeof(filename), "/proc/%d/status", pid);
+
+	FILE *status = fopen(filename, "r");
+
+	if (status == NULL)
+	{
+		log_trace("Failed to open \"%s\": %m", filename);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), status) != NULL)
+	{
+		if (sscanf(line, "VmRSS: %" SCNu64 " kB", &rssKB) == 1)
+		{
+			found = true;
+			break;
+		}
+	}
+
+	fclose(status);
+
+	*rssBytes = rssKB * 1024;
+
+	return found;
+#else
+	return false;
+#endif
+}
+
+
+/*
+ * storage_type_to_string returns a string representation of a StorageType.
+ */
+char *
+storage_type_to_string(StorageType storageType)
+{
+	switch (storageType)
+	{
+		case STORAGE_ROTATIONAL:
+		{
+			return "rotational disk";
+		}
+
+		case STORAGE_SSD:
+		{
+			return "SSD";
+		}
+
+		case STORAGE_NVME:
+		{
+			return "NVMe";
+		}
+
+		default:
+		{
+			return "unknown storage";
+		}
+	}
+}
+
+
 /*
  * pretty_print_bytes pretty prints bytes in a human readable form. Given
  * 17179869184 it places the string "16 GB" in the given buffer.
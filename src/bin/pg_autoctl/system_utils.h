@@ -11,6 +11,8 @@
 #define SYSTEM_UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 
 /* taken from sysinfo(2) on Linux */
@@ -18,9 +20,34 @@ typedef struct SystemInfo
 {
 	uint64_t totalram;          /* Total usable main memory size */
 	unsigned short ncpu;        /* Number of current processes */
+
+	/* host values, before applying cgroup limits */
+	uint64_t hostTotalram;
+	unsigned short hostNcpu;
+
+	/* cgroup v1 or v2 limits, zero when unlimited; already applied above */
+	int cgroupVersion;          /* 0 when not found */
+	uint64_t cgroupMemoryLimit;
+	unsigned short cgroupCpuLimit;
+
+	/* huge pages pool, as reserved in /proc/meminfo */
+	uint64_t hugePagesTotal;    /* in bytes */
+	uint64_t hugePageSize;      /* in bytes */
 } SystemInfo;
 
+/* the kind of block device a directory is stored on */
+typedef enum
+{
+	STORAGE_UNKNOWN = 0,
+	STORAGE_ROTATIONAL,
+	STORAGE_SSD,
+	STORAGE_NVME
+} StorageType;
+
 bool get_system_info(SystemInfo *sysInfo);
+StorageType get_storage_type(const char *path);
+bool get_process_rss(pid_t pid, uint64_t *rssBytes);
+char * storage_type_to_string(StorageType storageType);
 void pretty_print_bytes(char *buffer, size_t size, uint64_t bytes);
 
 
@@ -27,6 +27,10 @@
 	make_strbuf_option_default("Unit", "Description", NULL, true, BUFSIZE, \
 							   config->Description, "pg_auto_failover")
 
+#define OPTION_SYSTEMD_TYPE(config) \
+	make_strbuf_option_default("Service", "Type", NULL, true, BUFSIZE, \
+							   config->Type, "notify")
+
 #define OPTION_SYSTEMD_WORKING_DIRECTORY(config) \
 	make_strbuf_option_default("Service", "WorkingDirectory", \
 							   NULL, true, BUFSIZE, \
@@ -58,6 +62,10 @@
 	make_strbuf_option_default("Service", "ExecReload", NULL, true, BUFSIZE, \
 							   config->ExecReload, "/usr/bin/pg_autoctl reload")
 
+#define OPTION_SYSTEMD_WATCHDOGSEC(config) \
+	make_int_option_default("Service", "WatchdogSec", NULL, true, \
+							&(config->WatchdogSec), SYSTEMD_WATCHDOG_SEC)
+
 #define OPTION_SYSTEMD_WANTEDBY(config) \
 	make_strbuf_option_default("Install", "WantedBy", NULL, true, BUFSIZE, \
 							   config->WantedBy, "multi-user.target")
@@ -65,6 +73,7 @@
 #define SET_INI_OPTIONS_ARRAY(config) \
 	{ \
 		OPTION_SYSTEMD_DESCRIPTION(config), \
+		OPTION_SYSTEMD_TYPE(config), \
 		OPTION_SYSTEMD_WORKING_DIRECTORY(config), \
 		OPTION_SYSTEMD_ENVIRONMENT_PGDATA(config), \
 		OPTION_SYSTEMD_USER(config), \
@@ -72,6 +81,7 @@
 		OPTION_SYSTEMD_RESTART(config), \
 		OPTION_SYSTEMD_STARTLIMITBURST(config), \
 		OPTION_SYSTEMD_EXECRELOAD(config), \
+		OPTION_SYSTEMD_WATCHDOGSEC(config), \
 		OPTION_SYSTEMD_WANTEDBY(config), \
 		INI_OPTION_LAST \
 	}
@@ -23,6 +23,7 @@ typedef struct SystemdServiceConfig
 	char Description[BUFSIZE];
 
 	/* Service */
+	char Type[BUFSIZE];
 	char WorkingDirectory[MAXPGPATH];
 	char EnvironmentPGDATA[BUFSIZE];
 	char User[NAMEDATALEN];
@@ -30,6 +31,7 @@ typedef struct SystemdServiceConfig
 	char Restart[BUFSIZE];
 	int StartLimitBurst;
 	char ExecReload[BUFSIZE];
+	int WatchdogSec;
 
 	/* Install */
 	char WantedBy[BUFSIZE];
@@ -0,0 +1,241 @@
+/*
+ * src/bin/pg_autoctl/systemd_notify.c
+ *     Implementation of the systemd notification protocol
+ *
+ * When running with Type=notify, systemd gives the path of a unix datagram
+ * socket in the NOTIFY_SOCKET environment variable, where the service sends
+ * its status: READY=1 once started, STOPPING=1 when shutting down, and
+ * WATCHDOG=1 at least every WATCHDOG_USEC microseconds when WatchdogSec is
+ * set. The protocol is simple enough that we implement it here rather than
+ * depend on libsystemd.
+ *
+ * Only the supervisor process talks to systemd, which is the main process of
+ * the unit, so that the default NotifyAccess=main is enough. We remove the
+ * variables from our environment so that our services and Postgres do not
+ * send their own notifications.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "postgres_fe.h"
+
+#include "log.h"
+#include "string_utils.h"
+#include "systemd_notify.h"
+
+static bool notifyInitialized = false;
+static char notifySocketPath[sizeof(((struct sockaddr_un *) 0)->sun_path)] = { 0 };
+
+/* in microseconds, 0 when the systemd watchdog is disabled */
+static uint64_t watchdogIntervalUs = 0;
+static uint64_t watchdogLastPingUs = 0;
+
+static uint64_t systemd_monotonic_us(void);
+
+
+/*
+ * systemd_notify_init reads the systemd notification environment, and then
+ * removes it for our sub-processes. It's safe to call it more than once.
+ */
+void
+systemd_notify_init(void)
+{
+	char *socketPath = getenv("NOTIFY_SOCKET");
+	char *watchdogUsec = getenv("WATCHDOG_USEC");
+	char *watchdogPid = getenv("WATCHDOG_PID");
+
+	if (notifyInitialized)
+	{
+		return;
+	}
+
+	notifyInitialized = true;
+
+	if (socketPath == NULL)
+	{
+		return;
+	}
+
+	if (strlen(socketPath) >= sizeof(notifySocketPath) ||
+		(socketPath[0] != '/' && socketPath[0] != '@'))
+	{
+		log_warn("Ignoring systemd NOTIFY_SOCKET \"%s\"", socketPath);
+	}
+	else
+	{
+		strlcpy(notifySocketPath, socketPath, sizeof(notifySocketPath));
+	}
+
+	if (watchdogUsec != NULL)
+	{
+		uint64_t interval = 0;
+		int pid = 0;
+
+		/* the watchdog might be meant for another process than ours */
+		if (watchdogPid != NULL &&
+			(!stringToInt(watchdogPid, &pid) || pid != getpid()))
+		{
+			log_debug("Ignoring systemd watchdog for pid %s", watchdogPid);
+		}
+		else if (!stringToUInt64(watchdogUsec, &interval) || interval == 0)
+		{
+			log_warn("Ignoring systemd WATCHDOG_USEC \"%s\"", watchdogUsec);
+		}
+		else
+		{
+			watchdogIntervalUs = interval;
+		}
+	}
+
+	(void) unsetenv("NOTIFY_SOCKET");
+	(void) unsetenv("WATCHDOG_USEC");
+	(void) unsetenv("WATCHDOG_PID");
+
+	if (watchdogIntervalUs > 0)
+	{
+		log_info("Using systemd notifications, with a watchdog of %" PRIu64
+				 "ms", watchdogIntervalUs / 1000);
+	}
+	else if (notifySocketPath[0] != '\0')
+	{
+		log_info("Using systemd notifications");
+	}
+}
+
+
+/*
+ * systemd_notify_enabled returns true when systemd expects notifications
+ * from us.
+ */
+bool
+systemd_notify_enabled(void)
+{
+	return notifySocketPath[0] != '\0';
+}
+
+
+/*
+ * systemd_watchdog_interval_ms returns the systemd watchdog interval, in
+ * milliseconds, or zero when the watchdog is disabled.
+ */
+int
+systemd_watchdog_interval_ms(void)
+{
+	if (!systemd_notify_enabled())
+	{
+		return 0;
+	}
+
+	return (int) (watchdogIntervalUs / 1000);
+}
+
+
+/*
+ * systemd_notify sends the given state to systemd, such as "READY=1". When
+ * we are not running under systemd, there is nothing to do, and we return
+ * true.
+ */
+bool
+systemd_notify(const char *state)
+{
+	struct sockaddr_un address = { 0 };
+	size_t pathLength = strlen(notifySocketPath);
+	size_t stateLength = strlen(state);
+
+	if (!systemd_notify_enabled())
+	{
+		return true;
+	}
+
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, notifySocketPath, pathLength);
+
+	/* a leading @ means a socket in the Linux abstract namespace */
+	if (address.sun_path[0] == '@')
+	{
+		address.sun_path[0] = '\0';
+	}
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+	{
+		log_warn("Failed to create the systemd notification socket: %m");
+		return false;
+	}
+
+	ssize_t sent =
+		sendto(fd, state, stateLength, MSG_NOSIGNAL,
+			   (struct sockaddr *) &address,
+			   offsetof(struct sockaddr_un, sun_path) + pathLength);
+
+	if (sent < 0 || (size_t) sent != stateLength)
+	{
+		log_warn("Failed to send \"%s\" to systemd socket \"%s\": %m",
+				 state, notifySocketPath);
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	log_trace("systemd_notify: %s", state);
+
+	return true;
+}
+
+
+/*
+ * systemd_notify_watchdog sends WATCHDOG=1 to systemd when half of the
+ * watchdog interval has passed since the previous one, as the systemd
+ * documentation recommends.
+ */
+void
+systemd_notify_watchdog(void)
+{
+	uint64_t now = systemd_monotonic_us();
+
+	if (!systemd_notify_enabled() || watchdogIntervalUs == 0)
+	{
+		return;
+	}
+
+	if (watchdogLastPingUs > 0 && now - watchdogLastPingUs < watchdogIntervalUs / 2)
+	{
+		return;
+	}
+
+	if (systemd_notify("WATCHDOG=1"))
+	{
+		watchdogLastPingUs = now;
+	}
+}
+
+
+/*
+ * systemd_monotonic_us returns the current time of the monotonic clock, in
+ * microseconds.
+ */
+static uint64_t
+systemd_monotonic_us(void)
+{
+	struct timespec now = { 0 };
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
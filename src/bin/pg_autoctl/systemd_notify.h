@@ -0,0 +1,22 @@
+/*
+ * src/bin/pg_autoctl/systemd_notify.h
+ *     Implementation of the systemd notification protocol
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ */
+
+#ifndef SYSTEMD_NOTIFY_H
+#define SYSTEMD_NOTIFY_H
+
+#include <stdbool.h>
+
+void systemd_notify_init(void);
+bool systemd_notify_enabled(void);
+int systemd_watchdog_interval_ms(void);
+
+bool systemd_notify(const char *state);
+void systemd_notify_watchdog(void);
+
+#endif /* SYSTEMD_NOTIFY_H */
@@ -0,0 +1,356 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/discovery_cache.c
+ *
+ * Implementation of a backend-local cache of the service discovery answers.
+ *
+ * Applications and service discovery layers call formation_uri() and
+ * get_primary() very often, and the answer only changes when a node is
+ * added or removed, changes state, or changes how to connect to it. Each
+ * backend keeps the answers it computed in this cache, tagged with the
+ * topology generation of the node cache, and forgets about all of them as
+ * soon as a commit changed the topology. See node_cache.c.
+ *
+ * When the node cache is disabled, or when the current transaction has
+ * pending changes to the node table, the topology generation is zero and
+ * nothing is served from or added to this cache.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "discovery_cache.h"
+#include "node_cache.h"
+#include "node_metadata.h"
+
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+
+typedef struct FormationURIKey
+{
+	char formationId[NAMEDATALEN];
+	char clusterName[NAMEDATALEN];
+	char sslMode[NAMEDATALEN];
+} FormationURIKey;
+
+typedef struct FormationURIEntry
+{
+	FormationURIKey key;
+	char *sslRootCert;
+	char *sslCrl;
+	char *uri;                  /* NULL when formation_uri() returns NULL */
+} FormationURIEntry;
+
+typedef struct PrimaryKey
+{
+	char formationId[NAMEDATALEN];
+	int groupId;
+} PrimaryKey;
+
+typedef struct PrimaryEntry
+{
+	PrimaryKey key;
+	int64 nodeId;
+	char nodeName[NODE_CACHE_HOST_LEN];
+	char nodeHost[NODE_CACHE_HOST_LEN];
+	int nodePort;
+} PrimaryEntry;
+
+
+static MemoryContext DiscoveryCacheContext = NULL;
+static HTAB *FormationURIHash = NULL;
+static HTAB *PrimaryHash = NULL;
+static uint64 DiscoveryCacheGeneration = 0;
+
+
+static bool DiscoveryCacheIsCurrent(void);
+static bool DiscoveryCachePrepare(uint64 generation);
+static bool BuildFormationURIKey(FormationURIKey *key,
+								 const char *formationId,
+								 const char *clusterName,
+								 const char *sslMode);
+static bool BuildPrimaryKey(PrimaryKey *key,
+							const char *formationId, int groupId);
+
+
+/*
+ * DiscoveryCacheLookupFormationURI returns true when the answer to
+ * formation_uri() for the given arguments is in the cache, and then sets
+ * uri to a copy of it, which might be NULL.
+ */
+bool
+DiscoveryCacheLookupFormationURI(const char *formationId,
+								 const char *clusterName,
+								 const char *sslMode,
+								 const char *sslRootCert,
+								 const char *sslCrl,
+								 char **uri)
+{
+	FormationURIKey key;
+	FormationURIEntry *entry = NULL;
+
+	if (!DiscoveryCacheIsCurrent() ||
+		!BuildFormationURIKey(&key, formationId, clusterName, sslMode))
+	{
+		return false;
+	}
+
+	entry = (FormationURIEntry *) hash_search(FormationURIHash, &key,
+											  HASH_FIND, NULL);
+
+	if (entry == NULL ||
+		strcmp(entry->sslRootCert, sslRootCert) != 0 ||
+		strcmp(entry->sslCrl, sslCrl) != 0)
+	{
+		return false;
+	}
+
+	*uri = entry->uri == NULL ? NULL : pstrdup(entry->uri);
+
+	return true;
+}
+
+
+/*
+ * DiscoveryCacheStoreFormationURI adds the answer to formation_uri() for the
+ * given arguments to the cache, when it was computed at a known topology
+ * generation.
+ */
+void
+DiscoveryCacheStoreFormationURI(const char *formationId,
+								const char *clusterName,
+								const char *sslMode,
+								const char *sslRootCert,
+								const char *sslCrl,
+								const char *uri,
+								uint64 generation)
+{
+	FormationURIKey key;
+	FormationURIEntry *entry = NULL;
+	bool found = false;
+
+	if (!BuildFormationURIKey(&key, formationId, clusterName, sslMode) ||
+		!DiscoveryCachePrepare(generation))
+	{
+		return;
+	}
+
+	entry = (FormationURIEntry *) hash_search(FormationURIHash, &key,
+											  HASH_ENTER, &found);
+
+	if (found)
+	{
+		pfree(entry->sslRootCert);
+		pfree(entry->sslCrl);
+
+		if (entry->uri != NULL)
+		{
+			pfree(entry->uri);
+		}
+	}
+
+	entry->sslRootCert = MemoryContextStrdup(DiscoveryCacheContext, sslRootCert);
+	entry->sslCrl = MemoryContextStrdup(DiscoveryCacheContext, sslCrl);
+	entry->uri =
+		uri == NULL ? NULL : MemoryContextStrdup(DiscoveryCacheContext, uri);
+}
+
+
+/*
+ * DiscoveryCacheLookupPrimary returns true when the primary node of the
+ * given group is in the cache, and then sets node to a newly allocated
+ * AutoFailoverNode where only the fields returned by get_primary() are set.
+ */
+bool
+DiscoveryCacheLookupPrimary(const char *formationId, int groupId,
+							AutoFailoverNode **node)
+{
+	PrimaryKey key;
+	PrimaryEntry *entry = NULL;
+	AutoFailoverNode *primaryNode = NULL;
+
+	if (!DiscoveryCacheIsCurrent() ||
+		!BuildPrimaryKey(&key, formationId, groupId))
+	{
+		return false;
+	}
+
+	entry = (PrimaryEntry *) hash_search(PrimaryHash, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		return false;
+	}
+
+	primaryNode = (AutoFailoverNode *) palloc0(sizeof(AutoFailoverNode));
+
+	primaryNode->formationId = pstrdup(formationId);
+	primaryNode->groupId = groupId;
+	primaryNode->nodeId = entry->nodeId;
+	primaryNode->nodeName = pstrdup(entry->nodeName);
+	primaryNode->nodeHost = pstrdup(entry->nodeHost);
+	primaryNode->nodePort = entry->nodePort;
+
+	*node = primaryNode;
+
+	return true;
+}
+
+
+/*
+ * DiscoveryCacheStorePrimary adds the primary node of the given group to the
+ * cache, when it was found at a known topology generation. Node names and
+ * hosts that don't fit in the cache entry are not cached.
+ */
+void
+DiscoveryCacheStorePrimary(const char *formationId, int groupId,
+						   AutoFailoverNode *node, uint64 generation)
+{
+	PrimaryKey key;
+	PrimaryEntry *entry = NULL;
+
+	if (!BuildPrimaryKey(&key, formationId, groupId) ||
+		strlen(node->nodeName) >= NODE_CACHE_HOST_LEN ||
+		strlen(node->nodeHost) >= NODE_CACHE_HOST_LEN ||
+		!DiscoveryCachePrepare(generation))
+	{
+		return;
+	}
+
+	entry = (PrimaryEntry *) hash_search(PrimaryHash, &key, HASH_ENTER, NULL);
+
+	entry->nodeId = node->nodeId;
+	strlcpy(entry->nodeName, node->nodeName, NODE_CACHE_HOST_LEN);
+	strlcpy(entry->nodeHost, node->nodeHost, NODE_CACHE_HOST_LEN);
+	entry->nodePort = node->nodePort;
+}
+
+
+/*
+ * DiscoveryCacheIsCurrent returns true when the cached answers were computed
+ * at the current topology generation.
+ */
+static bool
+DiscoveryCacheIsCurrent(void)
+{
+	uint64 generation = 0;
+
+	if (DiscoveryCacheContext == NULL)
+	{
+		return false;
+	}
+
+	generation = NodeCacheGetTopologyGeneration();
+
+	return generation != 0 && generation == DiscoveryCacheGeneration;
+}
+
+
+/*
+ * DiscoveryCachePrepare makes sure the cache is ready to receive an answer
+ * computed at the given topology generation, forgetting about the answers
+ * computed at another generation, or about all of them when the cache is
+ * full. It returns false when the answer should not be cached.
+ */
+static bool
+DiscoveryCachePrepare(uint64 generation)
+{
+	HASHCTL info;
+
+	if (generation == 0)
+	{
+		return false;
+	}
+
+	if (DiscoveryCacheContext == NULL)
+	{
+		DiscoveryCacheContext =
+			AllocSetContextCreate(TopMemoryContext,
+								  "pg_auto_failover discovery cache",
+								  ALLOCSET_DEFAULT_MINSIZE,
+								  ALLOCSET_DEFAULT_INITSIZE,
+								  ALLOCSET_DEFAULT_MAXSIZE);
+	}
+	else if (generation == DiscoveryCacheGeneration &&
+			 hash_get_num_entries(FormationURIHash) +
+			 hash_get_num_entries(PrimaryHash) < DISCOVERY_CACHE_MAX_ENTRIES)
+	{
+		return true;
+	}
+
+	/* the hash tables live in the context, resetting it destroys them */
+	MemoryContextReset(DiscoveryCacheContext);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(FormationURIKey);
+	info.entrysize = sizeof(FormationURIEntry);
+	info.hash = tag_hash;
+	info.hcxt = DiscoveryCacheContext;
+
+	FormationURIHash = hash_create("pg_auto_failover formation uri cache",
+								   32, &info,
+								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(PrimaryKey);
+	info.entrysize = sizeof(PrimaryEntry);
+	info.hash = tag_hash;
+	info.hcxt = DiscoveryCacheContext;
+
+	PrimaryHash = hash_create("pg_auto_failover primary cache",
+							  32, &info,
+							  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	DiscoveryCacheGeneration = generation;
+
+	return true;
+}
+
+
+/*
+ * BuildFormationURIKey fills in the hash key for the given formation_uri()
+ * arguments, and returns false when they don't fit in the key.
+ */
+static bool
+BuildFormationURIKey(FormationURIKey *key,
+					 const char *formationId,
+					 const char *clusterName,
+					 const char *sslMode)
+{
+	/* the key is hashed as a whole, padding included */
+	memset(key, 0, sizeof(FormationURIKey));
+
+	if (strlcpy(key->formationId, formationId, NAMEDATALEN) >= NAMEDATALEN ||
+		strlcpy(key->clusterName, clusterName, NAMEDATALEN) >= NAMEDATALEN ||
+		strlcpy(key->sslMode, sslMode, NAMEDATALEN) >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * BuildPrimaryKey fills in the hash key for the given group, and returns
+ * false when the formation name doesn't fit in the key.
+ */
+static bool
+BuildPrimaryKey(PrimaryKey *key, const char *formationId, int groupId)
+{
+	memset(key, 0, sizeof(PrimaryKey));
+
+	if (strlcpy(key->formationId, formationId, NAMEDATALEN) >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	key->groupId = groupId;
+
+	return true;
+}
@@ -0,0 +1,43 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/discovery_cache.h
+ *
+ * Declarations for the backend-local cache of the service discovery
+ * answers.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "node_metadata.h"
+
+
+/* we forget about every answer before caching more than that */
+#define DISCOVERY_CACHE_MAX_ENTRIES 1024
+
+
+extern bool DiscoveryCacheLookupFormationURI(const char *formationId,
+											 const char *clusterName,
+											 const char *sslMode,
+											 const char *sslRootCert,
+											 const char *sslCrl,
+											 char **uri);
+extern void DiscoveryCacheStoreFormationURI(const char *formationId,
+											const char *clusterName,
+											const char *sslMode,
+											const char *sslRootCert,
+											const char *sslCrl,
+											const char *uri,
+											uint64 generation);
+
+extern bool DiscoveryCacheLookupPrimary(const char *formationId, int groupId,
+										AutoFailoverNode **node);
+extern void DiscoveryCacheStorePrimary(const char *formationId, int groupId,
+									   AutoFailoverNode *node,
+									   uint64 generation);
@@ -0,0 +1,276 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/event_queue.c
+ *
+ * Implementation of a shared memory queue of events, that the group state
+ * scheduler inserts in the pgautofailover.event table in batches.
+ *
+ * Inserting the events of a state change in the transaction that decides it
+ * adds the index maintenance and WAL of the event table to node_active and
+ * to the failover APIs. When pgautofailover.event_queue_size is set, those
+ * transactions instead copy their events into a ring buffer in shared
+ * memory right before they commit, along with their transaction id. The
+ * group state scheduler of the database then inserts the events of the
+ * transactions that have committed, and skips those of the transactions
+ * that aborted.
+ *
+ * The queue is shared by all the databases of the instance, and consumed in
+ * order: events from another database wait at the head of the queue until
+ * the scheduler of their own database inserts them.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "miscadmin.h"
+
+#include "event_queue.h"
+#include "health_check.h"
+#include "node_metadata.h"
+
+#include "access/xact.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+
+typedef struct EventQueueControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* the queue holds the entries from head to tail, modulo its size */
+	uint64 head;
+	uint64 tail;
+
+	EventQueueEntry entries[FLEXIBLE_ARRAY_MEMBER];
+} EventQueueControlData;
+
+
+/* GUC variable: how many events the queue can hold, 0 disables it */
+int EventQueueSize = 0;
+
+static EventQueueControlData *EventQueueControl = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static size_t EventQueueShmemSize(void);
+static void EventQueueShmemInit(void);
+
+
+/*
+ * InitializeEventQueue, called at server start, requests the shared memory
+ * needed for the event queue.
+ */
+void
+InitializeEventQueue(void)
+{
+	if (EventQueueSize <= 0)
+	{
+		return;
+	}
+
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(EventQueueShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = EventQueueShmemInit;
+}
+
+
+/*
+ * EventQueueShmemSize computes how much shared memory is required.
+ */
+static size_t
+EventQueueShmemSize(void)
+{
+	return add_size(offsetof(EventQueueControlData, entries),
+					mul_size(EventQueueSize, sizeof(EventQueueEntry)));
+}
+
+
+/*
+ * EventQueueShmemInit initializes the requested shared memory for the event
+ * queue.
+ */
+static void
+EventQueueShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	EventQueueControl =
+		(EventQueueControlData *) ShmemInitStruct("pg_auto_failover Event Queue",
+												  EventQueueShmemSize(),
+												  &alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		EventQueueControl->trancheId = LWLockNewTrancheId();
+		EventQueueControl->lockTrancheName = "pg_auto_failover Event Queue";
+		LWLockRegisterTranche(EventQueueControl->trancheId,
+							  EventQueueControl->lockTrancheName);
+
+		LWLockInitialize(&EventQueueControl->lock,
+						 EventQueueControl->trancheId);
+
+		EventQueueControl->head = 0;
+		EventQueueControl->tail = 0;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * EventQueueEnabled returns true when events may be queued.
+ */
+bool
+EventQueueEnabled(void)
+{
+	return EventQueueControl != NULL;
+}
+
+
+/*
+ * EnqueueEvent copies the given event into the queue, to be inserted once
+ * the current transaction has committed. It returns false when the event
+ * could not be queued, and must then be inserted by the caller.
+ */
+bool
+EnqueueEvent(AutoFailoverNode *node, const char *description,
+			 TimestampTz eventTime)
+{
+	TransactionId xid = GetTopTransactionIdIfAny();
+
+	if (!EventQueueEnabled() || !TransactionIdIsValid(xid))
+	{
+		return false;
+	}
+
+	if (strlen(node->formationId) >= EVENT_QUEUE_NAME_LEN ||
+		strlen(node->nodeName) >= EVENT_QUEUE_HOST_LEN ||
+		strlen(node->nodeHost) >= EVENT_QUEUE_HOST_LEN ||
+		strlen(description) >= EVENT_QUEUE_DESCRIPTION_LEN)
+	{
+		return false;
+	}
+
+	LWLockAcquire(&EventQueueControl->lock, LW_EXCLUSIVE);
+
+	uint64 queued = EventQueueControl->tail - EventQueueControl->head;
+
+	if (queued >= (uint64) EventQueueSize)
+	{
+		LWLockRelease(&EventQueueControl->lock);
+		return false;
+	}
+
+	EventQueueEntry *entry =
+		&(EventQueueControl->entries[EventQueueControl->tail % EventQueueSize]);
+
+	entry->databaseId = MyDatabaseId;
+	entry->xid = xid;
+	entry->eventTime = eventTime;
+
+	entry->nodeId = node->nodeId;
+	entry->groupId = node->groupId;
+	entry->nodePort = node->nodePort;
+	entry->goalState = node->goalState;
+	entry->reportedState = node->reportedState;
+	entry->pgsrSyncState = node->pgsrSyncState;
+	entry->reportedLSN = node->reportedLSN;
+	entry->candidatePriority = node->candidatePriority;
+	entry->replicationQuorum = node->replicationQuorum;
+
+	strlcpy(entry->formationId, node->formationId, EVENT_QUEUE_NAME_LEN);
+	strlcpy(entry->nodeName, node->nodeName, EVENT_QUEUE_HOST_LEN);
+	strlcpy(entry->nodeHost, node->nodeHost, EVENT_QUEUE_HOST_LEN);
+	strlcpy(entry->description, description, EVENT_QUEUE_DESCRIPTION_LEN);
+
+	EventQueueControl->tail++;
+
+	LWLockRelease(&EventQueueControl->lock);
+
+	/* don't wait for the next period when the queue is filling up */
+	if (queued + 1 >= (uint64) EventQueueSize / 2)
+	{
+		WakeGroupStateScheduler(MyDatabaseId);
+	}
+
+	return true;
+}
+
+
+/*
+ * EventQueuePeek copies at most maxCount entries from the head of the queue
+ * into the given array, stopping at the first entry of another database, and
+ * returns how many entries it copied. The entries are kept in the queue.
+ */
+int
+EventQueuePeek(EventQueueEntry *entries, int maxCount)
+{
+	int count = 0;
+
+	if (!EventQueueEnabled())
+	{
+		return 0;
+	}
+
+	LWLockAcquire(&EventQueueControl->lock, LW_SHARED);
+
+	for (uint64 position = EventQueueControl->head;
+		 position < EventQueueControl->tail && count < maxCount;
+		 position++)
+	{
+		EventQueueEntry *entry =
+			&(EventQueueControl->entries[position % EventQueueSize]);
+
+		if (entry->databaseId != MyDatabaseId)
+		{
+			break;
+		}
+
+		entries[count++] = *entry;
+	}
+
+	LWLockRelease(&EventQueueControl->lock);
+
+	return count;
+}
+
+
+/*
+ * EventQueueRemove removes the given number of entries from the head of the
+ * queue, after they have been returned by EventQueuePeek. The scheduler of a
+ * database is the only process that removes the entries of that database.
+ */
+void
+EventQueueRemove(int count)
+{
+	if (!EventQueueEnabled() || count <= 0)
+	{
+		return;
+	}
+
+	LWLockAcquire(&EventQueueControl->lock, LW_EXCLUSIVE);
+
+	Assert(EventQueueControl->head + count <= EventQueueControl->tail);
+
+	EventQueueControl->head += count;
+
+	LWLockRelease(&EventQueueControl->lock);
+}
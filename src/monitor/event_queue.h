@@ -0,0 +1,69 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/event_queue.h
+ *
+ * Declarations for the shared memory queue of events that are inserted in
+ * the pgautofailover.event table by a background worker.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+#include "node_metadata.h"
+
+
+/*
+ * The queue entries are stored in shared memory, so strings have to fit in
+ * fixed-size buffers. Events with longer strings are simply not queued, and
+ * inserted in the event table by the transaction that produced them.
+ */
+#define EVENT_QUEUE_NAME_LEN NAMEDATALEN
+#define EVENT_QUEUE_HOST_LEN 256
+#define EVENT_QUEUE_DESCRIPTION_LEN 1024
+
+/*
+ * EventQueueEntry is an event produced by the transaction xid, to be inserted
+ * in the event table of the database databaseId once that transaction has
+ * committed.
+ */
+typedef struct EventQueueEntry
+{
+	Oid databaseId;
+	TransactionId xid;
+	TimestampTz eventTime;
+
+	int64 nodeId;
+	int groupId;
+	int nodePort;
+	ReplicationState goalState;
+	ReplicationState reportedState;
+	SyncState pgsrSyncState;
+	XLogRecPtr reportedLSN;
+	int candidatePriority;
+	bool replicationQuorum;
+
+	char formationId[EVENT_QUEUE_NAME_LEN];
+	char nodeName[EVENT_QUEUE_HOST_LEN];
+	char nodeHost[EVENT_QUEUE_HOST_LEN];
+	char description[EVENT_QUEUE_DESCRIPTION_LEN];
+} EventQueueEntry;
+
+
+/* GUC variable: how many events the queue can hold, 0 disables it */
+extern int EventQueueSize;
+
+
+extern void InitializeEventQueue(void);
+extern bool EventQueueEnabled(void);
+extern bool EnqueueEvent(AutoFailoverNode *node, const char *description,
+						 TimestampTz eventTime);
+extern int EventQueuePeek(EventQueueEntry *entries, int maxCount);
+extern void EventQueueRemove(int count);
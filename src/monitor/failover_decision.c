@@ -0,0 +1,260 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_decision.c
+ *
+ * Implementation of the failover decisions of the group state machine that
+ * only depend on the reports of the nodes.
+ *
+ * ProceedGroupStateForMSFailover() tallies the LSN reports and the health of
+ * the standby nodes from the pgautofailover.node table, and then asks the
+ * functions here whether a failover candidate can be elected, and which one.
+ * They don't use any backend facility, so that the simulator found in
+ * src/monitor/simulator can replay the same decisions in-memory.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "failover_decision.h"
+
+
+static bool FailoverCandidateIsReadyFirst(FailoverElection *election,
+										  FailoverCandidate *candidate,
+										  FailoverCandidate *selected);
+
+
+/*
+ * CheckFailoverElection returns FAILOVER_DECISION_SELECTED when the election
+ * of a failover candidate can proceed, or the reason why it can't yet.
+ *
+ * We must have collected the last received LSN from ALL the standby nodes
+ * that are considered as a candidate, and we require at least
+ * number_sync_standbys + 1 of those to participate in the replication quorum,
+ * otherwise we would end-up with a node in WAIT_PRIMARY state with all the
+ * writes blocked for lack of standby nodes.
+ */
+FailoverDecision
+CheckFailoverElection(FailoverElection *election)
+{
+	int minCandidates = election->numberSyncStandbys + 1;
+
+	if (election->missingNodesCount > 0)
+	{
+		return FAILOVER_DECISION_WAIT_REPORTS;
+	}
+
+	if (election->candidateCount == 0)
+	{
+		return FAILOVER_DECISION_NO_CANDIDATE;
+	}
+
+	if (election->quorumCandidateCount < minCandidates)
+	{
+		return FAILOVER_DECISION_NOT_ENOUGH_QUORUM;
+	}
+
+	return FAILOVER_DECISION_SELECTED;
+}
+
+
+/*
+ * SelectFailoverCandidate selects the candidate to failover to, and sets
+ * selectedIndex to its position in the election candidates array, or -1.
+ * With FAILOVER_DECISION_MISSING_WAL the selectedIndex is still set, so that
+ * the caller can tell which node would have been promoted.
+ *
+ * We refuse to orchestrate a failover that would have us lose more data than
+ * is configured on the monitor, see PromoteXlogThreshold.
+ * Then we pick the most advanced LSN among the healthy candidates having
+ * max(candidate priority). When the selected node has to fetch missing WAL
+ * from one of the most advanced standby nodes, one of them must be healthy.
+ *
+ * With a replayTimeThresholdMs, a candidate that is expected to be ready for
+ * promotion sooner than another one of the same priority by more than that is
+ * preferred, even when it received less WAL: all the WAL up to the most
+ * advanced LSN has to be replayed before promotion anyway, see
+ * FailoverCandidateReadyTimeMs().
+ */
+FailoverDecision
+SelectFailoverCandidate(FailoverElection *election, int *selectedIndex)
+{
+	FailoverCandidate *selected = NULL;
+
+	*selectedIndex = -1;
+
+	if (election->hasPrimary &&
+		!FailoverWalDifferenceWithin(election->mostAdvancedReportedLSN,
+									 election->primaryReportedLSN,
+									 election->promoteXlogThreshold))
+	{
+		return FAILOVER_DECISION_DATA_LOSS;
+	}
+
+	for (int index = 0; index < election->candidateCount; index++)
+	{
+		FailoverCandidate *candidate = &(election->candidates[index]);
+
+		/* candidatePriority == 0 means the node is never promoted */
+		if (candidate->candidatePriority <= 0 || candidate->isUnhealthy)
+		{
+			continue;
+		}
+
+		if (selected == NULL ||
+			candidate->candidatePriority > selected->candidatePriority ||
+			(candidate->candidatePriority == selected->candidatePriority &&
+			 FailoverCandidateIsReadyFirst(election, candidate, selected)))
+		{
+			selected = candidate;
+			*selectedIndex = index;
+		}
+	}
+
+	if (selected == NULL)
+	{
+		return FAILOVER_DECISION_NO_HEALTHY_CANDIDATE;
+	}
+
+	if (selected->reportedLSN < election->mostAdvancedReportedLSN &&
+		!election->someMostAdvancedNodesAreHealthy)
+	{
+		return FAILOVER_DECISION_MISSING_WAL;
+	}
+
+	return FAILOVER_DECISION_SELECTED;
+}
+
+
+/*
+ * FailoverCandidateReadyTimeMs returns how long, in milliseconds, we expect
+ * the given candidate to take before it can be promoted: the time to replay
+ * the WAL from its replayed LSN up to the most advanced reported LSN, at its
+ * apply rate. The time to fetch the missing WAL bytes, if any, is not taken
+ * into account. It returns -1 when the candidate didn't report its replay
+ * progress.
+ */
+int64
+FailoverCandidateReadyTimeMs(FailoverElection *election,
+							 FailoverCandidate *candidate)
+{
+	if (candidate->replayLSN == 0 || candidate->applyRate <= 0)
+	{
+		return -1;
+	}
+
+	if (candidate->replayLSN >= election->mostAdvancedReportedLSN)
+	{
+		return 0;
+	}
+
+	XLogRecPtr backlog = election->mostAdvancedReportedLSN - candidate->replayLSN;
+
+	return (int64) ((backlog * 1000) / (uint64_t) candidate->applyRate);
+}
+
+
+/*
+ * FailoverCandidateIsReadyFirst returns true when the given candidate should
+ * be preferred over the selected one, both having the same priority: either
+ * because it is expected to be ready sooner by more than the
+ * replayTimeThresholdMs, or because it has the most advanced reported LSN.
+ */
+static bool
+FailoverCandidateIsReadyFirst(FailoverElection *election,
+							  FailoverCandidate *candidate,
+							  FailoverCandidate *selected)
+{
+	if (election->replayTimeThresholdMs > 0)
+	{
+		int64 candidateReadyMs =
+			FailoverCandidateReadyTimeMs(election, candidate);
+		int64 selectedReadyMs =
+			FailoverCandidateReadyTimeMs(election, selected);
+
+		if (candidateReadyMs >= 0 && selectedReadyMs >= 0)
+		{
+			if (candidateReadyMs + election->replayTimeThresholdMs <
+				selectedReadyMs)
+			{
+				return true;
+			}
+
+			if (selectedReadyMs + election->replayTimeThresholdMs <
+				candidateReadyMs)
+			{
+				return false;
+			}
+		}
+	}
+
+	return candidate->reportedLSN > selected->reportedLSN;
+}
+
+
+/*
+ * FailoverWalDifferenceWithin returns whether the given LSNs are within delta
+ * bytes of each other. When we don't have any data yet, it returns false.
+ */
+bool
+FailoverWalDifferenceWithin(XLogRecPtr lsn, XLogRecPtr otherLSN, int64 delta)
+{
+	if (lsn == 0 || otherLSN == 0)
+	{
+		return false;
+	}
+
+	int64 walDifference =
+		lsn > otherLSN ? (int64) (lsn - otherLSN) : (int64) (otherLSN - lsn);
+
+	return walDifference <= delta;
+}
+
+
+/*
+ * FailoverDecisionToString returns a string representation of the decision.
+ */
+const char *
+FailoverDecisionToString(FailoverDecision decision)
+{
+	switch (decision)
+	{
+		case FAILOVER_DECISION_SELECTED:
+		{
+			return "selected";
+		}
+
+		case FAILOVER_DECISION_WAIT_REPORTS:
+		{
+			return "wait for reports";
+		}
+
+		case FAILOVER_DECISION_NO_CANDIDATE:
+		{
+			return "no candidate";
+		}
+
+		case FAILOVER_DECISION_NOT_ENOUGH_QUORUM:
+		{
+			return "not enough quorum candidates";
+		}
+
+		case FAILOVER_DECISION_DATA_LOSS:
+		{
+			return "data loss";
+		}
+
+		case FAILOVER_DECISION_NO_HEALTHY_CANDIDATE:
+		{
+			return "no healthy candidate";
+		}
+
+		case FAILOVER_DECISION_MISSING_WAL:
+		{
+			return "missing WAL";
+		}
+	}
+
+	return "unknown";
+}
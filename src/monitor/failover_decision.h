@@ -0,0 +1,107 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_decision.h
+ *
+ * Declarations for the failover decisions of the group state machine that
+ * only depend on the reports of the nodes, and not on the backend.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+/*
+ * The simulator in src/monitor/simulator links this code outside of a
+ * Postgres backend, and then defines FAILOVER_SIMULATOR.
+ */
+#ifdef FAILOVER_SIMULATOR
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int64_t int64;
+typedef uint64_t XLogRecPtr;
+#else
+#include "postgres.h"
+
+#include "access/xlogdefs.h"
+#endif
+
+
+/*
+ * FailoverCandidate is what the failover decision needs to know about a
+ * standby node that has reported its LSN. The health of the node is
+ * evaluated by the caller, see IsHealthy() and IsUnhealthy().
+ *
+ * The replayed LSN and apply rate, in bytes per second, are zero when the
+ * keeper of the node hasn't reported them recently.
+ */
+typedef struct FailoverCandidate
+{
+	int64 nodeId;
+	int candidatePriority;
+	bool replicationQuorum;
+	bool isHealthy;
+	bool isUnhealthy;
+	XLogRecPtr reportedLSN;
+	XLogRecPtr replayLSN;
+	int64 applyRate;
+} FailoverCandidate;
+
+
+/*
+ * FailoverElection holds the state of the election of a failover candidate in
+ * a group, as tallied from the node reports when the primary has failed.
+ */
+typedef struct FailoverElection
+{
+	/* standby nodes in REPORT_LSN, in no particular order */
+	FailoverCandidate *candidates;
+	int candidateCount;
+
+	/* reports counted in BuildCandidateList() */
+	int quorumCandidateCount;
+	int missingNodesCount;
+	int numberSyncStandbys;
+
+	/* the most advanced standby nodes of the group */
+	XLogRecPtr mostAdvancedReportedLSN;
+	bool someMostAdvancedNodesAreHealthy;
+
+	/* the failed primary, when there's one */
+	bool hasPrimary;
+	XLogRecPtr primaryReportedLSN;
+	int64 promoteXlogThreshold;
+
+	/* rank by time to be ready when it differs by more, 0 disables it */
+	int64 replayTimeThresholdMs;
+} FailoverElection;
+
+
+/*
+ * FailoverDecision is the outcome of a round of the election: either a node
+ * has been selected, or the reason why we have to wait for the next round.
+ */
+typedef enum FailoverDecision
+{
+	FAILOVER_DECISION_SELECTED = 0,
+	FAILOVER_DECISION_WAIT_REPORTS,
+	FAILOVER_DECISION_NO_CANDIDATE,
+	FAILOVER_DECISION_NOT_ENOUGH_QUORUM,
+	FAILOVER_DECISION_DATA_LOSS,
+	FAILOVER_DECISION_NO_HEALTHY_CANDIDATE,
+	FAILOVER_DECISION_MISSING_WAL
+} FailoverDecision;
+
+
+extern FailoverDecision CheckFailoverElection(FailoverElection *election);
+extern FailoverDecision SelectFailoverCandidate(FailoverElection *election,
+												int *selectedIndex);
+extern int64 FailoverCandidateReadyTimeMs(FailoverElection *election,
+										  FailoverCandidate *candidate);
+extern bool FailoverWalDifferenceWithin(XLogRecPtr lsn, XLogRecPtr otherLSN,
+										int64 delta);
+extern const char * FailoverDecisionToString(FailoverDecision decision);
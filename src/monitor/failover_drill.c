@@ -0,0 +1,425 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_drill.c
+ *
+ * Implementation of the failover drills.
+ *
+ * A formation opts in to failover drills with
+ * pgautofailover.set_failover_drill(), which registers a daily time window
+ * and how often to run a drill. The first health check worker of the
+ * database then runs a switchover, the same as
+ * pgautofailover.perform_failover(), in one group of the formation at a time
+ * when a drill is due and the time of day is within the window.
+ *
+ * Each drill is recorded in the pgautofailover.failover_drill_history table,
+ * with the time it took for the keeper of the primary node to act on the
+ * switchover (detection), for another node to be writable (promotion), and
+ * for the former primary node to be a secondary again (rejoin). Benchmark
+ * clients report the outages they saw, and the longest one during the drill
+ * is its application-visible unavailability. The history keeps the version of
+ * the monitor, so that recovery time regressions across upgrades and
+ * infrastructure changes can be caught.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "failover_drill.h"
+#include "failover_trace.h"
+#include "metadata.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "nodes/pg_list.h"
+#include "pgstat.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+
+
+/* a group of a formation where a drill is due */
+typedef struct FailoverDrillTarget
+{
+	char *formationId;
+	int groupId;
+} FailoverDrillTarget;
+
+
+/* GUC variables */
+int FailoverDrillTimeoutMs = 10 * 60 * 1000;
+
+
+extern Datum perform_failover(PG_FUNCTION_ARGS);
+
+static bool FailoverDrillTablesExist(void);
+static void UpdateRunningFailoverDrills(void);
+static List * GetDueFailoverDrills(void);
+static void StartFailoverDrill(FailoverDrillTarget *target);
+static void InsertFailoverDrill(FailoverDrillTarget *target,
+								AutoFailoverNode *primaryNode,
+								char *traceId,
+								char *errorMessage);
+
+
+/*
+ * RunFailoverDrills updates the drills in progress, and then starts the
+ * drills that are due.
+ *
+ * This function runs its own transaction, and is meant to be called from the
+ * health check background worker.
+ */
+void
+RunFailoverDrills(void)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	if (!RecoveryInProgress() && FailoverDrillTablesExist())
+	{
+		ListCell *targetCell = NULL;
+
+		UpdateRunningFailoverDrills();
+
+		List *targetList = GetDueFailoverDrills();
+
+		foreach(targetCell, targetList)
+		{
+			StartFailoverDrill((FailoverDrillTarget *) lfirst(targetCell));
+		}
+	}
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+
+/*
+ * FailoverDrillTablesExist returns false while the extension has not been
+ * updated to a version that has the failover drill tables.
+ */
+static bool
+FailoverDrillTablesExist(void)
+{
+	Oid namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+
+	return OidIsValid(namespaceId) &&
+		   OidIsValid(get_relname_relid("failover_drill", namespaceId)) &&
+		   OidIsValid(get_relname_relid("failover_drill_history", namespaceId));
+}
+
+
+/*
+ * UpdateRunningFailoverDrills computes the durations of the steps of the
+ * drills in progress from the events of their group, and completes the
+ * drills where the former primary node is a secondary again. Drills that
+ * take longer than pgautofailover.failover_drill_timeout are failed.
+ */
+static void
+UpdateRunningFailoverDrills(void)
+{
+	Oid argTypes[] = {
+		INT4OID                     /* timeout in milliseconds */
+	};
+
+	Datum argValues[] = {
+		Int32GetDatum(FailoverDrillTimeoutMs)   /* timeout */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *updateQuery =
+		"WITH progress AS ("
+		"  SELECT h.drillid,"
+		"         (SELECT min(e.eventtime) FROM " AUTO_FAILOVER_EVENT_TABLE " e"
+		"           WHERE e.formationid = h.formationid"
+		"             AND e.groupid = h.groupid"
+		"             AND e.nodeid = h.primarynodeid"
+		"             AND e.eventtime >= h.starttime"
+		"             AND e.reportedstate IN "
+		"                 ('draining', 'demote_timeout', 'demoted')"
+		"         ) - h.starttime AS detection,"
+		"         (SELECT min(e.eventtime) FROM " AUTO_FAILOVER_EVENT_TABLE " e"
+		"           WHERE e.formationid = h.formationid"
+		"             AND e.groupid = h.groupid"
+		"             AND e.nodeid <> h.primarynodeid"
+		"             AND e.eventtime >= h.starttime"
+		"             AND e.reportedstate IN ('wait_primary', 'primary')"
+		"         ) - h.starttime AS promotion,"
+		"         (SELECT min(e.eventtime) FROM " AUTO_FAILOVER_EVENT_TABLE " e"
+		"           WHERE e.formationid = h.formationid"
+		"             AND e.groupid = h.groupid"
+		"             AND e.nodeid = h.primarynodeid"
+		"             AND e.eventtime >= h.starttime"
+		"             AND e.reportedstate = 'secondary'"
+		"             AND e.goalstate = 'secondary'"
+		"         ) - h.starttime AS rejoin,"
+		"         now() - h.starttime > $1 * interval '1 ms' AS timedout"
+		"    FROM " AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE " h"
+		"   WHERE h.status = 'running'"
+		") "
+		"UPDATE " AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE " h"
+		"   SET detection = p.detection,"
+		"       promotion = p.promotion,"
+		"       rejoin = p.rejoin,"
+		"       status = CASE WHEN p.rejoin IS NOT NULL THEN 'completed'"
+		"                     WHEN p.timedout THEN 'failed'"
+		"                     ELSE 'running' END,"
+		"       endtime = CASE WHEN p.rejoin IS NOT NULL"
+		"                      THEN h.starttime + p.rejoin"
+		"                      WHEN p.timedout THEN now() END,"
+		"       message = CASE WHEN p.rejoin IS NULL AND p.timedout"
+		"                      THEN 'timed out' END"
+		"  FROM progress p"
+		" WHERE p.drillid = h.drillid";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(updateQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update "
+			 AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE);
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * GetDueFailoverDrills returns the formations where a drill is due: the time
+ * of day is within their window, no drill is in progress, and the last drill
+ * is older than their interval. For each of them we drill the group with at
+ * least two nodes that has gone the longest without a drill.
+ */
+static List *
+GetDueFailoverDrills(void)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	List *targetList = NIL;
+
+	const char *selectQuery =
+		"SELECT d.formationid, g.groupid"
+		"  FROM " AUTO_FAILOVER_FAILOVER_DRILL_TABLE " d"
+		"  CROSS JOIN LATERAL ("
+		"    SELECT n.groupid"
+		"      FROM " AUTO_FAILOVER_NODE_TABLE " n"
+		"     WHERE n.formationid = d.formationid"
+		"  GROUP BY n.groupid"
+		"    HAVING count(*) >= 2"
+		"  ORDER BY (SELECT max(h.starttime)"
+		"              FROM " AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE " h"
+		"             WHERE h.formationid = d.formationid"
+		"               AND h.groupid = n.groupid) NULLS FIRST,"
+		"           n.groupid"
+		"     LIMIT 1"
+		"  ) AS g"
+		" WHERE CASE WHEN d.window_start <= d.window_end"
+		"            THEN localtime BETWEEN d.window_start AND d.window_end"
+		"            ELSE localtime >= d.window_start"
+		"              OR localtime <= d.window_end"
+		"        END"
+		"   AND NOT EXISTS ("
+		"       SELECT 1 FROM " AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE " h"
+		"        WHERE h.formationid = d.formationid"
+		"          AND (h.status = 'running'"
+		"               OR h.starttime > now() - d.drill_interval))"
+		" ORDER BY d.formationid";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute(selectQuery, true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from "
+			 AUTO_FAILOVER_FAILOVER_DRILL_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+		bool isNull = false;
+
+		Datum formationIdDatum = heap_getattr(heapTuple, 1, tupleDesc, &isNull);
+		Datum groupIdDatum = heap_getattr(heapTuple, 2, tupleDesc, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+		FailoverDrillTarget *target = palloc0(sizeof(FailoverDrillTarget));
+
+		target->formationId = TextDatumGetCString(formationIdDatum);
+		target->groupId = DatumGetInt32(groupIdDatum);
+
+		targetList = lappend(targetList, target);
+
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	return targetList;
+}
+
+
+/*
+ * StartFailoverDrill starts a switchover in the given group, the same as
+ * pgautofailover.perform_failover(), and records the drill in the history.
+ * When the switchover can't be started, such as when no standby node is a
+ * candidate, the drill is recorded as failed with the error message.
+ */
+static void
+StartFailoverDrill(FailoverDrillTarget *target)
+{
+	MemoryContext oldContext = CurrentMemoryContext;
+	ResourceOwner oldOwner = CurrentResourceOwner;
+	char *traceId = NULL;
+	char *errorMessage = NULL;
+
+	AutoFailoverNode *primaryNode =
+		GetPrimaryNodeInGroup(target->formationId, target->groupId);
+
+	if (primaryNode == NULL ||
+		!IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
+	{
+		InsertFailoverDrill(target, primaryNode, NULL,
+							"the group has no primary node in a stable state");
+		return;
+	}
+
+	BeginInternalSubTransaction(NULL);
+
+	PG_TRY();
+	{
+		/* perform_failover then keeps our trace, with the drill kind */
+		StartFailoverTrace(primaryNode, FAILOVER_TRACE_KIND_DRILL);
+
+		DirectFunctionCall2(perform_failover,
+							CStringGetTextDatum(target->formationId),
+							Int32GetDatum(target->groupId));
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldContext);
+		CurrentResourceOwner = oldOwner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldContext);
+
+		ErrorData *edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldContext);
+		CurrentResourceOwner = oldOwner;
+
+		errorMessage = pstrdup(edata->message);
+
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	if (errorMessage == NULL)
+	{
+		traceId = GetFailoverTraceId(target->formationId, target->groupId);
+
+		ereport(LOG,
+				(errmsg("Started a failover drill in group %d of formation "
+						"\"%s\", trace %s",
+						target->groupId, target->formationId,
+						traceId == NULL ? "(none)" : traceId)));
+	}
+	else
+	{
+		ereport(WARNING,
+				(errmsg("couldn't start a failover drill in group %d of "
+						"formation \"%s\": %s",
+						target->groupId, target->formationId,
+						errorMessage)));
+	}
+
+	InsertFailoverDrill(target, primaryNode, traceId, errorMessage);
+}
+
+
+/*
+ * InsertFailoverDrill records a drill in the history, as running, or as
+ * failed when an error message is given.
+ */
+static void
+InsertFailoverDrill(FailoverDrillTarget *target,
+					AutoFailoverNode *primaryNode,
+					char *traceId,
+					char *errorMessage)
+{
+	Oid argTypes[] = {
+		TEXTOID,                    /* formationid */
+		INT4OID,                    /* groupid */
+		INT8OID,                    /* primarynodeid */
+		TEXTOID,                    /* traceid */
+		TEXTOID                     /* message */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(target->formationId),   /* formationid */
+		Int32GetDatum(target->groupId),             /* groupid */
+		Int64GetDatum(primaryNode == NULL ? 0 : primaryNode->nodeId),
+		traceId == NULL ? (Datum) 0 : CStringGetTextDatum(traceId),
+		errorMessage == NULL ? (Datum) 0 : CStringGetTextDatum(errorMessage)
+	};
+
+	const char argNulls[] = {
+		' ',
+		' ',
+		primaryNode == NULL ? 'n' : ' ',
+		traceId == NULL ? 'n' : ' ',
+		errorMessage == NULL ? 'n' : ' '
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *insertQuery =
+		"INSERT INTO " AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE
+		" (formationid, groupid, primarynodeid, traceid, monitor_version,"
+		"  status, endtime, message)"
+		" SELECT $1, $2, $3, $4, extversion,"
+		"        CASE WHEN $5 IS NULL THEN 'running' ELSE 'failed' END,"
+		"        CASE WHEN $5 IS NOT NULL THEN now() END,"
+		"        $5"
+		"   FROM pg_catalog.pg_extension"
+		"  WHERE extname = 'pgautofailover'";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(insertQuery,
+										  argCount, argTypes, argValues,
+										  argNulls, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into "
+			 AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE);
+	}
+
+	SPI_finish();
+}
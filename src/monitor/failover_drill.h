@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_drill.h
+ *
+ * Declarations for the failover drills: switchovers that the monitor runs
+ * on a schedule, to measure the recovery time of the opted-in formations.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* how often the first health check worker looks for drills to run */
+#define FAILOVER_DRILL_INTERVAL_MS (60 * 1000)
+
+
+/* GUC variables */
+extern int FailoverDrillTimeoutMs;
+
+
+extern void RunFailoverDrills(void);
@@ -0,0 +1,324 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_trace.c
+ *
+ * Implementation of the trace ids of failovers and switchovers.
+ *
+ * A failover is made of many steps on several nodes: the primary is drained
+ * or demoted, the standby nodes report their LSN, one of them fast forwards,
+ * and then gets promoted. When the monitor starts a failover or a switchover
+ * in a group, it generates a trace id that is kept in the
+ * pgautofailover.failover_trace table until a node of the group is writable
+ * again. Meanwhile the trace id is added to the events of the group, to the
+ * goal states that node_active_v2 returns, and thus to the logs of the
+ * keepers. The events where a node reaches its goal state also have the
+ * duration of that step in their spanduration column, and the event that
+ * completes the trace has the duration of the whole failover.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+
+#include "failover_trace.h"
+#include "metadata.h"
+#include "notifications.h"
+
+
+static void GenerateFailoverTraceId(char *traceId);
+static bool FailoverTraceTableExists(void);
+
+
+/*
+ * StartFailoverTrace starts a trace of the given kind for the group of the
+ * given node, unless a trace is already active for that group: a failover
+ * that is started again, or a switchover that fails over many times, keeps
+ * its first trace id.
+ */
+void
+StartFailoverTrace(AutoFailoverNode *node, const char *kind)
+{
+	char traceId[FAILOVER_TRACE_ID_LEN + 1] = { 0 };
+
+	if (!FailoverTraceTableExists())
+	{
+		return;
+	}
+
+	GenerateFailoverTraceId(traceId);
+
+	Oid argTypes[] = {
+		TEXTOID,                    /* formationid */
+		INT4OID,                    /* groupid */
+		TEXTOID,                    /* traceid */
+		TEXTOID                     /* kind */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(node->formationId), /* formationid */
+		Int32GetDatum(node->groupId),           /* groupid */
+		CStringGetTextDatum(traceId),           /* traceid */
+		CStringGetTextDatum(kind)               /* kind */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *insertQuery =
+		"INSERT INTO " AUTO_FAILOVER_FAILOVER_TRACE_TABLE
+		" (formationid, groupid, traceid, kind) VALUES ($1, $2, $3, $4) "
+		"ON CONFLICT (formationid, groupid) DO NOTHING";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(insertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_FAILOVER_TRACE_TABLE);
+	}
+
+	bool started = SPI_processed > 0;
+
+	SPI_finish();
+
+	if (started)
+	{
+		ereport(LOG,
+				(errmsg("Starting %s trace %s in group %d of formation \"%s\"",
+						kind, traceId, node->groupId, node->formationId)));
+	}
+}
+
+
+/*
+ * StartFailoverTraceForGoalState starts a failover trace for the group of the
+ * given node when the given goal state is the first step of a failover.
+ * Switchovers have already started their trace with the right kind then.
+ */
+void
+StartFailoverTraceForGoalState(AutoFailoverNode *node,
+							   ReplicationState goalState)
+{
+	switch (goalState)
+	{
+		case REPLICATION_STATE_DRAINING:
+		case REPLICATION_STATE_DEMOTE_TIMEOUT:
+		case REPLICATION_STATE_REPORT_LSN:
+		case REPLICATION_STATE_PREPARE_PROMOTION:
+		{
+			StartFailoverTrace(node, FAILOVER_TRACE_KIND_FAILOVER);
+			break;
+		}
+
+		default:
+		{
+			/* not a failover step */
+			break;
+		}
+	}
+}
+
+
+/*
+ * GetFailoverTraceId returns the id of the active trace of the given group,
+ * or NULL when the group is not failing over.
+ */
+char *
+GetFailoverTraceId(const char *formationId, int groupId)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	char *traceId = NULL;
+
+	if (!FailoverTraceTableExists())
+	{
+		return NULL;
+	}
+
+	Oid argTypes[] = {
+		TEXTOID,                    /* formationid */
+		INT4OID                     /* groupid */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(formationId),   /* formationid */
+		Int32GetDatum(groupId)              /* groupid */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT traceid FROM " AUTO_FAILOVER_FAILOVER_TRACE_TABLE
+		" WHERE formationid = $1 AND groupid = $2";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, true, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_FAILOVER_TRACE_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum traceIdDatum = heap_getattr(SPI_tuptable->vals[0], 1,
+										  SPI_tuptable->tupdesc, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+		traceId = TextDatumGetCString(traceIdDatum);
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	return traceId;
+}
+
+
+/*
+ * EndFailoverTrace ends the active trace of the group of the given node, if
+ * any, and registers an event with the duration of the whole trace.
+ */
+void
+EndFailoverTrace(AutoFailoverNode *node)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	char *traceId = NULL;
+	char *kind = NULL;
+	TimestampTz startTime = 0;
+
+	if (!FailoverTraceTableExists())
+	{
+		return;
+	}
+
+	Oid argTypes[] = {
+		TEXTOID,                    /* formationid */
+		INT4OID                     /* groupid */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(node->formationId), /* formationid */
+		Int32GetDatum(node->groupId)            /* groupid */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *deleteQuery =
+		"DELETE FROM " AUTO_FAILOVER_FAILOVER_TRACE_TABLE
+		" WHERE formationid = $1 AND groupid = $2 "
+		"RETURNING traceid, kind, starttime";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(deleteQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_DELETE_RETURNING)
+	{
+		elog(ERROR, "could not delete from " AUTO_FAILOVER_FAILOVER_TRACE_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[0];
+		TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+		bool isNull = false;
+
+		Datum traceIdDatum = heap_getattr(heapTuple, 1, tupleDesc, &isNull);
+		Datum kindDatum = heap_getattr(heapTuple, 2, tupleDesc, &isNull);
+		Datum startTimeDatum = heap_getattr(heapTuple, 3, tupleDesc, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+		traceId = TextDatumGetCString(traceIdDatum);
+		kind = TextDatumGetCString(kindDatum);
+		startTime = DatumGetTimestampTz(startTimeDatum);
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	if (traceId == NULL)
+	{
+		return;
+	}
+
+	char message[BUFSIZE] = { 0 };
+	long seconds = 0;
+	int microseconds = 0;
+
+	TimestampDifference(startTime, GetCurrentTransactionStartTimestamp(),
+						&seconds, &microseconds);
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Completed %s trace %s of group %d in formation \"%s\" "
+		"in %ld.%03ds, " NODE_FORMAT " is now \"%s\"",
+		kind, traceId, node->groupId, node->formationId,
+		seconds, microseconds / 1000,
+		NODE_FORMAT_ARGS(node),
+		ReplicationStateGetName(node->reportedState));
+
+	NotifyStateChangeSpan(node, message, traceId, startTime);
+}
+
+
+/*
+ * GenerateFailoverTraceId writes a new random trace id in the given buffer,
+ * which must have room for FAILOVER_TRACE_ID_LEN + 1 bytes.
+ */
+static void
+GenerateFailoverTraceId(char *traceId)
+{
+	const char *hexDigits = "0123456789abcdef";
+	uint8 randomBytes[FAILOVER_TRACE_ID_LEN / 2];
+
+	if (!pg_strong_random(randomBytes, sizeof(randomBytes)))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not generate a random failover trace id")));
+	}
+
+	for (int i = 0; i < FAILOVER_TRACE_ID_LEN / 2; i++)
+	{
+		traceId[2 * i] = hexDigits[randomBytes[i] >> 4];
+		traceId[2 * i + 1] = hexDigits[randomBytes[i] & 0x0F];
+	}
+
+	traceId[FAILOVER_TRACE_ID_LEN] = '\0';
+}
+
+
+/*
+ * FailoverTraceTableExists returns false while the extension has not been
+ * updated to a version that has the pgautofailover.failover_trace table,
+ * such as when the health check worker notifies a state change during the
+ * upgrade of the monitor.
+ */
+static bool
+FailoverTraceTableExists(void)
+{
+	Oid namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+
+	return OidIsValid(namespaceId) &&
+		   OidIsValid(get_relname_relid("failover_trace", namespaceId));
+}
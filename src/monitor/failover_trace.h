@@ -0,0 +1,34 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failover_trace.h
+ *
+ * Declarations for the trace ids that the monitor assigns to a failover or
+ * a switchover, and carries in the events and goal states of its steps.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "node_metadata.h"
+#include "replication_state.h"
+
+
+/* a trace id is 16 random bytes, in hexadecimal */
+#define FAILOVER_TRACE_ID_LEN 32
+
+#define FAILOVER_TRACE_KIND_FAILOVER "failover"
+#define FAILOVER_TRACE_KIND_SWITCHOVER "switchover"
+#define FAILOVER_TRACE_KIND_DRILL "drill"
+
+
+extern void StartFailoverTrace(AutoFailoverNode *node, const char *kind);
+extern void StartFailoverTraceForGoalState(AutoFailoverNode *node,
+										   ReplicationState goalState);
+extern char * GetFailoverTraceId(const char *formationId, int groupId);
+extern void EndFailoverTrace(AutoFailoverNode *node);
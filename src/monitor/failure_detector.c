@@ -0,0 +1,349 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failure_detector.c
+ *
+ * Implementation of a phi accrual failure detector on the node_active()
+ * calls of the keepers.
+ *
+ * With a fixed pgautofailover.node_considered_unhealthy_timeout, the timeout
+ * has to be set for the most jittery network of all the nodes, and every
+ * node then takes that long to be found unresponsive. Here we keep, for each
+ * node, the last intervals between its node_active() calls, and compute how
+ * suspicious the time since its last call is given that history: phi is
+ * -log10 of the probability that the keeper is still alive and only late,
+ * assuming normally distributed delays. A phi of 8 means a chance of 1 in
+ * 10^8 of a false suspicion.
+ *
+ * The monitor asks each keeper to call again after a delay that depends on
+ * the group state, so we model how late each call is compared to what we
+ * asked for, rather than the raw intervals. Keepers that use the older
+ * node_active() protocol are not given a delay, and their raw intervals are
+ * modelled instead.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <math.h>
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "failure_detector.h"
+#include "node_shmem_hash.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+typedef struct NodeHeartbeatEntry
+{
+	NodeShmemHashKey key;
+
+	TimestampTz lastHeartbeat;
+	int expectedIntervalMs;     /* what we asked for at the last heartbeat */
+
+	int sampleCount;
+	int nextSample;
+	double delaysMs[FAILURE_DETECTOR_WINDOW];
+} NodeHeartbeatEntry;
+
+
+/* GUC variables */
+double FailureDetectorPhiThreshold = 0.0;
+int FailureDetectorMinStdDevMs = 200;
+
+static NodeShmemHash NodeHeartbeatHash =
+	make_node_shmem_hash("pg_auto_failover Failure Detector",
+						 NodeHeartbeatEntry, FAILURE_DETECTOR_MAX_NODES);
+
+
+static void NodeHeartbeatDelayStats(NodeHeartbeatEntry *entry,
+									double *mean, double *stddev);
+static double NodeHeartbeatEntryPhi(NodeHeartbeatEntry *entry, TimestampTz now);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(failure_detector);
+
+
+/*
+ * InitializeFailureDetector, called at server start, requests the shared
+ * memory for the heartbeat history of the nodes.
+ */
+void
+InitializeFailureDetector(void)
+{
+	NodeShmemHashRequest(&NodeHeartbeatHash);
+}
+
+
+/*
+ * RecordNodeHeartbeat registers a node_active() call of the given node of
+ * the current database. The next call is expected nextReportIntervalMs
+ * later, or 0 when that's up to the keeper. When the hash table is full,
+ * the heartbeat is not recorded.
+ */
+void
+RecordNodeHeartbeat(int64 nodeId, int nextReportIntervalMs)
+{
+	bool found = false;
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (NodeHeartbeatHash.hash == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(NodeHeartbeatHash.lock, LW_EXCLUSIVE);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) NodeShmemHashEnter(&NodeHeartbeatHash,
+												  nodeId, &found);
+
+	if (entry != NULL)
+	{
+		if (found)
+		{
+			long secs = 0;
+			int microsecs = 0;
+
+			TimestampDifference(entry->lastHeartbeat, now, &secs, &microsecs);
+
+			double intervalMs = secs * 1000.0 + microsecs / 1000.0;
+
+			entry->delaysMs[entry->nextSample] =
+				intervalMs - entry->expectedIntervalMs;
+
+			entry->nextSample = (entry->nextSample + 1) % FAILURE_DETECTOR_WINDOW;
+			entry->sampleCount =
+				Min(entry->sampleCount + 1, FAILURE_DETECTOR_WINDOW);
+		}
+
+		entry->lastHeartbeat = now;
+		entry->expectedIntervalMs = nextReportIntervalMs;
+	}
+
+	LWLockRelease(NodeHeartbeatHash.lock);
+}
+
+
+/*
+ * RemoveNodeHeartbeat forgets about the heartbeats of a node of the current
+ * database, when the node is removed.
+ */
+void
+RemoveNodeHeartbeat(int64 nodeId)
+{
+	NodeShmemHashRemove(&NodeHeartbeatHash, nodeId);
+}
+
+
+/*
+ * NodeHeartbeatPhi returns the suspicion level of the given node of the
+ * current database at the given time, or -1 when we don't have enough
+ * heartbeats of that node yet.
+ */
+double
+NodeHeartbeatPhi(int64 nodeId, TimestampTz now)
+{
+	double phi = -1.0;
+
+	if (NodeHeartbeatHash.hash == NULL)
+	{
+		return -1.0;
+	}
+
+	LWLockAcquire(NodeHeartbeatHash.lock, LW_SHARED);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) NodeShmemHashFind(&NodeHeartbeatHash, nodeId);
+
+	if (entry != NULL)
+	{
+		phi = NodeHeartbeatEntryPhi(entry, now);
+	}
+
+	LWLockRelease(NodeHeartbeatHash.lock);
+
+	return phi;
+}
+
+
+/*
+ * GetNodeHeartbeat sets the time of the last node_active() call of the given
+ * node of the current database, and how long after that we asked the keeper
+ * to call again, 0 when that's up to the keeper, and returns true. When we
+ * have no heartbeat for that node, we return false.
+ */
+bool
+GetNodeHeartbeat(int64 nodeId, TimestampTz *lastHeartbeat,
+				 int *expectedIntervalMs)
+{
+	bool found = false;
+
+	if (NodeHeartbeatHash.hash == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(NodeHeartbeatHash.lock, LW_SHARED);
+
+	NodeHeartbeatEntry *entry =
+		(NodeHeartbeatEntry *) NodeShmemHashFind(&NodeHeartbeatHash, nodeId);
+
+	if (entry != NULL)
+	{
+		*lastHeartbeat = entry->lastHeartbeat;
+		*expectedIntervalMs = entry->expectedIntervalMs;
+		found = true;
+	}
+
+	LWLockRelease(NodeHeartbeatHash.lock);
+
+	return found;
+}
+
+
+/*
+ * NodeHeartbeatDelayStats computes the mean and the standard deviation of
+ * the delays in the heartbeat history of the given entry, in milliseconds.
+ */
+static void
+NodeHeartbeatDelayStats(NodeHeartbeatEntry *entry,
+						double *mean, double *stddev)
+{
+	double sum = 0.0;
+	double squares = 0.0;
+
+	*mean = 0.0;
+	*stddev = 0.0;
+
+	if (entry->sampleCount == 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < entry->sampleCount; i++)
+	{
+		sum += entry->delaysMs[i];
+	}
+
+	*mean = sum / entry->sampleCount;
+
+	for (int i = 0; i < entry->sampleCount; i++)
+	{
+		double deviation = entry->delaysMs[i] - *mean;
+
+		squares += deviation * deviation;
+	}
+
+	*stddev = sqrt(squares / entry->sampleCount);
+}
+
+
+/*
+ * NodeHeartbeatEntryPhi returns the suspicion level of the given entry at
+ * the given time, or -1 when the entry doesn't have enough samples yet. The
+ * cumulative distribution function of the normal distribution is computed
+ * with a logistic approximation, which is precise enough for a threshold.
+ */
+static double
+NodeHeartbeatEntryPhi(NodeHeartbeatEntry *entry, TimestampTz now)
+{
+	double mean = 0.0;
+	double stddev = 0.0;
+	long secs = 0;
+	int microsecs = 0;
+
+	if (entry->sampleCount < FAILURE_DETECTOR_MIN_SAMPLES)
+	{
+		return -1.0;
+	}
+
+	NodeHeartbeatDelayStats(entry, &mean, &stddev);
+
+	stddev = Max(stddev, (double) Max(FailureDetectorMinStdDevMs, 1));
+
+	TimestampDifference(entry->lastHeartbeat, now, &secs, &microsecs);
+
+	double elapsedMs = secs * 1000.0 + microsecs / 1000.0;
+	double expectedMs = entry->expectedIntervalMs + mean;
+
+	double y = (elapsedMs - expectedMs) / stddev;
+	double e = exp(-y * (1.5976 + 0.070566 * y * y));
+
+	if (elapsedMs > expectedMs)
+	{
+		return -log10(e / (1.0 + e));
+	}
+
+	return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+
+/*
+ * failure_detector returns a row per node of the current database with the
+ * time of its last node_active() call, how many intervals we have recorded,
+ * the mean and standard deviation of how late the calls were (in
+ * milliseconds), and the current suspicion level, NULL when we need more
+ * intervals.
+ */
+Datum
+failure_detector(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+	NodeHeartbeatEntry *entry = NULL;
+	TimestampTz now = GetCurrentTimestamp();
+
+	Tuplestorestate *tupleStore =
+		NodeShmemHashBeginSRF(&NodeHeartbeatHash, fcinfo, &tupleDescriptor);
+
+	LWLockAcquire(NodeHeartbeatHash.lock, LW_SHARED);
+
+	NodeShmemHashSeqInit(&NodeHeartbeatHash, &status);
+
+	while ((entry = NodeShmemHashSeqSearch(&status)) != NULL)
+	{
+		Datum values[6];
+		bool isNulls[6];
+		double mean = 0.0;
+		double stddev = 0.0;
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		NodeHeartbeatDelayStats(entry, &mean, &stddev);
+
+		double phi = NodeHeartbeatEntryPhi(entry, now);
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+		values[1] = TimestampTzGetDatum(entry->lastHeartbeat);
+		values[2] = Int32GetDatum(entry->sampleCount);
+		values[3] = Float8GetDatum(mean);
+		values[4] = Float8GetDatum(stddev);
+
+		if (phi < 0)
+		{
+			isNulls[5] = true;
+		}
+		else
+		{
+			values[5] = Float8GetDatum(phi);
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(NodeHeartbeatHash.lock);
+
+	return (Datum) 0;
+}
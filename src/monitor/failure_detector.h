@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/failure_detector.h
+ *
+ * Declarations for the adaptive failure detector that models the intervals
+ * between the node_active() calls of each keeper.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+
+/* how many heartbeat intervals we keep per node */
+#define FAILURE_DETECTOR_WINDOW 100
+
+/* how many intervals we need before we trust the model of a node */
+#define FAILURE_DETECTOR_MIN_SAMPLES 10
+
+/* how many nodes we keep a heartbeat history for */
+#define FAILURE_DETECTOR_MAX_NODES 1024
+
+
+/* GUC variables */
+extern double FailureDetectorPhiThreshold;
+extern int FailureDetectorMinStdDevMs;
+
+
+extern void InitializeFailureDetector(void);
+extern void RecordNodeHeartbeat(int64 nodeId, int nextReportIntervalMs);
+extern void RemoveNodeHeartbeat(int64 nodeId);
+extern double NodeHeartbeatPhi(int64 nodeId, TimestampTz now);
+extern bool GetNodeHeartbeat(int64 nodeId, TimestampTz *lastHeartbeat,
+							 int *expectedIntervalMs);
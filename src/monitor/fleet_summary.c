@@ -0,0 +1,955 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/fleet_summary.c
+ *
+ * Implementation of shared memory counters that summarize the nodes and the
+ * groups of all the formations of the monitor.
+ *
+ * Dashboards want to know how many nodes are in each state and health, and
+ * how many groups are failing over or have no healthy secondary left. Rather
+ * than scanning the current state of every formation every few seconds, the
+ * pgautofailover.fleet_node_counts() and pgautofailover.fleet_group_counts()
+ * functions read counters that are kept up to date in shared memory.
+ *
+ * The counters follow the changes committed to the node_base table, as
+ * registered by the node cache trigger, see node_cache.c. We only keep what
+ * each node contributes to the counters of its group and formation: when a
+ * change commits, the previous contribution of the node is subtracted and the
+ * new one is added, so applying the same version of a row twice is a no-op.
+ * This is what allows loading the counters of a database from the catalogs
+ * while other transactions commit changes: we only mark the counters as
+ * loaded when no change has been applied since we started reading.
+ *
+ * When the counters can't be maintained in shared memory (the node cache is
+ * disabled, the server is a standby, or we ran out of room) the functions
+ * compute the same counters from the catalogs instead.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "fleet_summary.h"
+#include "health_check.h"
+#include "metadata.h"
+#include "node_cache.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+#include "version_compat.h"
+
+#include "access/xlog.h"
+#include "executor/spi.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+
+#define FLEET_SUMMARY_STATE_COUNT (REPLICATION_STATE_UNKNOWN + 1)
+
+/* NODE_HEALTH_UNKNOWN, NODE_HEALTH_BAD, NODE_HEALTH_GOOD */
+#define FLEET_SUMMARY_HEALTH_COUNT 3
+
+
+/* what a node contributes to the counters of its group and formation */
+typedef struct FleetNodeKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} FleetNodeKey;
+
+typedef struct FleetNodeEntry
+{
+	FleetNodeKey key;
+
+	char formationId[NAMEDATALEN];
+	int groupId;
+	int stateIndex;
+	int healthIndex;
+	bool inPromotion;           /* see IsParticipatingInPromotion() */
+	bool healthySecondary;
+} FleetNodeEntry;
+
+typedef struct FleetGroupKey
+{
+	Oid databaseId;
+	int groupId;
+	char formationId[NAMEDATALEN];
+} FleetGroupKey;
+
+typedef struct FleetGroupEntry
+{
+	FleetGroupKey key;
+
+	int nodeCount;
+	int promotionNodeCount;
+	int healthySecondaryCount;
+} FleetGroupEntry;
+
+typedef struct FleetFormationKey
+{
+	Oid databaseId;
+	char formationId[NAMEDATALEN];
+} FleetFormationKey;
+
+typedef struct FleetFormationEntry
+{
+	FleetFormationKey key;
+
+	int64 nodeCount;
+	int64 groupCount;
+	int64 groupsInFailover;
+	int64 groupsWithoutHealthySecondary;
+	int64 nodes[FLEET_SUMMARY_STATE_COUNT][FLEET_SUMMARY_HEALTH_COUNT];
+} FleetFormationEntry;
+
+
+/*
+ * The same code maintains the counters in shared memory and in backend-local
+ * hash tables, when computing the counters from the catalogs.
+ */
+typedef struct FleetSummaryTables
+{
+	HTAB *nodeHash;
+	HTAB *groupHash;
+	HTAB *formationHash;
+	HASHACTION enterAction;     /* HASH_ENTER_NULL in shared memory */
+} FleetSummaryTables;
+
+typedef struct FleetSummaryControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* incremented each time a change is applied to the counters */
+	uint64 generation;
+
+	/* databases that have their counters loaded, InvalidOid when free */
+	Oid loadedDatabases[FLEET_SUMMARY_MAX_DATABASES];
+} FleetSummaryControlData;
+
+
+static FleetSummaryControlData *FleetSummaryControl = NULL;
+static FleetSummaryTables SharedTables = { NULL, NULL, NULL, HASH_ENTER_NULL };
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static size_t FleetSummaryShmemSize(void);
+static void FleetSummaryShmemInit(void);
+static void InitFleetSummaryHashInfo(HASHCTL *hashInfo, Size keySize,
+									 Size entrySize);
+static bool FleetSummaryAddNode(FleetSummaryTables *tables, Oid databaseId,
+								AutoFailoverNode *node);
+static void FleetSummaryRemoveNode(FleetSummaryTables *tables, Oid databaseId,
+								   int64 nodeId);
+static bool FleetSummaryCount(FleetSummaryTables *tables, Oid databaseId,
+							  FleetNodeEntry *nodeEntry, int delta);
+static void RemoveDatabaseCounters(Oid databaseId);
+static int LoadedDatabaseIndex(Oid databaseId);
+static List * ReadAllNodes(void);
+static FleetFormationEntry * GetFleetFormations(int *formationCount);
+static FleetFormationEntry * CopyFormationEntries(HTAB *formationHash,
+												  int *formationCount);
+static Tuplestorestate * SetupFleetSummaryResult(FunctionCallInfo fcinfo,
+												 TupleDesc *tupleDescriptor);
+
+
+PG_FUNCTION_INFO_V1(fleet_node_counts);
+PG_FUNCTION_INFO_V1(fleet_group_counts);
+
+
+/*
+ * InitializeFleetSummary, called at server start, requests the shared memory
+ * for the fleet counters. They follow the changes registered for the node
+ * cache, so there is nothing to maintain when the cache is disabled.
+ */
+void
+InitializeFleetSummary(void)
+{
+	if (NodeCacheSize <= 0)
+	{
+		return;
+	}
+
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(FleetSummaryShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = FleetSummaryShmemInit;
+}
+
+
+/*
+ * FleetSummaryShmemSize computes how much shared memory is required. We
+ * expect at most a group and a formation per node.
+ */
+static size_t
+FleetSummaryShmemSize(void)
+{
+	Size size = sizeof(FleetSummaryControlData);
+
+	size = add_size(size, hash_estimate_size(NodeCacheSize,
+											 sizeof(FleetNodeEntry)));
+
+	size = add_size(size, hash_estimate_size(NodeCacheSize,
+											 sizeof(FleetGroupEntry)));
+
+	size = add_size(size, hash_estimate_size(NodeCacheSize,
+											 sizeof(FleetFormationEntry)));
+
+	return size;
+}
+
+
+/*
+ * FleetSummaryShmemInit initializes the requested shared memory for the
+ * fleet counters.
+ */
+static void
+FleetSummaryShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL nodeHashInfo;
+	HASHCTL groupHashInfo;
+	HASHCTL formationHashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	FleetSummaryControl =
+		(FleetSummaryControlData *) ShmemInitStruct("pg_auto_failover Fleet Summary",
+													sizeof(FleetSummaryControlData),
+													&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(FleetSummaryControl, 0, sizeof(FleetSummaryControlData));
+
+		FleetSummaryControl->trancheId = LWLockNewTrancheId();
+		FleetSummaryControl->lockTrancheName = "pg_auto_failover Fleet Summary";
+		LWLockRegisterTranche(FleetSummaryControl->trancheId,
+							  FleetSummaryControl->lockTrancheName);
+
+		LWLockInitialize(&FleetSummaryControl->lock,
+						 FleetSummaryControl->trancheId);
+
+		FleetSummaryControl->generation = 1;
+	}
+
+	InitFleetSummaryHashInfo(&nodeHashInfo,
+							 sizeof(FleetNodeKey), sizeof(FleetNodeEntry));
+	InitFleetSummaryHashInfo(&groupHashInfo,
+							 sizeof(FleetGroupKey), sizeof(FleetGroupEntry));
+	InitFleetSummaryHashInfo(&formationHashInfo,
+							 sizeof(FleetFormationKey),
+							 sizeof(FleetFormationEntry));
+
+	SharedTables.nodeHash =
+		ShmemInitHash("pg_auto_failover Fleet Summary Node Hash",
+					  NodeCacheSize, NodeCacheSize,
+					  &nodeHashInfo, HASH_ELEM | HASH_FUNCTION);
+
+	SharedTables.groupHash =
+		ShmemInitHash("pg_auto_failover Fleet Summary Group Hash",
+					  NodeCacheSize, NodeCacheSize,
+					  &groupHashInfo, HASH_ELEM | HASH_FUNCTION);
+
+	SharedTables.formationHash =
+		ShmemInitHash("pg_auto_failover Fleet Summary Formation Hash",
+					  NodeCacheSize, NodeCacheSize,
+					  &formationHashInfo, HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * InitFleetSummaryHashInfo prepares the HASHCTL of one of our hash tables.
+ */
+static void
+InitFleetSummaryHashInfo(HASHCTL *hashInfo, Size keySize, Size entrySize)
+{
+	memset(hashInfo, 0, sizeof(HASHCTL));
+
+	hashInfo->keysize = keySize;
+	hashInfo->entrysize = entrySize;
+	hashInfo->hash = tag_hash;
+}
+
+
+/*
+ * FleetSummaryApplyNodeChange applies a change to a node_base row of the
+ * current database, just committed, to the shared counters. The newNode is
+ * NULL when the node has been deleted. This is called after commit, so we
+ * must not ERROR here.
+ */
+void
+FleetSummaryApplyNodeChange(int64 nodeId, AutoFailoverNode *newNode)
+{
+	if (FleetSummaryControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&FleetSummaryControl->lock, LW_EXCLUSIVE);
+
+	FleetSummaryControl->generation++;
+
+	if (LoadedDatabaseIndex(MyDatabaseId) >= 0)
+	{
+		FleetSummaryRemoveNode(&SharedTables, MyDatabaseId, nodeId);
+
+		if (newNode != NULL &&
+			!FleetSummaryAddNode(&SharedTables, MyDatabaseId, newNode))
+		{
+			/* out of shared memory, we'll compute the counters instead */
+			RemoveDatabaseCounters(MyDatabaseId);
+		}
+	}
+
+	LWLockRelease(&FleetSummaryControl->lock);
+}
+
+
+/*
+ * FleetSummaryInvalidateDatabase forgets about the counters of the given
+ * database, which are going to be loaded again from the catalogs.
+ */
+void
+FleetSummaryInvalidateDatabase(Oid databaseId)
+{
+	if (FleetSummaryControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&FleetSummaryControl->lock, LW_EXCLUSIVE);
+
+	FleetSummaryControl->generation++;
+	RemoveDatabaseCounters(databaseId);
+
+	LWLockRelease(&FleetSummaryControl->lock);
+}
+
+
+/*
+ * FleetSummaryAddNode adds the contribution of the given node to the
+ * counters, and returns false when one of the hash tables is full. Caller
+ * must have removed the previous contribution of the node.
+ */
+static bool
+FleetSummaryAddNode(FleetSummaryTables *tables, Oid databaseId,
+					AutoFailoverNode *node)
+{
+	FleetNodeKey key;
+	bool found = false;
+
+	if (strlen(node->formationId) >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	memset(&key, 0, sizeof(FleetNodeKey));
+	key.databaseId = databaseId;
+	key.nodeId = node->nodeId;
+
+	FleetNodeEntry *nodeEntry =
+		(FleetNodeEntry *) hash_search(tables->nodeHash, &key,
+									   tables->enterAction, &found);
+
+	if (nodeEntry == NULL)
+	{
+		return false;
+	}
+
+	strlcpy(nodeEntry->formationId, node->formationId, NAMEDATALEN);
+	nodeEntry->groupId = node->groupId;
+
+	nodeEntry->stateIndex =
+		node->reportedState >= 0 && node->reportedState < REPLICATION_STATE_UNKNOWN
+		? node->reportedState
+		: REPLICATION_STATE_UNKNOWN;
+
+	nodeEntry->healthIndex =
+		node->health == NODE_HEALTH_GOOD ? 2
+		: node->health == NODE_HEALTH_BAD ? 1
+		: 0;
+
+	nodeEntry->inPromotion = IsParticipatingInPromotion(node);
+	nodeEntry->healthySecondary =
+		node->reportedState == REPLICATION_STATE_SECONDARY &&
+		node->goalState == REPLICATION_STATE_SECONDARY &&
+		node->health == NODE_HEALTH_GOOD;
+
+	if (!FleetSummaryCount(tables, databaseId, nodeEntry, 1))
+	{
+		(void) hash_search(tables->nodeHash, &key, HASH_REMOVE, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * FleetSummaryRemoveNode removes the contribution of the given node to the
+ * counters, if any.
+ */
+static void
+FleetSummaryRemoveNode(FleetSummaryTables *tables, Oid databaseId,
+					   int64 nodeId)
+{
+	FleetNodeKey key;
+
+	memset(&key, 0, sizeof(FleetNodeKey));
+	key.databaseId = databaseId;
+	key.nodeId = nodeId;
+
+	FleetNodeEntry *nodeEntry =
+		(FleetNodeEntry *) hash_search(tables->nodeHash, &key, HASH_FIND, NULL);
+
+	if (nodeEntry != NULL)
+	{
+		/* the group and formation entries exist, this can't fail */
+		(void) FleetSummaryCount(tables, databaseId, nodeEntry, -1);
+		(void) hash_search(tables->nodeHash, &key, HASH_REMOVE, NULL);
+	}
+}
+
+
+/*
+ * FleetSummaryCount adds (delta is 1) or subtracts (delta is -1) the
+ * contribution of the given node to the counters of its group and
+ * formation. The group counters decide which groups count as being in
+ * failover or without a healthy secondary in the formation counters.
+ */
+static bool
+FleetSummaryCount(FleetSummaryTables *tables, Oid databaseId,
+				  FleetNodeEntry *nodeEntry, int delta)
+{
+	FleetFormationKey formationKey;
+	FleetGroupKey groupKey;
+	bool found = false;
+
+	memset(&formationKey, 0, sizeof(FleetFormationKey));
+	formationKey.databaseId = databaseId;
+	strlcpy(formationKey.formationId, nodeEntry->formationId, NAMEDATALEN);
+
+	memset(&groupKey, 0, sizeof(FleetGroupKey));
+	groupKey.databaseId = databaseId;
+	groupKey.groupId = nodeEntry->groupId;
+	strlcpy(groupKey.formationId, nodeEntry->formationId, NAMEDATALEN);
+
+	FleetFormationEntry *formation =
+		(FleetFormationEntry *) hash_search(tables->formationHash,
+											&formationKey,
+											tables->enterAction, &found);
+
+	if (formation == NULL)
+	{
+		return false;
+	}
+
+	if (!found)
+	{
+		memset(((char *) formation) + sizeof(FleetFormationKey), 0,
+			   sizeof(FleetFormationEntry) - sizeof(FleetFormationKey));
+	}
+
+	FleetGroupEntry *group =
+		(FleetGroupEntry *) hash_search(tables->groupHash, &groupKey,
+										tables->enterAction, &found);
+
+	if (group == NULL)
+	{
+		if (formation->nodeCount == 0)
+		{
+			(void) hash_search(tables->formationHash, &formationKey,
+							   HASH_REMOVE, NULL);
+		}
+		return false;
+	}
+
+	if (!found)
+	{
+		group->nodeCount = 0;
+		group->promotionNodeCount = 0;
+		group->healthySecondaryCount = 0;
+	}
+
+	bool wasCounted = group->nodeCount > 0;
+	bool wasInFailover = wasCounted && group->promotionNodeCount > 0;
+	bool wasWithoutHealthySecondary =
+		wasCounted && group->healthySecondaryCount == 0;
+
+	group->nodeCount += delta;
+
+	if (nodeEntry->inPromotion)
+	{
+		group->promotionNodeCount += delta;
+	}
+
+	if (nodeEntry->healthySecondary)
+	{
+		group->healthySecondaryCount += delta;
+	}
+
+	bool isCounted = group->nodeCount > 0;
+	bool isInFailover = isCounted && group->promotionNodeCount > 0;
+	bool isWithoutHealthySecondary =
+		isCounted && group->healthySecondaryCount == 0;
+
+	formation->nodeCount += delta;
+	formation->nodes[nodeEntry->stateIndex][nodeEntry->healthIndex] += delta;
+
+	formation->groupCount += (int) isCounted - (int) wasCounted;
+	formation->groupsInFailover += (int) isInFailover - (int) wasInFailover;
+	formation->groupsWithoutHealthySecondary +=
+		(int) isWithoutHealthySecondary - (int) wasWithoutHealthySecondary;
+
+	if (!isCounted)
+	{
+		(void) hash_search(tables->groupHash, &groupKey, HASH_REMOVE, NULL);
+	}
+
+	if (formation->nodeCount <= 0)
+	{
+		(void) hash_search(tables->formationHash, &formationKey,
+						   HASH_REMOVE, NULL);
+	}
+
+	return true;
+}
+
+
+/*
+ * RemoveDatabaseCounters removes all the shared counters of the given
+ * database, which is not loaded anymore. Caller must hold the lock in
+ * exclusive mode.
+ */
+static void
+RemoveDatabaseCounters(Oid databaseId)
+{
+	HASH_SEQ_STATUS status;
+	FleetNodeEntry *nodeEntry = NULL;
+	FleetGroupEntry *groupEntry = NULL;
+	FleetFormationEntry *formationEntry = NULL;
+
+	int index = LoadedDatabaseIndex(databaseId);
+
+	if (index >= 0)
+	{
+		FleetSummaryControl->loadedDatabases[index] = InvalidOid;
+	}
+
+	/* dynahash allows removing the entry that was just returned */
+	hash_seq_init(&status, SharedTables.nodeHash);
+
+	while ((nodeEntry = (FleetNodeEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (nodeEntry->key.databaseId == databaseId)
+		{
+			(void) hash_search(SharedTables.nodeHash, &nodeEntry->key,
+							   HASH_REMOVE, NULL);
+		}
+	}
+
+	hash_seq_init(&status, SharedTables.groupHash);
+
+	while ((groupEntry = (FleetGroupEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (groupEntry->key.databaseId == databaseId)
+		{
+			(void) hash_search(SharedTables.groupHash, &groupEntry->key,
+							   HASH_REMOVE, NULL);
+		}
+	}
+
+	hash_seq_init(&status, SharedTables.formationHash);
+
+	while ((formationEntry =
+				(FleetFormationEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (formationEntry->key.databaseId == databaseId)
+		{
+			(void) hash_search(SharedTables.formationHash,
+							   &formationEntry->key,
+							   HASH_REMOVE, NULL);
+		}
+	}
+}
+
+
+/*
+ * LoadedDatabaseIndex returns the position of the given database in the
+ * array of databases that have their counters loaded, or -1. Caller must
+ * hold the lock.
+ */
+static int
+LoadedDatabaseIndex(Oid databaseId)
+{
+	for (int index = 0; index < FLEET_SUMMARY_MAX_DATABASES; index++)
+	{
+		if (FleetSummaryControl->loadedDatabases[index] == databaseId)
+		{
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+
+/*
+ * ReadAllNodes returns the list of all the nodes of all the formations.
+ */
+static List *
+ReadAllNodes(void)
+{
+	List *nodeList = NIL;
+	MemoryContext callerContext = CurrentMemoryContext;
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute(SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE,
+								true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
+	}
+
+	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		AutoFailoverNode *node =
+			TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
+
+		nodeList = lappend(nodeList, node);
+	}
+
+	MemoryContextSwitchTo(spiContext);
+
+	SPI_finish();
+
+	return nodeList;
+}
+
+
+/*
+ * GetFleetFormations returns a copy of the counters of the formations of the
+ * current database. The shared counters are loaded from the catalogs when
+ * needed, and when they can't be used we compute the counters in
+ * backend-local hash tables instead.
+ *
+ * The shared counters reflect the last committed changes, not the changes
+ * of the current transaction.
+ */
+static FleetFormationEntry *
+GetFleetFormations(int *formationCount)
+{
+	FleetFormationEntry *formations = NULL;
+	List *nodeList = NIL;
+	ListCell *nodeCell = NULL;
+
+	/* on a standby the node cache trigger never fires */
+	bool useShared = FleetSummaryControl != NULL && !RecoveryInProgress();
+
+	if (useShared)
+	{
+		LWLockAcquire(&FleetSummaryControl->lock, LW_SHARED);
+
+		uint64 generation = FleetSummaryControl->generation;
+
+		if (LoadedDatabaseIndex(MyDatabaseId) >= 0)
+		{
+			formations = CopyFormationEntries(SharedTables.formationHash,
+											  formationCount);
+		}
+
+		LWLockRelease(&FleetSummaryControl->lock);
+
+		if (formations != NULL)
+		{
+			return formations;
+		}
+
+		nodeList = ReadAllNodes();
+
+		LWLockAcquire(&FleetSummaryControl->lock, LW_EXCLUSIVE);
+
+		int index = LoadedDatabaseIndex(InvalidOid);
+
+		/* changes committed since we read the generation are in nodeList */
+		if (FleetSummaryControl->generation == generation && index >= 0)
+		{
+			bool complete = true;
+
+			RemoveDatabaseCounters(MyDatabaseId);
+
+			foreach(nodeCell, nodeList)
+			{
+				AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+				if (!FleetSummaryAddNode(&SharedTables, MyDatabaseId, node))
+				{
+					complete = false;
+					break;
+				}
+			}
+
+			if (complete)
+			{
+				FleetSummaryControl->loadedDatabases[index] = MyDatabaseId;
+
+				formations = CopyFormationEntries(SharedTables.formationHash,
+												  formationCount);
+			}
+			else
+			{
+				RemoveDatabaseCounters(MyDatabaseId);
+			}
+		}
+
+		LWLockRelease(&FleetSummaryControl->lock);
+
+		if (formations != NULL)
+		{
+			return formations;
+		}
+	}
+	else
+	{
+		nodeList = ReadAllNodes();
+	}
+
+	/* compute the counters from the nodes we just read */
+	FleetSummaryTables localTables = { NULL, NULL, NULL, HASH_ENTER };
+	HASHCTL nodeHashInfo;
+	HASHCTL groupHashInfo;
+	HASHCTL formationHashInfo;
+	int flags = HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT;
+
+	InitFleetSummaryHashInfo(&nodeHashInfo,
+							 sizeof(FleetNodeKey), sizeof(FleetNodeEntry));
+	InitFleetSummaryHashInfo(&groupHashInfo,
+							 sizeof(FleetGroupKey), sizeof(FleetGroupEntry));
+	InitFleetSummaryHashInfo(&formationHashInfo,
+							 sizeof(FleetFormationKey),
+							 sizeof(FleetFormationEntry));
+
+	nodeHashInfo.hcxt = CurrentMemoryContext;
+	groupHashInfo.hcxt = CurrentMemoryContext;
+	formationHashInfo.hcxt = CurrentMemoryContext;
+
+	localTables.nodeHash =
+		hash_create("pg_auto_failover Fleet Summary Local Node Hash",
+					32, &nodeHashInfo, flags);
+	localTables.groupHash =
+		hash_create("pg_auto_failover Fleet Summary Local Group Hash",
+					32, &groupHashInfo, flags);
+	localTables.formationHash =
+		hash_create("pg_auto_failover Fleet Summary Local Formation Hash",
+					32, &formationHashInfo, flags);
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		/* only formation names that are too long are skipped here */
+		(void) FleetSummaryAddNode(&localTables, MyDatabaseId, node);
+	}
+
+	formations = CopyFormationEntries(localTables.formationHash, formationCount);
+
+	hash_destroy(localTables.nodeHash);
+	hash_destroy(localTables.groupHash);
+	hash_destroy(localTables.formationHash);
+
+	return formations;
+}
+
+
+/*
+ * CopyFormationEntries returns a palloc'ed copy of the formation entries of
+ * the current database found in the given hash table. The returned array
+ * always has room for at least one entry, so that it's never NULL.
+ */
+static FleetFormationEntry *
+CopyFormationEntries(HTAB *formationHash, int *formationCount)
+{
+	HASH_SEQ_STATUS status;
+	FleetFormationEntry *entry = NULL;
+	int count = 0;
+
+	long entryCount = hash_get_num_entries(formationHash);
+	FleetFormationEntry *formations = (FleetFormationEntry *)
+									  palloc((entryCount + 1) *
+											 sizeof(FleetFormationEntry));
+
+	hash_seq_init(&status, formationHash);
+
+	while ((entry = (FleetFormationEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.databaseId == MyDatabaseId && count < entryCount)
+		{
+			formations[count++] = *entry;
+		}
+	}
+
+	*formationCount = count;
+
+	return formations;
+}
+
+
+/*
+ * SetupFleetSummaryResult prepares the tuplestore of the result of our
+ * set-returning functions.
+ */
+static Tuplestorestate *
+SetupFleetSummaryResult(FunctionCallInfo fcinfo, TupleDesc *tupleDescriptor)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		!(resultInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot "
+						"accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, tupleDescriptor) !=
+		TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("return type must be a row type")));
+	}
+
+	MemoryContext oldContext =
+		MemoryContextSwitchTo(resultInfo->econtext->ecxt_per_query_memory);
+
+	*tupleDescriptor = CreateTupleDescCopy(*tupleDescriptor);
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = *tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	return tupleStore;
+}
+
+
+/*
+ * fleet_node_counts returns how many nodes are in each reported state and
+ * health, per formation.
+ */
+Datum
+fleet_node_counts(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	int formationCount = 0;
+
+	checkPgAutoFailoverVersion();
+
+	Tuplestorestate *tupleStore =
+		SetupFleetSummaryResult(fcinfo, &tupleDescriptor);
+
+	FleetFormationEntry *formations = GetFleetFormations(&formationCount);
+
+	for (int index = 0; index < formationCount; index++)
+	{
+		FleetFormationEntry *formation = &(formations[index]);
+
+		/* REPLICATION_STATE_UNKNOWN has no SQL representation */
+		for (int state = 0; state < REPLICATION_STATE_UNKNOWN; state++)
+		{
+			for (int health = 0; health < FLEET_SUMMARY_HEALTH_COUNT; health++)
+			{
+				Datum values[4];
+				bool isNulls[4];
+
+				if (formation->nodes[state][health] <= 0)
+				{
+					continue;
+				}
+
+				memset(isNulls, false, sizeof(isNulls));
+
+				values[0] = CStringGetTextDatum(formation->key.formationId);
+				values[1] = ObjectIdGetDatum(
+					ReplicationStateGetEnum((ReplicationState) state));
+				values[2] = Int32GetDatum(health - 1);
+				values[3] = Int64GetDatum(formation->nodes[state][health]);
+
+				tuplestore_putvalues(tupleStore, tupleDescriptor,
+									 values, isNulls);
+			}
+		}
+	}
+
+	return (Datum) 0;
+}
+
+
+/*
+ * fleet_group_counts returns how many nodes and groups each formation has,
+ * how many of the groups are in the middle of a failover, and how many of
+ * the groups don't have a healthy secondary node.
+ */
+Datum
+fleet_group_counts(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	int formationCount = 0;
+
+	checkPgAutoFailoverVersion();
+
+	Tuplestorestate *tupleStore =
+		SetupFleetSummaryResult(fcinfo, &tupleDescriptor);
+
+	FleetFormationEntry *formations = GetFleetFormations(&formationCount);
+
+	for (int index = 0; index < formationCount; index++)
+	{
+		FleetFormationEntry *formation = &(formations[index]);
+		Datum values[5];
+		bool isNulls[5];
+
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = CStringGetTextDatum(formation->key.formationId);
+		values[1] = Int64GetDatum(formation->nodeCount);
+		values[2] = Int64GetDatum(formation->groupCount);
+		values[3] = Int64GetDatum(formation->groupsInFailover);
+		values[4] = Int64GetDatum(formation->groupsWithoutHealthySecondary);
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/fleet_summary.h
+ *
+ * Declarations for the shared memory counters that summarize the nodes and
+ * groups of all the formations of the monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "node_metadata.h"
+
+
+/* how many databases can have their counters maintained in shared memory */
+#define FLEET_SUMMARY_MAX_DATABASES 8
+
+
+extern void InitializeFleetSummary(void);
+
+extern void FleetSummaryApplyNodeChange(int64 nodeId, AutoFailoverNode *newNode);
+extern void FleetSummaryInvalidateDatabase(Oid databaseId);
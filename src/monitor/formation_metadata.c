@@ -15,9 +15,11 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 
+#include "discovery_cache.h"
 #include "health_check.h"
 #include "metadata.h"
 #include "formation_metadata.h"
+#include "node_cache.h"
 #include "node_metadata.h"
 #include "notifications.h"
 
@@ -25,6 +27,7 @@
 #include "access/xlogdefs.h"
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
+#include "lib/stringinfo.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
@@ -38,10 +41,20 @@ PG_FUNCTION_INFO_V1(drop_formation);
 PG_FUNCTION_INFO_V1(enable_secondary);
 PG_FUNCTION_INFO_V1(disable_secondary);
 PG_FUNCTION_INFO_V1(set_formation_number_sync_standbys);
+PG_FUNCTION_INFO_V1(formation_uri);
 
 Datum AutoFailoverFormationGetDatum(FunctionCallInfo fcinfo,
 									AutoFailoverFormation *formation);
 
+/* see node_active_protocol.c */
+extern Datum synchronous_standby_names(PG_FUNCTION_ARGS);
+
+/* GUC variable: push number_sync_standbys changes to the primary directly */
+bool EnableDirectSettings = false;
+
+static void RecordPushedSettings(int64 nodeId,
+								 const char *synchronousStandbyNames);
+
 /*
  * GetFormation returns an AutoFailoverFormation structure with the formationId
  * and its kind, when the formation has already been created, or NULL
@@ -532,6 +545,13 @@ IsCitusFormation(AutoFailoverFormation *formation)
 /*
  * set_formation_number_sync_standbys sets number_sync_standbys property of a
  * formation. The function returns true on success.
+ *
+ * The primary node is then assigned apply_settings, so that its keeper
+ * fetches and applies the new synchronous_standby_names value. When
+ * pgautofailover.enable_direct_settings is on and the primary is in the
+ * primary state, we rather push the new value in the state notification of
+ * the primary, and its keeper applies it with a reload as soon as it's
+ * notified, without going through apply_settings.
  */
 Datum
 set_formation_number_sync_standbys(PG_FUNCTION_ARGS)
@@ -624,6 +644,30 @@ set_formation_number_sync_standbys(PG_FUNCTION_ARGS)
 	/* SetFormationNumberSyncStandbys reports ERROR when returning false */
 	bool success = SetFormationNumberSyncStandbys(formationId, number_sync_standbys);
 
+	if (EnableDirectSettings &&
+		IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
+	{
+		Datum standbyNamesDatum =
+			DirectFunctionCall2(synchronous_standby_names,
+								CStringGetTextDatum(formationId),
+								Int32GetDatum(groupId));
+		char *standbyNames = TextDatumGetCString(standbyNamesDatum);
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Pushing synchronous_standby_names '%s' to " NODE_FORMAT
+			" after updating number_sync_standbys to %d for formation %s.",
+			standbyNames,
+			NODE_FORMAT_ARGS(primaryNode),
+			formation->number_sync_standbys,
+			formation->formationId);
+
+		RecordPushedSettings(primaryNode->nodeId, standbyNames);
+		NotifySettingsChange(primaryNode, message, standbyNames);
+
+		PG_RETURN_BOOL(success);
+	}
+
 	/* and now ask the primary to change its settings */
 	LogAndNotifyMessage(
 		message, BUFSIZE,
@@ -733,6 +777,193 @@ SetFormationNumberSyncStandbys(const char *formationId, int numberSyncStandbys)
 }
 
 
+/*
+ * RecordPushedSettings keeps the synchronous_standby_names value that we push
+ * to the given primary node in its state notification, so that the next
+ * node_active call of that node returns it too, see TakePushedSettings.
+ */
+static void
+RecordPushedSettings(int64 nodeId, const char *synchronousStandbyNames)
+{
+	Oid argTypes[] = {
+		INT8OID,     /* nodeid */
+		TEXTOID      /* synchronous_standby_names */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId),                        /* nodeid */
+		CStringGetTextDatum(synchronousStandbyNames)  /* synchronous_standby_names */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *upsertQuery =
+		"INSERT INTO " AUTO_FAILOVER_PUSHED_SETTINGS_TABLE
+		" (nodeid, synchronous_standby_names) VALUES ($1, $2) "
+		"ON CONFLICT (nodeid) DO UPDATE "
+		"SET synchronous_standby_names = excluded.synchronous_standby_names, "
+		"pushtime = now()";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+	SPI_finish();
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_PUSHED_SETTINGS_TABLE);
+	}
+}
+
+
+/*
+ * TakePushedSettings returns the synchronous_standby_names value that was
+ * pushed to the given node and forgets about it, or NULL when there is none.
+ */
+char *
+TakePushedSettings(int64 nodeId)
+{
+	MemoryContext callerContext = CurrentMemoryContext;
+	char *synchronousStandbyNames = NULL;
+
+	Oid argTypes[] = {
+		INT8OID      /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)    /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *deleteQuery =
+		"DELETE FROM " AUTO_FAILOVER_PUSHED_SETTINGS_TABLE
+		" WHERE nodeid = $1 "
+		"RETURNING synchronous_standby_names";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(deleteQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_DELETE_RETURNING)
+	{
+		elog(ERROR, "could not delete from " AUTO_FAILOVER_PUSHED_SETTINGS_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum standbyNamesDatum = SPI_getbinval(SPI_tuptable->vals[0],
+												SPI_tuptable->tupdesc,
+												1, &isNull);
+
+		MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+		synchronousStandbyNames = TextDatumGetCString(standbyNamesDatum);
+		MemoryContextSwitchTo(spiContext);
+	}
+
+	SPI_finish();
+
+	return synchronousStandbyNames;
+}
+
+
+/*
+ * formation_uri returns a connection string to the nodes of the given
+ * cluster of a formation, or NULL when the cluster has no nodes.
+ *
+ * Applications and service discovery layers call this function very often,
+ * so the answer is kept in the discovery cache until the next topology
+ * change. The formation dbname is only set when registering the first node
+ * of the formation, in the same transaction that changes the topology.
+ */
+Datum
+formation_uri(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+	char *clusterName = text_to_cstring(PG_GETARG_TEXT_P(1));
+	char *sslMode = text_to_cstring(PG_GETARG_TEXT_P(2));
+	char *sslRootCert = text_to_cstring(PG_GETARG_TEXT_P(3));
+	char *sslCrl = text_to_cstring(PG_GETARG_TEXT_P(4));
+
+	char *uri = NULL;
+
+	if (!DiscoveryCacheLookupFormationURI(formationId, clusterName, sslMode,
+										  sslRootCert, sslCrl, &uri))
+	{
+		/* read the generation first, a concurrent change then misses */
+		uint64 generation = NodeCacheGetTopologyGeneration();
+
+		AutoFailoverFormation *formation = GetFormation(formationId);
+		List *groupNodeList = NIL;
+		ListCell *nodeCell = NULL;
+		StringInfoData hosts;
+		int nodeCount = 0;
+
+		if (formation != NULL)
+		{
+			groupNodeList = AutoFailoverAllNodesInGroup(formationId, 0);
+		}
+
+		initStringInfo(&hosts);
+
+		foreach(nodeCell, groupNodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (strcmp(node->nodeCluster, clusterName) != 0)
+			{
+				continue;
+			}
+
+			appendStringInfo(&hosts, "%s%s:%d",
+							 nodeCount == 0 ? "" : ",",
+							 node->nodeHost, node->nodePort);
+			++nodeCount;
+		}
+
+		if (nodeCount > 0)
+		{
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "postgres://%s/%s?%ssslmode=%s",
+							 hosts.data,
+							 formation->dbname,
+							 strcmp(clusterName, "default") == 0
+							 ? "target_session_attrs=read-write&" : "",
+							 sslMode);
+
+			if (strcmp(sslRootCert, "") != 0)
+			{
+				appendStringInfo(&buf, "&sslrootcert=%s", sslRootCert);
+			}
+
+			if (strcmp(sslCrl, "") != 0)
+			{
+				appendStringInfo(&buf, "&sslcrl=%s", sslCrl);
+			}
+
+			uri = buf.data;
+		}
+
+		DiscoveryCacheStoreFormationURI(formationId, clusterName, sslMode,
+										sslRootCert, sslCrl, uri, generation);
+	}
+
+	if (uri == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text(uri));
+}
+
+
 /*
  * AutoFailoverFormationGetDatum prepares a Datum from given formation.
  * Caller is expected to provide fcinfo structure that contains compatible
@@ -44,6 +44,9 @@ typedef struct AutoFailoverFormation
 } AutoFailoverFormation;
 
 
+/* GUC variable: push number_sync_standbys changes to the primary directly */
+extern bool EnableDirectSettings;
+
 /* public function declarations */
 extern AutoFailoverFormation * GetFormation(const char *formationId);
 extern void AddFormation(const char *formationId, FormationKind kind, Name dbname,
@@ -61,6 +64,7 @@ extern bool FormationNumSyncStandbyIsValid(AutoFailoverFormation *formation,
 
 extern bool SetFormationNumberSyncStandbys(const char *formationId,
 										   int numberSyncStandbys);
+extern char * TakePushedSettings(int64 nodeId);
 
 extern FormationKind FormationKindFromString(const char *kind);
 extern char * FormationKindToString(FormationKind kind);
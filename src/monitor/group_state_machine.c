@@ -16,11 +16,18 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 
+#include "failover_decision.h"
+#include "failure_detector.h"
 #include "formation_metadata.h"
 #include "group_state_machine.h"
 #include "node_metadata.h"
 #include "notifications.h"
+#include "protocol_stats.h"
+#include "replay_progress.h"
 #include "replication_state.h"
+#include "storage_health.h"
+#include "sync_quorum.h"
+#include "sync_rep_stall.h"
 #include "version_compat.h"
 
 #include "access/htup_details.h"
@@ -57,6 +64,10 @@ static bool ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 										   AutoFailoverNode *primaryNode);
 static bool ProceedWithMSFailover(AutoFailoverNode *activeNode,
 								  AutoFailoverNode *candidateNode);
+static AutoFailoverNode * SelectPreRankedCandidateNode(List *nodesGroupList,
+													   AutoFailoverNode *primaryNode,
+													   AutoFailoverFormation *formation);
+static bool ConfirmPreRankedCandidateNode(AutoFailoverNode *candidateNode);
 
 static bool BuildCandidateList(List *standbyNodesGroupList,
 							   CandidateList *candidateList);
@@ -77,6 +88,11 @@ static bool WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 static bool IsHealthy(AutoFailoverNode *pgAutoFailoverNode);
 static bool IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode);
 static bool IsReporting(AutoFailoverNode *pgAutoFailoverNode);
+static bool KeeperStoppedReporting(AutoFailoverNode *pgAutoFailoverNode,
+								   TimestampTz now);
+static bool NodeUpstreamHasChanged(AutoFailoverNode *node);
+static int ProceedJoiningStandbyNodes(AutoFailoverNode *primaryNode,
+									  AutoFailoverNode *activeNode);
 
 /* GUC variables */
 int EnableSyncXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
@@ -84,6 +100,11 @@ int PromoteXlogThreshold = DEFAULT_XLOG_SEG_SIZE;
 int DrainTimeoutMs = 30 * 1000;
 int UnhealthyTimeoutMs = 20 * 1000;
 int StartupGracePeriodMs = 10 * 1000;
+bool EnableFastFailoverElection = true;
+bool EnableParallelStandbyJoin = true;
+bool EnableBaseBackupFromStandby = true;
+int SteadyReportIntervalMs = 5 * 1000;
+int TransitionReportIntervalMs = 500;
 
 
 /*
@@ -101,6 +122,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	List *nodesGroupList = AutoFailoverNodeGroup(formationId, groupId);
 	int nodesCount = list_length(nodesGroupList);
 
+	ProtocolStatsCountStateMachineRun();
+
 	if (formation == NULL)
 	{
 		ereport(ERROR,
@@ -345,6 +368,9 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		/* start replication */
 		AssignGoalState(activeNode, REPLICATION_STATE_CATCHINGUP, message);
 
+		/* other standby nodes waiting for the primary can start too */
+		(void) ProceedJoiningStandbyNodes(primaryNode, activeNode);
+
 		return true;
 	}
 
@@ -359,6 +385,9 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 	 * state to PRIMARY includes that edit. If the primary already is in the
 	 * primary state, we assign APPLY_SETTINGS to it to make sure its
 	 * repication settings are updated now.
+	 *
+	 * A standby node degraded after a synchronous replication stall is kept
+	 * in catchingup for a while, see SyncRepStallIsHeld().
 	 */
 	if (IsCurrentState(activeNode, REPLICATION_STATE_CATCHINGUP) &&
 		(IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) ||
@@ -366,7 +395,8 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY)) &&
 		IsHealthy(activeNode) &&
 		activeNode->reportedTLI == primaryNode->reportedTLI &&
-		WalDifferenceWithin(activeNode, primaryNode, EnableSyncXlogThreshold))
+		WalDifferenceWithin(activeNode, primaryNode, EnableSyncXlogThreshold) &&
+		!SyncRepStallIsHeld(activeNode, GetCurrentTimestamp()))
 	{
 		char message[BUFSIZE] = { 0 };
 
@@ -379,6 +409,37 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		/* node is ready for promotion */
 		AssignGoalState(activeNode, REPLICATION_STATE_SECONDARY, message);
 
+		/* other standby nodes that caught up too are ready as well */
+		(void) ProceedJoiningStandbyNodes(primaryNode, activeNode);
+
+		return true;
+	}
+
+	/*
+	 * when a cascading secondary should stream from another node:
+	 *      secondary -> catchingup
+	 *
+	 * The secondary follows its configured upstream node when that node is a
+	 * healthy secondary, and the primary otherwise. Going through CATCHINGUP
+	 * has the keeper edit primary_conninfo and wait until the node caught up
+	 * again before it's a failover candidate again.
+	 */
+	if (IsCurrentState(activeNode, REPLICATION_STATE_SECONDARY) &&
+		(IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) ||
+		 IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY)) &&
+		IsHealthy(primaryNode) && IsHealthy(activeNode) &&
+		NodeUpstreamHasChanged(activeNode))
+	{
+		char message[BUFSIZE] = { 0 };
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of " NODE_FORMAT
+			" to catchingup to switch to a new upstream node.",
+			NODE_FORMAT_ARGS(activeNode));
+
+		AssignGoalState(activeNode, REPLICATION_STATE_CATCHINGUP, message);
+
 		return true;
 	}
 
@@ -499,14 +560,23 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		IsCitusFormation(formation) && activeNode->groupId > 0)
 	{
 		char message[BUFSIZE];
+		long secs = 0;
+		int usecs = 0;
+
+		/* stateChangeTime is when the node reached prepare_promotion */
+		TimestampDifference(activeNode->stateChangeTime,
+							GetCurrentTimestamp(),
+							&secs, &usecs);
 
 		LogAndNotifyMessage(
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
-			" to demoted after the coordinator metadata was updated.",
+			" to demoted after the coordinator metadata was updated "
+			"in %ld.%03d s.",
 			NODE_FORMAT_ARGS(activeNode),
-			NODE_FORMAT_ARGS(primaryNode));
+			NODE_FORMAT_ARGS(primaryNode),
+			secs, usecs / 1000);
 
 		/* node is now taking writes */
 		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
@@ -635,14 +705,23 @@ ProceedGroupState(AutoFailoverNode *activeNode)
 		IsCitusFormation(formation) && activeNode->groupId > 0)
 	{
 		char message[BUFSIZE];
+		long secs = 0;
+		int usecs = 0;
+
+		/* stateChangeTime is when the node reached stop_replication */
+		TimestampDifference(activeNode->stateChangeTime,
+							GetCurrentTimestamp(),
+							&secs, &usecs);
 
 		LogAndNotifyMessage(
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
 			" to wait_primary and " NODE_FORMAT
-			" to demoted after the coordinator metadata was updated.",
+			" to demoted after the coordinator metadata was updated "
+			"in %ld.%03d s.",
 			NODE_FORMAT_ARGS(activeNode),
-			NODE_FORMAT_ARGS(primaryNode));
+			NODE_FORMAT_ARGS(primaryNode),
+			secs, usecs / 1000);
 
 		/* node is now taking writes */
 		AssignGoalState(activeNode, REPLICATION_STATE_WAIT_PRIMARY, message);
@@ -788,6 +867,18 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 	List *otherNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
 	int otherNodesCount = list_length(otherNodesGroupList);
 
+	/*
+	 * when the primary is ready for replication, every standby node that is
+	 * waiting for it or that has caught up makes progress in the same pass:
+	 *
+	 *  wait_standby -> catchingup
+	 *    catchingup -> secondary
+	 */
+	if (ProceedJoiningStandbyNodes(primaryNode, NULL) > 0)
+	{
+		return true;
+	}
+
 	/*
 	 * when a first "other" node wants to become standby:
 	 *  single -> wait_primary
@@ -928,6 +1019,26 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 				AssignGoalState(otherNode,
 								REPLICATION_STATE_CATCHINGUP, message);
 			}
+			else if (otherNode->goalState == REPLICATION_STATE_SECONDARY &&
+					 IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY) &&
+					 NodeWalReceiverIsStalled(otherNode, primaryNode,
+											  GetCurrentTimestamp()))
+			{
+				char message[BUFSIZE];
+
+				--secondaryNodesCount;
+				--secondaryQuorumNodesCount;
+
+				LogAndNotifyMessage(
+					message, BUFSIZE,
+					"Setting goal state of " NODE_FORMAT
+					" to catchingup after its WAL receiver stalled.",
+					NODE_FORMAT_ARGS(otherNode));
+
+				/* the lag is going to grow, don't wait for it */
+				AssignGoalState(otherNode,
+								REPLICATION_STATE_CATCHINGUP, message);
+			}
 			else if (!IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY))
 			{
 				--secondaryNodesCount;
@@ -1060,6 +1171,35 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 			return true;
 		}
 
+		/*
+		 * when a secondary node lags behind, or caught up after that:
+		 *     primary ➜ apply_settings
+		 *
+		 * The monitor leaves the secondary nodes that lag too much out of
+		 * synchronous_standby_names, so that they don't hold back the
+		 * commits, and adds them back once they caught up, see
+		 * pgautofailover.sync_quorum_exclude_lag_threshold.
+		 */
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) &&
+			ProceedSyncQuorumExclusion(formation,
+									   primaryNode,
+									   otherNodesGroupList))
+		{
+			char message[BUFSIZE] = { 0 };
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to apply_settings after updating the synchronous "
+				"replication quorum.",
+				NODE_FORMAT_ARGS(primaryNode));
+
+			AssignGoalState(primaryNode,
+							REPLICATION_STATE_APPLY_SETTINGS, message);
+
+			return true;
+		}
+
 		/*
 		 * when a node has changed its replication settings:
 		 *     apply_settings ➜ wait_primary
@@ -1142,11 +1282,21 @@ ProceedGroupStateForPrimaryNode(AutoFailoverNode *primaryNode)
 		if (allSecondariesAreHealthy)
 		{
 			char message[BUFSIZE] = { 0 };
+			long secs = 0;
+			int usecs = 0;
+
+			/* stateChangeTime is when the primary reached join_primary */
+			TimestampDifference(primaryNode->stateChangeTime,
+								GetCurrentTimestamp(),
+								&secs, &usecs);
 
 			LogAndNotifyMessage(
 				message, BUFSIZE,
-				"Setting goal state of " NODE_FORMAT " to primary",
-				NODE_FORMAT_ARGS(primaryNode));
+				"Setting goal state of " NODE_FORMAT " to primary "
+				"after %d standby nodes joined in %ld.%03d s",
+				NODE_FORMAT_ARGS(primaryNode),
+				otherNodesCount,
+				secs, usecs / 1000);
 
 			AssignGoalState(primaryNode, REPLICATION_STATE_PRIMARY, message);
 
@@ -1256,6 +1406,45 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 
 	candidateList.numberSyncStandbys = formation->number_sync_standbys;
 
+	/*
+	 * When the failover is only beginning, we might already know which node
+	 * is going to win the election, from the LSN positions reported while the
+	 * primary was still around. The pre-ranked candidate then skips the
+	 * REPORT_LSN step and goes to PREPARE_PROMOTION right away, while the
+	 * other standby nodes still report their LSN: the candidate waits for
+	 * them in PREPARE_PROMOTION before being promoted.
+	 */
+	if (nodeBeingPromoted == NULL)
+	{
+		AutoFailoverNode *preRankedNode =
+			SelectPreRankedCandidateNode(nodesGroupList, primaryNode, formation);
+
+		if (preRankedNode != NULL)
+		{
+			char message[BUFSIZE] = { 0 };
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to prepare_promotion after " NODE_FORMAT
+				" became unhealthy, the standby node is the most advanced "
+				"failover candidate with reported LSN %X/%X",
+				NODE_FORMAT_ARGS(preRankedNode),
+				NODE_FORMAT_ARGS(primaryNode),
+				(uint32) (preRankedNode->reportedLSN >> 32),
+				(uint32) preRankedNode->reportedLSN);
+
+			AssignGoalState(preRankedNode,
+							REPLICATION_STATE_PREPARE_PROMOTION,
+							message);
+
+			/* now have the other standby nodes report their LSN */
+			BuildCandidateList(nodesGroupList, &candidateList);
+
+			return true;
+		}
+	}
+
 	BuildCandidateList(nodesGroupList, &candidateList);
 
 	/*
@@ -1269,7 +1458,16 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 	 * candidate (thanks to the FSM transition secondary -> report_lsn), and
 	 * now we need to select one of the failover candidates.
 	 */
-	if (candidateList.missingNodesCount > 0)
+	FailoverElection election = { 0 };
+
+	election.candidateCount = candidateList.candidateCount;
+	election.quorumCandidateCount = candidateList.quorumCandidateCount;
+	election.missingNodesCount = candidateList.missingNodesCount;
+	election.numberSyncStandbys = formation->number_sync_standbys;
+
+	FailoverDecision decision = CheckFailoverElection(&election);
+
+	if (decision == FAILOVER_DECISION_WAIT_REPORTS)
 	{
 		char message[BUFSIZE] = { 0 };
 
@@ -1301,13 +1499,13 @@ ProceedGroupStateForMSFailover(AutoFailoverNode *activeNode,
 	int minCandidates = formation->number_sync_standbys + 1;
 
 	/* no candidates is a hard pass */
-	if (candidateList.candidateCount == 0)
+	if (decision == FAILOVER_DECISION_NO_CANDIDATE)
 	{
 		return false;
 	}
 
 	/* not enough candidates to promote and then accept writes, pass */
-	else if (candidateList.quorumCandidateCount < minCandidates)
+	else if (decision == FAILOVER_DECISION_NOT_ENOUGH_QUORUM)
 	{
 		char message[BUFSIZE] = { 0 };
 
@@ -1576,6 +1774,18 @@ ProceedWithMSFailover(AutoFailoverNode *activeNode,
 {
 	Assert(candidateNode != NULL);
 
+	/*
+	 * A candidate that reached PREPARE_PROMOTION without going through
+	 * REPORT_LSN first needs to wait until the other standby nodes have
+	 * reported their LSN, and then still be the most advanced of them.
+	 */
+	if (activeNode->nodeId == candidateNode->nodeId &&
+		IsCurrentState(activeNode, REPLICATION_STATE_PREPARE_PROMOTION) &&
+		!ConfirmPreRankedCandidateNode(activeNode))
+	{
+		return true;
+	}
+
 	/*
 	 * When the activeNode is "just" another standby which did REPORT LSN, we
 	 * stop replication as soon as possible, and later follow the new primary,
@@ -1604,6 +1814,210 @@ ProceedWithMSFailover(AutoFailoverNode *activeNode,
 }
 
 
+/*
+ * SelectPreRankedCandidateNode returns the standby node that is going to win
+ * the failover election anyway, when we can tell that from the LSN positions
+ * reported before the failover began, or NULL.
+ *
+ * The REPORT_LSN step disconnects every standby node from the primary, and
+ * the election waits until they have all done so, which costs a couple of
+ * keeper rounds and a restart of Postgres on the future primary. The
+ * election is conservative here and requires that:
+ *
+ *  - all the standby nodes are still secondary nodes, healthy, and have
+ *    reported their LSN recently enough,
+ *
+ *  - the candidate has the highest candidate priority, without a tie, and
+ *    has the most advanced LSN (including the replication statistics that
+ *    the primary node reported last),
+ *
+ *  - the candidate is within pgautofailover.promote_wal_log_threshold of the
+ *    primary, and enough nodes participate in the quorum.
+ *
+ * The other standby nodes still report their LSN, and the candidate then
+ * waits in PREPARE_PROMOTION until ConfirmPreRankedCandidateNode is satisfied.
+ */
+static AutoFailoverNode *
+SelectPreRankedCandidateNode(List *nodesGroupList,
+							 AutoFailoverNode *primaryNode,
+							 AutoFailoverFormation *formation)
+{
+	AutoFailoverNode *selectedNode = NULL;
+	ListCell *nodeCell = NULL;
+
+	int quorumCandidateCount = 0;
+	int minCandidates = formation->number_sync_standbys + 1;
+
+	TimestampTz now = GetCurrentTimestamp();
+
+	if (!EnableFastFailoverElection || primaryNode == NULL)
+	{
+		return NULL;
+	}
+
+	(void) ApplyReplicationStats(nodesGroupList);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->nodeId == primaryNode->nodeId)
+		{
+			continue;
+		}
+
+		/* a node in maintenance does not take part in the election */
+		if (IsInMaintenance(node))
+		{
+			continue;
+		}
+
+		if (!IsCurrentState(node, REPLICATION_STATE_SECONDARY) ||
+			!IsHealthy(node) ||
+			TimestampDifferenceExceeds(node->walReportTime, now,
+									   UnhealthyTimeoutMs))
+		{
+			return NULL;
+		}
+
+		/* perform_promotion is handled in the main election code path */
+		if (node->candidatePriority > MAX_USER_DEFINED_CANDIDATE_PRIORITY)
+		{
+			return NULL;
+		}
+
+		if (node->replicationQuorum || formation->number_sync_standbys == 0)
+		{
+			++quorumCandidateCount;
+		}
+
+		if (node->candidatePriority == 0)
+		{
+			continue;
+		}
+
+		if (selectedNode == NULL ||
+			node->candidatePriority > selectedNode->candidatePriority)
+		{
+			selectedNode = node;
+		}
+		else if (node->candidatePriority == selectedNode->candidatePriority)
+		{
+			/* a tie on priority is decided by the LSN, wait for them */
+			return NULL;
+		}
+	}
+
+	if (selectedNode == NULL || quorumCandidateCount < minCandidates)
+	{
+		return NULL;
+	}
+
+	/* the selected node must have all the WAL that we know of */
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->nodeId == primaryNode->nodeId ||
+			IsInMaintenance(node))
+		{
+			continue;
+		}
+
+		if (node->reportedTLI != selectedNode->reportedTLI ||
+			node->reportedLSN > selectedNode->reportedLSN)
+		{
+			return NULL;
+		}
+	}
+
+	if (!WalDifferenceWithin(selectedNode, primaryNode, PromoteXlogThreshold))
+	{
+		return NULL;
+	}
+
+	return selectedNode;
+}
+
+
+/*
+ * ConfirmPreRankedCandidateNode returns true when the given candidate node,
+ * which has reached PREPARE_PROMOTION, can go on with its promotion: all the
+ * other standby nodes that were asked to report their LSN did so, and none of
+ * them has received more WAL than the candidate.
+ *
+ * When a node got more WAL than the pre-ranked candidate, the candidate is
+ * sent to REPORT_LSN, and the regular election takes over.
+ */
+static bool
+ConfirmPreRankedCandidateNode(AutoFailoverNode *candidateNode)
+{
+	ListCell *nodeCell = NULL;
+
+	List *nodesGroupList =
+		AutoFailoverNodeGroup(candidateNode->formationId,
+							  candidateNode->groupId);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->nodeId == candidateNode->nodeId ||
+			node->goalState != REPLICATION_STATE_REPORT_LSN)
+		{
+			continue;
+		}
+
+		/* only the nodes in the quorum are required to report, as usual */
+		if (node->reportedState != REPLICATION_STATE_REPORT_LSN &&
+			!node->replicationQuorum &&
+			IsUnhealthy(node) && !IsReporting(node))
+		{
+			continue;
+		}
+
+		if (node->reportedState != REPLICATION_STATE_REPORT_LSN)
+		{
+			char message[BUFSIZE] = { 0 };
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Failover candidate " NODE_FORMAT
+				" is waiting for " NODE_FORMAT
+				" to report its LSN before promotion",
+				NODE_FORMAT_ARGS(candidateNode),
+				NODE_FORMAT_ARGS(node));
+
+			return false;
+		}
+
+		if (node->reportedTLI == candidateNode->reportedTLI &&
+			node->reportedLSN > candidateNode->reportedLSN)
+		{
+			char message[BUFSIZE] = { 0 };
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to report_lsn: " NODE_FORMAT
+				" reported LSN %X/%X, which is more advanced than %X/%X",
+				NODE_FORMAT_ARGS(candidateNode),
+				NODE_FORMAT_ARGS(node),
+				(uint32) (node->reportedLSN >> 32),
+				(uint32) node->reportedLSN,
+				(uint32) (candidateNode->reportedLSN >> 32),
+				(uint32) candidateNode->reportedLSN);
+
+			AssignGoalState(candidateNode, REPLICATION_STATE_REPORT_LSN, message);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
 /*
  * SelectFailoverCandidateNode returns the candidate to failover to when we
  * have one already.
@@ -1626,76 +2040,51 @@ static AutoFailoverNode *
 SelectFailoverCandidateNode(CandidateList *candidateList,
 							AutoFailoverNode *primaryNode)
 {
-	/*
-	 * Build the list of failover candidate nodes, ordered by priority.
-	 * Nodes with candidatePriority == 0 are skipped in GroupListCandidates.
-	 */
-	List *sortedCandidateNodesGroupList =
-		GroupListCandidates(candidateList->candidateNodesGroupList);
-
 	/* it's only one of the most advanced nodes, a reference to compare LSN */
 	AutoFailoverNode *mostAdvancedNode =
 		(AutoFailoverNode *) linitial(candidateList->mostAdvancedNodesGroupList);
 
-	/* the goal in this function is to find this one */
-	AutoFailoverNode *selectedNode = NULL;
-
+	FailoverElection election = { 0 };
 	ListCell *nodeCell = NULL;
+	int index = 0;
+	TimestampTz now = GetCurrentTimestamp();
 
-	/*
-	 * We refuse to orchestrate a failover that would have us lose more data
-	 * than is configured on the monitor. Both when using sync and async
-	 * replication we have the same situation that could happen, where the most
-	 * advanced standby node in the system is lagging behind the primary and
-	 * promoting it would incur data loss.
-	 *
-	 * In sync replication, that happens when the primary has been waiting for
-	 * a large chunk of WAL bytes to be reported. In async, the only difference
-	 * is that the primary did not wait.
-	 *
-	 * In terms of client-side guarantees, it's a big difference. In term of
-	 * data durability, it's the same thing.
-	 *
-	 * For this situation to change, users will have to either re-live the
-	 * unhealthy primary or change the
-	 * pgautofailover.enable_sync_wal_log_threshold GUC to a larger value and
-	 * thus explicitely accept data loss.
-	 */
-	if (primaryNode &&
-		!WalDifferenceWithin(mostAdvancedNode, primaryNode, PromoteXlogThreshold))
+	election.candidateCount = candidateList->candidateCount;
+	election.candidates =
+		(FailoverCandidate *) palloc0(Max(candidateList->candidateCount, 1) *
+									  sizeof(FailoverCandidate));
+
+	/* all the candidates are now in the REPORT_LSN state */
+	foreach(nodeCell, candidateList->candidateNodesGroupList)
 	{
-		char message[BUFSIZE] = { 0 };
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		FailoverCandidate *candidate = &(election.candidates[index++]);
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"One of the most advanced standby nodes in the group "
-			"is " NODE_FORMAT
-			"with reported LSN %X/%X, which is more than "
-			"pgautofailover.enable_sync_wal_log_threshold (%d) behind "
-			"the primary " NODE_FORMAT
-			", which has reported %X/%X",
-			NODE_FORMAT_ARGS(mostAdvancedNode),
-			(uint32) (mostAdvancedNode->reportedLSN >> 32),
-			(uint32) mostAdvancedNode->reportedLSN,
-			PromoteXlogThreshold,
-			NODE_FORMAT_ARGS(primaryNode),
-			(uint32) (primaryNode->reportedLSN >> 32),
-			(uint32) primaryNode->reportedLSN);
+		candidate->nodeId = node->nodeId;
+		candidate->candidatePriority = GetEffectiveCandidatePriority(node);
+		candidate->replicationQuorum = node->replicationQuorum;
+		candidate->isHealthy = IsHealthy(node);
+		candidate->isUnhealthy = IsUnhealthy(node);
+		candidate->reportedLSN = node->reportedLSN;
 
-		return NULL;
-	}
+		if (PromoteReplayTimeThresholdMs > 0)
+		{
+			(void) GetNodeReplayProgress(node->nodeId, now,
+										 &(candidate->replayLSN),
+										 &(candidate->applyRate));
+		}
 
-	/*
-	 * Select the node to be promoted: we can pick any candidate with the
-	 * max priority, so we pick the one with the most advanced LSN among
-	 * those having max(candidate priority).
-	 */
-	foreach(nodeCell, sortedCandidateNodesGroupList)
-	{
-		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		if (candidate->candidatePriority != node->candidatePriority)
+		{
+			elog(LOG, "Using candidate priority %d rather than %d for "
+				 NODE_FORMAT " because of its network latency to the "
+				 "application anchors",
+				 candidate->candidatePriority,
+				 node->candidatePriority,
+				 NODE_FORMAT_ARGS(node));
+		}
 
-		/* all the candidates are now in the REPORT_LSN state */
-		if (IsUnhealthy(node))
+		if (candidate->candidatePriority > 0 && candidate->isUnhealthy)
 		{
 			char message[BUFSIZE];
 
@@ -1704,59 +2093,108 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 				"Not selecting failover candidate " NODE_FORMAT
 				"because it is unhealthy",
 				NODE_FORMAT_ARGS(node));
-
-			continue;
 		}
-		else
-		{
-			int cPriority = node->candidatePriority;
-			XLogRecPtr cLSN = node->reportedLSN;
+	}
 
-			if (selectedNode == NULL)
-			{
-				selectedNode = node;
-			}
-			else if (cPriority == selectedNode->candidatePriority &&
-					 cLSN > selectedNode->reportedLSN)
-			{
-				selectedNode = node;
-			}
-			else if (cPriority < selectedNode->candidatePriority)
-			{
-				/*
-				 * Short circuit the loop, as we scan in decreasing
-				 * priority order.
-				 */
-				break;
-			}
+	election.mostAdvancedReportedLSN = candidateList->mostAdvancedReportedLSN;
+
+	foreach(nodeCell, candidateList->mostAdvancedNodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (IsHealthy(node))
+		{
+			election.someMostAdvancedNodesAreHealthy = true;
+			break;
 		}
 	}
 
 	/*
-	 * Now we may have a selectedNode. We need to check that either it has all
-	 * the WAL needed, or that at least one of the nodes with all the WAL
-	 * needed is healthy right now.
+	 * primaryNode->reportedLSN is zero until it has reported, in which case
+	 * FailoverWalDifferenceWithin() refuses the failover, as did
+	 * WalDifferenceWithin().
 	 */
-	if (selectedNode &&
-		selectedNode->reportedLSN < candidateList->mostAdvancedReportedLSN)
-	{
-		bool someMostAdvancedStandbysAreHealthy = false;
+	election.hasPrimary = primaryNode != NULL;
+	election.primaryReportedLSN = primaryNode ? primaryNode->reportedLSN : 0;
+	election.promoteXlogThreshold = PromoteXlogThreshold;
+	election.replayTimeThresholdMs = PromoteReplayTimeThresholdMs;
 
-		foreach(nodeCell, candidateList->mostAdvancedNodesGroupList)
-		{
-			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+	int selectedIndex = -1;
+	FailoverDecision decision = SelectFailoverCandidate(&election, &selectedIndex);
 
-			if (IsHealthy(node))
+	switch (decision)
+	{
+		case FAILOVER_DECISION_SELECTED:
+		{
+			AutoFailoverNode *selectedNode =
+				(AutoFailoverNode *) list_nth(candidateList->candidateNodesGroupList,
+											  selectedIndex);
+			int64 readyTimeMs =
+				FailoverCandidateReadyTimeMs(&election,
+											 &(election.candidates[selectedIndex]));
+
+			if (election.replayTimeThresholdMs > 0 && readyTimeMs >= 0)
 			{
-				someMostAdvancedStandbysAreHealthy = true;
-				break;
+				elog(LOG, "Selected failover candidate " NODE_FORMAT
+					 " is expected to replay WAL up to %X/%X in %lld ms",
+					 NODE_FORMAT_ARGS(selectedNode),
+					 (uint32) (election.mostAdvancedReportedLSN >> 32),
+					 (uint32) election.mostAdvancedReportedLSN,
+					 (long long) readyTimeMs);
 			}
+
+			pfree(election.candidates);
+
+			return selectedNode;
 		}
 
-		if (!someMostAdvancedStandbysAreHealthy)
+		/*
+		 * In sync replication, that happens when the primary has been waiting
+		 * for a large chunk of WAL bytes to be reported. In async, the only
+		 * difference is that the primary did not wait.
+		 *
+		 * In terms of client-side guarantees, it's a big difference. In term
+		 * of data durability, it's the same thing.
+		 *
+		 * For this situation to change, users will have to either re-live the
+		 * unhealthy primary or change the
+		 * pgautofailover.enable_sync_wal_log_threshold GUC to a larger value and
+		 * thus explicitely accept data loss.
+		 */
+		case FAILOVER_DECISION_DATA_LOSS:
 		{
 			char message[BUFSIZE] = { 0 };
 
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"One of the most advanced standby nodes in the group "
+				"is " NODE_FORMAT
+				"with reported LSN %X/%X, which is more than "
+				"pgautofailover.enable_sync_wal_log_threshold (%d) behind "
+				"the primary " NODE_FORMAT
+				", which has reported %X/%X",
+				NODE_FORMAT_ARGS(mostAdvancedNode),
+				(uint32) (mostAdvancedNode->reportedLSN >> 32),
+				(uint32) mostAdvancedNode->reportedLSN,
+				PromoteXlogThreshold,
+				NODE_FORMAT_ARGS(primaryNode),
+				(uint32) (primaryNode->reportedLSN >> 32),
+				(uint32) primaryNode->reportedLSN);
+
+			break;
+		}
+
+		/*
+		 * The selected node needs to fetch WAL from one of the most advanced
+		 * standby nodes, and none of them is healthy right now.
+		 */
+		case FAILOVER_DECISION_MISSING_WAL:
+		{
+			AutoFailoverNode *selectedNode =
+				(AutoFailoverNode *) list_nth(candidateList->candidateNodesGroupList,
+											  selectedIndex);
+			char message[BUFSIZE] = { 0 };
+
 			LogAndNotifyMessage(
 				message, BUFSIZE,
 				"The selected candidate " NODE_FORMAT
@@ -1770,11 +2208,21 @@ SelectFailoverCandidateNode(CandidateList *candidateList,
 				(uint32) (selectedNode->reportedLSN >> 32),
 				(uint32) selectedNode->reportedLSN);
 
-			return NULL;
+			break;
+		}
+
+		default:
+		{
+			elog(LOG, "No failover candidate selected: %s",
+				 FailoverDecisionToString(decision));
+
+			break;
 		}
 	}
 
-	return selectedNode;
+	pfree(election.candidates);
+
+	return NULL;
 }
 
 
@@ -1903,12 +2351,138 @@ AssignGoalState(AutoFailoverNode *pgAutoFailoverNode,
 }
 
 
+/*
+ * GroupStateReportInterval returns how long the keeper of the given node
+ * should wait before calling node_active() again, in milliseconds. Steady
+ * groups only need to report that nothing changed, and we keep below
+ * UnhealthyTimeoutMs so that those nodes are still seen as reporting.
+ * Groups in transition report faster, so that they make progress even when
+ * a state change notification has been missed.
+ */
+int
+GroupStateReportInterval(AutoFailoverNode *activeNode)
+{
+	if (!GroupStateIsSteady(activeNode))
+	{
+		return TransitionReportIntervalMs;
+	}
+
+	return Max(Min(SteadyReportIntervalMs, UnhealthyTimeoutMs / 4),
+			   TransitionReportIntervalMs);
+}
+
+
+/*
+ * GroupStateIsSteady returns true when ProceedGroupState has nothing to do for
+ * the group of the given node: all the nodes have reached their goal state,
+ * which is one of single (when alone in the group), primary, or secondary,
+ * and they are all healthy and reporting.
+ *
+ * It is safe to call with only a ShareLock on the group, and when it returns
+ * false the caller should take the ExclusiveLock and call ProceedGroupState.
+ */
+bool
+GroupStateIsSteady(AutoFailoverNode *activeNode)
+{
+	ListCell *nodeCell = NULL;
+
+	List *nodesGroupList =
+		AutoFailoverNodeGroup(activeNode->formationId, activeNode->groupId);
+	int nodesCount = list_length(nodesGroupList);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->goalState != node->reportedState)
+		{
+			return false;
+		}
+
+		switch (node->goalState)
+		{
+			case REPLICATION_STATE_SINGLE:
+			{
+				if (nodesCount > 1)
+				{
+					return false;
+				}
+				break;
+			}
+
+			case REPLICATION_STATE_PRIMARY:
+			case REPLICATION_STATE_SECONDARY:
+			{
+				if (nodesCount == 1)
+				{
+					return false;
+				}
+				break;
+			}
+
+			default:
+			{
+				return false;
+			}
+		}
+
+		if (!IsHealthy(node) || !IsReporting(node))
+		{
+			return false;
+		}
+	}
+
+	/* a cascading secondary might have to switch to a new upstream node */
+	if (NodeUpstreamHasChanged(activeNode))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * NodeUpstreamHasChanged returns true when the given standby node, which
+ * does not participate in the replication quorum, streams from another node
+ * than expected: its configured upstream node when that one is usable, or
+ * otherwise the primary node.
+ */
+static bool
+NodeUpstreamHasChanged(AutoFailoverNode *node)
+{
+	int64 upstreamNodeId = 0;
+	int64 streamingNodeId = 0;
+
+	/* only standby nodes out of the replication quorum may cascade */
+	if (node->replicationQuorum ||
+		!IsCurrentState(node, REPLICATION_STATE_SECONDARY))
+	{
+		return false;
+	}
+
+	if (!GetNodeUpstream(node->nodeId, &upstreamNodeId, &streamingNodeId))
+	{
+		return false;
+	}
+
+	AutoFailoverNode *upstreamNode = GetConfiguredUpstreamNode(node);
+	int64 expectedNodeId = upstreamNode != NULL ? upstreamNode->nodeId : 0;
+
+	return expectedNodeId != streamingNodeId;
+}
+
+
 /*
  * WalDifferenceWithin returns whether the most recently reported relative log
  * position of the given nodes is within the specified bound. Returns false if
  * neither node has reported a relative xlog position.
  *
  * Returns false when the nodes are not on the same reported timeline.
+ *
+ * Returns false also when the WAL receiver of the secondary node is stalled
+ * while the other node is a healthy primary: the reported LSN difference is
+ * then only going to grow.
  */
 static bool
 WalDifferenceWithin(AutoFailoverNode *secondaryNode,
@@ -1919,6 +2493,13 @@ WalDifferenceWithin(AutoFailoverNode *secondaryNode,
 		return true;
 	}
 
+	if (IsHealthy(otherNode) &&
+		NodeWalReceiverIsStalled(secondaryNode, otherNode,
+								 GetCurrentTimestamp()))
+	{
+		return false;
+	}
+
 	XLogRecPtr secondaryLsn = secondaryNode->reportedLSN;
 	XLogRecPtr otherNodeLsn = otherNode->reportedLSN;
 
@@ -1950,6 +2531,12 @@ IsHealthy(AutoFailoverNode *pgAutoFailoverNode)
 		return false;
 	}
 
+	/* Postgres accepts connections, but can't write */
+	if (NodeStorageIsStalled(pgAutoFailoverNode->nodeId, now))
+	{
+		return false;
+	}
+
 	/*
 	 * If the keeper has been reporting that Postgres is running after our last
 	 * background check run, and within the node-active protocol client-time
@@ -1979,8 +2566,9 @@ IsHealthy(AutoFailoverNode *pgAutoFailoverNode)
 
 /*
  * IsUnhealthy returns whether the given node is unhealthy, meaning it failed
- * its last health check and has not reported for more than UnhealthyTimeoutMs,
- * and it's PostgreSQL instance has been reporting as running by the keeper.
+ * its last health check and its keeper stopped reporting, or its PostgreSQL
+ * instance has been reported as not running by the keeper, or its storage
+ * as stalled.
  */
 static bool
 IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
@@ -1993,9 +2581,7 @@ IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
 	}
 
 	/* if the keeper isn't reporting, trust our Health Checks */
-	if (TimestampDifferenceExceeds(pgAutoFailoverNode->reportTime,
-								   now,
-								   UnhealthyTimeoutMs))
+	if (KeeperStoppedReporting(pgAutoFailoverNode, now))
 	{
 		if (pgAutoFailoverNode->health == NODE_HEALTH_BAD &&
 			TimestampDifferenceExceeds(PgStartTime,
@@ -2020,6 +2606,15 @@ IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
 		return true;
 	}
 
+	/*
+	 * If the keeper reports that the storage has been stalled for too long,
+	 * then the node isn't healthy either, even though Postgres is running.
+	 */
+	if (NodeStorageIsStalled(pgAutoFailoverNode->nodeId, now))
+	{
+		return true;
+	}
+
 	/* clues show that everything is fine, the node is not unhealthy */
 	return false;
 }
@@ -2027,7 +2622,7 @@ IsUnhealthy(AutoFailoverNode *pgAutoFailoverNode)
 
 /*
  * IsReporting returns whether the given node has reported recently, within the
- * UnhealthyTimeoutMs interval.
+ * UnhealthyTimeoutMs interval, and as often as it usually does.
  */
 static bool
 IsReporting(AutoFailoverNode *pgAutoFailoverNode)
@@ -2039,14 +2634,120 @@ IsReporting(AutoFailoverNode *pgAutoFailoverNode)
 		return false;
 	}
 
+	return !KeeperStoppedReporting(pgAutoFailoverNode, now);
+}
+
+
+/*
+ * KeeperStoppedReporting returns true when the keeper of the given node has
+ * not reported for more than UnhealthyTimeoutMs. When the failure detector is
+ * enabled, it also returns true as soon as the time since the last report is
+ * suspicious given the history of the node, which is usually much sooner on
+ * a steady network.
+ */
+static bool
+KeeperStoppedReporting(AutoFailoverNode *pgAutoFailoverNode, TimestampTz now)
+{
 	if (TimestampDifferenceExceeds(pgAutoFailoverNode->reportTime,
 								   now,
 								   UnhealthyTimeoutMs))
 	{
-		return false;
+		return true;
 	}
 
-	return true;
+	if (FailureDetectorPhiThreshold > 0)
+	{
+		double phi = NodeHeartbeatPhi(pgAutoFailoverNode->nodeId, now);
+
+		return phi >= FailureDetectorPhiThreshold;
+	}
+
+	return false;
+}
+
+
+/*
+ * ProceedJoiningStandbyNodes assigns the next goal state to every standby node
+ * of the group that is joining the primary, rather than only to the node that
+ * is currently calling node_active. Each standby is checked against the same
+ * rules as when it calls node_active itself, so that adding several standby
+ * nodes to a group brings them up concurrently rather than one at a time.
+ *
+ * The activeNode, when given, has already been taken care of. Returns how
+ * many nodes have been assigned a new goal state.
+ */
+static int
+ProceedJoiningStandbyNodes(AutoFailoverNode *primaryNode,
+						   AutoFailoverNode *activeNode)
+{
+	int assignedCount = 0;
+	ListCell *nodeCell = NULL;
+
+	if (!EnableParallelStandbyJoin || primaryNode == NULL ||
+		!IsHealthy(primaryNode))
+	{
+		return 0;
+	}
+
+	bool primaryIsJoining =
+		IsCurrentState(primaryNode, REPLICATION_STATE_WAIT_PRIMARY) ||
+		IsCurrentState(primaryNode, REPLICATION_STATE_JOIN_PRIMARY);
+
+	bool primaryIsReady =
+		primaryIsJoining ||
+		IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY);
+
+	if (!primaryIsReady)
+	{
+		return 0;
+	}
+
+	List *otherNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
+
+	foreach(nodeCell, otherNodesGroupList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+		char message[BUFSIZE] = { 0 };
+
+		if (activeNode != NULL && otherNode->nodeId == activeNode->nodeId)
+		{
+			continue;
+		}
+
+		if (primaryIsJoining &&
+			IsCurrentState(otherNode, REPLICATION_STATE_WAIT_STANDBY))
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to catchingup after " NODE_FORMAT
+				" converged to %s.",
+				NODE_FORMAT_ARGS(otherNode),
+				NODE_FORMAT_ARGS(primaryNode),
+				ReplicationStateGetName(primaryNode->reportedState));
+
+			AssignGoalState(otherNode, REPLICATION_STATE_CATCHINGUP, message);
+			++assignedCount;
+		}
+		else if (IsCurrentState(otherNode, REPLICATION_STATE_CATCHINGUP) &&
+				 IsHealthy(otherNode) &&
+				 otherNode->reportedTLI == primaryNode->reportedTLI &&
+				 WalDifferenceWithin(otherNode, primaryNode,
+									 EnableSyncXlogThreshold) &&
+				 !SyncRepStallIsHeld(otherNode, GetCurrentTimestamp()))
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to secondary after it caught up.",
+				NODE_FORMAT_ARGS(otherNode));
+
+			AssignGoalState(otherNode, REPLICATION_STATE_SECONDARY, message);
+			++assignedCount;
+		}
+	}
+
+	return assignedCount;
 }
 
 
@@ -36,6 +36,8 @@ typedef struct AutoFailoverNodeState
 
 /* public function declarations */
 extern bool ProceedGroupState(AutoFailoverNode *activeNode);
+extern bool GroupStateIsSteady(AutoFailoverNode *activeNode);
+extern int GroupStateReportInterval(AutoFailoverNode *activeNode);
 
 /* GUCs */
 extern int EnableSyncXlogThreshold;
@@ -43,3 +45,8 @@ extern int PromoteXlogThreshold;
 extern int DrainTimeoutMs;
 extern int UnhealthyTimeoutMs;
 extern int StartupGracePeriodMs;
+extern bool EnableFastFailoverElection;
+extern bool EnableParallelStandbyJoin;
+extern bool EnableBaseBackupFromStandby;
+extern int SteadyReportIntervalMs;
+extern int TransitionReportIntervalMs;
@@ -0,0 +1,457 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/group_state_scheduler.c
+ *
+ * Implementation of the group state scheduler, a background worker that
+ * proceeds the group state machines of a monitor database.
+ *
+ * Most of the group state machine progress happens when a keeper reports
+ * with node_active(). Some transitions only depend on the monitor though: a
+ * node that the health checks mark unhealthy, or a timeout that expires. The
+ * scheduler runs ProceedGroupState for the groups that are not steady every
+ * pgautofailover.group_state_scheduler_period, and as soon as the health
+ * check workers find a node health change, rather than wait for the next
+ * keeper to report.
+ *
+ * The scheduler also inserts the events of the event queue in the event
+ * table, when pgautofailover.event_queue_size is set.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+/* these are internal headers */
+#include "event_queue.h"
+#include "group_state_machine.h"
+#include "group_state_scheduler.h"
+#include "health_check.h"
+#include "metadata.h"
+#include "node_metadata.h"
+#include "notifications.h"
+#include "version_compat.h"
+
+/* these are always necessary for a bgworker */
+#include "access/xact.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lockdefs.h"
+#include "storage/proc.h"
+
+/* these headers are used by this particular worker's code */
+#include "catalog/pg_type.h"
+#include "libpq/pqsignal.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+
+/*
+ * A group that the scheduler looks at in a round.
+ */
+typedef struct SchedulerGroup
+{
+	char *formationId;
+	int groupId;
+} SchedulerGroup;
+
+
+/* private function declarations */
+static void group_state_scheduler_sigterm(SIGNAL_ARGS);
+static void group_state_scheduler_sighup(SIGNAL_ARGS);
+static List * LoadSchedulerGroupList(void);
+static void ProceedSchedulerGroupList(List *groupList);
+static void ProceedSchedulerGroup(SchedulerGroup *group);
+static bool SchedulerGroupIsSteady(List *nodesGroupList);
+static void SchedulerLatchWait(long timeoutMs);
+
+
+/* flags set by signal handlers */
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+/* GUC variables */
+int GroupStateSchedulerPeriod = 1000;
+
+
+/*
+ * Signal handler for SIGTERM
+ *		Set a flag to let the main loop to terminate, and set our latch to wake
+ *		it up.
+ */
+static void
+group_state_scheduler_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * Signal handler for SIGHUP
+ *		Set a flag to tell the main loop to reread the config file, and set
+ *		our latch to wake it up.
+ */
+static void
+group_state_scheduler_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+/*
+ * GroupStateSchedulerMain is the main entry-point for the background worker
+ * that proceeds the group state machines of a database. It is started by
+ * the health check launcher, in the same way as the health check workers.
+ */
+void
+GroupStateSchedulerMain(Datum arg)
+{
+	Oid dboid = DatumGetObjectId(arg);
+
+	/*
+	 * When the database crashes, background workers are restarted, but the
+	 * state in shared memory is lost. In that case, we exit and wait for
+	 * HealthCheckWorkerLauncherMain to restart us.
+	 */
+	if (!GroupStateSchedulerAttach(dboid))
+	{
+		proc_exit(0);
+	}
+
+	/* Establish signal handlers before unblocking signals. */
+	pqsignal(SIGHUP, group_state_scheduler_sighup);
+	pqsignal(SIGINT, SIG_IGN);
+	pqsignal(SIGTERM, group_state_scheduler_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect to our database */
+	BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+
+	/* Make background worker recognisable in pg_stat_activity */
+	pgstat_report_appname("pg_auto_failover group state scheduler");
+
+	MemoryContext schedulerContext =
+		AllocSetContextCreate(CurrentMemoryContext,
+							  "Group state scheduler context",
+							  ALLOCSET_DEFAULT_MINSIZE,
+							  ALLOCSET_DEFAULT_INITSIZE,
+							  ALLOCSET_DEFAULT_MAXSIZE);
+
+	MemoryContextSwitchTo(schedulerContext);
+
+	/*
+	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 */
+	while (!got_sigterm)
+	{
+		if (!GroupStateSchedulerIsAttached(dboid))
+		{
+			elog(LOG,
+				 "pg_auto_failover group state scheduler for database %d "
+				 "has been replaced, exiting", dboid);
+			proc_exit(0);
+		}
+
+		if (EventQueueEnabled())
+		{
+			DrainEventQueue();
+
+			/* CommitTransactionCommand switches to TopMemoryContext */
+			MemoryContextSwitchTo(schedulerContext);
+		}
+
+		if (GroupStateSchedulerPeriod > 0)
+		{
+			List *groupList = LoadSchedulerGroupList();
+
+			ProceedSchedulerGroupList(groupList);
+
+			/* CommitTransactionCommand switches to TopMemoryContext */
+			MemoryContextSwitchTo(schedulerContext);
+			MemoryContextReset(schedulerContext);
+		}
+
+		/* when disabled, we still check the setting from time to time */
+		SchedulerLatchWait(GroupStateSchedulerPeriod > 0
+						   ? GroupStateSchedulerPeriod
+						   : HealthCheckPeriod);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	/* insert the events that are still queued before exiting */
+	if (EventQueueEnabled())
+	{
+		DrainEventQueue();
+	}
+
+	elog(LOG,
+		 "pg_auto_failover group state scheduler exiting for database %d",
+		 dboid);
+
+	proc_exit(0);
+}
+
+
+/*
+ * LoadSchedulerGroupList returns the list of all the groups of all the
+ * formations. We only look at the groups when the installed extension
+ * matches the loaded library: during an upgrade, the keepers calls to
+ * node_active() fail until ALTER EXTENSION UPDATE is done, and so do we,
+ * but quietly.
+ */
+static List *
+LoadSchedulerGroupList(void)
+{
+	MemoryContext upperContext = CurrentMemoryContext;
+	List *groupList = NIL;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	Oid extensionOid = get_extension_oid(AUTO_FAILOVER_EXTENSION_NAME, true);
+
+	if (extensionOid != InvalidOid &&
+		!(creating_extension && CurrentExtensionObject == extensionOid) &&
+		!IsBinaryUpgrade)
+	{
+		Oid argTypes[] = { TEXTOID, TEXTOID };
+		Datum argValues[] = {
+			CStringGetTextDatum(AUTO_FAILOVER_EXTENSION_NAME),
+			CStringGetTextDatum(AUTO_FAILOVER_EXTENSION_VERSION)
+		};
+		const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+		const char *selectQuery =
+			"SELECT node.formationid, node.groupid "
+			"  FROM " AUTO_FAILOVER_NODE_TABLE " node, "
+			"       pg_catalog.pg_extension e "
+			" WHERE e.extname = $1 AND e.extversion = $2 "
+			" GROUP BY node.formationid, node.groupid "
+			" ORDER BY node.formationid, node.groupid";
+
+		pgstat_report_activity(STATE_RUNNING, selectQuery);
+
+		int spiStatus = SPI_execute_with_args(selectQuery,
+											  argCount, argTypes, argValues,
+											  NULL, true, 0);
+
+		if (spiStatus == SPI_OK_SELECT)
+		{
+			MemoryContext spiContext = MemoryContextSwitchTo(upperContext);
+
+			for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+			{
+				HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+				TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+				bool isNull = false;
+
+				SchedulerGroup *group =
+					(SchedulerGroup *) palloc0(sizeof(SchedulerGroup));
+
+				Datum formationId = SPI_getbinval(heapTuple, tupleDesc, 1, &isNull);
+				Datum groupId = SPI_getbinval(heapTuple, tupleDesc, 2, &isNull);
+
+				group->formationId = TextDatumGetCString(formationId);
+				group->groupId = DatumGetInt32(groupId);
+
+				groupList = lappend(groupList, group);
+			}
+
+			MemoryContextSwitchTo(spiContext);
+		}
+	}
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	MemoryContextSwitchTo(upperContext);
+
+	return groupList;
+}
+
+
+/*
+ * ProceedSchedulerGroupList proceeds each group in its own transaction, so
+ * that the group locks are only held for a short while, and so that an
+ * error in a group does not prevent the other groups from making progress.
+ */
+static void
+ProceedSchedulerGroupList(List *groupList)
+{
+	MemoryContext upperContext = CurrentMemoryContext;
+	ListCell *groupCell = NULL;
+
+	foreach(groupCell, groupList)
+	{
+		SchedulerGroup *group = (SchedulerGroup *) lfirst(groupCell);
+
+		if (got_sigterm)
+		{
+			break;
+		}
+
+		PG_TRY();
+		{
+			ProceedSchedulerGroup(group);
+		}
+		PG_CATCH();
+		{
+			MemoryContextSwitchTo(upperContext);
+
+			EmitErrorReport();
+			FlushErrorState();
+
+			AbortCurrentTransaction();
+			pgstat_report_activity(STATE_IDLE, NULL);
+		}
+		PG_END_TRY();
+
+		MemoryContextSwitchTo(upperContext);
+	}
+}
+
+
+/*
+ * ProceedSchedulerGroup runs the group state machine for each node of the
+ * given group, as if each of the keepers just reported, unless the group is
+ * steady. The steady check only needs a ShareLock on the group, like in
+ * node_active(), so that idle groups don't get in the way of the keepers.
+ */
+static void
+ProceedSchedulerGroup(SchedulerGroup *group)
+{
+	ListCell *nodeCell = NULL;
+	List *nodeIdList = NIL;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	LockFormation(group->formationId, ShareLock);
+	LockNodeGroup(group->formationId, group->groupId, ShareLock);
+
+	List *nodesGroupList =
+		AutoFailoverNodeGroup(group->formationId, group->groupId);
+
+	if (SchedulerGroupIsSteady(nodesGroupList))
+	{
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+
+		return;
+	}
+
+	UnlockNodeGroup(group->formationId, group->groupId, ShareLock);
+	LockNodeGroup(group->formationId, group->groupId, ExclusiveLock);
+
+	/* the group might have changed while we were waiting for the lock */
+	nodesGroupList = AutoFailoverNodeGroup(group->formationId, group->groupId);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		nodeIdList = lappend(nodeIdList, &(node->nodeId));
+	}
+
+	foreach(nodeCell, nodeIdList)
+	{
+		int64 nodeId = *((int64 *) lfirst(nodeCell));
+
+		/* previous calls might have changed the node, or removed it */
+		AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+		/* nodes being dropped are removed when their keeper reports */
+		if (node == NULL ||
+			node->reportedState == REPLICATION_STATE_DROPPED ||
+			node->goalState == REPLICATION_STATE_DROPPED)
+		{
+			continue;
+		}
+
+		(void) ProceedGroupState(node);
+
+		CommandCounterIncrement();
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+
+/*
+ * SchedulerGroupIsSteady returns true when ProceedGroupState has nothing to
+ * do for any node of the given group.
+ */
+static bool
+SchedulerGroupIsSteady(List *nodesGroupList)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (!GroupStateIsSteady(node))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * SchedulerLatchWait sleeps on the process latch until a timeout occurs, or
+ * until a backend wakes us up with WakeGroupStateScheduler().
+ */
+static void
+SchedulerLatchWait(long timeoutMs)
+{
+	int waitResult = WaitLatch(MyLatch,
+							   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							   timeoutMs, WAIT_EVENT_PG_SLEEP);
+
+	ResetLatch(MyLatch);
+
+	/* emergency bailout if postmaster has died */
+	if (waitResult & WL_POSTMASTER_DEATH)
+	{
+		elog(LOG, "pg_auto_failover group state scheduler exiting");
+
+		proc_exit(1);
+	}
+}
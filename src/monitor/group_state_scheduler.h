@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/group_state_scheduler.h
+ *
+ * Declarations for the background worker that proceeds the group state
+ * machines on the monitor.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* GUCs */
+extern int GroupStateSchedulerPeriod;
+
+
+extern void GroupStateSchedulerMain(Datum arg);
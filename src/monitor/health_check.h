@@ -17,6 +17,7 @@
 
 #include "access/htup.h"
 #include "access/tupdesc.h"
+#include "datatype/timestamp.h"
 #include "nodes/pg_list.h"
 
 
@@ -42,8 +43,32 @@ typedef struct NodeHealth
 	char *nodeHost;
 	int nodePort;
 	NodeHealthState healthState;
+	TimestampTz reportTime;     /* last time the keeper reported */
 } NodeHealth;
 
+/*
+ * NodeHealthUpdate is the result of a health check for a node, to be written
+ * to the metadata.
+ */
+typedef struct NodeHealthUpdate
+{
+	NodeHealth *node;
+	NodeHealthState healthState;
+} NodeHealthUpdate;
+
+
+/* maximum value of pgautofailover.health_check_workers */
+#define HEALTH_CHECK_MAX_WORKERS 16
+
+/*
+ * The group state scheduler is started by the health check launcher too,
+ * and uses the worker slot that follows the health check workers.
+ */
+#define GROUP_STATE_SCHEDULER_INDEX HEALTH_CHECK_MAX_WORKERS
+#define HEALTH_CHECK_WORKER_SLOTS (HEALTH_CHECK_MAX_WORKERS + 1)
+
+/* how many nodes we keep a health check latency histogram for */
+#define HEALTH_CHECK_LATENCY_MAX_NODES 1024
 
 /* GUCs to configure health checks */
 extern bool HealthChecksEnabled;
@@ -51,6 +76,10 @@ extern int HealthCheckPeriod;
 extern int HealthCheckTimeout;
 extern int HealthCheckMaxRetries;
 extern int HealthCheckRetryDelay;
+extern bool HealthCheckPersistentConnections;
+extern bool HealthCheckProbeOnly;
+extern bool HealthCheckRaceAddresses;
+extern int HealthCheckWorkers;
 
 
 extern void InitializeHealthCheckWorker(void);
@@ -65,5 +94,15 @@ extern void SetNodeHealthState(int64 nodeId,
 							   uint16 nodePort,
 							   int previousHealthState,
 							   int healthState);
+extern void SetNodeHealthStateList(List *nodeHealthUpdateList);
 extern void StopHealthCheckWorker(Oid databaseId);
+extern void HealthCheckNodeListChanged(void);
+extern void HealthCheckExtensionChanged(void);
+extern bool GroupStateSchedulerAttach(Oid databaseId);
+extern bool GroupStateSchedulerIsAttached(Oid databaseId);
+extern void WakeGroupStateScheduler(Oid databaseId);
 extern char * NodeHealthToString(NodeHealthState health);
+
+extern void InitializeHealthCheckLatency(void);
+extern void RecordHealthCheckLatency(int64 nodeId, int latencyMs);
+extern void RemoveHealthCheckLatency(int64 nodeId);
@@ -0,0 +1,173 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/health_check_latency.c
+ *
+ * Implementation of a shared memory histogram of the health check connect
+ * latency of each node.
+ *
+ * The health check workers only record whether a node could be reached or
+ * not. How long it took to connect is an early sign of an overloaded or a
+ * distant node, and is what pgautofailover.health_check_timeout should be
+ * tuned from, so we also count the successful connections of each node in
+ * fixed latency buckets.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "health_check.h"
+#include "node_shmem_hash.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "utils/tuplestore.h"
+
+
+/*
+ * Upper bounds of the histogram buckets, in milliseconds. The last bucket
+ * counts the connections that took longer than the last bound.
+ */
+static const int HealthCheckLatencyBounds[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+#define HEALTH_CHECK_LATENCY_BUCKETS \
+	(sizeof(HealthCheckLatencyBounds) / sizeof(HealthCheckLatencyBounds[0]) + 1)
+
+typedef struct HealthCheckLatencyEntry
+{
+	NodeShmemHashKey key;
+	int64 counts[HEALTH_CHECK_LATENCY_BUCKETS];
+} HealthCheckLatencyEntry;
+
+
+static NodeShmemHash HealthCheckLatencyHash =
+	make_node_shmem_hash("pg_auto_failover Health Check Latency",
+						 HealthCheckLatencyEntry,
+						 HEALTH_CHECK_LATENCY_MAX_NODES);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(health_check_latency);
+
+
+/*
+ * InitializeHealthCheckLatency, called at server start, requests the shared
+ * memory for the health check latency histograms.
+ */
+void
+InitializeHealthCheckLatency(void)
+{
+	NodeShmemHashRequest(&HealthCheckLatencyHash);
+}
+
+
+/*
+ * RecordHealthCheckLatency counts a successful connection to the given node
+ * of the current database in the bucket of its latency. When the hash table
+ * is full, the connection is not counted.
+ */
+void
+RecordHealthCheckLatency(int64 nodeId, int latencyMs)
+{
+	bool found = false;
+	int bucket = 0;
+
+	if (HealthCheckLatencyHash.hash == NULL)
+	{
+		return;
+	}
+
+	while (bucket < HEALTH_CHECK_LATENCY_BUCKETS - 1 &&
+		   latencyMs > HealthCheckLatencyBounds[bucket])
+	{
+		bucket++;
+	}
+
+	LWLockAcquire(HealthCheckLatencyHash.lock, LW_EXCLUSIVE);
+
+	HealthCheckLatencyEntry *entry =
+		(HealthCheckLatencyEntry *) NodeShmemHashEnter(&HealthCheckLatencyHash,
+													   nodeId, &found);
+
+	if (entry != NULL)
+	{
+		entry->counts[bucket]++;
+	}
+
+	LWLockRelease(HealthCheckLatencyHash.lock);
+}
+
+
+/*
+ * RemoveHealthCheckLatency forgets about the histogram of a node of the
+ * current database, when the node is removed.
+ */
+void
+RemoveHealthCheckLatency(int64 nodeId)
+{
+	NodeShmemHashRemove(&HealthCheckLatencyHash, nodeId);
+}
+
+
+/*
+ * health_check_latency returns a row per node of the current database and
+ * histogram bucket, with the number of health check connections that took
+ * at most the upper bound of the bucket, in milliseconds, and more than the
+ * upper bound of the previous bucket. The upper bound of the last bucket is
+ * NULL.
+ */
+Datum
+health_check_latency(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+	HealthCheckLatencyEntry *entry = NULL;
+
+	Tuplestorestate *tupleStore =
+		NodeShmemHashBeginSRF(&HealthCheckLatencyHash, fcinfo,
+							  &tupleDescriptor);
+
+	LWLockAcquire(HealthCheckLatencyHash.lock, LW_SHARED);
+
+	NodeShmemHashSeqInit(&HealthCheckLatencyHash, &status);
+
+	while ((entry = NodeShmemHashSeqSearch(&status)) != NULL)
+	{
+		for (int bucket = 0; bucket < HEALTH_CHECK_LATENCY_BUCKETS; bucket++)
+		{
+			Datum values[3];
+			bool isNulls[3];
+
+			memset(values, 0, sizeof(values));
+			memset(isNulls, false, sizeof(isNulls));
+
+			values[0] = Int64GetDatum(entry->key.nodeId);
+
+			if (bucket < HEALTH_CHECK_LATENCY_BUCKETS - 1)
+			{
+				values[1] = Int32GetDatum(HealthCheckLatencyBounds[bucket]);
+			}
+			else
+			{
+				isNulls[1] = true;
+			}
+
+			values[2] = Int64GetDatum(entry->counts[bucket]);
+
+			tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+		}
+	}
+
+	LWLockRelease(HealthCheckLatencyHash.lock);
+
+	return (Datum) 0;
+}
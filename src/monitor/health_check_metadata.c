@@ -16,6 +16,7 @@
 #include "health_check.h"
 #include "metadata.h"
 #include "notifications.h"
+#include "version_compat.h"
 
 #include "access/htup.h"
 #include "access/tupdesc.h"
@@ -23,8 +24,10 @@
 #include "commands/extension.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
+#include "catalog/pg_type.h"
 #include "nodes/pg_list.h"
 #include "pgstat.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
@@ -36,6 +39,7 @@
 #define TLIST_NUM_NODE_HOST 3
 #define TLIST_NUM_NODE_PORT 4
 #define TLIST_NUM_HEALTH_STATUS 5
+#define TLIST_NUM_REPORT_TIME 6
 
 
 /* GUCs */
@@ -70,7 +74,8 @@ LoadNodeHealthList(void)
 	{
 		initStringInfo(&query);
 		appendStringInfo(&query,
-						 "SELECT nodeid, nodename, nodehost, nodeport, health "
+						 "SELECT nodeid, nodename, nodehost, nodeport, health, "
+						 "reporttime "
 						 "FROM " AUTO_FAILOVER_NODE_TABLE);
 
 		pgstat_report_activity(STATE_RUNNING, query.data);
@@ -164,6 +169,8 @@ TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 										TLIST_NUM_NODE_PORT, &isNull);
 	Datum healthStateDatum = SPI_getbinval(heapTuple, tupleDescriptor,
 										   TLIST_NUM_HEALTH_STATUS, &isNull);
+	Datum reportTimeDatum = SPI_getbinval(heapTuple, tupleDescriptor,
+										  TLIST_NUM_REPORT_TIME, &isNull);
 
 	NodeHealth *nodeHealth = palloc0(sizeof(NodeHealth));
 	nodeHealth->nodeId = DatumGetInt64(nodeIdDatum);
@@ -171,6 +178,7 @@ TupleToNodeHealth(HeapTuple heapTuple, TupleDesc tupleDescriptor)
 	nodeHealth->nodeHost = TextDatumGetCString(nodeHostDatum);
 	nodeHealth->nodePort = DatumGetInt32(nodePortDatum);
 	nodeHealth->healthState = DatumGetInt32(healthStateDatum);
+	nodeHealth->reportTime = isNull ? 0 : DatumGetTimestampTz(reportTimeDatum);
 
 	return nodeHealth;
 }
@@ -187,54 +195,141 @@ SetNodeHealthState(int64 nodeId,
 				   int previousHealthState,
 				   int healthState)
 {
-	StringInfoData query;
-	int spiStatus PG_USED_FOR_ASSERTS_ONLY = 0;
+	NodeHealth nodeHealth = { 0 };
+	NodeHealthUpdate healthUpdate = { 0 };
+
+	nodeHealth.nodeId = nodeId;
+	nodeHealth.nodeName = nodeName;
+	nodeHealth.nodeHost = nodeHost;
+	nodeHealth.nodePort = nodePort;
+	nodeHealth.healthState = previousHealthState;
+
+	healthUpdate.node = &nodeHealth;
+	healthUpdate.healthState = healthState;
+
+	SetNodeHealthStateList(list_make1(&healthUpdate));
+}
+
+
+/*
+ * SetNodeHealthStateList updates the health state of a list of nodes in the
+ * metadata, using a single UPDATE statement in a single transaction. Then,
+ * once that transaction has committed, the health state changes are logged
+ * and notified, all in a second transaction.
+ */
+void
+SetNodeHealthStateList(List *nodeHealthUpdateList)
+{
 	MemoryContext upperContext = CurrentMemoryContext;
+	List *changedNodeList = NIL;
+	ListCell *updateCell = NULL;
+	int updateCount = list_length(nodeHealthUpdateList);
+	int updateIndex = 0;
+
+	if (updateCount == 0)
+	{
+		return;
+	}
+
+	Datum *nodeIdDatums = (Datum *) palloc0(updateCount * sizeof(Datum));
+	Datum *nodeHostDatums = (Datum *) palloc0(updateCount * sizeof(Datum));
+	Datum *nodePortDatums = (Datum *) palloc0(updateCount * sizeof(Datum));
+	Datum *healthDatums = (Datum *) palloc0(updateCount * sizeof(Datum));
+
+	foreach(updateCell, nodeHealthUpdateList)
+	{
+		NodeHealthUpdate *healthUpdate = (NodeHealthUpdate *) lfirst(updateCell);
+
+		nodeIdDatums[updateIndex] = Int64GetDatum(healthUpdate->node->nodeId);
+		nodeHostDatums[updateIndex] =
+			CStringGetTextDatum(healthUpdate->node->nodeHost);
+		nodePortDatums[updateIndex] = Int32GetDatum(healthUpdate->node->nodePort);
+		healthDatums[updateIndex] = Int32GetDatum(healthUpdate->healthState);
+
+		updateIndex++;
+	}
+
+	Oid argTypes[] = {
+		INT8ARRAYOID,           /* nodeid */
+		TEXTARRAYOID,           /* nodehost */
+		INT4ARRAYOID,           /* nodeport */
+		INT4ARRAYOID            /* health */
+	};
+
+	Datum argValues[] = {
+		PointerGetDatum(construct_array(nodeIdDatums, updateCount,
+										INT8OID, sizeof(int64),
+										FLOAT8PASSBYVAL, 'd')),
+		PointerGetDatum(construct_array(nodeHostDatums, updateCount,
+										TEXTOID, -1, false, 'i')),
+		PointerGetDatum(construct_array(nodePortDatums, updateCount,
+										INT4OID, sizeof(int32), true, 'i')),
+		PointerGetDatum(construct_array(healthDatums, updateCount,
+										INT4OID, sizeof(int32), true, 'i'))
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *updateQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE " node"
+		"   SET health = u.health, healthchecktime = now() "
+		"  FROM unnest($1, $2, $3, $4) "
+		"       AS u(nodeid, nodehost, nodeport, health), "
+		AUTO_FAILOVER_NODE_HEARTBEAT_TABLE " heartbeat "
+		" WHERE node.nodeid = u.nodeid "
+		"   AND node.nodehost = u.nodehost AND node.nodeport = u.nodeport "
+		"   AND heartbeat.nodeid = node.nodeid "
+		" RETURNING node.formationid, node.nodeid, node.groupid, "
+		"node.nodename, node.nodehost, node.nodeport, node.sysidentifier, "
+		"node.goalstate, node.reportedstate, heartbeat.reportedpgisrunning, "
+		"node.reportedrepstate, heartbeat.reporttime, heartbeat.reportedtli, "
+		"heartbeat.reportedlsn, heartbeat.walreporttime, node.health, "
+		"node.healthchecktime, node.statechangetime, node.candidatepriority, "
+		"node.replicationquorum, node.nodecluster";
 
 	StartSPITransaction();
 
 	if (HaMonitorHasBeenLoaded())
 	{
-		initStringInfo(&query);
-		appendStringInfo(&query,
-						 "UPDATE " AUTO_FAILOVER_NODE_TABLE
-						 "   SET health = %d, healthchecktime = now() "
-						 " WHERE nodeid = %lld "
-						 "   AND nodehost = %s AND nodeport = %d "
-						 " RETURNING node.*",
-						 healthState,
-						 (long long) nodeId,
-						 quote_literal_cstr(nodeHost),
-						 nodePort);
+		pgstat_report_activity(STATE_RUNNING, updateQuery);
 
-		pgstat_report_activity(STATE_RUNNING, query.data);
-
-		spiStatus = SPI_execute(query.data, false, 0);
+		int spiStatus PG_USED_FOR_ASSERTS_ONLY =
+			SPI_execute_with_args(updateQuery, argCount, argTypes, argValues,
+								  NULL, false, 0);
 		Assert(spiStatus == SPI_OK_UPDATE_RETURNING);
 
 		/*
-		 * We should have 0 or 1 row impacted, because of pkey on nodeid. We
-		 * might have updated zero rows when a node is concurrently being
-		 * DELETEd, because of the default REPETEABLE READ isolation level.
+		 * We might have updated fewer rows than given when a node is
+		 * concurrently being DELETEd, because of the default REPETEABLE READ
+		 * isolation level. Keep the nodes that changed health state.
 		 */
-		if (SPI_processed == 1)
+		for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
 		{
-			if (healthState != previousHealthState)
-			{
-				HeapTuple heapTuple = SPI_tuptable->vals[0];
-				AutoFailoverNode *pgAutoFailoverNode =
-					TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
-
-				char message[BUFSIZE] = { 0 };
-
-				LogAndNotifyMessage(message, sizeof(message),
-									"Node " NODE_FORMAT
-									" is marked as %s by the monitor",
-									NODE_FORMAT_ARGS(pgAutoFailoverNode),
-									healthState == 0 ? "unhealthy" : "healthy");
+			HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+			MemoryContext spiContext = MemoryContextSwitchTo(upperContext);
+			AutoFailoverNode *pgAutoFailoverNode =
+				TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
 
-				NotifyStateChange(pgAutoFailoverNode, message);
+			foreach(updateCell, nodeHealthUpdateList)
+			{
+				NodeHealthUpdate *healthUpdate =
+					(NodeHealthUpdate *) lfirst(updateCell);
+
+				if (healthUpdate->node->nodeId == pgAutoFailoverNode->nodeId)
+				{
+					/* the health check worker keeps its list of nodes */
+					healthUpdate->node->reportTime = pgAutoFailoverNode->reportTime;
+
+					if (healthUpdate->healthState !=
+						healthUpdate->node->healthState)
+					{
+						changedNodeList =
+							lappend(changedNodeList, pgAutoFailoverNode);
+					}
+					break;
+				}
 			}
+
+			MemoryContextSwitchTo(spiContext);
 		}
 	}
 	else
@@ -245,6 +340,43 @@ SetNodeHealthState(int64 nodeId,
 	EndSPITransaction();
 
 	MemoryContextSwitchTo(upperContext);
+
+	if (changedNodeList == NIL)
+	{
+		return;
+	}
+
+	/* now that the new health states are visible, log and notify them */
+	StartSPITransaction();
+
+	if (HaMonitorHasBeenLoaded())
+	{
+		ListCell *nodeCell = NULL;
+
+		foreach(nodeCell, changedNodeList)
+		{
+			AutoFailoverNode *pgAutoFailoverNode =
+				(AutoFailoverNode *) lfirst(nodeCell);
+
+			char message[BUFSIZE] = { 0 };
+
+			LogAndNotifyMessage(message, sizeof(message),
+								"Node " NODE_FORMAT
+								" is marked as %s by the monitor",
+								NODE_FORMAT_ARGS(pgAutoFailoverNode),
+								pgAutoFailoverNode->health == 0 ?
+								"unhealthy" : "healthy");
+
+			NotifyStateChange(pgAutoFailoverNode, message);
+		}
+	}
+
+	EndSPITransaction();
+
+	MemoryContextSwitchTo(upperContext);
+
+	/* the groups of those nodes might now have to fail over */
+	WakeGroupStateScheduler(MyDatabaseId);
 }
 
 
@@ -13,8 +13,10 @@
 #include "postgres.h"
 
 /* these are internal headers */
+#include "failover_drill.h"
 #include "health_check.h"
 #include "metadata.h"
+#include "notifications.h"
 #include "version_compat.h"
 
 /* these are always necessary for a bgworker */
@@ -22,6 +24,7 @@
 #include "access/htup_details.h"
 #include "access/xact.h"
 #include "catalog/pg_database.h"
+#include "common/ip.h"
 #include "commands/extension.h"
 #include "miscadmin.h"
 #include "pgstat.h"
@@ -34,15 +37,20 @@
 #include "storage/shmem.h"
 
 /* these headers are used by this particular worker's code */
+#include "arpa/inet.h"
 #include "fmgr.h"
+#include "lib/binaryheap.h"
 #include "lib/stringinfo.h"
 #include "libpq-fe.h"
 #include "libpq-int.h"
 #include "libpq/pqsignal.h"
 #include "poll.h"
+#include "port/atomics.h"
+#include "sys/socket.h"
 #include "sys/time.h"
 #include "utils/builtins.h"
 #include "utils/memutils.h"
+#include "utils/timestamp.h"
 #include "tcop/utility.h"
 
 /*
@@ -56,10 +64,40 @@
 	"host=%s port=%u user=pgautofailover_monitor " \
 	"password=pgautofailover_monitor dbname=postgres " \
 	"connect_timeout=%u"
+#define CONN_INFO_HOSTADDR_TEMPLATE " hostaddr=%s"
 #define MAX_CONN_INFO_SIZE 1024
 
 #define CANNOT_CONNECT_NOW "57P03"
 
+/* the round trip used to probe a persistent connection */
+#define HEALTH_CHECK_PROBE_QUERY "SELECT 1"
+
+/*
+ * When pgautofailover.health_check_probe_only is on, we only send an
+ * SSLRequest packet, the first message of the protocol, and any answer
+ * means that Postgres is running. This is what libpq sends with sslmode
+ * prefer, the request code is (1234 << 16) | 5679.
+ */
+#define HEALTH_CHECK_SSL_REQUEST_CODE 80877103
+
+/*
+ * Healthy nodes are checked every HealthCheckPeriod, give or take this
+ * percentage, so that the checks of all the nodes are spread over time.
+ */
+#define HEALTH_CHECK_JITTER_PERCENT 25
+
+/*
+ * When the host of a node resolves to several addresses, such as both an IPv4
+ * and an IPv6 address, we race TCP connections to at most this many of them.
+ */
+#define HEALTH_CHECK_MAX_ADDRESSES 4
+
+/* the latch, postmaster death, and the sockets of the given health checks */
+#define HEALTH_CHECK_WAIT_EVENTS(count) ((count) * HEALTH_CHECK_MAX_ADDRESSES + 2)
+
+/* how often the first health check worker maintains the event table */
+#define EVENT_MAINTENANCE_INTERVAL_MS (10 * 60 * 1000)
+
 
 typedef enum
 {
@@ -67,9 +105,27 @@ typedef enum
 	HEALTH_CHECK_CONNECTING = 1,
 	HEALTH_CHECK_OK = 2,
 	HEALTH_CHECK_RETRY = 3,
-	HEALTH_CHECK_DEAD = 4
+	HEALTH_CHECK_DEAD = 4,
+	HEALTH_CHECK_PROBING = 5,
+	HEALTH_CHECK_SSL_PROBING = 6,
+	HEALTH_CHECK_RACING = 7
 } HealthCheckState;
 
+/*
+ * When pgautofailover.health_check_persistent_connections is on, connections
+ * that have been fully established are kept open from a round of health
+ * checks to the next, and probed with a cheap query rather than re-opened.
+ */
+typedef struct HealthCheckConnection
+{
+	int64 nodeId;
+	char *nodeHost;
+	int nodePort;
+	PGconn *connection;
+	struct timeval connectedTime;
+	uint64 probeCount;
+} HealthCheckConnection;
+
 typedef struct HealthCheck
 {
 	NodeHealth *node;
@@ -79,9 +135,77 @@ typedef struct HealthCheck
 	PostgresPollingStatusType pollingStatus;
 	int numTries;
 	struct timeval nextEventTime;
+
+	/* when the current connection attempt started */
+	struct timeval connectStartTime;
+
+	/* our own socket, when only probing with an SSLRequest */
+	pgsocket probeSocket;
+
+	/* the addresses of the node, resolved once per round */
+	bool addressesResolved;
+	int addressCount;
+	struct sockaddr_storage addresses[HEALTH_CHECK_MAX_ADDRESSES];
+	socklen_t addressLengths[HEALTH_CHECK_MAX_ADDRESSES];
+
+	/* the sockets racing to connect to those addresses */
+	int raceCount;
+	pgsocket raceSockets[HEALTH_CHECK_MAX_ADDRESSES];
+	int raceAddressIndexes[HEALTH_CHECK_MAX_ADDRESSES];
+
+	/* set when probing a connection kept open from a previous round */
+	HealthCheckConnection *persistentConnection;
+
+	/* registration of our sockets in the WaitEventSet */
+	pgsocket waitSocket;
+	int waitSocketCount;
+	uint32 waitEvents;
+	int waitEventPosition;
+
+	/* the nextEventTime that has been added to the timers heap, if any */
+	bool timerScheduled;
+	struct timeval timerTime;
+
+	/* true when the health check is in HealthCheckWaitState.readyList */
+	bool isReady;
+
+	/* when to start the next check of this node, and why */
+	struct timeval nextCheckTime;
+	bool hadFailure;
 } HealthCheck;
 
 
+/*
+ * A timer in the HealthCheckWaitState heap. When the health check
+ * nextEventTime changes, we add a new timer rather than update the heap, and
+ * the previous timer is skipped when it reaches the top of the heap.
+ */
+typedef struct HealthCheckTimer
+{
+	HealthCheck *healthCheck;
+	struct timeval eventTime;
+} HealthCheckTimer;
+
+/* the heap is compacted when it gets full of stale timers */
+#define HEALTH_CHECK_TIMER_SLOTS(count) (4 * (count) + 16)
+
+/*
+ * HealthCheckWaitState is the state used to wait for events in a round of
+ * health checks.
+ */
+typedef struct HealthCheckWaitState
+{
+	List *healthCheckList;
+	WaitEventSet *waitEventSet;
+	bool rebuildWaitEventSet;
+	WaitEvent *occurredEvents;
+	binaryheap *timerHeap;
+
+	/* health checks to advance after a wait, at most one entry each */
+	HealthCheck **readyList;
+} HealthCheckWaitState;
+
+
 /*
  * Shared memory data for all maintenance workers.
  */
@@ -95,17 +219,50 @@ typedef struct HealthCheckHelperControlData
 	int trancheId;
 	char *lockTrancheName;
 	LWLock lock;
+
+	/*
+	 * Incremented each time a transaction that added or removed nodes, or
+	 * changed their address, commits. Health check workers then know they
+	 * need to reload their list of nodes.
+	 */
+	pg_atomic_uint64 nodeListGeneration;
+
+	/* set by the launcher, so that backends can wake it up */
+	Latch *launcherLatch;
 } HealthCheckHelperControlData;
 
 /*
- * Per database worker state.
+ * Whether the pgautofailover extension exists in a database. Until a health
+ * check worker found out, only the first worker is started there, and when
+ * the extension is absent no worker runs until CREATE EXTENSION is committed.
+ */
+typedef enum
+{
+	HEALTH_CHECK_EXTENSION_UNKNOWN = 0,
+	HEALTH_CHECK_EXTENSION_PRESENT,
+	HEALTH_CHECK_EXTENSION_ABSENT
+} HealthCheckExtensionState;
+
+/*
+ * Per database worker state. When pgautofailover.health_check_workers is
+ * more than one, the nodes are split across the workers by nodeid, and
+ * each worker only probes the nodes of its own shard.
  */
+typedef struct HealthCheckHelperWorker
+{
+	pid_t workerPid;
+	BackgroundWorkerHandle *handle;
+
+	/* set by the group state scheduler, so that backends can wake it up */
+	Latch *latch;
+} HealthCheckHelperWorker;
+
 typedef struct HealthCheckHelperDatabase
 {
 	/* hash key: database to run on */
 	Oid dboid;
-	pid_t workerPid;
-	BackgroundWorkerHandle *handle;
+	HealthCheckExtensionState extensionState;
+	HealthCheckHelperWorker workers[HEALTH_CHECK_WORKER_SLOTS];
 } HealthCheckHelperDatabase;
 
 typedef struct DatabaseListEntry
@@ -123,18 +280,85 @@ static HTAB *HealthCheckWorkerDBHash;
 static HealthCheckHelperControlData *HealthCheckHelperControl = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
+/*
+ * Persistent health check connections of this worker, allocated in
+ * HealthCheckConnectionContext so that they survive the per-round memory
+ * context reset.
+ */
+static List *HealthCheckConnectionList = NIL;
+static MemoryContext HealthCheckConnectionContext = NULL;
+
+/*
+ * Results of the current round of health checks, written to the metadata
+ * all at once at the end of the round.
+ */
+static List *NodeHealthUpdateList = NIL;
+
+/* set when the current transaction changed the list of nodes to check */
+static bool NodeListChangedInTransaction = false;
+
+/* set when the current transaction created or dropped our extension */
+static bool ExtensionChangedInTransaction = false;
+static bool ExtensionExistsAtCommit = false;
+
 
 /* private function declarations */
 static void pg_auto_failover_monitor_sigterm(SIGNAL_ARGS);
 static void pg_auto_failover_monitor_sighup(SIGNAL_ARGS);
-static BackgroundWorkerHandle * RegisterHealthCheckWorker(DatabaseListEntry *db);
+static void EnsureHealthCheckWorker(DatabaseListEntry *entry, int workerIndex);
+static BackgroundWorkerHandle * RegisterHealthCheckWorker(DatabaseListEntry *db,
+														  int workerIndex);
+static void StopHealthCheckWorkerSlot(Oid databaseId, int workerIndex);
+static const char * HealthCheckWorkerRole(int workerIndex);
+static bool HealthCheckWorkerOwnsShard(Oid databaseId, int workerIndex);
+static void SetHealthCheckExtensionState(Oid databaseId,
+										 HealthCheckExtensionState state);
+static bool HealthCheckExtensionIsAbsent(Oid databaseId, int workerIndex);
+static List * FilterNodeHealthShard(List *nodeHealthList, int workerIndex);
 static List * BuildDatabaseList(void);
 static bool pgAutoFailoverExtensionExists(void);
 static List * CreateHealthChecks(List *nodeHealthList);
 static HealthCheck * CreateHealthCheck(NodeHealth *nodeHealth);
+static void ResetHealthCheck(HealthCheck *healthCheck);
+static void ScheduleNextHealthCheck(HealthCheck *healthCheck,
+									struct timeval currentTime);
+static int JitteredHealthCheckPeriod(void);
+static int NextHealthCheckTimeout(List *healthCheckList);
+static void HealthCheckXactCallback(XactEvent event, void *arg);
 static void DoHealthChecks(List *healthCheckList);
 static void ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime);
-static int WaitForEvent(List *healthCheckList);
+static void StartHealthCheckConnection(HealthCheck *healthCheck,
+									   struct timeval currentTime,
+									   const char *hostaddr);
+static bool StartHealthCheckSSLProbe(HealthCheck *healthCheck);
+static void CloseHealthCheckSSLProbe(HealthCheck *healthCheck);
+static int ResolveHealthCheckAddresses(HealthCheck *healthCheck);
+static bool StartHealthCheckRace(HealthCheck *healthCheck);
+static int PollHealthCheckRace(HealthCheck *healthCheck);
+static void CloseHealthCheckRace(HealthCheck *healthCheck);
+static bool StartHealthCheckProbe(HealthCheck *healthCheck,
+								  struct timeval currentTime);
+static void KeepHealthCheckConnection(HealthCheck *healthCheck,
+									  struct timeval currentTime);
+static void CloseHealthCheckConnection(HealthCheckConnection *healthConnection);
+static HealthCheckConnection * FindHealthCheckConnection(NodeHealth *nodeHealth);
+static void RecordNodeHealthState(HealthCheck *healthCheck,
+								  NodeHealthState healthState);
+static void CloseUnusedHealthCheckConnections(List *nodeHealthList);
+static bool HealthCheckIsPending(HealthCheck *healthCheck);
+static void AdvanceHealthCheck(HealthCheckWaitState *waitState,
+							   HealthCheck *healthCheck,
+							   struct timeval currentTime);
+static void UpdateHealthCheckWaitEvents(HealthCheckWaitState *waitState,
+										HealthCheck *healthCheck);
+static void RebuildWaitEventSet(HealthCheckWaitState *waitState);
+static void ScheduleHealthCheckTimer(HealthCheckWaitState *waitState,
+									 HealthCheck *healthCheck);
+static void AddHealthCheckTimer(binaryheap *timerHeap, HealthCheck *healthCheck);
+static bool TimerIsStale(HealthCheckTimer *timer);
+static int CompareHealthCheckTimers(Datum a, Datum b, void *arg);
+static int WaitForEvent(HealthCheckWaitState *waitState);
+static void PopHealthCheckTimer(binaryheap *timerHeap);
 static int CompareTimes(struct timeval *leftTime, struct timeval *rightTime);
 static int SubtractTimes(struct timeval base, struct timeval subtract);
 static struct timeval AddTimeMillis(struct timeval base, uint32 additionalMs);
@@ -152,6 +376,10 @@ int HealthCheckPeriod = 5 * 1000;
 int HealthCheckTimeout = 5 * 1000;
 int HealthCheckMaxRetries = 2;
 int HealthCheckRetryDelay = 2 * 1000;
+bool HealthCheckPersistentConnections = false;
+bool HealthCheckProbeOnly = false;
+bool HealthCheckRaceAddresses = true;
+int HealthCheckWorkers = 1;
 
 
 /*
@@ -203,6 +431,81 @@ InitializeHealthCheckWorker(void)
 
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = HealthCheckWorkerShmemInit;
+
+	RegisterXactCallback(HealthCheckXactCallback, NULL);
+}
+
+
+/*
+ * HealthCheckNodeListChanged registers that the current transaction changed
+ * the list of nodes that the health check workers should check. The workers
+ * are told about it when the transaction commits.
+ */
+void
+HealthCheckNodeListChanged(void)
+{
+	NodeListChangedInTransaction = true;
+}
+
+
+/*
+ * HealthCheckExtensionChanged registers that the current transaction ran
+ * CREATE EXTENSION or DROP EXTENSION, so that the launcher is told whether
+ * the pgautofailover extension exists in this database when it commits.
+ */
+void
+HealthCheckExtensionChanged(void)
+{
+	ExtensionChangedInTransaction = true;
+}
+
+
+/*
+ * HealthCheckXactCallback increments the node list generation number when a
+ * transaction that changed the list of nodes commits, and publishes whether
+ * our extension exists when a transaction that created or dropped an
+ * extension commits.
+ */
+static void
+HealthCheckXactCallback(XactEvent event, void *arg)
+{
+	if (!NodeListChangedInTransaction && !ExtensionChangedInTransaction)
+	{
+		return;
+	}
+
+	if (event == XACT_EVENT_PRE_COMMIT || event == XACT_EVENT_PRE_PREPARE)
+	{
+		/* we can still read the catalogs here, and see our own changes */
+		if (ExtensionChangedInTransaction)
+		{
+			ExtensionExistsAtCommit =
+				get_extension_oid(AUTO_FAILOVER_EXTENSION_NAME, true) != InvalidOid;
+		}
+	}
+	else if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_PREPARE)
+	{
+		if (NodeListChangedInTransaction && HealthCheckHelperControl != NULL)
+		{
+			pg_atomic_fetch_add_u64(&HealthCheckHelperControl->nodeListGeneration, 1);
+		}
+
+		if (ExtensionChangedInTransaction && HealthCheckHelperControl != NULL)
+		{
+			SetHealthCheckExtensionState(MyDatabaseId,
+										 ExtensionExistsAtCommit
+										 ? HEALTH_CHECK_EXTENSION_PRESENT
+										 : HEALTH_CHECK_EXTENSION_ABSENT);
+		}
+
+		NodeListChangedInTransaction = false;
+		ExtensionChangedInTransaction = false;
+	}
+	else if (event == XACT_EVENT_ABORT)
+	{
+		NodeListChangedInTransaction = false;
+		ExtensionChangedInTransaction = false;
+	}
 }
 
 
@@ -211,9 +514,11 @@ InitializeHealthCheckWorker(void)
  * pg_auto_failover Health Check workers.
  *
  * We start a background worker for each database because a single background
- * worker may only connect to a single database for its whole lifetime. Each
- * worker checks if the "pgautofailover" extension is installed locally, and
- * then does the health checks.
+ * worker may only connect to a single database for its whole lifetime. The
+ * first worker checks if the "pgautofailover" extension is installed locally,
+ * and exits when it is not. The other workers are only started once the
+ * extension has been found, and CREATE EXTENSION or DROP EXTENSION wake us up
+ * to start or stop the workers of a database.
  */
 void
 HealthCheckWorkerLauncherMain(Datum arg)
@@ -236,6 +541,10 @@ HealthCheckWorkerLauncherMain(Datum arg)
 	/* Make background worker recognisable in pg_stat_activity */
 	pgstat_report_appname("pg_auto_failover monitor launcher");
 
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+	HealthCheckHelperControl->launcherLatch = MyLatch;
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
 	MemoryContext launcherContext = AllocSetContextCreate(CurrentMemoryContext,
 														  "Health Check Launcher Context",
 														  ALLOCSET_DEFAULT_MINSIZE,
@@ -256,133 +565,196 @@ HealthCheckWorkerLauncherMain(Datum arg)
 
 		foreach(databaseListCell, databaseList)
 		{
-			int pid;
-			BackgroundWorkerHandle *handle = NULL;
 			DatabaseListEntry *entry =
 				(DatabaseListEntry *) lfirst(databaseListCell);
-			bool isFound = false;
-
-			LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
+			for (int workerIndex = 0;
+				 workerIndex < HealthCheckWorkers && !got_sigterm;
+				 workerIndex++)
+			{
+				EnsureHealthCheckWorker(entry, workerIndex);
+			}
 
-			HealthCheckHelperDatabase *dbData = hash_search(HealthCheckWorkerDBHash,
-															(void *) &entry->dboid,
-															HASH_ENTER, &isFound);
-			if (isFound)
+			if (!got_sigterm)
 			{
-				handle = dbData->handle;
+				EnsureHealthCheckWorker(entry, GROUP_STATE_SCHEDULER_INDEX);
+			}
+		}
 
-				LWLockRelease(&HealthCheckHelperControl->lock);
+		MemoryContextReset(launcherContext);
 
-				/*
-				 * This database has already been processed.
-				 *
-				 * Perform a quick and inexpensive check to verify that it is
-				 * actually running. Note that it is not possible to get
-				 * BGWH_NOT_YET_STARTED at this point, because this is not first
-				 * time we try to register the worker due to the isFound value
-				 * above. The HealthCheckWorkerDBHash only maintains verified
-				 * started entries. Thus we can only get BGWH_STARTED or
-				 * BGWH_STOPPED.
-				 */
-				if (GetBackgroundWorkerPid(handle, &pid) != BGWH_STARTED)
-				{
-					ereport(WARNING,
-							(errmsg(
-								 "found stopped worker for pg_auto_failover "
-								 "health checks in \"%s\"",
-								 entry->dbname)));
+		LatchWait(HealthCheckTimeout);
 
-					/*
-					 * Now we know that the worker has stopped. We use
-					 * StopHealthCheckWorker to remove the entry from the
-					 * HealthCheckWorkerDBHash. That will force a retry in the
-					 * next scan of the databaselist.
-					 *
-					 * Furthermore, if the status from GetBackgroundWorkerPid
-					 * was not the correct one, then StopHealthCheckWorker will
-					 * also make certain that the rogue worker will be stopped.
-					 * That will leave HealthCheckWorkerDBHash in a consistent
-					 * state.
-					 */
-					StopHealthCheckWorker(entry->dboid);
-				}
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
 
-				continue;
-			}
+	MemoryContextReset(launcherContext);
+	MemoryContextSwitchTo(originalContext);
+}
 
-			/* register a worker for the entry database, in the background */
-			handle = RegisterHealthCheckWorker(entry);
-			if (handle)
-			{
-				/*
-				 * Once started, the Health Check process will update its
-				 * pid.
-				 */
-				dbData->workerPid = 0;
 
-				/*
-				 * We need to release the lock for the worker to be able to
-				 * complete its startup procedure: the per-database worker
-				 * takes the control lock in SHARED mode to edit its own PID in
-				 * its own entry in HealthCheckWorkerDBHash.
-				 */
-				LWLockRelease(&HealthCheckHelperControl->lock);
+/*
+ * EnsureHealthCheckWorker makes sure that the health check worker with the
+ * given index is running for the given database, and starts it if needed.
+ */
+static void
+EnsureHealthCheckWorker(DatabaseListEntry *entry, int workerIndex)
+{
+	int pid;
+	BackgroundWorkerHandle *handle = NULL;
+	bool isFound = false;
 
-				/*
-				 * WaitForBackgroundWorkerStartup will wait for worker to start;
-				 * thus, BGWH_NOT_YET_STARTED is never returned. However, if the
-				 * postmaster has died, it will give up and return
-				 * BGWH_POSTMASTER_DIED. In such a case the process will get
-				 * signaled to stop and we will exit further down. For good
-				 * measure though, do verify the process did actually start
-				 * before marking it as Active.
-				 */
-				if (WaitForBackgroundWorkerStartup(handle, &pid) == BGWH_STARTED)
-				{
-					dbData->handle = handle;
-					ereport(LOG,
-							(errmsg(
-								 "started worker for pg_auto_failover "
-								 "health checks in \"%s\"",
-								 entry->dbname)));
-					continue;
-				}
-			}
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
-			LWLockRelease(&HealthCheckHelperControl->lock);
+	HealthCheckHelperDatabase *dbData = hash_search(HealthCheckWorkerDBHash,
+													(void *) &entry->dboid,
+													HASH_ENTER, &isFound);
+	if (!isFound)
+	{
+		dbData->extensionState = HEALTH_CHECK_EXTENSION_UNKNOWN;
+		memset(dbData->workers, 0, sizeof(dbData->workers));
+	}
 
-			/*
-			 * Similarly to the comment above, we either failed to start
-			 * the worker, or we failed to register it.
-			 *
-			 * NOTE. We use StopHealthCheckWorker to remove the entry
-			 * from the HealthCheckWorkerDBHash so that it will be
-			 * retried in the next databaselist scan. The call to kill()
-			 * the failed worker in StopHealthCheckWorker() will take
-			 * place only if a handle was registered.
-			 */
+	HealthCheckHelperWorker *workerData = &(dbData->workers[workerIndex]);
+
+	/*
+	 * Only the first health check worker runs until the extension has been
+	 * found in the database, and none when it does not exist there.
+	 */
+	if (dbData->extensionState == HEALTH_CHECK_EXTENSION_ABSENT ||
+		(dbData->extensionState == HEALTH_CHECK_EXTENSION_UNKNOWN &&
+		 workerIndex != 0))
+	{
+		bool registered =
+			workerData->handle != NULL || workerData->workerPid > 0;
+
+		LWLockRelease(&HealthCheckHelperControl->lock);
+
+		/* stop the workers that were running before DROP EXTENSION */
+		if (registered)
+		{
+			StopHealthCheckWorkerSlot(entry->dboid, workerIndex);
+		}
+
+		return;
+	}
+
+	if (workerData->handle != NULL)
+	{
+		handle = workerData->handle;
+
+		LWLockRelease(&HealthCheckHelperControl->lock);
+
+		/*
+		 * This worker has already been started.
+		 *
+		 * Perform a quick and inexpensive check to verify that it is
+		 * actually running. Note that it is not possible to get
+		 * BGWH_NOT_YET_STARTED at this point, because the
+		 * HealthCheckWorkerDBHash only maintains verified started entries.
+		 * Thus we can only get BGWH_STARTED or BGWH_STOPPED.
+		 */
+		if (GetBackgroundWorkerPid(handle, &pid) != BGWH_STARTED)
+		{
 			ereport(WARNING,
-					(errmsg("failed to %s worker for pg_auto_failover "
-							"health checks in \"%s\"",
-							handle ? "start" : "register",
+					(errmsg("found stopped worker %d for pg_auto_failover "
+							"%s in \"%s\"",
+							workerIndex, HealthCheckWorkerRole(workerIndex),
 							entry->dbname)));
-			StopHealthCheckWorker(entry->dboid);
+
+			/*
+			 * Now we know that the worker has stopped. We use
+			 * StopHealthCheckWorkerSlot to clean-up its entry, which forces
+			 * a retry in the next scan of the database list, and also makes
+			 * certain that a rogue worker would be stopped.
+			 */
+			StopHealthCheckWorkerSlot(entry->dboid, workerIndex);
 		}
 
-		MemoryContextReset(launcherContext);
+		return;
+	}
 
-		LatchWait(HealthCheckTimeout);
+	/* register a worker for the entry database, in the background */
+	handle = RegisterHealthCheckWorker(entry, workerIndex);
 
-		if (got_sighup)
+	if (handle)
+	{
+		/*
+		 * Once started, the Health Check process will update its pid.
+		 */
+		workerData->workerPid = 0;
+
+		/*
+		 * We need to release the lock for the worker to be able to complete
+		 * its startup procedure: the per-database worker takes the control
+		 * lock in SHARED mode to edit its own PID in its own entry in
+		 * HealthCheckWorkerDBHash.
+		 */
+		LWLockRelease(&HealthCheckHelperControl->lock);
+
+		/*
+		 * WaitForBackgroundWorkerStartup will wait for worker to start; thus,
+		 * BGWH_NOT_YET_STARTED is never returned. However, if the postmaster
+		 * has died, it will give up and return BGWH_POSTMASTER_DIED. In such
+		 * a case the process will get signaled to stop and we will exit
+		 * further down. For good measure though, do verify the process did
+		 * actually start before marking it as Active.
+		 */
+		if (WaitForBackgroundWorkerStartup(handle, &pid) == BGWH_STARTED)
 		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
+			LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+			/* DROP DATABASE might have happened in the meantime */
+			dbData = hash_search(HealthCheckWorkerDBHash,
+								 (void *) &entry->dboid,
+								 HASH_FIND, NULL);
+
+			if (dbData != NULL)
+			{
+				dbData->workers[workerIndex].handle = handle;
+			}
+
+			LWLockRelease(&HealthCheckHelperControl->lock);
+
+			if (dbData == NULL)
+			{
+				TerminateBackgroundWorker(handle);
+				return;
+			}
+
+			ereport(LOG,
+					(errmsg("started worker %d for pg_auto_failover "
+							"%s in \"%s\"",
+							workerIndex, HealthCheckWorkerRole(workerIndex),
+							entry->dbname)));
+			return;
 		}
 	}
+	else
+	{
+		LWLockRelease(&HealthCheckHelperControl->lock);
+	}
 
-	MemoryContextReset(launcherContext);
-	MemoryContextSwitchTo(originalContext);
+	/*
+	 * Similarly to the comment above, we either failed to start the worker,
+	 * or we failed to register it.
+	 *
+	 * NOTE. We use StopHealthCheckWorkerSlot to clean-up the entry so that it
+	 * will be retried in the next databaselist scan. The call to kill() the
+	 * failed worker will take place only if its pid was registered.
+	 */
+	ereport(WARNING,
+			(errmsg("failed to %s worker %d for pg_auto_failover "
+					"%s in \"%s\"",
+					handle ? "start" : "register",
+					workerIndex, HealthCheckWorkerRole(workerIndex),
+					entry->dbname)));
+
+	StopHealthCheckWorkerSlot(entry->dboid, workerIndex);
 }
 
 
@@ -395,7 +767,7 @@ HealthCheckWorkerLauncherMain(Datum arg)
  * lock from the caller before waiting for the worker's start.
  */
 static BackgroundWorkerHandle *
-RegisterHealthCheckWorker(DatabaseListEntry *db)
+RegisterHealthCheckWorker(DatabaseListEntry *db, int workerIndex)
 {
 	BackgroundWorker worker;
 	BackgroundWorkerHandle *handle;
@@ -415,8 +787,26 @@ RegisterHealthCheckWorker(DatabaseListEntry *db)
 			sizeof(worker.bgw_library_name));
 	strlcpy(worker.bgw_function_name, "HealthCheckWorkerMain",
 			sizeof(worker.bgw_function_name));
-	appendStringInfo(&buf, "pg_auto_failover monitor healthcheck worker %s",
-					 db->dbname);
+	memcpy(worker.bgw_extra, &workerIndex, sizeof(int));
+
+	if (workerIndex == GROUP_STATE_SCHEDULER_INDEX)
+	{
+		strlcpy(worker.bgw_function_name, "GroupStateSchedulerMain",
+				sizeof(worker.bgw_function_name));
+
+		appendStringInfo(&buf, "pg_auto_failover monitor state machine worker %s",
+						 db->dbname);
+	}
+	else if (HealthCheckWorkers > 1)
+	{
+		appendStringInfo(&buf, "pg_auto_failover monitor healthcheck worker %s %d",
+						 db->dbname, workerIndex);
+	}
+	else
+	{
+		appendStringInfo(&buf, "pg_auto_failover monitor healthcheck worker %s",
+						 db->dbname);
+	}
 	strlcpy(worker.bgw_name, buf.data,
 			sizeof(worker.bgw_name));
 
@@ -424,8 +814,8 @@ RegisterHealthCheckWorker(DatabaseListEntry *db)
 	{
 		ereport(WARNING,
 				(errmsg(
-					 "failed to start worker for pg_auto_failover health checks in \"%s\"",
-					 db->dbname),
+					 "failed to start worker for pg_auto_failover %s in \"%s\"",
+					 HealthCheckWorkerRole(workerIndex), db->dbname),
 				 errhint("You might need to increase max_worker_processes.")));
 		return NULL;
 	}
@@ -491,8 +881,11 @@ void
 HealthCheckWorkerMain(Datum arg)
 {
 	Oid dboid = DatumGetObjectId(arg);
+	int workerIndex = 0;
 	bool foundPgAutoFailoverExtension = false;
 
+	memcpy(&workerIndex, MyBgworkerEntry->bgw_extra, sizeof(int));
+
 	/*
 	 * Look up this worker's configuration.
 	 */
@@ -502,7 +895,7 @@ HealthCheckWorkerMain(Datum arg)
 										  hash_search(HealthCheckWorkerDBHash,
 													  (void *) &dboid, HASH_FIND, NULL);
 
-	if (!myDbData)
+	if (!myDbData || workerIndex < 0 || workerIndex >= HealthCheckWorkers)
 	{
 		/*
 		 * When the database crashes, background workers are restarted, but
@@ -513,7 +906,7 @@ HealthCheckWorkerMain(Datum arg)
 	}
 
 	/* from this point, DROP DATABASE will attempt to kill the worker */
-	myDbData->workerPid = MyProcPid;
+	myDbData->workers[workerIndex].workerPid = MyProcPid;
 
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGHUP, pg_auto_failover_monitor_sighup);
@@ -542,6 +935,29 @@ HealthCheckWorkerMain(Datum arg)
 															 ALLOCSET_DEFAULT_INITSIZE,
 															 ALLOCSET_DEFAULT_MAXSIZE);
 
+	HealthCheckConnectionContext =
+		AllocSetContextCreate(TopMemoryContext,
+							  "Health check connections context",
+							  ALLOCSET_SMALL_MINSIZE,
+							  ALLOCSET_SMALL_INITSIZE,
+							  ALLOCSET_SMALL_MAXSIZE);
+
+	/*
+	 * The list of health checks is kept from a round to the next, and only
+	 * reloaded when the list of nodes changed.
+	 */
+	MemoryContext healthCheckListContext =
+		AllocSetContextCreate(TopMemoryContext,
+							  "Health check list context",
+							  ALLOCSET_DEFAULT_MINSIZE,
+							  ALLOCSET_DEFAULT_INITSIZE,
+							  ALLOCSET_DEFAULT_MAXSIZE);
+	List *healthCheckList = NIL;
+	uint64 nodeListGeneration = 0;
+	bool nodeListLoaded = false;
+	TimestampTz nextEventMaintenanceTime = 0;
+	TimestampTz nextFailoverDrillTime = 0;
+
 	MemoryContextSwitchTo(healthCheckContext);
 
 	/*
@@ -549,41 +965,124 @@ HealthCheckWorkerMain(Datum arg)
 	 */
 	while (!got_sigterm)
 	{
-		struct timeval currentTime = { 0, 0 };
-		struct timeval roundEndTime = { 0, 0 };
-
-		gettimeofday(&currentTime, NULL);
-		roundEndTime = AddTimeMillis(currentTime, HealthCheckPeriod);
-
 		if (!foundPgAutoFailoverExtension)
 		{
 			if (pgAutoFailoverExtensionExists())
 			{
 				foundPgAutoFailoverExtension = true;
+				SetHealthCheckExtensionState(dboid,
+											 HEALTH_CHECK_EXTENSION_PRESENT);
 				elog(LOG,
 					 "pg_auto_failover extension found in database %d, "
 					 "starting Health Checks.", dboid);
 			}
+			else if (HealthCheckExtensionIsAbsent(dboid, workerIndex))
+			{
+				/* CREATE EXTENSION has the launcher start us again */
+				elog(DEBUG1,
+					 "pg_auto_failover extension not found in database %d, "
+					 "exiting", dboid);
+				proc_exit(0);
+			}
 		}
 
 		if (foundPgAutoFailoverExtension)
 		{
-			List *nodeHealthList = LoadNodeHealthList();
+			/* make sure no other worker is now in charge of our shard */
+			if (!HealthCheckWorkerOwnsShard(dboid, workerIndex))
+			{
+				elog(LOG,
+					 "pg_auto_failover health check worker %d for database %d "
+					 "has been replaced, exiting", workerIndex, dboid);
+				proc_exit(0);
+			}
+
+			uint64 currentGeneration =
+				pg_atomic_read_u64(&HealthCheckHelperControl->nodeListGeneration);
 
-			if (nodeHealthList != NIL)
+			if (healthCheckList == NIL ||
+				currentGeneration != nodeListGeneration ||
+				!HealthChecksEnabled)
 			{
-				List *healthCheckList = CreateHealthChecks(nodeHealthList);
+				MemoryContextReset(healthCheckListContext);
+				MemoryContextSwitchTo(healthCheckListContext);
+
+				List *nodeHealthList =
+					FilterNodeHealthShard(LoadNodeHealthList(), workerIndex);
+
+				/* close connections to nodes that have been removed */
+				CloseUnusedHealthCheckConnections(nodeHealthList);
+
+				healthCheckList = CreateHealthChecks(nodeHealthList);
+
+				/*
+				 * Check all the nodes right away at startup, but otherwise
+				 * spread the checks over a period, rather than check all the
+				 * nodes at once because one of them was added or removed.
+				 */
+				if (nodeListLoaded)
+				{
+					ListCell *healthCheckCell = NULL;
+					struct timeval currentTime = { 0, 0 };
+
+					gettimeofday(&currentTime, NULL);
+
+					foreach(healthCheckCell, healthCheckList)
+					{
+						HealthCheck *healthCheck =
+							(HealthCheck *) lfirst(healthCheckCell);
+						int offset = random() % Max(HealthCheckPeriod, 1);
+
+						healthCheck->nextCheckTime =
+							AddTimeMillis(currentTime, offset);
+					}
+				}
+
+				nodeListGeneration = currentGeneration;
+				nodeListLoaded = true;
+
+				MemoryContextSwitchTo(healthCheckContext);
+			}
 
+			if (healthCheckList != NIL)
+			{
 				DoHealthChecks(healthCheckList);
 			}
 
+			/* a single worker per database maintains the event table */
+			if (workerIndex == 0 &&
+				GetCurrentTimestamp() >= nextEventMaintenanceTime)
+			{
+				MaintainEventTable();
+
+				nextEventMaintenanceTime =
+					TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												EVENT_MAINTENANCE_INTERVAL_MS);
+
+				/* CommitTransactionCommand switches to TopMemoryContext */
+				MemoryContextSwitchTo(healthCheckContext);
+			}
+
+			/* and it also runs the scheduled failover drills */
+			if (workerIndex == 0 &&
+				GetCurrentTimestamp() >= nextFailoverDrillTime)
+			{
+				RunFailoverDrills();
+
+				nextFailoverDrillTime =
+					TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												FAILOVER_DRILL_INTERVAL_MS);
+
+				MemoryContextSwitchTo(healthCheckContext);
+			}
+
 			MemoryContextReset(healthCheckContext);
 		}
 
-		gettimeofday(&currentTime, NULL);
-		int timeout = SubtractTimes(roundEndTime, currentTime);
+		/* sleep until the next node is due for a check */
+		int timeout = NextHealthCheckTimeout(healthCheckList);
 
-		if (timeout >= 0)
+		if (timeout > 0)
 		{
 			LatchWait(timeout);
 		}
@@ -652,349 +1151,1607 @@ CreateHealthChecks(List *nodeHealthList)
 static HealthCheck *
 CreateHealthCheck(NodeHealth *nodeHealth)
 {
-	struct timeval invalidTime = { 0, 0 };
-
 	HealthCheck *healthCheck = palloc0(sizeof(HealthCheck));
 	healthCheck->node = nodeHealth;
-	healthCheck->state = HEALTH_CHECK_INITIAL;
-	healthCheck->connection = NULL;
-	healthCheck->numTries = 0;
-	healthCheck->nextEventTime = invalidTime;
+
+	ResetHealthCheck(healthCheck);
 
 	return healthCheck;
 }
 
 
+/*
+ * ResetHealthCheck prepares a health check for a new round.
+ */
+static void
+ResetHealthCheck(HealthCheck *healthCheck)
+{
+	struct timeval invalidTime = { 0, 0 };
+
+	healthCheck->state = HEALTH_CHECK_INITIAL;
+	healthCheck->connection = NULL;
+	healthCheck->readyToPoll = false;
+	healthCheck->numTries = 0;
+	healthCheck->nextEventTime = invalidTime;
+	healthCheck->persistentConnection =
+		FindHealthCheckConnection(healthCheck->node);
+	healthCheck->probeSocket = PGINVALID_SOCKET;
+	healthCheck->addressesResolved = false;
+	healthCheck->addressCount = 0;
+	healthCheck->raceCount = 0;
+	healthCheck->waitSocket = PGINVALID_SOCKET;
+	healthCheck->waitSocketCount = 0;
+	healthCheck->waitEvents = 0;
+	healthCheck->waitEventPosition = -1;
+	healthCheck->timerScheduled = false;
+	healthCheck->isReady = false;
+	healthCheck->hadFailure = false;
+}
+
+
 /*
  * DoHealthChecks performs the given health checks.
+ *
+ * All the health checks are started at once, and then we only advance the
+ * state machine of health checks that have either received a socket event or
+ * reached their timeout, so that a round costs O(n log n) rather than O(n²)
+ * when many connections complete one at a time.
  */
 static void
 DoHealthChecks(List *healthCheckList)
 {
-	while (!got_sigterm)
+	HealthCheckWaitState waitState = { 0 };
+	ListCell *healthCheckCell = NULL;
+	ListCell *updateCell = NULL;
+	List *startedList = NIL;
+	struct timeval currentTime = { 0, 0 };
+	int healthCheckCount = list_length(healthCheckList);
+	int pendingCheckCount = 0;
+
+	NodeHealthUpdateList = NIL;
+
+	waitState.healthCheckList = healthCheckList;
+	waitState.timerHeap = binaryheap_allocate(HEALTH_CHECK_TIMER_SLOTS(healthCheckCount),
+											  CompareHealthCheckTimers, NULL);
+	waitState.occurredEvents = (WaitEvent *)
+							   palloc0(HEALTH_CHECK_WAIT_EVENTS(healthCheckCount) *
+									   sizeof(WaitEvent));
+	waitState.readyList = (HealthCheck **)
+						  palloc0((healthCheckCount + 1) * sizeof(HealthCheck *));
+
+	gettimeofday(&currentTime, NULL);
+
+	foreach(healthCheckCell, healthCheckList)
 	{
-		int pendingCheckCount = 0;
-		struct timeval currentTime = { 0, 0 };
-		ListCell *healthCheckCell = NULL;
+		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+
+		/* each node has its own schedule */
+		if (CompareTimes(&healthCheck->nextCheckTime, &currentTime) > 0)
+		{
+			continue;
+		}
+
+		ResetHealthCheck(healthCheck);
+		startedList = lappend(startedList, healthCheck);
+
+		AdvanceHealthCheck(&waitState, healthCheck, currentTime);
+
+		if (HealthCheckIsPending(healthCheck))
+		{
+			pendingCheckCount++;
+		}
+	}
+
+	if (startedList == NIL)
+	{
+		return;
+	}
+
+	while (!got_sigterm && pendingCheckCount > 0)
+	{
+		int readyCount = WaitForEvent(&waitState);
 
 		gettimeofday(&currentTime, NULL);
 
-		foreach(healthCheckCell, healthCheckList)
+		for (int readyIndex = 0; readyIndex < readyCount; readyIndex++)
 		{
-			HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
+			HealthCheck *healthCheck = waitState.readyList[readyIndex];
+
+			AdvanceHealthCheck(&waitState, healthCheck, currentTime);
 
-			ManageHealthCheck(healthCheck, currentTime);
+			healthCheck->readyToPoll = false;
+			healthCheck->isReady = false;
 
-			if (healthCheck->state != HEALTH_CHECK_OK &&
-				healthCheck->state != HEALTH_CHECK_DEAD)
+			if (!HealthCheckIsPending(healthCheck))
 			{
-				pendingCheckCount++;
+				pendingCheckCount--;
 			}
 		}
-		if (pendingCheckCount == 0)
+	}
+
+	if (waitState.waitEventSet != NULL)
+	{
+		FreeWaitEventSet(waitState.waitEventSet);
+	}
+
+	/* one transaction for all the health checks results of this round */
+	SetNodeHealthStateList(NodeHealthUpdateList);
+
+	/* the health check list is kept for the next round */
+	foreach(updateCell, NodeHealthUpdateList)
+	{
+		NodeHealthUpdate *healthUpdate =
+			(NodeHealthUpdate *) lfirst(updateCell);
+
+		healthUpdate->node->healthState = healthUpdate->healthState;
+	}
+
+	NodeHealthUpdateList = NIL;
+
+	gettimeofday(&currentTime, NULL);
+
+	foreach(healthCheckCell, startedList)
+	{
+		ScheduleNextHealthCheck((HealthCheck *) lfirst(healthCheckCell),
+								currentTime);
+	}
+}
+
+
+/*
+ * ScheduleNextHealthCheck computes when to check the given node again.
+ * Healthy nodes are checked on a jittered HealthCheckPeriod interval. We
+ * check suspicious nodes faster, at the HealthCheckRetryDelay cadence: nodes
+ * that needed more than one try in their last check, and nodes where the
+ * keeper has not reported to the monitor recently.
+ */
+static void
+ScheduleNextHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	NodeHealth *nodeHealth = healthCheck->node;
+	int interval = JitteredHealthCheckPeriod();
+
+	if (healthCheck->state == HEALTH_CHECK_OK)
+	{
+		bool keeperStoppedReporting =
+			nodeHealth->reportTime != 0 &&
+			TimestampDifferenceExceeds(nodeHealth->reportTime,
+									   GetCurrentTimestamp(),
+									   HealthCheckPeriod);
+
+		if (healthCheck->hadFailure || keeperStoppedReporting)
 		{
-			break;
+			interval = Min(interval, HealthCheckRetryDelay);
 		}
-
-		WaitForEvent(healthCheckList);
 	}
+
+	healthCheck->nextCheckTime = AddTimeMillis(currentTime, interval);
+}
+
+
+/*
+ * JitteredHealthCheckPeriod returns HealthCheckPeriod, plus or minus a
+ * random HEALTH_CHECK_JITTER_PERCENT of it. On average, that's still
+ * HealthCheckPeriod.
+ */
+static int
+JitteredHealthCheckPeriod(void)
+{
+	int64 jitterRange = 2 * HEALTH_CHECK_JITTER_PERCENT + 1;
+	int64 percent = 100 - HEALTH_CHECK_JITTER_PERCENT + (random() % jitterRange);
+
+	return (int) ((int64) HealthCheckPeriod * percent / 100);
 }
 
 
 /*
- * WaitForEvent sleeps until a time-based or I/O event occurs in any of the health
- * checks.
+ * NextHealthCheckTimeout returns how long to wait until the next node is to
+ * be checked, in milliseconds, and at most HealthCheckPeriod.
  */
 static int
-WaitForEvent(List *healthCheckList)
+NextHealthCheckTimeout(List *healthCheckList)
 {
 	ListCell *healthCheckCell = NULL;
-	int healthCheckCount = list_length(healthCheckList);
 	struct timeval currentTime = { 0, 0 };
-	struct timeval nextEventTime = { 0, 0 };
-	int healthCheckIndex = 0;
-
-	struct pollfd *pollFDs = (struct pollfd *) palloc0(healthCheckCount * sizeof(struct
-																				 pollfd));
+	int timeout = HealthCheckPeriod;
 
 	gettimeofday(&currentTime, NULL);
 
 	foreach(healthCheckCell, healthCheckList)
 	{
 		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
-
-		pollFileDescriptor->fd = -1;
-		pollFileDescriptor->events = 0;
-		pollFileDescriptor->revents = 0;
+		int checkTimeout = SubtractTimes(healthCheck->nextCheckTime, currentTime);
 
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
-			healthCheck->state == HEALTH_CHECK_RETRY)
+		if (checkTimeout < timeout)
 		{
-			bool hasTimeout = healthCheck->nextEventTime.tv_sec != 0;
-
-			if (hasTimeout &&
-				(nextEventTime.tv_sec == 0 ||
-				 CompareTimes(&healthCheck->nextEventTime, &nextEventTime) < 0))
-			{
-				nextEventTime = healthCheck->nextEventTime;
-			}
+			timeout = checkTimeout;
 		}
+	}
 
-		if (healthCheck->state == HEALTH_CHECK_CONNECTING)
-		{
-			PGconn *connection = healthCheck->connection;
-			int pollEventMask = 0;
+	return timeout < 0 ? 0 : timeout;
+}
 
-			if (healthCheck->pollingStatus == PGRES_POLLING_READING)
-			{
-				pollEventMask = POLLERR | POLLIN;
-			}
-			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
-			{
-				pollEventMask = POLLERR | POLLOUT;
-			}
 
-			pollFileDescriptor->fd = PQsocket(connection);
-			pollFileDescriptor->events = pollEventMask;
+/*
+ * RecordNodeHealthState registers the result of a health check, to be
+ * written to the metadata at the end of the current round.
+ */
+static void
+RecordNodeHealthState(HealthCheck *healthCheck, NodeHealthState healthState)
+{
+	NodeHealthUpdate *healthUpdate =
+		(NodeHealthUpdate *) palloc0(sizeof(NodeHealthUpdate));
+
+	healthUpdate->node = healthCheck->node;
+	healthUpdate->healthState = healthState;
+
+	NodeHealthUpdateList = lappend(NodeHealthUpdateList, healthUpdate);
+}
+
+
+/*
+ * HealthCheckIsPending returns true when the health check has not reached a
+ * final state yet.
+ */
+static bool
+HealthCheckIsPending(HealthCheck *healthCheck)
+{
+	return healthCheck->state != HEALTH_CHECK_OK &&
+		   healthCheck->state != HEALTH_CHECK_DEAD;
+}
+
+
+/*
+ * AdvanceHealthCheck runs the health check state machine, and then registers
+ * the health check socket and timeout for the next wait. A health check that
+ * is ready to retry, or to be declared dead, is advanced again immediately.
+ */
+static void
+AdvanceHealthCheck(HealthCheckWaitState *waitState,
+				   HealthCheck *healthCheck,
+				   struct timeval currentTime)
+{
+	ManageHealthCheck(healthCheck, currentTime);
+
+	while (healthCheck->state == HEALTH_CHECK_RETRY &&
+		   (healthCheck->numTries >= HealthCheckMaxRetries + 1 ||
+			CompareTimes(&healthCheck->nextEventTime, &currentTime) <= 0))
+	{
+		ManageHealthCheck(healthCheck, currentTime);
+	}
+
+	UpdateHealthCheckWaitEvents(waitState, healthCheck);
+	ScheduleHealthCheckTimer(waitState, healthCheck);
+}
+
+
+/*
+ * UpdateHealthCheckWaitEvents updates the socket events we wait for on
+ * behalf of the given health check. Before Postgres 17 there is no way to
+ * remove a socket from a WaitEventSet, so when a health check opens or
+ * closes its connection we only mark the set for a rebuild before the next
+ * wait. A health check that races connections to several addresses waits
+ * for all of its sockets to be writeable.
+ */
+static void
+UpdateHealthCheckWaitEvents(HealthCheckWaitState *waitState,
+							HealthCheck *healthCheck)
+{
+	pgsocket socket = PGINVALID_SOCKET;
+	int socketCount = 1;
+	uint32 events = 0;
+
+	if (healthCheck->state == HEALTH_CHECK_RACING &&
+		healthCheck->raceCount > 0)
+	{
+		socket = healthCheck->raceSockets[0];
+		socketCount = healthCheck->raceCount;
+		events = WL_SOCKET_WRITEABLE;
+	}
+	else if (healthCheck->state == HEALTH_CHECK_CONNECTING ||
+		healthCheck->state == HEALTH_CHECK_PROBING ||
+		healthCheck->state == HEALTH_CHECK_SSL_PROBING)
+	{
+		socket = healthCheck->state == HEALTH_CHECK_SSL_PROBING
+				 ? healthCheck->probeSocket
+				 : PQsocket(healthCheck->connection);
+
+		if (healthCheck->pollingStatus == PGRES_POLLING_READING)
+		{
+			events = WL_SOCKET_READABLE;
+		}
+		else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+		{
+			events = WL_SOCKET_WRITEABLE;
 		}
+	}
 
-		healthCheckIndex++;
+	if (socket == PGINVALID_SOCKET || events == 0)
+	{
+		socket = PGINVALID_SOCKET;
+		socketCount = 0;
+		events = 0;
 	}
 
-	int pollTimeout = SubtractTimes(nextEventTime, currentTime);
-	if (pollTimeout < 0)
+	if (socket != healthCheck->waitSocket ||
+		socketCount != healthCheck->waitSocketCount)
 	{
-		pollTimeout = 0;
+		healthCheck->waitSocket = socket;
+		healthCheck->waitSocketCount = socketCount;
+		healthCheck->waitEvents = events;
+		healthCheck->waitEventPosition = -1;
+
+		waitState->rebuildWaitEventSet = true;
 	}
-	else if (pollTimeout > HealthCheckRetryDelay)
+	else if (events != healthCheck->waitEvents)
 	{
-		pollTimeout = HealthCheckRetryDelay;
+		healthCheck->waitEvents = events;
+
+		if (!waitState->rebuildWaitEventSet &&
+			healthCheck->waitEventPosition >= 0)
+		{
+			ModifyWaitEvent(waitState->waitEventSet,
+							healthCheck->waitEventPosition,
+							events, NULL);
+		}
 	}
+}
 
-	int pollResult = poll(pollFDs, healthCheckCount, pollTimeout);
 
-	if (pollResult < 0)
+/*
+ * RebuildWaitEventSet creates a new WaitEventSet with our latch, postmaster
+ * death, and the sockets of the health checks that wait for I/O.
+ */
+static void
+RebuildWaitEventSet(HealthCheckWaitState *waitState)
+{
+	ListCell *healthCheckCell = NULL;
+	int healthCheckCount = list_length(waitState->healthCheckList);
+
+	if (waitState->waitEventSet != NULL)
 	{
-		return STATUS_ERROR;
+		FreeWaitEventSet(waitState->waitEventSet);
 	}
 
-	healthCheckIndex = 0;
+	waitState->waitEventSet =
+		CreateWaitEventSet(CurrentMemoryContext,
+						   HEALTH_CHECK_WAIT_EVENTS(healthCheckCount));
 
-	foreach(healthCheckCell, healthCheckList)
+	AddWaitEventToSet(waitState->waitEventSet, WL_LATCH_SET, PGINVALID_SOCKET,
+					  MyLatch, NULL);
+	AddWaitEventToSet(waitState->waitEventSet, WL_POSTMASTER_DEATH,
+					  PGINVALID_SOCKET, NULL, NULL);
+
+	foreach(healthCheckCell, waitState->healthCheckList)
 	{
 		HealthCheck *healthCheck = (HealthCheck *) lfirst(healthCheckCell);
-		struct pollfd *pollFileDescriptor = &pollFDs[healthCheckIndex];
 
-		healthCheck->readyToPoll = pollFileDescriptor->revents &
-								   pollFileDescriptor->events;
+		if (healthCheck->waitSocket == PGINVALID_SOCKET)
+		{
+			healthCheck->waitEventPosition = -1;
+			continue;
+		}
+
+		if (healthCheck->state == HEALTH_CHECK_RACING)
+		{
+			for (int i = 0; i < healthCheck->raceCount; i++)
+			{
+				AddWaitEventToSet(waitState->waitEventSet,
+								  healthCheck->waitEvents,
+								  healthCheck->raceSockets[i],
+								  NULL, healthCheck);
+			}
+
+			/* the events of a race never change, see above */
+			healthCheck->waitEventPosition = -1;
+			continue;
+		}
 
-		healthCheckIndex++;
+		healthCheck->waitEventPosition =
+			AddWaitEventToSet(waitState->waitEventSet,
+							  healthCheck->waitEvents,
+							  healthCheck->waitSocket,
+							  NULL, healthCheck);
 	}
 
-	return 0;
+	waitState->rebuildWaitEventSet = false;
 }
 
 
 /*
- * LatchWait sleeps on the process latch until a timeout occurs.
+ * ScheduleHealthCheckTimer adds the health check timeout to the timers
+ * heap, unless it has already been added. Timers that are not relevant
+ * anymore are skipped when they reach the top of the heap.
  */
 static void
-LatchWait(long timeoutMs)
+ScheduleHealthCheckTimer(HealthCheckWaitState *waitState,
+						 HealthCheck *healthCheck)
 {
-	int waitResult = 0;
-
-	/*
-	 * Background workers mustn't call usleep() or any direct equivalent:
-	 * instead, they may wait on their process latch, which sleeps as
-	 * necessary, but is awakened if postmaster dies.  That way the
-	 * background process goes away immediately in an emergency.
-	 */
-#if (PG_VERSION_NUM >= 100000)
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs, WAIT_EVENT_CLIENT_READ);
-#else
-	waitResult = WaitLatch(MyLatch,
-						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-						   timeoutMs);
-#endif
+	if (!HealthCheckIsPending(healthCheck) ||
+		healthCheck->nextEventTime.tv_sec == 0 ||
+		(healthCheck->timerScheduled &&
+		 CompareTimes(&healthCheck->timerTime, &healthCheck->nextEventTime) == 0))
+	{
+		return;
+	}
 
-	ResetLatch(MyLatch);
+	binaryheap *timerHeap = waitState->timerHeap;
 
-	/* emergency bailout if postmaster has died */
-	if (waitResult & WL_POSTMASTER_DEATH)
+	/* when the heap is full of stale timers, start again from scratch */
+	if (timerHeap->bh_size >= timerHeap->bh_space)
 	{
-		elog(LOG, "pg_auto_failover monitor exiting");
+		ListCell *healthCheckCell = NULL;
 
-		proc_exit(1);
+		binaryheap_reset(timerHeap);
+
+		foreach(healthCheckCell, waitState->healthCheckList)
+		{
+			HealthCheck *otherHealthCheck = (HealthCheck *) lfirst(healthCheckCell);
+
+			otherHealthCheck->timerScheduled = false;
+
+			if (otherHealthCheck != healthCheck &&
+				HealthCheckIsPending(otherHealthCheck) &&
+				otherHealthCheck->nextEventTime.tv_sec != 0)
+			{
+				AddHealthCheckTimer(timerHeap, otherHealthCheck);
+			}
+		}
 	}
+
+	AddHealthCheckTimer(timerHeap, healthCheck);
 }
 
 
 /*
- * ManageHealthCheck proceeds the health check state machine.
+ * AddHealthCheckTimer adds a timer for the current nextEventTime of the given
+ * health check to the heap.
  */
 static void
-ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+AddHealthCheckTimer(binaryheap *timerHeap, HealthCheck *healthCheck)
 {
-	HealthCheckState checkState = healthCheck->state;
-	NodeHealth *nodeHealth = healthCheck->node;
+	HealthCheckTimer *timer =
+		(HealthCheckTimer *) palloc0(sizeof(HealthCheckTimer));
 
-	switch (checkState)
+	timer->healthCheck = healthCheck;
+	timer->eventTime = healthCheck->nextEventTime;
+
+	healthCheck->timerScheduled = true;
+	healthCheck->timerTime = healthCheck->nextEventTime;
+
+	binaryheap_add(timerHeap, PointerGetDatum(timer));
+}
+
+
+/*
+ * TimerIsStale returns true when the health check has moved on since the
+ * timer was added to the heap.
+ */
+static bool
+TimerIsStale(HealthCheckTimer *timer)
+{
+	HealthCheck *healthCheck = timer->healthCheck;
+
+	return !HealthCheckIsPending(healthCheck) ||
+		   CompareTimes(&timer->eventTime, &healthCheck->nextEventTime) != 0;
+}
+
+
+/*
+ * CompareHealthCheckTimers is a binaryheap comparator. The binaryheap is a
+ * max-heap, and we want the earliest timer first.
+ */
+static int
+CompareHealthCheckTimers(Datum a, Datum b, void *arg)
+{
+	HealthCheckTimer *timerA = (HealthCheckTimer *) DatumGetPointer(a);
+	HealthCheckTimer *timerB = (HealthCheckTimer *) DatumGetPointer(b);
+
+	return CompareTimes(&timerB->eventTime, &timerA->eventTime);
+}
+
+
+/*
+ * WaitForEvent sleeps until a time-based or I/O event occurs in any of the
+ * health checks, and fills in waitState->readyList with the health checks
+ * that need to be advanced. It returns how many of them are ready.
+ */
+static int
+WaitForEvent(HealthCheckWaitState *waitState)
+{
+	binaryheap *timerHeap = waitState->timerHeap;
+	struct timeval currentTime = { 0, 0 };
+	long timeout = HealthCheckRetryDelay;
+	int readyCount = 0;
+
+	if (waitState->rebuildWaitEventSet || waitState->waitEventSet == NULL)
 	{
-		case HEALTH_CHECK_RETRY:
-		{
-			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
-			{
-				SetNodeHealthState(healthCheck->node->nodeId,
-								   healthCheck->node->nodeName,
-								   healthCheck->node->nodeHost,
-								   healthCheck->node->nodePort,
-								   nodeHealth->healthState,
-								   NODE_HEALTH_BAD);
+		RebuildWaitEventSet(waitState);
+	}
 
-				healthCheck->state = HEALTH_CHECK_DEAD;
-				break;
-			}
+	/* skip stale timers, then compute our timeout from the earliest one */
+	while (!binaryheap_empty(timerHeap))
+	{
+		HealthCheckTimer *timer =
+			(HealthCheckTimer *) DatumGetPointer(binaryheap_first(timerHeap));
 
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
-			{
-				/* Retry time lies in the future */
-				break;
-			}
+		if (!TimerIsStale(timer))
+		{
+			gettimeofday(&currentTime, NULL);
 
-			/* Fall through to re-connect */
+			timeout = SubtractTimes(timer->eventTime, currentTime);
+			break;
 		}
 
-		/* fallthrough */
-		case HEALTH_CHECK_INITIAL:
-		{
-			StringInfo connInfoString = makeStringInfo();
+		PopHealthCheckTimer(timerHeap);
+	}
 
-			appendStringInfo(connInfoString, CONN_INFO_TEMPLATE,
-							 nodeHealth->nodeHost, nodeHealth->nodePort,
-							 HealthCheckTimeout);
+	if (timeout < 0)
+	{
+		timeout = 0;
+	}
+	else if (timeout > HealthCheckRetryDelay)
+	{
+		timeout = HealthCheckRetryDelay;
+	}
 
-			PGconn *connection = PQconnectStart(connInfoString->data);
-			PQsetnonblocking(connection, true);
+	int eventCount = WaitEventSetWait(waitState->waitEventSet, timeout,
+									  waitState->occurredEvents,
+									  HEALTH_CHECK_WAIT_EVENTS(
+										  list_length(waitState->healthCheckList)),
+									  WAIT_EVENT_CLIENT_READ);
 
-			ConnStatusType connStatus = PQstatus(connection);
-			if (connStatus == CONNECTION_BAD)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+	for (int eventIndex = 0; eventIndex < eventCount; eventIndex++)
+	{
+		WaitEvent *event = &waitState->occurredEvents[eventIndex];
 
-				PQfinish(connection);
+		if (event->events & WL_POSTMASTER_DEATH)
+		{
+			elog(LOG, "pg_auto_failover monitor exiting");
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+			proc_exit(1);
+		}
+
+		if (event->events & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			continue;
+		}
+
+		HealthCheck *healthCheck = (HealthCheck *) event->user_data;
+
+		if (healthCheck != NULL && !healthCheck->isReady)
+		{
+			healthCheck->readyToPoll = true;
+			healthCheck->isReady = true;
+			waitState->readyList[readyCount++] = healthCheck;
+		}
+	}
+
+	/* now add the health checks that reached their timeout */
+	gettimeofday(&currentTime, NULL);
+
+	while (!binaryheap_empty(timerHeap))
+	{
+		HealthCheckTimer *timer =
+			(HealthCheckTimer *) DatumGetPointer(binaryheap_first(timerHeap));
+		HealthCheck *healthCheck = timer->healthCheck;
+
+		if (!TimerIsStale(timer))
+		{
+			if (CompareTimes(&timer->eventTime, &currentTime) > 0)
+			{
+				break;
+			}
+
+			if (!healthCheck->isReady)
+			{
+				healthCheck->isReady = true;
+				waitState->readyList[readyCount++] = healthCheck;
+			}
+		}
+
+		PopHealthCheckTimer(timerHeap);
+	}
+
+	return readyCount;
+}
+
+
+/*
+ * PopHealthCheckTimer removes the earliest timer from the heap.
+ */
+static void
+PopHealthCheckTimer(binaryheap *timerHeap)
+{
+	HealthCheckTimer *timer =
+		(HealthCheckTimer *) DatumGetPointer(binaryheap_remove_first(timerHeap));
+	HealthCheck *healthCheck = timer->healthCheck;
+
+	if (healthCheck->timerScheduled &&
+		CompareTimes(&timer->eventTime, &healthCheck->timerTime) == 0)
+	{
+		healthCheck->timerScheduled = false;
+	}
+
+	pfree(timer);
+}
+
+
+/*
+ * LatchWait sleeps on the process latch until a timeout occurs.
+ */
+static void
+LatchWait(long timeoutMs)
+{
+	int waitResult = 0;
+
+	/*
+	 * Background workers mustn't call usleep() or any direct equivalent:
+	 * instead, they may wait on their process latch, which sleeps as
+	 * necessary, but is awakened if postmaster dies.  That way the
+	 * background process goes away immediately in an emergency.
+	 */
+#if (PG_VERSION_NUM >= 100000)
+	waitResult = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   timeoutMs, WAIT_EVENT_CLIENT_READ);
+#else
+	waitResult = WaitLatch(MyLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   timeoutMs);
+#endif
+
+	ResetLatch(MyLatch);
+
+	/* emergency bailout if postmaster has died */
+	if (waitResult & WL_POSTMASTER_DEATH)
+	{
+		elog(LOG, "pg_auto_failover monitor exiting");
+
+		proc_exit(1);
+	}
+}
+
+
+/*
+ * ManageHealthCheck proceeds the health check state machine.
+ */
+static void
+ManageHealthCheck(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	HealthCheckState checkState = healthCheck->state;
+	NodeHealth *nodeHealth = healthCheck->node;
+
+	switch (checkState)
+	{
+		case HEALTH_CHECK_RETRY:
+		{
+			if (healthCheck->numTries >= HealthCheckMaxRetries + 1)
+			{
+				RecordNodeHealthState(healthCheck, NODE_HEALTH_BAD);
+
+				healthCheck->state = HEALTH_CHECK_DEAD;
+				break;
+			}
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) > 0)
+			{
+				/* Retry time lies in the future */
+				break;
+			}
+
+			/* Fall through to re-connect */
+		}
+
+		/* fallthrough */
+		case HEALTH_CHECK_INITIAL:
+		{
+			if (StartHealthCheckProbe(healthCheck, currentTime))
+			{
+				healthCheck->numTries++;
+				break;
+			}
+
+			/*
+			 * libpq tries the addresses of a host one after the other, with
+			 * a full connect_timeout for each of them. When one address
+			 * family is blackholed, we would need several timeouts to reach
+			 * the node, so we race TCP connections to all the addresses.
+			 */
+			if (HealthCheckRaceAddresses &&
+				ResolveHealthCheckAddresses(healthCheck) > 1)
+			{
+				if (StartHealthCheckRace(healthCheck))
+				{
+					healthCheck->nextEventTime =
+						AddTimeMillis(currentTime, HealthCheckTimeout);
+					healthCheck->connectStartTime = currentTime;
+					healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+					healthCheck->state = HEALTH_CHECK_RACING;
+				}
+				else
+				{
+					healthCheck->nextEventTime =
+						AddTimeMillis(currentTime, HealthCheckRetryDelay);
+					healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+					healthCheck->state = HEALTH_CHECK_RETRY;
+					healthCheck->hadFailure = true;
+				}
+
+				healthCheck->numTries++;
+				break;
+			}
+
+			if (HealthCheckProbeOnly)
+			{
+				if (StartHealthCheckSSLProbe(healthCheck))
+				{
+					healthCheck->nextEventTime =
+						AddTimeMillis(currentTime, HealthCheckTimeout);
+					healthCheck->connectStartTime = currentTime;
+					healthCheck->state = HEALTH_CHECK_SSL_PROBING;
+				}
+				else
+				{
+					healthCheck->nextEventTime =
+						AddTimeMillis(currentTime, HealthCheckRetryDelay);
+					healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+					healthCheck->state = HEALTH_CHECK_RETRY;
+					healthCheck->hadFailure = true;
+				}
+
+				healthCheck->numTries++;
+				break;
+			}
+
+			healthCheck->connectStartTime = currentTime;
+
+			StartHealthCheckConnection(healthCheck, currentTime, NULL);
+
+			healthCheck->numTries++;
+
+			break;
+		}
+
+		case HEALTH_CHECK_RACING:
+		{
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				CloseHealthCheckRace(healthCheck);
+
+				healthCheck->nextEventTime =
+					AddTimeMillis(currentTime, HealthCheckRetryDelay);
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+				break;
+			}
+
+			if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+
+			int winner = PollHealthCheckRace(healthCheck);
+
+			if (winner < 0)
+			{
+				/* when all the connections failed, we retry later */
+				if (healthCheck->raceCount == 0)
+				{
+					healthCheck->nextEventTime =
+						AddTimeMillis(currentTime, HealthCheckRetryDelay);
+					healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+					healthCheck->state = HEALTH_CHECK_RETRY;
+					healthCheck->hadFailure = true;
+				}
+				break;
+			}
+
+			int addressIndex = healthCheck->raceAddressIndexes[winner];
+			pgsocket winnerSocket = healthCheck->raceSockets[winner];
+
+			healthCheck->raceSockets[winner] = PGINVALID_SOCKET;
+			CloseHealthCheckRace(healthCheck);
+
+			/* the SSLRequest probe goes on with the winning connection */
+			if (HealthCheckProbeOnly)
+			{
+				healthCheck->probeSocket = winnerSocket;
+				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+				healthCheck->state = HEALTH_CHECK_SSL_PROBING;
+				break;
+			}
+
+			/*
+			 * libpq can't use our socket, so we connect again to the address
+			 * that answered first. The new socket may get the number of the
+			 * one we close, make sure it's registered again.
+			 */
+			char hostaddr[NI_MAXHOST] = { 0 };
+
+			closesocket(winnerSocket);
+			healthCheck->waitSocket = PGINVALID_SOCKET;
+
+			if (pg_getnameinfo_all(&(healthCheck->addresses[addressIndex]),
+								   healthCheck->addressLengths[addressIndex],
+								   hostaddr, sizeof(hostaddr),
+								   NULL, 0, NI_NUMERICHOST) != 0)
+			{
+				healthCheck->nextEventTime =
+					AddTimeMillis(currentTime, HealthCheckRetryDelay);
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+				break;
+			}
+
+			StartHealthCheckConnection(healthCheck, currentTime, hostaddr);
+
+			break;
+		}
+
+		case HEALTH_CHECK_CONNECTING:
+		{
+			PGconn *connection = healthCheck->connection;
+			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = pollingStatus;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+				break;
+			}
+
+			if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+
+			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
+			pollingStatus = PQconnectPoll(connection);
+			char *sqlstate = connection->last_sqlstate;
+			bool receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
+			bool cannotConnectNowSqlstate = (receivedSqlstate &&
+											 strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+
+			if (pollingStatus == PGRES_POLLING_OK ||
+
+			    /* an auth request means pg is running */
+				connection->auth_req_received ||
+
+			    /* any error but CANNOT_CONNECT means the db is accepting connections */
+				(receivedSqlstate && !cannotConnectNowSqlstate))
+			{
+				if (HealthCheckPersistentConnections &&
+					pollingStatus == PGRES_POLLING_OK)
+				{
+					KeepHealthCheckConnection(healthCheck, currentTime);
+				}
+				else
+				{
+					PQfinish(connection);
+				}
+
+				RecordHealthCheckLatency(nodeHealth->nodeId,
+										 SubtractTimes(currentTime,
+													   healthCheck->connectStartTime));
+				RecordNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+
+				healthCheck->connection = NULL;
+				healthCheck->numTries = 0;
+				healthCheck->state = HEALTH_CHECK_OK;
+			}
+			else if (pollingStatus == PGRES_POLLING_FAILED)
+			{
+				struct timeval nextTryTime = { 0, 0 };
+
+				PQfinish(connection);
+
+				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+				healthCheck->nextEventTime = nextTryTime;
+				healthCheck->connection = NULL;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+			}
+			else
+			{
+				/* Health check is still connecting */
+			}
+
+			healthCheck->pollingStatus = pollingStatus;
+
+			break;
+		}
+
+		case HEALTH_CHECK_PROBING:
+		{
+			HealthCheckConnection *healthConnection =
+				healthCheck->persistentConnection;
+			PGconn *connection = healthCheck->connection;
+			bool probeFailed = false;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				probeFailed = true;
+			}
+			else if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				int flushResult = PQflush(connection);
+
+				if (flushResult < 0)
+				{
+					probeFailed = true;
+				}
+				else if (flushResult == 0)
+				{
+					healthCheck->pollingStatus = PGRES_POLLING_READING;
+				}
+				break;
+			}
+			else if (!PQconsumeInput(connection))
+			{
+				probeFailed = true;
+			}
+			else if (PQisBusy(connection))
+			{
+				/* Probe is still waiting for its result */
+				break;
+			}
+			else
+			{
+				PGresult *result = NULL;
+
+				/* any reply at all means the node is accepting connections */
+				while ((result = PQgetResult(connection)) != NULL)
+				{
+					PQclear(result);
+				}
+
+				if (PQstatus(connection) != CONNECTION_OK)
+				{
+					probeFailed = true;
+				}
+			}
+
+			if (probeFailed)
+			{
+				/*
+				 * The connection is broken, re-connect right away: a probe
+				 * failure counts as one try, like a connection failure.
+				 */
+				CloseHealthCheckConnection(healthConnection);
+
+				healthCheck->persistentConnection = NULL;
+				healthCheck->connection = NULL;
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->nextEventTime = currentTime;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+				break;
+			}
+
+			healthConnection->probeCount++;
+
+			RecordNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+
+			healthCheck->connection = NULL;
+			healthCheck->numTries = 0;
+			healthCheck->state = HEALTH_CHECK_OK;
+
+			break;
+		}
+
+		case HEALTH_CHECK_SSL_PROBING:
+		{
+			bool probeFailed = false;
+			bool probeAnswered = false;
+
+			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
+			{
+				probeFailed = true;
+			}
+			else if (!healthCheck->readyToPoll)
+			{
+				break;
+			}
+			else if (healthCheck->pollingStatus == PGRES_POLLING_WRITING)
+			{
+				int socketError = 0;
+				socklen_t optionLength = sizeof(socketError);
+				uint32 sslRequest[2] = {
+					htonl(sizeof(sslRequest)),
+					htonl(HEALTH_CHECK_SSL_REQUEST_CODE)
+				};
+
+				/* the non-blocking connect() is done, check how it went */
+				if (getsockopt(healthCheck->probeSocket, SOL_SOCKET, SO_ERROR,
+							   (char *) &socketError, &optionLength) < 0 ||
+					socketError != 0 ||
+					send(healthCheck->probeSocket, (char *) sslRequest,
+						 sizeof(sslRequest), 0) != sizeof(sslRequest))
+				{
+					probeFailed = true;
+				}
+				else
+				{
+					healthCheck->pollingStatus = PGRES_POLLING_READING;
+					break;
+				}
+			}
+			else
+			{
+				char answer = 0;
+				ssize_t received = recv(healthCheck->probeSocket, &answer,
+										sizeof(answer), 0);
+
+				if (received == sizeof(answer))
+				{
+					/*
+					 * 'S' and 'N' are the usual answers, and 'E' is an error
+					 * message: either way, Postgres is running. The checks
+					 * for connection limits and for a database that is
+					 * starting up come later, we never get to them.
+					 */
+					probeAnswered = true;
+				}
+				else if (received < 0 && (errno == EAGAIN ||
+										  errno == EWOULDBLOCK ||
+										  errno == EINTR))
+				{
+					/* Probe is still waiting for its answer */
+					break;
+				}
+				else
+				{
+					probeFailed = true;
+				}
+			}
+
+			CloseHealthCheckSSLProbe(healthCheck);
+
+			if (probeFailed)
+			{
+				healthCheck->nextEventTime =
+					AddTimeMillis(currentTime, HealthCheckRetryDelay);
+				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+				healthCheck->state = HEALTH_CHECK_RETRY;
+				healthCheck->hadFailure = true;
+			}
+			else if (probeAnswered)
+			{
+				RecordHealthCheckLatency(nodeHealth->nodeId,
+										 SubtractTimes(currentTime,
+													   healthCheck->connectStartTime));
+				RecordNodeHealthState(healthCheck, NODE_HEALTH_GOOD);
+
+				healthCheck->numTries = 0;
+				healthCheck->state = HEALTH_CHECK_OK;
+			}
+
+			break;
+		}
+
+		case HEALTH_CHECK_DEAD:
+		case HEALTH_CHECK_OK:
+		default:
+		{
+			/* Health check is done */
+		}
+	}
+}
+
+
+/*
+ * StartHealthCheckConnection starts a libpq connection to the node of the
+ * given health check, to the given numeric address when not NULL.
+ */
+static void
+StartHealthCheckConnection(HealthCheck *healthCheck,
+						   struct timeval currentTime,
+						   const char *hostaddr)
+{
+	NodeHealth *nodeHealth = healthCheck->node;
+	StringInfo connInfoString = makeStringInfo();
+
+	appendStringInfo(connInfoString, CONN_INFO_TEMPLATE,
+					 nodeHealth->nodeHost, nodeHealth->nodePort,
+					 HealthCheckTimeout);
+
+	if (hostaddr != NULL)
+	{
+		appendStringInfo(connInfoString, CONN_INFO_HOSTADDR_TEMPLATE, hostaddr);
+	}
+
+	PGconn *connection = PQconnectStart(connInfoString->data);
+	PQsetnonblocking(connection, true);
+
+	ConnStatusType connStatus = PQstatus(connection);
+	if (connStatus == CONNECTION_BAD)
+	{
+		struct timeval nextTryTime = { 0, 0 };
+
+		PQfinish(connection);
+
+		nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+
+		healthCheck->nextEventTime = nextTryTime;
+		healthCheck->connection = NULL;
+		healthCheck->pollingStatus = PGRES_POLLING_FAILED;
+		healthCheck->state = HEALTH_CHECK_RETRY;
+		healthCheck->hadFailure = true;
+	}
+	else
+	{
+		struct timeval timeoutTime = { 0, 0 };
+
+		timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+
+		healthCheck->nextEventTime = timeoutTime;
+		healthCheck->connection = connection;
+		healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+		healthCheck->state = HEALTH_CHECK_CONNECTING;
+	}
+
+	pfree(connInfoString->data);
+	pfree(connInfoString);
+}
+
+
+/*
+ * StartHealthCheckSSLProbe opens a non-blocking TCP connection to the node
+ * of the given health check, so that we may send it an SSLRequest packet.
+ * Contrary to a libpq connection, the node does not go through
+ * authentication and never takes a connection slot: the server answers the
+ * SSLRequest before it looks at the connection limits.
+ *
+ * It returns false when the connection could not be started.
+ */
+static bool
+StartHealthCheckSSLProbe(HealthCheck *healthCheck)
+{
+	NodeHealth *nodeHealth = healthCheck->node;
+	struct addrinfo hints;
+	struct addrinfo *addressList = NULL;
+	char portString[12] = { 0 };
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pg_snprintf(portString, sizeof(portString), "%d", nodeHealth->nodePort);
+
+	if (pg_getaddrinfo_all(nodeHealth->nodeHost, portString,
+						   &hints, &addressList) != 0 ||
+		addressList == NULL)
+	{
+		return false;
+	}
+
+	/* use the first address that we can start connecting to */
+	for (struct addrinfo *address = addressList;
+		 address != NULL;
+		 address = address->ai_next)
+	{
+		pgsocket probeSocket = socket(address->ai_family, SOCK_STREAM, 0);
+
+		if (probeSocket == PGINVALID_SOCKET)
+		{
+			continue;
+		}
+
+		if (!pg_set_noblock(probeSocket) ||
+			(connect(probeSocket, address->ai_addr, address->ai_addrlen) < 0 &&
+			 errno != EINPROGRESS && errno != EINTR))
+		{
+			closesocket(probeSocket);
+			continue;
+		}
+
+		healthCheck->probeSocket = probeSocket;
+		healthCheck->pollingStatus = PGRES_POLLING_WRITING;
+		break;
+	}
+
+	pg_freeaddrinfo_all(hints.ai_family, addressList);
+
+	return healthCheck->probeSocket != PGINVALID_SOCKET;
+}
+
+
+/*
+ * CloseHealthCheckSSLProbe closes the socket of an SSLRequest probe.
+ */
+static void
+CloseHealthCheckSSLProbe(HealthCheck *healthCheck)
+{
+	if (healthCheck->probeSocket != PGINVALID_SOCKET)
+	{
+		closesocket(healthCheck->probeSocket);
+		healthCheck->probeSocket = PGINVALID_SOCKET;
+	}
+}
+
+
+/*
+ * ResolveHealthCheckAddresses resolves the host of the node of the given
+ * health check, once per round: the retries of the round use the same
+ * addresses. It returns how many addresses we have, 0 when the host could
+ * not be resolved, in which case libpq reports the error.
+ */
+static int
+ResolveHealthCheckAddresses(HealthCheck *healthCheck)
+{
+	NodeHealth *nodeHealth = healthCheck->node;
+	struct addrinfo hints;
+	struct addrinfo *addressList = NULL;
+	char portString[12] = { 0 };
+
+	if (healthCheck->addressesResolved)
+	{
+		return healthCheck->addressCount;
+	}
+
+	healthCheck->addressesResolved = true;
+	healthCheck->addressCount = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	pg_snprintf(portString, sizeof(portString), "%d", nodeHealth->nodePort);
+
+	if (pg_getaddrinfo_all(nodeHealth->nodeHost, portString,
+						   &hints, &addressList) != 0 ||
+		addressList == NULL)
+	{
+		return 0;
+	}
+
+	for (struct addrinfo *address = addressList;
+		 address != NULL &&
+		 healthCheck->addressCount < HEALTH_CHECK_MAX_ADDRESSES;
+		 address = address->ai_next)
+	{
+		int index = healthCheck->addressCount;
+
+		if (address->ai_addrlen > sizeof(struct sockaddr_storage))
+		{
+			continue;
+		}
+
+		memcpy(&(healthCheck->addresses[index]),
+			   address->ai_addr, address->ai_addrlen);
+		healthCheck->addressLengths[index] = address->ai_addrlen;
+		healthCheck->addressCount++;
+	}
+
+	pg_freeaddrinfo_all(hints.ai_family, addressList);
+
+	return healthCheck->addressCount;
+}
+
+
+/*
+ * StartHealthCheckRace starts a non-blocking TCP connection to each of the
+ * resolved addresses of the node of the given health check. It returns
+ * false when none of them could be started.
+ */
+static bool
+StartHealthCheckRace(HealthCheck *healthCheck)
+{
+	healthCheck->raceCount = 0;
+
+	for (int i = 0; i < healthCheck->addressCount; i++)
+	{
+		struct sockaddr *address =
+			(struct sockaddr *) &(healthCheck->addresses[i]);
+		pgsocket raceSocket = socket(address->sa_family, SOCK_STREAM, 0);
+
+		if (raceSocket == PGINVALID_SOCKET)
+		{
+			continue;
+		}
+
+		if (!pg_set_noblock(raceSocket) ||
+			(connect(raceSocket, address, healthCheck->addressLengths[i]) < 0 &&
+			 errno != EINPROGRESS && errno != EINTR))
+		{
+			closesocket(raceSocket);
+			continue;
+		}
+
+		healthCheck->raceSockets[healthCheck->raceCount] = raceSocket;
+		healthCheck->raceAddressIndexes[healthCheck->raceCount] = i;
+		healthCheck->raceCount++;
+	}
+
+	return healthCheck->raceCount > 0;
+}
+
+
+/*
+ * PollHealthCheckRace checks the racing connections of the given health
+ * check, and closes the ones that failed. It returns the index of a
+ * connection that has been established, or -1 when none has been yet.
+ */
+static int
+PollHealthCheckRace(HealthCheck *healthCheck)
+{
+	struct pollfd pollFds[HEALTH_CHECK_MAX_ADDRESSES];
+	int raceCount = healthCheck->raceCount;
+	int keptCount = 0;
+	int winner = -1;
+
+	for (int i = 0; i < raceCount; i++)
+	{
+		pollFds[i].fd = healthCheck->raceSockets[i];
+		pollFds[i].events = POLLOUT;
+		pollFds[i].revents = 0;
+	}
+
+	if (poll(pollFds, raceCount, 0) < 0)
+	{
+		/* EINTR and such, we check again at the next event */
+		return -1;
+	}
+
+	for (int i = 0; i < raceCount; i++)
+	{
+		pgsocket raceSocket = healthCheck->raceSockets[i];
+
+		if (pollFds[i].revents != 0)
+		{
+			int socketError = 0;
+			socklen_t optionLength = sizeof(socketError);
+
+			bool connected =
+				(pollFds[i].revents & POLLOUT) != 0 &&
+				getsockopt(raceSocket, SOL_SOCKET, SO_ERROR,
+						   (char *) &socketError, &optionLength) == 0 &&
+				socketError == 0;
+
+			if (!connected)
+			{
+				closesocket(raceSocket);
+				continue;
+			}
+
+			if (winner < 0)
+			{
+				winner = keptCount;
+			}
+		}
+
+		healthCheck->raceSockets[keptCount] = raceSocket;
+		healthCheck->raceAddressIndexes[keptCount] =
+			healthCheck->raceAddressIndexes[i];
+		keptCount++;
+	}
+
+	healthCheck->raceCount = keptCount;
+
+	return winner;
+}
+
+
+/*
+ * CloseHealthCheckRace closes the racing connections of the given health
+ * check, skipping the ones that have been set to PGINVALID_SOCKET.
+ */
+static void
+CloseHealthCheckRace(HealthCheck *healthCheck)
+{
+	for (int i = 0; i < healthCheck->raceCount; i++)
+	{
+		if (healthCheck->raceSockets[i] != PGINVALID_SOCKET)
+		{
+			closesocket(healthCheck->raceSockets[i]);
+		}
+	}
+
+	healthCheck->raceCount = 0;
+}
+
+
+/*
+ * StartHealthCheckProbe sends the probe query on the connection kept open
+ * from a previous round for this node, if any. It returns false when there
+ * is no such connection, or when it can't be used anymore, in which case
+ * the caller opens a new connection.
+ */
+static bool
+StartHealthCheckProbe(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	HealthCheckConnection *healthConnection = healthCheck->persistentConnection;
+
+	if (healthConnection == NULL)
+	{
+		return false;
+	}
+
+	if (!HealthCheckPersistentConnections ||
+		PQstatus(healthConnection->connection) != CONNECTION_OK ||
+		!PQsendQuery(healthConnection->connection, HEALTH_CHECK_PROBE_QUERY))
+	{
+		CloseHealthCheckConnection(healthConnection);
+		healthCheck->persistentConnection = NULL;
+
+		return false;
+	}
+
+	int flushResult = PQflush(healthConnection->connection);
+
+	if (flushResult < 0)
+	{
+		CloseHealthCheckConnection(healthConnection);
+		healthCheck->persistentConnection = NULL;
+
+		return false;
+	}
+
+	healthCheck->connection = healthConnection->connection;
+	healthCheck->nextEventTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+	healthCheck->pollingStatus =
+		flushResult == 0 ? PGRES_POLLING_READING : PGRES_POLLING_WRITING;
+	healthCheck->state = HEALTH_CHECK_PROBING;
+
+	return true;
+}
+
+
+/*
+ * KeepHealthCheckConnection registers the now established connection of the
+ * given health check so that the next rounds may probe it.
+ */
+static void
+KeepHealthCheckConnection(HealthCheck *healthCheck, struct timeval currentTime)
+{
+	NodeHealth *nodeHealth = healthCheck->node;
+	MemoryContext oldContext =
+		MemoryContextSwitchTo(HealthCheckConnectionContext);
+
+	HealthCheckConnection *healthConnection =
+		(HealthCheckConnection *) palloc0(sizeof(HealthCheckConnection));
+
+	healthConnection->nodeId = nodeHealth->nodeId;
+	healthConnection->nodeHost = pstrdup(nodeHealth->nodeHost);
+	healthConnection->nodePort = nodeHealth->nodePort;
+	healthConnection->connection = healthCheck->connection;
+	healthConnection->connectedTime = currentTime;
+	healthConnection->probeCount = 0;
+
+	HealthCheckConnectionList =
+		lappend(HealthCheckConnectionList, healthConnection);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = PGRES_POLLING_FAILED;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
-			{
-				struct timeval timeoutTime = { 0, 0 };
+	MemoryContextSwitchTo(oldContext);
 
-				timeoutTime = AddTimeMillis(currentTime, HealthCheckTimeout);
+	healthCheck->persistentConnection = healthConnection;
+}
 
-				healthCheck->nextEventTime = timeoutTime;
-				healthCheck->connection = connection;
-				healthCheck->pollingStatus = PGRES_POLLING_WRITING;
-				healthCheck->state = HEALTH_CHECK_CONNECTING;
-			}
 
-			healthCheck->numTries++;
+/*
+ * CloseHealthCheckConnection closes a persistent connection and forgets
+ * about it.
+ */
+static void
+CloseHealthCheckConnection(HealthCheckConnection *healthConnection)
+{
+	struct timeval currentTime = { 0, 0 };
 
-			pfree(connInfoString->data);
-			pfree(connInfoString);
+	gettimeofday(&currentTime, NULL);
 
-			break;
-		}
+	elog(DEBUG1,
+		 "closing health check connection to node %lld (%s:%d) "
+		 "after %d ms and %llu probes",
+		 (long long) healthConnection->nodeId,
+		 healthConnection->nodeHost,
+		 healthConnection->nodePort,
+		 SubtractTimes(currentTime, healthConnection->connectedTime),
+		 (unsigned long long) healthConnection->probeCount);
 
-		case HEALTH_CHECK_CONNECTING:
-		{
-			PGconn *connection = healthCheck->connection;
-			PostgresPollingStatusType pollingStatus = PGRES_POLLING_FAILED;
+	PQfinish(healthConnection->connection);
 
-			if (CompareTimes(&healthCheck->nextEventTime, &currentTime) < 0)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+	HealthCheckConnectionList =
+		list_delete_ptr(HealthCheckConnectionList, healthConnection);
 
-				PQfinish(connection);
+	pfree(healthConnection->nodeHost);
+	pfree(healthConnection);
+}
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->pollingStatus = pollingStatus;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-				break;
-			}
+/*
+ * FindHealthCheckConnection returns the persistent connection to the given
+ * node, or NULL. A connection to a node that has since changed its host or
+ * port is closed.
+ */
+static HealthCheckConnection *
+FindHealthCheckConnection(NodeHealth *nodeHealth)
+{
+	ListCell *connectionCell = NULL;
 
-			if (!healthCheck->readyToPoll)
-			{
-				break;
-			}
+	foreach(connectionCell, HealthCheckConnectionList)
+	{
+		HealthCheckConnection *healthConnection =
+			(HealthCheckConnection *) lfirst(connectionCell);
 
-			/* This logic is taken from libpq's internal_ping (fe-connect.c) */
-			pollingStatus = PQconnectPoll(connection);
-			char *sqlstate = connection->last_sqlstate;
-			bool receivedSqlstate = (sqlstate != NULL && strlen(sqlstate) == 5);
-			bool cannotConnectNowSqlstate = (receivedSqlstate &&
-											 strcmp(sqlstate, CANNOT_CONNECT_NOW) == 0);
+		if (healthConnection->nodeId != nodeHealth->nodeId)
+		{
+			continue;
+		}
 
-			if (pollingStatus == PGRES_POLLING_OK ||
+		if (healthConnection->nodePort != nodeHealth->nodePort ||
+			strcmp(healthConnection->nodeHost, nodeHealth->nodeHost) != 0)
+		{
+			CloseHealthCheckConnection(healthConnection);
+			return NULL;
+		}
 
-			    /* an auth request means pg is running */
-				connection->auth_req_received ||
+		return healthConnection;
+	}
 
-			    /* any error but CANNOT_CONNECT means the db is accepting connections */
-				(receivedSqlstate && !cannotConnectNowSqlstate))
-			{
-				PQfinish(connection);
+	return NULL;
+}
 
-				SetNodeHealthState(healthCheck->node->nodeId,
-								   healthCheck->node->nodeName,
-								   healthCheck->node->nodeHost,
-								   healthCheck->node->nodePort,
-								   nodeHealth->healthState,
-								   NODE_HEALTH_GOOD);
 
-				healthCheck->connection = NULL;
-				healthCheck->numTries = 0;
-				healthCheck->state = HEALTH_CHECK_OK;
-			}
-			else if (pollingStatus == PGRES_POLLING_FAILED)
-			{
-				struct timeval nextTryTime = { 0, 0 };
+/*
+ * CloseUnusedHealthCheckConnections closes the persistent connections to
+ * nodes that are not part of the given list anymore, and all of them when
+ * persistent connections have been disabled.
+ */
+static void
+CloseUnusedHealthCheckConnections(List *nodeHealthList)
+{
+	List *unusedConnectionList = NIL;
+	ListCell *connectionCell = NULL;
 
-				PQfinish(connection);
+	foreach(connectionCell, HealthCheckConnectionList)
+	{
+		HealthCheckConnection *healthConnection =
+			(HealthCheckConnection *) lfirst(connectionCell);
+		bool found = false;
+		ListCell *nodeHealthCell = NULL;
 
-				nextTryTime = AddTimeMillis(currentTime, HealthCheckRetryDelay);
+		foreach(nodeHealthCell, nodeHealthList)
+		{
+			NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
 
-				healthCheck->nextEventTime = nextTryTime;
-				healthCheck->connection = NULL;
-				healthCheck->state = HEALTH_CHECK_RETRY;
-			}
-			else
+			if (nodeHealth->nodeId == healthConnection->nodeId)
 			{
-				/* Health check is still connecting */
+				found = true;
+				break;
 			}
-
-			healthCheck->pollingStatus = pollingStatus;
-
-			break;
 		}
 
-		case HEALTH_CHECK_DEAD:
-		case HEALTH_CHECK_OK:
-		default:
+		if (!found || !HealthCheckPersistentConnections)
 		{
-			/* Health check is done */
+			unusedConnectionList =
+				lappend(unusedConnectionList, healthConnection);
 		}
 	}
+
+	foreach(connectionCell, unusedConnectionList)
+	{
+		CloseHealthCheckConnection(
+			(HealthCheckConnection *) lfirst(connectionCell));
+	}
+
+	list_free(unusedConnectionList);
 }
 
 
@@ -1139,6 +2896,9 @@ HealthCheckWorkerShmemInit(void)
 
 		LWLockInitialize(&HealthCheckHelperControl->lock,
 						 HealthCheckHelperControl->trancheId);
+
+		pg_atomic_init_u64(&HealthCheckHelperControl->nodeListGeneration, 0);
+		HealthCheckHelperControl->launcherLatch = NULL;
 	}
 
 	memset(&hashInfo, 0, sizeof(hashInfo));
@@ -1162,14 +2922,14 @@ HealthCheckWorkerShmemInit(void)
 
 
 /*
- * StopHealthCheckWorker stops the maintenance daemon for the given database
- * and removes it from the Health Check Launcher control hash.
+ * StopHealthCheckWorker stops the maintenance daemons for the given database
+ * and removes them from the Health Check Launcher control hash.
  */
 void
 StopHealthCheckWorker(Oid databaseId)
 {
 	bool found = false;
-	pid_t workerPid = 0;
+	pid_t workerPids[HEALTH_CHECK_WORKER_SLOTS] = { 0 };
 
 	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
 
@@ -1179,7 +2939,46 @@ StopHealthCheckWorker(Oid databaseId)
 
 	if (found)
 	{
-		workerPid = dbData->workerPid;
+		for (int workerIndex = 0; workerIndex < HEALTH_CHECK_WORKER_SLOTS; workerIndex++)
+		{
+			workerPids[workerIndex] = dbData->workers[workerIndex].workerPid;
+		}
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	for (int workerIndex = 0; workerIndex < HEALTH_CHECK_WORKER_SLOTS; workerIndex++)
+	{
+		if (workerPids[workerIndex] > 0)
+		{
+			kill(workerPids[workerIndex], SIGTERM);
+		}
+	}
+}
+
+
+/*
+ * StopHealthCheckWorkerSlot stops the given health check worker of a
+ * database, and clears its entry so that the launcher starts it again.
+ */
+static void
+StopHealthCheckWorkerSlot(Oid databaseId, int workerIndex)
+{
+	pid_t workerPid = 0;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		workerPid = dbData->workers[workerIndex].workerPid;
+
+		dbData->workers[workerIndex].workerPid = 0;
+		dbData->workers[workerIndex].handle = NULL;
+		dbData->workers[workerIndex].latch = NULL;
 	}
 
 	LWLockRelease(&HealthCheckHelperControl->lock);
@@ -1189,3 +2988,219 @@ StopHealthCheckWorker(Oid databaseId)
 		kill(workerPid, SIGTERM);
 	}
 }
+
+
+/*
+ * HealthCheckWorkerOwnsShard returns true when the current process is still
+ * the registered health check worker for the given database and shard,
+ * which guarantees that each node is probed by a single worker.
+ */
+static bool
+HealthCheckWorkerOwnsShard(Oid databaseId, int workerIndex)
+{
+	bool ownsShard = false;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		ownsShard = dbData->workers[workerIndex].workerPid == MyProcPid;
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	return ownsShard;
+}
+
+
+/*
+ * SetHealthCheckExtensionState records whether the pgautofailover extension
+ * exists in the given database, and wakes up the launcher when that changed
+ * so that it starts or stops the workers there. Databases that the launcher
+ * has not seen yet are skipped: it starts their first worker anyway.
+ */
+static void
+SetHealthCheckExtensionState(Oid databaseId, HealthCheckExtensionState state)
+{
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL && dbData->extensionState != state)
+	{
+		dbData->extensionState = state;
+
+		if (HealthCheckHelperControl->launcherLatch != NULL)
+		{
+			SetLatch(HealthCheckHelperControl->launcherLatch);
+		}
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+}
+
+
+/*
+ * HealthCheckExtensionIsAbsent is called by a health check worker that did
+ * not find the extension in its database. It returns true when the worker
+ * should exit, having recorded that the extension is absent, and false when
+ * a concurrent CREATE EXTENSION has been committed meanwhile, in which case
+ * the worker checks again.
+ */
+static bool
+HealthCheckExtensionIsAbsent(Oid databaseId, int workerIndex)
+{
+	bool isAbsent = false;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_EXCLUSIVE);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL &&
+		dbData->extensionState != HEALTH_CHECK_EXTENSION_PRESENT)
+	{
+		dbData->extensionState = HEALTH_CHECK_EXTENSION_ABSENT;
+
+		/* we are exiting, the launcher must not signal this pid anymore */
+		if (dbData->workers[workerIndex].workerPid == MyProcPid)
+		{
+			dbData->workers[workerIndex].workerPid = 0;
+		}
+
+		isAbsent = true;
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	return isAbsent;
+}
+
+
+/*
+ * FilterNodeHealthShard returns the nodes of the given list that belong to
+ * the shard of the given worker. Node ids are allocated from a sequence, so
+ * a simple modulo spreads the nodes evenly.
+ */
+static List *
+FilterNodeHealthShard(List *nodeHealthList, int workerIndex)
+{
+	List *shardNodeHealthList = NIL;
+	ListCell *nodeHealthCell = NULL;
+
+	if (HealthCheckWorkers <= 1)
+	{
+		return nodeHealthList;
+	}
+
+	foreach(nodeHealthCell, nodeHealthList)
+	{
+		NodeHealth *nodeHealth = (NodeHealth *) lfirst(nodeHealthCell);
+
+		if ((uint64) nodeHealth->nodeId % HealthCheckWorkers == workerIndex)
+		{
+			shardNodeHealthList = lappend(shardNodeHealthList, nodeHealth);
+		}
+	}
+
+	return shardNodeHealthList;
+}
+
+
+/*
+ * HealthCheckWorkerRole returns what the worker in the given slot is in
+ * charge of, for log messages.
+ */
+static const char *
+HealthCheckWorkerRole(int workerIndex)
+{
+	return workerIndex == GROUP_STATE_SCHEDULER_INDEX
+		   ? "group state scheduling"
+		   : "health checks";
+}
+
+
+/*
+ * GroupStateSchedulerAttach registers the current process as the group
+ * state scheduler of the given database, with the latch that backends set
+ * to wake it up. It returns false when the launcher has no entry for this
+ * database, as happens after a crash and restart.
+ */
+bool
+GroupStateSchedulerAttach(Oid databaseId)
+{
+	bool attached = false;
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		HealthCheckHelperWorker *workerData =
+			&(dbData->workers[GROUP_STATE_SCHEDULER_INDEX]);
+
+		workerData->workerPid = MyProcPid;
+		workerData->latch = MyLatch;
+
+		attached = true;
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+
+	return attached;
+}
+
+
+/*
+ * GroupStateSchedulerIsAttached returns true when the current process is
+ * still the registered group state scheduler of the given database.
+ */
+bool
+GroupStateSchedulerIsAttached(Oid databaseId)
+{
+	return HealthCheckWorkerOwnsShard(databaseId, GROUP_STATE_SCHEDULER_INDEX);
+}
+
+
+/*
+ * WakeGroupStateScheduler sets the latch of the group state scheduler of
+ * the given database, if it is running, so that it proceeds the groups that
+ * have pending changes without waiting for its next period.
+ */
+void
+WakeGroupStateScheduler(Oid databaseId)
+{
+	if (HealthCheckHelperControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&HealthCheckHelperControl->lock, LW_SHARED);
+
+	HealthCheckHelperDatabase *dbData = (HealthCheckHelperDatabase *)
+										hash_search(HealthCheckWorkerDBHash,
+													&databaseId, HASH_FIND, NULL);
+
+	if (dbData != NULL)
+	{
+		HealthCheckHelperWorker *workerData =
+			&(dbData->workers[GROUP_STATE_SCHEDULER_INDEX]);
+
+		if (workerData->workerPid > 0 && workerData->latch != NULL)
+		{
+			SetLatch(workerData->latch);
+		}
+	}
+
+	LWLockRelease(&HealthCheckHelperControl->lock);
+}
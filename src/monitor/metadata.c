@@ -4,6 +4,14 @@
  *
  * Implementation of functions related to pg_auto_failover metadata.
  *
+ * Keepers call the protocol functions over long-lived connections, and each
+ * call checks the extension version and may resolve the OIDs of our schema
+ * and relations. Each backend caches those OIDs until a syscache callback on
+ * pg_namespace or pg_class tells us they might have changed. The version
+ * check reads the control files of all the available extensions, so its
+ * result is kept too, and only the installed version is compared again at
+ * each call, from pg_extension directly.
+ *
  * Copyright (c) Microsoft Corporation. All rights reserved.
  * Licensed under the PostgreSQL License.
  *
@@ -15,6 +23,7 @@
 #include "fmgr.h"
 
 #include "metadata.h"
+#include "protocol_stats.h"
 #include "version_compat.h"
 
 #include "access/genam.h"
@@ -31,15 +40,83 @@
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
+#include "portability/instr_time.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/hsearch.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/syscache.h"
 
 bool EnableVersionChecks = true; /* version checks are enabled */
 
+/* we only ever need a handful of our relations from C code */
+#define METADATA_RELATION_CACHE_SIZE 16
+
+typedef struct MetadataRelationCacheEntry
+{
+	NameData relname;
+	Oid relationId;
+} MetadataRelationCacheEntry;
+
+/* per-backend caches, see InvalidateMetadataCache */
+static bool MetadataCallbackIsRegistered = false;
+static Oid CachedSchemaId = InvalidOid;
+static MetadataRelationCacheEntry RelationCache[METADATA_RELATION_CACHE_SIZE];
+static int RelationCacheCount = 0;
+static bool AvailableVersionIsChecked = false;
+
+
+static void AcquireMonitorLock(LOCKTAG *tag, LOCKMODE lockMode);
+static void RegisterMetadataCacheCallbacks(void);
+static void InvalidateMetadataCache(Datum argument, int cacheId,
+									uint32 hashValue);
+static char * pgAutoFailoverInstalledVersion(void);
+
+
+/*
+ * RegisterMetadataCacheCallbacks registers our syscache callbacks, once per
+ * backend.
+ */
+static void
+RegisterMetadataCacheCallbacks(void)
+{
+	if (MetadataCallbackIsRegistered)
+	{
+		return;
+	}
+
+	CacheRegisterSyscacheCallback(NAMESPACEOID, InvalidateMetadataCache,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(RELOID, InvalidateMetadataCache,
+								  (Datum) 0);
+
+	MetadataCallbackIsRegistered = true;
+}
+
+
+/*
+ * InvalidateMetadataCache forgets the cached OIDs when pg_namespace or
+ * pg_class change, which happens when the extension is dropped, created, or
+ * updated. We don't know which entry changed, so we forget them all, and the
+ * next lookups fill in the cache again.
+ */
+static void
+InvalidateMetadataCache(Datum argument, int cacheId, uint32 hashValue)
+{
+	CachedSchemaId = InvalidOid;
+	RelationCacheCount = 0;
+
+	/* a new extension might come with new control files */
+	if (cacheId == NAMESPACEOID)
+	{
+		AvailableVersionIsChecked = false;
+	}
+}
+
+
 /*
  * pgAutoFailoverRelationId returns the OID of a given relation in the
  * pgautofailover schema.
@@ -47,6 +124,15 @@ bool EnableVersionChecks = true; /* version checks are enabled */
 Oid
 pgAutoFailoverRelationId(const char *relname)
 {
+	for (int index = 0; index < RelationCacheCount; index++)
+	{
+		if (strncmp(NameStr(RelationCache[index].relname),
+					relname, NAMEDATALEN) == 0)
+		{
+			return RelationCache[index].relationId;
+		}
+	}
+
 	Oid namespaceId = pgAutoFailoverSchemaId();
 
 	Oid relationId = get_relname_relid(relname, namespaceId);
@@ -55,6 +141,16 @@ pgAutoFailoverRelationId(const char *relname)
 		ereport(ERROR, (errmsg("%s does not exist", relname)));
 	}
 
+	if (RelationCacheCount < METADATA_RELATION_CACHE_SIZE)
+	{
+		MetadataRelationCacheEntry *entry = &(RelationCache[RelationCacheCount]);
+
+		namestrcpy(&(entry->relname), relname);
+		entry->relationId = relationId;
+
+		++RelationCacheCount;
+	}
+
 	return relationId;
 }
 
@@ -66,6 +162,13 @@ pgAutoFailoverRelationId(const char *relname)
 Oid
 pgAutoFailoverSchemaId(void)
 {
+	if (OidIsValid(CachedSchemaId))
+	{
+		return CachedSchemaId;
+	}
+
+	RegisterMetadataCacheCallbacks();
+
 	Oid namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
 	if (namespaceId == InvalidOid)
 	{
@@ -75,10 +178,55 @@ pgAutoFailoverSchemaId(void)
 						 AUTO_FAILOVER_EXTENSION_NAME)));
 	}
 
+	CachedSchemaId = namespaceId;
+
 	return namespaceId;
 }
 
 
+/*
+ * pgAutoFailoverInstalledVersion returns the installed version of the
+ * extension from pg_extension, or NULL when it's not installed.
+ */
+static char *
+pgAutoFailoverInstalledVersion(void)
+{
+	ScanKeyData scanKey[1];
+	bool indexOK = true;
+	char *installedVersion = NULL;
+
+	Relation pgExtension = heap_open(ExtensionRelationId, AccessShareLock);
+
+	ScanKeyInit(&scanKey[0], Anum_pg_extension_extname, BTEqualStrategyNumber,
+				F_NAMEEQ, CStringGetDatum(AUTO_FAILOVER_EXTENSION_NAME));
+
+	SysScanDesc scanDescriptor = systable_beginscan(pgExtension, ExtensionNameIndexId,
+													indexOK,
+													NULL, 1, scanKey);
+
+	HeapTuple extensionTuple = systable_getnext(scanDescriptor);
+
+	if (HeapTupleIsValid(extensionTuple))
+	{
+		bool isNull = false;
+		Datum versionDatum = heap_getattr(extensionTuple,
+										  Anum_pg_extension_extversion,
+										  RelationGetDescr(pgExtension),
+										  &isNull);
+
+		if (!isNull)
+		{
+			installedVersion = TextDatumGetCString(versionDatum);
+		}
+	}
+
+	systable_endscan(scanDescriptor);
+	heap_close(pgExtension, AccessShareLock);
+
+	return installedVersion;
+}
+
+
 /*
  * pgAutoFailoverExtensionOwner gets the owner of the extension and verifies
  * that this is the superuser.
@@ -130,23 +278,68 @@ pgAutoFailoverExtensionOwner(void)
 }
 
 
+/*
+ * AcquireMonitorLock acquires the given lock for the rest of the transaction.
+ * When the lock is not available right away, the time spent waiting for it
+ * is added to the protocol statistics.
+ */
+static void
+AcquireMonitorLock(LOCKTAG *tag, LOCKMODE lockMode)
+{
+	const bool sessionLock = false;
+	instr_time startTime;
+	instr_time waitTime;
+
+	if (LockAcquire(tag, lockMode, sessionLock, true) != LOCKACQUIRE_NOT_AVAIL)
+	{
+		return;
+	}
+
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	(void) LockAcquire(tag, lockMode, sessionLock, false);
+
+	INSTR_TIME_SET_CURRENT(waitTime);
+	INSTR_TIME_SUBTRACT(waitTime, startTime);
+
+	ProtocolStatsAddLockWait(INSTR_TIME_GET_MILLISEC(waitTime));
+}
+
+
 /*
  * LockFormation takes a lock on a formation to prevent concurrent
  * membership changes.
  */
 void
 LockFormation(char *formationId, LOCKMODE lockMode)
+{
+	LOCKTAG tag;
+	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, formationIdHash,
+						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION);
+
+	AcquireMonitorLock(&tag, lockMode);
+}
+
+
+/*
+ * UnlockFormation releases a lock taken with LockFormation before the end of
+ * the transaction, which allows to switch to a stronger lock mode without
+ * risking a deadlock with another backend trying to do the same.
+ */
+void
+UnlockFormation(char *formationId, LOCKMODE lockMode)
 {
 	LOCKTAG tag;
 	const bool sessionLock = false;
-	const bool dontWait = false;
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, 0, formationIdHash,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_FORMATION);
 
-	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	(void) LockRelease(&tag, lockMode, sessionLock);
 }
 
 
@@ -156,17 +349,34 @@ LockFormation(char *formationId, LOCKMODE lockMode)
  */
 void
 LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
+{
+	LOCKTAG tag;
+	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
+
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, formationIdHash, (uint32) groupId,
+						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP);
+
+	AcquireMonitorLock(&tag, lockMode);
+}
+
+
+/*
+ * UnlockNodeGroup releases a lock taken with LockNodeGroup before the end of
+ * the transaction, which allows to switch to a stronger lock mode without
+ * risking a deadlock with another backend trying to do the same.
+ */
+void
+UnlockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
 {
 	LOCKTAG tag;
 	const bool sessionLock = false;
-	const bool dontWait = false;
 
 	uint32 formationIdHash = string_hash(formationId, NAMEDATALEN);
 
 	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, formationIdHash, (uint32) groupId,
 						 ADV_LOCKTAG_CLASS_AUTO_FAILOVER_NODE_GROUP);
 
-	(void) LockAcquire(&tag, lockMode, sessionLock, dontWait);
+	(void) LockRelease(&tag, lockMode, sessionLock);
 }
 
 
@@ -179,6 +389,10 @@ LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode)
  * We need to be careful that the pgautofailover.so that is currently loaded in
  * the Postgres backend is intended to work with the current extension version
  * definition (schema and SQL definitions of C coded functions).
+ *
+ * The latest available version is only checked once per backend, the loaded
+ * library doesn't change anyway. The installed version is checked at every
+ * call, as ALTER EXTENSION UPDATE might happen at any time.
  */
 bool
 checkPgAutoFailoverVersion()
@@ -200,6 +414,19 @@ checkPgAutoFailoverVersion()
 		return true;
 	}
 
+	if (AvailableVersionIsChecked)
+	{
+		installedVersion = pgAutoFailoverInstalledVersion();
+
+		if (installedVersion != NULL &&
+			strcmp(AUTO_FAILOVER_EXTENSION_VERSION, installedVersion) == 0)
+		{
+			return true;
+		}
+	}
+
+	RegisterMetadataCacheCallbacks();
+
 	SPI_connect();
 
 	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
@@ -273,5 +500,7 @@ checkPgAutoFailoverVersion()
 		return false;
 	}
 
+	AvailableVersionIsChecked = true;
+
 	return true;
 }
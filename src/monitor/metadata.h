@@ -20,7 +20,22 @@
 #define AUTO_FAILOVER_SCHEMA_NAME "pgautofailover"
 #define AUTO_FAILOVER_FORMATION_TABLE "pgautofailover.formation"
 #define AUTO_FAILOVER_NODE_TABLE "pgautofailover.node"
+#define AUTO_FAILOVER_NODE_BASE_TABLE "pgautofailover.node_base"
+#define AUTO_FAILOVER_NODE_HEARTBEAT_TABLE "pgautofailover.node_heartbeat"
 #define AUTO_FAILOVER_EVENT_TABLE "pgautofailover.event"
+#define AUTO_FAILOVER_GROUP_VERSION_TABLE "pgautofailover.group_version"
+#define AUTO_FAILOVER_REPLICATION_STATS_TABLE "pgautofailover.replication_stats"
+#define AUTO_FAILOVER_NODE_UPSTREAM_TABLE "pgautofailover.node_upstream"
+#define AUTO_FAILOVER_DRAIN_STATS_TABLE "pgautofailover.drain_stats"
+#define AUTO_FAILOVER_NODE_LATENCY_TABLE "pgautofailover.node_latency"
+#define AUTO_FAILOVER_NODE_HISTORY_TABLE "pgautofailover.node_history"
+#define AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE \
+	"pgautofailover.sync_quorum_exclusion"
+#define AUTO_FAILOVER_FAILOVER_TRACE_TABLE "pgautofailover.failover_trace"
+#define AUTO_FAILOVER_PUSHED_SETTINGS_TABLE "pgautofailover.pushed_settings"
+#define AUTO_FAILOVER_FAILOVER_DRILL_TABLE "pgautofailover.failover_drill"
+#define AUTO_FAILOVER_FAILOVER_DRILL_HISTORY_TABLE \
+	"pgautofailover.failover_drill_history"
 #define REPLICATION_STATE_TYPE_NAME "replication_state"
 
 
@@ -43,5 +58,7 @@ extern Oid pgAutoFailoverRelationId(const char *relname);
 extern Oid pgAutoFailoverSchemaId(void);
 extern Oid pgAutoFailoverExtensionOwner(void);
 extern void LockFormation(char *formationId, LOCKMODE lockMode);
+extern void UnlockFormation(char *formationId, LOCKMODE lockMode);
 extern void LockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode);
+extern void UnlockNodeGroup(char *formationId, int groupId, LOCKMODE lockMode);
 extern bool checkPgAutoFailoverVersion(void);
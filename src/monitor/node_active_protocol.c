@@ -17,28 +17,55 @@
 #include "miscadmin.h"
 #include "access/xact.h"
 
+#include "discovery_cache.h"
+#include "failover_trace.h"
+#include "failure_detector.h"
 #include "formation_metadata.h"
 #include "group_state_machine.h"
 #include "metadata.h"
+#include "node_cache.h"
+#include "node_history.h"
 #include "node_metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
+#include "sync_quorum.h"
+#include "sync_rep_stall.h"
+#include "version_compat.h"
 
 #include "access/htup_details.h"
 #include "access/xlogdefs.h"
 #include "catalog/pg_enum.h"
+#include "catalog/pg_type.h"
 #include "nodes/makefuncs.h"
 #include "nodes/parsenodes.h"
 #include "parser/parse_type.h"
 #include "storage/lockdefs.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/json.h"
 #include "utils/pg_lsn.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * The group state machine compares LSN positions with thresholds expressed in
+ * WAL bytes, the smallest default being 16MB. Keepers reporting an LSN that
+ * moved to another bucket of that size go through the state machine.
+ */
+#define NODE_ACTIVE_LSN_BUCKET_SIZE (16 * 1024 * 1024)
 
 
 /* private function forward declarations */
+static AutoFailoverNodeState * NodeActiveFromArguments(FunctionCallInfo fcinfo);
 static AutoFailoverNodeState * NodeActive(char *formationId,
 										  AutoFailoverNodeState *currentNodeState);
+static bool NodeReportIsUnchanged(AutoFailoverNode *pgAutoFailoverNode,
+								  AutoFailoverNodeState *currentNodeState);
+static bool RegisterNodeNeedsFormationLock(AutoFailoverFormation *formation,
+										   FormationKind expectedFormationKind,
+										   const char *expectedDBName,
+										   int currentGroupId);
 static void JoinAutoFailoverFormation(AutoFailoverFormation *formation,
 									  char *nodeName, char *nodeHost, int nodePort,
 									  uint64 sysIdentifier, char *nodeCluster,
@@ -47,26 +74,50 @@ static int AssignGroupId(AutoFailoverFormation *formation,
 						 char *nodeHost, int nodePort,
 						 ReplicationState *initialState);
 
-static bool RemoveNode(AutoFailoverNode *currentNode, bool force);
+static bool RemoveNode(AutoFailoverNode *currentNode, bool force,
+					   bool proceedGroupState);
+static void ProceedGroupStateAfterRemoval(AutoFailoverFormation *formation,
+										  AutoFailoverNode *removedNode,
+										  bool removedNodeIsPrimary,
+										  AutoFailoverNode *firstStandbyNode);
+static bool IsNodeInGroupList(List *nodeList, AutoFailoverNode *node);
+static void OtherNodesToJson(StringInfo json, List *nodesList);
+static AutoFailoverNode * SelectBaseBackupSourceNode(AutoFailoverNode *currentNode,
+													AutoFailoverNode *primaryNode);
+static void CheckSwitchoverDrainCost(AutoFailoverNode *primaryNode);
+static void CheckNodeCandidatePriority(AutoFailoverNode *currentNode,
+									   int candidatePriority);
+static void CheckNodeReplicationQuorum(AutoFailoverNode *currentNode,
+									   bool replicationQuorum);
+static void CheckNodeReplicationQuorumOptOut(AutoFailoverNode *currentNode);
 
 /* SQL-callable function declarations */
 PG_FUNCTION_INFO_V1(register_node);
 PG_FUNCTION_INFO_V1(node_active);
+PG_FUNCTION_INFO_V1(node_active_v2);
 PG_FUNCTION_INFO_V1(update_node_metadata);
 PG_FUNCTION_INFO_V1(get_nodes);
+PG_FUNCTION_INFO_V1(current_state);
+PG_FUNCTION_INFO_V1(current_state_page);
 PG_FUNCTION_INFO_V1(get_primary);
 PG_FUNCTION_INFO_V1(get_other_node);
 PG_FUNCTION_INFO_V1(get_other_nodes);
 PG_FUNCTION_INFO_V1(remove_node);
 PG_FUNCTION_INFO_V1(remove_node_by_nodeid);
 PG_FUNCTION_INFO_V1(remove_node_by_host);
+PG_FUNCTION_INFO_V1(remove_nodes);
 PG_FUNCTION_INFO_V1(perform_failover);
 PG_FUNCTION_INFO_V1(perform_promotion);
 PG_FUNCTION_INFO_V1(start_maintenance);
 PG_FUNCTION_INFO_V1(stop_maintenance);
 PG_FUNCTION_INFO_V1(set_node_candidate_priority);
 PG_FUNCTION_INFO_V1(set_node_replication_quorum);
+PG_FUNCTION_INFO_V1(set_node_properties);
+PG_FUNCTION_INFO_V1(set_node_upstream);
+PG_FUNCTION_INFO_V1(get_upstream);
+PG_FUNCTION_INFO_V1(get_basebackup_source);
 PG_FUNCTION_INFO_V1(synchronous_standby_names);
+PG_FUNCTION_INFO_V1(report_sync_rep_stall);
 
 
 /*
@@ -120,10 +171,36 @@ register_node(PG_FUNCTION_ARGS)
 	currentNodeState.candidatePriority = candidatePriority;
 	currentNodeState.replicationQuorum = replicationQuorum;
 
-	LockFormation(formationId, ExclusiveLock);
+	/*
+	 * Registering a node only needs the formation in exclusive mode when the
+	 * monitor assigns a group in a Citus formation, or to set up the
+	 * formation kind and dbname for its first node. Otherwise the target
+	 * group is known already, and a share lock on the formation with an
+	 * exclusive lock on the group allows registering nodes in different
+	 * groups concurrently.
+	 */
+	LockFormation(formationId, ShareLock);
 
 	AutoFailoverFormation *formation = GetFormation(formationId);
 
+	if (formation != NULL &&
+		RegisterNodeNeedsFormationLock(formation, expectedFormationKind,
+									   expectedDBName, currentGroupId))
+	{
+		UnlockFormation(formationId, ShareLock);
+		LockFormation(formationId, ExclusiveLock);
+
+		/* the formation might have changed while we were waiting */
+		formation = GetFormation(formationId);
+	}
+	else if (formation != NULL)
+	{
+		int targetGroupId =
+			formation->kind == FORMATION_KIND_PGSQL ? 0 : currentGroupId;
+
+		LockNodeGroup(formationId, targetGroupId, ExclusiveLock);
+	}
+
 	/*
 	 * The default formationId is "default" and of kind FORMATION_KIND_PGSQL.
 	 * It might get used to manage a formation though. Check about that here,
@@ -352,40 +429,118 @@ node_active(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	text *formationIdText = PG_GETARG_TEXT_P(0);
-	char *formationId = text_to_cstring(formationIdText);
+	AutoFailoverNodeState *assignedNodeState = NodeActiveFromArguments(fcinfo);
 
-	int64 currentNodeId = PG_GETARG_INT64(1);
-	int32 currentGroupId = PG_GETARG_INT32(2);
-	Oid currentReplicationStateOid = PG_GETARG_OID(3);
-	bool currentPgIsRunning = PG_GETARG_BOOL(4);
+	/* older keepers decide on their own when to call again */
+	RecordNodeHeartbeat(assignedNodeState->nodeId, 0);
 
-	int32 currentTLI = PG_GETARG_INT32(5);
-	XLogRecPtr currentLSN = PG_GETARG_LSN(6);
+	Oid newReplicationStateOid =
+		ReplicationStateGetEnum(assignedNodeState->replicationState);
 
-	text *currentPgsrSyncStateText = PG_GETARG_TEXT_P(7);
-	char *currentPgsrSyncState = text_to_cstring(currentPgsrSyncStateText);
+	TupleDesc resultDescriptor = NULL;
+	Datum values[5];
+	bool isNulls[5];
 
-	AutoFailoverNodeState currentNodeState = { 0 };
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
 
-	currentNodeState.nodeId = currentNodeId;
-	currentNodeState.groupId = currentGroupId;
-	currentNodeState.replicationState =
-		EnumGetReplicationState(currentReplicationStateOid);
-	currentNodeState.reportedTLI = currentTLI;
-	currentNodeState.reportedLSN = currentLSN;
-	currentNodeState.pgsrSyncState = SyncStateFromString(currentPgsrSyncState);
-	currentNodeState.pgIsRunning = currentPgIsRunning;
+	values[0] = Int64GetDatum(assignedNodeState->nodeId);
+	values[1] = Int32GetDatum(assignedNodeState->groupId);
+	values[2] = ObjectIdGetDatum(newReplicationStateOid);
+	values[3] = Int32GetDatum(assignedNodeState->candidatePriority);
+	values[4] = BoolGetDatum(assignedNodeState->replicationQuorum);
 
-	AutoFailoverNodeState *assignedNodeState =
-		NodeActive(formationId, &currentNodeState);
+	TypeFuncClass resultTypeClass =
+		get_call_result_type(fcinfo, NULL, &resultDescriptor);
+
+	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+	Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+	PG_RETURN_DATUM(resultDatum);
+}
+
+
+/*
+ * node_active_v2 is node_active with the list of the other nodes in the group
+ * added to the result, so that keepers get both in a single round trip.
+ *
+ * The other nodes are returned as a JSON array along with a version number
+ * computed from its contents. When the keeper already knows about that
+ * version, the nodes array is returned as NULL instead.
+ *
+ * The group version only changes when nodes are added, removed, or have their
+ * metadata updated, so that keepers may skip updating their HBA rules when
+ * only the LSN of the other nodes moved.
+ *
+ * During a failover, the trace id of the failover is also returned, so that
+ * the keepers can log it along with their assigned goal state.
+ *
+ * When the monitor pushed a new synchronous_standby_names value to a primary
+ * node, see pgautofailover.enable_direct_settings, the next node_active call
+ * of that node also returns it, in case the keeper missed the notification.
+ */
+Datum
+node_active_v2(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	AutoFailoverNodeState *assignedNodeState = NodeActiveFromArguments(fcinfo);
+	int64 knownNodesVersion = PG_GETARG_INT64(8);
 
 	Oid newReplicationStateOid =
 		ReplicationStateGetEnum(assignedNodeState->replicationState);
 
+	AutoFailoverNode *activeNode =
+		GetAutoFailoverNodeById(assignedNodeState->nodeId);
+	List *otherNodesList = AutoFailoverOtherNodesList(activeNode);
+
+	StringInfo otherNodesJson = makeStringInfo();
+
+	OtherNodesToJson(otherNodesJson, otherNodesList);
+
+	/*
+	 * The version is a hash of the JSON array, with its length in the low
+	 * bits to make collisions even less likely. It includes the nodes LSN,
+	 * which keepers also use, so it changes when any of them moves.
+	 */
+	uint32 nodesHash =
+		DatumGetUInt32(hash_any((unsigned char *) otherNodesJson->data,
+								otherNodesJson->len));
+	int64 nodesVersion =
+		(int64) (((uint64) nodesHash << 32) | (uint32) otherNodesJson->len);
+
+	int64 groupVersion =
+		GetGroupVersion(activeNode->formationId, activeNode->groupId);
+
+	int reportInterval = GroupStateReportInterval(activeNode);
+
+	RecordNodeHeartbeat(assignedNodeState->nodeId, reportInterval);
+
+	/* steady groups are not failing over, spare the lookup */
+	char *traceId = NULL;
+
+	if (!GroupStateIsSteady(activeNode))
+	{
+		traceId = GetFailoverTraceId(activeNode->formationId,
+									 activeNode->groupId);
+	}
+
+	/* only primary nodes are pushed settings */
+	char *synchronousStandbyNames = NULL;
+
+	if (assignedNodeState->replicationState == REPLICATION_STATE_PRIMARY)
+	{
+		synchronousStandbyNames = TakePushedSettings(assignedNodeState->nodeId);
+	}
+
 	TupleDesc resultDescriptor = NULL;
-	Datum values[5];
-	bool isNulls[5];
+	Datum values[11];
+	bool isNulls[11];
 
 	memset(values, 0, sizeof(values));
 	memset(isNulls, false, sizeof(isNulls));
@@ -395,6 +550,37 @@ node_active(PG_FUNCTION_ARGS)
 	values[2] = ObjectIdGetDatum(newReplicationStateOid);
 	values[3] = Int32GetDatum(assignedNodeState->candidatePriority);
 	values[4] = BoolGetDatum(assignedNodeState->replicationQuorum);
+	values[5] = Int64GetDatum(nodesVersion);
+
+	if (nodesVersion == knownNodesVersion)
+	{
+		isNulls[6] = true;
+	}
+	else
+	{
+		values[6] = CStringGetTextDatum(otherNodesJson->data);
+	}
+
+	values[7] = Int64GetDatum(groupVersion);
+	values[8] = Int32GetDatum(reportInterval);
+
+	if (traceId == NULL)
+	{
+		isNulls[9] = true;
+	}
+	else
+	{
+		values[9] = CStringGetTextDatum(traceId);
+	}
+
+	if (synchronousStandbyNames == NULL)
+	{
+		isNulls[10] = true;
+	}
+	else
+	{
+		values[10] = CStringGetTextDatum(synchronousStandbyNames);
+	}
 
 	TypeFuncClass resultTypeClass =
 		get_call_result_type(fcinfo, NULL, &resultDescriptor);
@@ -411,6 +597,88 @@ node_active(PG_FUNCTION_ARGS)
 }
 
 
+/*
+ * OtherNodesToJson appends to the given StringInfo a JSON array with the same
+ * fields as the result of pgautofailover.get_other_nodes().
+ */
+static void
+OtherNodesToJson(StringInfo json, List *nodesList)
+{
+	ListCell *nodeCell = NULL;
+	bool first = true;
+
+	appendStringInfoChar(json, '[');
+
+	foreach(nodeCell, nodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (!first)
+		{
+			appendStringInfoString(json, ", ");
+		}
+		first = false;
+
+		appendStringInfo(json, "{\"node_id\": " INT64_FORMAT ", ",
+						 (int64) node->nodeId);
+
+		appendStringInfoString(json, "\"node_name\": ");
+		escape_json(json, node->nodeName);
+
+		appendStringInfoString(json, ", \"node_host\": ");
+		escape_json(json, node->nodeHost);
+
+		appendStringInfo(json, ", \"node_port\": %d", node->nodePort);
+
+		appendStringInfo(json, ", \"node_lsn\": \"%X/%X\"",
+						 (uint32) (node->reportedLSN >> 32),
+						 (uint32) node->reportedLSN);
+
+		appendStringInfo(json, ", \"node_is_primary\": %s}",
+						 CanTakeWritesInState(node->reportedState) ?
+						 "true" : "false");
+	}
+
+	appendStringInfoChar(json, ']');
+}
+
+
+/*
+ * NodeActiveFromArguments parses the arguments that node_active and
+ * node_active_v2 have in common, and calls NodeActive with them.
+ */
+static AutoFailoverNodeState *
+NodeActiveFromArguments(FunctionCallInfo fcinfo)
+{
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+
+	int64 currentNodeId = PG_GETARG_INT64(1);
+	int32 currentGroupId = PG_GETARG_INT32(2);
+	Oid currentReplicationStateOid = PG_GETARG_OID(3);
+	bool currentPgIsRunning = PG_GETARG_BOOL(4);
+
+	int32 currentTLI = PG_GETARG_INT32(5);
+	XLogRecPtr currentLSN = PG_GETARG_LSN(6);
+
+	text *currentPgsrSyncStateText = PG_GETARG_TEXT_P(7);
+	char *currentPgsrSyncState = text_to_cstring(currentPgsrSyncStateText);
+
+	AutoFailoverNodeState currentNodeState = { 0 };
+
+	currentNodeState.nodeId = currentNodeId;
+	currentNodeState.groupId = currentGroupId;
+	currentNodeState.replicationState =
+		EnumGetReplicationState(currentReplicationStateOid);
+	currentNodeState.reportedTLI = currentTLI;
+	currentNodeState.reportedLSN = currentLSN;
+	currentNodeState.pgsrSyncState = SyncStateFromString(currentPgsrSyncState);
+	currentNodeState.pgIsRunning = currentPgIsRunning;
+
+	return NodeActive(formationId, &currentNodeState);
+}
+
+
 /*
  * NodeActive reports the current state of a node and returns the assigned state.
  */
@@ -419,6 +687,7 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 {
 	AutoFailoverNode *pgAutoFailoverNode = GetAutoFailoverNodeById(
 		currentNodeState->nodeId);
+	bool reportIsUnchanged = false;
 
 	if (pgAutoFailoverNode == NULL)
 	{
@@ -437,6 +706,9 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 	{
 		LockFormation(formationId, ShareLock);
 
+		reportIsUnchanged =
+			NodeReportIsUnchanged(pgAutoFailoverNode, currentNodeState);
+
 		if (pgAutoFailoverNode->reportedState != currentNodeState->replicationState)
 		{
 			/*
@@ -471,7 +743,32 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 			pgAutoFailoverNode->pgsrSyncState = currentNodeState->pgsrSyncState;
 			pgAutoFailoverNode->reportedLSN = currentNodeState->reportedLSN;
 
-			NotifyStateChange(pgAutoFailoverNode, message);
+			/*
+			 * During a failover, reaching the goal state ends a step of the
+			 * trace that started when that goal state was assigned, and the
+			 * trace itself ends once a node of the group is writable again.
+			 */
+			char *traceId = GetFailoverTraceId(pgAutoFailoverNode->formationId,
+											   pgAutoFailoverNode->groupId);
+			bool reachedGoalState =
+				pgAutoFailoverNode->reportedState == pgAutoFailoverNode->goalState;
+
+			if (traceId != NULL && reachedGoalState)
+			{
+				NotifyStateChangeSpan(pgAutoFailoverNode, message, traceId,
+									  pgAutoFailoverNode->stateChangeTime);
+
+				if (IsCurrentState(pgAutoFailoverNode, REPLICATION_STATE_SINGLE) ||
+					IsCurrentState(pgAutoFailoverNode, REPLICATION_STATE_WAIT_PRIMARY) ||
+					IsCurrentState(pgAutoFailoverNode, REPLICATION_STATE_PRIMARY))
+				{
+					EndFailoverTrace(pgAutoFailoverNode);
+				}
+			}
+			else
+			{
+				NotifyStateChange(pgAutoFailoverNode, message);
+			}
 		}
 
 		/*
@@ -485,11 +782,26 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 									currentNodeState->pgsrSyncState,
 									currentNodeState->reportedTLI,
 									currentNodeState->reportedLSN);
+
+		RecordNodeHistorySample(pgAutoFailoverNode, currentNodeState);
 	}
 
-	LockNodeGroup(formationId, currentNodeState->groupId, ExclusiveLock);
+	/*
+	 * Most calls only report that nothing changed. A ShareLock on the group
+	 * is enough to check that the group state machine has nothing to do, so
+	 * that the keepers of a group do not queue behind each other. Otherwise
+	 * we switch to the ExclusiveLock, releasing the ShareLock first so that
+	 * two backends doing the same can not deadlock.
+	 */
+	LockNodeGroup(formationId, currentNodeState->groupId, ShareLock);
 
-	ProceedGroupState(pgAutoFailoverNode);
+	if (!reportIsUnchanged || !GroupStateIsSteady(pgAutoFailoverNode))
+	{
+		UnlockNodeGroup(formationId, currentNodeState->groupId, ShareLock);
+		LockNodeGroup(formationId, currentNodeState->groupId, ExclusiveLock);
+
+		ProceedGroupState(pgAutoFailoverNode);
+	}
 
 	AutoFailoverNodeState *assignedNodeState =
 		(AutoFailoverNodeState *) palloc0(sizeof(AutoFailoverNodeState));
@@ -503,6 +815,55 @@ NodeActive(char *formationId, AutoFailoverNodeState *currentNodeState)
 }
 
 
+/*
+ * NodeReportIsUnchanged returns true when the keeper reports the same state as
+ * last time, which is also its goal state, with Postgres still running in the
+ * same sync state and the LSN still in the same NODE_ACTIVE_LSN_BUCKET_SIZE
+ * bucket.
+ */
+static bool
+NodeReportIsUnchanged(AutoFailoverNode *pgAutoFailoverNode,
+					  AutoFailoverNodeState *currentNodeState)
+{
+	/* a zero LSN means the keeper does not know, and we keep ours */
+	XLogRecPtr currentLSN =
+		currentNodeState->reportedLSN == InvalidXLogRecPtr
+		? pgAutoFailoverNode->reportedLSN
+		: currentNodeState->reportedLSN;
+
+	return pgAutoFailoverNode->reportedState ==
+		   currentNodeState->replicationState &&
+		   pgAutoFailoverNode->goalState == currentNodeState->replicationState &&
+		   pgAutoFailoverNode->pgIsRunning == currentNodeState->pgIsRunning &&
+		   currentNodeState->pgIsRunning &&
+		   pgAutoFailoverNode->pgsrSyncState == currentNodeState->pgsrSyncState &&
+		   (pgAutoFailoverNode->reportedLSN / NODE_ACTIVE_LSN_BUCKET_SIZE) ==
+		   (currentLSN / NODE_ACTIVE_LSN_BUCKET_SIZE);
+}
+
+
+/*
+ * RegisterNodeNeedsFormationLock returns true when registering a node has to
+ * lock the whole formation: to change the formation kind or dbname when
+ * registering its first node, or to assign a group id in a Citus formation,
+ * which depends on the nodes of all the groups.
+ */
+static bool
+RegisterNodeNeedsFormationLock(AutoFailoverFormation *formation,
+							   FormationKind expectedFormationKind,
+							   const char *expectedDBName,
+							   int currentGroupId)
+{
+	if (formation->kind != expectedFormationKind ||
+		strncmp(formation->dbname, expectedDBName, NAMEDATALEN) != 0)
+	{
+		return true;
+	}
+
+	return formation->kind != FORMATION_KIND_PGSQL && currentGroupId < 0;
+}
+
+
 /*
  * JoinAutoFailoverFormation adds a new node to a AutoFailover formation.
  */
@@ -718,6 +1079,9 @@ AssignGroupId(AutoFailoverFormation *formation, char *nodeHost, int nodePort,
 
 /*
  * get_primary returns the node in a group which currently takes writes.
+ *
+ * Service discovery layers call this function very often, so the answer is
+ * kept in the discovery cache until the next topology change.
  */
 Datum
 get_primary(PG_FUNCTION_ARGS)
@@ -733,12 +1097,22 @@ get_primary(PG_FUNCTION_ARGS)
 	Datum values[4];
 	bool isNulls[4];
 
-	AutoFailoverNode *primaryNode =
-		GetPrimaryOrDemotedNodeInGroup(formationId, groupId);
+	AutoFailoverNode *primaryNode = NULL;
 
-	if (primaryNode == NULL)
+	if (!DiscoveryCacheLookupPrimary(formationId, groupId, &primaryNode))
 	{
-		ereport(ERROR, (errmsg("group has no writable node right now")));
+		/* read the generation first, a concurrent change then misses */
+		uint64 generation = NodeCacheGetTopologyGeneration();
+
+		primaryNode = GetPrimaryOrDemotedNodeInGroup(formationId, groupId);
+
+		if (primaryNode == NULL)
+		{
+			ereport(ERROR, (errmsg("group has no writable node right now")));
+		}
+
+		DiscoveryCacheStorePrimary(formationId, groupId, primaryNode,
+								   generation);
 	}
 
 	memset(values, 0, sizeof(values));
@@ -762,131 +1136,287 @@ get_primary(PG_FUNCTION_ARGS)
 }
 
 
-typedef struct get_nodes_fctx
-{
-	List *nodesList;
-} get_nodes_fctx;
-
 /*
- * get_nodes returns all the node in a group, if any.
+ * get_upstream returns the node that the given standby node should stream
+ * from: its configured upstream node when that's a healthy secondary, and
+ * the primary node otherwise. The result is recorded, so that the monitor
+ * knows when the standby node needs to switch to another upstream node.
  */
 Datum
-get_nodes(PG_FUNCTION_ARGS)
+get_upstream(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	FuncCallContext *funcctx;
-	get_nodes_fctx *fctx;
-	MemoryContext oldcontext;
+	int64 nodeId = PG_GETARG_INT64(0);
 
-	/* stuff done only on the first call of the function */
-	if (SRF_IS_FIRSTCALL())
+	TupleDesc resultDescriptor = NULL;
+	Datum values[4];
+	bool isNulls[4];
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
 	{
-		text *formationIdText = PG_GETARG_TEXT_P(0);
-		char *formationId = text_to_cstring(formationIdText);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node %lld is not registered", (long long) nodeId)));
+	}
 
-		if (PG_ARGISNULL(0))
+	AutoFailoverNode *upstreamNode = GetConfiguredUpstreamNode(currentNode);
+
+	if (upstreamNode == NULL)
+	{
+		upstreamNode =
+			GetPrimaryOrDemotedNodeInGroup(currentNode->formationId,
+										   currentNode->groupId);
+
+		if (upstreamNode == NULL)
 		{
-			ereport(ERROR, (errmsg("formation_id must not be null")));
+			ereport(ERROR, (errmsg("group has no writable node right now")));
 		}
 
-		checkPgAutoFailoverVersion();
-
-		/* create a function context for cross-call persistence */
-		funcctx = SRF_FIRSTCALL_INIT();
+		SetNodeStreamingUpstream(currentNode->nodeId, 0);
+	}
+	else
+	{
+		SetNodeStreamingUpstream(currentNode->nodeId, upstreamNode->nodeId);
+	}
 
-		/*
-		 * switch to memory context appropriate for multiple function calls
-		 */
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
 
-		/* allocate memory for user context */
-		fctx = (get_nodes_fctx *) palloc(sizeof(get_nodes_fctx));
+	values[0] = Int64GetDatum(upstreamNode->nodeId);
+	values[1] = CStringGetTextDatum(upstreamNode->nodeName);
+	values[2] = CStringGetTextDatum(upstreamNode->nodeHost);
+	values[3] = Int32GetDatum(upstreamNode->nodePort);
 
-		/*
-		 * Use fctx to keep state from call to call. Seed current with the
-		 * original start value
-		 */
-		if (PG_ARGISNULL(1))
-		{
-			fctx->nodesList = AllAutoFailoverNodes(formationId);
-		}
-		else
-		{
-			int32 groupId = PG_GETARG_INT32(1);
+	TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL, &resultDescriptor);
+	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
 
-			fctx->nodesList = AutoFailoverAllNodesInGroup(formationId, groupId);
-		}
+	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+	Datum resultDatum = HeapTupleGetDatum(resultTuple);
 
-		funcctx->user_fctx = fctx;
-		MemoryContextSwitchTo(oldcontext);
+	PG_RETURN_DATUM(resultDatum);
+}
+
+
+/*
+ * get_basebackup_source returns the node that the given standby node should
+ * take its base backup from. When several standby nodes join a group at the
+ * same time, having them all run pg_basebackup against the primary node
+ * multiplies the read I/O there, so we pick a healthy secondary node instead
+ * when there is one, and fall back to the primary node otherwise.
+ */
+Datum
+get_basebackup_source(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+
+	TupleDesc resultDescriptor = NULL;
+	Datum values[4];
+	bool isNulls[4];
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node %lld is not registered", (long long) nodeId)));
 	}
 
-	/* stuff done on every call of the function */
-	funcctx = SRF_PERCALL_SETUP();
+	AutoFailoverNode *primaryNode =
+		GetPrimaryOrDemotedNodeInGroup(currentNode->formationId,
+									   currentNode->groupId);
 
-	/*
-	 * get the saved state and use current as the result for this iteration
-	 */
-	fctx = funcctx->user_fctx;
+	if (primaryNode == NULL)
+	{
+		ereport(ERROR, (errmsg("group has no writable node right now")));
+	}
 
-	if (fctx->nodesList != NIL)
+	AutoFailoverNode *sourceNode = NULL;
+
+	if (EnableBaseBackupFromStandby)
 	{
-		TupleDesc resultDescriptor = NULL;
-		Datum values[6];
-		bool isNulls[6];
+		sourceNode = SelectBaseBackupSourceNode(currentNode, primaryNode);
+	}
 
-		AutoFailoverNode *node = (AutoFailoverNode *) linitial(fctx->nodesList);
+	if (sourceNode == NULL)
+	{
+		sourceNode = primaryNode;
+		SetNodeBaseBackupSource(currentNode->nodeId, 0);
+	}
+	else
+	{
+		SetNodeBaseBackupSource(currentNode->nodeId, sourceNode->nodeId);
+	}
 
-		memset(values, 0, sizeof(values));
-		memset(isNulls, false, sizeof(isNulls));
+	memset(values, 0, sizeof(values));
+	memset(isNulls, false, sizeof(isNulls));
 
-		values[0] = Int64GetDatum(node->nodeId);
-		values[1] = CStringGetTextDatum(node->nodeName);
-		values[2] = CStringGetTextDatum(node->nodeHost);
-		values[3] = Int32GetDatum(node->nodePort);
-		values[4] = LSNGetDatum(node->reportedLSN);
-		values[5] = BoolGetDatum(CanTakeWritesInState(node->reportedState));
+	values[0] = Int64GetDatum(sourceNode->nodeId);
+	values[1] = CStringGetTextDatum(sourceNode->nodeName);
+	values[2] = CStringGetTextDatum(sourceNode->nodeHost);
+	values[3] = Int32GetDatum(sourceNode->nodePort);
 
-		TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL,
-															 &resultDescriptor);
-		if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL, &resultDescriptor);
+	if (resultTypeClass != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errmsg("return type must be a row type")));
+	}
+
+	HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+	Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+	PG_RETURN_DATUM(resultDatum);
+}
+
+
+/*
+ * SelectBaseBackupSourceNode returns the healthy secondary node with the
+ * fewest replication clients, and then the smallest lag behind the primary
+ * node, or NULL when no secondary node is usable. Secondary nodes that are
+ * on another timeline than the primary, or that lag more than
+ * pgautofailover.enable_sync_wal_log_threshold behind it, are not used.
+ */
+static AutoFailoverNode *
+SelectBaseBackupSourceNode(AutoFailoverNode *currentNode,
+						   AutoFailoverNode *primaryNode)
+{
+	AutoFailoverNode *selectedNode = NULL;
+	int selectedClients = 0;
+	uint64 selectedLag = 0;
+
+	List *otherNodesList = AutoFailoverOtherNodesList(currentNode);
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->nodeId == primaryNode->nodeId ||
+			!IsUsableUpstreamNode(otherNode) ||
+			otherNode->reportedTLI != primaryNode->reportedTLI ||
+			otherNode->reportedLSN == InvalidXLogRecPtr)
 		{
-			ereport(ERROR, (errmsg("return type must be a row type")));
+			continue;
 		}
 
-		HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
-		Datum resultDatum = HeapTupleGetDatum(resultTuple);
+		uint64 lag = 0;
 
-		/* prepare next SRF call */
-		fctx->nodesList = list_delete_first(fctx->nodesList);
+		if (primaryNode->reportedLSN > otherNode->reportedLSN)
+		{
+			lag = primaryNode->reportedLSN - otherNode->reportedLSN;
+		}
 
-		SRF_RETURN_NEXT(funcctx, PointerGetDatum(resultDatum));
+		if (lag > (uint64) EnableSyncXlogThreshold)
+		{
+			continue;
+		}
+
+		int clients = CountNodeReplicationClients(otherNode->nodeId);
+
+		if (selectedNode == NULL ||
+			clients < selectedClients ||
+			(clients == selectedClients && lag < selectedLag))
+		{
+			selectedNode = otherNode;
+			selectedClients = clients;
+			selectedLag = lag;
+		}
 	}
 
-	SRF_RETURN_DONE(funcctx);
+	return selectedNode;
 }
 
 
+typedef struct get_nodes_fctx
+{
+	List *nodesList;
+} get_nodes_fctx;
+
+
 /*
- * get_other_node is not supported anymore, but we might want to be able to
- * have the pgautofailover.so for 1.1 co-exists with the SQL definitions for
- * 1.0 at least during an upgrade, or to test upgrades.
+ * CompareNodesById is a qsort comparator that sorts an array of
+ * AutoFailoverNode pointers by nodeId.
  */
-Datum
-get_other_node(PG_FUNCTION_ARGS)
+static int
+CompareNodesById(const void *a, const void *b)
 {
-	ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			 errmsg("pgautofailover.get_other_node is no longer supported")));
+	AutoFailoverNode *node1 = *(AutoFailoverNode **) a;
+	AutoFailoverNode *node2 = *(AutoFailoverNode **) b;
+
+	if (node1->nodeId != node2->nodeId)
+	{
+		return node1->nodeId < node2->nodeId ? -1 : 1;
+	}
+
+	return 0;
 }
 
 
 /*
- * get_other_nodes returns the other node in a group, if any.
+ * GetNodesPage returns the nodes of the given list sorted by nodeId, starting
+ * after the node afterNodeId when hasKey is true, and with at most pageSize
+ * nodes when pageSize is positive.
+ */
+static List *
+GetNodesPage(List *nodesList, bool hasKey, int64 afterNodeId, int pageSize)
+{
+	int nodeCount = list_length(nodesList);
+	int nodeIndex = 0;
+	ListCell *nodeCell = NULL;
+	List *pageList = NIL;
+
+	if (nodeCount == 0)
+	{
+		return NIL;
+	}
+
+	AutoFailoverNode **nodeArray = (AutoFailoverNode **)
+								   palloc(nodeCount * sizeof(AutoFailoverNode *));
+
+	foreach(nodeCell, nodesList)
+	{
+		nodeArray[nodeIndex++] = (AutoFailoverNode *) lfirst(nodeCell);
+	}
+
+	qsort(nodeArray, nodeCount, sizeof(AutoFailoverNode *), CompareNodesById);
+
+	for (int i = 0; i < nodeCount; i++)
+	{
+		if (pageSize > 0 && list_length(pageList) >= pageSize)
+		{
+			break;
+		}
+
+		if (hasKey && nodeArray[i]->nodeId <= afterNodeId)
+		{
+			continue;
+		}
+
+		pageList = lappend(pageList, nodeArray[i]);
+	}
+
+	pfree(nodeArray);
+
+	return pageList;
+}
+
+
+/*
+ * get_nodes returns all the node in a group, if any. It implements both
+ * pgautofailover.get_nodes() and pgautofailover.get_nodes_page(), which
+ * returns the nodes sorted by node id, one page at a time: the nodes after
+ * after_node_id, up to page_size nodes.
  */
 Datum
-get_other_nodes(PG_FUNCTION_ARGS)
+get_nodes(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
@@ -897,8 +1427,13 @@ get_other_nodes(PG_FUNCTION_ARGS)
 	/* stuff done only on the first call of the function */
 	if (SRF_IS_FIRSTCALL())
 	{
-		int64 nodeId = PG_GETARG_INT64(0);
+		text *formationIdText = PG_GETARG_TEXT_P(0);
+		char *formationId = text_to_cstring(formationIdText);
 
+		if (PG_ARGISNULL(0))
+		{
+			ereport(ERROR, (errmsg("formation_id must not be null")));
+		}
 
 		checkPgAutoFailoverVersion();
 
@@ -917,33 +1452,32 @@ get_other_nodes(PG_FUNCTION_ARGS)
 		 * Use fctx to keep state from call to call. Seed current with the
 		 * original start value
 		 */
-		AutoFailoverNode *activeNode = GetAutoFailoverNodeById(nodeId);
-		if (activeNode == NULL)
+		if (PG_ARGISNULL(1))
 		{
-			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
-							errmsg("node %lld is not registered",
-								   (long long) nodeId)));
+			fctx->nodesList = AllAutoFailoverNodes(formationId);
 		}
-
-		if (PG_NARGS() == 1)
+		else
 		{
-			fctx->nodesList = AutoFailoverOtherNodesList(activeNode);
+			int32 groupId = PG_GETARG_INT32(1);
+
+			fctx->nodesList = AutoFailoverAllNodesInGroup(formationId, groupId);
 		}
-		else if (PG_NARGS() == 2)
+
+		if (PG_NARGS() > 2)
 		{
-			Oid currentReplicationStateOid = PG_GETARG_OID(1);
-			ReplicationState currentState =
-				EnumGetReplicationState(currentReplicationStateOid);
+			bool hasKey = !PG_ARGISNULL(2);
+			int64 afterNodeId = hasKey ? PG_GETARG_INT64(2) : 0;
+			int32 pageSize = PG_ARGISNULL(3) ? 0 : PG_GETARG_INT32(3);
+
+			if (pageSize < 0)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("page_size must not be negative")));
+			}
 
 			fctx->nodesList =
-				AutoFailoverOtherNodesListInState(activeNode, currentState);
-		}
-		else
-		{
-			/* that's a bug in the SQL exposure of that function */
-			ereport(ERROR,
-					(errmsg("unsupported number of arguments (%d)",
-							PG_NARGS())));
+				GetNodesPage(fctx->nodesList, hasKey, afterNodeId, pageSize);
 		}
 
 		funcctx->user_fctx = fctx;
@@ -996,819 +1530,1789 @@ get_other_nodes(PG_FUNCTION_ARGS)
 }
 
 
-/*
- * remove_node is not supported anymore, but we might want to be able to have
- * the pgautofailover.so for 1.1 co-exists with the SQL definitions for 1.0 at
- * least during an upgrade, or to test upgrades.
- */
-Datum
-remove_node(PG_FUNCTION_ARGS)
+typedef struct current_state_fctx
 {
-	ereport(ERROR,
-			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-			 errmsg("pgautofailover.remove_node is no longer supported")));
-}
+	char *formationKind;
+	AutoFailoverNode **nodeArray;
+	int nodeCount;
+	int nodeIndex;
+} current_state_fctx;
 
 
 /*
- * remove_node removes the given node from the monitor.
+ * CompareNodesByGroupAndId is a qsort comparator that sorts an array of
+ * AutoFailoverNode pointers by groupId, then nodeId.
  */
-Datum
-remove_node_by_nodeid(PG_FUNCTION_ARGS)
+static int
+CompareNodesByGroupAndId(const void *a, const void *b)
 {
-	checkPgAutoFailoverVersion();
+	AutoFailoverNode *node1 = *(AutoFailoverNode **) a;
+	AutoFailoverNode *node2 = *(AutoFailoverNode **) b;
 
-	int64 nodeId = PG_GETARG_INT64(0);
-	bool force = PG_GETARG_BOOL(1);
-
-	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+	if (node1->groupId != node2->groupId)
+	{
+		return node1->groupId < node2->groupId ? -1 : 1;
+	}
 
-	if (currentNode == NULL)
+	if (node1->nodeId != node2->nodeId)
 	{
-		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
-						errmsg("couldn't find node with nodeid %lld",
-							   (long long) nodeId)));
+		return node1->nodeId < node2->nodeId ? -1 : 1;
 	}
 
-	PG_RETURN_BOOL(RemoveNode(currentNode, force));
+	return 0;
 }
 
 
 /*
- * remove_node removes the given node from the monitor.
+ * CurrentStateFetchNodes fills in the given current_state_fctx with the nodes
+ * of the given formation, or of the given group of that formation, sorted by
+ * groupId and nodeId. The nodes are fetched with the kept plans of the node
+ * metadata layer, and from the node cache for a single group.
  */
-Datum
-remove_node_by_host(PG_FUNCTION_ARGS)
+static void
+CurrentStateFetchNodes(current_state_fctx *fctx, char *formationId,
+					   bool allGroups, int32 groupId)
 {
-	checkPgAutoFailoverVersion();
-
-	text *nodeHostText = PG_GETARG_TEXT_P(0);
-	char *nodeHost = text_to_cstring(nodeHostText);
-	int32 nodePort = PG_GETARG_INT32(1);
-	bool force = PG_GETARG_BOOL(2);
+	List *nodesList = NIL;
+	ListCell *nodeCell = NULL;
 
-	AutoFailoverNode *currentNode = GetAutoFailoverNode(nodeHost, nodePort);
+	/* without a formation row the SQL join returned no rows */
+	AutoFailoverFormation *formation = GetFormation(formationId);
 
-	if (currentNode == NULL)
+	if (formation != NULL)
 	{
-		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
-						errmsg("couldn't find node with "
-							   "hostname \"%s\" and port %d",
-							   nodeHost, nodePort)));
+		fctx->formationKind = FormationKindToString(formation->kind);
+
+		if (allGroups)
+		{
+			nodesList = AllAutoFailoverNodes(formationId);
+		}
+		else
+		{
+			nodesList = AutoFailoverAllNodesInGroup(formationId, groupId);
+		}
 	}
 
-	PG_RETURN_BOOL(RemoveNode(currentNode, force));
-}
+	fctx->nodeCount = list_length(nodesList);
 
+	if (fctx->nodeCount > 0)
+	{
+		int nodeIndex = 0;
 
-/* RemoveNode removes the given node from the monitor. */
-static bool
-RemoveNode(AutoFailoverNode *currentNode, bool force)
-{
-	ListCell *nodeCell = NULL;
-	char message[BUFSIZE] = { 0 };
+		fctx->nodeArray = (AutoFailoverNode **)
+						  palloc(fctx->nodeCount * sizeof(AutoFailoverNode *));
 
-	if (currentNode == NULL)
-	{
-		return false;
+		foreach(nodeCell, nodesList)
+		{
+			fctx->nodeArray[nodeIndex++] = (AutoFailoverNode *) lfirst(nodeCell);
+		}
+
+		qsort(fctx->nodeArray, fctx->nodeCount, sizeof(AutoFailoverNode *),
+			  CompareNodesByGroupAndId);
 	}
+}
 
-	LockFormation(currentNode->formationId, ExclusiveLock);
 
-	AutoFailoverFormation *formation = GetFormation(currentNode->formationId);
+/*
+ * CurrentStateTuple forms a result tuple of pgautofailover.current_state()
+ * straight from the in-memory AutoFailoverNode.
+ */
+static HeapTuple
+CurrentStateTuple(TupleDesc tupleDesc, char *formationKind,
+				  AutoFailoverNode *node)
+{
+	Datum values[13];
+	bool isNulls[13];
 
-	/* when removing the primary, initiate a failover */
-	bool currentNodeIsPrimary = CanTakeWritesInState(currentNode->goalState);
+	memset(isNulls, false, sizeof(isNulls));
 
-	/* get the list of the other nodes */
-	List *otherNodesGroupList = AutoFailoverOtherNodesList(currentNode);
+	values[0] = CStringGetTextDatum(formationKind);
+	values[1] = CStringGetTextDatum(node->nodeName);
+	values[2] = CStringGetTextDatum(node->nodeHost);
+	values[3] = Int32GetDatum(node->nodePort);
+	values[4] = Int32GetDatum(node->groupId);
+	values[5] = Int64GetDatum(node->nodeId);
+	values[6] = ObjectIdGetDatum(ReplicationStateGetEnum(node->reportedState));
+	values[7] = ObjectIdGetDatum(ReplicationStateGetEnum(node->goalState));
+	values[8] = Int32GetDatum(node->candidatePriority);
+	values[9] = BoolGetDatum(node->replicationQuorum);
+	values[10] = Int32GetDatum(node->reportedTLI);
+	values[11] = LSNGetDatum(node->reportedLSN);
+	values[12] = Int32GetDatum(node->health);
+
+	return heap_form_tuple(tupleDesc, values, isNulls);
+}
 
-	/* and the first other node to trigger our first FSM transition */
-	AutoFailoverNode *firstStandbyNode =
-		otherNodesGroupList == NIL ? NULL : linitial(otherNodesGroupList);
 
-	/*
-	 * To remove a node is a 2-step process.
-	 *
-	 *  1. pgautofailover.remove_node() sets the goal state to DROPPED
-	 *  2. pgautofailover.node_active() reports that the goal state is reached
-	 *
-	 * From the client side though, if a crash happens after having called the
-	 * node_active() function but before having stored the state, it might be
-	 * useful to call pgautofailover.remove_node() again.
-	 *
-	 * When pgautofailover.remove_node() is called on a node that has already
-	 * reached the DROPPED state, we proceed to remove it.
-	 */
-	if (IsCurrentState(currentNode, REPLICATION_STATE_DROPPED) || force)
+/*
+ * current_state implements both pgautofailover.current_state(text) and
+ * pgautofailover.current_state(text, int). The nodes are fetched once, and
+ * each call then forms a result tuple straight from the in-memory
+ * AutoFailoverNode, avoiding the planning and join of the SQL implementation
+ * this replaces.
+ */
+Datum
+current_state(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	current_state_fctx *fctx;
+
+	if (SRF_IS_FIRSTCALL())
 	{
-		/* time to actually remove the current node */
-		RemoveAutoFailoverNode(currentNode);
+		char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+		TupleDesc resultDescriptor = NULL;
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Removing " NODE_FORMAT " from formation \"%s\" and group %d",
-			NODE_FORMAT_ARGS(currentNode),
-			currentNode->formationId,
-			currentNode->groupId);
+		checkPgAutoFailoverVersion();
 
-		return true;
-	}
+		funcctx = SRF_FIRSTCALL_INIT();
 
-	/* if the removal is already in progress, politely ignore the request */
-	if (currentNode->goalState == REPLICATION_STATE_DROPPED)
-	{
-		return true;
-	}
+		MemoryContext oldcontext =
+			MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-	/* review the FSM for every other node, when removing the primary */
-	if (currentNodeIsPrimary)
-	{
-		int nodeCount = 0;
-		int candidates = 0;
+		if (get_call_result_type(fcinfo, NULL, &resultDescriptor) !=
+			TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errmsg("return type must be a row type")));
+		}
 
-		foreach(nodeCell, otherNodesGroupList)
+		funcctx->tuple_desc = BlessTupleDesc(resultDescriptor);
+
+		fctx = (current_state_fctx *) palloc0(sizeof(current_state_fctx));
+
+		if (PG_NARGS() > 1)
 		{
-			char message[BUFSIZE] = { 0 };
-			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+			(void) CurrentStateFetchNodes(fctx, formationId,
+										  false, PG_GETARG_INT32(1));
+		}
+		else
+		{
+			(void) CurrentStateFetchNodes(fctx, formationId, true, 0);
+		}
 
-			if (node == NULL)
-			{
-				/* shouldn't happen */
-				ereport(ERROR, (errmsg("BUG: node is NULL")));
-				continue;
-			}
+		funcctx->user_fctx = fctx;
+		MemoryContextSwitchTo(oldcontext);
+	}
 
-			++nodeCount;
+	funcctx = SRF_PERCALL_SETUP();
+	fctx = funcctx->user_fctx;
 
-			if (node->candidatePriority > 0)
-			{
-				++candidates;
-			}
+	if (fctx->nodeIndex < fctx->nodeCount)
+	{
+		AutoFailoverNode *node = fctx->nodeArray[fctx->nodeIndex++];
 
-			/* skip nodes that are currently in maintenance */
-			if (IsInMaintenance(node))
-			{
-				continue;
-			}
+		HeapTuple resultTuple =
+			CurrentStateTuple(funcctx->tuple_desc, fctx->formationKind, node);
 
-			LogAndNotifyMessage(
-				message, BUFSIZE,
-				"Setting goal state of " NODE_FORMAT
-				" to report_lsn after primary node removal.",
-				NODE_FORMAT_ARGS(node));
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(resultTuple));
+	}
 
-			SetNodeGoalState(node, REPLICATION_STATE_REPORT_LSN, message);
-		}
+	SRF_RETURN_DONE(funcctx);
+}
 
-		/*
-		 * Refuse to remove the primary node when there is no candidate, unless
-		 * the primary is the only node left of course.
-		 */
-		if (nodeCount > 0 && candidates == 0)
+
+/*
+ * NodeIsLagging returns true when the given node is not within
+ * pgautofailover.enable_sync_wal_log_threshold bytes of the most advanced
+ * node of its group, as when a standby node is catching up.
+ */
+static bool
+NodeIsLagging(AutoFailoverNode *node, AutoFailoverNode **nodeArray,
+			  int nodeCount)
+{
+	XLogRecPtr groupLSN = node->reportedLSN;
+
+	for (int i = 0; i < nodeCount; i++)
+	{
+		AutoFailoverNode *otherNode = nodeArray[i];
+
+		if (otherNode->groupId == node->groupId &&
+			otherNode->reportedLSN > groupLSN)
 		{
-			ereport(NOTICE,
-					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-					 errmsg("cannot remove current primary node " NODE_FORMAT,
-							NODE_FORMAT_ARGS(currentNode)),
-					 errdetail("At least one node with candidate priority "
-							   "greater than zero is needed to remove a "
-							   "primary node.")));
+			groupLSN = otherNode->reportedLSN;
 		}
 	}
 
-	/*
-	 * Mark the node as being dropped, so that the pg_autoctl node-active
-	 * process can implement further actions at drop time.
-	 */
-	LogAndNotifyMessage(
-		message, BUFSIZE,
-		"Setting goal state of " NODE_FORMAT
-		" from formation \"%s\" and group %d to \"dropped\""
-		" to implement node removal.",
-		NODE_FORMAT_ARGS(currentNode),
-		currentNode->formationId,
-		currentNode->groupId);
+	return (uint64) (groupLSN - node->reportedLSN) >
+		   (uint64) EnableSyncXlogThreshold;
+}
 
-	SetNodeGoalState(currentNode, REPLICATION_STATE_DROPPED, message);
 
-	/*
-	 * Adjust number-sync-standbys if necessary.
-	 *
-	 * otherNodesGroupList is the list of all the remaining nodes, and that
-	 * includes the current primary, which might be setup with replication
-	 * quorum set to true (and probably is).
-	 */
-	int countSyncStandbys = CountSyncStandbys(otherNodesGroupList) - 1;
+/*
+ * current_state_page implements pgautofailover.current_state_page(), which
+ * returns the same rows as pgautofailover.current_state(), filtered on the
+ * server side and one page at a time. All the arguments but the formation
+ * are optional, NULL meaning no filter:
+ *
+ *   - group_id, node_state (the current state), node_health,
+ *   - lagging_only, see NodeIsLagging(),
+ *   - after_group_id and after_node_id, to return the nodes that are sorted
+ *     after the last node of the previous page (keyset pagination),
+ *   - page_size, the maximum number of rows to return.
+ */
+Datum
+current_state_page(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	current_state_fctx *fctx;
 
-	if (countSyncStandbys < (formation->number_sync_standbys + 1))
+	if (SRF_IS_FIRSTCALL())
 	{
-		formation->number_sync_standbys = countSyncStandbys - 1;
+		TupleDesc resultDescriptor = NULL;
 
-		if (formation->number_sync_standbys < 0)
+		checkPgAutoFailoverVersion();
+
+		if (PG_ARGISNULL(0))
 		{
-			formation->number_sync_standbys = 0;
+			ereport(ERROR, (errmsg("formation_id must not be null")));
 		}
 
-		if (!SetFormationNumberSyncStandbys(formation->formationId,
-											formation->number_sync_standbys))
+		char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+		bool allGroups = PG_ARGISNULL(1);
+		int32 groupId = allGroups ? 0 : PG_GETARG_INT32(1);
+		bool filterState = !PG_ARGISNULL(2);
+		bool filterHealth = !PG_ARGISNULL(3);
+		bool laggingOnly = !PG_ARGISNULL(4) && PG_GETARG_BOOL(4);
+		bool hasKey = !PG_ARGISNULL(5) && !PG_ARGISNULL(6);
+		int32 pageSize = PG_ARGISNULL(7) ? 0 : PG_GETARG_INT32(7);
+
+		ReplicationState nodeState = filterState
+									 ? EnumGetReplicationState(PG_GETARG_OID(2))
+									 : REPLICATION_STATE_UNKNOWN;
+		int32 nodeHealth = filterHealth ? PG_GETARG_INT32(3) : 0;
+		int32 afterGroupId = hasKey ? PG_GETARG_INT32(5) : 0;
+		int64 afterNodeId = hasKey ? PG_GETARG_INT64(6) : 0;
+
+		if (pageSize < 0)
 		{
 			ereport(ERROR,
-					(errmsg("couldn't set the formation \"%s\" "
-							"number_sync_standbys to %d now that a "
-							"standby node has been removed",
-							currentNode->formationId,
-							formation->number_sync_standbys)));
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("page_size must not be negative")));
 		}
 
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting number_sync_standbys to %d for formation \"%s\" "
-			"now that we have %d standby nodes set with replication-quorum.",
-			formation->number_sync_standbys,
-			formation->formationId,
-			countSyncStandbys);
-	}
+		funcctx = SRF_FIRSTCALL_INIT();
 
-	/* now proceed with the failover, starting with the first standby */
-	if (currentNodeIsPrimary)
-	{
-		/* if we have at least one other node in the group, proceed */
-		if (firstStandbyNode)
+		MemoryContext oldcontext =
+			MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &resultDescriptor) !=
+			TYPEFUNC_COMPOSITE)
 		{
-			(void) ProceedGroupState(firstStandbyNode);
+			ereport(ERROR, (errmsg("return type must be a row type")));
 		}
-	}
-	else
-	{
-		/* find the primary, if any, and have it realize a node has left */
-		AutoFailoverNode *primaryNode =
-			GetPrimaryNodeInGroup(currentNode->formationId,
-								  currentNode->groupId);
 
-		if (primaryNode)
+		funcctx->tuple_desc = BlessTupleDesc(resultDescriptor);
+
+		fctx = (current_state_fctx *) palloc0(sizeof(current_state_fctx));
+
+		(void) CurrentStateFetchNodes(fctx, formationId, allGroups, groupId);
+
+		/*
+		 * Select the nodes of the page from the sorted array. The lag is
+		 * computed from all the nodes of the group, so we keep the whole
+		 * array around until we're done with the filtering.
+		 */
+		AutoFailoverNode **selectedNodes = (AutoFailoverNode **)
+										   palloc((fctx->nodeCount + 1) *
+												  sizeof(AutoFailoverNode *));
+		int selectedCount = 0;
+
+		for (int i = 0; i < fctx->nodeCount; i++)
 		{
-			ReplicationState goalState = primaryNode->goalState;
+			AutoFailoverNode *node = fctx->nodeArray[i];
 
-			(void) ProceedGroupState(primaryNode);
+			if (pageSize > 0 && selectedCount >= pageSize)
+			{
+				break;
+			}
 
-			/*
-			 * When the removal of a secondary node has no impact on the
-			 * primary node state, we still need to change the replication
-			 * settings to adjust to the possibly new
-			 * synchronous_standby_names, so we force APPLY_SETTINGS in that
-			 * case.
-			 */
-			if (primaryNode->goalState == goalState &&
-				goalState != REPLICATION_STATE_APPLY_SETTINGS)
+			if (hasKey &&
+				(node->groupId < afterGroupId ||
+				 (node->groupId == afterGroupId &&
+				  node->nodeId <= afterNodeId)))
 			{
-				LogAndNotifyMessage(
-					message, BUFSIZE,
-					"Setting goal state of " NODE_FORMAT
-					" to apply_settings after removing standby " NODE_FORMAT
-					" from formation %s.",
-					NODE_FORMAT_ARGS(primaryNode),
-					NODE_FORMAT_ARGS(currentNode),
-					formation->formationId);
+				continue;
+			}
 
-				SetNodeGoalState(primaryNode,
-								 REPLICATION_STATE_APPLY_SETTINGS, message);
+			if ((filterState && node->reportedState != nodeState) ||
+				(filterHealth && node->health != nodeHealth) ||
+				(laggingOnly &&
+				 !NodeIsLagging(node, fctx->nodeArray, fctx->nodeCount)))
+			{
+				continue;
 			}
+
+			selectedNodes[selectedCount++] = node;
 		}
+
+		fctx->nodeArray = selectedNodes;
+		fctx->nodeCount = selectedCount;
+
+		funcctx->user_fctx = fctx;
+		MemoryContextSwitchTo(oldcontext);
 	}
 
-	return true;
-}
+	funcctx = SRF_PERCALL_SETUP();
+	fctx = funcctx->user_fctx;
 
+	if (fctx->nodeIndex < fctx->nodeCount)
+	{
+		AutoFailoverNode *node = fctx->nodeArray[fctx->nodeIndex++];
 
-/*
- * perform_failover promotes the secondary in the given group
- */
-Datum
-perform_failover(PG_FUNCTION_ARGS)
-{
-	checkPgAutoFailoverVersion();
+		HeapTuple resultTuple =
+			CurrentStateTuple(funcctx->tuple_desc, fctx->formationKind, node);
 
-	text *formationIdText = PG_GETARG_TEXT_P(0);
-	char *formationId = text_to_cstring(formationIdText);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(resultTuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * get_other_node is not supported anymore, but we might want to be able to
+ * have the pgautofailover.so for 1.1 co-exists with the SQL definitions for
+ * 1.0 at least during an upgrade, or to test upgrades.
+ */
+Datum
+get_other_node(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pgautofailover.get_other_node is no longer supported")));
+}
+
+
+/*
+ * get_other_nodes returns the other node in a group, if any.
+ */
+Datum
+get_other_nodes(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	FuncCallContext *funcctx;
+	get_nodes_fctx *fctx;
+	MemoryContext oldcontext;
+
+	/* stuff done only on the first call of the function */
+	if (SRF_IS_FIRSTCALL())
+	{
+		int64 nodeId = PG_GETARG_INT64(0);
+
+
+		checkPgAutoFailoverVersion();
+
+		/* create a function context for cross-call persistence */
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		/*
+		 * switch to memory context appropriate for multiple function calls
+		 */
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* allocate memory for user context */
+		fctx = (get_nodes_fctx *) palloc(sizeof(get_nodes_fctx));
+
+		/*
+		 * Use fctx to keep state from call to call. Seed current with the
+		 * original start value
+		 */
+		AutoFailoverNode *activeNode = GetAutoFailoverNodeById(nodeId);
+		if (activeNode == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+							errmsg("node %lld is not registered",
+								   (long long) nodeId)));
+		}
+
+		if (PG_NARGS() == 1)
+		{
+			fctx->nodesList = AutoFailoverOtherNodesList(activeNode);
+		}
+		else if (PG_NARGS() == 2)
+		{
+			Oid currentReplicationStateOid = PG_GETARG_OID(1);
+			ReplicationState currentState =
+				EnumGetReplicationState(currentReplicationStateOid);
+
+			fctx->nodesList =
+				AutoFailoverOtherNodesListInState(activeNode, currentState);
+		}
+		else
+		{
+			/* that's a bug in the SQL exposure of that function */
+			ereport(ERROR,
+					(errmsg("unsupported number of arguments (%d)",
+							PG_NARGS())));
+		}
+
+		funcctx->user_fctx = fctx;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* stuff done on every call of the function */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/*
+	 * get the saved state and use current as the result for this iteration
+	 */
+	fctx = funcctx->user_fctx;
+
+	if (fctx->nodesList != NIL)
+	{
+		TupleDesc resultDescriptor = NULL;
+		Datum values[6];
+		bool isNulls[6];
+
+		AutoFailoverNode *node = (AutoFailoverNode *) linitial(fctx->nodesList);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(node->nodeId);
+		values[1] = CStringGetTextDatum(node->nodeName);
+		values[2] = CStringGetTextDatum(node->nodeHost);
+		values[3] = Int32GetDatum(node->nodePort);
+		values[4] = LSNGetDatum(node->reportedLSN);
+		values[5] = BoolGetDatum(CanTakeWritesInState(node->reportedState));
+
+		TypeFuncClass resultTypeClass = get_call_result_type(fcinfo, NULL,
+															 &resultDescriptor);
+		if (resultTypeClass != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errmsg("return type must be a row type")));
+		}
+
+		HeapTuple resultTuple = heap_form_tuple(resultDescriptor, values, isNulls);
+		Datum resultDatum = HeapTupleGetDatum(resultTuple);
+
+		/* prepare next SRF call */
+		fctx->nodesList = list_delete_first(fctx->nodesList);
+
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(resultDatum));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * remove_node is not supported anymore, but we might want to be able to have
+ * the pgautofailover.so for 1.1 co-exists with the SQL definitions for 1.0 at
+ * least during an upgrade, or to test upgrades.
+ */
+Datum
+remove_node(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pgautofailover.remove_node is no longer supported")));
+}
+
+
+/*
+ * remove_node removes the given node from the monitor.
+ */
+Datum
+remove_node_by_nodeid(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	bool force = PG_GETARG_BOOL(1);
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with nodeid %lld",
+							   (long long) nodeId)));
+	}
+
+	PG_RETURN_BOOL(RemoveNode(currentNode, force, true));
+}
+
+
+/*
+ * remove_node removes the given node from the monitor.
+ */
+Datum
+remove_node_by_host(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	text *nodeHostText = PG_GETARG_TEXT_P(0);
+	char *nodeHost = text_to_cstring(nodeHostText);
+	int32 nodePort = PG_GETARG_INT32(1);
+	bool force = PG_GETARG_BOOL(2);
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNode(nodeHost, nodePort);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with "
+							   "hostname \"%s\" and port %d",
+							   nodeHost, nodePort)));
+	}
+
+	PG_RETURN_BOOL(RemoveNode(currentNode, force, true));
+}
+
+
+/*
+ * remove_nodes removes the given nodes from the monitor in a single
+ * transaction, and then runs the state machine once per group that lost a
+ * node, rather than once per node. In each group the primary node is removed
+ * first, so that removing it doesn't assign report_lsn to a standby node
+ * that's being removed too.
+ */
+Datum
+remove_nodes(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	ArrayType *nodeIdsArray = PG_GETARG_ARRAYTYPE_P(0);
+	bool force = PG_GETARG_BOOL(1);
+
+	Datum *nodeIdDatums = NULL;
+	bool *nodeIdNulls = NULL;
+	int nodeIdCount = 0;
+
+	List *nodeList = NIL;
+	List *groupNodeList = NIL;
+	List *primaryGroupList = NIL;
+	ListCell *nodeCell = NULL;
+
+	deconstruct_array(nodeIdsArray, INT8OID, sizeof(int64),
+					  FLOAT8PASSBYVAL, 'd',
+					  &nodeIdDatums, &nodeIdNulls, &nodeIdCount);
+
+	for (int i = 0; i < nodeIdCount; i++)
+	{
+		if (nodeIdNulls[i])
+		{
+			continue;
+		}
+
+		int64 nodeId = DatumGetInt64(nodeIdDatums[i]);
+		AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+		if (node == NULL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+							errmsg("couldn't find node with nodeid %lld",
+								   (long long) nodeId)));
+		}
+
+		nodeList = lappend(nodeList, node);
+	}
+
+	/* primary nodes first, then the other ones */
+	for (int pass = 0; pass < 2; pass++)
+	{
+		bool removePrimaryNodes = pass == 0;
+
+		foreach(nodeCell, nodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+			bool nodeIsPrimary = CanTakeWritesInState(node->goalState);
+
+			if (nodeIsPrimary != removePrimaryNodes)
+			{
+				continue;
+			}
+
+			LockFormation(node->formationId, ExclusiveLock);
+
+			(void) RemoveNode(node, force, false);
+
+			if (!IsNodeInGroupList(groupNodeList, node))
+			{
+				groupNodeList = lappend(groupNodeList, node);
+			}
+
+			if (nodeIsPrimary && !IsNodeInGroupList(primaryGroupList, node))
+			{
+				primaryGroupList = lappend(primaryGroupList, node);
+			}
+		}
+	}
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *removedNode = (AutoFailoverNode *) lfirst(nodeCell);
+		AutoFailoverFormation *formation = GetFormation(removedNode->formationId);
+
+		List *remainingNodeList =
+			AutoFailoverNodeGroup(removedNode->formationId, removedNode->groupId);
+		AutoFailoverNode *firstStandbyNode =
+			remainingNodeList == NIL ? NULL : linitial(remainingNodeList);
+
+		ProceedGroupStateAfterRemoval(formation,
+									  removedNode,
+									  IsNodeInGroupList(primaryGroupList,
+														removedNode),
+									  firstStandbyNode);
+	}
+
+	PG_RETURN_INT32(list_length(nodeList));
+}
+
+
+/*
+ * IsNodeInGroupList returns true when nodeList contains a node of the same
+ * formation and group as the given node.
+ */
+static bool
+IsNodeInGroupList(List *nodeList, AutoFailoverNode *node)
+{
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *groupNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (groupNode->groupId == node->groupId &&
+			strcmp(groupNode->formationId, node->formationId) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/* RemoveNode removes the given node from the monitor. */
+static bool
+RemoveNode(AutoFailoverNode *currentNode, bool force, bool proceedGroupState)
+{
+	ListCell *nodeCell = NULL;
+	char message[BUFSIZE] = { 0 };
+
+	if (currentNode == NULL)
+	{
+		return false;
+	}
+
+	LockFormation(currentNode->formationId, ExclusiveLock);
+
+	AutoFailoverFormation *formation = GetFormation(currentNode->formationId);
+
+	/* when removing the primary, initiate a failover */
+	bool currentNodeIsPrimary = CanTakeWritesInState(currentNode->goalState);
+
+	/* get the list of the other nodes */
+	List *otherNodesGroupList = AutoFailoverOtherNodesList(currentNode);
+
+	/* and the first other node to trigger our first FSM transition */
+	AutoFailoverNode *firstStandbyNode =
+		otherNodesGroupList == NIL ? NULL : linitial(otherNodesGroupList);
+
+	/*
+	 * To remove a node is a 2-step process.
+	 *
+	 *  1. pgautofailover.remove_node() sets the goal state to DROPPED
+	 *  2. pgautofailover.node_active() reports that the goal state is reached
+	 *
+	 * From the client side though, if a crash happens after having called the
+	 * node_active() function but before having stored the state, it might be
+	 * useful to call pgautofailover.remove_node() again.
+	 *
+	 * When pgautofailover.remove_node() is called on a node that has already
+	 * reached the DROPPED state, we proceed to remove it.
+	 */
+	if (IsCurrentState(currentNode, REPLICATION_STATE_DROPPED) || force)
+	{
+		/* time to actually remove the current node */
+		RemoveAutoFailoverNode(currentNode);
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Removing " NODE_FORMAT " from formation \"%s\" and group %d",
+			NODE_FORMAT_ARGS(currentNode),
+			currentNode->formationId,
+			currentNode->groupId);
+
+		return true;
+	}
+
+	/* if the removal is already in progress, politely ignore the request */
+	if (currentNode->goalState == REPLICATION_STATE_DROPPED)
+	{
+		return true;
+	}
+
+	/* review the FSM for every other node, when removing the primary */
+	if (currentNodeIsPrimary)
+	{
+		int nodeCount = 0;
+		int candidates = 0;
+
+		foreach(nodeCell, otherNodesGroupList)
+		{
+			char message[BUFSIZE] = { 0 };
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (node == NULL)
+			{
+				/* shouldn't happen */
+				ereport(ERROR, (errmsg("BUG: node is NULL")));
+				continue;
+			}
+
+			++nodeCount;
+
+			if (node->candidatePriority > 0)
+			{
+				++candidates;
+			}
+
+			/* skip nodes that are currently in maintenance */
+			if (IsInMaintenance(node))
+			{
+				continue;
+			}
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to report_lsn after primary node removal.",
+				NODE_FORMAT_ARGS(node));
+
+			SetNodeGoalState(node, REPLICATION_STATE_REPORT_LSN, message);
+		}
+
+		/*
+		 * Refuse to remove the primary node when there is no candidate, unless
+		 * the primary is the only node left of course.
+		 */
+		if (nodeCount > 0 && candidates == 0)
+		{
+			ereport(NOTICE,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot remove current primary node " NODE_FORMAT,
+							NODE_FORMAT_ARGS(currentNode)),
+					 errdetail("At least one node with candidate priority "
+							   "greater than zero is needed to remove a "
+							   "primary node.")));
+		}
+	}
+
+	/*
+	 * Mark the node as being dropped, so that the pg_autoctl node-active
+	 * process can implement further actions at drop time.
+	 */
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of " NODE_FORMAT
+		" from formation \"%s\" and group %d to \"dropped\""
+		" to implement node removal.",
+		NODE_FORMAT_ARGS(currentNode),
+		currentNode->formationId,
+		currentNode->groupId);
+
+	SetNodeGoalState(currentNode, REPLICATION_STATE_DROPPED, message);
+
+	/*
+	 * Adjust number-sync-standbys if necessary.
+	 *
+	 * otherNodesGroupList is the list of all the remaining nodes, and that
+	 * includes the current primary, which might be setup with replication
+	 * quorum set to true (and probably is).
+	 */
+	int countSyncStandbys = CountSyncStandbys(otherNodesGroupList) - 1;
+
+	if (countSyncStandbys < (formation->number_sync_standbys + 1))
+	{
+		formation->number_sync_standbys = countSyncStandbys - 1;
+
+		if (formation->number_sync_standbys < 0)
+		{
+			formation->number_sync_standbys = 0;
+		}
+
+		if (!SetFormationNumberSyncStandbys(formation->formationId,
+											formation->number_sync_standbys))
+		{
+			ereport(ERROR,
+					(errmsg("couldn't set the formation \"%s\" "
+							"number_sync_standbys to %d now that a "
+							"standby node has been removed",
+							currentNode->formationId,
+							formation->number_sync_standbys)));
+		}
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting number_sync_standbys to %d for formation \"%s\" "
+			"now that we have %d standby nodes set with replication-quorum.",
+			formation->number_sync_standbys,
+			formation->formationId,
+			countSyncStandbys);
+	}
+
+	if (proceedGroupState)
+	{
+		ProceedGroupStateAfterRemoval(formation,
+									  currentNode,
+									  currentNodeIsPrimary,
+									  firstStandbyNode);
+	}
+
+	return true;
+}
+
+
+/*
+ * ProceedGroupStateAfterRemoval runs the state machine of a group from which
+ * a node is being removed.
+ */
+static void
+ProceedGroupStateAfterRemoval(AutoFailoverFormation *formation,
+							  AutoFailoverNode *removedNode,
+							  bool removedNodeIsPrimary,
+							  AutoFailoverNode *firstStandbyNode)
+{
+	char message[BUFSIZE] = { 0 };
+
+	/* now proceed with the failover, starting with the first standby */
+	if (removedNodeIsPrimary)
+	{
+		/* if we have at least one other node in the group, proceed */
+		if (firstStandbyNode)
+		{
+			(void) ProceedGroupState(firstStandbyNode);
+		}
+	}
+	else
+	{
+		/* find the primary, if any, and have it realize a node has left */
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(removedNode->formationId,
+								  removedNode->groupId);
+
+		if (primaryNode)
+		{
+			ReplicationState goalState = primaryNode->goalState;
+
+			(void) ProceedGroupState(primaryNode);
+
+			/*
+			 * When the removal of a secondary node has no impact on the
+			 * primary node state, we still need to change the replication
+			 * settings to adjust to the possibly new
+			 * synchronous_standby_names, so we force APPLY_SETTINGS in that
+			 * case.
+			 */
+			if (primaryNode->goalState == goalState &&
+				goalState != REPLICATION_STATE_APPLY_SETTINGS)
+			{
+				LogAndNotifyMessage(
+					message, BUFSIZE,
+					"Setting goal state of " NODE_FORMAT
+					" to apply_settings after removing standby " NODE_FORMAT
+					" from formation %s.",
+					NODE_FORMAT_ARGS(primaryNode),
+					NODE_FORMAT_ARGS(removedNode),
+					formation->formationId);
+
+				SetNodeGoalState(primaryNode,
+								 REPLICATION_STATE_APPLY_SETTINGS, message);
+			}
+		}
+	}
+}
+
+
+/*
+ * CheckSwitchoverDrainCost refuses a switchover from the given primary node
+ * when its keeper reports a write transaction or a prepared transaction that
+ * is older than pgautofailover.switchover_drain_limit. Demoting the primary
+ * would then have to wait for that transaction, or roll it back, and a
+ * prepared transaction keeps its locks on the new primary.
+ *
+ * Without a recent report, we don't know better and let the switchover
+ * proceed.
+ */
+static void
+CheckSwitchoverDrainCost(AutoFailoverNode *primaryNode)
+{
+	NodeDrainStats stats = { 0 };
+
+	if (SwitchoverDrainLimitMs <= 0 ||
+		!GetNodeDrainStats(primaryNode->nodeId, &stats))
+	{
+		return;
+	}
+
+	if (stats.oldestWriteXactMs > SwitchoverDrainLimitMs)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot fail over: primary node " NODE_FORMAT
+						" has %d write transaction(s) in progress",
+						NODE_FORMAT_ARGS(primaryNode),
+						stats.writeXacts),
+				 errdetail("The oldest write transaction started "
+						   INT64_FORMAT " ms ago, and draining the primary "
+						   "would have to wait for it, or roll it back.",
+						   stats.oldestWriteXactMs),
+				 errhint("Retry once the transactions are done, or raise "
+						 "pgautofailover.switchover_drain_limit, "
+						 "currently %d ms.",
+						 SwitchoverDrainLimitMs)));
+	}
+
+	if (stats.oldestPreparedXactMs > SwitchoverDrainLimitMs)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot fail over: primary node " NODE_FORMAT
+						" has %d prepared transaction(s)",
+						NODE_FORMAT_ARGS(primaryNode),
+						stats.preparedXacts),
+				 errdetail("The oldest prepared transaction is "
+						   INT64_FORMAT " ms old, and it would keep its locks "
+						   "on the new primary until it is committed or "
+						   "rolled back.",
+						   stats.oldestPreparedXactMs),
+				 errhint("Use COMMIT PREPARED or ROLLBACK PREPARED first, "
+						 "or raise pgautofailover.switchover_drain_limit, "
+						 "currently %d ms.",
+						 SwitchoverDrainLimitMs)));
+	}
+}
+
+
+/*
+ * perform_failover promotes the secondary in the given group
+ */
+Datum
+perform_failover(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
 	int32 groupId = PG_GETARG_INT32(1);
 
 
-	char message[BUFSIZE] = { 0 };
+	char message[BUFSIZE] = { 0 };
+
+	LockFormation(formationId, ShareLock);
+	LockNodeGroup(formationId, groupId, ExclusiveLock);
+
+	List *groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
+	if (list_length(groupNodeList) < 2)
+	{
+		ereport(ERROR,
+				(errmsg("cannot fail over: group %d in formation %s "
+						"currently has %d node registered",
+						groupId, formationId, list_length(groupNodeList)),
+				 errdetail("At least 2 nodes are required "
+						   "to implement a failover")));
+	}
+
+	/* get a current primary node that we can failover from (accepts writes) */
+	AutoFailoverNode *primaryNode =
+		GetNodeToFailoverFromInGroup(formationId, groupId);
+
+	if (primaryNode == NULL)
+	{
+		ereport(ERROR,
+				(errmsg("couldn't find the primary node in formation \"%s\", "
+						"group %d", formationId, groupId)));
+	}
+
+	(void) CheckSwitchoverDrainCost(primaryNode);
+
+	StartFailoverTrace(primaryNode, FAILOVER_TRACE_KIND_SWITCHOVER);
+
+	/*
+	 * When we have only two nodes, we can failover directly to the secondary
+	 * node, provided its current state allows for that.
+	 *
+	 * When we have more than two nodes, then we need to check that we have at
+	 * least one candidate for failover and initiate the REPORT_LSN dance to
+	 * make the failover happen.
+	 */
+	if (list_length(groupNodeList) == 2)
+	{
+		List *standbyNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
+
+		if (list_length(standbyNodesGroupList) != 1)
+		{
+			ereport(ERROR,
+					(errmsg("couldn't find the standby node in "
+							"formation \"%s\", group %d with primary node "
+							NODE_FORMAT,
+							formationId, groupId,
+							NODE_FORMAT_ARGS(primaryNode))));
+		}
+
+		AutoFailoverNode *secondaryNode = linitial(standbyNodesGroupList);
+
+		if (secondaryNode->goalState != REPLICATION_STATE_SECONDARY)
+		{
+			const char *secondaryState =
+				ReplicationStateGetName(secondaryNode->goalState);
+
+			ereport(ERROR,
+					(errmsg(
+						 "standby " NODE_FORMAT
+						 " is in state \"%s\", "
+						 "which prevents the node for being a failover candidate",
+						 NODE_FORMAT_ARGS(secondaryNode),
+						 secondaryState)));
+		}
+
+		/*
+		 * In order to safely proceed we need to ensure that the primary node
+		 * has reached the primary state fully already. In the transition to
+		 * PRIMARY we actually wait until the current LSN observed on the
+		 * primary has made it to the secondary, which is a needed guarantee
+		 * for avoiding data loss.
+		 */
+		if (!IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) ||
+			!IsCurrentState(secondaryNode, REPLICATION_STATE_SECONDARY))
+		{
+			ereport(ERROR,
+					(errmsg(
+						 "cannot fail over: primary node is not in a stable state"),
+					 errdetail(NODE_FORMAT
+							   " has reported state \"%s\" and"
+							   " is assigned state \"%s\","
+							   " and " NODE_FORMAT
+							   " has reported state \"%s\""
+							   " and is assigned state \"%s\"",
+							   NODE_FORMAT_ARGS(primaryNode),
+							   ReplicationStateGetName(primaryNode->reportedState),
+							   ReplicationStateGetName(primaryNode->goalState),
+							   NODE_FORMAT_ARGS(secondaryNode),
+							   ReplicationStateGetName(secondaryNode->reportedState),
+							   ReplicationStateGetName(secondaryNode->goalState)),
+					 errhint("a stable state must be observed to "
+							 "perform a manual failover")));
+		}
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of " NODE_FORMAT
+			" to draining and " NODE_FORMAT
+			" to prepare_promotion after a user-initiated failover.",
+			NODE_FORMAT_ARGS(primaryNode),
+			NODE_FORMAT_ARGS(secondaryNode));
+
+		SetNodeGoalState(primaryNode,
+						 REPLICATION_STATE_DRAINING, message);
+
+		SetNodeGoalState(secondaryNode,
+						 REPLICATION_STATE_PREPARE_PROMOTION, message);
+	}
+	else
+	{
+		List *standbyNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
+		AutoFailoverNode *firstStandbyNode = linitial(standbyNodesGroupList);
+		char message[BUFSIZE];
+
+		/* so we have at least one candidate, let's get started */
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting goal state of " NODE_FORMAT
+			"at LSN %X/%X to draining after a user-initiated failover.",
+			NODE_FORMAT_ARGS(primaryNode),
+			(uint32) (primaryNode->reportedLSN >> 32),
+			(uint32) primaryNode->reportedLSN);
+
+		SetNodeGoalState(primaryNode, REPLICATION_STATE_DRAINING, message);
+
+		/* now proceed with the failover, starting with the first standby */
+		(void) ProceedGroupState(firstStandbyNode);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * promote promotes a given target node in a group.
+ */
+Datum
+perform_promotion(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
+
+	text *nodeNameText = PG_GETARG_TEXT_P(1);
+	char *nodeName = text_to_cstring(nodeNameText);
+
+
+	AutoFailoverNode *currentNode =
+		GetAutoFailoverNodeByName(formationId, nodeName);
+
+	if (currentNode == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node \"%s\" is not registered in formation \"%s\"",
+						nodeName, formationId)));
+	}
+
+	LockFormation(formationId, ShareLock);
+	LockNodeGroup(formationId, currentNode->groupId, ExclusiveLock);
+
+	/*
+	 * If the current node is the primary, that's done.
+	 */
+	if (IsCurrentState(currentNode, REPLICATION_STATE_SINGLE) ||
+		IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
+	{
+		/* return false: no promotion is happening */
+		ereport(NOTICE,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot perform promotion: node %s in formation %s "
+						"is already a primary.",
+						nodeName, formationId)));
+		PG_RETURN_BOOL(false);
+	}
+
+	/*
+	 * If the node is not a primary, it needs to be in the SECONDARY state or
+	 * in the REPORT_LSN state. In the case where none of the nodes are a
+	 * candidate for failover, and the primary has been lost, all the remaining
+	 * nodes are assigned REPORT_LSN, and we make it possible to then manually
+	 * promote one of them.
+	 *
+	 * When we call perform_failover() to implement the actual failover
+	 * orchestration, this condition is going to be checked again, but in a
+	 * different way.
+	 *
+	 * For instance, the target could be in MAINTENANCE and perform_failover
+	 * would still be able to implement a failover given another secondary node
+	 * being around.
+	 */
+	if (!IsCurrentState(currentNode, REPLICATION_STATE_SECONDARY) &&
+		!IsCurrentState(currentNode, REPLICATION_STATE_REPORT_LSN))
+	{
+		/* return false: no promotion is happening */
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg(
+					 "cannot perform promotion: node %s in formation %s "
+					 "has reported state \"%s\" and is assigned state \"%s\", "
+					 "promotion can only be performed when "
+					 "in state \"secondary\".",
+					 nodeName, formationId,
+					 ReplicationStateGetName(currentNode->reportedState),
+					 ReplicationStateGetName(currentNode->goalState))));
+	}
+
+	/*
+	 * If we have only two nodes in the group, then perform a failover.
+	 */
+	List *groupNodesList =
+		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
+
+	int totalNodesCount = list_length(groupNodesList);
 
-	LockFormation(formationId, ShareLock);
-	LockNodeGroup(formationId, groupId, ExclusiveLock);
+	if (totalNodesCount <= 2)
+	{
+		DirectFunctionCall2(perform_failover,
+							CStringGetTextDatum(formationId),
+							Int32GetDatum(currentNode->groupId));
 
-	List *groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
-	if (list_length(groupNodeList) < 2)
+		/* if we reach this point, then a failover is in progress */
+		PG_RETURN_BOOL(true);
+	}
+	else
 	{
-		ereport(ERROR,
-				(errmsg("cannot fail over: group %d in formation %s "
-						"currently has %d node registered",
-						groupId, formationId, list_length(groupNodeList)),
-				 errdetail("At least 2 nodes are required "
-						   "to implement a failover")));
+		char message[BUFSIZE] = { 0 };
+
+		/*
+		 * In the general case, we perform a little trick:
+		 *
+		 *  - first increment the node's candidate-priority by 100,
+		 *
+		 *  - then call perform_failover,
+		 *
+		 *  - when the node reaches WAIT_PRIMARY again, after promotion, reset
+		 *    its candidate priority.
+		 */
+		currentNode->candidatePriority += CANDIDATE_PRIORITY_INCREMENT;
+
+		ReportAutoFailoverNodeReplicationSetting(
+			currentNode->nodeId,
+			currentNode->nodeHost,
+			currentNode->nodePort,
+			currentNode->candidatePriority,
+			currentNode->replicationQuorum);
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Updating candidate priority to %d for " NODE_FORMAT,
+			currentNode->candidatePriority,
+			NODE_FORMAT_ARGS(currentNode));
+
+		NotifyStateChange(currentNode, message);
+
+		/*
+		 * In case of errors in the perform_failover function, we ereport an
+		 * ERROR and that causes the transaction to fail (ROLLBACK). In that
+		 * case, the UPDATE of the candidate priority in the
+		 * pgautofailover.node table is also cancelled, and the notification
+		 * above is not sent either.
+		 */
+		DirectFunctionCall2(perform_failover,
+							CStringGetTextDatum(formationId),
+							Int32GetDatum(currentNode->groupId));
+
+		/* if we reach this point, then a failover is in progress */
+		PG_RETURN_BOOL(true);
 	}
 
-	/* get a current primary node that we can failover from (accepts writes) */
-	AutoFailoverNode *primaryNode =
-		GetNodeToFailoverFromInGroup(formationId, groupId);
+	/* can't happen, keep compiler happy */
+	PG_RETURN_BOOL(false);
+}
 
-	if (primaryNode == NULL)
+
+/*
+ * start_maintenance sets the given node in maintenance state.
+ *
+ * This operation is only allowed on a secondary node. To do so on a primary
+ * node, first failover so that it's now a secondary.
+ */
+Datum
+start_maintenance(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+
+	AutoFailoverNode *primaryNode = NULL;
+
+	List *secondaryStates = list_make2_int(REPLICATION_STATE_SECONDARY,
+										   REPLICATION_STATE_CATCHINGUP);
+
+
+	char message[BUFSIZE];
+
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
+	if (currentNode == NULL)
 	{
-		ereport(ERROR,
-				(errmsg("couldn't find the primary node in formation \"%s\", "
-						"group %d", formationId, groupId)));
+		PG_RETURN_BOOL(false);
+	}
+
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	AutoFailoverFormation *formation = GetFormation(currentNode->formationId);
+
+	List *groupNodesList =
+		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
+
+	int totalNodesCount = list_length(groupNodesList);
+
+	/* check pre-conditions for the current node (secondary) */
+	if (currentNode->reportedState == REPLICATION_STATE_MAINTENANCE ||
+		currentNode->goalState == REPLICATION_STATE_MAINTENANCE)
+	{
+		/* if we're already in maintenance, we're good */
+		PG_RETURN_BOOL(true);
 	}
 
 	/*
-	 * When we have only two nodes, we can failover directly to the secondary
-	 * node, provided its current state allows for that.
+	 * We allow to go to maintenance in the following cases only:
 	 *
-	 * When we have more than two nodes, then we need to check that we have at
-	 * least one candidate for failover and initiate the REPORT_LSN dance to
-	 * make the failover happen.
+	 *  - current node is a primary, and we then promote the secondary
+	 *  - current node is a secondary or is catching up
 	 */
-	if (list_length(groupNodeList) == 2)
+	if (!(IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY) ||
+		  (IsStateIn(currentNode->reportedState, secondaryStates))))
 	{
-		List *standbyNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot start maintenance: node %s:%d has reported state "
+						"\"%s\" and is assigned state \"%s\", "
+						"expected either \"primary\", "
+						"\"secondary\" or \"catchingup\"",
+						currentNode->nodeHost, currentNode->nodePort,
+						ReplicationStateGetName(currentNode->reportedState),
+						ReplicationStateGetName(currentNode->goalState))));
+	}
 
-		if (list_length(standbyNodesGroupList) != 1)
+	/*
+	 * We now need to have the primary node identified, and the list of the
+	 * secondary nodes (not including those already in maintenance), to decide
+	 * if we can proceed.
+	 */
+	if (IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
+	{
+		primaryNode = currentNode;
+	}
+	else
+	{
+		primaryNode = GetPrimaryNodeInGroup(currentNode->formationId,
+											currentNode->groupId);
+
+		if (primaryNode == NULL)
 		{
 			ereport(ERROR,
-					(errmsg("couldn't find the standby node in "
-							"formation \"%s\", group %d with primary node "
-							NODE_FORMAT,
-							formationId, groupId,
-							NODE_FORMAT_ARGS(primaryNode))));
+					(errmsg("couldn't find the primary node in formation \"%s\", "
+							"group %d",
+							currentNode->formationId, currentNode->groupId)));
 		}
+	}
 
-		AutoFailoverNode *secondaryNode = linitial(standbyNodesGroupList);
+	/*
+	 * We need to always have at least formation->number_sync_standbys nodes in
+	 * the SECONDARY state participating in the quorum, otherwise writes may be
+	 * blocked on the primary. So we refuse to put a node in maintenance when
+	 * it would force blocking writes.
+	 */
+	List *secondaryNodesList =
+		AutoFailoverOtherNodesListInState(primaryNode,
+										  REPLICATION_STATE_SECONDARY);
 
-		if (secondaryNode->goalState != REPLICATION_STATE_SECONDARY)
-		{
-			const char *secondaryState =
-				ReplicationStateGetName(secondaryNode->goalState);
+	int secondaryNodesCount = list_length(secondaryNodesList);
 
-			ereport(ERROR,
-					(errmsg(
-						 "standby " NODE_FORMAT
-						 " is in state \"%s\", "
-						 "which prevents the node for being a failover candidate",
-						 NODE_FORMAT_ARGS(secondaryNode),
-						 secondaryState)));
-		}
+	if (formation->number_sync_standbys > 0 &&
+		secondaryNodesCount <= formation->number_sync_standbys)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot start maintenance: we currently have %d "
+						"node(s) in the \"secondary\" state and require at "
+						"least %d sync standbys in formation \"%s\"",
+						secondaryNodesCount,
+						formation->number_sync_standbys,
+						formation->formationId)));
+	}
 
-		/*
-		 * In order to safely proceed we need to ensure that the primary node
-		 * has reached the primary state fully already. In the transition to
-		 * PRIMARY we actually wait until the current LSN observed on the
-		 * primary has made it to the secondary, which is a needed guarantee
-		 * for avoiding data loss.
-		 */
-		if (!IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY) ||
-			!IsCurrentState(secondaryNode, REPLICATION_STATE_SECONDARY))
+	/*
+	 * Because replication quorum and candidate priority are managed
+	 * separately, we also need another test to ensure that we have at least
+	 * one candidate to failover to.
+	 */
+	if (currentNode->candidatePriority > 0)
+	{
+		List *candidateNodesList =
+			AutoFailoverCandidateNodesListInState(currentNode,
+												  REPLICATION_STATE_SECONDARY);
+
+		int candidateNodesCount = list_length(candidateNodesList);
+
+		if (formation->number_sync_standbys > 0 &&
+			candidateNodesCount < 1)
 		{
 			ereport(ERROR,
-					(errmsg(
-						 "cannot fail over: primary node is not in a stable state"),
-					 errdetail(NODE_FORMAT
-							   " has reported state \"%s\" and"
-							   " is assigned state \"%s\","
-							   " and " NODE_FORMAT
-							   " has reported state \"%s\""
-							   " and is assigned state \"%s\"",
-							   NODE_FORMAT_ARGS(primaryNode),
-							   ReplicationStateGetName(primaryNode->reportedState),
-							   ReplicationStateGetName(primaryNode->goalState),
-							   NODE_FORMAT_ARGS(secondaryNode),
-							   ReplicationStateGetName(secondaryNode->reportedState),
-							   ReplicationStateGetName(secondaryNode->goalState)),
-					 errhint("a stable state must be observed to "
-							 "perform a manual failover")));
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot start maintenance: we would then have %d "
+							"node(s) that would be candidate for promotion",
+							candidateNodesCount)));
 		}
+	}
+
+	/*
+	 * Now that we cleared that adding another node in MAINTENANCE is
+	 * compatible with our service expectations from
+	 * formation->number_sync_standbys, we may proceed.
+	 *
+	 * We proceed in different ways when asked to put a primary or a secondary
+	 * to maintenance: in the case of a primary, we must failover.
+	 */
+	if (IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
+	{
+		List *standbyNodesGroupList = AutoFailoverOtherNodesList(currentNode);
+		AutoFailoverNode *firstStandbyNode = linitial(standbyNodesGroupList);
+		char message[BUFSIZE] = { 0 };
 
+		/*
+		 * Set the primary to prepare_maintenance now, and if we have a single
+		 * secondary we assign it prepare_promotion, otherwise we need to elect
+		 * a secondary, same as in perform_failover.
+		 */
 		LogAndNotifyMessage(
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
-			" to draining and " NODE_FORMAT
-			" to prepare_promotion after a user-initiated failover.",
-			NODE_FORMAT_ARGS(primaryNode),
-			NODE_FORMAT_ARGS(secondaryNode));
+			" to prepare_maintenance "
+			"after a user-initiated start_maintenance call.",
+			NODE_FORMAT_ARGS(currentNode));
 
-		SetNodeGoalState(primaryNode,
-						 REPLICATION_STATE_DRAINING, message);
+		StartFailoverTrace(currentNode, FAILOVER_TRACE_KIND_SWITCHOVER);
 
-		SetNodeGoalState(secondaryNode,
-						 REPLICATION_STATE_PREPARE_PROMOTION, message);
+		SetNodeGoalState(currentNode,
+						 REPLICATION_STATE_PREPARE_MAINTENANCE, message);
+
+		if (totalNodesCount == 2)
+		{
+			AutoFailoverNode *otherNode = firstStandbyNode;
+
+			/*
+			 * We put the only secondary node straight to prepare_replication.
+			 */
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to prepare_maintenance and " NODE_FORMAT
+				" to prepare_promotion "
+				"after a user-initiated start_maintenance call.",
+				NODE_FORMAT_ARGS(currentNode),
+				NODE_FORMAT_ARGS(otherNode));
+
+			SetNodeGoalState(otherNode,
+							 REPLICATION_STATE_PREPARE_PROMOTION, message);
+		}
+		else
+		{
+			/* now proceed with the failover, starting with the first standby */
+			(void) ProceedGroupState(firstStandbyNode);
+		}
+
+		PG_RETURN_BOOL(true);
 	}
-	else
+
+	/*
+	 * Only allow a secondary to get to MAINTENANCE when the primary is in the
+	 * PRIMARY state.
+	 */
+	else if (IsStateIn(currentNode->reportedState, secondaryStates) &&
+			 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
 	{
-		List *standbyNodesGroupList = AutoFailoverOtherNodesList(primaryNode);
-		AutoFailoverNode *firstStandbyNode = linitial(standbyNodesGroupList);
-		char message[BUFSIZE];
+		/*
+		 * When putting the last secondary node to maintenance, we disable sync
+		 * rep on the primary by switching it to wait_primary. Because we
+		 * didn't change the state of any standby node yet, we get there when
+		 * the count is one (not zero).
+		 */
+		ReplicationState primaryGoalState =
+			secondaryNodesCount == 1
+			? REPLICATION_STATE_WAIT_PRIMARY
+			: REPLICATION_STATE_JOIN_PRIMARY;
 
-		/* so we have at least one candidate, let's get started */
 		LogAndNotifyMessage(
 			message, BUFSIZE,
 			"Setting goal state of " NODE_FORMAT
-			"at LSN %X/%X to draining after a user-initiated failover.",
+			" to %s and " NODE_FORMAT
+			" to wait_maintenance "
+			"after a user-initiated start_maintenance call.",
 			NODE_FORMAT_ARGS(primaryNode),
-			(uint32) (primaryNode->reportedLSN >> 32),
-			(uint32) primaryNode->reportedLSN);
-
-		SetNodeGoalState(primaryNode, REPLICATION_STATE_DRAINING, message);
+			ReplicationStateGetName(primaryGoalState),
+			NODE_FORMAT_ARGS(currentNode));
 
-		/* now proceed with the failover, starting with the first standby */
-		(void) ProceedGroupState(firstStandbyNode);
+		SetNodeGoalState(primaryNode, primaryGoalState, message);
+		SetNodeGoalState(currentNode, REPLICATION_STATE_WAIT_MAINTENANCE, message);
+	}
+	else
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("cannot start maintenance: current state for "
+						NODE_FORMAT
+						" is \"%s\", expected \"secondary\" or \"catchingup\", "
+						"and current state for primary " NODE_FORMAT
+						"is \"%s\" ➜ \"%s\" ",
+						NODE_FORMAT_ARGS(currentNode),
+						ReplicationStateGetName(currentNode->reportedState),
+						NODE_FORMAT_ARGS(primaryNode),
+						ReplicationStateGetName(primaryNode->reportedState),
+						ReplicationStateGetName(primaryNode->goalState))));
 	}
 
-	PG_RETURN_VOID();
+	PG_RETURN_BOOL(true);
 }
 
 
 /*
- * promote promotes a given target node in a group.
+ * stop_maintenance sets the given node back in catchingup state.
+ *
+ * This operation is only allowed on a secondary node. To do so on a primary
+ * node, first failover so that it's now a secondary.
  */
 Datum
-perform_promotion(PG_FUNCTION_ARGS)
+stop_maintenance(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	text *formationIdText = PG_GETARG_TEXT_P(0);
-	char *formationId = text_to_cstring(formationIdText);
-
-	text *nodeNameText = PG_GETARG_TEXT_P(1);
-	char *nodeName = text_to_cstring(nodeNameText);
+	int64 nodeId = PG_GETARG_INT64(0);
 
 
-	AutoFailoverNode *currentNode =
-		GetAutoFailoverNodeByName(formationId, nodeName);
+	char message[BUFSIZE];
 
+	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
 	if (currentNode == NULL)
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_OBJECT),
-				 errmsg("node \"%s\" is not registered in formation \"%s\"",
-						nodeName, formationId)));
-	}
-
-	LockFormation(formationId, ShareLock);
-	LockNodeGroup(formationId, currentNode->groupId, ExclusiveLock);
-
-	/*
-	 * If the current node is the primary, that's done.
-	 */
-	if (IsCurrentState(currentNode, REPLICATION_STATE_SINGLE) ||
-		IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
-	{
-		/* return false: no promotion is happening */
-		ereport(NOTICE,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("cannot perform promotion: node %s in formation %s "
-						"is already a primary.",
-						nodeName, formationId)));
 		PG_RETURN_BOOL(false);
 	}
 
-	/*
-	 * If the node is not a primary, it needs to be in the SECONDARY state or
-	 * in the REPORT_LSN state. In the case where none of the nodes are a
-	 * candidate for failover, and the primary has been lost, all the remaining
-	 * nodes are assigned REPORT_LSN, and we make it possible to then manually
-	 * promote one of them.
-	 *
-	 * When we call perform_failover() to implement the actual failover
-	 * orchestration, this condition is going to be checked again, but in a
-	 * different way.
-	 *
-	 * For instance, the target could be in MAINTENANCE and perform_failover
-	 * would still be able to implement a failover given another secondary node
-	 * being around.
-	 */
-	if (!IsCurrentState(currentNode, REPLICATION_STATE_SECONDARY) &&
-		!IsCurrentState(currentNode, REPLICATION_STATE_REPORT_LSN))
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+
+	if (!IsCurrentState(currentNode, REPLICATION_STATE_MAINTENANCE))
 	{
-		/* return false: no promotion is happening */
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg(
-					 "cannot perform promotion: node %s in formation %s "
-					 "has reported state \"%s\" and is assigned state \"%s\", "
-					 "promotion can only be performed when "
-					 "in state \"secondary\".",
-					 nodeName, formationId,
-					 ReplicationStateGetName(currentNode->reportedState),
-					 ReplicationStateGetName(currentNode->goalState))));
+				 errmsg("cannot stop maintenance when current state for "
+						NODE_FORMAT
+						" is not \"maintenance\"",
+						NODE_FORMAT_ARGS(currentNode)),
+				 errdetail("Current reported state is \"%s\" and "
+						   "assigned state is \"%s\"",
+						   ReplicationStateGetName(currentNode->reportedState),
+						   ReplicationStateGetName(currentNode->goalState))));
 	}
 
 	/*
-	 * If we have only two nodes in the group, then perform a failover.
+	 * We need to find the primary node even if we are in the middle of a
+	 * failover, and it's already set to draining. That way we may rejoin the
+	 * cluster, report our LSN, and help proceed to reach a consistent state.
 	 */
-	List *groupNodesList =
-		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
-
-	int totalNodesCount = list_length(groupNodesList);
+	AutoFailoverNode *primaryNode =
+		GetPrimaryOrDemotedNodeInGroup(currentNode->formationId,
+									   currentNode->groupId);
 
-	if (totalNodesCount <= 2)
+	if (primaryNode == NULL)
 	{
-		DirectFunctionCall2(perform_failover,
-							CStringGetTextDatum(formationId),
-							Int32GetDatum(currentNode->groupId));
-
-		/* if we reach this point, then a failover is in progress */
-		PG_RETURN_BOOL(true);
+		ereport(ERROR,
+				(errmsg("couldn't find the primary node in formation \"%s\", "
+						"group %d",
+						currentNode->formationId, currentNode->groupId)));
 	}
-	else
-	{
-		char message[BUFSIZE] = { 0 };
-
-		/*
-		 * In the general case, we perform a little trick:
-		 *
-		 *  - first increment the node's candidate-priority by 100,
-		 *
-		 *  - then call perform_failover,
-		 *
-		 *  - when the node reaches WAIT_PRIMARY again, after promotion, reset
-		 *    its candidate priority.
-		 */
-		currentNode->candidatePriority += CANDIDATE_PRIORITY_INCREMENT;
-
-		ReportAutoFailoverNodeReplicationSetting(
-			currentNode->nodeId,
-			currentNode->nodeHost,
-			currentNode->nodePort,
-			currentNode->candidatePriority,
-			currentNode->replicationQuorum);
-
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Updating candidate priority to %d for " NODE_FORMAT,
-			currentNode->candidatePriority,
-			NODE_FORMAT_ARGS(currentNode));
-
-		NotifyStateChange(currentNode, message);
 
-		/*
-		 * In case of errors in the perform_failover function, we ereport an
-		 * ERROR and that causes the transaction to fail (ROLLBACK). In that
-		 * case, the UPDATE of the candidate priority in the
-		 * pgautofailover.node table is also cancelled, and the notification
-		 * above is not sent either.
-		 */
-		DirectFunctionCall2(perform_failover,
-							CStringGetTextDatum(formationId),
-							Int32GetDatum(currentNode->groupId));
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Setting goal state of " NODE_FORMAT
+		" to catchingup  after a user-initiated stop_maintenance call.",
+		NODE_FORMAT_ARGS(currentNode));
 
-		/* if we reach this point, then a failover is in progress */
-		PG_RETURN_BOOL(true);
-	}
+	SetNodeGoalState(currentNode, REPLICATION_STATE_CATCHINGUP, message);
 
-	/* can't happen, keep compiler happy */
-	PG_RETURN_BOOL(false);
+	PG_RETURN_BOOL(true);
 }
 
 
 /*
- * start_maintenance sets the given node in maintenance state.
- *
- * This operation is only allowed on a secondary node. To do so on a primary
- * node, first failover so that it's now a secondary.
+ * set_node_candidate_priority sets node candidate priority property
  */
 Datum
-start_maintenance(PG_FUNCTION_ARGS)
+set_node_candidate_priority(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	int64 nodeId = PG_GETARG_INT64(0);
-
-	AutoFailoverNode *primaryNode = NULL;
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
 
-	List *secondaryStates = list_make2_int(REPLICATION_STATE_SECONDARY,
-										   REPLICATION_STATE_CATCHINGUP);
+	text *nodeNameText = PG_GETARG_TEXT_P(1);
+	char *nodeName = text_to_cstring(nodeNameText);
 
+	int candidatePriority = PG_GETARG_INT32(2);
 
-	char message[BUFSIZE];
+	AutoFailoverNode *currentNode =
+		GetAutoFailoverNodeByName(formationId, nodeName);
 
-	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
 	if (currentNode == NULL)
 	{
-		PG_RETURN_BOOL(false);
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node \"%s\" is not registered in formation \"%s\"",
+						nodeName, formationId)));
 	}
 
 	LockFormation(currentNode->formationId, ShareLock);
 	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
 
-	AutoFailoverFormation *formation = GetFormation(currentNode->formationId);
-
-	List *groupNodesList =
+	List *nodesGroupList =
 		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
+	int nodesCount = list_length(nodesGroupList);
 
-	int totalNodesCount = list_length(groupNodesList);
+	CheckNodeCandidatePriority(currentNode, candidatePriority);
 
-	/* check pre-conditions for the current node (secondary) */
-	if (currentNode->reportedState == REPLICATION_STATE_MAINTENANCE ||
-		currentNode->goalState == REPLICATION_STATE_MAINTENANCE)
-	{
-		/* if we're already in maintenance, we're good */
-		PG_RETURN_BOOL(true);
-	}
+	currentNode->candidatePriority = candidatePriority;
 
-	/*
-	 * We allow to go to maintenance in the following cases only:
-	 *
-	 *  - current node is a primary, and we then promote the secondary
-	 *  - current node is a secondary or is catching up
-	 */
-	if (!(IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY) ||
-		  (IsStateIn(currentNode->reportedState, secondaryStates))))
-	{
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("cannot start maintenance: node %s:%d has reported state "
-						"\"%s\" and is assigned state \"%s\", "
-						"expected either \"primary\", "
-						"\"secondary\" or \"catchingup\"",
-						currentNode->nodeHost, currentNode->nodePort,
-						ReplicationStateGetName(currentNode->reportedState),
-						ReplicationStateGetName(currentNode->goalState))));
-	}
+	ReportAutoFailoverNodeReplicationSetting(
+		currentNode->nodeId,
+		currentNode->nodeHost,
+		currentNode->nodePort,
+		currentNode->candidatePriority,
+		currentNode->replicationQuorum);
 
-	/*
-	 * We now need to have the primary node identified, and the list of the
-	 * secondary nodes (not including those already in maintenance), to decide
-	 * if we can proceed.
-	 */
-	if (IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
+	if (nodesCount == 1)
 	{
-		primaryNode = currentNode;
+		char message[BUFSIZE];
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Updating candidate priority to %d for " NODE_FORMAT,
+			currentNode->candidatePriority,
+			NODE_FORMAT_ARGS(currentNode));
+
+		NotifyStateChange(currentNode, message);
 	}
 	else
 	{
-		primaryNode = GetPrimaryNodeInGroup(currentNode->formationId,
-											currentNode->groupId);
+		char message[BUFSIZE];
 
-		if (primaryNode == NULL)
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(currentNode->formationId,
+								  currentNode->groupId);
+
+		/*
+		 * If we allow setting changes during APPLY_SETTINGS we open the door
+		 * for race conditions where we can't be sure that the latest changes
+		 * have been applied.
+		 *
+		 * If we don't currently have a primary node anyway, we can just
+		 * proceed with the change.
+		 */
+		if (primaryNode &&
+			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to apply_settings after updating " NODE_FORMAT
+				" candidate priority to %d.",
+				NODE_FORMAT_ARGS(primaryNode),
+				NODE_FORMAT_ARGS(currentNode),
+				currentNode->candidatePriority);
+
+			SetNodeGoalState(primaryNode,
+							 REPLICATION_STATE_APPLY_SETTINGS, message);
+		}
+
+		/* if primaryNode is not NULL, then current state is APPLY_SETTINGS */
+		else if (primaryNode)
 		{
 			ereport(ERROR,
-					(errmsg("couldn't find the primary node in formation \"%s\", "
-							"group %d",
-							currentNode->formationId, currentNode->groupId)));
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot set candidate priority when current state "
+							"for primary " NODE_FORMAT
+							" is \"%s\"",
+							NODE_FORMAT_ARGS(primaryNode),
+							ReplicationStateGetName(primaryNode->reportedState))));
 		}
+
+		/* other case is that we failed to find a primary node, proceed */
 	}
 
-	/*
-	 * We need to always have at least formation->number_sync_standbys nodes in
-	 * the SECONDARY state participating in the quorum, otherwise writes may be
-	 * blocked on the primary. So we refuse to put a node in maintenance when
-	 * it would force blocking writes.
-	 */
-	List *secondaryNodesList =
-		AutoFailoverOtherNodesListInState(primaryNode,
-										  REPLICATION_STATE_SECONDARY);
+	PG_RETURN_BOOL(true);
+}
 
-	int secondaryNodesCount = list_length(secondaryNodesList);
 
-	if (formation->number_sync_standbys > 0 &&
-		secondaryNodesCount <= formation->number_sync_standbys)
-	{
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("cannot start maintenance: we currently have %d "
-						"node(s) in the \"secondary\" state and require at "
-						"least %d sync standbys in formation \"%s\"",
-						secondaryNodesCount,
-						formation->number_sync_standbys,
-						formation->formationId)));
-	}
+/*
+ * set_node_replication_quorum sets node replication quorum property
+ */
+Datum
+set_node_replication_quorum(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
 
-	/*
-	 * Because replication quorum and candidate priority are managed
-	 * separately, we also need another test to ensure that we have at least
-	 * one candidate to failover to.
-	 */
-	if (currentNode->candidatePriority > 0)
-	{
-		List *candidateNodesList =
-			AutoFailoverCandidateNodesListInState(currentNode,
-												  REPLICATION_STATE_SECONDARY);
+	text *formationIdText = PG_GETARG_TEXT_P(0);
+	char *formationId = text_to_cstring(formationIdText);
 
-		int candidateNodesCount = list_length(candidateNodesList);
+	text *nodeNameText = PG_GETARG_TEXT_P(1);
+	char *nodeName = text_to_cstring(nodeNameText);
 
-		if (formation->number_sync_standbys > 0 &&
-			candidateNodesCount < 1)
-		{
-			ereport(ERROR,
-					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-					 errmsg("cannot start maintenance: we would then have %d "
-							"node(s) that would be candidate for promotion",
-							candidateNodesCount)));
-		}
-	}
+	bool replicationQuorum = PG_GETARG_BOOL(2);
 
-	/*
-	 * Now that we cleared that adding another node in MAINTENANCE is
-	 * compatible with our service expectations from
-	 * formation->number_sync_standbys, we may proceed.
-	 *
-	 * We proceed in different ways when asked to put a primary or a secondary
-	 * to maintenance: in the case of a primary, we must failover.
-	 */
-	if (IsCurrentState(currentNode, REPLICATION_STATE_PRIMARY))
+
+	AutoFailoverNode *currentNode =
+		GetAutoFailoverNodeByName(formationId, nodeName);
+
+	if (currentNode == NULL)
 	{
-		List *standbyNodesGroupList = AutoFailoverOtherNodesList(currentNode);
-		AutoFailoverNode *firstStandbyNode = linitial(standbyNodesGroupList);
-		char message[BUFSIZE] = { 0 };
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("node \"%s\" is not registered in formation \"%s\"",
+						nodeName, formationId)));
+	}
 
-		/*
-		 * Set the primary to prepare_maintenance now, and if we have a single
-		 * secondary we assign it prepare_promotion, otherwise we need to elect
-		 * a secondary, same as in perform_failover.
-		 */
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Setting goal state of " NODE_FORMAT
-			" to prepare_maintenance "
-			"after a user-initiated start_maintenance call.",
-			NODE_FORMAT_ARGS(currentNode));
+	LockFormation(currentNode->formationId, ShareLock);
+	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
 
-		SetNodeGoalState(currentNode,
-						 REPLICATION_STATE_PREPARE_MAINTENANCE, message);
+	List *nodesGroupList =
+		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
+	int nodesCount = list_length(nodesGroupList);
 
-		if (totalNodesCount == 2)
-		{
-			AutoFailoverNode *otherNode = firstStandbyNode;
+	CheckNodeReplicationQuorum(currentNode, replicationQuorum);
 
-			/*
-			 * We put the only secondary node straight to prepare_replication.
-			 */
-			LogAndNotifyMessage(
-				message, BUFSIZE,
-				"Setting goal state of " NODE_FORMAT
-				" to prepare_maintenance and " NODE_FORMAT
-				" to prepare_promotion "
-				"after a user-initiated start_maintenance call.",
-				NODE_FORMAT_ARGS(currentNode),
-				NODE_FORMAT_ARGS(otherNode));
+	currentNode->replicationQuorum = replicationQuorum;
 
-			SetNodeGoalState(otherNode,
-							 REPLICATION_STATE_PREPARE_PROMOTION, message);
-		}
-		else
-		{
-			/* now proceed with the failover, starting with the first standby */
-			(void) ProceedGroupState(firstStandbyNode);
-		}
+	ReportAutoFailoverNodeReplicationSetting(currentNode->nodeId,
+											 currentNode->nodeHost,
+											 currentNode->nodePort,
+											 currentNode->candidatePriority,
+											 currentNode->replicationQuorum);
+
+	/* we need to see the result of that operation in the next query */
+	CommandCounterIncrement();
 
-		PG_RETURN_BOOL(true);
+	/* it's not always possible to opt-out from replication-quorum */
+	if (!currentNode->replicationQuorum)
+	{
+		CheckNodeReplicationQuorumOptOut(currentNode);
 	}
 
-	/*
-	 * Only allow a secondary to get to MAINTENANCE when the primary is in the
-	 * PRIMARY state.
-	 */
-	else if (IsStateIn(currentNode->reportedState, secondaryStates) &&
-			 IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
+	if (nodesCount == 1)
 	{
-		/*
-		 * When putting the last secondary node to maintenance, we disable sync
-		 * rep on the primary by switching it to wait_primary. Because we
-		 * didn't change the state of any standby node yet, we get there when
-		 * the count is one (not zero).
-		 */
-		ReplicationState primaryGoalState =
-			secondaryNodesCount == 1
-			? REPLICATION_STATE_WAIT_PRIMARY
-			: REPLICATION_STATE_JOIN_PRIMARY;
+		char message[BUFSIZE];
 
 		LogAndNotifyMessage(
 			message, BUFSIZE,
-			"Setting goal state of " NODE_FORMAT
-			" to %s and " NODE_FORMAT
-			" to wait_maintenance "
-			"after a user-initiated start_maintenance call.",
-			NODE_FORMAT_ARGS(primaryNode),
-			ReplicationStateGetName(primaryGoalState),
+			"Updating replicationQuorum to %s for " NODE_FORMAT,
+			currentNode->replicationQuorum ? "true" : "false",
 			NODE_FORMAT_ARGS(currentNode));
 
-		SetNodeGoalState(primaryNode, primaryGoalState, message);
-		SetNodeGoalState(currentNode, REPLICATION_STATE_WAIT_MAINTENANCE, message);
+		NotifyStateChange(currentNode, message);
 	}
 	else
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("cannot start maintenance: current state for "
-						NODE_FORMAT
-						" is \"%s\", expected \"secondary\" or \"catchingup\", "
-						"and current state for primary " NODE_FORMAT
-						"is \"%s\" ➜ \"%s\" ",
-						NODE_FORMAT_ARGS(currentNode),
-						ReplicationStateGetName(currentNode->reportedState),
-						NODE_FORMAT_ARGS(primaryNode),
-						ReplicationStateGetName(primaryNode->reportedState),
-						ReplicationStateGetName(primaryNode->goalState))));
+		char message[BUFSIZE];
+
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(currentNode->formationId,
+								  currentNode->groupId);
+
+		/*
+		 * If we allow setting changes during APPLY_SETTINGS we open the door
+		 * for race conditions where we can't be sure that the latest changes
+		 * have been applied.
+		 *
+		 * If we don't currently have a primary node anyway, we can just
+		 * proceed with the change.
+		 */
+		if (primaryNode &&
+			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to apply_settings after updating " NODE_FORMAT
+				" replication quorum to %s.",
+				NODE_FORMAT_ARGS(primaryNode),
+				NODE_FORMAT_ARGS(currentNode),
+				currentNode->replicationQuorum ? "true" : "false");
+
+			SetNodeGoalState(primaryNode,
+							 REPLICATION_STATE_APPLY_SETTINGS, message);
+		}
+
+		/* if primaryNode is not NULL, then current state is APPLY_SETTINGS */
+		else if (primaryNode)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot set replication quorum when current state "
+							"for primary " NODE_FORMAT
+							" is \"%s\"",
+							NODE_FORMAT_ARGS(primaryNode),
+							ReplicationStateGetName(primaryNode->reportedState))));
+		}
+
+		/* other case is that we failed to find a primary node, proceed */
 	}
 
 	PG_RETURN_BOOL(true);
@@ -1816,110 +3320,263 @@ start_maintenance(PG_FUNCTION_ARGS)
 
 
 /*
- * stop_maintenance sets the given node back in catchingup state.
+ * set_node_properties sets the candidate priority and replication quorum of
+ * a list of nodes of a formation in a single transaction. The arrays of
+ * values are either NULL or of the same length as the array of node names,
+ * and a NULL value leaves the property of that node unchanged.
  *
- * This operation is only allowed on a secondary node. To do so on a primary
- * node, first failover so that it's now a secondary.
+ * The settings are checked against the resulting state of each group, so
+ * that replication quorum can move from a node to another one, and then the
+ * primary node of each group that has changed goes through a single
+ * APPLY_SETTINGS transition, rather than one per node and property. We
+ * return how many primary nodes have been assigned APPLY_SETTINGS.
  */
 Datum
-stop_maintenance(PG_FUNCTION_ARGS)
+set_node_properties(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
-	int64 nodeId = PG_GETARG_INT64(0);
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("formation_id and node_names must not be NULL")));
+	}
 
+	char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+	ArrayType *nodeNamesArray = PG_GETARG_ARRAYTYPE_P(1);
 
-	char message[BUFSIZE];
+	Datum *nodeNameDatums = NULL;
+	bool *nodeNameNulls = NULL;
+	int nodeCount = 0;
 
-	AutoFailoverNode *currentNode = GetAutoFailoverNodeById(nodeId);
-	if (currentNode == NULL)
+	Datum *priorityDatums = NULL;
+	bool *priorityNulls = NULL;
+	int priorityCount = 0;
+
+	Datum *quorumDatums = NULL;
+	bool *quorumNulls = NULL;
+	int quorumCount = 0;
+
+	List *nodeList = NIL;
+	List *groupNodeList = NIL;
+	ListCell *nodeCell = NULL;
+	int applySettingsCount = 0;
+
+	deconstruct_array(nodeNamesArray, TEXTOID, -1, false, 'i',
+					  &nodeNameDatums, &nodeNameNulls, &nodeCount);
+
+	if (!PG_ARGISNULL(2))
 	{
-		PG_RETURN_BOOL(false);
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), INT4OID, sizeof(int32),
+						  true, 'i',
+						  &priorityDatums, &priorityNulls, &priorityCount);
 	}
 
-	LockFormation(currentNode->formationId, ShareLock);
-	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+	if (!PG_ARGISNULL(3))
+	{
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(3), BOOLOID, sizeof(bool),
+						  true, 'c',
+						  &quorumDatums, &quorumNulls, &quorumCount);
+	}
 
-	if (!IsCurrentState(currentNode, REPLICATION_STATE_MAINTENANCE))
+	if ((priorityDatums != NULL && priorityCount != nodeCount) ||
+		(quorumDatums != NULL && quorumCount != nodeCount))
 	{
 		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-				 errmsg("cannot stop maintenance when current state for "
-						NODE_FORMAT
-						" is not \"maintenance\"",
-						NODE_FORMAT_ARGS(currentNode)),
-				 errdetail("Current reported state is \"%s\" and "
-						   "assigned state is \"%s\"",
-						   ReplicationStateGetName(currentNode->reportedState),
-						   ReplicationStateGetName(currentNode->goalState))));
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("candidate_priorities and replication_quorums must "
+						"have as many elements as node_names")));
 	}
 
-	/*
-	 * We need to find the primary node even if we are in the middle of a
-	 * failover, and it's already set to draining. That way we may rejoin the
-	 * cluster, report our LSN, and help proceed to reach a consistent state.
-	 */
-	AutoFailoverNode *primaryNode =
-		GetPrimaryOrDemotedNodeInGroup(currentNode->formationId,
-									   currentNode->groupId);
+	LockFormation(formationId, ShareLock);
 
-	if (primaryNode == NULL)
+	for (int i = 0; i < nodeCount; i++)
 	{
-		ereport(ERROR,
-				(errmsg("couldn't find the primary node in formation \"%s\", "
-						"group %d",
-						currentNode->formationId, currentNode->groupId)));
+		if (nodeNameNulls[i])
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("node_names must not contain NULL values")));
+		}
+
+		char *nodeName = TextDatumGetCString(nodeNameDatums[i]);
+		AutoFailoverNode *node = GetAutoFailoverNodeByName(formationId, nodeName);
+
+		if (node == NULL)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("node \"%s\" is not registered in formation \"%s\"",
+							nodeName, formationId)));
+		}
+
+		foreach(nodeCell, nodeList)
+		{
+			AutoFailoverNode *listedNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (listedNode->nodeId == node->nodeId)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("node \"%s\" is listed more than once",
+								nodeName)));
+			}
+		}
+
+		nodeList = lappend(nodeList, node);
+
+		if (!IsNodeInGroupList(groupNodeList, node))
+		{
+			groupNodeList = lappend(groupNodeList, node);
+		}
 	}
 
-	LogAndNotifyMessage(
-		message, BUFSIZE,
-		"Setting goal state of " NODE_FORMAT
-		" to catchingup  after a user-initiated stop_maintenance call.",
-		NODE_FORMAT_ARGS(currentNode));
+	/* lock the groups in a stable order, as concurrent calls would */
+	int lockedGroupId = -1;
 
-	SetNodeGoalState(currentNode, REPLICATION_STATE_CATCHINGUP, message);
+	for (;;)
+	{
+		int nextGroupId = -1;
 
-	PG_RETURN_BOOL(true);
-}
+		foreach(nodeCell, groupNodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
 
+			if (node->groupId > lockedGroupId &&
+				(nextGroupId == -1 || node->groupId < nextGroupId))
+			{
+				nextGroupId = node->groupId;
+			}
+		}
 
-/*
- * set_node_candidate_priority sets node candidate priority property
- */
-Datum
-set_node_candidate_priority(PG_FUNCTION_ARGS)
-{
-	checkPgAutoFailoverVersion();
+		if (nextGroupId == -1)
+		{
+			break;
+		}
 
-	text *formationIdText = PG_GETARG_TEXT_P(0);
-	char *formationId = text_to_cstring(formationIdText);
+		LockNodeGroup(formationId, nextGroupId, ExclusiveLock);
+		lockedGroupId = nextGroupId;
+	}
 
-	text *nodeNameText = PG_GETARG_TEXT_P(1);
-	char *nodeName = text_to_cstring(nodeNameText);
+	/* the same race conditions as in set_node_candidate_priority apply */
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(node->formationId, node->groupId);
 
-	int candidatePriority = PG_GETARG_INT32(2);
+		if (IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("cannot set node properties when current state "
+							"for primary " NODE_FORMAT
+							" is \"%s\"",
+							NODE_FORMAT_ARGS(primaryNode),
+							ReplicationStateGetName(primaryNode->reportedState))));
+		}
+	}
 
+	int index = 0;
 
-	ListCell *nodeCell = NULL;
-	int nonZeroCandidatePriorityNodeCount = 0;
+	foreach(nodeCell, nodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
 
-	AutoFailoverNode *currentNode =
-		GetAutoFailoverNodeByName(formationId, nodeName);
+		if (priorityDatums != NULL && !priorityNulls[index])
+		{
+			int candidatePriority = DatumGetInt32(priorityDatums[index]);
 
-	if (currentNode == NULL)
+			CheckNodeCandidatePriority(node, candidatePriority);
+			node->candidatePriority = candidatePriority;
+		}
+
+		if (quorumDatums != NULL && !quorumNulls[index])
+		{
+			bool replicationQuorum = DatumGetBool(quorumDatums[index]);
+
+			CheckNodeReplicationQuorum(node, replicationQuorum);
+			node->replicationQuorum = replicationQuorum;
+		}
+
+		ReportAutoFailoverNodeReplicationSetting(node->nodeId,
+												 node->nodeHost,
+												 node->nodePort,
+												 node->candidatePriority,
+												 node->replicationQuorum);
+		++index;
+	}
+
+	/* we need to see the result of that operation in the next query */
+	CommandCounterIncrement();
+
+	foreach(nodeCell, nodeList)
 	{
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_OBJECT),
-				 errmsg("node \"%s\" is not registered in formation \"%s\"",
-						nodeName, formationId)));
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (!node->replicationQuorum)
+		{
+			CheckNodeReplicationQuorumOptOut(node);
+		}
 	}
 
-	LockFormation(currentNode->formationId, ShareLock);
-	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		char message[BUFSIZE];
 
-	List *nodesGroupList =
-		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
-	int nodesCount = list_length(nodesGroupList);
+		List *nodesGroupList =
+			AutoFailoverNodeGroup(node->formationId, node->groupId);
+
+		AutoFailoverNode *primaryNode =
+			GetPrimaryNodeInGroup(node->formationId, node->groupId);
+
+		if (list_length(nodesGroupList) == 1)
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Updating candidate priority to %d and replicationQuorum "
+				"to %s for " NODE_FORMAT,
+				node->candidatePriority,
+				node->replicationQuorum ? "true" : "false",
+				NODE_FORMAT_ARGS(node));
+
+			NotifyStateChange(node, message);
+		}
+		else if (primaryNode != NULL)
+		{
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to apply_settings after updating the properties "
+				"of nodes in group %d.",
+				NODE_FORMAT_ARGS(primaryNode),
+				node->groupId);
+
+			SetNodeGoalState(primaryNode,
+							 REPLICATION_STATE_APPLY_SETTINGS, message);
+
+			++applySettingsCount;
+		}
+
+		/* other case is that we failed to find a primary node, proceed */
+	}
+
+	PG_RETURN_INT32(applySettingsCount);
+}
+
+
+/*
+ * CheckNodeCandidatePriority errors out when the given candidate priority is
+ * not valid for the given node, and warns when setting it would leave the
+ * group of the node without a failover candidate.
+ */
+static void
+CheckNodeCandidatePriority(AutoFailoverNode *currentNode, int candidatePriority)
+{
+	ListCell *nodeCell = NULL;
+	int nonZeroCandidatePriorityNodeCount = 0;
 
 	if (candidatePriority < 0 ||
 		candidatePriority > MAX_USER_DEFINED_CANDIDATE_PRIORITY)
@@ -1943,6 +3600,10 @@ set_node_candidate_priority(PG_FUNCTION_ARGS)
 
 	if (candidatePriority == 0 && currentNode->candidatePriority != 0)
 	{
+		List *nodesGroupList =
+			AutoFailoverNodeGroup(currentNode->formationId,
+								  currentNode->groupId);
+
 		/*
 		 * We need to ensure we have at least two nodes with a non-zero
 		 * candidate priority, otherwise we can't failover. Those two nodes
@@ -1969,99 +3630,116 @@ set_node_candidate_priority(PG_FUNCTION_ARGS)
 							"automated failover"),
 					 errdetail("Group %d in formation \"%s\" have no "
 							   "failover candidate.",
-							   currentNode->groupId, formationId)));
+							   currentNode->groupId,
+							   currentNode->formationId)));
 		}
 	}
+}
 
-	currentNode->candidatePriority = candidatePriority;
-
-	ReportAutoFailoverNodeReplicationSetting(
-		currentNode->nodeId,
-		currentNode->nodeHost,
-		currentNode->nodePort,
-		currentNode->candidatePriority,
-		currentNode->replicationQuorum);
 
-	if (nodesCount == 1)
+/*
+ * CheckNodeReplicationQuorum errors out when the given node can't take part
+ * in the replication quorum: synchronous_standby_names only applies to the
+ * primary's standbys.
+ */
+static void
+CheckNodeReplicationQuorum(AutoFailoverNode *currentNode,
+						   bool replicationQuorum)
+{
+	if (replicationQuorum)
 	{
-		char message[BUFSIZE];
-
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Updating candidate priority to %d for " NODE_FORMAT,
-			currentNode->candidatePriority,
-			NODE_FORMAT_ARGS(currentNode));
+		int64 upstreamNodeId = 0;
+		int64 streamingNodeId = 0;
 
-		NotifyStateChange(currentNode, message);
+		if (GetNodeUpstream(currentNode->nodeId,
+							&upstreamNodeId, &streamingNodeId) &&
+			(upstreamNodeId != 0 || streamingNodeId != 0))
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("can't set replication quorum to true for "
+							NODE_FORMAT,
+							NODE_FORMAT_ARGS(currentNode)),
+					 errdetail("The node streams from another standby node, "
+							   "or is configured to do so."),
+					 errhint("Use pgautofailover.set_node_upstream() "
+							 "to stream from the primary node first.")));
+		}
 	}
-	else
-	{
-		char message[BUFSIZE];
+}
 
-		AutoFailoverNode *primaryNode =
-			GetPrimaryNodeInGroup(currentNode->formationId,
-								  currentNode->groupId);
 
-		/*
-		 * If we allow setting changes during APPLY_SETTINGS we open the door
-		 * for race conditions where we can't be sure that the latest changes
-		 * have been applied.
-		 *
-		 * If we don't currently have a primary node anyway, we can just
-		 * proceed with the change.
-		 */
-		if (primaryNode &&
-			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
-		{
-			LogAndNotifyMessage(
-				message, BUFSIZE,
-				"Setting goal state of " NODE_FORMAT
-				" to apply_settings after updating " NODE_FORMAT
-				" candidate priority to %d.",
-				NODE_FORMAT_ARGS(primaryNode),
-				NODE_FORMAT_ARGS(currentNode),
-				currentNode->candidatePriority);
+/*
+ * CheckNodeReplicationQuorumOptOut errors out when the group of the given
+ * node, which has opted out of the replication quorum, doesn't have enough
+ * standby nodes left in the quorum for the formation number_sync_standbys.
+ */
+static void
+CheckNodeReplicationQuorumOptOut(AutoFailoverNode *currentNode)
+{
+	AutoFailoverFormation *formation =
+		GetFormation(currentNode->formationId);
 
-			SetNodeGoalState(primaryNode,
-							 REPLICATION_STATE_APPLY_SETTINGS, message);
-		}
+	AutoFailoverNode *primaryNode =
+		GetPrimaryNodeInGroup(formation->formationId, currentNode->groupId);
 
-		/* if primaryNode is not NULL, then current state is APPLY_SETTINGS */
-		else if (primaryNode)
-		{
-			ereport(ERROR,
-					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-					 errmsg("cannot set candidate priority when current state "
-							"for primary " NODE_FORMAT
-							" is \"%s\"",
-							NODE_FORMAT_ARGS(primaryNode),
-							ReplicationStateGetName(primaryNode->reportedState))));
-		}
+	int standbyCount = 0;
 
-		/* other case is that we failed to find a primary node, proceed */
+	if (primaryNode == NULL)
+	{
+		/* maybe we could use an Assert() instead? */
+		ereport(ERROR,
+				(errmsg("Couldn't find the primary node in "
+						"formation \"%s\", group %d",
+						formation->formationId, currentNode->groupId)));
 	}
 
-	PG_RETURN_BOOL(true);
+	if (!FormationNumSyncStandbyIsValid(formation,
+										primaryNode,
+										currentNode->groupId,
+										&standbyCount))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("can't set replication quorum to false"),
+				 errdetail("At least %d standby nodes are required "
+						   "in formation %s with number_sync_standbys = %d, "
+						   "and only %d would be participating in "
+						   "the replication quorum",
+						   formation->number_sync_standbys + 1,
+						   formation->formationId,
+						   formation->number_sync_standbys,
+						   standbyCount)));
+	}
 }
 
 
 /*
- * set_node_replication_quorum sets node replication quorum property
+ * set_node_upstream sets the node that a standby node which does not
+ * participate in the replication quorum streams from, so that not all the
+ * standby nodes are connected to the primary. A NULL upstream node name
+ * resets the setting, and the node then streams from the primary again.
+ *
+ * The state machine then has the standby node follow its new upstream node
+ * at its next call to node_active.
  */
 Datum
-set_node_replication_quorum(PG_FUNCTION_ARGS)
+set_node_upstream(PG_FUNCTION_ARGS)
 {
 	checkPgAutoFailoverVersion();
 
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		ereport(ERROR,
+				(errmsg("formation_id and node_name must not be null")));
+	}
+
 	text *formationIdText = PG_GETARG_TEXT_P(0);
 	char *formationId = text_to_cstring(formationIdText);
 
 	text *nodeNameText = PG_GETARG_TEXT_P(1);
 	char *nodeName = text_to_cstring(nodeNameText);
 
-	bool replicationQuorum = PG_GETARG_BOOL(2);
-
-
 	AutoFailoverNode *currentNode =
 		GetAutoFailoverNodeByName(formationId, nodeName);
 
@@ -2076,119 +3754,108 @@ set_node_replication_quorum(PG_FUNCTION_ARGS)
 	LockFormation(currentNode->formationId, ShareLock);
 	LockNodeGroup(currentNode->formationId, currentNode->groupId, ExclusiveLock);
 
-	List *nodesGroupList =
-		AutoFailoverNodeGroup(currentNode->formationId, currentNode->groupId);
-	int nodesCount = list_length(nodesGroupList);
-
-	currentNode->replicationQuorum = replicationQuorum;
-
-	ReportAutoFailoverNodeReplicationSetting(currentNode->nodeId,
-											 currentNode->nodeHost,
-											 currentNode->nodePort,
-											 currentNode->candidatePriority,
-											 currentNode->replicationQuorum);
-
-	/* we need to see the result of that operation in the next query */
-	CommandCounterIncrement();
+	AutoFailoverNode *upstreamNode = NULL;
 
-	/* it's not always possible to opt-out from replication-quorum */
-	if (!currentNode->replicationQuorum)
+	if (!PG_ARGISNULL(2))
 	{
-		AutoFailoverFormation *formation =
-			GetFormation(currentNode->formationId);
-
-		AutoFailoverNode *primaryNode =
-			GetPrimaryNodeInGroup(formation->formationId, currentNode->groupId);
+		text *upstreamNodeNameText = PG_GETARG_TEXT_P(2);
+		char *upstreamNodeName = text_to_cstring(upstreamNodeNameText);
 
-		int standbyCount = 0;
+		upstreamNode = GetAutoFailoverNodeByName(formationId, upstreamNodeName);
 
-		if (primaryNode == NULL)
+		if (upstreamNode == NULL)
 		{
-			/* maybe we could use an Assert() instead? */
 			ereport(ERROR,
-					(errmsg("Couldn't find the primary node in "
-							"formation \"%s\", group %d",
-							formation->formationId, currentNode->groupId)));
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+					 errmsg("node \"%s\" is not registered in formation \"%s\"",
+							upstreamNodeName, formationId)));
 		}
 
-		if (!FormationNumSyncStandbyIsValid(formation,
-											primaryNode,
-											currentNode->groupId,
-											&standbyCount))
+		if (upstreamNode->groupId != currentNode->groupId ||
+			upstreamNode->nodeId == currentNode->nodeId)
 		{
 			ereport(ERROR,
 					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("can't set replication quorum to false"),
-					 errdetail("At least %d standby nodes are required "
-							   "in formation %s with number_sync_standbys = %d, "
-							   "and only %d would be participating in "
-							   "the replication quorum",
-							   formation->number_sync_standbys + 1,
-							   formation->formationId,
-							   formation->number_sync_standbys,
-							   standbyCount)));
+					 errmsg("can't use " NODE_FORMAT " as the upstream node of "
+							NODE_FORMAT,
+							NODE_FORMAT_ARGS(upstreamNode),
+							NODE_FORMAT_ARGS(currentNode)),
+					 errdetail("The upstream node must be another node in "
+							   "the same group.")));
 		}
-	}
-
-	if (nodesCount == 1)
-	{
-		char message[BUFSIZE];
-
-		LogAndNotifyMessage(
-			message, BUFSIZE,
-			"Updating replicationQuorum to %s for " NODE_FORMAT,
-			currentNode->replicationQuorum ? "true" : "false",
-			NODE_FORMAT_ARGS(currentNode));
 
-		NotifyStateChange(currentNode, message);
-	}
-	else
-	{
-		char message[BUFSIZE];
+		if (currentNode->replicationQuorum)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("can't set an upstream node for " NODE_FORMAT,
+							NODE_FORMAT_ARGS(currentNode)),
+					 errdetail("Standby nodes that participate in the "
+							   "replication quorum stream from the primary."),
+					 errhint("Use pgautofailover.set_node_replication_quorum() "
+							 "to set replication quorum to false first.")));
+		}
 
-		AutoFailoverNode *primaryNode =
-			GetPrimaryNodeInGroup(currentNode->formationId,
+		/* we only support a single level of cascading */
+		List *nodesGroupList =
+			AutoFailoverNodeGroup(currentNode->formationId,
 								  currentNode->groupId);
+		ListCell *nodeCell = NULL;
 
-		/*
-		 * If we allow setting changes during APPLY_SETTINGS we open the door
-		 * for race conditions where we can't be sure that the latest changes
-		 * have been applied.
-		 *
-		 * If we don't currently have a primary node anyway, we can just
-		 * proceed with the change.
-		 */
-		if (primaryNode &&
-			!IsCurrentState(primaryNode, REPLICATION_STATE_APPLY_SETTINGS))
+		foreach(nodeCell, nodesGroupList)
 		{
-			LogAndNotifyMessage(
-				message, BUFSIZE,
-				"Setting goal state of " NODE_FORMAT
-				" to apply_settings after updating " NODE_FORMAT
-				" replication quorum to %s.",
-				NODE_FORMAT_ARGS(primaryNode),
-				NODE_FORMAT_ARGS(currentNode),
-				currentNode->replicationQuorum ? "true" : "false");
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+			int64 upstreamNodeId = 0;
+			int64 streamingNodeId = 0;
 
-			SetNodeGoalState(primaryNode,
-							 REPLICATION_STATE_APPLY_SETTINGS, message);
-		}
+			if (!GetNodeUpstream(node->nodeId, &upstreamNodeId, &streamingNodeId))
+			{
+				continue;
+			}
 
-		/* if primaryNode is not NULL, then current state is APPLY_SETTINGS */
-		else if (primaryNode)
-		{
-			ereport(ERROR,
-					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
-					 errmsg("cannot set replication quorum when current state "
-							"for primary " NODE_FORMAT
-							" is \"%s\"",
-							NODE_FORMAT_ARGS(primaryNode),
-							ReplicationStateGetName(primaryNode->reportedState))));
+			if ((node->nodeId == upstreamNode->nodeId &&
+				 upstreamNodeId != 0) ||
+				(node->nodeId != currentNode->nodeId &&
+				 upstreamNodeId == currentNode->nodeId))
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						 errmsg("can't use " NODE_FORMAT
+								" as the upstream node of " NODE_FORMAT,
+								NODE_FORMAT_ARGS(upstreamNode),
+								NODE_FORMAT_ARGS(currentNode)),
+						 errdetail("A node that streams from another standby "
+								   "node can't be used as an upstream node.")));
+			}
 		}
+	}
 
-		/* other case is that we failed to find a primary node, proceed */
+	SetNodeUpstream(currentNode->nodeId,
+					upstreamNode != NULL ? upstreamNode->nodeId : 0);
+
+	/* we need to see the result of that operation in the next query */
+	CommandCounterIncrement();
+
+	char message[BUFSIZE] = { 0 };
+
+	if (upstreamNode != NULL)
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting upstream node of " NODE_FORMAT " to " NODE_FORMAT,
+			NODE_FORMAT_ARGS(currentNode),
+			NODE_FORMAT_ARGS(upstreamNode));
+	}
+	else
+	{
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Setting upstream node of " NODE_FORMAT " to the primary node",
+			NODE_FORMAT_ARGS(currentNode));
 	}
 
+	NotifyStateChange(currentNode, message);
+
 	PG_RETURN_BOOL(true);
 }
 
@@ -2356,7 +4023,10 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 	 * priority, and with replicationQuorum (bool: true or false).
 	 *
 	 *   - syncStandbyNodesGroupList contains only nodes that participates in
-	 *     the replication quorum
+	 *     the replication quorum, the ones with the lowest replication
+	 *     latency first, as reported by the keeper of the primary node, and
+	 *     without the nodes that the monitor excluded for lagging behind,
+	 *     see pgautofailover.sync_quorum_exclude_lag_threshold
 	 *
 	 *   - then we build synchronous_standby_names with the following model:
 	 *
@@ -2366,7 +4036,9 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 	 */
 	{
 		List *syncStandbyNodesGroupList =
-			GroupListSyncStandbys(standbyNodesGroupList);
+			SortSyncStandbysByLatency(
+				RemoveSyncQuorumExcludedNodes(
+					GroupListSyncStandbys(standbyNodesGroupList)));
 
 		int count = list_length(syncStandbyNodesGroupList);
 
@@ -2417,3 +4089,128 @@ synchronous_standby_names(PG_FUNCTION_ARGS)
 		}
 	}
 }
+
+
+/*
+ * report_sync_rep_stall is called by the keeper of a primary node where
+ * commits have been waiting for synchronous replication for longer than the
+ * keeper is configured to accept. Without it, writes hang until the monitor
+ * finds that the standby nodes are unhealthy, which only happens after
+ * pgautofailover.node_considered_unhealthy_timeout.
+ *
+ * The keeper sends the ids of the standby nodes that are streaming and have
+ * replied recently. We then handle the other standby nodes of the quorum as
+ * if they were unhealthy, when their own reports confirm it, see
+ * SyncRepStallIsConfirmed(): they are assigned catchingup, where they are
+ * held for a while, see SyncRepStallIsHeld(), and the primary is assigned
+ * wait_primary when no secondary node in the quorum is left and
+ * number_sync_standbys is zero, as usual.
+ */
+Datum
+report_sync_rep_stall(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	ArrayType *standbyIdsArray = PG_GETARG_ARRAYTYPE_P(1);
+	int stallMs = PG_GETARG_INT32(2);
+
+	Datum *standbyIdDatums = NULL;
+	bool *standbyIdNulls = NULL;
+	int standbyIdCount = 0;
+
+	bool degraded = false;
+	ListCell *nodeCell = NULL;
+	TimestampTz now = GetCurrentTimestamp();
+
+	AutoFailoverNode *primaryNode = GetAutoFailoverNodeById(nodeId);
+
+	if (primaryNode == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with nodeid %lld",
+							   (long long) nodeId)));
+	}
+
+	LockFormation(primaryNode->formationId, ShareLock);
+	LockNodeGroup(primaryNode->formationId, primaryNode->groupId, ExclusiveLock);
+
+	/* only a primary node waits for its standby nodes */
+	if (!IsCurrentState(primaryNode, REPLICATION_STATE_PRIMARY))
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	deconstruct_array(standbyIdsArray, INT8OID, sizeof(int64),
+					  FLOAT8PASSBYVAL, 'd',
+					  &standbyIdDatums, &standbyIdNulls, &standbyIdCount);
+
+	List *otherNodesList = AutoFailoverOtherNodesList(primaryNode);
+
+	foreach(nodeCell, otherNodesList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+		bool isStreaming = false;
+
+		if (!otherNode->replicationQuorum ||
+			!IsCurrentState(otherNode, REPLICATION_STATE_SECONDARY))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < standbyIdCount; i++)
+		{
+			if (!standbyIdNulls[i] &&
+				DatumGetInt64(standbyIdDatums[i]) == otherNode->nodeId)
+			{
+				isStreaming = true;
+				break;
+			}
+		}
+
+		if (!isStreaming)
+		{
+			char message[BUFSIZE] = { 0 };
+			char reason[BUFSIZE] = { 0 };
+
+			if (!SyncRepStallIsConfirmed(otherNode, stallMs, now,
+										 reason, sizeof(reason)))
+			{
+				ereport(LOG,
+						(errmsg("not degrading " NODE_FORMAT
+								" after " NODE_FORMAT
+								" reported commits waiting for synchronous"
+								" replication for %d ms: its own reports"
+								" show it is streaming",
+								NODE_FORMAT_ARGS(otherNode),
+								NODE_FORMAT_ARGS(primaryNode),
+								stallMs)));
+				continue;
+			}
+
+			LogAndNotifyMessage(
+				message, BUFSIZE,
+				"Setting goal state of " NODE_FORMAT
+				" to catchingup after " NODE_FORMAT
+				" reported commits waiting for synchronous replication"
+				" for %d ms, and %s.",
+				NODE_FORMAT_ARGS(otherNode),
+				NODE_FORMAT_ARGS(primaryNode),
+				stallMs,
+				reason);
+
+			/* other node is behind, no longer eligible for promotion */
+			SetNodeGoalState(otherNode, REPLICATION_STATE_CATCHINGUP, message);
+			RecordSyncRepStall(otherNode->nodeId, now);
+
+			degraded = true;
+		}
+	}
+
+	if (degraded)
+	{
+		(void) ProceedGroupState(primaryNode);
+	}
+
+	PG_RETURN_BOOL(degraded);
+}
@@ -0,0 +1,1557 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_cache.c
+ *
+ * Implementation of a shared memory cache of the pgautofailover.node rows.
+ *
+ * Every keeper calls node_active() every second or so, and each call needs
+ * to read the calling node and all the nodes in its group. When nothing
+ * changed since the previous call, that's a lot of catalog scans for the
+ * exact same result. This cache allows the monitor to serve those reads from
+ * shared memory instead.
+ *
+ * The cache is maintained by an AFTER trigger on the node_base and
+ * node_heartbeat tables that registers each row change in a backend-local
+ * list of pending changes. When the transaction commits the pending changes
+ * are written to the cache, and when the transaction aborts they are
+ * forgotten. A generation number is incremented at each commit, and readers
+ * only add entries to the cache when no commit happened while they were
+ * reading the catalogs.
+ *
+ * The two tables are updated by different transactions without locking each
+ * other's rows, so a pending change only overwrites the part of the cached
+ * entry that the transaction wrote: the heartbeat columns or the base ones.
+ *
+ * The committed changes to the node_base rows are also applied to the fleet
+ * summary counters, see fleet_summary.c.
+ *
+ * A second generation number, the topology generation, is only incremented
+ * when a commit changed what the service discovery functions return: nodes
+ * being added or removed, their goal or reported state, or how to connect to
+ * them. Heartbeats don't change it. See discovery_cache.c.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "fleet_summary.h"
+#include "health_check.h"
+#include "metadata.h"
+#include "node_cache.h"
+#include "node_metadata.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+
+/*
+ * Nodes are cached per database, as the extension might be created in more
+ * than one database of the same Postgres instance.
+ */
+typedef struct NodeCacheKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} NodeCacheKey;
+
+typedef struct NodeCacheEntry
+{
+	NodeCacheKey key;
+
+	char formationId[NODE_CACHE_NAME_LEN];
+	int groupId;
+	char nodeName[NODE_CACHE_HOST_LEN];
+	char nodeHost[NODE_CACHE_HOST_LEN];
+	int nodePort;
+	uint64 sysIdentifier;
+	ReplicationState goalState;
+	ReplicationState reportedState;
+	TimestampTz reportTime;
+	bool pgIsRunning;
+	SyncState pgsrSyncState;
+	TimestampTz walReportTime;
+	NodeHealthState health;
+	TimestampTz healthCheckTime;
+	TimestampTz stateChangeTime;
+	int reportedTLI;
+	XLogRecPtr reportedLSN;
+	int candidatePriority;
+	bool replicationQuorum;
+	char nodeCluster[NODE_CACHE_NAME_LEN];
+} NodeCacheEntry;
+
+
+/*
+ * A group entry lists all the nodes (including dropped ones) that belong to a
+ * group. It only exists when all of the group nodes are found in the cache.
+ */
+typedef struct NodeCacheGroupKey
+{
+	Oid databaseId;
+	int groupId;
+	char formationId[NODE_CACHE_NAME_LEN];
+} NodeCacheGroupKey;
+
+typedef struct NodeCacheGroupEntry
+{
+	NodeCacheGroupKey key;
+
+	int nodeCount;
+	int64 nodeIds[NODE_CACHE_MAX_GROUP_SIZE];
+} NodeCacheGroupEntry;
+
+
+typedef struct NodeCacheControlData
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+
+	/* incremented each time a transaction that changed nodes commits */
+	uint64 generation;
+
+	/* incremented when the commit changed the service discovery answers */
+	uint64 topologyGeneration;
+} NodeCacheControlData;
+
+
+/*
+ * Changes made by the current transaction, registered by our trigger, and
+ * applied to the shared cache at commit time.
+ */
+typedef struct NodeCachePendingChange
+{
+	int64 nodeId;
+	AutoFailoverNode *oldNode;  /* committed row, NULL when inserted */
+	AutoFailoverNode *newNode;  /* current row, NULL when deleted */
+	bool baseChanged;           /* we wrote to the node_base row */
+	bool heartbeatChanged;      /* we wrote to the node_heartbeat row */
+} NodeCachePendingChange;
+
+
+/* GUC variable */
+int NodeCacheSize = 2048;
+
+static NodeCacheControlData *NodeCacheControl = NULL;
+static HTAB *NodeCacheHash = NULL;
+static HTAB *NodeCacheGroupHash = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* backend-local state, allocated in TopTransactionContext */
+static List *PendingChanges = NIL;
+static bool PendingChangesUnsafe = false;
+static bool PendingDatabaseReset = false;
+static bool PendingTopologyChange = false;
+
+
+static size_t NodeCacheShmemSize(void);
+static void NodeCacheShmemInit(void);
+static void NodeCacheXactCallback(XactEvent event, void *arg);
+static void NodeCacheSubXactCallback(SubXactEvent event,
+									 SubTransactionId mySubid,
+									 SubTransactionId parentSubid,
+									 void *arg);
+static void ResetPendingChanges(void);
+static void ApplyPendingChanges(void);
+static void ApplyPendingChange(NodeCachePendingChange *change);
+static void RecordPendingChange(AutoFailoverNode *oldNode,
+								AutoFailoverNode *newNode,
+								bool baseChanged, bool heartbeatChanged);
+static NodeCachePendingChange * FindPendingChange(int64 nodeId);
+static bool BaseTupleChangesTopology(TupleDesc tupleDescriptor,
+									 HeapTuple oldTuple,
+									 HeapTuple newTuple);
+static void InitNodeCacheKey(NodeCacheKey *key, int64 nodeId);
+static bool InitNodeCacheGroupKey(NodeCacheGroupKey *key,
+								  const char *formationId, int groupId);
+static bool WriteNodeCacheEntry(AutoFailoverNode *node);
+static void CopyEntryHeartbeat(NodeCacheEntry *entry, AutoFailoverNode *node);
+static void RemoveNodeCacheEntry(int64 nodeId);
+static void RemoveNodeCacheGroupEntry(const char *formationId, int groupId);
+static void GroupEntryAddNode(const char *formationId, int groupId,
+							  int64 nodeId);
+static void GroupEntryRemoveNode(const char *formationId, int groupId,
+								 int64 nodeId);
+static void RemoveDatabaseEntries(Oid databaseId);
+static AutoFailoverNode * NodeCacheEntryToNode(NodeCacheEntry *entry);
+static AutoFailoverNode * CopyAutoFailoverNode(AutoFailoverNode *node);
+static AutoFailoverNode * TupleToNodeIdentity(TupleDesc tupleDescriptor,
+											  HeapTuple heapTuple);
+static void RecordHeartbeatChange(TriggerData *triggerData);
+static int CompareNodeIds(const void *a, const void *b);
+
+
+PG_FUNCTION_INFO_V1(node_cache_trigger);
+
+
+/*
+ * InitializeNodeCache, called at server start, requests the shared memory
+ * needed for the node cache and registers the transaction callbacks that
+ * maintain it.
+ */
+void
+InitializeNodeCache(void)
+{
+	if (NodeCacheSize <= 0)
+	{
+		return;
+	}
+
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeCacheShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = NodeCacheShmemInit;
+
+	RegisterXactCallback(NodeCacheXactCallback, NULL);
+	RegisterSubXactCallback(NodeCacheSubXactCallback, NULL);
+}
+
+
+/*
+ * NodeCacheShmemSize computes how much shared memory is required.
+ */
+static size_t
+NodeCacheShmemSize(void)
+{
+	Size size = sizeof(NodeCacheControlData);
+
+	size = add_size(size, hash_estimate_size(NodeCacheSize,
+											 sizeof(NodeCacheEntry)));
+
+	size = add_size(size, hash_estimate_size(NodeCacheSize,
+											 sizeof(NodeCacheGroupEntry)));
+
+	return size;
+}
+
+
+/*
+ * NodeCacheShmemInit initializes the requested shared memory for the node
+ * cache.
+ */
+static void
+NodeCacheShmemInit(void)
+{
+	bool alreadyInitialized = false;
+	HASHCTL hashInfo;
+	HASHCTL groupHashInfo;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	NodeCacheControl =
+		(NodeCacheControlData *) ShmemInitStruct("pg_auto_failover Node Cache",
+												 sizeof(NodeCacheControlData),
+												 &alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		NodeCacheControl->trancheId = LWLockNewTrancheId();
+		NodeCacheControl->lockTrancheName = "pg_auto_failover Node Cache";
+		LWLockRegisterTranche(NodeCacheControl->trancheId,
+							  NodeCacheControl->lockTrancheName);
+
+		LWLockInitialize(&NodeCacheControl->lock,
+						 NodeCacheControl->trancheId);
+
+		NodeCacheControl->generation = 1;
+		NodeCacheControl->topologyGeneration = 1;
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(NodeCacheKey);
+	hashInfo.entrysize = sizeof(NodeCacheEntry);
+	hashInfo.hash = tag_hash;
+
+	NodeCacheHash = ShmemInitHash("pg_auto_failover Node Cache Hash",
+								  NodeCacheSize, NodeCacheSize,
+								  &hashInfo, HASH_ELEM | HASH_FUNCTION);
+
+	memset(&groupHashInfo, 0, sizeof(groupHashInfo));
+	groupHashInfo.keysize = sizeof(NodeCacheGroupKey);
+	groupHashInfo.entrysize = sizeof(NodeCacheGroupEntry);
+	groupHashInfo.hash = tag_hash;
+
+	NodeCacheGroupHash = ShmemInitHash("pg_auto_failover Node Group Cache Hash",
+									   NodeCacheSize, NodeCacheSize,
+									   &groupHashInfo, HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * NodeCacheEnabled returns true when the current backend may use the cache.
+ *
+ * The cache always contains the last committed version of the rows, which
+ * is fine with READ COMMITTED, but not when using a transaction snapshot.
+ * On a standby, the trigger never fires, so the cache can't be trusted.
+ */
+bool
+NodeCacheEnabled(void)
+{
+	return NodeCacheControl != NULL &&
+		   !PendingChangesUnsafe &&
+		   !PendingDatabaseReset &&
+		   !IsolationUsesXactSnapshot() &&
+		   !RecoveryInProgress();
+}
+
+
+/*
+ * NodeCacheGetGeneration returns the current cache generation number, to be
+ * used later when storing entries read from the catalogs.
+ */
+uint64
+NodeCacheGetGeneration(void)
+{
+	uint64 generation = 0;
+
+	if (!NodeCacheEnabled())
+	{
+		return 0;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+	generation = NodeCacheControl->generation;
+	LWLockRelease(&NodeCacheControl->lock);
+
+	return generation;
+}
+
+
+/*
+ * NodeCacheGetTopologyGeneration returns the current topology generation
+ * number, or zero when the answers of the service discovery functions can't
+ * be cached, such as when the current transaction changed some nodes.
+ */
+uint64
+NodeCacheGetTopologyGeneration(void)
+{
+	uint64 generation = 0;
+
+	if (!NodeCacheEnabled() || PendingChanges != NIL)
+	{
+		return 0;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+	generation = NodeCacheControl->topologyGeneration;
+	LWLockRelease(&NodeCacheControl->lock);
+
+	return generation;
+}
+
+
+/*
+ * NodeCacheLookupNode searches the cache for the given nodeId. When the
+ * function returns true, *node has been set to a freshly allocated copy of
+ * the node, or to NULL when the current transaction has deleted the node.
+ */
+bool
+NodeCacheLookupNode(int64 nodeId, AutoFailoverNode **node)
+{
+	NodeCacheKey key;
+	bool found = false;
+
+	if (!NodeCacheEnabled())
+	{
+		return false;
+	}
+
+	/* changes from our own transaction are visible to us only */
+	NodeCachePendingChange *change = FindPendingChange(nodeId);
+
+	if (change != NULL)
+	{
+		*node = CopyAutoFailoverNode(change->newNode);
+		return true;
+	}
+
+	InitNodeCacheKey(&key, nodeId);
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_FIND, NULL);
+
+	if (entry != NULL)
+	{
+		*node = NodeCacheEntryToNode(entry);
+		found = true;
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	return found;
+}
+
+
+/*
+ * NodeCacheLookupGroup searches the cache for all the nodes in the given
+ * group, including dropped nodes. When the function returns true, *nodeList
+ * has been set to the list of nodes ordered by nodeid.
+ */
+bool
+NodeCacheLookupGroup(char *formationId, int groupId, List **nodeList)
+{
+	NodeCacheGroupKey groupKey;
+	List *groupNodeList = NIL;
+	ListCell *changeCell = NULL;
+	bool found = true;
+
+	if (!NodeCacheEnabled() ||
+		!InitNodeCacheGroupKey(&groupKey, formationId, groupId))
+	{
+		return false;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_SHARED);
+
+	NodeCacheGroupEntry *groupEntry =
+		(NodeCacheGroupEntry *) hash_search(NodeCacheGroupHash, &groupKey,
+											HASH_FIND, NULL);
+
+	if (groupEntry == NULL)
+	{
+		found = false;
+	}
+	else
+	{
+		for (int index = 0; index < groupEntry->nodeCount; index++)
+		{
+			NodeCacheKey key;
+			int64 nodeId = groupEntry->nodeIds[index];
+
+			/* our own changes are added later */
+			if (FindPendingChange(nodeId) != NULL)
+			{
+				continue;
+			}
+
+			InitNodeCacheKey(&key, nodeId);
+
+			NodeCacheEntry *entry =
+				(NodeCacheEntry *) hash_search(NodeCacheHash, &key,
+											   HASH_FIND, NULL);
+
+			if (entry == NULL)
+			{
+				/* shouldn't happen, but then we don't have the whole group */
+				found = false;
+				break;
+			}
+
+			groupNodeList = lappend(groupNodeList, NodeCacheEntryToNode(entry));
+		}
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	if (!found)
+	{
+		return false;
+	}
+
+	/* now add the current version of the rows changed in our transaction */
+	foreach(changeCell, PendingChanges)
+	{
+		NodeCachePendingChange *change =
+			(NodeCachePendingChange *) lfirst(changeCell);
+
+		if (change->newNode != NULL &&
+			change->newNode->groupId == groupId &&
+			strcmp(change->newNode->formationId, formationId) == 0)
+		{
+			groupNodeList =
+				lappend(groupNodeList, CopyAutoFailoverNode(change->newNode));
+		}
+	}
+
+	/* sort the list by nodeid, as in the catalog queries */
+	int nodeCount = list_length(groupNodeList);
+
+	if (nodeCount > 1)
+	{
+		ListCell *nodeCell = NULL;
+		int index = 0;
+
+		AutoFailoverNode **nodeArray =
+			(AutoFailoverNode **) palloc0(nodeCount * sizeof(AutoFailoverNode *));
+
+		foreach(nodeCell, groupNodeList)
+		{
+			nodeArray[index++] = (AutoFailoverNode *) lfirst(nodeCell);
+		}
+
+		qsort(nodeArray, nodeCount, sizeof(AutoFailoverNode *), CompareNodeIds);
+
+		list_free(groupNodeList);
+		groupNodeList = NIL;
+
+		for (index = 0; index < nodeCount; index++)
+		{
+			groupNodeList = lappend(groupNodeList, nodeArray[index]);
+		}
+
+		pfree(nodeArray);
+	}
+
+	*nodeList = groupNodeList;
+
+	return true;
+}
+
+
+/*
+ * NodeCacheStoreNode adds a node that has just been read from the catalogs
+ * to the cache, unless a transaction committed node changes since the given
+ * generation was obtained.
+ */
+void
+NodeCacheStoreNode(AutoFailoverNode *node, uint64 generation)
+{
+	/* the catalogs show our own uncommitted changes, don't cache those */
+	if (node == NULL || !NodeCacheEnabled() || PendingChanges != NIL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	if (NodeCacheControl->generation == generation)
+	{
+		(void) WriteNodeCacheEntry(node);
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+}
+
+
+/*
+ * NodeCacheStoreGroup adds all the nodes of a group that have just been read
+ * from the catalogs to the cache, and registers the group membership.
+ */
+void
+NodeCacheStoreGroup(char *formationId, int groupId,
+					List *nodeList, uint64 generation)
+{
+	NodeCacheGroupKey groupKey;
+	ListCell *nodeCell = NULL;
+
+	if (!NodeCacheEnabled() || PendingChanges != NIL ||
+		list_length(nodeList) > NODE_CACHE_MAX_GROUP_SIZE ||
+		!InitNodeCacheGroupKey(&groupKey, formationId, groupId))
+	{
+		return;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	if (NodeCacheControl->generation == generation)
+	{
+		bool complete = true;
+
+		foreach(nodeCell, nodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (!WriteNodeCacheEntry(node))
+			{
+				complete = false;
+				break;
+			}
+		}
+
+		if (complete)
+		{
+			NodeCacheGroupEntry *groupEntry =
+				(NodeCacheGroupEntry *) hash_search(NodeCacheGroupHash,
+													&groupKey,
+													HASH_ENTER_NULL, NULL);
+
+			if (groupEntry != NULL)
+			{
+				groupEntry->nodeCount = 0;
+
+				foreach(nodeCell, nodeList)
+				{
+					AutoFailoverNode *node =
+						(AutoFailoverNode *) lfirst(nodeCell);
+
+					GroupEntryAddNode(formationId, groupId, node->nodeId);
+				}
+			}
+		}
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+}
+
+
+/*
+ * NodeCacheResetDatabase removes all the cache entries that belong to the
+ * given database, right away.
+ */
+void
+NodeCacheResetDatabase(Oid databaseId)
+{
+	if (NodeCacheControl == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	NodeCacheControl->generation++;
+	RemoveDatabaseEntries(databaseId);
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	FleetSummaryInvalidateDatabase(databaseId);
+}
+
+
+/*
+ * NodeCacheInvalidateAtCommit removes all the cache entries of the current
+ * database now, and again when the current transaction ends. That's needed
+ * when the pgautofailover.node table is changed in ways that our trigger
+ * can't follow, such as ALTER EXTENSION UPDATE or TRUNCATE.
+ */
+void
+NodeCacheInvalidateAtCommit(void)
+{
+	if (NodeCacheControl == NULL)
+	{
+		return;
+	}
+
+	NodeCacheResetDatabase(MyDatabaseId);
+	PendingDatabaseReset = true;
+}
+
+
+/*
+ * node_cache_trigger is an AFTER trigger on the node_base and node_heartbeat
+ * tables that registers row changes, to be applied to the cache at commit
+ * time. It also lets the health check workers know when they need to reload
+ * their list of nodes.
+ *
+ * The cache holds rows of the pgautofailover.node view, so we read the new
+ * version of the row from the view rather than from the trigger tuple. When
+ * installed on node_heartbeat, the trigger is given the 'heartbeat' argument.
+ */
+Datum
+node_cache_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+	AutoFailoverNode *oldNode = NULL;
+	AutoFailoverNode *newIdentity = NULL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("node_cache_trigger: not called by trigger manager")));
+	}
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(triggerData->tg_event))
+	{
+		HealthCheckNodeListChanged();
+		NodeCacheInvalidateAtCommit();
+		return PointerGetDatum(NULL);
+	}
+
+	if (triggerData->tg_trigger->tgnargs > 0 &&
+		strcmp(triggerData->tg_trigger->tgargs[0], "heartbeat") == 0)
+	{
+		RecordHeartbeatChange(triggerData);
+		return PointerGetDatum(NULL);
+	}
+
+	TupleDesc tupleDescriptor = RelationGetDescr(triggerData->tg_relation);
+	MemoryContext oldContext =
+		NodeCacheControl != NULL
+		? MemoryContextSwitchTo(TopTransactionContext)
+		: CurrentMemoryContext;
+
+	if (TRIGGER_FIRED_BY_INSERT(triggerData->tg_event))
+	{
+		newIdentity = TupleToNodeIdentity(tupleDescriptor,
+										  triggerData->tg_trigtuple);
+	}
+	else if (TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event))
+	{
+		oldNode = TupleToNodeIdentity(tupleDescriptor,
+									  triggerData->tg_trigtuple);
+		newIdentity = TupleToNodeIdentity(tupleDescriptor,
+										  triggerData->tg_newtuple);
+	}
+	else if (TRIGGER_FIRED_BY_DELETE(triggerData->tg_event))
+	{
+		oldNode = TupleToNodeIdentity(tupleDescriptor,
+									  triggerData->tg_trigtuple);
+	}
+
+	/* the health check workers only need to know about some changes */
+	if (oldNode == NULL || newIdentity == NULL ||
+		oldNode->nodeId != newIdentity->nodeId ||
+		oldNode->nodePort != newIdentity->nodePort ||
+		strcmp(oldNode->nodeHost, newIdentity->nodeHost) != 0 ||
+		strcmp(oldNode->nodeName, newIdentity->nodeName) != 0)
+	{
+		HealthCheckNodeListChanged();
+	}
+
+	if (NodeCacheControl != NULL)
+	{
+		/* a node without a heartbeat row is not in the view */
+		AutoFailoverNode *newNode =
+			newIdentity != NULL
+			? ReadAutoFailoverNodeById(newIdentity->nodeId)
+			: NULL;
+
+		if (oldNode != NULL || newNode != NULL)
+		{
+			RecordPendingChange(oldNode, newNode, true, false);
+		}
+
+		if (!TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event) ||
+			BaseTupleChangesTopology(tupleDescriptor,
+									 triggerData->tg_trigtuple,
+									 triggerData->tg_newtuple))
+		{
+			PendingTopologyChange = true;
+		}
+	}
+
+	MemoryContextSwitchTo(oldContext);
+
+	return PointerGetDatum(NULL);
+}
+
+
+/*
+ * RecordHeartbeatChange registers a change to a node_heartbeat row. The
+ * heartbeat columns are not used by the health check workers, and a row
+ * that has been deleted is taken care of by the node_base trigger.
+ */
+static void
+RecordHeartbeatChange(TriggerData *triggerData)
+{
+	TupleDesc tupleDescriptor = RelationGetDescr(triggerData->tg_relation);
+	int nodeIdAttNum = SPI_fnumber(tupleDescriptor, "nodeid");
+	bool isNull = false;
+
+	if (NodeCacheControl == NULL ||
+		TRIGGER_FIRED_BY_DELETE(triggerData->tg_event))
+	{
+		return;
+	}
+
+	int64 nodeId =
+		DatumGetInt64(heap_getattr(triggerData->tg_trigtuple, nodeIdAttNum,
+								   tupleDescriptor, &isNull));
+
+	if (TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event))
+	{
+		int64 newNodeId =
+			DatumGetInt64(heap_getattr(triggerData->tg_newtuple, nodeIdAttNum,
+									   tupleDescriptor, &isNull));
+
+		/* nobody should do that, don't try to be smart about it */
+		if (newNodeId != nodeId)
+		{
+			NodeCacheInvalidateAtCommit();
+			return;
+		}
+	}
+
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+	AutoFailoverNode *newNode = ReadAutoFailoverNodeById(nodeId);
+
+	if (newNode != NULL)
+	{
+		AutoFailoverNode *oldNode =
+			TRIGGER_FIRED_BY_INSERT(triggerData->tg_event)
+			? NULL
+			: CopyAutoFailoverNode(newNode);
+
+		RecordPendingChange(oldNode, newNode, false, true);
+	}
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * NodeCacheXactCallback applies our pending changes to the shared cache at
+ * commit time, and forgets about them at abort time.
+ */
+static void
+NodeCacheXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		{
+			ApplyPendingChanges();
+			ResetPendingChanges();
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		{
+			if (PendingDatabaseReset)
+			{
+				NodeCacheResetDatabase(MyDatabaseId);
+			}
+
+			ResetPendingChanges();
+			break;
+		}
+
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			/* we would not know when the prepared transaction commits */
+			if (PendingChanges != NIL || PendingDatabaseReset)
+			{
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has "
+								"modified " AUTO_FAILOVER_NODE_TABLE)));
+			}
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * NodeCacheSubXactCallback makes sure that we don't apply changes made in an
+ * aborted subtransaction to the cache. We don't track which changes belong
+ * to which subtransaction, rather we invalidate every node we touched.
+ */
+static void
+NodeCacheSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+						 SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB && PendingChanges != NIL)
+	{
+		PendingChangesUnsafe = true;
+	}
+}
+
+
+/*
+ * ResetPendingChanges forgets about the current transaction changes. The
+ * memory is released together with the TopTransactionContext.
+ */
+static void
+ResetPendingChanges(void)
+{
+	PendingChanges = NIL;
+	PendingChangesUnsafe = false;
+	PendingDatabaseReset = false;
+	PendingTopologyChange = false;
+}
+
+
+/*
+ * ApplyPendingChanges writes the current transaction changes to the shared
+ * cache. This is called after commit, so we must not ERROR here.
+ */
+static void
+ApplyPendingChanges(void)
+{
+	ListCell *changeCell = NULL;
+
+	if (NodeCacheControl == NULL ||
+		(PendingChanges == NIL && !PendingDatabaseReset))
+	{
+		return;
+	}
+
+	bool topologyChanged =
+		PendingDatabaseReset ||
+		PendingChangesUnsafe ||
+		PendingTopologyChange;
+
+	LWLockAcquire(&NodeCacheControl->lock, LW_EXCLUSIVE);
+
+	NodeCacheControl->generation++;
+
+	if (topologyChanged)
+	{
+		NodeCacheControl->topologyGeneration++;
+	}
+
+	if (PendingDatabaseReset)
+	{
+		RemoveDatabaseEntries(MyDatabaseId);
+	}
+	else
+	{
+		foreach(changeCell, PendingChanges)
+		{
+			NodeCachePendingChange *change =
+				(NodeCachePendingChange *) lfirst(changeCell);
+
+			if (PendingChangesUnsafe)
+			{
+				AutoFailoverNode *node =
+					change->newNode ? change->newNode : change->oldNode;
+
+				RemoveNodeCacheEntry(change->nodeId);
+				RemoveNodeCacheGroupEntry(node->formationId, node->groupId);
+
+				if (change->oldNode != NULL)
+				{
+					RemoveNodeCacheGroupEntry(change->oldNode->formationId,
+											  change->oldNode->groupId);
+				}
+			}
+			else
+			{
+				ApplyPendingChange(change);
+			}
+		}
+	}
+
+	LWLockRelease(&NodeCacheControl->lock);
+
+	if (PendingDatabaseReset || PendingChangesUnsafe)
+	{
+		FleetSummaryInvalidateDatabase(MyDatabaseId);
+		return;
+	}
+
+	/*
+	 * Only the node_base part of the rows is used for the summary, and a
+	 * change to the node_heartbeat row only might have been read before
+	 * another transaction committed a change to the node_base row. A new
+	 * node only shows up in the view with its node_heartbeat row though.
+	 */
+	foreach(changeCell, PendingChanges)
+	{
+		NodeCachePendingChange *change =
+			(NodeCachePendingChange *) lfirst(changeCell);
+
+		if (change->baseChanged || change->oldNode == NULL)
+		{
+			FleetSummaryApplyNodeChange(change->nodeId, change->newNode);
+		}
+	}
+}
+
+
+/*
+ * ApplyPendingChange writes a single change to the cache, maintaining the
+ * group membership entries.
+ */
+static void
+ApplyPendingChange(NodeCachePendingChange *change)
+{
+	/*
+	 * When we only wrote one of the two tables, the other part of the row
+	 * might have been changed and committed by another transaction since our
+	 * trigger read it: only write the part we own to an existing entry.
+	 */
+	if (change->oldNode != NULL && change->newNode != NULL &&
+		!(change->baseChanged && change->heartbeatChanged))
+	{
+		NodeCacheKey key;
+
+		InitNodeCacheKey(&key, change->nodeId);
+
+		NodeCacheEntry *entry =
+			(NodeCacheEntry *) hash_search(NodeCacheHash, &key,
+										   HASH_FIND, NULL);
+
+		if (entry == NULL)
+		{
+			/* let readers add the node to the cache again */
+			RemoveNodeCacheGroupEntry(change->oldNode->formationId,
+									  change->oldNode->groupId);
+			RemoveNodeCacheGroupEntry(change->newNode->formationId,
+									  change->newNode->groupId);
+			return;
+		}
+
+		if (!change->baseChanged)
+		{
+			entry->reportTime = change->newNode->reportTime;
+			entry->pgIsRunning = change->newNode->pgIsRunning;
+			entry->walReportTime = change->newNode->walReportTime;
+			entry->reportedTLI = change->newNode->reportedTLI;
+			entry->reportedLSN = change->newNode->reportedLSN;
+			return;
+		}
+
+		CopyEntryHeartbeat(entry, change->newNode);
+	}
+
+	if (change->oldNode != NULL)
+	{
+		GroupEntryRemoveNode(change->oldNode->formationId,
+							 change->oldNode->groupId,
+							 change->nodeId);
+	}
+
+	if (change->newNode == NULL)
+	{
+		RemoveNodeCacheEntry(change->nodeId);
+		return;
+	}
+
+	if (WriteNodeCacheEntry(change->newNode))
+	{
+		GroupEntryAddNode(change->newNode->formationId,
+						  change->newNode->groupId,
+						  change->nodeId);
+	}
+}
+
+
+/*
+ * RecordPendingChange registers a row change from our trigger. We keep the
+ * first old version of the row, which is the committed one, and the last new
+ * version of the row.
+ */
+static void
+RecordPendingChange(AutoFailoverNode *oldNode, AutoFailoverNode *newNode,
+					bool baseChanged, bool heartbeatChanged)
+{
+	if (oldNode != NULL && newNode != NULL && oldNode->nodeId != newNode->nodeId)
+	{
+		RecordPendingChange(oldNode, NULL, baseChanged, heartbeatChanged);
+		RecordPendingChange(NULL, newNode, baseChanged, heartbeatChanged);
+		return;
+	}
+
+	int64 nodeId = newNode != NULL ? newNode->nodeId : oldNode->nodeId;
+	NodeCachePendingChange *change = FindPendingChange(nodeId);
+
+	if (change == NULL)
+	{
+		change = (NodeCachePendingChange *)
+				 palloc0(sizeof(NodeCachePendingChange));
+
+		change->nodeId = nodeId;
+		change->oldNode = oldNode;
+
+		PendingChanges = lappend(PendingChanges, change);
+	}
+
+	change->newNode = newNode;
+	change->baseChanged |= baseChanged;
+	change->heartbeatChanged |= heartbeatChanged;
+}
+
+
+/*
+ * FindPendingChange returns the pending change for the given nodeId, if any.
+ */
+static NodeCachePendingChange *
+FindPendingChange(int64 nodeId)
+{
+	ListCell *changeCell = NULL;
+
+	foreach(changeCell, PendingChanges)
+	{
+		NodeCachePendingChange *change =
+			(NodeCachePendingChange *) lfirst(changeCell);
+
+		if (change->nodeId == nodeId)
+		{
+			return change;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * InitNodeCacheKey prepares a hash key for the given nodeId. The hash
+ * function reads the whole structure, including padding bytes.
+ */
+static void
+InitNodeCacheKey(NodeCacheKey *key, int64 nodeId)
+{
+	memset(key, 0, sizeof(NodeCacheKey));
+
+	key->databaseId = MyDatabaseId;
+	key->nodeId = nodeId;
+}
+
+
+/*
+ * InitNodeCacheGroupKey prepares a hash key for the given group, and returns
+ * false when the formationId is too long to be cached.
+ */
+static bool
+InitNodeCacheGroupKey(NodeCacheGroupKey *key, const char *formationId,
+					  int groupId)
+{
+	if (strlen(formationId) >= NODE_CACHE_NAME_LEN)
+	{
+		return false;
+	}
+
+	memset(key, 0, sizeof(NodeCacheGroupKey));
+
+	key->databaseId = MyDatabaseId;
+	key->groupId = groupId;
+	strlcpy(key->formationId, formationId, NODE_CACHE_NAME_LEN);
+
+	return true;
+}
+
+
+/*
+ * WriteNodeCacheEntry copies the given node to its cache entry. When the
+ * node doesn't fit in the cache, its entry and group entry are removed, and
+ * false is returned. Caller must hold the lock in exclusive mode.
+ */
+static bool
+WriteNodeCacheEntry(AutoFailoverNode *node)
+{
+	NodeCacheKey key;
+
+	InitNodeCacheKey(&key, node->nodeId);
+
+	if (strlen(node->formationId) >= NODE_CACHE_NAME_LEN ||
+		strlen(node->nodeName) >= NODE_CACHE_HOST_LEN ||
+		strlen(node->nodeHost) >= NODE_CACHE_HOST_LEN ||
+		strlen(node->nodeCluster) >= NODE_CACHE_NAME_LEN)
+	{
+		RemoveNodeCacheEntry(node->nodeId);
+		return false;
+	}
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, &key,
+									   HASH_ENTER_NULL, NULL);
+
+	if (entry == NULL)
+	{
+		/* the cache is full: don't pretend we have the whole group */
+		RemoveNodeCacheGroupEntry(node->formationId, node->groupId);
+		return false;
+	}
+
+	strlcpy(entry->formationId, node->formationId, NODE_CACHE_NAME_LEN);
+	entry->groupId = node->groupId;
+	strlcpy(entry->nodeName, node->nodeName, NODE_CACHE_HOST_LEN);
+	strlcpy(entry->nodeHost, node->nodeHost, NODE_CACHE_HOST_LEN);
+	entry->nodePort = node->nodePort;
+	entry->sysIdentifier = node->sysIdentifier;
+	entry->goalState = node->goalState;
+	entry->reportedState = node->reportedState;
+	entry->reportTime = node->reportTime;
+	entry->pgIsRunning = node->pgIsRunning;
+	entry->pgsrSyncState = node->pgsrSyncState;
+	entry->walReportTime = node->walReportTime;
+	entry->health = node->health;
+	entry->healthCheckTime = node->healthCheckTime;
+	entry->stateChangeTime = node->stateChangeTime;
+	entry->reportedTLI = node->reportedTLI;
+	entry->reportedLSN = node->reportedLSN;
+	entry->candidatePriority = node->candidatePriority;
+	entry->replicationQuorum = node->replicationQuorum;
+	strlcpy(entry->nodeCluster, node->nodeCluster, NODE_CACHE_NAME_LEN);
+
+	return true;
+}
+
+
+/*
+ * CopyEntryHeartbeat copies the heartbeat columns of a cache entry to the
+ * given node.
+ */
+static void
+CopyEntryHeartbeat(NodeCacheEntry *entry, AutoFailoverNode *node)
+{
+	node->reportTime = entry->reportTime;
+	node->pgIsRunning = entry->pgIsRunning;
+	node->walReportTime = entry->walReportTime;
+	node->reportedTLI = entry->reportedTLI;
+	node->reportedLSN = entry->reportedLSN;
+}
+
+
+/*
+ * RemoveNodeCacheEntry removes a node from the cache, together with the
+ * group it belongs to, which is not complete anymore. Caller must hold the
+ * lock in exclusive mode.
+ */
+static void
+RemoveNodeCacheEntry(int64 nodeId)
+{
+	NodeCacheKey key;
+
+	InitNodeCacheKey(&key, nodeId);
+
+	NodeCacheEntry *entry =
+		(NodeCacheEntry *) hash_search(NodeCacheHash, &key, HASH_FIND, NULL);
+
+	if (entry != NULL)
+	{
+		GroupEntryRemoveNode(entry->formationId, entry->groupId, nodeId);
+		(void) hash_search(NodeCacheHash, &key, HASH_REMOVE, NULL);
+	}
+}
+
+
+/*
+ * RemoveNodeCacheGroupEntry removes a group membership entry from the cache.
+ * Caller must hold the lock in exclusive mode.
+ */
+static void
+RemoveNodeCacheGroupEntry(const char *formationId, int groupId)
+{
+	NodeCacheGroupKey groupKey;
+
+	if (InitNodeCacheGroupKey(&groupKey, formationId, groupId))
+	{
+		(void) hash_search(NodeCacheGroupHash, &groupKey, HASH_REMOVE, NULL);
+	}
+}
+
+
+/*
+ * GroupEntryAddNode adds a nodeId to a cached group entry, keeping the
+ * nodeIds array sorted. When there is no room left in the entry, the group
+ * is removed from the cache instead. Caller must hold the lock in exclusive
+ * mode.
+ */
+static void
+GroupEntryAddNode(const char *formationId, int groupId, int64 nodeId)
+{
+	NodeCacheGroupKey groupKey;
+	int position = 0;
+
+	if (!InitNodeCacheGroupKey(&groupKey, formationId, groupId))
+	{
+		return;
+	}
+
+	NodeCacheGroupEntry *groupEntry =
+		(NodeCacheGroupEntry *) hash_search(NodeCacheGroupHash, &groupKey,
+											HASH_FIND, NULL);
+
+	if (groupEntry == NULL)
+	{
+		return;
+	}
+
+	while (position < groupEntry->nodeCount &&
+		   groupEntry->nodeIds[position] < nodeId)
+	{
+		++position;
+	}
+
+	if (position < groupEntry->nodeCount &&
+		groupEntry->nodeIds[position] == nodeId)
+	{
+		/* already there */
+		return;
+	}
+
+	if (groupEntry->nodeCount >= NODE_CACHE_MAX_GROUP_SIZE)
+	{
+		(void) hash_search(NodeCacheGroupHash, &groupKey, HASH_REMOVE, NULL);
+		return;
+	}
+
+	memmove(&groupEntry->nodeIds[position + 1],
+			&groupEntry->nodeIds[position],
+			(groupEntry->nodeCount - position) * sizeof(int64));
+
+	groupEntry->nodeIds[position] = nodeId;
+	groupEntry->nodeCount++;
+}
+
+
+/*
+ * GroupEntryRemoveNode removes a nodeId from a cached group entry. Caller
+ * must hold the lock in exclusive mode.
+ */
+static void
+GroupEntryRemoveNode(const char *formationId, int groupId, int64 nodeId)
+{
+	NodeCacheGroupKey groupKey;
+
+	if (!InitNodeCacheGroupKey(&groupKey, formationId, groupId))
+	{
+		return;
+	}
+
+	NodeCacheGroupEntry *groupEntry =
+		(NodeCacheGroupEntry *) hash_search(NodeCacheGroupHash, &groupKey,
+											HASH_FIND, NULL);
+
+	if (groupEntry == NULL)
+	{
+		return;
+	}
+
+	for (int position = 0; position < groupEntry->nodeCount; position++)
+	{
+		if (groupEntry->nodeIds[position] == nodeId)
+		{
+			memmove(&groupEntry->nodeIds[position],
+					&groupEntry->nodeIds[position + 1],
+					(groupEntry->nodeCount - position - 1) * sizeof(int64));
+
+			groupEntry->nodeCount--;
+			break;
+		}
+	}
+}
+
+
+/*
+ * RemoveDatabaseEntries removes all the entries that belong to the given
+ * database. Caller must hold the lock in exclusive mode.
+ */
+static void
+RemoveDatabaseEntries(Oid databaseId)
+{
+	HASH_SEQ_STATUS status;
+	NodeCacheEntry *entry = NULL;
+	NodeCacheGroupEntry *groupEntry = NULL;
+
+	hash_seq_init(&status, NodeCacheHash);
+
+	while ((entry = (NodeCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.databaseId == databaseId)
+		{
+			(void) hash_search(NodeCacheHash, &entry->key, HASH_REMOVE, NULL);
+		}
+	}
+
+	hash_seq_init(&status, NodeCacheGroupHash);
+
+	while ((groupEntry =
+				(NodeCacheGroupEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (groupEntry->key.databaseId == databaseId)
+		{
+			(void) hash_search(NodeCacheGroupHash, &groupEntry->key,
+							   HASH_REMOVE, NULL);
+		}
+	}
+}
+
+
+/*
+ * NodeCacheEntryToNode builds an AutoFailoverNode in the current memory
+ * context from a cache entry.
+ */
+static AutoFailoverNode *
+NodeCacheEntryToNode(NodeCacheEntry *entry)
+{
+	AutoFailoverNode *node =
+		(AutoFailoverNode *) palloc0(sizeof(AutoFailoverNode));
+
+	node->formationId = pstrdup(entry->formationId);
+	node->nodeId = entry->key.nodeId;
+	node->groupId = entry->groupId;
+	node->nodeName = pstrdup(entry->nodeName);
+	node->nodeHost = pstrdup(entry->nodeHost);
+	node->nodePort = entry->nodePort;
+	node->sysIdentifier = entry->sysIdentifier;
+	node->goalState = entry->goalState;
+	node->reportedState = entry->reportedState;
+	node->reportTime = entry->reportTime;
+	node->pgIsRunning = entry->pgIsRunning;
+	node->pgsrSyncState = entry->pgsrSyncState;
+	node->walReportTime = entry->walReportTime;
+	node->health = entry->health;
+	node->healthCheckTime = entry->healthCheckTime;
+	node->stateChangeTime = entry->stateChangeTime;
+	node->reportedTLI = entry->reportedTLI;
+	node->reportedLSN = entry->reportedLSN;
+	node->candidatePriority = entry->candidatePriority;
+	node->replicationQuorum = entry->replicationQuorum;
+	node->nodeCluster = pstrdup(entry->nodeCluster);
+
+	return node;
+}
+
+
+/*
+ * CopyAutoFailoverNode returns a copy of the given node allocated in the
+ * current memory context.
+ */
+static AutoFailoverNode *
+CopyAutoFailoverNode(AutoFailoverNode *node)
+{
+	if (node == NULL)
+	{
+		return NULL;
+	}
+
+	AutoFailoverNode *copy =
+		(AutoFailoverNode *) palloc0(sizeof(AutoFailoverNode));
+
+	*copy = *node;
+
+	copy->formationId = pstrdup(node->formationId);
+	copy->nodeName = pstrdup(node->nodeName);
+	copy->nodeHost = pstrdup(node->nodeHost);
+	copy->nodeCluster = pstrdup(node->nodeCluster);
+
+	return copy;
+}
+
+
+/*
+ * TupleToNodeIdentity builds an AutoFailoverNode from a node_base row, with
+ * only the columns that identify the node and its group filled in, which is
+ * all we need from the previous version of a row.
+ */
+static AutoFailoverNode *
+TupleToNodeIdentity(TupleDesc tupleDescriptor, HeapTuple heapTuple)
+{
+	bool isNull = false;
+
+	Datum formationId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "formationid"),
+					 tupleDescriptor, &isNull);
+	Datum nodeId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "nodeid"),
+					 tupleDescriptor, &isNull);
+	Datum groupId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "groupid"),
+					 tupleDescriptor, &isNull);
+	Datum nodeName =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "nodename"),
+					 tupleDescriptor, &isNull);
+	Datum nodeHost =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "nodehost"),
+					 tupleDescriptor, &isNull);
+	Datum nodePort =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "nodeport"),
+					 tupleDescriptor, &isNull);
+
+	AutoFailoverNode *node =
+		(AutoFailoverNode *) palloc0(sizeof(AutoFailoverNode));
+
+	node->formationId = TextDatumGetCString(formationId);
+	node->nodeId = DatumGetInt64(nodeId);
+	node->groupId = DatumGetInt32(groupId);
+	node->nodeName = TextDatumGetCString(nodeName);
+	node->nodeHost = TextDatumGetCString(nodeHost);
+	node->nodePort = DatumGetInt32(nodePort);
+	node->nodeCluster = pstrdup("");
+
+	return node;
+}
+
+
+/*
+ * BaseTupleChangesTopology returns true when an update of a node_base row
+ * might change the answers of formation_uri() or get_primary(), such as the
+ * goal state changes made by SetNodeGoalState(). The health checks and the
+ * replication state reports also update node_base, and don't count.
+ */
+static bool
+BaseTupleChangesTopology(TupleDesc tupleDescriptor,
+						 HeapTuple oldTuple, HeapTuple newTuple)
+{
+	const char *columns[] = {
+		"formationid",
+		"nodeid",
+		"groupid",
+		"nodename",
+		"nodehost",
+		"nodeport",
+		"goalstate",
+		"reportedstate",
+		"nodecluster",
+		NULL
+	};
+
+	for (int i = 0; columns[i] != NULL; i++)
+	{
+		int attNum = SPI_fnumber(tupleDescriptor, columns[i]);
+		Form_pg_attribute attribute = TupleDescAttr(tupleDescriptor, attNum - 1);
+		bool oldIsNull = false;
+		bool newIsNull = false;
+
+		Datum oldValue =
+			heap_getattr(oldTuple, attNum, tupleDescriptor, &oldIsNull);
+		Datum newValue =
+			heap_getattr(newTuple, attNum, tupleDescriptor, &newIsNull);
+
+		if (oldIsNull != newIsNull ||
+			(!oldIsNull &&
+			 !datumIsEqual(oldValue, newValue,
+						   attribute->attbyval, attribute->attlen)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * CompareNodeIds is a qsort comparator for arrays of AutoFailoverNode
+ * pointers, by nodeId.
+ */
+static int
+CompareNodeIds(const void *a, const void *b)
+{
+	AutoFailoverNode *node1 = *(AutoFailoverNode **) a;
+	AutoFailoverNode *node2 = *(AutoFailoverNode **) b;
+
+	if (node1->nodeId < node2->nodeId)
+	{
+		return -1;
+	}
+
+	if (node1->nodeId > node2->nodeId)
+	{
+		return 1;
+	}
+
+	return 0;
+}
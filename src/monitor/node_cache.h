@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_cache.h
+ *
+ * Declarations for the shared memory cache of pgautofailover.node rows.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+
+#include "node_metadata.h"
+
+
+/*
+ * The cache entries are stored in shared memory, so strings have to fit in
+ * fixed-size buffers. Nodes with longer names are simply not cached.
+ */
+#define NODE_CACHE_NAME_LEN NAMEDATALEN
+#define NODE_CACHE_HOST_LEN 256
+#define NODE_CACHE_MAX_GROUP_SIZE 32
+
+
+/* GUC variable: how many nodes we can keep in the cache, 0 disables it */
+extern int NodeCacheSize;
+
+
+extern void InitializeNodeCache(void);
+extern bool NodeCacheEnabled(void);
+extern uint64 NodeCacheGetGeneration(void);
+extern uint64 NodeCacheGetTopologyGeneration(void);
+
+extern bool NodeCacheLookupNode(int64 nodeId, AutoFailoverNode **node);
+extern bool NodeCacheLookupGroup(char *formationId, int groupId,
+								 List **nodeList);
+
+extern void NodeCacheStoreNode(AutoFailoverNode *node, uint64 generation);
+extern void NodeCacheStoreGroup(char *formationId, int groupId,
+								List *nodeList, uint64 generation);
+
+extern void NodeCacheResetDatabase(Oid databaseId);
+extern void NodeCacheInvalidateAtCommit(void);
@@ -0,0 +1,141 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_history.c
+ *
+ * Implementation of the fixed-size history of the LSN, lag and health of
+ * each node, kept in the pgautofailover.node_history table.
+ *
+ * The node table only has the last report of each node. Here node_active()
+ * also records a sample every pgautofailover.node_history_resolution, in a
+ * ring of pgautofailover.node_history_size rows per node: the sample time
+ * selects the slot, and the row of the slot is overwritten in place. The
+ * table then never grows, and updating a row of its own is a HOT update.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "nodes/pg_list.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+#include "metadata.h"
+#include "node_history.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+
+
+/* GUC variables */
+int NodeHistoryResolutionMs = 10 * 1000;
+int NodeHistorySize = 360;
+
+/*
+ * Keeper sessions report for a single node, so remembering the last sample
+ * of this backend is enough to skip most of the node_active() calls.
+ */
+static int64 LastSampleNodeId = -1;
+static int64 LastSampleBucket = -1;
+
+
+/*
+ * RecordNodeHistorySample records the current report of the given node in
+ * the history table, unless a sample has already been recorded for the
+ * current period. The lag is counted in bytes from the most advanced LSN
+ * reported in the group.
+ */
+void
+RecordNodeHistorySample(AutoFailoverNode *node,
+						AutoFailoverNodeState *currentNodeState)
+{
+	ListCell *nodeCell = NULL;
+	XLogRecPtr groupLSN = currentNodeState->reportedLSN;
+
+	if (NodeHistoryResolutionMs <= 0 || NodeHistorySize <= 0)
+	{
+		return;
+	}
+
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+	int64 bucket = now / ((int64) NodeHistoryResolutionMs * 1000);
+
+	if (node->nodeId == LastSampleNodeId && bucket == LastSampleBucket)
+	{
+		return;
+	}
+
+	List *nodesGroupList = AutoFailoverNodeGroup(node->formationId,
+												 node->groupId);
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *otherNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (otherNode->reportedLSN > groupLSN)
+		{
+			groupLSN = otherNode->reportedLSN;
+		}
+	}
+
+	int slot = (int) (bucket % NodeHistorySize);
+
+	Oid argTypes[] = {
+		INT8OID,                    /* nodeid */
+		INT4OID,                    /* slot */
+		TIMESTAMPTZOID,             /* sampletime */
+		ReplicationStateTypeOid(),  /* reportedstate */
+		LSNOID,                     /* reportedlsn */
+		INT8OID,                    /* lagbytes */
+		INT4OID,                    /* health */
+		BOOLOID                     /* pgisrunning */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(node->nodeId),                                /* nodeid */
+		Int32GetDatum(slot),                                        /* slot */
+		TimestampTzGetDatum(now),                                   /* sampletime */
+		ObjectIdGetDatum(
+			ReplicationStateGetEnum(currentNodeState->replicationState)), /* reportedstate */
+		LSNGetDatum(currentNodeState->reportedLSN),                 /* reportedlsn */
+		Int64GetDatum((int64) (groupLSN - currentNodeState->reportedLSN)), /* lagbytes */
+		Int32GetDatum(node->health),                                /* health */
+		BoolGetDatum(currentNodeState->pgIsRunning)                 /* pgisrunning */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *upsertQuery =
+		"INSERT INTO " AUTO_FAILOVER_NODE_HISTORY_TABLE
+		" (nodeid, slot, sampletime, reportedstate, reportedlsn, lagbytes, "
+		"  health, pgisrunning) "
+		"VALUES ($1, $2, $3, $4, $5, $6, $7, $8) "
+		"ON CONFLICT (nodeid, slot) DO UPDATE "
+		"SET sampletime = excluded.sampletime, "
+		"    reportedstate = excluded.reportedstate, "
+		"    reportedlsn = excluded.reportedlsn, "
+		"    lagbytes = excluded.lagbytes, "
+		"    health = excluded.health, "
+		"    pgisrunning = excluded.pgisrunning";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_NODE_HISTORY_TABLE);
+	}
+
+	SPI_finish();
+
+	LastSampleNodeId = node->nodeId;
+	LastSampleBucket = bucket;
+}
@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_history.h
+ *
+ * Declarations for the fixed-size history of the LSN, lag and health of
+ * each node.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "group_state_machine.h"
+#include "node_metadata.h"
+
+
+/* GUC variables */
+extern int NodeHistoryResolutionMs;
+extern int NodeHistorySize;
+
+
+extern void RecordNodeHistorySample(AutoFailoverNode *node,
+									AutoFailoverNodeState *currentNodeState);
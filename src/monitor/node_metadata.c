@@ -19,10 +19,16 @@
 /* list_qsort is only in Postgres 11 and 12 */
 #include "version_compat.h"
 
+#include "failover_trace.h"
+#include "failure_detector.h"
 #include "health_check.h"
 #include "metadata.h"
+#include "node_cache.h"
 #include "node_metadata.h"
 #include "notifications.h"
+#include "replay_progress.h"
+#include "storage_health.h"
+#include "sync_rep_stall.h"
 
 #include "access/genam.h"
 #include "access/heapam.h"
@@ -36,6 +42,7 @@
 #include "catalog/pg_extension.h"
 #include "catalog/pg_type.h"
 #include "commands/sequence.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
 #include "nodes/pg_list.h"
@@ -46,6 +53,54 @@
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * The queries run on the node_active hot path are prepared the first time
+ * they are used, and then kept for the lifetime of the backend.
+ */
+static SPIPlanPtr AllNodesPlan = NULL;
+static SPIPlanPtr AllNodesInGroupPlan = NULL;
+static SPIPlanPtr NodeByHostPortPlan = NULL;
+static SPIPlanPtr NodeByIdPlan = NULL;
+static SPIPlanPtr NodeByNamePlan = NULL;
+static SPIPlanPtr ReportNodeStatePlan = NULL;
+static SPIPlanPtr ReplicationLatencyPlan = NULL;
+static SPIPlanPtr ReplicationStatsPlan = NULL;
+static SPIPlanPtr NodeUpstreamPlan = NULL;
+static SPIPlanPtr NodeDrainStatsPlan = NULL;
+static SPIPlanPtr NodeAnchorLatencyPlan = NULL;
+static Oid ReportNodeStatePlanTypeOid = InvalidOid;
+
+/*
+ * Inactive standby slots that retain more WAL than this on their primary
+ * (in MB) are invalidated, see pgautofailover.report_replication_slots().
+ */
+int ReplicationSlotWalBudget = 0;
+
+/*
+ * A switchover is refused when the primary reports a write or prepared
+ * transaction older than this (in milliseconds), 0 disables the check.
+ */
+int SwitchoverDrainLimitMs = 0;
+
+/*
+ * The candidate priority of a standby node is lowered by one for each step
+ * of this many milliseconds of its network latency to the application
+ * anchors, 0 disables it.
+ */
+int AnchorLatencyPriorityStepMs = 0;
+
+
+static int ExecuteKeptPlan(SPIPlanPtr *plan, const char *query,
+						   int argCount, Oid *argTypes, Datum *argValues,
+						   const char *argNulls, long tupleCount);
+static void BumpGroupVersion(int64 nodeId);
+static int SyncStandbyLatencyCompare(const void *a, const void *b);
+
+
+PG_FUNCTION_INFO_V1(same_system_identifier_trigger);
 
 
 /*
@@ -74,8 +129,9 @@ AllAutoFailoverNodes(char *formationId)
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 0);
+	int spiStatus = ExecuteKeptPlan(&AllNodesPlan, selectQuery,
+									argCount, argTypes, argValues,
+									NULL, 0);
 	if (spiStatus != SPI_OK_SELECT)
 	{
 		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
@@ -100,68 +156,88 @@ AllAutoFailoverNodes(char *formationId)
 }
 
 
+/*
+ * ExecuteKeptPlan runs the given query with a plan that is prepared the first
+ * time around and then kept for the lifetime of the backend, and returns the
+ * SPI status. The caller must be connected to SPI.
+ *
+ * Kept plans are invalidated and planned again by Postgres when the objects
+ * they depend on change, such as when the extension is dropped and created
+ * again.
+ */
+static int
+ExecuteKeptPlan(SPIPlanPtr *plan, const char *query,
+				int argCount, Oid *argTypes, Datum *argValues,
+				const char *argNulls, long tupleCount)
+{
+	if (*plan == NULL)
+	{
+		SPIPlanPtr newPlan = SPI_prepare(query, argCount, argTypes);
+
+		if (newPlan == NULL)
+		{
+			elog(ERROR, "could not prepare query \"%s\": %s",
+				 query, SPI_result_code_string(SPI_result));
+		}
+
+		if (SPI_keepplan(newPlan) != 0)
+		{
+			elog(ERROR, "could not keep the plan for query \"%s\"", query);
+		}
+
+		*plan = newPlan;
+	}
+
+	return SPI_execute_plan(*plan, argValues, argNulls, false, tupleCount);
+}
+
+
 /*
  * TupleToAutoFailoverNode constructs a AutoFailoverNode from a heap tuple.
+ *
+ * The tuple is deformed in a single pass with heap_deform_tuple. Fetching
+ * each of the columns with heap_getattr() instead walks the tuple from its
+ * start again for every attribute that follows a variable-length one, which
+ * is most of them here, and this runs for every node of the group on each
+ * node_active call that misses the node cache.
  */
 AutoFailoverNode *
 TupleToAutoFailoverNode(TupleDesc tupleDescriptor, HeapTuple heapTuple)
 {
-	bool isNull = false;
-	bool sysIdentifierIsNull = false;
-
-	Datum formationId = heap_getattr(heapTuple,
-									 Anum_pgautofailover_node_formationid,
-									 tupleDescriptor, &isNull);
-	Datum nodeId = heap_getattr(heapTuple, Anum_pgautofailover_node_nodeid,
-								tupleDescriptor, &isNull);
-	Datum groupId = heap_getattr(heapTuple, Anum_pgautofailover_node_groupid,
-								 tupleDescriptor, &isNull);
-	Datum nodeName = heap_getattr(heapTuple, Anum_pgautofailover_node_nodename,
-								  tupleDescriptor, &isNull);
-	Datum nodeHost = heap_getattr(heapTuple, Anum_pgautofailover_node_nodehost,
-								  tupleDescriptor, &isNull);
-	Datum nodePort = heap_getattr(heapTuple, Anum_pgautofailover_node_nodeport,
-								  tupleDescriptor, &isNull);
-	Datum sysIdentifier = heap_getattr(heapTuple,
-									   Anum_pgautofailover_node_sysidentifier,
-									   tupleDescriptor, &sysIdentifierIsNull);
-	Datum goalState = heap_getattr(heapTuple, Anum_pgautofailover_node_goalstate,
-								   tupleDescriptor, &isNull);
-	Datum reportedState = heap_getattr(heapTuple,
-									   Anum_pgautofailover_node_reportedstate,
-									   tupleDescriptor, &isNull);
-	Datum pgIsRunning = heap_getattr(heapTuple,
-									 Anum_pgautofailover_node_reportedpgisrunning,
-									 tupleDescriptor, &isNull);
-	Datum pgsrSyncState = heap_getattr(heapTuple,
-									   Anum_pgautofailover_node_reportedrepstate,
-									   tupleDescriptor, &isNull);
-	Datum reportTime = heap_getattr(heapTuple, Anum_pgautofailover_node_reporttime,
-									tupleDescriptor, &isNull);
-	Datum walReportTime = heap_getattr(heapTuple,
-									   Anum_pgautofailover_node_walreporttime,
-									   tupleDescriptor, &isNull);
-	Datum health = heap_getattr(heapTuple, Anum_pgautofailover_node_health,
-								tupleDescriptor, &isNull);
-	Datum healthCheckTime = heap_getattr(heapTuple,
-										 Anum_pgautofailover_node_healthchecktime,
-										 tupleDescriptor, &isNull);
-	Datum stateChangeTime = heap_getattr(heapTuple,
-										 Anum_pgautofailover_node_statechangetime,
-										 tupleDescriptor, &isNull);
-	Datum reportedTLI = heap_getattr(heapTuple, Anum_pgautofailover_node_reportedTLI,
-									 tupleDescriptor, &isNull);
-	Datum reportedLSN = heap_getattr(heapTuple, Anum_pgautofailover_node_reportedLSN,
-									 tupleDescriptor, &isNull);
-	Datum candidatePriority = heap_getattr(heapTuple,
-										   Anum_pgautofailover_node_candidate_priority,
-										   tupleDescriptor, &isNull);
-	Datum replicationQuorum = heap_getattr(heapTuple,
-										   Anum_pgautofailover_node_replication_quorum,
-										   tupleDescriptor, &isNull);
-	Datum nodeCluster = heap_getattr(heapTuple,
-									 Anum_pgautofailover_node_nodecluster,
-									 tupleDescriptor, &isNull);
+	Datum values[Natts_pgautofailover_node];
+	bool isNulls[Natts_pgautofailover_node];
+
+	if (tupleDescriptor->natts != Natts_pgautofailover_node)
+	{
+		elog(ERROR, "expected %d columns for " AUTO_FAILOVER_NODE_TABLE
+					", got %d", Natts_pgautofailover_node,
+			 tupleDescriptor->natts);
+	}
+
+	heap_deform_tuple(heapTuple, tupleDescriptor, values, isNulls);
+
+	Datum formationId = values[Anum_pgautofailover_node_formationid - 1];
+	Datum nodeId = values[Anum_pgautofailover_node_nodeid - 1];
+	Datum groupId = values[Anum_pgautofailover_node_groupid - 1];
+	Datum nodeName = values[Anum_pgautofailover_node_nodename - 1];
+	Datum nodeHost = values[Anum_pgautofailover_node_nodehost - 1];
+	Datum nodePort = values[Anum_pgautofailover_node_nodeport - 1];
+	Datum sysIdentifier = values[Anum_pgautofailover_node_sysidentifier - 1];
+	Datum goalState = values[Anum_pgautofailover_node_goalstate - 1];
+	Datum reportedState = values[Anum_pgautofailover_node_reportedstate - 1];
+	Datum pgIsRunning = values[Anum_pgautofailover_node_reportedpgisrunning - 1];
+	Datum pgsrSyncState = values[Anum_pgautofailover_node_reportedrepstate - 1];
+	Datum reportTime = values[Anum_pgautofailover_node_reporttime - 1];
+	Datum walReportTime = values[Anum_pgautofailover_node_walreporttime - 1];
+	Datum health = values[Anum_pgautofailover_node_health - 1];
+	Datum healthCheckTime = values[Anum_pgautofailover_node_healthchecktime - 1];
+	Datum stateChangeTime = values[Anum_pgautofailover_node_statechangetime - 1];
+	Datum reportedTLI = values[Anum_pgautofailover_node_reportedTLI - 1];
+	Datum reportedLSN = values[Anum_pgautofailover_node_reportedLSN - 1];
+	Datum candidatePriority = values[Anum_pgautofailover_node_candidate_priority - 1];
+	Datum replicationQuorum = values[Anum_pgautofailover_node_replication_quorum - 1];
+	Datum nodeCluster = values[Anum_pgautofailover_node_nodecluster - 1];
+	bool sysIdentifierIsNull = isNulls[Anum_pgautofailover_node_sysidentifier - 1];
 
 	Oid goalStateOid = DatumGetObjectId(goalState);
 	Oid reportedStateOid = DatumGetObjectId(reportedState);
@@ -206,49 +282,21 @@ List *
 AutoFailoverNodeGroup(char *formationId, int groupId)
 {
 	List *nodeList = NIL;
-	MemoryContext callerContext = CurrentMemoryContext;
-
-	Oid argTypes[] = {
-		TEXTOID, /* formationid */
-		INT4OID  /* groupid */
-	};
-
-	Datum argValues[] = {
-		CStringGetTextDatum(formationId), /* formationid */
-		Int32GetDatum(groupId)            /* groupid */
-	};
-	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	uint64 rowNumber = 0;
-
-	const char *selectQuery =
-		SELECT_ALL_FROM_AUTO_FAILOVER_NODE_TABLE
-		"    WHERE formationid = $1 AND groupid = $2"
-		"      AND goalstate <> 'dropped'"
-		" ORDER BY nodeid";
-
-	SPI_connect();
-
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 0);
-	if (spiStatus != SPI_OK_SELECT)
-	{
-		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
-	}
+	ListCell *nodeCell = NULL;
 
-	MemoryContext spiContext = MemoryContextSwitchTo(callerContext);
+	List *allNodesList = AutoFailoverAllNodesInGroup(formationId, groupId);
 
-	for (rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	foreach(nodeCell, allNodesList)
 	{
-		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
-		AutoFailoverNode *pgAutoFailoverNode =
-			TupleToAutoFailoverNode(SPI_tuptable->tupdesc, heapTuple);
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
 
-		nodeList = lappend(nodeList, pgAutoFailoverNode);
+		if (node->goalState != REPLICATION_STATE_DROPPED)
+		{
+			nodeList = lappend(nodeList, node);
+		}
 	}
 
-	MemoryContextSwitchTo(spiContext);
-
-	SPI_finish();
+	list_free(allNodesList);
 
 	return nodeList;
 }
@@ -281,10 +329,18 @@ AutoFailoverAllNodesInGroup(char *formationId, int groupId)
 		"    WHERE formationid = $1 AND groupid = $2"
 		" ORDER BY nodeid";
 
+	if (NodeCacheLookupGroup(formationId, groupId, &nodeList))
+	{
+		return nodeList;
+	}
+
+	uint64 cacheGeneration = NodeCacheGetGeneration();
+
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 0);
+	int spiStatus = ExecuteKeptPlan(&AllNodesInGroupPlan, selectQuery,
+									argCount, argTypes, argValues,
+									NULL, 0);
 	if (spiStatus != SPI_OK_SELECT)
 	{
 		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
@@ -305,6 +361,8 @@ AutoFailoverAllNodesInGroup(char *formationId, int groupId)
 
 	SPI_finish();
 
+	NodeCacheStoreGroup(formationId, groupId, nodeList, cacheGeneration);
+
 	return nodeList;
 }
 
@@ -735,106 +793,755 @@ pgautofailover_node_reportedlsn_compare(const void *a, const void *b)
 	AutoFailoverNode *node2 = (AutoFailoverNode *) lfirst(*(ListCell **) b);
 #endif
 
-	if (node1->reportedTLI > node2->reportedTLI ||
-		(node1->reportedTLI == node2->reportedTLI &&
-		 node1->reportedLSN > node2->reportedLSN))
-	{
-		return -1;
-	}
+	if (node1->reportedTLI > node2->reportedTLI ||
+		(node1->reportedTLI == node2->reportedTLI &&
+		 node1->reportedLSN > node2->reportedLSN))
+	{
+		return -1;
+	}
+
+	if (node1->reportedTLI < node2->reportedTLI ||
+		(node1->reportedTLI == node2->reportedTLI &&
+		 node1->reportedLSN < node2->reportedLSN))
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * ApplyReplicationStats updates the reportedLSN of the standby nodes in the
+ * given list with the flush LSN that the keeper of the primary node found in
+ * pg_stat_replication, when that's been reported more recently than the node
+ * itself did in node_active.
+ *
+ * Postgres only reports WAL as flushed once the standby has written it to
+ * disk, so the standby has at least that much WAL.
+ */
+void
+ApplyReplicationStats(List *groupNodeList)
+{
+	ListCell *nodeCell = NULL;
+
+	if (groupNodeList == NIL)
+	{
+		return;
+	}
+
+	const char *selectQuery =
+		"SELECT nodeid, flushlsn, reporttime "
+		"  FROM " AUTO_FAILOVER_REPLICATION_STATS_TABLE
+		" WHERE flushlsn IS NOT NULL "
+		"   AND reporttime > now() - interval '"
+		CppAsString2(REPLICATION_LATENCY_MAX_AGE) " s'";
+
+	SPI_connect();
+
+	int spiStatus = ExecuteKeptPlan(&ReplicationStatsPlan, selectQuery,
+									0, NULL, NULL, NULL, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_REPLICATION_STATS_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		bool isNull = false;
+
+		int64 nodeId = DatumGetInt64(
+			heap_getattr(heapTuple, 1, SPI_tuptable->tupdesc, &isNull));
+		XLogRecPtr flushLSN = DatumGetLSN(
+			heap_getattr(heapTuple, 2, SPI_tuptable->tupdesc, &isNull));
+		TimestampTz reportTime = DatumGetTimestampTz(
+			heap_getattr(heapTuple, 3, SPI_tuptable->tupdesc, &isNull));
+
+		foreach(nodeCell, groupNodeList)
+		{
+			AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+			if (node->nodeId != nodeId)
+			{
+				continue;
+			}
+
+			if (!StateBelongsToPrimary(node->reportedState) &&
+				node->walReportTime < reportTime &&
+				node->reportedLSN < flushLSN)
+			{
+				node->reportedLSN = flushLSN;
+				node->walReportTime = reportTime;
+			}
+			break;
+		}
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * ListMostAdvancedStandbyNodes returns the nodes in groupNodeList that have
+ * the most advanced LSN, using the replication stats reported by the primary
+ * node when they are fresher.
+ */
+List *
+ListMostAdvancedStandbyNodes(List *groupNodeList)
+{
+	ListCell *nodeCell = NULL;
+	List *mostAdvancedNodeList = NIL;
+	XLogRecPtr mostAdvancedLSN = 0;
+
+	(void) ApplyReplicationStats(groupNodeList);
+
+	#if (PG_VERSION_NUM >= 130000)
+	List *sortedNodeList = list_copy(groupNodeList);
+	list_sort(sortedNodeList, pgautofailover_node_reportedlsn_compare);
+	#else
+	List *sortedNodeList =
+		list_qsort(groupNodeList,
+				   pgautofailover_node_reportedlsn_compare);
+	#endif
+
+	foreach(nodeCell, sortedNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		/* skip old primary */
+		if (StateBelongsToPrimary(node->reportedState))
+		{
+			continue;
+		}
+
+		if (mostAdvancedLSN == 0)
+		{
+			mostAdvancedLSN = node->reportedLSN;
+		}
+
+		if (node->reportedLSN == mostAdvancedLSN)
+		{
+			mostAdvancedNodeList = lappend(mostAdvancedNodeList, node);
+		}
+	}
+
+	return mostAdvancedNodeList;
+}
+
+
+/*
+ * GroupListSyncStandbys returns a list of nodes in groupNodeList that are all
+ * candidates for failover (those with AutoFailoverNode.replicationQuorum set
+ * to true), sorted by candidatePriority.
+ */
+List *
+GroupListSyncStandbys(List *groupNodeList)
+{
+	ListCell *nodeCell = NULL;
+	List *syncStandbyNodesList = NIL;
+
+	if (groupNodeList == NIL)
+	{
+		return NIL;
+	}
+
+	#if (PG_VERSION_NUM >= 130000)
+	List *sortedNodeList = list_copy(groupNodeList);
+	list_sort(sortedNodeList, pgautofailover_node_candidate_priority_compare);
+	#else
+	List *sortedNodeList =
+		list_qsort(groupNodeList,
+				   pgautofailover_node_candidate_priority_compare);
+	#endif
+
+	foreach(nodeCell, sortedNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->replicationQuorum)
+		{
+			syncStandbyNodesList = lappend(syncStandbyNodesList, node);
+		}
+	}
+	list_free(sortedNodeList);
+
+	return syncStandbyNodesList;
+}
+
+
+/*
+ * SyncStandbyLatency associates a sync standby with its replication latency
+ * tier, and its position in the list we are sorting, so that we keep the
+ * candidate priority order between standbys of the same tier.
+ */
+typedef struct SyncStandbyLatency
+{
+	AutoFailoverNode *node;
+	int tier;
+	int position;
+} SyncStandbyLatency;
+
+
+/*
+ * SortSyncStandbysByLatency returns a copy of the given list of sync standby
+ * nodes sorted by the flush lag that the keeper of the primary node reported
+ * for them in pgautofailover.replication_stats.
+ *
+ * Latencies are compared in tiers of REPLICATION_LATENCY_TIER_MS, so that
+ * small variations don't change the order of the nodes each time. Standbys
+ * without a recent report are sorted last.
+ */
+List *
+SortSyncStandbysByLatency(List *syncStandbyNodesList)
+{
+	int nodesCount = list_length(syncStandbyNodesList);
+	int position = 0;
+	ListCell *nodeCell = NULL;
+	List *sortedNodesList = NIL;
+
+	if (nodesCount < 2)
+	{
+		return list_copy(syncStandbyNodesList);
+	}
+
+	SyncStandbyLatency *latencies =
+		(SyncStandbyLatency *) palloc0(nodesCount * sizeof(SyncStandbyLatency));
+
+	foreach(nodeCell, syncStandbyNodesList)
+	{
+		latencies[position].node = (AutoFailoverNode *) lfirst(nodeCell);
+		latencies[position].tier = PG_INT32_MAX;
+		latencies[position].position = position;
+		++position;
+	}
+
+	const char *selectQuery =
+		"SELECT nodeid, "
+		"       least(floor(extract(epoch from flushlag) * 1000 / "
+		CppAsString2(REPLICATION_LATENCY_TIER_MS) "), 2147483646)::int "
+		"  FROM " AUTO_FAILOVER_REPLICATION_STATS_TABLE
+		" WHERE flushlag IS NOT NULL "
+		"   AND reporttime > now() - interval '"
+		CppAsString2(REPLICATION_LATENCY_MAX_AGE) " s'";
+
+	SPI_connect();
+
+	int spiStatus = ExecuteKeptPlan(&ReplicationLatencyPlan, selectQuery,
+									0, NULL, NULL, NULL, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_REPLICATION_STATS_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		bool isNull = false;
+
+		Datum nodeId =
+			heap_getattr(heapTuple, 1, SPI_tuptable->tupdesc, &isNull);
+		Datum tier =
+			heap_getattr(heapTuple, 2, SPI_tuptable->tupdesc, &isNull);
+
+		for (int i = 0; i < nodesCount; i++)
+		{
+			if (latencies[i].node->nodeId == DatumGetInt64(nodeId))
+			{
+				latencies[i].tier = DatumGetInt32(tier);
+				break;
+			}
+		}
+	}
+
+	SPI_finish();
+
+	qsort(latencies, nodesCount, sizeof(SyncStandbyLatency),
+		  SyncStandbyLatencyCompare);
+
+	for (int i = 0; i < nodesCount; i++)
+	{
+		sortedNodesList = lappend(sortedNodesList, latencies[i].node);
+	}
+
+	pfree(latencies);
+
+	return sortedNodesList;
+}
+
+
+/*
+ * SyncStandbyLatencyCompare is a qsort comparator for SyncStandbyLatency
+ * arrays: by latency tier, and then by position.
+ */
+static int
+SyncStandbyLatencyCompare(const void *a, const void *b)
+{
+	const SyncStandbyLatency *latency1 = (const SyncStandbyLatency *) a;
+	const SyncStandbyLatency *latency2 = (const SyncStandbyLatency *) b;
+
+	if (latency1->tier != latency2->tier)
+	{
+		return latency1->tier < latency2->tier ? -1 : 1;
+	}
+
+	return latency1->position - latency2->position;
+}
+
+
+/*
+ * GetNodeDrainStats reads the drain stats that the keeper of the given
+ * primary node reported in the last DRAIN_STATS_MAX_AGE seconds. It returns
+ * false when there is no such report.
+ */
+bool
+GetNodeDrainStats(int64 nodeId, NodeDrainStats *stats)
+{
+	bool found = false;
+
+	Oid argTypes[] = {
+		INT8OID  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)   /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT writexacts, "
+		"       coalesce(floor(extract(epoch from oldestwritexact) * 1000 "
+		"                      + extract(epoch from now() - reporttime) * 1000), "
+		"                -1)::bigint, "
+		"       preparedxacts, "
+		"       coalesce(floor(extract(epoch from oldestpreparedxact) * 1000 "
+		"                      + extract(epoch from now() - reporttime) * 1000), "
+		"                -1)::bigint "
+		"  FROM " AUTO_FAILOVER_DRAIN_STATS_TABLE
+		" WHERE nodeid = $1 "
+		"   AND reporttime > now() - interval '"
+		CppAsString2(DRAIN_STATS_MAX_AGE) " s'";
+
+	SPI_connect();
+
+	int spiStatus = ExecuteKeptPlan(&NodeDrainStatsPlan, selectQuery,
+									argCount, argTypes, argValues, NULL, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_DRAIN_STATS_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[0];
+		TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+		bool isNull = false;
+
+		stats->writeXacts =
+			DatumGetInt32(heap_getattr(heapTuple, 1, tupleDesc, &isNull));
+		stats->oldestWriteXactMs =
+			DatumGetInt64(heap_getattr(heapTuple, 2, tupleDesc, &isNull));
+		stats->preparedXacts =
+			DatumGetInt32(heap_getattr(heapTuple, 3, tupleDesc, &isNull));
+		stats->oldestPreparedXactMs =
+			DatumGetInt64(heap_getattr(heapTuple, 4, tupleDesc, &isNull));
+
+		found = true;
+	}
+
+	SPI_finish();
+
+	return found;
+}
+
+
+/*
+ * GetNodeAnchorLatencyMs returns the average network round-trip time from
+ * the given node to the application anchors, as reported by its keeper in
+ * the last ANCHOR_LATENCY_MAX_AGE seconds, in milliseconds. It returns -1
+ * when there is no such report.
+ */
+int
+GetNodeAnchorLatencyMs(int64 nodeId)
+{
+	int latencyMs = -1;
+
+	Oid argTypes[] = {
+		INT8OID  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)   /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT least(floor(avg(coalesce(extract(epoch from rtt) * 1000, "
+		CppAsString2(ANCHOR_LATENCY_UNREACHABLE_MS) "))), "
+		"             2147483646)::int "
+		"  FROM " AUTO_FAILOVER_NODE_LATENCY_TABLE
+		" WHERE nodeid = $1 "
+		"   AND targetnodeid IS NULL "
+		"   AND reporttime > now() - interval '"
+		CppAsString2(ANCHOR_LATENCY_MAX_AGE) " s'";
+
+	SPI_connect();
+
+	int spiStatus = ExecuteKeptPlan(&NodeAnchorLatencyPlan, selectQuery,
+									argCount, argTypes, argValues, NULL, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_LATENCY_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum latency = heap_getattr(SPI_tuptable->vals[0], 1,
+									 SPI_tuptable->tupdesc, &isNull);
+
+		/* avg() is NULL when there's no recent report */
+		if (!isNull)
+		{
+			latencyMs = DatumGetInt32(latency);
+		}
+	}
+
+	SPI_finish();
+
+	return latencyMs;
+}
+
+
+/*
+ * GetEffectiveCandidatePriority returns the candidate priority of the given
+ * node, lowered by one for each pgautofailover.anchor_latency_priority_step
+ * of its network latency to the application anchors. A node that is a
+ * failover candidate remains one, with a priority of at least 1, and the
+ * priority of a node that is being promoted by perform_promotion() is not
+ * changed.
+ */
+int
+GetEffectiveCandidatePriority(AutoFailoverNode *node)
+{
+	int priority = node->candidatePriority;
+
+	if (AnchorLatencyPriorityStepMs <= 0 ||
+		priority <= 0 ||
+		priority > MAX_USER_DEFINED_CANDIDATE_PRIORITY)
+	{
+		return priority;
+	}
+
+	int latencyMs = GetNodeAnchorLatencyMs(node->nodeId);
+
+	if (latencyMs < 0)
+	{
+		return priority;
+	}
+
+	return Max(1, priority - latencyMs / AnchorLatencyPriorityStepMs);
+}
+
+
+/*
+ * GetNodeUpstream reads the upstream settings of the given node. It returns
+ * false when the node has no such settings, and otherwise sets
+ * upstreamNodeId and streamingNodeId, using zero for NULL values, which
+ * stand for the primary node.
+ */
+bool
+GetNodeUpstream(int64 nodeId, int64 *upstreamNodeId, int64 *streamingNodeId)
+{
+	bool found = false;
+
+	Oid argTypes[] = {
+		INT8OID  /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)   /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT upstreamnodeid, streamingnodeid "
+		"  FROM " AUTO_FAILOVER_NODE_UPSTREAM_TABLE
+		" WHERE nodeid = $1";
+
+	*upstreamNodeId = 0;
+	*streamingNodeId = 0;
+
+	SPI_connect();
+
+	int spiStatus = ExecuteKeptPlan(&NodeUpstreamPlan, selectQuery,
+									argCount, argTypes, argValues, NULL, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_UPSTREAM_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		HeapTuple heapTuple = SPI_tuptable->vals[0];
+		bool isNull = false;
+
+		Datum upstream =
+			heap_getattr(heapTuple, 1, SPI_tuptable->tupdesc, &isNull);
+
+		if (!isNull)
+		{
+			*upstreamNodeId = DatumGetInt64(upstream);
+		}
+
+		Datum streaming =
+			heap_getattr(heapTuple, 2, SPI_tuptable->tupdesc, &isNull);
+
+		if (!isNull)
+		{
+			*streamingNodeId = DatumGetInt64(streaming);
+		}
+
+		found = true;
+	}
+
+	SPI_finish();
+
+	return found;
+}
+
+
+/*
+ * SetNodeUpstream sets the configured upstream node of the given node, or
+ * resets it when upstreamNodeId is zero.
+ */
+void
+SetNodeUpstream(int64 nodeId, int64 upstreamNodeId)
+{
+	Oid argTypes[] = {
+		INT8OID, /* nodeid */
+		INT8OID  /* upstreamnodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId),        /* nodeid */
+		Int64GetDatum(upstreamNodeId) /* upstreamnodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *upsertQuery =
+		"INSERT INTO " AUTO_FAILOVER_NODE_UPSTREAM_TABLE
+		" (nodeid, upstreamnodeid) VALUES ($1, nullif($2, 0)) "
+		"ON CONFLICT (nodeid) "
+		"DO UPDATE SET upstreamnodeid = excluded.upstreamnodeid";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_UPSTREAM_TABLE);
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * SetNodeStreamingUpstream records which node the given node streams from,
+ * zero meaning the primary node. Nodes that never had an upstream node
+ * configured don't have settings to update.
+ */
+void
+SetNodeStreamingUpstream(int64 nodeId, int64 streamingNodeId)
+{
+	Oid argTypes[] = {
+		INT8OID, /* nodeid */
+		INT8OID  /* streamingnodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId),         /* nodeid */
+		Int64GetDatum(streamingNodeId) /* streamingnodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *updateQuery =
+		"UPDATE " AUTO_FAILOVER_NODE_UPSTREAM_TABLE
+		" SET streamingnodeid = nullif($2, 0) "
+		"WHERE nodeid = $1";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(updateQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_UPDATE)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_UPSTREAM_TABLE);
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * SetNodeBaseBackupSource records which node the given node takes its base
+ * backup from, zero meaning the primary node.
+ */
+void
+SetNodeBaseBackupSource(int64 nodeId, int64 sourceNodeId)
+{
+	Oid argTypes[] = {
+		INT8OID, /* nodeid */
+		INT8OID  /* basebackupnodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId),      /* nodeid */
+		Int64GetDatum(sourceNodeId) /* basebackupnodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
-	if (node1->reportedTLI < node2->reportedTLI ||
-		(node1->reportedTLI == node2->reportedTLI &&
-		 node1->reportedLSN < node2->reportedLSN))
+	const char *upsertQuery =
+		"INSERT INTO " AUTO_FAILOVER_NODE_UPSTREAM_TABLE
+		" (nodeid, basebackupnodeid) VALUES ($1, nullif($2, 0)) "
+		"ON CONFLICT (nodeid) "
+		"DO UPDATE SET basebackupnodeid = excluded.basebackupnodeid";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
 	{
-		return 1;
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_UPSTREAM_TABLE);
 	}
 
-	return 0;
+	SPI_finish();
 }
 
 
 /*
- * ListMostAdvancedStandbyNodes returns the nodes in groupNodeList that have
- * the most advanced LSN.
+ * CountNodeReplicationClients returns how many nodes are using the given node
+ * as a replication source: the standby nodes streaming from it, and the
+ * standby nodes that are still joining after a base backup taken from it.
  */
-List *
-ListMostAdvancedStandbyNodes(List *groupNodeList)
+int
+CountNodeReplicationClients(int64 nodeId)
 {
-	ListCell *nodeCell = NULL;
-	List *mostAdvancedNodeList = NIL;
-	XLogRecPtr mostAdvancedLSN = 0;
+	int count = 0;
 
-	#if (PG_VERSION_NUM >= 130000)
-	List *sortedNodeList = list_copy(groupNodeList);
-	list_sort(sortedNodeList, pgautofailover_node_reportedlsn_compare);
-	#else
-	List *sortedNodeList =
-		list_qsort(groupNodeList,
-				   pgautofailover_node_reportedlsn_compare);
-	#endif
+	Oid argTypes[] = {
+		INT8OID  /* nodeid */
+	};
 
-	foreach(nodeCell, sortedNodeList)
-	{
-		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)   /* nodeid */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
-		/* skip old primary */
-		if (StateBelongsToPrimary(node->reportedState))
-		{
-			continue;
-		}
+	const char *selectQuery =
+		"SELECT count(*) "
+		"  FROM " AUTO_FAILOVER_NODE_UPSTREAM_TABLE " u "
+		"  JOIN " AUTO_FAILOVER_NODE_TABLE " n USING(nodeid) "
+		" WHERE u.streamingnodeid = $1 "
+		"    OR (u.basebackupnodeid = $1 "
+		"        AND n.reportedstate IN ('wait_standby', 'catchingup'))";
 
-		if (mostAdvancedLSN == 0)
-		{
-			mostAdvancedLSN = node->reportedLSN;
-		}
+	SPI_connect();
 
-		if (node->reportedLSN == mostAdvancedLSN)
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_UPSTREAM_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+		Datum countDatum = heap_getattr(SPI_tuptable->vals[0], 1,
+										SPI_tuptable->tupdesc, &isNull);
+
+		if (!isNull)
 		{
-			mostAdvancedNodeList = lappend(mostAdvancedNodeList, node);
+			count = (int) DatumGetInt64(countDatum);
 		}
 	}
 
-	return mostAdvancedNodeList;
+	SPI_finish();
+
+	return count;
 }
 
 
 /*
- * GroupListSyncStandbys returns a list of nodes in groupNodeList that are all
- * candidates for failover (those with AutoFailoverNode.replicationQuorum set
- * to true), sorted by candidatePriority.
+ * GetConfiguredUpstreamNode returns the upstream node that has been set for
+ * the given node with pgautofailover.set_node_upstream(), when that node is
+ * currently usable as an upstream node, and NULL otherwise: the node then
+ * streams from the primary.
  */
-List *
-GroupListSyncStandbys(List *groupNodeList)
+AutoFailoverNode *
+GetConfiguredUpstreamNode(AutoFailoverNode *node)
 {
-	ListCell *nodeCell = NULL;
-	List *syncStandbyNodesList = NIL;
+	int64 upstreamNodeId = 0;
+	int64 streamingNodeId = 0;
 
-	if (groupNodeList == NIL)
+	if (!GetNodeUpstream(node->nodeId, &upstreamNodeId, &streamingNodeId) ||
+		upstreamNodeId == 0)
 	{
-		return NIL;
+		return NULL;
 	}
 
-	#if (PG_VERSION_NUM >= 130000)
-	List *sortedNodeList = list_copy(groupNodeList);
-	list_sort(sortedNodeList, pgautofailover_node_candidate_priority_compare);
-	#else
-	List *sortedNodeList =
-		list_qsort(groupNodeList,
-				   pgautofailover_node_candidate_priority_compare);
-	#endif
+	AutoFailoverNode *upstreamNode = GetAutoFailoverNodeById(upstreamNodeId);
 
-	foreach(nodeCell, sortedNodeList)
+	if (upstreamNode == NULL ||
+		strcmp(upstreamNode->formationId, node->formationId) != 0 ||
+		upstreamNode->groupId != node->groupId ||
+		!IsUsableUpstreamNode(upstreamNode))
 	{
-		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		return NULL;
+	}
 
-		if (node->replicationQuorum)
-		{
-			syncStandbyNodesList = lappend(syncStandbyNodesList, node);
-		}
+	return upstreamNode;
+}
+
+
+/*
+ * IsUsableUpstreamNode returns true when the given node is a healthy
+ * secondary node, that other standby nodes can stream from. A secondary node
+ * whose own WAL receiver is stalled would only stall its downstream nodes,
+ * which then stream from the primary again.
+ */
+bool
+IsUsableUpstreamNode(AutoFailoverNode *node)
+{
+	if (node == NULL ||
+		!IsCurrentState(node, REPLICATION_STATE_SECONDARY) ||
+		node->health != NODE_HEALTH_GOOD ||
+		!node->pgIsRunning)
+	{
+		return false;
 	}
-	list_free(sortedNodeList);
 
-	return syncStandbyNodesList;
+	AutoFailoverNode *primaryNode =
+		GetPrimaryNodeInGroup(node->formationId, node->groupId);
+
+	return !NodeWalReceiverIsStalled(node, primaryNode, GetCurrentTimestamp());
 }
 
 
@@ -888,8 +1595,9 @@ GetAutoFailoverNode(char *nodeHost, int nodePort)
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 1);
+	int spiStatus = ExecuteKeptPlan(&NodeByHostPortPlan, selectQuery,
+									argCount, argTypes, argValues,
+									NULL, 1);
 	if (spiStatus != SPI_OK_SELECT)
 	{
 		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
@@ -921,6 +1629,33 @@ GetAutoFailoverNode(char *nodeHost, int nodePort)
  */
 AutoFailoverNode *
 GetAutoFailoverNodeById(int64 nodeId)
+{
+	AutoFailoverNode *pgAutoFailoverNode = NULL;
+
+	if (NodeCacheLookupNode(nodeId, &pgAutoFailoverNode))
+	{
+		return pgAutoFailoverNode;
+	}
+
+	uint64 cacheGeneration = NodeCacheGetGeneration();
+
+	pgAutoFailoverNode = ReadAutoFailoverNodeById(nodeId);
+
+	NodeCacheStoreNode(pgAutoFailoverNode, cacheGeneration);
+
+	return pgAutoFailoverNode;
+}
+
+
+/*
+ * ReadAutoFailoverNodeById reads a single node from the catalogs, bypassing
+ * the node cache. It is used by the cache trigger to build the new version
+ * of a row from the node_base and node_heartbeat tables.
+ *
+ * This function returns NULL, when the node could not be found.
+ */
+AutoFailoverNode *
+ReadAutoFailoverNodeById(int64 nodeId)
 {
 	AutoFailoverNode *pgAutoFailoverNode = NULL;
 	MemoryContext callerContext = CurrentMemoryContext;
@@ -940,9 +1675,9 @@ GetAutoFailoverNodeById(int64 nodeId)
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(selectQuery,
-										  argCount, argTypes, argValues,
-										  NULL, false, 1);
+	int spiStatus = ExecuteKeptPlan(&NodeByIdPlan, selectQuery,
+									argCount, argTypes, argValues,
+									NULL, 1);
 	if (spiStatus != SPI_OK_SELECT)
 	{
 		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
@@ -993,8 +1728,9 @@ GetAutoFailoverNodeByName(char *formationId, char *nodeName)
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes, argValues,
-										  NULL, false, 1);
+	int spiStatus = ExecuteKeptPlan(&NodeByNamePlan, selectQuery,
+									argCount, argTypes, argValues,
+									NULL, 1);
 	if (spiStatus != SPI_OK_SELECT)
 	{
 		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_TABLE);
@@ -1121,14 +1857,20 @@ AddAutoFailoverNode(char *formationId,
 	 * In a citus formation kind, we want to name the node with the convention
 	 * 'coordinator_%d' for the coordinator nodes, and 'worker%d' for the
 	 * worker nodes.
+	 *
+	 * The heartbeat columns of the node live in their own table, where we
+	 * insert the row with the default values in the same statement.
 	 */
 
 	const char *insertQuery =
 		"WITH seq(nodeid) AS "
 		"(SELECT case when $2 = -1 "
 		"  then nextval('pgautofailover.node_nodeid_seq'::regclass) "
-		"  else $2 end) "
-		"INSERT INTO " AUTO_FAILOVER_NODE_TABLE
+		"  else $2 end), "
+		"heartbeat AS "
+		"(INSERT INTO " AUTO_FAILOVER_NODE_HEARTBEAT_TABLE " (nodeid) "
+		" SELECT nodeid FROM seq) "
+		"INSERT INTO " AUTO_FAILOVER_NODE_BASE_TABLE
 		" (formationid, nodeid, groupid, nodename, nodehost, nodeport, "
 		" sysidentifier, goalstate, reportedstate, "
 		" candidatepriority, replicationquorum, nodecluster)"
@@ -1157,7 +1899,7 @@ AddAutoFailoverNode(char *formationId,
 	}
 	else
 	{
-		elog(ERROR, "could not insert into " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_NODE_BASE_TABLE);
 	}
 
 	/* when a desired_node_id has been given, maintain the nodeid sequence */
@@ -1166,7 +1908,7 @@ AddAutoFailoverNode(char *formationId,
 		const char *setValQuery =
 			"SELECT setval('pgautofailover.node_nodeid_seq'::regclass, "
 			" max(nodeid)+1) "
-			" FROM " AUTO_FAILOVER_NODE_TABLE;
+			" FROM " AUTO_FAILOVER_NODE_BASE_TABLE;
 
 		int spiStatus = SPI_execute_with_args(setValQuery,
 											  0, NULL, NULL, NULL,
@@ -1181,6 +1923,8 @@ AddAutoFailoverNode(char *formationId,
 
 	SPI_finish();
 
+	BumpGroupVersion(insertedNodeId);
+
 	return insertedNodeId;
 }
 
@@ -1209,7 +1953,7 @@ SetNodeGoalState(AutoFailoverNode *pgAutoFailoverNode,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *updateQuery =
-		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		"UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE
 		" SET goalstate = $1, statechangetime = now() "
 		"WHERE nodeid = $2";
 
@@ -1220,7 +1964,7 @@ SetNodeGoalState(AutoFailoverNode *pgAutoFailoverNode,
 										  NULL, false, 0);
 	if (spiStatus != SPI_OK_UPDATE)
 	{
-		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_BASE_TABLE);
 	}
 
 	SPI_finish();
@@ -1231,6 +1975,9 @@ SetNodeGoalState(AutoFailoverNode *pgAutoFailoverNode,
 	 */
 	pgAutoFailoverNode->goalState = goalState;
 
+	/* the first step of a failover starts its trace, see failover_trace.c */
+	StartFailoverTraceForGoalState(pgAutoFailoverNode, goalState);
+
 	if (message != NULL)
 	{
 		NotifyStateChange(pgAutoFailoverNode, (char *) message);
@@ -1242,6 +1989,10 @@ SetNodeGoalState(AutoFailoverNode *pgAutoFailoverNode,
  * ReportAutoFailoverNodeState persists the reported state and nodes version of
  * a node.
  *
+ * The heartbeat columns are updated at each call, whereas the node_base row
+ * is only updated when the reported state or replication state changed, so
+ * that the keepers' regular reports only touch the narrow heartbeat table.
+ *
  * We use SPI to automatically handle triggers, function calls, etc.
  */
 void
@@ -1276,24 +2027,42 @@ ReportAutoFailoverNodeState(char *nodeHost, int nodePort,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *updateQuery =
-		"UPDATE " AUTO_FAILOVER_NODE_TABLE
-		" SET reportedstate = $1, reporttime = now(), "
-		"reportedpgisrunning = $2, reportedrepstate = $3, "
-		"reportedtli = CASE $4 WHEN 0 THEN reportedtli ELSE $4 END, "
-		"reportedlsn = CASE $5 WHEN '0/0'::pg_lsn THEN reportedlsn ELSE $5 END, "
-		"walreporttime = CASE $5 WHEN '0/0'::pg_lsn THEN walreporttime ELSE now() END, "
+		"WITH base AS "
+		"(UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE
+		" SET reportedstate = $1, reportedrepstate = $3, "
 		"statechangetime = CASE WHEN reportedstate <> $1 THEN now() ELSE statechangetime END "
-		"WHERE nodehost = $6 AND nodeport = $7";
+		"WHERE nodehost = $6 AND nodeport = $7 "
+		"AND (reportedstate <> $1 OR reportedrepstate IS DISTINCT FROM $3)) "
+		"UPDATE " AUTO_FAILOVER_NODE_HEARTBEAT_TABLE " heartbeat"
+		" SET reporttime = now(), reportedpgisrunning = $2, "
+		"reportedtli = CASE $4 WHEN 0 THEN heartbeat.reportedtli ELSE $4 END, "
+		"reportedlsn = CASE $5 WHEN '0/0'::pg_lsn THEN heartbeat.reportedlsn ELSE $5 END, "
+		"walreporttime = CASE $5 WHEN '0/0'::pg_lsn THEN heartbeat.walreporttime ELSE now() END "
+		"FROM " AUTO_FAILOVER_NODE_BASE_TABLE " node "
+		"WHERE heartbeat.nodeid = node.nodeid "
+		"AND node.nodehost = $6 AND node.nodeport = $7";
+
+	/*
+	 * The replication_state type is part of the extension, so it gets a new
+	 * Oid when the extension is dropped and created again in this backend.
+	 */
+	if (ReportNodeStatePlan != NULL &&
+		ReportNodeStatePlanTypeOid != replicationStateTypeOid)
+	{
+		SPI_freeplan(ReportNodeStatePlan);
+		ReportNodeStatePlan = NULL;
+	}
+	ReportNodeStatePlanTypeOid = replicationStateTypeOid;
 
 	SPI_connect();
 
-	int spiStatus = SPI_execute_with_args(updateQuery,
-										  argCount, argTypes, argValues,
-										  NULL, false, 0);
+	int spiStatus = ExecuteKeptPlan(&ReportNodeStatePlan, updateQuery,
+									argCount, argTypes, argValues,
+									NULL, 0);
 
 	if (spiStatus != SPI_OK_UPDATE)
 	{
-		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_HEARTBEAT_TABLE);
 	}
 
 	SPI_finish();
@@ -1329,7 +2098,7 @@ ReportAutoFailoverNodeHealth(char *nodeHost, int nodePort,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *updateQuery =
-		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		"UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE
 		" SET goalstate = $1, health = $2, "
 		"healthchecktime = now(), statechangetime = now() "
 		"WHERE nodehost = $3 AND nodeport = $4";
@@ -1342,7 +2111,7 @@ ReportAutoFailoverNodeHealth(char *nodeHost, int nodePort,
 
 	if (spiStatus != SPI_OK_UPDATE)
 	{
-		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_BASE_TABLE);
 	}
 
 	SPI_finish();
@@ -1379,7 +2148,7 @@ ReportAutoFailoverNodeReplicationSetting(int64 nodeid,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *updateQuery =
-		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		"UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE
 		"   SET candidatepriority = $1, replicationquorum = $2 "
 		" WHERE nodeid = $3 and nodehost = $4 AND nodeport = $5";
 
@@ -1391,7 +2160,7 @@ ReportAutoFailoverNodeReplicationSetting(int64 nodeid,
 
 	if (spiStatus != SPI_OK_UPDATE)
 	{
-		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_BASE_TABLE);
 	}
 
 	SPI_finish();
@@ -1426,7 +2195,7 @@ UpdateAutoFailoverNodeMetadata(int64 nodeid,
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *updateQuery =
-		"UPDATE " AUTO_FAILOVER_NODE_TABLE
+		"UPDATE " AUTO_FAILOVER_NODE_BASE_TABLE
 		" SET nodename = $2, nodehost = $3, nodeport = $4 "
 		"WHERE nodeid = $1";
 
@@ -1438,10 +2207,11 @@ UpdateAutoFailoverNodeMetadata(int64 nodeid,
 
 	if (spiStatus != SPI_OK_UPDATE)
 	{
-		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not update " AUTO_FAILOVER_NODE_BASE_TABLE);
 	}
 
 	SPI_finish();
+	BumpGroupVersion(nodeid);
 }
 
 
@@ -1463,9 +2233,14 @@ RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode)
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
 
 	const char *deleteQuery =
-		"DELETE FROM " AUTO_FAILOVER_NODE_TABLE
+		"WITH heartbeat AS "
+		"(DELETE FROM " AUTO_FAILOVER_NODE_HEARTBEAT_TABLE " WHERE nodeid = $1) "
+		"DELETE FROM " AUTO_FAILOVER_NODE_BASE_TABLE
 		" WHERE nodeid = $1";
 
+	/* the node must still exist for us to find its group */
+	BumpGroupVersion(pgAutoFailoverNode->nodeId);
+
 	SPI_connect();
 
 	int spiStatus = SPI_execute_with_args(deleteQuery,
@@ -1474,10 +2249,218 @@ RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode)
 
 	if (spiStatus != SPI_OK_DELETE)
 	{
-		elog(ERROR, "could not delete from " AUTO_FAILOVER_NODE_TABLE);
+		elog(ERROR, "could not delete from " AUTO_FAILOVER_NODE_BASE_TABLE);
+	}
+
+	SPI_finish();
+
+	RemoveHealthCheckLatency(pgAutoFailoverNode->nodeId);
+	RemoveNodeHeartbeat(pgAutoFailoverNode->nodeId);
+	RemoveStorageHealth(pgAutoFailoverNode->nodeId);
+	RemoveReplayProgress(pgAutoFailoverNode->nodeId);
+	RemoveSyncRepStall(pgAutoFailoverNode->nodeId);
+}
+
+
+/*
+ * BumpGroupVersion increments the membership version of the group of the
+ * given node, so that the keepers know they need to refresh their list of
+ * other nodes in the group.
+ */
+static void
+BumpGroupVersion(int64 nodeId)
+{
+	Oid argTypes[] = {
+		INT8OID  /* nodeId */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(nodeId)        /* nodeId */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *upsertQuery =
+		"INSERT INTO " AUTO_FAILOVER_GROUP_VERSION_TABLE
+		" (formationid, groupid) "
+		"SELECT formationid, groupid FROM " AUTO_FAILOVER_NODE_BASE_TABLE
+		" WHERE nodeid = $1 "
+		"ON CONFLICT (formationid, groupid) "
+		"DO UPDATE SET version = group_version.version + 1";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(upsertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not update " AUTO_FAILOVER_GROUP_VERSION_TABLE);
+	}
+
+	SPI_finish();
+}
+
+
+/*
+ * GetGroupVersion returns the current membership version of the given group,
+ * or zero when the group has no version yet.
+ */
+int64
+GetGroupVersion(char *formationId, int groupId)
+{
+	int64 groupVersion = 0;
+
+	Oid argTypes[] = {
+		TEXTOID, /* formationId */
+		INT4OID  /* groupId */
+	};
+
+	Datum argValues[] = {
+		CStringGetTextDatum(formationId), /* formationId */
+		Int32GetDatum(groupId)            /* groupId */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT version FROM " AUTO_FAILOVER_GROUP_VERSION_TABLE
+		" WHERE formationid = $1 AND groupid = $2";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_GROUP_VERSION_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		bool isNull = false;
+
+		Datum versionDatum = SPI_getbinval(SPI_tuptable->vals[0],
+										   SPI_tuptable->tupdesc,
+										   1,
+										   &isNull);
+
+		groupVersion = isNull ? 0 : DatumGetInt64(versionDatum);
+	}
+
+	SPI_finish();
+
+	return groupVersion;
+}
+
+
+/*
+ * same_system_identifier_trigger is a deferred constraint trigger on the
+ * node_base table that only allows the same sysidentifier for all the nodes
+ * in the same group. It only fires when the sysidentifier, formationid or
+ * groupid columns are written to, which is rare, so that the other updates
+ * of the table don't pay for the check.
+ *
+ * Concurrent transactions that write a sysidentifier in the same group are
+ * serialized with the group lock, at commit time, and the check then sees
+ * the rows committed by the other transactions.
+ */
+Datum
+same_system_identifier_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData *triggerData = (TriggerData *) fcinfo->context;
+	bool isNull = false;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("same_system_identifier_trigger: "
+						"not called by trigger manager")));
+	}
+
+	Relation relation = triggerData->tg_relation;
+	TupleDesc tupleDescriptor = RelationGetDescr(relation);
+	HeapTuple heapTuple =
+		TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event)
+		? triggerData->tg_newtuple
+		: triggerData->tg_trigtuple;
+
+	Datum sysIdentifier =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "sysidentifier"),
+					 tupleDescriptor, &isNull);
+
+	/* no system identifier yet, nothing to check */
+	if (isNull)
+	{
+		return PointerGetDatum(NULL);
+	}
+
+	Datum nodeId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "nodeid"),
+					 tupleDescriptor, &isNull);
+	Datum formationId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "formationid"),
+					 tupleDescriptor, &isNull);
+	Datum groupId =
+		heap_getattr(heapTuple, SPI_fnumber(tupleDescriptor, "groupid"),
+					 tupleDescriptor, &isNull);
+
+	LockNodeGroup(TextDatumGetCString(formationId), DatumGetInt32(groupId),
+				  ExclusiveLock);
+
+	Oid argTypes[] = {
+		TEXTOID, /* formationid */
+		INT4OID, /* groupid */
+		INT8OID  /* sysidentifier */
+	};
+
+	Datum argValues[] = {
+		formationId,   /* formationid */
+		groupId,       /* groupid */
+		sysIdentifier  /* sysidentifier */
+	};
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT sysidentifier FROM " AUTO_FAILOVER_NODE_BASE_TABLE
+		" WHERE formationid = $1 AND groupid = $2 AND sysidentifier <> $3";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(selectQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 1);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from " AUTO_FAILOVER_NODE_BASE_TABLE);
+	}
+
+	if (SPI_processed > 0)
+	{
+		Datum otherSysIdentifier = SPI_getbinval(SPI_tuptable->vals[0],
+												 SPI_tuptable->tupdesc,
+												 1,
+												 &isNull);
+
+		ereport(ERROR,
+				(errcode(ERRCODE_EXCLUSION_VIOLATION),
+				 errmsg("node %lld in group %d of formation \"%s\" has "
+						"system identifier %lld, but another node in this "
+						"group has system identifier %lld",
+						(long long) DatumGetInt64(nodeId),
+						DatumGetInt32(groupId),
+						TextDatumGetCString(formationId),
+						(long long) DatumGetInt64(sysIdentifier),
+						(long long) DatumGetInt64(otherSysIdentifier)),
+				 errtableconstraint(relation,
+									"same_system_identifier_within_group")));
 	}
 
 	SPI_finish();
+
+	return PointerGetDatum(NULL);
 }
 
 
@@ -1660,7 +2643,11 @@ bool
 IsBeingPromoted(AutoFailoverNode *node)
 {
 	return node != NULL &&
-		   ((node->reportedState == REPLICATION_STATE_REPORT_LSN &&
+		   (((node->reportedState == REPLICATION_STATE_SECONDARY ||
+			  node->reportedState == REPLICATION_STATE_CATCHINGUP) &&
+			 node->goalState == REPLICATION_STATE_PREPARE_PROMOTION) ||
+
+			(node->reportedState == REPLICATION_STATE_REPORT_LSN &&
 			 (node->goalState == REPLICATION_STATE_FAST_FORWARD ||
 			  node->goalState == REPLICATION_STATE_PREPARE_PROMOTION)) ||
 
@@ -22,11 +22,29 @@
 
 #define AUTO_FAILOVER_NODE_TABLE_NAME "node"
 
+/*
+ * The replication stats of the standbys, as reported by the keeper of the
+ * primary, are used for that long. The flush lag only counts in tiers of
+ * that many milliseconds.
+ */
+#define REPLICATION_LATENCY_TIER_MS 10
+#define REPLICATION_LATENCY_MAX_AGE 60        /* seconds */
+
+/* the drain stats reported by the keeper of the primary are used that long */
+#define DRAIN_STATS_MAX_AGE 10                /* seconds */
+
+/*
+ * The keepers probe the network latency to the application anchors every
+ * minute, with a timeout of a second that we count for unreachable anchors.
+ */
+#define ANCHOR_LATENCY_MAX_AGE 180            /* seconds */
+#define ANCHOR_LATENCY_UNREACHABLE_MS 1000
+
 /* column indexes for pgautofailover.node
  * indices must match with the columns given
  * in the following definition.
  */
-#define Natts_pgautofailover_node 19
+#define Natts_pgautofailover_node 21
 #define Anum_pgautofailover_node_formationid 1
 #define Anum_pgautofailover_node_nodeid 2
 #define Anum_pgautofailover_node_groupid 3
@@ -150,6 +168,26 @@ typedef enum FormationKind
 } FormationKind;
 
 
+/*
+ * NodeDrainStats is what the keeper of a primary node reports about the
+ * transactions that a switchover would have to wait for. Ages are in
+ * milliseconds, and -1 when there's no such transaction.
+ */
+typedef struct NodeDrainStats
+{
+	int writeXacts;
+	int64 oldestWriteXactMs;
+	int preparedXacts;
+	int64 oldestPreparedXactMs;
+} NodeDrainStats;
+
+
+/* GUCs */
+extern int ReplicationSlotWalBudget;
+extern int SwitchoverDrainLimitMs;
+extern int AnchorLatencyPriorityStepMs;
+
+
 /* public function declarations */
 extern List * AllAutoFailoverNodes(char *formationId);
 extern List * AutoFailoverNodeGroup(char *formationId, int groupId);
@@ -165,8 +203,21 @@ extern AutoFailoverNode * GetPrimaryOrDemotedNodeInGroup(char *formationId,
 														 int32 groupId);
 extern AutoFailoverNode * FindFailoverNewStandbyNode(List *groupNodeList);
 extern List * GroupListCandidates(List *groupNodeList);
+extern void ApplyReplicationStats(List *groupNodeList);
 extern List * ListMostAdvancedStandbyNodes(List *groupNodeList);
 extern List * GroupListSyncStandbys(List *groupNodeList);
+extern List * SortSyncStandbysByLatency(List *syncStandbyNodesList);
+extern bool GetNodeUpstream(int64 nodeId,
+							int64 *upstreamNodeId, int64 *streamingNodeId);
+extern bool GetNodeDrainStats(int64 nodeId, NodeDrainStats *stats);
+extern int GetNodeAnchorLatencyMs(int64 nodeId);
+extern int GetEffectiveCandidatePriority(AutoFailoverNode *node);
+extern void SetNodeUpstream(int64 nodeId, int64 upstreamNodeId);
+extern void SetNodeStreamingUpstream(int64 nodeId, int64 streamingNodeId);
+extern void SetNodeBaseBackupSource(int64 nodeId, int64 sourceNodeId);
+extern int CountNodeReplicationClients(int64 nodeId);
+extern AutoFailoverNode * GetConfiguredUpstreamNode(AutoFailoverNode *node);
+extern bool IsUsableUpstreamNode(AutoFailoverNode *node);
 extern bool AllNodesHaveSameCandidatePriority(List *groupNodeList);
 extern int CountSyncStandbys(List *groupNodeList);
 extern bool IsFailoverInProgress(List *groupNodeList);
@@ -175,6 +226,7 @@ extern AutoFailoverNode * FindCandidateNodeBeingPromoted(List *groupNodeList);
 
 extern AutoFailoverNode * GetAutoFailoverNode(char *nodeHost, int nodePort);
 extern AutoFailoverNode * GetAutoFailoverNodeById(int64 nodeId);
+extern AutoFailoverNode * ReadAutoFailoverNodeById(int64 nodeId);
 extern AutoFailoverNode * GetAutoFailoverNodeByName(char *formationId,
 													char *nodeName);
 extern AutoFailoverNode * OtherNodeInGroup(AutoFailoverNode *pgAutoFailoverNode);
@@ -216,6 +268,7 @@ extern void UpdateAutoFailoverNodeMetadata(int64 nodeid,
 										   char *nodeHost,
 										   int nodePort);
 extern void RemoveAutoFailoverNode(AutoFailoverNode *pgAutoFailoverNode);
+extern int64 GetGroupVersion(char *formationId, int groupId);
 
 
 extern SyncState SyncStateFromString(const char *pgsrSyncState);
@@ -0,0 +1,322 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_shmem_hash.c
+ *
+ * Implementation of the shared memory hash tables where we keep what the
+ * keepers and the health checks report about each node, such as the health
+ * check latency, the node_active() heartbeats, the storage health, and the
+ * replay progress of the nodes.
+ *
+ * The entries are kept per database, as the extension might be created in
+ * more than one database of the same Postgres instance: the hash key is the
+ * database oid and the node id, and each module only ever sees the entries
+ * of the current database.
+ *
+ * Each module declares a NodeShmemHash and registers it with
+ * NodeShmemHashRequest() at server start. A single shared memory startup
+ * hook then initializes all the registered tables.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "node_shmem_hash.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "nodes/execnodes.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+
+static NodeShmemHash *NodeShmemHashList = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static size_t NodeShmemHashShmemSize(NodeShmemHash *table);
+static void NodeShmemHashShmemInit(void);
+static void InitNodeShmemHashKey(NodeShmemHashKey *key,
+								 Oid databaseId, int64 nodeId);
+
+
+/*
+ * NodeShmemHashRequest, called at server start, requests the shared memory
+ * for the given table, which is then initialized at shared memory startup.
+ */
+void
+NodeShmemHashRequest(NodeShmemHash *table)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(NodeShmemHashShmemSize(table));
+	}
+
+	/* the first table installs the hook that initializes them all */
+	if (NodeShmemHashList == NULL)
+	{
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = NodeShmemHashShmemInit;
+	}
+
+	table->next = NodeShmemHashList;
+	NodeShmemHashList = table;
+}
+
+
+/*
+ * NodeShmemHashShmemSize computes how much shared memory the given table
+ * requires.
+ */
+static size_t
+NodeShmemHashShmemSize(NodeShmemHash *table)
+{
+	Size size = sizeof(NodeShmemHashControl);
+
+	size = add_size(size, hash_estimate_size(table->maxNodes,
+											 table->entrySize));
+
+	return size;
+}
+
+
+/*
+ * NodeShmemHashShmemInit initializes the requested shared memory for all the
+ * registered tables.
+ */
+static void
+NodeShmemHashShmemInit(void)
+{
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	for (NodeShmemHash *table = NodeShmemHashList;
+		 table != NULL;
+		 table = table->next)
+	{
+		bool alreadyInitialized = false;
+		char hashName[SHMEM_INDEX_KEYSIZE] = { 0 };
+		HASHCTL hashInfo;
+
+		table->control =
+			(NodeShmemHashControl *)
+			ShmemInitStruct(table->name,
+							sizeof(NodeShmemHashControl),
+							&alreadyInitialized);
+
+		if (!alreadyInitialized)
+		{
+			table->control->trancheId = LWLockNewTrancheId();
+			table->control->lockTrancheName = (char *) table->name;
+			LWLockRegisterTranche(table->control->trancheId,
+								  table->control->lockTrancheName);
+
+			LWLockInitialize(&table->control->lock,
+							 table->control->trancheId);
+		}
+
+		table->lock = &(table->control->lock);
+
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = sizeof(NodeShmemHashKey);
+		hashInfo.entrysize = table->entrySize;
+		hashInfo.hash = tag_hash;
+
+		snprintf(hashName, sizeof(hashName), "%s Hash", table->name);
+
+		table->hash =
+			ShmemInitHash(hashName,
+						  table->maxNodes,
+						  table->maxNodes,
+						  &hashInfo, HASH_ELEM | HASH_FUNCTION);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * InitNodeShmemHashKey sets the hash key of the given node, taking care of
+ * the padding bytes.
+ */
+static void
+InitNodeShmemHashKey(NodeShmemHashKey *key, Oid databaseId, int64 nodeId)
+{
+	memset(key, 0, sizeof(NodeShmemHashKey));
+
+	key->databaseId = databaseId;
+	key->nodeId = nodeId;
+}
+
+
+/*
+ * NodeShmemHashCheckLoaded errors out when the shared memory of the given
+ * table has not been initialized, because the extension is not loaded via
+ * shared_preload_libraries.
+ */
+void
+NodeShmemHashCheckLoaded(NodeShmemHash *table)
+{
+	if (table->hash == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+}
+
+
+/*
+ * NodeShmemHashFind returns the entry of the given node of the current
+ * database, or NULL when there is none. The caller must hold the lock.
+ */
+void *
+NodeShmemHashFind(NodeShmemHash *table, int64 nodeId)
+{
+	NodeShmemHashKey key;
+
+	InitNodeShmemHashKey(&key, MyDatabaseId, nodeId);
+
+	return hash_search(table->hash, &key, HASH_FIND, NULL);
+}
+
+
+/*
+ * NodeShmemHashEnter returns the entry of the given node of the current
+ * database, with everything but its key set to zero when it's new, or NULL
+ * when the hash table is full. The caller must hold the lock in exclusive
+ * mode.
+ */
+void *
+NodeShmemHashEnter(NodeShmemHash *table, int64 nodeId, bool *found)
+{
+	NodeShmemHashKey key;
+
+	InitNodeShmemHashKey(&key, MyDatabaseId, nodeId);
+
+	char *entry = hash_search(table->hash, &key, HASH_ENTER_NULL, found);
+
+	if (entry != NULL && !*found)
+	{
+		memset(entry + sizeof(NodeShmemHashKey), 0,
+			   table->entrySize - sizeof(NodeShmemHashKey));
+	}
+
+	return entry;
+}
+
+
+/*
+ * NodeShmemHashRemove forgets about a node of the current database, when the
+ * node is removed.
+ */
+void
+NodeShmemHashRemove(NodeShmemHash *table, int64 nodeId)
+{
+	NodeShmemHashKey key;
+
+	if (table->hash == NULL)
+	{
+		return;
+	}
+
+	InitNodeShmemHashKey(&key, MyDatabaseId, nodeId);
+
+	LWLockAcquire(table->lock, LW_EXCLUSIVE);
+	hash_search(table->hash, &key, HASH_REMOVE, NULL);
+	LWLockRelease(table->lock);
+}
+
+
+/*
+ * NodeShmemHashSeqInit starts a scan of the entries of the given table, see
+ * NodeShmemHashSeqSearch. The caller must hold the lock.
+ */
+void
+NodeShmemHashSeqInit(NodeShmemHash *table, HASH_SEQ_STATUS *status)
+{
+	hash_seq_init(status, table->hash);
+}
+
+
+/*
+ * NodeShmemHashSeqSearch returns the next entry of the current database, or
+ * NULL when the scan is over.
+ */
+void *
+NodeShmemHashSeqSearch(HASH_SEQ_STATUS *status)
+{
+	NodeShmemHashKey *key = NULL;
+
+	while ((key = (NodeShmemHashKey *) hash_seq_search(status)) != NULL)
+	{
+		if (key->databaseId == MyDatabaseId)
+		{
+			return key;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * NodeShmemHashBeginSRF sets up the materialized result of a set-returning
+ * function that lists the entries of the given table, and returns the tuple
+ * store where to put the rows, with the tuple descriptor to use.
+ */
+Tuplestorestate *
+NodeShmemHashBeginSRF(NodeShmemHash *table,
+					  FunctionCallInfo fcinfo,
+					  TupleDesc *tupleDescriptor)
+{
+	ReturnSetInfo *resultInfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	NodeShmemHashCheckLoaded(table);
+
+	if (resultInfo == NULL || !IsA(resultInfo, ReturnSetInfo) ||
+		!(resultInfo->allowedModes & SFRM_Materialize))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot "
+						"accept a set")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, tupleDescriptor) !=
+		TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("return type must be a row type")));
+	}
+
+	MemoryContext oldContext =
+		MemoryContextSwitchTo(resultInfo->econtext->ecxt_per_query_memory);
+
+	*tupleDescriptor = CreateTupleDescCopy(*tupleDescriptor);
+	Tuplestorestate *tupleStore = tuplestore_begin_heap(true, false, work_mem);
+
+	resultInfo->returnMode = SFRM_Materialize;
+	resultInfo->setResult = tupleStore;
+	resultInfo->setDesc = *tupleDescriptor;
+
+	MemoryContextSwitchTo(oldContext);
+
+	return tupleStore;
+}
@@ -0,0 +1,76 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/node_shmem_hash.h
+ *
+ * Declarations for the shared memory hash tables where we keep what the
+ * keepers and the health checks report about each node.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+
+/*
+ * The entries of a NodeShmemHash start with this key, see node_shmem_hash.c.
+ */
+typedef struct NodeShmemHashKey
+{
+	Oid databaseId;
+	int64 nodeId;
+} NodeShmemHashKey;
+
+typedef struct NodeShmemHashControl
+{
+	int trancheId;
+	char *lockTrancheName;
+	LWLock lock;
+} NodeShmemHashControl;
+
+/*
+ * A NodeShmemHash is declared by each module with its name, the size of its
+ * entries, and how many nodes it has room for. The rest is set when the
+ * shared memory is initialized: the lock protects the hash table, which is
+ * NULL when the extension is not loaded via shared_preload_libraries.
+ */
+typedef struct NodeShmemHash
+{
+	const char *name;
+	Size entrySize;
+	long maxNodes;
+
+	NodeShmemHashControl *control;
+	LWLock *lock;
+	HTAB *hash;
+
+	struct NodeShmemHash *next;
+} NodeShmemHash;
+
+#define make_node_shmem_hash(name, entryType, maxNodes) \
+	{ name, sizeof(entryType), maxNodes, NULL, NULL, NULL, NULL }
+
+
+extern void NodeShmemHashRequest(NodeShmemHash *table);
+extern void NodeShmemHashCheckLoaded(NodeShmemHash *table);
+extern void * NodeShmemHashFind(NodeShmemHash *table, int64 nodeId);
+extern void * NodeShmemHashEnter(NodeShmemHash *table, int64 nodeId,
+								 bool *found);
+extern void NodeShmemHashRemove(NodeShmemHash *table, int64 nodeId);
+extern void NodeShmemHashSeqInit(NodeShmemHash *table, HASH_SEQ_STATUS *status);
+extern void * NodeShmemHashSeqSearch(HASH_SEQ_STATUS *status);
+extern Tuplestorestate * NodeShmemHashBeginSRF(NodeShmemHash *table,
+											   FunctionCallInfo fcinfo,
+											   TupleDesc *tupleDescriptor);
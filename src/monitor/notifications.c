@@ -15,18 +15,107 @@
 
 #include "postgres.h"
 
+#include "event_queue.h"
+#include "failover_trace.h"
 #include "metadata.h"
 #include "node_metadata.h"
 #include "notifications.h"
 #include "replication_state.h"
+#include "state_change_wait.h"
 
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
 #include "commands/async.h"
+#include "commands/extension.h"
 #include "executor/spi.h"
+#include "pgstat.h"
+#include "storage/procarray.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
 #include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+
+/* how many days of event partitions are created ahead of time */
+#define EVENT_PARTITION_DAYS_AHEAD 2
+
+/*
+ * EventPartition describes a daily partition of the event table that is to be
+ * created.
+ */
+typedef struct EventPartition
+{
+	char *name;
+	char *lowerBound;
+	char *upperBound;
+} EventPartition;
+
+
+/* how many events we insert with a single INSERT statement, at most */
+#define EVENT_INSERT_BATCH_SIZE 100
+#define EVENT_INSERT_COLUMN_COUNT 16
+
+/* the traceid and spanduration columns are only inserted when needed */
+#define EVENT_INSERT_TRACE_COLUMN_COUNT 2
+
+/* stay well under the NOTIFY payload size limit, about 8000 bytes */
+#define STATE_NOTIFICATION_MAX_PAYLOAD 7000
+
+/*
+ * PendingStateChange is a state change that has been decided in the current
+ * transaction, and that is to be inserted in the events table and notified
+ * when the transaction commits.
+ */
+typedef struct PendingStateChange
+{
+	SubTransactionId subId;
+	AutoFailoverNode node;
+	char *description;
+	char *payload;              /* JSON object sent in the notification */
+	TimestampTz eventTime;
+	bool durable;               /* never goes through the event queue */
+
+	/* the failover trace of the group, and the duration of this step */
+	char *traceId;
+	bool hasSpan;
+	int64 spanDurationUs;
+} PendingStateChange;
+
+
+/* GUC variable: how long we keep events (in minutes), 0 keeps them all */
+int EventRetention = 0;
+
+/* state changes of the current transaction, in TopTransactionContext */
+static List *PendingStateChangeList = NIL;
+
+
+static void NotificationsXactCallback(XactEvent event, void *arg);
+static void NotificationsSubXactCallback(SubXactEvent event,
+										 SubTransactionId mySubid,
+										 SubTransactionId parentSubid,
+										 void *arg);
+static void RegisterStateChange(AutoFailoverNode *node, char *description,
+								const char *traceId, bool hasSpan,
+								TimestampTz spanStartTime,
+								const char *synchronousStandbyNames);
+static bool StateChangeIsDurable(AutoFailoverNode *node);
+static void FlushPendingStateChanges(void);
+static void NotifyPendingStateChanges(List *stateChangeList);
+static void NotifyGroupStateChanges(AutoFailoverNode *node, List *payloadList);
+static void SendStateNotification(char *groupChannel, StringInfo payload,
+								  int payloadCount, char *lastObject);
+static void InsertEvents(List *stateChangeList);
+static PendingStateChange * EventQueueEntryToStateChange(EventQueueEntry *entry);
+static void CreateEventPartitions(void);
+static void DropExpiredEventPartitions(void);
+static void DeleteExpiredEvents(const char *relationName);
 
 
 /*
@@ -61,19 +150,111 @@ LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...)
 
 
 /*
- * NotifyStateChange emits a notification message on the CHANNEL_STATE channel
- * about a state change decided by the monitor. This state change is encoded so
- * as to be easy to parse by a machine.
+ * InitializeNotifications registers the transaction callbacks that flush the
+ * state change notifications of a transaction at commit time.
  */
-int64
+void
+InitializeNotifications(void)
+{
+	RegisterXactCallback(NotificationsXactCallback, NULL);
+	RegisterSubXactCallback(NotificationsSubXactCallback, NULL);
+}
+
+
+/*
+ * NotifyStateChange registers a state change decided by the monitor, to be
+ * inserted in the events table and notified on the CHANNEL_STATE channel and
+ * on the channel of the node's group. This state change is encoded so as to
+ * be easy to parse by a machine.
+ *
+ * A single call to node_active or to a failover API may assign states to
+ * several nodes. The state changes are buffered until commit time, where all
+ * the events of the transaction are inserted in a single statement, and the
+ * keepers receive a single notification per group with the last known state
+ * of each node.
+ *
+ * When the group is failing over, the state change has the id of the
+ * failover trace, see failover_trace.c.
+ */
+void
 NotifyStateChange(AutoFailoverNode *node, char *description)
 {
+	char *traceId = GetFailoverTraceId(node->formationId, node->groupId);
+
+	RegisterStateChange(node, description, traceId, false, 0, NULL);
+}
+
+
+/*
+ * NotifyStateChangeSpan registers a state change that ends a step of the
+ * given failover trace, which started at spanStartTime. The duration of the
+ * step is inserted in the spanduration column of the event.
+ */
+void
+NotifyStateChangeSpan(AutoFailoverNode *node, char *description,
+					  const char *traceId, TimestampTz spanStartTime)
+{
+	RegisterStateChange(node, description, traceId, true, spanStartTime, NULL);
+}
+
+
+/*
+ * NotifySettingsChange registers a notification for the given node, in its
+ * current state, with the synchronous_standby_names value that the keeper
+ * should apply right away. The keeper of a primary node then reloads its
+ * configuration without going through the apply_settings state.
+ */
+void
+NotifySettingsChange(AutoFailoverNode *node, char *description,
+					 const char *synchronousStandbyNames)
+{
+	char *traceId = GetFailoverTraceId(node->formationId, node->groupId);
+
+	RegisterStateChange(node, description, traceId, false, 0,
+						synchronousStandbyNames);
+}
+
+
+/*
+ * RegisterStateChange adds a state change to the list of the state changes
+ * of the current transaction. When synchronousStandbyNames is not NULL, it
+ * is added to the notification payload.
+ */
+static void
+RegisterStateChange(AutoFailoverNode *node, char *description,
+					const char *traceId, bool hasSpan,
+					TimestampTz spanStartTime,
+					const char *synchronousStandbyNames)
+{
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+	PendingStateChange *stateChange = palloc0(sizeof(PendingStateChange));
 	StringInfo payload = makeStringInfo();
 
-	/*
-	 * Insert the event in our events table.
-	 */
-	int64 eventid = InsertEvent(node, description);
+	stateChange->subId = GetCurrentSubTransactionId();
+
+	/* copy the node, its strings are owned by the caller */
+	stateChange->node = *node;
+	stateChange->node.formationId = pstrdup(node->formationId);
+	stateChange->node.nodeName = pstrdup(node->nodeName);
+	stateChange->node.nodeHost = pstrdup(node->nodeHost);
+	stateChange->node.nodeCluster = NULL;
+	stateChange->description = pstrdup(description);
+	stateChange->eventTime = GetCurrentTransactionStartTimestamp();
+	stateChange->durable = StateChangeIsDurable(node);
+
+	/* the event queue does not have the trace columns */
+	if (traceId != NULL)
+	{
+		stateChange->traceId = pstrdup(traceId);
+		stateChange->durable = true;
+
+		if (hasSpan)
+		{
+			stateChange->hasSpan = true;
+			stateChange->spanDurationUs =
+				Max(stateChange->eventTime - spanStartTime, 0);
+		}
+	}
 
 	/* build a json object from the notification pieces */
 	appendStringInfoChar(payload, '{');
@@ -103,92 +284,900 @@ NotifyStateChange(AutoFailoverNode *node, char *description)
 	appendStringInfo(payload, ", \"health\":");
 	escape_json(payload, NodeHealthToString(node->health));
 
+	if (traceId != NULL)
+	{
+		appendStringInfo(payload, ", \"traceId\": ");
+		escape_json(payload, traceId);
+	}
+
+	if (synchronousStandbyNames != NULL)
+	{
+		appendStringInfo(payload, ", \"synchronousStandbyNames\": ");
+		escape_json(payload, synchronousStandbyNames);
+	}
+
 	appendStringInfoChar(payload, '}');
 
-	Async_Notify(CHANNEL_STATE, payload->data);
+	stateChange->payload = payload->data;
+
+	PendingStateChangeList = lappend(PendingStateChangeList, stateChange);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * StateChangeIsDurable returns true for the state changes that are steps of
+ * a failover or a switchover. Their events are always inserted by the
+ * transaction that decides them, so that the event table keeps the history
+ * of every failover even when the monitor restarts before the event queue
+ * has been drained.
+ */
+static bool
+StateChangeIsDurable(AutoFailoverNode *node)
+{
+	switch (node->goalState)
+	{
+		case REPLICATION_STATE_DRAINING:
+		case REPLICATION_STATE_DEMOTE_TIMEOUT:
+		case REPLICATION_STATE_DEMOTED:
+		case REPLICATION_STATE_PREPARE_PROMOTION:
+		case REPLICATION_STATE_STOP_REPLICATION:
+		{
+			return true;
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
+
+
+/*
+ * NotificationsXactCallback flushes the pending state changes right before
+ * commit, while we can still run queries, and forgets about them at the end
+ * of the transaction.
+ */
+static void
+NotificationsXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+		{
+			FlushPendingStateChanges();
+			break;
+		}
+
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+		{
+			/* the list is allocated in TopTransactionContext */
+			PendingStateChangeList = NIL;
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * NotificationsSubXactCallback forgets about the state changes registered in
+ * a subtransaction that aborts, and hands over the state changes of a
+ * subtransaction that commits to its parent.
+ */
+static void
+NotificationsSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+							 SubTransactionId parentSubid, void *arg)
+{
+	ListCell *stateChangeCell = NULL;
+	List *keptStateChangeList = NIL;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_ABORT_SUB:
+		{
+			MemoryContext oldContext =
+				MemoryContextSwitchTo(TopTransactionContext);
+
+			foreach(stateChangeCell, PendingStateChangeList)
+			{
+				PendingStateChange *stateChange =
+					(PendingStateChange *) lfirst(stateChangeCell);
+
+				if (stateChange->subId < mySubid)
+				{
+					keptStateChangeList =
+						lappend(keptStateChangeList, stateChange);
+				}
+			}
+
+			PendingStateChangeList = keptStateChangeList;
+
+			MemoryContextSwitchTo(oldContext);
+			break;
+		}
+
+		case SUBXACT_EVENT_COMMIT_SUB:
+		{
+			foreach(stateChangeCell, PendingStateChangeList)
+			{
+				PendingStateChange *stateChange =
+					(PendingStateChange *) lfirst(stateChangeCell);
+
+				if (stateChange->subId >= mySubid)
+				{
+					stateChange->subId = parentSubid;
+				}
+			}
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * FlushPendingStateChanges inserts all the pending events in the events table
+ * and then sends a notification per group with the last state of each node
+ * that changed in this transaction.
+ *
+ * When pgautofailover.event_queue_size is set, the events that are not
+ * durable are added to the event queue instead, and inserted later by the
+ * group state scheduler. The events that don't fit in the queue are inserted
+ * here.
+ */
+static void
+FlushPendingStateChanges(void)
+{
+	List *stateChangeList = PendingStateChangeList;
+	ListCell *stateChangeCell = NULL;
+	List *batchList = NIL;
+
+	if (stateChangeList == NIL)
+	{
+		return;
+	}
+
+	/* make sure we don't flush twice, even if we fail here */
+	PendingStateChangeList = NIL;
+
+	foreach(stateChangeCell, stateChangeList)
+	{
+		PendingStateChange *stateChange =
+			(PendingStateChange *) lfirst(stateChangeCell);
+
+		if (!stateChange->durable &&
+			EnqueueEvent(&(stateChange->node),
+						 stateChange->description,
+						 stateChange->eventTime))
+		{
+			continue;
+		}
+
+		batchList = lappend(batchList, stateChange);
+
+		if (list_length(batchList) == EVENT_INSERT_BATCH_SIZE)
+		{
+			InsertEvents(batchList);
+			list_free(batchList);
+			batchList = NIL;
+		}
+	}
+
+	if (batchList != NIL)
+	{
+		InsertEvents(batchList);
+		list_free(batchList);
+	}
+
+	NotifyPendingStateChanges(stateChangeList);
+}
+
+
+/*
+ * NotifyPendingStateChanges sends the notifications for the given list of
+ * pending state changes. Notifications are grouped by formation and group,
+ * and only the last state change of each node is sent.
+ *
+ * When a group has a single node to notify about, the notification payload is
+ * the JSON object of that node, as it has always been. Otherwise the payload
+ * is a JSON array of such objects, split into several notifications if needed
+ * to fit in the NOTIFY payload size limit.
+ */
+static void
+NotifyPendingStateChanges(List *stateChangeList)
+{
+	ListCell *stateChangeCell = NULL;
+	int stateChangeCount = list_length(stateChangeList);
+	bool *notified = (bool *) palloc0(stateChangeCount * sizeof(bool));
+	int index = 0;
+
+	foreach(stateChangeCell, stateChangeList)
+	{
+		PendingStateChange *groupChange =
+			(PendingStateChange *) lfirst(stateChangeCell);
+		List *groupPayloadList = NIL;
+		ListCell *otherCell = NULL;
+		int otherIndex = 0;
+
+		if (notified[index++])
+		{
+			continue;
+		}
+
+		/* collect the last state change of every node in the same group */
+		foreach(otherCell, stateChangeList)
+		{
+			PendingStateChange *stateChange =
+				(PendingStateChange *) lfirst(otherCell);
+			bool isLastChangeOfNode = true;
+
+			if (notified[otherIndex] ||
+				stateChange->node.groupId != groupChange->node.groupId ||
+				strcmp(stateChange->node.formationId,
+					   groupChange->node.formationId) != 0)
+			{
+				otherIndex++;
+				continue;
+			}
+
+			notified[otherIndex++] = true;
+
+			for (int laterIndex = otherIndex;
+				 laterIndex < stateChangeCount;
+				 laterIndex++)
+			{
+				PendingStateChange *laterChange =
+					(PendingStateChange *) list_nth(stateChangeList, laterIndex);
+
+				if (laterChange->node.nodeId == stateChange->node.nodeId)
+				{
+					isLastChangeOfNode = false;
+					break;
+				}
+			}
+
+			if (isLastChangeOfNode)
+			{
+				groupPayloadList =
+					lappend(groupPayloadList, stateChange->payload);
+			}
+		}
+
+		NotifyGroupStateChanges(&(groupChange->node), groupPayloadList);
+
+		list_free(groupPayloadList);
+	}
+
+	pfree(notified);
+}
+
+
+/*
+ * NotifyGroupStateChanges sends the given JSON objects as notifications on the
+ * CHANNEL_STATE channel and on the channel of the group of the given node.
+ */
+static void
+NotifyGroupStateChanges(AutoFailoverNode *node, List *payloadList)
+{
+	ListCell *payloadCell = NULL;
+	StringInfo payload = makeStringInfo();
+	int payloadCount = 0;
+	char *lastObject = NULL;
+
+	/* channel names are identifiers, skip the group channel when too long */
+	char *groupChannel = psprintf(CHANNEL_STATE_GROUP_FORMAT,
+								  node->formationId, node->groupId);
+
+	if (strlen(groupChannel) >= NAMEDATALEN)
+	{
+		pfree(groupChannel);
+		groupChannel = NULL;
+	}
+
+	foreach(payloadCell, payloadList)
+	{
+		char *object = (char *) lfirst(payloadCell);
+
+		if (payloadCount > 0 &&
+			payload->len + strlen(object) + 2 > STATE_NOTIFICATION_MAX_PAYLOAD)
+		{
+			SendStateNotification(groupChannel, payload, payloadCount,
+								  lastObject);
+			resetStringInfo(payload);
+			payloadCount = 0;
+		}
+
+		appendStringInfoString(payload, payloadCount == 0 ? "[" : ", ");
+		appendStringInfoString(payload, object);
+
+		lastObject = object;
+		payloadCount++;
+	}
+
+	if (payloadCount > 0)
+	{
+		SendStateNotification(groupChannel, payload, payloadCount, lastObject);
+	}
+
+	/* also wake up the keepers that wait on the group without LISTEN */
+	RegisterGroupStateChange(node->formationId, node->groupId);
+
+	if (groupChannel != NULL)
+	{
+		pfree(groupChannel);
+	}
 
 	pfree(payload->data);
 	pfree(payload);
-	return eventid;
 }
 
 
 /*
- * InsertEvent populates the monitor's pgautofailover.event table with a new
- * entry, and returns the id of the new event.
+ * SendStateNotification sends the JSON array being built in the given payload
+ * on the CHANNEL_STATE channel and on the given group channel, when not NULL.
+ * An array of a single object is sent as the object itself.
  */
-int64
-InsertEvent(AutoFailoverNode *node, char *description)
+static void
+SendStateNotification(char *groupChannel, StringInfo payload,
+					  int payloadCount, char *lastObject)
 {
-	Oid goalStateOid = ReplicationStateGetEnum(node->goalState);
-	Oid reportedStateOid = ReplicationStateGetEnum(node->reportedState);
+	char *message = lastObject;
+
+	if (payloadCount > 1)
+	{
+		appendStringInfoChar(payload, ']');
+		message = payload->data;
+	}
+
+	Async_Notify(CHANNEL_STATE, message);
+
+	if (groupChannel != NULL)
+	{
+		Async_Notify(groupChannel, message);
+	}
+}
+
+
+/*
+ * InsertEvents populates the monitor's pgautofailover.event table with the
+ * given list of pending state changes, using a single INSERT statement.
+ *
+ * The traceid and spanduration columns are only part of the INSERT when one
+ * of the state changes belongs to a failover trace, so that the events are
+ * still inserted while the extension is being updated from an older version.
+ */
+static void
+InsertEvents(List *stateChangeList)
+{
+	ListCell *stateChangeCell = NULL;
 	Oid replicationStateTypeOid = ReplicationStateTypeOid();
+	int rowCount = list_length(stateChangeList);
+	int columnCount =
+		EVENT_INSERT_COLUMN_COUNT - EVENT_INSERT_TRACE_COLUMN_COUNT;
+	StringInfo insertQuery = makeStringInfo();
+	int argIndex = 0;
+
+	foreach(stateChangeCell, stateChangeList)
+	{
+		PendingStateChange *stateChange =
+			(PendingStateChange *) lfirst(stateChangeCell);
+
+		if (stateChange->traceId != NULL)
+		{
+			columnCount = EVENT_INSERT_COLUMN_COUNT;
+			break;
+		}
+	}
+
+	int argCount = rowCount * columnCount;
+	Oid *argTypes = (Oid *) palloc0(argCount * sizeof(Oid));
+	Datum *argValues = (Datum *) palloc0(argCount * sizeof(Datum));
+	char *argNulls = (char *) palloc0((argCount + 1) * sizeof(char));
+
+	appendStringInfo(insertQuery,
+					 "INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
+					 "(formationid, nodeid, groupid, nodename, nodehost, nodeport,"
+					 " reportedstate, goalstate, reportedrepstate, reportedlsn,"
+					 " candidatepriority, replicationquorum, description,"
+					 " eventtime%s) "
+					 "VALUES ",
+					 columnCount == EVENT_INSERT_COLUMN_COUNT
+					 ? ", traceid, spanduration" : "");
+
+	foreach(stateChangeCell, stateChangeList)
+	{
+		PendingStateChange *stateChange =
+			(PendingStateChange *) lfirst(stateChangeCell);
+		AutoFailoverNode *node = &(stateChange->node);
+
+		Oid goalStateOid = ReplicationStateGetEnum(node->goalState);
+		Oid reportedStateOid = ReplicationStateGetEnum(node->reportedState);
+
+		Interval *spanDuration = (Interval *) palloc0(sizeof(Interval));
+		spanDuration->time = stateChange->spanDurationUs;
+
+		Oid rowArgTypes[] = {
+			TEXTOID, /* formationid */
+			INT8OID, /* nodeid */
+			INT4OID, /* groupid */
+			TEXTOID, /* nodename */
+			TEXTOID, /* nodehost */
+			INT4OID, /* nodeport */
+			replicationStateTypeOid, /* reportedstate */
+			replicationStateTypeOid, /* goalstate */
+			TEXTOID, /* pg_stat_replication.sync_state */
+			LSNOID,  /* reportedLSN */
+			INT4OID, /* candidate_priority */
+			BOOLOID, /* replication_quorum */
+			TEXTOID, /* description */
+			TIMESTAMPTZOID, /* eventtime */
+			TEXTOID, /* traceid */
+			INTERVALOID /* spanduration */
+		};
+
+		Datum rowArgValues[] = {
+			CStringGetTextDatum(node->formationId),   /* formationid */
+			Int64GetDatum(node->nodeId),              /* nodeid */
+			Int32GetDatum(node->groupId),             /* groupid */
+			CStringGetTextDatum(node->nodeName),      /* nodename */
+			CStringGetTextDatum(node->nodeHost),      /* nodehost */
+			Int32GetDatum(node->nodePort),            /* nodeport */
+			ObjectIdGetDatum(reportedStateOid), /* reportedstate */
+			ObjectIdGetDatum(goalStateOid),     /* goalstate */
+			CStringGetTextDatum(SyncStateToString(node->pgsrSyncState)), /* sync_state */
+			LSNGetDatum(node->reportedLSN),           /* reportedLSN */
+			Int32GetDatum(node->candidatePriority),   /* candidate_priority */
+			BoolGetDatum(node->replicationQuorum),    /* replication_quorum */
+			CStringGetTextDatum(stateChange->description), /* description */
+			TimestampTzGetDatum(stateChange->eventTime), /* eventtime */
+			stateChange->traceId == NULL ? (Datum) 0 :
+			CStringGetTextDatum(stateChange->traceId), /* traceid */
+			IntervalPGetDatum(spanDuration) /* spanduration */
+		};
+
+		char rowArgNulls[] = {
+			' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+			stateChange->traceId == NULL ? 'n' : ' ', /* traceid */
+			stateChange->hasSpan ? ' ' : 'n' /* spanduration */
+		};
+
+		StaticAssertStmt(lengthof(rowArgValues) == EVENT_INSERT_COLUMN_COUNT,
+						 "EVENT_INSERT_COLUMN_COUNT does not match the INSERT");
+		StaticAssertStmt(lengthof(rowArgNulls) == EVENT_INSERT_COLUMN_COUNT,
+						 "EVENT_INSERT_COLUMN_COUNT does not match the INSERT");
+
+		appendStringInfoString(insertQuery, argIndex == 0 ? "(" : ", (");
+
+		for (int column = 0; column < columnCount; column++)
+		{
+			argTypes[argIndex] = rowArgTypes[column];
+			argValues[argIndex] = rowArgValues[column];
+			argNulls[argIndex] = rowArgNulls[column];
+			argIndex++;
+
+			appendStringInfo(insertQuery, "%s$%d",
+							 column == 0 ? "" : ", ", argIndex);
+		}
+
+		appendStringInfoChar(insertQuery, ')');
+	}
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(insertQuery->data,
+										  argCount, argTypes, argValues,
+										  argNulls, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into " AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	SPI_finish();
+
+	pfree(insertQuery->data);
+	pfree(insertQuery);
+	pfree(argTypes);
+	pfree(argValues);
+	pfree(argNulls);
+}
+
+
+/*
+ * DrainEventQueue inserts the queued events of the current database in the
+ * event table, in batches, for the transactions that have committed. The
+ * events of the transactions that aborted are skipped, and we stop at the
+ * first event of a transaction that is still in progress.
+ *
+ * This function runs its own transactions, and is meant to be called from
+ * the group state scheduler background worker.
+ */
+void
+DrainEventQueue(void)
+{
+	EventQueueEntry *entries =
+		(EventQueueEntry *) palloc(EVENT_INSERT_BATCH_SIZE *
+								   sizeof(EventQueueEntry));
+	int doneCount = EVENT_INSERT_BATCH_SIZE;
+
+	while (doneCount == EVENT_INSERT_BATCH_SIZE)
+	{
+		int entryCount = EventQueuePeek(entries, EVENT_INSERT_BATCH_SIZE);
+		List *stateChangeList = NIL;
+
+		if (entryCount == 0)
+		{
+			break;
+		}
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+
+		for (doneCount = 0; doneCount < entryCount; doneCount++)
+		{
+			EventQueueEntry *entry = &(entries[doneCount]);
+
+			if (TransactionIdIsInProgress(entry->xid))
+			{
+				break;
+			}
+
+			if (TransactionIdDidCommit(entry->xid))
+			{
+				stateChangeList =
+					lappend(stateChangeList,
+							EventQueueEntryToStateChange(entry));
+			}
+		}
+
+		/* the events are removed first, so that a failed INSERT is not retried */
+		EventQueueRemove(doneCount);
+
+		if (stateChangeList != NIL &&
+			OidIsValid(get_extension_oid(AUTO_FAILOVER_EXTENSION_NAME, true)))
+		{
+			pgstat_report_activity(STATE_RUNNING,
+								   "INSERT INTO " AUTO_FAILOVER_EVENT_TABLE);
+
+			InsertEvents(stateChangeList);
+		}
+
+		pgstat_report_activity(STATE_IDLE, NULL);
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+
+	pfree(entries);
+}
+
+
+/*
+ * EventQueueEntryToStateChange returns a pending state change for the given
+ * event queue entry, suitable for InsertEvents. The strings are not copied.
+ */
+static PendingStateChange *
+EventQueueEntryToStateChange(EventQueueEntry *entry)
+{
+	PendingStateChange *stateChange = palloc0(sizeof(PendingStateChange));
+	AutoFailoverNode *node = &(stateChange->node);
+
+	node->formationId = entry->formationId;
+	node->nodeId = entry->nodeId;
+	node->groupId = entry->groupId;
+	node->nodeName = entry->nodeName;
+	node->nodeHost = entry->nodeHost;
+	node->nodePort = entry->nodePort;
+	node->goalState = entry->goalState;
+	node->reportedState = entry->reportedState;
+	node->pgsrSyncState = entry->pgsrSyncState;
+	node->reportedLSN = entry->reportedLSN;
+	node->candidatePriority = entry->candidatePriority;
+	node->replicationQuorum = entry->replicationQuorum;
+
+	stateChange->description = entry->description;
+	stateChange->eventTime = entry->eventTime;
+
+	return stateChange;
+}
+
+
+/*
+ * MaintainEventTable creates the upcoming daily partitions of the event table
+ * and removes the events that are older than pgautofailover.event_retention,
+ * by dropping whole partitions when possible. On Postgres 10 the event table
+ * is not partitioned, and we DELETE the expired events instead.
+ *
+ * This function runs its own transaction, and is meant to be called from the
+ * health check background worker.
+ */
+void
+MaintainEventTable(void)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+
+	Oid namespaceId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+	Oid eventRelationId = InvalidOid;
+
+	if (OidIsValid(namespaceId))
+	{
+		eventRelationId = get_relname_relid("event", namespaceId);
+	}
+
+	if (OidIsValid(eventRelationId))
+	{
+		if (get_rel_relkind(eventRelationId) == RELKIND_PARTITIONED_TABLE)
+		{
+			CreateEventPartitions();
+
+			if (EventRetention > 0)
+			{
+				DropExpiredEventPartitions();
+				DeleteExpiredEvents(AUTO_FAILOVER_EVENT_TABLE "_default");
+			}
+		}
+		else if (EventRetention > 0)
+		{
+			DeleteExpiredEvents(AUTO_FAILOVER_EVENT_TABLE);
+		}
+	}
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+}
+
+
+/*
+ * CreateEventPartitions creates the daily partitions of the event table for
+ * today and the next EVENT_PARTITION_DAYS_AHEAD days, when they do not exist
+ * already. Partition bounds are computed in UTC.
+ *
+ * A partition can not be created when the default partition already contains
+ * events in its range, in that case we skip it: those events will be removed
+ * from the default partition by the retention policy.
+ */
+static void
+CreateEventPartitions(void)
+{
+	List *partitionList = NIL;
+	ListCell *partitionCell = NULL;
 
 	Oid argTypes[] = {
-		TEXTOID, /* formationid */
-		INT8OID, /* nodeid */
-		INT4OID, /* groupid */
-		TEXTOID, /* nodename */
-		TEXTOID, /* nodehost */
-		INT4OID, /* nodeport */
-		replicationStateTypeOid, /* reportedstate */
-		replicationStateTypeOid, /* goalstate */
-		TEXTOID, /* pg_stat_replication.sync_state */
-		LSNOID,  /* reportedLSN */
-		INT4OID, /* candidate_priority */
-		BOOLOID, /* replication_quorum */
-		TEXTOID  /* description */
+		INT4OID                 /* days ahead */
 	};
 
 	Datum argValues[] = {
-		CStringGetTextDatum(node->formationId),   /* formationid */
-		Int64GetDatum(node->nodeId),              /* nodeid */
-		Int32GetDatum(node->groupId),             /* groupid */
-		CStringGetTextDatum(node->nodeName),      /* nodename */
-		CStringGetTextDatum(node->nodeHost),      /* nodehost */
-		Int32GetDatum(node->nodePort),            /* nodeport */
-		ObjectIdGetDatum(reportedStateOid), /* reportedstate */
-		ObjectIdGetDatum(goalStateOid),     /* goalstate */
-		CStringGetTextDatum(SyncStateToString(node->pgsrSyncState)), /* sync_state */
-		LSNGetDatum(node->reportedLSN),           /* reportedLSN */
-		Int32GetDatum(node->candidatePriority),   /* candidate_priority */
-		BoolGetDatum(node->replicationQuorum),    /* replication_quorum */
-		CStringGetTextDatum(description)          /* description */
+		Int32GetDatum(EVENT_PARTITION_DAYS_AHEAD)   /* days ahead */
 	};
 
 	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
-	int64 eventId = 0;
 
-	const char *insertQuery =
-		"INSERT INTO " AUTO_FAILOVER_EVENT_TABLE
-		"(formationid, nodeid, groupid, nodename, nodehost, nodeport,"
-		" reportedstate, goalstate, reportedrepstate, reportedlsn,"
-		" candidatepriority, replicationquorum, description) "
-		"VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13) "
-		"RETURNING eventid";
+	const char *selectQuery =
+		"SELECT 'event_p' || to_char(d, 'YYYYMMDD'), "
+		"       to_char(d, 'YYYY-MM-DD') || ' 00:00:00+00', "
+		"       to_char(d + interval '1 day', 'YYYY-MM-DD') || ' 00:00:00+00' "
+		"  FROM generate_series(date_trunc('day', now() AT TIME ZONE 'UTC'), "
+		"                       date_trunc('day', now() AT TIME ZONE 'UTC') "
+		"                       + $1 * interval '1 day', "
+		"                       interval '1 day') AS d "
+		" WHERE to_regclass('" AUTO_FAILOVER_SCHEMA_NAME ".event_p' "
+		"                   || to_char(d, 'YYYYMMDD')) IS NULL";
 
-	SPI_connect();
+	pgstat_report_activity(STATE_RUNNING, selectQuery);
 
-	int spiStatus = SPI_execute_with_args(insertQuery, argCount, argTypes,
-										  argValues, NULL, false, 0);
+	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes,
+										  argValues, NULL, true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not list partitions of " AUTO_FAILOVER_EVENT_TABLE);
+	}
 
-	if (spiStatus == SPI_OK_INSERT_RETURNING && SPI_processed > 0)
+	/* copy the results out of SPI_tuptable, we run more queries next */
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
 	{
-		bool isNull = false;
+		HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+		TupleDesc tupleDesc = SPI_tuptable->tupdesc;
+		EventPartition *partition = palloc0(sizeof(EventPartition));
 
-		Datum eventIdDatum = SPI_getbinval(SPI_tuptable->vals[0],
-										   SPI_tuptable->tupdesc,
-										   1,
-										   &isNull);
+		partition->name = SPI_getvalue(heapTuple, tupleDesc, 1);
+		partition->lowerBound = SPI_getvalue(heapTuple, tupleDesc, 2);
+		partition->upperBound = SPI_getvalue(heapTuple, tupleDesc, 3);
 
-		eventId = DatumGetInt64(eventIdDatum);
+		partitionList = lappend(partitionList, partition);
 	}
-	else
+
+	foreach(partitionCell, partitionList)
 	{
-		elog(ERROR, "could not insert into " AUTO_FAILOVER_EVENT_TABLE);
+		EventPartition *partition = (EventPartition *) lfirst(partitionCell);
+
+		Oid rangeArgTypes[] = {
+			TEXTOID,            /* lower bound */
+			TEXTOID             /* upper bound */
+		};
+
+		Datum rangeArgValues[] = {
+			CStringGetTextDatum(partition->lowerBound), /* lower bound */
+			CStringGetTextDatum(partition->upperBound)  /* upper bound */
+		};
+
+		const int rangeArgCount =
+			sizeof(rangeArgValues) / sizeof(rangeArgValues[0]);
+
+		const char *defaultQuery =
+			"SELECT 1 FROM " AUTO_FAILOVER_EVENT_TABLE "_default "
+			" WHERE eventtime >= $1::timestamptz "
+			"   AND eventtime < $2::timestamptz "
+			" LIMIT 1";
+
+		spiStatus = SPI_execute_with_args(defaultQuery,
+										  rangeArgCount, rangeArgTypes,
+										  rangeArgValues, NULL, true, 1);
+
+		if (spiStatus != SPI_OK_SELECT)
+		{
+			elog(ERROR, "could not check the default partition of "
+						AUTO_FAILOVER_EVENT_TABLE);
+		}
+
+		if (SPI_processed > 0)
+		{
+			elog(DEBUG1,
+				 "skipping creation of events partition \"%s\": the default "
+				 "partition already contains events in its range",
+				 partition->name);
+			continue;
+		}
+
+		char *createCommand =
+			psprintf("CREATE TABLE %s.%s PARTITION OF " AUTO_FAILOVER_EVENT_TABLE
+					 " FOR VALUES FROM (%s) TO (%s)",
+					 quote_identifier(AUTO_FAILOVER_SCHEMA_NAME),
+					 quote_identifier(partition->name),
+					 quote_literal_cstr(partition->lowerBound),
+					 quote_literal_cstr(partition->upperBound));
+
+		pgstat_report_activity(STATE_RUNNING, createCommand);
+
+		spiStatus = SPI_execute(createCommand, false, 0);
+
+		if (spiStatus != SPI_OK_UTILITY)
+		{
+			elog(ERROR, "could not create events partition \"%s\"",
+				 partition->name);
+		}
 	}
+}
 
-	SPI_finish();
 
-	return eventId;
+/*
+ * DropExpiredEventPartitions drops the daily partitions of the event table
+ * that only contain events older than pgautofailover.event_retention.
+ */
+static void
+DropExpiredEventPartitions(void)
+{
+	List *partitionNameList = NIL;
+	ListCell *partitionNameCell = NULL;
+
+	Oid argTypes[] = {
+		INT4OID                 /* retention, in minutes */
+	};
+
+	Datum argValues[] = {
+		Int32GetDatum(EventRetention)   /* retention, in minutes */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *selectQuery =
+		"SELECT c.relname "
+		"  FROM pg_catalog.pg_inherits i "
+		"  JOIN pg_catalog.pg_class c ON c.oid = i.inhrelid "
+		" WHERE i.inhparent = '" AUTO_FAILOVER_EVENT_TABLE "'::regclass "
+		"   AND c.relname ~ '^event_p[0-9]{8}$' "
+		"   AND to_date(substr(c.relname, 8), 'YYYYMMDD') + 1 "
+		"       <= (now() - $1 * interval '1 min') AT TIME ZONE 'UTC' "
+		" ORDER BY c.relname";
+
+	pgstat_report_activity(STATE_RUNNING, selectQuery);
+
+	int spiStatus = SPI_execute_with_args(selectQuery, argCount, argTypes,
+										  argValues, NULL, true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not list partitions of " AUTO_FAILOVER_EVENT_TABLE);
+	}
+
+	for (uint64 rowNumber = 0; rowNumber < SPI_processed; rowNumber++)
+	{
+		char *partitionName = SPI_getvalue(SPI_tuptable->vals[rowNumber],
+										   SPI_tuptable->tupdesc, 1);
+
+		partitionNameList = lappend(partitionNameList, partitionName);
+	}
+
+	foreach(partitionNameCell, partitionNameList)
+	{
+		char *partitionName = (char *) lfirst(partitionNameCell);
+		char *dropCommand =
+			psprintf("DROP TABLE %s.%s",
+					 quote_identifier(AUTO_FAILOVER_SCHEMA_NAME),
+					 quote_identifier(partitionName));
+
+		ereport(LOG,
+				(errmsg("dropping expired events partition \"%s\"",
+						partitionName)));
+
+		pgstat_report_activity(STATE_RUNNING, dropCommand);
+
+		spiStatus = SPI_execute(dropCommand, false, 0);
+
+		if (spiStatus != SPI_OK_UTILITY)
+		{
+			elog(ERROR, "could not drop events partition \"%s\"",
+				 partitionName);
+		}
+	}
+}
+
+
+/*
+ * DeleteExpiredEvents deletes the events older than
+ * pgautofailover.event_retention from the given relation.
+ */
+static void
+DeleteExpiredEvents(const char *relationName)
+{
+	Oid argTypes[] = {
+		INT4OID                 /* retention, in minutes */
+	};
+
+	Datum argValues[] = {
+		Int32GetDatum(EventRetention)   /* retention, in minutes */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	char *deleteQuery =
+		psprintf("DELETE FROM %s WHERE eventtime < now() - $1 * interval '1 min'",
+				 relationName);
+
+	pgstat_report_activity(STATE_RUNNING, deleteQuery);
+
+	int spiStatus = SPI_execute_with_args(deleteQuery, argCount, argTypes,
+										  argValues, NULL, false, 0);
+
+	if (spiStatus != SPI_OK_DELETE)
+	{
+		elog(ERROR, "could not delete expired events from %s", relationName);
+	}
+
+	if (SPI_processed > 0)
+	{
+		elog(DEBUG1, "deleted " UINT64_FORMAT " expired events from %s",
+			 (uint64) SPI_processed, relationName);
+	}
 }
@@ -26,18 +26,33 @@
  * - the "state" channel is used when a node's state is assigned to something
  *   new
  *
+ * - the "state.<formation>.<group>" channels receive the same messages as the
+ *   "state" channel, only for the nodes of a given group, so that keepers can
+ *   subscribe to the changes in their own group only
+ *
  * - the "log" channel is used to duplicate message that are sent to the
  *   PostgreSQL logs, in order for a pg_auto_failover monitor client to subscribe to
  *   the chatter without having to actually have the privileges to tail the
  *   PostgreSQL server logs.
  */
 #define CHANNEL_STATE "state"
+#define CHANNEL_STATE_GROUP_FORMAT CHANNEL_STATE ".%s.%d"
 #define CHANNEL_LOG "log"
 #define BUFSIZE 8192
 
 
+/* GUC variable: how long events are kept (in minutes), 0 keeps them all */
+extern int EventRetention;
+
+
 void LogAndNotifyMessage(char *message, size_t size, const char *fmt, ...) __attribute__(
 	(format(printf, 3, 4)));
 
-int64 NotifyStateChange(AutoFailoverNode *node, char *description);
-int64 InsertEvent(AutoFailoverNode *node, char *description);
+void InitializeNotifications(void);
+void NotifyStateChange(AutoFailoverNode *node, char *description);
+void NotifyStateChangeSpan(AutoFailoverNode *node, char *description,
+						   const char *traceId, TimestampTz spanStartTime);
+void NotifySettingsChange(AutoFailoverNode *node, char *description,
+						  const char *synchronousStandbyNames);
+void MaintainEventTable(void);
+void DrainEventQueue(void);
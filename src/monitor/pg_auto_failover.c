@@ -13,9 +13,26 @@
 #include "postgres.h"
 
 /* these are internal headers */
+#include "event_queue.h"
+#include "failover_drill.h"
+#include "failure_detector.h"
+#include "formation_metadata.h"
+#include "fleet_summary.h"
 #include "health_check.h"
 #include "group_state_machine.h"
+#include "group_state_scheduler.h"
 #include "metadata.h"
+#include "node_cache.h"
+#include "node_history.h"
+#include "node_metadata.h"
+#include "notifications.h"
+#include "protocol_memory.h"
+#include "protocol_stats.h"
+#include "replay_progress.h"
+#include "state_change_wait.h"
+#include "storage_health.h"
+#include "sync_quorum.h"
+#include "sync_rep_stall.h"
 #include "version_compat.h"
 
 /* these are always necessary for a bgworker */
@@ -120,6 +137,39 @@ StartMonitorNode(void)
 							NULL, &HealthCheckRetryDelay, 2 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.health_check_workers",
+							"Number of health check workers per database.",
+							NULL, &HealthCheckWorkers, 1, 1, HEALTH_CHECK_MAX_WORKERS,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.health_check_persistent_connections",
+							 "Keep health check connections open between checks.",
+							 NULL, &HealthCheckPersistentConnections, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.health_check_probe_only",
+							 "Only wait for the server's answer to an SSL request "
+							 "in health checks, without connecting.",
+							 NULL, &HealthCheckProbeOnly, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.health_check_race_addresses",
+							 "Race health check connections to all the addresses "
+							 "of a node's host, rather than trying them in turn.",
+							 NULL, &HealthCheckRaceAddresses, true,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.event_retention",
+							"Remove events older than this, 0 keeps all the events.",
+							NULL, &EventRetention, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MIN, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.event_queue_size",
+							"Maximum number of events queued in shared memory, to be "
+							"inserted by a background worker, 0 disables the queue.",
+							NULL, &EventQueueSize, 0, 0, INT_MAX / 2,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.enable_sync_wal_log_threshold",
 							"Don't enable synchronous replication until secondary xlog"
 							" is within this many bytes of the primary's",
@@ -132,6 +182,75 @@ StartMonitorNode(void)
 							NULL, &PromoteXlogThreshold, DEFAULT_XLOG_SEG_SIZE, 1,
 							INT_MAX, PGC_SIGHUP, 0, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.replication_slot_wal_budget",
+							"Invalidate the inactive replication slots of standby "
+							"nodes that retain more WAL than this, 0 disables it.",
+							NULL, &ReplicationSlotWalBudget, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_quorum_exclude_lag_threshold",
+							"Leave the standby nodes that lag more than this out of "
+							"synchronous_standby_names, 0 disables it.",
+							NULL, &SyncQuorumExcludeLagThreshold, 0, 0, INT_MAX / 2,
+							PGC_SIGHUP, GUC_UNIT_MB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.switchover_drain_limit",
+							"Refuse a switchover when the primary has a write or "
+							"prepared transaction older than this, 0 disables it.",
+							NULL, &SwitchoverDrainLimitMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.anchor_latency_priority_step",
+							"Lower the candidate priority of a standby node by one "
+							"for each step of this much network latency to the "
+							"application anchors, 0 disables it.",
+							NULL, &AnchorLatencyPriorityStepMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.enable_fast_failover_election",
+							 "Promote the most advanced standby without waiting for "
+							 "the other nodes to report their LSN first.",
+							 NULL, &EnableFastFailoverElection, true,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.enable_parallel_standby_join",
+							 "Let all the standby nodes joining a group make "
+							 "progress at once rather than one at a time.",
+							 NULL, &EnableParallelStandbyJoin, true,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.enable_direct_settings",
+							 "Push number_sync_standbys changes to the primary "
+							 "node in its state notification rather than "
+							 "assigning it apply_settings.",
+							 NULL, &EnableDirectSettings, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.enable_basebackup_from_standby",
+							 "Have joining standby nodes take their base backup "
+							 "from a healthy secondary node rather than from "
+							 "the primary node.",
+							 NULL, &EnableBaseBackupFromStandby, true,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.group_state_scheduler_period",
+							"Duration between each run of the group state machines "
+							"by the monitor (in milliseconds), 0 disables it.",
+							NULL, &GroupStateSchedulerPeriod, 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_report_interval",
+							"Ask the keepers of steady groups to report this often "
+							"(in milliseconds).",
+							NULL, &SteadyReportIntervalMs, 5 * 1000, 1, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_transition_report_interval",
+							"Ask the keepers of groups in transition to report "
+							"this often (in milliseconds).",
+							NULL, &TransitionReportIntervalMs, 500, 1, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.primary_demote_timeout",
 							"Give the primary this long to drain before promoting the secondary",
 							NULL, &DrainTimeoutMs, 30 * 1000, 1, INT_MAX,
@@ -142,16 +261,112 @@ StartMonitorNode(void)
 							NULL, &UnhealthyTimeoutMs, 20 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomRealVariable("pgautofailover.failure_detector_phi_threshold",
+							 "Consider that a keeper stopped reporting when the "
+							 "suspicion level of its node_active() calls reaches "
+							 "this, 0 disables the failure detector.",
+							 NULL, &FailureDetectorPhiThreshold, 0.0, 0.0, 100.0,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.failure_detector_min_stddev",
+							"Minimum standard deviation of the delays of the "
+							"node_active() calls used by the failure detector.",
+							NULL, &FailureDetectorMinStdDevMs, 200, 1, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
 	DefineCustomIntVariable("pgautofailover.startup_grace_period",
 							"Wait for at least this much time after startup before "
 							"initiating a failover.",
 							NULL, &StartupGracePeriodMs, 10 * 1000, 1, INT_MAX,
 							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
 
+	DefineCustomIntVariable("pgautofailover.storage_stall_timeout",
+							"Mark a node unhealthy when its keeper reports an I/O "
+							"probe that has been waiting for this long, "
+							"0 disables it.",
+							NULL, &StorageStallTimeoutMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.wal_exhaustion_threshold",
+							"Register an event when a keeper expects pg_wal to be "
+							"full in less than this, 0 disables it.",
+							NULL, &WalExhaustionThresholdSecs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.wal_exhaustion_switchover",
+							 "Switch over from a primary node when its pg_wal is "
+							 "expected to be full within "
+							 "pgautofailover.wal_exhaustion_threshold.",
+							 NULL, &WalExhaustionSwitchover, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.promote_replay_time_threshold",
+							"Prefer a failover candidate of the same priority that "
+							"is expected to replay its WAL sooner by more than "
+							"this, 0 ranks candidates by received LSN only.",
+							NULL, &PromoteReplayTimeThresholdMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.wal_receiver_stall_timeout",
+							"Consider a standby node lagging when its WAL "
+							"receiver did not hear from the primary in this "
+							"long while the primary has more WAL, 0 disables it.",
+							NULL, &WalReceiverStallTimeoutMs, 0, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.sync_rep_stall_hold_time",
+							"Keep a standby node that was degraded after a "
+							"synchronous replication stall in catchingup for "
+							"at least this long.",
+							NULL, &SyncRepStallHoldTimeMs, 30 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.failover_drill_timeout",
+							"Fail a scheduled failover drill when the former "
+							"primary is not a secondary again after this long.",
+							NULL, &FailoverDrillTimeoutMs, 10 * 60 * 1000,
+							1000, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_history_resolution",
+							"Record the LSN, lag and health of each node this "
+							"often, 0 disables the node history.",
+							NULL, &NodeHistoryResolutionMs, 10 * 1000, 0, INT_MAX,
+							PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_history_size",
+							"Number of samples kept in the history of each node.",
+							NULL, &NodeHistorySize, 360, 1, 100000,
+							PGC_SIGHUP, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pgautofailover.node_cache_size",
+							"Maximum number of nodes kept in the shared memory cache, "
+							"0 disables the cache.",
+							NULL, &NodeCacheSize, 2048, 0, INT_MAX / 2,
+							PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pgautofailover.enable_protocol_memory_context",
+							 "Run the protocol functions in a memory context "
+							 "that is reset at the end of each transaction.",
+							 NULL, &EnableProtocolMemoryContext, false,
+							 PGC_SIGHUP, 0, NULL, NULL, NULL);
+
 	PreviousProcessUtility_hook = ProcessUtility_hook;
 	ProcessUtility_hook = pgautofailover_ProcessUtility;
 
 	InitializeHealthCheckWorker();
+	InitializeNodeCache();
+	InitializeFleetSummary();
+	InitializeEventQueue();
+	InitializeNotifications();
+	InitializeProtocolStats();
+	InitializeProtocolMemory();
+	InitializeHealthCheckLatency();
+	InitializeFailureDetector();
+	InitializeStorageHealth();
+	InitializeReplayProgress();
+	InitializeSyncRepStall();
+	InitializeStateChangeWait();
 
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
@@ -209,9 +424,45 @@ pgautofailover_ProcessUtility(PlannedStmt * pstmt,
 		if (databaseOid != InvalidOid)
 		{
 			StopHealthCheckWorker(databaseOid);
+			NodeCacheResetDatabase(databaseOid);
 		}
 	}
 
+	/*
+	 * Extension scripts and DROP EXTENSION change the pgautofailover.node
+	 * table behind the back of our cache maintenance trigger.
+	 */
+	if (IsA(parsetree, CreateExtensionStmt))
+	{
+		CreateExtensionStmt *createExtensionStatement =
+			(CreateExtensionStmt *) parsetree;
+
+		/* the launcher starts the health checks once this commits */
+		if (strcmp(createExtensionStatement->extname,
+				   AUTO_FAILOVER_EXTENSION_NAME) == 0)
+		{
+			HealthCheckExtensionChanged();
+		}
+	}
+	else if (IsA(parsetree, AlterExtensionStmt))
+	{
+		AlterExtensionStmt *alterExtensionStatement =
+			(AlterExtensionStmt *) parsetree;
+
+		if (strcmp(alterExtensionStatement->extname, AUTO_FAILOVER_EXTENSION_NAME) == 0)
+		{
+			NodeCacheInvalidateAtCommit();
+			HealthCheckNodeListChanged();
+		}
+	}
+	else if (IsA(parsetree, DropStmt) &&
+			 ((DropStmt *) parsetree)->removeType == OBJECT_EXTENSION)
+	{
+		NodeCacheInvalidateAtCommit();
+		HealthCheckNodeListChanged();
+		HealthCheckExtensionChanged();
+	}
+
 	if (PreviousProcessUtility_hook)
 	{
 #if (PG_VERSION_NUM < 140000)
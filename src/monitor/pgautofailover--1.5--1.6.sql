@@ -53,16 +53,14 @@ CREATE TYPE pgautofailover.replication_state
     'dropped'
  );
 
--- Note the double cast here, first to text and only then to the new enums
-ALTER TABLE pgautofailover.event
-      ALTER COLUMN goalstate
-              TYPE pgautofailover.replication_state
-             USING goalstate::text::pgautofailover.replication_state,
-
-      ALTER COLUMN reportedstate
-              TYPE pgautofailover.replication_state
-             USING reportedstate::text::pgautofailover.replication_state;
-
+--
+-- The whole update runs in the ALTER EXTENSION transaction, and the tables
+-- it copies stay locked until the end of it, blocking node_active() calls.
+-- The event table is the only one that might be large, so it is copied only
+-- once: the new enum values are cast in the copy to the partitioned table,
+-- see below, and it's only with Postgres 10 that the column types are
+-- changed in place.
+--
 ALTER TABLE pgautofailover.node RENAME TO node_upgrade_old;
 
 ALTER TABLE pgautofailover.node_upgrade_old
@@ -73,7 +71,15 @@ ALTER TABLE pgautofailover.node_upgrade_old
       RENAME CONSTRAINT same_system_identifier_within_group
                      TO same_system_identifier_within_group_old;
 
-CREATE TABLE pgautofailover.node
+--
+-- The node table is split in two: the node_base table contains the node
+-- registration and its state, and the node_heartbeat table contains the
+-- columns that the keepers update each time they call node_active(). The
+-- heartbeat table is kept narrow and without constraints, so that those
+-- frequent updates are cheap. The pgautofailover.node view joins the two
+-- tables back together.
+--
+CREATE TABLE pgautofailover.node_base
  (
     formationid          text not null default 'default',
     nodeid               bigint not null DEFAULT nextval('pgautofailover.node_nodeid_seq'::regclass),
@@ -84,12 +90,7 @@ CREATE TABLE pgautofailover.node
     sysidentifier        bigint,
     goalstate            pgautofailover.replication_state not null default 'init',
     reportedstate        pgautofailover.replication_state not null,
-    reportedpgisrunning  bool default true,
     reportedrepstate     text default 'async',
-    reporttime           timestamptz not null default now(),
-    reportedtli          int not null default 1 check (reportedtli > 0),
-    reportedlsn          pg_lsn not null default '0/0',
-    walreporttime        timestamptz not null default now(),
     health               integer not null default -1,
     healthchecktime      timestamptz not null default now(),
     statechangetime      timestamptz not null default now(),
@@ -102,11 +103,6 @@ CREATE TABLE pgautofailover.node
     -- any nodehost:port can only be a unique node in the system
     UNIQUE (nodehost, nodeport),
     --
-    -- The EXCLUDE constraint only allows the same sysidentifier for all the
-    -- nodes in the same group. The system_identifier is a property that is
-    -- kept when implementing streaming replication and should be unique per
-    -- Postgres instance in all other cases.
-    --
     -- We allow the sysidentifier column to be NULL when registering a new
     -- primary server from scratch, because we have not done pg_ctl initdb
     -- at the time we call the register_node() function.
@@ -126,25 +122,100 @@ CREATE TABLE pgautofailover.node
                 OR sysidentifier IS NOT NULL
                ),
 
-    CONSTRAINT same_system_identifier_within_group
-       EXCLUDE USING gist(formationid with =,
-                          groupid with =,
-                          sysidentifier with <>)
-    DEFERRABLE INITIALLY DEFERRED,
-
     PRIMARY KEY (nodeid),
     FOREIGN KEY (formationid) REFERENCES pgautofailover.formation(formationid)
  )
  -- we expect few rows and lots of UPDATE, let's benefit from HOT
  WITH (fillfactor = 25);
 
-ALTER SEQUENCE pgautofailover.node_nodeid_seq OWNED BY pgautofailover.node.nodeid;
+ALTER SEQUENCE pgautofailover.node_nodeid_seq
+      OWNED BY pgautofailover.node_base.nodeid;
+
+--
+-- Only the same sysidentifier is allowed for all the nodes in the same
+-- group. The system_identifier is a property that is kept when implementing
+-- streaming replication and should be unique per Postgres instance in all
+-- other cases.
+--
+-- The constraint trigger only fires when the sysidentifier, formationid or
+-- groupid columns are written to, so that the other updates of the table
+-- don't pay for the check.
+--
+CREATE FUNCTION pgautofailover.same_system_identifier_trigger()
+RETURNS trigger LANGUAGE C
+AS 'MODULE_PATHNAME', $$same_system_identifier_trigger$$;
+
+comment on function pgautofailover.same_system_identifier_trigger()
+        is 'checks that all the nodes in a group share the same sysidentifier';
+
+CREATE CONSTRAINT TRIGGER same_system_identifier_within_group
+	AFTER INSERT OR UPDATE OF sysidentifier, formationid, groupid
+	ON pgautofailover.node_base
+	DEFERRABLE INITIALLY DEFERRED
+	FOR EACH ROW
+	EXECUTE PROCEDURE pgautofailover.same_system_identifier_trigger();
+
+CREATE TABLE pgautofailover.node_heartbeat
+ (
+    nodeid               bigint not null,
+    reportedpgisrunning  bool default true,
+    reporttime           timestamptz not null default now(),
+    reportedtli          int not null default 1,
+    reportedlsn          pg_lsn not null default '0/0',
+    walreporttime        timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid)
+ )
+ WITH (fillfactor = 25);
 
-INSERT INTO pgautofailover.node
+--
+-- With a heartbeat per node every second, the node tables get more dead rows
+-- in a minute than autovacuum's default 20% scale factor of a few hundred
+-- rows would wait for, and the pages fill up with dead row versions: updates
+-- stop being HOT and the indexes bloat. Vacuum after a fixed number of dead
+-- rows instead, and without cost delay, which is cheap on such small tables.
+--
+ALTER TABLE pgautofailover.node_base
+      SET (autovacuum_vacuum_scale_factor = 0,
+           autovacuum_vacuum_threshold = 500,
+           autovacuum_vacuum_cost_delay = 0);
+
+ALTER TABLE pgautofailover.node_heartbeat
+      SET (autovacuum_vacuum_scale_factor = 0,
+           autovacuum_vacuum_threshold = 500,
+           autovacuum_vacuum_cost_delay = 0);
+
+CREATE VIEW pgautofailover.node
+    AS
+    SELECT base.formationid,
+           base.nodeid,
+           base.groupid,
+           base.nodename,
+           base.nodehost,
+           base.nodeport,
+           base.sysidentifier,
+           base.goalstate,
+           base.reportedstate,
+           heartbeat.reportedpgisrunning,
+           base.reportedrepstate,
+           heartbeat.reporttime,
+           heartbeat.reportedtli,
+           heartbeat.reportedlsn,
+           heartbeat.walreporttime,
+           base.health,
+           base.healthchecktime,
+           base.statechangetime,
+           base.candidatepriority,
+           base.replicationquorum,
+           base.nodecluster
+      FROM pgautofailover.node_base AS base
+      JOIN pgautofailover.node_heartbeat AS heartbeat
+        ON heartbeat.nodeid = base.nodeid;
+
+INSERT INTO pgautofailover.node_base
  (
   formationid, nodeid, groupid, nodename, nodehost, nodeport, sysidentifier,
-  goalstate, reportedstate, reportedpgisrunning, reportedrepstate,
-  reporttime, reportedtli, reportedlsn, walreporttime,
+  goalstate, reportedstate, reportedrepstate,
   health, healthchecktime, statechangetime,
   candidatepriority, replicationquorum, nodecluster
  )
@@ -152,17 +223,275 @@ INSERT INTO pgautofailover.node
         nodename, nodehost, nodeport, sysidentifier,
         goalstate::text::pgautofailover.replication_state,
         reportedstate::text::pgautofailover.replication_state,
-        reportedpgisrunning, reportedrepstate, reporttime,
-        1 as reportedtli,
-        reportedlsn, walreporttime, health, healthchecktime, statechangetime,
+        reportedrepstate, health, healthchecktime, statechangetime,
         candidatepriority, replicationquorum, nodecluster
    FROM pgautofailover.node_upgrade_old;
 
+INSERT INTO pgautofailover.node_heartbeat
+ (
+  nodeid, reportedpgisrunning, reporttime, reportedtli, reportedlsn,
+  walreporttime
+ )
+ SELECT nodeid, reportedpgisrunning, reporttime,
+        1 as reportedtli,
+        reportedlsn, walreporttime
+   FROM pgautofailover.node_upgrade_old;
+
 DROP TABLE pgautofailover.node_upgrade_old;
+
+CREATE OR REPLACE FUNCTION pgautofailover.set_node_system_identifier
+ (
+    IN node_id             bigint,
+    IN node_sysidentifier  bigint,
+   OUT node_id          bigint,
+   OUT node_name        text,
+   OUT node_host        text,
+   OUT node_port        int
+ )
+RETURNS record LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+      update pgautofailover.node_base
+         set sysidentifier = node_sysidentifier
+       where nodeid = set_node_system_identifier.node_id
+   returning nodeid, nodename, nodehost, nodeport;
+$$;
+
+CREATE OR REPLACE FUNCTION pgautofailover.set_group_system_identifier
+ (
+    IN group_id            bigint,
+    IN node_sysidentifier  bigint,
+   OUT node_id          bigint,
+   OUT node_name        text,
+   OUT node_host        text,
+   OUT node_port        int
+ )
+RETURNS setof record LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+      update pgautofailover.node_base
+         set sysidentifier = node_sysidentifier
+       where groupid = set_group_system_identifier.group_id
+         and sysidentifier = 0
+   returning nodeid, nodename, nodehost, nodeport;
+$$;
+
+-- the last_events functions depend on the event table row type
+DROP FUNCTION pgautofailover.last_events(int);
+DROP FUNCTION pgautofailover.last_events(text,int);
+DROP FUNCTION pgautofailover.last_events(text,int,int);
+
+--
+-- Partition the event table by eventtime, see pgautofailover.sql. The
+-- existing events are all moved to the default partition, where they are
+-- removed by pgautofailover.event_retention.
+--
+DO $body$
+BEGIN
+  IF current_setting('server_version_num')::int >= 110000
+  THEN
+    ALTER TABLE pgautofailover.event RENAME TO event_upgrade_old;
+
+    ALTER TABLE pgautofailover.event_upgrade_old
+          RENAME CONSTRAINT event_pkey TO event_pkey_old;
+
+    EXECUTE $sql$
+CREATE TABLE pgautofailover.event
+ (
+    eventid           bigint not null DEFAULT nextval('pgautofailover.event_eventid_seq'::regclass),
+    eventtime         timestamptz not null default now(),
+    formationid       text not null,
+    nodeid            bigint not null,
+    groupid           int not null,
+    nodename          text not null,
+    nodehost          text not null,
+    nodeport          integer not null,
+    reportedstate     pgautofailover.replication_state not null,
+    goalstate         pgautofailover.replication_state not null,
+    reportedrepstate  text,
+    reportedlsn       pg_lsn not null default '0/0',
+    candidatepriority int,
+    replicationquorum bool,
+    description       text,
+    traceid           text,
+    spanduration      interval,
+
+    PRIMARY KEY (eventid, eventtime)
+ )
+ PARTITION BY RANGE (eventtime)
+$sql$;
+
+    EXECUTE 'CREATE TABLE pgautofailover.event_default '
+         || 'PARTITION OF pgautofailover.event DEFAULT';
+
+    ALTER SEQUENCE pgautofailover.event_eventid_seq
+          OWNED BY pgautofailover.event.eventid;
+
+    INSERT INTO pgautofailover.event
+     (
+      eventid, eventtime, formationid, nodeid, groupid,
+      nodename, nodehost, nodeport, reportedstate, goalstate,
+      reportedrepstate, reportedlsn, candidatepriority, replicationquorum,
+      description
+     )
+     SELECT eventid, eventtime, formationid, nodeid, groupid,
+            nodename, nodehost, nodeport,
+            reportedstate::text::pgautofailover.replication_state,
+            goalstate::text::pgautofailover.replication_state,
+            reportedrepstate, reportedlsn, candidatepriority, replicationquorum,
+            description
+       FROM pgautofailover.event_upgrade_old;
+
+    DROP TABLE pgautofailover.event_upgrade_old;
+  ELSE
+    -- Note the double cast here, first to text and only then to the new enums
+    ALTER TABLE pgautofailover.event
+          ALTER COLUMN goalstate
+                  TYPE pgautofailover.replication_state
+                 USING goalstate::text::pgautofailover.replication_state,
+
+          ALTER COLUMN reportedstate
+                  TYPE pgautofailover.replication_state
+                 USING reportedstate::text::pgautofailover.replication_state,
+
+          ADD COLUMN traceid text,
+          ADD COLUMN spanduration interval;
+  END IF;
+END
+$body$;
+
 DROP TYPE pgautofailover.old_replication_state;
 
+CREATE INDEX event_formationid_eventid_idx
+    ON pgautofailover.event (formationid, eventid desc);
+
+CREATE INDEX event_formationid_groupid_eventid_idx
+    ON pgautofailover.event (formationid, groupid, eventid desc);
+
+--
+-- The last_events functions are not STRICT, so that Postgres can inline them
+-- in the calling query and implement them with a top-N index scan. The
+-- "count is not null" conditions keep the previous behavior with NULL
+-- arguments.
+--
+CREATE FUNCTION pgautofailover.last_events
+ (
+  count int default 10
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE SQL STABLE
+AS $$
+with last_events as
+(
+  select eventid, eventtime, formationid,
+         nodeid, groupid, nodename, nodehost, nodeport,
+         reportedstate, goalstate,
+         reportedrepstate, reportedlsn,
+         candidatepriority, replicationquorum, description,
+         traceid, spanduration
+    from pgautofailover.event
+   where count is not null
+order by eventid desc
+   limit count
+)
+select * from last_events order by eventtime, eventid;
+$$;
+
+comment on function pgautofailover.last_events(int)
+        is 'retrieve last COUNT events';
+
+CREATE FUNCTION pgautofailover.last_events
+ (
+  formation_id text default 'default',
+  count        int  default 10
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE SQL STABLE
+AS $$
+with last_events as
+(
+    select eventid, eventtime, formationid,
+           nodeid, groupid, nodename, nodehost, nodeport,
+           reportedstate, goalstate,
+           reportedrepstate, reportedlsn,
+           candidatepriority, replicationquorum, description,
+           traceid, spanduration
+      from pgautofailover.event
+     where formationid = formation_id
+       and count is not null
+  order by eventid desc
+     limit count
+)
+select * from last_events order by eventtime, eventid;
+$$;
+
+comment on function pgautofailover.last_events(text,int)
+        is 'retrieve last COUNT events for given formation';
+
+CREATE FUNCTION pgautofailover.last_events
+ (
+  formation_id text,
+  group_id     int,
+  count        int default 10
+ )
+RETURNS SETOF pgautofailover.event LANGUAGE SQL STABLE
+AS $$
+with last_events as
+(
+    select eventid, eventtime, formationid,
+           nodeid, groupid, nodename, nodehost, nodeport,
+           reportedstate, goalstate,
+           reportedrepstate, reportedlsn,
+           candidatepriority, replicationquorum, description,
+           traceid, spanduration
+      from pgautofailover.event
+     where formationid = formation_id
+       and groupid = group_id
+       and count is not null
+  order by eventid desc
+     limit count
+)
+select * from last_events order by eventtime, eventid;
+$$;
+
+comment on function pgautofailover.last_events(text,int,int)
+        is 'retrieve last COUNT events for given formation and group';
+
 GRANT SELECT ON ALL TABLES IN SCHEMA pgautofailover TO autoctl_node;
 
+CREATE FUNCTION pgautofailover.node_cache_trigger()
+RETURNS trigger LANGUAGE C
+AS 'MODULE_PATHNAME', $$node_cache_trigger$$;
+
+comment on function pgautofailover.node_cache_trigger()
+        is 'maintains the monitor shared memory cache of nodes';
+
+CREATE TRIGGER node_cache
+	AFTER INSERT OR UPDATE OR DELETE
+	ON pgautofailover.node_base
+	FOR EACH ROW
+	EXECUTE PROCEDURE pgautofailover.node_cache_trigger();
+
+CREATE TRIGGER node_cache_truncate
+	AFTER TRUNCATE
+	ON pgautofailover.node_base
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE pgautofailover.node_cache_trigger();
+
+CREATE TRIGGER node_cache
+	AFTER INSERT OR UPDATE OR DELETE
+	ON pgautofailover.node_heartbeat
+	FOR EACH ROW
+	EXECUTE PROCEDURE pgautofailover.node_cache_trigger('heartbeat');
+
+CREATE TRIGGER node_cache_truncate
+	AFTER TRUNCATE
+	ON pgautofailover.node_heartbeat
+	FOR EACH STATEMENT
+	EXECUTE PROCEDURE pgautofailover.node_cache_trigger('heartbeat');
+
+-- the cache must be maintained even when replaying changes
+ALTER TABLE pgautofailover.node_base ENABLE ALWAYS TRIGGER node_cache;
+ALTER TABLE pgautofailover.node_base ENABLE ALWAYS TRIGGER node_cache_truncate;
+ALTER TABLE pgautofailover.node_heartbeat ENABLE ALWAYS TRIGGER node_cache;
+ALTER TABLE pgautofailover.node_heartbeat ENABLE ALWAYS TRIGGER node_cache_truncate;
+
 
 
 CREATE FUNCTION pgautofailover.register_node
@@ -341,6 +670,20 @@ comment on function pgautofailover.remove_node(text,int,bool)
 grant execute on function pgautofailover.remove_node(text,int,bool)
    to autoctl_node;
 
+CREATE FUNCTION pgautofailover.remove_nodes
+ (
+   node_ids bigint[],
+   force    bool default 'false'
+ )
+RETURNS int LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$remove_nodes$$;
+
+comment on function pgautofailover.remove_nodes(bigint[],bool)
+        is 'remove a set of nodes from the monitor';
+
+grant execute on function pgautofailover.remove_nodes(bigint[],bool)
+   to autoctl_node;
+
 DROP FUNCTION pgautofailover.start_maintenance(node_id int);
 
 CREATE FUNCTION pgautofailover.start_maintenance(node_id bigint)
@@ -422,17 +765,8 @@ CREATE FUNCTION pgautofailover.current_state
    OUT reported_lsn         pg_lsn,
    OUT health               integer
  )
-RETURNS SETOF record LANGUAGE SQL STRICT
-AS $$
-   select kind, nodename, nodehost, nodeport, groupid, nodeid,
-          reportedstate, goalstate,
-   		  candidatepriority, replicationquorum,
-          reportedtli, reportedlsn, health
-     from pgautofailover.node
-     join pgautofailover.formation using(formationid)
-    where formationid = formation_id
- order by groupid, nodeid;
-$$;
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$current_state$$;
 
 grant execute on function pgautofailover.current_state(text)
    to autoctl_node;
@@ -458,21 +792,1410 @@ CREATE FUNCTION pgautofailover.current_state
    OUT reported_lsn         pg_lsn,
    OUT health               integer
  )
-RETURNS SETOF record LANGUAGE SQL STRICT
-AS $$
-   select kind, nodename, nodehost, nodeport, groupid, nodeid,
-          reportedstate, goalstate,
-   		  candidatepriority, replicationquorum,
-          reportedtli, reportedlsn, health
-     from pgautofailover.node
-     join pgautofailover.formation using(formationid)
-    where formationid = formation_id
-      and groupid = group_id
- order by groupid, nodeid;
-$$;
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$current_state$$;
 
 grant execute on function pgautofailover.current_state(text, int)
    to autoctl_node;
 
 comment on function pgautofailover.current_state(text, int)
         is 'get the current state of both nodes of a group in a formation';
+
+--
+-- The group version is incremented each time a node is added, removed, or
+-- has its metadata updated in a group, so that the keepers know when they
+-- need to refresh their HBA rules.
+--
+CREATE TABLE pgautofailover.group_version
+ (
+    formationid          text not null,
+    groupid              int not null,
+    version              bigint not null default 1,
+
+    PRIMARY KEY (formationid, groupid),
+    FOREIGN KEY (formationid) REFERENCES pgautofailover.formation(formationid)
+        ON DELETE CASCADE
+ );
+
+insert into pgautofailover.group_version (formationid, groupid)
+     select distinct formationid, groupid
+       from pgautofailover.node;
+
+CREATE FUNCTION pgautofailover.node_active_v2
+ (
+    IN formation_id           		text,
+    IN node_id        		        bigint,
+    IN group_id       		        int,
+    IN current_group_role     		pgautofailover.replication_state default 'init',
+    IN current_pg_is_running  		bool default true,
+    IN current_tli			  		integer default 1,
+    IN current_lsn			  		pg_lsn default '0/0',
+    IN current_rep_state      		text default '',
+    IN known_nodes_version    		bigint default 0,
+   OUT assigned_node_id       		bigint,
+   OUT assigned_group_id      		int,
+   OUT assigned_group_state   		pgautofailover.replication_state,
+   OUT assigned_candidate_priority 	int,
+   OUT assigned_replication_quorum  bool,
+   OUT nodes_version                bigint,
+   OUT other_nodes                  json,
+   OUT group_version                bigint,
+   OUT report_interval              int,
+   OUT trace_id                     text,
+   OUT synchronous_standby_names    text
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$node_active_v2$$;
+
+comment on function pgautofailover.node_active_v2(text,bigint,int,
+                          pgautofailover.replication_state,bool,int,pg_lsn,
+                          text,bigint)
+        is 'node_active, also returning the other nodes unless known_nodes_version is current, when to report again, the failover trace id, and the synchronous_standby_names pushed to a primary node';
+
+grant execute on function
+      pgautofailover.node_active_v2(text,bigint,int,
+                          pgautofailover.replication_state,bool,int,pg_lsn,
+                          text,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.stat_protocol_functions
+ (
+   OUT function_name      text,
+   OUT calls              bigint,
+   OUT errors             bigint,
+   OUT total_time         double precision,
+   OUT mean_time          double precision,
+   OUT max_time           double precision,
+   OUT p99_time           double precision,
+   OUT lock_wait_time     double precision,
+   OUT state_machine_runs bigint,
+   OUT stats_reset        timestamptz
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$stat_protocol_functions$$;
+
+comment on function pgautofailover.stat_protocol_functions()
+        is 'get the statistics of the monitor protocol functions';
+
+CREATE VIEW pgautofailover.stat_protocol
+AS
+ SELECT function_name, calls, errors, total_time, mean_time, max_time,
+        p99_time, lock_wait_time, state_machine_runs, stats_reset
+   FROM pgautofailover.stat_protocol_functions();
+
+comment on view pgautofailover.stat_protocol
+        is 'calls, latency (in milliseconds), lock waits and state machine runs of the monitor protocol functions';
+
+grant select on pgautofailover.stat_protocol to autoctl_node;
+
+CREATE FUNCTION pgautofailover.stat_protocol_reset()
+RETURNS void LANGUAGE C
+AS 'MODULE_PATHNAME', $$stat_protocol_reset$$;
+
+comment on function pgautofailover.stat_protocol_reset()
+        is 'reset the statistics of the monitor protocol functions';
+
+revoke all on function pgautofailover.stat_protocol_reset() from public;
+
+CREATE FUNCTION pgautofailover.stat_protocol_memory_backends
+ (
+   OUT pid            int,
+   OUT calls          bigint,
+   OUT call_bytes     bigint,
+   OUT max_call_bytes bigint,
+   OUT cache_bytes    bigint,
+   OUT total_bytes    bigint,
+   OUT last_call      timestamptz
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$stat_protocol_memory_backends$$;
+
+comment on function pgautofailover.stat_protocol_memory_backends()
+        is 'get the memory statistics of the backends that call the monitor protocol functions';
+
+CREATE VIEW pgautofailover.stat_protocol_memory
+AS
+ SELECT pid, calls, call_bytes, max_call_bytes, cache_bytes, total_bytes,
+        last_call
+   FROM pgautofailover.stat_protocol_memory_backends();
+
+comment on view pgautofailover.stat_protocol_memory
+        is 'memory sizes (in bytes) of the backends that call the monitor protocol functions';
+
+grant select on pgautofailover.stat_protocol_memory to autoctl_node;
+
+CREATE FUNCTION pgautofailover.table_health
+ (
+   OUT relation        regclass,
+   OUT live_tuples     bigint,
+   OUT dead_tuples     bigint,
+   OUT hot_ratio       float8,
+   OUT pages           bigint,
+   OUT expected_pages  bigint,
+   OUT index_pages     bigint,
+   OUT last_vacuum     timestamptz,
+   OUT hint            text
+ )
+RETURNS SETOF record LANGUAGE SQL STABLE
+AS $$
+  with tables as
+  (
+     select c.oid::regclass as relation,
+            s.n_live_tup, s.n_dead_tup, s.n_tup_upd, s.n_tup_hot_upd,
+            pg_relation_size(c.oid)
+            / current_setting('block_size')::bigint as pages,
+            pg_indexes_size(c.oid)
+            / current_setting('block_size')::bigint as index_pages,
+            greatest(s.last_vacuum, s.last_autovacuum) as last_vacuum,
+            -- rows per page, from the fillfactor and the average row width,
+            -- with the tuple header and the line pointer
+            greatest(floor(current_setting('block_size')::bigint
+                           * coalesce((select option_value::int
+                                         from pg_options_to_table(c.reloptions)
+                                        where option_name = 'fillfactor'),
+                                      100)
+                           / 100
+                           / (coalesce((select sum(st.avg_width)
+                                          from pg_stats st
+                                         where st.schemaname = 'pgautofailover'
+                                           and st.tablename = c.relname),
+                                       64)
+                              + 28)),
+                     1) as rows_per_page
+       from pg_class c
+            join pg_stat_all_tables s on s.relid = c.oid
+      where c.relnamespace = 'pgautofailover'::regnamespace
+        and c.relkind = 'r'
+  ),
+  horizon as
+  (
+     select max(age(backend_xmin)) as xmin_age
+       from pg_stat_activity
+      where backend_xmin is not null
+  )
+  select relation, n_live_tup, n_dead_tup,
+         case when n_tup_upd > 0
+              then n_tup_hot_upd::float8 / n_tup_upd
+          end,
+         pages,
+         ceil(greatest(n_live_tup, 1)::numeric / rows_per_page)::bigint,
+         index_pages,
+         last_vacuum,
+         case when n_dead_tup > 10 * greatest(n_live_tup, 100)
+                   and xmin_age > 10000
+              then format('dead rows can''t be pruned while a transaction '
+                          'holds the xmin horizon %s transactions back, '
+                          'see pg_stat_activity.backend_xmin', xmin_age)
+              when n_tup_upd > 1000
+                   and n_tup_hot_upd::float8 / n_tup_upd < 0.9
+              then 'less than 90% of the updates are HOT: the pages have '
+                   'no room left for new row versions, VACUUM the table'
+              when pages > 8
+                   and pages > 4 * ceil(greatest(n_live_tup, 1)::numeric / rows_per_page)
+              then 'the table is bloated, VACUUM FULL rewrites it with a '
+                   'short exclusive lock'
+              when index_pages > 8
+                   and index_pages > 2 * greatest(pages, 1)
+              then 'the indexes are bloated, REINDEX TABLE rebuilds them'
+          end
+    from tables, horizon
+order by pages desc, relation;
+$$;
+
+comment on function pgautofailover.table_health()
+        is 'report dead rows, HOT updates and bloat of the monitor tables, with maintenance hints';
+
+CREATE FUNCTION pgautofailover.health_check_latency
+ (
+   OUT nodeid              bigint,
+   OUT latency_upper_bound int,
+   OUT checks              bigint
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$health_check_latency$$;
+
+comment on function pgautofailover.health_check_latency()
+        is 'get the histogram of the health check connection latency (in milliseconds) of each node';
+
+CREATE FUNCTION pgautofailover.failure_detector
+ (
+   OUT nodeid          bigint,
+   OUT last_heartbeat  timestamptz,
+   OUT intervals       int,
+   OUT mean_delay      float8,
+   OUT stddev_delay    float8,
+   OUT phi             float8
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$failure_detector$$;
+
+comment on function pgautofailover.failure_detector()
+        is 'get the heartbeat model of the failure detector for each node';
+
+CREATE FUNCTION pgautofailover.storage_health
+ (
+   OUT nodeid          bigint,
+   OUT report_time     timestamptz,
+   OUT p50_us          bigint,
+   OUT p99_us          bigint,
+   OUT max_us          bigint,
+   OUT stall_ms        int,
+   OUT stalled         bool,
+   OUT wal_free_bytes  bigint,
+   OUT wal_rate        bigint,
+   OUT wal_time_to_full int
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$storage_health$$;
+
+comment on function pgautofailover.storage_health()
+        is 'get the I/O watchdog latency, current stall, and pg_wal free space reported by each node';
+
+CREATE FUNCTION pgautofailover.node_history
+ (
+   IN node_id          bigint,
+   IN since            interval default '1 hour',
+   OUT sampletime      timestamptz,
+   OUT reportedstate   pgautofailover.replication_state,
+   OUT reportedlsn     pg_lsn,
+   OUT lagbytes        bigint,
+   OUT health          integer,
+   OUT pgisrunning     bool
+ )
+RETURNS SETOF record LANGUAGE SQL STABLE
+AS $$
+  select sampletime, reportedstate, reportedlsn, lagbytes, health, pgisrunning
+    from pgautofailover.node_history
+   where nodeid = node_id
+     and sampletime >= now() - since
+order by sampletime;
+$$;
+
+comment on function pgautofailover.node_history(bigint,interval)
+        is 'get the history of the LSN, lag and health of a node';
+
+CREATE FUNCTION pgautofailover.node_history_summary
+ (
+   IN formation_id     text default 'default',
+   IN since            interval default '1 hour',
+   OUT nodeid          bigint,
+   OUT nodename        text,
+   OUT samples         bigint,
+   OUT first_sample    timestamptz,
+   OUT max_lagbytes    bigint,
+   OUT avg_lagbytes    bigint,
+   OUT unhealthy       bigint,
+   OUT not_running     bigint
+ )
+RETURNS SETOF record LANGUAGE SQL STABLE
+AS $$
+  select node.nodeid, node.nodename,
+         count(history.sampletime),
+         min(history.sampletime),
+         max(history.lagbytes),
+         avg(history.lagbytes)::bigint,
+         count(*) filter (where history.health = 0),
+         count(*) filter (where not history.pgisrunning)
+    from pgautofailover.node
+         join pgautofailover.node_history as history
+           on history.nodeid = node.nodeid
+   where node.formationid = formation_id
+     and history.sampletime >= now() - since
+group by node.nodeid, node.nodename
+order by node.nodeid;
+$$;
+
+comment on function pgautofailover.node_history_summary(text,interval)
+        is 'summarize the history of the LSN, lag and health of the nodes of a formation';
+
+ALTER TABLE pgautofailover.formation ADD COLUMN maximum_backup_rate text;
+
+CREATE FUNCTION pgautofailover.set_formation_maximum_backup_rate
+ (
+    IN formation_id        text,
+    IN maximum_backup_rate text
+ )
+RETURNS bool LANGUAGE SQL SECURITY DEFINER
+AS $$
+  with updated as
+  (
+      update pgautofailover.formation
+         set maximum_backup_rate = nullif($2, '')
+       where formationid = $1
+   returning formationid
+  )
+  select exists(select 1 from updated);
+$$;
+
+comment on function pgautofailover.set_formation_maximum_backup_rate(text, text)
+        is 'set the pg_basebackup --max-rate of the nodes of a formation, NULL to use the node setting';
+
+grant execute on function
+      pgautofailover.set_formation_maximum_backup_rate(text, text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_transition_timing
+ (
+    IN node_id     bigint,
+    IN description text
+ )
+RETURNS bigint LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  insert into pgautofailover.event
+         (formationid, nodeid, groupid, nodename, nodehost, nodeport,
+          reportedstate, goalstate, reportedrepstate, reportedlsn,
+          candidatepriority, replicationquorum, description)
+  select formationid, nodeid, groupid, nodename, nodehost, nodeport,
+         reportedstate, goalstate, reportedrepstate, reportedlsn,
+         candidatepriority, replicationquorum, $2
+    from pgautofailover.node
+   where nodeid = $1
+returning eventid;
+$$;
+
+comment on function pgautofailover.report_transition_timing(bigint, text)
+        is 'record how long a keeper took to implement an FSM transition as an event';
+
+grant execute on function
+      pgautofailover.report_transition_timing(bigint, text)
+   to autoctl_node;
+
+--
+-- The keeper of a primary node reports the replication progress of each of
+-- its standbys, as seen in pg_stat_replication, about every second. That's
+-- fresher than what the standbys report themselves in node_active when
+-- ranking failover candidates, and allows the monitor to prefer the closest
+-- standbys in synchronous_standby_names.
+--
+CREATE TABLE pgautofailover.replication_stats
+ (
+    nodeid               bigint not null,
+    sentlsn              pg_lsn,
+    writelsn             pg_lsn,
+    flushlsn             pg_lsn,
+    replaylsn            pg_lsn,
+    writelag             interval,
+    flushlag             interval,
+    replaylag            interval,
+    reporttime           timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ )
+ WITH (fillfactor = 25);
+
+GRANT SELECT ON pgautofailover.replication_stats TO autoctl_node;
+
+--
+-- The keeper of a primary node also reports how much WAL the replication
+-- slot of each standby node retains, and the slot wal_status with Postgres
+-- 13 and later, where max_slot_wal_keep_size may have invalidated it. A
+-- standby node that is away for a long time keeps WAL on the primary until
+-- its disk is full, so the monitor asks the primary to invalidate the
+-- inactive slots that retain more WAL than the budget set with
+-- pgautofailover.replication_slot_wal_budget.
+--
+CREATE TABLE pgautofailover.replication_slot_stats
+ (
+    nodeid               bigint not null,
+    slotactive           bool not null,
+    retainedbytes        bigint,
+    walstatus            text,
+    reporttime           timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ )
+ WITH (fillfactor = 25);
+
+GRANT SELECT ON pgautofailover.replication_slot_stats TO autoctl_node;
+
+--
+-- The keeper of a primary node also reports the write transactions that are
+-- in progress, and the prepared transactions. A switchover has to wait for
+-- them, and prepared transactions keep their locks on the new primary, so
+-- the monitor refuses a switchover that would stall for longer than
+-- pgautofailover.switchover_drain_limit.
+--
+CREATE TABLE pgautofailover.drain_stats
+ (
+    nodeid               bigint not null,
+    writexacts           int not null,
+    oldestwritexact      interval,
+    preparedxacts        int not null,
+    oldestpreparedxact   interval,
+    reporttime           timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ )
+ WITH (fillfactor = 25);
+
+GRANT SELECT ON pgautofailover.drain_stats TO autoctl_node;
+
+--
+-- The monitor leaves the secondary nodes that lag behind by more than
+-- pgautofailover.sync_quorum_exclude_lag_threshold out of
+-- synchronous_standby_names, until they catch up again. They keep their
+-- replicationquorum property meanwhile.
+--
+CREATE TABLE pgautofailover.sync_quorum_exclusion
+ (
+    nodeid               bigint not null,
+    lagbytes             bigint not null,
+    excludedat           timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ );
+
+GRANT SELECT ON pgautofailover.sync_quorum_exclusion TO autoctl_node;
+
+--
+-- When pgautofailover.enable_direct_settings is on, the monitor pushes the
+-- new synchronous_standby_names of a primary node in its state notification,
+-- and keeps it here until the next node_active call of that node returns it,
+-- so that the keeper gets it even when it missed the notification.
+--
+CREATE TABLE pgautofailover.pushed_settings
+ (
+    nodeid                    bigint not null,
+    synchronous_standby_names text not null,
+    pushtime                  timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ );
+
+GRANT SELECT ON pgautofailover.pushed_settings TO autoctl_node;
+
+--
+-- When the monitor starts a failover or a switchover in a group, it keeps a
+-- trace id here until a node of the group is writable again. The events of
+-- the group have that trace id meanwhile, see the event table.
+--
+CREATE TABLE pgautofailover.failover_trace
+ (
+    formationid          text not null,
+    groupid              int not null,
+    traceid              text not null,
+    kind                 text not null,
+    starttime            timestamptz not null default now(),
+
+    PRIMARY KEY (formationid, groupid),
+    FOREIGN KEY (formationid) REFERENCES pgautofailover.formation(formationid)
+        ON DELETE CASCADE
+ );
+
+GRANT SELECT ON pgautofailover.failover_trace TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_replication_stats
+ (
+    IN node_id     bigint,
+    IN standby_ids bigint[],
+    IN sent_lsns   pg_lsn[],
+    IN write_lsns  pg_lsn[],
+    IN flush_lsns  pg_lsn[],
+    IN replay_lsns pg_lsn[],
+    IN write_lags  interval[],
+    IN flush_lags  interval[],
+    IN replay_lags interval[]
+ )
+RETURNS int LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with reported(nodeid, sentlsn, writelsn, flushlsn, replaylsn,
+                writelag, flushlag, replaylag) as
+  (
+    select * from unnest($2, $3, $4, $5, $6, $7, $8, $9)
+  ),
+  upserted as
+  (
+       insert into pgautofailover.replication_stats
+              (nodeid, sentlsn, writelsn, flushlsn, replaylsn,
+               writelag, flushlag, replaylag, reporttime)
+       select reported.nodeid,
+              reported.sentlsn, reported.writelsn,
+              reported.flushlsn, reported.replaylsn,
+              reported.writelag, reported.flushlag, reported.replaylag,
+              now()
+         from reported
+              join pgautofailover.node as standby
+                on standby.nodeid = reported.nodeid
+              join pgautofailover.node as primary_node
+                on primary_node.formationid = standby.formationid
+               and primary_node.groupid = standby.groupid
+        where primary_node.nodeid = $1
+          and standby.nodeid <> $1
+  on conflict (nodeid)
+    do update set sentlsn = excluded.sentlsn,
+                  writelsn = excluded.writelsn,
+                  flushlsn = excluded.flushlsn,
+                  replaylsn = excluded.replaylsn,
+                  writelag = excluded.writelag,
+                  flushlag = excluded.flushlag,
+                  replaylag = excluded.replaylag,
+                  reporttime = excluded.reporttime
+    returning nodeid
+  )
+  select count(*)::int from upserted;
+$$;
+
+comment on function
+        pgautofailover.report_replication_stats(bigint,bigint[],pg_lsn[],pg_lsn[],pg_lsn[],pg_lsn[],interval[],interval[],interval[])
+        is 'record the replication progress of the standbys of a primary node';
+
+grant execute on function
+      pgautofailover.report_replication_stats(bigint,bigint[],pg_lsn[],pg_lsn[],pg_lsn[],pg_lsn[],interval[],interval[],interval[])
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_replication_slots
+ (
+    IN node_id          bigint,
+    IN standby_ids      bigint[],
+    IN slots_active     bool[],
+    IN retained_bytes   bigint[],
+    IN wal_status       text[],
+   OUT standby_id       bigint,
+   OUT standby_name     text,
+   OUT standby_host     text,
+   OUT standby_port     int,
+   OUT standby_lsn      pg_lsn,
+   OUT standby_is_primary bool
+ )
+RETURNS SETOF record LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with reported(nodeid, slotactive, retainedbytes, walstatus) as
+  (
+    select * from unnest($2, $3, $4, $5)
+  ),
+  upserted as
+  (
+       insert into pgautofailover.replication_slot_stats
+              (nodeid, slotactive, retainedbytes, walstatus, reporttime)
+       select reported.nodeid, reported.slotactive,
+              reported.retainedbytes, reported.walstatus,
+              now()
+         from reported
+              join pgautofailover.node as standby
+                on standby.nodeid = reported.nodeid
+              join pgautofailover.node as primary_node
+                on primary_node.formationid = standby.formationid
+               and primary_node.groupid = standby.groupid
+        where primary_node.nodeid = $1
+          and standby.nodeid <> $1
+  on conflict (nodeid)
+    do update set slotactive = excluded.slotactive,
+                  retainedbytes = excluded.retainedbytes,
+                  walstatus = excluded.walstatus,
+                  reporttime = excluded.reporttime
+    returning nodeid, slotactive, retainedbytes, walstatus
+  ),
+  budget(bytes) as
+  (
+    select pg_size_bytes(
+             current_setting('pgautofailover.replication_slot_wal_budget'))
+  ),
+  invalidated as
+  (
+    select upserted.nodeid, upserted.retainedbytes, upserted.walstatus
+      from upserted, budget
+     where not upserted.slotactive
+       and (   upserted.walstatus = 'lost'
+            or (budget.bytes > 0 and upserted.retainedbytes > budget.bytes))
+  ),
+  events as
+  (
+       insert into pgautofailover.event
+              (formationid, nodeid, groupid, nodename, nodehost, nodeport,
+               reportedstate, goalstate, reportedrepstate, reportedlsn,
+               candidatepriority, replicationquorum, description)
+       select formationid, node.nodeid, groupid, nodename, nodehost, nodeport,
+              reportedstate, goalstate, reportedrepstate, reportedlsn,
+              candidatepriority, replicationquorum,
+              format('Invalidating the replication slot of node %s "%s" '
+                     '(%s:%s) on its primary, which %s',
+                     node.nodeid, nodename, nodehost, nodeport,
+                     case when invalidated.walstatus = 'lost'
+                          then 'has been invalidated by Postgres already'
+                          else format('retains %s of WAL',
+                                      pg_size_pretty(invalidated.retainedbytes))
+                      end)
+         from pgautofailover.node
+              join invalidated on invalidated.nodeid = node.nodeid
+    returning eventid
+  )
+  select node.nodeid, node.nodename, node.nodehost, node.nodeport,
+         node.reportedlsn, false
+    from pgautofailover.node
+         join invalidated on invalidated.nodeid = node.nodeid
+   order by node.nodeid;
+$$;
+
+comment on function
+        pgautofailover.report_replication_slots(bigint,bigint[],bool[],bigint[],text[])
+        is 'record the WAL retained by the slots of a primary node, returns the slots to invalidate';
+
+grant execute on function
+      pgautofailover.report_replication_slots(bigint,bigint[],bool[],bigint[],text[])
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_drain_stats
+ (
+    IN node_id                 bigint,
+    IN write_xacts             int,
+    IN oldest_write_xact_ms    bigint,
+    IN prepared_xacts          int,
+    IN oldest_prepared_xact_ms bigint
+ )
+RETURNS void LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  insert into pgautofailover.drain_stats
+         (nodeid, writexacts, oldestwritexact,
+          preparedxacts, oldestpreparedxact, reporttime)
+  values ($1, $2, case when $3 >= 0 then $3 * interval '1 ms' end,
+          $4, case when $5 >= 0 then $5 * interval '1 ms' end,
+          now())
+  on conflict (nodeid)
+    do update set writexacts = excluded.writexacts,
+                  oldestwritexact = excluded.oldestwritexact,
+                  preparedxacts = excluded.preparedxacts,
+                  oldestpreparedxact = excluded.oldestpreparedxact,
+                  reporttime = excluded.reporttime;
+$$;
+
+comment on function
+        pgautofailover.report_drain_stats(bigint,int,bigint,int,bigint)
+        is 'record the write and prepared transactions in progress on a primary node';
+
+grant execute on function
+      pgautofailover.report_drain_stats(bigint,int,bigint,int,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_sync_rep_stall
+ (
+    IN node_id      bigint,
+    IN standby_ids  bigint[],
+    IN stall_ms     int
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$report_sync_rep_stall$$;
+
+comment on function pgautofailover.report_sync_rep_stall(bigint,bigint[],int)
+        is 'degrade the quorum standbys that are not streaming when commits wait on the primary';
+
+grant execute on function
+      pgautofailover.report_sync_rep_stall(bigint,bigint[],int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_storage_health
+ (
+    IN node_id      bigint,
+    IN p50_us       bigint,
+    IN p99_us       bigint,
+    IN max_us       bigint,
+    IN stall_ms     int
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$report_storage_health$$;
+
+comment on function pgautofailover.report_storage_health(bigint,bigint,bigint,bigint,int)
+        is 'report the I/O watchdog latency and current stall of a node';
+
+grant execute on function
+      pgautofailover.report_storage_health(bigint,bigint,bigint,bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_wal_space
+ (
+    IN node_id      bigint,
+    IN free_bytes   bigint,
+    IN wal_rate     bigint,
+    IN time_to_full int
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$report_wal_space$$;
+
+comment on function pgautofailover.report_wal_space(bigint,bigint,bigint,int)
+        is 'report the pg_wal free space of a node and when it is expected to be full';
+
+grant execute on function
+      pgautofailover.report_wal_space(bigint,bigint,bigint,int)
+   to autoctl_node;
+
+--
+-- A standby node that does not participate in the replication quorum may
+-- stream from another standby node rather than from the primary, to spare
+-- the primary some WAL senders. The keeper of the node gets its effective
+-- upstream node with pgautofailover.get_upstream(), which falls back to the
+-- primary when the configured upstream node is not a healthy secondary, and
+-- records the node it then streams from in streamingnodeid (NULL for the
+-- primary). A joining standby node gets the node to take its base backup
+-- from with pgautofailover.get_basebackup_source(), which is recorded in
+-- basebackupnodeid so that concurrent base backups are spread around.
+--
+CREATE TABLE pgautofailover.node_upstream
+ (
+    nodeid               bigint not null,
+    upstreamnodeid       bigint,
+    streamingnodeid      bigint,
+    basebackupnodeid     bigint,
+
+    PRIMARY KEY (nodeid),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE,
+    FOREIGN KEY (upstreamnodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE SET NULL,
+    FOREIGN KEY (basebackupnodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE SET NULL,
+    CHECK (nodeid <> upstreamnodeid)
+ );
+
+GRANT SELECT ON pgautofailover.node_upstream TO autoctl_node;
+
+--
+-- The node table only has the last report of each node. The history keeps a
+-- sample of the LSN, lag and health of each node every
+-- pgautofailover.node_history_resolution, in a ring of
+-- pgautofailover.node_history_size slots per node whose rows are updated in
+-- place, so that the table never grows.
+--
+CREATE TABLE pgautofailover.node_history
+ (
+    nodeid               bigint not null,
+    slot                 int not null,
+    sampletime           timestamptz not null,
+    reportedstate        pgautofailover.replication_state not null,
+    reportedlsn          pg_lsn not null,
+    lagbytes             bigint not null,
+    health               integer not null,
+    pgisrunning          bool not null,
+
+    PRIMARY KEY (nodeid, slot),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ )
+ WITH (fillfactor = 50);
+
+GRANT SELECT ON pgautofailover.node_history TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_properties
+ (
+    IN formation_id         text,
+    IN node_names           text[],
+    IN candidate_priorities int[] default null,
+    IN replication_quorums  bool[] default null
+ )
+RETURNS int LANGUAGE C SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_node_properties$$;
+
+comment on function pgautofailover.set_node_properties(text,text[],int[],bool[])
+        is 'sets the candidate priority and replication quorum of a list of nodes, and returns how many primary nodes are applying the settings';
+
+grant execute on function
+      pgautofailover.set_node_properties(text,text[],int[],bool[])
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_node_upstream
+ (
+    IN formation_id       text,
+    IN node_name          text,
+    IN upstream_node_name text default null
+ )
+RETURNS bool LANGUAGE C SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$set_node_upstream$$;
+
+comment on function pgautofailover.set_node_upstream(text, text, text)
+        is 'sets the standby node to stream from, NULL to stream from the primary';
+
+grant execute on function
+      pgautofailover.set_node_upstream(text, text, text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_upstream
+ (
+    IN node_id            bigint,
+   OUT upstream_node_id   bigint,
+   OUT upstream_name      text,
+   OUT upstream_host      text,
+   OUT upstream_port      int
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$get_upstream$$;
+
+comment on function pgautofailover.get_upstream(bigint)
+        is 'get the node to stream from for a standby node';
+
+grant execute on function pgautofailover.get_upstream(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_basebackup_source
+ (
+    IN node_id            bigint,
+   OUT source_node_id     bigint,
+   OUT source_name        text,
+   OUT source_host        text,
+   OUT source_port        int
+ )
+RETURNS record LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$get_basebackup_source$$;
+
+comment on function pgautofailover.get_basebackup_source(bigint)
+        is 'get the node to take a base backup from for a joining standby node';
+
+grant execute on function pgautofailover.get_basebackup_source(bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.wait_for_state_change
+ (
+    IN formation_id       text,
+    IN group_id           int,
+    IN known_change_count bigint,
+    IN timeout_ms         int,
+   OUT change_count       bigint
+ )
+RETURNS bigint LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$wait_for_state_change$$;
+
+comment on function pgautofailover.wait_for_state_change(text,int,bigint,int)
+        is 'wait for a state change in a group, without using LISTEN';
+
+grant execute on function
+      pgautofailover.wait_for_state_change(text,int,bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.wait_for_node_state
+ (
+    IN formation_id       text,
+    IN group_id           int,
+    IN node_id            bigint,
+    IN target_state       pgautofailover.replication_state,
+    IN timeout_ms         int,
+   OUT reached_node_id    bigint
+ )
+RETURNS bigint LANGUAGE C
+AS 'MODULE_PATHNAME', $$wait_for_node_state$$;
+
+comment on function pgautofailover.wait_for_node_state(text,int,bigint,pgautofailover.replication_state,int)
+        is 'wait until a node, or any node of a group, reaches a given state';
+
+grant execute on function
+      pgautofailover.wait_for_node_state(text,int,bigint,pgautofailover.replication_state,int)
+   to autoctl_node;
+
+--
+-- Read-scaling clients connect to the secondary nodes of a formation. The
+-- lag of each secondary node is counted in bytes from the most advanced LSN
+-- reported in its group, and the healthy and least lagging secondary nodes
+-- come first, so that clients don't pile onto a lagging node.
+--
+CREATE FUNCTION pgautofailover.read_replicas
+ (
+    IN formation_id         text DEFAULT 'default',
+    IN cluster_name         text DEFAULT 'default',
+    IN max_lag_bytes        bigint DEFAULT NULL,
+   OUT node_id              bigint,
+   OUT node_name            text,
+   OUT node_host            text,
+   OUT node_port            int,
+   OUT reported_lsn         pg_lsn,
+   OUT lag_bytes            bigint,
+   OUT replay_lag           interval,
+   OUT report_age           interval,
+   OUT health               int
+ )
+RETURNS SETOF record LANGUAGE SQL
+AS $$
+  with groupnodes as
+  (
+    select node.*,
+           max(node.reportedlsn) over () as grouplsn
+      from pgautofailover.node as node
+     where node.formationid = formation_id
+       and node.groupid = 0
+  )
+    select groupnodes.nodeid,
+           groupnodes.nodename,
+           groupnodes.nodehost,
+           groupnodes.nodeport,
+           groupnodes.reportedlsn,
+           (groupnodes.grouplsn - groupnodes.reportedlsn)::bigint,
+           stats.replaylag,
+           now() - groupnodes.walreporttime,
+           groupnodes.health
+      from groupnodes
+           left join pgautofailover.replication_stats as stats
+                  on stats.nodeid = groupnodes.nodeid
+     where groupnodes.nodecluster = cluster_name
+       and groupnodes.reportedstate = 'secondary'
+       and groupnodes.goalstate = 'secondary'
+       and groupnodes.reportedpgisrunning
+       and groupnodes.health <> 0
+       and (max_lag_bytes is null
+            or groupnodes.grouplsn - groupnodes.reportedlsn <= max_lag_bytes)
+  order by groupnodes.health desc,
+           groupnodes.grouplsn - groupnodes.reportedlsn,
+           groupnodes.nodeid;
+$$;
+
+comment on function pgautofailover.read_replicas(text,text,bigint)
+        is 'get the secondary nodes of a formation, least lagging first';
+
+CREATE FUNCTION pgautofailover.formation_read_only_uri
+ (
+    IN formation_id         text DEFAULT 'default',
+    IN cluster_name         text DEFAULT 'default',
+    IN sslmode              text DEFAULT 'prefer',
+    IN sslrootcert          text DEFAULT '',
+    IN sslcrl               text DEFAULT '',
+    IN max_lag_bytes        bigint DEFAULT NULL
+ )
+RETURNS text LANGUAGE SQL
+AS $$
+    select format(
+               'postgres://%s/%s?sslmode=%s%s%s',
+               string_agg(format('%s:%s', replica.node_host, replica.node_port),
+                          ',' order by replica.rank),
+               min(formation.dbname),
+               sslmode,
+               CASE WHEN sslrootcert = ''
+                   THEN ''
+                   ELSE '&sslrootcert=' || sslrootcert
+               END,
+               CASE WHEN sslcrl = ''
+                   THEN ''
+                   ELSE '&sslcrl=' || sslcrl
+               END
+           ) as uri
+      from pgautofailover.read_replicas(formation_id, cluster_name,
+                                        max_lag_bytes)
+           with ordinality
+           as replica(node_id, node_name, node_host, node_port,
+                      reported_lsn, lag_bytes, replay_lag, report_age,
+                      health, rank)
+           join pgautofailover.formation
+             on formation.formationid = formation_id
+    having count(*) > 0;
+$$;
+
+comment on function pgautofailover.formation_read_only_uri(text,text,text,text,text,bigint)
+        is 'get a multi-host uri of the secondary nodes of a formation';
+
+--
+-- A monitor can also be used as a directory of monitor shards, where each
+-- formation is assigned to the monitor that manages it. pg_autoctl then
+-- resolves the monitor of a formation with pgautofailover.formation_shard()
+-- when given the directory as --monitor, and the keepers only ever connect
+-- to the monitor of their formation. Formations that are not found in the
+-- directory are managed by the directory monitor itself.
+--
+CREATE TABLE pgautofailover.formation_shard
+ (
+    formationid          text NOT NULL,
+    monitoruri           text NOT NULL,
+    registeredat         timestamptz NOT NULL DEFAULT now(),
+
+    PRIMARY KEY   (formationid)
+ );
+
+GRANT SELECT ON pgautofailover.formation_shard TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_formation_shard
+ (
+    IN formation_id         text,
+    IN monitor_uri          text
+ )
+RETURNS void LANGUAGE plpgsql STRICT
+AS $$
+begin
+    if exists(select 1
+                from pgautofailover.node
+               where formationid = formation_id)
+    then
+        raise exception object_not_in_prerequisite_state
+        using message = format('formation "%s" has nodes registered on '
+                               'this monitor', formation_id),
+                 hint = 'Drop the nodes of the formation first.';
+    end if;
+
+    insert into pgautofailover.formation_shard (formationid, monitoruri)
+         values (formation_id, monitor_uri)
+    on conflict (formationid)
+      do update set monitoruri = excluded.monitoruri,
+                    registeredat = now();
+end;
+$$;
+
+comment on function pgautofailover.set_formation_shard(text,text)
+        is 'assign a formation to the monitor shard at the given uri';
+
+CREATE FUNCTION pgautofailover.drop_formation_shard
+ (
+    IN formation_id         text
+ )
+RETURNS bool LANGUAGE SQL STRICT
+AS $$
+  with deleted as
+  (
+      delete from pgautofailover.formation_shard
+       where formationid = formation_id
+   returning formationid
+  )
+  select exists(select 1 from deleted);
+$$;
+
+comment on function pgautofailover.drop_formation_shard(text)
+        is 'manage a formation on this monitor again';
+
+CREATE FUNCTION pgautofailover.formation_shard
+ (
+    IN formation_id         text
+ )
+RETURNS text LANGUAGE SQL STRICT STABLE
+AS $$
+    select monitoruri
+      from pgautofailover.formation_shard
+     where formationid = formation_id;
+$$;
+
+comment on function pgautofailover.formation_shard(text)
+        is 'get the uri of the monitor shard of a formation, NULL when it is managed here';
+
+grant execute on function pgautofailover.formation_shard(text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.get_nodes_page
+ (
+    IN formation_id     text default 'default',
+    IN group_id         int default NULL,
+    IN after_node_id    bigint default NULL,
+    IN page_size        int default NULL,
+   OUT node_id          bigint,
+   OUT node_name        text,
+   OUT node_host        text,
+   OUT node_port        int,
+   OUT node_lsn         pg_lsn,
+   OUT node_is_primary  bool
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$get_nodes$$;
+
+comment on function pgautofailover.get_nodes_page(text,int,bigint,int)
+        is 'get a page of the nodes in a group, sorted by node id';
+
+grant execute on function pgautofailover.get_nodes_page(text,int,bigint,int)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.current_state_page
+ (
+    IN formation_id         text default 'default',
+    IN group_id             int default NULL,
+    IN node_state           pgautofailover.replication_state default NULL,
+    IN node_health          int default NULL,
+    IN lagging_only         bool default false,
+    IN after_group_id       int default NULL,
+    IN after_node_id        bigint default NULL,
+    IN page_size            int default NULL,
+   OUT formation_kind       text,
+   OUT nodename             text,
+   OUT nodehost             text,
+   OUT nodeport             int,
+   OUT group_id             int,
+   OUT node_id              bigint,
+   OUT current_group_state  pgautofailover.replication_state,
+   OUT assigned_group_state pgautofailover.replication_state,
+   OUT candidate_priority	int,
+   OUT replication_quorum	bool,
+   OUT reported_tli         int,
+   OUT reported_lsn         pg_lsn,
+   OUT health               integer
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$current_state_page$$;
+
+comment on function pgautofailover.current_state_page(text,int,pgautofailover.replication_state,int,bool,int,bigint,int)
+        is 'get a filtered page of the current state of the nodes of a formation';
+
+CREATE FUNCTION pgautofailover.fleet_node_counts
+ (
+   OUT formation_id     text,
+   OUT reported_state   pgautofailover.replication_state,
+   OUT health           integer,
+   OUT nodes            bigint
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$fleet_node_counts$$;
+
+comment on function pgautofailover.fleet_node_counts()
+        is 'get how many nodes of each formation are in each reported state and health';
+
+grant execute on function pgautofailover.fleet_node_counts()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.fleet_group_counts
+ (
+   OUT formation_id                      text,
+   OUT nodes                             bigint,
+   OUT groups                            bigint,
+   OUT groups_in_failover                bigint,
+   OUT groups_without_healthy_secondary  bigint
+ )
+RETURNS SETOF record LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$fleet_group_counts$$;
+
+comment on function pgautofailover.fleet_group_counts()
+        is 'get how many groups of each formation are failing over or without a healthy secondary';
+
+grant execute on function pgautofailover.fleet_group_counts()
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_replay_progress
+ (
+    IN node_id      bigint,
+    IN received_lsn pg_lsn,
+    IN replay_lsn   pg_lsn,
+    IN apply_rate   bigint,
+    IN receiver_staleness_ms bigint default -1,
+    IN catchup_rate bigint default 0
+ )
+RETURNS bool LANGUAGE C STRICT SECURITY DEFINER
+AS 'MODULE_PATHNAME', $$report_replay_progress$$;
+
+comment on function pgautofailover.report_replay_progress(bigint,pg_lsn,pg_lsn,bigint,bigint,bigint)
+        is 'report the received and replayed LSN of a standby node, its apply and catch-up rates, and the staleness of its WAL receiver';
+
+grant execute on function
+      pgautofailover.report_replay_progress(bigint,pg_lsn,pg_lsn,bigint,bigint,bigint)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.replay_progress
+ (
+   OUT nodeid          bigint,
+   OUT report_time     timestamptz,
+   OUT received_lsn    pg_lsn,
+   OUT replay_lsn      pg_lsn,
+   OUT apply_rate      bigint,
+   OUT receiver_staleness_ms bigint,
+   OUT catchup_rate    bigint,
+   OUT catchup_eta     interval
+ )
+RETURNS SETOF record LANGUAGE C
+AS 'MODULE_PATHNAME', $$replay_progress$$;
+
+comment on function pgautofailover.replay_progress()
+        is 'get the received and replayed LSN, the apply and catch-up rates, the WAL receiver staleness, and the catch-up ETA of each standby node';
+
+--
+-- The keepers measure the network round-trip time to the other nodes and to
+-- the application anchors listed in their pg_autoctl.latency_anchors setting.
+-- Targets are "host:port", targetnodeid is NULL for the application anchors,
+-- and rtt is NULL when the keeper couldn't connect to the target in time. The
+-- monitor prefers to promote the nodes that are close to the applications,
+-- see pgautofailover.anchor_latency_priority_step.
+--
+CREATE TABLE pgautofailover.node_latency
+ (
+    nodeid               bigint not null,
+    target               text not null,
+    targetnodeid         bigint,
+    rtt                  interval,
+    reporttime           timestamptz not null default now(),
+
+    PRIMARY KEY (nodeid, target),
+    FOREIGN KEY (nodeid) REFERENCES pgautofailover.node_base(nodeid)
+        ON DELETE CASCADE
+ )
+ WITH (fillfactor = 25);
+
+GRANT SELECT ON pgautofailover.node_latency TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_node_latency
+ (
+    IN node_id          bigint,
+    IN target_node_ids  bigint[],
+    IN targets          text[],
+    IN rtts_us          bigint[]
+ )
+RETURNS void LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with reported(targetnodeid, target, rtt) as
+  (
+    select distinct on (target)
+           targetnodeid, target,
+           case when rttus >= 0 then rttus * interval '1 microsecond' end
+      from unnest($2, $3, $4) as t(targetnodeid, target, rttus)
+  ),
+  removed as
+  (
+    delete from pgautofailover.node_latency
+     where nodeid = $1
+       and target <> all($3)
+  )
+  insert into pgautofailover.node_latency
+         (nodeid, target, targetnodeid, rtt, reporttime)
+  select $1, target, targetnodeid, rtt, now()
+    from reported
+  on conflict (nodeid, target)
+    do update set targetnodeid = excluded.targetnodeid,
+                  rtt = excluded.rtt,
+                  reporttime = excluded.reporttime;
+$$;
+
+comment on function
+        pgautofailover.report_node_latency(bigint,bigint[],text[],bigint[])
+        is 'record the network round-trip time from a node to the other nodes and the application anchors';
+
+grant execute on function
+      pgautofailover.report_node_latency(bigint,bigint[],text[],bigint[])
+   to autoctl_node;
+
+--
+-- Formations opt in to failover drills: switchovers that the monitor runs
+-- on a schedule, once every drill_interval at most, when the time of day on
+-- the monitor is between window_start and window_end. A window may span
+-- midnight. Each drill is recorded in the failover_drill_history table, with
+-- the duration of its steps and the application-visible unavailability that
+-- the benchmark clients report.
+--
+CREATE TABLE pgautofailover.failover_drill
+ (
+    formationid          text not null,
+    window_start         time not null,
+    window_end           time not null,
+    drill_interval       interval not null default '1 day',
+
+    PRIMARY KEY (formationid),
+    FOREIGN KEY (formationid) REFERENCES pgautofailover.formation(formationid)
+        ON DELETE CASCADE
+ );
+
+GRANT SELECT ON pgautofailover.failover_drill TO autoctl_node;
+
+CREATE TABLE pgautofailover.failover_drill_history
+ (
+    drillid              bigserial,
+    formationid          text not null,
+    groupid              int not null,
+    primarynodeid        bigint,
+    traceid              text,
+    monitor_version      text not null,
+    status               text not null default 'running',
+    starttime            timestamptz not null default now(),
+    endtime              timestamptz,
+    detection            interval,
+    promotion            interval,
+    rejoin               interval,
+    unavailability       interval,
+    message              text,
+
+    PRIMARY KEY (drillid),
+    CHECK (status IN ('running', 'completed', 'failed'))
+ );
+
+CREATE INDEX failover_drill_history_formationid_starttime_idx
+    ON pgautofailover.failover_drill_history (formationid, starttime);
+
+GRANT SELECT ON pgautofailover.failover_drill_history TO autoctl_node;
+
+CREATE FUNCTION pgautofailover.set_failover_drill
+ (
+    IN formation_id   text,
+    IN window_start   time,
+    IN window_end     time,
+    IN drill_interval interval default '1 day'
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with upserted as
+  (
+      insert into pgautofailover.failover_drill
+             (formationid, window_start, window_end, drill_interval)
+      select formationid, $2, $3, $4
+        from pgautofailover.formation
+       where formationid = $1
+      on conflict (formationid)
+        do update set window_start = excluded.window_start,
+                      window_end = excluded.window_end,
+                      drill_interval = excluded.drill_interval
+   returning formationid
+  )
+  select exists(select 1 from upserted);
+$$;
+
+comment on function
+        pgautofailover.set_failover_drill(text,time,time,interval)
+        is 'run scheduled failover drills in a formation, within the given time window';
+
+grant execute on function
+      pgautofailover.set_failover_drill(text,time,time,interval)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.drop_failover_drill
+ (
+    IN formation_id text
+ )
+RETURNS bool LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with deleted as
+  (
+      delete from pgautofailover.failover_drill
+       where formationid = $1
+   returning formationid
+  )
+  select exists(select 1 from deleted);
+$$;
+
+comment on function pgautofailover.drop_failover_drill(text)
+        is 'stop running scheduled failover drills in a formation';
+
+grant execute on function pgautofailover.drop_failover_drill(text)
+   to autoctl_node;
+
+CREATE FUNCTION pgautofailover.report_drill_outage
+ (
+    IN formation_id text,
+    IN group_id     int,
+    IN outage_start timestamptz,
+    IN outage       interval
+ )
+RETURNS int LANGUAGE SQL STRICT SECURITY DEFINER
+AS $$
+  with updated as
+  (
+      update pgautofailover.failover_drill_history
+         set unavailability = greatest(unavailability, $4)
+       where formationid = $1
+         and groupid = $2
+         and $3 <= coalesce(endtime, now())
+         and $3 + $4 >= starttime
+   returning drillid
+  )
+  select count(*)::int from updated;
+$$;
+
+comment on function
+        pgautofailover.report_drill_outage(text,int,timestamptz,interval)
+        is 'report an outage seen by an application during failover drills';
+
+grant execute on function
+      pgautofailover.report_drill_outage(text,int,timestamptz,interval)
+   to autoctl_node;
+
+--
+-- formation_uri is now implemented in C, so that its answer is cached until
+-- the next topology change.
+--
+CREATE OR REPLACE FUNCTION pgautofailover.formation_uri
+ (
+    IN formation_id         text DEFAULT 'default',
+    IN cluster_name         text DEFAULT 'default',
+    IN sslmode              text DEFAULT 'prefer',
+    IN sslrootcert          text DEFAULT '',
+    IN sslcrl               text DEFAULT ''
+ )
+RETURNS text LANGUAGE C STRICT
+AS 'MODULE_PATHNAME', $$formation_uri$$;
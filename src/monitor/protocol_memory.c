@@ -0,0 +1,445 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_memory.c
+ *
+ * Implementation of the memory context of the monitor protocol calls, and
+ * of the per-backend memory statistics.
+ *
+ * Keepers keep their monitor session open for weeks, so that any memory
+ * that our protocol functions leave behind in a long-lived context shows
+ * as a backend that slowly grows. With
+ * pgautofailover.enable_protocol_memory_context the protocol calls run in
+ * a memory context of their own, which is reset at the end of each
+ * transaction: what a call allocates can't outlive it, and we know how much
+ * memory the calls needed.
+ *
+ * After each protocol call a backend also publishes the size of its memory
+ * contexts in shared memory, in a slot that it claims at its first protocol
+ * call, and the pgautofailover.stat_protocol_memory view reports them. The
+ * sizes are only known with Postgres 13 and later.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "protocol_memory.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+
+/* memory statistics of a backend, a slot is free when its pid is 0 */
+typedef struct ProtocolMemorySlot
+{
+	int pid;
+	int64 calls;
+	int64 callBytes;            /* held by the calls of the last transaction */
+	int64 maxCallBytes;
+	int64 cacheBytes;           /* CacheMemoryContext and its children */
+	int64 totalBytes;           /* TopMemoryContext and its children */
+	TimestampTz lastCallTime;
+} ProtocolMemorySlot;
+
+typedef struct ProtocolMemoryData
+{
+	slock_t mutex;              /* protects the slots */
+	int slotCount;
+	ProtocolMemorySlot slots[FLEXIBLE_ARRAY_MEMBER];
+} ProtocolMemoryData;
+
+
+/* GUC variable */
+bool EnableProtocolMemoryContext = false;
+
+/* shared memory statistics, NULL when the library was not preloaded */
+static ProtocolMemoryData *ProtocolMemory = NULL;
+
+/* the slot of this backend, claimed at its first protocol call */
+static ProtocolMemorySlot *MyProtocolMemorySlot = NULL;
+static bool ProtocolMemorySlotClaimed = false;
+
+/* the memory context of the protocol calls, and the one of their caller */
+static MemoryContext ProtocolCallContext = NULL;
+static MemoryContext ProtocolCallerContext = NULL;
+static int ProtocolMemoryCallDepth = 0;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+static Size ProtocolMemoryShmemSize(void);
+static void ProtocolMemoryShmemInit(void);
+static void ProtocolMemoryXactCallback(XactEvent event, void *arg);
+static void ClaimProtocolMemorySlot(void);
+static void ReleaseProtocolMemorySlot(int code, Datum arg);
+static void PublishProtocolMemoryStats(void);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(stat_protocol_memory_backends);
+
+
+/*
+ * InitializeProtocolMemory, called at server start, requests the shared
+ * memory for the per-backend memory statistics, a slot per connection.
+ */
+void
+InitializeProtocolMemory(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(ProtocolMemoryShmemSize());
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ProtocolMemoryShmemInit;
+
+	RegisterXactCallback(ProtocolMemoryXactCallback, NULL);
+}
+
+
+/*
+ * ProtocolMemoryShmemSize computes how much shared memory is required.
+ */
+static Size
+ProtocolMemoryShmemSize(void)
+{
+	return add_size(offsetof(ProtocolMemoryData, slots),
+					mul_size(MaxConnections, sizeof(ProtocolMemorySlot)));
+}
+
+
+/*
+ * ProtocolMemoryShmemInit initializes the requested shared memory for the
+ * per-backend memory statistics.
+ */
+static void
+ProtocolMemoryShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ProtocolMemory =
+		(ProtocolMemoryData *) ShmemInitStruct("pg_auto_failover Protocol Memory",
+											   ProtocolMemoryShmemSize(),
+											   &alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(ProtocolMemory, 0, ProtocolMemoryShmemSize());
+
+		SpinLockInit(&ProtocolMemory->mutex);
+		ProtocolMemory->slotCount = MaxConnections;
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * ProtocolMemoryCallStart is called by the protocol statistics fmgr hook
+ * when a protocol function is called. The outermost call switches to the
+ * protocol call memory context.
+ */
+void
+ProtocolMemoryCallStart(void)
+{
+	if (ProtocolMemoryCallDepth++ > 0)
+	{
+		return;
+	}
+
+	if (!EnableProtocolMemoryContext)
+	{
+		return;
+	}
+
+	if (ProtocolCallContext == NULL)
+	{
+		ProtocolCallContext = AllocSetContextCreate(TopMemoryContext,
+													"pgautofailover protocol call",
+													ALLOCSET_DEFAULT_SIZES);
+	}
+
+	ProtocolCallerContext = MemoryContextSwitchTo(ProtocolCallContext);
+}
+
+
+/*
+ * ProtocolMemoryCallEnd is called by the protocol statistics fmgr hook when
+ * a protocol function returns or fails. The outermost call switches back to
+ * the memory context of its caller, which may use the result of the call
+ * until the end of the transaction, and publishes the memory statistics of
+ * the backend.
+ */
+void
+ProtocolMemoryCallEnd(void)
+{
+	if (ProtocolMemoryCallDepth <= 0 || --ProtocolMemoryCallDepth > 0)
+	{
+		return;
+	}
+
+	if (ProtocolCallerContext != NULL)
+	{
+		MemoryContextSwitchTo(ProtocolCallerContext);
+		ProtocolCallerContext = NULL;
+	}
+
+	PublishProtocolMemoryStats();
+}
+
+
+/*
+ * ProtocolMemoryXactCallback resets the protocol call memory context at the
+ * end of each transaction, when the results of the calls can't be used
+ * anymore.
+ */
+static void
+ProtocolMemoryXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		{
+			ProtocolMemoryCallDepth = 0;
+			ProtocolCallerContext = NULL;
+
+			if (ProtocolCallContext != NULL)
+			{
+				MemoryContextReset(ProtocolCallContext);
+			}
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * ClaimProtocolMemorySlot finds a free slot for this backend, and releases
+ * it when the backend exits. When all the slots are taken, the memory
+ * statistics of this backend are not published.
+ */
+static void
+ClaimProtocolMemorySlot(void)
+{
+	ProtocolMemorySlotClaimed = true;
+
+	if (ProtocolMemory == NULL)
+	{
+		return;
+	}
+
+	SpinLockAcquire(&ProtocolMemory->mutex);
+
+	for (int index = 0; index < ProtocolMemory->slotCount; index++)
+	{
+		ProtocolMemorySlot *slot = &(ProtocolMemory->slots[index]);
+
+		if (slot->pid == 0)
+		{
+			memset(slot, 0, sizeof(ProtocolMemorySlot));
+			slot->pid = MyProcPid;
+
+			MyProtocolMemorySlot = slot;
+			break;
+		}
+	}
+
+	SpinLockRelease(&ProtocolMemory->mutex);
+
+	if (MyProtocolMemorySlot != NULL)
+	{
+		on_shmem_exit(ReleaseProtocolMemorySlot, (Datum) 0);
+	}
+}
+
+
+/*
+ * ReleaseProtocolMemorySlot frees the slot of this backend when it exits.
+ */
+static void
+ReleaseProtocolMemorySlot(int code, Datum arg)
+{
+	SpinLockAcquire(&ProtocolMemory->mutex);
+	MyProtocolMemorySlot->pid = 0;
+	SpinLockRelease(&ProtocolMemory->mutex);
+
+	MyProtocolMemorySlot = NULL;
+}
+
+
+/*
+ * PublishProtocolMemoryStats updates the memory statistics of this backend
+ * in shared memory.
+ */
+static void
+PublishProtocolMemoryStats(void)
+{
+	int64 callBytes = 0;
+	int64 cacheBytes = 0;
+	int64 totalBytes = 0;
+
+	if (!ProtocolMemorySlotClaimed)
+	{
+		ClaimProtocolMemorySlot();
+	}
+
+	if (MyProtocolMemorySlot == NULL)
+	{
+		return;
+	}
+
+#if (PG_VERSION_NUM >= 130000)
+	if (ProtocolCallContext != NULL)
+	{
+		callBytes = MemoryContextMemAllocated(ProtocolCallContext, true);
+	}
+
+	if (CacheMemoryContext != NULL)
+	{
+		cacheBytes = MemoryContextMemAllocated(CacheMemoryContext, true);
+	}
+
+	totalBytes = MemoryContextMemAllocated(TopMemoryContext, true);
+#endif
+
+	SpinLockAcquire(&ProtocolMemory->mutex);
+
+	MyProtocolMemorySlot->calls++;
+	MyProtocolMemorySlot->callBytes = callBytes;
+	MyProtocolMemorySlot->maxCallBytes =
+		Max(MyProtocolMemorySlot->maxCallBytes, callBytes);
+	MyProtocolMemorySlot->cacheBytes = cacheBytes;
+	MyProtocolMemorySlot->totalBytes = totalBytes;
+	MyProtocolMemorySlot->lastCallTime = GetCurrentTimestamp();
+
+	SpinLockRelease(&ProtocolMemory->mutex);
+}
+
+
+/*
+ * stat_protocol_memory_backends returns a row per backend that has called
+ * protocol functions, with its memory statistics. The sizes are NULL before
+ * Postgres 13, where we can't compute them.
+ */
+Datum
+stat_protocol_memory_backends(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	ProtocolMemorySlot *slots = NULL;
+
+	if (ProtocolMemory == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc tupleDescriptor = NULL;
+		int slotCount = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) !=
+			TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("return type must be a row type")));
+		}
+
+		funcctx->tuple_desc = BlessTupleDesc(tupleDescriptor);
+
+		/* copy the slots in use so that we don't hold the lock */
+		slots = (ProtocolMemorySlot *)
+				palloc0(mul_size(ProtocolMemory->slotCount,
+								 sizeof(ProtocolMemorySlot)));
+
+		SpinLockAcquire(&ProtocolMemory->mutex);
+
+		for (int index = 0; index < ProtocolMemory->slotCount; index++)
+		{
+			if (ProtocolMemory->slots[index].pid != 0)
+			{
+				slots[slotCount++] = ProtocolMemory->slots[index];
+			}
+		}
+
+		SpinLockRelease(&ProtocolMemory->mutex);
+
+		funcctx->user_fctx = slots;
+		funcctx->max_calls = slotCount;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	slots = (ProtocolMemorySlot *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		ProtocolMemorySlot *slot = &(slots[funcctx->call_cntr]);
+		bool knownSizes = PG_VERSION_NUM >= 130000;
+
+		HeapTuple resultTuple = NULL;
+		Datum values[7];
+		bool isNulls[7];
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int32GetDatum(slot->pid);
+		values[1] = Int64GetDatum(slot->calls);
+		values[2] = Int64GetDatum(slot->callBytes);
+		values[3] = Int64GetDatum(slot->maxCallBytes);
+		values[4] = Int64GetDatum(slot->cacheBytes);
+		values[5] = Int64GetDatum(slot->totalBytes);
+		values[6] = TimestampTzGetDatum(slot->lastCallTime);
+
+		isNulls[2] = !knownSizes || !EnableProtocolMemoryContext;
+		isNulls[3] = !knownSizes || !EnableProtocolMemoryContext;
+		isNulls[4] = !knownSizes;
+		isNulls[5] = !knownSizes;
+
+		resultTuple = heap_form_tuple(funcctx->tuple_desc, values, isNulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(resultTuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
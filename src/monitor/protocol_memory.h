@@ -0,0 +1,26 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_memory.h
+ *
+ * Declarations for the memory context of the monitor protocol calls, and
+ * for the per-backend memory statistics.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/* GUC variable */
+extern bool EnableProtocolMemoryContext;
+
+
+extern void InitializeProtocolMemory(void);
+
+extern void ProtocolMemoryCallStart(void);
+extern void ProtocolMemoryCallEnd(void);
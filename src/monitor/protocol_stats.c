@@ -0,0 +1,676 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_stats.c
+ *
+ * Implementation of pg_stat style counters for the monitor protocol
+ * functions.
+ *
+ * The keepers call node_active() every second or so, and a monitor that is
+ * slow to answer is a monitor that is about to trigger failovers. These
+ * statistics keep track of how many times each of the protocol functions
+ * has been called, how long the calls took, how long they waited on the
+ * formation and group locks, and how many times they had to run the group
+ * state machine.
+ *
+ * The calls are instrumented with the fmgr hooks, which PostgreSQL already
+ * calls around SECURITY DEFINER functions, so that none of the protocol
+ * functions have to be changed. The counters are kept in shared memory and
+ * are reported by the pgautofailover.stat_protocol view. They are shared by
+ * all the databases of the Postgres instance and are lost at restart.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "metadata.h"
+#include "protocol_memory.h"
+#include "protocol_stats.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "portability/instr_time.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+
+/*
+ * The protocol functions we keep statistics for, by SQL name. The position
+ * of a function in this array is the position of its counters in shared
+ * memory.
+ */
+static const char *ProtocolFunctionNames[] = {
+	"register_node",
+	"node_active",
+	"node_active_v2",
+	"get_nodes",
+	"get_primary",
+	"get_other_node",
+	"get_other_nodes",
+	"remove_node",
+	"perform_failover",
+	"perform_promotion",
+	"start_maintenance",
+	"stop_maintenance",
+	"set_node_candidate_priority",
+	"set_node_replication_quorum",
+	"update_node_metadata",
+	"synchronous_standby_names"
+};
+
+#define PROTOCOL_FUNCTION_COUNT \
+	(sizeof(ProtocolFunctionNames) / sizeof(ProtocolFunctionNames[0]))
+
+/*
+ * Latencies are also counted in a histogram so that we can estimate the
+ * 99th percentile without keeping every sample. Bucket i counts the calls
+ * that took less than 0.125ms * 2^i, and the last bucket counts the calls
+ * that took longer than that, up to the maximum.
+ */
+#define PROTOCOL_STATS_HISTOGRAM_SIZE 16
+#define PROTOCOL_STATS_HISTOGRAM_FIRST_BOUND 0.125
+
+/* counters of a single protocol function, in milliseconds */
+typedef struct ProtocolStatsEntry
+{
+	slock_t mutex;
+	int64 calls;
+	int64 errors;
+	double totalTime;
+	double maxTime;
+	double lockWaitTime;
+	int64 stateMachineRuns;
+	int64 histogram[PROTOCOL_STATS_HISTOGRAM_SIZE];
+} ProtocolStatsEntry;
+
+typedef struct ProtocolStatsData
+{
+	slock_t mutex;              /* protects resetTime */
+	TimestampTz resetTime;
+	ProtocolStatsEntry entries[PROTOCOL_FUNCTION_COUNT];
+} ProtocolStatsData;
+
+/*
+ * ProtocolCall is the backend-local state of a call that is in progress.
+ * Calls nest (a protocol function may call another one through SPI), and
+ * the fmgr hook events come in a strict LIFO order, so we keep them in a
+ * stack.
+ */
+typedef struct ProtocolCall
+{
+	int functionIndex;          /* -1 when not a protocol function */
+	bool continuation;          /* next call of a set-returning function */
+	instr_time startTime;
+	double lockWaitTime;
+	int64 stateMachineRuns;
+} ProtocolCall;
+
+#define PROTOCOL_CALL_STACK_SIZE 8
+
+
+/* shared memory statistics, NULL when the library was not preloaded */
+static ProtocolStatsData *ProtocolStats = NULL;
+
+/* stack of the calls in progress in this backend */
+static ProtocolCall ProtocolCallStack[PROTOCOL_CALL_STACK_SIZE];
+static int ProtocolCallDepth = 0;
+
+/* backend-local counters, sampled at the start and at the end of each call */
+static double BackendLockWaitTime = 0.0;
+static int64 BackendStateMachineRuns = 0;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static needs_fmgr_hook_type prev_needs_fmgr_hook = NULL;
+static fmgr_hook_type prev_fmgr_hook = NULL;
+
+
+static void ProtocolStatsShmemInit(void);
+static int ProtocolFunctionIndex(Oid functionId);
+static bool ProtocolStatsNeedsFmgrHook(Oid functionId);
+static void ProtocolStatsFmgrHook(FmgrHookEventType event,
+								  FmgrInfo *flinfo, Datum *arg);
+static void ProtocolStatsXactCallback(XactEvent event, void *arg);
+static void ProtocolCallStart(FmgrInfo *flinfo);
+static void ProtocolCallEnd(bool failed);
+static double HistogramPercentile(ProtocolStatsEntry *entry, double fraction);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(stat_protocol_functions);
+PG_FUNCTION_INFO_V1(stat_protocol_reset);
+
+
+/*
+ * InitializeProtocolStats, called at server start, requests the shared
+ * memory for the protocol statistics and installs the fmgr hooks that
+ * maintain them.
+ */
+void
+InitializeProtocolStats(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(sizeof(ProtocolStatsData));
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ProtocolStatsShmemInit;
+
+	prev_needs_fmgr_hook = needs_fmgr_hook;
+	needs_fmgr_hook = ProtocolStatsNeedsFmgrHook;
+
+	prev_fmgr_hook = fmgr_hook;
+	fmgr_hook = ProtocolStatsFmgrHook;
+
+	RegisterXactCallback(ProtocolStatsXactCallback, NULL);
+}
+
+
+/*
+ * ProtocolStatsShmemInit initializes the requested shared memory for the
+ * protocol statistics.
+ */
+static void
+ProtocolStatsShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ProtocolStats =
+		(ProtocolStatsData *) ShmemInitStruct("pg_auto_failover Protocol Stats",
+											  sizeof(ProtocolStatsData),
+											  &alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		memset(ProtocolStats, 0, sizeof(ProtocolStatsData));
+
+		SpinLockInit(&ProtocolStats->mutex);
+		ProtocolStats->resetTime = GetCurrentTimestamp();
+
+		for (int index = 0; index < PROTOCOL_FUNCTION_COUNT; index++)
+		{
+			SpinLockInit(&ProtocolStats->entries[index].mutex);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * ProtocolStatsAddLockWait adds the given time, in milliseconds, to the time
+ * that the current call spent waiting on monitor locks.
+ */
+void
+ProtocolStatsAddLockWait(double lockWaitTime)
+{
+	BackendLockWaitTime += lockWaitTime;
+}
+
+
+/*
+ * ProtocolStatsCountStateMachineRun counts a run of the group state machine
+ * for the current call.
+ */
+void
+ProtocolStatsCountStateMachineRun(void)
+{
+	BackendStateMachineRuns++;
+}
+
+
+/*
+ * ProtocolStatsXactCallback forgets about the calls in progress at the end
+ * of a transaction. Every call start is matched with an end or an abort
+ * event, this is only there so that a missed event can't skew the
+ * statistics of the next transactions.
+ */
+static void
+ProtocolStatsXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		{
+			ProtocolCallDepth = 0;
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * ProtocolFunctionIndex returns the position of the given function in
+ * ProtocolFunctionNames, or -1 when it is not one of our C protocol
+ * functions.
+ */
+static int
+ProtocolFunctionIndex(Oid functionId)
+{
+	HeapTuple procTuple = NULL;
+	Form_pg_proc procForm = NULL;
+	Oid schemaId = InvalidOid;
+	int functionIndex = -1;
+
+	/* built-in functions are never ours, and we need the catalogs */
+	if (functionId < FirstNormalObjectId || !IsTransactionState())
+	{
+		return -1;
+	}
+
+	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(functionId));
+	if (!HeapTupleIsValid(procTuple))
+	{
+		return -1;
+	}
+
+	procForm = (Form_pg_proc) GETSTRUCT(procTuple);
+
+	if (procForm->prolang == ClanguageId)
+	{
+		schemaId = get_namespace_oid(AUTO_FAILOVER_SCHEMA_NAME, true);
+	}
+
+	if (OidIsValid(schemaId) && procForm->pronamespace == schemaId)
+	{
+		const char *functionName = NameStr(procForm->proname);
+
+		for (int index = 0; index < PROTOCOL_FUNCTION_COUNT; index++)
+		{
+			if (strcmp(functionName, ProtocolFunctionNames[index]) == 0)
+			{
+				functionIndex = index;
+				break;
+			}
+		}
+	}
+
+	ReleaseSysCache(procTuple);
+
+	return functionIndex;
+}
+
+
+/*
+ * ProtocolStatsNeedsFmgrHook tells the function manager which functions
+ * need to go through our fmgr hook.
+ */
+static bool
+ProtocolStatsNeedsFmgrHook(Oid functionId)
+{
+	if (prev_needs_fmgr_hook != NULL && prev_needs_fmgr_hook(functionId))
+	{
+		return true;
+	}
+
+	if (ProtocolStats == NULL)
+	{
+		return false;
+	}
+
+	return ProtocolFunctionIndex(functionId) >= 0;
+}
+
+
+/*
+ * ProtocolStatsFmgrHook is called by the function manager before and after
+ * each call to the functions selected by ProtocolStatsNeedsFmgrHook, and
+ * when such a call fails.
+ *
+ * The private argument is left to the previous hook: we keep our own state
+ * in ProtocolCallStack.
+ */
+static void
+ProtocolStatsFmgrHook(FmgrHookEventType event, FmgrInfo *flinfo, Datum *arg)
+{
+	if (prev_fmgr_hook != NULL)
+	{
+		prev_fmgr_hook(event, flinfo, arg);
+	}
+
+	if (ProtocolStats == NULL)
+	{
+		return;
+	}
+
+	switch (event)
+	{
+		case FHET_START:
+		{
+			ProtocolCallStart(flinfo);
+			break;
+		}
+
+		case FHET_END:
+		{
+			ProtocolCallEnd(false);
+			break;
+		}
+
+		case FHET_ABORT:
+		{
+			ProtocolCallEnd(true);
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+}
+
+
+/*
+ * ProtocolCallStart pushes a new call on the stack of calls in progress.
+ */
+static void
+ProtocolCallStart(FmgrInfo *flinfo)
+{
+	ProtocolCall *call = NULL;
+
+	if (ProtocolCallDepth >= PROTOCOL_CALL_STACK_SIZE)
+	{
+		/* too deep to keep track of, only count the depth */
+		ProtocolCallDepth++;
+		return;
+	}
+
+	call = &ProtocolCallStack[ProtocolCallDepth++];
+
+	call->functionIndex = ProtocolFunctionIndex(flinfo->fn_oid);
+
+	/*
+	 * A set-returning function is called once per row, only count it once:
+	 * fn_extra is NULL on the first call and holds the FuncCallContext of
+	 * the function on the next ones.
+	 */
+	call->continuation = flinfo->fn_retset && flinfo->fn_extra != NULL;
+
+	call->lockWaitTime = BackendLockWaitTime;
+	call->stateMachineRuns = BackendStateMachineRuns;
+
+	if (call->functionIndex >= 0)
+	{
+		ProtocolMemoryCallStart();
+	}
+
+	INSTR_TIME_SET_CURRENT(call->startTime);
+}
+
+
+/*
+ * ProtocolCallEnd pops the current call from the stack and adds its
+ * statistics to the shared memory counters.
+ */
+static void
+ProtocolCallEnd(bool failed)
+{
+	ProtocolCall *call = NULL;
+	ProtocolStatsEntry *entry = NULL;
+	instr_time duration;
+	double elapsedTime = 0.0;
+	double lockWaitTime = 0.0;
+	int64 stateMachineRuns = 0;
+	int bucket = 0;
+	double bound = PROTOCOL_STATS_HISTOGRAM_FIRST_BOUND;
+
+	if (ProtocolCallDepth <= 0)
+	{
+		return;
+	}
+
+	if (ProtocolCallDepth-- > PROTOCOL_CALL_STACK_SIZE)
+	{
+		return;
+	}
+
+	call = &ProtocolCallStack[ProtocolCallDepth];
+
+	if (call->functionIndex < 0)
+	{
+		return;
+	}
+
+	ProtocolMemoryCallEnd();
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, call->startTime);
+
+	elapsedTime = INSTR_TIME_GET_MILLISEC(duration);
+	lockWaitTime = BackendLockWaitTime - call->lockWaitTime;
+	stateMachineRuns = BackendStateMachineRuns - call->stateMachineRuns;
+
+	if (!call->continuation)
+	{
+		while (bucket < PROTOCOL_STATS_HISTOGRAM_SIZE - 1 && elapsedTime >= bound)
+		{
+			bound *= 2;
+			bucket++;
+		}
+	}
+
+	entry = &ProtocolStats->entries[call->functionIndex];
+
+	SpinLockAcquire(&entry->mutex);
+
+	if (!call->continuation)
+	{
+		entry->calls++;
+		entry->histogram[bucket]++;
+	}
+
+	if (failed)
+	{
+		entry->errors++;
+	}
+
+	entry->totalTime += elapsedTime;
+	entry->lockWaitTime += lockWaitTime;
+	entry->stateMachineRuns += stateMachineRuns;
+
+	if (elapsedTime > entry->maxTime)
+	{
+		entry->maxTime = elapsedTime;
+	}
+
+	SpinLockRelease(&entry->mutex);
+}
+
+
+/*
+ * HistogramPercentile estimates the latency under which the given fraction
+ * of the calls were answered, as the upper bound of the histogram bucket
+ * where that fraction is reached. The estimate is never more than the
+ * maximum latency.
+ */
+static double
+HistogramPercentile(ProtocolStatsEntry *entry, double fraction)
+{
+	int64 totalCount = 0;
+	int64 count = 0;
+	double target = 0.0;
+	double bound = PROTOCOL_STATS_HISTOGRAM_FIRST_BOUND;
+
+	for (int bucket = 0; bucket < PROTOCOL_STATS_HISTOGRAM_SIZE; bucket++)
+	{
+		totalCount += entry->histogram[bucket];
+	}
+
+	if (totalCount == 0)
+	{
+		return 0.0;
+	}
+
+	target = fraction * totalCount;
+
+	for (int bucket = 0; bucket < PROTOCOL_STATS_HISTOGRAM_SIZE - 1; bucket++)
+	{
+		count += entry->histogram[bucket];
+
+		if (count >= target)
+		{
+			return Min(bound, entry->maxTime);
+		}
+
+		bound *= 2;
+	}
+
+	return entry->maxTime;
+}
+
+
+/*
+ * stat_protocol_functions returns a row per protocol function with the
+ * statistics collected since the last reset.
+ */
+Datum
+stat_protocol_functions(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TimestampTz resetTime = 0;
+
+	if (ProtocolStats == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc tupleDescriptor = NULL;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		funcctx->max_calls = PROTOCOL_FUNCTION_COUNT;
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) !=
+			TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("return type must be a row type")));
+		}
+
+		funcctx->tuple_desc = BlessTupleDesc(tupleDescriptor);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		int functionIndex = (int) funcctx->call_cntr;
+		ProtocolStatsEntry entry;
+
+		HeapTuple resultTuple = NULL;
+		Datum values[10];
+		bool isNulls[10];
+
+		SpinLockAcquire(&ProtocolStats->entries[functionIndex].mutex);
+		entry = ProtocolStats->entries[functionIndex];
+		SpinLockRelease(&ProtocolStats->entries[functionIndex].mutex);
+
+		SpinLockAcquire(&ProtocolStats->mutex);
+		resetTime = ProtocolStats->resetTime;
+		SpinLockRelease(&ProtocolStats->mutex);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = CStringGetTextDatum(ProtocolFunctionNames[functionIndex]);
+		values[1] = Int64GetDatum(entry.calls);
+		values[2] = Int64GetDatum(entry.errors);
+		values[3] = Float8GetDatum(entry.totalTime);
+		values[4] = Float8GetDatum(entry.calls > 0
+								   ? entry.totalTime / entry.calls
+								   : 0.0);
+		values[5] = Float8GetDatum(entry.maxTime);
+		values[6] = Float8GetDatum(HistogramPercentile(&entry, 0.99));
+		values[7] = Float8GetDatum(entry.lockWaitTime);
+		values[8] = Int64GetDatum(entry.stateMachineRuns);
+		values[9] = TimestampTzGetDatum(resetTime);
+
+		resultTuple = heap_form_tuple(funcctx->tuple_desc, values, isNulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(resultTuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * stat_protocol_reset resets all the protocol statistics.
+ */
+Datum
+stat_protocol_reset(PG_FUNCTION_ARGS)
+{
+	if (ProtocolStats == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+
+	for (int index = 0; index < PROTOCOL_FUNCTION_COUNT; index++)
+	{
+		ProtocolStatsEntry *entry = &ProtocolStats->entries[index];
+
+		SpinLockAcquire(&entry->mutex);
+
+		entry->calls = 0;
+		entry->errors = 0;
+		entry->totalTime = 0.0;
+		entry->maxTime = 0.0;
+		entry->lockWaitTime = 0.0;
+		entry->stateMachineRuns = 0;
+		memset(entry->histogram, 0, sizeof(entry->histogram));
+
+		SpinLockRelease(&entry->mutex);
+	}
+
+	SpinLockAcquire(&ProtocolStats->mutex);
+	ProtocolStats->resetTime = GetCurrentTimestamp();
+	SpinLockRelease(&ProtocolStats->mutex);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,22 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/protocol_stats.h
+ *
+ * Declarations for the shared memory statistics of the monitor protocol
+ * functions.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+extern void InitializeProtocolStats(void);
+
+extern void ProtocolStatsAddLockWait(double lockWaitTime);
+extern void ProtocolStatsCountStateMachineRun(void);
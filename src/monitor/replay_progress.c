@@ -0,0 +1,432 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/replay_progress.c
+ *
+ * Implementation of the replay progress of the standby nodes, in shared
+ * memory.
+ *
+ * The LSN that a standby reports in node_active() is the last one it has
+ * received. A standby that received more WAL but has a large replay backlog
+ * can take much longer to be promoted than one that received a little less
+ * and has replayed it all. The keepers of the standby nodes report their
+ * replayed LSN and an estimate of their apply rate, in bytes per second.
+ *
+ * When pgautofailover.promote_replay_time_threshold is set, the failover
+ * candidates of the same priority are ranked by the time they are expected to
+ * take to replay the WAL up to the most advanced LSN, see
+ * FailoverCandidateReadyTimeMs().
+ *
+ * The keepers also report the staleness of their WAL receiver, the time since
+ * it last heard from the upstream node. When
+ * pgautofailover.wal_receiver_stall_timeout is set, a standby node whose WAL
+ * receiver is stalled while its primary has more WAL is considered lagging
+ * right away, see NodeWalReceiverIsStalled().
+ *
+ * A standby node that is catching up also reports how fast its distance to
+ * the upstream node shrinks, and replay_progress() turns that into the time
+ * it is expected to take for the node to get within
+ * pgautofailover.enable_sync_wal_log_threshold of the primary, which is when
+ * the monitor assigns it the secondary state.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "group_state_machine.h"
+#include "metadata.h"
+#include "node_metadata.h"
+#include "node_shmem_hash.h"
+#include "replay_progress.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+typedef struct ReplayProgressEntry
+{
+	NodeShmemHashKey key;
+
+	TimestampTz reportTime;
+	XLogRecPtr receivedLSN;
+	XLogRecPtr replayLSN;
+	int64 applyRate;            /* bytes per second, 0 when unknown */
+	int64 receiverStalenessMs;  /* -1 when unknown */
+	int64 catchupRate;          /* bytes per second, 0 when unknown */
+} ReplayProgressEntry;
+
+
+/* GUC variables */
+int PromoteReplayTimeThresholdMs = 0;
+int WalReceiverStallTimeoutMs = 0;
+
+static NodeShmemHash ReplayProgressHash =
+	make_node_shmem_hash("pg_auto_failover Replay Progress",
+						 ReplayProgressEntry, REPLAY_PROGRESS_MAX_NODES);
+
+
+static bool NodeCatchupEta(ReplayProgressEntry *entry, Interval *eta);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(report_replay_progress);
+PG_FUNCTION_INFO_V1(replay_progress);
+
+
+/*
+ * InitializeReplayProgress, called at server start, requests the shared
+ * memory for the replay progress of the nodes.
+ */
+void
+InitializeReplayProgress(void)
+{
+	NodeShmemHashRequest(&ReplayProgressHash);
+}
+
+
+/*
+ * GetNodeReplayProgress sets the replayed LSN and apply rate that the keeper
+ * of the given node of the current database reported, and returns true. A
+ * report that is older than pgautofailover.node_considered_unhealthy_timeout
+ * is not trusted anymore, and then we return false.
+ */
+bool
+GetNodeReplayProgress(int64 nodeId, TimestampTz now,
+					  XLogRecPtr *replayLSN, int64 *applyRate)
+{
+	bool found = false;
+
+	*replayLSN = InvalidXLogRecPtr;
+	*applyRate = 0;
+
+	if (ReplayProgressHash.hash == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(ReplayProgressHash.lock, LW_SHARED);
+
+	ReplayProgressEntry *entry =
+		(ReplayProgressEntry *) NodeShmemHashFind(&ReplayProgressHash, nodeId);
+
+	if (entry != NULL &&
+		!TimestampDifferenceExceeds(entry->reportTime, now, UnhealthyTimeoutMs))
+	{
+		*replayLSN = entry->replayLSN;
+		*applyRate = entry->applyRate;
+		found = true;
+	}
+
+	LWLockRelease(ReplayProgressHash.lock);
+
+	return found;
+}
+
+
+/*
+ * GetNodeWalReceiverStaleness sets the staleness of the WAL receiver that the
+ * keeper of the given node of the current database last reported, in
+ * milliseconds, and the time of that report, and returns true. When the
+ * report is older than pgautofailover.node_considered_unhealthy_timeout, or
+ * the keeper doesn't know the staleness, we return false.
+ */
+bool
+GetNodeWalReceiverStaleness(int64 nodeId, TimestampTz now,
+							TimestampTz *reportTime, int64 *stalenessMs)
+{
+	bool found = false;
+
+	*reportTime = 0;
+	*stalenessMs = -1;
+
+	if (ReplayProgressHash.hash == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(ReplayProgressHash.lock, LW_SHARED);
+
+	ReplayProgressEntry *entry =
+		(ReplayProgressEntry *) NodeShmemHashFind(&ReplayProgressHash, nodeId);
+
+	if (entry != NULL &&
+		entry->receiverStalenessMs >= 0 &&
+		!TimestampDifferenceExceeds(entry->reportTime, now, UnhealthyTimeoutMs))
+	{
+		*reportTime = entry->reportTime;
+		*stalenessMs = entry->receiverStalenessMs;
+		found = true;
+	}
+
+	LWLockRelease(ReplayProgressHash.lock);
+
+	return found;
+}
+
+
+/*
+ * NodeWalReceiverIsStalled returns true when the keeper of the given standby
+ * node recently reported that its WAL receiver did not hear from the upstream
+ * node in pgautofailover.wal_receiver_stall_timeout or more, while the given
+ * primary node has WAL that the standby did not receive. An idle primary only
+ * sends keepalive messages, which is not a stall.
+ */
+bool
+NodeWalReceiverIsStalled(AutoFailoverNode *node,
+						 AutoFailoverNode *primaryNode,
+						 TimestampTz now)
+{
+	bool stalled = false;
+
+	if (WalReceiverStallTimeoutMs <= 0 ||
+		ReplayProgressHash.hash == NULL ||
+		node == NULL ||
+		primaryNode == NULL ||
+		primaryNode->reportedLSN <= node->reportedLSN)
+	{
+		return false;
+	}
+
+	LWLockAcquire(ReplayProgressHash.lock, LW_SHARED);
+
+	ReplayProgressEntry *entry =
+		(ReplayProgressEntry *) NodeShmemHashFind(&ReplayProgressHash,
+												  node->nodeId);
+
+	if (entry != NULL &&
+		!TimestampDifferenceExceeds(entry->reportTime, now, UnhealthyTimeoutMs))
+	{
+		stalled = entry->receiverStalenessMs >= WalReceiverStallTimeoutMs;
+	}
+
+	LWLockRelease(ReplayProgressHash.lock);
+
+	return stalled;
+}
+
+
+/*
+ * RemoveReplayProgress forgets about the replay progress of a node of the
+ * current database, when the node is removed.
+ */
+void
+RemoveReplayProgress(int64 nodeId)
+{
+	NodeShmemHashRemove(&ReplayProgressHash, nodeId);
+}
+
+
+/*
+ * report_replay_progress is called by the keepers of the standby nodes with
+ * their last received and replayed LSN, their apply rate estimate in bytes
+ * per second, zero when they don't have one yet, and the staleness of their
+ * WAL receiver in milliseconds, -1 when unknown. The catch-up rate is how
+ * fast the distance to the upstream node shrinks, in bytes per second, zero
+ * when unknown and negative when the node is falling behind. It returns false
+ * when the report could not be registered because the hash table is full.
+ */
+Datum
+report_replay_progress(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	XLogRecPtr receivedLSN = PG_GETARG_LSN(1);
+	XLogRecPtr replayLSN = PG_GETARG_LSN(2);
+	int64 applyRate = PG_GETARG_INT64(3);
+	int64 receiverStalenessMs = PG_GETARG_INT64(4);
+	int64 catchupRate = PG_GETARG_INT64(5);
+
+	bool found = false;
+
+	NodeShmemHashCheckLoaded(&ReplayProgressHash);
+
+	AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+	if (node == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with nodeid %lld",
+							   (long long) nodeId)));
+	}
+
+	LWLockAcquire(ReplayProgressHash.lock, LW_EXCLUSIVE);
+
+	ReplayProgressEntry *entry =
+		(ReplayProgressEntry *) NodeShmemHashEnter(&ReplayProgressHash,
+												   nodeId, &found);
+
+	if (entry != NULL)
+	{
+		entry->reportTime = GetCurrentTimestamp();
+		entry->receivedLSN = receivedLSN;
+		entry->replayLSN = replayLSN;
+		entry->applyRate = Max(applyRate, 0);
+		entry->receiverStalenessMs = Max(receiverStalenessMs, -1);
+		entry->catchupRate = catchupRate;
+	}
+
+	LWLockRelease(ReplayProgressHash.lock);
+
+	PG_RETURN_BOOL(entry != NULL);
+}
+
+
+/*
+ * NodeCatchupEta sets the time the node of the given entry is expected to
+ * need to get within pgautofailover.enable_sync_wal_log_threshold of its
+ * primary, as WalDifferenceWithin() computes it, and returns true. Without
+ * a primary, or a catch-up rate, we don't know and return false.
+ */
+static bool
+NodeCatchupEta(ReplayProgressEntry *entry, Interval *eta)
+{
+	AutoFailoverNode *node = GetAutoFailoverNodeById(entry->key.nodeId);
+
+	if (node == NULL)
+	{
+		return false;
+	}
+
+	AutoFailoverNode *primaryNode =
+		GetPrimaryNodeInGroup(node->formationId, node->groupId);
+
+	if (primaryNode == NULL ||
+		primaryNode->nodeId == node->nodeId ||
+		primaryNode->reportedLSN == InvalidXLogRecPtr ||
+		node->reportedLSN == InvalidXLogRecPtr)
+	{
+		return false;
+	}
+
+	int64 distance =
+		(int64) (primaryNode->reportedLSN - node->reportedLSN) -
+		EnableSyncXlogThreshold;
+
+	memset(eta, 0, sizeof(Interval));
+
+	if (primaryNode->reportedLSN <= node->reportedLSN || distance <= 0)
+	{
+		return true;
+	}
+
+	if (entry->catchupRate <= 0)
+	{
+		return false;
+	}
+
+	eta->time = (TimeOffset) ((double) distance / entry->catchupRate *
+							  USECS_PER_SEC);
+
+	return true;
+}
+
+
+/*
+ * replay_progress returns a row per node of the current database, with the
+ * last replay progress that its keeper reported.
+ */
+Datum
+replay_progress(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+	ReplayProgressEntry *entry = NULL;
+	int entryCount = 0;
+
+	Tuplestorestate *tupleStore =
+		NodeShmemHashBeginSRF(&ReplayProgressHash, fcinfo, &tupleDescriptor);
+
+	/*
+	 * Computing the catch-up ETA needs the nodes from the catalogs, so we
+	 * copy the entries of the current database and release the lock first.
+	 */
+	ReplayProgressEntry *entries =
+		(ReplayProgressEntry *) palloc0(REPLAY_PROGRESS_MAX_NODES *
+										sizeof(ReplayProgressEntry));
+
+	LWLockAcquire(ReplayProgressHash.lock, LW_SHARED);
+
+	NodeShmemHashSeqInit(&ReplayProgressHash, &status);
+
+	while ((entry = NodeShmemHashSeqSearch(&status)) != NULL)
+	{
+		if (entryCount < REPLAY_PROGRESS_MAX_NODES)
+		{
+			entries[entryCount++] = *entry;
+		}
+	}
+
+	LWLockRelease(ReplayProgressHash.lock);
+
+	for (int index = 0; index < entryCount; index++)
+	{
+		Datum values[8];
+		bool isNulls[8];
+		Interval eta;
+
+		entry = &(entries[index]);
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+		values[1] = TimestampTzGetDatum(entry->reportTime);
+		values[2] = LSNGetDatum(entry->receivedLSN);
+		values[3] = LSNGetDatum(entry->replayLSN);
+
+		if (entry->applyRate > 0)
+		{
+			values[4] = Int64GetDatum(entry->applyRate);
+		}
+		else
+		{
+			isNulls[4] = true;
+		}
+
+		if (entry->receiverStalenessMs >= 0)
+		{
+			values[5] = Int64GetDatum(entry->receiverStalenessMs);
+		}
+		else
+		{
+			isNulls[5] = true;
+		}
+
+		if (entry->catchupRate != 0)
+		{
+			values[6] = Int64GetDatum(entry->catchupRate);
+		}
+		else
+		{
+			isNulls[6] = true;
+		}
+
+		if (NodeCatchupEta(entry, &eta))
+		{
+			/* tuplestore_putvalues copies the by-reference values */
+			values[7] = IntervalPGetDatum(&eta);
+		}
+		else
+		{
+			isNulls[7] = true;
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	pfree(entries);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,42 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/replay_progress.h
+ *
+ * Declarations for the replay progress that the keepers of standby nodes
+ * report, used to rank the failover candidates.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "access/xlogdefs.h"
+#include "datatype/timestamp.h"
+
+#include "node_metadata.h"
+
+
+/* how many nodes we keep the replay progress for */
+#define REPLAY_PROGRESS_MAX_NODES 1024
+
+
+/* GUC variables */
+extern int PromoteReplayTimeThresholdMs;
+extern int WalReceiverStallTimeoutMs;
+
+
+extern void InitializeReplayProgress(void);
+extern void RemoveReplayProgress(int64 nodeId);
+extern bool GetNodeReplayProgress(int64 nodeId, TimestampTz now,
+								  XLogRecPtr *replayLSN, int64 *applyRate);
+extern bool GetNodeWalReceiverStaleness(int64 nodeId, TimestampTz now,
+										TimestampTz *reportTime,
+										int64 *stalenessMs);
+extern bool NodeWalReceiverIsStalled(AutoFailoverNode *node,
+									 AutoFailoverNode *primaryNode,
+									 TimestampTz now);
@@ -5,6 +5,13 @@
  * Implementation of functions related to (de)serialising replication
  * states.
  *
+ * node_active converts replication states from and to their enum OID
+ * several times per call, and so does every event that we insert. Each
+ * backend keeps a table of the enum OIDs of the replication_state type, so
+ * that those conversions don't need a syscache lookup by name. The table is
+ * built again after an invalidation of pg_type or pg_enum, such as when the
+ * extension is updated, or dropped and created again.
+ *
  * Copyright (c) Microsoft Corporation. All rights reserved.
  * Licensed under the PostgreSQL License.
  *
@@ -25,11 +32,23 @@
 #include "nodes/parsenodes.h"
 #include "nodes/value.h"
 #include "parser/parse_type.h"
+#include "utils/catcache.h"
+#include "utils/inval.h"
 #include "utils/syscache.h"
 
 
+/* per-backend table of the replication_state enum OIDs */
+static bool ReplicationStateCacheIsValid = false;
+static bool ReplicationStateCallbackIsRegistered = false;
+static Oid CachedReplicationStateTypeOid = InvalidOid;
+static Oid ReplicationStateEnumOids[REPLICATION_STATE_UNKNOWN] = { 0 };
+
+
 /* private function forward declarations */
 static bool IsReplicationStateName(char *name, ReplicationState replicationState);
+static void EnsureReplicationStateCache(void);
+static void InvalidateReplicationStateCache(Datum argument, int cacheId,
+											uint32 hashValue);
 
 
 /*
@@ -39,13 +58,77 @@ static bool IsReplicationStateName(char *name, ReplicationState replicationState
 Oid
 ReplicationStateTypeOid(void)
 {
+	EnsureReplicationStateCache();
+
+	return CachedReplicationStateTypeOid;
+}
+
+
+/*
+ * EnsureReplicationStateCache builds the table of the replication_state enum
+ * OIDs, when it's not valid anymore.
+ */
+static void
+EnsureReplicationStateCache(void)
+{
+	if (ReplicationStateCacheIsValid)
+	{
+		return;
+	}
+
+	if (!ReplicationStateCallbackIsRegistered)
+	{
+		CacheRegisterSyscacheCallback(TYPEOID,
+									  InvalidateReplicationStateCache,
+									  (Datum) 0);
+		CacheRegisterSyscacheCallback(ENUMOID,
+									  InvalidateReplicationStateCache,
+									  (Datum) 0);
+		ReplicationStateCallbackIsRegistered = true;
+	}
+
 	Value *schemaName = makeString(AUTO_FAILOVER_SCHEMA_NAME);
 	Value *typeName = makeString(REPLICATION_STATE_TYPE_NAME);
 	List *enumTypeNameList = list_make2(schemaName, typeName);
 	TypeName *enumTypeName = makeTypeNameFromNameList(enumTypeNameList);
 	Oid enumTypeOid = typenameTypeId(NULL, enumTypeName);
 
-	return enumTypeOid;
+	/* an invalidation received while we build the table flags it again */
+	ReplicationStateCacheIsValid = true;
+
+	memset(ReplicationStateEnumOids, 0, sizeof(ReplicationStateEnumOids));
+
+	CatCList *enumList =
+		SearchSysCacheList1(ENUMTYPOIDNAME, ObjectIdGetDatum(enumTypeOid));
+
+	for (int index = 0; index < enumList->n_members; index++)
+	{
+		HeapTuple enumTuple = &(enumList->members[index]->tuple);
+		Form_pg_enum enumForm = (Form_pg_enum) GETSTRUCT(enumTuple);
+		ReplicationState replicationState =
+			NameGetReplicationState(NameStr(enumForm->enumlabel));
+
+		if (replicationState < REPLICATION_STATE_UNKNOWN)
+		{
+			ReplicationStateEnumOids[replicationState] =
+				HeapTupleGetOid(enumTuple);
+		}
+	}
+
+	ReleaseSysCacheList(enumList);
+
+	CachedReplicationStateTypeOid = enumTypeOid;
+}
+
+
+/*
+ * InvalidateReplicationStateCache is registered as a syscache callback for
+ * pg_type and pg_enum, so that the next conversion builds the table again.
+ */
+static void
+InvalidateReplicationStateCache(Datum argument, int cacheId, uint32 hashValue)
+{
+	ReplicationStateCacheIsValid = false;
 }
 
 
@@ -55,6 +138,18 @@ ReplicationStateTypeOid(void)
 ReplicationState
 EnumGetReplicationState(Oid replicationStateOid)
 {
+	EnsureReplicationStateCache();
+
+	for (int state = 0; state < REPLICATION_STATE_UNKNOWN; state++)
+	{
+		if (ReplicationStateEnumOids[state] == replicationStateOid &&
+			OidIsValid(replicationStateOid))
+		{
+			return (ReplicationState) state;
+		}
+	}
+
+	/* not one of ours, let the catalogs tell */
 	HeapTuple enumTuple = SearchSysCache1(ENUMOID, ObjectIdGetDatum(replicationStateOid));
 	if (!HeapTupleIsValid(enumTuple))
 	{
@@ -79,6 +174,15 @@ EnumGetReplicationState(Oid replicationStateOid)
 Oid
 ReplicationStateGetEnum(ReplicationState replicationState)
 {
+	EnsureReplicationStateCache();
+
+	if (replicationState >= 0 &&
+		replicationState < REPLICATION_STATE_UNKNOWN &&
+		OidIsValid(ReplicationStateEnumOids[replicationState]))
+	{
+		return ReplicationStateEnumOids[replicationState];
+	}
+
 	const char *enumName = ReplicationStateGetName(replicationState);
 	Oid enumTypeOid = ReplicationStateTypeOid();
 
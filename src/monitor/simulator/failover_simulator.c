@@ -0,0 +1,658 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/simulator/failover_simulator.c
+ *
+ * Deterministic simulator for the failover decisions of the monitor.
+ *
+ * Each scenario is a group with a failed primary and a random set of standby
+ * nodes: candidate priorities, replication quorum, number_sync_standbys and
+ * LSN positions are all drawn from a pseudo-random generator seeded from the
+ * scenario number. Then rounds of keeper reports are replayed: at each round
+ * standby nodes reach REPORT_LSN, crash, lose Postgres or come back, and the
+ * reports are tallied the same way BuildCandidateList() does before calling
+ * the decision functions of src/monitor/failover_decision.c.
+ *
+ * As soon as a candidate is selected we check our safety invariants:
+ *
+ *  - the selected node has a candidate priority and is not unhealthy,
+ *  - no other healthy candidate has a higher priority,
+ *  - with number_sync_standbys > 0, no committed transaction is lost,
+ *  - the WAL the selected node misses can be fetched from a healthy node,
+ *  - the promoted LSN is within the promote threshold of the primary.
+ *
+ * The simulator reports how many rounds the scenarios took to converge, and
+ * why the others were still waiting when we gave up on them.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "failover_decision.h"
+
+
+#define SIMULATOR_MAX_STANDBYS 8
+#define SIMULATOR_MAX_ROUNDS 64
+#define SIMULATOR_DECISION_COUNT (FAILOVER_DECISION_MISSING_WAL + 1)
+
+/* 16MB, the default pgautofailover.promote_wal_log_threshold */
+#define SIMULATOR_PROMOTE_THRESHOLD (16 * 1024 * 1024)
+
+/* per-round probabilities, in percents */
+#define SIMULATOR_REPORT_RATE 60
+#define SIMULATOR_CRASH_RATE 3
+#define SIMULATOR_PG_DOWN_RATE 2
+#define SIMULATOR_RECOVERY_RATE 10
+
+
+typedef enum SimulatedHealth
+{
+	SIMULATED_NODE_ALIVE = 0,
+	SIMULATED_NODE_PG_DOWN,     /* Postgres is down, the keeper reports */
+	SIMULATED_NODE_DEAD         /* both are gone */
+} SimulatedHealth;
+
+typedef struct SimulatedNode
+{
+	int64 nodeId;
+	int candidatePriority;
+	bool replicationQuorum;
+	SimulatedHealth health;
+	bool reachedReportLSN;
+
+	/* received LSN, and the LSN of the last report in pgautofailover.node */
+	XLogRecPtr receivedLSN;
+	XLogRecPtr reportedLSN;
+} SimulatedNode;
+
+typedef struct SimulatedGroup
+{
+	SimulatedNode standbys[SIMULATOR_MAX_STANDBYS];
+	int standbyCount;
+	int numberSyncStandbys;
+
+	XLogRecPtr primaryLSN;
+	XLogRecPtr primaryReportedLSN;
+
+	/* the LSN of the last transaction reported committed to a client */
+	XLogRecPtr committedLSN;
+} SimulatedGroup;
+
+typedef struct ScenarioResult
+{
+	FailoverDecision decision;
+	int rounds;
+	int64 selectedNodeId;
+	int violations;
+} ScenarioResult;
+
+typedef struct SimulatorStats
+{
+	uint64_t scenarios;
+	uint64_t converged;
+	uint64_t violations;
+	uint64_t totalRounds;
+	uint64_t roundsHistogram[SIMULATOR_MAX_ROUNDS + 1];
+	uint64_t blocked[SIMULATOR_DECISION_COUNT];
+} SimulatorStats;
+
+
+static bool verbose = false;
+
+
+static uint64_t random_next(uint64_t *state);
+static int random_percent(uint64_t *state);
+static void simulate_group(SimulatedGroup *group, uint64_t *state);
+static void simulate_round(SimulatedGroup *group, uint64_t *state);
+static FailoverDecision simulate_election(SimulatedGroup *group,
+										  int *selectedIndex,
+										  FailoverCandidate *candidates,
+										  int *candidateIndexes);
+static void run_scenario(uint64_t seed, uint64_t scenario,
+						 ScenarioResult *result);
+static int check_invariants(SimulatedGroup *group, SimulatedNode *selected,
+							uint64_t scenario);
+static uint64_t rounds_percentile(SimulatorStats *stats, int percent);
+
+
+/*
+ * random_next is xorshift64*: it's fast, and every scenario only depends on
+ * its seed, so that a failing scenario can be replayed alone with -s and -f.
+ */
+static uint64_t
+random_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * UINT64_C(2685821657736338717);
+}
+
+
+/*
+ * random_percent returns a number between 0 and 99.
+ */
+static int
+random_percent(uint64_t *state)
+{
+	return (int) (random_next(state) % 100);
+}
+
+
+/*
+ * simulate_group draws a group of nodes whose primary has just failed.
+ */
+static void
+simulate_group(SimulatedGroup *group, uint64_t *state)
+{
+	int quorumCount = 0;
+
+	memset(group, 0, sizeof(SimulatedGroup));
+
+	group->standbyCount = 1 + (int) (random_next(state) % SIMULATOR_MAX_STANDBYS);
+	group->primaryLSN = (XLogRecPtr) 0x1000000 + random_next(state) % 0x40000000;
+
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+		int lagKind = random_percent(state);
+		XLogRecPtr lag = 0;
+
+		node->nodeId = index + 2;
+
+		/* a third of the nodes keep the default priority */
+		node->candidatePriority =
+			random_percent(state) < 33 ? 50 : (int) (random_next(state) % 101);
+		node->replicationQuorum = random_percent(state) < 80;
+
+		/* most standby nodes are streaming, some are lagging behind */
+		if (lagKind < 50)
+		{
+			lag = 0;
+		}
+		else if (lagKind < 90)
+		{
+			lag = random_next(state) % (1024 * 1024);
+		}
+		else
+		{
+			lag = random_next(state) % (2 * SIMULATOR_PROMOTE_THRESHOLD);
+		}
+
+		node->receivedLSN = group->primaryLSN - lag;
+
+		/* the last report from SECONDARY is older than what we received */
+		node->reportedLSN = node->receivedLSN - random_next(state) % 8192;
+
+		if (node->replicationQuorum)
+		{
+			++quorumCount;
+		}
+	}
+
+	/* number_sync_standbys must be satisfied by the quorum nodes */
+	group->numberSyncStandbys =
+		quorumCount == 0 ? 0 : (int) (random_next(state) % quorumCount);
+
+	/*
+	 * With number_sync_standbys set, a commit is reported to the client once
+	 * that many quorum nodes have received it: the committed LSN is then the
+	 * number_sync_standbys-th most advanced received LSN in the quorum.
+	 */
+	if (group->numberSyncStandbys > 0)
+	{
+		XLogRecPtr quorumLSN[SIMULATOR_MAX_STANDBYS] = { 0 };
+		int count = 0;
+
+		for (int index = 0; index < group->standbyCount; index++)
+		{
+			SimulatedNode *node = &(group->standbys[index]);
+
+			if (node->replicationQuorum)
+			{
+				int position = count++;
+
+				/* insertion sort, in decreasing order */
+				while (position > 0 && quorumLSN[position - 1] < node->receivedLSN)
+				{
+					quorumLSN[position] = quorumLSN[position - 1];
+					--position;
+				}
+				quorumLSN[position] = node->receivedLSN;
+			}
+		}
+
+		group->committedLSN = quorumLSN[group->numberSyncStandbys - 1];
+	}
+
+	group->primaryReportedLSN =
+		group->primaryLSN - random_next(state) % (256 * 1024);
+}
+
+
+/*
+ * simulate_round replays one round of node_active() calls, after the monitor
+ * assigned REPORT_LSN to the standby nodes.
+ */
+static void
+simulate_round(SimulatedGroup *group, uint64_t *state)
+{
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+
+		switch (node->health)
+		{
+			case SIMULATED_NODE_ALIVE:
+			{
+				int event = random_percent(state);
+
+				if (event < SIMULATOR_CRASH_RATE)
+				{
+					node->health = SIMULATED_NODE_DEAD;
+				}
+				else if (event < SIMULATOR_CRASH_RATE + SIMULATOR_PG_DOWN_RATE)
+				{
+					node->health = SIMULATED_NODE_PG_DOWN;
+				}
+				break;
+			}
+
+			case SIMULATED_NODE_PG_DOWN:
+			case SIMULATED_NODE_DEAD:
+			{
+				if (random_percent(state) < SIMULATOR_RECOVERY_RATE)
+				{
+					node->health = SIMULATED_NODE_ALIVE;
+				}
+				break;
+			}
+		}
+
+		/* the keeper reports its LSN with Postgres up or down */
+		if (node->health != SIMULATED_NODE_DEAD &&
+			!node->reachedReportLSN &&
+			random_percent(state) < SIMULATOR_REPORT_RATE)
+		{
+			node->reachedReportLSN = true;
+			node->reportedLSN = node->receivedLSN;
+		}
+	}
+}
+
+
+/*
+ * simulate_election tallies the reports of the standby nodes the same way
+ * BuildCandidateList() does, and runs the decision of the monitor.
+ */
+static FailoverDecision
+simulate_election(SimulatedGroup *group, int *selectedIndex,
+				  FailoverCandidate *candidates, int *candidateIndexes)
+{
+	FailoverElection election = { 0 };
+
+	election.candidates = candidates;
+	election.numberSyncStandbys = group->numberSyncStandbys;
+
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+
+		/* skip unhealthy nodes that don't report, unless we miss their LSN */
+		if (node->health == SIMULATED_NODE_DEAD)
+		{
+			if (node->replicationQuorum && !node->reachedReportLSN)
+			{
+				++election.missingNodesCount;
+			}
+			continue;
+		}
+
+		if (!node->reachedReportLSN)
+		{
+			++election.missingNodesCount;
+			continue;
+		}
+
+		FailoverCandidate *candidate = &(candidates[election.candidateCount]);
+
+		candidateIndexes[election.candidateCount] = index;
+		++election.candidateCount;
+
+		candidate->nodeId = node->nodeId;
+		candidate->candidatePriority = node->candidatePriority;
+		candidate->replicationQuorum = node->replicationQuorum;
+		candidate->isHealthy = node->health == SIMULATED_NODE_ALIVE;
+		candidate->isUnhealthy = node->health != SIMULATED_NODE_ALIVE;
+		candidate->reportedLSN = node->reportedLSN;
+
+		if (node->replicationQuorum || group->numberSyncStandbys == 0)
+		{
+			++election.quorumCandidateCount;
+		}
+	}
+
+	FailoverDecision decision = CheckFailoverElection(&election);
+
+	if (decision != FAILOVER_DECISION_SELECTED)
+	{
+		return decision;
+	}
+
+	/* see ListMostAdvancedStandbyNodes() */
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+
+		if (node->reportedLSN > election.mostAdvancedReportedLSN)
+		{
+			election.mostAdvancedReportedLSN = node->reportedLSN;
+		}
+	}
+
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+
+		if (node->reportedLSN == election.mostAdvancedReportedLSN &&
+			node->health == SIMULATED_NODE_ALIVE)
+		{
+			election.someMostAdvancedNodesAreHealthy = true;
+		}
+	}
+
+	election.hasPrimary = true;
+	election.primaryReportedLSN = group->primaryReportedLSN;
+	election.promoteXlogThreshold = SIMULATOR_PROMOTE_THRESHOLD;
+
+	return SelectFailoverCandidate(&election, selectedIndex);
+}
+
+
+/*
+ * run_scenario replays the rounds of the given scenario until a candidate is
+ * selected, or until we give-up.
+ */
+static void
+run_scenario(uint64_t seed, uint64_t scenario, ScenarioResult *result)
+{
+	SimulatedGroup group = { 0 };
+	FailoverCandidate candidates[SIMULATOR_MAX_STANDBYS] = { 0 };
+	int candidateIndexes[SIMULATOR_MAX_STANDBYS] = { 0 };
+
+	/* xorshift must not be seeded with zero */
+	uint64_t state = (seed ^ (scenario * UINT64_C(0x9E3779B97F4A7C15))) | 1;
+
+	memset(result, 0, sizeof(ScenarioResult));
+	result->selectedNodeId = -1;
+
+	simulate_group(&group, &state);
+
+	for (int round = 1; round <= SIMULATOR_MAX_ROUNDS; round++)
+	{
+		int selectedIndex = -1;
+
+		simulate_round(&group, &state);
+
+		result->rounds = round;
+		result->decision =
+			simulate_election(&group, &selectedIndex, candidates, candidateIndexes);
+
+		if (result->decision == FAILOVER_DECISION_SELECTED)
+		{
+			SimulatedNode *selected =
+				&(group.standbys[candidateIndexes[selectedIndex]]);
+
+			result->selectedNodeId = selected->nodeId;
+			result->violations = check_invariants(&group, selected, scenario);
+
+			return;
+		}
+	}
+}
+
+
+/*
+ * check_invariants checks the safety of promoting the selected node, and
+ * returns how many invariants are violated.
+ */
+static int
+check_invariants(SimulatedGroup *group, SimulatedNode *selected,
+				 uint64_t scenario)
+{
+	int violations = 0;
+	XLogRecPtr promotedLSN = selected->reportedLSN;
+	bool canFetchMissingWAL = false;
+
+	if (selected->candidatePriority <= 0 ||
+		selected->health != SIMULATED_NODE_ALIVE)
+	{
+		fprintf(stderr, "scenario %" PRIu64 ": selected node %" PRId64
+				" has priority %d and health %d\n",
+				scenario, selected->nodeId,
+				selected->candidatePriority, selected->health);
+		++violations;
+	}
+
+	for (int index = 0; index < group->standbyCount; index++)
+	{
+		SimulatedNode *node = &(group->standbys[index]);
+
+		if (node->reachedReportLSN &&
+			node->health == SIMULATED_NODE_ALIVE &&
+			node->candidatePriority > selected->candidatePriority)
+		{
+			fprintf(stderr, "scenario %" PRIu64 ": selected node %" PRId64
+					" with priority %d over node %" PRId64
+					" with priority %d\n",
+					scenario, selected->nodeId, selected->candidatePriority,
+					node->nodeId, node->candidatePriority);
+			++violations;
+		}
+
+		/* the selected node fetches missing WAL from a healthy node */
+		if (node->health == SIMULATED_NODE_ALIVE &&
+			node->reportedLSN > promotedLSN)
+		{
+			promotedLSN = node->reportedLSN;
+			canFetchMissingWAL = true;
+		}
+	}
+
+	if (promotedLSN > selected->reportedLSN && !canFetchMissingWAL)
+	{
+		fprintf(stderr, "scenario %" PRIu64 ": node %" PRId64
+				" can't fetch its missing WAL\n",
+				scenario, selected->nodeId);
+		++violations;
+	}
+
+	if (group->numberSyncStandbys > 0 && promotedLSN < group->committedLSN)
+	{
+		fprintf(stderr, "scenario %" PRIu64 ": promoting node %" PRId64
+				" at %" PRIX64 " loses commits up to %" PRIX64 "\n",
+				scenario, selected->nodeId,
+				(uint64_t) promotedLSN, (uint64_t) group->committedLSN);
+		++violations;
+	}
+
+	if (!FailoverWalDifferenceWithin(promotedLSN, group->primaryReportedLSN,
+									 SIMULATOR_PROMOTE_THRESHOLD))
+	{
+		fprintf(stderr, "scenario %" PRIu64 ": promoting node %" PRId64
+				" at %" PRIX64 " is too far behind the primary at %" PRIX64 "\n",
+				scenario, selected->nodeId,
+				(uint64_t) promotedLSN, (uint64_t) group->primaryReportedLSN);
+		++violations;
+	}
+
+	return violations;
+}
+
+
+/*
+ * rounds_percentile returns the count of rounds under which the given
+ * percentage of the converged scenarios did converge.
+ */
+static uint64_t
+rounds_percentile(SimulatorStats *stats, int percent)
+{
+	uint64_t target = (stats->converged * percent + 99) / 100;
+	uint64_t count = 0;
+
+	for (int rounds = 1; rounds <= SIMULATOR_MAX_ROUNDS; rounds++)
+	{
+		count += stats->roundsHistogram[rounds];
+
+		if (count >= target)
+		{
+			return rounds;
+		}
+	}
+
+	return SIMULATOR_MAX_ROUNDS;
+}
+
+
+/*
+ * main parses the command line options and runs the scenarios.
+ */
+int
+main(int argc, char **argv)
+{
+	SimulatorStats stats = { 0 };
+	uint64_t scenarioCount = 1000000;
+	uint64_t firstScenario = 0;
+	uint64_t seed = 1;
+	struct timespec start, end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:vh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+			{
+				scenarioCount = strtoull(optarg, NULL, 10);
+				break;
+			}
+
+			case 's':
+			{
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			}
+
+			case 'f':
+			{
+				firstScenario = strtoull(optarg, NULL, 10);
+				break;
+			}
+
+			case 'v':
+			{
+				verbose = true;
+				break;
+			}
+
+			default:
+			{
+				fprintf(stderr,
+						"Usage: %s [ -n scenarios ] [ -s seed ] "
+						"[ -f first scenario ] [ -v ]\n",
+						argv[0]);
+				return opt == 'h' ? 0 : 1;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (uint64_t scenario = firstScenario;
+		 scenario < firstScenario + scenarioCount;
+		 scenario++)
+	{
+		ScenarioResult result = { 0 };
+
+		run_scenario(seed, scenario, &result);
+
+		/* a scenario depends only on its seed: check that now and then */
+		if (scenario % 1024 == 0)
+		{
+			ScenarioResult replay = { 0 };
+
+			run_scenario(seed, scenario, &replay);
+
+			if (memcmp(&result, &replay, sizeof(ScenarioResult)) != 0)
+			{
+				fprintf(stderr, "scenario %" PRIu64 " is not deterministic\n",
+						scenario);
+				++stats.violations;
+			}
+		}
+
+		++stats.scenarios;
+		stats.violations += result.violations;
+
+		if (result.decision == FAILOVER_DECISION_SELECTED)
+		{
+			++stats.converged;
+			stats.totalRounds += result.rounds;
+			++stats.roundsHistogram[result.rounds];
+		}
+		else
+		{
+			++stats.blocked[result.decision];
+		}
+
+		if (verbose)
+		{
+			printf("scenario %" PRIu64 ": %s after %d rounds, node %" PRId64 "\n",
+				   scenario, FailoverDecisionToString(result.decision),
+				   result.rounds, result.selectedNodeId);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed =
+		(double) (end.tv_sec - start.tv_sec) +
+		(double) (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("scenarios:   %" PRIu64 " in %.2fs (%.0f per minute)\n",
+		   stats.scenarios, elapsed,
+		   elapsed > 0 ? 60.0 * stats.scenarios / elapsed : 0.0);
+
+	printf("converged:   %" PRIu64 ", rounds avg %.2f p50 %" PRIu64
+		   " p99 %" PRIu64 "\n",
+		   stats.converged,
+		   stats.converged > 0 ? (double) stats.totalRounds / stats.converged : 0.0,
+		   rounds_percentile(&stats, 50),
+		   rounds_percentile(&stats, 99));
+
+	for (int decision = 0; decision < SIMULATOR_DECISION_COUNT; decision++)
+	{
+		if (stats.blocked[decision] > 0)
+		{
+			printf("blocked:     %" PRIu64 " on %s\n",
+				   stats.blocked[decision],
+				   FailoverDecisionToString((FailoverDecision) decision));
+		}
+	}
+
+	printf("violations:  %" PRIu64 "\n", stats.violations);
+
+	return stats.violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+-- Copyright (c) Microsoft Corporation. All rights reserved.
+-- Licensed under the PostgreSQL License.
+
+-- The last_events functions are inlined in the calling query, check that
+-- they are implemented with a top-N index scan rather than by sorting the
+-- whole event table. The event table may be partitioned, so rather than the
+-- full EXPLAIN output that depends on the partitions, summarize the plan.
+set enable_seqscan to off;
+
+create function pg_temp.check_plan
+ (
+    IN query       text,
+    IN index_name  text,
+   OUT uses_index  bool,
+   OUT seq_scans   int,
+   OUT sorts       int
+ )
+language plpgsql
+as $$
+declare
+  line text;
+begin
+  uses_index := false;
+  seq_scans := 0;
+  sorts := 0;
+
+  for line in execute 'explain (costs off) ' || query
+  loop
+    if line ~ ('Index (Only )?Scan (Backward )?using \S*' || index_name)
+    then
+      uses_index := true;
+    end if;
+
+    if line ~ 'Seq Scan'
+    then
+      seq_scans := seq_scans + 1;
+    end if;
+
+    if line ~ '^\s*(->\s+)?(Incremental )?Sort\s*$'
+    then
+      sorts := sorts + 1;
+    end if;
+  end loop;
+end;
+$$;
+
+-- only the final sort of at most count rows is expected
+select *
+  from pg_temp.check_plan(
+        $$ select * from pgautofailover.last_events(10) $$,
+        '_pkey');
+
+select *
+  from pg_temp.check_plan(
+        $$ select * from pgautofailover.last_events('default', count => 10) $$,
+        'formationid_eventid_idx');
+
+select *
+  from pg_temp.check_plan(
+        $$ select * from pgautofailover.last_events('default', 0, 10) $$,
+        'formationid_groupid_eventid_idx');
+
+-- NULL arguments still return no events
+select count(*) from pgautofailover.last_events(NULL::int);
+select count(*) from pgautofailover.last_events('default', count => NULL);
+select count(*) from pgautofailover.last_events('default', 0, NULL);
+
+reset enable_seqscan;
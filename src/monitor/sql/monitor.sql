@@ -60,6 +60,38 @@ select * from pgautofailover.get_primary();
 select * from pgautofailover.get_primary('default', 0);
 select * from pgautofailover.get_other_nodes(1);
 
+-- node_active_v2 also returns the other nodes, unless they are known already
+select assigned_node_id, assigned_group_state, other_nodes, group_version,
+       report_interval
+  from pgautofailover.node_active_v2('default', 1, 0,
+                                     current_group_role => 'wait_primary');
+
+with v2 as (
+  select nodes_version
+    from pgautofailover.node_active_v2('default', 1, 0,
+                                       current_group_role => 'wait_primary')
+)
+select assigned_group_state, other_nodes is null as other_nodes_known
+  from v2,
+       pgautofailover.node_active_v2('default', 1, 0,
+                                     current_group_role => 'wait_primary',
+                                     known_nodes_version => v2.nodes_version);
+
+-- a steady report only updates the node_heartbeat row of the node
+select xmin as base_xmin from pgautofailover.node_base where nodeid = 1 \gset
+select xmin as heartbeat_xmin
+  from pgautofailover.node_heartbeat where nodeid = 1 \gset
+
+select assigned_group_state
+  from pgautofailover.node_active('default', 1, 0,
+                                  current_group_role => 'wait_primary');
+
+select base.xmin::text = :'base_xmin' as base_unchanged,
+       heartbeat.xmin::text <> :'heartbeat_xmin' as heartbeat_changed
+  from pgautofailover.node_base base
+  join pgautofailover.node_heartbeat heartbeat using (nodeid)
+ where nodeid = 1;
+
 -- remove the primary node
 select pgautofailover.remove_node(1);
 
@@ -78,3 +110,26 @@ select *
 
 -- should fail as there's no primary at this point
 select pgautofailover.perform_failover();
+
+-- should fail as node_2 in the same group has another system identifier
+select *
+  from pgautofailover.set_node_system_identifier(3, 42);
+
+-- the protocol functions calls are counted, failed calls too
+select function_name, calls > 0 as called, errors > 0 as failed
+  from pgautofailover.stat_protocol
+ where function_name in ('register_node', 'node_active', 'perform_failover')
+order by function_name;
+
+-- the fleet counters match the nodes
+(select formationid, reportedstate, health, count(*)
+   from pgautofailover.node
+ group by formationid, reportedstate, health
+ except
+ select * from pgautofailover.fleet_node_counts())
+union all
+(select * from pgautofailover.fleet_node_counts()
+ except
+ select formationid, reportedstate, health, count(*)
+   from pgautofailover.node
+ group by formationid, reportedstate, health);
@@ -0,0 +1,51 @@
+-- Copyright (c) Microsoft Corporation. All rights reserved.
+-- Licensed under the PostgreSQL License.
+
+-- The node metadata queries are prepared once per backend and then kept,
+-- check that the kept plans survive the extension being created again.
+select formation_id
+  from pgautofailover.create_formation('plans', 'pgsql', 'plans', true, 0);
+
+select assigned_group_state
+  from pgautofailover.register_node('plans', 'localhost', 9990, 'plans',
+                                    sysidentifier => 6852685710417058800);
+
+select assigned_group_state
+  from pgautofailover.node_active('plans',
+                                  (select nodeid
+                                     from pgautofailover.node
+                                    where nodeport = 9990),
+                                  0,
+                                  current_group_role => 'single');
+
+drop extension pgautofailover;
+create extension pgautofailover;
+
+select formation_id
+  from pgautofailover.create_formation('plans', 'pgsql', 'plans', true, 0);
+
+select assigned_group_state
+  from pgautofailover.register_node('plans', 'localhost', 9990, 'plans',
+                                    sysidentifier => 6852685710417058800);
+
+select assigned_group_state
+  from pgautofailover.node_active('plans',
+                                  (select nodeid
+                                     from pgautofailover.node
+                                    where nodeport = 9990),
+                                  0,
+                                  current_group_role => 'single');
+
+-- a microbenchmark of the node_active hot path, use \timing to compare
+select count(*) as calls
+  from generate_series(1, 1000) as i,
+       lateral pgautofailover.node_active('plans',
+                                          (select nodeid
+                                             from pgautofailover.node
+                                            where nodeport = 9990),
+                                          0,
+                                          current_group_role => 'single');
+
+select count(*) as nodes
+  from generate_series(1, 1000) as i,
+       lateral pgautofailover.get_nodes('plans') as nodes;
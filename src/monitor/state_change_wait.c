@@ -0,0 +1,438 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/state_change_wait.c
+ *
+ * Implementation of shared memory state change counters per group, that
+ * keepers can wait on with pgautofailover.wait_for_state_change().
+ *
+ * Postgres signals every backend that is LISTENing in a database for every
+ * NOTIFY sent in that database, whatever the channel. With a keeper session
+ * per node, a failover storm then costs listeners times events wake-ups on
+ * the monitor. Here a transaction that changes the state of a group bumps a
+ * counter when it commits and only wakes up the backends that wait on the
+ * slot of that group.
+ *
+ * The same counters allow pgautofailover.wait_for_node_state() to block
+ * until a node reaches a given state, so that the pg_autoctl commands that
+ * wait for a failover or a maintenance operation get only the result.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+
+#include "metadata.h"
+#include "node_metadata.h"
+#include "replication_state.h"
+#include "state_change_wait.h"
+#include "version_compat.h"
+
+#include "access/xact.h"
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+
+/* before Postgres 13 we can't sleep on a condition variable with a timeout */
+#define STATE_CHANGE_WAIT_POLL_MS 100
+
+/*
+ * The node cache might be updated at commit time after the counter has been
+ * bumped, so wait_for_node_state checks the node states again at least that
+ * often.
+ */
+#define NODE_STATE_WAIT_RECHECK_MS 1000
+
+typedef struct StateChangeSlot
+{
+	pg_atomic_uint64 changeCount;
+	ConditionVariable changed;
+} StateChangeSlot;
+
+
+static StateChangeSlot *StateChangeSlots = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* slots of the groups that changed in the current transaction */
+static List *PendingSlotList = NIL;
+
+
+static void StateChangeWaitShmemInit(void);
+static void StateChangeWaitXactCallback(XactEvent event, void *arg);
+static int StateChangeSlotIndex(const char *formationId, int groupId);
+static uint64 StateChangeWaitSleep(StateChangeSlot *slot,
+								   uint64 knownChangeCount,
+								   TimestampTz deadline);
+static AutoFailoverNode * FindNodeInState(char *formationId, int groupId,
+										  bool anyNode, int64 nodeId,
+										  ReplicationState targetState);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(wait_for_state_change);
+PG_FUNCTION_INFO_V1(wait_for_node_state);
+
+
+/*
+ * InitializeStateChangeWait, called at server start, requests the shared
+ * memory for the state change counters and registers the transaction
+ * callback that bumps them at commit time.
+ */
+void
+InitializeStateChangeWait(void)
+{
+	if (!IsUnderPostmaster)
+	{
+		RequestAddinShmemSpace(mul_size(STATE_CHANGE_WAIT_SLOTS,
+										sizeof(StateChangeSlot)));
+	}
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = StateChangeWaitShmemInit;
+
+	RegisterXactCallback(StateChangeWaitXactCallback, NULL);
+}
+
+
+/*
+ * StateChangeWaitShmemInit initializes the requested shared memory for the
+ * state change counters.
+ */
+static void
+StateChangeWaitShmemInit(void)
+{
+	bool alreadyInitialized = false;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	StateChangeSlots =
+		(StateChangeSlot *)
+		ShmemInitStruct("pg_auto_failover State Change Wait",
+						mul_size(STATE_CHANGE_WAIT_SLOTS,
+								 sizeof(StateChangeSlot)),
+						&alreadyInitialized);
+
+	if (!alreadyInitialized)
+	{
+		for (int index = 0; index < STATE_CHANGE_WAIT_SLOTS; index++)
+		{
+			pg_atomic_init_u64(&(StateChangeSlots[index].changeCount), 0);
+			ConditionVariableInit(&(StateChangeSlots[index].changed));
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	if (prev_shmem_startup_hook != NULL)
+	{
+		prev_shmem_startup_hook();
+	}
+}
+
+
+/*
+ * StateChangeSlotIndex returns the slot of the given group of the current
+ * database.
+ */
+static int
+StateChangeSlotIndex(const char *formationId, int groupId)
+{
+	uint32 hash =
+		DatumGetUInt32(hash_any((const unsigned char *) formationId,
+								strlen(formationId)));
+
+	hash ^= (uint32) groupId * 0x9E3779B1;
+	hash ^= (uint32) MyDatabaseId * 0x85EBCA77;
+
+	return hash % STATE_CHANGE_WAIT_SLOTS;
+}
+
+
+/*
+ * RegisterGroupStateChange remembers that the given group has a state change
+ * in the current transaction. The backends waiting for the group are woken
+ * up when the transaction commits.
+ */
+void
+RegisterGroupStateChange(const char *formationId, int groupId)
+{
+	int slotIndex = StateChangeSlotIndex(formationId, groupId);
+
+	if (StateChangeSlots == NULL || list_member_int(PendingSlotList, slotIndex))
+	{
+		return;
+	}
+
+	MemoryContext oldContext = MemoryContextSwitchTo(TopTransactionContext);
+
+	PendingSlotList = lappend_int(PendingSlotList, slotIndex);
+
+	MemoryContextSwitchTo(oldContext);
+}
+
+
+/*
+ * StateChangeWaitXactCallback bumps the counters of the groups that changed
+ * once the transaction has committed, so that the woken up keepers see the
+ * new state when they call node_active.
+ */
+static void
+StateChangeWaitXactCallback(XactEvent event, void *arg)
+{
+	ListCell *slotCell = NULL;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		{
+			foreach(slotCell, PendingSlotList)
+			{
+				StateChangeSlot *slot = &(StateChangeSlots[lfirst_int(slotCell)]);
+
+				pg_atomic_fetch_add_u64(&(slot->changeCount), 1);
+				ConditionVariableBroadcast(&(slot->changed));
+			}
+
+			/* the list is allocated in TopTransactionContext */
+			PendingSlotList = NIL;
+			break;
+		}
+
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+		{
+			PendingSlotList = NIL;
+			break;
+		}
+
+		default:
+		{
+			/* nothing to do */
+			break;
+		}
+	}
+}
+
+
+/*
+ * wait_for_state_change waits until the state change counter of the given
+ * group differs from known_change_count, or until timeout_ms milliseconds
+ * have passed, and returns the current counter. A negative
+ * known_change_count waits for the next change from now on.
+ *
+ * Counters start at zero when the monitor starts, and groups may share a
+ * counter, so callers must only take a changed counter as a hint to call
+ * node_active again.
+ */
+Datum
+wait_for_state_change(PG_FUNCTION_ARGS)
+{
+	char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+	int32 groupId = PG_GETARG_INT32(1);
+	int64 knownChangeCount = PG_GETARG_INT64(2);
+	int32 timeoutMs = PG_GETARG_INT32(3);
+
+	if (StateChangeSlots == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+
+	if (timeoutMs < 0)
+	{
+		ereport(ERROR, (errmsg("timeout_ms must not be negative")));
+	}
+
+	StateChangeSlot *slot =
+		&(StateChangeSlots[StateChangeSlotIndex(formationId, groupId)]);
+
+	uint64 changeCount = pg_atomic_read_u64(&(slot->changeCount));
+
+	if (knownChangeCount < 0)
+	{
+		knownChangeCount = (int64) changeCount;
+	}
+
+	TimestampTz deadline =
+		TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeoutMs);
+
+	changeCount = StateChangeWaitSleep(slot, (uint64) knownChangeCount, deadline);
+
+	PG_RETURN_INT64((int64) changeCount);
+}
+
+
+/*
+ * wait_for_node_state waits until the given node, or any node of the group
+ * when node_id is NULL, has both its reported state and goal state set to
+ * target_state, or until timeout_ms milliseconds have passed. It returns the
+ * id of the node that reached the target state, or NULL at timeout.
+ */
+Datum
+wait_for_node_state(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3) || PG_ARGISNULL(4))
+	{
+		ereport(ERROR,
+				(errmsg("only node_id may be NULL in wait_for_node_state")));
+	}
+
+	char *formationId = text_to_cstring(PG_GETARG_TEXT_P(0));
+	int32 groupId = PG_GETARG_INT32(1);
+	bool anyNode = PG_ARGISNULL(2);
+	int64 nodeId = anyNode ? 0 : PG_GETARG_INT64(2);
+	Oid targetStateOid = PG_GETARG_OID(3);
+	ReplicationState targetState = EnumGetReplicationState(targetStateOid);
+	int32 timeoutMs = PG_GETARG_INT32(4);
+
+	if (StateChangeSlots == NULL)
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pgautofailover must be loaded via "
+						"shared_preload_libraries")));
+	}
+
+	if (timeoutMs < 0)
+	{
+		ereport(ERROR, (errmsg("timeout_ms must not be negative")));
+	}
+
+	StateChangeSlot *slot =
+		&(StateChangeSlots[StateChangeSlotIndex(formationId, groupId)]);
+
+	TimestampTz deadline =
+		TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeoutMs);
+
+	for (;;)
+	{
+		/* read the counter first, so that we don't miss a change */
+		uint64 changeCount = pg_atomic_read_u64(&(slot->changeCount));
+
+		AutoFailoverNode *node =
+			FindNodeInState(formationId, groupId, anyNode, nodeId, targetState);
+
+		if (node != NULL)
+		{
+			PG_RETURN_INT64(node->nodeId);
+		}
+
+		if (GetCurrentTimestamp() >= deadline)
+		{
+			break;
+		}
+
+		TimestampTz recheck =
+			TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										NODE_STATE_WAIT_RECHECK_MS);
+
+		(void) StateChangeWaitSleep(slot, changeCount, Min(deadline, recheck));
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	PG_RETURN_NULL();
+}
+
+
+/*
+ * FindNodeInState returns the given node, or the first node of the group
+ * when anyNode is true, that has reached the target state, or NULL.
+ */
+static AutoFailoverNode *
+FindNodeInState(char *formationId, int groupId, bool anyNode, int64 nodeId,
+				ReplicationState targetState)
+{
+	ListCell *nodeCell = NULL;
+	List *groupNodeList = AutoFailoverNodeGroup(formationId, groupId);
+
+	foreach(nodeCell, groupNodeList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if ((anyNode || node->nodeId == nodeId) &&
+			node->reportedState == targetState &&
+			node->goalState == targetState)
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * StateChangeWaitSleep sleeps until the counter of the given slot differs
+ * from knownChangeCount, or until the deadline, and returns the counter.
+ */
+static uint64
+StateChangeWaitSleep(StateChangeSlot *slot, uint64 knownChangeCount,
+					 TimestampTz deadline)
+{
+	uint64 changeCount = pg_atomic_read_u64(&(slot->changeCount));
+
+#if (PG_VERSION_NUM >= 130000)
+	ConditionVariablePrepareToSleep(&(slot->changed));
+#endif
+
+	while (changeCount == knownChangeCount)
+	{
+		long secs = 0;
+		int microsecs = 0;
+
+		TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &microsecs);
+
+		long remainingMs = secs * 1000 + microsecs / 1000;
+
+		if (remainingMs <= 0)
+		{
+			break;
+		}
+
+#if (PG_VERSION_NUM >= 130000)
+		(void) ConditionVariableTimedSleep(&(slot->changed), remainingMs,
+										   PG_WAIT_EXTENSION);
+#else
+		int waitResult =
+			WaitLatch(MyLatch,
+					  WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					  Min(remainingMs, STATE_CHANGE_WAIT_POLL_MS),
+					  PG_WAIT_EXTENSION);
+
+		ResetLatch(MyLatch);
+
+		if (waitResult & WL_POSTMASTER_DEATH)
+		{
+			proc_exit(1);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+#endif
+
+		changeCount = pg_atomic_read_u64(&(slot->changeCount));
+	}
+
+#if (PG_VERSION_NUM >= 130000)
+	ConditionVariableCancelSleep();
+#endif
+
+	return changeCount;
+}
@@ -0,0 +1,27 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/state_change_wait.h
+ *
+ * Declarations for the shared memory state change counters that keepers
+ * can wait on, as an alternative to LISTEN.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+
+/*
+ * Groups are hashed to a fixed number of slots, two groups sharing a slot
+ * only cost each other a spurious wake-up.
+ */
+#define STATE_CHANGE_WAIT_SLOTS 1024
+
+
+extern void InitializeStateChangeWait(void);
+extern void RegisterGroupStateChange(const char *formationId, int groupId);
@@ -0,0 +1,528 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/storage_health.c
+ *
+ * Implementation of the storage health of the nodes, in shared memory.
+ *
+ * A primary whose storage is stalled still accepts connections, so it passes
+ * our health checks and its keeper reports that Postgres is running, while
+ * its commits hang. The keepers run an I/O watchdog that regularly writes and
+ * fsyncs a small file in PGDATA and in pg_wal, and report the latency
+ * percentiles of those probes to the monitor, along with how long the
+ * current probe has been waiting, if any.
+ *
+ * When pgautofailover.storage_stall_timeout is set and a node reports a probe
+ * that has been waiting for longer than that, the node is unhealthy.
+ *
+ * The keepers also report the free space of their pg_wal file system, and
+ * how long until it is full at the rate the free space has been going down.
+ * When that is less than pgautofailover.wal_exhaustion_threshold, we register
+ * an event, and on a primary node with pgautofailover.wal_exhaustion_switchover
+ * we start a switchover, rather than wait for Postgres to PANIC.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+
+#include "group_state_machine.h"
+#include "metadata.h"
+#include "node_metadata.h"
+#include "node_shmem_hash.h"
+#include "notifications.h"
+#include "replication_state.h"
+#include "storage_health.h"
+#include "version_compat.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "nodes/pg_list.h"
+#include "storage/lockdefs.h"
+#include "utils/builtins.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+
+typedef struct StorageHealthEntry
+{
+	NodeShmemHashKey key;
+
+	TimestampTz reportTime;
+	int64 p50Us;
+	int64 p99Us;
+	int64 maxUs;
+	int stallMs;
+
+	TimestampTz walReportTime;
+	int64 walFreeBytes;
+	int64 walRate;
+	int walTimeToFull;          /* seconds, -1 when not running out */
+} StorageHealthEntry;
+
+
+/* GUC variables */
+int StorageStallTimeoutMs = 0;
+int WalExhaustionThresholdSecs = 0;
+bool WalExhaustionSwitchover = false;
+
+static NodeShmemHash StorageHealthHash =
+	make_node_shmem_hash("pg_auto_failover Storage Health",
+						 StorageHealthEntry, STORAGE_HEALTH_MAX_NODES);
+
+
+static bool StorageHealthEntryIsStalled(StorageHealthEntry *entry,
+										TimestampTz now);
+static bool StorageHealthEntryIsExhausting(StorageHealthEntry *entry);
+static StorageHealthEntry * StorageHealthEnterEntry(int64 nodeId);
+static void ProceedStorageFailureGroup(AutoFailoverNode *node);
+static void SwitchoverOnWalExhaustion(AutoFailoverNode *node);
+
+
+/* see node_active_protocol.c */
+extern Datum perform_failover(PG_FUNCTION_ARGS);
+
+
+/* declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(report_storage_health);
+PG_FUNCTION_INFO_V1(report_wal_space);
+PG_FUNCTION_INFO_V1(storage_health);
+
+
+/*
+ * InitializeStorageHealth, called at server start, requests the shared
+ * memory for the storage health of the nodes.
+ */
+void
+InitializeStorageHealth(void)
+{
+	NodeShmemHashRequest(&StorageHealthHash);
+}
+
+
+/*
+ * StorageHealthEntryIsStalled returns true when the given report is a stall
+ * beyond pgautofailover.storage_stall_timeout. A report that is older than
+ * pgautofailover.node_considered_unhealthy_timeout is not trusted anymore:
+ * when the keeper stops reporting, we rely on the health checks instead.
+ */
+static bool
+StorageHealthEntryIsStalled(StorageHealthEntry *entry, TimestampTz now)
+{
+	return StorageStallTimeoutMs > 0 &&
+		   entry->stallMs >= StorageStallTimeoutMs &&
+		   !TimestampDifferenceExceeds(entry->reportTime, now,
+									   UnhealthyTimeoutMs);
+}
+
+
+/*
+ * StorageHealthEntryIsExhausting returns true when the last report of pg_wal
+ * free space predicts that it is going to be full in less than
+ * pgautofailover.wal_exhaustion_threshold.
+ */
+static bool
+StorageHealthEntryIsExhausting(StorageHealthEntry *entry)
+{
+	return WalExhaustionThresholdSecs > 0 &&
+		   entry->walReportTime != 0 &&
+		   entry->walTimeToFull >= 0 &&
+		   entry->walTimeToFull < WalExhaustionThresholdSecs;
+}
+
+
+/*
+ * StorageHealthEnterEntry returns the entry of the given node of the current
+ * database, initializing it when it's new, or NULL when the hash table is
+ * full. The caller must hold the lock in exclusive mode.
+ */
+static StorageHealthEntry *
+StorageHealthEnterEntry(int64 nodeId)
+{
+	bool found = false;
+
+	StorageHealthEntry *entry =
+		(StorageHealthEntry *) NodeShmemHashEnter(&StorageHealthHash,
+												  nodeId, &found);
+
+	if (entry != NULL && !found)
+	{
+		entry->walTimeToFull = -1;
+	}
+
+	return entry;
+}
+
+
+/*
+ * NodeStorageIsStalled returns true when the keeper of the given node of the
+ * current database recently reported that its storage has been stalled for
+ * longer than pgautofailover.storage_stall_timeout.
+ */
+bool
+NodeStorageIsStalled(int64 nodeId, TimestampTz now)
+{
+	bool stalled = false;
+
+	if (StorageHealthHash.hash == NULL || StorageStallTimeoutMs <= 0)
+	{
+		return false;
+	}
+
+	LWLockAcquire(StorageHealthHash.lock, LW_SHARED);
+
+	StorageHealthEntry *entry =
+		(StorageHealthEntry *) NodeShmemHashFind(&StorageHealthHash, nodeId);
+
+	if (entry != NULL)
+	{
+		stalled = StorageHealthEntryIsStalled(entry, now);
+	}
+
+	LWLockRelease(StorageHealthHash.lock);
+
+	return stalled;
+}
+
+
+/*
+ * RemoveStorageHealth forgets about the storage health of a node of the
+ * current database, when the node is removed.
+ */
+void
+RemoveStorageHealth(int64 nodeId)
+{
+	NodeShmemHashRemove(&StorageHealthHash, nodeId);
+}
+
+
+/*
+ * report_storage_health is called by the keepers with the latency
+ * percentiles of their I/O watchdog probes, in microseconds, and how long the
+ * current probe has been waiting, in milliseconds, zero when no probe is
+ * waiting.
+ *
+ * When the storage of the node has just been found stalled, we proceed with
+ * the state machine of its group right away, rather than at the next
+ * node_active() calls, and return true.
+ */
+Datum
+report_storage_health(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	int64 p50Us = PG_GETARG_INT64(1);
+	int64 p99Us = PG_GETARG_INT64(2);
+	int64 maxUs = PG_GETARG_INT64(3);
+	int stallMs = PG_GETARG_INT32(4);
+
+	TimestampTz now = GetCurrentTimestamp();
+	bool wasStalled = false;
+	bool isStalled = false;
+
+	NodeShmemHashCheckLoaded(&StorageHealthHash);
+
+	AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+	if (node == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with nodeid %lld",
+							   (long long) nodeId)));
+	}
+
+	LWLockAcquire(StorageHealthHash.lock, LW_EXCLUSIVE);
+
+	StorageHealthEntry *entry = StorageHealthEnterEntry(nodeId);
+
+	if (entry != NULL)
+	{
+		wasStalled = StorageHealthEntryIsStalled(entry, now);
+
+		entry->reportTime = now;
+		entry->p50Us = p50Us;
+		entry->p99Us = p99Us;
+		entry->maxUs = maxUs;
+		entry->stallMs = stallMs;
+
+		isStalled = StorageHealthEntryIsStalled(entry, now);
+	}
+
+	LWLockRelease(StorageHealthHash.lock);
+
+	if (isStalled && !wasStalled)
+	{
+		char message[BUFSIZE] = { 0 };
+
+		LockFormation(node->formationId, ShareLock);
+		LockNodeGroup(node->formationId, node->groupId, ExclusiveLock);
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"Storage of " NODE_FORMAT " has been stalled for %d ms, "
+			"more than "
+			"pgautofailover.storage_stall_timeout (%d ms).",
+			NODE_FORMAT_ARGS(node),
+			stallMs,
+			StorageStallTimeoutMs);
+
+		(void) ProceedStorageFailureGroup(node);
+	}
+
+	PG_RETURN_BOOL(isStalled && !wasStalled);
+}
+
+
+/*
+ * ProceedStorageFailureGroup proceeds with the state machine of each node of
+ * the group of the given node, as the failover of a primary node is decided
+ * when proceeding for its standby nodes.
+ */
+static void
+ProceedStorageFailureGroup(AutoFailoverNode *node)
+{
+	List *nodesGroupList =
+		AutoFailoverNodeGroup(node->formationId, node->groupId);
+	List *nodeIdList = NIL;
+	ListCell *nodeCell = NULL;
+
+	foreach(nodeCell, nodesGroupList)
+	{
+		AutoFailoverNode *groupNode = (AutoFailoverNode *) lfirst(nodeCell);
+
+		nodeIdList = lappend(nodeIdList, &(groupNode->nodeId));
+	}
+
+	foreach(nodeCell, nodeIdList)
+	{
+		int64 groupNodeId = *((int64 *) lfirst(nodeCell));
+
+		/* previous calls might have changed the node */
+		AutoFailoverNode *groupNode = GetAutoFailoverNodeById(groupNodeId);
+
+		if (groupNode == NULL ||
+			groupNode->reportedState == REPLICATION_STATE_DROPPED ||
+			groupNode->goalState == REPLICATION_STATE_DROPPED)
+		{
+			continue;
+		}
+
+		(void) ProceedGroupState(groupNode);
+
+		CommandCounterIncrement();
+	}
+}
+
+
+/*
+ * report_wal_space is called by the keepers with the free space of their
+ * pg_wal file system in bytes, their WAL generation rate in bytes per second,
+ * and how many seconds until pg_wal is full, -1 when the free space is not
+ * going down.
+ *
+ * When pg_wal has just been found to be full in less than
+ * pgautofailover.wal_exhaustion_threshold, we register an event, maybe start
+ * a switchover, and return true.
+ */
+Datum
+report_wal_space(PG_FUNCTION_ARGS)
+{
+	checkPgAutoFailoverVersion();
+
+	int64 nodeId = PG_GETARG_INT64(0);
+	int64 freeBytes = PG_GETARG_INT64(1);
+	int64 walRate = PG_GETARG_INT64(2);
+	int timeToFull = PG_GETARG_INT32(3);
+
+	bool wasExhausting = false;
+	bool isExhausting = false;
+
+	NodeShmemHashCheckLoaded(&StorageHealthHash);
+
+	AutoFailoverNode *node = GetAutoFailoverNodeById(nodeId);
+
+	if (node == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+						errmsg("couldn't find node with nodeid %lld",
+							   (long long) nodeId)));
+	}
+
+	LWLockAcquire(StorageHealthHash.lock, LW_EXCLUSIVE);
+
+	StorageHealthEntry *entry = StorageHealthEnterEntry(nodeId);
+
+	if (entry != NULL)
+	{
+		wasExhausting = StorageHealthEntryIsExhausting(entry);
+
+		entry->walReportTime = GetCurrentTimestamp();
+		entry->walFreeBytes = freeBytes;
+		entry->walRate = walRate;
+		entry->walTimeToFull = timeToFull;
+
+		isExhausting = StorageHealthEntryIsExhausting(entry);
+	}
+
+	LWLockRelease(StorageHealthHash.lock);
+
+	if (isExhausting && !wasExhausting)
+	{
+		char message[BUFSIZE] = { 0 };
+
+		LogAndNotifyMessage(
+			message, BUFSIZE,
+			"pg_wal of " NODE_FORMAT " is expected to be full in %d s, "
+			"less than pgautofailover.wal_exhaustion_threshold (%d s), "
+			"with %lld MB free and a WAL rate of %lld kB/s.",
+			NODE_FORMAT_ARGS(node),
+			timeToFull,
+			WalExhaustionThresholdSecs,
+			(long long) (freeBytes / (1024 * 1024)),
+			(long long) (walRate / 1024));
+
+		if (WalExhaustionSwitchover)
+		{
+			(void) SwitchoverOnWalExhaustion(node);
+		}
+	}
+
+	PG_RETURN_BOOL(isExhausting && !wasExhausting);
+}
+
+
+/*
+ * SwitchoverOnWalExhaustion starts a switchover away from the given node
+ * when it is a primary node, the same as pgautofailover.perform_failover().
+ * When the switchover can't be started, such as when no standby node is a
+ * candidate, we log a warning, and the keeper report is still registered.
+ */
+static void
+SwitchoverOnWalExhaustion(AutoFailoverNode *node)
+{
+	MemoryContext oldContext = CurrentMemoryContext;
+	ResourceOwner oldOwner = CurrentResourceOwner;
+
+	if (!IsCurrentState(node, REPLICATION_STATE_PRIMARY))
+	{
+		return;
+	}
+
+	BeginInternalSubTransaction(NULL);
+
+	PG_TRY();
+	{
+		DirectFunctionCall2(perform_failover,
+							CStringGetTextDatum(node->formationId),
+							Int32GetDatum(node->groupId));
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldContext);
+		CurrentResourceOwner = oldOwner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldContext);
+
+		ErrorData *edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldContext);
+		CurrentResourceOwner = oldOwner;
+
+		ereport(WARNING,
+				(errmsg("couldn't switch over from " NODE_FORMAT
+						" before pg_wal is full: %s",
+						NODE_FORMAT_ARGS(node),
+						edata->message)));
+
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * storage_health returns a row per node of the current database, with the
+ * last storage health and pg_wal free space that its keeper reported.
+ */
+Datum
+storage_health(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupleDescriptor = NULL;
+	HASH_SEQ_STATUS status;
+	StorageHealthEntry *entry = NULL;
+	TimestampTz now = GetCurrentTimestamp();
+
+	Tuplestorestate *tupleStore =
+		NodeShmemHashBeginSRF(&StorageHealthHash, fcinfo, &tupleDescriptor);
+
+	LWLockAcquire(StorageHealthHash.lock, LW_SHARED);
+
+	NodeShmemHashSeqInit(&StorageHealthHash, &status);
+
+	while ((entry = NodeShmemHashSeqSearch(&status)) != NULL)
+	{
+		Datum values[10];
+		bool isNulls[10];
+
+		memset(values, 0, sizeof(values));
+		memset(isNulls, false, sizeof(isNulls));
+
+		values[0] = Int64GetDatum(entry->key.nodeId);
+
+		/* a keeper might only report one of the probes or pg_wal space */
+		if (entry->reportTime != 0)
+		{
+			values[1] = TimestampTzGetDatum(entry->reportTime);
+			values[2] = Int64GetDatum(entry->p50Us);
+			values[3] = Int64GetDatum(entry->p99Us);
+			values[4] = Int64GetDatum(entry->maxUs);
+			values[5] = Int32GetDatum(entry->stallMs);
+		}
+		else
+		{
+			for (int i = 1; i <= 5; i++)
+			{
+				isNulls[i] = true;
+			}
+		}
+
+		values[6] = BoolGetDatum(StorageHealthEntryIsStalled(entry, now));
+
+		if (entry->walReportTime != 0)
+		{
+			values[7] = Int64GetDatum(entry->walFreeBytes);
+			values[8] = Int64GetDatum(entry->walRate);
+		}
+		else
+		{
+			isNulls[7] = true;
+			isNulls[8] = true;
+		}
+
+		if (entry->walReportTime != 0 && entry->walTimeToFull >= 0)
+		{
+			values[9] = Int32GetDatum(entry->walTimeToFull);
+		}
+		else
+		{
+			isNulls[9] = true;
+		}
+
+		tuplestore_putvalues(tupleStore, tupleDescriptor, values, isNulls);
+	}
+
+	LWLockRelease(StorageHealthHash.lock);
+
+	return (Datum) 0;
+}
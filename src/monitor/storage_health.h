@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/storage_health.h
+ *
+ * Declarations for the storage health that the keepers report, as measured
+ * by their I/O watchdog.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+
+/* how many nodes we keep the storage health for */
+#define STORAGE_HEALTH_MAX_NODES 1024
+
+
+/* GUC variables */
+extern int StorageStallTimeoutMs;
+extern int WalExhaustionThresholdSecs;
+extern bool WalExhaustionSwitchover;
+
+
+extern void InitializeStorageHealth(void);
+extern void RemoveStorageHealth(int64 nodeId);
+extern bool NodeStorageIsStalled(int64 nodeId, TimestampTz now);
@@ -0,0 +1,362 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/sync_quorum.c
+ *
+ * Implementation of the exclusion of lagging standby nodes from the
+ * synchronous replication quorum.
+ *
+ * A standby node that falls far behind, because of a slow disk or a long
+ * replay conflict, is still healthy and keeps its replicationQuorum
+ * property, and with ANY n in synchronous_standby_names it holds back the
+ * commits as soon as fewer than n of the other standby nodes reply faster.
+ * When pgautofailover.sync_quorum_exclude_lag_threshold is set, the monitor
+ * then leaves the standby nodes that lag more than that many MB out of
+ * synchronous_standby_names, and adds them back once they are within
+ * pgautofailover.enable_sync_wal_log_threshold bytes again, the same as when
+ * a standby node catches up. The excluded nodes are kept in the
+ * pgautofailover.sync_quorum_exclusion table.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+
+#include "group_state_machine.h"
+#include "metadata.h"
+#include "notifications.h"
+#include "replication_state.h"
+#include "sync_quorum.h"
+
+
+/* GUC variables */
+int SyncQuorumExcludeLagThreshold = 0;
+
+
+static int GetSyncQuorumExclusions(int64 **nodeIds);
+static bool NodeIdIsExcluded(int64 nodeId, int64 *nodeIds, int count);
+static void ExcludeNodeFromSyncQuorum(AutoFailoverNode *node, int64 lagBytes);
+static void RestoreNodeInSyncQuorum(AutoFailoverNode *node, int64 lagBytes);
+
+
+/*
+ * RemoveSyncQuorumExcludedNodes returns the nodes of the given list that are
+ * not excluded from the synchronous replication quorum, in the same order.
+ */
+List *
+RemoveSyncQuorumExcludedNodes(List *syncStandbyNodesList)
+{
+	int64 *excludedNodeIds = NULL;
+	ListCell *nodeCell = NULL;
+	List *nodesList = NIL;
+
+	if (syncStandbyNodesList == NIL)
+	{
+		return NIL;
+	}
+
+	int excludedCount = GetSyncQuorumExclusions(&excludedNodeIds);
+
+	if (excludedCount == 0)
+	{
+		return syncStandbyNodesList;
+	}
+
+	foreach(nodeCell, syncStandbyNodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (!NodeIdIsExcluded(node->nodeId, excludedNodeIds, excludedCount))
+		{
+			nodesList = lappend(nodesList, node);
+		}
+	}
+
+	return nodesList;
+}
+
+
+/*
+ * ProceedSyncQuorumExclusion excludes the secondary nodes of the quorum that
+ * lag behind the most advanced node of the group by more than
+ * pgautofailover.sync_quorum_exclude_lag_threshold, and restores the
+ * excluded secondary nodes that caught up. It returns true when the
+ * synchronous quorum has changed, and then the caller has the primary node
+ * apply its replication settings again.
+ *
+ * We never exclude so many nodes that fewer than number_sync_standbys
+ * secondary nodes, or none at all, are left in the quorum: we would then
+ * block the writes or disable synchronous replication, where the group state
+ * machine decides between those with the wait_primary state.
+ */
+bool
+ProceedSyncQuorumExclusion(AutoFailoverFormation *formation,
+						   AutoFailoverNode *primaryNode,
+						   List *standbyNodesList)
+{
+	int64 excludeLagBytes = (int64) SyncQuorumExcludeLagThreshold * 1024 * 1024;
+	int64 restoreLagBytes = Min((int64) EnableSyncXlogThreshold,
+								excludeLagBytes / 2);
+	int minQuorumNodesCount = Max(formation->number_sync_standbys, 1);
+	int quorumNodesCount = 0;
+	XLogRecPtr groupLSN = primaryNode->reportedLSN;
+	int64 *excludedNodeIds = NULL;
+	ListCell *nodeCell = NULL;
+	bool changed = false;
+
+	int excludedCount = GetSyncQuorumExclusions(&excludedNodeIds);
+
+	/* nothing to do when disabled and no node has been excluded before */
+	if (excludeLagBytes == 0 && excludedCount == 0)
+	{
+		return false;
+	}
+
+	/* the keeper of the primary reports the flush LSN every second */
+	ApplyReplicationStats(standbyNodesList);
+
+	foreach(nodeCell, standbyNodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+
+		if (node->reportedLSN > groupLSN)
+		{
+			groupLSN = node->reportedLSN;
+		}
+
+		if (node->replicationQuorum &&
+			IsCurrentState(node, REPLICATION_STATE_SECONDARY) &&
+			!NodeIdIsExcluded(node->nodeId, excludedNodeIds, excludedCount))
+		{
+			++quorumNodesCount;
+		}
+	}
+
+	/* first restore the nodes that caught up, or all when disabled */
+	foreach(nodeCell, standbyNodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		int64 lagBytes = (int64) (groupLSN - node->reportedLSN);
+
+		if (!NodeIdIsExcluded(node->nodeId, excludedNodeIds, excludedCount))
+		{
+			continue;
+		}
+
+		if (excludeLagBytes == 0 ||
+			(IsCurrentState(node, REPLICATION_STATE_SECONDARY) &&
+			 lagBytes <= restoreLagBytes))
+		{
+			RestoreNodeInSyncQuorum(node, lagBytes);
+
+			if (node->replicationQuorum &&
+				IsCurrentState(node, REPLICATION_STATE_SECONDARY))
+			{
+				++quorumNodesCount;
+			}
+			changed = true;
+		}
+	}
+
+	if (excludeLagBytes == 0)
+	{
+		return changed;
+	}
+
+	foreach(nodeCell, standbyNodesList)
+	{
+		AutoFailoverNode *node = (AutoFailoverNode *) lfirst(nodeCell);
+		int64 lagBytes = (int64) (groupLSN - node->reportedLSN);
+
+		if (!node->replicationQuorum ||
+			!IsCurrentState(node, REPLICATION_STATE_SECONDARY) ||
+			NodeIdIsExcluded(node->nodeId, excludedNodeIds, excludedCount) ||
+			lagBytes <= excludeLagBytes)
+		{
+			continue;
+		}
+
+		if (quorumNodesCount <= minQuorumNodesCount)
+		{
+			break;
+		}
+
+		ExcludeNodeFromSyncQuorum(node, lagBytes);
+
+		--quorumNodesCount;
+		changed = true;
+	}
+
+	return changed;
+}
+
+
+/*
+ * GetSyncQuorumExclusions sets nodeIds to an array of the ids of the nodes
+ * that are currently excluded from the synchronous quorum, and returns its
+ * size.
+ */
+static int
+GetSyncQuorumExclusions(int64 **nodeIds)
+{
+	const char *selectQuery =
+		"SELECT nodeid FROM " AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE;
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute(selectQuery, true, 0);
+
+	if (spiStatus != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not select from "
+			 AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE);
+	}
+
+	int count = (int) SPI_processed;
+
+	*nodeIds = NULL;
+
+	if (count > 0)
+	{
+		/* allocate in the caller's memory context */
+		*nodeIds = (int64 *) SPI_palloc(count * sizeof(int64));
+
+		for (int rowNumber = 0; rowNumber < count; rowNumber++)
+		{
+			HeapTuple heapTuple = SPI_tuptable->vals[rowNumber];
+			bool isNull = false;
+
+			(*nodeIds)[rowNumber] = DatumGetInt64(
+				heap_getattr(heapTuple, 1, SPI_tuptable->tupdesc, &isNull));
+		}
+	}
+
+	SPI_finish();
+
+	return count;
+}
+
+
+/*
+ * NodeIdIsExcluded returns true when the given node id is found in the
+ * nodeIds array.
+ */
+static bool
+NodeIdIsExcluded(int64 nodeId, int64 *nodeIds, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (nodeIds[i] == nodeId)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * ExcludeNodeFromSyncQuorum registers that the given node is excluded from
+ * the synchronous quorum, and notifies an event about it.
+ */
+static void
+ExcludeNodeFromSyncQuorum(AutoFailoverNode *node, int64 lagBytes)
+{
+	char message[BUFSIZE] = { 0 };
+
+	Oid argTypes[] = {
+		INT8OID,                    /* nodeid */
+		INT8OID                     /* lagbytes */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(node->nodeId),    /* nodeid */
+		Int64GetDatum(lagBytes)         /* lagbytes */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *insertQuery =
+		"INSERT INTO " AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE
+		" (nodeid, lagbytes) VALUES ($1, $2) "
+		"ON CONFLICT (nodeid) DO NOTHING";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(insertQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_INSERT)
+	{
+		elog(ERROR, "could not insert into "
+			 AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE);
+	}
+
+	SPI_finish();
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Excluding " NODE_FORMAT
+		" from the synchronous replication quorum: it lags %lld bytes "
+		"behind, more than pgautofailover.sync_quorum_exclude_lag_threshold",
+		NODE_FORMAT_ARGS(node),
+		(long long) lagBytes);
+
+	NotifyStateChange(node, message);
+}
+
+
+/*
+ * RestoreNodeInSyncQuorum removes the given node from the nodes that are
+ * excluded from the synchronous quorum, and notifies an event about it.
+ */
+static void
+RestoreNodeInSyncQuorum(AutoFailoverNode *node, int64 lagBytes)
+{
+	char message[BUFSIZE] = { 0 };
+
+	Oid argTypes[] = {
+		INT8OID                     /* nodeid */
+	};
+
+	Datum argValues[] = {
+		Int64GetDatum(node->nodeId)     /* nodeid */
+	};
+
+	const int argCount = sizeof(argValues) / sizeof(argValues[0]);
+
+	const char *deleteQuery =
+		"DELETE FROM " AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE
+		" WHERE nodeid = $1";
+
+	SPI_connect();
+
+	int spiStatus = SPI_execute_with_args(deleteQuery,
+										  argCount, argTypes, argValues,
+										  NULL, false, 0);
+
+	if (spiStatus != SPI_OK_DELETE)
+	{
+		elog(ERROR, "could not delete from "
+			 AUTO_FAILOVER_SYNC_QUORUM_EXCLUSION_TABLE);
+	}
+
+	SPI_finish();
+
+	LogAndNotifyMessage(
+		message, BUFSIZE,
+		"Restoring " NODE_FORMAT
+		" in the synchronous replication quorum: it lags %lld bytes behind",
+		NODE_FORMAT_ARGS(node),
+		(long long) lagBytes);
+
+	NotifyStateChange(node, message);
+}
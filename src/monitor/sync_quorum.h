@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/sync_quorum.h
+ *
+ * Declarations for the exclusion of lagging standby nodes from the
+ * synchronous replication quorum.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "nodes/pg_list.h"
+
+#include "formation_metadata.h"
+#include "node_metadata.h"
+
+
+/* GUC variables */
+extern int SyncQuorumExcludeLagThreshold;
+
+
+extern List * RemoveSyncQuorumExcludedNodes(List *syncStandbyNodesList);
+extern bool ProceedSyncQuorumExclusion(AutoFailoverFormation *formation,
+									   AutoFailoverNode *primaryNode,
+									   List *standbyNodesList);
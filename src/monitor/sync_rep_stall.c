@@ -0,0 +1,226 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/sync_rep_stall.c
+ *
+ * Implementation of the standby nodes that were degraded after their primary
+ * reported commits waiting for synchronous replication, in shared memory.
+ *
+ * The keeper of a primary node calls report_sync_rep_stall() with the standby
+ * nodes that are streaming when commits have been waiting for too long. The
+ * other quorum standby nodes are then assigned catchingup, which removes them
+ * from synchronous_standby_names. We don't take the primary at its word
+ * alone: a standby node is only degraded when its own reports confirm that it
+ * is not keeping up, see SyncRepStallIsConfirmed().
+ *
+ * A degraded standby node would otherwise be assigned secondary again at the
+ * next ProceedGroupState() as soon as it is healthy and its LSN is close,
+ * which puts it back in synchronous_standby_names, and commits stall again.
+ * To avoid that flapping, the node stays in catchingup for
+ * pgautofailover.sync_rep_stall_hold_time, and then until its keeper reports
+ * that its WAL receiver heard from its upstream node again, see
+ * SyncRepStallIsHeld().
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "failure_detector.h"
+#include "node_metadata.h"
+#include "node_shmem_hash.h"
+#include "replay_progress.h"
+#include "storage_health.h"
+#include "sync_rep_stall.h"
+
+#include "utils/timestamp.h"
+
+
+typedef struct SyncRepStallEntry
+{
+	NodeShmemHashKey key;
+
+	TimestampTz degradedTime;
+} SyncRepStallEntry;
+
+
+/* GUC variables */
+int SyncRepStallHoldTimeMs = 30 * 1000;
+
+static NodeShmemHash SyncRepStallHash =
+	make_node_shmem_hash("pg_auto_failover Sync Rep Stall",
+						 SyncRepStallEntry, SYNC_REP_STALL_MAX_NODES);
+
+
+/*
+ * InitializeSyncRepStall, called at server start, requests the shared memory
+ * for the degraded standby nodes.
+ */
+void
+InitializeSyncRepStall(void)
+{
+	NodeShmemHashRequest(&SyncRepStallHash);
+}
+
+
+/*
+ * RemoveSyncRepStall forgets about the degradation of a node of the current
+ * database, when the node is removed.
+ */
+void
+RemoveSyncRepStall(int64 nodeId)
+{
+	NodeShmemHashRemove(&SyncRepStallHash, nodeId);
+}
+
+
+/*
+ * SyncRepStallIsConfirmed returns true when the reports of the given standby
+ * node itself agree with its primary that it is not keeping up, and then sets
+ * the reason in the given buffer. That is when its keeper is late on its
+ * node_active() call by more than stallMs, when it reports that Postgres is
+ * not running, when its WAL receiver did not hear from the primary in stallMs
+ * or more, or when its storage is stalled.
+ *
+ * A standby node whose keeper reports in time that it is streaming is not
+ * degraded: commits then wait until the monitor finds it unhealthy, as they
+ * would without the keeper watchdog.
+ */
+bool
+SyncRepStallIsConfirmed(AutoFailoverNode *node, int stallMs, TimestampTz now,
+						char *reason, size_t size)
+{
+	TimestampTz lastHeartbeat = node->reportTime;
+	int expectedIntervalMs = 0;
+	TimestampTz reportTime = 0;
+	int64 stalenessMs = -1;
+
+	(void) GetNodeHeartbeat(node->nodeId, &lastHeartbeat, &expectedIntervalMs);
+
+	if (TimestampDifferenceExceeds(
+			TimestampTzPlusMilliseconds(lastHeartbeat, expectedIntervalMs),
+			now, stallMs))
+	{
+		snprintf(reason, size,
+				 "its keeper is late on its node_active() call by more "
+				 "than %d ms", stallMs);
+		return true;
+	}
+
+	if (!node->pgIsRunning)
+	{
+		snprintf(reason, size, "its keeper reports Postgres is not running");
+		return true;
+	}
+
+	if (GetNodeWalReceiverStaleness(node->nodeId, now,
+									&reportTime, &stalenessMs) &&
+		stalenessMs >= stallMs)
+	{
+		snprintf(reason, size,
+				 "its WAL receiver did not hear from the primary in %lld ms",
+				 (long long) stalenessMs);
+		return true;
+	}
+
+	if (NodeStorageIsStalled(node->nodeId, now))
+	{
+		snprintf(reason, size, "its storage is stalled");
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * RecordSyncRepStall registers that the given node of the current database
+ * has just been degraded after its primary reported a synchronous
+ * replication stall. When the hash table is full, the node is not held in
+ * catchingup.
+ */
+void
+RecordSyncRepStall(int64 nodeId, TimestampTz now)
+{
+	bool found = false;
+
+	if (SyncRepStallHash.hash == NULL)
+	{
+		return;
+	}
+
+	LWLockAcquire(SyncRepStallHash.lock, LW_EXCLUSIVE);
+
+	SyncRepStallEntry *entry =
+		(SyncRepStallEntry *) NodeShmemHashEnter(&SyncRepStallHash,
+												 nodeId, &found);
+
+	if (entry != NULL)
+	{
+		entry->degradedTime = now;
+	}
+
+	LWLockRelease(SyncRepStallHash.lock);
+}
+
+
+/*
+ * SyncRepStallIsHeld returns true when the given node has been degraded after
+ * a synchronous replication stall, and should not be assigned secondary yet.
+ * That is for pgautofailover.sync_rep_stall_hold_time, and then until its
+ * keeper reports that its WAL receiver heard from the upstream node after the
+ * node was degraded. Keepers that don't report their WAL receiver staleness
+ * are only held for the hold time.
+ */
+bool
+SyncRepStallIsHeld(AutoFailoverNode *node, TimestampTz now)
+{
+	TimestampTz degradedTime = 0;
+	TimestampTz reportTime = 0;
+	int64 stalenessMs = -1;
+
+	if (SyncRepStallHash.hash == NULL || node == NULL)
+	{
+		return false;
+	}
+
+	LWLockAcquire(SyncRepStallHash.lock, LW_SHARED);
+
+	SyncRepStallEntry *entry =
+		(SyncRepStallEntry *) NodeShmemHashFind(&SyncRepStallHash,
+												node->nodeId);
+
+	if (entry != NULL)
+	{
+		degradedTime = entry->degradedTime;
+	}
+
+	LWLockRelease(SyncRepStallHash.lock);
+
+	if (degradedTime == 0)
+	{
+		return false;
+	}
+
+	if (!TimestampDifferenceExceeds(degradedTime, now, SyncRepStallHoldTimeMs))
+	{
+		return true;
+	}
+
+	/* the receiver last heard from upstream stalenessMs before the report */
+	if (GetNodeWalReceiverStaleness(node->nodeId, now,
+									&reportTime, &stalenessMs) &&
+		!TimestampDifferenceExceeds(degradedTime,
+									TimestampTzPlusMilliseconds(reportTime,
+																-stalenessMs),
+									0))
+	{
+		return true;
+	}
+
+	RemoveSyncRepStall(node->nodeId);
+
+	return false;
+}
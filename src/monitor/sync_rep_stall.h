@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * src/monitor/sync_rep_stall.h
+ *
+ * Declarations for the standby nodes that were degraded after their primary
+ * reported commits waiting for synchronous replication.
+ *
+ * Copyright (c) Microsoft Corporation. All rights reserved.
+ * Licensed under the PostgreSQL License.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#pragma once
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+
+#include "node_metadata.h"
+
+
+/* how many nodes we keep the degradation time for */
+#define SYNC_REP_STALL_MAX_NODES 1024
+
+
+/* GUC variables */
+extern int SyncRepStallHoldTimeMs;
+
+
+extern void InitializeSyncRepStall(void);
+extern void RemoveSyncRepStall(int64 nodeId);
+extern bool SyncRepStallIsConfirmed(AutoFailoverNode *node, int stallMs,
+									TimestampTz now,
+									char *reason, size_t size);
+extern void RecordSyncRepStall(int64 nodeId, TimestampTz now);
+extern bool SyncRepStallIsHeld(AutoFailoverNode *node, TimestampTz now);
@@ -72,9 +72,19 @@ HeapTupleGetOid(HeapTuple tuple)
 
 #if (PG_VERSION_NUM < 130000)
 
+/* hash_any() moved to common/hashfn.h in Postgres 13 */
+#include "access/hash.h"
+
 /* Compatibility for ProcessUtility hook */
 #define QueryCompletion char
 
 #endif
 
+/* array type Oids are not all defined in older versions */
+#include "catalog/pg_type.h"
+
+#ifndef INT8ARRAYOID
+#define INT8ARRAYOID 1016
+#endif
+
 #endif   /* VERSION_COMPAT_H */
@@ -0,0 +1,230 @@
+#
+# Failover timings regression suite.
+#
+# The test_multi_* files check that failovers happen, this file checks how
+# long they take. It is not collected by the default nose run, use:
+#
+#   make TEST=bench_failover run-test
+#
+# Each scenario injects a failure on the current primary, and measures:
+#
+#   - detection: until the monitor assigns the standby a promotion state,
+#   - promotion: until the standby is a writable primary,
+#   - rejoin: from the time the old primary is given back to the cluster
+#     (restarted, network up, maintenance disabled), until it's a secondary
+#     again.
+#
+# The timings are compared to bench_failover_baseline.json, allowing for
+# BENCH_FAILOVER_TOLERANCE times the baseline (default 1.5) and at least a
+# 2 seconds slack. Set BENCH_FAILOVER_UPDATE=1 to write the timings measured
+# in this run as the new baseline instead.
+#
+import pgautofailover_utils as pgautofailover
+
+import json
+import os
+import os.path
+import time
+
+cluster = None
+monitor = None
+primary = None
+standby = None
+
+BASELINE_FILE = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "bench_failover_baseline.json"
+)
+RESULTS_FILE = "/tmp/bench_failover/results.json"
+
+TOLERANCE = float(os.getenv("BENCH_FAILOVER_TOLERANCE", "1.5"))
+MIN_SLACK = 2.0
+
+PROMOTION_ASSIGNED_STATES = (
+    "prepare_promotion",
+    "stop_replication",
+    "wait_primary",
+    "primary",
+)
+WRITABLE_STATES = ("wait_primary", "primary")
+
+timings = {}
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def wait_for_states(node, states, start, assigned=False):
+    """
+    Polls the monitor until node reaches one of the given states, and returns
+    the number of seconds elapsed since start. Several states are accepted
+    because a transient state might be missed between two polls.
+    """
+    timeout = pgautofailover.STATE_CHANGE_TIMEOUT
+
+    while time.monotonic() - start < timeout:
+        reported, goal = node.get_state()
+        current = goal if assigned else reported
+
+        if current in states:
+            elapsed = time.monotonic() - start
+            what = "assigned" if assigned else "in"
+            print(
+                "%s is %s '%s' after %.3fs"
+                % (node.datadir, what, current, elapsed)
+            )
+            return elapsed
+
+        time.sleep(pgautofailover.POLLING_INTERVAL)
+
+    node.print_debug_logs()
+    raise Exception(
+        "%s failed to reach any of %s after %d seconds"
+        % (node.datadir, ", ".join(states), timeout)
+    )
+
+
+def measure_failover(scenario, inject, recover):
+    """
+    Runs a failover scenario on the current primary, records its timings, and
+    swaps the primary and standby roles for the next scenario.
+    """
+    global primary, standby
+
+    print()
+    print("Scenario %s: %s is primary" % (scenario, primary.datadir))
+
+    assert primary.wait_until_state(target_state="primary")
+    assert standby.wait_until_state(target_state="secondary")
+
+    start = time.monotonic()
+    inject(primary)
+
+    detection = wait_for_states(
+        standby, PROMOTION_ASSIGNED_STATES, start, assigned=True
+    )
+    promotion = wait_for_states(standby, WRITABLE_STATES, start)
+
+    # the old primary might still be failed, give it back to the cluster
+    start = time.monotonic()
+    recover(primary)
+
+    rejoin = wait_for_states(primary, ("secondary",), start)
+    assert standby.wait_until_state(target_state="primary")
+
+    timings[scenario] = {
+        "detection": round(detection, 3),
+        "promotion": round(promotion, 3),
+        "rejoin": round(rejoin, 3),
+    }
+
+    primary, standby = standby, primary
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/bench_failover/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global primary
+    primary = cluster.create_datanode("/tmp/bench_failover/node1")
+    primary.create()
+    primary.run()
+    assert primary.wait_until_state(target_state="single")
+
+
+def test_002_add_standby():
+    global standby
+    standby = cluster.create_datanode("/tmp/bench_failover/node2")
+    standby.create()
+    standby.run()
+
+    assert standby.wait_until_state(target_state="secondary")
+    assert primary.wait_until_state(target_state="primary")
+
+
+def test_003_primary_kill():
+    measure_failover(
+        "primary_kill",
+        inject=lambda node: node.fail(),
+        recover=lambda node: node.run(),
+    )
+
+
+def test_004_network_partition():
+    measure_failover(
+        "network_partition",
+        inject=lambda node: node.ifdown(),
+        recover=lambda node: node.ifup(),
+    )
+
+
+def test_005_switchover():
+    measure_failover(
+        "switchover",
+        inject=lambda node: monitor.failover(),
+        recover=lambda node: None,
+    )
+
+
+def test_006_maintenance():
+    measure_failover(
+        "maintenance",
+        inject=lambda node: node.enable_maintenance(allowFailover=True),
+        recover=lambda node: node.disable_maintenance(),
+    )
+
+
+def test_007_compare_to_baseline():
+    print()
+
+    os.makedirs(os.path.dirname(RESULTS_FILE), exist_ok=True)
+    with open(RESULTS_FILE, "w") as f:
+        json.dump(timings, f, indent=2, sort_keys=True)
+    print("Failover timings written to %s" % RESULTS_FILE)
+
+    if os.getenv("BENCH_FAILOVER_UPDATE"):
+        with open(BASELINE_FILE, "w") as f:
+            json.dump(timings, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Baseline updated in %s" % BASELINE_FILE)
+        return
+
+    with open(BASELINE_FILE) as f:
+        baseline = json.load(f)
+
+    regressions = []
+
+    for scenario, metrics in sorted(timings.items()):
+        for metric, value in sorted(metrics.items()):
+            expected = baseline.get(scenario, {}).get(metric)
+
+            if expected is None:
+                print(
+                    "%-20s %-10s %8.3fs (no baseline)"
+                    % (scenario, metric, value)
+                )
+                continue
+
+            allowed = max(expected * TOLERANCE, expected + MIN_SLACK)
+            status = "ok" if value <= allowed else "REGRESSION"
+
+            print(
+                "%-20s %-10s %8.3fs baseline %8.3fs allowed %8.3fs %s"
+                % (scenario, metric, value, expected, allowed, status)
+            )
+
+            if value > allowed:
+                regressions.append("%s %s" % (scenario, metric))
+
+    assert not regressions, "Failover timings regressed: %s" % ", ".join(
+        regressions
+    )
@@ -0,0 +1,231 @@
+#
+# Idle CPU and wakeup budget of the pg_autoctl services.
+#
+# A stable cluster (a monitor, a primary and a secondary) is left alone for
+# BENCH_IDLE_SECONDS (default 60), and we measure for each pg_autoctl process,
+# the supervisor and each of its services:
+#
+#   - wakeups: the number of times the process was scheduled on a CPU, from
+#     /proc/<pid>/schedstat, or its voluntary context switches,
+#   - ctxsw: the voluntary and involuntary context switches,
+#   - cpu_ms: the user and system CPU time, in milliseconds.
+#
+# All metrics are given per second of the measurement. Postgres processes are
+# not included, only the pg_autoctl ones. It is not collected by the default
+# nose run, use:
+#
+#   make bench-idle
+#
+# The rates are compared to bench_idle_budget.json, allowing for
+# BENCH_IDLE_TOLERANCE times the budget (default 1.5) and at least a 0.5
+# slack. Set BENCH_IDLE_UPDATE=1 to write the rates measured in this run as
+# the new budget instead.
+#
+import pgautofailover_utils as pgautofailover
+
+import json
+import os
+import os.path
+import time
+
+cluster = None
+monitor = None
+primary = None
+standby = None
+
+BUDGET_FILE = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "bench_idle_budget.json"
+)
+RESULTS_FILE = "/tmp/bench_idle/results.json"
+
+DURATION = float(os.getenv("BENCH_IDLE_SECONDS", "60"))
+TOLERANCE = float(os.getenv("BENCH_IDLE_TOLERANCE", "1.5"))
+MIN_SLACK = 0.5
+
+# let the services settle after the cluster reached its stable state
+WARMUP = 10
+
+CLOCK_TICKS = os.sysconf("SC_CLK_TCK")
+
+rates = {}
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def service_pids(node):
+    """
+    Returns a dict of the pg_autoctl process pids of the given node, by
+    service name, from the pg_autoctl pid file. The supervisor itself is
+    named "supervisor".
+    """
+    pgautoctl = pgautofailover.PGAutoCtl(node)
+    out, err, ret = pgautoctl.execute(
+        "show file --pid", "show", "file", "--pid", "--contents", "--json"
+    )
+    pidfile = json.loads(out)
+
+    pids = {"supervisor": pidfile["pid"]}
+
+    for service in pidfile["services"]:
+        pids[service["name"]] = service["pid"]
+
+    return pids
+
+
+def process_counters(pid):
+    """
+    Returns the wakeups, context switches, and CPU milliseconds used so far
+    by the given process.
+    """
+    with open("/proc/%d/stat" % pid) as f:
+        # the command name is in parens and may contain spaces
+        fields = f.read().rsplit(")", 1)[1].split()
+
+    # utime and stime are fields 14 and 15, fields[0] is field 3
+    cpu_ms = (int(fields[11]) + int(fields[12])) * 1000.0 / CLOCK_TICKS
+
+    switches = {}
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.endswith("ctxt_switches\n"):
+                name, value = line.split(":")
+                switches[name] = int(value)
+
+    voluntary = switches.get("voluntary_ctxt_switches", 0)
+    ctxsw = voluntary + switches.get("nonvoluntary_ctxt_switches", 0)
+
+    # the third field is the count of timeslices run on a CPU
+    try:
+        with open("/proc/%d/schedstat" % pid) as f:
+            wakeups = int(f.read().split()[2])
+    except (OSError, IndexError):
+        wakeups = voluntary
+
+    return {"wakeups": wakeups, "ctxsw": ctxsw, "cpu_ms": cpu_ms}
+
+
+def snapshot(nodes):
+    """
+    Returns the counters of all the pg_autoctl processes of the given nodes,
+    by "role/service" name.
+    """
+    counters = {}
+
+    for role, node in nodes.items():
+        for service, pid in service_pids(node).items():
+            counters["%s/%s" % (role, service)] = (
+                pid,
+                process_counters(pid),
+            )
+
+    return counters
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/bench_idle/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global primary
+    primary = cluster.create_datanode("/tmp/bench_idle/node1")
+    primary.create()
+    primary.run()
+    assert primary.wait_until_state(target_state="single")
+
+
+def test_002_add_standby():
+    global standby
+    standby = cluster.create_datanode("/tmp/bench_idle/node2")
+    standby.create()
+    standby.run()
+
+    assert standby.wait_until_state(target_state="secondary")
+    assert primary.wait_until_state(target_state="primary")
+
+
+def test_003_measure_idle():
+    nodes = {"monitor": monitor, "primary": primary, "secondary": standby}
+
+    cluster.sleep(WARMUP)
+
+    start = time.monotonic()
+    before = snapshot(nodes)
+
+    print()
+    print("Measuring idle services for %ds" % DURATION)
+    cluster.sleep(DURATION)
+
+    after = snapshot(nodes)
+    elapsed = time.monotonic() - start
+
+    # the cluster must still be stable, or we measured something else
+    assert primary.wait_until_state(target_state="primary")
+    assert standby.wait_until_state(target_state="secondary")
+
+    for name, (pid, counters) in sorted(after.items()):
+        if name not in before or before[name][0] != pid:
+            print("%-24s restarted during the measurement, skipped" % name)
+            continue
+
+        start_counters = before[name][1]
+
+        rates[name] = {
+            metric: round((value - start_counters[metric]) / elapsed, 3)
+            for metric, value in counters.items()
+        }
+
+
+def test_004_compare_to_budget():
+    print()
+
+    os.makedirs(os.path.dirname(RESULTS_FILE), exist_ok=True)
+    with open(RESULTS_FILE, "w") as f:
+        json.dump(rates, f, indent=2, sort_keys=True)
+    print("Idle rates written to %s" % RESULTS_FILE)
+
+    if os.getenv("BENCH_IDLE_UPDATE"):
+        with open(BUDGET_FILE, "w") as f:
+            json.dump(rates, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Budget updated in %s" % BUDGET_FILE)
+        return
+
+    with open(BUDGET_FILE) as f:
+        budget = json.load(f)
+
+    regressions = []
+
+    for name, metrics in sorted(rates.items()):
+        for metric, value in sorted(metrics.items()):
+            expected = budget.get(name, {}).get(metric)
+
+            if expected is None:
+                print(
+                    "%-24s %-8s %8.3f/s (no budget)" % (name, metric, value)
+                )
+                continue
+
+            allowed = max(expected * TOLERANCE, expected + MIN_SLACK)
+            status = "ok" if value <= allowed else "REGRESSION"
+
+            print(
+                "%-24s %-8s %8.3f/s budget %8.3f/s allowed %8.3f/s %s"
+                % (name, metric, value, expected, allowed, status)
+            )
+
+            if value > allowed:
+                regressions.append("%s %s" % (name, metric))
+
+    assert not regressions, "Idle budget exceeded: %s" % ", ".join(
+        regressions
+    )
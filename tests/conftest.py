@@ -0,0 +1,83 @@
+#
+# pytest configuration, used when running the tests in parallel with
+# pytest-xdist, see PARALLEL in the Makefile. The nose runs ignore this file.
+#
+# The tests of a module share a cluster created in setup_module(), so all the
+# tests of a module are sent to the same worker: their xdist_group is the
+# module name. Modules that use resources shared on the host set
+# PARALLEL_GROUP at the top-level to run in the same worker, one after the
+# other. Each worker uses its own network namespaces and subnet, see
+# pgautofailover_utils.worker_index().
+#
+# At the end of the run, the duration of each test and module is written to
+# the PG_AUTOCTL_TEST_TIMINGS file as JSON (default is
+# /tmp/pg_auto_failover_test_timings.json), and the slowest modules are
+# listed in the summary.
+#
+import json
+import os
+import os.path
+
+import pytest
+
+TIMINGS_FILE = os.getenv(
+    "PG_AUTOCTL_TEST_TIMINGS", "/tmp/pg_auto_failover_test_timings.json"
+)
+SUMMARY_MODULES = 10
+
+timings = {}
+
+
+def pytest_collection_modifyitems(config, items):
+    for item in items:
+        group = getattr(item.module, "PARALLEL_GROUP", item.module.__name__)
+        item.add_marker(pytest.mark.xdist_group(name=group))
+
+
+def pytest_runtest_logreport(report):
+    test = timings.setdefault(
+        report.nodeid,
+        {"module": report.nodeid.split("::")[0], "duration": 0, "outcome": ""},
+    )
+    test["duration"] += report.duration
+
+    if report.when == "call" or report.outcome != "passed":
+        test["outcome"] = report.outcome
+
+    # with pytest-xdist, the worker running the test is reported
+    gateway = getattr(getattr(report, "node", None), "gateway", None)
+    if gateway is not None:
+        test["worker"] = gateway.id
+
+
+def pytest_sessionfinish(session, exitstatus):
+    # only the controller process writes the report
+    if hasattr(session.config, "workerinput") or not timings:
+        return
+
+    with open(TIMINGS_FILE, "w") as f:
+        json.dump({"tests": timings, "modules": module_timings()}, f, indent=2)
+
+
+def pytest_terminal_summary(terminalreporter, exitstatus, config):
+    if hasattr(config, "workerinput") or not timings:
+        return
+
+    modules = module_timings()
+
+    terminalreporter.section("timings")
+    for module in sorted(modules, key=modules.get, reverse=True)[
+        :SUMMARY_MODULES
+    ]:
+        terminalreporter.write_line("%9.2fs %s" % (modules[module], module))
+    terminalreporter.write_line("timings of each test in %s" % TIMINGS_FILE)
+
+
+def module_timings():
+    modules = {}
+
+    for test in timings.values():
+        modules[test["module"]] = (
+            modules.get(test["module"], 0) + test["duration"]
+        )
+    return modules
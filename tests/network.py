@@ -86,7 +86,12 @@ class VirtualLAN:
         for node in self.nodes:
             node.destroy()
         _remove_interface_if_exists(self.bridgeName)
-        if self.saved_bridge_nf_call_iptables is not None:
+        # when the tests run in parallel, the other workers still need the
+        # setting, and the value we saved might be one of theirs
+        if (
+            self.saved_bridge_nf_call_iptables is not None
+            and os.getenv("PYTEST_XDIST_WORKER") is None
+        ):
             with open(BRIDGE_NF_CALL_IPTABLES, "w") as f:
                 f.write(self.saved_bridge_nf_call_iptables)
 
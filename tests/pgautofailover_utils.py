@@ -39,16 +39,36 @@ class Feature(Enum):
         return self.name.lower()
 
 
+def worker_index():
+    """
+    Returns the index of the pytest-xdist worker running the tests, from 1 to
+    the count of workers, or 0 when the tests are not run in parallel.
+    """
+    worker = os.getenv("PYTEST_XDIST_WORKER", "")
+
+    if worker.startswith("gw"):
+        return int(worker[2:]) + 1
+    return 0
+
+
 class Cluster:
     # Docker uses 172.17.0.0/16 by default, so we use 172.27.1.0/24 to not
-    # conflict with that.
-    def __init__(
-        self, networkNamePrefix="pgauto", networkSubnet="172.27.1.0/24"
-    ):
+    # conflict with that. When running tests in parallel, each worker uses
+    # its own namespaces names and subnet: 172.27.2.0/24 for the first one,
+    # and so on.
+    def __init__(self, networkNamePrefix=None, networkSubnet=None):
         """
         Initializes the environment, virtual network, and other local state
         necessary for operation of the Cluster.
         """
+        index = worker_index()
+
+        if networkNamePrefix is None:
+            networkNamePrefix = "pgauto%s" % (index if index > 0 else "")
+
+        if networkSubnet is None:
+            networkSubnet = "172.27.%d.0/24" % (index + 1)
+
         os.environ["PG_REGRESS_SOCK_DIR"] = ""
         os.environ["PG_AUTOCTL_DEBUG"] = ""
         os.environ["PGHOST"] = "localhost"
@@ -1359,7 +1379,7 @@ SELECT reportedstate, goalstate
 
         :return:
         """
-        filename = "/tmp/nodes.json"
+        filename = "/tmp/%s-nodes.json" % self.vnode.namespace
 
         with open(filename, "w") as nodesFile:
             nodesFile.write(json.dumps(nodesArray))
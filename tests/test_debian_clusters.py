@@ -2,6 +2,9 @@ import pgautofailover_utils as pgautofailover
 import os.path
 import subprocess
 
+# debian clusters share /etc/postgresql, see tests/conftest.py
+PARALLEL_GROUP = "debian"
+
 cluster = None
 monitor = None
 
@@ -4,6 +4,9 @@ import subprocess
 import os
 import time
 
+# ~/.postgresql and /tmp/certs are shared, see tests/conftest.py
+PARALLEL_GROUP = "ssl"
+
 cluster = None
 monitor = None
 node1 = None
@@ -0,0 +1,297 @@
+import pgautofailover_utils as pgautofailover
+from nose.tools import eq_
+
+import ipaddress
+import os
+import random
+import shutil
+import subprocess
+import time
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+node3 = None
+
+REPLICATION_USERNAME = "pgautofailover_replicator"
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    cluster.destroy()
+
+
+def hba_hosts(*hosts):
+    """
+    Returns the hosts of the HBA rules that pg_autoctl edits for nodes found
+    at the given hosts when postgresql.hba_compact is set, or None when it
+    fails to compute them.
+    """
+    command = [shutil.which("pg_autoctl"), "do", "show", "hba-hosts"]
+
+    env = dict(os.environ, PG_AUTOCTL_DEBUG="1")
+    p = subprocess.run(
+        command + ["--"] + list(hosts), text=True, capture_output=True, env=env
+    )
+
+    if p.returncode != 0:
+        return None
+
+    return p.stdout.splitlines()
+
+
+def collapse(*addresses):
+    networks = [ipaddress.ip_network(address) for address in addresses]
+
+    # collapse_addresses doesn't mix IPv4 and IPv6, we list IPv4 first
+    return [
+        str(network)
+        for version in [4, 6]
+        for network in ipaddress.collapse_addresses(
+            [n for n in networks if n.version == version]
+        )
+    ]
+
+
+def test_000_siblings_merge():
+    eq_(hba_hosts("10.0.0.4", "10.0.0.5"), ["10.0.0.4/31"])
+    eq_(hba_hosts("10.0.0.5", "10.0.0.4"), ["10.0.0.4/31"])
+    eq_(
+        hba_hosts("10.0.0.4", "10.0.0.5", "10.0.0.6", "10.0.0.7"),
+        ["10.0.0.4/30"],
+    )
+    eq_(
+        hba_hosts("10.0.0.4", "10.0.0.5", "10.0.0.6"),
+        ["10.0.0.4/31", "10.0.0.6/32"],
+    )
+    eq_(hba_hosts("fd00::4", "fd00::5"), ["fd00::4/127"])
+
+
+def test_001_non_siblings_do_not_merge():
+    # adjacent addresses, but in different /31 blocks
+    eq_(hba_hosts("10.0.0.5", "10.0.0.6"), ["10.0.0.5/32", "10.0.0.6/32"])
+
+    # same /30 block, but not the whole of it
+    eq_(hba_hosts("10.0.0.4", "10.0.0.6"), ["10.0.0.4/32", "10.0.0.6/32"])
+
+    # the two /31 blocks are not siblings
+    eq_(
+        hba_hosts("10.0.0.2", "10.0.0.3", "10.0.0.4", "10.0.0.5"),
+        ["10.0.0.2/31", "10.0.0.4/31"],
+    )
+
+    eq_(hba_hosts("10.0.0.1"), ["10.0.0.1/32"])
+    eq_(hba_hosts("10.0.0.255", "10.0.1.0"), ["10.0.0.255/32", "10.0.1.0/32"])
+
+
+def test_002_duplicates():
+    eq_(hba_hosts("10.0.0.1", "10.0.0.1"), ["10.0.0.1/32"])
+    eq_(hba_hosts("10.0.0.4", "10.0.0.5", "10.0.0.4"), ["10.0.0.4/31"])
+    eq_(hba_hosts("fd00::1", "fd00:0:0::1"), ["fd00::1/128"])
+
+
+def test_003_mixed_ipv4_and_ipv6():
+    eq_(
+        hba_hosts("fd00::5", "10.0.0.5", "fd00::4", "10.0.0.4"),
+        ["10.0.0.4/31", "fd00::4/127"],
+    )
+
+    # an IPv4 address and its IPv4-mapped IPv6 address are not siblings
+    eq_(
+        hba_hosts("10.0.0.4", "::ffff:10.0.0.5"),
+        ["10.0.0.4/32", "::ffff:10.0.0.5/128"],
+    )
+
+
+def test_004_hostnames():
+    # hostnames that resolve are aggregated with the IP addresses
+    eq_(hba_hosts("localhost", "127.0.0.1"), ["127.0.0.1/32"])
+
+    # the others get rules of their own, after the blocks
+    eq_(
+        hba_hosts("10.0.0.5", "node.invalid", "10.0.0.4"),
+        ["10.0.0.4/31", "node.invalid"],
+    )
+    eq_(
+        hba_hosts("a.node.invalid", "b.node.invalid"),
+        ["a.node.invalid", "b.node.invalid"],
+    )
+
+
+def test_005_same_as_collapse_addresses():
+    rng = random.Random(117)
+
+    # a group has at most NODE_ARRAY_MAX_COUNT other nodes
+    for _ in range(50):
+        count = rng.randint(1, 12)
+        ipv6 = rng.randint(0, min(4, count - 1))
+        addresses = [
+            str(ipaddress.ip_address("10.1.0.0") + rng.randrange(32))
+            for _ in range(count - ipv6)
+        ]
+        addresses += [
+            str(ipaddress.ip_address("fd00::") + rng.randrange(16))
+            for _ in range(ipv6)
+        ]
+
+        eq_(hba_hosts(*addresses), collapse(*addresses), addresses)
+
+    eq_(hba_hosts(*["10.1.0.%d" % i for i in range(13)]), None)
+
+
+def test_006_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/hba_compact/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_007_init_nodes():
+    global node1, node2, node3
+
+    node1 = cluster.create_datanode("/tmp/hba_compact/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node2 = cluster.create_datanode("/tmp/hba_compact/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+
+    node3 = cluster.create_datanode("/tmp/hba_compact/node3")
+    node3.create()
+    node3.run()
+    assert node3.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def hba_rules(node):
+    """
+    Returns the HBA rules of the node as (type, database, user, address,
+    method, generated) tuples, skipping local rules.
+    """
+    rules = []
+
+    with open(os.path.join(node.datadir, "pg_hba.conf")) as hba:
+        for line in hba:
+            generated = "# Auto-generated by pg_auto_failover" in line
+            fields = line.split("#")[0].split()
+
+            if len(fields) < 5 or fields[0] == "local":
+                continue
+
+            database = fields[1].split(",")
+            user = [u.strip('"') for u in fields[2].split(",")]
+
+            rules.append(
+                (fields[0], database, user, fields[3], fields[4], generated)
+            )
+
+    return rules
+
+
+def replication_admitted(node):
+    """
+    Returns the addresses of the test network that the HBA rules of the node
+    admit replication connections from, as Postgres finds the first rule that
+    matches each connection.
+    """
+    subnet = ipaddress.ip_network(cluster.networkSubnet)
+    rules = [
+        rule
+        for rule in hba_rules(node)
+        if "replication" in rule[1]
+        and (REPLICATION_USERNAME in rule[2] or "all" in rule[2])
+    ]
+    admitted = set()
+
+    for address in subnet.hosts():
+        for rule in rules:
+            if rule[3] in ["all", "samehost", "samenet"]:
+                network = subnet
+            else:
+                # we don't resolve hostnames here: the nodes use addresses
+                network = ipaddress.ip_network(rule[3])
+
+            if address in network:
+                if rule[4] != "reject":
+                    admitted.add(str(address))
+                break
+
+    return admitted
+
+
+def test_008_enable_hba_compact():
+    others = [str(node2.vnode.address), str(node3.vnode.address)]
+
+    node1.config_set("postgresql.hba_compact", "1")
+
+    # the keeper edits the HBA file at the next round with the monitor
+    expected = collapse(*others)
+    rules = []
+
+    for _ in range(30):
+        rules = [
+            rule[3]
+            for rule in hba_rules(node1)
+            if rule[5] and "replication" in rule[1]
+        ]
+        if sorted(rules) == sorted(expected):
+            break
+        time.sleep(1)
+
+    eq_(sorted(rules), sorted(expected))
+
+    # also the rules for the application connections
+    dbname_rules = [
+        rule[3]
+        for rule in hba_rules(node1)
+        if rule[5] and REPLICATION_USERNAME in rule[2]
+        and "replication" not in rule[1]
+    ]
+    eq_(sorted(dbname_rules), sorted(expected))
+
+    eq_(replication_admitted(node1), set(others))
+
+
+def test_009_replication_still_works():
+    node1.run_sql_query("CREATE TABLE t1(a int)")
+    node1.run_sql_query("INSERT INTO t1 VALUES (1), (2)")
+
+    for node in [node2, node3]:
+        assert node.wait_until_state(target_state="secondary")
+
+    # the standbys reconnect with the compacted rules
+    node2.restart_postgres()
+    node3.restart_postgres()
+
+    node1.run_sql_query("INSERT INTO t1 VALUES (3)")
+    node1.run_sql_query("CHECKPOINT")
+
+    for node in [node2, node3]:
+        for _ in range(30):
+            results = node.run_sql_query("SELECT count(*) FROM t1")
+            if results == [(3,)]:
+                break
+            time.sleep(1)
+        eq_(results, [(3,)])
+
+
+def test_010_drop_node():
+    node3.drop()
+    assert node1.wait_until_state(target_state="primary")
+
+    others = [str(node2.vnode.address)]
+
+    for _ in range(30):
+        if replication_admitted(node1) == set(others):
+            break
+        time.sleep(1)
+
+    eq_(replication_admitted(node1), set(others))
@@ -0,0 +1,199 @@
+from nose.tools import eq_
+
+import json
+import os
+import shutil
+import subprocess
+
+# the nodes array scanner (parseNodesArray) replaced a parson based parser
+# (parseNodesArrayWithParson), both are run on the same input by the command
+# pg_autoctl do monitor parse-nodes, which needs no cluster.
+
+
+def node(number, **properties):
+    n = {
+        "node_id": number,
+        "node_name": "node_%d" % number,
+        "node_host": "10.0.0.%d" % number,
+        "node_port": 5432,
+        "node_lsn": "0/3000148",
+        "node_is_primary": number == 1,
+    }
+    n.update(properties)
+    return n
+
+
+def parse_nodes(nodes_json, node_id=None):
+    command = [shutil.which("pg_autoctl"), "do", "monitor", "parse-nodes"]
+
+    if node_id is not None:
+        command += ["--node-id", str(node_id)]
+
+    env = dict(os.environ, PG_AUTOCTL_DEBUG="1")
+    p = subprocess.run(
+        command + ["--", nodes_json], text=True, capture_output=True, env=env
+    )
+    eq_(p.returncode, 0, p.stderr)
+
+    return json.loads(p.stdout)
+
+
+def assert_same(nodes_json, node_id=None):
+    """
+    Both parsers accept the input, and find the same nodes in there.
+    """
+    result = parse_nodes(nodes_json, node_id)
+
+    assert result["scanner"]["valid"], nodes_json
+    assert result["parson"]["valid"], nodes_json
+    eq_(result["scanner"]["nodes"], result["parson"]["nodes"])
+
+    return result["scanner"]["nodes"]
+
+
+def assert_both_reject(nodes_json):
+    result = parse_nodes(nodes_json)
+
+    assert not result["scanner"]["valid"], nodes_json
+    assert not result["parson"]["valid"], nodes_json
+
+
+def assert_scanner_rejects(nodes_json):
+    """
+    The scanner is stricter than parson, which accepts the input.
+    """
+    result = parse_nodes(nodes_json)
+
+    assert not result["scanner"]["valid"], nodes_json
+    assert result["parson"]["valid"], nodes_json
+
+
+def test_000_nodes_array():
+    nodes = assert_same(json.dumps([node(1), node(2), node(3)]))
+    eq_([n["node_id"] for n in nodes], [1, 2, 3])
+    eq_(nodes[1]["node_host"], "10.0.0.2")
+
+    eq_(assert_same("[]"), [])
+    eq_(assert_same(" [ ] "), [])
+
+
+def test_001_skip_ourselves():
+    nodes = assert_same(json.dumps([node(1), node(2), node(3)]), node_id=2)
+    eq_([n["node_id"] for n in nodes], [1, 3])
+
+
+def test_002_sorted_by_node_id():
+    nodes = assert_same(json.dumps([node(3), node(1), node(2)]))
+    eq_([n["node_id"] for n in nodes], [1, 2, 3])
+
+
+def test_003_escapes():
+    names = [
+        'quote " backslash \\ slash /',
+        "tab\tnewline\nreturn\rbackspace\bformfeed\f",
+        "latin é, euro €",
+        "emoji 😀",
+    ]
+
+    # json.dumps escapes to \uXXXX by default, and then not at all
+    for ensure_ascii in [True, False]:
+        nodes_json = json.dumps(
+            [node(i + 1, node_name=name) for i, name in enumerate(names)],
+            ensure_ascii=ensure_ascii,
+        )
+        # the scanner doesn't decode surrogate pairs: keep the emoji raw
+        nodes_json = nodes_json.replace("\\ud83d\\ude00", "😀")
+
+        nodes = assert_same(nodes_json)
+        eq_([n["node_name"] for n in nodes], names)
+
+    nodes = assert_same(
+        '[{"node_id": 1, "node_name": "\\/\\u0041\\u00E9", '
+        '"node_host": "h", "node_port": 1, "node_lsn": "0/1", '
+        '"node_is_primary": true}]'
+    )
+    eq_(nodes[0]["node_name"], "/Aé")
+
+
+def test_004_unknown_and_nested_fields():
+    nodes = assert_same(
+        json.dumps(
+            [
+                node(
+                    1,
+                    node_extra={"a": [1, {"b": None}], "c": "}]\"{["},
+                    node_flag=False,
+                    node_float=1.5e3,
+                ),
+                node(2, node_array=[[], {}, [[["deep"]]]]),
+            ]
+        )
+    )
+    eq_([n["node_id"] for n in nodes], [1, 2])
+
+    # the order of the properties doesn't matter
+    reordered = dict(reversed(list(node(2).items())))
+    eq_(
+        assert_same(json.dumps([node(1), reordered])),
+        assert_same(json.dumps([node(1), node(2)])),
+    )
+
+
+def test_005_embedded_nul():
+    # an embedded NUL would truncate the value, and parson does just that
+    assert_scanner_rejects(json.dumps([node(1, node_name="node\u0000_1")]))
+    assert_scanner_rejects(json.dumps([node(1, node_host="10.0.0.1\u0000x")]))
+
+    # a raw control character is not valid JSON
+    assert_both_reject(json.dumps([node(1)]).replace("node_1", "node\u0001_1"))
+
+
+def test_006_over_long_strings():
+    # parson then truncates the values to fit in the NodeAddress
+    assert_scanner_rejects(json.dumps([node(1, node_name="n" * 300)]))
+    assert_scanner_rejects(json.dumps([node(1, node_host="h" * 300)]))
+
+    # a truncated LSN is not valid anymore
+    assert_both_reject(json.dumps([node(1, node_lsn="0/" + "1" * 100)]))
+
+    # long values of the properties that we skip are fine
+    assert_same(json.dumps([node(1, node_extra="x" * 10000)]))
+
+
+def test_007_truncated_input():
+    nodes_json = json.dumps([node(1), node(2)])
+
+    for length in range(len(nodes_json)):
+        assert_both_reject(nodes_json[:length])
+
+
+def test_008_malformed_input():
+    for nodes_json in [
+        "",
+        "{}",
+        "null",
+        "[null]",
+        "[1]",
+        '[{"node_id": 1}]',
+        json.dumps([node(1, node_id="1")]),
+        json.dumps([node(1, node_port="5432")]),
+        json.dumps([node(1, node_is_primary="true")]),
+        json.dumps([node(1, node_lsn="not an lsn")]),
+        json.dumps([node(1), node(1)]),
+        json.dumps([node(1), node(2, node_is_primary=True)]),
+        '[{"node_id": 1, "node_name": "\\x", "node_host": "h", '
+        '"node_port": 1, "node_lsn": "0/1", "node_is_primary": true}]',
+        '[{"node_id": 1, "node_name": "\\u12", "node_host": "h", '
+        '"node_port": 1, "node_lsn": "0/1", "node_is_primary": true}]',
+    ]:
+        assert_both_reject(nodes_json)
+
+    missing = node(1)
+    del missing["node_lsn"]
+    assert_both_reject(json.dumps([missing]))
+
+    # the scanner wants the whole input to be the nodes array
+    assert_scanner_rejects(json.dumps([node(1)]) + " trailing")
+
+    # and it only knows about integers
+    assert_scanner_rejects(json.dumps([node(1, node_port=5432.0)]))
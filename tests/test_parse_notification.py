@@ -0,0 +1,265 @@
+from nose.tools import eq_
+
+import json
+import os
+import shutil
+import subprocess
+
+# the keeper parses the monitor state notifications with a fixed schema
+# parser, and falls back to parson for the messages that it doesn't accept.
+# pg_autoctl do monitor parse-notification --compare runs both parsers on the
+# same message, and tells which one parse_state_notification_message uses.
+
+
+def payload(**properties):
+    """
+    Build a notification message as NotifyStateChange() does: properties in
+    the same order, separated the same way, with escape_json() escaping.
+    """
+    state = {
+        "formation": "default",
+        "groupId": 0,
+        "nodeId": 1,
+        "name": "node_1",
+        "host": "localhost",
+        "port": 5001,
+        "reportedState": "wait_primary",
+        "goalState": "primary",
+        "health": "good",
+    }
+    state.update(properties)
+
+    def escape(value):
+        return json.dumps(value, ensure_ascii=False)
+
+    message = '{"type": "state"'
+    message += ', "formation": %s' % escape(state["formation"])
+    message += ', "groupId": %d' % state["groupId"]
+    message += ', "nodeId": %d' % state["nodeId"]
+    message += ', "name": %s' % escape(state["name"])
+    message += ', "host": %s' % escape(state["host"])
+    message += ', "port": %d' % state["port"]
+    message += ', "reportedState": %s' % escape(state["reportedState"])
+    message += ', "goalState": %s' % escape(state["goalState"])
+    message += ', "health":%s' % escape(state["health"])
+
+    if "traceId" in state:
+        message += ', "traceId": %s' % escape(state["traceId"])
+
+    if "synchronousStandbyNames" in state:
+        message += ', "synchronousStandbyNames": %s' % escape(
+            state["synchronousStandbyNames"]
+        )
+
+    message += "}"
+
+    return message
+
+
+def parse_notification(message):
+    command = [
+        shutil.which("pg_autoctl"),
+        "do",
+        "monitor",
+        "parse-notification",
+        "--compare",
+    ]
+
+    env = dict(os.environ, PG_AUTOCTL_DEBUG="1")
+    p = subprocess.run(
+        command + ["--", message], text=True, capture_output=True, env=env
+    )
+    eq_(p.returncode, 0, p.stderr)
+
+    return json.loads(p.stdout)
+
+
+def assert_fixed(message):
+    """
+    The fixed schema parser takes the message, and finds the same node state
+    as parson does.
+    """
+    result = parse_notification(message)
+
+    eq_(result["parser"], "fixed", message)
+    assert result["parson"]["valid"], message
+    eq_(result["fixed"]["state"], result["parson"]["state"])
+
+    return result["fixed"]["state"]
+
+
+def assert_fallback(message):
+    """
+    The fixed schema parser gives up on the message, and parson takes it.
+    """
+    result = parse_notification(message)
+
+    assert not result["fixed"]["valid"], message
+    eq_(result["parser"], "parson", message)
+
+    return result["parson"]["state"]
+
+
+def assert_rejected(message):
+    result = parse_notification(message)
+
+    assert not result["fixed"]["valid"], message
+    assert not result["parson"]["valid"], message
+    eq_(result["parser"], None, message)
+
+
+def test_000_notify_state_change():
+    state = assert_fixed(payload())
+
+    eq_(state["formation"], "default")
+    eq_(state["nodeId"], 1)
+    eq_(state["name"], "node_1")
+    eq_(state["host"], "localhost")
+    eq_(state["port"], 5001)
+    eq_(state["reportedState"], "wait_primary")
+    eq_(state["goalState"], "primary")
+    eq_(state["health"], 1)
+    assert "synchronousStandbyNames" not in state
+
+
+def test_001_states_and_health():
+    for reported, goal, health, value in [
+        ("init", "single", "unknown", -1),
+        ("single", "single", "good", 1),
+        ("primary", "draining", "bad", 0),
+        ("demote_timeout", "demoted", "bad", 0),
+        ("catchingup", "secondary", "good", 1),
+        ("report_lsn", "fast_forward", "good", 1),
+        ("maintenance", "maintenance", "unknown", -1),
+        ("dropped", "dropped", "bad", 0),
+    ]:
+        state = assert_fixed(
+            payload(reportedState=reported, goalState=goal, health=health)
+        )
+        eq_(state["reportedState"], reported)
+        eq_(state["goalState"], goal)
+        eq_(state["health"], value)
+
+
+def test_002_optional_properties():
+    state = assert_fixed(
+        payload(
+            groupId=2,
+            nodeId=9007199254740991,
+            traceId="00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01",
+            synchronousStandbyNames="ANY 1 (pgautofailover_standby_2)",
+        )
+    )
+    eq_(state["groupId"], 2)
+    eq_(state["nodeId"], 9007199254740991)
+    eq_(state["synchronousStandbyNames"], "ANY 1 (pgautofailover_standby_2)")
+
+    state = assert_fixed(payload(synchronousStandbyNames=""))
+    eq_(state["synchronousStandbyNames"], "")
+
+
+def test_003_escaped_names():
+    for name in [
+        'quote " backslash \\ slash /',
+        "tab\tnewline\nreturn\r",
+        "control \u0001 \u001f",
+        "latin é, euro €, emoji 😀",
+    ]:
+        state = assert_fixed(payload(name=name, formation=name))
+        eq_(state["name"], name)
+        eq_(state["formation"], name)
+
+    # escape_json() doesn't escape those, other JSON writers might
+    state = assert_fixed(
+        payload().replace('"node_1"', '"\\u006eode\\/1 \\u00e9\\u20ac"')
+    )
+    eq_(state["name"], "node/1 é€")
+
+
+def test_004_reordered_and_extra_keys():
+    expected = assert_fixed(payload())
+
+    message = json.loads(payload())
+    reordered = json.dumps(dict(reversed(list(message.items()))))
+    eq_(assert_fixed(reordered), expected)
+
+    # compact and spaced out separators
+    eq_(assert_fixed(json.dumps(message, separators=(",", ":"))), expected)
+    eq_(assert_fixed(json.dumps(message, indent=4)), expected)
+
+    extra = dict(message)
+    extra["nodeCluster"] = "default"
+    extra["candidatePriority"] = 50
+    extra["replicationQuorum"] = True
+    extra["description"] = None
+    extra["nested"] = {"a": [1, 2.5, {"b": "}\"]"}], "c": {}}
+    eq_(assert_fixed(json.dumps(extra)), expected)
+
+
+def test_005_fallback():
+    # messages from another version of the monitor, without all the
+    # properties that we know about
+    message = json.loads(payload(groupId=1))
+    del message["groupId"]
+    state = assert_fallback(json.dumps(message))
+    eq_(state["groupId"], 0)
+    eq_(state["name"], "node_1")
+
+    # numbers that are not integers
+    state = assert_fallback(payload().replace("5001", "5001.0"))
+    eq_(state["port"], 5001)
+
+    # an escaped surrogate pair
+    state = assert_fallback(payload().replace('"node_1"', '"\\ud83d\\ude00"'))
+    eq_(state["name"], "😀")
+
+    # an embedded NUL, escaped as \u0000, that parson truncates the name at
+    state = assert_fallback(payload(name="node\u0000_1"))
+    eq_(state["name"], "node")
+
+    # a name that's too long for the fixed parser buffer, that parson
+    # truncates
+    state = assert_fallback(payload(name="n" * 300))
+    assert state["name"].startswith("nnn")
+    assert len(state["name"]) < 300
+
+    # deeply nested extra values
+    deep = json.loads(payload())
+    deep["nested"] = json.loads("[" * 64 + "]" * 64)
+    eq_(assert_fallback(json.dumps(deep))["name"], "node_1")
+
+    # extra input after the message
+    eq_(assert_fallback(payload() + " trailing")["name"], "node_1")
+
+
+def test_006_truncated_messages():
+    message = payload()
+
+    for length in range(len(message)):
+        assert_rejected(message[:length])
+
+
+def test_007_malformed_messages():
+    message = json.loads(payload())
+
+    not_state = dict(message, type="log")
+    no_name = dict(message)
+    del no_name["name"]
+    bad_health = dict(message, health="excellent")
+    number_name = dict(message, name=1)
+
+    for malformed in [
+        "",
+        "null",
+        "[]",
+        "{}",
+        "state",
+        json.dumps([message]),
+        json.dumps(not_state),
+        json.dumps(no_name),
+        json.dumps(bad_health),
+        json.dumps(number_name),
+        payload().replace('"node_1"', '"node\\x"'),
+        payload().replace('"node_1"', '"\\u12"'),
+    ]:
+        assert_rejected(malformed)
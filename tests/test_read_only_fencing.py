@@ -0,0 +1,152 @@
+import pgautofailover_utils as pgautofailover
+from nose.tools import eq_
+
+import psycopg2
+import threading
+import time
+
+cluster = None
+monitor = None
+node1 = None
+node2 = None
+
+# commits acknowledged by node1, as (id, time) tuples
+acknowledged = []
+writing = threading.Event()
+
+
+def setup_module():
+    global cluster
+    cluster = pgautofailover.Cluster()
+
+
+def teardown_module():
+    writing.clear()
+    cluster.destroy()
+
+
+def test_000_create_monitor():
+    global monitor
+    monitor = cluster.create_monitor("/tmp/fencing/monitor")
+    monitor.run()
+    monitor.wait_until_pg_is_running()
+
+
+def test_001_init_primary():
+    global node1
+    node1 = cluster.create_datanode("/tmp/fencing/node1")
+    node1.create()
+    node1.run()
+    assert node1.wait_until_state(target_state="single")
+
+    node1.run_sql_query("CREATE TABLE t1(id int)")
+
+
+def test_002_init_secondary():
+    global node2
+    node2 = cluster.create_datanode("/tmp/fencing/node2")
+    node2.create()
+    node2.run()
+    assert node2.wait_until_state(target_state="secondary")
+    assert node1.wait_until_state(target_state="primary")
+
+
+def test_003_enable_fencing():
+    node1.config_set("pg_autoctl.read_only_fencing", "1")
+    eq_(node1.config_get("pg_autoctl.read_only_fencing"), "1")
+
+    # wait until the reload signal has been processed
+    time.sleep(2)
+
+
+def write_read_write(node, id):
+    """
+    Commits a row in an explicit read-write transaction, which the
+    default_transaction_read_only setting does not prevent.
+    """
+    conn = psycopg2.connect(node.connection_string(), connect_timeout=2)
+    conn.autocommit = True
+
+    try:
+        with conn.cursor() as cur:
+            cur.execute("BEGIN READ WRITE")
+            cur.execute("INSERT INTO t1 VALUES (%s)", (id,))
+            cur.execute("COMMIT")
+    finally:
+        conn.close()
+
+
+def writer():
+    id = 0
+
+    while writing.is_set():
+        id += 1
+
+        try:
+            write_read_write(node1, id)
+            acknowledged.append((id, time.time()))
+        except psycopg2.Error:
+            time.sleep(0.1)
+
+
+def test_004_failover_while_writing():
+    print()
+
+    writing.set()
+    thread = threading.Thread(target=writer, daemon=True)
+    thread.start()
+
+    # make sure that we write before the failover
+    time.sleep(2)
+    assert len(acknowledged) > 0
+
+    print("Calling pgautofailover.failover() on the monitor")
+    monitor.failover()
+
+    # as soon as node1 reports demoted, commits must be refused
+    demoted_at = None
+    timeout = 90
+
+    while demoted_at is None and timeout > 0:
+        current, assigned = node1.get_local_state()
+
+        if current in ("demote_timeout", "demoted", "catchingup", "secondary"):
+            demoted_at = time.time()
+            break
+
+        time.sleep(0.2)
+        timeout -= 0.2
+
+    assert demoted_at is not None
+
+    # keep writing for a while after the node reported demoted
+    time.sleep(5)
+    writing.clear()
+
+    late = [id for (id, at) in acknowledged if at > demoted_at]
+    eq_(late, [])
+
+
+def test_005_read_write_refused_once_demoted():
+    current, assigned = node1.get_local_state()
+    print()
+    print("node1 is now %s" % current)
+
+    # whether Postgres is stopped or back as a standby, the commit fails
+    refused = False
+
+    try:
+        write_read_write(node1, -1)
+    except psycopg2.Error as e:
+        print("explicit read-write commit refused: %s" % str(e).strip())
+        refused = True
+
+    assert refused
+
+
+def test_006_old_primary_rejoins():
+    assert node2.wait_until_state(target_state="primary")
+    assert node1.wait_until_state(target_state="secondary")
+
+    # the new primary never got the row we tried to commit once demoted
+    eq_(node2.run_sql_query("SELECT count(*) FROM t1 WHERE id = -1"), [(0,)])
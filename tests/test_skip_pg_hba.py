@@ -4,6 +4,9 @@ from nose.tools import eq_
 import subprocess
 import os, os.path, time, shutil
 
+# debian clusters share /etc/postgresql, see tests/conftest.py
+PARALLEL_GROUP = "debian"
+
 cluster = None
 node1 = None
 node2 = None
@@ -5,6 +5,9 @@ from nose.tools import *
 import subprocess
 import os, os.path, time, shutil
 
+# ~/.postgresql and /tmp/certs are shared, see tests/conftest.py
+PARALLEL_GROUP = "ssl"
+
 cluster = None
 node1 = None
 node2 = None
@@ -142,7 +145,7 @@ def test_000_create_monitor():
         "-starttls",
         "postgres",
         "-connect",
-        "172.27.1.2:5432",
+        "%s:5432" % monitor.vnode.address,
         "-showcerts",
         "-CAfile",
         cluster.cert.crt,